@@ -161,6 +161,9 @@ int     fake_response          = OK;
 header_line *header_last       = NULL;
 header_line *header_list       = NULL;
 
+hash_set hset_duplicates       = {0};
+hash_set hset_unusable         = {0};
+
 BOOL    host_lookup_deferred   = FALSE;
 BOOL    host_lookup_failed     = FALSE;
 uschar *interface_address      = NULL;
@@ -228,9 +231,7 @@ tls_support tls_in = {
  /* remainder zero/null/false */
 };
 
-tree_node *tree_duplicates     = NULL;
 tree_node *tree_nonrecipients  = NULL;
-tree_node *tree_unusable       = NULL;
 
 uschar *version_date           = US"?";
 uschar *version_string         = US"?";
@@ -191,9 +191,11 @@ typedef struct queue_item {
   int  size;
   uschar *sender;
   uschar name[17];
+  unsigned generation;            /* of its directory when last checked */
   uschar seen;
   uschar frozen;
   uschar dir_char;
+  uschar journal;                 /* had a -J file when last checked */
 } queue_item;
 
 
@@ -51,7 +51,26 @@ static uschar tab62[] =
 
 /* Index for quickly finding things in the ordered queue. */
 
-static queue_item *queue_index[queue_index_size];
+static queue_item *queue_idx[queue_index_size];
+
+/* What was found when each spool input directory was last read, indexed by
+the subdirectory character (zero for the top directory). A directory whose
+modification time has not changed since then holds the same set of files, and
+since header files are always replaced by renaming, none of them has been
+rewritten either; so it need not be read again, nor need its messages be
+checked for changes. A change within the second of reading might not change the
+time, so a directory is re-read if its time is not earlier than the read. */
+
+typedef struct spool_dir_state {
+  time_t   mtime;
+  time_t   scanned;                /* when last read; 0 for never */
+  int      count;                  /* -H files found then */
+  unsigned generation;             /* bumped by each full read */
+  BOOL     full;                   /* last read was a full scan */
+  BOOL     skipped;                /* not read this time */
+} spool_dir_state;
+
+static spool_dir_state spool_dirs[256];
 
 
 
@@ -167,6 +186,8 @@ Ustrncpy(q->name, name, sizeof(q->name));
 q->seen = TRUE;
 q->frozen = FALSE;
 q->dir_char = dir_char;
+q->generation = 0;
+q->journal = FALSE;
 q->sender = NULL;
 q->size = 0;
 
@@ -314,17 +335,17 @@ queue_item *p;
 printf("\nqueue_total=%d\n", queue_total);
 
 for (i = 0; i < queue_index_size; i++)
-  printf("index %d = %d %s\n", i, (int)(queue_index[i]),
-    (queue_index[i])->name);
+  printf("index %d = %d %s\n", i, (int)(queue_idx[i]),
+    (queue_idx[i])->name);
 
 printf("Queue is:\n");
-p = queue_index[0];
+p = queue_idx[0];
 while (p != NULL)
   {
   count++;
   for (i = 0; i < queue_index_size; i++)
     {
-    if (queue_index[i] == p) printf("count=%d index=%d\n", count, (int)p);
+    if (queue_idx[i] == p) printf("count=%d index=%d\n", count, (int)p);
     }
   printf("%d %d %d %s\n", (int)p, (int)p->next, (int)p->prev, p->name);
   p = p->next;
@@ -350,7 +371,7 @@ if (queue_total == 0)
   if ((qq = set_up(name, dir_char)) != NULL)
     {
     int i;
-    for (i = 0; i < queue_index_size; i++) queue_index[i] = qq;
+    for (i = 0; i < queue_index_size; i++) queue_idx[i] = qq;
     queue_total++;
     return qq;
     }
@@ -360,28 +381,28 @@ if (queue_total == 0)
 /* Also handle insertion at the start or end of the queue
 as special cases. */
 
-if (Ustrcmp(name, (queue_index[0])->name) < 0)
+if (Ustrcmp(name, (queue_idx[0])->name) < 0)
   {
   if (action != queue_add) return NULL;
   if ((qq = set_up(name, dir_char)) != NULL)
     {
-    qq->next = queue_index[0];
-    (queue_index[0])->prev = qq;
-    queue_index[0] = qq;
+    qq->next = queue_idx[0];
+    (queue_idx[0])->prev = qq;
+    queue_idx[0] = qq;
     queue_total++;
     return qq;
     }
   return NULL;
   }
 
-if (Ustrcmp(name, (queue_index[queue_index_size-1])->name) > 0)
+if (Ustrcmp(name, (queue_idx[queue_index_size-1])->name) > 0)
   {
   if (action != queue_add) return NULL;
   if ((qq = set_up(name, dir_char)) != NULL)
     {
-    qq->prev = queue_index[queue_index_size-1];
-    (queue_index[queue_index_size-1])->next = qq;
-    queue_index[queue_index_size-1] = qq;
+    qq->prev = queue_idx[queue_index_size-1];
+    (queue_idx[queue_index_size-1])->next = qq;
+    queue_idx[queue_index_size-1] = qq;
     queue_total++;
     return qq;
     }
@@ -393,7 +414,7 @@ when the name is somewhere in the middle, if present. */
 
 while (middle > first)
   {
-  if (Ustrcmp(name, (queue_index[middle])->name) >= 0) first = middle;
+  if (Ustrcmp(name, (queue_idx[middle])->name) >= 0) first = middle;
     else last = middle;
   middle = (first + last)/2;
   }
@@ -402,8 +423,8 @@ while (middle > first)
 lie if it exists. Both end points are inclusive - though in fact
 the bottom one can only be = if it is the original bottom. */
 
-p = queue_index[first];
-q = queue_index[last];
+p = queue_idx[first];
+q = queue_idx[last];
 
 for (;;)
   {
@@ -461,19 +482,21 @@ for (;;)
 /* If we discover that there are subdirectories, set a flag so that the menu
 code knows to look for them. We count the entries to set the value for the
 queue stripchart, and set up data for the queue display window if the "full"
-option is given. */
+option is given. Directories that have not changed since they were last read
+are not read again (see spool_dirs above); with a split spool, most of them are
+unchanged between refreshes even on a busy host. */
 
 void
 scan_spool_input(int full)
 {
 int i;
 int subptr;
-int subdir_max = 1;
 int count = 0;
 int indexptr = 1;
 queue_item *p;
 uschar input_dir[256];
-uschar subdirs[64];
+static uschar subdirs[64];
+static int subdir_max = 1;
 
 subdirs[0] = 0;
 stripchart_total[0] = 0;
@@ -489,6 +512,8 @@ there is progress, output a dot for each one to the standard output. */
 for (i = 0; i < subdir_max; i++)
   {
   int subdirchar = subdirs[i];      /* 0 for main directory */
+  spool_dir_state * ds = &spool_dirs[subdirchar];
+  struct stat statbuf;
   DIR *dd;
   struct dirent *ent;
 
@@ -498,6 +523,27 @@ for (i = 0; i < subdir_max; i++)
     input_dir[subptr+1] = subdirchar;
     }
 
+  if (Ustat(input_dir, &statbuf) == 0)
+    {
+    if (  ds->scanned
+       && statbuf.st_mtime == ds->mtime && ds->mtime < ds->scanned
+       && (ds->full || !full))
+      {
+      ds->skipped = TRUE;
+      stripchart_total[0] += ds->count;
+      continue;
+      }
+    ds->mtime = statbuf.st_mtime;
+    }
+  else ds->mtime = 0;
+
+  ds->skipped = FALSE;
+  ds->scanned = time(NULL);
+  ds->count = 0;
+  ds->full = full;
+  if (full) ds->generation++;
+  if (i == 0) subdir_max = 1;
+
   if (!(dd = exim_opendir(input_dir))) continue;
 
   while ((ent = readdir(dd)))
@@ -524,6 +570,7 @@ for (i = 0; i < subdir_max; i++)
       {
       uschar basename[SPOOL_NAME_LENGTH + 1];
       stripchart_total[0]++;
+      ds->count++;
       if (!eximon_initialized) { printf("."); fflush(stdout); }
       Ustrcpy(basename, name);
       basename[SPOOL_NAME_LENGTH - 2] = 0;
@@ -538,28 +585,28 @@ items in the in-store queue. */
 
 if (!full || queue_total == 0) return;
 
-/* Now scan the queue and remove any items that were not in the directory. At
-the same time, set up the index pointers into the queue. Because we are
-removing items, the total that we are comparing against isn't actually correct,
-but in a long queue it won't make much difference, and in a short queue it
-doesn't matter anyway!*/
+/* Now scan the queue and remove any items that were not in the directory,
+leaving alone those in directories that were not read. At the same time, set up
+the index pointers into the queue. Because we are removing items, the total
+that we are comparing against isn't actually correct, but in a long queue it
+won't make much difference, and in a short queue it doesn't matter anyway!*/
 
-for (p = queue_index[0]; p; )
-  if (!p->seen)
+for (p = queue_idx[0]; p; )
+  if (!p->seen && !spool_dirs[p->dir_char].skipped)
     {
     queue_item * next = p->next;
     if (p->prev)
       p->prev->next = next;
     else
-      queue_index[0] = next;
+      queue_idx[0] = next;
     if (next)
       next->prev = p->prev;
     else
       {
       int i;
-      queue_item * q = queue_index[queue_index_size-1];
+      queue_item * q = queue_idx[queue_index_size-1];
       for (i = queue_index_size - 1; i >= 0; i--)
-        if (queue_index[i] == q) queue_index[i] = p->prev;
+        if (queue_idx[i] == q) queue_idx[i] = p->prev;
       }
     clean_up(p);
     queue_total--;
@@ -568,7 +615,7 @@ for (p = queue_index[0]; p; )
   else
     {
     if (++count > (queue_total * indexptr)/(queue_index_size-1))
-      queue_index[indexptr++] = p;
+      queue_idx[indexptr++] = p;
     p->seen = FALSE;  /* for next time */
     p = p->next;
     }
@@ -578,7 +625,7 @@ have got the index all filled in yet. Make sure all the pointers
 are legal. */
 
 while (indexptr < queue_index_size - 1)
-  queue_index[indexptr++] = queue_index[queue_index_size-1];
+  queue_idx[indexptr++] = queue_idx[queue_index_size-1];
 }
 
 
@@ -589,7 +636,9 @@ while (indexptr < queue_index_size - 1)
 *************************************************/
 
 /* We read the spool file only if its update time differs from last time,
-or if there is a journal file in existence. */
+or if there is a journal file in existence. Neither needs checking if the
+message's directory has not changed since the last check, unless there was a
+journal then, which may have been added to. */
 
 /* First, a local subroutine to scan the non-recipients tree and
 remove any of them from the address list */
@@ -614,13 +663,18 @@ FILE *jread;
 rmark reset_point;
 struct stat statdata;
 uschar buffer[1024];
+unsigned generation = spool_dirs[p->dir_char].generation;
+
+if (p->generation == generation && !p->journal) return;
+p->generation = generation;
 
 message_subdir[0] = p->dir_char;
 
 snprintf(CS buffer, sizeof(buffer), "%s/input/%s/%s/%s-J",
   spool_directory, queue_name, message_subdir, p->name);
 
-if (!(jread = fopen(CS buffer, "r")))
+p->journal = (jread = fopen(CS buffer, "r")) != NULL;
+if (!jread)
   {
   snprintf(CS buffer, sizeof(buffer), "%s/input/%s/%s/%s-H",
     spool_directory, queue_name, message_subdir, p->name);
@@ -702,7 +756,7 @@ void
 queue_display(void)
 {
 int now = (int)time(NULL);
-queue_item *p = queue_index[0];
+queue_item *p = queue_idx[0];
 
 if (menu_is_up) return;            /* Avoid nasty interactions */
 
@@ -381,6 +381,7 @@ enum {
   CONTROL_CASEFUL_LOCAL_PART,
   CONTROL_CASELOWER_LOCAL_PART,
   CONTROL_CUTTHROUGH_DELIVERY,
+  CONTROL_DAEMON_BLOCKLIST,
   CONTROL_DEBUG,
 #ifndef DISABLE_DKIM
   CONTROL_DKIM_VERIFY,
@@ -442,6 +443,10 @@ static control_def controls_list[] = {
   { US"caselower_local_part",    FALSE, (unsigned) ~ACL_BIT_RCPT },
 [CONTROL_CUTTHROUGH_DELIVERY] =
   { US"cutthrough_delivery",     TRUE,		0 },
+[CONTROL_DAEMON_BLOCKLIST] =
+  { US"daemon_blocklist",        TRUE,
+	  ACL_BIT_NOTSMTP | ACL_BIT_NOTSMTP_START
+  },
 [CONTROL_DEBUG] =
   { US"debug",                   TRUE,		0 },
 
@@ -814,6 +819,108 @@ return TRUE;
 }
 
 
+/*************************************************
+*        Put cheap ACL conditions first          *
+*************************************************/
+
+/* When acl_reorder_conditions is set, the conditions in each statement are
+rearranged so that cheap ones, which only match lists against data already to
+hand, come before costly ones that may do DNS or network work. Only runs of
+these two kinds are rearranged, and the order within each kind is kept; any
+other condition or modifier stays where it is and ends a run, so side effects
+happen in the order written. A statement whose cheap test fails then does not
+run the costly ones at all.
+
+Arguments:  type   the condition type
+Returns:    1 for a cheap condition, 2 for a costly one, 0 otherwise
+*/
+
+static int
+acl_cond_cost(int type)
+{
+switch (type)
+  {
+  case ACLC_AUTHENTICATED:
+  case ACLC_DOMAINS:
+  case ACLC_ENCRYPTED:
+  case ACLC_HOSTS:
+  case ACLC_LOCAL_PARTS:
+  case ACLC_RECIPIENTS:
+  case ACLC_SENDER_DOMAINS:
+  case ACLC_SENDERS:
+    return 1;
+
+  case ACLC_DNSLISTS:
+#ifdef WITH_CONTENT_SCAN
+  case ACLC_MALWARE:
+  case ACLC_MIME_REGEX:
+  case ACLC_REGEX:
+  case ACLC_SPAM:
+#endif
+#ifdef SUPPORT_SPF
+  case ACLC_SPF:
+  case ACLC_SPF_GUESS:
+#endif
+  case ACLC_VERIFY:
+    return 2;
+  }
+return 0;
+}
+
+
+/* Arguments:  acl   the parsed ACL
+   Returns:    the same ACL
+*/
+
+static acl_block *
+acl_reorder(acl_block * acl)
+{
+if (!acl_reorder_conditions) return acl;
+
+for (acl_block * a = acl; a; a = a->next)
+  {
+  acl_condition_block ** start = &a->condition;
+
+  while (*start)
+    {
+    acl_condition_block * cheap = NULL, ** cheapt = &cheap;
+    acl_condition_block * costly = NULL, ** costlyt = &costly;
+    acl_condition_block * cb;
+    int cost;
+
+    for (cb = *start; cb && (cost = acl_cond_cost(cb->type)); cb = cb->next)
+      if (cost == 1)
+	{ *cheapt = cb; cheapt = &cb->next; }
+      else
+	{ *costlyt = cb; costlyt = &cb->next; }
+
+    if (!cheap && !costly)		/* not movable; step over it */
+      {
+      start = &(*start)->next;
+      continue;
+      }
+
+    /* Link the cheap ones, then the costly ones, then the rest */
+
+    *start = cheap ? cheap : costly;
+    if (costly)
+      {
+      *cheapt = costly;
+      *costlyt = cb;
+      start = costlyt;
+      }
+    else
+      {
+      *cheapt = cb;
+      start = cheapt;
+      }
+    }
+  }
+return acl;
+}
+
+
+
 /*************************************************
 *            Read and parse one ACL              *
 *************************************************/
@@ -864,7 +971,7 @@ while ((s = (*func)()))
   can be started by a name, or by a macro definition. */
 
   s = readconf_readname(name, sizeof(name), s);
-  if (*s == ':' || (isupper(name[0]) && *s == '=')) return yield;
+  if (*s == ':' || (isupper(name[0]) && *s == '=')) return acl_reorder(yield);
 
   /* If a verb is unrecognized, it may be another condition or modifier that
   continues the previous verb. */
@@ -962,7 +1069,74 @@ while ((s = (*func)()))
     if (!acl_data_to_cond(s, cond, name, error)) return NULL;
   }
 
-return yield;
+return acl_reorder(yield);
+}
+
+
+
+/*************************************************
+*      Start the lookups of ACL dnslists         *
+*************************************************/
+
+/* Called when an SMTP connection is accepted, if dns_prefetch_on_connect is
+set.  The dnslists conditions of the named ACLs whose lists need no expansion
+are started, for the connecting host, so that the answers are likely to be
+waiting when the ACL gets to them.
+
+Arguments:  node name, data (ACL), context (unused)
+Returns:    nothing
+*/
+
+static void
+acl_prefetch_one(uschar * name, uschar * data, void * ctx)
+{
+for (acl_block * acl = (acl_block *)data; acl; acl = acl->next)
+  for (acl_condition_block * cb = acl->condition; cb; cb = cb->next)
+    if (  cb->type == ACLC_DNSLISTS && cb->arg
+       && !Ustrchr(cb->arg, '$') && !Ustrchr(cb->arg, '\\'))
+      dnsbl_prefetch_early(cb->arg);
+}
+
+void
+acl_prefetch_dnslists(void)
+{
+tree_walk(acl_anchor, acl_prefetch_one, NULL);
+}
+
+
+
+/*************************************************
+*     Offer ACL regexes for precompilation       *
+*************************************************/
+
+/* Called by the daemon before it starts accepting connections.  The regex
+and mime_regex conditions are lists of regexes; everything else is a string
+which may contain "match" expansion conditions.
+
+Arguments:  node name, data (ACL), context (unused)
+Returns:    nothing
+*/
+
+static void
+acl_prewarm_one(uschar * name, uschar * data, void * ctx)
+{
+for (acl_block * acl = (acl_block *)data; acl; acl = acl->next)
+  for (acl_condition_block * cb = acl->condition; cb; cb = cb->next)
+    if (cb->arg)
+      switch (cb->type)
+	{
+#ifdef WITH_CONTENT_SCAN
+	case ACLC_REGEX:
+	case ACLC_MIME_REGEX:	regex_prewarm_list(cb->arg); break;
+#endif
+	default:		regex_prewarm_string(cb->arg); break;
+	}
+}
+
+void
+acl_prewarm_regex(void)
+{
+tree_walk(acl_anchor, acl_prewarm_one, NULL);
 }
 
 
@@ -2155,8 +2329,16 @@ else if (verify_sender_address)
       /* The recipient, qualify, and expn options are never set in
       verify_options. */
 
-      rc = verify_address(sender_vaddr, NULL, verify_options, callout,
-        callout_overall, callout_connect, se_mailfrom, pm_mailfrom, &routed);
+      if (  callout > 0
+	 || !verify_session_cache_get(sender_vaddr, verify_options, &routed,
+				      &rc))
+	{
+	rc = verify_address(sender_vaddr, NULL, verify_options, callout,
+	  callout_overall, callout_connect, se_mailfrom, pm_mailfrom, &routed);
+	if (callout <= 0)
+	  verify_session_cache_put(verify_sender_address, verify_options,
+	    sender_vaddr, routed, rc);
+	}
 
       HDEBUG(D_acl) debug_printf_indent("----------- end verify ------------\n");
 
@@ -2349,6 +2531,444 @@ return ERROR;
 
 
 
+/*************************************************
+*         Update a smoothed event rate           *
+*************************************************/
+
+/* Called from acl_ratelimit() below, and by the daemon for ratelimit_shared.
+
+Arguments:
+  dbd         the previous rate data, updated in place
+  tv          the time of this event
+  count       the size of this event
+  period      the smoothing period
+
+Returns:      nothing
+*/
+
+static void
+ratelimit_ewma(dbdata_ratelimit * dbd, const struct timeval * tv,
+  double count, double period)
+{
+/* The smoothed rate is computed using an exponentially weighted moving
+average adjusted for variable sampling intervals. The standard EWMA for
+a fixed sampling interval is:  f'(t) = (1 - a) * f(t) + a * f'(t - 1)
+where f() is the measured value and f'() is the smoothed value.
+
+Old data decays out of the smoothed value exponentially, such that data n
+samples old is multiplied by a^n. The exponential decay time constant p
+is defined such that data p samples old is multiplied by 1/e, which means
+that a = exp(-1/p). We can maintain the same time constant for a variable
+sampling interval i by using a = exp(-i/p).
+
+The rate we are measuring is messages per period, suitable for directly
+comparing with the limit. The average rate between now and the previous
+message is period / interval, which we feed into the EWMA as the sample.
+
+It turns out that the number of messages required for the smoothed rate
+to reach the limit when they are sent in a burst is equal to the limit.
+This can be seen by analysing the value of the smoothed rate after N
+messages sent at even intervals. Let k = (1 - a) * p/i
+
+  rate_1 = (1 - a) * p/i + a * rate_0
+         = k + a * rate_0
+  rate_2 = k + a * rate_1
+         = k + a * k + a^2 * rate_0
+  rate_3 = k + a * k + a^2 * k + a^3 * rate_0
+  rate_N = rate_0 * a^N + k * SUM(x=0..N-1)(a^x)
+         = rate_0 * a^N + k * (1 - a^N) / (1 - a)
+         = rate_0 * a^N + p/i * (1 - a^N)
+
+When N is large, a^N -> 0 so rate_N -> p/i as desired.
+
+  rate_N = p/i + (rate_0 - p/i) * a^N
+  a^N = (rate_N - p/i) / (rate_0 - p/i)
+  N * -i/p = log((rate_N - p/i) / (rate_0 - p/i))
+  N = p/i * log((rate_0 - p/i) / (rate_N - p/i))
+
+Numerical analysis of the above equation, setting the computed rate to
+increase from rate_0 = 0 to rate_N = limit, shows that for large sending
+rates, p/i, the number of messages N = limit. So limit serves as both the
+maximum rate measured in messages per period, and the maximum number of
+messages that can be sent in a fast burst. */
+
+double this_time = (double)tv->tv_sec
+                 + (double)tv->tv_usec / 1000000.0;
+double prev_time = (double)dbd->time_stamp
+                 + (double)dbd->time_usec / 1000000.0;
+
+/* We must avoid division by zero, and deal gracefully with the clock going
+backwards. If we blunder ahead when time is in reverse then the computed
+rate will be bogus. To be safe we clamp interval to a very small number. */
+
+double interval = this_time - prev_time <= 0.0 ? 1e-9
+                : this_time - prev_time;
+
+double i_over_p = interval / period;
+double a = exp(-i_over_p);
+
+/* Combine the instantaneous rate (period / interval) with the previous rate
+using the smoothing factor a. In order to measure sized events, multiply the
+instantaneous rate by the count of bytes or recipients etc. */
+
+dbd->time_stamp = tv->tv_sec;
+dbd->time_usec = tv->tv_usec;
+dbd->rate = (1 - a) * count / i_over_p + a * dbd->rate;
+
+/* When events are very widely spaced the computed rate tends towards zero.
+Although this is accurate it turns out not to be useful for our purposes,
+especially when the first event after a long silence is the start of a spam
+run. A more useful model is that the rate for an isolated event should be the
+size of the event per the period size, ignoring the lack of events outside
+the current period and regardless of where the event falls in the period. So,
+if the interval was so long that the calculated rate is unhelpfully small, we
+re-initialize the rate. In the absence of higher-rate bursts, the condition
+below is true if the interval is greater than the period. */
+
+if (dbd->rate < count) dbd->rate = count;
+}
+
+
+
+
+/*************************************************
+*          Rates held by the daemon              *
+*************************************************/
+
+/* With ratelimit_shared set, the daemon holds the smoothed rates and does
+each update itself, so that concurrent checks neither lock the ratelimit
+hints database nor race each other. A request carries the parameters of the
+check followed by the key, and the answer is the computed rate. The daemon
+fills its table from the database on the first request, and writes changed
+rates back every ratelimit_shared interval (from a child process) and when it
+stops or restarts. Checks counting unique events keep their Bloom filters in
+the database and do not come here. */
+
+typedef struct rls_req {
+  uschar	notifier_reqtype;	/* NOTIFY_RATELIMIT */
+  uschar	update;			/* RLS_* below */
+  double	count;
+  double	period;
+  double	limit;
+} rls_req;				/* followed by the key, with a NUL */
+
+typedef struct rls_resp {
+  double	rate;
+} rls_resp;
+
+#define RLS_READONLY	0
+#define RLS_LEAKY	1
+#define RLS_STRICT	2
+
+#define RLS_NBUCKETS	4096		/* hashtable size */
+#define RLS_MAX		65536		/* entries before LRU eviction */
+
+
+/* Ask the daemon to do a ratelimit update.
+
+Arguments:
+  key		the ratelimit key
+  count		the size of this event
+  period	the smoothing period
+  limit		the limit, for leaky mode
+  update	RLS_READONLY, RLS_LEAKY or RLS_STRICT
+  rate		where to put the computed rate
+
+Returns:	TRUE if the daemon answered
+*/
+
+static BOOL
+ratelimit_shared_update(const uschar * key, double count, double period,
+  double limit, int update, double * rate)
+{
+rls_req req = {.notifier_reqtype = NOTIFY_RATELIMIT, .update = update,
+		.count = count, .period = period, .limit = limit};
+gstring * g = string_catn(NULL, US &req, sizeof(req));
+uschar buf[NOTIFY_MSG_MAX];
+rls_resp resp;
+
+g = string_catn(g, key, Ustrlen(key) + 1);
+if (search_shared_exchange(g, buf) < (ssize_t)sizeof(resp)) return FALSE;
+memcpy(&resp, buf, sizeof(resp));
+*rate = resp.rate;
+return TRUE;
+}
+
+
+
+/* Daemon side. Entries are in malloc store, on a hash chain and on an LRU
+chain. */
+
+typedef struct rls_entry {
+  struct rls_entry *	next;		/* hash chain */
+  struct rls_entry *	older;		/* LRU chain */
+  struct rls_entry *	newer;
+  unsigned		hash;
+  BOOL			dirty;		/* changed since written back */
+  dbdata_ratelimit	dbd;
+  uschar		key[1];
+} rls_entry;
+
+static rls_entry **	rls_buckets = NULL;
+static rls_entry *	rls_oldest = NULL;
+static rls_entry *	rls_newest = NULL;
+static unsigned		rls_count = 0;
+static unsigned		rls_dirty = 0;
+static time_t		rls_next_writeback = 0;
+
+
+static unsigned
+rls_hash(const uschar * key, int len)
+{
+unsigned h = 5381;
+while (len--) h = (h << 5) + h + *key++;
+return h;
+}
+
+static void
+rls_lru_unlink(rls_entry * e)
+{
+if (e->older) e->older->newer = e->newer; else rls_oldest = e->newer;
+if (e->newer) e->newer->older = e->older; else rls_newest = e->older;
+}
+
+static void
+rls_lru_add(rls_entry * e)
+{
+e->newer = NULL;
+if ((e->older = rls_newest)) rls_newest->newer = e; else rls_oldest = e;
+rls_newest = e;
+}
+
+
+/* Find an entry, moving it to the new end of the LRU chain */
+
+static rls_entry *
+rls_find(const uschar * key, unsigned hash)
+{
+for (rls_entry * e = rls_buckets[hash % RLS_NBUCKETS]; e; e = e->next)
+  if (e->hash == hash && Ustrcmp(e->key, key) == 0)
+    {
+    rls_lru_unlink(e);
+    rls_lru_add(e);
+    return e;
+    }
+return NULL;
+}
+
+
+/* Add an entry, dropping the least recently used if the table is full. A
+rate so dropped falls back to its last written-back value, or is forgotten. */
+
+static rls_entry *
+rls_add(const uschar * key, unsigned hash, const dbdata_ratelimit * dbd)
+{
+int len = Ustrlen(key);
+rls_entry * e;
+
+if (rls_count >= RLS_MAX && (e = rls_oldest))
+  {
+  for (rls_entry ** ep = &rls_buckets[e->hash % RLS_NBUCKETS]; *ep;
+       ep = &(*ep)->next)
+    if (*ep == e) { *ep = e->next; break; }
+  rls_lru_unlink(e);
+  if (e->dirty) rls_dirty--;
+  store_free(e);
+  rls_count--;
+  }
+
+e = store_malloc(sizeof(rls_entry) + len);
+memcpy(e->key, key, len + 1);
+e->hash = hash;
+e->dbd = *dbd;
+e->dirty = FALSE;
+e->next = rls_buckets[hash % RLS_NBUCKETS];
+rls_buckets[hash % RLS_NBUCKETS] = e;
+rls_lru_add(e);
+rls_count++;
+return e;
+}
+
+
+/* Fill the table from the database; records holding a Bloom filter are
+bigger than a plain rate, and are skipped. */
+
+static void
+rls_load(void)
+{
+rmark reset_point = store_mark();
+open_db dbblock, * dbm;
+EXIM_CURSOR * cursor;
+
+if ((dbm = dbfn_open(US"ratelimit", O_RDONLY, &dbblock, FALSE, TRUE)))
+  {
+  for (uschar * key = dbfn_scan(dbm, TRUE, &cursor); key;
+       key = dbfn_scan(dbm, FALSE, &cursor))
+    {
+    dbdata_ratelimit * dbd;
+    int len;
+
+    if (  rls_count < RLS_MAX
+       && (dbd = dbfn_read_with_length(dbm, key, &len))
+       && len == sizeof(*dbd))
+      {
+      unsigned hash = rls_hash(key, Ustrlen(key));
+      if (!rls_find(key, hash)) (void) rls_add(key, hash, dbd);
+      }
+    }
+  dbfn_close(dbm);
+  }
+DEBUG(D_any) debug_printf("ratelimit_shared: %u rates loaded\n", rls_count);
+store_reset(reset_point);
+}
+
+
+/* Write the changed rates to the database, keeping their timestamps */
+
+static void
+rls_write_back(void)
+{
+rmark reset_point = store_mark();
+open_db dbblock, * dbm;
+
+if ((dbm = dbfn_open(US"ratelimit", O_RDWR, &dbblock, TRUE, TRUE)))
+  {
+  BOOL txn = dbfn_transaction_start(dbm);
+
+  for (rls_entry * e = rls_oldest; e; e = e->newer)
+    if (e->dirty)
+      (void) dbfn_write_stamped(dbm, e->key, &e->dbd, sizeof(e->dbd));
+  if (txn) dbfn_transaction_commit(dbm);
+  dbfn_close(dbm);
+  }
+store_reset(reset_point);
+}
+
+static void
+rls_clean(void)
+{
+for (rls_entry * e = rls_oldest; e; e = e->newer) e->dirty = FALSE;
+rls_dirty = 0;
+}
+
+
+/* Handle a ratelimit request in the daemon.
+
+Arguments:
+  fd		the notifier socket, for the response
+  buf		the request
+  len		its length
+  sa		the requester's address
+  salen		its length
+*/
+
+void
+acl_ratelimit_at_daemon(int fd, const uschar * buf, int len,
+  const struct sockaddr * sa, socklen_t salen)
+{
+const uschar * key = buf + sizeof(rls_req);
+int keylen = len - (int)sizeof(rls_req);
+dbdata_ratelimit dbd;
+struct timeval tv;
+rls_resp resp;
+rls_entry * e;
+rls_req req;
+unsigned hash;
+
+if (keylen <= 0 || key[keylen-1]) return;
+memcpy(&req, buf, sizeof(req));
+if (req.period <= 0.0 || req.count < 0.0) return;
+
+if (!rls_buckets)
+  {
+  rls_buckets = store_malloc(RLS_NBUCKETS * sizeof(rls_entry *));
+  memset(rls_buckets, 0, RLS_NBUCKETS * sizeof(rls_entry *));
+  rls_load();
+  rls_next_writeback = time(NULL) + ratelimit_shared;
+  }
+
+hash = rls_hash(key, keylen - 1);
+gettimeofday(&tv, NULL);
+
+if ((e = rls_find(key, hash)))
+  {
+  dbd = e->dbd;
+  ratelimit_ewma(&dbd, &tv, req.count, req.period);
+  }
+else
+  {
+  dbd.time_stamp = tv.tv_sec;
+  dbd.time_usec = tv.tv_usec;
+  dbd.rate = req.count;
+  }
+
+/* Update the held rate as acl_ratelimit() would update the database */
+
+if (  req.update == RLS_STRICT
+   || req.update == RLS_LEAKY && dbd.rate < req.limit)
+  {
+  if (!e) e = rls_add(key, hash, &dbd);
+  else e->dbd = dbd;
+  if (!e->dirty) { e->dirty = TRUE; rls_dirty++; }
+  }
+
+resp.rate = dbd.rate;
+if (sendto(fd, &resp, sizeof(resp), 0, sa, salen) < 0)
+  DEBUG(D_any) debug_printf("%s: sendto: %s\n", __FUNCTION__, strerror(errno));
+}
+
+
+/* Milliseconds until the daemon's next write-back of held rates, for its
+poll; -1 if there is nothing to write */
+
+int
+acl_ratelimit_timeout(void)
+{
+time_t now;
+
+if (!rls_dirty) return -1;
+now = time(NULL);
+return rls_next_writeback > now ? (int)(rls_next_writeback - now) * 1000 : 0;
+}
+
+
+/* Called from the daemon's main loop; write back changed rates when due.
+The writing is done by a child so as not to hold up the daemon. */
+
+void
+acl_ratelimit_tick(void)
+{
+time_t now = time(NULL);
+pid_t pid;
+
+if (!rls_dirty || now < rls_next_writeback) return;
+rls_next_writeback = now + ratelimit_shared;
+
+if ((pid = exim_fork(US"ratelimit-writeback")) == 0)
+  {
+  rls_write_back();
+  exim_underbar_exit(EXIT_SUCCESS);
+  }
+if (pid > 0) rls_clean();
+}
+
+
+/* Write back any changed rates now; used by the daemon when it stops or
+re-execs itself */
+
+void
+acl_ratelimit_close(void)
+{
+if (rls_dirty)
+  {
+  rls_write_back();
+  rls_clean();
+  }
+}
+
+
+
+
 /*************************************************
 *            Handle rate limiting                *
 *************************************************/
@@ -2574,10 +3194,34 @@ if ((t = tree_search(*anchor, key)))
   return rc;
   }
 
+/* With ratelimit_shared, the daemon does the update, unless we are counting
+unique events. If it does not answer, use the database. */
+
+if (ratelimit_shared > 0 && !unique && search_shared_usable())
+  {
+  double rate;
+
+  if (ratelimit_shared_update(key, count, period, limit,
+	strict ? RLS_STRICT : leaky ? RLS_LEAKY : RLS_READONLY, &rate))
+    {
+    HDEBUG(D_acl) debug_printf_indent("ratelimit rate from the daemon\n");
+    dbd = store_get(sizeof(*dbd), GET_UNTAINTED);
+    dbd->time_stamp = time(NULL);
+    dbd->time_usec = 0;
+    dbd->rate = rate;
+    rc = rate < limit ? FAIL : OK;
+    goto remember;
+    }
+  }
+
 /* We aren't using a pre-computed rate, so get a previously recorded rate
-from the database, which will be updated and written back if required. */
+from the database, which will be updated and written back if required.
+In readonly mode nothing is written, so a read-only open suffices; if the
+database does not yet exist there is no recorded rate. */
 
-if (!(dbm = dbfn_open(US"ratelimit", O_RDWR, &dbblock, TRUE, TRUE)))
+if (  !(dbm = dbfn_open(US"ratelimit", readonly ? O_RDONLY : O_RDWR,
+			&dbblock, TRUE, TRUE))
+   && !(readonly && errno == ENOENT))
   {
   store_pool = old_pool;
   sender_rate = NULL;
@@ -2585,7 +3229,7 @@ if (!(dbm = dbfn_open(US"ratelimit", O_RDWR, &dbblock, TRUE, TRUE)))
   *log_msgptr = US"ratelimit database not available";
   return DEFER;
   }
-dbdb = dbfn_read_with_length(dbm, key, &dbdb_size);
+dbdb = dbm ? dbfn_read_with_length(dbm, key, &dbdb_size) : NULL;
 dbd = NULL;
 
 gettimeofday(&tv, NULL);
@@ -2742,7 +3386,7 @@ if (unique && !readonly)
 
 /* If there was no previous ratelimit data block for this key, initialize
 the new one, otherwise update the block from the database. The initial rate
-is what would be computed by the code below for an infinite interval. */
+is what would be computed by ratelimit_ewma() for an infinite interval. */
 
 if (!dbd)
   {
@@ -2753,84 +3397,7 @@ if (!dbd)
   dbd->rate = count;
   }
 else
-  {
-  /* The smoothed rate is computed using an exponentially weighted moving
-  average adjusted for variable sampling intervals. The standard EWMA for
-  a fixed sampling interval is:  f'(t) = (1 - a) * f(t) + a * f'(t - 1)
-  where f() is the measured value and f'() is the smoothed value.
-
-  Old data decays out of the smoothed value exponentially, such that data n
-  samples old is multiplied by a^n. The exponential decay time constant p
-  is defined such that data p samples old is multiplied by 1/e, which means
-  that a = exp(-1/p). We can maintain the same time constant for a variable
-  sampling interval i by using a = exp(-i/p).
-
-  The rate we are measuring is messages per period, suitable for directly
-  comparing with the limit. The average rate between now and the previous
-  message is period / interval, which we feed into the EWMA as the sample.
-
-  It turns out that the number of messages required for the smoothed rate
-  to reach the limit when they are sent in a burst is equal to the limit.
-  This can be seen by analysing the value of the smoothed rate after N
-  messages sent at even intervals. Let k = (1 - a) * p/i
-
-    rate_1 = (1 - a) * p/i + a * rate_0
-           = k + a * rate_0
-    rate_2 = k + a * rate_1
-           = k + a * k + a^2 * rate_0
-    rate_3 = k + a * k + a^2 * k + a^3 * rate_0
-    rate_N = rate_0 * a^N + k * SUM(x=0..N-1)(a^x)
-           = rate_0 * a^N + k * (1 - a^N) / (1 - a)
-           = rate_0 * a^N + p/i * (1 - a^N)
-
-  When N is large, a^N -> 0 so rate_N -> p/i as desired.
-
-    rate_N = p/i + (rate_0 - p/i) * a^N
-    a^N = (rate_N - p/i) / (rate_0 - p/i)
-    N * -i/p = log((rate_N - p/i) / (rate_0 - p/i))
-    N = p/i * log((rate_0 - p/i) / (rate_N - p/i))
-
-  Numerical analysis of the above equation, setting the computed rate to
-  increase from rate_0 = 0 to rate_N = limit, shows that for large sending
-  rates, p/i, the number of messages N = limit. So limit serves as both the
-  maximum rate measured in messages per period, and the maximum number of
-  messages that can be sent in a fast burst. */
-
-  double this_time = (double)tv.tv_sec
-                   + (double)tv.tv_usec / 1000000.0;
-  double prev_time = (double)dbd->time_stamp
-                   + (double)dbd->time_usec / 1000000.0;
-
-  /* We must avoid division by zero, and deal gracefully with the clock going
-  backwards. If we blunder ahead when time is in reverse then the computed
-  rate will be bogus. To be safe we clamp interval to a very small number. */
-
-  double interval = this_time - prev_time <= 0.0 ? 1e-9
-                  : this_time - prev_time;
-
-  double i_over_p = interval / period;
-  double a = exp(-i_over_p);
-
-  /* Combine the instantaneous rate (period / interval) with the previous rate
-  using the smoothing factor a. In order to measure sized events, multiply the
-  instantaneous rate by the count of bytes or recipients etc. */
-
-  dbd->time_stamp = tv.tv_sec;
-  dbd->time_usec = tv.tv_usec;
-  dbd->rate = (1 - a) * count / i_over_p + a * dbd->rate;
-
-  /* When events are very widely spaced the computed rate tends towards zero.
-  Although this is accurate it turns out not to be useful for our purposes,
-  especially when the first event after a long silence is the start of a spam
-  run. A more useful model is that the rate for an isolated event should be the
-  size of the event per the period size, ignoring the lack of events outside
-  the current period and regardless of where the event falls in the period. So,
-  if the interval was so long that the calculated rate is unhelpfully small, we
-  re-initialize the rate. In the absence of higher-rate bursts, the condition
-  below is true if the interval is greater than the period. */
-
-  if (dbd->rate < count) dbd->rate = count;
-  }
+  ratelimit_ewma(dbd, &tv, count, period);
 
 /* Clients sending at the limit are considered to be over the limit.
 This matters for edge cases such as a limit of zero, when the client
@@ -2855,8 +3422,9 @@ else
     readonly? "readonly mode" : "over the limit, but leaky");
   }
 
-dbfn_close(dbm);
+if (dbm) dbfn_close(dbm);
 
+remember:
 /* Store the result in the tree for future reference.  Take the taint status
 from the key for consistency even though it's unlikely we'll ever expand this. */
 
@@ -2959,14 +3527,16 @@ while ((ele = string_nextinlist(&list, &slash, NULL, 0)))
   else
     goto badopt;
 
-if (!(dbm = dbfn_open(US"seen", O_RDWR, &dbblock, TRUE, TRUE)))
+if (  !(dbm = dbfn_open(US"seen", mode == SEEN_READONLY ? O_RDONLY : O_RDWR,
+			&dbblock, TRUE, TRUE))
+   && !(mode == SEEN_READONLY && errno == ENOENT))
   {
   HDEBUG(D_acl) debug_printf_indent("database for 'seen' not available\n");
   *log_msgptr = US"database for 'seen' not available";
   return DEFER;
   }
 
-dbd = dbfn_read_with_length(dbm, key, NULL);
+dbd = dbm ? dbfn_read_with_length(dbm, key, NULL) : NULL;
 now = time(NULL);
 if (dbd)		/* an existing record */
   {
@@ -3002,7 +3572,7 @@ else
     HDEBUG(D_acl) debug_printf_indent("seen db not written (readonly)\n");
   }
 
-dbfn_close(dbm);
+if (dbm) dbfn_close(dbm);
 return yield;
 
 
@@ -3599,16 +4169,16 @@ for (; cb; cb = cb->next)
 	    ignored = US"nonfirst rcpt";
 	  else if (cutthrough.delivery)
 	    ignored = US"repeated";
-	  else if (cutthrough.callout_hold_only)
-	    {
-	    DEBUG(D_acl)
-	      debug_printf_indent(" cutthrough request upgrades callout hold\n");
-	    cutthrough.callout_hold_only = FALSE;
-	    cutthrough.delivery = TRUE;	/* control accepted */
-	    }
 	  else
 	    {
+	    if (cutthrough.callout_hold_only)
+	      {
+	      DEBUG(D_acl)
+		debug_printf_indent(" cutthrough request upgrades callout hold\n");
+	      cutthrough.callout_hold_only = FALSE;
+	      }
 	    cutthrough.delivery = TRUE;	/* control accepted */
+	    cutthrough.partial = cutthrough.spooled = FALSE;
 	    while (*p == '/')
 	      {
 	      const uschar * pp = p+1;
@@ -3618,8 +4188,9 @@ for (; cb; cb = cb->next)
 		if (Ustrncmp(pp, "pass", 4) == 0) cutthrough.defer_pass = TRUE;
 		/* else if (Ustrncmp(pp, "spool") == 0) ;	default */
 		}
-	      else
-		while (*pp && *pp != '/') pp++;
+	      else if (Ustrncmp(pp, "partial", 7) == 0)
+		cutthrough.partial = TRUE;
+	      while (*pp && *pp != '/') pp++;
 	      p = pp;
 	      }
 	    }
@@ -3629,6 +4200,22 @@ for (; cb; cb = cb->next)
 	  }
 	break;
 
+	case CONTROL_DAEMON_BLOCKLIST:
+	  {
+	  int secs = *p == '/' ? readconf_readtime(p+1, 0, FALSE) : -1;
+	  if (secs <= 0)
+	    {
+	    *log_msgptr = string_sprintf("syntax error in \"control=%s\"", arg);
+	    return ERROR;
+	    }
+	  if (sender_host_address)
+	    daemon_blocklist_add(sender_host_address, secs);
+	  else
+	    HDEBUG(D_acl)
+	      debug_printf_indent("no client address for daemon blocklist\n");
+	  }
+	break;
+
 #ifdef SUPPORT_I18N
 	case CONTROL_UTF8_DOWNCONVERT:
 	  if (*p == '/')
@@ -4174,6 +4761,15 @@ Returns:   a pointer to the next line
 static uschar *acl_text;          /* Current pointer in the text */
 static uschar *acl_text_end;      /* Points one past the terminating '0' */
 
+/* Inline ACLs that have been parsed, keyed by their text, so that an expansion
+which gives the same text again does not have to parse it again. The number is
+limited because the text might differ for every message. */
+
+#define ACL_INLINE_MAX 64
+
+static tree_node *acl_inline_anchor = NULL;
+static int acl_inline_count = 0;
+
 
 static uschar *
 acl_getline(void)
@@ -4400,21 +4996,43 @@ if (Ustrchr(ss, ' ') == NULL)
 
 /* Parse an ACL that is still in text form. If it came from a file, remember it
 in the ACL tree, having read it into the POOL_PERM store pool so that it
-persists between multiple messages. */
+persists between multiple messages. Inline text is remembered in the same
+way, up to a limit, in a tree of its own. It is parsed from a copy, because
+acl_getline() alters the text. */
 
 if (!acl)
   {
-  int old_pool = store_pool;
-  if (fd >= 0) store_pool = POOL_PERM;
-  acl = acl_read(acl_getline, log_msgptr);
-  store_pool = old_pool;
-  if (!acl && *log_msgptr) return ERROR;
-  if (fd >= 0)
+  tree_node * t;
+
+  if (fd < 0 && (t = tree_search(acl_inline_anchor, ss)))
     {
-    tree_node * t = store_get_perm(sizeof(tree_node) + Ustrlen(ss), ss);
-    Ustrcpy(t->name, ss);
-    t->data.ptr = acl;
-    (void)tree_insertnode(&acl_anchor, t);
+    HDEBUG(D_acl) debug_printf_indent("using previously parsed inline ACL\n");
+    acl = (acl_block *)(t->data.ptr);
+    }
+  else
+    {
+    int old_pool = store_pool;
+    BOOL keep = fd >= 0 || acl_inline_count < ACL_INLINE_MAX;
+
+    if (fd < 0)
+      {
+      acl_text = string_copy(ss);
+      acl_text_end = acl_text + Ustrlen(acl_text) + 1;
+      }
+    if (keep) store_pool = POOL_PERM;
+    acl = acl_read(acl_getline, log_msgptr);
+    store_pool = old_pool;
+    if (!acl && *log_msgptr) return ERROR;
+    if (keep)
+      {
+      t = store_get_perm(sizeof(tree_node) + Ustrlen(ss), ss);
+      Ustrcpy(t->name, ss);
+      t->data.ptr = acl;
+      if (fd >= 0)
+	(void)tree_insertnode(&acl_anchor, t);
+      else if (tree_insertnode(&acl_inline_anchor, t))
+	acl_inline_count++;
+      }
     }
   }
 
@@ -4719,6 +5337,7 @@ acl_check(int where, const uschar * recipient, uschar * s,
 int rc;
 address_item adb;
 address_item *addr = NULL;
+struct timeval start;
 
 *user_msgptr = *log_msgptr = NULL;
 sender_verified_failed = NULL;
@@ -4752,9 +5371,12 @@ if (where==ACL_WHERE_RCPT || where==ACL_WHERE_VRFY)
 
 acl_where = where;
 acl_level = 0;
+if (PHASE_TIMING) exim_gettime(&start);
 rc = acl_check_internal(where, addr, s, user_msgptr, log_msgptr);
 acl_level = 0;
 acl_where = ACL_WHERE_UNKNOWN;
+if (PHASE_TIMING) metrics_acl_time(where, &start);
+if (metrics) metrics_acl(where, rc);
 
 /* Cutthrough - if requested,
 and WHERE_RCPT and not yet opened conn as result of recipient-verify,
@@ -4790,6 +5412,8 @@ switch (where)
 	    && rcpt_count > cutthrough.nrcpt
 	    )
       {
+      int nrcpt = cutthrough.nrcpt;
+
       if ((rc = open_cutthrough_connection(addr)) == DEFER)
 	if (cutthrough.defer_pass)
 	  {
@@ -4805,6 +5429,16 @@ switch (where)
 	  HDEBUG(D_acl) debug_printf_indent("cutthrough defer; will spool\n");
 	  rc = OK;
 	  }
+
+      /* With the partial option, an accepted recipient that did not join
+      the held connection is delivered from the spool after reception. */
+
+      if (  rc == OK && cutthrough.delivery && cutthrough.partial
+	 && nrcpt > 0 && cutthrough.nrcpt == nrcpt)
+	{
+	HDEBUG(D_acl) debug_printf_indent("cutthrough partial; will spool\n");
+	cutthrough.spooled = TRUE;
+	}
       }
     else HDEBUG(D_acl) if (cutthrough.delivery)
       if (rcpt_count <= cutthrough.nrcpt)
@@ -4918,7 +5552,7 @@ acl_cfoo.
 Arguments:
   name    of the variable
   value   of the variable
-  ctx     FILE pointer (as a void pointer)
+  ctx     pointer to the gstring being built (as a void pointer)
 
 Returns:  nothing
 */
@@ -4926,15 +5560,16 @@ Returns:  nothing
 void
 acl_var_write(uschar * name, uschar * value, void * ctx)
 {
-FILE * f = (FILE *)ctx;
-putc('-', f);
+gstring ** gp = ctx, * g = *gp;
+g = string_catn(g, US"-", 1);
 if (is_tainted(value))
   {
   int q = quoter_for_address(value);
-  putc('-', f);
-  if (is_real_quoter(q)) fprintf(f, "(%s)", lookup_list[q]->name);
+  g = string_catn(g, US"-", 1);
+  if (is_real_quoter(q)) g = string_fmt_append(g, "(%s)", lookup_list[q]->name);
   }
-fprintf(f, "acl%c %s %d\n%s\n", name[0], name+1, Ustrlen(value), value);
+*gp = string_fmt_append(g, "acl%c %s %d\n%s\n",
+  name[0], name+1, Ustrlen(value), value);
 }
 
 
@@ -1316,7 +1316,7 @@ else
   hhash.len = hdata->ptr;
   }
 
-if (  (errstr = exim_dkim_signing_init(privkey, &sctx))
+if (  (errstr = exim_dkim_signing_key(privkey, &sctx))
    || (errstr = exim_dkim_sign(&sctx, hm, &hhash, sig)))
   {
   log_write(0, LOG_MAIN, "ARC: %s signing: %s\n", why, errstr);
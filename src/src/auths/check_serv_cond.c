@@ -13,6 +13,106 @@
 by all authenticators. */
 
 
+/* The key for cached server_condition results.  It is made by the daemon and
+inherited by the processes it forks for incoming connections, so results
+cannot be looked up by anything that does not have it. */
+
+static uschar auth_cache_secret[32];
+static BOOL auth_cache_keyed = FALSE;
+
+
+/*************************************************
+*      Make the key for cached results           *
+*************************************************/
+
+/* Called by the daemon at startup when some authenticator has
+server_condition_cache set. */
+
+void
+auth_cache_init(void)
+{
+for (int i = 0; i < sizeof(auth_cache_secret); i++)
+  auth_cache_secret[i] = (uschar) vaguely_random_number(256);
+auth_cache_keyed = TRUE;
+}
+
+
+/* Add a string that may be unset to the hash, with its length so that the
+concatenation of several cannot be ambiguous */
+
+static void
+auth_cache_hash(hctx * h, const uschar * s)
+{
+int len = s ? Ustrlen(s) : -1;
+exim_sha_update(h, CUS &len, sizeof(len));
+if (len > 0) exim_sha_update(h, s, len);
+}
+
+
+/* Build the shared-cache key for the current credentials.  It starts with the
+authenticator name and the id the client claims, in clear so that all the
+entries for an id can be dropped together, followed by an HMAC, keyed with the
+daemon's secret, of the $auth<n> values, the condition, and the state of the
+connection that a condition commonly depends on: the client's IP address and
+the TLS cipher and client certificate DN.  The returned prefix length covers
+the clear part.
+
+Arguments:
+  ablock     the authenticator's instance block
+  id         the claimed id, from server_set_id
+  prefixlen  where to put the length of the clear part
+
+Returns:     the key
+*/
+
+#define AUTH_CACHE_BLOCKLEN	64	/* block size of SHA-1 and SHA-256 */
+
+static gstring *
+auth_cache_key(auth_instance * ablock, const uschar * id, int * prefixlen)
+{
+gstring * g = string_catn(NULL, US AUTH_CACHE_PREFIX,
+			  sizeof(AUTH_CACHE_PREFIX));
+#ifdef EXIM_HAVE_SHA2
+hashmethod m = HASH_SHA2_256;
+#else
+hashmethod m = HASH_SHA1;
+#endif
+uschar pad[AUTH_CACHE_BLOCKLEN];
+hctx h;
+blob b;
+
+g = string_catn(g, ablock->name, Ustrlen(ablock->name) + 1);
+g = string_catn(g, id, Ustrlen(id) + 1);
+*prefixlen = g->ptr;
+
+/* The inner hash, over the key padded with 0x36 and then the values */
+
+memset(pad, 0, sizeof(pad));
+memcpy(pad, auth_cache_secret, sizeof(auth_cache_secret));
+for (int i = 0; i < sizeof(pad); i++) pad[i] ^= 0x36;
+
+exim_sha_init(&h, m);
+exim_sha_update(&h, pad, sizeof(pad));
+for (int i = 0; i < AUTH_VARS; i++)
+  auth_cache_hash(&h, auth_vars[i]);
+exim_sha_update_string(&h, ablock->server_condition);
+auth_cache_hash(&h, sender_host_address);
+auth_cache_hash(&h, tls_in.cipher);
+auth_cache_hash(&h, tls_in.peerdn);
+exim_sha_finish(&h, &b);
+
+/* The outer hash, over the key padded with 0x5c and then the inner hash */
+
+for (int i = 0; i < sizeof(pad); i++) pad[i] ^= 0x36 ^ 0x5c;
+
+exim_sha_init(&h, m);
+exim_sha_update(&h, pad, sizeof(pad));
+exim_sha_update(&h, b.data, b.len);
+exim_sha_finish(&h, &b);
+return string_catn(g, b.data, b.len);
+}
+
+
 /*************************************************
 *              Check server_condition            *
 *************************************************/
@@ -23,6 +123,12 @@ for those, setting server_condition is what enables it as a server
 authenticator. For all the other authenticators, this function is called after
 they have authenticated, to enable additional authorization to be done.
 
+If server_condition_cache is set, a success is remembered in the daemon for
+that long, and the same credentials are then accepted without expanding the
+condition again.  Any definite result from the condition drops the entries
+held for the id, so that an old password stops working once a new one is seen
+and a failed attempt cannot leave a stale success behind.
+
 Argument:     the authenticator's instance block
 
 Returns:
@@ -34,8 +140,39 @@ Returns:
 int
 auth_check_serv_cond(auth_instance * ablock)
 {
-return auth_check_some_cond(ablock,
+gstring * key = NULL;
+int prefixlen, rc;
+
+if (  ablock->server_condition_cache > 0 && ablock->server_condition
+   && auth_cache_keyed && search_shared_usable())
+  {
+  const uschar * id = ablock->set_id ? expand_cstring(ablock->set_id) : US"";
+  uschar * data;
+  int len;
+
+  if (id)
+    {
+    key = auth_cache_key(ablock, id, &prefixlen);
+    if (search_shared_get_raw(key->s, key->ptr, &data, &len))
+      {
+      HDEBUG(D_auth) debug_printf("%s authenticator: cached server_condition"
+	" success for '%s'\n", ablock->name, id);
+      return OK;
+      }
+    }
+  }
+
+rc = auth_check_some_cond(ablock,
       US"server_condition", ablock->server_condition, OK);
+
+if (key && rc != DEFER)
+  {
+  search_shared_flush_raw(key->s, prefixlen);
+  if (rc == OK)
+    search_shared_put_raw(key->s, key->ptr, US"1", 1,
+			  (unsigned)ablock->server_condition_cache);
+  }
+return rc;
 }
 
 
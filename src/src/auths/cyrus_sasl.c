@@ -88,19 +88,24 @@ enable consistency checks to be done, or anything else that needs
 to be set up. */
 
 
-/* Auxiliary function, passed in data to sasl_server_init(). */
+/* The library is initialised once per process, which loads its plugins and
+reads its configuration.  This is first done while reading the configuration,
+so a daemon does it before forking, and the processes handling connections
+then only need to create a connection context for each authentication.  The
+library is not shut down again; the process exits instead. */
+
+static BOOL sasl_server_up = FALSE;
 
 static int
-mysasl_config(void *context, const char *plugin_name, const char *option,
-      const char **result, unsigned int *len)
+mysasl_server_init(void)
 {
-if (context && !strcmp(option, "mech_list"))
-  {
-  *result = context;
-  if (len) *len = strlen(*result);
-  return SASL_OK;
-  }
-return SASL_FAIL;
+static sasl_callback_t cbs[] = {{SASL_CB_LIST_END, NULL, NULL}};
+int rc;
+
+if (sasl_server_up) return SASL_OK;
+if ((rc = sasl_server_init(cbs, "exim")) == SASL_OK)
+  sasl_server_up = TRUE;
+return rc;
 }
 
 /* Here's the real function */
@@ -118,9 +123,6 @@ uschar *expanded_hostname;
 char *realm_expanded;
 
 sasl_conn_t *conn;
-sasl_callback_t cbs[] = {
-  {SASL_CB_GETOPT, NULL, NULL },
-  {SASL_CB_LIST_END, NULL, NULL}};
 
 /* default the mechanism to our "public name" */
 
@@ -141,10 +143,7 @@ if (  ob->server_realm
 /* we're going to initialise the library to check that there is an
 authenticator of type whatever mechanism we're using */
 
-cbs[0].proc = (int(*)(void)) &mysasl_config;
-cbs[0].context = ob->server_mech;
-
-if ((rc = sasl_server_init(cbs, "exim")) != SASL_OK)
+if ((rc = mysasl_server_init()) != SASL_OK)
   log_write(0, LOG_PANIC_DIE|LOG_CONFIG_FOR, "%s authenticator:  "
       "couldn't initialise Cyrus SASL library.", ablock->name);
 
@@ -191,7 +190,6 @@ HDEBUG(D_auth) debug_printf("Cyrus SASL driver %s: %s initialised\n", ablock->na
 ablock->server = TRUE;
 
 sasl_dispose(&conn);
-sasl_done();
 }
 
 /*************************************************
@@ -210,7 +208,6 @@ auth_cyrus_sasl_options_block * ob =
   (auth_cyrus_sasl_options_block *)(ablock->options_block);
 uschar * output, * out2, * input, * clear, * hname;
 uschar * debug = NULL;   /* Stops compiler complaining */
-sasl_callback_t cbs[] = {{SASL_CB_LIST_END, NULL, NULL}};
 sasl_conn_t * conn;
 char * realm_expanded = NULL;
 int rc, firsttime = 1, clen, * negotiated_ssf_ptr = NULL, negotiated_ssf;
@@ -238,7 +235,7 @@ if (inlen)
   inlen = clen;
   }
 
-if ((rc = sasl_server_init(cbs, "exim")) != SASL_OK)
+if ((rc = mysasl_server_init()) != SASL_OK)
   {
   auth_defer_msg = US"couldn't initialise Cyrus SASL library";
   return DEFER;
@@ -254,7 +251,6 @@ HDEBUG(D_auth)
 if (rc != SASL_OK )
   {
   auth_defer_msg = US"couldn't initialise Cyrus SASL connection";
-  sasl_done();
   return DEFER;
   }
 
@@ -265,7 +261,7 @@ if (tls_in.cipher)
     HDEBUG(D_auth) debug_printf("Cyrus SASL EXTERNAL SSF set %d failed: %s\n",
         tls_in.bits, sasl_errstring(rc, NULL, NULL));
     auth_defer_msg = US"couldn't set Cyrus SASL EXTERNAL SSF";
-    sasl_done();
+    sasl_dispose(&conn);
     return DEFER;
     }
   else
@@ -340,7 +336,6 @@ for (rc = SASL_CONTINUE; rc == SASL_CONTINUE; )
       /* we couldn't get the data, so free up the library before
       returning whatever error we get */
       sasl_dispose(&conn);
-      sasl_done();
       return rc;
       }
     inlen = Ustrlen(input);
@@ -351,7 +346,6 @@ for (rc = SASL_CONTINUE; rc == SASL_CONTINUE; )
       if ((clen = b64decode(input, &clear, GET_TAINTED)) < 0)
        {
        sasl_dispose(&conn);
-       sasl_done();
        return BAD64;
        }
       input = clear;
@@ -365,7 +359,6 @@ for (rc = SASL_CONTINUE; rc == SASL_CONTINUE; )
   if (rc == SASL_BADPROT)
     {
     sasl_dispose(&conn);
-    sasl_done();
     return UNEXPECTED;
     }
   if (rc == SASL_CONTINUE)
@@ -383,7 +376,6 @@ for (rc = SASL_CONTINUE; rc == SASL_CONTINUE; )
        "Cyrus SASL username fetch problem: %s", ablock->name, ob->server_mech,
        sasl_errstring(rc, NULL, NULL));
     sasl_dispose(&conn);
-    sasl_done();
     return FAIL;
     }
   auth_vars[0] = expand_nstring[1] = string_copy(out2);
@@ -402,7 +394,6 @@ for (rc = SASL_CONTINUE; rc == SASL_CONTINUE; )
 	 "Cyrus SASL permanent failure: %s", ablock->name, ob->server_mech,
 	 sasl_errstring(rc, NULL, NULL));
       sasl_dispose(&conn);
-      sasl_done();
       return FAIL;
 
     case SASL_NOMECH:
@@ -415,7 +406,6 @@ for (rc = SASL_CONTINUE; rc == SASL_CONTINUE; )
       auth_defer_msg =
 	  string_sprintf("Cyrus SASL: mechanism %s not available", ob->server_mech);
       sasl_dispose(&conn);
-      sasl_done();
       return DEFER;
 
     case SASL_OK:
@@ -432,7 +422,6 @@ for (rc = SASL_CONTINUE; rc == SASL_CONTINUE; )
 	    "Cyrus SASL SSF value not available: %s", ablock->name, ob->server_mech,
 	    sasl_errstring(rc, NULL, NULL));
 	sasl_dispose(&conn);
-	sasl_done();
 	return FAIL;
 	}
       negotiated_ssf = *negotiated_ssf_ptr;
@@ -445,13 +434,11 @@ for (rc = SASL_CONTINUE; rc == SASL_CONTINUE; )
 	log_write(0, LOG_REJECT, "%s authenticator (%s): "
 	    "Cyrus SASL SSF %d not supported by Exim", ablock->name, ob->server_mech, negotiated_ssf);
 	sasl_dispose(&conn);
-	sasl_done();
 	return FAIL;
 	}
 
-      /* close down the connection, freeing up library's memory */
+      /* close down the connection, freeing up its memory */
       sasl_dispose(&conn);
-      sasl_done();
 
       /* Expand server_condition as an authorization check */
       return auth_check_serv_cond(ablock);
@@ -465,7 +452,6 @@ for (rc = SASL_CONTINUE; rc == SASL_CONTINUE; )
       auth_defer_msg =
 	  string_sprintf("Cyrus SASL: %s", sasl_errstring(rc, NULL, NULL));
       sasl_dispose(&conn);
-      sasl_done();
       return DEFER;
     }
   }
@@ -87,6 +87,16 @@ int auth_dovecot_client(auth_instance *ablock, void * sx,
 static uschar sbuffer[256];
 static int socket_buffer_left;
 
+/* The connection to the auth service is kept open for later AUTH commands in
+the same process, with the mechanisms it advertised; each request on it takes
+the next id. */
+
+static client_conn_ctx dc_cctx = {.sock = -1, .tls_ctx = NULL};
+static const uschar * dc_socket_name = NULL;
+static uschar * dc_mechs = NULL;
+static pid_t dc_pid = 0;
+static int dc_requid = 0;
+
 
 
 /*************************************************
@@ -241,6 +251,26 @@ return s;
 
 
 
+/*************************************************
+*       Close the kept auth connection           *
+*************************************************/
+
+static void
+dc_close(void)
+{
+#ifndef DISABLE_TLS
+if (dc_cctx.tls_ctx)
+  tls_close(dc_cctx.tls_ctx, TRUE);
+#endif
+if (dc_cctx.sock >= 0)
+  close(dc_cctx.sock);
+dc_cctx = (client_conn_ctx) {.sock = -1, .tls_ctx = NULL};
+dc_socket_name = NULL;
+socket_buffer_left = 0;
+}
+
+
+
 /*************************************************
 *              Server entry point                *
 *************************************************/
@@ -256,10 +286,13 @@ uschar *auth_command;
 uschar *auth_extra_data = US"";
 uschar *p;
 int nargs, tmp;
-int crequid = 1, ret = DEFER;
+int crequid, ret = DEFER;
 host_item host;
-client_conn_ctx cctx = {.sock = -1, .tls_ctx = NULL};
-BOOL found = FALSE, have_mech_line = FALSE;
+client_conn_ctx * cctx = &dc_cctx;
+const uschar * list;
+uschar * mech;
+int sep = 0;
+BOOL found = FALSE, have_mech_line = FALSE, reused, clean = FALSE;
 
 HDEBUG(D_auth) debug_printf("dovecot authentication\n");
 
@@ -269,10 +302,41 @@ if (!data)
   goto out;
   }
 
+/* Added by PH: data must not contain tab (as it is
+b64 it shouldn't, but check for safety). */
+
+if (Ustrchr(data, '\t') != NULL)
+  {
+  ret = FAIL;
+  goto out;
+  }
+
+/* A connection kept from an earlier AUTH is used if it is to the same socket
+and was made by this process (not inherited). If the service has closed it
+meanwhile, a new one is made. */
+
+if (  cctx->sock >= 0
+   && (  dc_pid != getpid() || !dc_socket_name
+      || Ustrcmp(dc_socket_name, ob->server_socket) != 0))
+  dc_close();
+
+RECONNECT:
+found = FALSE;
+if ((reused = cctx->sock >= 0))
+  {
+  HDEBUG(D_auth) debug_printf("  reusing dovecot auth connection\n");
+  goto HANDSHAKEN;
+  }
+
 /*XXX timeout? */
-cctx.sock = ip_streamsocket(ob->server_socket, &auth_defer_msg, 5, &host);
-if (cctx.sock < 0)
+cctx->sock = ip_streamsocket(ob->server_socket, &auth_defer_msg, 5, &host);
+if (cctx->sock < 0)
  goto out;
+(void) fcntl(cctx->sock, F_SETFD, fcntl(cctx->sock, F_GETFD) | FD_CLOEXEC);
+dc_socket_name = ob->server_socket;
+dc_pid = getpid();
+dc_requid = 0;
+dc_mechs = NULL;
 
 #ifdef notdef
 # ifndef DISABLE_TLS
@@ -292,7 +356,7 @@ if (ob->server_tls)
     goto bad;
     }
 
-  if (!tls_client_start(&cctx, &conn_args, NULL, &tls_dummy, &errstr))
+  if (!tls_client_start(cctx, &conn_args, NULL, &tls_dummy, &errstr))
     {
     auth_defer_msg = string_sprintf("TLS connect failed: %s", errstr);
     goto out;
@@ -306,7 +370,7 @@ auth_defer_msg = US"authentication socket protocol error";
 socket_buffer_left = 0;  /* Global, used to read more than a line but return by line */
 for (;;)
   {
-  if (!dc_gets(buffer, sizeof(buffer), &cctx))
+  if (!dc_gets(buffer, sizeof(buffer), cctx))
     OUT("authentication socket read error or premature eof");
   p = buffer + Ustrlen(buffer) - 1;
   if (*p != '\n')
@@ -337,10 +401,13 @@ for (;;)
     }
   else if (Ustrcmp(args[0], US"MECH") == 0)
     {
+    int old_pool = store_pool;
     CHECK_COMMAND("MECH", 1, INT_MAX);
     have_mech_line = TRUE;
-    if (strcmpic(US args[1], ablock->public_name) == 0)
-      found = TRUE;
+    store_pool = POOL_PERM;
+    dc_mechs = string_sprintf("%s%s%s", dc_mechs ? dc_mechs : US"",
+      dc_mechs ? ":" : "", args[1]);
+    store_pool = old_pool;
     }
   else if (Ustrcmp(args[0], US"SPID") == 0)
     {
@@ -364,6 +431,10 @@ for (;;)
     }
   }
 
+HANDSHAKEN:
+for (list = dc_mechs; !found && (mech = string_nextinlist(&list, &sep, NULL, 0)); )
+  found = strcmpic(mech, ablock->public_name) == 0;
+
 if (!found)
   {
   auth_defer_msg = string_sprintf(
@@ -371,15 +442,6 @@ if (!found)
   goto out;
   }
 
-/* Added by PH: data must not contain tab (as it is
-b64 it shouldn't, but check for safety). */
-
-if (Ustrchr(data, '\t') != NULL)
-  {
-  ret = FAIL;
-  goto out;
-  }
-
 /* Added by PH: extra fields when TLS is in use or if the TCP/IP
 connection is local. */
 
@@ -409,29 +471,42 @@ Subsequently, the command was modified to add "secured" and "valid-client-
 cert" when relevant.
 ****************************************************************************/
 
-auth_command = string_sprintf("VERSION\t%d\t%d\nCPID\t%d\n"
+/* The VERSION and CPID lines are sent only once on a connection; the request
+id distinguishes the requests made on it. */
+
+crequid = ++dc_requid;
+auth_command = string_sprintf("%s"
        "AUTH\t%d\t%s\tservice=smtp\t%srip=%s\tlip=%s\tnologin\tresp=%s\n",
-       VERSION_MAJOR, VERSION_MINOR, getpid(), crequid,
+       reused ? US""
+	: string_sprintf("VERSION\t%d\t%d\nCPID\t%d\n",
+	    VERSION_MAJOR, VERSION_MINOR, (int)getpid()),
+       crequid,
        ablock->public_name, auth_extra_data, sender_host_address,
        interface_address, data);
 
 if ((
 #ifndef DISABLE_TLS
-    cctx.tls_ctx ? tls_write(cctx.tls_ctx, auth_command, Ustrlen(auth_command), FALSE) :
+    cctx->tls_ctx ? tls_write(cctx->tls_ctx, auth_command, Ustrlen(auth_command), FALSE) :
 #endif
-    write(cctx.sock, auth_command, Ustrlen(auth_command))) < 0)
+    write(cctx->sock, auth_command, Ustrlen(auth_command))) < 0)
   HDEBUG(D_auth) debug_printf("error sending auth_command: %s\n",
     strerror(errno));
 
 HDEBUG(D_auth) debug_printf("  DOVECOT>> '%s'\n", auth_command);
 
-while (1)
+for (BOOL first = TRUE; ; first = FALSE)
   {
   uschar * temp;
   uschar * auth_id_pre = NULL;
 
-  if (!dc_gets(buffer, sizeof(buffer), &cctx))
+  if (!dc_gets(buffer, sizeof(buffer), cctx))
     {
+    if (reused && first)
+      {
+      HDEBUG(D_auth) debug_printf("  kept dovecot auth connection was closed\n");
+      dc_close();
+      goto RECONNECT;
+      }
     auth_defer_msg = US"authentication socket read error or premature eof";
     goto out;
     }
@@ -467,9 +542,9 @@ while (1)
       temp = string_sprintf("CONT\t%d\t%s\n", crequid, data);
       if ((
 #ifndef DISABLE_TLS
-	  cctx.tls_ctx ? tls_write(cctx.tls_ctx, temp, Ustrlen(temp), FALSE) :
+	  cctx->tls_ctx ? tls_write(cctx->tls_ctx, temp, Ustrlen(temp), FALSE) :
 #endif
-	  write(cctx.sock, temp, Ustrlen(temp))) < 0)
+	  write(cctx->sock, temp, Ustrlen(temp))) < 0)
 	OUT("authentication socket write error");
 
       HDEBUG(D_auth) debug_printf("  DOVECOT>> '%s'\n", temp);
@@ -486,6 +561,7 @@ while (1)
 	  expand_nlength[1] = Ustrlen(auth_id_pre);
 	  expand_nmax = 1;
 	  }
+      clean = TRUE;
       ret = FAIL;
       goto out;
 
@@ -507,6 +583,7 @@ while (1)
       if (!auth_id_pre)
         OUT("authentication socket protocol error, username missing");
 
+      clean = TRUE;
       auth_defer_msg = NULL;
       ret = OK;
       /* fallthrough */
@@ -517,13 +594,11 @@ while (1)
   }
 
 out:
-/* close the socket used by dovecot */
-#ifndef DISABLE_TLS
-if (cctx.tls_ctx)
-  tls_close(cctx.tls_ctx, TRUE);
-#endif
-if (cctx.sock >= 0)
-  close(cctx.sock);
+/* Keep the connection for another AUTH if the request it carried completed
+and nothing is left unread; otherwise close it. */
+
+if (!clean || socket_buffer_left > 0)
+  dc_close();
 
 /* Expand server_condition as an authorization check */
 if (ret == OK) ret = auth_check_serv_cond(ablock);
@@ -0,0 +1,264 @@
+/*************************************************
+*     Exim - an Internet mail transport agent    *
+*************************************************/
+
+/*
+ * Copyright (c) The Exim Maintainers 2024
+ * License: GPL
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+/* Microbenchmarks of some of the hot paths, for the -bB option in a build
+with SUPPORT_BENCHMARKS.  Each one runs a function a given number of times,
+after the configuration has been read, and reports the rate and the median,
+99th percentile and worst times for one call.  Store is reset after each
+call, so that what is measured is the work and not the growth of the pools.
+
+  exim -bB expand <count> <string>
+  exim -bB match  <count> <domain-list> <domain>
+  exim -bB spool  <count> <message-id>
+  exim -bB write  <count> <message-id>
+  exim -bB hash   <count> <method> <length>
+
+"spool" reads the header file of a message on the queue; "write" writes the
+message, as an smtp transport would (CRLF line endings and a terminating dot),
+to /dev/null.  "hash" digests a buffer of the given length with md5 or one of
+the SHA family, through the same calls as the expansion operators, and also
+reports the throughput.  The end-to-end counterpart, for SMTP reception by a
+daemon, is the load generator test/src/smtpload.c. */
+
+#include "exim.h"
+
+#ifdef SUPPORT_BENCHMARKS
+
+typedef struct {
+  const uschar * name;
+  int		 nargs;			/* after the count */
+  const uschar * usage;
+} bench_desc;
+
+static bench_desc benches[] = {
+  { US"expand",	1, US"<string>" },
+  { US"match",	2, US"<domain-list> <domain>" },
+  { US"spool",	1, US"<message-id>" },
+  { US"write",	1, US"<message-id>" },
+  { US"hash",	2, US"<method> <length>" },
+};
+
+static struct {
+  const uschar * name;
+  hashmethod	 method;
+} bench_hashes[] = {
+  { US"md5",	HASH_NULL },		/* the native md5.c */
+  { US"sha1",	HASH_SHA1 },
+  { US"sha256",	HASH_SHA2_256 },
+  { US"sha384",	HASH_SHA2_384 },
+  { US"sha512",	HASH_SHA2_512 },
+  { US"sha3",	HASH_SHA3_256 },
+};
+
+static hashmethod bench_hash_method;
+static uschar *	  bench_hash_buf;
+static int	  bench_hash_len;
+
+
+static int
+cmp_double(const void * a, const void * b)
+{
+double x = *(const double *)a, y = *(const double *)b;
+return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static double
+now_us(void)
+{
+struct timespec ts;
+(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+
+/* Open a message on the queue for the spool and write benchmarks */
+
+static BOOL
+bench_load_message(const uschar * id)
+{
+if (!mac_ismsgid(id))
+  { printf("exim: malformed message id %s\n", id); return FALSE; }
+message_id = string_copy_taint(id, GET_UNTAINTED);
+if ((deliver_datafile = spool_open_datafile(message_id)) < 0)
+  { printf("exim: failed to open the data file for %s\n", id); return FALSE; }
+if (spool_read_header(string_sprintf("%s-H", message_id), TRUE, TRUE)
+    != spool_read_OK)
+  { printf("exim: failed to read the header file for %s\n", id); return FALSE; }
+return TRUE;
+}
+
+
+/* One call of the function being measured.  Returns FALSE on a failure,
+which is reported and ends the run. */
+
+static BOOL
+bench_once(int which, const uschar ** args, int devnull)
+{
+switch (which)
+  {
+  case 0:
+    if (!expand_cstring(args[0]) && !f.expand_string_forcedfail)
+      {
+      printf("expansion failed: %s\n", expand_string_message);
+      return FALSE;
+      }
+    return TRUE;
+
+  case 1:
+    {
+    const uschar * list = args[0];
+    if (match_isinlist(args[1], &list, 0, &domainlist_anchor, NULL,
+	  MCL_DOMAIN, TRUE, NULL) == DEFER)
+      {
+      printf("list match deferred\n");
+      return FALSE;
+      }
+    return TRUE;
+    }
+
+  case 2:
+    if (spool_read_header(string_sprintf("%s-H", message_id), TRUE, TRUE)
+	!= spool_read_OK)
+      {
+      printf("failed to read the header file: %s\n", strerror(errno));
+      return FALSE;
+      }
+    return TRUE;
+
+  case 3:
+    {
+    transport_ctx tctx = {{0}};
+    tctx.u.fd = devnull;
+    tctx.options = topt_use_crlf | topt_end_dot;
+    if (!transport_write_message(&tctx, 0))
+      {
+      printf("failed to write the message: %s\n", strerror(errno));
+      return FALSE;
+      }
+    return TRUE;
+    }
+
+  case 4:
+    if (bench_hash_method == HASH_NULL)
+      {
+      md5 base;
+      uschar digest[16];
+      md5_start(&base);
+      md5_end(&base, bench_hash_buf, bench_hash_len, digest);
+      }
+    else
+      {
+      hctx h;
+      blob b;
+      if (!exim_sha_init(&h, bench_hash_method))
+	{
+	printf("hash method not supported by this build\n");
+	return FALSE;
+	}
+      exim_sha_update(&h, bench_hash_buf, bench_hash_len);
+      exim_sha_finish(&h, &b);
+      }
+    return TRUE;
+  }
+return FALSE;
+}
+
+
+/* Run a benchmark, for the -bB option.
+
+Arguments:
+  argc		the number of arguments
+  argv		the arguments: name, count, then those for the benchmark
+
+Returns:	an exit code
+*/
+
+int
+bench_run(int argc, const uschar ** argv)
+{
+int which, count, devnull = -1, done = 0;
+double * times, total = 0, start;
+
+for (which = 0; which < nelem(benches); which++)
+  if (argc >= 1 && Ustrcmp(argv[0], benches[which].name) == 0) break;
+
+if (  which >= nelem(benches)
+   || argc != 2 + benches[which].nargs
+   || (count = Uatoi(argv[1])) <= 0)
+  {
+  printf("usage:\n");
+  for (int i = 0; i < nelem(benches); i++)
+    printf("  exim -bB %s <count> %s\n", benches[i].name, benches[i].usage);
+  return EXIT_FAILURE;
+  }
+argv += 2;
+
+if ((which == 2 || which == 3) && !bench_load_message(argv[0]))
+  return EXIT_FAILURE;
+if (which == 3)
+  {
+  deliver_in_buffer = store_malloc(DELIVER_IN_BUFFER_SIZE);
+  deliver_out_buffer = store_malloc(DELIVER_OUT_BUFFER_SIZE);
+  if ((devnull = open("/dev/null", O_WRONLY)) < 0)
+    { printf("exim: failed to open /dev/null: %s\n", strerror(errno));
+    return EXIT_FAILURE; }
+  }
+if (which == 4)
+  {
+  int i;
+  for (i = 0; i < nelem(bench_hashes); i++)
+    if (Ustrcmp(argv[0], bench_hashes[i].name) == 0) break;
+  if (i >= nelem(bench_hashes))
+    { printf("exim: unknown hash method %s\n", argv[0]); return EXIT_FAILURE; }
+  if ((bench_hash_len = Uatoi(argv[1])) < 0)
+    { printf("exim: bad length %s\n", argv[1]); return EXIT_FAILURE; }
+  bench_hash_method = bench_hashes[i].method;
+  bench_hash_buf = store_malloc(bench_hash_len + 1);
+  for (int j = 0; j < bench_hash_len; j++) bench_hash_buf[j] = (uschar) j;
+  }
+f.enable_dollar_recipients = TRUE;
+
+times = store_malloc(count * sizeof(double));
+start = now_us();
+for ( ; done < count; done++)
+  {
+  rmark reset_point = store_mark();
+  double t0 = now_us();
+  BOOL ok = bench_once(which, argv, devnull);
+
+  times[done] = now_us() - t0;
+  store_reset(reset_point);
+  if (!ok) break;
+  }
+total = now_us() - start;
+
+if (done > 0)
+  {
+  qsort(times, done, sizeof(double), cmp_double);
+  printf("%s: %d calls in %.3fs, %.0f/s; per call p50 %.2fus p99 %.2fus"
+    " max %.2fus\n",
+    benches[which].name, done, total / 1e6, done / (total / 1e6),
+    times[done / 2], times[(int)(done * 0.99)], times[done - 1]);
+  if (which == 4)
+    printf("hash: %.1f MB/s\n",
+      (double)bench_hash_len * done / total);	/* bytes per us is MB/s */
+  }
+
+store_free(times);
+if (bench_hash_buf) store_free(bench_hash_buf);
+if (devnull >= 0) (void) close(devnull);
+if (deliver_datafile >= 0)
+  { (void) close(deliver_datafile); deliver_datafile = -1; }
+return done == count ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#endif	/*SUPPORT_BENCHMARKS*/
+
+/* End of bench.c */
@@ -0,0 +1,60 @@
+/*
+ *  Exim - an Internet mail transport agent
+ *  Copyright (c) The Exim Maintainers 2024
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ *  Bloom filter file layout and hashing, shared by the bloom lookup and
+ *  exim_dbmbuild so that both set and test the same bits.
+ */
+
+#if !defined(BLOOM_H)	/* entire file */
+#define BLOOM_H
+
+/* A filter file is a 32-byte header followed by the bit array.  The header
+holds the magic string, the number of bits (m) as a 64-bit number, the number
+of hash functions (k) and of keys added as 32-bit numbers, all little-endian,
+and 8 reserved bytes.  Bit n of the array is bit (n & 7) of byte (n >> 3).
+
+A key's bits come from one 64-bit FNV-1a hash of it, and a second value mixed
+from that, combined as h1 + i*h2 for i = 0 .. k-1 (Kirsch and Mitzenmacher's
+double hashing), reduced modulo m. */
+
+#define BLOOM_MAGIC	"EXIMBLM1"
+#define BLOOM_HDRSIZE	32
+#define BLOOM_MAX_K	32
+
+static inline uint64_t
+bloom_hash(const uschar * s, unsigned len)
+{
+uint64_t h = 0xcbf29ce484222325ULL;
+while (len--) { h ^= *s++; h *= 0x100000001b3ULL; }
+return h;
+}
+
+/* The second value must be odd, so that it is never zero */
+
+static inline uint64_t
+bloom_hash2(uint64_t h)
+{
+h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+h ^= h >> 33;
+return h | 1;
+}
+
+static inline uint64_t
+bloom_get64(const uschar * p)
+{
+uint64_t n = 0;
+for (int i = 7; i >= 0; i--) n = n << 8 | p[i];
+return n;
+}
+
+static inline void
+bloom_put64(uschar * p, uint64_t n)
+{
+for (int i = 0; i < 8; i++, n >>= 8) p[i] = n & 0xff;
+}
+
+#endif	/* whole file */
+/* End of bloom.h */
@@ -53,7 +53,8 @@ typedef struct {
   char *data;
 } save_item;
 
-static const char *db_opts[] = { "", "USE_DB", "USE_GDBM", "USE_TDB", "USE_NDBM" };
+static const char *db_opts[] = { "", "USE_DB", "USE_GDBM", "USE_TDB", "USE_LMDB",
+  "USE_NDBM" };
 
 static int have_ipv6 = 0;
 static int have_iconv = 0;
@@ -266,7 +267,7 @@ while (fgets(buffer, sizeof(buffer), base) != NULL)
         {
         if (use_which_db_in_local_makefile)
           {
-          printf("*** Only one of USE_DB, USE_GDBM, or USE_TDB should be "
+          printf("*** Only one of USE_DB, USE_GDBM, USE_TDB or USE_LMDB should be "
             "defined in Local/Makefile\n");
           exit(1);
           }
@@ -383,9 +384,9 @@ while (fgets(buffer, sizeof(buffer), base) != NULL)
   while (*p && (isalnum((unsigned char)*p) || *p == '_')) *q++ = *p++;
   *q = 0;
 
-  /* USE_DB, USE_GDBM, and USE_TDB are special cases. We want to have only
-  one of them set. The scan of the Makefile has saved which was the last one
-  encountered. */
+  /* USE_DB, USE_GDBM, USE_TDB and USE_LMDB are special cases. We want to have
+  only one of them set. The scan of the Makefile has saved which was the last
+  one encountered. */
 
   for (i = 1; i < sizeof(db_opts)/sizeof(char *); i++)
     if (strcmp(name, db_opts[i]) == 0)
@@ -11,24 +11,88 @@
 
 
 #include "exim.h"
+#include <sys/mman.h>
+#ifdef EXIM_HAVE_SCHED_AFFINITY
+# include <sched.h>
+#endif
 
 
-/* Structure for holding data for each SMTP connection */
+/* Structure for holding data for each SMTP connection. The address is held
+inline so that the table can be placed in memory shared between acceptor
+processes. A pid of -1 marks a slot claimed by an acceptor that is about to
+fork the reception process. */
 
 typedef struct smtp_slot {
   pid_t		pid;		/* pid of the spawned reception process */
-  uschar *	host_address;	/* address of the client host */
+  pid_t		acceptor;	/* pid of the process that spawned it */
+  int		pid_next;	/* next slot (plus one) in its pid chain */
+  uschar	host_address[EXIM_IPADDR_MAX+1];  /* address of the client host */
 } smtp_slot;
 
+/* So that accepting a connection and reaping its process do not have to scan
+the slots, there is a table of connection counts by host address (open
+addressing, with twice as many entries as slots), a hash of the slots by pid,
+chained through the slots, and a stack of the free slots. These follow the
+slots, in the shared mapping if there is one, and are all addressed by index. */
+
+typedef struct smtp_host_count {
+  int		count;		/* zero for an unused entry */
+  uschar	host_address[EXIM_IPADDR_MAX+1];
+} smtp_host_count;
+
+typedef struct smtp_slot_index {
+  int		free_count;	/* entries on the free stack */
+  unsigned	host_size;	/* host table entries, a power of two */
+  unsigned	pid_size;	/* pid hash buckets, a power of two */
+} smtp_slot_index;
+
 typedef struct runner_slot {
   pid_t		pid;		/* pid of spawned queue-runner process */
   const uschar *queue_name;	/* pointer to the name in the qrunner struct */
 } runner_slot;
 
+/* A spare reception process, forked before there is a connection for it, and
+what the daemon sends it along with the connection when there is. */
+
+typedef struct spare_slot {
+  pid_t		pid;		/* pid of the waiting process; 0 if none */
+  int		fd;		/* daemon end of its socketpair */
+  time_t	started;	/* when it was forked */
+} spare_slot;
+
+/* A call the daemon is holding, for smtp_accept_hold, before handing it to a
+reception process */
+
+typedef struct held_call {
+  int		fd;		/* the accepted socket */
+  time_t	until;		/* when the hold ends */
+  union sockaddr_46 addr;	/* the client's address */
+} held_call;
+
+typedef struct spare_msg {
+  int		accept_count;	/* smtp_accept_count, including this one */
+  int		listen_backlog;	/* smtp_listen_backlog */
+} spare_msg;
+
+/* An idle spare is replaced after this many seconds, so that the state it
+was forked with does not get too far behind the daemon's */
+
+#define SPARE_MAX_AGE	300
+
+/* When a listening socket is ready, up to this many calls waiting on it are
+taken before going back to the top of the daemon loop */
+
+#define ACCEPT_BATCH_MAX	16
+
+/* The most calls the daemon holds at once for smtp_accept_hold; more are
+handed over at once */
+
+#define ACCEPT_HOLD_MAX		256
+
 /* An empty slot for initializing (Standard C does not allow constructor
 expressions in assignments except as initializers in declarations). */
 
-static smtp_slot empty_smtp_slot = { .pid = 0, .host_address = NULL };
+static smtp_slot empty_smtp_slot = { .pid = 0 };
 
 /*************************************************
 *               Local static variables           *
@@ -43,13 +107,54 @@ static int   accept_retry_errno;
 static BOOL  accept_retry_select_failed;
 
 static int   queue_run_count = 0;	/* current runners */
+static time_t qrun_next_tick = 0;	/* next periodic run due; 0 for none */
 
 static unsigned queue_runner_slot_count = 0;
 static runner_slot * queue_runner_slots = NULL;
 static smtp_slot * smtp_slots = NULL;
 
+static smtp_slot_index * smtp_slots_ix = NULL;
+static smtp_host_count * smtp_hosts = NULL;
+static int * smtp_pid_buckets = NULL;	/* slot number plus one; 0 for none */
+static int * smtp_free_slots = NULL;	/* stack of slot numbers */
+
+/* When there are several acceptor processes the slot table lives in a mapped,
+unlinked spool file which doubles as the lock for the table; the running total
+follows the slots. The main daemon keeps every acceptor's listener set so that
+it can restart one that dies. */
+
+static int   smtp_slots_fd = -1;
+static int * smtp_slots_total = NULL;
+
+static int   acceptor_index = 0;	/* 0 in the main daemon */
+static pid_t * acceptor_pids = NULL;	/* extra acceptors, by index */
+static int * acceptor_fds = NULL;	/* their listener sets */
+static BOOL  acceptors_missing = FALSE;
+
+static spare_slot * spares = NULL;
+static BOOL  spares_missing = FALSE;
+static BOOL  spare_process = FALSE;	/* TRUE in a spare, once passed a call */
+
+static held_call * held_calls = NULL;	/* for smtp_accept_hold */
+static int   held_count = 0;
+
 static BOOL  write_pid = TRUE;
 
+/* The load average as sampled by the daemon, in a mapped spool file */
+
+#define DAEMON_LOAD_FILE	"daemon-load"
+#define DAEMON_LOAD_MAGIC	0x4c4f4144
+
+typedef struct daemon_load_t {
+  unsigned	magic;
+  int		load;			/* as from os_getloadavg() */
+  time_t	stamp;			/* when sampled */
+} daemon_load_t;
+
+static volatile daemon_load_t * daemon_load = NULL;
+static BOOL  daemon_load_tried = FALSE;
+static BOOL  daemon_load_writer = FALSE;	/* TRUE in the main daemon */
+
 #ifndef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
 static uschar * notifier_socket_name;
 #endif
@@ -74,93 +179,1178 @@ signal(SIGHUP, sighup_handler);
 
 
 
-/*************************************************
-*     SIGCHLD handler for main daemon process    *
-*************************************************/
+/*************************************************
+*   Check the configuration before a re-exec     *
+*************************************************/
+
+/* A SIGHUP makes the daemon re-exec itself to read its configuration afresh.
+So that a mistake in a new configuration does not stop the daemon, it is first
+read by "exim -bV", with the same configuration options, in a child. The
+daemon carries on with its old configuration while the check runs; the child
+is reaped by handle_ending_processes() and the result acted on at the end of
+the main loop. The start of what the child writes to stderr, which says what
+is wrong, goes into the log line. If the check cannot be run, the re-exec goes
+ahead as it always did. */
+
+#define CONFIG_CHECK_TIMEOUT 60
+
+static pid_t	config_check_pid = 0;
+static int	config_check_fd = -1;
+static int	config_check_status;
+static BOOL	config_check_ended;
+static time_t	config_check_started;
+static uschar	config_check_err[256];
+static int	config_check_errlen;
+
+
+/* Start the check.
+
+Returns: FALSE if it could not be started
+*/
+
+static BOOL
+daemon_config_check_start(void)
+{
+int pfd[2];
+pid_t pid;
+
+if (pipe(pfd) != 0)
+  {
+  log_write(0, LOG_MAIN, "cannot check the new configuration: pipe failed: %s",
+    strerror(errno));
+  return FALSE;
+  }
+if ((pid = exim_fork(US"config-check")) == 0)
+  {
+  int fd = open("/dev/null", O_WRONLY);
+  if (fd >= 0) force_fd(fd, 1);
+  (void) close(pfd[0]);
+  force_fd(pfd[1], 2);
+  (void) child_exec_exim(CEE_EXEC_EXIT, TRUE, NULL, TRUE, 1, US"-bV");
+  /* Control does not return here. */
+  }
+(void) close(pfd[1]);
+if (pid < 0)
+  {
+  log_write(0, LOG_MAIN, "cannot check the new configuration: fork failed: %s",
+    strerror(errno));
+  (void) close(pfd[0]);
+  return FALSE;
+  }
+
+(void) fcntl(pfd[0], F_SETFL, fcntl(pfd[0], F_GETFL) | O_NONBLOCK);
+(void) fcntl(pfd[0], F_SETFD, fcntl(pfd[0], F_GETFD) | FD_CLOEXEC);
+config_check_fd = pfd[0];
+config_check_pid = pid;
+config_check_ended = FALSE;
+config_check_errlen = 0;
+config_check_started = time(NULL);
+DEBUG(D_any) debug_printf("new configuration being checked by pid %d\n",
+  (int)pid);
+return TRUE;
+}
+
+
+/* Called from handle_ending_processes().
+
+Returns: TRUE if the pid was that of the check
+*/
+
+static BOOL
+daemon_config_check_reaped(pid_t pid, int status)
+{
+if (config_check_pid <= 0 || pid != config_check_pid) return FALSE;
+config_check_status = status;
+config_check_ended = TRUE;
+return TRUE;
+}
+
+
+/* In the main loop, the time in milliseconds until a running check is to be
+given up on; -1 if there is none */
+
+static int
+daemon_config_check_timeout(void)
+{
+int left;
+
+if (config_check_pid <= 0 || config_check_ended) return -1;
+left = (int)(config_check_started + CONFIG_CHECK_TIMEOUT - time(NULL));
+return left > 0 ? left * 1000 : 0;
+}
+
+
+/* Called at the end of each time round the main loop while a check is
+running. Collect the start of its complaints, so that it never blocks writing
+them, and once it has ended (or been killed for taking too long) log any
+failure.
+
+Returns: 1 if the check passed, 0 if it failed, -1 if it is still running
+*/
+
+static int
+daemon_config_check_tick(void)
+{
+BOOL timedout = FALSE;
+uschar * s;
+int status;
+
+for (int n; ; )
+  {
+  uschar junk[1024];
+  BOOL keep = config_check_errlen < sizeof(config_check_err) - 1;
+
+  if ((n = read(config_check_fd,
+		keep ? config_check_err + config_check_errlen : junk,
+		keep ? sizeof(config_check_err) - 1 - config_check_errlen
+		: sizeof(junk))) <= 0)
+    break;
+  if (keep) config_check_errlen += n;
+  }
+
+if (!config_check_ended)
+  {
+  if (daemon_config_check_timeout() != 0) return -1;
+  (void) kill(config_check_pid, SIGKILL);
+  (void) waitpid(config_check_pid, &config_check_status, 0);
+  timedout = TRUE;
+  }
+
+status = config_check_status;
+config_check_pid = 0;
+(void) close(config_check_fd);
+config_check_fd = -1;
+
+if (!timedout && WIFEXITED(status) && WEXITSTATUS(status) == 0) return 1;
+
+/* Make one line of it */
+
+config_check_err[config_check_errlen] = '\0';
+for (uschar * t = s = config_check_err; *t; t++)
+  if (!isspace(*t)) *s++ = *t;
+  else if (s > config_check_err && s[-1] != ' ') *s++ = ' ';
+while (s > config_check_err && s[-1] == ' ') s--;
+*s = '\0';
+log_write(0, LOG_MAIN|LOG_PANIC, "pid %d: SIGHUP received: new configuration "
+  "%s; daemon not restarted%s%s", getpid(),
+  timedout ? US"check timed out"
+  : WIFEXITED(status)
+  ? string_sprintf("failed its check (exit code %d)", WEXITSTATUS(status))
+  : string_sprintf("check was killed by signal %d", WTERMSIG(status)),
+  *config_check_err ? ": " : "", config_check_err);
+return 0;
+}
+
+
+/* The file that holds the shared cache across a re-exec. The pid stays the
+same through the exec. */
+
+static const uschar *
+shared_cache_file(void)
+{
+return string_sprintf("%s/daemon-cache-%d", spool_directory, (int)getpid());
+}
+
+
+
+/*************************************************
+*     SIGCHLD handler for main daemon process    *
+*************************************************/
+
+/* Don't re-enable the handler here, since we aren't doing the
+waiting here. If the signal is re-enabled, there will just be an
+infinite sequence of calls to this handler. The SIGCHLD signal is
+used just as a means of waking up the daemon so that it notices
+terminated subprocesses as soon as possible.
+
+Argument: the signal number
+Returns:  nothing
+*/
+
+static void
+main_sigchld_handler(int sig)
+{
+os_non_restarting_signal(SIGCHLD, SIG_DFL);
+sigchld_seen = TRUE;
+}
+
+
+/* SIGTERM handler.  Try to get the daemon pid file removed
+before exiting. */
+
+static void
+main_sigterm_handler(int sig)
+{
+sigterm_seen = TRUE;
+}
+
+
+
+
+/*************************************************
+*          Unexpected errors in SMTP calls       *
+*************************************************/
+
+/* This function just saves a bit of repetitious coding.
+
+Arguments:
+  log_msg        Text of message to be logged
+  smtp_msg       Text of SMTP error message
+  was_errno      The failing errno
+
+Returns:         nothing
+*/
+
+static void
+never_error(uschar *log_msg, uschar *smtp_msg, int was_errno)
+{
+uschar *emsg = was_errno <= 0
+  ? US"" : string_sprintf(": %s", strerror(was_errno));
+log_write(0, LOG_MAIN|LOG_PANIC, "%s%s", log_msg, emsg);
+if (smtp_out) smtp_printf("421 %s\r\n", SP_NO_MORE, smtp_msg);
+}
+
+
+
+
+/*************************************************
+*************************************************/
+
+static void
+unlink_notifier_socket(void)
+{
+#ifndef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
+DEBUG(D_any) debug_printf("unlinking notifier socket %s\n", notifier_socket_name);
+Uunlink(notifier_socket_name);
+#endif
+}
+
+
+/* Close any calls being held; used in children of the daemon */
+
+static void
+daemon_held_close(void)
+{
+while (held_count > 0) (void) close(held_calls[--held_count].fd);
+}
+
+
+static void
+close_daemon_sockets(int daemon_notifier_fd,
+  struct pollfd * fd_polls, int listen_socket_count)
+{
+if (daemon_notifier_fd >= 0)
+  {
+  (void) close(daemon_notifier_fd);
+  daemon_notifier_fd = -1;
+  }
+
+for (int i = 0; i < listen_socket_count; i++) (void) close(fd_polls[i].fd);
+if (acceptor_fds)
+  for (int i = 0; i < (daemon_acceptors - 1) * listen_socket_count; i++)
+    (void) close(acceptor_fds[i]);
+if (spares)
+  for (int i = 0; i < smtp_accept_spares; i++)
+    if (spares[i].pid > 0) (void) close(spares[i].fd);
+daemon_held_close();
+lookup_proxy_close(FALSE);
+smtp_pool_close();
+}
+
+
+
+/*************************************************
+*      Lock or unlock the SMTP connection table  *
+*************************************************/
+
+/* This matters only when the table is shared by several acceptor processes;
+otherwise it is a no-op. Taking the lock picks up the current total of
+reception processes into smtp_accept_count; releasing it publishes ours.
+
+Argument:   TRUE to lock, FALSE to unlock
+Returns:    nothing
+*/
+
+static void
+smtp_slots_lock(BOOL lock)
+{
+struct flock fl = { .l_type = lock ? F_WRLCK : F_UNLCK, .l_whence = SEEK_SET };
+
+if (smtp_slots_fd < 0) return;
+if (!lock) *smtp_slots_total = smtp_accept_count;
+while (fcntl(smtp_slots_fd, F_SETLKW, &fl) < 0)
+  if (errno != EINTR)
+    {
+    log_write(0, LOG_MAIN|LOG_PANIC, "daemon: %slocking connection table "
+      "failed: %s", lock ? "" : "un", strerror(errno));
+    break;
+    }
+if (lock) smtp_accept_count = *smtp_slots_total;
+}
+
+
+
+/*************************************************
+*       Load average sampled by the daemon       *
+*************************************************/
+
+/* When any option that tests the load average is set, the daemon samples it
+once a second into a small file in the spool directory, mapped shared.
+Processes forked from the daemon inherit the mapping, and others (such as
+queue runners that were re-executed, or started by cron) map the file on first
+use, so that a check costs a memory read rather than the system calls and text
+parsing that getting the load can take.  A sample more than a second old, from
+a daemon that is busy or has gone, is not used.  The file is replaced each
+time a daemon starts.
+
+Returns:  the load average * 1000, or -1 if not available
+*/
+
+int
+daemon_getloadavg(void)
+{
+#ifndef LOAD_AVG_NEEDS_ROOT	/* the first call must get at the kernel */
+if (!daemon_load && !daemon_load_tried)
+  {
+  uschar * fname = string_sprintf("%s/" DAEMON_LOAD_FILE, spool_directory);
+  struct stat statbuf;
+  void * map;
+  int fd;
+
+  daemon_load_tried = TRUE;
+  if ((fd = Uopen(fname, EXIM_CLOEXEC | O_RDONLY, 0)) >= 0)
+    {
+    if (  fstat(fd, &statbuf) == 0
+       && statbuf.st_size == sizeof(daemon_load_t)
+       && (map = mmap(NULL, sizeof(daemon_load_t), PROT_READ, MAP_SHARED,
+		      fd, 0)) != MAP_FAILED)
+      if (((daemon_load_t *)map)->magic == DAEMON_LOAD_MAGIC)
+	daemon_load = map;
+      else
+	(void) munmap(map, sizeof(daemon_load_t));
+    (void) close(fd);
+    }
+  DEBUG(D_load) debug_printf("load average from daemon: %s\n",
+    daemon_load ? "mapped" : "not available");
+  }
+
+if (daemon_load)
+  {
+  time_t stamp = daemon_load->stamp;
+  int load = daemon_load->load;
+
+  /* The daemon writes the load before the time, so if the time changed
+  while they were read the load may be from the next sample; get our own */
+
+  if (stamp >= time(NULL) - 1 && daemon_load->stamp == stamp)
+    return load;
+  }
+#endif
+return os_getloadavg();
+}
+
+
+/* Called in the daemon at startup: make the file, if there is an option that
+will need the load average.  It is built under a temporary name and
+renamed, so that processes holding an older one are not disturbed. */
+
+static void
+daemon_load_init(void)
+{
+uschar * fname, * tname;
+daemon_load_t * map;
+int fd;
+
+if (  queue_only_load < 0 && smtp_load_reserve < 0
+   && deliver_queue_load_max < 0)
+  return;
+
+/* The spool directory is writable by the exim user, so anything left under
+the temporary name is removed and the file must be new; a planted symlink is
+not followed before the file is given to exim. */
+
+fname = string_sprintf("%s/" DAEMON_LOAD_FILE, spool_directory);
+tname = string_sprintf("%s.%d", fname, (int)getpid());
+(void) Uunlink(tname);
+if (  (fd = Uopen(tname,
+		  EXIM_CLOEXEC | EXIM_NOFOLLOW | O_RDWR | O_CREAT | O_EXCL,
+		  SPOOL_MODE)) < 0
+   || exim_fchown(fd, exim_uid, exim_gid, tname) < 0
+   || ftruncate(fd, sizeof(daemon_load_t)) < 0
+   || (map = mmap(NULL, sizeof(daemon_load_t), PROT_READ | PROT_WRITE,
+		  MAP_SHARED, fd, 0)) == MAP_FAILED
+   )
+  {
+  log_write(0, LOG_MAIN|LOG_PANIC, "daemon: failed to set up %s: %s",
+    tname, strerror(errno));
+  if (fd >= 0) { (void) close(fd); (void) Uunlink(tname); }
+  return;
+  }
+(void) close(fd);
+
+map->load = os_getloadavg();
+map->stamp = time(NULL);
+map->magic = DAEMON_LOAD_MAGIC;
+
+if (Urename(tname, fname) < 0)
+  {
+  log_write(0, LOG_MAIN|LOG_PANIC, "daemon: failed to rename %s: %s",
+    tname, strerror(errno));
+  (void) Uunlink(tname);
+  (void) munmap(map, sizeof(daemon_load_t));
+  return;
+  }
+daemon_load = map;
+daemon_load_tried = daemon_load_writer = TRUE;
+}
+
+
+/* Called in the main daemon loop: take a new sample if the second has
+changed.
+
+Returns:  milliseconds until the next sample is due, or -1 if none are taken
+*/
+
+static int
+daemon_load_tick(void)
+{
+struct timeval now;
+
+if (!daemon_load_writer) return -1;
+gettimeofday(&now, NULL);
+if (daemon_load->stamp != now.tv_sec)
+  {
+  daemon_load->load = os_getloadavg();
+  daemon_load->stamp = now.tv_sec;
+  }
+return 1000 - (int)(now.tv_usec / 1000);
+}
+
+
+
+/*************************************************
+*         CPU placement of child processes       *
+*************************************************/
+
+/* With smtp_accept_cpus set, each reception process is pinned to one CPU of
+the list, taken in turn. With several acceptors the list is dealt out among
+them, so that an acceptor and the processes it forks keep to their own CPUs;
+an acceptor is pinned to its share. With queue_run_cpus set, each queue runner
+is pinned to one CPU of that list in turn, and its delivery processes inherit
+the placement. */
+
+#ifdef EXIM_HAVE_SCHED_AFFINITY
+# define DAEMON_CPU_MAX	CPU_SETSIZE
+#else
+# define DAEMON_CPU_MAX	1024
+#endif
+
+static int *   smtp_cpus = NULL;
+static int     smtp_cpu_count = 0;
+static unsigned smtp_cpu_turn = 0;	/* reception processes forked */
+static int *   qrun_cpus = NULL;
+static int     qrun_cpu_count = 0;
+static unsigned qrun_cpu_turn = 0;	/* queue runners forked */
+
+
+/* Split a list of CPU numbers and ranges, such as "0-7 : 16-23".
+
+Arguments:
+  name		the option name, for errors
+  list		its value
+  countp	where to put the number of CPUs
+
+Returns:	a vector of the CPU numbers; panics on a bad list
+*/
+
+static int *
+daemon_cpus_parse(const uschar * name, const uschar * list, int * countp)
+{
+int * cpus = store_get(DAEMON_CPU_MAX * sizeof(int), GET_UNTAINTED);
+int n = 0;
+uschar * s;
+
+for (int sep = 0; (s = string_nextinlist(&list, &sep, NULL, 0)); )
+  {
+  uschar * end;
+  long lo = Ustrtol(s, &end, 10), hi = lo;
+
+  if (*end == '-') hi = Ustrtol(end + 1, &end, 10);
+  if (end == s || *end || lo < 0 || hi < lo || hi >= DAEMON_CPU_MAX)
+    log_write(0, LOG_MAIN|LOG_PANIC_DIE, "%s: bad CPU number or range \"%s\"",
+      name, s);
+  while (lo <= hi && n < DAEMON_CPU_MAX) cpus[n++] = (int)lo++;
+  }
+*countp = n;
+return n ? cpus : NULL;
+}
+
+
+/* Called in the daemon at startup */
+
+static void
+daemon_cpus_init(void)
+{
+if (smtp_accept_cpus)
+  smtp_cpus = daemon_cpus_parse(US"smtp_accept_cpus", smtp_accept_cpus,
+				&smtp_cpu_count);
+if (queue_run_cpus)
+  qrun_cpus = daemon_cpus_parse(US"queue_run_cpus", queue_run_cpus,
+				&qrun_cpu_count);
+#ifndef EXIM_HAVE_SCHED_AFFINITY
+if (smtp_cpu_count || qrun_cpu_count)
+  log_write(0, LOG_MAIN, "CPU affinity is not supported on this system; "
+    "smtp_accept_cpus and queue_run_cpus are ignored");
+#endif
+}
+
+
+/* Pin this process to cpus[first], cpus[first + step], ... */
+
+static void
+daemon_cpus_set(const int * cpus, int count, int first, int step)
+{
+#ifdef EXIM_HAVE_SCHED_AFFINITY
+cpu_set_t set;
+
+CPU_ZERO(&set);
+for (int i = first; i < count; i += step) CPU_SET(cpus[i], &set);
+if (sched_setaffinity(0, sizeof(set), &set) < 0)
+  { DEBUG(D_any) debug_printf("sched_setaffinity: %s\n", strerror(errno)); }
+else
+  DEBUG(D_any) debug_printf("pinned to CPU %d%s\n", cpus[first],
+    first + step < count ? " and others" : "");
+#endif
+}
+
+
+/* Called in a new acceptor. It keeps to the CPUs its reception processes
+will be given; if there are fewer CPUs than acceptors, they are shared. */
+
+static void
+daemon_cpus_acceptor(void)
+{
+if (!smtp_cpu_count) return;
+if (smtp_cpu_count >= daemon_acceptors)
+  daemon_cpus_set(smtp_cpus, smtp_cpu_count, acceptor_index, daemon_acceptors);
+else
+  daemon_cpus_set(smtp_cpus, smtp_cpu_count,
+    acceptor_index % smtp_cpu_count, smtp_cpu_count);
+}
+
+
+/* Called in a new reception process, or a spare */
+
+static void
+daemon_cpus_smtp(void)
+{
+int pos;
+
+if (!smtp_cpu_count) return;
+if (smtp_cpu_count >= daemon_acceptors)
+  {
+  int share = (smtp_cpu_count - acceptor_index + daemon_acceptors - 1)
+	      / daemon_acceptors;
+  pos = acceptor_index + daemon_acceptors * (smtp_cpu_turn % share);
+  }
+else
+  pos = (acceptor_index + smtp_cpu_turn) % smtp_cpu_count;
+daemon_cpus_set(smtp_cpus, smtp_cpu_count, pos, smtp_cpu_count);
+}
+
+
+/* Called in a new queue runner */
+
+static void
+daemon_cpus_qrun(void)
+{
+if (qrun_cpu_count)
+  daemon_cpus_set(qrun_cpus, qrun_cpu_count, qrun_cpu_turn % qrun_cpu_count,
+		  qrun_cpu_count);
+}
+
+
+
+/*************************************************
+*      Free SMTP connection slots                *
+*************************************************/
+
+/*************************************************
+*         Index of the SMTP connection slots     *
+*************************************************/
+
+/* The space needed for the slots, the running total and the index, for
+a given number of slots, and the sizes of the tables */
+
+static size_t
+smtp_slots_size(int max, unsigned * host_size, unsigned * pid_size)
+{
+unsigned h = 16, p = 16;
+while (h < 2 * (unsigned)max) h <<= 1;
+while (p < (unsigned)max) p <<= 1;
+if (host_size) *host_size = h;
+if (pid_size) *pid_size = p;
+return max * sizeof(smtp_slot) + sizeof(int) + sizeof(smtp_slot_index)
+  + h * sizeof(smtp_host_count) + (p + max) * sizeof(int);
+}
+
+/* Set up the slots and the index in zeroed memory of that size */
+
+static void
+smtp_slots_init(void * mem, int max)
+{
+uschar * p = mem;
+unsigned host_size, pid_size;
+
+(void) smtp_slots_size(max, &host_size, &pid_size);
+smtp_slots = (smtp_slot *)p;		p += max * sizeof(smtp_slot);
+smtp_slots_total = (int *)p;		p += sizeof(int);
+smtp_slots_ix = (smtp_slot_index *)p;	p += sizeof(smtp_slot_index);
+smtp_hosts = (smtp_host_count *)p;	p += host_size * sizeof(smtp_host_count);
+smtp_pid_buckets = (int *)p;		p += pid_size * sizeof(int);
+smtp_free_slots = (int *)p;
+
+smtp_slots_ix->host_size = host_size;
+smtp_slots_ix->pid_size = pid_size;
+for (int i = 0; i < max; i++)
+  {
+  smtp_slots[i] = empty_smtp_slot;
+  smtp_free_slots[i] = max - 1 - i;
+  }
+smtp_slots_ix->free_count = max;
+}
+
+
+static unsigned
+smtp_host_hash(const uschar * s)
+{
+unsigned h = 5381;
+while (*s) h = (h << 5) + h + *s++;
+return h;
+}
+
+/* Find the count for a host address, or the unused entry where it would go.
+The table cannot fill, having twice as many entries as there are slots. */
+
+static smtp_host_count *
+smtp_host_find(const uschar * address)
+{
+unsigned mask = smtp_slots_ix->host_size - 1;
+
+for (unsigned i = smtp_host_hash(address) & mask; ; i = (i + 1) & mask)
+  if (  !smtp_hosts[i].count
+     || Ustrcmp(smtp_hosts[i].host_address, address) == 0)
+    return smtp_hosts + i;
+}
+
+static void
+smtp_host_count_up(const uschar * address)
+{
+smtp_host_count * e = smtp_host_find(address);
+if (!e->count++)
+  string_format_nt(e->host_address, sizeof(e->host_address), "%s", address);
+}
+
+/* When a count goes to zero, close the gap by moving back any later entry of
+the run that could not otherwise be found. */
+
+static void
+smtp_host_count_down(const uschar * address)
+{
+smtp_host_count * e = smtp_host_find(address);
+unsigned mask = smtp_slots_ix->host_size - 1, i;
+
+if (!e->count || --e->count > 0) return;
+
+i = e - smtp_hosts;
+for (unsigned j = (i + 1) & mask; smtp_hosts[j].count; j = (j + 1) & mask)
+  {
+  unsigned home = smtp_host_hash(smtp_hosts[j].host_address) & mask;
+  if (i <= j ? home <= i || home > j : home <= i && home > j)
+    {
+    smtp_hosts[i] = smtp_hosts[j];
+    smtp_hosts[j].count = 0;
+    i = j;
+    }
+  }
+}
+
+static void
+smtp_pid_link(int n)
+{
+int * bucket = smtp_pid_buckets
+  + ((unsigned)smtp_slots[n].pid & (smtp_slots_ix->pid_size - 1));
+smtp_slots[n].pid_next = *bucket;
+*bucket = n + 1;
+}
+
+static void
+smtp_pid_unlink(int n)
+{
+for (int * p = smtp_pid_buckets
+	    + ((unsigned)smtp_slots[n].pid & (smtp_slots_ix->pid_size - 1));
+     *p; p = &smtp_slots[*p - 1].pid_next)
+  if (*p == n + 1)
+    {
+    *p = smtp_slots[n].pid_next;
+    break;
+    }
+}
+
+/* Free one slot. The table must be locked. */
+
+static void
+smtp_slot_release(int n)
+{
+smtp_slot * slot = smtp_slots + n;
+
+if (slot->pid > 0) smtp_pid_unlink(n);
+if (*slot->host_address) smtp_host_count_down(slot->host_address);
+*slot = empty_smtp_slot;
+smtp_free_slots[smtp_slots_ix->free_count++] = n;
+if (--smtp_accept_count < 0) smtp_accept_count = 0;
+}
+
+
+
+/* Called when one of our reception processes has ended, to free its slot; or,
+with by_acceptor set, when an acceptor process has ended, to free any slots it
+left behind (one that is killed outright cannot free them itself). A process
+is found through the pid hash; the rare other cases scan the slots.
+
+Arguments:
+  pid           the process that ended
+  by_acceptor   TRUE to match the spawning acceptor rather than the process
+
+Returns:        TRUE if any slot was freed
+*/
+
+static BOOL
+smtp_slots_free(pid_t pid, BOOL by_acceptor)
+{
+pid_t me = getpid();
+int freed = 0;
+
+if (!smtp_slots) return FALSE;
+
+smtp_slots_lock(TRUE);
+if (!by_acceptor && pid > 0)
+  {
+  for (int n = smtp_pid_buckets[(unsigned)pid & (smtp_slots_ix->pid_size - 1)];
+       n; n = smtp_slots[n - 1].pid_next)
+    if (smtp_slots[n - 1].pid == pid && smtp_slots[n - 1].acceptor == me)
+      {
+      smtp_slot_release(n - 1);
+      freed++;
+      break;
+      }
+  }
+else
+  for (int i = 0; i < smtp_accept_max; i++)
+    {
+    smtp_slot * slot = smtp_slots + i;
+    if (by_acceptor
+	? slot->acceptor == pid && slot->pid != 0
+	: slot->pid == pid && slot->acceptor == me)
+      {
+      smtp_slot_release(i);
+      freed++;
+      if (!by_acceptor) break;
+      }
+    }
+smtp_slots_lock(FALSE);
+
+if (freed)
+  DEBUG(D_any) debug_printf("%d SMTP accept process%s now running\n",
+    smtp_accept_count, smtp_accept_count == 1 ? "" : "es");
+return freed > 0;
+}
+
+
+/*************************************************
+*      Pass a connection to a spare process      *
+*************************************************/
+
+/* Send an accepted socket, with the counts, to any waiting spare. A spare that
+cannot be reached has died, or is about to. Either way its slot is emptied, to
+be refilled from the main loop.
+
+Arguments:
+  sock            the accepted socket
+  accept_count    the value of smtp_accept_count for the new process
+
+Returns:          the pid of the spare, or -1 if there was none to take it
+*/
+
+static pid_t
+daemon_spare_pass(int sock, int accept_count)
+{
+if (spares) for (int i = 0; i < smtp_accept_spares; i++) if (spares[i].pid > 0)
+  {
+  spare_slot * sp = spares + i;
+  pid_t pid = sp->pid;
+  spare_msg m = { .accept_count = accept_count,
+		  .listen_backlog = smtp_listen_backlog };
+  struct iovec iov = { .iov_base = &m, .iov_len = sizeof(m) };
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } cmsgbuf;
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+			.msg_control = cmsgbuf.buf,
+			.msg_controllen = sizeof(cmsgbuf.buf) };
+  struct cmsghdr * cp = CMSG_FIRSTHDR(&msg);
+  ssize_t n;
+
+  memset(&cmsgbuf, 0, sizeof(cmsgbuf));
+  cp->cmsg_len = CMSG_LEN(sizeof(int));
+  cp->cmsg_level = SOL_SOCKET;
+  cp->cmsg_type = SCM_RIGHTS;
+  memcpy(CMSG_DATA(cp), &sock, sizeof(int));
+
+  while ((n = sendmsg(sp->fd, &msg, 0)) < 0 && errno == EINTR) ;
+  (void) close(sp->fd);
+  sp->pid = 0;
+  spares_missing = TRUE;
+
+  if (n == sizeof(m))
+    {
+    DEBUG(D_any) debug_printf("connection passed to spare process %d\n",
+      (int)pid);
+    return pid;
+    }
+  DEBUG(D_any) debug_printf("failed to pass connection to spare process %d: "
+    "%s\n", (int)pid, n < 0 ? strerror(errno) : "short write");
+  (void) kill(pid, SIGTERM);
+  }
+return -1;
+}
+
+
+
+/*************************************************
+*       Blocklist of refused client addresses     *
+*************************************************/
+
+/* With daemon_blocklist_file set, calls from the addresses it lists are
+refused by the daemon itself, before any count is taken or process forked.
+The file is held as an array of address ranges, sorted and with overlaps
+merged, so that a check is a binary search. IPv4 addresses are mapped into
+the IPv6 space so that one array serves for both. The file is read again when
+its modification time changes; that is looked at no more than every
+BLOCKLIST_RECHECK seconds.
+
+Temporary entries, each for a single address, can be added by notification
+from "control = daemon_blocklist" in an ACL. They live in a small unsorted
+array; when it is full the entry nearest to expiry is replaced. Only the main
+daemon gets the notifications, so with daemon_acceptors set the array is in a
+file mapped shared, which the acceptors read; only the main daemon changes it.
+An acceptor that looks at an entry while it is being replaced might, just
+once, miss it or match the entry being replaced. */
+
+#define BLOCKLIST_RECHECK	5
+#define BLOCKLIST_TEMP_MAX	1024
+
+typedef struct {
+  unsigned	lo[4];		/* first address, as from host_aton() */
+  unsigned	hi[4];		/* last address */
+} bl_range;
+
+typedef struct {
+  unsigned	addr[4];
+  time_t	expire;
+} bl_temp;
+
+static bl_range * bl_ranges = NULL;
+static int	bl_count = 0;
+static time_t	bl_mtime = 0;
+static time_t	bl_next_check = 0;
+
+typedef struct {
+  int		count;
+  bl_temp	e[BLOCKLIST_TEMP_MAX];
+} bl_temp_table;
+
+static bl_temp_table	bl_temp_local;
+static bl_temp_table *	bl_temps = &bl_temp_local;
+
+
+static int
+bl_cmp(const unsigned * a, const unsigned * b)
+{
+for (int i = 0; i < 4; i++)
+  if (a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+return 0;
+}
+
+static int
+bl_sort_cmp(const void * a, const void * b)
+{
+return bl_cmp(((const bl_range *)a)->lo, ((const bl_range *)b)->lo);
+}
+
+
+/* Convert an address to the common form, IPv4 mapped as ::ffff:a.b.c.d.
+Returns the number of mask bits covering the address as given. */
+
+static int
+bl_address(const uschar * s, unsigned * a)
+{
+int x[4];
+
+if (host_aton(s, x) == 1)
+  {
+  a[0] = a[1] = 0; a[2] = 0xffff; a[3] = (unsigned)x[0];
+  return 96;
+  }
+for (int i = 0; i < 4; i++) a[i] = (unsigned)x[i];
+return 0;
+}
+
+
+/* Convert one file entry, an address with an optional /mask, to a range.
+Returns FALSE for a syntax error. */
+
+static BOOL
+bl_entry(const uschar * s, bl_range * r)
+{
+int mask, bits, af = string_is_ip_addressX(s, &mask, NULL);
+unsigned a[4];
+
+if (!af) return FALSE;
+if (mask)
+  {
+  bits = Uatoi(s + mask + 1);
+  if (bits > (af == 4 ? 32 : 128)) return FALSE;
+  s = string_copyn(s, mask);
+  }
+else
+  bits = af == 4 ? 32 : 128;
+
+bits += bl_address(s, a);
+for (int i = 0; i < 4; i++, bits -= 32)
+  {
+  unsigned m = bits >= 32 ? 0xffffffffu : bits <= 0 ? 0 : ~(0xffffffffu >> bits);
+  r->lo[i] = a[i] & m;
+  r->hi[i] = a[i] | ~m;
+  }
+return TRUE;
+}
+
+
+/* Read the blocklist file. On failure to open it the previous list is kept;
+a bad line is logged and skipped. */
+
+static void
+blocklist_load(void)
+{
+FILE * f;
+struct stat st;
+bl_range * ranges = NULL;
+int size = 0, count = 0, lineno = 0;
+uschar buf[256];
+rmark reset_point = store_mark();
+
+if (!(f = Ufopen(daemon_blocklist_file, "rb")))
+  {
+  log_write(0, LOG_MAIN|LOG_PANIC, "failed to open daemon_blocklist_file %s: %s",
+    daemon_blocklist_file, strerror(errno));
+  bl_mtime = 0;
+  return;
+  }
+if (fstat(fileno(f), &st) == 0) bl_mtime = st.st_mtime;
+
+while (Ufgets(buf, sizeof(buf), f))
+  {
+  uschar * s = buf, * e;
+
+  lineno++;
+  if ((e = Ustrchr(s, '#'))) *e = 0;
+  Uskip_whitespace(&s);
+  for (e = s + Ustrlen(s); e > s && isspace(e[-1]); ) *--e = 0;
+  if (!*s) continue;
+
+  if (count >= size)
+    {
+    bl_range * new = store_malloc((size = size ? size * 2 : 256) * sizeof(bl_range));
+    if (ranges)
+      {
+      memcpy(new, ranges, count * sizeof(bl_range));
+      store_free(ranges);
+      }
+    ranges = new;
+    }
+  if (bl_entry(s, &ranges[count]))
+    count++;
+  else
+    log_write(0, LOG_MAIN, "daemon_blocklist_file %s line %d: bad address \"%s\"",
+      daemon_blocklist_file, lineno, s);
+  }
+(void) fclose(f);
 
-/* Don't re-enable the handler here, since we aren't doing the
-waiting here. If the signal is re-enabled, there will just be an
-infinite sequence of calls to this handler. The SIGCHLD signal is
-used just as a means of waking up the daemon so that it notices
-terminated subprocesses as soon as possible.
+if (count > 0)
+  {
+  int n = 0;
 
-Argument: the signal number
-Returns:  nothing
-*/
+  qsort(ranges, count, sizeof(bl_range), bl_sort_cmp);
+  for (int i = 1; i < count; i++)
+    if (bl_cmp(ranges[i].lo, ranges[n].hi) <= 0)
+      {
+      if (bl_cmp(ranges[i].hi, ranges[n].hi) > 0)
+	memcpy(ranges[n].hi, ranges[i].hi, sizeof(ranges[n].hi));
+      }
+    else
+      ranges[++n] = ranges[i];
+  DEBUG(D_any) debug_printf("daemon blocklist: %d entries as %d ranges\n",
+    count, n + 1);
+  count = n + 1;
+  }
 
-static void
-main_sigchld_handler(int sig)
-{
-os_non_restarting_signal(SIGCHLD, SIG_DFL);
-sigchld_seen = TRUE;
+if (bl_ranges) store_free(bl_ranges);
+bl_ranges = ranges;
+bl_count = count;
+store_reset(reset_point);
 }
 
 
-/* SIGTERM handler.  Try to get the daemon pid file removed
-before exiting. */
+/* Check a client address against the list and the temporary entries,
+reading the file again first if it has changed. */
 
-static void
-main_sigterm_handler(int sig)
+static BOOL
+blocklist_match(const uschar * addr)
 {
-sigterm_seen = TRUE;
-}
+unsigned a[4];
+time_t now;
+int lo = 0, hi;
 
+if (!daemon_blocklist_file && bl_temps->count == 0) return FALSE;
 
+now = time(NULL);
+if (daemon_blocklist_file && now >= bl_next_check)
+  {
+  struct stat st;
+  bl_next_check = now + BLOCKLIST_RECHECK;
+  if (Ustat(daemon_blocklist_file, &st) == 0
+      ? st.st_mtime != bl_mtime : bl_mtime != 0)
+    blocklist_load();
+  }
 
+(void) bl_address(addr, a);
 
-/*************************************************
-*          Unexpected errors in SMTP calls       *
-*************************************************/
+for (hi = bl_count; lo < hi; )
+  {
+  int mid = (lo + hi) / 2;
+  if (bl_cmp(bl_ranges[mid].lo, a) <= 0) lo = mid + 1; else hi = mid;
+  }
+if (lo > 0 && bl_cmp(a, bl_ranges[lo - 1].hi) <= 0)
+  return TRUE;
 
-/* This function just saves a bit of repetitious coding.
+for (int i = 0; i < bl_temps->count && i < BLOCKLIST_TEMP_MAX; i++)
+  if (bl_temps->e[i].expire <= now)
+    {
+    if (acceptor_index == 0)
+      bl_temps->e[i--] = bl_temps->e[--bl_temps->count];
+    }
+  else if (bl_cmp(a, bl_temps->e[i].addr) == 0)
+    return TRUE;
+return FALSE;
+}
 
-Arguments:
-  log_msg        Text of message to be logged
-  smtp_msg       Text of SMTP error message
-  was_errno      The failing errno
 
-Returns:         nothing
-*/
+/* Notification from a reception process: "+<seconds> <address>" */
 
 static void
-never_error(uschar *log_msg, uschar *smtp_msg, int was_errno)
+blocklist_at_daemon(const uschar * buf)
 {
-uschar *emsg = was_errno <= 0
-  ? US"" : string_sprintf(": %s", strerror(was_errno));
-log_write(0, LOG_MAIN|LOG_PANIC, "%s%s", log_msg, emsg);
-if (smtp_out) smtp_printf("421 %s\r\n", SP_NO_MORE, smtp_msg);
-}
+time_t expire;
+unsigned a[4];
+int secs, n = 0, slot;
+
+if (*buf++ != '+' || sscanf(CCS buf, "%d %n", &secs, &n) < 1 || !n
+   || secs <= 0 || !string_is_ip_address(buf + n, NULL))
+  {
+  DEBUG(D_any) debug_printf("bad daemon blocklist notification\n");
+  return;
+  }
+(void) bl_address(buf + n, a);
+expire = time(NULL) + secs;
 
+for (slot = 0; slot < bl_temps->count; slot++)
+  if (bl_cmp(a, bl_temps->e[slot].addr) == 0) break;
 
+if (slot >= BLOCKLIST_TEMP_MAX)
+  {
+  slot = 0;
+  for (int i = 1; i < bl_temps->count; i++)
+    if (bl_temps->e[i].expire < bl_temps->e[slot].expire) slot = i;
+  }
 
+/* Make the entry before counting it, so that an acceptor never looks at one
+half made */
 
-/*************************************************
-*************************************************/
+bl_temps->e[slot].expire = 0;
+memcpy(bl_temps->e[slot].addr, a, sizeof(a));
+bl_temps->e[slot].expire = expire;
+if (slot == bl_temps->count) bl_temps->count++;
+DEBUG(D_any) debug_printf("daemon blocklist: %s added for %ds\n", buf + n, secs);
+}
+
+
+/* With several acceptors, move the temporary entries to anonymous memory
+mapped shared, before the acceptors are forked. If it cannot be set up, the
+entries apply only to calls taken by the main daemon. */
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+# define MAP_ANONYMOUS MAP_ANON
+#endif
 
 static void
-unlink_notifier_socket(void)
+blocklist_share(void)
 {
-#ifndef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
-DEBUG(D_any) debug_printf("unlinking notifier socket %s\n", notifier_socket_name);
-Uunlink(notifier_socket_name);
+#ifdef MAP_ANONYMOUS
+void * map = mmap(NULL, sizeof(bl_temp_table), PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+if (map == MAP_FAILED)
+  log_write(0, LOG_MAIN|LOG_PANIC, "daemon: failed to set up shared "
+    "blocklist: %s; temporary entries will not apply to acceptors",
+    strerror(errno));
+else
+  {
+  memcpy(map, bl_temps, sizeof(bl_temp_table));
+  bl_temps = map;
+  }
+#else
+log_write(0, LOG_MAIN, "daemon: no anonymous shared memory; temporary "
+  "blocklist entries will not apply to acceptors");
 #endif
 }
 
 
-static void
-close_daemon_sockets(int daemon_notifier_fd,
-  struct pollfd * fd_polls, int listen_socket_count)
+/* Called from an ACL control, in a reception process, to have the daemon
+refuse calls from an address for a time. */
+
+void
+daemon_blocklist_add(const uschar * addr, int secs)
 {
-if (daemon_notifier_fd >= 0)
+uschar buf[64];
+int fd, len = snprintf(CS buf, sizeof(buf), "%c+%d %s",
+			NOTIFY_BLOCKLIST, secs, addr);
+
+if ((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) >= 0)
   {
-  (void) close(daemon_notifier_fd);
-  daemon_notifier_fd = -1;
-  }
+  struct sockaddr_un sa_un = {.sun_family = AF_UNIX};
+  ssize_t slen = daemon_notifier_sockname(&sa_un);
 
-for (int i = 0; i < listen_socket_count; i++) (void) close(fd_polls[i].fd);
+  if (sendto(fd, buf, len, 0, (struct sockaddr *)&sa_un, (socklen_t)slen) < 0)
+    DEBUG(D_any) debug_printf("%s: sendto %s\n", __FUNCTION__, strerror(errno));
+  close(fd);
+  }
+else DEBUG(D_any) debug_printf(" socket: %s\n", strerror(errno));
 }
 
 
+
 /*************************************************
 *            Handle a connected SMTP call        *
 *************************************************/
@@ -191,6 +1381,8 @@ int dup_accept_socket = -1;
 int max_for_this_host = 0;
 int save_log_selector = *log_selector;
 gstring * whofrom;
+smtp_slot * slot = NULL;
+BOOL slots_locked = FALSE;
 
 rmark reset_point = store_mark();
 
@@ -254,10 +1446,41 @@ if (LOGGING(incoming_interface))
   whofrom = string_fmt_append(whofrom, " I=[%s]:%d",
     interface_address, interface_port);
 
+/* In a spare process, the daemon has done the checks and the counting, and
+this is the process for the connection. */
+
+if (spare_process)
+  {
+  pid = 0;
+  goto PASSED_ON;
+  }
+
+/* Refuse a call from an address on the daemon blocklist straight away, neither
+counting it nor forking. */
+
+if (blocklist_match(sender_host_address))
+  {
+  DEBUG(D_any) debug_printf("rejecting SMTP connection: in daemon blocklist\n");
+  if (!daemon_blocklist_silent)
+    smtp_printf("554 SMTP service not available\r\n", SP_NO_MORE);
+  log_write(L_connection_reject,
+            LOG_MAIN, "Connection from %Y refused: in daemon blocklist",
+    whofrom);
+  if (metrics) metrics_connection(FALSE);
+  goto ERROR_RETURN;
+  }
+
+/* Have the reception process inherit up-to-date local DNS list zones */
+
+dnsbl_zones_check();
+
 /* Check maximum number of connections. We do not check for reserved
 connections or unacceptable hosts here. That is done in the subprocess because
-it might take some time. */
+it might take some time. If other acceptor processes share the table of
+connections, hold it locked until this one has been counted in. */
 
+smtp_slots_lock(TRUE);
+slots_locked = TRUE;
 if (smtp_accept_max > 0 && smtp_accept_count >= smtp_accept_max)
   {
   DEBUG(D_any) debug_printf("rejecting SMTP connection: count=%d max=%d\n",
@@ -267,6 +1490,7 @@ if (smtp_accept_max > 0 && smtp_accept_count >= smtp_accept_max)
   log_write(L_connection_reject,
             LOG_MAIN, "Connection from %Y refused: too many connections",
     whofrom);
+  if (metrics) metrics_connection(FALSE);
   goto ERROR_RETURN;
   }
 
@@ -286,6 +1510,7 @@ if (smtp_load_reserve >= 0)
     log_write(L_connection_reject,
               LOG_MAIN, "Connection from %Y refused: load average = %.2f",
       whofrom, (double)load_average/1000.0);
+    if (metrics) metrics_connection(FALSE);
     goto ERROR_RETURN;
     }
   }
@@ -319,31 +1544,14 @@ if (smtp_accept_max_per_host)
     }
   }
 
-/* If we have fewer connections than max_for_this_host, we can skip the tedious
-per host_address checks. Note that at this stage smtp_accept_count contains the
+/* If we have fewer connections than max_for_this_host, we can skip the
+per host_address check. Note that at this stage smtp_accept_count contains the
 count of *other* connections, not including this one. */
 
-if (max_for_this_host > 0 && smtp_accept_count >= max_for_this_host)
+if (  max_for_this_host > 0 && smtp_accept_count >= max_for_this_host
+   && smtp_slots)
   {
-  int host_accept_count = 0;
-  int other_host_count = 0;    /* keep a count of non matches to optimise */
-
-  for (int i = 0; i < smtp_accept_max; ++i)
-    if (smtp_slots[i].host_address)
-      {
-      if (Ustrcmp(sender_host_address, smtp_slots[i].host_address) == 0)
-       host_accept_count++;
-      else
-       other_host_count++;
-
-      /* Testing all these strings is expensive - see if we can drop out
-      early, either by hitting the target, or finding there are not enough
-      connections left to make the target. */
-
-      if (  host_accept_count >= max_for_this_host
-         || smtp_accept_count - other_host_count < max_for_this_host)
-       break;
-      }
+  int host_accept_count = smtp_host_find(sender_host_address)->count;
 
   if (host_accept_count >= max_for_this_host)
     {
@@ -356,19 +1564,47 @@ if (max_for_this_host > 0 && smtp_accept_count >= max_for_this_host)
               LOG_MAIN, "Connection from %Y refused: too many connections "
       "from that IP address", whofrom);
     search_tidyup();
+    if (metrics) metrics_connection(FALSE);
     goto ERROR_RETURN;
     }
   }
 
-/* OK, the connection count checks have been passed.
-Now we can fork the accepting process; do a lookup tidy, just in case any
-expansion above did a lookup. */
+/* OK, the connection count checks have been passed. Claim a slot for the new
+process before the fork, so that the count is right for any other acceptor.
+Connection closes come asynchronously, so the address is copied into the slot
+rather than held in stacked store. */
+
+if (smtp_slots && smtp_slots_ix->free_count > 0)
+  {
+  slot = smtp_slots + smtp_free_slots[--smtp_slots_ix->free_count];
+  slot->pid = -1;
+  slot->acceptor = getpid();
+  if (smtp_accept_max_per_host)
+    {
+    string_format_nt(slot->host_address, sizeof(slot->host_address),
+      "%s", sender_host_address);
+    smtp_host_count_up(slot->host_address);
+    }
+  smtp_accept_count++;
+  }
+smtp_slots_lock(FALSE);
+slots_locked = FALSE;
+
+/* Now we can fork the accepting process, or pass the connection to one that
+was forked earlier; do a lookup tidy, just in case any expansion above did a
+lookup. */
 
 search_tidyup();
-pid = exim_fork(US"daemon-accept");
+if ((pid = daemon_spare_pass(accept_socket,
+		slot ? smtp_accept_count : smtp_accept_count + 1)) < 0)
+  {
+  smtp_cpu_turn++;
+  pid = exim_fork(US"daemon-accept");
+  }
 
 /* Handle the child process */
 
+PASSED_ON:
 if (pid == 0)
   {
   int queue_only_reason = 0;
@@ -380,8 +1616,10 @@ if (pid == 0)
   struct sigaction act;
 #endif
 
-  smtp_accept_count++;    /* So that it includes this process */
+  if (!slot && !spare_process)
+    smtp_accept_count++;    /* So that it includes this process */
   connection_id = getpid();
+  if (!spare_process) daemon_cpus_smtp();	/* a spare was pinned already */
 
   /* Log the connection if requested.
   In order to minimize the cost (because this is going to happen for every
@@ -467,6 +1705,7 @@ if (pid == 0)
   explanation of this logic. */
 
   close_daemon_sockets(daemon_notifier_fd, fd_polls, listen_socket_count);
+  daemon_notifier_fd = -1;
 
   /* Set FD_CLOEXEC on the SMTP socket. We don't want any rogue child processes
   to be able to communicate with them, under any circumstances. */
@@ -659,7 +1898,10 @@ if (pid == 0)
       }
 
     /* Log the queueing here, when it will get a message id attached, but
-    not if queue_only is set (case 0). */
+    not if queue_only is set (case 0). A lazy message log is created now, as
+    there will be no delivery process to do it. */
+
+    if (local_queue_only) receive_msglog_write();
 
     if (local_queue_only) switch(queue_only_reason)
       {
@@ -736,6 +1978,7 @@ if (pid == 0)
       else
 	{
 	cancel_cutthrough_connection(TRUE, US"delivery fork failed");
+	receive_msglog_write();
         log_write(0, LOG_MAIN|LOG_PANIC, "daemon: delivery process fork "
           "failed: %s", strerror(errno));
 	}
@@ -745,23 +1988,25 @@ if (pid == 0)
 
 
 /* Carrying on in the parent daemon process... Can't do much if the fork
-failed. Otherwise, keep count of the number of accepting processes and
-remember the pid for ticking off when the child completes. */
+failed, except give back the slot. Otherwise, remember the pid (of the new
+process or of the spare) in the slot for ticking off when the child
+completes. */
 
 if (pid < 0)
+  {
   never_error(US"daemon: accept process fork failed", US"Fork failed", errno);
+  if (slot) (void) smtp_slots_free(-1, FALSE);
+  }
 else
   {
-  for (int i = 0; i < smtp_accept_max; ++i)
-    if (smtp_slots[i].pid <= 0)
-      {
-      smtp_slots[i].pid = pid;
-      /* Connection closes come asyncronously, so we cannot stack this store */
-      if (smtp_accept_max_per_host)
-        smtp_slots[i].host_address = string_copy_malloc(sender_host_address);
-      smtp_accept_count++;
-      break;
-      }
+  if (slot)
+    {
+    smtp_slots_lock(TRUE);
+    slot->pid = pid;
+    smtp_pid_link(slot - smtp_slots);
+    smtp_slots_lock(FALSE);
+    }
+  if (metrics) metrics_connection(TRUE);
   DEBUG(D_any) debug_printf("%d SMTP accept process%s running\n",
     smtp_accept_count, smtp_accept_count == 1 ? "" : "es");
   }
@@ -769,6 +2014,7 @@ else
 /* Get here via goto in error cases */
 
 ERROR_RETURN:
+if (slots_locked) smtp_slots_lock(FALSE);
 
 /* Close the streams associated with the socket which will also close the
 socket fds in this process. We can't do anything if fclose() fails, but
@@ -807,6 +2053,303 @@ store_reset(reset_point);
 
 
 
+/*************************************************
+*       Run as a spare reception process         *
+*************************************************/
+
+/* A spare is forked before there is a connection for it, so that the fork is
+not on the path between accepting a call and sending the banner. It waits for
+the daemon to pass it an accepted socket, and then carries on just like a
+process forked for the call. It handles only the one call - a reception
+process is not set up to be reused - and it exits if the daemon closes its
+end of the socketpair instead.
+
+Arguments:
+  fd                    the spare's end of its socketpair
+  fd_polls              the daemon's listening sockets, which are closed
+  listen_socket_count   the number of them
+
+Returns:                does not return
+*/
+
+static void
+daemon_spare_wait(int fd, struct pollfd * fd_polls, int listen_socket_count)
+{
+spare_msg m;
+struct iovec iov = { .iov_base = &m, .iov_len = sizeof(m) };
+union {
+  struct cmsghdr hdr;
+  char buf[CMSG_SPACE(sizeof(int))];
+} cmsgbuf;
+struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+		      .msg_control = cmsgbuf.buf,
+		      .msg_controllen = sizeof(cmsgbuf.buf) };
+struct cmsghdr * cp;
+union sockaddr_46 accepted;
+EXIM_SOCKLEN_T alen = sizeof(accepted);
+int sock = -1;
+ssize_t n;
+
+/* Shed the daemon's sockets now, and clear the record of them, as their
+numbers may be reused by the call's socket. */
+
+close_daemon_sockets(daemon_notifier_fd, fd_polls, listen_socket_count);
+daemon_notifier_fd = -1;
+acceptor_fds = NULL;
+spares = NULL;
+
+ALARM_CLR(0);
+signal(SIGHUP, SIG_DFL);
+signal(SIGTERM, SIG_DFL);
+signal(SIGINT, SIG_DFL);
+set_process_info("daemon(%s): spare, waiting for a connection",
+  version_string);
+
+while ((n = recvmsg(fd, &msg, 0)) < 0 && errno == EINTR) ;
+if (  n == sizeof(m)
+   && (cp = CMSG_FIRSTHDR(&msg))
+   && cp->cmsg_level == SOL_SOCKET && cp->cmsg_type == SCM_RIGHTS)
+  memcpy(&sock, CMSG_DATA(cp), sizeof(int));
+(void) close(fd);
+
+if (sock < 0)
+  {
+  DEBUG(D_any) debug_printf("spare process %d: no connection passed\n",
+    (int)getpid());
+  exim_underbar_exit(EXIT_SUCCESS);
+  }
+
+/* Pick up where the daemon left the call. If the client has already gone,
+there is nothing to do. */
+
+if (getpeername(sock, (struct sockaddr *)&accepted, &alen) < 0)
+  {
+  DEBUG(D_any) debug_printf("spare process %d: getpeername: %s\n",
+    (int)getpid(), strerror(errno));
+  exim_underbar_exit(EXIT_SUCCESS);
+  }
+
+smtp_accept_count = m.accept_count;
+smtp_listen_backlog = m.listen_backlog;
+spare_process = TRUE;
+handle_smtp_call(fd_polls, 0, sock, (struct sockaddr *)&accepted);
+exim_underbar_exit(EXIT_SUCCESS);
+}
+
+
+/* Fork spares for any empty slots. Called from the main loop; each new spare
+goes off to wait for a call. */
+
+static void
+daemon_spares_start(struct pollfd * fd_polls, int listen_socket_count)
+{
+spares_missing = FALSE;
+for (int i = 0; i < smtp_accept_spares; i++) if (spares[i].pid == 0)
+  {
+  int sv[2];
+  pid_t pid;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    {
+    log_write(0, LOG_MAIN|LOG_PANIC, "daemon: socketpair for spare process "
+      "failed: %s", strerror(errno));
+    spares_missing = TRUE;		/* try again next time round */
+    return;
+    }
+  smtp_cpu_turn++;
+  if ((pid = exim_fork(US"daemon-spare")) == 0)
+    {
+    (void) close(sv[0]);
+    daemon_cpus_smtp();
+    daemon_spare_wait(sv[1], fd_polls, listen_socket_count);
+    }
+
+  (void) close(sv[1]);
+  if (pid < 0)
+    {
+    log_write(0, LOG_MAIN|LOG_PANIC, "daemon: fork of spare process "
+      "failed: %s", strerror(errno));
+    (void) close(sv[0]);
+    spares_missing = TRUE;
+    return;
+    }
+  DEBUG(D_any) debug_printf("started spare process %d\n", (int)pid);
+  spares[i] = (spare_slot) { .pid = pid, .fd = sv[0], .started = time(NULL) };
+  }
+}
+
+
+/* Let idle spares go, either all of them or just those past their age. Closing
+the socketpair makes a spare exit; the slots are refilled from the main loop
+unless the daemon itself is going.
+
+Argument:   TRUE for all the spares
+Returns:    milliseconds until the next one is due to go, or -1 for none
+*/
+
+static int
+daemon_spares_tick(BOOL all)
+{
+time_t now = time(NULL), next = 0;
+
+if (!spares) return -1;
+for (int i = 0; i < smtp_accept_spares; i++) if (spares[i].pid > 0)
+  {
+  time_t expires = spares[i].started + SPARE_MAX_AGE;
+
+  if (all || now >= expires)
+    {
+    DEBUG(D_any) debug_printf("releasing spare process %d\n",
+      (int)spares[i].pid);
+    (void) close(spares[i].fd);
+    spares[i].pid = 0;
+    spares_missing = TRUE;
+    }
+  else if (!next || expires < next)
+    next = expires;
+  }
+
+return next ? (int)(next - now) * 1000 : -1;
+}
+
+
+
+
+/*************************************************
+*       Hold calls before the banner             *
+*************************************************/
+
+/* With smtp_accept_hold set, an accepted call is kept in the daemon's poll
+set, without a process of its own, until the hold time has passed; then it
+goes to handle_smtp_call() as if just accepted. A client that closes the
+connection in that time costs no process at all, nor does one that talks
+before the banner, unless pipe_connect is advertised to anyone: then it is
+handed over at once, for the reception process to decide. Calls on a
+TLS-on-connect port are not held, since the client speaks first there.
+
+Returns:    TRUE if the call is now held
+*/
+
+static BOOL
+daemon_hold_call(int fd, struct sockaddr * accepted, EXIM_SOCKLEN_T alen)
+{
+union sockaddr_46 local;
+EXIM_SOCKLEN_T llen = sizeof(local);
+int port;
+held_call * h;
+rmark reset_point;
+
+if (!held_calls || held_count >= ACCEPT_HOLD_MAX || tls_in.on_connect)
+  return FALSE;
+if (getsockname(fd, (struct sockaddr *)&local, &llen) < 0) return FALSE;
+reset_point = store_mark();
+(void) host_ntoa(-1, &local, NULL, &port);
+store_reset(reset_point);
+if (host_is_tls_on_connect_port(port)) return FALSE;
+
+h = held_calls + held_count++;
+h->fd = fd;
+h->until = time(NULL) + smtp_accept_hold;
+memcpy(&h->addr, accepted, alen < sizeof(h->addr) ? alen : sizeof(h->addr));
+DEBUG(D_any) debug_printf("holding call on fd %d for %ds\n",
+  fd, smtp_accept_hold);
+return TRUE;
+}
+
+
+/* Set up the poll entries for the held calls, which follow the daemon's own
+ones. Returns the milliseconds until the first hold ends, or -1 if none. */
+
+static int
+daemon_held_polls(struct pollfd * p)
+{
+time_t now = time(NULL), next = 0;
+
+for (int i = 0; i < held_count; i++, p++)
+  {
+  p->fd = held_calls[i].fd;
+  p->events = POLLIN;
+  p->revents = 0;
+  if (!next || held_calls[i].until < next) next = held_calls[i].until;
+  }
+return !held_count ? -1 : next > now ? (int)(next - now) * 1000 : 0;
+}
+
+
+/* Deal with the held calls after a poll: drop those that closed or talked
+too early, and hand over those whose hold is over. The entry is removed before
+the handover so that the reception process does not close its own socket.
+
+Arguments:
+  p                     the poll entries set up by daemon_held_polls()
+  fd_polls              the daemon's listening sockets
+  listen_socket_count   the number of them
+
+Returns:                the number of poll entries that were ready
+*/
+
+static int
+daemon_held_tick(struct pollfd * p, struct pollfd * fd_polls,
+  int listen_socket_count)
+{
+time_t now = time(NULL);
+int ready = 0;
+BOOL logged = FALSE;
+
+for (int i = held_count - 1; i >= 0; i--)
+  {
+  held_call h = held_calls[i];
+  short revents = p[i].revents;
+
+  if (!revents && now < h.until) continue;
+  if (revents) ready++;
+
+  held_calls[i] = held_calls[--held_count];
+  p[i] = p[held_count];
+
+  if (revents)
+    {
+    uschar buf[128];
+    int n = recv(h.fd, buf, sizeof(buf), MSG_PEEK|MSG_DONTWAIT);
+
+    if (n <= 0)
+      {
+      DEBUG(D_any) debug_printf("held call on fd %d closed\n", h.fd);
+      (void) close(h.fd);
+      continue;
+      }
+#ifndef DISABLE_PIPE_CONNECT
+    if (!pipe_connect_advertise_hosts || !*pipe_connect_advertise_hosts)
+#endif
+      {
+      static const char resp[] = "554 SMTP synchronization error\r\n";
+      rmark reset_point = store_mark();
+
+      log_write(0, LOG_MAIN|LOG_REJECT, "SMTP protocol "
+	"synchronization error (input sent without waiting for greeting): "
+	"rejected connection from H=[%s] input=\"%s\"",
+	host_ntoa(-1, &h.addr, NULL, NULL),
+	string_printing(string_copyn(buf, n)));
+      store_reset(reset_point);
+      logged = TRUE;
+      (void)write(h.fd, resp, sizeof(resp) - 1);
+      (void) close(h.fd);
+      if (metrics) metrics_connection(FALSE);
+      continue;
+      }
+    }
+
+  handle_smtp_call(fd_polls, listen_socket_count, h.fd,
+    (struct sockaddr *)&h.addr);
+  }
+
+if (logged) log_close_all();
+return ready;
+}
+
+
+
+
 /*************************************************
 *       Check wildcard listen special cases      *
 *************************************************/
@@ -855,18 +2398,86 @@ if (back)
     }
   }
 
-/* For the "forward" case, if the current address is a wildcard IPv6 address,
-we seek a following wildcard IPv4 address on the same port. */
+/* For the "forward" case, if the current address is a wildcard IPv6 address,
+we seek a following wildcard IPv4 address on the same port. */
+
+else
+  {
+  if (ipa->address[0] != ':' || ipa->address[1] != 0) return FALSE;
+  for (ipa2 = ipa->next; ipa2 != NULL; ipa2 = ipa2->next)
+    if (ipa2->address[0] == 0 && ipa->port == ipa2->port) return TRUE;
+  }
+
+return FALSE;
+}
+
+
+
+#ifdef SO_REUSEPORT
+/*************************************************
+*       Duplicate a listening socket             *
+*************************************************/
+
+/* For an extra acceptor process, make another socket bound to the same
+address as an existing listening one. SO_REUSEPORT, which was set on the
+original before it was bound, has the kernel share incoming connections out
+between them. The setup otherwise follows that of the original.
+
+Argument:   the existing listening socket
+Returns:    the new socket; failures are fatal
+*/
 
-else
+static int
+daemon_listener_clone(int fd)
+{
+union sockaddr_46 sa;
+EXIM_SOCKLEN_T salen = sizeof(sa);
+const uschar * where;
+int nfd, af;
+
+if (getsockname(fd, (struct sockaddr *)&sa, &salen) < 0)
+  { where = US"getsockname"; goto bad; }
+af = sa.v4.sin_family;
+if ((nfd = ip_socket(SOCK_STREAM, af)) < 0)
+  { where = US"socket"; goto bad; }
+
+#ifdef IPV6_V6ONLY
+if (af == AF_INET6)
   {
-  if (ipa->address[0] != ':' || ipa->address[1] != 0) return FALSE;
-  for (ipa2 = ipa->next; ipa2 != NULL; ipa2 = ipa2->next)
-    if (ipa2->address[0] == 0 && ipa->port == ipa2->port) return TRUE;
+  int v6only = 0;
+  EXIM_SOCKLEN_T len = sizeof(v6only);
+  if (getsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, &len) == 0 && v6only)
+    (void) setsockopt(nfd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on));
   }
+#endif
 
-return FALSE;
+if (  setsockopt(nfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0
+   || setsockopt(nfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+  { where = US"setsockopt"; goto bad; }
+if (tcp_nodelay) setsockopt(nfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+if (bind(nfd, (struct sockaddr *)&sa, salen) < 0)
+  { where = US"bind"; goto bad; }
+
+#if defined(TCP_FASTOPEN) && !defined(__APPLE__)
+if (f.tcp_fastopen_ok)
+  (void) setsockopt(nfd, IPPROTO_TCP, TCP_FASTOPEN,
+		&smtp_connect_backlog, sizeof(smtp_connect_backlog));
+#endif
+if (listen(nfd, smtp_connect_backlog) < 0)
+  { where = US"listen"; goto bad; }
+#if defined(TCP_FASTOPEN) && defined(__APPLE__)
+if (f.tcp_fastopen_ok)
+  (void) setsockopt(nfd, IPPROTO_TCP, TCP_FASTOPEN, &on, sizeof(on));
+#endif
+return nfd;
+
+bad:
+  log_write(0, LOG_MAIN|LOG_PANIC_DIE, "daemon: %s() failed for acceptor "
+    "listening socket: %s", where, strerror(errno));
+  return -1;
 }
+#endif	/*SO_REUSEPORT*/
 
 
 
@@ -904,24 +2515,55 @@ while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
 #endif
     }
 
+  /* A lookup proxy helper gets restarted from the main loop */
+
+  if (lookup_proxy_reaped(pid)) continue;
+
+  /* The check of a new configuration is dealt with at the end of the main
+  loop */
+
+  if (daemon_config_check_reaped(pid, status)) continue;
+
+  /* A finished rebuild of the queue index gets loaded */
+
+  if (queue_index_reaped(pid, status)) continue;
+
   /* If it's a listening daemon for which we are keeping track of individual
   subprocesses, deal with an accepting process that has terminated. */
 
-  if (smtp_slots)
+  if (smtp_slots_free(pid, FALSE)) continue;  /* Found an accepting process */
+
+  /* A spare that was still waiting needs replacing */
+
+  if (spares)
     {
     int i;
-    for (i = 0; i < smtp_accept_max; i++)
-      if (smtp_slots[i].pid == pid)
-        {
-        if (smtp_slots[i].host_address)
-          store_free(smtp_slots[i].host_address);
-        smtp_slots[i] = empty_smtp_slot;
-        if (--smtp_accept_count < 0) smtp_accept_count = 0;
-        DEBUG(D_any) debug_printf("%d SMTP accept process%s now running\n",
-          smtp_accept_count, (smtp_accept_count == 1)? "" : "es");
-        break;
-        }
-    if (i < smtp_accept_max) continue;  /* Found an accepting process */
+    for (i = 0; i < smtp_accept_spares; i++)
+      if (spares[i].pid == pid)
+	{
+	(void) close(spares[i].fd);
+	spares[i].pid = 0;
+	spares_missing = TRUE;
+	break;
+	}
+    if (i < smtp_accept_spares) continue;
+    }
+
+  /* An acceptor process needs restarting, unless it was one we told to go.
+  Either way, drop any connections it was unable to tick off. */
+
+  if (acceptor_pids)
+    {
+    for (int i = 1; i < daemon_acceptors; i++)
+      if (acceptor_pids[i] == pid)
+	{
+	log_write(0, LOG_MAIN|LOG_PANIC, "daemon acceptor %d (pid %d) ended "
+	  "unexpectedly: status=0x%x", i, (int)pid, status);
+	acceptor_pids[i] = 0;
+	acceptors_missing = TRUE;
+	break;
+	}
+    if (smtp_slots_free(pid, TRUE)) continue;
     }
 
   /* If it wasn't an accepting process, see if it was a queue-runner
@@ -1105,6 +2747,158 @@ exim_exit(EXIT_SUCCESS);
 }
 
 
+/*************************************************
+*          Start any missing acceptors           *
+*************************************************/
+
+/* Called from the main daemon loop. An extra acceptor is a copy of the daemon
+that listens on its own set of SO_REUSEPORT sockets, counting its connections
+in the shared table, and leaves everything else (queue runs, the notifier
+socket and the periodic housekeeping) to the main daemon.
+
+Arguments:
+  fd_polls              the main daemon's listening sockets; in a new acceptor
+                          they are replaced by its own set
+  listen_socket_count   the number of sockets in a set
+
+Returns:                TRUE in a new acceptor process, FALSE in the daemon
+*/
+
+static BOOL
+daemon_acceptors_start(struct pollfd * fd_polls, int listen_socket_count)
+{
+acceptors_missing = FALSE;
+for (int i = 1; i < daemon_acceptors; i++) if (acceptor_pids[i] == 0)
+  {
+  pid_t pid = exim_fork(US"daemon-acceptor");
+
+  if (pid < 0)
+    {
+    log_write(0, LOG_MAIN|LOG_PANIC, "daemon: fork of acceptor %d failed: %s",
+      i, strerror(errno));
+    acceptors_missing = TRUE;		/* try again next time round */
+    continue;
+    }
+  if (pid > 0)
+    {
+    DEBUG(D_any) debug_printf("started acceptor %d, pid %d\n", i, (int)pid);
+    acceptor_pids[i] = pid;
+    continue;
+    }
+
+  /* In the new acceptor, which is listening like the daemon (the fork
+  cleared that). Swap in its own listening sockets, and close those of the
+  others along with the rest of the daemon's sockets. */
+
+  f.daemon_listen = TRUE;
+
+  for (int sk = 0; sk < listen_socket_count; sk++)
+    (void) close(fd_polls[sk].fd);
+  for (int a = 1; a < daemon_acceptors; a++)
+    for (int sk = 0; sk < listen_socket_count; sk++)
+      {
+      int fd = acceptor_fds[(a-1) * listen_socket_count + sk];
+      if (a == i) fd_polls[sk].fd = fd; else (void) close(fd);
+      }
+  acceptor_fds = NULL;
+  acceptor_pids = NULL;
+  acceptor_index = i;
+  daemon_cpus_acceptor();
+
+  /* The daemon's spares are its own; this acceptor forks its own set */
+
+  if (spares)
+    {
+    for (int sp = 0; sp < smtp_accept_spares; sp++)
+      if (spares[sp].pid > 0)
+	{
+	(void) close(spares[sp].fd);
+	spares[sp].pid = 0;
+	}
+    spares_missing = TRUE;
+    }
+  daemon_held_close();
+
+  if (daemon_notifier_fd >= 0)
+    {
+    (void) close(daemon_notifier_fd);
+    daemon_notifier_fd = -1;
+    }
+#if !defined(DISABLE_TLS) && (defined(EXIM_HAVE_INOTIFY) || defined(EXIM_HAVE_KEVENT))
+  tls_watch_invalidate();
+#endif
+  lookup_proxy_close(FALSE);
+  smtp_pool_close();
+
+  ALARM_CLR(0);
+  sigalrm_seen = FALSE;
+  qrun_next_tick = 0;
+  signal(SIGHUP, SIG_IGN);
+  set_process_info("daemon(%s): acceptor %d, listening", version_string, i);
+  return TRUE;
+  }
+return FALSE;
+}
+
+
+/* Tell the acceptors to go.  They stop listening at once, but carry on until
+their reception processes have finished. If they are to be replaced, the new
+ones get started next time round the main loop. */
+
+static void
+daemon_acceptors_stop(BOOL restart)
+{
+if (!acceptor_pids) return;
+for (int i = 1; i < daemon_acceptors; i++)
+  if (acceptor_pids[i] > 0)
+    {
+    (void) kill(acceptor_pids[i], SIGTERM);
+    acceptor_pids[i] = 0;
+    }
+acceptors_missing = restart;
+}
+
+
+/* SIGTERM in an acceptor. Close the listening sockets, wait for the
+reception processes, and exit. Does not return. */
+
+static void
+acceptor_die(struct pollfd * fd_polls, int listen_socket_count)
+{
+pid_t pid;
+int status;
+
+DEBUG(D_any) debug_printf("acceptor %d: SIGTERM seen\n", acceptor_index);
+for (int sk = 0; sk < listen_socket_count; sk++)
+  (void) close(fd_polls[sk].fd);
+(void) daemon_spares_tick(TRUE);
+set_process_info("daemon(%s): acceptor %d, finishing", version_string,
+  acceptor_index);
+
+while ((pid = wait(&status)) > 0 || errno == EINTR)
+  if (pid > 0) (void) smtp_slots_free(pid, FALSE);
+exim_exit(EXIT_SUCCESS);
+}
+
+
+static void daemon_notification(void);
+
+/* Before the notifier socket is closed, handle whatever is still queued on
+it, so that log lines sent for log_via_daemon are not lost; then write out
+those gathered. */
+
+static void
+daemon_notifier_drain(void)
+{
+struct pollfd p = {.fd = daemon_notifier_fd, .events = POLLIN};
+
+if (log_via_daemon < 0 || daemon_notifier_fd < 0) return;
+for (int i = 0; i < 1000 && poll(&p, 1, 0) > 0; i++)
+  daemon_notification();
+log_daemon_flush(TRUE);
+}
+
+
 /* Called by the daemon; exec a child to get the pid file deleted
 since we may require privs for the containing directory */
 
@@ -1114,16 +2908,20 @@ daemon_die(void)
 int pid;
 
 DEBUG(D_any) debug_printf("SIGTERM/SIGINT seen\n");
+daemon_acceptors_stop(FALSE);
 #if !defined(DISABLE_TLS) && (defined(EXIM_HAVE_INOTIFY) || defined(EXIM_HAVE_KEVENT))
 tls_watch_invalidate();
 #endif
 
+daemon_notifier_drain();
 if (daemon_notifier_fd >= 0)
   {
   close(daemon_notifier_fd);
   daemon_notifier_fd = -1;
   unlink_notifier_socket();
   }
+lookup_proxy_close(TRUE);
+acl_ratelimit_close();
 
 if (f.running_in_test_harness || write_pid)
   {
@@ -1263,7 +3061,8 @@ and do the action.
 static void
 daemon_notification(void)
 {
-uschar buf[256], cbuf[256];
+static uschar buf[NOTIFY_MSG_MAX];
+uschar cbuf[256];
 struct sockaddr_un sa_un;
 struct iovec iov = {.iov_base = buf, .iov_len = sizeof(buf)-1};
 struct msghdr msg = { .msg_name = &sa_un,
@@ -1274,10 +3073,21 @@ struct msghdr msg = { .msg_name = &sa_un,
 		      .msg_controllen = sizeof(cbuf)
 		    };
 ssize_t sz;
+BOOL peer_priv = FALSE;		/* root or exim, by the credentials */
+int passed_fd = -1;		/* connection handed over, for the pool */
 
 buf[sizeof(buf)-1] = 0;
+#ifdef MSG_CMSG_CLOEXEC
+if ((sz = recvmsg(daemon_notifier_fd, &msg, MSG_CMSG_CLOEXEC)) <= 0) return;
+#else
 if ((sz = recvmsg(daemon_notifier_fd, &msg, 0)) <= 0) return;
-if (sz >= sizeof(buf)) return;
+#endif
+
+for (struct cmsghdr * cp = CMSG_FIRSTHDR(&msg); cp; cp = CMSG_NXTHDR(&msg, cp))
+  if (cp->cmsg_level == SOL_SOCKET && cp->cmsg_type == SCM_RIGHTS)
+    memcpy(&passed_fd, CMSG_DATA(cp), sizeof(int));
+
+if (sz >= sizeof(buf)) goto out;
 
 #ifdef notdef
 debug_printf("addrlen %d\n", msg.msg_namelen);
@@ -1321,6 +3131,7 @@ for (struct cmsghdr * cp = CMSG_FIRSTHDR(&msg);
     DEBUG(D_queue_run) debug_printf("%s: sender creds pid %d uid %d gid %d\n",
       __FUNCTION__, (int)cr->pid, (int)cr->uid, (int)cr->gid);
     }
+  else peer_priv = TRUE;
 # elif defined(LOCAL_CREDS)				/* BSD-ish */
   struct sockcred * cr = (struct sockcred *) CMSG_DATA(cp);
   if (cr->sc_uid && cr->sc_uid != exim_uid)
@@ -1328,6 +3139,7 @@ for (struct cmsghdr * cp = CMSG_FIRSTHDR(&msg);
     DEBUG(D_queue_run) debug_printf("%s: sender creds pid ??? uid %d gid %d\n",
       __FUNCTION__, (int)cr->sc_uid, (int)cr->sc_gid);
     }
+  else peer_priv = TRUE;
 # endif
   break;
   }
@@ -1350,13 +3162,17 @@ switch (buf[0])
 	  : !buf[1+MESSAGE_ID_LENGTH+1]
 	 )
 	{ queuerun_msg_qname = q->name; break; }
-    return;
+    break;
 #endif
 
   case NOTIFY_QUEUE_SIZE_REQ:
     {
     uschar buf[16];
-    int len = snprintf(CS buf, sizeof(buf), "%u", queue_count_cached());
+    unsigned count;
+    int len;
+
+    if (!queue_index_count(&count)) count = queue_count_cached();
+    len = snprintf(CS buf, sizeof(buf), "%u", count);
 
     DEBUG(D_queue_run)
       debug_printf("%s: queue size request: %s\n", __FUNCTION__, buf);
@@ -1371,7 +3187,101 @@ switch (buf[0])
   case NOTIFY_REGEX:
     regex_at_daemon(buf);
     break;
+
+  /* The queue index is changed, and read, only by Exim itself; it would let
+any user hide messages from queue runners, or list the queue.  Other requesters
+get an empty reply, so that they scan the spool at once. */
+
+  case NOTIFY_QUEUE_INDEX_ADD:
+  case NOTIFY_QUEUE_INDEX_DEL:
+    if (queue_index && peer_priv) queue_index_at_daemon(buf);
+    break;
+
+  case NOTIFY_QUEUE_INDEX_REQ:
+    if (!queue_index) break;
+    if (peer_priv)
+      queue_index_slice(daemon_notifier_fd, buf,
+		      (const struct sockaddr *)&sa_un, msg.msg_namelen);
+    else
+      (void) sendto(daemon_notifier_fd, "", 0, 0,
+		      (const struct sockaddr *)&sa_un, msg.msg_namelen);
+    break;
+
+  /* Log lines gathered for writing together */
+
+  case NOTIFY_LOG_WRITE:
+    if (log_via_daemon >= 0 && peer_priv)
+      log_at_daemon(buf, sz);
+    break;
+
+  /* Temporary entries for the daemon blocklist */
+
+  case NOTIFY_BLOCKLIST:
+    if (peer_priv) blocklist_at_daemon(buf+1);
+    break;
+
+  case NOTIFY_QUEUE_STATS:
+    if (!queue_index) break;
+    if (peer_priv)
+      queue_index_stats_at_daemon(daemon_notifier_fd, buf,
+		      (const struct sockaddr *)&sa_un, msg.msg_namelen);
+    else
+      (void) sendto(daemon_notifier_fd, "", 0, 0,
+		      (const struct sockaddr *)&sa_un, msg.msg_namelen);
+    break;
+
+#ifdef EXIM_HAVE_SYNCFS
+  case NOTIFY_SPOOL_SYNC:
+    if (peer_priv)
+      spool_sync_at_daemon((const struct sockaddr *)&sa_un, msg.msg_namelen);
+    break;
+#endif
+
+  /* The shared lookup cache holds data that only Exim itself may see or
+  change */
+
+  case NOTIFY_LOOKUP_GET:
+  case NOTIFY_LOOKUP_PUT:
+  case NOTIFY_LOOKUP_FLUSH:
+  case NOTIFY_LOOKUP_STATS:
+    if (  (  lookup_cache_shared || dns_cache_shared || host_health_used
+	  || auth_cache_used
+#ifndef DISABLE_PIPE_CONNECT
+	  || pipe_connect_used
+#endif
+#ifdef SUPPORT_SPF
+	  || spf_cache_ttl > 0
+#endif
+#if !defined(DISABLE_TLS) && !defined(DISABLE_TLS_RESUME)
+	  || tls_resumption_shared > 0
+#endif
+	  )
+       && peer_priv)
+      search_shared_at_daemon(daemon_notifier_fd, buf, sz,
+		      (const struct sockaddr *)&sa_un, msg.msg_namelen);
+    break;
+
+  /* Rates for ratelimit conditions */
+
+  case NOTIFY_RATELIMIT:
+    if (ratelimit_shared > 0 && peer_priv)
+      acl_ratelimit_at_daemon(daemon_notifier_fd, buf, sz,
+		      (const struct sockaddr *)&sa_un, msg.msg_namelen);
+    break;
+
+  /* Idle outbound connections, held for reuse */
+
+  case NOTIFY_POOL_PARK:
+  case NOTIFY_POOL_BORROW:
+    if (  peer_priv
+       && smtp_pool_at_daemon(daemon_notifier_fd, buf, sz, passed_fd,
+		      (const struct sockaddr *)&sa_un, msg.msg_namelen))
+      passed_fd = -1;
+    break;
   }
+
+out:
+if (passed_fd >= 0) (void) close(passed_fd);
 return;
 }
 
@@ -1412,6 +3322,28 @@ ALARM(resignal_interval);
 }
 
 
+/* The periodic queue runs are driven by a deadline that bounds the wait in
+the daemon loop, rather than by SIGALRM; an alarm set for anything else in the
+daemon would otherwise cancel it. Return the milliseconds until the next run
+is due, or -1 if there is none. */
+
+static int
+daemon_qrun_timeout(void)
+{
+time_t now;
+
+if (!qrun_next_tick) return -1;
+now = time(NULL);
+return qrun_next_tick > now ? (int)(qrun_next_tick - now) * 1000 : 0;
+}
+
+static BOOL
+daemon_qrun_due(void)
+{
+return qrun_next_tick && time(NULL) >= qrun_next_tick;
+}
+
+
 /* Re-sort the qrunners list, and return the shortest interval.
 That could be negatime.
 The next-tick times should have been updated by any runs initiated,
@@ -1464,11 +3396,11 @@ DEBUG(D_any) debug_printf("%s received\n",
 #ifndef DISABLE_QUEUE_RAMP
   *queuerun_msgid ? "qrun notification" :
 #endif
-  "SIGALRM");
+  "queue-run tick");
 
 /* Do a full queue run in a child process, if required, unless we already have
 enough queue runners on the go. If we are not running as root, a re-exec is
-required. In the calling process, restart the alamr timer for the next run.  */
+required. In the calling process, set the deadline for the next run.  */
 
 if (is_multiple_qrun())				/* we are managing periodic runs */
   if (local_queue_run_max <= 0 || queue_run_count < local_queue_run_max)
@@ -1490,11 +3422,26 @@ if (is_multiple_qrun())				/* we are managing periodic runs */
       }
     else
 #endif
-      /* Normal periodic runL in order of run priority, find the first queue
-      for which we can start a runner */
+      /* Normal periodic run.  Of the queues which are due and have room for
+      another runner, take the one with the fewest runners for its weight.
+      One that has been waiting for a runner for longer than its interval is
+      taken first, so that heavily-weighted queues cannot starve the others.
+      If none is due, take the first that has room. The list is in order of
+      next tick. */
 
-      for (q = qrunners; q; q = q->next)
-	if (q->run_count < q->run_max) break;
+      {
+      time_t now = time(NULL);
+      for (qrunner * qq = qrunners; qq; qq = qq->next)
+	if (qq->run_count < qq->run_max)
+	  {
+	  if (qq->next_tick > now)
+	    { if (!q) q = qq; break; }
+	  if (qq->interval && now - qq->next_tick >= qq->interval)
+	    { q = qq; break; }
+	  if (!q || qq->run_count * q->weight < q->run_count * qq->weight)
+	    q = qq;
+	  }
+      }
 
     if (q)					/* found a queue to run */
       {
@@ -1508,8 +3455,16 @@ if (is_multiple_qrun())				/* we are managing periodic runs */
 	do ; while ((q->next_tick += q->interval) <= now);
 	}
 
+      /* Bring the queue index up to date, so that a forked runner
+      inherits a usable one */
+
+      if (queue_index) queue_index_refresh(q->name);
+
+      qrun_cpu_turn++;
       if ((pid = exim_fork(US"queue-runner")) == 0)
 	{
+	daemon_cpus_qrun();
+
 	/* Disable debugging if it's required only for the daemon process. We
 	leave the above message, because it ties up with the "child ended"
 	debugging messages. */
@@ -1520,6 +3475,7 @@ if (is_multiple_qrun())				/* we are managing periodic runs */
 
 	close_daemon_sockets(daemon_notifier_fd,
 	  fd_polls, listen_socket_count);
+	daemon_notifier_fd = -1;
 
 	/* Reset SIGHUP and SIGCHLD in the child in both cases. */
 
@@ -1644,9 +3600,10 @@ else				/* periodic or one-time queue run */
   sigalrm_seen = FALSE;
   if (qrunners)			/* there are still periodic qrunners */
     {
-    ALARM(interval);		/* set up next qrun tick */
+    qrun_next_tick = time(NULL) + interval;	/* set up next qrun tick */
     return interval;
     }
+  qrun_next_tick = 0;
   }
 return 0;
 }
@@ -1701,14 +3658,17 @@ void
 daemon_go(void)
 {
 struct passwd * pw;
-struct pollfd * fd_polls, * tls_watch_poll = NULL, * dnotify_poll = NULL;
+struct pollfd * fd_polls, * dnotify_poll = NULL;
+#ifndef DISABLE_TLS
+struct pollfd * tls_watch_poll = NULL;
+#endif
 int listen_socket_count = 0, poll_fd_count;
 ip_address_item * addresses = NULL;
 time_t last_connection_time = (time_t)0;
 int local_queue_run_max = 0;
 
 if (is_multiple_qrun())
-
+  {
   /* Nuber of runner-tracking structs needed:  If the option queue_run_max has
   no expandable elements then it is the overall maximum; else we assume it
   depends on the queue name, and add them up to get the maximum.
@@ -1731,6 +3691,17 @@ if (is_multiple_qrun())
       q->run_max = local_queue_run_max;
     }
 
+  /* The weights only matter when the queues share an overall limit */
+
+  for (qrunner * q = qrunners; q; q = q->next)
+    {
+    int w;
+    queue_name = q->name;
+    q->weight = (w = atoi(CS expand_string(queue_run_weight))) > 0 ? w : 1;
+    }
+  queue_name = US"";
+  }
+
 process_purpose = US"daemon";
 
 /* If any debugging options are set, turn on the D_pid bit so that all
@@ -2077,11 +4048,15 @@ if (f.daemon_listen && !f.inetd_wait_mode)
 
   for (ipa = addresses; ipa; ipa = ipa->next)
     listen_socket_count++;
-  fd_polls = store_get(sizeof(struct pollfd) * (listen_socket_count + 2),
-			    GET_UNTAINTED);
+  /* Room for the ancillary sockets, and for any held calls after them */
+
+  fd_polls = store_get(sizeof(struct pollfd) * (listen_socket_count + 2
+	      + (smtp_accept_hold > 0 ? ACCEPT_HOLD_MAX : 0)), GET_UNTAINTED);
   for (struct pollfd * p = fd_polls; p < fd_polls + listen_socket_count + 2;
        p++)
     { p->fd = -1; p->events = POLLIN; }
+  if (smtp_accept_hold > 0)
+    held_calls = store_get(sizeof(held_call) * ACCEPT_HOLD_MAX, GET_UNTAINTED);
 
   } /* daemon_listen but not inetd_wait_mode */
 
@@ -2099,16 +4074,75 @@ if (f.daemon_listen)
 
   if (smtp_accept_queue > smtp_accept_max) smtp_accept_queue = 0;
 
-  /* Get somewhere to keep the list of SMTP accepting pids if we are keeping
-  track of them for total number and queue/host limits. */
+  /* Extra acceptor processes need SO_REUSEPORT, and are pointless when inetd
+  supplies the socket. */
 
-  if (smtp_accept_max > 0)
+  if (daemon_acceptors < 1 || f.inetd_wait_mode) daemon_acceptors = 1;
+#ifndef SO_REUSEPORT
+  if (daemon_acceptors > 1)
+    {
+    log_write(0, LOG_MAIN|LOG_PANIC,
+      "daemon_acceptors ignored: SO_REUSEPORT is not supported");
+    daemon_acceptors = 1;
+    }
+#endif
+
+  /* Spare reception processes get forked from the main loop */
+
+  if (smtp_accept_spares > 0 && !f.inetd_wait_mode)
     {
-    smtp_slots = store_get(smtp_accept_max * sizeof(smtp_slot), GET_UNTAINTED);
-    for (int i = 0; i < smtp_accept_max; i++) smtp_slots[i] = empty_smtp_slot;
+    spares = store_get(smtp_accept_spares * sizeof(spare_slot), GET_UNTAINTED);
+    memset(spares, 0, smtp_accept_spares * sizeof(spare_slot));
+    spares_missing = TRUE;
     }
+
+  /* Get somewhere to keep the list of SMTP accepting pids if we are keeping
+  track of them for total number and queue/host limits. With several
+  acceptors this is a file mapped shared, followed by the running total and
+  the index of the slots; it is unlinked at once, and the open file is used for
+  locking. */
+
+  if (smtp_accept_max > 0)
+    if (daemon_acceptors > 1)
+      {
+      uschar * fname = string_sprintf("%s/daemon-slots-%d", spool_directory,
+				      (int)getpid());
+      size_t size = smtp_slots_size(smtp_accept_max, NULL, NULL);
+      void * map = MAP_FAILED;
+
+      (void) Uunlink(fname);
+      if (  (smtp_slots_fd = Uopen(fname,
+		    EXIM_CLOEXEC | EXIM_NOFOLLOW | O_RDWR | O_CREAT | O_EXCL,
+		    SPOOL_MODE)) < 0
+	 || Uunlink(fname) < 0
+	 || ftruncate(smtp_slots_fd, size) < 0
+	 || (map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    smtp_slots_fd, 0)) == MAP_FAILED)
+	log_write(0, LOG_MAIN|LOG_PANIC_DIE, "daemon: failed to set up "
+	  "shared connection table %s: %s", fname, strerror(errno));
+      smtp_slots_init(map, smtp_accept_max);
+      }
+    else
+      {
+      size_t size = smtp_slots_size(smtp_accept_max, NULL, NULL);
+      void * mem = store_get(size, GET_UNTAINTED);
+      memset(mem, 0, size);
+      smtp_slots_init(mem, smtp_accept_max);
+      }
+
+  /* Temporary blocklist entries are added by the main daemon but must be seen
+  by all the acceptors */
+
+  if (daemon_acceptors > 1) blocklist_share();
   }
 
+/* Set up the table of counters for the metrics option, before any process
+that might count is forked. */
+
+metrics_init();
+daemon_load_init();
+daemon_cpus_init();
+
 /* The variable background_daemon is always false when debugging, but
 can also be forced false in order to keep a non-debugging daemon in the
 foreground. If background_daemon is true, close all open file descriptors that
@@ -2135,6 +4169,11 @@ if (f.background_daemon || f.inetd_wait_mode)
   log_stderr = NULL;  /* So no attempt to copy paniclog output */
   }
 
+/* After a re-exec for SIGHUP, take back the shared cache of the old daemon.
+This is before any fork, which would change the pid. */
+
+search_shared_restore(shared_cache_file());
+
 if (f.background_daemon)
   {
   /* If the parent process of this one has pid == 1, we are re-initializing the
@@ -2161,6 +4200,15 @@ if (f.background_daemon)
 the listening sockets if required. */
 
 daemon_notifier_socket();
+if (auth_cache_used) auth_cache_init();
+lookup_proxy_start();
+regex_prewarm();
+if (daemon_blocklist_file)
+  {
+  blocklist_load();
+  bl_next_check = time(NULL) + BLOCKLIST_RECHECK;
+  }
+dnsbl_zones_check();
 
 if (f.daemon_listen && !f.inetd_wait_mode)
   {
@@ -2221,6 +4269,16 @@ if (f.daemon_listen && !f.inetd_wait_mode)
       log_write(0, LOG_MAIN|LOG_PANIC_DIE, "setting SO_REUSEADDR on socket "
         "failed when starting daemon: %s", strerror(errno));
 
+    /* With extra acceptor processes, each gets its own copy of the socket,
+    bound to the same address. */
+
+#ifdef SO_REUSEPORT
+    if (  daemon_acceptors > 1
+       && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+      log_write(0, LOG_MAIN|LOG_PANIC_DIE, "setting SO_REUSEPORT on socket "
+        "failed when starting daemon: %s", strerror(errno));
+#endif
+
     /* Set TCP_NODELAY; Exim does its own buffering. There is a switch to
     disable this because it breaks some broken clients. */
 
@@ -2332,6 +4390,24 @@ if (f.daemon_listen && !f.inetd_wait_mode)
       ipa = ipa2;
       }
     }          /* End of bind/listen loop for each address */
+
+#ifdef SO_REUSEPORT
+  /* Make the copies of the sockets for the extra acceptors. They get started
+  from the main loop, and restarted from there if they die. */
+
+  if (daemon_acceptors > 1)
+    {
+    int n = (daemon_acceptors - 1) * listen_socket_count;
+
+    acceptor_fds = store_get(n * sizeof(int), GET_UNTAINTED);
+    for (int i = 0; i < n; i++)
+      acceptor_fds[i] = daemon_listener_clone(fd_polls[i % listen_socket_count].fd);
+    acceptor_pids = store_get(daemon_acceptors * sizeof(pid_t), GET_UNTAINTED);
+    memset(acceptor_pids, 0, daemon_acceptors * sizeof(pid_t));
+    acceptors_missing = TRUE;
+    DEBUG(D_any) debug_printf("%d acceptor processes\n", daemon_acceptors);
+    }
+#endif
   }            /* End of setup for listening */
 
 
@@ -2615,9 +4691,32 @@ report_time_since(&timestamp_startup, US"daemon loop start");	/* testcase 0022 *
 for (;;)
   {
   int nolisten_sleep = 60;
+  int spare_timeout;
+  BOOL reexec = FALSE;
 
   if (sigterm_seen)
-    daemon_die();	/* Does not return */
+    if (acceptor_index > 0)
+      acceptor_die(fd_polls, listen_socket_count);	/* Does not return */
+    else
+      daemon_die();	/* Does not return */
+
+  /* Start any extra acceptor processes that are not running. A new one
+  polls only its own listening sockets. */
+
+  if (acceptors_missing && daemon_acceptors_start(fd_polls, listen_socket_count))
+    {
+    poll_fd_count = listen_socket_count;
+#ifndef DISABLE_TLS
+    tls_watch_poll = NULL;
+#endif
+    dnotify_poll = NULL;
+    }
+
+  /* Replace any spare reception processes that have been used or are past
+  their age. */
+
+  spare_timeout = daemon_spares_tick(FALSE);
+  if (spares_missing) daemon_spares_start(fd_polls, listen_socket_count);
 
   /* This code is placed first in the loop, so that it gets obeyed at the
   start, before the first wait, for the queue-runner case, so that the first
@@ -2625,7 +4724,7 @@ for (;;)
 
   The other option is that we have an inetd wait timeout specified to -bw. */
 
-  if (sigalrm_seen || *queuerun_msgid)
+  if (sigalrm_seen || daemon_qrun_due() || *queuerun_msgid)
     if (inetd_wait_timeout > 0)
       daemon_inetd_wtimeout(last_connection_time);	/* Might not return */
     else
@@ -2646,6 +4745,7 @@ for (;;)
     {
     int lcount;
     BOOL select_failed = FALSE;
+    int held_timeout = daemon_held_polls(fd_polls + poll_fd_count);
 
     DEBUG(D_any) debug_printf("Listening...\n");
 
@@ -2656,15 +4756,63 @@ for (;;)
     only to do the reaping more quickly, it shouldn't result in anything other
     than a delay until something else causes a wake-up.
     For the normal case, wait for either a pollable fd (eg. new connection) or
-    or a SIGALRM (for a periodic queue run) */
+    the deadline for a periodic queue run */
 
     if (sigchld_seen)
       {
       lcount = -1;
       errno = EINTR;
       }
+    else if (acceptor_index > 0)
+      {
+      int timeout = log_daemon_timeout();
+
+      if (spare_timeout >= 0 && (timeout < 0 || spare_timeout < timeout))
+	timeout = spare_timeout;
+      if (held_timeout >= 0 && (timeout < 0 || held_timeout < timeout))
+	timeout = held_timeout;
+      lcount = poll(fd_polls, poll_fd_count + held_count, timeout);
+      }
     else
-      lcount = poll(fd_polls, poll_fd_count, -1);
+      {
+      int timeout = smtp_pool_timeout();
+      int qrun_timeout = daemon_qrun_timeout();
+      int rl_timeout = acl_ratelimit_timeout();
+      int hs_timeout = dbfn_shared_timeout();
+      int log_timeout = log_daemon_timeout();
+      int load_timeout = daemon_load_tick();
+      int cc_timeout = daemon_config_check_timeout();
+
+      if (spare_timeout >= 0 && (timeout < 0 || spare_timeout < timeout))
+	timeout = spare_timeout;
+      if (load_timeout >= 0 && (timeout < 0 || load_timeout < timeout))
+	timeout = load_timeout;
+      if (cc_timeout >= 0 && (timeout < 0 || cc_timeout < timeout))
+	timeout = cc_timeout;
+      if (held_timeout >= 0 && (timeout < 0 || held_timeout < timeout))
+	timeout = held_timeout;
+      if (qrun_timeout >= 0 && (timeout < 0 || qrun_timeout < timeout))
+	timeout = qrun_timeout;
+#ifdef EXIM_HAVE_SYNCFS
+      int sync_timeout = spool_sync_timeout();
+
+      if (sync_timeout >= 0 && (timeout < 0 || sync_timeout < timeout))
+	timeout = sync_timeout;
+#endif
+      if (rl_timeout >= 0 && (timeout < 0 || rl_timeout < timeout))
+	timeout = rl_timeout;
+      if (hs_timeout >= 0 && (timeout < 0 || hs_timeout < timeout))
+	timeout = hs_timeout;
+      if (log_timeout >= 0 && (timeout < 0 || log_timeout < timeout))
+	timeout = log_timeout;
+#ifndef DISABLE_TLS
+      int tls_timeout = tls_daemon_timeout();
+
+      if (tls_timeout >= 0 && (timeout < 0 || tls_timeout < timeout))
+	timeout = tls_timeout;
+#endif
+      lcount = poll(fd_polls, poll_fd_count + held_count, timeout);
+      }
 
     if (lcount < 0)
       {
@@ -2689,21 +4837,58 @@ for (;;)
       /* Create or rotate any required keys; handle (delayed) filewatch event */
 
       if ((old_tfd = tls_daemon_tick()) >= 0)
+	{
 	for (struct pollfd * p = &fd_polls[listen_socket_count];
 	     p < fd_polls + poll_fd_count; p++)
 	  if (p->fd == old_tfd) { p->fd = tls_watch_fd ; break; }
+
+	/* Acceptors and spares carry the creds they were forked with; replace
+	them */
+
+	daemon_acceptors_stop(TRUE);
+	(void) daemon_spares_tick(TRUE);
+	}
       }
 #endif
+      /* Write log lines sent by other processes, once their window ends */
+
+      log_daemon_flush(FALSE);
+
+      if (acceptor_index == 0)
+	{
+#ifdef EXIM_HAVE_SYNCFS
+	/* Answer processes waiting on a group commit, once its window ends */
+
+	spool_sync_flush(daemon_notifier_fd);
+#endif
+	lookup_proxy_tick(fd_polls, listen_socket_count);
+	smtp_pool_tick();
+	acl_ratelimit_tick();
+	dbfn_shared_tick();
+	}
+
+      /* Drop or hand over held calls; those that were ready are not
+      listening sockets to accept on */
+
+      if (held_count > 0)
+	{
+	int held_ready = daemon_held_tick(fd_polls + poll_fd_count,
+				fd_polls, listen_socket_count);
+	if (!select_failed) lcount -= held_ready;
+	}
       errno = select_errno;
       }
 
     /* Loop for all the sockets that are currently ready to go. If select
     actually failed, we have set the count to 1 and select_failed=TRUE, so as
-    to use the common error code for select/accept below. */
+    to use the common error code for select/accept below. After a call has
+    been handled, any more already waiting on the same socket are taken, up to
+    ACCEPT_BATCH_MAX, without going round the loop again. */
 
-    while (lcount-- > 0)
+    for (int batch = 0; lcount-- > 0; )
       {
       int accept_socket = -1;
+      struct pollfd * accepted_from = NULL;
 #if HAVE_IPV6
       struct sockaddr_in6 accepted;
 #else
@@ -2764,6 +4949,7 @@ for (;;)
 #endif
 	    p->revents = 0;
             accept_socket = accept(p->fd, (struct sockaddr *)&accepted, &alen);
+	    accepted_from = p;
             break;
             }
 	}
@@ -2824,23 +5010,45 @@ for (;;)
 #endif
         if (inetd_wait_timeout)
           last_connection_time = time(NULL);
-        handle_smtp_call(fd_polls, listen_socket_count, accept_socket,
-          (struct sockaddr *)&accepted);
+	if (!daemon_hold_call(accept_socket, (struct sockaddr *)&accepted,
+			      sizeof(accepted)))
+	  handle_smtp_call(fd_polls, listen_socket_count, accept_socket,
+	    (struct sockaddr *)&accepted);
+
+	/* Each acceptor has its own listening sockets, so a call that is seen
+	waiting here cannot be taken by another process before the accept() */
+
+	if (  accepted_from && ++batch < ACCEPT_BATCH_MAX
+	   && !sigterm_seen && !sighup_seen)
+	  {
+	  struct pollfd q = { .fd = accepted_from->fd, .events = POLLIN };
+	  if (poll(&q, 1, 0) > 0 && q.revents & POLLIN)
+	    {
+	    accepted_from->revents = POLLIN;
+	    lcount++;
+	    }
+	  }
         }
       }
     }
 
   /* If not listening, then just sleep for the queue interval. If we woke
   up early the last time for some other signal, it won't matter because
-  the alarm signal will wake at the right time. This code originally used
-  sleep() but it turns out that on the FreeBSD system, sleep() is not inter-
-  rupted by signals, so it wasn't waking up for SIGALRM or SIGCHLD. Luckily
-  select() can be used as an interruptible sleep() on all versions of Unix. */
+  the sleep is worked out from the deadline of the next run. This code
+  originally used sleep() but it turns out that on the FreeBSD system, sleep()
+  is not interrupted by signals, so it wasn't waking up for SIGCHLD. Luckily
+  poll() can be used as an interruptible sleep() on all versions of Unix. */
 
   else
     {
     struct pollfd p;
-    poll(&p, 0, nolisten_sleep * 1000);
+    int timeout = daemon_qrun_timeout();
+    int cc_timeout = daemon_config_check_timeout();
+
+    if (cc_timeout >= 0 && (timeout < 0 || cc_timeout < timeout))
+      timeout = cc_timeout;
+
+    poll(&p, 0, timeout >= 0 ? timeout : nolisten_sleep * 1000);
     handle_ending_processes();
     }
 
@@ -2859,14 +5067,37 @@ for (;;)
   alarm in case it is just about to go off, and set SIGHUP to be ignored so
   that another HUP in quick succession doesn't clobber the new daemon before it
   gets going. All log files get closed by the close-on-exec flag; however, if
-  the exec fails, we need to close the logs. */
+  the exec fails, we need to close the logs.
+
+  The new configuration is checked first, by a child that the daemon does not
+  wait for, and the daemon carries on as it is if that fails. A SIGHUP that
+  arrives during a check is dealt with once it is over. The shared cache is
+  written to a file for the new daemon to read back, less the cached
+  authentication results, which are keyed on a secret that the new daemon
+  does not have. */
 
-  if (sighup_seen)
+  if (sighup_seen && config_check_pid == 0)
     {
+    sighup_seen = FALSE;
+    if (!daemon_config_check_start()) reexec = TRUE;
+    }
+  if (config_check_pid > 0 && daemon_config_check_tick() == 1)
+    reexec = TRUE;
+
+  if (reexec)
+    {
+    daemon_notifier_drain();
     log_write(0, LOG_MAIN, "pid %d: SIGHUP received: re-exec daemon",
       getpid());
+    lookup_proxy_close(TRUE);
+    acl_ratelimit_close();
+    daemon_acceptors_stop(FALSE);
     close_daemon_sockets(daemon_notifier_fd, fd_polls, listen_socket_count);
     unlink_notifier_socket();
+#ifdef CONFIGURE_CACHE
+    (void) Uunlink(CONFIGURE_CACHE);	/* have the config read afresh */
+#endif
+    (void) search_shared_save(shared_cache_file());
     ALARM_CLR(0);
     signal(SIGHUP, SIG_IGN);
     sighup_argv[0] = exim_path;
@@ -89,6 +89,19 @@ unnecessarily, because usually the lock file will be there. If the directory
 exists, there is no error. */
 
 snprintf(CS dirname, sizeof(dirname), "%s/db", spool_directory);
+
+/* With a DB library giving readers a consistent snapshot regardless of
+writers, there is no need for a reader to lock. */
+
+#ifdef EXIM_DB_MVCC_READERS
+if (read_only)
+  {
+  dbblock->lockfd = -1;
+  DEBUG(D_hints_lookup) debug_printf_indent("no lock needed for read\n");
+  goto dbopen;
+  }
+#endif
+
 snprintf(CS filename, sizeof(filename), "%s/%s.lockfile", dirname, name);
 
 priv_drop_temp(exim_uid, exim_gid);
@@ -136,6 +149,10 @@ if (rc < 0)
 
 DEBUG(D_hints_lookup) debug_printf_indent("locked  %s\n", filename);
 
+#ifdef EXIM_DB_MVCC_READERS
+dbopen:
+#endif
+
 /* At this point we have an opened and locked separate lock file, that is,
 exclusive access to the database, so we can go ahead and open it. If we are
 expected to create it, don't do so at first, again so that we can detect
@@ -172,7 +189,7 @@ if (!dbblock->dbptr)
     DEBUG(D_hints_lookup)
       debug_printf_indent("%s\n", CS string_open_failed("DB file %s",
           filename));
-  (void)close(dbblock->lockfd);
+  if (dbblock->lockfd >= 0) (void)close(dbblock->lockfd);
   errno = save_errno;
   DEBUG(D_hints_lookup) acl_level--;
   return NULL;
@@ -199,7 +216,7 @@ return dbblock;
 *************************************************/
 
 /* Closing a file automatically unlocks it, so after closing the database, just
-close the lock file.
+close the lock file, if one was taken.
 
 Argument: a pointer to an open database block
 Returns:  nothing
@@ -209,7 +226,7 @@ void
 dbfn_close(open_db *dbblock)
 {
 exim_dbclose(dbblock->dbptr);
-(void)close(dbblock->lockfd);
+if (dbblock->lockfd >= 0) (void)close(dbblock->lockfd);
 DEBUG(D_hints_lookup)
   { debug_printf_indent("closed hints database and lockfile\n"); acl_level--; }
 }
@@ -217,6 +234,40 @@ DEBUG(D_hints_lookup)
 
 
 
+/*************************************************
+*       Batch writes to an open database         *
+*************************************************/
+
+/* A caller about to make several writes to an open database may bracket them
+with these, so that a backend supporting transactions can apply them together
+rather than one at a time. For backends without transactions it is a no-op,
+and the writes go directly to the file while the lock is held.
+
+Argument: a pointer to an open database block
+Returns:  TRUE if a transaction was started; the caller should then call
+          dbfn_transaction_commit() before closing the file
+*/
+
+BOOL
+dbfn_transaction_start(open_db * dbblock)
+{
+BOOL yield = exim_dbtransaction_start(dbblock->dbptr);
+DEBUG(D_hints_lookup)
+  debug_printf_indent("dbfn_transaction_start: %s\n",
+    yield ? "started" : "not supported");
+return yield;
+}
+
+void
+dbfn_transaction_commit(open_db * dbblock)
+{
+DEBUG(D_hints_lookup) debug_printf_indent("dbfn_transaction_commit\n");
+exim_dbtransaction_commit(dbblock->dbptr);
+}
+
+
+
+
 /*************************************************
 *             Read from database file            *
 *************************************************/
@@ -316,13 +367,22 @@ Returns:    the yield of the underlying dbm or db "write" function. If this
 int
 dbfn_write(open_db *dbblock, const uschar *key, void *ptr, int length)
 {
+((dbdata_generic *)ptr)->time_stamp = time(NULL);
+return dbfn_write_stamped(dbblock, key, ptr, length);
+}
+
+
+/* As dbfn_write(), but leaving the record's timestamp as supplied, for
+records written back from a copy held elsewhere. */
+
+int
+dbfn_write_stamped(open_db *dbblock, const uschar *key, void *ptr, int length)
+{
 EXIM_DATUM key_datum, value_datum;
-dbdata_generic *gptr = (dbdata_generic *)ptr;
 int klen = Ustrlen(key) + 1;
 uschar * key_copy = store_get(klen, key);
 
 memcpy(key_copy, key, klen);
-gptr->time_stamp = time(NULL);
 
 DEBUG(D_hints_lookup) debug_printf_indent("dbfn_write: key=%s\n", key);
 
@@ -409,6 +469,349 @@ return yield;
 
 
 
+#ifndef STAND_ALONE
+/*************************************************
+*      Exchange hints with other hosts           *
+*************************************************/
+
+/* With hints_shared set, the main listening daemon periodically starts a child
+which exchanges the records of the named hints databases with a Redis server,
+found through the redis lookup and the redis_servers option.  Each database is
+held there as one hash, "exim:hints:<name>", of hex-encoded keys and records.
+
+The child fetches the whole hash, writes to the local file any record whose
+time stamp is later than that of the local copy (keeping the stamp), and sends
+back, in pipelined batches, the local records that are later than the server's.
+Everything else in Exim only ever reads and writes the local files, so nothing
+waits on the network; while the server is unreachable each host just carries
+on with its own hints.  Records past the age at which exim_tidydb would drop
+them by default are neither taken nor sent, and are deleted from the server.
+
+Records are exchanged as they are held, so all of the hosts must run the same
+build of Exim, and their clocks must agree as the stamps decide which copy
+wins. */
+
+#define SHARED_BATCH	64		/* commands per round trip */
+#define SHARED_MAX_AGE	(30*24*60*60)
+
+typedef struct shared_rec {
+  struct shared_rec * next;
+  uschar *	key;			/* decoded */
+  uschar *	hkey;			/* as on the server */
+  uschar *	data;
+  int		len;
+  BOOL		local;			/* the file has the key */
+  BOOL		take;			/* to be written to the file */
+} shared_rec;
+
+typedef struct shared_cmd {
+  struct shared_cmd * next;
+  uschar *	cmd;
+} shared_cmd;
+
+static time_t hints_shared_next = 0;	/* next exchange due */
+static pid_t  hints_shared_pid = 0;	/* the child doing it */
+
+
+static uschar *
+shared_hex(const uschar * p, int len)
+{
+uschar * s = store_get(2 * len + 1, GET_UNTAINTED), * t = s;
+for (; len > 0; len--, p++)
+  { *t++ = hex_digits[*p >> 4]; *t++ = hex_digits[*p & 0xf]; }
+*t = '\0';
+return s;
+}
+
+/* Returns the decoded bytes, zero-terminated, or NULL for a malformed string */
+
+static uschar *
+shared_unhex(const uschar * s, int * len)
+{
+int slen = Ustrlen(s);
+uschar * p;
+
+if (slen & 1) return NULL;
+p = store_get(slen / 2 + 1, GET_UNTAINTED);
+for (int i = 0; i < slen; i += 2)
+  {
+  const uschar * h = Ustrchr(hex_digits, tolower(s[i]));
+  const uschar * l = Ustrchr(hex_digits, tolower(s[i+1]));
+  if (!h || !l || !*h || !*l) return NULL;	/* Ustrchr finds a terminator */
+  p[i/2] = (h - hex_digits) << 4 | (l - hex_digits);
+  }
+p[slen / 2] = '\0';
+*len = slen / 2;
+return p;
+}
+
+static time_t
+shared_stamp(const uschar * data)
+{
+dbdata_generic d;
+memcpy(&d, data, sizeof(d));
+return d.time_stamp;
+}
+
+static shared_cmd *
+shared_cmd_add(shared_cmd * list, uschar * cmd)
+{
+shared_cmd * c = store_get(sizeof(shared_cmd), GET_UNTAINTED);
+c->next = list;
+c->cmd = cmd;
+return c;
+}
+
+/* Send the commands in batches, each as a prefetch lookup so that it takes
+one round trip.  Returns FALSE after a failure. */
+
+static BOOL
+shared_send(void * handle, const uschar * name, shared_cmd * cmds)
+{
+while (cmds)
+  {
+  gstring * g = string_get(SHARED_BATCH * 64);
+  uschar * res, * err = NULL;
+  uint do_cache;
+
+  g = string_catn(g, US"<;", 2);
+  for (int n = 0; cmds && n < SHARED_BATCH; cmds = cmds->next, n++)
+    g = string_fmt_append(g, " %s ;", cmds->cmd);
+
+  if (search_find_driver(handle, NULL, string_from_gstring(g), &res, &err,
+	&do_cache, US"prefetch") != OK)
+    {
+    log_write(0, LOG_MAIN, "hints_shared: sending %s: %s", name,
+      err ? err : US"failed");
+    return FALSE;
+    }
+  }
+return TRUE;
+}
+
+/* The time of the previous complete exchange of a database is kept as the
+modification time of a file alongside it; zero if there has been none */
+
+static time_t
+shared_last_get(const uschar * name)
+{
+struct stat statbuf;
+return Ustat(string_sprintf("%s/db/%s.shared", spool_directory, name),
+	  &statbuf) == 0 ? statbuf.st_mtime : 0;
+}
+
+static void
+shared_last_set(const uschar * name, time_t when)
+{
+uschar * filename = string_sprintf("%s/db/%s.shared", spool_directory, name);
+struct utimbuf times = { .actime = when, .modtime = when };
+int fd;
+
+priv_drop_temp(exim_uid, exim_gid);
+if ((fd = Uopen(filename, O_WRONLY|O_CREAT, EXIMDB_LOCKFILE_MODE)) >= 0)
+  {
+  (void) close(fd);
+  (void) utime(CS filename, &times);
+  }
+priv_restore();
+}
+
+
+/* Exchange one database with the server.  A record the server has but the
+file does not is taken if it may be new since the previous exchange; if it is
+older than that, it was deleted here (perhaps by a successful delivery for a
+retry record) and is deleted on the server too.  A record is on the server
+within one interval of being written, so the test allows for that. */
+
+static void
+shared_exchange(void * handle, const uschar * name)
+{
+const uschar * hash = string_sprintf("exim:hints:%s", name);
+time_t now = time(NULL), old = now - SHARED_MAX_AGE;
+time_t last = shared_last_get(name);
+tree_node * remote = NULL;
+shared_rec * recs = NULL;
+shared_cmd * cmds = NULL;
+int taken = 0, sent = 0, dropped = 0;
+uschar * res, * err = NULL, * key;
+uint do_cache;
+open_db dbblock, * dbm;
+EXIM_CURSOR * cursor;
+
+if (last) last -= hints_shared_interval;
+
+/* Fetch the server's copy; an empty hash gives FAIL.  The result has the
+keys and values on alternate lines. */
+
+switch (search_find_driver(handle, NULL,
+	  string_sprintf("HGETALL %s", hash), &res, &err, &do_cache, NULL))
+  {
+  case DEFER:
+    log_write(0, LOG_MAIN, "hints_shared: fetching %s: %s", name,
+      err ? err : US"failed");
+    return;
+  case FAIL:
+    res = US"";
+    break;
+  }
+
+for (const uschar * list = res; ; )
+  {
+  int sep = '\n', klen, len;
+  uschar * hk = string_nextinlist(&list, &sep, NULL, 0);
+  uschar * hv = hk ? string_nextinlist(&list, &sep, NULL, 0) : NULL;
+  uschar * k, * data;
+  tree_node * t;
+  shared_rec * r;
+
+  if (!hv) break;
+  if (  !(k = shared_unhex(hk, &klen)) || !klen
+     || !(data = shared_unhex(hv, &len)) || len < sizeof(dbdata_generic)
+     || shared_stamp(data) < old)
+    {
+    cmds = shared_cmd_add(cmds, string_sprintf("HDEL %s %s", hash, hk));
+    continue;
+    }
+  t = store_get(sizeof(tree_node) + Ustrlen(k), GET_UNTAINTED);
+  Ustrcpy(t->name, k);
+  if (!tree_insertnode(&remote, t)) continue;
+  r = t->data.ptr = store_get(sizeof(shared_rec), GET_UNTAINTED);
+  r->next = recs;
+  r->key = t->name;
+  r->hkey = hk;
+  r->data = data;
+  r->len = len;
+  r->local = FALSE;
+  r->take = FALSE;
+  recs = r;
+  }
+
+if (!(dbm = dbfn_open(US name, O_RDWR|O_CREAT, &dbblock, FALSE, FALSE)))
+  return;
+
+/* Compare the local records with the server's.  Nothing is written to the
+file during the scan, as some DBM libraries do not allow for that. */
+
+for (key = dbfn_scan(dbm, TRUE, &cursor); key;
+     key = dbfn_scan(dbm, FALSE, &cursor))
+  {
+  int len;
+  uschar * data = dbfn_read_with_length(dbm, key, &len);
+  tree_node * t = tree_search(remote, key);
+  time_t stamp;
+
+  if (!data || len < sizeof(dbdata_generic)) continue;
+  stamp = shared_stamp(data);
+
+  if (t)
+    {
+    shared_rec * r = t->data.ptr;
+    time_t rstamp = shared_stamp(r->data);
+
+    r->local = TRUE;
+    r->take = rstamp > stamp;
+    if (rstamp >= stamp) continue;
+    }
+  if (stamp < old) continue;
+
+  cmds = shared_cmd_add(cmds, string_sprintf("HSET %s %s %s", hash,
+	   shared_hex(key, Ustrlen(key)), shared_hex(data, len)));
+  sent++;
+  }
+
+for (shared_rec * r = recs; r; r = r->next)
+  {
+  if (r->local)
+    ;
+  else if (!last || shared_stamp(r->data) >= last)
+    r->take = TRUE;
+  else
+    {
+    cmds = shared_cmd_add(cmds, string_sprintf("HDEL %s %s", hash, r->hkey));
+    dropped++;
+    }
+  if (r->take && dbfn_write_stamped(dbm, r->key, r->data, r->len) == 0)
+    taken++;
+  }
+dbfn_close(dbm);
+
+/* The lock is not held while talking to the server */
+
+if (shared_send(handle, name, cmds))
+  {
+  shared_last_set(name, now);
+  DEBUG(D_any) debug_printf("hints_shared: %s: %d taken, %d sent, %d dropped\n",
+    name, taken, sent, dropped);
+  }
+}
+
+
+static void
+shared_exchange_all(void)
+{
+int stype = search_findtype(US"redis", 5);
+const uschar * list = hints_shared;
+uschar * name;
+void * handle;
+
+if (stype < 0 || !(handle = search_open(NULL, stype, 0, NULL, NULL)))
+  {
+  log_write(0, LOG_MAIN, "hints_shared: %s", search_error_message);
+  return;
+  }
+for (int sep = 0; (name = string_nextinlist(&list, &sep, NULL, 0)); )
+  {
+  rmark reset_point = store_mark();
+  shared_exchange(handle, name);
+  store_reset(reset_point);
+  }
+search_tidyup();
+}
+
+
+/* Milliseconds until the daemon's next exchange, for its poll; -1 if hints
+are not shared */
+
+int
+dbfn_shared_timeout(void)
+{
+time_t now;
+
+if (!hints_shared) return -1;
+now = time(NULL);
+return hints_shared_next > now ? (int)(hints_shared_next - now) * 1000 : 0;
+}
+
+
+/* Called from the daemon's main loop; start an exchange when one is due and
+the previous one has finished.  The pid is only checked for existence, as the
+daemon reaps all its children together.  While it is still running, look
+again in a second, so that the daemon's poll does not spin. */
+
+void
+dbfn_shared_tick(void)
+{
+time_t now = time(NULL);
+
+if (!hints_shared || now < hints_shared_next) return;
+if (hints_shared_pid > 0 && kill(hints_shared_pid, 0) == 0)
+  {
+  hints_shared_next = now + 1;
+  return;
+  }
+hints_shared_next = now + (hints_shared_interval > 0 ? hints_shared_interval : 60);
+
+if ((hints_shared_pid = exim_fork(US"hints-share")) == 0)
+  {
+  set_process_info("exchanging hints for %s", hints_shared);
+  shared_exchange_all();
+  exim_underbar_exit(EXIT_SUCCESS);
+  }
+}
+#endif	/*!STAND_ALONE*/
+
+
+
 /*************************************************
 **************************************************
 *             Stand-alone test program           *
@@ -462,6 +865,8 @@ printf("Berkeley DB: %s\n", DB_VERSION_STRING);
 printf("probably ndbm\n");
 #elif defined(USE_TDB)
 printf("using tdb\n");
+#elif defined(USE_LMDB)
+printf("using lmdb\n");
 #else
   #ifdef USE_GDBM
   printf("probably GDBM (native mode)\n");
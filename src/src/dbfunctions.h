@@ -18,7 +18,12 @@ open_db *dbfn_open(uschar *, int, open_db *, BOOL, BOOL);
 void    *dbfn_read_with_length(open_db *, const uschar *, int *);
 void    *dbfn_read_enforce_length(open_db *, const uschar *, size_t);
 uschar  *dbfn_scan(open_db *, BOOL, EXIM_CURSOR **);
+void     dbfn_shared_tick(void);
+int      dbfn_shared_timeout(void);
+void     dbfn_transaction_commit(open_db *);
+BOOL     dbfn_transaction_start(open_db *);
 int      dbfn_write(open_db *, const uschar *, void *, int);
+int      dbfn_write_stamped(open_db *, const uschar *, void *, int);
 
 /* Macro for the common call to read without wanting to know the length. */
 
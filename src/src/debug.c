@@ -472,6 +472,7 @@ debug_trigger_fire(void)
 {
 int nbytes;
 
+trace_ring_dump("trigger");
 if (!debug_pretrigger_buf) return;
 
 if (debug_file && (nbytes = pretrigger_writeoff - pretrigger_readoff) != 0)
@@ -496,4 +497,117 @@ dtrigger_selector = 0;
 }
 
 
+
+/**************************************************************/
+/* The trace ring.  Hot paths record fixed-size events with trace_event();
+nothing is formatted until the ring is dumped to trace_ring_file, which is
+done on a panic-log write, on SIGUSR1, and when a debug trigger fires.  Each
+dump holds the events since the previous one, up to the size of the ring.
+The dump can be called from a signal handler, so it formats by hand into a
+static buffer and uses only write(). */
+
+static const char * trace_event_names[] = {
+  [TRACE_SMTP_CONN] =	"smtp-conn",
+  [TRACE_SMTP_CMD] =	"smtp-cmd",
+  [TRACE_DELIVER_MSG] =	"deliver-msg",
+  [TRACE_DELIVER_ADDR] = "deliver-addr",
+  [TRACE_TPT_CONN] =	"tpt-conn",
+  [TRACE_TPT_HOST] =	"tpt-host",
+  [TRACE_DNS] =		"dns",
+};
+
+static unsigned trace_ring_dumped = 0;
+
+void
+trace_ring_init(void)
+{
+unsigned n = 16;
+
+if (trace_ring || !trace_ring_file || trace_ring_size <= 0) return;
+while (n < (unsigned)trace_ring_size && n < 65536) n <<= 1;
+trace_ring = store_malloc(n * sizeof(trace_rec));
+trace_ring_mask = n - 1;
+trace_ring_next = trace_ring_dumped = 0;
+}
+
+
+/* Decimal, zero-padded to width */
+
+static char *
+trace_put_num(char * p, uint64_t v, int width)
+{
+char tmp[24];
+int n = 0;
+
+do tmp[n++] = '0' + v % 10; while ((v /= 10));
+while (n < width) tmp[n++] = '0';
+while (n) *p++ = tmp[--n];
+return p;
+}
+
+static char *
+trace_put_str(char * p, const char * s)
+{
+while (*s) *p++ = *s++;
+return p;
+}
+
+void
+trace_ring_dump(const char * why)
+{
+static char buf[4096];
+static BOOL dumping = FALSE;
+char * p = buf;
+unsigned from;
+uint64_t pid = (uint64_t)getpid();
+int fd;
+
+if (!trace_ring || dumping || trace_ring_next == trace_ring_dumped) return;
+dumping = TRUE;
+
+if ((fd = log_open_as_exim(trace_ring_file)) >= 0)
+  {
+  from = trace_ring_next - trace_ring_dumped > trace_ring_mask + 1
+    ? trace_ring_next - (trace_ring_mask + 1) : trace_ring_dumped;
+
+  p = trace_put_num(p, pid, 0);
+  p = trace_put_str(p, " trace ring dump (");
+  p = trace_put_str(p, why);
+  p = trace_put_str(p, "), ");
+  p = trace_put_num(p, trace_ring_next - from, 0);
+  p = trace_put_str(p, " events\n");
+
+  for (unsigned i = from; i != trace_ring_next; i++)
+    {
+    const trace_rec * r = trace_ring + (i & trace_ring_mask);
+
+    if (p - buf > sizeof(buf) - 128)
+      { (void) write(fd, buf, p - buf); p = buf; }
+
+    p = trace_put_num(p, pid, 0);
+    *p++ = ' ';
+    p = trace_put_num(p, r->ns / 1000000000, 0);
+    *p++ = '.';
+    p = trace_put_num(p, r->ns % 1000000000, 9);
+    *p++ = ' ';
+    p = r->event < nelem(trace_event_names) && trace_event_names[r->event]
+      ? trace_put_str(p, trace_event_names[r->event])
+      : trace_put_num(p, r->event, 0);
+    for (int j = 0; j < 3; j++)
+      {
+      int a = r->arg[j];
+      *p++ = ' ';
+      if (a < 0) { *p++ = '-'; p = trace_put_num(p, -(int64_t)a, 0); }
+      else p = trace_put_num(p, a, 0);
+      }
+    *p++ = '\n';
+    }
+  (void) write(fd, buf, p - buf);
+  (void) close(fd);
+  trace_ring_dumped = trace_ring_next;
+  }
+dumping = FALSE;
+}
+
+
 /* End of debug.c */
@@ -30,6 +30,19 @@ typedef struct pardata {
   const uschar *return_path;   /* return_path for these addresses */
 } pardata;
 
+/* Data block for a local delivery run in parallel with others */
+
+typedef struct lpardata {
+  address_item *addr;          /* chain of addresses */
+  transport_instance *tp;      /* the transport, as before the delivery */
+  pid_t pid;                   /* subprocess pid */
+  int fd;                      /* pipe fd for getting result from subprocess */
+  int logflags;                /* for logging the results */
+  uschar *serialize_key;       /* hints key for a max_parallel transport */
+  const uschar *return_path;   /* return_path for these addresses */
+  struct timeval delivery_start;
+} lpardata;
+
 /* Values for the process_recipients variable */
 
 enum { RECIP_ACCEPT, RECIP_IGNORE, RECIP_DEFER,
@@ -39,7 +52,7 @@ enum { RECIP_ACCEPT, RECIP_IGNORE, RECIP_DEFER,
 /* Mutually recursive functions for marking addresses done. */
 
 static void child_done(address_item *, const uschar *);
-static void address_done(address_item *, const uschar *);
+static void address_done(address_item *, const uschar *, BOOL);
 
 /* Table for turning base-62 numbers into binary */
 
@@ -70,14 +83,36 @@ static address_item *addr_route = NULL;
 static address_item *addr_succeed = NULL;
 
 static FILE *message_log = NULL;
+static BOOL msglog_held = FALSE;
+static struct {				/* message_logs_lazy */
+  BOOL		active;
+  pid_t		pid;			/* process that owns the lines */
+  uschar *	buf;			/* malloc'd; store resets don't touch it */
+  int		len, size;
+} msglog_mem = { .active = FALSE };
 static BOOL update_spool;
 static BOOL remove_journal;
 static int  parcount = 0;
 static pardata *parlist = NULL;
 static struct pollfd *parpoll;
+static int  lparcount = 0;
+static lpardata *lparlist = NULL;
+static struct pollfd *lparpoll;
 static int  return_count;
+static BOOL journal_sync_pending = FALSE;
+static BOOL journal_unfolded;		/* journal has entries not in -H */
+static BOOL journal_kept;		/* journal stands in for a -H rewrite */
+static gstring *journal_delta;		/* new non-recipients, for the journal */
+static struct {				/* state as read, for journal_update() */
+  BOOL		firsttime, freeze, manual_thaw;
+  time_t	frozen_at, retry_after;
+  int		rcount, warnings;
+} journal_base;
+static int  shard_index = -1;
 static uschar *frozen_info = US"";
 static const uschar * used_return_path = NULL;
+static tree_node *tree_copy_routing = NULL;
+static int  remote_result_fd = -1;
 
 
 
@@ -366,7 +401,7 @@ for (int i = 2; i > 0; i--)
   if (errno != ENOENT)
     break;
 
-  (void)directory_make(spool_directory,
+  (void)directory_make(spool_root(message_subdir),
 			spool_sname(US"msglog", message_subdir),
 			MSGLOG_DIRECTORY_MODE, TRUE);
   }
@@ -378,6 +413,94 @@ return -1;
 
 
 
+/*************************************************
+*        Message log lines held in memory        *
+*************************************************/
+
+/* With message_logs_lazy set, and no file yet for the message, the lines for
+the message log are kept in memory by the delivery process, and written to the
+file only if the message stays on the queue. */
+
+static void
+msglog_mem_add(const char * format, va_list ap)
+{
+va_list aq;
+int n;
+
+va_copy(aq, ap);
+n = vsnprintf(NULL, 0, format, aq);
+va_end(aq);
+if (n < 0) return;
+
+if (msglog_mem.len + n + 1 > msglog_mem.size)
+  {
+  int size = MAX(msglog_mem.size * 2, msglog_mem.len + n + 256);
+  uschar * buf = store_malloc(size);
+  if (msglog_mem.buf)
+    {
+    memcpy(buf, msglog_mem.buf, msglog_mem.len);
+    store_free(msglog_mem.buf);
+    }
+  msglog_mem.buf = buf;
+  msglog_mem.size = size;
+  }
+(void) vsnprintf(CS msglog_mem.buf + msglog_mem.len, n + 1, format, ap);
+msglog_mem.len += n;
+}
+
+
+/* Drop the held lines and leave the lazy state. */
+
+static void
+msglog_mem_drop(void)
+{
+if (msglog_mem.buf) store_free(msglog_mem.buf);
+msglog_mem.buf = NULL;
+msglog_mem.len = msglog_mem.size = 0;
+msglog_mem.active = FALSE;
+}
+
+
+/* Create the message log file and write the held lines to it. A delivery
+subprocess that has lines to add does this with none of its own, as its
+parent still has the earlier lines and will write them if it needs to.
+
+Returns:  TRUE if message_log is now open; FALSE if not, after logging
+*/
+
+static BOOL
+msglog_mem_write(void)
+{
+uschar * fname, * error;
+int fd;
+
+if (!msglog_mem.active) return FALSE;
+if (msglog_mem.pid != getpid()) msglog_mem.len = 0;
+
+fname = spool_fname(US"msglog", message_subdir, message_id, US"");
+if (  (fd = open_msglog_file(fname, SPOOL_MODE, &error)) < 0
+   || !(message_log = fdopen(fd, "a")))
+  {
+  log_write(0, LOG_MAIN|LOG_PANIC, "Couldn't %s message log %s: %s",
+    fd < 0 ? error : US"fdopen", fname, strerror(errno));
+  if (fd >= 0) (void)close(fd);
+  msglog_mem_drop();
+  return FALSE;
+  }
+
+if (msglog_mem.len > 0)
+  {
+  (void) fwrite(msglog_mem.buf, 1, msglog_mem.len, message_log);
+  (void) fflush(message_log);
+  }
+DEBUG(D_deliver) debug_printf("message log written from memory (%d bytes)\n",
+  msglog_mem.len);
+msglog_mem_drop();
+return TRUE;
+}
+
+
+
 /*************************************************
 *           Write to msglog if required          *
 *************************************************/
@@ -396,13 +519,37 @@ deliver_msglog(const char *format, ...)
 {
 va_list ap;
 if (!message_logs) return;
+if (!message_log)
+  if (  !msglog_mem.active
+     || (msglog_mem.pid != getpid() && !msglog_mem_write()))
+    return;
 va_start(ap, format);
-vfprintf(message_log, format, ap);
-fflush(message_log);
+if (message_log)
+  {
+  vfprintf(message_log, format, ap);
+  if (!msglog_held) fflush(message_log);
+  }
+else
+  msglog_mem_add(format, ap);
 va_end(ap);
 }
 
 
+/* While the results of one transport run are being processed, the lines for
+the message log are left in its buffer, and written together at the end. */
+
+static void
+deliver_msglog_hold(BOOL hold)
+{
+if (hold) msglog_held = TRUE;
+else
+  {
+  msglog_held = FALSE;
+  if (message_logs && message_log) fflush(message_log);
+  }
+}
+
+
 
 
 /*************************************************
@@ -625,6 +772,39 @@ return TRUE;
 
 
 
+/*************************************************
+*      Journal lines and non-recipients          *
+*************************************************/
+
+/* Take one line, without its newline, from a journal file. A line is normally
+an address that has been dealt with, for the non-recipients. With
+spool_journal_size set, a line starting with a tab records a change to some
+other part of the state kept in the -H file; see journal_update(). */
+
+static void
+journal_line(uschar * s)
+{
+if (*s != '\t')
+  tree_add_nonrecipient(s);
+else if (Ustrncmp(s + 1, "warning_count ", 14) == 0)
+  warning_count = Uatoi(s + 15);
+}
+
+
+/* Add an address to the non-recipients when it has been dealt with, noting it
+for the journal if it is new and not already written there by the delivery. */
+
+static void
+done_nonrecipient(const uschar * s, BOOL journalled)
+{
+if (tree_search_nonrecipient(s)) return;
+tree_add_nonrecipient(s);
+if (spool_journal_size > 0 && !journalled)
+  journal_delta = string_fmt_append(journal_delta, "%s\n", s);
+}
+
+
+
 /*************************************************
 *      Record that an address is complete        *
 *************************************************/
@@ -651,27 +831,31 @@ tree, so that it gets recorded in the spool file and therefore appears as
 "done" in any spool listings. The original address may differ from the unique
 address in the case of the domain.
 
-Finally, this function scans the list of duplicates, marks as done any that
-match this address, and calls child_done() for their ancestors.
+Finally, this function finds the duplicates of this address, marks them as
+done, and calls child_done() for their ancestors.
 
 Arguments:
   addr        address item that has been completed
   now         current time as a string
+  journalled  TRUE if the address has been delivered, in which case the
+              delivery wrote its unique address to the journal already
 
 Returns:      nothing
 */
 
 static void
-address_done(address_item * addr, const uschar * now)
+address_done(address_item * addr, const uschar * now, BOOL journalled)
 {
+tree_node * tnode;
+
 update_spool = TRUE;        /* Ensure spool gets updated */
 
 /* Top-level address */
 
 if (!addr->parent)
   {
-  tree_add_nonrecipient(addr->unique);
-  tree_add_nonrecipient(addr->address);
+  done_nonrecipient(addr->unique, journalled);
+  done_nonrecipient(addr->address, FALSE);
   }
 
 /* Homonymous child address */
@@ -679,21 +863,24 @@ if (!addr->parent)
 else if (testflag(addr, af_homonym))
   {
   if (addr->transport)
-    tree_add_nonrecipient(
-      string_sprintf("%s/%s", addr->unique + 3, addr->transport->name));
+    done_nonrecipient(
+      string_sprintf("%s/%s", addr->unique + 3, addr->transport->name),
+      journalled);
   }
 
 /* Non-homonymous child address */
 
-else tree_add_nonrecipient(addr->unique);
+else done_nonrecipient(addr->unique, journalled);
 
-/* Check the list of duplicate addresses and ensure they are now marked
-done as well. */
+/* Ensure that the duplicates of the address are now marked done as well.
+They are chained from the address first seen with this unique value, so
+there is no need to scan the whole list of duplicates. */
 
-for (address_item * dup = addr_duplicate; dup; dup = dup->next)
-  if (Ustrcmp(addr->unique, dup->unique) == 0)
+if ((tnode = hset_search(&hset_duplicates, addr->unique)))
+  for (address_item * dup = ((address_item *)tnode->data.ptr)->dups; dup;
+       dup = dup->dupnext)
     {
-    tree_add_nonrecipient(dup->unique);
+    done_nonrecipient(dup->unique, FALSE);
     child_done(dup, now);
     }
 }
@@ -727,7 +914,7 @@ while (addr->parent)
 
   addr = addr->parent;
   if (--addr->child_count > 0) return;   /* Incomplete parent */
-  address_done(addr, now);
+  address_done(addr, now, FALSE);
 
   /* Log the completion of all descendents only when there is no ancestor with
   the same original address. */
@@ -1108,6 +1295,39 @@ return g;
 
 
 
+/* The fields of the JSON log common to delivery, deferral and failure */
+
+static gstring *
+d_json_addr(gstring * g, const address_item * addr)
+{
+const address_item * top = addr;
+
+if (!g) return g;
+while (top->parent) top = top->parent;
+
+g = log_json_str(g, "recipient", addr->address);
+if (top != addr)
+  g = log_json_str(g, "original", top->address);
+g = log_json_str(g, "sender", sender_address);
+if (addr->router)
+  g = log_json_str(g, "router", addr->router->name);
+if (addr->transport)
+  g = log_json_str(g, "transport", addr->transport->name);
+if (addr->host_used)
+  {
+  g = log_json_str(g, "host_name", addr->host_used->name);
+  g = log_json_str(g, "host_address", addr->host_used->address);
+  g = log_json_int(g, "host_port", addr->host_used->port);
+  }
+#ifndef DISABLE_TLS
+g = log_json_str(g, "tls_cipher", addr->cipher);
+#endif
+if (*queue_name)
+  g = log_json_str(g, "queue", queue_name);
+return log_json_time(g, "deliver_time", &addr->delivery_time);
+}
+
+
 /******************************************************************************/
 
 
@@ -1280,6 +1500,24 @@ store we used to build the line after writing it. */
 
 log_write(0, flags, "%Y", g);
 
+if (!msg && (g = log_json_start(US"delivery")))
+  {
+  struct timeval qt;
+
+  g = d_json_addr(g, addr);
+  g = log_json_int(g, "size", transport_count);
+  if (addr->authenticator)
+    g = log_json_str(g, "auth", addr->authenticator);
+  if (  addr->message
+     && (addr->host_used || Ustrcmp(addr->transport->driver_name, "lmtp") == 0))
+    g = log_json_str(g, "confirmation", addr->message);
+  if (logchar == '>')
+    g = log_json_bool(g, "cutthrough", TRUE);
+  timesince(&qt, &received_time);
+  g = log_json_time(g, "queue_time", &qt);
+  log_json_write(g);
+  }
+
 #ifndef DISABLE_EVENT
 if (!msg) msg_event_raise(US"msg:delivery", addr);
 #endif
@@ -1353,6 +1591,17 @@ others. */
 log_write(addr->basic_errno <= ERRNO_RETRY_BASE ? L_retry_defer : 0, logflags,
   "== %Y", g);
 
+if (  (addr->basic_errno > ERRNO_RETRY_BASE || LOGGING(retry_defer))
+   && (g = log_json_start(US"defer")))
+  {
+  g = d_json_addr(g, addr);
+  g = log_json_int(g, "errno", addr->basic_errno);
+  if (addr->basic_errno > 0)
+    g = log_json_str(g, "error", US strerror(addr->basic_errno));
+  g = log_json_str(g, "message", addr->message);
+  log_json_write(g);
+  }
+
 store_reset(reset_point);
 return;
 }
@@ -1424,6 +1673,16 @@ else
 
 log_write(0, LOG_MAIN, "** %Y", g);
 
+if ((g = log_json_start(US"fail")))
+  {
+  g = d_json_addr(g, addr);
+  g = log_json_int(g, "errno", addr->basic_errno);
+  if (addr->basic_errno > 0)
+    g = log_json_str(g, "error", US strerror(addr->basic_errno));
+  g = log_json_str(g, "message", addr->message);
+  log_json_write(g);
+  }
+
 store_reset(reset_point);
 return;
 }
@@ -1457,6 +1716,7 @@ uschar * driver_kind = NULL;
 uschar * driver_name = NULL;
 
 DEBUG(D_deliver) debug_printf("post-process %s (%d)\n", addr->address, result);
+trace_event(TRACE_DELIVER_ADDR, result, addr->basic_errno, addr->more_errno);
 
 /* Set up driver kind and name for logging. Disable logging if the router or
 transport has disabled it. */
@@ -1468,6 +1728,7 @@ if (driver_type == EXIM_DTYPE_TRANSPORT)
     driver_name = addr->transport->name;
     driver_kind = US" transport";
     f.disable_logging = addr->transport->disable_logging;
+    if (metrics) metrics_delivery(driver_name, result);
     }
   else driver_kind = US"transporting";
   }
@@ -1594,7 +1855,7 @@ if (result == OK)
   call child_done() to scan the ancestors and mark them complete if this is the
   last child to complete. */
 
-  address_done(addr, now);
+  address_done(addr, now, TRUE);
   DEBUG(D_deliver) debug_printf("%s delivered\n", addr->address);
 
   if (!addr->parent)
@@ -2030,7 +2291,7 @@ previously_transported(address_item *addr, BOOL testing)
 uschar * s = string_sprintf("%s/%s",
   addr->unique + (testflag(addr, af_homonym)? 3:0), addr->transport->name);
 
-if (tree_search(tree_nonrecipients, s) != 0)
+if (tree_search_nonrecipient(s) != 0)
   {
   DEBUG(D_deliver|D_route|D_transport)
     debug_printf("%s was previously delivered (%s transport): discarded\n",
@@ -2083,6 +2344,126 @@ return FALSE;
 
 
 
+/*************************************************
+*           Push the journal out to disk         *
+*************************************************/
+
+static void
+journal_sync(void)
+{
+if (EXIMfdatasync(journal_fd) < 0)
+  log_write(0, LOG_MAIN|LOG_PANIC, "failed to fsync journal: %s",
+    strerror(errno));
+journal_sync_pending = FALSE;
+}
+
+
+
+
+/*************************************************
+*      Run a local transport in this process     *
+*************************************************/
+
+/* This is the in-process equivalent of the delivery subprocess below, used
+for a transport with deliver_in_process set when the delivery would not change
+uid or gid. There is no pipe; the results are left in the address blocks
+exactly as the parent would have read them back. The globals that the
+subprocess sets and forgets are restored afterwards, and the cwd is put back
+to the spool directory.
+
+Arguments:
+  addr       the address (chain) for the delivery
+  uid, gid   the uid and gid for the transport (the same as ours)
+  working_directory  the directory for the transport to run in
+
+Returns:     nothing
+*/
+
+static void
+deliver_local_in_process(address_item * addr, uid_t uid, gid_t gid,
+  const uschar * working_directory)
+{
+transport_instance * tp = addr->transport;
+uschar * save_transport_name = transport_name;
+uschar * save_router_name = router_name;
+const uschar * save_srcfile = driver_srcfile;
+int save_srcline = driver_srcline;
+void (*old_int)(int), (*old_term)(int);
+BOOL replicate = TRUE;
+
+DEBUG(D_deliver) debug_printf("running %s transport in the delivery process\n",
+  tp->name);
+
+if (tp->setup)
+  switch((tp->setup)(tp, addr, NULL, uid, gid, &addr->message))
+    {
+    case DEFER:	addr->transport_return = DEFER; goto DONE;
+    case FAIL:	addr->transport_return = PANIC; goto DONE;
+    }
+
+old_int = signal(SIGINT, SIG_IGN);
+old_term = signal(SIGTERM, SIG_IGN);
+
+DEBUG(D_deliver)
+  {
+  debug_printf("  home=%s current=%s\n", deliver_home, working_directory);
+  for (address_item * batched = addr->next; batched; batched = batched->next)
+    debug_printf("additional batched address: %s\n", batched->address);
+  }
+
+if (Uchdir(working_directory) < 0)
+  {
+  addr->transport_return = DEFER;
+  addr->basic_errno = errno;
+  addr->message = string_sprintf("failed to chdir to %s", working_directory);
+  }
+else
+  {
+  BOOL ok = TRUE;
+  set_process_info("delivering %s to %s using %s", message_id,
+   addr->local_part, tp->name);
+
+  transport_name = tp->name;
+  if (addr->router) router_name = addr->router->name;
+  driver_srcfile = tp->srcfile;
+  driver_srcline = tp->srcline;
+
+  if (tp->filter_command)
+    {
+    ok = transport_set_up_command(&transport_filter_argv,
+      tp->filter_command,
+      TSUC_EXPAND_ARGS, PANIC, addr, US"transport filter", NULL);
+    transport_filter_timeout = tp->filter_timeout;
+    }
+  else transport_filter_argv = NULL;
+
+  if (ok)
+    {
+    debug_print_string(tp->debug_string);
+    replicate = !(tp->info->code)(addr->transport, addr);
+    }
+
+  transport_filter_argv = NULL;
+  transport_name = save_transport_name;
+  router_name = save_router_name;
+  driver_srcfile = save_srcfile;
+  driver_srcline = save_srcline;
+
+  if (Uchdir(spool_directory) < 0)
+    log_write(0, LOG_MAIN|LOG_PANIC, "failed to chdir back to %s: %s",
+      spool_directory, strerror(errno));
+  }
+
+signal(SIGINT, old_int);
+signal(SIGTERM, old_term);
+
+DONE:
+if (replicate) replicate_status(addr);
+}
+
+
+
+
 /*************************************************
 *           Perform a local delivery             *
 *************************************************/
@@ -2107,6 +2488,11 @@ Using a separate process makes it more complicated to get error information
 back. We use a pipe to pass the return code and also an error code and error
 text string back to the parent process.
 
+A transport may ask, with deliver_in_process, to be run without the fork when
+the uid and gid it needs are those of this process already. The journal for
+such a delivery is not fsync()ed at once; that is left to the end of the run
+of local deliveries, so that a run of them shares a single sync.
+
 Arguments:
   addr       points to an address block for this delivery; for "normal" local
              deliveries this is the only address to be delivered, but for
@@ -2118,16 +2504,19 @@ Arguments:
   shadowing  TRUE if running a shadow transport; this causes output from pipes
              to be ignored.
 
-Returns:     nothing
+  fdp        where to put the reading end of the pipe from the subprocess
+
+Returns:     the pid of the subprocess, for deliver_local_finish();
+             zero if the transport was run in this process, or
+             -1 if the delivery was abandoned (the addresses have the error)
 */
 
-void
-deliver_local(address_item *addr, BOOL shadowing)
+static pid_t
+deliver_local_start(address_item * addr, BOOL shadowing, int * fdp)
 {
 BOOL use_initgroups;
 uid_t uid;
 gid_t gid;
-int status, len, rc;
 int pfd[2];
 pid_t pid;
 uschar *working_directory;
@@ -2152,7 +2541,7 @@ if (tp->return_path)
     common_error(TRUE, addr, ERRNO_EXPANDFAIL,
       US"Failed to expand return path \"%s\" in %s transport: %s",
       tp->return_path, tp->name, expand_string_message);
-    return;
+    return -1;
     }
   }
 
@@ -2165,7 +2554,7 @@ used_return_path = return_path;
 gets put into the address(es), and the expansions are unset, so we can just
 return. */
 
-if (!findugid(addr, tp, &uid, &gid, &use_initgroups)) return;
+if (!findugid(addr, tp, &uid, &gid, &use_initgroups)) return -1;
 
 /* See if either the transport or the address specifies a home directory. A
 home directory set in the address may already be expanded; a flag is set to
@@ -2183,13 +2572,13 @@ if (  (deliver_home = tp->home_dir)		/* Set in transport, or */
     common_error(TRUE, addr, ERRNO_EXPANDFAIL, US"home directory \"%s\" failed "
       "to expand for %s transport: %s", rawhome, tp->name,
       expand_string_message);
-    return;
+    return -1;
     }
   if (*deliver_home != '/')
     {
     common_error(TRUE, addr, ERRNO_NOTABSOLUTE, US"home directory path \"%s\" "
       "is not absolute for %s transport", deliver_home, tp->name);
-    return;
+    return -1;
     }
   }
 
@@ -2209,13 +2598,13 @@ if (working_directory)
     common_error(TRUE, addr, ERRNO_EXPANDFAIL, US"current directory \"%s\" "
       "failed to expand for %s transport: %s", raw, tp->name,
       expand_string_message);
-    return;
+    return -1;
     }
   if (*working_directory != '/')
     {
     common_error(TRUE, addr, ERRNO_NOTABSOLUTE, US"current directory path "
       "\"%s\" is not absolute for %s transport", working_directory, tp->name);
-    return;
+    return -1;
     }
   }
 else working_directory = deliver_home ? deliver_home : US"/";
@@ -2240,17 +2629,29 @@ if (  !shadowing
     {
     common_error(TRUE, addr, errno, US"Unable to %s file for %s transport "
       "to return message: %s", error, tp->name, strerror(errno));
-    return;
+    return -1;
     }
   }
 
+/* If the transport permits it and no change of uid or gid would be needed,
+run it here and skip the subprocess and pipe. */
+
+if (  tp->deliver_in_process && !use_initgroups
+   && uid == getuid() && uid == geteuid()
+   && gid == getgid() && gid == getegid())
+  {
+  deliver_local_in_process(addr, uid, gid, working_directory);
+  *fdp = -1;
+  return 0;
+  }
+
 /* Create the pipe for inter-process communication. */
 
 if (pipe(pfd) != 0)
   {
   common_error(TRUE, addr, ERRNO_PIPEFAIL, US"Creation of pipe failed: %s",
     strerror(errno));
-  return;
+  return -1;
   }
 
 /* Now fork the process to do the real work in the subprocess, but first
@@ -2456,36 +2857,65 @@ if (pid < 0)
   log_write(0, LOG_MAIN|LOG_PANIC_DIE, "Fork failed for local delivery to %s",
     addr->address);
 
-/* Read the pipe to get the delivery status codes and error messages. Our copy
-of the writing end must be closed first, as otherwise read() won't return zero
-on an empty pipe. We check that a status exists for each address before
-overwriting the address structure. If data is missing, the default DEFER status
-will remain. Afterwards, close the reading end. */
+/* Our copy of the writing end must be closed, as otherwise read() won't
+return zero on an empty pipe. */
 
 (void)close(pfd[pipe_write]);
+*fdp = pfd[pipe_read];
+return pid;
+}
+
+
+
+/* Collect the results of a local delivery started by deliver_local_start().
+
+Arguments:
+  addr       the address (chain) for the delivery
+  tp         the transport, as it was before the delivery
+  shadowing  TRUE if running a shadow transport
+  pid        the delivery subprocess, or zero if it was run in this process
+  fd         the reading end of the results pipe
+
+Returns:     nothing
+*/
+
+static void
+deliver_local_finish(address_item * addr, transport_instance * tp,
+  BOOL shadowing, pid_t pid, int fd)
+{
+BOOL in_process = pid == 0;
+int status = 0, len, rc;
+address_item *addr2;
+
+if (in_process) goto JOURNAL;
+
+/* Read the pipe to get the delivery status codes and error messages. We check
+that a status exists for each address before overwriting the address
+structure. If data is missing, the default DEFER status will remain.
+Afterwards, close the reading end. */
 
 for (addr2 = addr; addr2; addr2 = addr2->next)
   {
-  if ((len = read(pfd[pipe_read], &status, sizeof(int))) > 0)
+  if ((len = read(fd, &status, sizeof(int))) > 0)
     {
     int i;
     uschar **sptr;
 
     addr2->transport_return = status;
-    len = read(pfd[pipe_read], &transport_count,
+    len = read(fd, &transport_count,
       sizeof(transport_count));
-    len = read(pfd[pipe_read], &addr2->flags, sizeof(addr2->flags));
-    len = read(pfd[pipe_read], &addr2->basic_errno,    sizeof(int));
-    len = read(pfd[pipe_read], &addr2->more_errno,     sizeof(int));
-    len = read(pfd[pipe_read], &addr2->delivery_time,  sizeof(struct timeval));
-    len = read(pfd[pipe_read], &i, sizeof(int)); addr2->special_action = i;
-    len = read(pfd[pipe_read], &addr2->transport,
+    len = read(fd, &addr2->flags, sizeof(addr2->flags));
+    len = read(fd, &addr2->basic_errno,    sizeof(int));
+    len = read(fd, &addr2->more_errno,     sizeof(int));
+    len = read(fd, &addr2->delivery_time,  sizeof(struct timeval));
+    len = read(fd, &i, sizeof(int)); addr2->special_action = i;
+    len = read(fd, &addr2->transport,
       sizeof(transport_instance *));
 
     if (testflag(addr2, af_file))
       {
       int llen;
-      if (  read(pfd[pipe_read], &llen, sizeof(int)) != sizeof(int)
+      if (  read(fd, &llen, sizeof(int)) != sizeof(int)
 	 || llen > 64*4	/* limit from rfc 5821, times I18N factor */
          )
 	{
@@ -2495,7 +2925,7 @@ for (addr2 = addr; addr2; addr2 = addr2->next)
 	}
       /* sanity-checked llen so disable the Coverity error */
       /* coverity[tainted_data] */
-      if (read(pfd[pipe_read], big_buffer, llen) != llen)
+      if (read(fd, big_buffer, llen) != llen)
 	{
 	log_write(0, LOG_MAIN|LOG_PANIC, "bad local_part read"
 	  " from delivery subprocess");
@@ -2508,10 +2938,10 @@ for (addr2 = addr; addr2; addr2 = addr2->next)
     for (i = 0, sptr = &addr2->message; i < 2; i++, sptr = &addr2->user_message)
       {
       int message_length;
-      len = read(pfd[pipe_read], &message_length, sizeof(int));
+      len = read(fd, &message_length, sizeof(int));
       if (message_length > 0)
         {
-        len = read(pfd[pipe_read], big_buffer, message_length);
+        len = read(fd, big_buffer, message_length);
 	big_buffer[big_buffer_size-1] = '\0';		/* guard byte */
         if (len > 0) *sptr = string_copy(big_buffer);
         }
@@ -2526,41 +2956,49 @@ for (addr2 = addr; addr2; addr2 = addr2->next)
     }
   }
 
-(void)close(pfd[pipe_read]);
+(void)close(fd);
 
 /* Unless shadowing, write all successful addresses immediately to the journal
 file, to ensure they are recorded asap. For homonymic addresses, use the base
-address plus the transport name. Failure to write the journal is panic-worthy,
-but don't stop, as it may prove possible subsequently to update the spool file
-in order to record the delivery. */
+address plus the transport name. The lines for the whole batch go in one write.
+Failure to write the journal is panic-worthy, but don't stop, as it may prove
+possible subsequently to update the spool file in order to record the
+delivery. */
 
+JOURNAL:
 if (!shadowing)
   {
+  gstring * g = NULL;
+
   for (addr2 = addr; addr2; addr2 = addr2->next)
     if (addr2->transport_return == OK)
       {
-      if (testflag(addr2, af_homonym))
-	sprintf(CS big_buffer, "%.500s/%s\n", addr2->unique + 3, tp->name);
-      else
-	sprintf(CS big_buffer, "%.500s\n", addr2->unique);
+      len = gstring_length(g);
+      g = testflag(addr2, af_homonym)
+	? string_fmt_append(g, "%.500s/%s\n", addr2->unique + 3, tp->name)
+	: string_fmt_append(g, "%.500s\n", addr2->unique);
+      DEBUG(D_deliver) debug_printf("journalling %.*s", g->ptr - len, g->s + len);
+      }
 
-      /* In the test harness, wait just a bit to let the subprocess finish off
-      any debug output etc first. */
+  if (g)
+    {
+    /* In the test harness, wait just a bit to let the subprocess finish off
+    any debug output etc first. */
 
-      testharness_pause_ms(300);
+    testharness_pause_ms(300);
 
-      DEBUG(D_deliver) debug_printf("journalling %s", big_buffer);
-      len = Ustrlen(big_buffer);
-      if (write(journal_fd, big_buffer, len) != len)
-	log_write(0, LOG_MAIN|LOG_PANIC, "failed to update journal for %s: %s",
-	  big_buffer, strerror(errno));
-      }
+    if (write(journal_fd, g->s, g->ptr) != g->ptr)
+      log_write(0, LOG_MAIN|LOG_PANIC, "failed to update journal for %s: %s",
+	addr->address, strerror(errno));
+    }
 
-  /* Ensure the journal file is pushed out to disk. */
+  /* Ensure the journal file is pushed out to disk. For an in-process delivery
+this is put off until the end of the local deliveries. */
 
-  if (EXIMfsync(journal_fd) < 0)
-    log_write(0, LOG_MAIN|LOG_PANIC, "failed to fsync journal: %s",
-      strerror(errno));
+  if (in_process)
+    journal_sync_pending = TRUE;
+  else
+    journal_sync();
   }
 
 /* Wait for the process to finish. If it terminates with a non-zero code,
@@ -2571,7 +3009,7 @@ when Exim was called from an MUA that set SIGCHLD to SIG_IGN. When that
 happens, wait() doesn't recognize the termination of child processes. Exim now
 resets SIGCHLD to SIG_DFL, but this code should still be robust. */
 
-while ((rc = wait(&status)) != pid)
+if (!in_process) while ((rc = waitpid(pid, &status, 0)) != pid)
   if (rc < 0 && errno == ECHILD)      /* Process has vanished */
     {
     log_write(0, LOG_MAIN, "%s transport process vanished unexpectedly",
@@ -2632,6 +3070,21 @@ if (addr->special_action == SPECIAL_WARN && addr->transport->warn_message)
 
 
 
+/* Run a local delivery to completion; this is the normal serial case.
+See deliver_local_start() for the arguments. */
+
+void
+deliver_local(address_item *addr, BOOL shadowing)
+{
+transport_instance * tp = addr->transport;
+int fd = -1;
+pid_t pid = deliver_local_start(addr, shadowing, &fd);
+
+if (pid >= 0) deliver_local_finish(addr, tp, shadowing, pid, fd);
+}
+
+
+
 
 /* Check transport for the given concurrency limit.  Return TRUE if over
 the limit (or an expansion failure), else FALSE and if there was a limit,
@@ -2679,67 +3132,320 @@ return FALSE;
 
 
 /*************************************************
-*              Do local deliveries               *
+*       Process the results of a local delivery  *
 *************************************************/
 
-/* This function processes the list of addresses in addr_local. True local
-deliveries are always done one address at a time. However, local deliveries can
-be batched up in some cases. Typically this is when writing batched SMTP output
-files for use by some external transport mechanism, or when running local
-deliveries over LMTP.
+/* This is the part of do_local_deliveries() that follows the running of the
+transport, split out so that it can be used for deliveries that have run in
+parallel. The expansion variables for the delivery must be set on entry.
 
-Arguments:   None
-Returns:     Nothing
+Arguments:
+  addr           the address (chain) delivered
+  tp             the transport used
+  serialize_key  the hints DB key for a max_parallel transport, or NULL
+  logflags       flags for logging the results
+  delivery_start when the delivery was started
+
+Returns:         nothing
 */
 
 static void
-do_local_deliveries(void)
+local_post_process(address_item * addr, transport_instance * tp,
+  uschar * serialize_key, int logflags, struct timeval * delivery_start)
 {
-open_db dbblock;
-open_db *dbm_file = NULL;
-time_t now = time(NULL);
+struct timeval deliver_time;
+address_item *addr2, *addr3, *nextaddr;
+int logchar = f.dont_deliver? '*' : '=';
 
-/* Loop until we have exhausted the supply of local deliveries */
+timesince(&deliver_time, delivery_start);
 
-while (addr_local)
+/* If a shadow transport (which must perforce be another local transport), is
+defined, and its condition is met, we must pass the message to the shadow
+too, but only those addresses that succeeded. We do this by making a new
+chain of addresses - also to keep the original chain uncontaminated. We must
+use a chain rather than doing it one by one, because the shadow transport may
+batch.
+
+NOTE: if the condition fails because of a lookup defer, there is nothing we
+can do! */
+
+if (  tp->shadow
+   && (  !tp->shadow_condition
+      || expand_check_condition(tp->shadow_condition, tp->name, US"transport")
+   )  )
   {
-  struct timeval delivery_start;
-  struct timeval deliver_time;
-  address_item *addr2, *addr3, *nextaddr;
-  int logflags = LOG_MAIN;
-  int logchar = f.dont_deliver? '*' : '=';
-  transport_instance *tp;
-  uschar * serialize_key = NULL;
+  transport_instance *stp;
+  address_item *shadow_addr = NULL;
+  address_item **last = &shadow_addr;
 
-  /* Pick the first undelivered address off the chain */
+  for (stp = transports; stp; stp = stp->next)
+    if (Ustrcmp(stp->name, tp->shadow) == 0) break;
 
-  address_item *addr = addr_local;
-  addr_local = addr->next;
-  addr->next = NULL;
+  if (!stp)
+    log_write(0, LOG_MAIN|LOG_PANIC, "shadow transport \"%s\" not found ",
+      tp->shadow);
 
-  DEBUG(D_deliver|D_transport)
-    debug_printf("--------> %s <--------\n", addr->address);
+  /* Pick off the addresses that have succeeded, and make clones. Put into
+  the shadow_message field a pointer to the shadow_message field of the real
+  address. */
 
-  /* An internal disaster if there is no transport. Should not occur! */
+  else for (addr2 = addr; addr2; addr2 = addr2->next)
+    if (addr2->transport_return == OK)
+      {
+      addr3 = store_get(sizeof(address_item), GET_UNTAINTED);
+      *addr3 = *addr2;
+      addr3->next = NULL;
+      addr3->shadow_message = US &addr2->shadow_message;
+      addr3->transport = stp;
+      addr3->transport_return = DEFER;
+      addr3->return_filename = NULL;
+      addr3->return_file = -1;
+      *last = addr3;
+      last = &addr3->next;
+      }
 
-  if (!(tp = addr->transport))
+  /* If we found any addresses to shadow, run the delivery, and stick any
+  message back into the shadow_message field in the original. */
+
+  if (shadow_addr)
     {
-    logflags |= LOG_PANIC;
-    f.disable_logging = FALSE;  /* Jic */
-    addr->message = addr->router
-      ? string_sprintf("No transport set by %s router", addr->router->name)
-      : US"No transport set by system filter";
-    post_process_one(addr, DEFER, logflags, EXIM_DTYPE_TRANSPORT, 0);
-    continue;
-    }
+    int save_count = transport_count;
 
-  /* Check that this base address hasn't previously been delivered to this
-  transport. The check is necessary at this point to handle homonymic addresses
-  correctly in cases where the pattern of redirection changes between delivery
-  attempts. Non-homonymic previous delivery is detected earlier, at routing
-  time. */
+    DEBUG(D_deliver|D_transport)
+      debug_printf(">>>>>>>>>>>>>>>> Shadow delivery >>>>>>>>>>>>>>>>\n");
+    deliver_local(shadow_addr, TRUE);
 
-  if (previously_transported(addr, FALSE)) continue;
+    for(; shadow_addr; shadow_addr = shadow_addr->next)
+      {
+      int sresult = shadow_addr->transport_return;
+      *(uschar **)shadow_addr->shadow_message =
+        sresult == OK
+        ? string_sprintf(" ST=%s", stp->name)
+        : string_sprintf(" ST=%s (%s%s%s)", stp->name,
+            shadow_addr->basic_errno <= 0
+            ? US""
+            : US strerror(shadow_addr->basic_errno),
+            shadow_addr->basic_errno <= 0 || !shadow_addr->message
+            ? US""
+            : US": ",
+            shadow_addr->message
+            ? shadow_addr->message
+            : shadow_addr->basic_errno <= 0
+            ? US"unknown error"
+            : US"");
+
+      DEBUG(D_deliver|D_transport)
+        debug_printf("%s shadow transport returned %s for %s\n",
+          stp->name, rc_to_string(sresult), shadow_addr->address);
+      }
+
+    DEBUG(D_deliver|D_transport)
+      debug_printf(">>>>>>>>>>>>>>>> End shadow delivery >>>>>>>>>>>>>>>>\n");
+
+    transport_count = save_count;   /* Restore original transport count */
+    }
+  }
+
+/* Cancel the expansions that were set up for the delivery. */
+
+deliver_set_expansions(NULL);
+
+/* If the transport was parallelism-limited, decrement the hints DB record. */
+
+if (serialize_key) enq_end(serialize_key);
+
+/* Now we can process the results of the real transport. We must take each
+address off the chain first, because post_process_one() puts it on another
+chain. */
+
+deliver_msglog_hold(TRUE);
+for (addr2 = addr; addr2; addr2 = nextaddr)
+  {
+  int result = addr2->transport_return;
+  nextaddr = addr2->next;
+
+  DEBUG(D_deliver|D_transport)
+    debug_printf("%s transport returned %s for %s\n",
+      tp->name, rc_to_string(result), addr2->address);
+
+  /* If there is a retry_record, or if delivery is deferred, build a retry
+  item for setting a new retry time or deleting the old retry record from
+  the database. These items are handled all together after all addresses
+  have been handled (so the database is open just for a short time for
+  updating). */
+
+  if (result == DEFER || testflag(addr2, af_lt_retry_exists))
+    {
+    int flags = result == DEFER ? 0 : rf_delete;
+    uschar *retry_key = string_copy(tp->retry_use_local_part
+      ? addr2->address_retry_key : addr2->domain_retry_key);
+    *retry_key = 'T';
+    retry_add_item(addr2, retry_key, flags);
+    }
+
+  /* Done with this address */
+
+  addr2->delivery_time = deliver_time;
+  post_process_one(addr2, result, logflags, EXIM_DTYPE_TRANSPORT, logchar);
+
+  /* If a pipe delivery generated text to be sent back, the result may be
+  changed to FAIL, and we must copy this for subsequent addresses in the
+  batch. */
+
+  if (addr2->transport_return != result)
+    {
+    for (addr3 = nextaddr; addr3; addr3 = addr3->next)
+      {
+      addr3->transport_return = addr2->transport_return;
+      addr3->basic_errno = addr2->basic_errno;
+      addr3->message = addr2->message;
+      }
+    result = addr2->transport_return;
+    }
+
+  /* Whether or not the result was changed to FAIL, we need to copy the
+  return_file value from the first address into all the addresses of the
+  batch, so they are all listed in the error message. */
+
+  addr2->return_file = addr->return_file;
+
+  /* Change log character for recording successful deliveries. */
+
+  if (result == OK) logchar = '-';
+  }
+deliver_msglog_hold(FALSE);
+}
+
+
+
+/*************************************************
+*    Wait for a parallel local delivery to end   *
+*************************************************/
+
+/* A delivery subprocess writes its results down the pipe only once the
+transport has finished, so a readable pipe means a delivery that is done or
+nearly so, and reading all of the results from it will not wait for long.
+The globals that the serial code would still have set from the start of the
+delivery are put back before the results are processed.
+
+Arguments:   none
+Returns:     nothing
+*/
+
+static void
+local_par_reap(void)
+{
+lpardata * lp = NULL;
+
+while (!lp)
+  {
+  for (int i = 0; i < local_max_parallel; i++)
+    {
+    lparpoll[i].fd = lparlist[i].pid ? lparlist[i].fd : -1;
+    lparpoll[i].events = POLLIN;
+    }
+
+  if (poll(lparpoll, local_max_parallel, 60 * 1000) > 0)
+    for (int i = 0; i < local_max_parallel; i++)
+      if (lparlist[i].pid && lparpoll[i].revents)
+	{ lp = lparlist + i; break; }
+  }
+
+DEBUG(D_deliver) debug_printf("local delivery process %d done\n", (int)lp->pid);
+
+used_return_path = lp->return_path;
+f.disable_logging = lp->tp->disable_logging;
+deliver_set_expansions(lp->addr);
+
+deliver_local_finish(lp->addr, lp->tp, FALSE, lp->pid, lp->fd);
+local_post_process(lp->addr, lp->tp, lp->serialize_key, lp->logflags,
+  &lp->delivery_start);
+
+lp->pid = 0;
+lparcount--;
+}
+
+
+
+/*************************************************
+*              Do local deliveries               *
+*************************************************/
+
+/* This function processes the list of addresses in addr_local. True local
+deliveries are always done one address at a time. However, local deliveries can
+be batched up in some cases. Typically this is when writing batched SMTP output
+files for use by some external transport mechanism, or when running local
+deliveries over LMTP.
+
+With local_max_parallel greater than one, that many delivery subprocesses may
+be running at once; their results are collected by local_par_reap() as they
+end.
+
+Arguments:   None
+Returns:     Nothing
+*/
+
+static void
+do_local_deliveries(void)
+{
+open_db dbblock;
+open_db *dbm_file = NULL;
+time_t now = time(NULL);
+
+if (local_max_parallel > 1 && !lparlist)
+  {
+  lparlist = store_get(local_max_parallel * sizeof(lpardata), GET_UNTAINTED);
+  for (int i = 0; i < local_max_parallel; i++)
+    lparlist[i].pid = 0;
+  lparpoll = store_get(local_max_parallel * sizeof(struct pollfd), GET_UNTAINTED);
+  }
+
+/* Loop until we have exhausted the supply of local deliveries */
+
+while (addr_local)
+  {
+  struct timeval delivery_start;
+  address_item *addr2, *addr3;
+  int logflags = LOG_MAIN;
+  transport_instance *tp;
+  uschar * serialize_key = NULL;
+  address_item *addr;
+
+  /* If all the parallel delivery slots are busy, wait for one to be free */
+
+  while (lparcount >= local_max_parallel) local_par_reap();
+
+  /* Pick the first undelivered address off the chain */
+
+  addr = addr_local;
+  addr_local = addr->next;
+  addr->next = NULL;
+
+  DEBUG(D_deliver|D_transport)
+    debug_printf("--------> %s <--------\n", addr->address);
+
+  /* An internal disaster if there is no transport. Should not occur! */
+
+  if (!(tp = addr->transport))
+    {
+    logflags |= LOG_PANIC;
+    f.disable_logging = FALSE;  /* Jic */
+    addr->message = addr->router
+      ? string_sprintf("No transport set by %s router", addr->router->name)
+      : US"No transport set by system filter";
+    post_process_one(addr, DEFER, logflags, EXIM_DTYPE_TRANSPORT, 0);
+    continue;
+    }
+
+  /* Check that this base address hasn't previously been delivered to this
+  transport. The check is necessary at this point to handle homonymic addresses
+  correctly in cases where the pattern of redirection changes between delivery
+  attempts. Non-homonymic previous delivery is detected earlier, at routing
+  time. */
+
+  if (testflag(addr, af_homonym))
+    while (lparcount > 0) local_par_reap();
+  if (previously_transported(addr, FALSE)) continue;
 
   /* There are weird cases where logging is disabled */
 
@@ -3001,163 +3707,46 @@ while (addr_local)
   deliver_set_expansions(addr);
 
   gettimeofday(&delivery_start, NULL);
-  deliver_local(addr, FALSE);
-  timesince(&deliver_time, &delivery_start);
-
-  /* If a shadow transport (which must perforce be another local transport), is
-  defined, and its condition is met, we must pass the message to the shadow
-  too, but only those addresses that succeeded. We do this by making a new
-  chain of addresses - also to keep the original chain uncontaminated. We must
-  use a chain rather than doing it one by one, because the shadow transport may
-  batch.
-
-  NOTE: if the condition fails because of a lookup defer, there is nothing we
-  can do! */
-
-  if (  tp->shadow
-     && (  !tp->shadow_condition
-        || expand_check_condition(tp->shadow_condition, tp->name, US"transport")
-     )  )
-    {
-    transport_instance *stp;
-    address_item *shadow_addr = NULL;
-    address_item **last = &shadow_addr;
-
-    for (stp = transports; stp; stp = stp->next)
-      if (Ustrcmp(stp->name, tp->shadow) == 0) break;
-
-    if (!stp)
-      log_write(0, LOG_MAIN|LOG_PANIC, "shadow transport \"%s\" not found ",
-        tp->shadow);
-
-    /* Pick off the addresses that have succeeded, and make clones. Put into
-    the shadow_message field a pointer to the shadow_message field of the real
-    address. */
-
-    else for (addr2 = addr; addr2; addr2 = addr2->next)
-      if (addr2->transport_return == OK)
-	{
-	addr3 = store_get(sizeof(address_item), GET_UNTAINTED);
-	*addr3 = *addr2;
-	addr3->next = NULL;
-	addr3->shadow_message = US &addr2->shadow_message;
-	addr3->transport = stp;
-	addr3->transport_return = DEFER;
-	addr3->return_filename = NULL;
-	addr3->return_file = -1;
-	*last = addr3;
-	last = &addr3->next;
-	}
-
-    /* If we found any addresses to shadow, run the delivery, and stick any
-    message back into the shadow_message field in the original. */
-
-    if (shadow_addr)
-      {
-      int save_count = transport_count;
-
-      DEBUG(D_deliver|D_transport)
-        debug_printf(">>>>>>>>>>>>>>>> Shadow delivery >>>>>>>>>>>>>>>>\n");
-      deliver_local(shadow_addr, TRUE);
-
-      for(; shadow_addr; shadow_addr = shadow_addr->next)
-        {
-        int sresult = shadow_addr->transport_return;
-        *(uschar **)shadow_addr->shadow_message =
-	  sresult == OK
-	  ? string_sprintf(" ST=%s", stp->name)
-	  : string_sprintf(" ST=%s (%s%s%s)", stp->name,
-	      shadow_addr->basic_errno <= 0
-	      ? US""
-	      : US strerror(shadow_addr->basic_errno),
-	      shadow_addr->basic_errno <= 0 || !shadow_addr->message
-	      ? US""
-	      : US": ",
-	      shadow_addr->message
-	      ? shadow_addr->message
-	      : shadow_addr->basic_errno <= 0
-	      ? US"unknown error"
-	      : US"");
-
-        DEBUG(D_deliver|D_transport)
-          debug_printf("%s shadow transport returned %s for %s\n",
-            stp->name, rc_to_string(sresult), shadow_addr->address);
-        }
-
-      DEBUG(D_deliver|D_transport)
-        debug_printf(">>>>>>>>>>>>>>>> End shadow delivery >>>>>>>>>>>>>>>>\n");
-
-      transport_count = save_count;   /* Restore original transport count */
-      }
-    }
-
-  /* Cancel the expansions that were set up for the delivery. */
 
-  deliver_set_expansions(NULL);
+  /* For parallel deliveries, a subprocess that is started is left running
+  and its results are dealt with when it ends. */
 
-  /* If the transport was parallelism-limited, decrement the hints DB record. */
-
-  if (serialize_key) enq_end(serialize_key);
-
-  /* Now we can process the results of the real transport. We must take each
-  address off the chain first, because post_process_one() puts it on another
-  chain. */
-
-  for (addr2 = addr; addr2; addr2 = nextaddr)
+  if (local_max_parallel > 1)
     {
-    int result = addr2->transport_return;
-    nextaddr = addr2->next;
+    int fd = -1;
+    pid_t pid = deliver_local_start(addr, FALSE, &fd);
 
-    DEBUG(D_deliver|D_transport)
-      debug_printf("%s transport returned %s for %s\n",
-        tp->name, rc_to_string(result), addr2->address);
-
-    /* If there is a retry_record, or if delivery is deferred, build a retry
-    item for setting a new retry time or deleting the old retry record from
-    the database. These items are handled all together after all addresses
-    have been handled (so the database is open just for a short time for
-    updating). */
-
-    if (result == DEFER || testflag(addr2, af_lt_retry_exists))
+    if (pid > 0)
       {
-      int flags = result == DEFER ? 0 : rf_delete;
-      uschar *retry_key = string_copy(tp->retry_use_local_part
-	? addr2->address_retry_key : addr2->domain_retry_key);
-      *retry_key = 'T';
-      retry_add_item(addr2, retry_key, flags);
-      }
-
-    /* Done with this address */
-
-    addr2->delivery_time = deliver_time;
-    post_process_one(addr2, result, logflags, EXIM_DTYPE_TRANSPORT, logchar);
-
-    /* If a pipe delivery generated text to be sent back, the result may be
-    changed to FAIL, and we must copy this for subsequent addresses in the
-    batch. */
-
-    if (addr2->transport_return != result)
-      {
-      for (addr3 = nextaddr; addr3; addr3 = addr3->next)
-        {
-        addr3->transport_return = addr2->transport_return;
-        addr3->basic_errno = addr2->basic_errno;
-        addr3->message = addr2->message;
-        }
-      result = addr2->transport_return;
+      lpardata * lp = lparlist;
+      while (lp->pid) lp++;
+      lp->addr = addr;
+      lp->tp = tp;
+      lp->pid = pid;
+      lp->fd = fd;
+      lp->logflags = logflags;
+      lp->serialize_key = serialize_key;
+      lp->return_path = used_return_path;
+      lp->delivery_start = delivery_start;
+      lparcount++;
+      DEBUG(D_deliver) debug_printf("local delivery process %d started\n",
+	(int)pid);
+      deliver_set_expansions(NULL);
+      continue;
       }
+    if (pid == 0) deliver_local_finish(addr, tp, FALSE, pid, fd);
+    }
+  else
+    deliver_local(addr, FALSE);
 
-    /* Whether or not the result was changed to FAIL, we need to copy the
-    return_file value from the first address into all the addresses of the
-    batch, so they are all listed in the error message. */
+  local_post_process(addr, tp, serialize_key, logflags, &delivery_start);
+  }        /* Loop back for next batch of addresses */
 
-    addr2->return_file = addr->return_file;
+while (lparcount > 0) local_par_reap();
 
-    /* Change log character for recording successful deliveries. */
+/* One sync covers the journal entries of all the in-process deliveries. */
 
-    if (result == OK) logchar = '-';
-    }
-  }        /* Loop back for next batch of addresses */
+if (journal_sync_pending) journal_sync();
 }
 
 
@@ -3764,6 +4353,7 @@ for (host_item * h = addr->host_list; h; h = h->next)
 /* Now handle each address on the chain. The transport has placed '=' or '-'
 into the special_action field for each successful delivery. */
 
+deliver_msglog_hold(TRUE);
 while (addr)
   {
   address_item * next = addr->next;
@@ -3802,6 +4392,7 @@ while (addr)
 
   addr = next;
   }
+deliver_msglog_hold(FALSE);
 
 /* If we have just delivered down a passed SMTP channel, and that was
 the last address, the channel will have been closed down. Now that
@@ -4334,13 +4925,23 @@ So look out for the place it gets used.
   one address at a time to the transport, in order to be able to use
   $local_part and $domain in constructing a new return path. We could test for
   the use of these variables, but as it is so likely they will be used when the
-  maximum is 1, we don't bother. Just leave the value alone. */
+  maximum is 1, we don't bother. Just leave the value alone.
 
-  if (  address_count_max != 1
-     && address_count_max < remote_delivery_count/remote_max_parallel
-     )
+  A transport can set max_rcpt_parallel to say how many connections it wants
+  the addresses shared over, instead of remote_max_parallel; then the division
+  rounds up so that there are no more groups than that. The number running at
+  once is still limited by remote_max_parallel. */
+
+  {
+  int parallel = tp->max_rcpt_parallel > 0
+    ? tp->max_rcpt_parallel : remote_max_parallel;
+  int share = tp->max_rcpt_parallel > 0
+    ? (remote_delivery_count + parallel - 1)/parallel
+    : remote_delivery_count/parallel;
+
+  if (address_count_max != 1 && address_count_max < share)
     {
-    int new_max = remote_delivery_count/remote_max_parallel;
+    int new_max = share;
     int message_max = tp->connection_max_messages;
     if (connection_max_messages >= 0) message_max = connection_max_messages;
     message_max -= continue_sequence - 1;
@@ -4348,6 +4949,7 @@ So look out for the place it gets used.
       new_max = address_count_max * message_max;
     address_count_max = new_max;
     }
+  }
 
   /************************************************************************/
 
@@ -4683,6 +5285,7 @@ all pipes, so I do not see a reason to use non-blocking IO here
     SMTP connection. */
 
     (void)fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+    remote_result_fd = fd;
 
     /* Close open file descriptors for the pipes of other processes
     that are running in parallel. */
@@ -5470,12 +6073,14 @@ while ((addr = *anchor))
     {
     anchor = &(addr->next);
     }
-  else if ((tnode = tree_search(tree_duplicates, addr->unique)))
+  else if ((tnode = hset_search(&hset_duplicates, addr->unique)))
     {
     DEBUG(D_deliver|D_route)
       debug_printf("%s is a duplicate address: discarded\n", addr->unique);
     *anchor = addr->next;
     addr->dupof = tnode->data.ptr;
+    addr->dupnext = addr->dupof->dups;
+    addr->dupof->dups = addr;
     addr->next = addr_duplicate;
     addr_duplicate = addr;
     }
@@ -5572,6 +6177,81 @@ fprintf(fp, "%s\n", wrap_header(string_from_gstring(g), 79, 1023, US" ", 1));
 
 
 
+/*************************************************
+*        Hold failures for a bounce digest       *
+*************************************************/
+
+/* Called with bounce_digest_window set. The failed addresses that have the
+same errors address as the first are written in the form used for a bounce
+and offered to moan_digest_hold(). If they are held, they are marked done as
+if a bounce had been sent. Failures with text from a local transport are
+always bounced alone, as that text goes in the bounce.
+
+Argument:   logtod, for address_done()
+Returns:    TRUE if the failures were held
+*/
+
+static BOOL
+bounce_digest_hold(const uschar * logtod)
+{
+FILE * fp;
+gstring * g = NULL;
+const uschar * subject;
+address_item ** paddr;
+uschar buffer[256];
+size_t n;
+
+for (address_item * addr = addr_failed; addr; addr = addr->next)
+  if (  addr->return_file >= 0
+     && Ustrcmp(bounce_recipient, addr->prop.errors_address
+	  ? addr->prop.errors_address : sender_address) == 0)
+    return FALSE;
+
+if (!(fp = tmpfile())) return FALSE;
+
+fprintf(fp, "Message %s", message_id);
+if ((subject = expand_cstring(US"$h_subject:")) && *subject)
+  fprintf(fp, " (Subject: %s)", string_printing(subject));
+fprintf(fp, " from <%s>:\n", sender_address);
+for (address_item * addr = addr_failed; addr; addr = addr->next)
+  if (Ustrcmp(bounce_recipient, addr->prop.errors_address
+	? addr->prop.errors_address : sender_address) == 0)
+    {
+    if (print_address_information(addr, fp, US"  ", US"\n    ", US""))
+      print_address_error(addr, fp, US"");
+    fputc('\n', fp);
+    }
+fputc('\n', fp);
+
+rewind(fp);
+while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+  g = string_catn(g, buffer, n);
+(void)fclose(fp);
+
+if (!g || !moan_digest_hold(bounce_recipient, g)) return FALSE;
+
+log_write(0, LOG_MAIN, "failures held for bounce digest to %s",
+  bounce_recipient);
+
+paddr = &addr_failed;
+for (address_item * addr = addr_failed; addr; addr = *paddr)
+  if (Ustrcmp(bounce_recipient, addr->prop.errors_address
+	? addr->prop.errors_address : sender_address) == 0)
+    {
+    *paddr = addr->next;
+    address_done(addr, logtod, FALSE);
+    child_done(addr, logtod);
+    }
+  else
+    paddr = &addr->next;
+
+/* Panic-dies on error */
+(void)spool_write_header(message_id, SW_DELIVERING, NULL);
+return TRUE;
+}
+
+
+
 /*************************************************
 *              Send a bounce message             *
 *************************************************/
@@ -5590,6 +6270,12 @@ int fd;
 if (!(bounce_recipient = addr_failed->prop.errors_address))
   bounce_recipient = sender_address;
 
+/* Later failures to the same address within a window can be held back and
+sent together */
+
+if (bounce_digest_window > 0 && bounce_digest_hold(logtod))
+  return;
+
 /* Make a subprocess to send a message, using its stdin */
 
 if ((pid = child_open_exim(&fd, US"bounce-message")) < 0)
@@ -6008,7 +6694,7 @@ wording. */
     {
     for (address_item * addr = handled_addr; addr; addr = addr->next)
       {
-      address_done(addr, logtod);
+      address_done(addr, logtod, FALSE);
       child_done(addr, logtod);
       }
     /* Panic-dies on error */
@@ -6192,6 +6878,26 @@ If there's an error, don't update the count. */
 return child_close(pid, 0) == 0;
 }
 
+
+/* Find when the next delay warning for a message falls due, by the same
+reckoning as for sending one: the delay_warning times in turn, then repeats
+of the last interval. */
+
+static time_t
+deliver_next_warning(void)
+{
+int n = delay_warning[1], next = warning_count + 1, at;
+
+if (next <= n)
+  at = delay_warning[next+1];
+else
+  {
+  int last_gap = delay_warning[n+1] - (n > 1 ? delay_warning[n] : 0);
+  at = delay_warning[n+1] + last_gap * (next - n);
+  }
+return received_time.tv_sec + at;
+}
+
 /*************************************************
 *              Send a success-DSN                *
 *************************************************/
@@ -6348,6 +7054,348 @@ if (addr_senddsn)
   }
 }
 
+/*************************************************
+*      Update the journal instead of the -H      *
+*************************************************/
+
+/* Called at the end of a delivery attempt that leaves the message on the
+queue, when the -H file would otherwise be rewritten. With spool_journal_size
+set, the addresses dealt with by this attempt are appended to the journal, and
+the -H file is left alone, as long as nothing else has changed in the header
+apart from the warning count, and the journal is no bigger than the option.
+The frozen state, retry time and first-delivery flag are left out because
+queue runners read them from the -H file, which does not look at journals.
+
+Returns:    TRUE if the journal now records the changes; FALSE if the -H file
+            has to be rewritten
+*/
+
+static BOOL
+journal_update(void)
+{
+struct stat statbuf;
+gstring * g = journal_delta;
+
+if (  spool_journal_size <= 0 || journal_fd < 0 || f.header_rewritten
+   || f.deliver_firsttime != journal_base.firsttime
+   || f.deliver_freeze != journal_base.freeze
+   || f.deliver_manual_thaw != journal_base.manual_thaw
+   || deliver_frozen_at != journal_base.frozen_at
+   || deliver_retry_after != journal_base.retry_after
+   || recipients_count != journal_base.rcount)
+  return FALSE;
+
+if (warning_count != journal_base.warnings)
+  g = string_fmt_append(g, "\twarning_count %d\n", warning_count);
+
+if (  fstat(journal_fd, &statbuf) != 0
+   || statbuf.st_size + gstring_length(g) > spool_journal_size)
+  return FALSE;
+
+if (g)
+  {
+  if (write(journal_fd, g->s, g->ptr) != g->ptr)
+    {
+    log_write(0, LOG_MAIN|LOG_PANIC, "failed to update journal for %s: %s",
+      message_id, strerror(errno));
+    return FALSE;
+    }
+  journal_sync();
+  }
+
+DEBUG(D_deliver) debug_printf("journal updated instead of the header (%d bytes"
+  " added)\n", gstring_length(g));
+return journal_kept = TRUE;
+}
+
+
+
+/*************************************************
+*            Create the journal file             *
+*************************************************/
+
+/* The file is opened with O_APPEND so that several processes can write to it
+at once.
+
+Argument:    the message id
+Returns:     TRUE if the journal is open; FALSE after logging a failure
+*/
+
+static BOOL
+journal_open(const uschar * id)
+{
+uschar * fname = spool_fname(US"input", message_subdir, id, US"-J");
+
+if ((journal_fd = Uopen(fname,
+	  EXIM_CLOEXEC | O_WRONLY|O_APPEND|O_CREAT|O_EXCL, SPOOL_MODE)) < 0)
+  {
+  log_write(0, LOG_MAIN|LOG_PANIC, "Couldn't open journal file %s: %s",
+    fname, strerror(errno));
+  return FALSE;
+  }
+
+/* Set the close-on-exec flag, make the file owned by Exim, and ensure
+that the mode is correct - the group setting doesn't always seem to get
+set automatically. */
+
+if(  exim_fchown(journal_fd, exim_uid, exim_gid, fname)
+  || fchmod(journal_fd, SPOOL_MODE)
+#ifndef O_CLOEXEC
+  || fcntl(journal_fd, F_SETFD, fcntl(journal_fd, F_GETFD) | FD_CLOEXEC)
+#endif
+  )
+  {
+  int ret = Uunlink(fname);
+  log_write(0, LOG_MAIN|LOG_PANIC, "Couldn't set perms on journal file %s: %s",
+    fname, strerror(errno));
+  if(ret  &&  errno != ENOENT)
+    log_write(0, LOG_MAIN|LOG_PANIC_DIE, "failed to unlink %s: %s",
+      fname, strerror(errno));
+  (void)close(journal_fd);
+  journal_fd = -1;
+  return FALSE;
+  }
+return TRUE;
+}
+
+
+
+/*************************************************
+*        Split a delivery across processes       *
+*************************************************/
+
+/* The shard for a recipient, from a hash of its domain */
+
+static int
+deliver_shard_of(const uschar * address)
+{
+const uschar * s = Ustrrchr(address, '@');
+unsigned h = 0;
+
+for (s = s ? s+1 : address; *s; s++) h = h * 33 + tolower(*s);
+return h % deliver_shards;
+}
+
+
+
+/* When a message has at least deliver_shards_threshold recipients still to be
+delivered, the recipients are shared among deliver_shards subprocesses, each
+of which routes and delivers those whose domains hash to it, so keeping the
+recipients of a domain together for the transports. A shard does its own
+retry updates and failure reports, then records in the journal every address
+it has finished with before exiting. The caller waits for all the shards,
+takes their work from the journal, and either completes the message or
+updates the spool header for the next attempt and leaves it on the queue.
+
+Delay warnings are not sent for a message handled this way, as no one
+process knows about all the deferred addresses.
+
+Arguments:    id     the message id
+Returns:      TRUE in the original process, when the shards are done;
+              FALSE in a shard (shard_index is then set), or if the message
+              should not be split
+*/
+
+static BOOL
+deliver_shards_run(const uschar * id)
+{
+pid_t * pids;
+int undone = 0;
+FILE * jread;
+
+for (int i = 0; i < recipients_count; i++)
+  if (!tree_search_nonrecipient(recipients_list[i].address))
+    undone++;
+if (undone < deliver_shards_threshold) return FALSE;
+
+if (journal_fd < 0 && !journal_open(id)) return FALSE;
+
+DEBUG(D_deliver) debug_printf("splitting %d recipients over %d delivery shards\n",
+  undone, deliver_shards);
+
+search_tidyup();
+pids = store_get(deliver_shards * sizeof(pid_t), GET_UNTAINTED);
+for (int i = 0; i < deliver_shards; i++)
+  if ((pids[i] = exim_fork(US"delivery-shard")) == 0)
+    {
+    shard_index = i;
+    set_process_info("delivering %s (shard %d)", id, i);
+    return FALSE;
+    }
+  else if (pids[i] < 0)
+    log_write(0, LOG_MAIN|LOG_PANIC, "fork failed for delivery shard %d of %s",
+      i, id);
+
+for (int i = 0; i < deliver_shards; i++) if (pids[i] > 0)
+  {
+  int status;
+  pid_t rc;
+
+  while ((rc = waitpid(pids[i], &status, 0)) < 0 && errno == EINTR) ;
+  if (rc == pids[i] && status != 0)
+    log_write(0, LOG_MAIN|LOG_PANIC, "delivery shard %d of %s ended with "
+      "status 0x%04x", i, id, status);
+  }
+
+/* Pick up what the shards did from the journal */
+
+if ((jread = Ufopen(spool_fname(US"input", message_subdir, id, US"-J"), "rb")))
+  {
+  while (Ufgets(big_buffer, big_buffer_size, jread))
+    {
+    int n = Ustrlen(big_buffer);
+    if (n > 0 && big_buffer[n-1] == '\n') big_buffer[n-1] = 0;
+    journal_line(big_buffer);
+    }
+  (void)fclose(jread);
+  }
+else
+  log_write(0, LOG_MAIN|LOG_PANIC, "failed to read journal for %s: %s",
+    id, strerror(errno));
+
+undone = 0;
+for (int i = 0; i < recipients_count; i++)
+  if (!tree_search_nonrecipient(recipients_list[i].address))
+    undone++;
+
+DEBUG(D_deliver) debug_printf("delivery shards done: %d recipients left\n",
+  undone);
+
+if (undone == 0)
+  addr_defer = NULL;
+else
+  {
+  addr_defer = (address_item *)(+1);	/* keep the message; no warning */
+  if (f.deliver_firsttime && !f.queue_2stage) f.deliver_firsttime = FALSE;
+  /* Panic-dies on error */
+  (void)spool_write_header(message_id, SW_DELIVERING, NULL);
+  }
+return TRUE;
+}
+
+
+/* Called in a shard when its deliveries and failure reports are done. Every
+address it has dealt with is written to the journal for the original process
+to pick up. */
+
+static void
+shard_journal_entry(uschar * name, uschar * val, void * ctx)
+{
+uschar * s = string_sprintf("%s\n", name);
+int len = Ustrlen(s);
+
+if (write(journal_fd, s, len) != len)
+  log_write(0, LOG_MAIN|LOG_PANIC, "failed to update journal for %s: %s",
+    name, strerror(errno));
+}
+
+static void
+deliver_shard_end(void)
+{
+DEBUG(D_deliver) debug_printf("delivery shard %d done\n", shard_index);
+if (journal_fd >= 0)
+  {
+  tree_walk(tree_nonrecipients, shard_journal_entry, NULL);
+  journal_sync();
+  }
+exim_exit(EXIT_SUCCESS);
+}
+
+
+
+
+/*************************************************
+*     Remember and reuse same-domain routing      *
+*************************************************/
+
+/* When a router with same_domain_copy_routing set routes an address to a
+remote transport, the result is kept for the rest of the delivery, keyed by
+domain. Any later address with the same domain, whether an original recipient
+or one generated by a redirection in a later routing pass, is given the same
+routing instead of running the routers again. Because the copy bypasses all
+the routers, the address must start routing at the same place and carry the
+same errors address as the one that was routed, and have no header changes
+of its own.
+
+The errors address is remembered as it was before routing, because the router
+might have replaced it. */
+
+typedef struct routing_copy {
+  address_item *	addr;		/* the address that was routed */
+  router_instance *	start_router;	/* where its routing began */
+  const uschar *	errors_address;	/* before routing */
+} routing_copy;
+
+static void
+routing_copy_remember(address_item * addr, router_instance * start_router,
+  const uschar * errors_address)
+{
+rmark rpoint = store_mark();
+tree_node * node = store_get(sizeof(tree_node) + Ustrlen(addr->domain),
+				addr->domain);
+routing_copy * rc = store_get(sizeof(routing_copy), GET_UNTAINTED);
+
+rc->addr = addr;
+rc->start_router = start_router;
+rc->errors_address = errors_address;
+Ustrcpy(node->name, addr->domain);
+node->data.ptr = rc;
+if (!tree_insertnode(&tree_copy_routing, node)) store_reset(rpoint);
+}
+
+
+/* Look for remembered routing that can be copied to an address, and if found
+copy it, and put the address on the remote delivery chain.
+
+Argument:   the address, not yet routed
+Returns:    TRUE if the routing was copied
+*/
+
+static BOOL
+routing_copy_apply(address_item * addr)
+{
+tree_node * node;
+routing_copy * rc;
+address_item * from;
+
+if (  !tree_copy_routing
+   || addr->prop.extra_headers || addr->prop.remove_headers
+   || !(node = tree_search(tree_copy_routing, addr->domain))
+   )
+  return FALSE;
+
+rc = node->data.ptr;
+if (  addr->start_router != rc->start_router
+   || (addr->prop.errors_address
+      ? !rc->errors_address
+        || Ustrcmp(addr->prop.errors_address, rc->errors_address) != 0
+      : rc->errors_address != NULL)
+   )
+  return FALSE;
+
+from = rc->addr;
+addr->router = from->router;
+addr->transport = from->transport;
+addr->host_list = from->host_list;
+addr->fallback_hosts = from->fallback_hosts;
+addr->prop.errors_address = from->prop.errors_address;
+copyflag(addr, from, af_hide_child);
+copyflag(addr, from, af_local_host_removed);
+
+addr->next = addr_remote;
+addr_remote = addr;
+
+DEBUG(D_deliver|D_route)
+  debug_printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>\n"
+	       "routing %s\n"
+	       "Routing for %s copied from %s\n",
+    addr->address, addr->address, from->address);
+return TRUE;
+}
+
+
+
+
 /*************************************************
 *              Deliver one message               *
 *************************************************/
@@ -6414,6 +7462,7 @@ information. If not, we want to show this initial information if D_deliver or
 D_queue_run is set or in verbose mode. */
 
 set_process_info("%s", info);
+trace_event(TRACE_DELIVER_MSG, forced, give_up, queue_run_pid != (pid_t)0);
 
 if (  !(debug_selector & D_process_info)
    && (debug_selector & (D_deliver|D_queue_run|D_v))
@@ -6455,6 +7504,8 @@ message_size = 0;
 
 update_spool = FALSE;
 remove_journal = TRUE;
+journal_unfolded = journal_kept = FALSE;
+journal_delta = NULL;
 
 /* Set a known context for any ACLs we call via expansions */
 acl_where = ACL_WHERE_DELIVERY;
@@ -6520,6 +7571,7 @@ give up; if the message has been around for sufficiently long, remove it. */
       Uunlink(spool_fname(US"input", message_subdir, id, US"-D"));
       Uunlink(spool_fname(US"input", message_subdir, id, US"-H"));
       Uunlink(spool_fname(US"input", message_subdir, id, US"-J"));
+      Uunlink(spool_fname(US"input", message_subdir, id, US"-L"));
       log_write(0, LOG_MAIN, "Message removed because older than %s",
 	readconf_printtime(keep_malformed));
       }
@@ -6532,12 +7584,14 @@ give up; if the message has been around for sufficiently long, remove it. */
 
 /* The spool header file has been read. Look to see if there is an existing
 journal file for this message. If there is, it means that a previous delivery
-attempt crashed (program or host) before it could update the spool header file.
-Read the list of delivered addresses from the journal and add them to the
-nonrecipients tree. Then update the spool file. We can leave the journal in
-existence, as it will get further successful deliveries added to it in this
-run, and it will be deleted if this function gets to its end successfully.
-Otherwise it might be needed again. */
+attempt crashed (program or host) before it could update the spool header file,
+or, with spool_journal_size set, that earlier attempts left their updates in
+the journal instead of rewriting the header. Read the list of delivered
+addresses from the journal and add them to the nonrecipients tree. Then update
+the spool file, unless the journal is still small enough to stand in for that.
+We can leave the journal in existence, as it will get further successful
+deliveries added to it in this run, and it will be deleted if this function
+gets to its end successfully. Otherwise it might be needed again. */
 
   {
   uschar * fname = spool_fname(US"input", message_subdir, id, US"-J");
@@ -6549,11 +7603,13 @@ Otherwise it might be needed again. */
      && (jread = fdopen(journal_fd, "rb"))
      )
     {
+    struct stat statbuf;
+
     while (Ufgets(big_buffer, big_buffer_size, jread))
       {
       int n = Ustrlen(big_buffer);
       big_buffer[n-1] = 0;
-      tree_add_nonrecipient(big_buffer);
+      journal_line(big_buffer);
       DEBUG(D_deliver) debug_printf("Previously delivered address %s taken from "
 	"journal file\n", big_buffer);
       }
@@ -6563,8 +7619,17 @@ Otherwise it might be needed again. */
     else
       (void) fclose(jread);	/* Try to not leak the FILE resource */
 
-    /* Panic-dies on error */
-    (void)spool_write_header(message_id, SW_DELIVERING, NULL);
+    if (  spool_journal_size > 0
+       && fstat(journal_fd, &statbuf) == 0
+       && statbuf.st_size <= spool_journal_size)
+      {
+      DEBUG(D_deliver) debug_printf("journal (" OFF_T_FMT " bytes) left to "
+	"stand in for the header\n", statbuf.st_size);
+      journal_unfolded = TRUE;
+      }
+    else
+      /* Panic-dies on error */
+      (void)spool_write_header(message_id, SW_DELIVERING, NULL);
     }
   else if (errno != ENOENT)
     {
@@ -6584,6 +7649,16 @@ Otherwise it might be needed again. */
     }
   }
 
+/* Remember the state that journal_update() cannot record. */
+
+journal_base.firsttime = f.deliver_firsttime;
+journal_base.freeze = f.deliver_freeze;
+journal_base.manual_thaw = f.deliver_manual_thaw;
+journal_base.frozen_at = deliver_frozen_at;
+journal_base.retry_after = deliver_retry_after;
+journal_base.rcount = recipients_count;
+journal_base.warnings = warning_count;
+
 
 /* Handle a message that is frozen. There are a number of different things that
 can happen, but in the default situation, unless forced, no delivery is
@@ -6663,28 +7738,56 @@ if (f.deliver_freeze)
 /* Open the message log file if we are using them. This records details of
 deliveries, deferments, and failures for the benefit of the mail administrator.
 The log is not used by exim itself to track the progress of a message; that is
-done by rewriting the header spool file. */
+done by rewriting the header spool file.
 
+With message_logs_lazy, a message that has no log file yet (normally one on
+its first delivery attempt) has its lines kept in memory, unless debugging. */
+
+msglog_mem_drop();
 if (message_logs)
   {
   uschar * fname = spool_fname(US"msglog", message_subdir, id, US"");
   uschar * error;
-  int fd;
+  int fd = -1;
 
-  if ((fd = open_msglog_file(fname, SPOOL_MODE, &error)) < 0)
+  if (  message_logs_lazy && !debug_selector
+     && (fd = Uopen(fname, EXIM_CLOEXEC | EXIM_NOFOLLOW | O_WRONLY|O_APPEND,
+		    0)) < 0
+     && errno == ENOENT)
     {
-    log_write(0, LOG_MAIN|LOG_PANIC, "Couldn't %s message log %s: %s", error,
-      fname, strerror(errno));
-    return continue_closedown();   /* yields DELIVER_NOT_ATTEMPTED */
+    msglog_mem.active = TRUE;
+    msglog_mem.pid = getpid();
+    message_log = NULL;
+    }
+  else
+    {
+    if (fd < 0 && (fd = open_msglog_file(fname, SPOOL_MODE, &error)) < 0)
+      {
+      log_write(0, LOG_MAIN|LOG_PANIC, "Couldn't %s message log %s: %s", error,
+	fname, strerror(errno));
+      return continue_closedown();   /* yields DELIVER_NOT_ATTEMPTED */
+      }
+
+    /* Make a stdio stream out of it. */
+
+    if (!(message_log = fdopen(fd, "a")))
+      {
+      log_write(0, LOG_MAIN|LOG_PANIC, "Couldn't fdopen message log %s: %s",
+	fname, strerror(errno));
+      return continue_closedown();   /* yields DELIVER_NOT_ATTEMPTED */
+      }
     }
+  }
 
-  /* Make a stdio stream out of it. */
+/* A message received lazily by this process has its reception lines held;
+they go first. */
 
-  if (!(message_log = fdopen(fd, "a")))
+  {
+  uschar * held = receive_msglog_take(id);
+  if (held)
     {
-    log_write(0, LOG_MAIN|LOG_PANIC, "Couldn't fdopen message log %s: %s",
-      fname, strerror(errno));
-    return continue_closedown();   /* yields DELIVER_NOT_ATTEMPTED */
+    deliver_msglog("%s", held);
+    store_free(held);
     }
   }
 
@@ -7007,11 +8110,29 @@ option is used to fail all of them.
 Duplicate addresses are handled later by a different tree structure; we can't
 just extend the non-recipients tree, because that will be re-written to the
 spool if the message is deferred, and in any case there are casing
-complications for local addresses. */
+complications for local addresses.
+
+With deliver_shards set, a message with many recipients may be split here over
+several processes. Each takes only its share of the recipients; any addresses
+already set up by the system filter go to the first. */
+
+if (  deliver_shards > 1
+   && process_recipients == RECIP_ACCEPT
+   && !mua_wrapper && !continue_hostname
+   )
+  {
+  if (deliver_shards_run(id))
+    goto DELIVERY_TIDYUP;
+  if (shard_index > 0)
+    addr_new = addr_last = NULL;
+  }
 
 if (process_recipients != RECIP_IGNORE)
   for (i = 0; i < recipients_count; i++)
-    if (!tree_search(tree_nonrecipients, recipients_list[i].address))
+    if (  !tree_search_nonrecipient(recipients_list[i].address)
+       && (  shard_index < 0
+	  || deliver_shard_of(recipients_list[i].address) == shard_index
+       )  )
       {
       recipient_item * r = recipients_list + i;
       address_item * new = deliver_make_addr(r->address, FALSE);
@@ -7221,6 +8342,18 @@ while (addr_new)           /* Loop until all addresses dealt with */
       debug_printf("Considering: %s\n", addr->address);
       }
 
+    /* A process whose pool store has passed the soft limit takes on no more
+    routing work; the remaining addresses are deferred for a later run, which
+    starts with fresh pools. */
+
+    if (!testflag(addr, af_pfr) && store_over_soft_limit())
+      {
+      addr->basic_errno = ERRNO_MEMLIMIT;
+      addr->message = US"pool store is over store_soft_limit";
+      (void)post_process_one(addr, DEFER, LOG_MAIN, EXIM_DTYPE_ROUTER, 0);
+      continue;
+      }
+
     /* Handle generated address that is a pipe or a file or an autoreply. */
 
     if (testflag(addr, af_pfr))
@@ -7259,14 +8392,16 @@ while (addr_new)           /* Loop until all addresses dealt with */
       keep piling '>' characters on the front. */
 
       if (addr->address[0] == '>')
-        while (tree_search(tree_duplicates, addr->unique))
+        while (hset_search(&hset_duplicates, addr->unique))
           addr->unique = string_sprintf(">%s", addr->unique);
 
-      else if ((tnode = tree_search(tree_duplicates, addr->unique)))
+      else if ((tnode = hset_search(&hset_duplicates, addr->unique)))
         {
         DEBUG(D_deliver|D_route)
           debug_printf("%s is a duplicate address: discarded\n", addr->address);
         addr->dupof = tnode->data.ptr;
+        addr->dupnext = addr->dupof->dups;
+        addr->dupof->dups = addr;
         addr->next = addr_duplicate;
         addr_duplicate = addr;
         continue;
@@ -7276,7 +8411,7 @@ while (addr_new)           /* Loop until all addresses dealt with */
 
       /* Check for previous delivery */
 
-      if (tree_search(tree_nonrecipients, addr->unique))
+      if (tree_search_nonrecipient(addr->unique))
         {
         DEBUG(D_deliver|D_route)
           debug_printf("%s was previously delivered: discarded\n", addr->address);
@@ -7431,7 +8566,7 @@ while (addr_new)           /* Loop until all addresses dealt with */
 
     DEBUG(D_deliver|D_route) debug_printf("unique = %s\n", addr->unique);
 
-    if (tree_search(tree_nonrecipients, addr->unique))
+    if (tree_search_nonrecipient(addr->unique))
       {
       DEBUG(D_deliver|D_route)
         debug_printf("%s was previously delivered: discarded\n", addr->unique);
@@ -7657,6 +8792,9 @@ while (addr_new)           /* Loop until all addresses dealt with */
     address_item *addr = addr_route;
     const uschar *old_domain = addr->domain;
     uschar *old_unique = addr->unique;
+    router_instance *old_start_router = addr->start_router;
+    const uschar *old_errors_address = addr->prop.errors_address;
+    BOOL copied;
     addr_route = addr->next;
     addr->next = NULL;
 
@@ -7665,11 +8803,18 @@ while (addr_new)           /* Loop until all addresses dealt with */
     if (!(return_path = addr->prop.errors_address))
       return_path = sender_address;
 
-    /* If a router defers an address, add a retry item. Whether or not to
-    use the local part in the key is a property of the router. */
+    /* Use routing remembered from an earlier address with the same domain,
+if there is some that fits; otherwise run the routers. If a router defers an
+address, add a retry item. Whether or not to use the local part in the key is
+a property of the router. */
 
-    if ((rc = route_address(addr, &addr_local, &addr_remote, &addr_new,
-         &addr_succeed, v_none)) == DEFER)
+    if ((copied = routing_copy_apply(addr)))
+      rc = OK;
+    else
+      rc = route_address(addr, &addr_local, &addr_remote, &addr_new,
+	&addr_succeed, v_none);
+
+    if (rc == DEFER)
       retry_add_item(addr,
         addr->router->retry_use_local_part
 	  ? string_sprintf("R:%s@%s", addr->local_part, addr->domain)
@@ -7699,7 +8844,7 @@ while (addr_new)           /* Loop until all addresses dealt with */
 
     if (rc == DISCARD)
       {
-      address_done(addr, tod_stamp(tod_log));
+      address_done(addr, tod_stamp(tod_log), FALSE);
       continue;  /* route next address */
       }
 
@@ -7717,7 +8862,7 @@ while (addr_new)           /* Loop until all addresses dealt with */
     gets recorded. */
 
     if (  addr->unique != old_unique
-       && tree_search(tree_nonrecipients, addr->unique) != 0
+       && tree_search_nonrecipient(addr->unique) != 0
        )
       {
       DEBUG(D_deliver|D_route) debug_printf("%s was previously delivered: "
@@ -7732,50 +8877,17 @@ while (addr_new)           /* Loop until all addresses dealt with */
     routing. The option is settable only on routers that generate host lists.
     We play it very safe, and do the optimization only if the address is routed
     to a remote transport, there are no header changes, and the domain was not
-    modified by the router. */
+    modified by the router. The routing is remembered for the rest of this
+    delivery, and copied when each later address is taken for routing. */
 
-    if (  addr_remote == addr
+    if (  !copied
+       && addr_remote == addr
        && addr->router->same_domain_copy_routing
        && !addr->prop.extra_headers
        && !addr->prop.remove_headers
        && old_domain == addr->domain
        )
-      {
-      address_item **chain = &addr_route;
-      while (*chain)
-        {
-        address_item *addr2 = *chain;
-        if (Ustrcmp(addr2->domain, addr->domain) != 0)
-          {
-          chain = &(addr2->next);
-          continue;
-          }
-
-        /* Found a suitable address; take it off the routing list and add it to
-        the remote delivery list. */
-
-        *chain = addr2->next;
-        addr2->next = addr_remote;
-        addr_remote = addr2;
-
-        /* Copy the routing data */
-
-        addr2->domain = addr->domain;
-        addr2->router = addr->router;
-        addr2->transport = addr->transport;
-        addr2->host_list = addr->host_list;
-        addr2->fallback_hosts = addr->fallback_hosts;
-        addr2->prop.errors_address = addr->prop.errors_address;
-        copyflag(addr2, addr, af_hide_child);
-        copyflag(addr2, addr, af_local_host_removed);
-
-        DEBUG(D_deliver|D_route)
-          debug_printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>\n"
-                       "routing %s\n"
-                       "Routing for %s copied from %s\n",
-            addr2->address, addr2->address, addr->address);
-        }
-      }
+      routing_copy_remember(addr, old_start_router, old_errors_address);
     }  /* Continue with routing the next address. */
   }    /* Loop to process any child addresses that the routers created, and
           any rerouted addresses that got put back on the new chain. */
@@ -7941,40 +9053,10 @@ therein are added to the non-recipients. */
 
 if (addr_local || addr_remote)
   {
-  if (journal_fd < 0)
-    {
-    uschar * fname = spool_fname(US"input", message_subdir, id, US"-J");
-
-    if ((journal_fd = Uopen(fname,
-	      EXIM_CLOEXEC | O_WRONLY|O_APPEND|O_CREAT|O_EXCL, SPOOL_MODE)) < 0)
-      {
-      log_write(0, LOG_MAIN|LOG_PANIC, "Couldn't open journal file %s: %s",
-	fname, strerror(errno));
-      return DELIVER_NOT_ATTEMPTED;
-      }
-
-    /* Set the close-on-exec flag, make the file owned by Exim, and ensure
-    that the mode is correct - the group setting doesn't always seem to get
-    set automatically. */
-
-    if(  exim_fchown(journal_fd, exim_uid, exim_gid, fname)
-      || fchmod(journal_fd, SPOOL_MODE)
-#ifndef O_CLOEXEC
-      || fcntl(journal_fd, F_SETFD, fcntl(journal_fd, F_GETFD) | FD_CLOEXEC)
-#endif
-      )
-      {
-      int ret = Uunlink(fname);
-      log_write(0, LOG_MAIN|LOG_PANIC, "Couldn't set perms on journal file %s: %s",
-	fname, strerror(errno));
-      if(ret  &&  errno != ENOENT)
-	log_write(0, LOG_MAIN|LOG_PANIC_DIE, "failed to unlink %s: %s",
-	  fname, strerror(errno));
-      return DELIVER_NOT_ATTEMPTED;
-      }
-    }
+  if (journal_fd < 0 && !journal_open(id))
+    return DELIVER_NOT_ATTEMPTED;
   }
-else if (journal_fd >= 0)
+else if (journal_fd >= 0 && shard_index < 0)
   {
   close(journal_fd);
   journal_fd = -1;
@@ -7987,13 +9069,16 @@ deliveries are done first, then remote ones. If ever the problems of how to
 handle fallback transports are figured out, this section can be put into a loop
 for handling fallbacks, though the uid switching will have to be revised. */
 
-/* Precompile a regex that is used to recognize a parameter in response
-to an LHLO command, if is isn't already compiled. This may be used on both
+/* Precompile regexes that are used to recognize parameters in response
+to an LHLO command, if they aren't already compiled. These may be used on both
 local and remote LMTP deliveries. */
 
 if (!regex_IGNOREQUOTA)
   regex_IGNOREQUOTA =
     regex_must_compile(US"\\n250[\\s\\-]IGNOREQUOTA(\\s|\\n|$)", MCS_NOFLAGS, TRUE);
+if (!regex_PIPELINING)
+  regex_PIPELINING =
+    regex_must_compile(US"\\n250[\\s\\-]PIPELINING(\\s|\\n|$)", MCS_NOFLAGS, TRUE);
 
 /* Handle local deliveries */
 
@@ -8216,7 +9301,7 @@ while (addr_failed)
       addr->prop.ignore_error
       ? US"" : US": RFC 3461 DSN, failure notify not requested");
 
-    address_done(addr, logtod);
+    address_done(addr, logtod, FALSE);
     child_done(addr, logtod);
     /* Panic-dies on error */
     (void)spool_write_header(message_id, SW_DELIVERING, NULL);
@@ -8232,6 +9317,11 @@ while (addr_failed)
 
 f.disable_logging = FALSE;  /* In case left set */
 
+/* A delivery shard has no more to do; the process that started it looks
+after the message from here. */
+
+if (shard_index >= 0) deliver_shard_end();
+
 /* Come here from the mua_wrapper case if routing goes wrong */
 
 DELIVERY_TIDYUP:
@@ -8244,18 +9334,27 @@ if (!addr_defer)
   {
   uschar * fname;
 
-  if (message_logs)
+  /* A message log still in memory is written only if it is to be kept. */
+
+  if (message_logs && !message_log && preserve_message_logs)
+    (void) msglog_mem_write();
+
+  if (message_logs && message_log)
     {
     fname = spool_fname(US"msglog", message_subdir, id, US"");
     if (preserve_message_logs)
       {
       int rc;
-      uschar * moname = spool_fname(US"msglog.OLD", US"", id, US"");
+      /* A sharded spool keeps them by sub-directory, so that the rename
+      stays on the filesystem of the shard */
+
+      const uschar * osub = spool_shard_count ? message_subdir : US"";
+      uschar * moname = spool_fname(US"msglog.OLD", osub, id, US"");
 
       if ((rc = Urename(fname, moname)) < 0)
         {
-        (void)directory_make(spool_directory,
-			      spool_sname(US"msglog.OLD", US""),
+        (void)directory_make(spool_root(osub),
+			      spool_sname(US"msglog.OLD", osub),
 			      MSGLOG_DIRECTORY_MODE, TRUE);
         rc = Urename(fname, moname);
         }
@@ -8279,6 +9378,9 @@ if (!addr_defer)
   if (Uunlink(fname) < 0)
     log_write(0, LOG_MAIN|LOG_PANIC_DIE, "failed to unlink %s: %s",
       fname, strerror(errno));
+  if (spool_dedup_size > 0)
+    (void) Uunlink(spool_fname(US"input", message_subdir, id, US"-L"));
+  queue_index_notify(NOTIFY_QUEUE_INDEX_DEL, queue_name, id, 0);
 
   /* Log the end of this message, with queue time if requested. */
 
@@ -8467,6 +9569,30 @@ else if (addr_defer != (address_item *)(+1))
 
   deliver_domain = NULL;
 
+  /* For queue_run_retry_skip, if every deferred address is waiting for a
+  retry time, note in the spool the earliest time at which one of them could
+  be tried, which queue runners use to pass the message by. A delay warning
+  that will be due before then brings it forward. */
+
+  if (queue_run_retry_skip || deliver_retry_after)
+    {
+    time_t t = queue_run_retry_skip && !f.queue_2stage
+      ? retry_next_attempt(addr_defer) : 0;
+
+    if (t && delay_warning[1] > 0 && sender_address[0])
+      {
+      time_t w = deliver_next_warning();
+      if (w < t) t = w > time(NULL) ? w : 0;
+      }
+    if (t != deliver_retry_after)
+      {
+      DEBUG(D_deliver) debug_printf("no delivery attempt is due until %s\n",
+	t ? string_sprintf("now+%s", readconf_printtime(t - time(NULL))) : US"now");
+      deliver_retry_after = t;
+      update_spool = TRUE;
+      }
+    }
+
   /* If this was a first delivery attempt, unset the first time flag, and
   ensure that the spool gets updated. */
 
@@ -8524,15 +9650,22 @@ else if (addr_defer != (address_item *)(+1))
     debug_printf("delivery deferred: update_spool=%d header_rewritten=%d\n",
       update_spool, f.header_rewritten);
 
-  if (update_spool || f.header_rewritten)
+  if ((update_spool || f.header_rewritten || journal_unfolded)
+     && !journal_update())
     /* Panic-dies on error */
     (void)spool_write_header(message_id, SW_DELIVERING, NULL);
   }
 
 /* Finished with the message log. If the message is complete, it will have
-been unlinked or renamed above. */
+been unlinked or renamed above. One still in memory is written now if the
+message is staying on the queue. */
 
-if (message_logs) (void)fclose(message_log);
+if (message_logs)
+  {
+  if (!message_log && addr_defer) (void) msglog_mem_write();
+  if (message_log) { (void)fclose(message_log); message_log = NULL; }
+  msglog_mem_drop();
+  }
 
 /* Now we can close and remove the journal file. Its only purpose is to record
 successfully completed deliveries asap so that this information doesn't get
@@ -8548,7 +9681,7 @@ at the next attempt, after the journal has been inspected. */
 
 if (journal_fd >= 0) (void)close(journal_fd);
 
-if (remove_journal)
+if (remove_journal && !journal_kept)
   {
   uschar * fname = spool_fname(US"input", message_subdir, id, US"-J");
 
@@ -8588,6 +9721,91 @@ return final_yield;
 
 
 
+/*************************************************
+*      Continue a delivery in this process       *
+*************************************************/
+
+/* Called in a process forked from a remote-delivery subprocess, in place of
+the exec of a new Exim with -MC, when this process already has all the
+privilege the delivery needs.  Drop what is left over from the message that
+the subprocess was delivering, set up what the -MC options would have set, and
+deliver the waiting message.  As for -MC, the connection is put on stdin.
+
+Arguments:  as for transport_do_pass_socket()
+Returns:    does not return
+*/
+
+void
+deliver_continue_in_process(const uschar * transport_name,
+  const uschar * hostname, const uschar * hostaddress, const uschar * id,
+  int socket_fd)
+{
+DEBUG(D_deliver|D_transport)
+  debug_printf("continuing delivery of %s in process\n", id);
+
+/* Files and pipes of the previous delivery.  The message log has been flushed
+after every write, so there is nothing to be written twice. */
+
+if (remote_result_fd >= 0) { (void)close(remote_result_fd); remote_result_fd = -1; }
+if (deliver_datafile >= 0) { (void)close(deliver_datafile); deliver_datafile = -1; }
+if (journal_fd >= 0) { (void)close(journal_fd); journal_fd = -1; }
+if (message_log) { (void)fclose(message_log); message_log = NULL; }
+msglog_mem_drop();
+search_tidyup();
+log_close_all();
+
+/* The state that deliver_message() expects to find as in a new process */
+
+addr_defer = addr_failed = addr_fallback = addr_local = addr_new =
+  addr_remote = addr_route = addr_succeed = NULL;
+parcount = lparcount = 0;
+parlist = NULL;
+lparlist = NULL;
+journal_sync_pending = FALSE;
+shard_index = -1;
+frozen_info = US"";
+used_return_path = NULL;
+tree_copy_routing = NULL;
+hset_clear(&hset_duplicates);
+hset_clear(&hset_unusable);
+hset_clear(&hset_dns_fails);
+f.continue_more = FALSE;
+
+/* What -MC and its companion options would carry.  A TLS session that is
+still active is now being proxied by another process (see the smtp transport),
+as for -MCt. */
+
+continue_transport = string_copy_taint(transport_name, GET_TAINTED);
+continue_hostname = string_copy_taint(hostname, GET_TAINTED);
+continue_host_address = string_copy_taint(hostaddress, GET_TAINTED);
+continue_sequence++;
+smtp_peer_options &= OPTION_CHUNKING | OPTION_DSN | OPTION_PIPE | OPTION_SIZE
+		    | OPTION_TLS;
+#ifndef DISABLE_TLS
+if (tls_out.active.sock >= 0)
+  {
+  continue_proxy_cipher = tls_out.cipher;
+  continue_proxy_sni = tls_out.sni;
+# ifdef SUPPORT_DANE
+  continue_proxy_dane = tls_out.dane_verified;
+# endif
+  }
+tls_out = (tls_support) {.active = {.sock = -1}};
+#endif
+
+if (socket_fd != 0)
+  {
+  (void)dup2(socket_fd, 0);
+  (void)close(socket_fd);
+  }
+
+set_process_info("delivering %s (continued in process)", id);
+(void) deliver_message(id, TRUE, FALSE);
+exim_exit(EXIT_SUCCESS);
+}
+
+
+
 void
 tcp_init(void)
 {
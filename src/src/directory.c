@@ -23,7 +23,7 @@ can be NULL if the name is absolute.
 
 If a non-root uid has been specified for exim, and we are currently running as
 root, ensure the directory is owned by the non-root id if the parent is the
-spool directory.
+spool directory or one of the spool shard roots.
 
 Arguments:
   parent    parent directory name; if NULL the name must be absolute
@@ -39,12 +39,16 @@ BOOL
 directory_make(const uschar *parent, const uschar *name,
                int mode, BOOL panic)
 {
-BOOL use_chown = parent == spool_directory && geteuid() == root_uid;
+BOOL use_chown = parent == spool_directory;
 uschar * p;
 uschar c = 1;
 struct stat statbuf;
 uschar * path;
 
+for (int i = 0; i < spool_shard_count; i++)	/* the roots of a split spool */
+  if (parent == spool_shard_roots[i]) use_chown = TRUE;
+use_chown = use_chown && geteuid() == root_uid;
+
 if (is_tainted(name)) 
   { p = US"create"; path = US name; errno = ERRNO_TAINT; goto bad; }
 
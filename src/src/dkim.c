@@ -35,25 +35,113 @@ int dkim_verify_oldpool;
 pdkim_ctx *dkim_verify_ctx = NULL;
 pdkim_signature *dkim_cur_sig = NULL;
 static const uschar * dkim_collect_error = NULL;
+static pid_t dkim_prefetch_pid = 0;
+
+/* Key records already fetched while verifying the current message, so that
+a selector used by several DKIM signatures, or by the AMS and AS of ARC sets,
+is fetched and checked for in the key cache only once.  Failures are kept
+too.  Held in the message pool, and dropped by dkim_exim_verify_init(). */
+
+typedef struct {
+  const uschar *	record;
+  uschar *		dnssec;		/* lookup_dnssec_authenticated */
+} dkim_key_seen;
+
+static tree_node * dkim_keys_seen = NULL;
 
 #define DKIM_MAX_SIGNATURES 20
 
 
 
+/* With dkim_verify_key_cache set, key records are held in the "dkimkeys"
+hints database for up to that time (or their DNS TTL if shorter).  A record
+counts the times it was used from the cache, and the times it was fetched. */
+
+static uschar *
+dkim_key_cache_get(const uschar * key, unsigned * fetches)
+{
+open_db dbblock, * dbm;
+dbdata_dkim_key * dk;
+uschar * s = NULL;
+int len;
+
+*fetches = 0;
+if (!(dbm = dbfn_open(US"dkimkeys", O_RDWR, &dbblock, FALSE, TRUE)))
+  return NULL;
+
+if (  (dk = dbfn_read_with_length(dbm, key, &len))
+   && len > (int)sizeof(dbdata_dkim_key))
+  {
+  *fetches = dk->fetches;
+  if (dk->expiry > time(NULL))
+    {
+    dk->hits++;
+    dbfn_write(dbm, key, dk, len);
+    s = string_copyn_taint(dk->record, len - sizeof(dbdata_dkim_key),
+			    GET_TAINTED);
+    lookup_dnssec_authenticated =
+      dk->dnssec == 2 ? US"yes" : dk->dnssec == 1 ? US"no" : NULL;
+    }
+  }
+dbfn_close(dbm);
+
+DEBUG(D_acl) debug_printf("DKIM: key cache %s for %s\n",
+			  s ? "hit" : "miss", key);
+return s;
+}
+
+static void
+dkim_key_cache_put(const uschar * key, const uschar * record, unsigned ttl,
+  unsigned fetches)
+{
+open_db dbblock, * dbm;
+int rlen = Ustrlen(record), len = sizeof(dbdata_dkim_key) + rlen;
+dbdata_dkim_key * dk;
+
+if (!(dbm = dbfn_open(US"dkimkeys", O_RDWR, &dbblock, FALSE, TRUE)))
+  return;
+
+if (ttl > (unsigned)dkim_verify_key_cache) ttl = dkim_verify_key_cache;
+dk = store_get(len, GET_UNTAINTED);
+dk->expiry = time(NULL) + ttl;
+dk->hits = 0;
+dk->fetches = fetches + 1;
+dk->dnssec = !lookup_dnssec_authenticated ? 0
+  : Ustrcmp(lookup_dnssec_authenticated, "yes") == 0 ? 2 : 1;
+memcpy(dk->record, record, rlen + 1);
+
+dbfn_write(dbm, key, dk, len);
+dbfn_close(dbm);
+}
+
+
 /* Look up the DKIM record in DNS for the given hostname.
 Will use the first found if there are multiple.
 The return string is tainted, having come from off-site.
 */
 
-uschar *
-dkim_exim_query_dns_txt(const uschar * name)
+static uschar *
+dkim_key_fetch(const uschar * name)
 {
-dns_answer * dnsa = store_get_dns_answer();
+dns_answer * dnsa;
 dns_scan dnss;
-rmark reset_point = store_mark();
-gstring * g = string_get_tainted(256, GET_TAINTED);
+rmark reset_point;
+gstring * g;
+const uschar * key = NULL;
+unsigned fetches = 0;
 
 lookup_dnssec_authenticated = NULL;
+if (dkim_verify_key_cache > 0)
+  {
+  uschar * s;
+  if ((s = dkim_key_cache_get(key = string_copylc(name), &fetches)))
+    return s;
+  }
+
+dnsa = store_get_dns_answer();
+reset_point = store_mark();
+g = string_get_tainted(256, GET_TAINTED);
+
 if (dns_lookup(dnsa, name, T_TXT, NULL) != DNS_SUCCEED)
   goto bad;
 
@@ -78,9 +166,13 @@ for (dns_record * rr = dns_next_rr(dnsa, &dnss, RESET_ANSWERS);
     /* Check if this looks like a DKIM record */
     if (Ustrncmp(g->s, "v=", 2) != 0 || strncasecmp(CS g->s, "v=dkim", 6) == 0)
       {
+      unsigned ttl = rr->ttl;
+
       store_free_dns_answer(dnsa);
       gstring_release_unused(g);
-      return string_from_gstring(g);
+      (void) string_from_gstring(g);
+      if (key) dkim_key_cache_put(key, g->s, ttl, fetches);
+      return g->s;
       }
 
     gstring_reset(g);		/* overwrite previous record */
@@ -92,6 +184,41 @@ store_free_dns_answer(dnsa);
 return NULL;	/*XXX better error detail?  logging? */
 }
 
+uschar *
+dkim_exim_query_dns_txt(const uschar * name)
+{
+const uschar * key;
+dkim_key_seen * ks;
+tree_node * t;
+uschar * s;
+int old_pool;
+
+if (!dkim_verify_ctx) return dkim_key_fetch(name);
+
+key = string_copylc(name);
+if ((t = tree_search(dkim_keys_seen, key)))
+  {
+  ks = t->data.ptr;
+  DEBUG(D_acl) debug_printf("DKIM: key for %s already %s\n", key,
+			    ks->record ? "fetched" : "failed");
+  lookup_dnssec_authenticated = ks->dnssec;
+  return ks->record ? string_copy_taint(ks->record, GET_TAINTED) : NULL;
+  }
+
+s = dkim_key_fetch(name);
+
+old_pool = store_pool;
+store_pool = POOL_MESSAGE;
+t = store_get(sizeof(tree_node) + Ustrlen(key), key);
+Ustrcpy(t->name, key);
+t->data.ptr = ks = store_get(sizeof(dkim_key_seen), GET_UNTAINTED);
+ks->record = s ? string_copy_taint(s, GET_TAINTED) : NULL;
+ks->dnssec = lookup_dnssec_authenticated;
+(void) tree_insertnode(&dkim_keys_seen, t);
+store_pool = old_pool;
+return s;
+}
+
 
 void
 dkim_exim_init(void)
@@ -103,10 +230,25 @@ pdkim_init();
 
 
 
+/* Wait for any key-prefetch process from a previous message, or for the
+current one before using the keys. */
+
+static void
+dkim_prefetch_reap(void)
+{
+if (dkim_prefetch_pid > 0)
+  {
+  (void) waitpid(dkim_prefetch_pid, NULL, 0);
+  dkim_prefetch_pid = 0;
+  }
+}
+
+
 void
 dkim_exim_verify_init(BOOL dot_stuffing)
 {
 dkim_exim_init();
+dkim_prefetch_reap();
 
 /* There is a store-reset between header & body reception for the main pool
 (actually, after every header line) so cannot use that as we need the data we
@@ -122,6 +264,7 @@ store_pool = POOL_MESSAGE;
 
 if (dkim_verify_ctx)
   pdkim_free_ctx(dkim_verify_ctx);
+dkim_keys_seen = NULL;
 
 /* Create new context */
 
@@ -157,6 +300,50 @@ store_pool = dkim_verify_oldpool;
 }
 
 
+/* Called at the end of the header section.  When the daemon holds DNS
+answers for us (dns_cache_shared) a child process looks up the keys for the
+signatures seen so far while the body is being received; the verification
+at the end of the message then finds the answers held. */
+
+void
+dkim_exim_verify_prefetch(void)
+{
+pdkim_signature * sig;
+pid_t pid;
+
+if (  !dkim_verify_ctx || !(sig = dkim_verify_ctx->sig)
+   || !dns_cache_shared || !search_shared_usable())
+  return;
+
+if ((pid = exim_fork(US"dkim-key-prefetch")) == 0)
+  {
+  dns_answer * dnsa = store_get_dns_answer();
+
+  for ( ; sig; sig = sig->next)
+    if (sig->selector && sig->domain)
+      (void) dns_lookup(dnsa,
+	string_sprintf("%s._domainkey.%s.", sig->selector, sig->domain),
+	T_TXT, NULL);
+  exim_underbar_exit(EXIT_SUCCESS);
+  }
+
+if (pid > 0) dkim_prefetch_pid = pid;
+}
+
+
+/* Whether verification needs any more of the message: while the headers are
+being read, and after them only if a DKIM signature or an ARC message
+signature found in them needs a body hash. */
+
+BOOL
+dkim_exim_verify_wants_body(void)
+{
+return dkim_collect_input && dkim_verify_ctx
+  && (  !(dkim_verify_ctx->flags & PDKIM_PAST_HDRS)
+     || dkim_verify_ctx->bodyhash);
+}
+
+
 /* Log the result for the given signature */
 static void
 dkim_exim_verify_log_sig(pdkim_signature * sig)
@@ -316,6 +503,7 @@ store_pool = POOL_MESSAGE;
 
 dkim_signers = NULL;
 dkim_signatures = NULL;
+dkim_prefetch_reap();
 
 if (dkim_collect_error)
   {
@@ -596,6 +784,7 @@ store_pool = old_pool;
 
 /* Generate signatures for the given file.
 If a prefix is given, prepend it to the file for the calculations.
+A negative fd means the prefix is the entire message.
 
 Return:
   NULL:		error; error string written
@@ -603,7 +792,7 @@ Return:
 */
 
 gstring *
-dkim_exim_sign(int fd, off_t off, uschar * prefix,
+dkim_exim_sign(int fd, off_t off, gstring * prefix,
   struct ob_dkim * dkim, const uschar ** errstr)
 {
 const uschar * dkim_domain = NULL;
@@ -762,10 +951,13 @@ if (!dkim_sign_ctx.sig && !dkim->force_bodyhash)
   }
 else
   {
-  if (prefix && (pdkim_rc = pdkim_feed(&dkim_sign_ctx, prefix, Ustrlen(prefix))) != PDKIM_OK)
+  if (  prefix && prefix->ptr > 0
+     && (pdkim_rc = pdkim_feed(&dkim_sign_ctx, prefix->s, prefix->ptr)) != PDKIM_OK)
     goto pk_bad;
 
-  if (lseek(fd, off, SEEK_SET) < 0)
+  if (fd < 0)
+    sread = 0;
+  else if (lseek(fd, off, SEEK_SET) < 0)
     sread = -1;
   else
     while ((sread = read(fd, &buf, sizeof(buf))) > 0)
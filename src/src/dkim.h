@@ -7,10 +7,12 @@
 /* SPDX-License-Identifier: GPL-2.0-or-later */
 
 void    dkim_exim_init(void);
-gstring * dkim_exim_sign(int, off_t, uschar *, struct ob_dkim *, const uschar **);
+gstring * dkim_exim_sign(int, off_t, gstring *, struct ob_dkim *, const uschar **);
 void    dkim_exim_verify_init(BOOL);
 void    dkim_exim_verify_feed(uschar *, int);
 void    dkim_exim_verify_finish(void);
+void    dkim_exim_verify_prefetch(void);
+BOOL    dkim_exim_verify_wants_body(void);
 void    dkim_exim_verify_log_all(void);
 int     dkim_exim_acl_run(uschar *, gstring **, uschar **, uschar **);
 uschar *dkim_exim_expand_query(int);
@@ -57,7 +57,8 @@ DEBUG(D_transport) debug_printf("send file fd=%d\n", out_fd);
 /* We can use sendfile() to shove the file contents
    to the socket. However only if we don't use TLS,
    as then there's another layer of indirection
-   before the data finally hits the socket. */
+   before the data finally hits the socket, unless the
+   kernel is doing the TLS. */
 if (tls_out.active.sock != out_fd)
   {
   ssize_t copied = 0;
@@ -67,6 +68,18 @@ if (tls_out.active.sock != out_fd)
   if (copied < 0)
     return FALSE;
   }
+# ifndef DISABLE_TLS
+else if (tls_can_sendfile(tls_out.active.tls_ctx))
+  {
+  ssize_t copied = 0;
+
+  DEBUG(D_transport) debug_printf(" using kTLS\n");
+  while(copied >= 0 && off < size)
+    copied = tls_sendfile(tls_out.active.tls_ctx, in_fd, &off, size - off);
+  if (copied < 0)
+    return FALSE;
+  }
+# endif
 else
 
 #endif
@@ -128,7 +141,7 @@ int save_fd = tctx->u.fd;
 int save_options = tctx->options;
 BOOL save_wireformat = f.spool_file_wireformat;
 uschar * hdrs;
-gstring * dkim_signature;
+gstring * hg, * dkim_signature;
 int hsize;
 const uschar * errstr;
 BOOL rc;
@@ -143,8 +156,9 @@ tctx->options = tctx->options & ~(topt_end_dot | topt_use_bdat)
   | topt_output_string | topt_no_body;
 
 rc = transport_write_message(tctx, 0);
-hdrs = string_from_gstring(tctx->u.msg);
-hsize = tctx->u.msg->ptr;
+hg = tctx->u.msg;
+hdrs = string_from_gstring(hg);
+hsize = hg->ptr;
 
 tctx->u.fd = save_fd;
 tctx->options = save_options;
@@ -161,7 +175,7 @@ in wireformat. */
 
 dkim->dot_stuffed = f.spool_file_wireformat;
 if (!(dkim_signature = dkim_exim_sign(deliver_datafile,
-	      spool_data_start_offset(message_id), hdrs, dkim, &errstr)))
+	      spool_data_start_offset(message_id), hg, dkim, &errstr)))
   if (!(rc = dkt_sign_fail(dkim, &errno)))
     {
     *err = errstr;
@@ -211,7 +225,100 @@ return TRUE;
 
 /* This function is a wrapper around transport_write_message().
    It is only called from the smtp transport if DKIM or Domainkeys support
-   is active and a transport filter is to be used.  The function sets up a
+   is active, a transport filter is to be used, and the message is small
+   enough.  The output of the filter is collected in memory, exactly as it
+   would have gone "on the wire", and signed there; the signature and the
+   collected message are then sent down the original fd.  This avoids the
+   write and re-read of a -K file.
+
+Arguments:
+  As for transport_write_message() in transort.c, with additional arguments
+  for DKIM.
+
+Returns:       TRUE on success; FALSE (with errno) for any failure
+*/
+
+static BOOL
+dkt_via_memory(transport_ctx * tctx, struct ob_dkim * dkim, const uschar ** err)
+{
+int save_fd = tctx->u.fd;
+int options = tctx->options;
+gstring * msg, * dkim_signature;
+int dlen;
+const uschar * errstr;
+BOOL rc;
+
+DEBUG(D_transport) debug_printf("dkim signing via memory\n");
+
+/* Collect the message as transport_write_message() would write it; CRLF
+expansion, and unless CHUNKING the dot-stuffing and dot-termination. */
+
+tctx->u.msg = NULL;
+tctx->options = (options & ~topt_use_bdat) | topt_output_string;
+
+rc = transport_write_message(tctx, 0);
+msg = tctx->u.msg;
+
+tctx->u.fd = save_fd;
+tctx->options = options;
+if (!rc) return FALSE;
+if (!msg) msg = string_get(1);
+
+#ifdef EXPERIMENTAL_ARC
+arc_sign_init();
+#endif
+
+dkim->dot_stuffed = !!(options & topt_end_dot);
+if (!(dkim_signature = dkim_exim_sign(-1, 0, msg, dkim, &errstr)))
+  {
+  dlen = 0;
+  if (!dkt_sign_fail(dkim, &errno))
+    {
+    *err = errstr;
+    return FALSE;
+    }
+  }
+else
+  dlen = dkim_signature->ptr;
+
+#ifdef EXPERIMENTAL_ARC
+if (dkim->arc_signspec)				/* Prepend ARC headers */
+  {
+  if (!(dkim_signature = arc_sign(dkim->arc_signspec, dkim_signature, USS err)))
+    return FALSE;
+  dlen = dkim_signature->ptr;
+  }
+#endif
+
+if (options & topt_use_bdat)
+  {
+  /* As for the -K file case, on big messages get the pipelined MAIL & RCPT
+  responses before sending the bulk of the data. */
+
+  if (  dlen + msg->ptr > DELIVER_OUT_BUFFER_SIZE
+     && dlen > 0)
+    {
+    if (  tctx->chunk_cb(tctx, dlen, 0) != OK
+       || !transport_write_block(tctx, dkim_signature->s, dlen, FALSE)
+       || tctx->chunk_cb(tctx, 0, tc_reap_prev) != OK
+       )
+      return FALSE;
+    dlen = 0;
+    }
+
+  if (tctx->chunk_cb(tctx, dlen + msg->ptr, tc_chunk_last) != OK)
+    return FALSE;
+  }
+
+return (dlen <= 0 || transport_write_block(tctx, dkim_signature->s, dlen, TRUE))
+  && (msg->ptr <= 0 || transport_write_block(tctx, msg->s, msg->ptr, FALSE));
+}
+
+
+/* This function is a wrapper around transport_write_message().
+   It is only called from the smtp transport if DKIM or Domainkeys support
+   is active and a transport filter is to be used, for a message too large
+   to be handled in memory.  The function sets up a
    replacement fd into a -K file, then calls the normal function. This way, the
    exact bits that exim would have put "on the wire" will end up in the file
    (except for TLS encapsulation, which is the very very last thing). When we
@@ -400,10 +507,14 @@ if (  !transport_filter_argv
    )
   return dkt_direct(tctx, dkim, err);
 
-/* Use the transport path to write a file, calculate a dkim signature,
-send the signature and then send the file. */
+/* With a filter, the signature must be calculated over its output.  For a
+message of moderate size collect that in memory, otherwise use the transport
+path to write a file, calculate a dkim signature, send the signature and then
+send the file. */
 
-return dkt_via_kfile(tctx, dkim, err);
+return message_size <= DKIM_MEMORY_SIGN_MAX
+  ? dkt_via_memory(tctx, dkim, err)
+  : dkt_via_kfile(tctx, dkim, err);
 }
 
 #endif	/* whole file */
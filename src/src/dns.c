@@ -448,6 +448,8 @@ TRACE trace = "R-class";
 (void) dnss_inc_aptr(dnsa, dnss, sizeof(uint16_t));	/* skip class */
 
 GETLONG(dnss->srr.ttl, dnss->aptr);			/* TTL */
+if (dnss->srr.ttl < dns_least_ttl && dnss->srr.type != T_OPT)
+  dns_least_ttl = dnss->srr.ttl;				/* for caches */
 GETSHORT(dnss->srr.size, dnss->aptr);			/* Size of data portion */
 dnss->srr.data = dnss->aptr;				/* The record's data follows */
 
@@ -655,7 +657,7 @@ tree_node * previous, * new;
 expiring_data * e;
 
 dns_fail_tag(node_name, name, type);
-if ((previous = tree_search(tree_dns_fails, node_name)))
+if ((previous = hset_search(&hset_dns_fails, node_name)))
   e = previous->data.ptr;
 else
   {
@@ -663,7 +665,7 @@ else
   new = (void *)(e+1);
   dns_fail_tag(new->name, name, type);
   new->data.ptr = e;
-  (void)tree_insertnode(&tree_dns_fails, new);
+  (void)hset_insert(&hset_dns_fails, new);
   }
 
 DEBUG(D_dns) debug_printf(" %s neg-cache entry for %s, ttl %d\n",
@@ -686,7 +688,7 @@ expiring_data * e;
 int val, rc;
 
 dns_fail_tag(node_name, name, type);
-if (!(previous = tree_search(tree_dns_fails, node_name)))
+if (!(previous = hset_search(&hset_dns_fails, node_name)))
   return -1;
 
 e = previous->data.ptr;
@@ -788,6 +790,625 @@ return 0;
 }
 
 
+/*************************************************
+*        DNS answers held by the daemon          *
+*************************************************/
+
+/* With dns_cache_shared set, answers and negative answers (NXDOMAIN, NODATA)
+are also held in the daemon's shared cache (see search.c), so that the many
+processes it forks for connections from the same hosts do not each ask the
+resolver.  An entry lives for the least TTL of the records in the packet,
+capped by dns_cache_shared_ttl; the TTLs of a packet taken from the cache are
+reduced by the time it has been held.  Soft failures are not shared, and neither are TLSA answers, whose
+trust matters for DANE. */
+
+#ifndef STAND_ALONE
+
+typedef struct dns_shared_hdr {
+  time_t	stored;		/* when it was put */
+  int		err;		/* h_errno equivalent; 0 for an answer */
+} dns_shared_hdr;
+
+
+/* Walk a packet, giving its length and the least TTL of its records.
+Optionally age the TTLs.
+
+Arguments:
+  buf		the packet
+  max		the most it can be
+  age		seconds to take off each TTL, or 0
+  minttl	where to put the least TTL
+
+Returns:	the packet length, or -1 if it is not sound
+*/
+
+static int
+dns_packet_walk(uschar * buf, int max, unsigned age, unsigned * minttl)
+{
+const HEADER * h = (const HEADER *)buf;
+uschar * p = buf + HFIXEDSZ, * end = buf + max;
+int n;
+
+*minttl = UINT_MAX;
+if (max < HFIXEDSZ) return -1;
+
+for (int i = ntohs(h->qdcount); i > 0; i--)
+  if ((n = dn_skipname(p, end)) < 0 || (p += n + QFIXEDSZ) > end)
+    return -1;
+
+for (int i = ntohs(h->ancount) + ntohs(h->nscount) + ntohs(h->arcount);
+     i > 0; i--)
+  {
+  uschar * tp;
+  unsigned type, ttl, rdlen;
+
+  if ((n = dn_skipname(p, end)) < 0 || (p += n) + RRFIXEDSZ > end)
+    return -1;
+  GETSHORT(type, p);
+  p += INT16SZ;					/* class */
+  tp = p;
+  GETLONG(ttl, p);
+  GETSHORT(rdlen, p);
+  if ((p += rdlen) > end) return -1;
+
+  if (type == T_OPT) continue;			/* not a real TTL */
+  if (age)
+    {
+    ttl = ttl > age ? ttl - age : 0;
+    PUTLONG(ttl, tp);
+    }
+  if (ttl < *minttl) *minttl = ttl;
+  }
+return p - buf;
+}
+
+
+/* The key is the kind name "dns", the record type, whether DNSSEC was asked
+for, and the lowercased name */
+
+static uschar *
+dns_shared_key(const uschar * name, int type, int * len)
+{
+const uschar * tname = dns_text_type(type);
+int tlen = Ustrlen(tname) + 1, nlen = Ustrlen(name) + 1;
+uschar * key = store_get(4 + tlen + 1 + nlen, name), * p = key;
+#ifdef RES_USE_DNSSEC
+BOOL sec = !!(os_get_dns_resolver_res()->options & RES_USE_DNSSEC);
+#else
+BOOL sec = FALSE;
+#endif
+
+memcpy(p, "dns", 4);		p += 4;
+memcpy(p, tname, tlen);		p += tlen;
+*p++ = sec ? 'S' : '-';
+for (int i = 0; i < nlen; i++) *p++ = tolower(name[i]);
+*len = p - key;
+return key;
+}
+
+
+/* Take an answer from the daemon's cache, with its TTLs aged.
+
+Arguments:
+  name, type	the lookup
+  buf		where to put the packet
+  size		its size
+  len		where to put its length
+  err		where to put the h_errno equivalent, 0 for an answer
+
+Returns:   TRUE if there was a cached answer
+*/
+
+static BOOL
+dns_shared_fetch(const uschar * name, int type, uschar * buf, int size,
+  int * len, int * err)
+{
+dns_shared_hdr hdr;
+uschar * key, * data;
+int keylen, dlen;
+unsigned ttl;
+time_t now;
+
+if (!dns_cache_shared || !search_shared_usable())
+  return FALSE;
+key = dns_shared_key(name, type, &keylen);
+if (  !search_shared_get_raw(key, keylen, &data, &dlen)
+   || (dlen -= sizeof(hdr)) < HFIXEDSZ || dlen > size)
+  return FALSE;
+
+memcpy(&hdr, data, sizeof(hdr));
+memcpy(buf, data + sizeof(hdr), dlen);
+now = time(NULL);
+if (dns_packet_walk(buf, dlen,
+	      now > hdr.stored ? (unsigned)(now - hdr.stored) : 0, &ttl) < 0)
+  return FALSE;
+
+*len = dlen;
+*err = hdr.err;
+DEBUG(D_dns) debug_printf("DNS lookup of %s (%s) found in shared cache\n",
+  name, dns_text_type(type));
+return TRUE;
+}
+
+
+/* Take an answer from the daemon's cache into a dns_answer as res_search()
+would put it, with the length set to -1 and h_errno set for a negative
+answer. */
+
+static BOOL
+dns_shared_get(dns_answer * dnsa, const uschar * name, int type)
+{
+int len, err;
+
+if (!dns_shared_fetch(name, type, dnsa->answer, sizeof(dnsa->answer),
+		      &len, &err))
+  return FALSE;
+dnsa->answerlen = err ? -1 : len;
+h_errno = err;
+return TRUE;
+}
+
+
+/* Offer the result of a resolver call to the daemon.  TLSA answers, on which
+DANE relies, are offered only when DNSSEC-authenticated; so an entry never
+replaces a validation, it only saves repeating one. */
+
+static void
+dns_shared_put(const dns_answer * dnsa, const uschar * name, int type)
+{
+dns_shared_hdr hdr = {.stored = time(NULL), .err = 0};
+uschar * key;
+gstring * g;
+int keylen, len;
+unsigned ttl;
+
+if (  !dns_cache_shared || dns_cache_shared_ttl <= 0
+   || (type == T_TLSA && !((const HEADER *)dnsa->answer)->ad)
+   || !search_shared_usable())
+  return;
+
+if (dnsa->answerlen >= 0)
+  len = dnsa->answerlen;
+else if (h_errno == HOST_NOT_FOUND || h_errno == NO_DATA)
+  {
+  hdr.err = h_errno;
+  len = sizeof(dnsa->answer);			/* the walk finds the end */
+  }
+else
+  return;
+
+if (  (len = dns_packet_walk(US dnsa->answer, len, 0, &ttl)) < 0
+   || ttl == 0 || ttl == UINT_MAX)
+  return;
+if (ttl > (unsigned)dns_cache_shared_ttl) ttl = dns_cache_shared_ttl;
+
+key = dns_shared_key(name, type, &keylen);
+g = string_catn(NULL, US &hdr, sizeof(hdr));
+g = string_catn(g, dnsa->answer, len);
+search_shared_put_raw(key, keylen, g->s, g->ptr, ttl);
+}
+
+#endif	/*!STAND_ALONE*/
+
+
+
+/*************************************************
+*       Send a set of lookups in parallel        *
+*************************************************/
+
+/* When several lookups are known to be needed together (the zones of a
+dnslists condition) they are all sent at once over UDP to the resolver's
+nameservers, and the answers held.  dns_basic_lookup() takes a held answer,
+or a held failure, in place of calling the resolver; so the lookups are still
+made, and their results applied, in the order the caller wants them.
+
+Queries go to every IPv4 nameserver of the resolver configuration.  Each of
+dns_retry rounds waits up to dns_retrans for the outstanding answers, so the
+whole set takes at most the time the resolver allows for one lookup.  A name
+with no answer by then is held as TRY_AGAIN, which is what the resolver would
+have given.  Truncated answers and server failures are not held; those names
+are left to the resolver, which can retry over TCP or with other servers.
+Names whose answers are in the daemon's shared cache are not sent.
+
+Lookups can also be started early, for example when an SMTP connection is
+accepted, without waiting for the answers; see dns_prefetch_start(). */
+
+typedef struct dns_held {
+  struct dns_held * next;
+  int		type;
+  int		err;		/* h_errno equivalent; 0 for an answer */
+  int		len;		/* answer length; -1 while outstanding */
+  BOOL		shared;		/* answer is from the shared cache */
+  unsigned	id;		/* query id */
+  int		qlen;		/* query length */
+  BOOL		early;		/* sent by dns_prefetch_start() */
+  uschar *	answer;
+  uschar	query[PACKETSZ];
+  uschar	name[1];	/* expands */
+} dns_held;
+
+static dns_held * dns_held_answers = NULL;
+
+static int dns_early_sock = -1;		/* socket for early lookups */
+static struct timeval dns_early_deadline; /* when to give up on them */
+
+
+/* Match a response to its outstanding query, and hold it */
+
+static BOOL
+dns_prefetch_response(const uschar * buf, int len)
+{
+const HEADER * h = (const HEADER *)buf;
+const uschar * p = buf + HFIXEDSZ;
+uschar qname[256];
+int qtype, n;
+
+if (len < HFIXEDSZ || !h->qr || ntohs(h->qdcount) != 1
+   || (n = dn_expand(buf, buf + len, p, CS qname, sizeof(qname))) < 0
+   || (p += n) + 4 > buf + len)
+  return FALSE;
+GETSHORT(qtype, p);
+
+for (dns_held * d = dns_held_answers; d; d = d->next)
+  if (  d->len < 0 && d->type == qtype && d->id == ntohs(h->id)
+     && strcmpic(d->name, qname) == 0)
+    {
+    if (h->tc || (h->rcode != NOERROR && h->rcode != NXDOMAIN))
+      {
+      DEBUG(D_dns) debug_printf("DNS: parallel lookup of %s not usable\n",
+	d->name);
+      d->len = 0;
+      d->type = -1;			/* leave to the resolver */
+      return TRUE;
+      }
+    d->answer = store_get(len, GET_TAINTED);
+    memcpy(d->answer, buf, d->len = len);
+    d->err = h->rcode == NXDOMAIN ? HOST_NOT_FOUND
+      : ntohs(h->ancount) == 0 ? NO_DATA : 0;
+    return TRUE;
+    }
+return FALSE;
+}
+
+
+/* Collect the nameservers to query; only IPv4 ones are used */
+
+static int
+dns_prefetch_servers(struct sockaddr_in * ns)
+{
+res_state resp = os_get_dns_resolver_res();
+int nscount = 0;
+
+for (int i = 0; i < resp->nscount; i++)
+  if (resp->nsaddr_list[i].sin_family == AF_INET)
+    ns[nscount++] = resp->nsaddr_list[i];
+return nscount;
+}
+
+
+/* Make held entries, with queries, for the names that need a lookup.
+
+Arguments:
+  names      vector of names
+  count      number of names
+  type       type of DNS record required (T_A, T_MX, etc)
+  early      TRUE for an early lookup
+
+Returns:     the number of queries to be sent
+*/
+
+static int
+dns_prefetch_queue(const uschar ** names, int count, int type, BOOL early)
+{
+int outstanding = 0;
+uschar buf[4096];
+
+for (int i = 0; i < count; i++)
+  {
+  const uschar * name = names[i];
+  uschar tag[DNS_FAILTAG_MAX];
+  dns_held * d;
+  tree_node * t;
+  BOOL skip = FALSE;
+
+  /* Names already failed, non-ASCII names and repeats are left to the normal
+  path */
+
+  dns_fail_tag(tag, name, type);
+  if (  (t = hset_search(&hset_dns_fails, tag))
+     && !(((expiring_data *)t->data.ptr)->expiry
+         && ((expiring_data *)t->data.ptr)->expiry <= time(NULL)))
+    continue;
+  for (const uschar * s = name; *s; s++) if (*s > 127) skip = TRUE;
+  for (d = dns_held_answers; d; d = d->next)
+    if (d->type == type && strcmpic(d->name, name) == 0) skip = TRUE;
+  if (skip) continue;
+
+  d = store_get(sizeof(dns_held) + Ustrlen(name), name);
+  Ustrcpy(d->name, name);
+  d->type = type;
+  d->err = 0;
+  d->answer = NULL;
+  d->early = early;
+
+  /* One in the daemon's cache needs no query */
+
+#ifndef STAND_ALONE
+  if ((d->shared = dns_shared_fetch(name, type, buf, sizeof(buf),
+				    &d->len, &d->err)))
+    {
+    d->answer = store_get(d->len, GET_TAINTED);
+    memcpy(d->answer, buf, d->len);
+    d->next = dns_held_answers;
+    dns_held_answers = d;
+    continue;
+    }
+#else
+  d->shared = FALSE;
+#endif
+
+  if ((d->qlen = res_mkquery(QUERY, CS name, C_IN, type, NULL, 0, NULL,
+			  d->query, sizeof(d->query))) < HFIXEDSZ)
+    continue;
+  d->len = -1;
+  d->id = random_number(65536);
+  ((HEADER *)d->query)->id = htons(d->id);
+#ifdef RES_USE_DNSSEC
+  /* Ask for the AD bit, as the resolver library would */
+  if (os_get_dns_resolver_res()->options & RES_USE_DNSSEC)
+    ((HEADER *)d->query)->ad = 1;
+#endif
+  d->next = dns_held_answers;
+  dns_held_answers = d;
+  outstanding++;
+  }
+return outstanding;
+}
+
+
+/* Send the outstanding queries of one kind to all the nameservers */
+
+static void
+dns_prefetch_send(int sock, struct sockaddr_in * ns, int nscount, BOOL early)
+{
+for (dns_held * d = dns_held_answers; d; d = d->next)
+  if (d->len < 0 && d->early == early)
+    for (int i = 0; i < nscount; i++)
+      (void) sendto(sock, d->query, d->qlen, 0,
+		    (struct sockaddr *)(ns + i), sizeof(ns[i]));
+}
+
+
+/* Read one response from a socket, waiting up to the given time, and hold it
+if it answers an outstanding query.
+
+Returns:  TRUE if an outstanding query was answered
+*/
+
+static BOOL
+dns_prefetch_read(int sock, struct sockaddr_in * ns, int nscount, int ms)
+{
+struct pollfd p = {.fd = sock, .events = POLLIN};
+struct sockaddr_in from;
+socklen_t fromlen = sizeof(from);
+uschar buf[4096];
+int len;
+
+if (  poll(&p, 1, ms) > 0
+   && (len = recvfrom(sock, buf, sizeof(buf), 0,
+		      (struct sockaddr *)&from, &fromlen)) > 0)
+  for (int i = 0; i < nscount; i++)
+    if (  from.sin_addr.s_addr == ns[i].sin_addr.s_addr
+       && from.sin_port == ns[i].sin_port)
+      return dns_prefetch_response(buf, len);
+return FALSE;
+}
+
+
+/* Send lookups of one or more types for a set of names, and gather the
+answers.  All the lookups share the one timeout.
+
+Arguments:
+  names      vector of names
+  count      number of names
+  types      vector of types of DNS record required (T_A, T_MX, etc)
+  ntypes     number of types
+
+Returns:     nothing
+*/
+
+void
+dns_prefetch_types(const uschar ** names, int count, const int * types,
+  int ntypes)
+{
+res_state resp = os_get_dns_resolver_res();
+struct sockaddr_in ns[MAXNS];
+int nscount, outstanding = 0, sock;
+
+if (f.running_in_test_harness || count * ntypes < 2) return;
+if ((nscount = dns_prefetch_servers(ns)) == 0) return;
+for (int i = 0; i < ntypes; i++)
+  outstanding += dns_prefetch_queue(names, count, types[i], FALSE);
+if (outstanding == 0) return;
+
+if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+  {
+  dns_prefetch_clear();
+  return;
+  }
+
+DEBUG(D_dns) debug_printf("DNS: %d parallel %s%s lookups to %d server%s\n",
+  outstanding, dns_text_type(types[0]), ntypes > 1 ? "/..." : "",
+  nscount, nscount == 1 ? "" : "s");
+
+for (int try = 0; try < (resp->retry > 0 ? resp->retry : 1) && outstanding; try++)
+  {
+  struct timeval start, now;
+  int wait = (resp->retrans > 0 ? resp->retrans : 5) * 1000, ms;
+
+  dns_prefetch_send(sock, ns, nscount, FALSE);
+
+  gettimeofday(&start, NULL);
+  for (ms = wait; outstanding && ms > 0; )
+    {
+    if (dns_prefetch_read(sock, ns, nscount, ms)) outstanding--;
+    gettimeofday(&now, NULL);
+    ms = wait - (int)((now.tv_sec - start.tv_sec) * 1000
+		      + (now.tv_usec - start.tv_usec) / 1000);
+    }
+  }
+(void) close(sock);
+
+/* No answer at all is what the resolver would call TRY_AGAIN */
+
+for (dns_held * d = dns_held_answers; d; d = d->next)
+  if (d->len < 0 && !d->early)
+    {
+    DEBUG(D_dns) debug_printf("DNS: parallel lookup of %s timed out\n", d->name);
+    d->len = 0;
+    d->err = TRY_AGAIN;
+    }
+}
+
+
+/* Send lookups of one type for a set of names, and gather the answers */
+
+void
+dns_prefetch(const uschar ** names, int count, int type)
+{
+dns_prefetch_types(names, count, &type, 1);
+}
+
+
+/* Start lookups of one type for a set of names, without waiting for the
+answers.  The entries and their answers are in the permanent pool, as they
+are kept for the life of the process (an SMTP connection) until used.  A lookup
+that finds its early query still unanswered waits for it, but not beyond the
+time the resolver would allow for one lookup counted from when the query was
+sent; after that, lookups go to the resolver as usual.
+
+Arguments:
+  names      vector of names
+  count      number of names
+  type       type of DNS record required (T_A, T_PTR, etc)
+
+Returns:     nothing
+*/
+
+void
+dns_prefetch_start(const uschar ** names, int count, int type)
+{
+res_state resp = os_get_dns_resolver_res();
+struct sockaddr_in ns[MAXNS];
+int nscount, outstanding, old_pool = store_pool;
+
+if (f.running_in_test_harness || count < 1) return;
+if ((nscount = dns_prefetch_servers(ns)) == 0) return;
+if (dns_early_sock < 0 && (dns_early_sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+  return;
+
+store_pool = POOL_PERM;
+outstanding = dns_prefetch_queue(names, count, type, TRUE);
+store_pool = old_pool;
+if (outstanding == 0) return;
+
+DEBUG(D_dns) debug_printf("DNS: %d early %s lookups to %d server%s\n",
+  outstanding, dns_text_type(type), nscount, nscount == 1 ? "" : "s");
+
+dns_prefetch_send(dns_early_sock, ns, nscount, TRUE);
+gettimeofday(&dns_early_deadline, NULL);
+dns_early_deadline.tv_sec +=
+  (resp->retrans > 0 ? resp->retrans : 5) * (resp->retry > 0 ? resp->retry : 1);
+}
+
+
+/* Wait for the answer to an early lookup, while there is time left.  Other
+answers arriving meanwhile are held too.
+
+Returns:  TRUE if the answer has arrived
+*/
+
+static BOOL
+dns_prefetch_wait(dns_held * d)
+{
+struct sockaddr_in ns[MAXNS];
+int nscount = dns_prefetch_servers(ns), old_pool = store_pool;
+
+store_pool = POOL_PERM;
+while (d->len < 0)
+  {
+  struct timeval now;
+  int ms;
+
+  gettimeofday(&now, NULL);
+  ms = (int)((dns_early_deadline.tv_sec - now.tv_sec) * 1000
+	     + (dns_early_deadline.tv_usec - now.tv_usec) / 1000);
+  if (ms <= 0) break;
+  (void) dns_prefetch_read(dns_early_sock, ns, nscount, ms);
+  }
+store_pool = old_pool;
+return d->len >= 0;
+}
+
+
+/* Discard any held answers not used, except those of early lookups */
+
+void
+dns_prefetch_clear(void)
+{
+dns_held ** dp = &dns_held_answers;
+
+while (*dp)
+  if ((*dp)->early) dp = &(*dp)->next;
+  else *dp = (*dp)->next;
+}
+
+
+/* Take a held answer for a lookup, if there is one.  The answer goes into
+the dns_answer as res_search() would put it, with the length set to -1 and
+h_errno set for a failure.
+
+Arguments:
+  dnsa		where to put the answer
+  name, type	the lookup
+  shared	set TRUE if the answer came from the daemon's cache
+
+Returns:   TRUE if a held answer was used
+*/
+
+static BOOL
+dns_prefetched(dns_answer * dnsa, const uschar * name, int type, BOOL * shared)
+{
+for (dns_held ** dp = &dns_held_answers; *dp; dp = &(*dp)->next)
+  {
+  dns_held * d = *dp;
+  if (d->type == type && strcmpic(d->name, name) == 0)
+    {
+    BOOL answered = d->len >= 0 || dns_prefetch_wait(d);
+
+    *dp = d->next;
+    if (!answered)
+      {
+      DEBUG(D_dns) debug_printf("DNS: early lookup of %s timed out\n", name);
+      return FALSE;
+      }
+    *shared = d->shared;
+    if (d->answer)
+      memcpy(dnsa->answer, d->answer, d->len);
+    else
+      memset(dnsa->answer, 0, HFIXEDSZ);
+    dnsa->answerlen = d->err ? -1 : d->len;
+    h_errno = d->err;
+    DEBUG(D_dns) debug_printf("DNS lookup of %s (%s) using parallel lookup\n",
+      name, dns_text_type(type));
+    return TRUE;
+    }
+  }
+return FALSE;
+}
+
+
+
 /*************************************************
 *              Do basic DNS lookup               *
 *************************************************/
@@ -821,6 +1442,7 @@ int
 dns_basic_lookup(dns_answer * dnsa, const uschar * name, int type)
 {
 int rc;
+BOOL shared = FALSE;
 #ifndef STAND_ALONE
 const uschar * save_domain;
 static BOOL try_again_recursion = FALSE;
@@ -903,9 +1525,25 @@ if ((type == T_A || type == T_AAAA) && string_is_ip_address(name, NULL) != 0)
 domains, and interfaces to a fake nameserver for certain special zones. */
 
 h_errno = 0;
-dnsa->answerlen = f.running_in_test_harness
-  ? fakens_search(name, type, dnsa->answer, sizeof(dnsa->answer))
-  : res_search(CCS name, C_IN, type, dnsa->answer, sizeof(dnsa->answer));
+if (dns_held_answers && dns_prefetched(dnsa, name, type, &shared))
+  ;
+#ifndef STAND_ALONE
+else if (dns_shared_get(dnsa, name, type))
+  shared = TRUE;
+#endif
+else
+  {
+#ifndef STAND_ALONE
+  struct timeval start;
+  if (metrics) exim_gettime(&start);
+#endif
+  dnsa->answerlen = f.running_in_test_harness
+    ? fakens_search(name, type, dnsa->answer, sizeof(dnsa->answer))
+    : res_search(CCS name, C_IN, type, dnsa->answer, sizeof(dnsa->answer));
+#ifndef STAND_ALONE
+  if (metrics) metrics_time(METRICS_TIME_DNS, 0, &start);
+#endif
+  }
 
 if (dnsa->answerlen > (int) sizeof(dnsa->answer))
   {
@@ -915,6 +1553,12 @@ if (dnsa->answerlen > (int) sizeof(dnsa->answer))
   dnsa->answerlen = sizeof(dnsa->answer);
   }
 
+#ifndef STAND_ALONE
+if (!shared) dns_shared_put(dnsa, name, type);
+trace_event(TRACE_DNS, type, dnsa->answerlen,
+  dnsa->answerlen < 0 ? h_errno : 0);
+#endif
+
 if (dnsa->answerlen < 0) switch (h_errno)
   {
   case HOST_NOT_FOUND:
@@ -34,6 +34,598 @@ static tree_node *dnsbl_cache = NULL;
 #define MT_ALL 2
 
 
+/*************************************************
+*          DNS lists held in local zones         *
+*************************************************/
+
+/* With dnslist_zones set, lookups in the listed zones are answered from
+rbldnsd-format data files read into memory, instead of the DNS. The listening
+daemon reads the files before forking reception processes, which share its
+copy, and reads any that have changed again when a call arrives (no more often
+than every DNSBL_ZONE_RECHECK seconds). Other processes read them when first
+needed.
+
+Three of the rbldnsd dataset types are understood. For ip4set and ip6trie the
+entries are held, with IPv4 mapped into IPv6 space, as an array of address
+ranges sorted by start address, with a running maximum of the range ends.
+A check is a binary search and then a backward scan as far as that maximum
+allows; the range found is the most specific covering the address. For dnset
+the names are held in a sorted array with their wildcard kind. Excluded
+entries (those starting with '!') are held with a value of -1. All the text
+of a zone, names and values, goes in one arena, referenced by offset. */
+
+#define DNSBL_ZONE_RECHECK	5
+
+enum { ZT_IP4SET, ZT_IP6TRIE, ZT_DNSET };
+enum { ZN_EXACT, ZN_SUBS, ZN_BOTH };	/* name, *.name, .name */
+
+typedef struct {
+  unsigned	lo[4];
+  unsigned	hi[4];
+  unsigned	maxhi[4];		/* largest hi so far in the array */
+  int		value;			/* index in values, -1 to exclude */
+} zone_range;
+
+typedef struct {
+  int		name;			/* offset in text */
+  int		kind;
+  int		value;
+} zone_name;
+
+typedef struct {
+  int		a;			/* offsets in text; -1 for none */
+  int		txt;
+} zone_value;
+
+typedef struct dnsbl_zone {
+  struct dnsbl_zone * next;
+  const uschar * domain;
+  const uschar * file;
+  int		type;
+  time_t	mtime;
+  zone_range *	ranges;
+  int		nranges;
+  zone_name *	names;
+  int		nnames;
+  zone_value *	values;
+  int		nvalues;
+  uschar *	text;
+  int		textlen;
+} dnsbl_zone;
+
+static dnsbl_zone * dnsbl_zones = NULL;
+static BOOL	dnsbl_zones_read = FALSE;
+static time_t	dnsbl_zones_next_check = 0;
+
+
+/* Grow a store_malloc()ed array to hold one more element */
+
+static void *
+zone_grow(void * arr, int used, int * size, int elsize)
+{
+void * new;
+
+if (used < *size) return arr;
+*size = *size ? *size * 2 : 1024;
+new = store_malloc(*size * elsize);
+if (arr)
+  {
+  memcpy(new, arr, used * elsize);
+  store_free(arr);
+  }
+return new;
+}
+
+static int
+zone_text(dnsbl_zone * z, int * size, const uschar * s, int len)
+{
+int off = z->textlen;
+
+if (off + len + 1 > *size)
+  {
+  uschar * new = store_malloc(*size = (off + len + 1) * 2);
+  if (z->text)
+    {
+    memcpy(new, z->text, off);
+    store_free(z->text);
+    }
+  z->text = new;
+  }
+memcpy(z->text + off, s, len);
+z->text[off + len] = 0;
+z->textlen = off + len + 1;
+return off;
+}
+
+
+static void
+zone_free(dnsbl_zone * z)
+{
+if (z->ranges) store_free(z->ranges);
+if (z->names) store_free(z->names);
+if (z->values) store_free(z->values);
+if (z->text) store_free(z->text);
+z->ranges = NULL; z->names = NULL; z->values = NULL; z->text = NULL;
+z->nranges = z->nnames = z->nvalues = z->textlen = 0;
+}
+
+
+static int
+zone_cmp(const unsigned * a, const unsigned * b)
+{
+for (int i = 0; i < 4; i++)
+  if (a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+return 0;
+}
+
+/* Ranges sort by start, and the wider of two with the same start first, so
+that the backward scan meets the narrower one first. */
+
+static int
+zone_range_cmp(const void * a, const void * b)
+{
+const zone_range * ra = a, * rb = b;
+int c = zone_cmp(ra->lo, rb->lo);
+return c ? c : zone_cmp(rb->hi, ra->hi);
+}
+
+static const uschar * zone_sort_text;
+
+static int
+zone_name_cmp(const void * a, const void * b)
+{
+return Ustrcmp(zone_sort_text + ((const zone_name *)a)->name,
+	       zone_sort_text + ((const zone_name *)b)->name);
+}
+
+
+/* Convert an address, as from host_aton(), to the common form */
+
+static void
+zone_address(const int * x, int count, unsigned * a)
+{
+if (count == 1)
+  { a[0] = a[1] = 0; a[2] = 0xffff; a[3] = (unsigned)x[0]; }
+else
+  for (int i = 0; i < 4; i++) a[i] = (unsigned)x[i];
+}
+
+static void
+zone_mask(zone_range * r, const unsigned * a, int bits)
+{
+for (int i = 0; i < 4; i++, bits -= 32)
+  {
+  unsigned m = bits >= 32 ? 0xffffffffu : bits <= 0 ? 0 : ~(0xffffffffu >> bits);
+  r->lo[i] = a[i] & m;
+  r->hi[i] = a[i] | ~m;
+  }
+}
+
+
+/* Parse an ip4set entry: a.b.c.d, a.b.c, a.b or a, each optionally with
+/bits, or a range a.b.c.d-e.f.g.h whose end may give just the trailing
+octets. Returns the end of the entry, or NULL for a syntax error. */
+
+static const uschar *
+zone_ip4_entry(const uschar * s, zone_range * r)
+{
+unsigned oct[4] = {0}, v;
+int n = 0, bits;
+unsigned a[4];
+int x;
+
+do
+  {
+  if (!isdigit(*s)) return NULL;
+  for (v = 0; isdigit(*s); ) v = v * 10 + *s++ - '0';
+  if (v > 255) return NULL;
+  oct[n++] = v;
+  } while (n < 4 && *s == '.' && s++);
+
+bits = n * 8;
+x = (int)(oct[0] << 24 | oct[1] << 16 | oct[2] << 8 | oct[3]);
+zone_address(&x, 1, a);
+
+if (*s == '/')
+  {
+  for (s++, bits = 0; isdigit(*s); ) bits = bits * 10 + *s++ - '0';
+  if (bits > 32) return NULL;
+  }
+else if (*s == '-')
+  {
+  unsigned end[4];
+  int m = 0;
+
+  memcpy(end, oct, sizeof(end));
+  s++;
+  do
+    {
+    if (!isdigit(*s)) return NULL;
+    for (v = 0; isdigit(*s); ) v = v * 10 + *s++ - '0';
+    if (v > 255) return NULL;
+    end[m++] = v;
+    } while (m < 4 && *s == '.' && s++);
+
+  /* A short end replaces the trailing octets */
+
+  if (m < 4)
+    {
+    memmove(end + 4 - m, end, m * sizeof(unsigned));
+    for (int i = 0; i < 4 - m; i++) end[i] = oct[i];
+    }
+  zone_mask(r, a, 128);
+  r->hi[3] = end[0] << 24 | end[1] << 16 | end[2] << 8 | end[3];
+  return zone_cmp(r->lo, r->hi) <= 0 ? s : NULL;
+  }
+
+zone_mask(r, a, bits + 96);
+return s;
+}
+
+
+/* Parse an ip6trie entry: an address with optional /bits */
+
+static const uschar *
+zone_ip6_entry(const uschar * s, zone_range * r)
+{
+const uschar * e = s;
+uschar addr[64];
+int x[4], bits = 128, mask;
+unsigned a[4];
+
+while (*e && !isspace(*e)) e++;
+if (e - s >= sizeof(addr)) return NULL;
+memcpy(addr, s, e - s);
+addr[e - s] = 0;
+if (string_is_ip_addressX(addr, &mask, NULL) != 6) return NULL;
+if (mask)
+  {
+  bits = Uatoi(addr + mask + 1);
+  if (bits > 128) return NULL;
+  addr[mask] = 0;
+  }
+zone_address(x, host_aton(addr, x), a);
+zone_mask(r, a, bits);
+return e;
+}
+
+
+/* Parse a value: [:]a[:txt], where a is an address, a number n for
+127.0.0.n, or empty for the default. Returns the value index. */
+
+static int
+zone_value_for(dnsbl_zone * z, int * vsize, int * tsize, const uschar * s,
+  const zone_value * dflt)
+{
+zone_value v = *dflt;
+const uschar * e;
+
+if (*s == ':') s++;
+for (e = s; *e && *e != ':' && !isspace(*e); ) e++;
+if (e > s && e - s < 16)
+  {
+  uschar a[32];
+  int len = Ustrspn(s, "0123456789") == e - s
+    ? snprintf(CS a, sizeof(a), "127.0.0.%.*s", (int)(e - s), s)
+    : snprintf(CS a, sizeof(a), "%.*s", (int)(e - s), s);
+  v.a = string_is_ip_address(a, NULL) == 4 ? zone_text(z, tsize, a, len) : -1;
+  }
+if (*e) e++;
+while (isspace(*e)) e++;
+if (*e)
+  v.txt = zone_text(z, tsize, e, Ustrlen(e));
+
+z->values = zone_grow(z->values, z->nvalues, vsize, sizeof(zone_value));
+z->values[z->nvalues] = v;
+return z->nvalues++;
+}
+
+
+/* Read a zone file. The previous data is kept if it cannot be opened. */
+
+static void
+zone_load(dnsbl_zone * z)
+{
+FILE * f;
+struct stat st;
+int rsize = 0, nsize = 0, vsize = 0, tsize = 0, lineno = 0;
+int dflt_index;
+zone_value dflt;
+uschar buf[4096];
+dnsbl_zone nz = *z;
+
+if (!(f = Ufopen(z->file, "rb")))
+  {
+  log_write(0, LOG_MAIN|LOG_PANIC, "dnslist_zones: failed to open %s: %s",
+    z->file, strerror(errno));
+  z->mtime = 0;
+  return;
+  }
+if (fstat(fileno(f), &st) == 0) nz.mtime = st.st_mtime;
+nz.ranges = NULL; nz.names = NULL; nz.values = NULL; nz.text = NULL;
+nz.nranges = nz.nnames = nz.nvalues = nz.textlen = 0;
+
+dflt.a = zone_text(&nz, &tsize, US"127.0.0.2", 9);
+dflt.txt = -1;
+dflt_index = zone_value_for(&nz, &vsize, &tsize, US"", &dflt);
+
+while (Ufgets(buf, sizeof(buf), f))
+  {
+  uschar * s = buf, * e;
+  BOOL excl = FALSE;
+  int value;
+
+  lineno++;
+  for (e = s + Ustrlen(s); e > s && isspace(e[-1]); ) *--e = 0;
+  Uskip_whitespace(&s);
+  if (!*s || *s == '#' || *s == ';' || *s == '$') continue;
+
+  /* A line with only a value sets the default for those that follow */
+
+  if (*s == ':')
+    {
+    dflt_index = zone_value_for(&nz, &vsize, &tsize, s, &nz.values[dflt_index]);
+    dflt = nz.values[dflt_index];
+    continue;
+    }
+  if (*s == '!') { excl = TRUE; s++; }
+
+  if (z->type == ZT_DNSET)
+    {
+    int kind = ZN_EXACT, len;
+    zone_name * n;
+
+    if (*s == '*' && s[1] == '.') { kind = ZN_SUBS; s += 2; }
+    else if (*s == '.') { kind = ZN_BOTH; s++; }
+    for (e = s; *e && !isspace(*e) && *e != ':'; e++) *e = tolower(*e);
+    if ((len = e - s) > 0 && s[len-1] == '.') len--;
+    if (len == 0) goto BAD;
+
+    nz.names = zone_grow(nz.names, nz.nnames, &nsize, sizeof(zone_name));
+    n = &nz.names[nz.nnames];
+    n->kind = kind;
+    n->name = zone_text(&nz, &tsize, s, len);
+    }
+  else
+    {
+    zone_range * r;
+
+    nz.ranges = zone_grow(nz.ranges, nz.nranges, &rsize, sizeof(zone_range));
+    r = &nz.ranges[nz.nranges];
+    if (!(e = US (z->type == ZT_IP4SET ? zone_ip4_entry(s, r) : zone_ip6_entry(s, r)))
+       || (*e && !isspace(*e) && *e != ':'))
+      goto BAD;
+    }
+
+  while (isspace(*e)) e++;
+  value = excl ? -1
+    : *e ? zone_value_for(&nz, &vsize, &tsize, e, &dflt) : dflt_index;
+  if (z->type == ZT_DNSET)
+    nz.names[nz.nnames++].value = value;
+  else
+    nz.ranges[nz.nranges++].value = value;
+  continue;
+
+  BAD:
+    log_write(0, LOG_MAIN, "dnslist_zones: %s line %d: bad entry \"%s\"",
+      z->file, lineno, buf);
+  }
+(void) fclose(f);
+
+if (nz.nranges > 0)
+  {
+  qsort(nz.ranges, nz.nranges, sizeof(zone_range), zone_range_cmp);
+  memcpy(nz.ranges[0].maxhi, nz.ranges[0].hi, sizeof(nz.ranges[0].hi));
+  for (int i = 1; i < nz.nranges; i++)
+    memcpy(nz.ranges[i].maxhi,
+      zone_cmp(nz.ranges[i].hi, nz.ranges[i-1].maxhi) > 0
+      ? nz.ranges[i].hi : nz.ranges[i-1].maxhi, sizeof(nz.ranges[i].maxhi));
+  }
+if (nz.nnames > 0)
+  {
+  zone_sort_text = nz.text;
+  qsort(nz.names, nz.nnames, sizeof(zone_name), zone_name_cmp);
+  }
+
+DEBUG(D_dnsbl) debug_printf("dnslist zone %s: %d entries from %s\n",
+  z->domain, nz.nranges + nz.nnames, z->file);
+zone_free(z);
+*z = nz;
+}
+
+
+/* Parse dnslist_zones, once per process: a list of "<zone> <type> <file>". */
+
+static void
+zone_list_read(void)
+{
+const uschar * list = dnslist_zones;
+uschar * ele;
+int sep = 0;
+dnsbl_zone ** zp = &dnsbl_zones;
+int old_pool = store_pool;
+
+dnsbl_zones_read = TRUE;
+store_pool = POOL_PERM;
+while ((ele = string_nextinlist(&list, &sep, NULL, 0)))
+  {
+  uschar * s = ele, * f[3];
+  int n = 0;
+  const uschar * domain, * type, * file;
+  dnsbl_zone * z;
+
+  /* The file name is the remainder of the item */
+
+  for ( ; n < 3 && Uskip_whitespace(&s); n++)
+    {
+    f[n] = s;
+    if (n < 2)
+      {
+      while (*s && !isspace(*s)) s++;
+      if (*s) *s++ = 0;
+      }
+    }
+  domain = f[0]; type = f[1]; file = f[2];
+  if (n < 3)
+    {
+    log_write(0, LOG_MAIN|LOG_PANIC, "dnslist_zones: bad item \"%s\"", ele);
+    continue;
+    }
+
+  z = store_get(sizeof(dnsbl_zone), GET_UNTAINTED);
+  memset(z, 0, sizeof(*z));
+  z->domain = domain;
+  z->file = file;
+  if (Ustrcmp(type, "ip4set") == 0)	   z->type = ZT_IP4SET;
+  else if (Ustrcmp(type, "ip6trie") == 0) z->type = ZT_IP6TRIE;
+  else if (Ustrcmp(type, "dnset") == 0)   z->type = ZT_DNSET;
+  else
+    {
+    log_write(0, LOG_MAIN|LOG_PANIC, "dnslist_zones: unknown type \"%s\"", type);
+    continue;
+    }
+  *zp = z;
+  zp = &z->next;
+  }
+store_pool = old_pool;
+
+for (dnsbl_zone * z = dnsbl_zones; z; z = z->next) zone_load(z);
+}
+
+
+/* Called by the daemon when it starts, and for each call before forking:
+read any zone file that has changed. */
+
+void
+dnsbl_zones_check(void)
+{
+time_t now;
+
+if (!dnslist_zones) return;
+if (!dnsbl_zones_read)
+  {
+  zone_list_read();
+  dnsbl_zones_next_check = time(NULL) + DNSBL_ZONE_RECHECK;
+  return;
+  }
+if ((now = time(NULL)) < dnsbl_zones_next_check) return;
+dnsbl_zones_next_check = now + DNSBL_ZONE_RECHECK;
+
+for (dnsbl_zone * z = dnsbl_zones; z; z = z->next)
+  {
+  struct stat st;
+  if (Ustat(z->file, &st) == 0 ? st.st_mtime != z->mtime : z->mtime != 0)
+    zone_load(z);
+  }
+}
+
+
+static dnsbl_zone *
+zone_find(const uschar * domain)
+{
+if (!dnslist_zones) return NULL;
+if (!dnsbl_zones_read) zone_list_read();
+for (dnsbl_zone * z = dnsbl_zones; z; z = z->next)
+  if (strcmpic(z->domain, domain) == 0) return z;
+return NULL;
+}
+
+
+/* Find a dnset entry for a name, of one of the given kinds */
+
+static const zone_name *
+zone_name_find(const dnsbl_zone * z, const uschar * name, int kind)
+{
+int lo = 0, hi = z->nnames;
+
+while (lo < hi)
+  {
+  int mid = (lo + hi) / 2;
+  int c = Ustrcmp(z->text + z->names[mid].name, name);
+  if (c < 0) lo = mid + 1;
+  else if (c > 0) hi = mid;
+  else
+    {
+    for (lo = mid; lo > 0 && Ustrcmp(z->text + z->names[lo-1].name, name) == 0; )
+      lo--;
+    for ( ; lo < z->nnames && Ustrcmp(z->text + z->names[lo].name, name) == 0; lo++)
+      if (kind == ZN_EXACT
+	  ? z->names[lo].kind != ZN_SUBS : z->names[lo].kind != ZN_EXACT)
+	return &z->names[lo];
+    break;
+    }
+  }
+return NULL;
+}
+
+
+/* Look up a key in a local zone, filling in a cache block as the DNS
+lookup would. A $ in the text is replaced by the key. */
+
+static void
+zone_lookup(const dnsbl_zone * z, const uschar * key, dnsbl_cache_block * cb)
+{
+int value = -1;
+BOOL found = FALSE;
+
+if (z->type == ZT_DNSET)
+  {
+  uschar * name = string_copylc(key);
+  const zone_name * n = zone_name_find(z, name, ZN_EXACT);
+
+  for (const uschar * s = name; !n && (s = Ustrchr(s, '.')); )
+    n = zone_name_find(z, ++s, ZN_SUBS);
+  if (n) { found = TRUE; value = n->value; }
+  }
+else if (string_is_ip_address(key, NULL))
+  {
+  int x[4], lo = 0, hi = z->nranges;
+  unsigned a[4];
+
+  zone_address(x, host_aton(key, x), a);
+  while (lo < hi)
+    {
+    int mid = (lo + hi) / 2;
+    if (zone_cmp(z->ranges[mid].lo, a) <= 0) lo = mid + 1; else hi = mid;
+    }
+  for (int i = lo - 1; i >= 0 && zone_cmp(z->ranges[i].maxhi, a) >= 0; i--)
+    if (zone_cmp(z->ranges[i].hi, a) >= 0)
+      { found = TRUE; value = z->ranges[i].value; break; }
+  }
+
+cb->text_set = TRUE;
+cb->text = NULL;
+cb->rhs = NULL;
+cb->expiry = 0;
+
+if (found && value >= 0 && z->values[value].a >= 0)
+  {
+  const zone_value * v = &z->values[value];
+  const uschar * a = z->text + v->a;
+  dns_address * da = store_get(sizeof(dns_address) + Ustrlen(a), GET_UNTAINTED);
+
+  da->next = NULL;
+  Ustrcpy(da->address, a);
+  cb->rhs = da;
+  cb->rc = DNS_SUCCEED;
+  if (v->txt >= 0)
+    {
+    gstring * g = NULL;
+    for (const uschar * s = z->text + v->txt; *s; s++)
+      g = *s == '$' ? string_cat(g, key) : string_catn(g, s, 1);
+    cb->text = string_from_gstring(g);
+    }
+  if (cb->text && Ustrlen(cb->text) > 511) cb->text[511] = 0;
+  }
+else
+  cb->rc = DNS_NOMATCH;
+
+HDEBUG(D_dnsbl) debug_printf("dnslists: %s %s in local zone %s\n",
+  key, cb->rc == DNS_SUCCEED ? "found" : "not found", z->domain);
+}
+
+
+
 /*************************************************
 *          Perform a single dnsbl lookup         *
 *************************************************/
@@ -72,7 +664,8 @@ one_check_dnsbl(uschar *domain, uschar *domain_txt, uschar *keydomain,
 dns_answer * dnsa = store_get_dns_answer();
 dns_scan dnss;
 tree_node *t;
-dnsbl_cache_block *cb;
+dnsbl_cache_block *cb, local_cb;
+const dnsbl_zone * zone;
 int old_pool = store_pool;
 uschar * query;
 int qlen, yield;
@@ -88,9 +681,14 @@ if ((qlen = Ustrlen(query)) >= 256)
   goto out;
   }
 
+/* A zone held locally is answered from memory, without using the cache. */
+
+if ((zone = zone_find(domain)))
+  zone_lookup(zone, keydomain, cb = &local_cb);
+
 /* Look for this query in the cache. */
 
-if (  (t = tree_search(dnsbl_cache, query))
+else if (  (t = tree_search(dnsbl_cache, query))
    && (cb = t->data.ptr)->expiry > time(NULL)
    )
 
@@ -463,14 +1061,15 @@ Returns:    OK      successful lookup (i.e. the address is on the list), or
             DEFER   lookup failure, if +defer_unknown was set
 */
 
-int
-verify_check_dnsbl(int where, const uschar ** listptr, uschar ** log_msgptr)
+static int
+check_dnsbl_list(int where, const uschar ** listptr, uschar ** log_msgptr)
 {
 int sep = 0;
 int defer_return = FAIL;
 const uschar *list = *listptr;
 uschar *domain;
 uschar revadd[128];        /* Long enough for IPv6 address */
+struct timeval start;
 
 /* Indicate that the inverted IP address is not yet set up */
 
@@ -590,8 +1189,10 @@ while ((domain = string_nextinlist(&list, &sep, NULL, 0)))
       }
     if (!sender_host_address) return FAIL;    /* can never match */
     if (revadd[0] == 0) invert_address(revadd, sender_host_address);
+    if (LOGGING(receive_phases)) exim_gettime(&start);
     rc = one_check_dnsbl(domain, domain_txt, sender_host_address, revadd,
       iplist, bitmask, match_type, defer_return);
+    if (LOGGING(receive_phases)) metrics_dnslist_time(where, domain, &start);
     if (rc == OK)
       {
       dnslist_domain = string_copy(domain_txt);
@@ -622,8 +1223,10 @@ while ((domain = string_nextinlist(&list, &sep, NULL, 0)))
         prepend = keyrevadd;
         }
 
+      if (LOGGING(receive_phases)) exim_gettime(&start);
       rc = one_check_dnsbl(domain, domain_txt, keydomain, prepend, iplist,
         bitmask, match_type, defer_return);
+      if (LOGGING(receive_phases)) metrics_dnslist_time(where, domain, &start);
       if (rc == OK)
         {
         dnslist_domain = string_copy(domain_txt);
@@ -647,6 +1250,139 @@ while ((domain = string_nextinlist(&list, &sep, NULL, 0)))
 return FAIL;
 }
 
+
+
+
+/*************************************************
+*     Send the lookups of a dnslist together     *
+*************************************************/
+
+/* Work out the query names the list would use, in the same way as the loop
+above, and have those not already cached looked up in parallel.  The list is
+then checked in order as usual, finding the answers ready.  This costs
+lookups that a match early in the list would have made unnecessary, but saves
+waiting for the lists one after another.
+
+Arguments:
+  where     as for verify_check_dnsbl()
+  list      the dnslist
+  early     TRUE to start the lookups and not wait for them
+
+Returns:    nothing
+*/
+
+#define DNSBL_PREFETCH_MAX 64
+
+static void
+dnsbl_prefetch_add(const uschar ** names, int * count, const uschar * prepend,
+  const uschar * domain)
+{
+uschar * query = string_sprintf("%s.%s", prepend, domain);
+tree_node * t;
+
+if (  *count < DNSBL_PREFETCH_MAX && Ustrlen(query) < 256
+   && !(  (t = tree_search(dnsbl_cache, query))
+       && ((dnsbl_cache_block *)t->data.ptr)->expiry > time(NULL)))
+  names[(*count)++] = query;
+}
+
+static void
+dnsbl_prefetch(int where, const uschar * list, BOOL early)
+{
+int sep = 0, count = 0;
+const uschar * names[DNSBL_PREFETCH_MAX];
+uschar revadd[128];
+uschar * domain;
+
+revadd[0] = 0;
+while ((domain = string_nextinlist(&list, &sep, NULL, 0)))
+  {
+  uschar * key, * s, * keydomain;
+  int keysep = 0;
+
+  if (*domain == '+') continue;
+  if ((key = Ustrchr(domain, '/'))) *key++ = 0;
+  if ((s = Ustrchr(domain, '=')) || (s = Ustrchr(domain, '&')))
+    {
+    if (s > domain && s[-1] == '!') s--;
+    *s = 0;
+    }
+  if ((s = Ustrchr(domain, ','))) domain = s + 1;
+  if (zone_find(domain)) continue;		/* answered locally */
+
+  if (!key)
+    {
+    if (  sender_host_address
+       && where != ACL_WHERE_NOTSMTP_START && where != ACL_WHERE_NOTSMTP)
+      {
+      if (revadd[0] == 0) invert_address(revadd, sender_host_address);
+      dnsbl_prefetch_add(names, &count, revadd, domain);
+      }
+    }
+  else while ((keydomain = string_nextinlist(CUSS &key, &keysep, NULL, 0)))
+    {
+    uschar keyrevadd[128];
+
+    if (string_is_ip_address(keydomain, NULL) != 0)
+      {
+      invert_address(keyrevadd, keydomain);
+      keydomain = keyrevadd;
+      }
+    dnsbl_prefetch_add(names, &count, keydomain, domain);
+    }
+  }
+
+if (early) dns_prefetch_start(names, count, T_A);
+else dns_prefetch(names, count, T_A);
+}
+
+
+/* Start the lookups a dnslist will need for the connecting host, when the
+connection is accepted, so that their answers are likely to be ready by the
+time the ACL needs them.
+
+Arguments:  list      the dnslist
+Returns:    nothing
+*/
+
+void
+dnsbl_prefetch_early(const uschar * list)
+{
+dnsbl_prefetch(ACL_WHERE_CONNECT, list, TRUE);
+}
+
+
+
+/*************************************************
+*    Check a dnslist, with parallel lookups      *
+*************************************************/
+
+/* A wrapper for check_dnsbl_list() above, first sending the lookups it will
+need together.
+
+Arguments:  as for check_dnsbl_list()
+Returns:    as for check_dnsbl_list()
+*/
+
+int
+verify_check_dnsbl(int where, const uschar ** listptr, uschar ** log_msgptr)
+{
+struct timeval start;
+int rc;
+
+/* The queries are built with the resolver options set here. DNSSEC is not
+asked for, just as check_dnsbl_list() does not for the lookups it makes itself,
+so the answers are treated alike whichever way they came. */
+
+if (PHASE_TIMING) exim_gettime(&start);
+dns_init(FALSE, FALSE, FALSE);
+dnsbl_prefetch(where, *listptr, FALSE);
+rc = check_dnsbl_list(where, listptr, log_msgptr);
+dns_prefetch_clear();
+if (PHASE_TIMING) metrics_phase(RP_DNSLISTS, &start);
+return rc;
+}
+
 /* vi: aw ai sw=2
 */
 /* End of dnsbl.c.c */
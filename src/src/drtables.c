@@ -558,6 +558,9 @@ lookup_list[pos] = info;
  * which give parse errors on an extern in function scope.  Each entry needs
  * to also be invoked in init_lookup_list() below  */
 
+#if defined(LOOKUP_BLOOM) && LOOKUP_BLOOM!=2
+extern lookup_module_info bloom_lookup_module_info;
+#endif
 #if defined(LOOKUP_CDB) && LOOKUP_CDB!=2
 extern lookup_module_info cdb_lookup_module_info;
 #endif
@@ -622,6 +625,203 @@ extern lookup_module_info whoson_lookup_module_info;
 extern lookup_module_info readsock_lookup_module_info;
 
 
+#ifdef LOOKUP_MODULE_DIR
+/* The lookup types in each of the modules that can be built for dynamic
+loading.  A module named here is not opened when the list is set up; its types
+go into the list as entries with only a name, and the module is loaded by
+lookup_module_load() when search_findtype() first finds one of them.  Modules
+in the directory that are not named here are loaded at once, as before. */
+
+static const struct {
+  const uschar * module;
+  const uschar * types[5];
+} lazy_module_types[] = {
+  { US"bloom",		{ US"bloom" } },
+  { US"cdb",		{ US"cdb" } },
+  { US"dbmdb",		{ US"dbm", US"dbmjz", US"dbmnz" } },
+  { US"dnsdb",		{ US"dnsdb" } },
+  { US"dsearch",	{ US"dsearch" } },
+  { US"ibase",		{ US"ibase" } },
+  { US"json",		{ US"json" } },
+  { US"ldap",		{ US"ldap", US"ldapdn", US"ldapm" } },
+  { US"lmdb",		{ US"lmdb" } },
+  { US"lsearch",	{ US"iplsearch", US"lsearch", US"nwildlsearch", US"wildlsearch" } },
+  { US"mysql",		{ US"mysql" } },
+  { US"nis",		{ US"nis", US"nis0" } },
+  { US"nisplus",	{ US"nisplus" } },
+  { US"oracle",		{ US"oracle" } },
+  { US"passwd",		{ US"passwd" } },
+  { US"pgsql",		{ US"pgsql" } },
+  { US"redis",		{ US"redis" } },
+  { US"spf",		{ US"spf" } },
+  { US"sqlite",		{ US"sqlite" } },
+  { US"testdb",		{ US"testdb" } },
+  { US"whoson",		{ US"whoson" } },
+};
+
+/* A module waiting to be loaded, and the name-only entries for its types.
+These are in malloc store, as they outlive the reset at the end of
+init_lookup_list(). */
+
+typedef struct lazy_module {
+  struct lazy_module *	next;
+  uschar *		path;
+  lookup_info *		stubs;
+  int			nstubs;
+  BOOL			tried;
+} lazy_module;
+
+static lazy_module * lazy_modules = NULL;
+
+
+/* Open a lookup module and check that it is one.  The errors are logged, and
+also written to stderr when the module is being loaded at startup.
+
+Arguments:
+  path		the full path of the module file
+  name		its name in the directory, for messages
+  dlp		where to return the dlopen() handle
+  startup	TRUE when called from init_lookup_list()
+
+Returns:	the module's info block, or NULL
+*/
+
+static lookup_module_info *
+lookup_module_open(const uschar * path, const uschar * name, void ** dlp,
+  BOOL startup)
+{
+void * dl;
+lookup_module_info * info;
+const char * errormsg;
+
+if (!(dl = dlopen(CCS path, RTLD_NOW)))
+  {
+  errormsg = dlerror();
+  if (startup) fprintf(stderr, "Error loading %s: %s\n", name, errormsg);
+  log_write(0, LOG_MAIN|LOG_PANIC, "Error loading lookup module %s: %s\n", name, errormsg);
+  return NULL;
+  }
+
+/* FreeBSD nsdispatch() can trigger dlerror() errors about
+_nss_cache_cycle_prevention_function; we need to clear the dlerror()
+state before calling dlsym(), so that any error afterwards only comes
+from dlsym().  */
+
+errormsg = dlerror();
+
+info = (struct lookup_module_info*) dlsym(dl, "_lookup_module_info");
+if ((errormsg = dlerror()))
+  {
+  if (startup) fprintf(stderr, "%s does not appear to be a lookup module (%s)\n", name, errormsg);
+  log_write(0, LOG_MAIN|LOG_PANIC, "%s does not appear to be a lookup module (%s)\n", name, errormsg);
+  dlclose(dl);
+  return NULL;
+  }
+if (info->magic != LOOKUP_MODULE_INFO_MAGIC)
+  {
+  if (startup) fprintf(stderr, "Lookup module %s is not compatible with this version of Exim\n", name);
+  log_write(0, LOG_MAIN|LOG_PANIC, "Lookup module %s is not compatible with this version of Exim\n", name);
+  dlclose(dl);
+  return NULL;
+  }
+*dlp = dl;
+return info;
+}
+
+
+/* Note a module for loading when one of its types is wanted.
+
+Arguments:
+  path		the full path of the module file
+  name		its name in the directory
+  len		the length of the name
+
+Returns:	TRUE if the module is one of the known ones
+*/
+
+static BOOL
+add_lazy_module(const uschar * path, const uschar * name, int len)
+{
+int extlen = Ustrlen(DYNLIB_FN_EXT) + 1;	/* with the dot */
+
+for (int i = 0; i < nelem(lazy_module_types); i++)
+  {
+  const uschar * m = lazy_module_types[i].module;
+  const uschar * const * t = lazy_module_types[i].types;
+  lazy_module * lm;
+  int n = 0;
+
+  if (Ustrlen(m) != len - extlen || Ustrncmp(m, name, len - extlen) != 0)
+    continue;
+
+  while (n < nelem(lazy_module_types[i].types) && t[n]) n++;
+  lm = store_malloc(sizeof(lazy_module));
+  lm->path = string_copy_malloc(path);
+  lm->stubs = store_malloc(n * sizeof(lookup_info));
+  memset(lm->stubs, 0, n * sizeof(lookup_info));
+  for (int j = 0; j < n; j++) lm->stubs[j].name = US t[j];
+  lm->nstubs = n;
+  lm->tried = FALSE;
+  lm->next = lazy_modules;
+  lazy_modules = lm;
+  lookup_list_count += n;
+  return TRUE;
+  }
+return FALSE;
+}
+#endif	/*LOOKUP_MODULE_DIR*/
+
+
+/* If an entry in the lookup list is only a name, for a module that has not
+been loaded yet, load the module and put its types in their places.  A module
+that fails to load leaves its entries without a find function, so that the
+lookup type is reported as not available.
+
+Argument:	the index of the entry in lookup_list
+*/
+
+void
+lookup_module_load(int n)
+{
+#ifdef LOOKUP_MODULE_DIR
+lookup_info * li = lookup_list[n];
+lookup_module_info * info;
+void * dl;
+
+if (li->find) return;
+for (lazy_module * lm = lazy_modules; lm; lm = lm->next)
+  if (li >= lm->stubs && li < lm->stubs + lm->nstubs)
+    {
+    if (lm->tried) return;
+    lm->tried = TRUE;
+    DEBUG(D_lookup) debug_printf("Loading lookup module %s for \"%s\"\n",
+      lm->path, li->name);
+
+    if (!(info = lookup_module_open(lm->path, lm->path, &dl, FALSE)))
+      return;
+
+    for (int j = 0; j < info->lookupcount; j++)
+      {
+      lookup_info * real = info->lookups[j];
+      int k;
+
+      for (k = 0; k < lookup_list_count; k++)
+	if (  lookup_list[k] >= lm->stubs && lookup_list[k] < lm->stubs + lm->nstubs
+	   && Ustrcmp(lookup_list[k]->name, real->name) == 0)
+	  {
+	  lookup_list[k] = real;
+	  break;
+	  }
+      if (k >= lookup_list_count)
+	DEBUG(D_lookup) debug_printf("lookup type \"%s\" in %s is not listed;"
+	  " ignored\n", real->name, lm->path);
+      }
+    return;
+    }
+#endif
+}
+
+
 void
 init_lookup_list(void)
 {
@@ -639,6 +839,10 @@ if (lookup_list_init_done)
 reset_point = store_mark();
 lookup_list_init_done = TRUE;
 
+#if defined(LOOKUP_BLOOM) && LOOKUP_BLOOM!=2
+addlookupmodule(NULL, &bloom_lookup_module_info);
+#endif
+
 #if defined(LOOKUP_CDB) && LOOKUP_CDB!=2
 addlookupmodule(NULL, &cdb_lookup_module_info);
 #endif
@@ -742,7 +946,6 @@ else
       int pathnamelen = len + (int)strlen(LOOKUP_MODULE_DIR) + 2;
       void *dl;
       struct lookup_module_info *info;
-      const char *errormsg;
 
       /* SRH: am I being paranoid here or what? */
       if (pathnamelen > big_buffer_size)
@@ -755,36 +958,14 @@ else
       /* SRH: snprintf here? */
       sprintf(CS big_buffer, "%s/%s", LOOKUP_MODULE_DIR, name);
 
-      if (!(dl = dlopen(CS big_buffer, RTLD_NOW)))
+      if (add_lazy_module(big_buffer, US name, len))
 	{
-	errormsg = dlerror();
-	fprintf(stderr, "Error loading %s: %s\n", name, errormsg);
-	log_write(0, LOG_MAIN|LOG_PANIC, "Error loading lookup module %s: %s\n", name, errormsg);
-	moduleerrors++;
+	DEBUG(D_lookup) debug_printf("Noted \"%s\" for loading when used\n", name);
 	continue;
 	}
 
-      /* FreeBSD nsdispatch() can trigger dlerror() errors about
-      _nss_cache_cycle_prevention_function; we need to clear the dlerror()
-      state before calling dlsym(), so that any error afterwards only comes
-      from dlsym().  */
-
-      errormsg = dlerror();
-
-      info = (struct lookup_module_info*) dlsym(dl, "_lookup_module_info");
-      if ((errormsg = dlerror()))
+      if (!(info = lookup_module_open(big_buffer, US name, &dl, TRUE)))
 	{
-	fprintf(stderr, "%s does not appear to be a lookup module (%s)\n", name, errormsg);
-	log_write(0, LOG_MAIN|LOG_PANIC, "%s does not appear to be a lookup module (%s)\n", name, errormsg);
-	dlclose(dl);
-	moduleerrors++;
-	continue;
-	}
-      if (info->magic != LOOKUP_MODULE_INFO_MAGIC)
-	{
-	fprintf(stderr, "Lookup module %s is not compatible with this version of Exim\n", name);
-	log_write(0, LOG_MAIN|LOG_PANIC, "Lookup module %s is not compatible with this version of Exim\n", name);
-	dlclose(dl);
 	moduleerrors++;
 	continue;
 	}
@@ -810,6 +991,11 @@ memset(lookup_list, 0, sizeof(lookup_info *) * lookup_list_count);
 for (struct lookupmodulestr * p = lookupmodules; p; p = p->next)
   for (int j = 0; j < p->info->lookupcount; j++)
     add_lookup_to_list(p->info->lookups[j]);
+#ifdef LOOKUP_MODULE_DIR
+for (lazy_module * lm = lazy_modules; lm; lm = lm->next)
+  for (int j = 0; j < lm->nstubs; j++)
+    add_lookup_to_list(lm->stubs + j);
+#endif
 store_reset(reset_point);
 /* just to be sure */
 lookupmodules = NULL;
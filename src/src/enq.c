@@ -26,8 +26,12 @@ or ETRN run. If increasing the count would take us past the given limit
 value return FALSE.  If not, bump it and return TRUE.  If not found, create
 one with value 1 and return TRUE.
 
+If a limit key is given, a record for it holds a lower limit that is in force
+for the time being; see enq_limit_adjust() below.
+
 Arguments:
   key            string on which to serialize
+  limkey         key for an adaptive limit, or NULL
   lim            parallelism limit
 
 Returns:         TRUE if OK to proceed; FALSE otherwise
@@ -35,7 +39,7 @@ Returns:         TRUE if OK to proceed; FALSE otherwise
 
 
 BOOL
-enq_start(uschar *key, unsigned lim)
+enq_start_limited(uschar * key, const uschar * limkey, unsigned lim)
 {
 dbdata_serialize *serial_record;
 dbdata_serialize new_record;
@@ -52,6 +56,16 @@ O_RDONLY as its argument. */
 if (!(dbm_file = dbfn_open(US"misc", O_RDWR, &dbblock, TRUE, TRUE)))
   return FALSE;
 
+if (  limkey
+   && (serial_record = dbfn_read_enforce_length(dbm_file, limkey,
+					      sizeof(dbdata_serialize)))
+   && time(NULL) - serial_record->time_stamp < 6*60*60
+   && serial_record->count < lim)
+  {
+  lim = serial_record->count > 0 ? serial_record->count : 1;
+  DEBUG(D_transport) debug_printf("limit for %s is %u\n", key, lim);
+  }
+
 /* See if there is a record for this host or queue run; if there is, we cannot
 proceed with the connection unless the record is very old. */
 
@@ -79,6 +93,69 @@ dbfn_close(dbm_file);
 return TRUE;
 }
 
+BOOL
+enq_start(uschar * key, unsigned lim)
+{
+return enq_start_limited(key, NULL, lim);
+}
+
+
+
+/*************************************************
+*     Adjust an adaptive serialization limit     *
+*************************************************/
+
+/* This function is called after a serialized connection, to move the limit
+on connections to the host: halved after the host sent a temporary error, and
+up by one after a clean delivery. Once the limit is back up to the configured
+one, the record is deleted. Like the serialization records, one that has not
+been touched for six hours is ignored.
+
+Arguments:
+  limkey       the key for the limit record
+  lim          the configured limit
+  adjust       negative to back off, positive to grow, zero for no change
+
+Returns:       nothing
+*/
+
+void
+enq_limit_adjust(const uschar * limkey, unsigned lim, int adjust)
+{
+open_db dbblock;
+open_db *dbm_file;
+dbdata_serialize * rec, new_record;
+unsigned cur;
+
+if (adjust == 0 || !(dbm_file = dbfn_open(US"misc", O_RDWR, &dbblock, TRUE, TRUE)))
+  return;
+
+if (  (rec = dbfn_read_enforce_length(dbm_file, limkey, sizeof(dbdata_serialize)))
+   && time(NULL) - rec->time_stamp >= 6*60*60)
+  rec = NULL;
+cur = rec && rec->count > 0 && rec->count < lim ? rec->count : lim;
+
+if (adjust < 0)
+  new_record.count = cur > 1 ? cur / 2 : 1;
+else if (!rec)
+  { dbfn_close(dbm_file); return; }
+else
+  new_record.count = cur + 1;
+
+if (new_record.count >= lim)
+  {
+  DEBUG(D_transport) debug_printf("remove limit record %s\n", limkey);
+  dbfn_delete(dbm_file, limkey);
+  }
+else
+  {
+  DEBUG(D_transport) debug_printf("write limit record %s val %d\n",
+    limkey, new_record.count);
+  dbfn_write(dbm_file, limkey, &new_record, (int)sizeof(dbdata_serialize));
+  }
+dbfn_close(dbm_file);
+}
+
 
 
 /*************************************************
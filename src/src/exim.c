@@ -324,6 +324,7 @@ usr1_handler(int sig)
 int fd;
 
 os_restarting_signal(sig, usr1_handler);
+trace_ring_dump("signal");
 
 if (!process_log_path) return;
 fd = log_open_as_exim(process_log_path);
@@ -811,7 +812,9 @@ Returns:     does not return
 void
 exim_exit(int rc)
 {
+receive_id_lead_wait();
 search_tidyup();
+metrics_store();
 store_exit();
 DEBUG(D_any)
   debug_printf(">>>>>>>>>>>>>>>> Exim pid=%d (%s) terminating with rc=%d "
@@ -824,6 +827,8 @@ exit(rc);
 void
 exim_underbar_exit(int rc)
 {
+receive_id_lead_wait();
+metrics_store();
 store_exit();
 DEBUG(D_any)
   debug_printf(">>>>>>>>>>>>>>>> Exim pid=%d (%s) terminating with rc=%d "
@@ -1013,6 +1018,9 @@ else
 g = string_cat(g, US"Probably ndbm\n");
 #elif defined(USE_TDB)
 g = string_cat(g, US"Using tdb\n");
+#elif defined(USE_LMDB)
+g = string_fmt_append(g, "Using LMDB: Compile: %d.%d.%d\n",
+  MDB_VERSION_MAJOR, MDB_VERSION_MINOR, MDB_VERSION_PATCH);
 #else
 # ifdef USE_GDBM
   g = string_cat(g, US"Probably GDBM (native mode)\n");
@@ -1161,6 +1169,9 @@ g = string_cat(g, US"Lookups (built-in):");
 #if defined(LOOKUP_LSEARCH) && LOOKUP_LSEARCH!=2
   g = string_cat(g, US" lsearch wildlsearch nwildlsearch iplsearch");
 #endif
+#if defined(LOOKUP_BLOOM) && LOOKUP_BLOOM!=2
+  g = string_cat(g, US" bloom");
+#endif
 #if defined(LOOKUP_CDB) && LOOKUP_CDB!=2
   g = string_cat(g, US" cdb");
 #endif
@@ -1312,8 +1323,11 @@ g = NULL;
 
 init_lookup_list();
 for (int i = 0; i < lookup_list_count; i++)
+  {
+  lookup_module_load(i);
   if (lookup_list[i]->version_report)
     g = lookup_list[i]->version_report(g);
+  }
 show_string(is_stdout, g);
 g = NULL;
 
@@ -1326,6 +1340,11 @@ g = NULL;
   g = string_fmt_append(g, "TRUSTED_CONFIG_LIST: \"%s\"\n", TRUSTED_CONFIG_LIST);
 #else
   g = string_cat(g, US"TRUSTED_CONFIG_LIST unset\n");
+#endif
+#ifdef CONFIGURE_CACHE
+  g = string_fmt_append(g, "CONFIGURE_CACHE: \"%s\"\n", CONFIGURE_CACHE);
+#else
+  g = string_cat(g, US"CONFIGURE_CACHE unset\n");
 #endif
   }
 
@@ -1781,6 +1800,9 @@ int  test_rewrite_arg = -1;
 gid_t original_egid;
 BOOL arg_queue_only = FALSE;
 BOOL bi_option = FALSE;
+#ifdef SUPPORT_BENCHMARKS
+BOOL bench_test = FALSE;
+#endif
 BOOL checking = FALSE;
 BOOL count_queue = FALSE;
 BOOL expansion_test = FALSE;
@@ -2283,6 +2305,14 @@ on the second character (the one after '-'), to save some effort. */
 	  else if (*argrest) badarg = TRUE;
 	  break;
 
+#ifdef SUPPORT_BENCHMARKS
+	/* -bB:  Run a microbenchmark; the arguments follow */
+	case 'B':
+	  bench_test = checking = TRUE;
+	  if (*argrest) badarg = TRUE;
+	  break;
+#endif
+
 	/* -be:  Run in expansion test mode
 	   -bem: Ditto, but read a message from a file first
 	*/
@@ -2986,6 +3016,31 @@ on the second character (the one after '-'), to save some effort. */
 
 	case 'A': f.smtp_authenticated = TRUE; break;
 
+    /* -MCB: the rest of a batch of messages for the host, collected by the
+    first phase of a 2-stage queue run; this is useful only when it precedes
+    -MC (see above) */
+
+	case 'B': if (++i < argc)
+		    {
+		    const uschar * s = exim_str_fail_toolong(argv[i],
+			CONTINUE_BATCH_MAX * MESSAGE_ID_LENGTH, "-MCB");
+		    uschar mid[MESSAGE_ID_LENGTH + 1];
+		    int len = Ustrlen(s);
+
+		    if (len % MESSAGE_ID_LENGTH) badarg = TRUE;
+		    else for (int j = 0; j < len; j += MESSAGE_ID_LENGTH)
+		      {
+		      Ustrncpy_nt(mid, s + j, MESSAGE_ID_LENGTH);
+		      mid[MESSAGE_ID_LENGTH] = '\0';
+		      if (!mac_ismsgid(mid))
+			exim_fail("exim: malformed message id %s after -MCB "
+			  "option\n", mid);
+		      }
+		    continue_batch = string_copy_taint(s, GET_UNTAINTED);
+		    }
+		  else badarg = TRUE;
+		  break;
+
     /* -MCD: set the smtp_use_dsn flag; this indicates that the host
        that exim is connected to supports the esmtp extension DSN */
 
@@ -3126,6 +3181,7 @@ on the second character (the one after '-'), to save some effort. */
        -Mg   give up on the messages
        -Mt   thaw the messages
        -Mrm  remove the messages
+       -Mwh  rewrite the spool header files in the configured format
     In the above cases, this must be the last option. There are also the
     following options which are followed by a single message id, and which
     act on that message. Some of them use the "recipient" addresses as well.
@@ -3204,6 +3260,7 @@ on the second character (the one after '-'), to save some effort. */
       msg_action = MSG_SHOW_LOG;
       one_msg_action = TRUE;
       }
+    else if (Ustrcmp(argrest, "wh") == 0) msg_action = MSG_REWRITE_HEADER;
     else { badarg = TRUE; break; }
 
     /* All the -Mxx options require at least one message id. */
@@ -3216,6 +3273,9 @@ on the second character (the one after '-'), to save some effort. */
 
     if (!one_msg_action)
       {
+      if (  msg_action != MSG_DELIVER && argc == msg_action_arg + 1
+	 && Ustrcmp(argv[msg_action_arg], "-") == 0)
+	goto END_ARG;   /* Ids on stdin */
       for (int j = msg_action_arg; j < argc; j++) if (!mac_ismsgid(argv[j]))
         exim_fail("exim: malformed message id %s after %s option\n",
           argv[j], arg);
@@ -4038,6 +4098,10 @@ if ((                                            /* EITHER */
     ) ||                                         /*   OR   */
     expansion_test                               /* expansion testing */
     ||                                           /*   OR   */
+#ifdef SUPPORT_BENCHMARKS
+    bench_test                                   /* benchmarking */
+    ||                                           /*   OR   */
+#endif
     filter_test != FTEST_NONE)                   /* Filter testing */
   {
   setgroups(group_count, group_list);
@@ -4138,6 +4202,7 @@ defined) */
   store_pool = POOL_CONFIG;
   readconf_main(checking || list_options);
   store_pool = old_pool;
+  trace_ring_init();
 
 #ifdef MEASURE_TIMING
   report_time_since(&t0, US"readconf_main (delta)");
@@ -4370,12 +4435,18 @@ if (  removed_privilege
 /* Start up Perl interpreter if Perl support is configured and there is a
 perl_startup option, and the configuration or the command line specifies
 initializing starting. Note that the global variables are actually called
-opt_perl_xxx to avoid clashing with perl's namespace (perl_*). */
+opt_perl_xxx to avoid clashing with perl's namespace (perl_*).
+With perl_at_daemon_start, a daemon starts it before forking any children, so
+that they inherit it ready for use; -pd overrides that too. */
 
 #ifdef EXIM_PERL
 if (perl_start_option != 0)
   opt_perl_at_start = (perl_start_option > 0);
-if (opt_perl_at_start && opt_perl_startup != NULL)
+if (  (  opt_perl_at_start
+      || (  opt_perl_at_daemon_start && perl_start_option == 0
+	 && (f.daemon_listen || f.inetd_wait_mode || is_multiple_qrun())
+      )  )
+   && opt_perl_startup != NULL)
   {
   uschar *errstr;
   DEBUG(D_any) debug_printf("Starting Perl interpreter\n");
@@ -4713,7 +4784,7 @@ if (list_queue)
 if (count_queue)
   {
   set_process_info("counting the queue");
-  fprintf(stdout, "%u\n", queue_count());
+  fprintf(stdout, "%u\n", queue_index_queue_count());
   exit(EXIT_SUCCESS);
   }
 
@@ -4741,12 +4812,15 @@ if (msg_action_arg > 0 && msg_action != MSG_DELIVER && msg_action != MSG_LOAD)
 
   if (!one_msg_action)
     {
-    for (i = msg_action_arg; i < argc; i++)
-      if (!queue_action(argv[i], msg_action, NULL, 0, 0))
-        yield = EXIT_FAILURE;
+    if (!queue_action_list(
+	  argc == msg_action_arg + 1 && Ustrcmp(argv[msg_action_arg], "-") == 0
+	  ? NULL : argv + msg_action_arg,
+	  argc - msg_action_arg, msg_action))
+      yield = EXIT_FAILURE;
     switch (msg_action)
       {
-      case MSG_REMOVE: case MSG_FREEZE: case MSG_THAW: break;
+      case MSG_REMOVE: case MSG_FREEZE: case MSG_THAW:
+      case MSG_REWRITE_HEADER: break;
       default: printf("\n"); break;
       }
     }
@@ -5304,6 +5378,20 @@ if (verify_address_mode || f.address_test_mode)
   exim_exit(exit_value);
   }
 
+#ifdef SUPPORT_BENCHMARKS
+/* Handle benchmarking. The remaining arguments name the benchmark and give its
+parameters. Some of them read messages from the spool, so restrict it to admin
+users. */
+
+if (bench_test)
+  {
+  if (!f.admin_user)
+    exim_fail("exim: permission denied\n");
+  dns_init(FALSE, FALSE, FALSE);
+  exim_exit(bench_run(argc - recipients_arg, CUSS argv + recipients_arg));
+  }
+#endif
+
 /* Handle expansion checking. Either expand items on the command line, or read
 from stdin if there aren't any. If -Mset was specified, load the message so
 that its variables can be used, but restrict this facility to admin users.
@@ -5322,11 +5410,14 @@ if (expansion_test)
     Get an untainted version so file opens can be done. */
     message_id = string_copy_taint(message_id, GET_UNTAINTED);
 
+    /* Only the header file is read here; the data file is opened if an
+    expansion needs the body or the message size. */
+
     spoolname = string_sprintf("%s-H", message_id);
-    if ((deliver_datafile = spool_open_datafile(message_id)) < 0)
-      printf ("Failed to load message datafile %s\n", message_id);
     if (spool_read_header(spoolname, TRUE, FALSE) != spool_read_OK)
       printf ("Failed to load message %s\n", message_id);
+    else
+      f.spool_header_only = TRUE;
     }
 
   /* Read a test message from a file. We fudge it up to be on stdin, saving
@@ -6045,6 +6136,7 @@ for (BOOL more = TRUE; more; )
   if (local_queue_only)
     {
     cancel_cutthrough_connection(TRUE, US"no delivery; queueing");
+    receive_msglog_write();
     switch(queue_only_reason)
       {
       case 2:
@@ -6103,6 +6195,7 @@ for (BOOL more = TRUE; more; )
     if (pid < 0)
       {
       cancel_cutthrough_connection(TRUE, US"delivery fork failed");
+      receive_msglog_write();
       log_write(0, LOG_MAIN|LOG_PANIC, "failed to fork automatic delivery "
         "process: %s", strerror(errno));
       }
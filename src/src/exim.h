@@ -574,6 +574,19 @@ requires various things that are set therein. */
 # define EXIMfsync(f) fsync(f)
 #endif
 
+/* For a file that is only appended to, such as a journal, fdatasync() is
+enough: it still pushes out the size, which is needed to read the data back. */
+
+#if defined(_POSIX_SYNCHRONIZED_IO) && _POSIX_SYNCHRONIZED_IO > 0
+# ifdef ENABLE_DISABLE_FSYNC
+#  define EXIMfdatasync(f) (disable_fsync? 0 : fdatasync(f))
+# else
+#  define EXIMfdatasync(f) fdatasync(f)
+# endif
+#else
+# define EXIMfdatasync(f) EXIMfsync(f)
+#endif
+
 /* Backward compatibility; LOOKUP_LSEARCH now includes all three */
 
 #if (!defined LOOKUP_LSEARCH) && (defined LOOKUP_WILDLSEARCH || defined LOOKUP_NWILDLSEARCH)
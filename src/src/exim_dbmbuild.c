@@ -16,9 +16,15 @@ never get flushed out.
 
 This program is clever enough to cope with ndbm, which creates two files called
 <name>.dir and <name>.pag, or with db, which creates a single file called
-<name>.db. If native db is in use (USE_DB defined) or tdb is in use (USE_TDB
-defined) there is no extension to the output filename. This is also handled. If
-there are any other variants, the program won't cope.
+<name>.db. If native db is in use (USE_DB defined) or tdb, gdbm or lmdb is in
+use (USE_TDB, USE_GDBM or USE_LMDB defined) there is no extension to the output
+filename. This is also handled. If there are any other variants, the program
+won't cope.
+
+With the -cdb option a CDB file, for the cdb lookup, is written instead of a
+DBM file, whatever DBM library is in use. It is written in one sequential pass,
+with the hash tables built in memory, which is much quicker than inserting a
+large number of records into a DBM file.
 
 The first argument to the program is the name of the serial file; the second
 is the base name for the DBM file(s). When native db is in use, these must be
@@ -31,6 +37,7 @@ characters. */
 
 
 #include "exim.h"
+#include "bloom.h"
 
 uschar * spool_directory = NULL;	/* dummy for hintsdb.h */
 
@@ -74,6 +81,8 @@ struct global_flags	f;
 unsigned int		log_selector[1];
 uschar *		queue_name;
 BOOL			split_spool_directory;
+int			spool_shard_count;
+const uschar **		spool_shard_roots;
 
 
 /* These introduced by the taintwarn handling */
@@ -161,6 +170,380 @@ return ch;
 }
 
 
+/*************************************************
+*             Writing a CDB file                 *
+*************************************************/
+
+/* A CDB file starts with 256 (position, length) pairs locating its hash
+tables. Then come the records, each a key length, data length, key and data,
+and then the tables. Each table has twice as many slots as there are keys in
+it, each slot holding a hash value and record position, all in little-endian
+32-bit numbers. A key is put in table (hash & 255), starting at slot
+((hash >> 8) % length) and moving on past used slots. See
+http://cr.yp.to/cdb/cdb.txt.
+
+While writing, the hashes and positions are kept in an array, and an open hash
+index of that array is used to find duplicate keys. Records with the same hash
+as a new key are read back from the file to compare the keys; that is rare
+except for actual duplicates. */
+
+typedef struct {
+  uint32_t	hash;
+  uint32_t	pos;
+} cdb_entry;
+
+typedef struct {
+  FILE *	f;
+  uint32_t	pos;		/* where the next record goes */
+  cdb_entry *	entries;
+  unsigned	count;
+  unsigned	size;
+  unsigned *	index;		/* entry number + 1; 0 for an empty slot */
+  unsigned	index_size;	/* a power of two */
+} cdb_out;
+
+
+static uint32_t
+cdb_hash(const uschar * s, unsigned len)
+{
+uint32_t h = 5381;
+while (len--) h = (h + (h << 5)) ^ *s++;
+return h;
+}
+
+static void
+cdb_pack(uschar * buf, uint32_t n)
+{
+buf[0] = n & 0xff; buf[1] = (n >> 8) & 0xff;
+buf[2] = (n >> 16) & 0xff; buf[3] = n >> 24;
+}
+
+
+/* Find the index slot of an entry with the given key, or the empty slot
+where it would go. Returns -1 on a read error. */
+
+static long
+cdb_index_find(cdb_out * c, uint32_t h, const uschar * key, unsigned klen)
+{
+unsigned mask = c->index_size - 1;
+uschar buf[8 + 256];
+
+for (unsigned i = h & mask; ; i = (i + 1) & mask)
+  {
+  cdb_entry * e;
+
+  if (!c->index[i]) return i;
+  e = c->entries + c->index[i] - 1;
+  if (e->hash != h) continue;
+
+  if (  fflush(c->f) != 0
+     || pread(fileno(c->f), buf, 8 + klen, e->pos) != 8 + klen)
+    return -1;
+  if (  (buf[0] | buf[1] << 8 | buf[2] << 16 | (uint32_t)buf[3] << 24) == klen
+     && memcmp(buf + 8, key, klen) == 0)
+    return i;
+  }
+}
+
+
+/* Add the entry for a record to the array and the index, growing them as
+necessary. Returns FALSE if out of memory. */
+
+static BOOL
+cdb_add_entry(cdb_out * c, uint32_t h, uint32_t pos, long slot)
+{
+if (c->count >= c->size)
+  {
+  unsigned size = c->size ? c->size * 2 : 4096;
+  cdb_entry * e = realloc(c->entries, size * sizeof(cdb_entry));
+  if (!e) return FALSE;
+  c->entries = e;
+  c->size = size;
+  }
+c->entries[c->count].hash = h;
+c->entries[c->count].pos = pos;
+c->index[slot] = ++c->count;
+
+/* Keep the index no more than half full */
+
+if (c->count * 2 > c->index_size)
+  {
+  unsigned nsize = c->index_size * 2, mask = nsize - 1;
+  unsigned * index = calloc(nsize, sizeof(unsigned));
+
+  if (!index) return FALSE;
+  for (unsigned n = 0; n < c->count; n++)
+    {
+    unsigned i = c->entries[n].hash & mask;
+    while (index[i]) i = (i + 1) & mask;
+    index[i] = n + 1;
+    }
+  free(c->index);
+  c->index = index;
+  c->index_size = nsize;
+  }
+return TRUE;
+}
+
+
+static BOOL
+cdb_write_record(cdb_out * c, EXIM_DATUM * key, EXIM_DATUM * content)
+{
+unsigned klen = exim_datum_size_get(key), dlen = exim_datum_size_get(content);
+uschar buf[8];
+
+if ((uint64_t)c->pos + 8 + klen + dlen > 0xffffffffUL - 256*8)
+  { errno = EFBIG; return FALSE; }
+cdb_pack(buf, klen);
+cdb_pack(buf + 4, dlen);
+if (  fwrite(buf, 1, 8, c->f) != 8
+   || fwrite(exim_datum_data_get(key), 1, klen, c->f) != klen
+   || fwrite(exim_datum_data_get(content), 1, dlen, c->f) != dlen)
+  return FALSE;
+c->pos += 8 + klen + dlen;
+return TRUE;
+}
+
+
+/* The equivalents of exim_dbputb() and exim_dbput(). For a duplicate, the
+record is written again and the entry pointed at the new copy; the old one is
+left unreferenced in the file. */
+
+static int
+cdb_putb(cdb_out * c, EXIM_DATUM * key, EXIM_DATUM * content)
+{
+uschar * k = exim_datum_data_get(key);
+unsigned klen = exim_datum_size_get(key);
+uint32_t h = cdb_hash(k, klen), pos = c->pos;
+long slot = cdb_index_find(c, h, k, klen);
+
+if (slot < 0) return -1;
+if (c->index[slot]) return EXIM_DBPUTB_DUP;
+return cdb_write_record(c, key, content) && cdb_add_entry(c, h, pos, slot)
+  ? EXIM_DBPUTB_OK : -1;
+}
+
+static int
+cdb_put(cdb_out * c, EXIM_DATUM * key, EXIM_DATUM * content)
+{
+uschar * k = exim_datum_data_get(key);
+unsigned klen = exim_datum_size_get(key);
+uint32_t h = cdb_hash(k, klen), pos = c->pos;
+long slot = cdb_index_find(c, h, k, klen);
+
+if (slot < 0 || !cdb_write_record(c, key, content)) return -1;
+if (c->index[slot])
+  {
+  c->entries[c->index[slot] - 1].pos = pos;
+  return 0;
+  }
+return cdb_add_entry(c, h, pos, slot) ? 0 : -1;
+}
+
+
+/* Open the output, leaving space for the table positions */
+
+static cdb_out *
+cdb_open(const uschar * name)
+{
+static uschar zeros[256*8];
+cdb_out * c = calloc(1, sizeof(cdb_out));
+int fd;
+
+if (!c) return NULL;
+if (  (fd = Uopen(name, O_RDWR|O_CREAT|O_EXCL, 0644)) < 0
+   || !(c->f = fdopen(fd, "w+b")))
+  {
+  if (fd >= 0) (void)close(fd);
+  free(c);
+  return NULL;
+  }
+(void) setvbuf(c->f, NULL, _IOFBF, 1024*1024);
+c->index_size = 8192;
+if (  !(c->index = calloc(c->index_size, sizeof(unsigned)))
+   || fwrite(zeros, 1, sizeof(zeros), c->f) != sizeof(zeros))
+  {
+  (void)fclose(c->f);
+  free(c);
+  return NULL;
+  }
+c->pos = sizeof(zeros);
+return c;
+}
+
+
+/* Write the hash tables after the records, then their positions at the start
+of the file, and close it. Returns FALSE on error; the file is closed in
+either case. */
+
+static BOOL
+cdb_close(cdb_out * c, BOOL write_tables)
+{
+uschar header[256*8];
+unsigned counts[256] = {0}, starts[256];
+cdb_entry * sorted = NULL, * slots = NULL;
+unsigned maxlen = 0;
+BOOL ok = write_tables;
+
+free(c->index);
+if (!ok) goto CLOSE;
+
+/* Group the entries by table */
+
+for (unsigned n = 0; n < c->count; n++) counts[c->entries[n].hash & 255]++;
+for (unsigned t = 0, start = 0; t < 256; t++)
+  {
+  starts[t] = start;
+  start += counts[t];
+  if (counts[t] * 2 > maxlen) maxlen = counts[t] * 2;
+  }
+if (  !(sorted = malloc((c->count + 1) * sizeof(cdb_entry)))
+   || !(slots = malloc((maxlen + 1) * sizeof(cdb_entry))))
+  { ok = FALSE; goto CLOSE; }
+for (unsigned n = 0; n < c->count; n++)
+  sorted[starts[c->entries[n].hash & 255]++] = c->entries[n];
+
+for (unsigned t = 0, start = 0; ok && t < 256; start += counts[t++])
+  {
+  unsigned len = counts[t] * 2;
+
+  if ((uint64_t)c->pos + len * 8 > 0xffffffffUL)
+    { errno = EFBIG; ok = FALSE; break; }
+  cdb_pack(header + t*8, c->pos);
+  cdb_pack(header + t*8 + 4, len);
+
+  memset(slots, 0, len * sizeof(cdb_entry));
+  for (unsigned n = start; n < start + counts[t]; n++)
+    {
+    unsigned i = (sorted[n].hash >> 8) % len;
+    while (slots[i].pos) i = (i + 1) % len;
+    slots[i] = sorted[n];
+    }
+  for (unsigned i = 0; i < len; i++)
+    {
+    uschar buf[8];
+    cdb_pack(buf, slots[i].hash);
+    cdb_pack(buf + 4, slots[i].pos);
+    if (fwrite(buf, 1, 8, c->f) != 8) { ok = FALSE; break; }
+    }
+  c->pos += len * 8;
+  }
+
+if (ok)
+  ok =  fseek(c->f, 0, SEEK_SET) == 0
+     && fwrite(header, 1, sizeof(header), c->f) == sizeof(header);
+
+CLOSE:
+if (fclose(c->f) != 0) ok = FALSE;
+free(sorted);
+free(slots);
+free(c->entries);
+free(c);
+return ok;
+}
+
+
+
+/*************************************************
+*           Writing a Bloom filter file          *
+*************************************************/
+
+/* The layout and the hashing are in bloom.h. Until the number of keys is
+known, only the first hash of each key is kept; the filter is sized from the
+count and written out at the end. Duplicate keys cannot be told from hash
+collisions, so they are not reported; in a filter they do no harm. */
+
+typedef struct {
+  FILE *	f;
+  uint64_t *	hashes;
+  unsigned	count;
+  unsigned	size;
+  unsigned	bits_per_key;
+} bloom_out;
+
+
+static bloom_out *
+bloom_open(const uschar * name, unsigned bits_per_key)
+{
+bloom_out * b = calloc(1, sizeof(bloom_out));
+int fd;
+
+if (!b) return NULL;
+if (  (fd = Uopen(name, O_RDWR|O_CREAT|O_EXCL, 0644)) < 0
+   || !(b->f = fdopen(fd, "wb")))
+  {
+  if (fd >= 0) (void)close(fd);
+  free(b);
+  return NULL;
+  }
+b->bits_per_key = bits_per_key;
+return b;
+}
+
+
+static int
+bloom_putb(bloom_out * b, EXIM_DATUM * key)
+{
+if (b->count >= b->size)
+  {
+  unsigned size = b->size ? b->size * 2 : 65536;
+  uint64_t * h = realloc(b->hashes, size * sizeof(uint64_t));
+  if (!h) return -1;
+  b->hashes = h;
+  b->size = size;
+  }
+b->hashes[b->count++] =
+  bloom_hash(exim_datum_data_get(key), exim_datum_size_get(key));
+return EXIM_DBPUTB_OK;
+}
+
+
+/* Size the filter at bits_per_key bits for each key, and use the number of
+hash functions that minimizes the false positive rate for that: bits_per_key
+times ln 2, rounded. Returns FALSE on error; the file is closed in either
+case. */
+
+static BOOL
+bloom_close(bloom_out * b, BOOL write_filter)
+{
+uschar header[BLOOM_HDRSIZE] = {0};
+uint64_t m = (uint64_t)b->count * b->bits_per_key;
+unsigned k = (b->bits_per_key * 693 + 500) / 1000;
+uschar * bits = NULL;
+BOOL ok = write_filter;
+
+if (!ok) goto CLOSE;
+if (m < 64) m = 64;
+if (k < 1) k = 1;
+if (k > BLOOM_MAX_K) k = BLOOM_MAX_K;
+
+if (!(bits = calloc((m + 7) / 8, 1))) { ok = FALSE; goto CLOSE; }
+for (unsigned n = 0; n < b->count; n++)
+  {
+  uint64_t h1 = b->hashes[n], h2 = bloom_hash2(h1);
+  for (unsigned i = 0; i < k; i++, h1 += h2)
+    {
+    uint64_t bit = h1 % m;
+    bits[bit >> 3] |= 1 << (bit & 7);
+    }
+  }
+
+memcpy(header, BLOOM_MAGIC, 8);
+bloom_put64(header + 8, m);
+bloom_put64(header + 16, (uint64_t)b->count << 32 | k);
+ok =  fwrite(header, 1, sizeof(header), b->f) == sizeof(header)
+   && fwrite(bits, 1, (m + 7) / 8, b->f) == (m + 7) / 8;
+
+CLOSE:
+if (fclose(b->f) != 0) ok = FALSE;
+free(bits);
+free(b->hashes);
+free(b);
+return ok;
+}
+
+
+
 /*************************************************
 *               Main Program                     *
 *************************************************/
@@ -177,12 +560,17 @@ BOOL lowercase = TRUE;
 BOOL warn = TRUE;
 BOOL duperr = TRUE;
 BOOL lastdup = FALSE;
-#if !defined (USE_DB) && !defined(USE_TDB) && !defined(USE_GDBM)
+BOOL cdb = FALSE;
+unsigned bloom = 0;
+#if !defined (USE_DB) && !defined(USE_TDB) && !defined(USE_GDBM) \
+  && !defined(USE_LMDB)
 int is_db = 0;
 struct stat statbuf;
 #endif
 FILE *f;
-EXIM_DB *d;
+EXIM_DB *d = NULL;
+cdb_out *c = NULL;
+bloom_out *b = NULL;
 EXIM_DATUM key, content;
 uschar *bptr;
 uschar  keybuffer[256];
@@ -199,6 +587,17 @@ while (argc > 1)
   else if (Ustrcmp(argv[arg], "-lastdup") == 0)  lastdup = TRUE;
   else if (Ustrcmp(argv[arg], "-noduperr") == 0) duperr = FALSE;
   else if (Ustrcmp(argv[arg], "-nozero") == 0)   add_zero = 0;
+  else if (Ustrcmp(argv[arg], "-cdb") == 0)      cdb = TRUE;
+  else if (Ustrcmp(argv[arg], "-bloom") == 0)    bloom = 10;
+  else if (Ustrncmp(argv[arg], "-bloom=", 7) == 0)
+    {
+    bloom = atoi(argv[arg] + 7);
+    if (bloom < 1 || bloom > 64)
+      {
+      printf("exim_dbmbuild: -bloom= needs a number of bits per key from 1 to 64\n");
+      exit(1);
+      }
+    }
   else break;
   arg++;
   argc--;
@@ -206,10 +605,14 @@ while (argc > 1)
 
 if (argc != 3)
   {
-  printf("usage: exim_dbmbuild [-nolc] <source file> <dbm base name>\n");
+  printf("usage: exim_dbmbuild [-nolc] [-cdb | -bloom[=<bits>]] <source file> <dbm base name>\n");
   exit(1);
   }
 
+/* The cdb and bloom lookups have no terminating zeros on keys or data */
+
+if (cdb || bloom) add_zero = 0;
+
 if (Ustrcmp(argv[arg], "-") == 0)
   f = stdin;
 else if (!(f = fopen(argv[arg], "rb")))
@@ -221,13 +624,15 @@ else if (!(f = fopen(argv[arg], "rb")))
 /* By default Berkeley db does not put extensions on... which
 can be painful! */
 
-#if defined(USE_DB) || defined(USE_TDB) || defined(USE_GDBM)
-if (Ustrcmp(argv[arg], argv[arg+1]) == 0)
-  {
-  printf("exim_dbmbuild: input and output filenames are the same\n");
-  exit(1);
-  }
+#if !defined(USE_DB) && !defined(USE_TDB) && !defined(USE_GDBM) \
+  && !defined(USE_LMDB)
+if (cdb || bloom)
 #endif
+  if (Ustrcmp(argv[arg], argv[arg+1]) == 0)
+    {
+    printf("exim_dbmbuild: input and output filenames are the same\n");
+    exit(1);
+    }
 
 /* Check length of filename; allow for adding .dbmbuild_temp and .db or
 .dir/.pag later. */
@@ -250,7 +655,9 @@ else
 /* It is apparently necessary to open with O_RDWR for this to work
 with gdbm-1.7.3, though no reading is actually going to be done. */
 
-if (!(d = exim_dbopen(temp_dbmname, dirname, O_RDWR|O_CREAT|O_EXCL, 0644)))
+if (  bloom ? !(b = bloom_open(temp_dbmname, bloom))
+   : cdb ? !(c = cdb_open(temp_dbmname))
+   : !(d = exim_dbopen(temp_dbmname, dirname, O_RDWR|O_CREAT|O_EXCL, 0644)))
   {
   printf("exim_dbmbuild: unable to create %s: %s\n", temp_dbmname,
     strerror(errno));
@@ -261,9 +668,10 @@ if (!(d = exim_dbopen(temp_dbmname, dirname, O_RDWR|O_CREAT|O_EXCL, 0644)))
 /* Unless using native db calls, see if we have created <name>.db; if not,
 assume .dir & .pag */
 
-#if !defined(USE_DB) && !defined(USE_TDB) && !defined(USE_GDBM)
+#if !defined(USE_DB) && !defined(USE_TDB) && !defined(USE_GDBM) \
+  && !defined(USE_LMDB)
 sprintf(CS real_dbmname, "%s.db", temp_dbmname);
-is_db = Ustat(real_dbmname, &statbuf) == 0;
+is_db = !cdb && !bloom && Ustat(real_dbmname, &statbuf) == 0;
 #endif
 
 /* Now do the business */
@@ -333,7 +741,9 @@ while (Ufgets(line, max_insize, f) != NULL)
       exim_datum_data_set(&content, buffer);
       exim_datum_size_set(&content, bptr - buffer + add_zero);
 
-      switch(rc = exim_dbputb(d, &key, &content))
+      switch(rc = b ? bloom_putb(b, &key)
+		 : c ? cdb_putb(c, &key, &content)
+		 : exim_dbputb(d, &key, &content))
         {
         case EXIM_DBPUTB_OK:
 	  count++;
@@ -343,7 +753,14 @@ while (Ufgets(line, max_insize, f) != NULL)
 	  if (warn) fprintf(stderr, "** Duplicate key \"%s\"\n", keybuffer);
 	  dupcount++;
 	  if(duperr) yield = 1;
-	  if (lastdup) exim_dbput(d, &key, &content);
+	  if (!lastdup) break;
+	  if ((c ? cdb_put(c, &key, &content) : exim_dbput(d, &key, &content)))
+	    {
+	    fprintf(stderr, "Error while writing key %s: errno=%d\n",
+	      keybuffer, errno);
+	    yield = 2;
+	    goto TIDYUP;
+	    }
 	  break;
 
         default:
@@ -423,7 +840,9 @@ if (started)
   exim_datum_data_set(&content, buffer);
   exim_datum_size_set(&content, bptr - buffer + add_zero);
 
-  switch(rc = exim_dbputb(d, &key, &content))
+  switch(rc = b ? bloom_putb(b, &key)
+	     : c ? cdb_putb(c, &key, &content)
+	     : exim_dbputb(d, &key, &content))
     {
     case EXIM_DBPUTB_OK:
     count++;
@@ -433,7 +852,13 @@ if (started)
     if (warn) fprintf(stderr, "** Duplicate key \"%s\"\n", keybuffer);
     dupcount++;
     if (duperr) yield = 1;
-    if (lastdup) exim_dbput(d, &key, &content);
+    if (lastdup && (c ? cdb_put(c, &key, &content)
+		      : exim_dbput(d, &key, &content)))
+      {
+      fprintf(stderr, "Error while writing key %s: errno=%d\n",
+	keybuffer, errno);
+      yield = 2;
+      }
     break;
 
     default:
@@ -448,7 +873,24 @@ if (started)
 
 TIDYUP:
 
-exim_dbclose(d);
+if (b)
+  {
+  if (!bloom_close(b, yield < 2) && yield < 2)
+    {
+    printf("Error while writing %s: %s\n", temp_dbmname, strerror(errno));
+    yield = 2;
+    }
+  }
+else if (c)
+  {
+  if (!cdb_close(c, yield < 2) && yield < 2)
+    {
+    printf("Error while writing %s: %s\n", temp_dbmname, strerror(errno));
+    yield = 2;
+    }
+  }
+else
+  exim_dbclose(d);
 (void)fclose(f);
 
 /* If successful, output the number of entries and rename the temporary
@@ -462,7 +904,8 @@ if (yield == 0 || yield == 1)
     printf("%d duplicate key%s \n", dupcount, (dupcount > 1)? "s" : "");
     }
 
-  #if defined(USE_DB) || defined(USE_TDB) || defined(USE_GDBM)
+  #if defined(USE_DB) || defined(USE_TDB) || defined(USE_GDBM) \
+  || defined(USE_LMDB)
   Ustrcpy(real_dbmname, temp_dbmname);
   Ustrcpy(buffer, US argv[arg+1]);
   if (Urename(real_dbmname, buffer) != 0)
@@ -472,9 +915,20 @@ if (yield == 0 || yield == 1)
     }
   #else
 
+  /* Rename a CDB or Bloom filter file, which has no suffix */
+
+  if (cdb || bloom)
+    {
+    if (Urename(temp_dbmname, argv[arg+1]) != 0)
+      {
+      printf("Unable to rename %s as %s\n", temp_dbmname, argv[arg+1]);
+      return 1;
+      }
+    }
+
   /* Rename a single .db file */
 
-  if (is_db)
+  else if (is_db)
     {
     sprintf(CS real_dbmname, "%s.db", temp_dbmname);
     sprintf(CS buffer, "%s.db", argv[arg+1]);
@@ -514,12 +968,15 @@ if (yield == 0 || yield == 1)
 else
   {
   printf("dbmbuild abandoned\n");
-#if defined(USE_DB) || defined(USE_TDB) || defined(USE_GDBM)
+#if defined(USE_DB) || defined(USE_TDB) || defined(USE_GDBM) \
+  || defined(USE_LMDB)
   /* We created it, so safe to delete despite the name coming from outside */
   /* coverity[tainted_string] */
   Uunlink(temp_dbmname);
 #else
-  if (is_db)
+  if (cdb || bloom)
+    Uunlink(temp_dbmname);
+  else if (is_db)
     {
     sprintf(CS real_dbmname, "%s.db", temp_dbmname);
     Uunlink(real_dbmname);
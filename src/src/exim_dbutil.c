@@ -18,7 +18,13 @@ maintaining Exim hints databases.
 In all cases, the first argument is the name of the spool directory. The second
 argument is the name of the database file. The available names are:
 
+  bodies:	shared message bodies (spool_dedup_size)
+  bounces:	failures held for bounce digests
   callout:	callout verification cache
+  dkimkeys:	DKIM public-key records
+  filter:	parsed filter cache
+  hostcache:	host lists for dnslookup routers
+  scancache:	malware and spam verdicts
   misc:		miscellaneous hints data
   ratelimit:	record for ACL "ratelimit" condition
   retry:	etry delivery information
@@ -42,6 +48,12 @@ whose inclusion is controlled by -D on the compilation command. */
 #define type_ratelimit 5
 #define type_tls       6
 #define type_seen      7
+#define type_dkimkeys  8
+#define type_filter    9
+#define type_bodies   10
+#define type_hostcache 11
+#define type_scancache 12
+#define type_bounces  13
 
 
 /* This is used by our cut-down dbfn_open(). */
@@ -79,6 +91,8 @@ struct global_flags	f;
 unsigned int		log_selector[1];
 uschar *		queue_name;
 BOOL			split_spool_directory;
+int			spool_shard_count;
+const uschar **		spool_shard_roots;
 
 
 /* These introduced by the taintwarn handling */
@@ -111,7 +125,7 @@ static void
 usage(uschar *name, uschar *options)
 {
 printf("Usage: exim_%s%s  <spool-directory> <database-name>\n", name, options);
-printf("  <database-name> = retry | misc | wait-<transport-name> | callout | ratelimit | tls | seen\n");
+printf("  <database-name> = retry | misc | wait-<transport-name> | callout | ratelimit | tls | seen | dkimkeys | filter | bodies | hostcache | scancache | bounces\n");
 exit(EXIT_FAILURE);
 }
 
@@ -137,6 +151,12 @@ if (argc - optind == 2)
   if (Ustrcmp(aname, "ratelimit") == 0)	return type_ratelimit;
   if (Ustrcmp(aname, "tls") == 0)	return type_tls;
   if (Ustrcmp(aname, "seen") == 0)	return type_seen;
+  if (Ustrcmp(aname, "dkimkeys") == 0)	return type_dkimkeys;
+  if (Ustrcmp(aname, "filter") == 0)	return type_filter;
+  if (Ustrcmp(aname, "bodies") == 0)	return type_bodies;
+  if (Ustrcmp(aname, "hostcache") == 0) return type_hostcache;
+  if (Ustrcmp(aname, "scancache") == 0) return type_scancache;
+  if (Ustrcmp(aname, "bounces") == 0)	return type_bounces;
   }
 usage(name, options);
 return -1;              /* Never obeyed */
@@ -221,6 +241,40 @@ return value == ccache_accept ? US"accept" :
 }
 
 
+
+#if defined(EXIM_DUMPDB) || defined(EXIM_FIXDB)
+/*************************************************
+*      Print the hosts of a hostcache record     *
+*************************************************/
+
+static void
+print_hostcache(const dbdata_hostcache * hc, int length, const char * prefix)
+{
+const uschar * s = hc->data, * end = US hc + length;
+
+if (length <= (int)offsetof(dbdata_hostcache, data) || end[-1])
+  { printf("%s(bad record)\n", prefix); return; }
+printf("%sname %s\n", prefix, s);
+s += Ustrlen(s) + 1;
+for (unsigned i = 0; i < hc->count && s < end; i++)
+  {
+  const uschar * name = s, * address;
+  int mx, port, sort_key, dnssec;
+
+  if ((s += Ustrlen(s) + 1) >= end) break;
+  address = s;
+  if ((s += Ustrlen(s) + 1) >= end) break;
+  if (sscanf(CCS s, "%d %d %d %d", &mx, &port, &sort_key, &dnssec) != 4) break;
+  s += Ustrlen(s) + 1;
+  printf("%s%s [%s] MX=%d", prefix, name, address, mx);
+  if (port != PORT_NONE) printf(" port=%d", port);
+  if (dnssec == DS_YES) printf(" DNSSEC");
+  printf("\n");
+  }
+}
+#endif
+
+
 #ifdef EXIM_FIXDB
 /*************************************************
 *                Read time value                 *
@@ -307,6 +361,15 @@ dirname = string_sprintf("%s/db", spool_directory);
 filename = string_sprintf("%s/%s.lockfile", dirname, name);
 #endif
 
+#ifdef EXIM_DB_MVCC_READERS
+/* Readers need no lock, and should not hold up writers */
+if (read_only)
+  {
+  dbblock->lockfd = -1;
+  goto dbopen;
+  }
+#endif
+
 dbblock->lockfd = Uopen(filename, flags, 0);
 if (dbblock->lockfd < 0)
   {
@@ -341,6 +404,10 @@ if (rc < 0)
 /* At this point we have an opened and locked separate lock file, that is,
 exclusive access to the database, so we can go ahead and open it. */
 
+#ifdef EXIM_DB_MVCC_READERS
+dbopen:
+#endif
+
 #ifdef COMPILE_UTILITY
 if (asprintf(CSS &filename, "%s/%s", dirname, name) < 0) return NULL;
 #else
@@ -358,7 +425,7 @@ if (!dbblock->dbptr)
     ""
     #endif
     );
-  (void)close(dbblock->lockfd);
+  if (dbblock->lockfd >= 0) (void)close(dbblock->lockfd);
   return NULL;
   }
 
@@ -383,7 +450,7 @@ void
 dbfn_close(open_db *dbblock)
 {
 exim_dbclose(dbblock->dbptr);
-(void)close(dbblock->lockfd);
+if (dbblock->lockfd >= 0) (void)close(dbblock->lockfd);
 }
 
 
@@ -590,6 +657,12 @@ for (uschar * key = dbfn_scan(dbm, TRUE, &cursor);
   dbdata_ratelimit_unique *rate_unique;
   dbdata_tls_session *session;
   dbdata_seen *seen;
+  dbdata_dkim_key *dkimkey;
+  dbdata_filter *filter;
+  dbdata_body *body;
+  dbdata_hostcache *hostcache;
+  dbdata_scan_verdict *verdict;
+  dbdata_bounce_digest *digest;
   int count_bad = 0;
   int length;
   uschar *t;
@@ -735,6 +808,50 @@ for (uschar * key = dbfn_scan(dbm, TRUE, &cursor);
 	seen = (dbdata_seen *)value;
 	printf("%s\t%s\n", keybuffer, print_time(seen->time_stamp));
 	break;
+
+      case type_dkimkeys:
+	dkimkey = (dbdata_dkim_key *)value;
+	printf("%s", print_time(dkimkey->time_stamp));
+	printf(" expires %s hits %u fetches %u\n  %s %.*s\n",
+	  print_time(dkimkey->expiry), dkimkey->hits, dkimkey->fetches,
+	  keybuffer,
+	  (int)(length - sizeof(dbdata_dkim_key)), dkimkey->record);
+	break;
+
+      case type_filter:
+	filter = (dbdata_filter *)value;
+	printf("%s %s text %d parsed %d\n", keybuffer,
+	  print_time(filter->time_stamp), filter->text_len,
+	  (int)(length - offsetof(dbdata_filter, data) - filter->text_len));
+	break;
+
+      case type_bodies:
+	body = (dbdata_body *)value;
+	printf("%s %s %s\n", keybuffer, print_time(body->time_stamp), body->id);
+	break;
+
+      case type_hostcache:
+	hostcache = (dbdata_hostcache *)value;
+	printf("%s", print_time(hostcache->time_stamp));
+	printf(" expires %s hits %u %s\n", print_time(hostcache->expiry),
+	  hostcache->hits, keybuffer);
+	print_hostcache(hostcache, length, "  ");
+	break;
+
+      case type_scancache:
+	verdict = (dbdata_scan_verdict *)value;
+	printf("%s", print_time(verdict->time_stamp));
+	printf(" expires %s hits %u found %d %s\n", print_time(verdict->expiry),
+	  verdict->hits, verdict->found, keybuffer);
+	break;
+
+      case type_bounces:
+	digest = (dbdata_bounce_digest *)value;
+	printf("%s", print_time(digest->time_stamp));
+	printf(" window ends %s messages %u unlisted %u %s\n",
+	  print_time(digest->window_end), digest->messages, digest->unlisted,
+	  keybuffer);
+	break;
       }
   store_reset(reset_point);
   }
@@ -815,6 +932,12 @@ for(; (reset_point = store_mark()); store_reset(reset_point))
   dbdata_ratelimit *ratelimit;
   dbdata_ratelimit_unique *rate_unique;
   dbdata_tls_session *session;
+  dbdata_dkim_key *dkimkey;
+  dbdata_filter *filter;
+  dbdata_body *body;
+  dbdata_hostcache *hostcache;
+  dbdata_scan_verdict *verdict;
+  dbdata_bounce_digest *digest;
   int oldlength;
   uschar *t;
   uschar field[256], value[256];
@@ -996,6 +1119,30 @@ for(; (reset_point = store_mark()); store_reset(reset_point))
             case type_tls:
 	      printf("Can't change contents of tls database record\n");
 	      break;
+
+            case type_dkimkeys:
+	      printf("Can't change contents of dkimkeys database record\n");
+	      break;
+
+            case type_filter:
+	      printf("Can't change contents of filter database record\n");
+	      break;
+
+            case type_bodies:
+	      printf("Can't change contents of bodies database record\n");
+	      break;
+
+            case type_hostcache:
+	      printf("Can't change contents of hostcache database record\n");
+	      break;
+
+            case type_scancache:
+	      printf("Can't change contents of scancache database record\n");
+	      break;
+
+            case type_bounces:
+	      printf("Can't change contents of bounces database record\n");
+	      break;
             }
 
           dbfn_write(dbm, name, record, oldlength);
@@ -1112,6 +1259,53 @@ for(; (reset_point = store_mark()); store_reset(reset_point))
 	printf("0 time stamp:  %s\n", print_time(session->time_stamp));
 	printf("1 session: .%s\n", session->session);
 	break;
+
+      case type_dkimkeys:
+	dkimkey = (dbdata_dkim_key *)record;
+	printf("0 time stamp:  %s\n", print_time(dkimkey->time_stamp));
+	printf("1 expires:     %s\n", print_time(dkimkey->expiry));
+	printf("2 hits:        %u\n", dkimkey->hits);
+	printf("3 fetches:     %u\n", dkimkey->fetches);
+	printf("4 record:      %.*s\n",
+	  (int)(oldlength - sizeof(dbdata_dkim_key)), dkimkey->record);
+	break;
+
+      case type_filter:
+	filter = (dbdata_filter *)record;
+	printf("0 time stamp:  %s\n", print_time(filter->time_stamp));
+	printf("1 text:        %.*s\n", filter->text_len, filter->data);
+	break;
+
+      case type_bodies:
+	body = (dbdata_body *)record;
+	printf("0 time stamp:  %s\n", print_time(body->time_stamp));
+	printf("1 message:     %s\n", body->id);
+	break;
+
+      case type_hostcache:
+	hostcache = (dbdata_hostcache *)record;
+	printf("0 time stamp:  %s\n", print_time(hostcache->time_stamp));
+	printf("1 expires:     %s\n", print_time(hostcache->expiry));
+	printf("2 hits:        %u\n", hostcache->hits);
+	print_hostcache(hostcache, oldlength, "  ");
+	break;
+
+      case type_scancache:
+	verdict = (dbdata_scan_verdict *)record;
+	printf("0 time stamp:  %s\n", print_time(verdict->time_stamp));
+	printf("1 expires:     %s\n", print_time(verdict->expiry));
+	printf("2 hits:        %u\n", verdict->hits);
+	printf("3 found:       %d\n", verdict->found);
+	printf("4 score:       %.1f\n", verdict->score);
+	break;
+
+      case type_bounces:
+	digest = (dbdata_bounce_digest *)record;
+	printf("0 time stamp:  %s\n", print_time(digest->time_stamp));
+	printf("1 window ends: %s\n", print_time(digest->window_end));
+	printf("2 messages:    %u\n", digest->messages);
+	printf("3 unlisted:    %u\n", digest->unlisted);
+	break;
       }
     }
 
@@ -1134,10 +1328,24 @@ return 0;
 *************************************************/
 
 
-/* Utility program to tidy the contents of an exim database file. There is one
-option:
+/* Utility program to tidy the contents of an exim database file. The options
+are:
 
    -t <time>  expiry time for old records - default 30 days
+   -c <count> records to process each time the lock is taken - default 1000;
+              0 means to keep the lock for the whole tidy
+   -r         compact the file by rebuilding it
+
+The keys are collected with only a read lock (or none, for backends with
+lockless readers). The records are then processed in chunks, the write lock
+being released between chunks so that other Exim processes are not held up for
+the whole of the tidy.
+
+If any records were deleted, the file is then compacted, for the backends that
+support doing it in place (tdb, gdbm and Berkeley DB 4.4 onwards).  This is
+done with the database lock still held, so other Exim processes simply wait
+for it. With -r the file is instead rebuilt, for any backend, by
+tidy_rebuild().
 
 For backwards compatibility, an -f option is recognized and ignored. (It used
 to request a "full" tidy. This version always does the whole job.) */
@@ -1148,13 +1356,164 @@ typedef struct key_item {
   uschar key[1];
 } key_item;
 
+#define TIDY_OPTIONS US" [-t <time>] [-c <count>] [-r]"
+
+
+
+/*************************************************
+*       Rebuild a database into a new file       *
+*************************************************/
+
+/* The records are copied, with their timestamps unchanged, to a temporary file
+beside the original, which is then renamed over it, all with the write lock
+held. Other Exim processes open the file only while they hold the lock, so none
+can see a partly built one. The new file is given the ownership and mode of the
+old one. This returns to the DBM library all the space freed by the tidy, even
+for those that cannot compact in place.
+
+It is not done for LMDB, whose readers take no lock and may still be using the
+old file.
+
+Arguments:
+  dbm       the open, write-locked, database
+  dirname   the directory containing it
+  name      the database name
+
+Returns:    TRUE if the file was replaced
+*/
+
+static BOOL
+tidy_rebuild(open_db * dbm, const uschar * dirname, const uschar * name)
+{
+#ifdef EXIM_DB_MVCC_READERS
+printf("** %s files cannot be rebuilt while in use; not compacted\n",
+  EXIM_DBTYPE);
+return FALSE;
+#else
+
+/* ndbm (or db through its ndbm interface) uses one or two files whose names
+are the one given with a suffix. */
+
+# if !defined(USE_DB) && !defined(USE_TDB) && !defined(USE_GDBM)
+static const char * suffixes[] = { ".db", ".dir", ".pag", NULL };
+# else
+static const char * suffixes[] = { "", NULL };
+# endif
+
+uschar real[PATH_MAX], temp[PATH_MAX], from[PATH_MAX+8], to[PATH_MAX+8];
+uschar keybuffer[1024];
+EXIM_DB * newdb;
+EXIM_CURSOR * cursor;
+struct stat statbuf;
+int count = 0;
+BOOL ok = TRUE;
+
+snprintf(CS real, sizeof(real), "%s/%s", dirname, name);
+snprintf(CS temp, sizeof(temp), "%s/%s.tidydb_temp", dirname, name);
+
+/* Remove any leftovers from an earlier failed attempt */
+
+for (const char ** sfx = suffixes; *sfx; sfx++)
+  {
+  snprintf(CS from, sizeof(from), "%s%s", temp, *sfx);
+  (void) Uunlink(from);
+  }
+
+if (!(newdb = exim_dbopen(temp, dirname, O_RDWR|O_CREAT, EXIMDB_MODE)))
+  {
+  printf("** Failed to create %s: %s\n", temp, strerror(errno));
+  return FALSE;
+  }
+
+for (uschar * key = dbfn_scan(dbm, TRUE, &cursor);
+     key;
+     key = dbfn_scan(dbm, FALSE, &cursor))
+  {
+  rmark reset_point = store_mark();
+  EXIM_DATUM key_datum, value_datum;
+  void * value;
+  int length;
+
+  /* Keep a copy of the key, as in some DBMs the pointer is into data which
+  might change. */
+
+  if (Ustrlen(key) > sizeof(keybuffer) - 1)
+    {
+    printf("** Overlong key encountered: %s\n", key);
+    ok = FALSE;
+    break;
+    }
+  Ustrcpy(keybuffer, key);
+
+  if ((value = dbfn_read_with_length(dbm, keybuffer, &length)))
+    {
+    exim_datum_init(&key_datum);
+    exim_datum_init(&value_datum);
+    exim_datum_data_set(&key_datum, keybuffer);
+    exim_datum_size_set(&key_datum, Ustrlen(keybuffer) + 1);
+    exim_datum_data_set(&value_datum, value);
+    exim_datum_size_set(&value_datum, length);
+    if (exim_dbput(newdb, &key_datum, &value_datum) != 0)
+      {
+      printf("** Failed to write %s to %s\n", keybuffer, temp);
+      ok = FALSE;
+      break;
+      }
+    count++;
+    }
+  store_reset(reset_point);
+  }
+
+exim_dbclose(newdb);
+
+/* Give each new file the owner and mode of the old one, and rename it into
+place. */
+
+for (const char ** sfx = suffixes; ok && *sfx; sfx++)
+  {
+  snprintf(CS from, sizeof(from), "%s%s", temp, *sfx);
+  snprintf(CS to, sizeof(to), "%s%s", real, *sfx);
+  if (Ustat(from, &statbuf) != 0) continue;
+
+  if (  Ustat(to, &statbuf) == 0
+     && (  chown(CCS from, statbuf.st_uid, statbuf.st_gid) < 0
+        || Uchmod(from, statbuf.st_mode & 07777) < 0))
+    {
+    printf("** Failed to set owner or mode of %s: %s\n", from,
+      strerror(errno));
+    ok = FALSE;
+    }
+  else if (Urename(from, to) != 0)
+    {
+    printf("** Failed to rename %s as %s: %s\n", from, to, strerror(errno));
+    ok = FALSE;
+    }
+  }
+
+if (!ok)
+  {
+  for (const char ** sfx = suffixes; *sfx; sfx++)
+    {
+    snprintf(CS from, sizeof(from), "%s%s", temp, *sfx);
+    (void) Uunlink(from);
+    }
+  return FALSE;
+  }
+
+printf("rebuilt %s with %d records\n", real, count);
+return TRUE;
+#endif
+}
+
 
 int
 main(int argc, char **cargv)
 {
 struct stat statbuf;
 int maxkeep = 30 * 24 * 60 * 60;
-int dbdata_type, i, oldest, path_len;
+int dbdata_type, i, oldest, path_len, deleted = 0;
+int chunk = 1000, count = 0;
+BOOL rebuild = FALSE;
 key_item *keychain = NULL;
 rmark reset_point;
 open_db dbblock;
@@ -1172,7 +1531,13 @@ for (i = 1; i < argc; i++)
   {
   if (argv[i][0] != '-') break;
   if (Ustrcmp(argv[i], "-f") == 0) continue;
-  if (Ustrcmp(argv[i], "-t") == 0)
+  if (Ustrcmp(argv[i], "-r") == 0) rebuild = TRUE;
+  else if (Ustrcmp(argv[i], "-c") == 0)
+    {
+    if (!argv[++i] || !isdigit(*argv[i])) usage(US"tidydb", TIDY_OPTIONS);
+    chunk = atoi(CS argv[i]);
+    }
+  else if (Ustrcmp(argv[i], "-t") == 0)
     {
     uschar *s;
     s = argv[++i];
@@ -1180,7 +1545,7 @@ for (i = 1; i < argc; i++)
     while (*s != 0)
       {
       int value, count;
-      if (!isdigit(*s)) usage(US"tidydb", US" [-t <time>]");
+      if (!isdigit(*s)) usage(US"tidydb", TIDY_OPTIONS);
       (void)sscanf(CS s, "%d%n", &value, &count);
       s += count;
       switch (*s)
@@ -1191,12 +1556,12 @@ for (i = 1; i < argc; i++)
         case 'm': value *= 60;
         case 's': s++;
         break;
-        default: usage(US"tidydb", US" [-t <time>]");
+        default: usage(US"tidydb", TIDY_OPTIONS);
         }
       maxkeep += value;
       }
     }
-  else usage(US"tidydb", US" [-t <time>]");
+  else usage(US"tidydb", TIDY_OPTIONS);
   }
 
 /* Adjust argument values and process arguments */
@@ -1204,7 +1569,7 @@ for (i = 1; i < argc; i++)
 argc -= --i;
 argv += i;
 
-dbdata_type = check_args(argc, argv, US"tidydb", US" [-t <time>]");
+dbdata_type = check_args(argc, argv, US"tidydb", TIDY_OPTIONS);
 
 /* Compute the oldest keep time, verify what we are doing, and open the
 database */
@@ -1213,7 +1578,7 @@ oldest = time(NULL) - maxkeep;
 printf("Tidying Exim hints database %s/db/%s\n", argv[1], argv[2]);
 
 spool_directory = argv[1];
-if (!(dbm = dbfn_open(argv[2], O_RDWR, &dbblock, FALSE, TRUE)))
+if (!(dbm = dbfn_open(argv[2], O_RDONLY, &dbblock, FALSE, TRUE)))
   exit(1);
 
 /* Prepare for building file names */
@@ -1225,7 +1590,8 @@ path_len = Ustrlen(buffer);
 /* It appears, by experiment, that it is a bad idea to make changes
 to the file while scanning it. Pity the man page doesn't warn you about that.
 Therefore, we scan and build a list of all the keys. Then we use that to
-read the records and possibly update them. */
+read the records and possibly update them. Only reading is needed for the
+scan, so it does not hold up other readers. */
 
 for (key = dbfn_scan(dbm, TRUE, &cursor);
      key;
@@ -1237,13 +1603,30 @@ for (key = dbfn_scan(dbm, TRUE, &cursor);
   Ustrcpy(k->key, key);
   }
 
+dbfn_close(dbm);
+if (!(dbm = dbfn_open(argv[2], O_RDWR, &dbblock, FALSE, TRUE)))
+  exit(1);
+
 /* Now scan the collected keys and operate on the records, resetting
-the store each time round. */
+the store each time round. Each record is read afresh, so a change made by
+another process between the key scan and here is seen. */
 
 for (; keychain && (reset_point = store_mark()); store_reset(reset_point))
   {
   dbdata_generic *value;
 
+  /* Between chunks, release the lock for a moment so that waiting Exim
+  processes can get in. */
+
+  if (chunk > 0 && ++count > chunk)
+    {
+    dbfn_close(dbm);
+    (void) poll(NULL, 0, 10);
+    if (!(dbm = dbfn_open(argv[2], O_RDWR, &dbblock, FALSE, TRUE)))
+      exit(1);
+    count = 1;
+    }
+
   key = keychain->key;
   keychain = keychain->next;
   value = dbfn_read_with_length(dbm, key, NULL);
@@ -1259,6 +1642,7 @@ for (; keychain && (reset_point = store_mark()); store_reset(reset_point))
     {
     printf("deleted %s (too old)\n", key);
     dbfn_delete(dbm, key);
+    deleted++;
     continue;
     }
 
@@ -1296,6 +1680,7 @@ for (; keychain && (reset_point = store_mark()); store_reset(reset_point))
     if (wait->time_stamp < time(NULL) - 365*24*60*60)
       {
       dbfn_delete(dbm, key);
+      deleted++;
       printf("deleted %s (too old)\n", key);
       continue;
       }
@@ -1350,6 +1735,7 @@ for (; keychain && (reset_point = store_mark()); store_reset(reset_point))
             value = newvalue;
             wait = (dbdata_wait *)newvalue;
             dbfn_delete(dbm, newkey);
+            deleted++;
             printf("renamed %s\n", newkey);
             update = TRUE;
             }
@@ -1362,6 +1748,7 @@ for (; keychain && (reset_point = store_mark()); store_reset(reset_point))
         if (wait->count == 0 && wait->sequence == 0)
           {
           dbfn_delete(dbm, key);
+          deleted++;
           printf("deleted %s (empty)\n", key);
           update = FALSE;
           break;
@@ -1411,12 +1798,67 @@ for (; keychain && (reset_point = store_mark()); store_reset(reset_point))
       if (Ustat(buffer, &statbuf) != 0)
         {
         dbfn_delete(dbm, key);
+        deleted++;
         printf("deleted %s (no message)\n", key);
         }
       }
     }
+
+  /* DKIM key records, host lists and scan verdicts are of no use once
+  expired */
+
+  else if (dbdata_type == type_dkimkeys)
+    {
+    if (((dbdata_dkim_key *)value)->expiry < time(NULL))
+      {
+      dbfn_delete(dbm, key);
+      deleted++;
+      printf("deleted %s (expired)\n", key);
+      }
+    }
+
+  else if (dbdata_type == type_hostcache)
+    {
+    if (((dbdata_hostcache *)value)->expiry < time(NULL))
+      {
+      dbfn_delete(dbm, key);
+      deleted++;
+      printf("deleted %s (expired)\n", key);
+      }
+    }
+
+  else if (dbdata_type == type_scancache)
+    {
+    if (((dbdata_scan_verdict *)value)->expiry < time(NULL))
+      {
+      dbfn_delete(dbm, key);
+      deleted++;
+      printf("deleted %s (expired)\n", key);
+      }
+    }
+
+  /* A bounce digest window that is over can go if it holds no failures;
+  ones that do are left for a queue run to send. */
+
+  else if (dbdata_type == type_bounces)
+    {
+    dbdata_bounce_digest * digest = (dbdata_bounce_digest *)value;
+    if (digest->window_end < time(NULL) && digest->messages == 0)
+      {
+      dbfn_delete(dbm, key);
+      deleted++;
+      printf("deleted %s (expired)\n", key);
+      }
+    }
   }
 
+if (rebuild)
+  {
+  sprintf(CS buffer, "%s/db", argv[1]);
+  (void) tidy_rebuild(dbm, buffer, argv[2]);
+  }
+else if (deleted)
+  (void) exim_dbcompact(dbm->dbptr);
 dbfn_close(dbm);
 printf("Tidying complete\n");
 return 0;
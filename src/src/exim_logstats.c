@@ -0,0 +1,2165 @@
+/*************************************************
+*     Exim - an Internet mail transport agent    *
+*************************************************/
+
+/* Copyright (c) The Exim Maintainers 2024 */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/* A compiled counterpart of the eximstats script, for main logs that are too
+big for it.  It reads the same log lines in the same way and writes the same
+plain text report, but the files are mapped into memory and the work is shared
+between several processes.
+
+Lines are divided between the processes by a hash of the message id, so that
+everything logged for one message is seen by the same process and the
+per-message state (size, arrival time, delays, errors, relaying) stays local
+to it.  Each process scans the whole of the input, but only parses the lines
+that belong to it; the partial totals are passed back to the parent over a
+pipe and merged before the report is printed.
+
+Options (a subset of those of eximstats, with the same meanings):
+
+  -h<n>          histogram with <n> intervals per hour; -h0 for none
+  -ne            no error list
+  -nr            no relay list; -nr/pattern/ omits relays that match
+  -nt            no transport table; -nt/pattern/ ignores those transports
+  -q<list>       queue time bins, in seconds; -q0 for none
+  -t<n>          length of the league tables; -t0 for none
+  -tnl           no local user league tables
+  -byhost, -bydomain, -byemail, -byedomain
+                 which sender tables to produce; by host is the default
+  -nvr           no rounding of volumes
+  -utc           the log timestamps are in UTC
+  -emptyok       a report on an empty log is not an error
+  -j<n>          the number of processes; the default is one per CPU
+
+Files whose names contain .gz or .Z are uncompressed through a pipe; with no
+file arguments the standard input is read.  Patterns are Perl compatible, as
+they are for eximstats.  The HTML and spreadsheet outputs, merging of earlier
+reports and the other timing tables are left to eximstats. */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define PCRE2_CODE_UNIT_WIDTH 8
+#include <pcre2.h>
+
+
+typedef unsigned BOOL;
+#define FALSE 0
+#define TRUE  1
+
+#define GIG		(1024ULL * 1024 * 1024)
+#define MAX_WORKERS	64
+#define MAX_QTIMES	32
+#define MAX_HIST	(24 * 60)
+#define TODLEN		32
+
+/* The tables kept.  The four sender tables, for received and delivered
+messages, are indexed by the sender type. */
+
+enum { BY_HOST, BY_DOMAIN, BY_EMAIL, BY_EDOMAIN, BY_COUNT };
+
+enum {
+  T_RCV = 0,				/* + BY_* */
+  T_DLV = T_RCV + BY_COUNT,		/* + BY_* */
+  T_RCV_USER = T_DLV + BY_COUNT,
+  T_DLV_USER,
+  T_TRANSPORT,
+  T_RELAYED,
+  T_ERRORS,
+  T_REJ_REASON,
+  T_TREJ_REASON,
+  T_REJ_IP,
+  T_TREJ_IP,
+  T_HAM_IP,
+  T_SPAM_IP,
+  T_COUNT
+};
+
+static const char * by_names[] = { "Host", "Domain", "Email", "Edomain" };
+
+typedef struct entry {
+  struct entry * next;
+  uint64_t	count;			/* messages */
+  uint64_t	addrs;			/* addresses */
+  uint64_t	bytes;			/* volume */
+  unsigned	hash;
+  unsigned	keylen;
+  char		key[1];
+} entry;
+
+typedef struct {
+  entry **	buckets;
+  unsigned	size;			/* a power of two */
+  unsigned	used;
+} table;
+
+/* Everything else that is counted.  This is passed back from a worker as it
+stands, so it holds no pointers. */
+
+typedef struct {
+  uint64_t	rcv_count, rcv_bytes;
+  uint64_t	dlv_messages, dlv_addrs, dlv_bytes;
+  uint64_t	delayed, failed, relayed_unshown;
+  uint64_t	qt_all[MAX_QTIMES + 1];	/* the last is the overflow */
+  uint64_t	qt_remote[MAX_QTIMES + 1];
+  uint64_t	rcv_hist[MAX_HIST];
+  uint64_t	dlv_hist[MAX_HIST];
+  char		begin[TODLEN], end[TODLEN];
+} totals;
+
+/* The state kept for a message between its arrival and completion */
+
+typedef struct msg {
+  struct msg *	next;
+  unsigned	hash;
+  unsigned	has_size:1;
+  unsigned	remote:1;
+  unsigned	delayed:1;
+  unsigned	had_error:1;
+  unsigned	has_arrival:1;
+  uint64_t	size;
+  char *	from_host;
+  char *	from_addr;
+  char		arrival[TODLEN];
+  unsigned	idlen;
+  char		id[1];
+} msg;
+
+typedef struct {
+  const char *	data;
+  size_t	len;
+} input;
+
+
+/* Options */
+
+static BOOL show_errors = TRUE;
+static BOOL show_relay = TRUE;
+static BOOL show_transport = TRUE;
+static BOOL local_league_table = TRUE;
+static BOOL volume_rounding = TRUE;
+static BOOL empty_ok = FALSE;
+static BOOL use_localtime_offset = TRUE;
+static BOOL do_sender[BY_COUNT];
+static int  topcount = 50;
+static int  hist_opt = 1;
+static int  hist_interval = 60;
+static int  hist_number = 24;
+static int  nqtimes;
+static long qtimes[MAX_QTIMES];
+static pcre2_code * relay_pattern = NULL;
+static pcre2_code * transport_pattern = NULL;
+
+/* Working data */
+
+static table tabs[T_COUNT];
+static totals tot;
+static msg ** msgs;
+static unsigned msgs_size, msgs_used;
+static long localtime_offset;
+static input * inputs;
+static int ninputs;
+static pcre2_match_data * md;
+
+static const char * begin_init = "9999-99-99 99:99:99";
+static const char * end_init   = "0000-00-00 00:00:00";
+
+
+
+/*************************************************
+*            Errors and memory                   *
+*************************************************/
+
+static void
+die(const char * fmt, ...)
+{
+va_list ap;
+va_start(ap, fmt);
+fprintf(stderr, "exim_logstats: ");
+vfprintf(stderr, fmt, ap);
+fprintf(stderr, "\n");
+va_end(ap);
+exit(1);
+}
+
+static void *
+xmalloc(size_t n)
+{
+void * p = malloc(n);
+if (!p) die("malloc(%lu) failed", (unsigned long)n);
+return p;
+}
+
+static char *
+xstrndup(const char * s, size_t n)
+{
+char * p = xmalloc(n + 1);
+memcpy(p, s, n);
+p[n] = '\0';
+return p;
+}
+
+
+
+/*************************************************
+*            Hash tables                         *
+*************************************************/
+
+static unsigned
+hash_string(const char * s, size_t len)
+{
+unsigned h = 2166136261u;
+while (len--) h = (h ^ (unsigned char)*s++) * 16777619u;
+return h;
+}
+
+/* Find an entry in a table, creating it if need be */
+
+static entry *
+tab_find(table * t, const char * key, size_t len)
+{
+unsigned h = hash_string(key, len);
+entry * e;
+
+if (!t->buckets)
+  {
+  t->size = 256;
+  t->buckets = calloc(t->size, sizeof(entry *));
+  if (!t->buckets) die("out of memory");
+  }
+
+for (e = t->buckets[h & (t->size - 1)]; e; e = e->next)
+  if (e->hash == h && e->keylen == len && memcmp(e->key, key, len) == 0)
+    return e;
+
+if (t->used >= t->size)
+  {
+  unsigned nsize = t->size * 2;
+  entry ** nb = calloc(nsize, sizeof(entry *));
+  if (!nb) die("out of memory");
+  for (unsigned i = 0; i < t->size; i++)
+    for (entry * next; (e = t->buckets[i]); t->buckets[i] = next)
+      {
+      next = e->next;
+      e->next = nb[e->hash & (nsize - 1)];
+      nb[e->hash & (nsize - 1)] = e;
+      }
+  free(t->buckets);
+  t->buckets = nb;
+  t->size = nsize;
+  }
+
+e = xmalloc(sizeof(entry) + len);
+memcpy(e->key, key, len);
+e->key[len] = '\0';
+e->keylen = len;
+e->hash = h;
+e->count = e->addrs = e->bytes = 0;
+e->next = t->buckets[h & (t->size - 1)];
+t->buckets[h & (t->size - 1)] = e;
+t->used++;
+return e;
+}
+
+static inline entry *
+tab_finds(int which, const char * key)
+{
+return tab_find(&tabs[which], key, strlen(key));
+}
+
+
+/* Find the state for a message, optionally creating it */
+
+static msg *
+msg_find(const char * id, size_t len, BOOL create)
+{
+unsigned h = hash_string(id, len);
+msg * m;
+
+if (!msgs)
+  {
+  msgs_size = 4096;
+  if (!(msgs = calloc(msgs_size, sizeof(msg *)))) die("out of memory");
+  }
+
+for (m = msgs[h & (msgs_size - 1)]; m; m = m->next)
+  if (m->hash == h && m->idlen == len && memcmp(m->id, id, len) == 0)
+    return m;
+if (!create) return NULL;
+
+if (msgs_used >= msgs_size)
+  {
+  unsigned nsize = msgs_size * 2;
+  msg ** nb = calloc(nsize, sizeof(msg *));
+  if (!nb) die("out of memory");
+  for (unsigned i = 0; i < msgs_size; i++)
+    for (msg * next; (m = msgs[i]); msgs[i] = next)
+      {
+      next = m->next;
+      m->next = nb[m->hash & (nsize - 1)];
+      nb[m->hash & (nsize - 1)] = m;
+      }
+  free(msgs);
+  msgs = nb;
+  msgs_size = nsize;
+  }
+
+m = xmalloc(sizeof(msg) + len);
+memset(m, 0, sizeof(msg));
+memcpy(m->id, id, len);
+m->id[len] = '\0';
+m->idlen = len;
+m->hash = h;
+m->next = msgs[h & (msgs_size - 1)];
+msgs[h & (msgs_size - 1)] = m;
+msgs_used++;
+return m;
+}
+
+static void
+msg_delete(msg * dead)
+{
+for (msg ** mp = &msgs[dead->hash & (msgs_size - 1)]; *mp; mp = &(*mp)->next)
+  if (*mp == dead)
+    {
+    *mp = dead->next;
+    free(dead->from_host);
+    free(dead->from_addr);
+    free(dead);
+    msgs_used--;
+    return;
+    }
+}
+
+
+
+/*************************************************
+*            Regular expressions                 *
+*************************************************/
+
+static pcre2_code *
+regex_compile(const char * pattern)
+{
+int err;
+PCRE2_SIZE off;
+pcre2_code * re = pcre2_compile((PCRE2_SPTR)pattern, PCRE2_ZERO_TERMINATED,
+  0, &err, &off, NULL);
+if (!re)
+  {
+  PCRE2_UCHAR buf[256];
+  pcre2_get_error_message(err, buf, sizeof(buf));
+  die("bad pattern \"%s\" at offset %d: %s", pattern, (int)off, buf);
+  }
+return re;
+}
+
+static BOOL
+regex_match(const pcre2_code * re, const char * s, size_t len)
+{
+return pcre2_match(re, (PCRE2_SPTR)s, len, 0, 0, md, NULL) >= 0;
+}
+
+/* Append capture n of the last match to a buffer, optionally with its first
+character upper-cased.  An unset capture adds nothing. */
+
+static size_t
+regex_capture(const char * s, int n, char * buf, size_t used, size_t size,
+  BOOL ucfirst)
+{
+PCRE2_SIZE * ov = pcre2_get_ovector_pointer(md);
+size_t len;
+
+if (n >= (int)pcre2_get_ovector_count(md) || ov[2*n] == PCRE2_UNSET)
+  return used;
+len = ov[2*n+1] - ov[2*n];
+if (len > size - used - 1) len = size - used - 1;
+memcpy(buf + used, s + ov[2*n], len);
+if (ucfirst && len > 0) buf[used] = toupper((unsigned char)buf[used]);
+buf[used + len] = '\0';
+return used + len;
+}
+
+
+/* The rejection classification of eximstats, in the same order.  Each reason
+is made from the captures: "\u$1" or "\u$1$2", or is fixed. */
+
+enum { R_REJ, R_TEMP };
+
+typedef struct {
+  const char *	pattern;
+  int		kind;
+  int		ncaps;		/* captures in the reason, if not fixed */
+  const char *	fixed;		/* reason text, or prefix for ncaps == -1 */
+  pcre2_code *	re;
+} rej_rule;
+
+static rej_rule rej_rules[] = {
+  { "SpamAssassin",				R_REJ, 0, "Rejected by SpamAssassin" },
+  { "(temporarily rejected [A-Z]*) .*?(: .*?)(:|\\s*$)", R_TEMP, 2, NULL },
+  { "(temporarily refused connection)",		R_TEMP, 1, NULL },
+
+  { "(listed at [^ ]+)",			R_REJ, 1, NULL },
+  { "(Forged IP detected in HELO)",		R_REJ, 1, NULL },
+  { "(Invalid domain or IP given in HELO/EHLO)", R_REJ, 1, NULL },
+  { "(unqualified recipient rejected)",		R_REJ, 1, NULL },
+  { "(closed connection (after|in response) .*?)\\s*$", R_REJ, 1, NULL },
+  { "(sender rejected)",			R_REJ, 1, NULL },
+  { " rejected after DATA: (.*)",		R_REJ, 1, NULL },
+  { " (rejected DATA: .*)",			R_REJ, 1, NULL },
+  { ".DATA ACL discarded recipients.: (.*)",	R_REJ, 1, NULL },
+  { "rejected after DATA: (unqualified address not permitted)", R_REJ, 1, NULL },
+  { "(VRFY rejected)",				R_REJ, 1, NULL },
+  { "(too many recipients)",			R_REJ, 1, NULL },
+  { "(refused relay.*?) to",			R_REJ, 1, NULL },
+  { "(rejected by non-SMTP ACL: .*)",		R_REJ, 1, NULL },
+  { "(rejected by local_scan.*)",		R_REJ, 1, NULL },
+  { "(dropped: too many ((nonmail|unrecognized) commands|syntax or protocol errors))", R_REJ, 1, NULL },
+  { "(local_scan.. function .* - message temporarily rejected)", R_REJ, 1, NULL },
+  { "(SMTP protocol .*?(error|violation))",	R_REJ, 1, NULL },
+  { "(message too big)",			R_REJ, 1, NULL },
+
+  { "rejected [HE][HE]LO from [^:]*: syntactically invalid argument", R_REJ, 0,
+    "Rejected HELO/EHLO: syntactically invalid argument" },
+  { "response to \"RCPT TO.*? was: (.*)",	R_REJ, -1, "Response to RCPT TO was: " },
+
+  { "(lookup of host )\\S+ (failed)",		R_REJ, 2, NULL },
+  { "(rejected [A-Z]*) .*?(: .*?)(:|\\s*$)",	R_REJ, 2, NULL },
+  { "(refused connection )from.*? (\\(.*)",	R_REJ, 2, NULL },
+  { "(error from remote mailer after .*?:).*(: .*?)(:|\\s*$)", R_REJ, 2, NULL },
+  { "rejected after DATA: (\".\" or \".\" expected).*?(: failing address in .*? header)", R_REJ, 2, NULL },
+  { "(Connection )from.*? (refused: load average)", R_REJ, 2, NULL },
+  { "([Cc]onnection )from.*? (refused.*)",	R_REJ, 2, NULL },
+  { ": (Connection refused)()",			R_REJ, 2, NULL },
+
+  { "(temporarily rejected connection in .*?ACL:?.*)", R_TEMP, 1, NULL },
+};
+
+static pcre2_code * re_helo_ip, * re_sa_from, * re_sa_local;
+static pcre2_code * re_sa_spam, * re_sa_ham, * re_sa_skip;
+
+static void
+regex_init(void)
+{
+for (int i = 0; i < sizeof(rej_rules)/sizeof(rej_rule); i++)
+  rej_rules[i].re = regex_compile(rej_rules[i].pattern);
+re_helo_ip = regex_compile("^rejected [HE][HE]LO from .*?(\\[.+?\\]):");
+re_sa_from = regex_compile("From.*?(\\[[^]]+\\])");
+re_sa_local = regex_compile("\\((local)\\)");
+re_sa_spam = regex_compile("Action: ((permanently|temporarily) rejected message|"
+  "flagged as Spam but accepted): score=(\\d+\\.\\d)");
+re_sa_ham = regex_compile("Action: scanned but message isn't spam: score=(-?\\d+\\.\\d)");
+re_sa_skip = regex_compile("(Not running SA because SAEximRunCond expanded to false|"
+  "check skipped due to message size)");
+md = pcre2_match_data_create(16, NULL);
+}
+
+
+
+/*************************************************
+*            Small string matchers               *
+*************************************************/
+
+/* These stand in for the simple Perl patterns that eximstats applies to
+every line; they find what the pattern would. */
+
+#define isws(c)   ((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r' \
+		   || (c) == '\f' || (c) == '\v')
+#define isword(c) (isalnum((unsigned char)(c)) || (c) == '_')
+
+/* /\sX=(\S+)/ for a two-character "X=".  Returns the value and its length. */
+
+static const char *
+find_field(const char * s, const char * e, const char * name, size_t * len)
+{
+for (const char * p = s + 1; p + 2 < e; p++)
+  if (p[0] == name[0] && p[1] == name[1] && isws(p[-1]) && !isws(p[2]))
+    {
+    const char * q = p + 2;
+    while (q < e && !isws(*q)) q++;
+    *len = q - (p + 2);
+    return p + 2;
+    }
+return NULL;
+}
+
+/* /\bH=(\S+)/ and /\bH=(?:|.*? )(\[[^]]+\])/ */
+
+static BOOL
+find_host(const char * s, const char * e, const char ** host, size_t * hlen,
+  const char ** ip, size_t * iplen)
+{
+BOOL gothost = FALSE, gotip = FALSE;
+
+for (const char * p = s; p + 1 < e && !(gothost && gotip); p++)
+  {
+  const char * h = p + 2, * q;
+  if (p[0] != 'H' || p[1] != '=' || (p > s && isword(p[-1]))) continue;
+
+  if (!gothost && h < e && !isws(*h))
+    {
+    for (q = h; q < e && !isws(*q); ) q++;
+    *host = h;
+    *hlen = q - h;
+    gothost = TRUE;
+    }
+
+  if (!gotip)
+    for (q = h; q < e; q++)
+      if (q == h ? *q == '[' : q[-1] == ' ' && *q == '[')
+	{
+	const char * c = memchr(q + 1, ']', e - (q + 1));
+	if (!c) break;			/* no later start can succeed either */
+	if (c > q + 1)
+	  {
+	  *ip = q;
+	  *iplen = c + 1 - q;
+	  gotip = TRUE;
+	  break;
+	  }
+	}
+  }
+return gothost || gotip;
+}
+
+/* (\[\S+\]) starting at p; the closing bracket is the last one in the
+non-space run. */
+
+static size_t
+bracket_token(const char * p, const char * e)
+{
+const char * q, * last = NULL;
+if (p >= e || *p != '[') return 0;
+for (q = p + 1; q < e && !isws(*q); q++)
+  if (*q == ']' && q > p + 1) last = q;
+return last ? last + 1 - p : 0;
+}
+
+static const char *
+find_str(const char * s, const char * e, const char * needle)
+{
+size_t n = strlen(needle);
+if ((size_t)(e - s) < n) return NULL;
+for (const char * p = s; (p = memchr(p, needle[0], e - n + 1 - p)); p++)
+  if (memcmp(p, needle, n) == 0) return p;
+return NULL;
+}
+
+/* The fallbacks for the IP address, for lines that have no H= */
+
+static BOOL
+find_conn_ip(const char * s, const char * e, const char ** ip, size_t * iplen)
+{
+const char * p;
+size_t n;
+
+for (p = s; (p = find_str(p, e, "Connection from ")); p++)
+  if ((n = bracket_token(p + 16, e)))
+    { *ip = p + 16; *iplen = n; return TRUE; }
+
+for (p = s; (p = find_str(p, e, "SMTP call from ")); p++)
+  for (const char * q = p + 15; q < e; q++)
+    if (*q == '[' && (n = bracket_token(q, e)))
+      { *ip = q; *iplen = n; return TRUE; }
+return FALSE;
+}
+
+/* /\sS=(\d+)( |$)/ */
+
+static uint64_t
+find_size(const char * s, const char * e)
+{
+for (const char * p = s + 1; p + 2 < e; p++)
+  if (p[0] == 'S' && p[1] == '=' && isws(p[-1]) && isdigit((unsigned char)p[2]))
+    {
+    const char * q = p + 2;
+    uint64_t v = 0;
+    while (q < e && isdigit((unsigned char)*q)) v = v * 10 + (*q++ - '0');
+    if (q == e || *q == ' ') return v;
+    }
+return 0;
+}
+
+static size_t
+first_token(const char * s, const char * e)
+{
+const char * p = s;
+while (p < e && !isws(*p)) p++;
+return p - s;
+}
+
+static void
+lc(char * s)
+{
+for ( ; *s; s++) *s = tolower((unsigned char)*s);
+}
+
+
+
+/*************************************************
+*            Time handling                       *
+*************************************************/
+
+/* The seconds() function of eximstats: the time of a timestamp, adjusted to
+UTC by its own offset or by that of the local time zone. */
+
+static long
+tod_seconds(const char * tod)
+{
+static char last_date[11];
+static time_t date_seconds;
+int y, mo, d, h, mi, s;
+long t;
+const char * z;
+
+if (sscanf(tod, "%4d-%2d-%2d %2d:%2d:%2d", &y, &mo, &d, &h, &mi, &s) != 6)
+  return 0;
+if (memcmp(last_date, tod, 10) != 0)
+  {
+  struct tm tm = { .tm_mday = d, .tm_mon = mo - 1, .tm_year = y - 1900,
+    .tm_isdst = -1 };
+  memcpy(last_date, tod, 10);
+  date_seconds = mktime(&tm);
+  }
+t = date_seconds + h * 3600 + mi * 60 + s;
+
+if (strlen(tod) >= 25 && (z = tod + 20) && (*z == '+' || *z == '-'))
+  {
+  long off = ((z[1]-'0') * 10 + (z[2]-'0')) * 3600 + ((z[3]-'0') * 10 + (z[4]-'0')) * 60;
+  t -= *z == '-' ? -off : off;
+  }
+else if (use_localtime_offset)
+  t -= localtime_offset;
+return t;
+}
+
+/* The time encoded at the start of a message id */
+
+static long
+id_seconds(const char * id)
+{
+long s = 0;
+for (int i = 0; i < 6 && id[i]; i++)
+  {
+  int c = (unsigned char)id[i], v = 0;
+  if (c >= '0' && c <= '9') v = c - '0';
+  else if (c >= 'A' && c <= 'Z') v = c - 'A' + 10;
+  else if (c >= 'a' && c <= 'z') v = c - 'a' + 36;
+  s = s * 62 + v;
+  }
+return s;
+}
+
+static void
+format_time(long t, char * buf)
+{
+long s = t % 60, m, h, d, w;
+char * p = buf;
+t /= 60; m = t % 60;
+t /= 60; h = t % 24;
+t /= 24; d = t % 7;
+w = t / 7;
+*p = '\0';
+if (w > 0) p += sprintf(p, "%ldw", w);
+if (d > 0) p += sprintf(p, "%ldd", d);
+if (h > 0) p += sprintf(p, "%ldh", h);
+if (m > 0) p += sprintf(p, "%ldm", m);
+if (s > 0 || p == buf) sprintf(p, "%lds", s);
+}
+
+
+
+/*************************************************
+*            Parse one log line                  *
+*************************************************/
+
+static const char *
+reject_reason(const char * s, size_t len, int * kind, char * buf, size_t size)
+{
+for (int i = 0; i < sizeof(rej_rules)/sizeof(rej_rule); i++)
+  {
+  rej_rule * r = &rej_rules[i];
+  size_t used = 0;
+
+  if (!regex_match(r->re, s, len)) continue;
+  *kind = r->kind;
+  if (r->ncaps == 0) return r->fixed;
+  buf[0] = '\0';
+  if (r->ncaps < 0)
+    {
+    used = strlen(r->fixed);
+    memcpy(buf, r->fixed, used + 1);
+    regex_capture(s, 1, buf, used, size, FALSE);
+    return buf;
+    }
+  used = regex_capture(s, 1, buf, 0, size, TRUE);
+  if (r->ncaps > 1) regex_capture(s, 2, buf, used, size, FALSE);
+  return buf;
+  }
+*kind = R_REJ;
+return "Unknown";
+}
+
+/* The user for the local league tables, from a delivery line.  Returns FALSE
+if there is none. */
+
+static BOOL
+local_user(const char * rest, const char * e, char * buf, size_t size,
+  BOOL with_parent)
+{
+const char * p, * q;
+size_t n = 0;
+BOOL split_lt = FALSE;
+
+for (p = rest; p + 1 < e; p++)
+  if (isws(p[0]) && p[1] == '<') { split_lt = TRUE; break; }
+
+if (rest >= e) return FALSE;
+if (split_lt)
+  {
+  p = rest;
+  if (!(q = find_str(rest, e, " <"))) q = e;
+  }
+else
+  {
+  for (p = rest; p < e && isws(*p); ) p++;
+  if (p >= e) return FALSE;
+  for (q = p; q < e && !isws(*q); ) q++;
+  }
+if ((n = q - p) > size - 1) n = size - 1;
+memcpy(buf, p, n);
+buf[n] = '\0';
+
+/* A pipe or file delivery: add the parent address, / (<.+?>) / */
+
+if (with_parent && (buf[0] == '/' || buf[0] == '|'))
+  for (p = rest; (p = find_str(p, e, " <")); p++)
+    {
+    const char * c;
+    for (c = p + 3; c + 1 < e; c++)
+      if (c[0] == '>' && c[1] == ' ') break;
+    if (c + 1 < e && n + 1 + (c + 1 - (p + 1)) < size)
+      {
+      buf[n++] = ' ';
+      memcpy(buf + n, p + 1, c + 1 - (p + 1));
+      n += c + 1 - (p + 1);
+      buf[n] = '\0';
+      break;
+      }
+    }
+return TRUE;
+}
+
+
+static void
+parse_line(const char * line, const char * e, BOOL nl, int me, int nworkers)
+{
+const char * p = line, * rest, * id, * flagp;
+const char * host = NULL, * ip = NULL;
+size_t length, hlen = 0, iplen = 0, idlen, flaglen;
+long extra = 0;
+char tod[TODLEN], flag[3], hostbuf[512], ipbuf[256], domain[512];
+char email[512], edomain[512];
+int hh, mm;
+msg * m = NULL;
+
+/* Convert syslog lines to mainlog format */
+
+if (  e - p < 4 || !isdigit((unsigned char)p[0]) || !isdigit((unsigned char)p[1])
+   || !isdigit((unsigned char)p[2]) || !isdigit((unsigned char)p[3]))
+  {
+  const char * x;
+  for (x = p; (x = find_str(x, e, " exim")); x++)
+    if (x + 5 >= e || !isword(x[5])) break;
+  if (!x || !(x = find_str(x + 5, e, ": "))) return;
+  p = x + 2;
+  }
+
+length = (e - p) + (nl ? 1 : 0);
+if (length < 38) return;
+
+/* The timestamp, with optional fractions of a second, timezone and pid */
+
+if (!(  isdigit((unsigned char)p[0]) && isdigit((unsigned char)p[1])
+     && isdigit((unsigned char)p[2]) && isdigit((unsigned char)p[3])
+     && p[4] == '-' && isdigit((unsigned char)p[5]) && isdigit((unsigned char)p[6])
+     && p[7] == '-' && isdigit((unsigned char)p[8]) && isdigit((unsigned char)p[9])
+     && isws(p[10])
+     && isdigit((unsigned char)p[11]) && isdigit((unsigned char)p[12]) && p[13] == ':'
+     && isdigit((unsigned char)p[14]) && isdigit((unsigned char)p[15]) && p[16] == ':'
+     && isdigit((unsigned char)p[17]) && isdigit((unsigned char)p[18])))
+  return;
+hh = (p[11] - '0') * 10 + p[12] - '0';
+mm = (p[14] - '0') * 10 + p[15] - '0';
+memcpy(tod, p, 19);
+tod[19] = '\0';
+
+  {
+  const char * q = p + 19, * sub = NULL, * tz = NULL, * pid = NULL;
+  size_t sublen = 0, pidlen = 0;
+
+  if (q + 1 < e && *q == '.' && isdigit((unsigned char)q[1]))
+    {
+    for (sub = q++; q < e && isdigit((unsigned char)*q); ) q++;
+    sublen = q - sub;
+    }
+  if (  q + 5 < e && isws(q[0]) && (q[1] == '+' || q[1] == '-')
+     && isdigit((unsigned char)q[2]) && isdigit((unsigned char)q[3])
+     && isdigit((unsigned char)q[4]) && isdigit((unsigned char)q[5]))
+    { tz = q; q += 6; }
+  if (q + 3 < e && isws(q[0]) && q[1] == '[' && isdigit((unsigned char)q[2]))
+    {
+    const char * r = q + 2;
+    while (r < e && isdigit((unsigned char)*r)) r++;
+    if (r < e && *r == ']') { pid = q; pidlen = r + 1 - q; }
+    }
+
+  if (tz)
+    {
+    memcpy(tod + 19, tz, 6);
+    tod[25] = '\0';
+    extra = 6;
+    if (length < 44) return;
+    }
+  if (sub)
+    {
+    extra += sublen;
+    if (length < 38 + extra) return;
+    }
+  if (pid)
+    {
+    extra += pidlen;
+    if (length < 38 + extra) return;
+    }
+  }
+
+/* The message id is the first word in the next 23 characters; anything that
+does not look like one is a reject without an id. */
+
+  {
+  const char * w = p + 20 + extra, * we = w + 23, * t;
+  if (we > e) we = e;
+  if (w > e) w = e;
+  for (t = w; t < we && isws(*t); ) t++;
+  if (t < we)
+    while (t < we && !isws(*t)) t++;
+  else
+    t = we;
+  id = w;
+  idlen = t - w;
+  }
+extra += (long)idlen - 16;
+
+flagp = p + 37 + extra;
+flaglen = flagp >= e ? 0 : e - flagp >= 2 ? 2 : 1;
+memcpy(flag, flagp, flaglen);
+flag[flaglen] = '\0';
+
+/* Share the lines out between the workers */
+
+if (nworkers > 1 && hash_string(id, idlen) % nworkers != me) return;
+
+  {
+  BOOL isflag = flaglen > 0;
+  if (flaglen == 2 && flag[0] == 'S' && flag[1] == 'A')
+    ;
+  else
+    for (int i = 0; i < flaglen; i++)
+      if (!strchr("<>=*-", flag[i])) isflag = FALSE;
+
+  if (!isflag && (  find_str(p, e, "rejected") || find_str(p, e, "refused")
+		 || find_str(p, e, "dropped")))
+    {
+    strcpy(flag, "Re");
+    extra -= 3;
+    }
+  }
+
+if (strcmp(flag, "Re") == 0)
+  {
+  BOOL isid = idlen > 0;
+  for (int i = 0; i < idlen; i++)
+    if (!isalnum((unsigned char)id[i]) && id[i] != '-') isid = FALSE;
+  if (!isid) extra -= 17;		/* eximstats' "reject:<n>" id */
+  }
+
+if (  strcmp(flag, "<=") != 0 && strcmp(flag, "=>") != 0
+   && strcmp(flag, "->") != 0 && strcmp(flag, "==") != 0
+   && strcmp(flag, "**") != 0 && strcmp(flag, "Co") != 0
+   && strcmp(flag, "SA") != 0 && strcmp(flag, "Re") != 0)
+  return;
+
+/* Strip away the timestamp, id and flag */
+
+rest = p + 40 + extra;
+if (rest > e) rest = e;
+
+if (transport_pattern)
+  {
+  size_t n;
+  const char * t = find_field(rest, e, "T=", &n);
+  if (t && regex_match(transport_pattern, t, n)) return;
+  }
+
+/* The host and IP address */
+
+if (!find_host(rest, e, &host, &hlen, &ip, &iplen) || !ip)
+  if (!find_conn_ip(rest, e, &ip, &iplen))
+    ip = NULL;
+if (host)
+  {
+  if (hlen > sizeof(hostbuf) - 1) hlen = sizeof(hostbuf) - 1;
+  memcpy(hostbuf, host, hlen);
+  hostbuf[hlen] = '\0';
+  }
+else
+  strcpy(hostbuf, "local");
+if (ip)
+  {
+  if (iplen > sizeof(ipbuf) - 1) iplen = sizeof(ipbuf) - 1;
+  memcpy(ipbuf, ip, iplen);
+  ipbuf[iplen] = '\0';
+  }
+else
+  strcpy(ipbuf, "local");
+
+strcpy(domain, "localdomain");
+if (do_sender[BY_DOMAIN])
+  {
+  const char * d1, * d2;
+  if (hostbuf[0] == '[' || strspn(hostbuf, "0123456789.") == strlen(hostbuf))
+    strcpy(domain, hostbuf);
+  else
+    {
+    const char * h = hostbuf;
+    BOOL paren = *h == '(';
+    if (paren) h++;
+    if (  (d1 = strchr(h, '.')) && d1 > h
+       && (d2 = strchr(d1 + 1, '.')) && d2 > d1 + 1)
+      {
+      snprintf(domain, sizeof(domain), "%s%s", paren ? "(." : "", d1 + 1);
+      lc(domain);
+      }
+    else if (paren && (d1 = strchr(hostbuf, '.')) && d1 > hostbuf
+       && (d2 = strchr(d1 + 1, '.')) && d2 > d1 + 1)
+      {
+      snprintf(domain, sizeof(domain), "%s", d1 + 1);	/* "(" is the label */
+      lc(domain);
+      }
+    }
+  }
+
+if (do_sender[BY_EMAIL])
+  {
+  size_t n = first_token(rest, e);
+  if (n > sizeof(email) - 1) n = sizeof(email) - 1;
+  memcpy(email, rest, n);
+  email[n] = '\0';
+  }
+
+if (do_sender[BY_EDOMAIN])
+  {
+  size_t n = first_token(rest, e);
+  const char * at;
+  edomain[0] = '\0';
+  if (e - rest >= 2 && memcmp(rest, "<>", 2) == 0)
+    strcpy(edomain, "<>");
+  else if (e - rest >= 9 && memcmp(rest, "blackhole", 9) == 0)
+    strcpy(edomain, "blackhole");
+  else
+    for (at = rest; (at = memchr(at, '@', rest + n - at)); at++)
+      if (at + 1 < rest + n)
+	{
+	size_t dl = rest + n - (at + 1);
+	if (dl > sizeof(edomain) - 1) dl = sizeof(edomain) - 1;
+	memcpy(edomain, at + 1, dl);
+	edomain[dl] = '\0';
+	lc(edomain);
+	break;
+	}
+  }
+
+if (strcmp(tod, tot.begin) < 0)
+  strcpy(tot.begin, tod);
+else if (strcmp(tod, tot.end) > 0)
+  strcpy(tot.end, tod);
+
+if (strcmp(flag, "Re") != 0)
+  m = msg_find(id, idlen, TRUE);
+
+if (strcmp(flag, "<=") == 0)
+  {
+  uint64_t thissize = find_size(rest, e);
+  entry * en;
+  size_t n;
+  const char * u;
+
+  m->size = thissize;
+  m->has_size = TRUE;
+
+  if (show_relay && strcmp(hostbuf, "local") != 0)
+    {
+    char * fh = xmalloc(strlen(hostbuf) + strlen(ipbuf) + 1);
+    sprintf(fh, "%s%s", hostbuf, ip ? ipbuf : "local");
+    free(m->from_host);
+    free(m->from_addr);
+    m->from_host = fh;
+    m->from_addr = xstrndup(rest, first_token(rest, e));
+    }
+
+  if (  local_league_table && strcmp(hostbuf, "local") == 0
+     && (u = find_field(rest, e, "U=", &n)))
+    {
+    en = tab_find(&tabs[T_RCV_USER], u, n);
+    en->count++;
+    en->bytes += thissize;
+    }
+
+  if (do_sender[BY_HOST])
+    { en = tab_finds(T_RCV + BY_HOST, hostbuf); en->count++; en->bytes += thissize; }
+  if (do_sender[BY_DOMAIN] && *domain && strcmp(domain, "0") != 0)
+    { en = tab_finds(T_RCV + BY_DOMAIN, domain); en->count++; en->bytes += thissize; }
+  if (do_sender[BY_EMAIL])
+    { en = tab_finds(T_RCV + BY_EMAIL, email); en->count++; en->bytes += thissize; }
+  if (do_sender[BY_EDOMAIN])
+    { en = tab_finds(T_RCV + BY_EDOMAIN, edomain); en->count++; en->bytes += thissize; }
+
+  tot.rcv_count++;
+  tot.rcv_bytes += thissize;
+
+  if (nqtimes > 0)
+    {
+    strcpy(m->arrival, tod);
+    m->has_arrival = TRUE;
+    }
+  if (hist_opt > 0)
+    tot.rcv_hist[(hh * 60 + mm) / hist_interval]++;
+  }
+
+else if (strcmp(flag, "=>") == 0)
+  {
+  uint64_t size = m->size;
+  entry * en;
+
+  if (strcmp(hostbuf, "local") != 0)
+    {
+    m->remote = TRUE;
+
+    /* Relaying: a single address, or two the same, from a remote host to a
+    remote host */
+
+    if (m->from_host)
+      {
+      const char * tok_e = rest + first_token(rest, e), * q = tok_e;
+      char * old = NULL, * new = NULL;
+
+      if (tok_e > rest)
+	{
+	const char * r = q;
+	while (r < e && isws(*r)) r++;
+	if (r > q && r + 2 < e && r[0] == '(' && r[1] != ')' && r[2] == ')')
+	  {
+	  const char * r2 = r + 3;
+	  while (r2 < e && isws(*r2)) r2++;
+	  if (r2 > r + 3 && r2 < e && *r2 == '<') r = r2;
+	  }
+	if (r > q && r < e && *r == '<')
+	  {
+	  const char * c = memchr(r + 1, '>', e - (r + 1));
+	  if (c && c > r + 1)
+	    {
+	    old = xstrndup(rest, tok_e - rest);
+	    new = xstrndup(r + 1, c - (r + 1));
+	    }
+	  }
+	}
+      if (!old)
+	{
+	old = xstrndup("", 0);
+	new = xstrndup("", 0);
+	}
+      lc(old);
+      lc(new);
+      if (strcmp(old, new) == 0)
+	{
+	char * key, * fh, * fa, * lh;
+	if (!*old)
+	  {
+	  free(old);
+	  old = xstrndup(rest, first_token(rest, e));
+	  lc(old);
+	  }
+	fh = strdup(m->from_host); lc(fh);
+	fa = strdup(m->from_addr); lc(fa);
+	lh = strdup(hostbuf); lc(lh);
+	key = xmalloc(strlen(fh) + strlen(fa) + strlen(lh) + strlen(ipbuf)
+	  + strlen(old) + 20);
+	sprintf(key, "H=%s A=%s => H=%s%s A=%s", fh, fa, lh, ip ? ipbuf : "local", old);
+	if (!relay_pattern || !regex_match(relay_pattern, key, strlen(key)))
+	  tab_finds(T_RELAYED, key)->count++;
+	else
+	  tot.relayed_unshown++;
+	free(key); free(fh); free(fa); free(lh);
+	}
+      free(old);
+      free(new);
+      }
+    }
+
+  if (local_league_table && strcmp(hostbuf, "local") == 0)
+    {
+    char user[1024];
+    if (local_user(rest, e, user, sizeof(user), TRUE))
+      {
+      en = tab_finds(T_DLV_USER, user);
+      en->count++;
+      en->addrs++;
+      en->bytes += size;
+      }
+    }
+
+  if (do_sender[BY_HOST])
+    { en = tab_finds(T_DLV + BY_HOST, hostbuf); en->count++; en->addrs++; en->bytes += size; }
+  if (do_sender[BY_DOMAIN] && *domain && strcmp(domain, "0") != 0)
+    { en = tab_finds(T_DLV + BY_DOMAIN, domain); en->count++; en->addrs++; en->bytes += size; }
+  if (do_sender[BY_EMAIL])
+    { en = tab_finds(T_DLV + BY_EMAIL, email); en->count++; en->addrs++; en->bytes += size; }
+  if (do_sender[BY_EDOMAIN])
+    { en = tab_finds(T_DLV + BY_EDOMAIN, edomain); en->count++; en->addrs++; en->bytes += size; }
+
+  tot.dlv_messages++;
+  tot.dlv_addrs++;
+  tot.dlv_bytes += size;
+
+  if (show_transport)
+    {
+    size_t n;
+    const char * t = find_field(rest, e, "T=", &n);
+    en = t ? tab_find(&tabs[T_TRANSPORT], t, n) : tab_finds(T_TRANSPORT, ":blackhole:");
+    en->count++;
+    en->bytes += size;
+    }
+
+  if (hist_opt > 0)
+    tot.dlv_hist[(hh * 60 + mm) / hist_interval]++;
+  }
+
+else if (strcmp(flag, "->") == 0)
+  {
+  if (local_league_table && strcmp(hostbuf, "local") == 0)
+    {
+    char user[1024];
+    if (local_user(rest, e, user, sizeof(user), TRUE))
+      tab_finds(T_DLV_USER, user)->addrs++;
+    }
+  if (do_sender[BY_HOST]) tab_finds(T_DLV + BY_HOST, hostbuf)->addrs++;
+  if (do_sender[BY_DOMAIN] && *domain && strcmp(domain, "0") != 0)
+    tab_finds(T_DLV + BY_DOMAIN, domain)->addrs++;
+  if (do_sender[BY_EMAIL]) tab_finds(T_DLV + BY_EMAIL, email)->addrs++;
+  if (do_sender[BY_EDOMAIN]) tab_finds(T_DLV + BY_EDOMAIN, edomain)->addrs++;
+  tot.dlv_addrs++;
+  }
+
+else if (strcmp(flag, "==") == 0)
+  {
+  if (m->has_size && !m->delayed)
+    {
+    tot.delayed++;
+    m->delayed = TRUE;
+    }
+  }
+
+else if (strcmp(flag, "**") == 0)
+  {
+  if (m->has_size && !m->had_error)
+    {
+    tot.failed++;
+    m->had_error = TRUE;
+    }
+  if (show_errors)
+    tab_find(&tabs[T_ERRORS], rest, e - rest)->count++;
+  }
+
+else if (strcmp(flag, "Co") == 0)
+  {
+  if (nqtimes > 0)
+    {
+    long queued = m->has_arrival
+      ? tod_seconds(tod) - tod_seconds(m->arrival)
+      : tod_seconds(tod) - id_seconds(m->id);
+    int i;
+    for (i = 0; i < nqtimes; i++)
+      if (queued < qtimes[i])
+	{
+	tot.qt_all[i]++;
+	if (m->remote) tot.qt_remote[i]++;
+	break;
+	}
+    if (i >= nqtimes)
+      {
+      tot.qt_all[MAX_QTIMES]++;
+      if (m->remote) tot.qt_remote[MAX_QTIMES]++;
+      }
+    }
+  msg_delete(m);
+  m = NULL;
+  }
+
+else if (strcmp(flag, "SA") == 0)
+  {
+  char sa_ip[256];
+  size_t len = e - rest;
+  sa_ip[0] = '\0';
+  if (regex_match(re_sa_from, rest, len) || regex_match(re_sa_local, rest, len))
+    regex_capture(rest, 1, sa_ip, 0, sizeof(sa_ip), FALSE);
+  if (regex_match(re_sa_spam, rest, len))
+    tab_finds(T_SPAM_IP, sa_ip)->count++;
+  else if (regex_match(re_sa_ham, rest, len) || regex_match(re_sa_skip, rest, len))
+    tab_finds(T_HAM_IP, sa_ip)->count++;
+  }
+
+/* Rejects, and blackholed messages (deliveries without a transport) */
+
+if (  strcmp(flag, "Re") == 0
+   || (strcmp(flag, "=>") == 0 && !find_field(rest, e, "T=", &hlen)))
+  {
+  size_t len = e - rest, rsize = len + 64;
+  char * reason = xmalloc(rsize);
+  const char * r;
+  int kind;
+
+  if (!ip && regex_match(re_helo_ip, rest, len))
+    regex_capture(rest, 1, ipbuf, 0, sizeof(ipbuf), FALSE);
+
+  r = reject_reason(rest, len, &kind, reason, rsize);
+  tab_finds(kind == R_TEMP ? T_TREJ_REASON : T_REJ_REASON, r)->count++;
+  tab_finds(kind == R_TEMP ? T_TREJ_IP : T_REJ_IP, ipbuf)->count++;
+  free(reason);
+  }
+}
+
+
+
+/*************************************************
+*            Scan the input                      *
+*************************************************/
+
+static void
+parse_all(int me, int nworkers)
+{
+for (int i = 0; i < ninputs; i++)
+  {
+  const char * p = inputs[i].data, * end = p + inputs[i].len;
+  while (p < end)
+    {
+    const char * nl = memchr(p, '\n', end - p);
+    parse_line(p, nl ? nl : end, nl != NULL, me, nworkers);
+    p = nl ? nl + 1 : end;
+    }
+  }
+}
+
+
+/* Read all of a file descriptor into memory */
+
+static void
+slurp(int fd, input * in)
+{
+size_t size = 1024 * 1024, len = 0;
+char * buf = xmalloc(size);
+ssize_t n;
+
+for (;;)
+  {
+  if (len == size && !(buf = realloc(buf, size *= 2)))
+    die("out of memory");
+  if ((n = read(fd, buf + len, size - len)) < 0)
+    {
+    if (errno == EINTR) continue;
+    die("read failed: %s", strerror(errno));
+    }
+  if (n == 0) break;
+  len += n;
+  }
+in->data = buf;
+in->len = len;
+}
+
+
+/* Open one input; compressed files are read through a pipe, others are
+mapped. */
+
+static BOOL
+load_file(const char * name, input * in)
+{
+const char * decomp = strstr(name, ".gz") ? "gunzip"
+  : strstr(name, ".Z") ? "uncompress" : NULL;
+int fd;
+struct stat st;
+
+in->data = NULL;
+in->len = 0;
+
+if (decomp)
+  {
+  int pfd[2], status;
+  pid_t pid;
+  if (pipe(pfd) < 0 || (pid = fork()) < 0)
+    { fprintf(stderr, "Failed to %s -c %s: %s\n", decomp, name, strerror(errno));
+    return FALSE; }
+  if (pid == 0)
+    {
+    (void) dup2(pfd[1], 1);
+    (void) close(pfd[0]);
+    (void) close(pfd[1]);
+    execlp(decomp, decomp, "-c", name, (char *)NULL);
+    _exit(127);
+    }
+  (void) close(pfd[1]);
+  slurp(pfd[0], in);
+  (void) close(pfd[0]);
+  (void) waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    fprintf(stderr, "Failed to %s -c %s\n", decomp, name);
+  return TRUE;
+  }
+
+if ((fd = open(name, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+  {
+  fprintf(stderr, "Failed to read %s: %s\n", name, strerror(errno));
+  if (fd >= 0) (void) close(fd);
+  return FALSE;
+  }
+if (st.st_size > 0)
+  {
+  void * p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (p == MAP_FAILED)
+    slurp(fd, in);
+  else
+    {
+#ifdef MADV_SEQUENTIAL
+    (void) madvise(p, st.st_size, MADV_SEQUENTIAL);
+#endif
+    in->data = p;
+    in->len = st.st_size;
+    }
+  }
+(void) close(fd);
+return TRUE;
+}
+
+
+
+/*************************************************
+*            Pass results between processes      *
+*************************************************/
+
+typedef struct {
+  uint32_t	which;
+  uint32_t	keylen;
+  uint64_t	count, addrs, bytes;
+} rec_hdr;
+
+static void
+results_write(FILE * f)
+{
+rec_hdr h;
+
+if (fwrite(&tot, sizeof(tot), 1, f) != 1) _exit(1);
+for (int t = 0; t < T_COUNT; t++)
+  for (unsigned i = 0; i < tabs[t].size; i++)
+    for (entry * e = tabs[t].buckets[i]; e; e = e->next)
+      {
+      h.which = t;
+      h.keylen = e->keylen;
+      h.count = e->count;
+      h.addrs = e->addrs;
+      h.bytes = e->bytes;
+      if (  fwrite(&h, sizeof(h), 1, f) != 1
+	 || fwrite(e->key, 1, e->keylen, f) != e->keylen)
+	_exit(1);
+      }
+h.which = UINT32_MAX;
+if (fwrite(&h, sizeof(h), 1, f) != 1 || fflush(f) != 0) _exit(1);
+}
+
+static BOOL
+results_merge(FILE * f)
+{
+totals w;
+rec_hdr h;
+char * key = NULL;
+size_t keysize = 0;
+
+if (fread(&w, sizeof(w), 1, f) != 1) return FALSE;
+tot.rcv_count += w.rcv_count;
+tot.rcv_bytes += w.rcv_bytes;
+tot.dlv_messages += w.dlv_messages;
+tot.dlv_addrs += w.dlv_addrs;
+tot.dlv_bytes += w.dlv_bytes;
+tot.delayed += w.delayed;
+tot.failed += w.failed;
+tot.relayed_unshown += w.relayed_unshown;
+for (int i = 0; i <= MAX_QTIMES; i++)
+  {
+  tot.qt_all[i] += w.qt_all[i];
+  tot.qt_remote[i] += w.qt_remote[i];
+  }
+for (int i = 0; i < MAX_HIST; i++)
+  {
+  tot.rcv_hist[i] += w.rcv_hist[i];
+  tot.dlv_hist[i] += w.dlv_hist[i];
+  }
+if (strcmp(w.begin, tot.begin) < 0) strcpy(tot.begin, w.begin);
+if (strcmp(w.end, tot.end) > 0) strcpy(tot.end, w.end);
+
+for (;;)
+  {
+  entry * e;
+  if (fread(&h, sizeof(h), 1, f) != 1) return FALSE;
+  if (h.which == UINT32_MAX) break;
+  if (h.which >= T_COUNT) return FALSE;
+  if (h.keylen >= keysize && !(key = realloc(key, keysize = h.keylen + 1)))
+    die("out of memory");
+  if (fread(key, 1, h.keylen, f) != h.keylen) return FALSE;
+  e = tab_find(&tabs[h.which], key, h.keylen);
+  e->count += h.count;
+  e->addrs += h.addrs;
+  e->bytes += h.bytes;
+  }
+free(key);
+return TRUE;
+}
+
+
+/* Run the workers and merge what they find */
+
+static void
+run_workers(int nworkers)
+{
+FILE * from[MAX_WORKERS];
+pid_t pids[MAX_WORKERS];
+BOOL ok = TRUE;
+
+fflush(stdout);
+fflush(stderr);
+for (int i = 0; i < nworkers; i++)
+  {
+  int pfd[2];
+  if (pipe(pfd) < 0 || (pids[i] = fork()) < 0)
+    die("failed to start a worker: %s", strerror(errno));
+  if (pids[i] == 0)
+    {
+    FILE * f;
+    (void) close(pfd[0]);
+    for (int j = 0; j < i; j++) (void) fclose(from[j]);
+    if (!(f = fdopen(pfd[1], "w"))) _exit(1);
+    parse_all(i, nworkers);
+    results_write(f);
+    _exit(0);
+    }
+  (void) close(pfd[1]);
+  if (!(from[i] = fdopen(pfd[0], "r")))
+    die("fdopen failed: %s", strerror(errno));
+  }
+
+for (int i = 0; i < nworkers; i++)
+  {
+  int status;
+  if (!results_merge(from[i])) ok = FALSE;
+  (void) fclose(from[i]);
+  if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status)
+     || WEXITSTATUS(status) != 0)
+    ok = FALSE;
+  }
+if (!ok) die("a worker process failed");
+}
+
+
+
+/*************************************************
+*            Report                              *
+*************************************************/
+
+/* The volume_rounded() and un_round() functions of eximstats, on a volume
+held as bytes and gigabytes. */
+
+static void
+volume_rounded(uint64_t x, uint64_t g, char * buf)
+{
+while (x > GIG) { g++; x -= GIG; }
+
+if (!volume_rounding)
+  sprintf(buf, "%llu", (unsigned long long)(g * GIG + x));
+else if (g == 0)
+  {
+  if (x < 10000) sprintf(buf, "%6llu", (unsigned long long)x);
+  else if (x < 10000000) sprintf(buf, "%4lluKB", (unsigned long long)((x + 512) / 1024));
+  else sprintf(buf, "%4lluMB", (unsigned long long)((x + 512*1024) / (1024*1024)));
+  }
+else if (g < 10)
+  sprintf(buf, "%4lluMB", (unsigned long long)(g * 1024 + (x + 512*1024) / (1024*1024)));
+else
+  sprintf(buf, "%4lluGB", (unsigned long long)(g + (x + GIG/2) / GIG));
+}
+
+static void
+volume(uint64_t bytes, char * buf)
+{
+uint64_t g = 0;
+while (bytes > GIG) { g++; bytes -= GIG; }
+volume_rounded(bytes, g, buf);
+}
+
+static void
+un_round(const char * s, uint64_t * bytes, uint64_t * gigs)
+{
+unsigned long long n = 0;
+const char * p = s + strspn(s, " ");
+sscanf(p, "%llu", &n);
+if      (strstr(p, "GB")) *gigs += n;
+else if (strstr(p, "MB")) { *gigs += n / 1024; *bytes += (n % 1024) * 1024 * 1024; }
+else if (strstr(p, "KB")) { *gigs += n / (1024*1024); *bytes += (n % (1024*1024)) * 1024; }
+else { *gigs += n / GIG; *bytes += n % GIG; }
+while (*bytes > GIG) { (*gigs)++; *bytes -= GIG; }
+}
+
+/* The average of a rounded volume, as the reader would work it out */
+
+static void
+rounded_average(const char * vol, uint64_t messages, char * buf)
+{
+uint64_t b = 0, g = 0;
+un_round(vol, &b, &g);
+volume_rounded(b / messages, g / messages, buf);
+}
+
+
+static int
+cmp_key(const void * a, const void * b)
+{
+const entry * x = *(const entry **)a, * y = *(const entry **)b;
+size_t n = x->keylen < y->keylen ? x->keylen : y->keylen;
+int c = memcmp(x->key, y->key, n);
+return c ? c : x->keylen < y->keylen ? -1 : x->keylen > y->keylen ? 1 : 0;
+}
+
+#define CMP_DESC(a, b) if ((a) != (b)) return (a) > (b) ? -1 : 1
+
+static int
+cmp_count(const void * a, const void * b)
+{
+const entry * x = *(const entry **)a, * y = *(const entry **)b;
+CMP_DESC(x->count, y->count);
+CMP_DESC(x->bytes, y->bytes);
+return cmp_key(a, b);
+}
+
+static int
+cmp_volume(const void * a, const void * b)
+{
+const entry * x = *(const entry **)a, * y = *(const entry **)b;
+CMP_DESC(x->bytes, y->bytes);
+CMP_DESC(x->count, y->count);
+return cmp_key(a, b);
+}
+
+/* The entries of a table with a non-zero message count, sorted */
+
+static entry **
+tab_sorted(int which, int (*cmp)(const void *, const void *), unsigned * n)
+{
+table * t = &tabs[which];
+entry ** v = xmalloc((t->used + 1) * sizeof(entry *));
+unsigned k = 0;
+
+for (unsigned i = 0; i < t->size; i++)
+  for (entry * e = t->buckets[i]; e; e = e->next)
+    if (e->count > 0) v[k++] = e;
+qsort(v, k, sizeof(entry *), cmp);
+*n = k;
+return v;
+}
+
+static unsigned
+tab_nonzero(int which)
+{
+unsigned n = 0;
+table * t = &tabs[which];
+for (unsigned i = 0; i < t->size; i++)
+  for (entry * e = t->buckets[i]; e; e = e->next)
+    if (e->count > 0) n++;
+return n;
+}
+
+static void
+underline(const char * title)
+{
+printf("%s\n", title);
+for (const char * p = title; *p; p++) putchar('-');
+putchar('\n');
+}
+
+
+static void
+print_grandtotals(void)
+{
+char sender_hdr[128] = "", vol[32], fmt1[256];
+int nsenders = 0;
+struct { const char * name; int which; } extras[] = {
+  { "Rejects", T_REJ_IP }, { "Temp Rejects", T_TREJ_IP },
+  { "Ham", T_HAM_IP },     { "Spam", T_SPAM_IP } };
+
+for (int i = 0; i < BY_COUNT; i++) if (do_sender[i])
+  {
+  size_t l = strlen(sender_hdr);
+  snprintf(sender_hdr + l, sizeof(sender_hdr) - l, "%*s%ss",
+    8, by_names[i], "");
+  nsenders++;
+  }
+
+printf("\nGrand total summary\n-------------------\n");
+printf("                                              %*s           At least one address\n",
+  (int)strlen(sender_hdr), "");
+printf("  TOTAL               Volume   Messages Addresses %s      Delayed       Failed\n",
+  sender_hdr);
+
+#define SENDER_COLS(vals) \
+  for (int i = 0, k = 0; i < BY_COUNT; i++) if (do_sender[i]) printf("   %6s", vals[k++]);
+
+  {
+  char cols[BY_COUNT][24];
+  int k = 0;
+  volume(tot.rcv_bytes, vol);
+  for (int i = 0; i < BY_COUNT; i++) if (do_sender[i])
+    sprintf(cols[k++], "%u", tab_nonzero(T_RCV + i));
+  printf("  %-16s %9s     %6llu    %6s ", "Received", vol,
+    (unsigned long long)tot.rcv_count, "");
+  SENDER_COLS(cols);
+  printf("  %6llu %4.1f%% %6llu %4.1f%%\n",
+    (unsigned long long)tot.delayed,
+    tot.rcv_count ? tot.delayed * 100.0 / tot.rcv_count : 0.0,
+    (unsigned long long)tot.failed,
+    tot.rcv_count ? tot.failed * 100.0 / tot.rcv_count : 0.0);
+
+  k = 0;
+  volume(tot.dlv_bytes, vol);
+  for (int i = 0; i < BY_COUNT; i++) if (do_sender[i])
+    sprintf(cols[k++], "%u", tab_nonzero(T_DLV + i));
+  sprintf(fmt1, "%llu", (unsigned long long)tot.dlv_addrs);
+  printf("  %-16s %9s     %6llu    %6s ", "Delivered", vol,
+    (unsigned long long)tot.dlv_messages, fmt1);
+  SENDER_COLS(cols);
+  printf("\n");
+
+  for (int x = 0; x < 4; x++)
+    {
+    uint64_t messages = 0;
+    table * t = &tabs[extras[x].which];
+    for (unsigned i = 0; i < t->size; i++)
+      for (entry * e = t->buckets[i]; e; e = e->next) messages += e->count;
+    if (messages == 0) continue;
+    k = 0;
+    for (int i = 0; i < BY_COUNT; i++) if (do_sender[i])
+      {
+      if (i == BY_HOST) sprintf(cols[k++], "%u", t->used);
+      else cols[k++][0] = '\0';
+      }
+    printf("  %-16s %9s     %6llu    %6s ", extras[x].name, "",
+      (unsigned long long)messages, "");
+    SENDER_COLS(cols);
+    printf("\n");
+    }
+  }
+printf("\n");
+}
+
+
+static void
+print_transport(void)
+{
+unsigned n;
+entry ** v = tab_sorted(T_TRANSPORT, cmp_key, &n);
+char vol[32];
+
+printf("Deliveries by transport\n-----------------------");
+printf("\n                      Volume    Messages\n");
+for (unsigned i = 0; i < n; i++)
+  {
+  volume(v[i]->bytes, vol);
+  printf("  %-18s  %6s      %6llu\n", v[i]->key, vol,
+    (unsigned long long)v[i]->count);
+  }
+printf("\n");
+free(v);
+}
+
+
+static void
+print_histogram(const char * text, const char * unit, const uint64_t * counts)
+{
+uint64_t maxd = 0, scale;
+char title[128], units[32];
+int hour = 0, minutes = 0;
+
+for (int i = 0; i < hist_number; i++) if (counts[i] > maxd) maxd = counts[i];
+if ((scale = (maxd + 25) / 50) == 0) scale = 1;
+
+strcpy(units, unit);
+if (scale != 1)
+  {
+  size_t l = strlen(units);
+  if (units[l-1] == 'y') strcpy(units + l - 1, "ies");
+  else strcat(units, "s");
+  }
+
+if (hist_interval == 60)
+  snprintf(title, sizeof(title), "%s per hour", text);
+else if (hist_interval == 1)
+  snprintf(title, sizeof(title), "%s per minute", text);
+else
+  snprintf(title, sizeof(title), "%s per %d minutes", text, hist_interval);
+snprintf(title + strlen(title), sizeof(title) - strlen(title),
+  " (each dot is %llu %s)", (unsigned long long)scale, units);
+printf("%s\n", title);
+for (char * p = title; *p; p++) putchar('-');
+printf("\n\n");
+
+for (int i = 0; i < hist_number; i++)
+  {
+  uint64_t c = counts[i];
+  if (hist_opt == 1)
+    printf("%02d-%02d", hour, hour + 1), hour++;
+  else
+    {
+    if (minutes == 0) printf("%02d:%02d", hour, minutes);
+    else printf("  :%02d", minutes);
+    if ((minutes += hist_interval) >= 60) { minutes = 0; hour++; }
+    }
+  printf(" %6llu ", (unsigned long long)c);
+  for (uint64_t d = c / scale; d > 0; d--) putchar('.');
+  putchar('\n');
+  }
+printf("\n");
+}
+
+
+static void
+print_duration_table(const char * title, const char * type,
+  const uint64_t * values)
+{
+uint64_t total = values[MAX_QTIMES];
+double cumulative = 0;
+BOOL printed_one = FALSE;
+char buf[128], t[32];
+
+for (int i = 0; i < nqtimes; i++) total += values[i];
+snprintf(buf, sizeof(buf), "%s: %s", title, type);
+printf("%s\n", buf);
+for (char * p = buf; *p; p++) putchar('-');
+printf("\n\n");
+
+for (int i = 0; i < nqtimes; i++)
+  if (values[i] > 0)
+    {
+    double percent = values[i] * 100.0 / total;
+    cumulative += percent;
+    format_time(qtimes[i], t);
+    printf("%5s %4s   %6llu %5.1f%%  %5.1f%%\n", printed_one ? "     " : "Under",
+      t, (unsigned long long)values[i], percent, cumulative);
+    printed_one = TRUE;
+    }
+if (values[MAX_QTIMES] > 0)
+  {
+  double percent = values[MAX_QTIMES] * 100.0 / total;
+  cumulative += percent;
+  format_time(qtimes[nqtimes-1], t);
+  printf("%5s %4s   %6llu %5.1f%%  %5.1f%%\n", "Over ", t,
+    (unsigned long long)values[MAX_QTIMES], percent, cumulative);
+  }
+printf("\n");
+}
+
+
+static void
+print_relay(void)
+{
+unsigned n;
+entry ** v = tab_sorted(T_RELAYED, cmp_key, &n);
+uint64_t shown = 0;
+
+if (n == 0 && tot.relayed_unshown == 0)
+  printf("No relayed messages\n-------------------\n\n");
+else
+  {
+  printf("Relayed messages\n----------------\n\n");
+  for (unsigned i = 0; i < n; i++)
+    {
+    char * key = xmalloc(v[i]->keylen + 1), * d = key, * two;
+    for (const char * s = v[i]->key; *s; s++)
+      if ((*s == 'H' || *s == 'A') && s[1] == '=') s++;
+      else *d++ = *s;
+    *d = '\0';
+    if ((two = strstr(key, "=> ")))
+      {
+      *two = '\0';
+      two += 3;
+      }
+    shown += v[i]->count;
+    printf("%7llu %s\n      => %s\n", (unsigned long long)v[i]->count, key,
+      two ? two : "");
+    free(key);
+    }
+  printf("%sTotal: %llu (plus %llu unshown)\n\n", n ? "\n" : "",
+    (unsigned long long)shown, (unsigned long long)tot.relayed_unshown);
+  }
+free(v);
+}
+
+
+static void
+print_league_table(const char * text, int which, int addrs_which, BOOL with_data)
+{
+char name[128], title[160], label[128], hdr[128] = "";
+unsigned n, shown;
+entry ** v;
+BOOL with_addrs = addrs_which >= 0 && tabs[addrs_which].used > 0;
+
+if (topcount == 1) snprintf(name, sizeof(name), "%s", text);
+else snprintf(name, sizeof(name), "%d %ss", topcount, text);
+snprintf(label, sizeof(label), "%s", text);
+label[0] = toupper((unsigned char)label[0]);
+
+strcat(hdr, "  Messages ");
+if (with_addrs) strcat(hdr, " Addresses ");
+if (with_data) strcat(hdr, "     Bytes    Average ");
+
+for (int pass = 0; pass < (with_data ? 2 : 1); pass++)
+  {
+  v = tab_sorted(which, pass ? cmp_volume : cmp_count, &n);
+  snprintf(title, sizeof(title), "Top %s by %s", name,
+    pass ? "volume" : "message count");
+  underline(title);
+  printf("%s  %s\n", hdr, label);
+
+  shown = n < (unsigned)topcount ? n : (unsigned)topcount;
+  for (unsigned i = 0; i < shown; i++)
+    {
+    entry * e = v[i];
+    printf("%10llu ", (unsigned long long)e->count);
+    if (with_addrs) printf("%10llu ", (unsigned long long)e->addrs);
+    if (with_data)
+      {
+      char vol[32], avg[32];
+      volume(e->bytes, vol);
+      rounded_average(vol, e->count, avg);
+      printf("%10s %10s ", vol, avg);
+      }
+    printf("  %s\n", e->key);
+    }
+  printf("\n");
+  free(v);
+  }
+}
+
+
+static void
+print_errors(void)
+{
+unsigned n;
+entry ** v = tab_sorted(T_ERRORS, cmp_key, &n);
+uint64_t total = 0;
+char buf[64];
+
+if (n == 0) { free(v); return; }
+printf("List of errors\n--------------\n\n");
+for (unsigned i = 0; i < n; i++)
+  {
+  char * text = xmalloc(v[i]->keylen + 1), * d = text, * rem;
+  size_t len;
+
+  /* Convert multiple spaces to a single space */
+
+  for (const char * s = v[i]->key; *s; )
+    if (isws(s[0]) && isws(s[1]))
+      {
+      while (isws(*s)) s++;
+      *d++ = ' ';
+      }
+    else *d++ = *s++;
+  *d = '\0';
+
+  total += v[i]->count;
+  printf("%5llu ", (unsigned long long)v[i]->count);
+
+  /* Wrap at a space after 50 characters while more than 65 remain */
+
+  for (rem = text; (len = strlen(rem)) > 65; )
+    {
+    char * q = rem + 50;
+    while (*q && !isws(*q)) q++;
+    if (!*q || !q[1]) break;
+    *q++ = '\0';
+    while (isws(*q) && q[1]) q++;
+    printf("%s\n\t    ", rem);
+    rem = q;
+    }
+  printf("%s\n\n", rem);
+  free(text);
+  }
+snprintf(buf, sizeof(buf), "Errors encountered: %llu", (unsigned long long)total);
+underline(buf);
+free(v);
+}
+
+
+
+/*************************************************
+*            Options                             *
+*************************************************/
+
+/* An entry of a -q list: a simple arithmetic expression, as eximstats
+would evaluate it */
+
+static long
+eval_term(const char ** pp)
+{
+long v = strtol(*pp, (char **)pp, 10);
+while (**pp == '*' || **pp == '/')
+  {
+  char op = *(*pp)++;
+  long w = strtol(*pp, (char **)pp, 10);
+  v = op == '*' ? v * w : w ? v / w : 0;
+  }
+return v;
+}
+
+static long
+eval_expr(const char * s)
+{
+long v = eval_term(&s);
+while (*s == '+' || *s == '-')
+  {
+  char op = *s++;
+  long w = eval_term(&s);
+  v = op == '+' ? v + w : v - w;
+  }
+return v;
+}
+
+static int
+cmp_long(const void * a, const void * b)
+{
+long x = *(const long *)a, y = *(const long *)b;
+return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static void
+parse_time_list(const char * s)
+{
+char * copy = strdup(s), * tok, * save = NULL;
+nqtimes = 0;
+for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+  {
+  if (nqtimes >= MAX_QTIMES) die("too many queue times");
+  qtimes[nqtimes++] = eval_expr(tok);
+  }
+free(copy);
+qsort(qtimes, nqtimes, sizeof(long), cmp_long);
+if (nqtimes == 1 && qtimes[0] == 0) nqtimes = 0;
+}
+
+/* -nr/pattern/ and -nt/pattern/: the delimiter is the character after the
+option name, and must end the argument too. */
+
+static pcre2_code *
+option_pattern(const char * arg)
+{
+size_t len = strlen(arg);
+char * pat;
+pcre2_code * re;
+
+if (len < 2 || arg[len-1] != arg[0])
+  die("malformed option pattern %s", arg);
+pat = xstrndup(arg + 1, len - 2);
+re = regex_compile(pat);
+free(pat);
+return re;
+}
+
+static void
+usage(void)
+{
+fprintf(stderr,
+  "usage: exim_logstats [-h<n>] [-ne] [-nr[/pattern/]] [-nt[/pattern/]]\n"
+  "       [-q<list>] [-t<n>] [-tnl] [-byhost] [-bydomain] [-byemail]\n"
+  "       [-byedomain] [-nvr] [-utc] [-emptyok] [-j<n>] [file ...]\n");
+exit(1);
+}
+
+
+
+/*************************************************
+*            Main program                        *
+*************************************************/
+
+int
+main(int argc, char ** argv)
+{
+int i, nworkers = 0;
+size_t total_len = 0;
+BOOL any_sender = FALSE;
+
+parse_time_list("60,300,900,1800,3600,10800,21600,43200,86400");
+regex_init();
+
+for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1]; i++)
+  {
+  const char * a = argv[i];
+  if (a[1] == 'h' && isdigit((unsigned char)a[2]))	hist_opt = atoi(a + 2);
+  else if (strcmp(a, "-ne") == 0)			show_errors = FALSE;
+  else if (strcmp(a, "-nr") == 0)			show_relay = FALSE;
+  else if (strncmp(a, "-nr", 3) == 0)			relay_pattern = option_pattern(a + 3);
+  else if (strcmp(a, "-nt") == 0)			show_transport = FALSE;
+  else if (strncmp(a, "-nt", 3) == 0)			transport_pattern = option_pattern(a + 3);
+  else if (a[1] == 'q' && a[2])				parse_time_list(a + 2);
+  else if (strcmp(a, "-tnl") == 0)			local_league_table = FALSE;
+  else if (a[1] == 't' && isdigit((unsigned char)a[2]))	topcount = atoi(a + 2);
+  else if (strcmp(a, "-byhost") == 0)			do_sender[BY_HOST] = any_sender = TRUE;
+  else if (strcmp(a, "-bydomain") == 0)			do_sender[BY_DOMAIN] = any_sender = TRUE;
+  else if (strcmp(a, "-byemail") == 0)			do_sender[BY_EMAIL] = any_sender = TRUE;
+  else if (  strcmp(a, "-byedomain") == 0
+	  || strcmp(a, "-byemaildomain") == 0)		do_sender[BY_EDOMAIN] = any_sender = TRUE;
+  else if (strcmp(a, "-nvr") == 0)			volume_rounding = FALSE;
+  else if (strcmp(a, "-utc") == 0)			use_localtime_offset = FALSE;
+  else if (strcmp(a, "-emptyok") == 0)			empty_ok = TRUE;
+  else if (a[1] == 'j' && isdigit((unsigned char)a[2]))	nworkers = atoi(a + 2);
+  else
+    {
+    fprintf(stderr, "exim_logstats: unknown or unsupported option %s\n", a);
+    usage();
+    }
+  }
+if (!any_sender) do_sender[BY_HOST] = TRUE;
+
+if (hist_opt > 0)
+  {
+  if (hist_opt > 60 || 60 % hist_opt != 0)
+    die("-h must specify a factor of 60");
+  hist_interval = 60 / hist_opt;
+  hist_number = (24 * 60) / hist_interval;
+  }
+
+  {
+  time_t now = time(NULL);
+  struct tm g = *gmtime(&now);
+  g.tm_isdst = 0;
+  localtime_offset = (long)(mktime(&g) - now);
+  }
+strcpy(tot.begin, begin_init);
+strcpy(tot.end, end_init);
+
+/* Load the input */
+
+if (i >= argc)
+  {
+  inputs = xmalloc(sizeof(input));
+  slurp(0, &inputs[0]);
+  ninputs = 1;
+  }
+else
+  {
+  inputs = xmalloc((argc - i) * sizeof(input));
+  for ( ; i < argc; i++)
+    if (load_file(argv[i], &inputs[ninputs])) ninputs++;
+  }
+for (i = 0; i < ninputs; i++) total_len += inputs[i].len;
+
+/* One process per CPU by default, but not for small logs */
+
+if (nworkers <= 0)
+  {
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  nworkers = ncpu > 0 ? (int)ncpu : 1;
+  if (total_len < 16 * 1024 * 1024) nworkers = 1;
+  }
+if (nworkers > MAX_WORKERS) nworkers = MAX_WORKERS;
+
+if (nworkers == 1)
+  parse_all(0, 1);
+else
+  run_workers(nworkers);
+
+if (strcmp(tot.begin, begin_init) == 0 && !empty_ok)
+  {
+  fprintf(stderr, "**** No valid log lines read\n");
+  exit(1);
+  }
+
+/* Output the results, in the order of eximstats */
+
+printf("\nExim statistics from %s to %s\n", tot.begin, tot.end);
+print_grandtotals();
+if (show_transport) print_transport();
+if (hist_opt > 0)
+  {
+  print_histogram("Messages received", "message", tot.rcv_hist);
+  print_histogram("Deliveries", "delivery", tot.dlv_hist);
+  }
+if (nqtimes > 0)
+  {
+  print_duration_table("Time spent on the queue", "all messages", tot.qt_all);
+  print_duration_table("Time spent on the queue",
+    "messages with at least one remote delivery", tot.qt_remote);
+  }
+if (show_relay) print_relay();
+
+if (topcount > 0)
+  {
+  static const char * by_lc[] = { "host", "domain", "email", "edomain" };
+  char text[64];
+
+  if (tabs[T_REJ_REASON].used)
+    print_league_table("mail rejection reason", T_REJ_REASON, -1, FALSE);
+  if (tabs[T_TREJ_REASON].used)
+    print_league_table("mail temporary rejection reason", T_TREJ_REASON, -1, FALSE);
+  for (i = 0; i < BY_COUNT; i++) if (do_sender[i])
+    {
+    snprintf(text, sizeof(text), "sending %s", by_lc[i]);
+    print_league_table(text, T_RCV + i, -1, TRUE);
+    }
+  if (local_league_table && tabs[T_RCV_USER].used)
+    print_league_table("local sender", T_RCV_USER, -1, TRUE);
+  for (i = 0; i < BY_COUNT; i++) if (do_sender[i])
+    {
+    snprintf(text, sizeof(text), "%s destination", by_lc[i]);
+    print_league_table(text, T_DLV + i, T_DLV + i, TRUE);
+    }
+  if (local_league_table && tab_nonzero(T_DLV_USER))
+    print_league_table("local destination", T_DLV_USER, T_DLV_USER, TRUE);
+  if (tabs[T_REJ_IP].used)
+    print_league_table("rejected ip", T_REJ_IP, -1, FALSE);
+  if (tabs[T_TREJ_IP].used)
+    print_league_table("temporarily rejected ip", T_TREJ_IP, -1, FALSE);
+  if (tabs[T_SPAM_IP].used)
+    print_league_table("non-rejected spamming ip", T_SPAM_IP, -1, FALSE);
+  }
+
+if (show_errors) print_errors();
+return 0;
+}
+
+/* End of exim_logstats.c */
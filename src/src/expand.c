@@ -424,6 +424,7 @@ enum {
 
 enum vtypes {
   vtype_int,            /* value is address of int */
+  vtype_msgsize,        /* ditto, but the data file is opened if not yet done */
   vtype_filter_int,     /* ditto, but recognized only when filtering */
   vtype_ino,            /* value is address of ino_t (not always an int) */
   vtype_uid,            /* value is address of uid_t (not always an int) */
@@ -619,13 +620,13 @@ static var_entry var_table[] = {
   { "message_age",         vtype_int,         &message_age },
   { "message_body",        vtype_msgbody,     &message_body },
   { "message_body_end",    vtype_msgbody_end, &message_body_end },
-  { "message_body_size",   vtype_int,         &message_body_size },
+  { "message_body_size",   vtype_msgsize,     &message_body_size },
   { "message_exim_id",     vtype_stringptr,   &message_id },
   { "message_headers",     vtype_msgheaders,  NULL },
   { "message_headers_raw", vtype_msgheaders_raw, NULL },
   { "message_id",          vtype_stringptr,   &message_id },
   { "message_linecount",   vtype_int,         &message_linecount },
-  { "message_size",        vtype_int,         &message_size },
+  { "message_size",        vtype_msgsize,     &message_size },
 #ifdef SUPPORT_I18N
   { "message_smtputf8",    vtype_bool,        &message_smtputf8 },
 #endif
@@ -640,7 +641,7 @@ static var_entry var_table[] = {
   { "mime_content_size",   vtype_int,         &mime_content_size },
   { "mime_content_transfer_encoding",vtype_stringptr, &mime_content_transfer_encoding },
   { "mime_content_type",   vtype_stringptr,   &mime_content_type },
-  { "mime_decoded_filename", vtype_stringptr, &mime_decoded_filename },
+  { "mime_decoded_filename", vtype_string_func, (void *) &mime_decoded_file },
   { "mime_filename",       vtype_stringptr,   &mime_filename },
   { "mime_is_coverletter", vtype_int,         &mime_is_coverletter },
   { "mime_is_multipart",   vtype_int,         &mime_is_multipart },
@@ -696,6 +697,8 @@ static var_entry var_table[] = {
   { "recipients",          vtype_string_func, (void *) &fn_recipients },
   { "recipients_count",    vtype_int,         &recipients_count },
   { "recipients_list",     vtype_string_func, (void *) &fn_recipients_list },
+  { "regex_cache_hits",    vtype_int,         &regex_cache_hits },
+  { "regex_cache_misses",  vtype_int,         &regex_cache_misses },
   { "regex_cachesize",     vtype_int,         &regex_cachesize },/* undocumented; devel observability */
 #ifdef WITH_CONTENT_SCAN
   { "regex_match_string",  vtype_stringptr,   &regex_match_string },
@@ -842,6 +845,9 @@ uschar * fn_hdrs_added(void) {return NULL;}
 uschar * fn_queue_size(void) {return NULL;}
 uschar * fn_recipients(void) {return NULL;}
 uschar * fn_recipients_list(void) {return NULL;}
+#ifdef WITH_CONTENT_SCAN
+uschar * mime_decoded_file(void) {return NULL;}
+#endif
 uschar * sender_helo_verified_boolstr(void) {return NULL;}
 uschar * smtp_cmd_hist(void) {return NULL;}
 
@@ -1676,8 +1682,16 @@ int len = name ? Ustrlen(name) : 0;
 BOOL comma = FALSE;
 gstring * g = NULL;
 uschar * rawhdr;
+header_line ** hv = NULL, * h;
+int hn;
+
+/* For a single header, only those the index gives need be looked at */
 
-for (header_line * h = header_list; h; h = h->next)
+if (len > 0 && name[len-1] == ':')
+  hv = header_index_find(name, len, &hn);
+h = hv ? hn > 0 ? hv[0] : NULL : header_list;
+
+for (int i = 0; h; h = hv ? ++i < hn ? hv[i] : NULL : h->next)
   if (h->type != htype_old && h->text)  /* NULL => Received: placeholder */
     if (!name || (len <= h->slen && strncmpic(name, h->text, len) == 0))
       {
@@ -1926,13 +1940,12 @@ Returns:        NULL if the variable does not exist, or
                 something non-NULL if exists_only is TRUE
 */
 
+static const uschar * var_entry_value(var_entry *, BOOL, BOOL, int *);
+
 static const uschar *
 find_variable(uschar *name, BOOL exists_only, BOOL skipping, int *newsize)
 {
 var_entry * vp;
-uschar *s, *domain;
-uschar **ss;
-void * val;
 
 /* Handle ACL variables, whose names are of the form acl_cxxx or acl_mxxx.
 Originally, xxx had to be a number in the range 0-9 (later 0-19), but from
@@ -1982,8 +1995,22 @@ else if (Ustrncmp(name, "regex", 5) == 0)
 if (!(vp = find_var_ent(name)))
   return NULL;          /* Unknown variable name */
 
-/* Found an existing variable. If in skipping state, the value isn't needed,
-and we want to avoid processing (such as looking up the host name). */
+return var_entry_value(vp, exists_only, skipping, newsize);
+}
+
+
+/* Get the value of a variable from the main table. The arguments and result
+are as for find_variable(). */
+
+static const uschar *
+var_entry_value(var_entry * vp, BOOL exists_only, BOOL skipping, int * newsize)
+{
+uschar *s, *domain;
+uschar **ss;
+void * val;
+
+/* If in skipping state, the value isn't needed, and we want to avoid
+processing (such as looking up the host name). */
 
 if (skipping)
   return US"";
@@ -1991,6 +2018,11 @@ if (skipping)
 val = vp->value;
 switch (vp->type)
   {
+  case vtype_msgsize:
+    (void) spool_open_body();
+    sprintf(CS var_buffer, "%d", *(int *)(val));
+    return var_buffer;
+
   case vtype_filter_int:
     if (!f.filter_running) return NULL;
     /* Fall through */
@@ -2055,7 +2087,7 @@ switch (vp->type)
   case vtype_msgbody:                        /* Pointer to msgbody string */
   case vtype_msgbody_end:                    /* Ditto, the end of the msg */
     ss = (uschar **)(val);
-    if (!*ss && deliver_datafile >= 0)  /* Read body when needed */
+    if (!*ss && spool_open_body())      /* Read body when needed */
       {
       uschar * body;
       off_t start_offset_o = spool_data_start_offset(message_id);
@@ -2081,6 +2113,13 @@ switch (vp->type)
       if ((len = read(deliver_datafile, body, len)) > 0)
 	{
 	body[len] = 0;
+	if (f.spool_file_wireformat) /* Drop the CR of each stored CRLF */
+	  {
+	  int j = 0;
+	  for (int i = 0; i < len; i++)
+	    if (body[i] != '\r' || body[i+1] != '\n') body[j++] = body[i];
+	  body[len = j] = 0;
+	  }
 	if (message_body_newlines)   /* Separate loops for efficiency */
 	  while (len > 0)
 	    { if (body[--len] == 0) body[len] = ' '; }
@@ -4353,55 +4392,84 @@ return x;
 
 
 /************************************************/
+/* An element of a list being sorted: the item, the field extracted from it
+for comparison and, for a numeric comparator, that field as a number, so that
+it is converted once rather than on every comparison. */
+
+typedef struct {
+  const uschar *	item;
+  const uschar *	key;
+  int_eximarith_t	num;
+} sort_ele;
+
 /* Comparison operation for sort expansion.  We need to avoid
 re-expanding the fields being compared, so need a custom routine.
 
 Arguments:
  cond_type		Comparison operator code
- leftarg, rightarg	Arguments for comparison
+ left, right		Elements for comparison
 
-Return true iff (leftarg compare rightarg)
+Return true iff (left compare right)
 */
 
 static BOOL
-sortsbefore(int cond_type, BOOL alpha_cond,
-  const uschar * leftarg, const uschar * rightarg)
+sortsbefore(int cond_type, const sort_ele * left, const sort_ele * right)
 {
-int_eximarith_t l_num, r_num;
+const uschar * leftarg = left->key, * rightarg = right->key;
 
-if (!alpha_cond)
+switch (cond_type)
   {
-  l_num = expanded_string_integer(leftarg, FALSE);
-  if (expand_string_message) return FALSE;
-  r_num = expanded_string_integer(rightarg, FALSE);
-  if (expand_string_message) return FALSE;
-
-  switch (cond_type)
-    {
-    case ECOND_NUM_G:	return l_num >  r_num;
-    case ECOND_NUM_GE:	return l_num >= r_num;
-    case ECOND_NUM_L:	return l_num <  r_num;
-    case ECOND_NUM_LE:	return l_num <= r_num;
-    default: break;
-    }
+  case ECOND_NUM_G:	return left->num >  right->num;
+  case ECOND_NUM_GE:	return left->num >= right->num;
+  case ECOND_NUM_L:	return left->num <  right->num;
+  case ECOND_NUM_LE:	return left->num <= right->num;
+
+  case ECOND_STR_LT:	return Ustrcmp (leftarg, rightarg) <  0;
+  case ECOND_STR_LTI:	return strcmpic(leftarg, rightarg) <  0;
+  case ECOND_STR_LE:	return Ustrcmp (leftarg, rightarg) <= 0;
+  case ECOND_STR_LEI:	return strcmpic(leftarg, rightarg) <= 0;
+  case ECOND_STR_GT:	return Ustrcmp (leftarg, rightarg) >  0;
+  case ECOND_STR_GTI:	return strcmpic(leftarg, rightarg) >  0;
+  case ECOND_STR_GE:	return Ustrcmp (leftarg, rightarg) >= 0;
+  case ECOND_STR_GEI:	return strcmpic(leftarg, rightarg) >= 0;
+  default: break;
   }
-else
-  switch (cond_type)
-    {
-    case ECOND_STR_LT:	return Ustrcmp (leftarg, rightarg) <  0;
-    case ECOND_STR_LTI:	return strcmpic(leftarg, rightarg) <  0;
-    case ECOND_STR_LE:	return Ustrcmp (leftarg, rightarg) <= 0;
-    case ECOND_STR_LEI:	return strcmpic(leftarg, rightarg) <= 0;
-    case ECOND_STR_GT:	return Ustrcmp (leftarg, rightarg) >  0;
-    case ECOND_STR_GTI:	return strcmpic(leftarg, rightarg) >  0;
-    case ECOND_STR_GE:	return Ustrcmp (leftarg, rightarg) >= 0;
-    case ECOND_STR_GEI:	return strcmpic(leftarg, rightarg) >= 0;
-    default: break;
-    }
 return FALSE;	/* should not happen */
 }
 
 
+/* Merge sort for the sort expansion, O(n log n) in comparisons.  An element
+from the later half is taken first only if it sorts before the one from the
+earlier half, which gives the same order as inserting each element in turn
+before the first that it sorts before: elements that compare equal keep their
+list order under a strict comparator, and are reversed under a non-strict one.
+
+Arguments:
+ v		elements to sort, in place
+ tmp		workspace for n elements
+ n		number of elements
+ cond_type	comparison operator code
+*/
+
+static void
+sort_eles(sort_ele * v, sort_ele * tmp, int n, int cond_type)
+{
+int h = n / 2, i = 0, j = h, k = 0;
+
+if (n < 2) return;
+sort_eles(v, tmp, h, cond_type);
+sort_eles(v + h, tmp, n - h, cond_type);
+
+while (i < h && j < n)
+  tmp[k++] = sortsbefore(cond_type, &v[j], &v[i]) ? v[j++] : v[i++];
+
+/* Any left in the later half are already in place */
+
+while (i < h) tmp[k++] = v[i++];
+memcpy(v, tmp, k * sizeof(sort_ele));
+}
+
+
 /* Expand a named list.  Return false on failure. */
 static gstring *
 expand_listnamed(gstring * yield, const uschar * name, const uschar * listtype)
@@ -6765,11 +6833,11 @@ while (*s)
 
     case EITEM_SORT:
       {
-      int sep = 0, cond_type;
+      int sep = 0, cond_type, n = 0;
       const uschar * srclist, * cmp, * xtract;
       uschar * opname, * srcitem;
-      const uschar * dstlist = NULL, * dstkeylist = NULL;
       uschar * tmp, * save_iterate_item = iterate_item;
+      sort_ele * eles;
 
       Uskip_whitespace(&s);
       if (*s++ != '{')							/*}*/
@@ -6849,10 +6917,21 @@ while (*s)
 
       if (flags & ESI_SKIPPING) continue;
 
-      while ((srcitem = string_nextinlist(&srclist, &sep, NULL, 0)))
+      /* Parse the list once, into an array of items with their comparison
+      fields; count it first so the array can be sized. */
+
 	{
-	uschar * srcfield, * dstitem;
-	gstring * newlist = NULL, * newkeylist = NULL;
+	const uschar * list = srclist;
+	uschar * dummy = store_get(2, GET_TAINTED);
+	int tsep = 0;
+
+	while (string_nextinlist(&list, &tsep, dummy, 1)) n++;
+	}
+      eles = store_get((2*n + 1) * sizeof(sort_ele), GET_UNTAINTED);
+
+      for (int i = 0; i < n && (srcitem = string_nextinlist(&srclist, &sep, NULL, 0)); i++)
+	{
+	uschar * srcfield;
 
         DEBUG(D_expand) debug_printf_indent("%s: $item = \"%s\"\n", name, srcitem);
 
@@ -6867,72 +6946,36 @@ while (*s)
 	  goto EXPAND_FAILED;
 	  }
 
-	/* Insertion sort */
+	/* String-comparator names start with a letter; numeric names do not */
 
-	/* copy output list until new-item < list-item */
-	while ((dstitem = string_nextinlist(&dstlist, &sep, NULL, 0)))
+	if (!isalpha(opname[0]))
 	  {
-	  uschar * dstfield;
-
-	  /* field for comparison */
-	  if (!(dstfield = string_nextinlist(&dstkeylist, &sep, NULL, 0)))
-	    goto SORT_MISMATCH;
-
-	  /* String-comparator names start with a letter; numeric names do not */
-
-	  if (sortsbefore(cond_type, isalpha(opname[0]),
-	      srcfield, dstfield))
-	    {
-	    /* New-item sorts before this dst-item.  Append new-item,
-	    then dst-item, then remainder of dst list. */
-
-	    newlist = string_append_listele(newlist, sep, srcitem);
-	    newkeylist = string_append_listele(newkeylist, sep, srcfield);
-	    srcitem = NULL;
-
-	    newlist = string_append_listele(newlist, sep, dstitem);
-	    newkeylist = string_append_listele(newkeylist, sep, dstfield);
+	  eles[i].num = expanded_string_integer(srcfield, FALSE);
+	  if (expand_string_message) goto EXPAND_FAILED;
+	  }
+	eles[i].item = srcitem;
+	eles[i].key = srcfield;
+	}
 
-/*XXX why field-at-a-time copy?  Why not just dup the rest of the list? */
-	    while ((dstitem = string_nextinlist(&dstlist, &sep, NULL, 0)))
-	      {
-	      if (!(dstfield = string_nextinlist(&dstkeylist, &sep, NULL, 0)))
-		goto SORT_MISMATCH;
-	      newlist = string_append_listele(newlist, sep, dstitem);
-	      newkeylist = string_append_listele(newkeylist, sep, dstfield);
-	      }
+      sort_eles(eles, eles + n, n, cond_type);
 
-	    break;
-	    }
+	{
+	gstring * dstlist = NULL;
 
-	  newlist = string_append_listele(newlist, sep, dstitem);
-	  newkeylist = string_append_listele(newkeylist, sep, dstfield);
-	  }
+	for (int i = 0; i < n; i++)
+	  dstlist = string_append_listele(dstlist, sep, eles[i].item);
 
-	/* If we ran out of dstlist without consuming srcitem, append it */
-	if (srcitem)
+	if (dstlist)
 	  {
-	  newlist = string_append_listele(newlist, sep, srcitem);
-	  newkeylist = string_append_listele(newkeylist, sep, srcfield);
+	  DEBUG(D_expand) debug_printf_indent("%s: dstlist = \"%s\"\n",
+				      name, string_from_gstring(dstlist));
+	  yield = gstring_append(yield, dstlist);
 	  }
-
-	dstlist = newlist->s;
-	dstkeylist = newkeylist->s;
-
-        DEBUG(D_expand) debug_printf_indent("%s: dstlist = \"%s\"\n", name, dstlist);
-        DEBUG(D_expand) debug_printf_indent("%s: dstkeylist = \"%s\"\n", name, dstkeylist);
 	}
 
-      if (dstlist)
-	yield = string_cat(yield, dstlist);
-
       /* Restore preserved $item */
       iterate_item = save_iterate_item;
       break;
-
-      SORT_MISMATCH:
-	expand_string_message = US"Internal error in sort (list mismatch)";
-	goto EXPAND_FAILED;
       }
 
 
@@ -8544,6 +8587,275 @@ return NULL;
 
 
 
+/*************************************************
+*        Cache of compiled simple strings        *
+*************************************************/
+
+/* Many option strings that are expanded over and over consist only of text
+and references to variables, such as "$local_part@$domain". A string of that
+form is compiled on first use into a list of pieces, so that later expansions
+just concatenate the text and the values without parsing it again. Strings
+that use any expansion item, operator or condition are left to the full
+expander; as they are remembered too, recognising them is quick.
+
+The cache is indexed by the address of the string, and holds a copy of the
+text to make sure that the string at that address has not changed. A slot
+is taken over by another string only after repeated misses. It is not used
+when expansion debugging is on, so that the debug output is unchanged. */
+
+#define ESC_SLOTS	512
+#define ESC_MAXLEN	1024
+#define ESC_MAXSEGS	64
+
+enum { ESC_TEXT, ESC_VAR, ESC_HEADER, ESC_NUM };
+
+typedef struct esc_seg {
+  uschar		kind;
+  BOOL			bheader;	/* $bh_ - no charset conversion */
+  unsigned		hflags;		/* for find_header() */
+  int			len;		/* of the text, or the number */
+  var_entry *		vp;		/* a variable in the main table */
+  const uschar *	s;		/* text, or variable or header name */
+} esc_seg;
+
+typedef struct esc_entry {
+  const uschar *	key;		/* the string's address */
+  uschar *		copy;		/* and its text */
+  int			nsegs;		/* -1 if it cannot be compiled */
+  int			hits;
+  BOOL			textonly;
+  esc_seg		segs[1];	/* extended as needed */
+} esc_entry;
+
+static esc_entry * esc_table[ESC_SLOTS];
+
+
+/* Compile a string into a new cache entry, in malloc store. */
+
+static esc_entry *
+esc_compile(const uschar * string)
+{
+esc_seg segs[ESC_MAXSEGS];
+uschar buf[2 * ESC_MAXLEN + 2 * ESC_MAXSEGS];	/* text and names */
+int nsegs = 0, bufused = 0, slen = Ustrlen(string);
+BOOL textonly = TRUE;
+const uschar * s = string;
+esc_entry * e;
+uschar * p;
+
+while (*s)
+  {
+  uschar name[256];
+
+  if (nsegs >= ESC_MAXSEGS) goto NOT_SIMPLE;
+
+  if (*s != '$')
+    {
+    /* Text, processing backslashes as the expander does; consecutive text
+    goes into one piece. */
+
+    if (!nsegs || segs[nsegs-1].kind != ESC_TEXT)
+      {
+      segs[nsegs] = (esc_seg) { .kind = ESC_TEXT };
+      segs[nsegs].s = US (size_t)bufused;	/* offset until relocated */
+      nsegs++;
+      }
+    if (*s == '\\')
+      {
+      if (!s[1]) goto NOT_SIMPLE;
+      if (s[1] == 'N')
+	{
+	const uschar * t = s + 2;
+	for (s = t; *s; s++) if (*s == '\\' && s[1] == 'N') break;
+	memcpy(buf + bufused, t, s - t);
+	bufused += s - t;
+	segs[nsegs-1].len += s - t;
+	if (*s) s += 2;
+	}
+      else
+	{
+	buf[bufused++] = string_interpret_escape(&s);
+	segs[nsegs-1].len++;
+	s++;
+	}
+      }
+    else
+      {
+      buf[bufused++] = *s++;
+      segs[nsegs-1].len++;
+      }
+    continue;
+    }
+
+  textonly = FALSE;
+  if (isalpha(*++s))
+    {
+    uschar * t;
+
+    s = read_name(name, sizeof(name), s, US"_");
+    if (  ( *(t = name) == 'h'
+	  || (*t == 'r' || *t == 'l' || *t == 'b') && *++t == 'h'
+	  )
+       && (*++t == '_' || Ustrncmp(t, "eader_", 6) == 0)
+       )
+      {
+      segs[nsegs] = (esc_seg) { .kind = ESC_HEADER };
+      segs[nsegs].hflags = *name == 'r' ? FH_WANT_RAW
+			  : *name == 'l' ? FH_WANT_RAW|FH_WANT_LIST
+			  : 0;
+      segs[nsegs].bheader = *name == 'b';
+      s = read_header_name(name, sizeof(name), s);
+      }
+    else
+      segs[nsegs] = (esc_seg) { .kind = ESC_VAR };
+    }
+  else if (*s == '{' && isalpha(s[1]))
+    {
+    s = read_name(name, sizeof(name), s + 1, US"_-");
+    if (*s++ != '}' || chop_match(name, item_table, nelem(item_table)) >= 0)
+      goto NOT_SIMPLE;
+    segs[nsegs] = (esc_seg) { .kind = ESC_VAR };
+    }
+  else if (isdigit(*s) || *s == '{' && isdigit(s[1]))
+    {
+    BOOL braced = *s == '{';
+    segs[nsegs] = (esc_seg) { .kind = ESC_NUM };
+    s = read_cnumber(&segs[nsegs].len, s + (braced ? 1 : 0));
+    if (braced && *s++ != '}') goto NOT_SIMPLE;
+    nsegs++;
+    continue;
+    }
+  else
+    goto NOT_SIMPLE;
+
+  /* A variable that is not one of the special forms handled by
+  find_variable() must be in the main table, else the full expander gives
+  the error. */
+
+  if (segs[nsegs].kind == ESC_VAR)
+    if (  (Ustrncmp(name, "acl_c", 5) == 0 || Ustrncmp(name, "acl_m", 5) == 0)
+	  && !isalpha(name[5])
+       || Ustrncmp(name, "r_", 2) == 0
+       || Ustrncmp(name, "auth", 4) == 0
+       || Ustrncmp(name, "regex", 5) == 0
+       )
+      segs[nsegs].vp = NULL;
+    else if (!(segs[nsegs].vp = find_var_ent(name)))
+      goto NOT_SIMPLE;
+
+  segs[nsegs].len = Ustrlen(name);
+  segs[nsegs].s = US (size_t)bufused;
+  memcpy(buf + bufused, name, segs[nsegs].len + 1);
+  bufused += segs[nsegs].len + 1;
+  nsegs++;
+  }
+
+e = store_malloc(sizeof(esc_entry) + nsegs * sizeof(esc_seg) + bufused
+		  + slen + 1);
+e->nsegs = nsegs;
+e->textonly = textonly;
+p = US (e->segs + nsegs);
+memcpy(p, buf, bufused);
+for (int i = 0; i < nsegs; i++)
+  {
+  e->segs[i] = segs[i];
+  if (segs[i].kind != ESC_NUM) e->segs[i].s = p + (size_t)segs[i].s;
+  }
+e->copy = p + bufused;
+goto DONE;
+
+NOT_SIMPLE:
+  e = store_malloc(sizeof(esc_entry) + slen + 1);
+  e->nsegs = -1;
+  e->copy = US (e + 1);
+
+DONE:
+  memcpy(e->copy, string, slen + 1);
+  e->key = string;
+  e->hits = 0;
+  return e;
+}
+
+
+/* Expand a string from its compiled form, if it has one.
+
+Arguments:
+  string	the string to be expanded
+  textonly_p	if not NULL, where to write whether only text was met
+
+Returns:	the expanded string, or NULL if the full expander must be used
+*/
+
+static uschar *
+esc_expand(const uschar * string, BOOL * textonly_p)
+{
+unsigned slot = ((uintptr_t)string >> 3) % ESC_SLOTS;
+esc_entry * e = esc_table[slot];
+rmark reset_point;
+gstring * g;
+
+if (is_tainted(string)) return NULL;
+
+if (!e || e->key != string || Ustrcmp(e->copy, string) != 0)
+  {
+  if (e && --e->hits >= 0) return NULL;
+  if (Ustrlen(string) > ESC_MAXLEN) return NULL;
+  if (e) store_free(e);
+  esc_table[slot] = e = esc_compile(string);
+  }
+else if (e->hits < 8) e->hits++;
+
+if (e->nsegs < 0) return NULL;
+
+f.expand_string_forcedfail = FALSE;
+expand_string_message = US"";
+
+reset_point = store_mark();
+g = string_get(Ustrlen(string) + 64);
+for (esc_seg * sg = e->segs; sg < e->segs + e->nsegs; sg++)
+  {
+  const uschar * value;
+  int newsize = 0;
+
+  switch (sg->kind)
+    {
+    case ESC_TEXT:
+      g = string_catn(g, sg->s, sg->len);
+      break;
+
+    case ESC_NUM:
+      if (sg->len <= expand_nmax)
+	g = string_catn(g, expand_nstring[sg->len], expand_nlength[sg->len]);
+      break;
+
+    case ESC_HEADER:
+      if ((value = find_header(US sg->s, &newsize, sg->hflags,
+			      sg->bheader ? NULL : headers_charset)))
+	g = string_cat(g, value);
+      else if (Ustrchr(sg->s, '}'))
+	malformed_header = TRUE;
+      break;
+
+    case ESC_VAR:
+      if (!(value = sg->vp
+	    ? var_entry_value(sg->vp, FALSE, FALSE, &newsize)
+	    : find_variable(US sg->s, FALSE, FALSE, &newsize)))
+	{			/* leave the error to the full expander */
+	store_reset(reset_point);
+	return NULL;
+	}
+      g = string_cat(g, value);
+      break;
+    }
+  }
+
+gstring_release_unused(g);
+if (textonly_p) *textonly_p = e->textonly;
+return string_from_gstring(g);
+}
+
+
+
 /* This is the external function call. Do a quick check for any expansion
 metacharacters, and if there are none, just return the input string.
 
@@ -8566,7 +8878,8 @@ if (Ustrpbrk(string, "$\\") != NULL)
   f.search_find_defer = FALSE;
   malformed_header = FALSE;
   store_pool = POOL_MAIN;
-    s = expand_string_internal(string, ESI_HONOR_DOLLAR, NULL, NULL, textonly_p);
+    if ((debug_selector & D_expand) || !(s = esc_expand(string, textonly_p)))
+      s = expand_string_internal(string, ESI_HONOR_DOLLAR, NULL, NULL, textonly_p);
   store_pool = old_pool;
   return s;
   }
@@ -8890,10 +9203,10 @@ for (var_entry * v = var_table; v < var_table + nelem(var_table); v++)
     assert_variable_notin(US v->name, *(USS v->value), &e);
 
 /* check dns and address trees */
-tree_walk(tree_dns_fails,     assert_variable_notin, &e);
-tree_walk(tree_duplicates,    assert_variable_notin, &e);
+hset_walk(&hset_dns_fails,    assert_variable_notin, &e);
+hset_walk(&hset_duplicates,   assert_variable_notin, &e);
 tree_walk(tree_nonrecipients, assert_variable_notin, &e);
-tree_walk(tree_unusable,      assert_variable_notin, &e);
+hset_walk(&hset_unusable,     assert_variable_notin, &e);
 
 if (e.var_name)
   log_write(0, LOG_MAIN|LOG_PANIC_DIE,
@@ -1428,6 +1428,365 @@ return TRUE;
 
 
 
+/*************************************************
+*          Cache of parsed filters               *
+*************************************************/
+
+/* With filter_cache set, the commands parsed from a filter are kept in the
+"filter" hints database, keyed by an MD5 of the text and the options that
+affect parsing. The record holds the text, which is compared on a hit, and
+then the commands and conditions in a simple serial form. This is used only
+by processes that can open the hints databases, that is, running as root or
+the Exim user. */
+
+typedef struct {
+  const uschar * p;
+  const uschar * end;
+  BOOL		 bad;
+} fc_reader;
+
+static void
+fc_put_int(gstring ** g, int i)
+{
+*g = string_catn(*g, US &i, sizeof(int));
+}
+
+static void
+fc_put_str(gstring ** g, const uschar * s)
+{
+if (!s)
+  fc_put_int(g, -1);
+else
+  {
+  int len = Ustrlen(s);
+  fc_put_int(g, len);
+  *g = string_catn(*g, s, len);
+  }
+}
+
+static void
+fc_put_cond(gstring ** g, const condition_block * c)
+{
+if (!c) { fc_put_int(g, -1); return; }
+fc_put_int(g, c->type);
+fc_put_int(g, c->testfor);
+switch (c->type)
+  {
+  case cond_and:
+  case cond_or:
+    fc_put_cond(g, c->left.c);
+    fc_put_cond(g, c->right.c);
+    break;
+
+  case cond_personal:
+    {
+    int n = 0;
+    for (const string_item * a = c->left.a; a; a = a->next) n++;
+    fc_put_int(g, n);
+    for (const string_item * a = c->left.a; a; a = a->next)
+      fc_put_str(g, a->text);
+    }
+    break;
+
+  case cond_foranyaddress:
+    fc_put_str(g, c->left.u);
+    fc_put_cond(g, c->right.c);
+    break;
+
+  case cond_delivered:
+  case cond_errormsg:
+  case cond_firsttime:
+  case cond_manualthaw:
+    break;
+
+  default:
+    fc_put_str(g, c->left.u);
+    fc_put_str(g, c->right.u);
+    break;
+  }
+}
+
+static void
+fc_put_cmds(gstring ** g, const filter_cmd * cmd)
+{
+for ( ; cmd; cmd = cmd->next)
+  {
+  fc_put_int(g, cmd->command);
+  fc_put_int(g, cmd->seen);
+  fc_put_int(g, cmd->noerror);
+  switch (cmd->command)
+    {
+    case if_command:
+      fc_put_cond(g, cmd->args[0].c);
+      fc_put_cmds(g, cmd->args[1].f);
+      fc_put_cmds(g, cmd->args[2].f);
+      break;
+
+    case headers_command:
+      fc_put_str(g, cmd->args[0].u);
+      fc_put_int(g, cmd->args[1].b);
+      break;
+
+    case logfile_command:
+    case save_command:
+      fc_put_str(g, cmd->args[0].u);
+      fc_put_int(g, cmd->args[1].i);
+      break;
+
+    case defer_command:
+    case fail_command:
+    case finish_command:
+    case freeze_command:
+      fc_put_str(g, cmd->args[0].u);
+      break;
+
+    case mail_command:
+    case vacation_command:
+      for (int i = 0; i < mailargs_total; i++)
+	fc_put_str(g, cmd->args[i].u);
+      break;
+
+    default:
+      fc_put_str(g, cmd->args[0].u);
+      fc_put_str(g, cmd->args[1].u);
+      break;
+    }
+  }
+fc_put_int(g, -1);
+}
+
+
+static int
+fc_get_int(fc_reader * r)
+{
+int i;
+if (r->bad || r->end - r->p < (int)sizeof(int)) { r->bad = TRUE; return -1; }
+memcpy(&i, r->p, sizeof(int));
+r->p += sizeof(int);
+return i;
+}
+
+static const uschar *
+fc_get_str(fc_reader * r)
+{
+int len = fc_get_int(r);
+const uschar * s;
+
+if (len < 0 || r->bad) return NULL;
+if (r->end - r->p < len) { r->bad = TRUE; return NULL; }
+s = string_copyn_taint(r->p, len, GET_UNTAINTED);
+r->p += len;
+return s;
+}
+
+static condition_block *
+fc_get_cond(fc_reader * r)
+{
+int type = fc_get_int(r);
+condition_block * c;
+
+if (type < 0 || type > cond_foranyaddress)
+  {
+  if (type != -1) r->bad = TRUE;
+  return NULL;
+  }
+c = store_get(sizeof(condition_block), GET_UNTAINTED);
+c->parent = NULL;
+c->type = type;
+c->testfor = fc_get_int(r);
+c->left.u = c->right.u = NULL;
+switch (type)
+  {
+  case cond_and:
+  case cond_or:
+    c->left.c = fc_get_cond(r);
+    c->right.c = fc_get_cond(r);
+    break;
+
+  case cond_personal:
+    {
+    string_item ** ap = &c->left.a;
+    for (int n = fc_get_int(r); n > 0 && !r->bad; n--)
+      {
+      string_item * a = store_get(sizeof(string_item), GET_UNTAINTED);
+      a->text = US fc_get_str(r);
+      a->next = NULL;
+      *ap = a;
+      ap = &a->next;
+      }
+    }
+    break;
+
+  case cond_foranyaddress:
+    c->left.u = fc_get_str(r);
+    c->right.c = fc_get_cond(r);
+    break;
+
+  case cond_delivered:
+  case cond_errormsg:
+  case cond_firsttime:
+  case cond_manualthaw:
+    break;
+
+  default:
+    c->left.u = fc_get_str(r);
+    c->right.u = fc_get_str(r);
+    break;
+  }
+return c;
+}
+
+static filter_cmd *
+fc_get_cmds(fc_reader * r)
+{
+filter_cmd * list = NULL, ** last = &list;
+int command;
+
+while ((command = fc_get_int(r)) >= 0 && command < command_list_count)
+  {
+  int nargs = command == if_command ? 4
+    : command == mail_command || command == vacation_command ? mailargs_total
+    : 2;
+  filter_cmd * cmd = store_get(sizeof(filter_cmd)
+			+ (nargs - 1) * sizeof(union argtypes), GET_UNTAINTED);
+
+  cmd->next = NULL;
+  cmd->command = command;
+  cmd->seen = fc_get_int(r);
+  cmd->noerror = fc_get_int(r);
+  for (int i = 0; i < nargs; i++) cmd->args[i].u = NULL;
+
+  switch (command)
+    {
+    case if_command:
+      cmd->args[0].c = fc_get_cond(r);
+      cmd->args[1].f = fc_get_cmds(r);
+      cmd->args[2].f = fc_get_cmds(r);
+      break;
+
+    case headers_command:
+      cmd->args[0].u = fc_get_str(r);
+      cmd->args[1].b = fc_get_int(r);
+      break;
+
+    case logfile_command:
+    case save_command:
+      cmd->args[0].u = fc_get_str(r);
+      cmd->args[1].i = fc_get_int(r);
+      break;
+
+    case defer_command:
+    case fail_command:
+    case finish_command:
+    case freeze_command:
+      cmd->args[0].u = fc_get_str(r);
+      break;
+
+    case mail_command:
+    case vacation_command:
+      for (int i = 0; i < mailargs_total; i++)
+	cmd->args[i].u = fc_get_str(r);
+      break;
+
+    default:
+      cmd->args[0].u = fc_get_str(r);
+      cmd->args[1].u = fc_get_str(r);
+      break;
+    }
+  if (r->bad) return NULL;
+  *last = cmd;
+  last = &cmd->next;
+  }
+if (command != -1) r->bad = TRUE;
+return list;
+}
+
+
+/* Build the key for a filter, or return NULL if the cache is not to be used */
+
+static const uschar *
+filter_cache_key(const uschar * filter, int options)
+{
+md5 base;
+uschar digest[16];
+gstring * g;
+
+if (  !filter_cache || filter_test != FTEST_NONE
+   || (geteuid() != root_uid && geteuid() != exim_uid))
+  return NULL;
+
+md5_start(&base);
+md5_end(&base, filter, Ustrlen(filter), digest);
+g = string_fmt_append(NULL, "%c%08x:", f.system_filtering ? 's' : 'u', options);
+for (int i = 0; i < 16; i++) g = string_fmt_append(g, "%02x", digest[i]);
+return string_from_gstring(g);
+}
+
+
+/* Look for the parsed form of a filter.
+
+Arguments:
+  key		from filter_cache_key()
+  filter	the filter text
+
+Returns:	the commands, or NULL if not found
+*/
+
+static filter_cmd *
+filter_cache_read(const uschar * key, const uschar * filter)
+{
+open_db dbblock, * dbm;
+dbdata_filter * df;
+filter_cmd * commands = NULL;
+int len, tlen = Ustrlen(filter);
+
+if (!(dbm = dbfn_open(US"filter", O_RDONLY, &dbblock, FALSE, TRUE)))
+  return NULL;
+
+if (  (df = dbfn_read_with_length(dbm, key, &len))
+   && df->text_len == tlen
+   && len >= (int)sizeof(dbdata_filter) + tlen
+   && memcmp(df->data, filter, tlen) == 0)
+  {
+  fc_reader r = { .p = df->data + tlen, .end = US df + len, .bad = FALSE };
+
+  commands = fc_get_cmds(&r);
+  if (r.bad) commands = NULL;
+  }
+dbfn_close(dbm);
+
+DEBUG(D_filter) debug_printf("Filter: cache %s for %s\n",
+  commands ? "hit" : "miss", key);
+return commands;
+}
+
+
+/* Save the parsed form of a filter */
+
+static void
+filter_cache_write(const uschar * key, const uschar * filter,
+  const filter_cmd * commands)
+{
+open_db dbblock, * dbm;
+int tlen = Ustrlen(filter);
+gstring * g = string_get(sizeof(dbdata_filter) + tlen + 256);
+dbdata_filter * df;
+
+memset(g->s, 0, sizeof(dbdata_filter));
+g->ptr = offsetof(dbdata_filter, data);
+g = string_catn(g, filter, tlen);
+fc_put_cmds(&g, commands);
+df = (dbdata_filter *) g->s;
+df->text_len = tlen;
+
+if ((dbm = dbfn_open(US"filter", O_RDWR, &dbblock, FALSE, TRUE)))
+  {
+  dbfn_write(dbm, key, df, g->ptr);
+  dbfn_close(dbm);
+  }
+}
+
+
 /*************************************************
 *             Test a condition                   *
 *************************************************/
@@ -2524,6 +2883,7 @@ const uschar *ptr = filter;
 const uschar *save_headers_charset = headers_charset;
 filter_cmd *commands = NULL;
 filter_cmd **lastcmdptr = &commands;
+const uschar *cache_key = filter_cache_key(filter, options);
 
 DEBUG(D_route) debug_printf("Filter: start of processing\n");
 acl_level++;
@@ -2557,8 +2917,13 @@ delivered or not, unless something went wrong. */
 seen_force = FALSE;
 ptr = nextsigchar(ptr, TRUE);
 
-if (read_command_list(&ptr, &lastcmdptr, FALSE))
+if (cache_key && (commands = filter_cache_read(cache_key, filter)))
   yield = interpret_commands(commands, generated);
+else if (read_command_list(&ptr, &lastcmdptr, FALSE))
+  {
+  if (cache_key && commands) filter_cache_write(cache_key, filter, commands);
+  yield = interpret_commands(commands, generated);
+  }
 
 if (filter_test != FTEST_NONE || (debug_selector & D_filter) != 0)
   {
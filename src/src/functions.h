@@ -59,9 +59,11 @@ extern BOOL    tls_client_adjunct_start(host_item *, client_conn_ctx *,
 extern void    tls_client_creds_reload(BOOL);
 
 extern void    tls_close(void *, int);
+extern BOOL    tls_can_sendfile(void *);
 extern BOOL    tls_could_getc(void);
 extern void    tls_daemon_init(void);
 extern int     tls_daemon_tick(void);
+extern int     tls_daemon_timeout(void);
 extern BOOL    tls_dropprivs_validate_require_cipher(BOOL);
 extern BOOL    tls_export_cert(uschar *, size_t, void *);
 extern int     tls_feof(void);
@@ -74,10 +76,12 @@ extern void    tls_get_cache(unsigned);
 extern BOOL    tls_hasc(void);
 extern BOOL    tls_import_cert(const uschar *, void **);
 extern BOOL    tls_is_name_for_cert(const uschar *, void *);
+extern const uschar *tls_peekbuf(unsigned *);
 # ifdef USE_OPENSSL
 extern BOOL    tls_openssl_options_parse(uschar *, long *);
 # endif
 extern int     tls_read(void *, uschar *, size_t);
+extern ssize_t tls_sendfile(void *, int, off_t *, size_t);
 extern int     tls_server_start(uschar **);
 extern void    tls_shutdown_wr(void *);
 extern BOOL    tls_smtp_buffered(void);
@@ -101,7 +105,14 @@ extern int     tlsa_lookup(const host_item *, dns_answer *, BOOL);
 
 extern acl_block *acl_read(uschar *(*)(void), uschar **);
 extern int     acl_check(int, const uschar *, uschar *, uschar **, uschar **);
+extern void    acl_ratelimit_at_daemon(int, const uschar *, int,
+			const struct sockaddr *, socklen_t);
+extern void    acl_ratelimit_close(void);
+extern void    acl_ratelimit_tick(void);
+extern int     acl_ratelimit_timeout(void);
 extern uschar *acl_current_verb(void);
+extern void    acl_prefetch_dnslists(void);
+extern void    acl_prewarm_regex(void);
 extern int     acl_eval(int, uschar *, uschar **, uschar **);
 extern uschar *acl_standalone_setvar(const uschar *);
 
@@ -122,6 +133,7 @@ extern uschar * fn_arc_domains(void);
 
 extern void    assert_no_variables(void *, int, const char *, int);
 extern int     auth_call_pam(const uschar *, uschar **);
+extern void    auth_cache_init(void);
 extern int     auth_call_pwcheck(uschar *, uschar **);
 extern int     auth_call_radius(const uschar *, uschar **);
 extern int     auth_call_saslauthd(const uschar *, const uschar *,
@@ -163,10 +175,17 @@ extern uschar *bdat_getbuf(unsigned *);
 extern BOOL    bdat_hasc(void);
 extern int     bdat_ungetc(int);
 extern void    bdat_flush_data(void);
+#ifdef EXIM_HAVE_SPLICE
+extern int     bdat_splice(int, unsigned);
+#endif
+#ifdef SUPPORT_BENCHMARKS
+extern int     bench_run(int, const uschar **);
+#endif
 
 extern void    bits_clear(unsigned int *, size_t, int *);
 extern void    bits_set(unsigned int *, size_t, int *);
 
+extern void    callout_held_close(const uschar *);
 extern void    cancel_cutthrough_connection(BOOL, const uschar *);
 extern gstring *cat_file(FILE *, gstring *, uschar *);
 extern gstring *cat_file_tls(void *, gstring *, uschar *);
@@ -188,6 +207,8 @@ extern BOOL    cutthrough_headers_send(void);
 extern BOOL    cutthrough_predata(void);
 extern void    release_cutthrough_connection(const uschar *);
 
+extern void    daemon_blocklist_add(const uschar *, int);
+extern int     daemon_getloadavg(void);
 extern void    daemon_go(void);
 #ifndef COMPILE_UTILITY
 extern ssize_t daemon_client_sockname(struct sockaddr_un *, uschar **);
@@ -215,6 +236,8 @@ extern void    debug_trigger_fire(void);
 extern void    decode_bits(unsigned int *, size_t, int *,
 	           const uschar *, bit_table *, int, uschar *, int);
 extern void    delete_pid_file(void);
+extern void    deliver_continue_in_process(const uschar *, const uschar *,
+		 const uschar *, const uschar *, int) NORETURN;
 extern void    deliver_local(address_item *, BOOL);
 extern address_item *deliver_make_addr(const uschar *, BOOL);
 extern void    delivery_log(int, address_item *, int, uschar *);
@@ -235,6 +258,8 @@ extern void    dkim_exim_sign_init(void);
 extern BOOL    dkim_transport_write_message(transport_ctx *,
 		  struct ob_dkim *, const uschar ** errstr);
 #endif
+extern void    dnsbl_prefetch_early(const uschar *);
+extern void    dnsbl_zones_check(void);
 extern dns_address *dns_address_from_rr(dns_answer *, dns_record *);
 extern int     dns_basic_lookup(dns_answer *, const uschar *, int);
 extern uschar *dns_build_reverse(const uschar *);
@@ -244,6 +269,10 @@ extern BOOL    dns_is_aa(const dns_answer *);
 extern BOOL    dns_is_secure(const dns_answer *);
 extern int     dns_lookup(dns_answer *, const uschar *, int, const uschar **);
 extern void    dns_pattern_init(void);
+extern void    dns_prefetch(const uschar **, int, int);
+extern void    dns_prefetch_clear(void);
+extern void    dns_prefetch_start(const uschar **, int, int);
+extern void    dns_prefetch_types(const uschar **, int, const int *, int);
 extern int     dns_special_lookup(dns_answer *, const uschar *, int, const uschar **);
 extern dns_record *dns_next_rr(const dns_answer *, dns_scan *, int);
 extern uschar *dns_text_type(int);
@@ -251,7 +280,9 @@ extern void    dscp_list_to_stream(FILE *);
 extern BOOL    dscp_lookup(const uschar *, int, int *, int *, int *);
 
 extern void    enq_end(uschar *);
+extern void    enq_limit_adjust(const uschar *, unsigned, int);
 extern BOOL    enq_start(uschar *, unsigned);
+extern BOOL    enq_start_limited(uschar *, const uschar *, unsigned);
 #ifndef DISABLE_EVENT
 extern uschar *event_raise(uschar *, const uschar *, uschar *, int *);
 extern void    msg_event_raise(const uschar *, const address_item *);
@@ -293,6 +324,8 @@ extern void    force_fd(int, int);
 extern void    header_add(int, const char *, ...);
 extern header_line *header_add_at_position_internal(BOOL, uschar *, BOOL, int, const char *, ...);
 extern int     header_checkname(header_line *, BOOL);
+extern header_line **header_index_find(const uschar *, int, int *);
+extern void    header_index_reset(void);
 extern BOOL    header_match(uschar *, BOOL, BOOL, string_item *, int, ...);
 extern int     host_address_extract_port(uschar *);
 extern uschar *host_and_ident(BOOL);
@@ -314,6 +347,10 @@ extern int     host_name_lookup(void);
 extern int     host_nmtoa(int, int *, int, uschar *, int);
 extern uschar *host_ntoa(int, const void *, uschar *, int *);
 extern int     host_scan_for_local_hosts(host_item *, host_item **, BOOL *);
+extern void    hset_clear(hash_set *);
+extern BOOL    hset_insert(hash_set *, tree_node *);
+extern tree_node *hset_search(const hash_set *, const uschar *);
+extern void    hset_walk(const hash_set *, void (*)(uschar*, uschar*, void*), void *);
 
 extern uschar *imap_utf7_encode(uschar *, const uschar *,
 				 uschar, uschar *, uschar **);
@@ -322,6 +359,7 @@ extern void    invert_address(uschar *, uschar *);
 extern int     ip_addr(void *, int, const uschar *, int);
 extern int     ip_bind(int, int, uschar *, int);
 extern int     ip_connect(int, int, const uschar *, int, int, const blob *);
+extern int     ip_connect_start(int, int, const uschar *, int, BOOL);
 extern int     ip_connectedsocket(int, const uschar *, int, int,
                  int, host_item *, uschar **, const blob *);
 extern int     ip_get_address_family(int);
@@ -337,7 +375,26 @@ extern int     ipv6_nmtoa(int *, uschar *);
 
 extern const uschar *local_part_quote(const uschar *);
 extern int     log_open_as_exim(const uschar * const);
+extern void    log_at_daemon(const uschar *, int);
 extern void    log_close_all(void);
+extern void    log_daemon_flush(BOOL);
+extern gstring *log_json_bool(gstring *, const char *, BOOL);
+extern gstring *log_json_int(gstring *, const char *, long);
+extern gstring *log_json_quote(gstring *, const uschar *);
+extern gstring *log_json_start(const uschar *);
+extern gstring *log_json_str(gstring *, const char *, const uschar *);
+extern gstring *log_json_time(gstring *, const char *, const struct timeval *);
+extern void    log_json_write(gstring *);
+extern int     log_daemon_timeout(void);
+extern void    lookup_module_load(int);
+extern void    lookup_proxy_close(BOOL);
+extern BOOL    lookup_proxy_find(int, const uschar *, const uschar *,
+		  const uschar *, uschar **, uschar **, uint *, int *);
+extern BOOL    lookup_proxy_reaped(pid_t);
+extern void    lookup_proxy_start(void);
+struct pollfd;
+extern void    lookup_proxy_tick(const struct pollfd *, int);
+extern BOOL    lookup_proxy_wanted(int);
 
 extern macro_item * macro_create(const uschar *, const uschar *, BOOL);
 extern BOOL    macro_read_assignment(uschar *);
@@ -365,17 +422,36 @@ extern void    message_tidyup(void);
 extern void    md5_end(md5 *, const uschar *, int, uschar *);
 extern void    md5_mid(md5 *, const uschar *);
 extern void    md5_start(md5 *);
+extern void    metrics_acl(int, int);
+extern void    metrics_acl_time(int, const struct timeval *);
+extern void    metrics_connection(BOOL);
+extern void    metrics_delivery(const uschar *, int);
+extern void    metrics_dnslist_time(int, const uschar *,
+                 const struct timeval *);
+extern void    metrics_init(void);
+extern void    metrics_phase(int, const struct timeval *);
+extern gstring *metrics_phases_log(gstring *);
+extern void    metrics_phases_reset(BOOL);
+extern BOOL    metrics_print(void);
+extern void    metrics_store(void);
+extern void    metrics_time(int, int, const struct timeval *);
 extern void    millisleep(int);
 #ifdef WITH_CONTENT_SCAN
 struct mime_boundary_context;
+struct mime_sink;
 extern int     mime_acl_check(uschar *acl, FILE *f,
                  struct mime_boundary_context *, uschar **, uschar **);
 extern int     mime_decode(const uschar **);
-extern ssize_t mime_decode_base64(FILE *, FILE *, uschar *);
+extern ssize_t mime_decode_base64(FILE *, struct mime_sink *, uschar *);
+extern uschar *mime_decoded_file(void);
+extern uschar *mime_decoded_memory(int *);
 extern int     mime_regex(const uschar **, BOOL);
 extern void    mime_set_anomaly(int);
+extern BOOL    mime_write(struct mime_sink *, const uschar *, size_t);
 #endif
 extern uschar *moan_check_errorcopy(const uschar *);
+extern void    moan_digest_flush(void);
+extern BOOL    moan_digest_hold(const uschar *, const gstring *);
 extern BOOL    moan_skipped_syntax_errors(uschar *, error_block *, uschar *,
                  BOOL, uschar *);
 extern void    moan_smtp_batch(uschar *, const char *, ...) PRINTF_FUNCTION(2,3);
@@ -409,14 +485,27 @@ extern void	proxy_protocol_setup(void);
 #endif
 
 extern BOOL    queue_action(const uschar *, int, const uschar **, int, int);
+extern BOOL    queue_action_list(const uschar **, int, int);
 extern void    queue_check_only(void);
 extern unsigned queue_count(void);
 extern unsigned queue_count_cached(void);
+extern queue_filename *queue_get_spool_list(int, uschar *, int *, BOOL, unsigned *);
+extern void    queue_index_at_daemon(const uschar *);
+extern BOOL    queue_index_count(unsigned *);
+extern BOOL    queue_index_list(BOOL, BOOL, queue_filename **);
+extern void    queue_index_notify(uschar, const uschar *, const uschar *, uschar);
+extern BOOL    queue_index_print_stats(void);
+extern BOOL    queue_index_reaped(pid_t, int);
+extern unsigned queue_index_queue_count(void);
+extern void    queue_index_refresh(const uschar *);
+extern void    queue_index_slice(int, const uschar *, const struct sockaddr *, socklen_t);
+extern void    queue_index_stats_at_daemon(int, const uschar *, const struct sockaddr *, socklen_t);
 extern void    queue_list(int, const uschar **, int);
 #ifndef DISABLE_QUEUE_RAMP
 extern void    queue_notify_daemon(const uschar * hostname);
 #endif
 extern void    queue_run(qrunner *, const uschar *, const uschar *, BOOL);
+extern queue_filename *queue_sort_list(queue_filename *);
 
 extern int     random_number(int);
 extern const uschar *rc_to_string(int);
@@ -437,10 +526,14 @@ extern int     readconf_readtime(const uschar *, int, BOOL);
 extern void    readconf_rest(void);
 extern uschar *readconf_retry_error(const uschar *, const uschar *, int *, int *);
 extern void    readconf_save_config(const uschar *);
+extern void    readconf_walk_strings(void (*)(const uschar *));
 extern void    read_message_body(BOOL);
 extern void    receive_bomb_out(uschar *, uschar *) NORETURN;
 extern BOOL    receive_check_fs(int);
 extern BOOL    receive_check_set_sender(const uschar *);
+extern void    receive_id_lead_wait(void);
+extern void    receive_msglog_write(void);
+extern uschar *receive_msglog_take(const uschar *);
 extern BOOL    receive_msg(BOOL);
 extern int_eximarith_t receive_statvfs(BOOL, int *);
 extern void    receive_swallow_smtp(void);
@@ -449,6 +542,9 @@ extern int     regex(const uschar **, BOOL);
 extern void    regex_vars_clear(void);
 #endif
 extern void    regex_at_daemon(const uschar *);
+extern void    regex_prewarm(void);
+extern void    regex_prewarm_list(const uschar *);
+extern void    regex_prewarm_string(const uschar *);
 extern BOOL    regex_match(const pcre2_code *, const uschar *, int, uschar **);
 extern BOOL    regex_match_and_setup(const pcre2_code *, const uschar *, int, int);
 extern const pcre2_code *regex_compile(const uschar *, mcs_flags, uschar **,
@@ -458,6 +554,7 @@ extern void    retry_add_item(address_item *, uschar *, int);
 extern BOOL    retry_check_address(const uschar *, host_item *, uschar *, BOOL,
                  uschar **, uschar **);
 extern retry_config *retry_find_config(const uschar *, const uschar *, int, int);
+extern time_t  retry_next_attempt(address_item *);
 extern BOOL    retry_ultimate_address_timeout(uschar *, const uschar *,
                  dbdata_retry *, time_t);
 extern void    retry_update(address_item **, address_item **, address_item **);
@@ -487,12 +584,26 @@ extern void    route_tidyup(void);
 extern uschar *router_current_name(void);
 
 extern uschar *search_args(int, uschar *, uschar *, uschar **, const uschar *);
+extern void    search_cache_seed(const uschar *, const uschar *);
 extern uschar *search_find(void *, const uschar *, uschar *, int,
 		 const uschar *, int, int, int *, const uschar *);
+extern int     search_find_driver(void *, const uschar *, uschar *, uschar **,
+		  uschar **, uint *, const uschar *);
 extern int     search_findtype(const uschar *, int);
 extern int     search_findtype_partial(const uschar *, int *, const uschar **, int *,
                  int *, const uschar **);
 extern void   *search_open(const uschar *, int, int, uid_t *, gid_t *);
+extern void    search_shared_at_daemon(int, const uschar *, int,
+		  const struct sockaddr *, socklen_t);
+extern ssize_t search_shared_exchange(const gstring *, uschar *);
+extern void    search_shared_flush_raw(const uschar *, int);
+extern BOOL    search_shared_get_raw(const uschar *, int, uschar **, int *);
+extern void    search_shared_put_raw(const uschar *, int, const uschar *, int,
+		  unsigned);
+extern void    search_shared_restore(const uschar *);
+extern BOOL    search_shared_save(const uschar *);
+extern BOOL    search_shared_stats(void);
+extern BOOL    search_shared_usable(void);
 extern void    search_tidyup(void);
 extern uschar *sender_helo_verified_boolstr(void);
 extern void    set_process_info(const char *, ...) PRINTF_FUNCTION(1,2);
@@ -527,10 +638,20 @@ extern int     smtp_handle_acl_fail(int, int, uschar *, uschar *);
 extern void    smtp_log_no_mail(void);
 extern void    smtp_message_code(uschar **, int *, uschar **, uschar **, BOOL);
 extern void    smtp_proxy_tls(void *, uschar *, size_t, int *, int, const uschar *) NORETURN;
+extern host_item *smtp_race_connect(host_item *, int, transport_instance *,
+		 address_item *, uschar *);
+extern void    smtp_race_discard(void);
 extern BOOL    smtp_read_response(void *, uschar *, int, int, int);
 extern void   *smtp_reset(void *);
 extern void    smtp_respond(uschar *, int, BOOL, uschar *);
 extern void    smtp_notquit_exit(uschar *, uschar *, uschar *, ...);
+extern BOOL    smtp_pool_at_daemon(int, const uschar *, int, int,
+		 const struct sockaddr *, socklen_t);
+extern int     smtp_pool_borrow(const uschar *, uschar **, int *);
+extern void    smtp_pool_close(void);
+extern BOOL    smtp_pool_park(int, const uschar *, const void *, int, int);
+extern void    smtp_pool_tick(void);
+extern int     smtp_pool_timeout(void);
 extern void    smtp_port_for_connect(host_item *, int);
 extern void    smtp_send_prohibition_message(int, uschar *);
 extern int     smtp_setup_msg(void);
@@ -542,13 +663,39 @@ extern int     smtp_write_command(void *, int, const char *, ...) PRINTF_FUNCTIO
 #ifdef WITH_CONTENT_SCAN
 extern int     spam(const uschar **);
 extern FILE   *spool_mbox(unsigned long *, const uschar *, uschar **);
+extern const uschar *spool_mbox_body_hash(void);
+extern const uschar *spool_mbox_hash(void);
+extern const uschar *spool_mbox_memory(unsigned long *);
+extern dbdata_scan_verdict *scan_verdict_get(const uschar *, int *);
+extern void    scan_verdict_put(const uschar *, dbdata_scan_verdict *, int, int);
 #endif
 extern void    spool_clear_header_globals(void);
+extern int     spool_dedup_datafile(const uschar *, FILE **, uschar **);
 extern BOOL    spool_move_message(const uschar *, const uschar *, const uschar *, const uschar *);
+extern BOOL    spool_open_body(void);
 extern int     spool_open_datafile(const uschar *);
+extern void    spool_handoff_set(const uschar *, const gstring *, const struct stat *);
 extern int     spool_open_temp(uschar *);
 extern int     spool_read_header(uschar *, BOOL, BOOL);
 extern uschar *spool_sender_from_msgid(const uschar *);
+#ifdef EXIM_HAVE_SYNCFS
+extern void    spool_sync_at_daemon(const struct sockaddr *, socklen_t);
+#endif
+extern BOOL    spool_sync_deferred(void);
+#ifdef EXIM_HAVE_SYNCFS
+extern void    spool_sync_flush(int);
+#endif
+extern BOOL    spool_sync_received(const uschar *, int, uschar **);
+#ifdef EXIM_HAVE_SYNCFS
+extern int     spool_sync_timeout(void);
+#endif
+extern void    spool_view_close(spool_view *);
+extern BOOL    spool_view_header_size(spool_view *, int *);
+extern BOOL    spool_view_nonrecipients(spool_view *);
+extern int     spool_view_open(spool_view *, const uschar *, BOOL);
+extern const uschar *spool_view_option(const spool_view *, const uschar *);
+extern const uschar *spool_view_recipient(spool_view *, const uschar **, int *);
+extern int     spool_view_recipients(spool_view *);
 extern int     spool_write_header(const uschar *, int, uschar **);
 extern int     stdin_getc(unsigned);
 extern int     stdin_feof(void);
@@ -631,6 +778,9 @@ extern uschar *transport_current_name(void);
 extern void    transport_do_pass_socket(const uschar *, const uschar *,
 		 const uschar *, uschar *, int);
 extern void    transport_init(void);
+#ifndef DISABLE_QUEUE_RAMP
+extern void    transport_kick_waiting(const uschar *, const uschar *, int);
+#endif
 extern BOOL    transport_pass_socket(const uschar *, const uschar *, const uschar *, uschar *, int
 #ifdef EXPERIMENTAL_ESMTP_LIMITS
 			, unsigned, unsigned, unsigned
@@ -647,12 +797,17 @@ extern BOOL    transport_headers_send(transport_ctx *,
                  BOOL (*)(transport_ctx *, const uschar *, int));
 extern gstring * transport_show_supported(gstring *);
 extern BOOL    transport_write_message(transport_ctx *, int);
+extern void    trace_ring_dump(const char *);
+extern void    trace_ring_init(void);
 extern void    tree_add_duplicate(const uschar *, address_item *);
 extern void    tree_add_nonrecipient(const uschar *);
 extern void    tree_add_unusable(const host_item *);
+extern void    tree_clear_nonrecipients(void);
 extern void    tree_dup(tree_node **, tree_node *);
+extern void    tree_index_nonrecipients(void);
 extern int     tree_insertnode(tree_node **, tree_node *);
 extern tree_node *tree_search(tree_node *, const uschar *);
+extern tree_node *tree_search_nonrecipient(const uschar *);
 extern void    tree_write(tree_node *, FILE *);
 extern void    tree_walk(tree_node *, void (*)(uschar*, uschar*, void*), void *);
 
@@ -685,6 +840,9 @@ extern void    verify_quota(uschar *);
 extern int     verify_quota_call(const uschar *, int, int, uschar **);
 extern BOOL    verify_sender(int *, uschar **);
 extern BOOL    verify_sender_preliminary(int *, uschar **);
+extern BOOL    verify_session_cache_get(address_item *, int, BOOL *, int *);
+extern void    verify_session_cache_put(const uschar *, int,
+		 const address_item *, BOOL, int);
 extern void    version_init(void);
 
 extern BOOL    write_chunk(transport_ctx *, const uschar *, int);
@@ -726,6 +884,27 @@ return is_incompatible_fn(old, new);
 #endif
 }
 
+/******************************************************************************/
+/* Record an event in the trace ring, if there is one.  This is meant for hot
+paths: a clock read and a few stores, with no formatting. */
+
+#if !defined(COMPILE_UTILITY) && !defined(MACRO_PREDEF) && !defined(EM_VERSION_C)
+static inline void
+trace_event(unsigned event, int a, int b, int c)
+{
+if (trace_ring)
+  {
+  trace_rec * r = trace_ring + (trace_ring_next++ & trace_ring_mask);
+  struct timespec ts;
+
+  (void) clock_gettime(CLOCK_REALTIME, &ts);
+  r->ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  r->event = event;
+  r->arg[0] = a; r->arg[1] = b; r->arg[2] = c;
+  }
+}
+#endif
+
 /******************************************************************************/
 /* String functions */
 static inline uschar * __Ustrcat(uschar * dst, const uschar * src, const char * func, int line)
@@ -971,6 +1150,19 @@ string_get_trc(unsigned size, const char * func, unsigned line)
 return string_get_tainted_trc(size, GET_UNTAINTED, func, line);
 }
 
+/* Set up a growable-string in a caller's buffer, usually an auto variable.
+It moves to store, as usual, if it outgrows the buffer or tainted data is
+added.  Get the result with string_from_gstring_buf(). */
+
+static inline gstring *
+gstring_in_buf(gstring * g, uschar * buf, int size)
+{
+g->size = size;
+g->ptr = 0;
+g->s = buf;
+return g;
+}
+
 /* NUL-terminate the C string in the growable-string, and return it. */
 
 static inline uschar *
@@ -1043,6 +1235,17 @@ gstring_release_unused_trc(gstring * g, const char * file, unsigned line)
 if (g) store_release_above_3(g->s + (g->size = g->ptr + 1), file, line);
 }
 
+/* Return the C string from a growable-string set up by gstring_in_buf(), in
+store of the exact size; if the string is still in the buffer it is copied. */
+
+static inline uschar *
+string_from_gstring_buf(gstring * g, const uschar * buf)
+{
+if (g->s == buf) return string_copyn(buf, g->ptr);
+gstring_release_unused(g);
+return string_from_gstring(g);
+}
+
 
 /* sprintf-append to a growable-string */
 
@@ -1086,6 +1289,28 @@ return string_catn(dest, item->s, item->ptr);
 }
 
 
+/******************************************************************************/
+/* With spool_shards set, each sub-directory of the split spool, for every
+queue and purpose, is under the shard root picked by its character rather than
+under the spool directory. The directory for the character of a message id's
+last time digit changes every second, so new messages cycle over the roots. */
+
+static inline int
+spool_shard(int subdirchar)
+{
+int v = isdigit(subdirchar) ? subdirchar - '0'
+  : isupper(subdirchar) ? subdirchar - 'A' + 10 : subdirchar - 'a' + 36;
+return v % spool_shard_count;
+}
+
+static inline const uschar *
+spool_root(const uschar * subdir)
+{
+return spool_shard_count > 0 && *subdir
+  ? spool_shard_roots[spool_shard(*subdir)] : spool_directory;
+}
+
+
 # ifndef COMPILE_UTILITY
 /******************************************************************************/
 /* Use store_malloc for DNSA structs, and explicit frees. Using the same pool
@@ -1139,7 +1364,7 @@ static inline uschar *
 spool_dname(const uschar * purpose, uschar * subdir)
 {
 return string_sprintf("%s/%s/%s/%s",
-	spool_directory, queue_name, purpose, subdir);
+	spool_root(subdir), queue_name, purpose, subdir);
 }
 # endif
 
@@ -1163,7 +1388,7 @@ spool_q_fname(const uschar * purpose, const uschar * q,
 	const uschar * subdir, const uschar * fname, const uschar * suffix)
 {
 return string_sprintf("%s/%s/%s/%s/%s%s",
-	spool_directory, q, purpose, subdir, fname, suffix);
+	spool_root(subdir), q, purpose, subdir, fname, suffix);
 }
 
 static inline uschar *
@@ -1213,6 +1438,17 @@ if (is_old_message_id(id)) return SPOOL_DATA_START_OFFSET_OLD;
 return SPOOL_DATA_START_OFFSET;
 }
 
+/* Lock the first line of a message's data file (containing the message id),
+which is the traditional lock on a message. */
+
+static inline BOOL
+spool_lock_datafile(int fd, const uschar * id)
+{
+flock_t lock_data = {.l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = 0,
+		     .l_len = spool_data_start_offset(id)};
+return fcntl(fd, F_SETLK, &lock_data) == 0;
+}
+
 /******************************************************************************/
 /* Time calculations */
 
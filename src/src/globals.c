@@ -29,6 +29,8 @@ optionlist optionlist_auths[] = {
                  OPT_OFF(auth_instance, advertise_condition)},
   { "server_condition", opt_stringptr | opt_public,
                  OPT_OFF(auth_instance, server_condition) },
+  { "server_condition_cache", opt_time | opt_public,
+                 OPT_OFF(auth_instance, server_condition_cache) },
   { "server_debug_print", opt_stringptr | opt_public,
                  OPT_OFF(auth_instance, server_debug_string) },
   { "server_mail_auth_condition", opt_stringptr | opt_public,
@@ -49,6 +51,7 @@ duplicate them here... */
 
 #ifdef EXIM_PERL
 uschar *opt_perl_startup       = NULL;
+BOOL    opt_perl_at_daemon_start = FALSE;
 BOOL    opt_perl_at_start      = FALSE;
 BOOL    opt_perl_started       = FALSE;
 BOOL    opt_perl_taintmode     = FALSE;
@@ -122,6 +125,7 @@ uschar *dsn_advertise_hosts    = NULL;
 BOOL    gnutls_compat_mode     = FALSE;
 BOOL    gnutls_allow_auto_pkcs11 = FALSE;
 uschar *hosts_require_alpn     = NULL;
+BOOL    openssl_async          = FALSE;
 uschar *openssl_options        = NULL;
 const pcre2_code *regex_STARTTLS     = NULL;
 uschar *tls_advertise_hosts    = US"*";
@@ -136,13 +140,17 @@ uschar *tls_dhparam            = NULL;
 uschar *tls_eccurve            = US"auto";
 # ifndef DISABLE_OCSP
 uschar *tls_ocsp_file          = NULL;
+int     tls_ocsp_refresh       = 0;
 # endif
 uschar *tls_privatekey         = NULL;
 BOOL    tls_remember_esmtp     = FALSE;
 uschar *tls_require_ciphers    = NULL;
 # ifndef DISABLE_TLS_RESUME
 uschar *tls_resumption_hosts   = NULL;
+uschar *tls_resumption_secret  = NULL;
+int     tls_resumption_shared  = 0;
 # endif
+uschar *tls_sni_preload        = NULL;
 uschar *tls_try_verify_hosts   = NULL;
 uschar *tls_verify_certificates= US"system";
 uschar *tls_verify_hosts       = NULL;
@@ -317,6 +325,7 @@ struct global_flags f =
 	.smtp_in_pipelining_used = FALSE,
 	.smtp_in_quit		= FALSE,
 	.spool_file_wireformat  = FALSE,
+	.spool_header_only      = FALSE,
 	.submission_mode        = FALSE,
 	.suppress_local_fixups  = FALSE,
 	.suppress_local_fixups_default = FALSE,
@@ -368,22 +377,30 @@ BOOL    envelope_to_remove     = TRUE;
 BOOL    exim_gid_set           = TRUE;          /* This gid is always set */
 BOOL    exim_uid_set           = TRUE;          /* This uid is always set */
 BOOL    extract_addresses_remove_arguments = TRUE;
+BOOL    filter_cache           = FALSE;
 
 BOOL    host_checking          = FALSE;
+BOOL    host_health_used       = FALSE;
 BOOL    host_lookup_deferred   = FALSE;
 BOOL    host_lookup_failed     = FALSE;
 BOOL    ignore_fromline_local  = FALSE;
 
 BOOL    local_from_check       = TRUE;
 BOOL    local_sender_retain    = FALSE;
+BOOL    log_json               = FALSE;
 BOOL    log_timezone           = FALSE;
 BOOL    message_body_newlines  = FALSE;
 BOOL    message_logs           = TRUE;
+BOOL    message_logs_lazy      = FALSE;
 #ifdef SUPPORT_I18N
 BOOL    message_smtputf8       = FALSE;
 #endif
+BOOL    metrics                = FALSE;
 BOOL    mua_wrapper            = FALSE;
 
+#ifndef DISABLE_PIPE_CONNECT
+BOOL    pipe_connect_used      = FALSE;
+#endif
 BOOL    preserve_message_logs  = FALSE;
 BOOL    print_topbitchars      = FALSE;
 BOOL    prod_requires_admin    = TRUE;
@@ -394,11 +411,14 @@ BOOL    proxy_session          = FALSE;
 #ifndef DISABLE_QUEUE_RAMP
 BOOL    queue_fast_ramp		= TRUE;
 #endif
+BOOL    queue_index            = FALSE;
 BOOL    queue_list_requires_admin = TRUE;
 BOOL    queue_only             = FALSE;
 BOOL    queue_only_load_latch  = TRUE;
 BOOL    queue_only_override    = TRUE;
+BOOL    queue_run_batch        = FALSE;
 BOOL    queue_run_in_order     = FALSE;
+BOOL    queue_run_retry_skip   = FALSE;
 BOOL    recipients_max_reject  = FALSE;
 BOOL    return_path_remove     = TRUE;
 
@@ -415,6 +435,7 @@ BOOL    smtp_return_error_details = FALSE;
 BOOL    spf_result_guessed     = FALSE;
 #endif
 BOOL    split_spool_directory  = FALSE;
+BOOL    spool_binary_header    = FALSE;
 BOOL    spool_wireformat       = FALSE;
 BOOL    strict_acl_vars        = FALSE;
 BOOL    strip_excess_angle_brackets = FALSE;
@@ -444,6 +465,7 @@ uschar *acl_not_smtp_mime      = NULL;
 #endif
 uschar *acl_not_smtp_start     = NULL;
 uschar *acl_removed_headers    = NULL;
+BOOL    acl_reorder_conditions = FALSE;
 uschar *acl_smtp_auth          = NULL;
 uschar *acl_smtp_connect       = NULL;
 uschar *acl_smtp_data          = NULL;
@@ -534,6 +556,8 @@ address_item address_defaults = {
   .parent =		NULL,
   .first =		NULL,
   .dupof =		NULL,
+  .dups =		NULL,
+  .dupnext =		NULL,
   .start_router =	NULL,
   .router =		NULL,
   .transport =		NULL,
@@ -643,11 +667,13 @@ auth_instance auth_defaults    = {
     .mail_auth_condition = NULL,
     .server_debug_string = NULL,
     .server_condition =	NULL,
+    .server_condition_cache = 0,
     .client =		FALSE,
     .server =		FALSE,
     .advertised =	FALSE
 };
 
+BOOL    auth_cache_used        = FALSE;
 uschar *auth_defer_msg         = US"reason not recorded";
 uschar *auth_defer_user_msg    = US"";
 const uschar *auth_vars[AUTH_VARS];
@@ -681,6 +707,7 @@ int     bsmtp_transaction_linecount = 0;
 int     body_8bitmime          = 0;
 int     body_linecount         = 0;
 int     body_zerocount         = 0;
+int     bounce_digest_window   = 0;
 uschar *bounce_message_file    = NULL;
 uschar *bounce_message_text    = NULL;
 const uschar *bounce_recipient = NULL;
@@ -739,11 +766,16 @@ uid_t   config_uid             = 0;
 
 uint64_t connection_id	       = 0L;
 int     connection_max_messages= -1;
+#ifdef WITH_CONTENT_SCAN
+int     content_scan_memory_max= 0;
+#endif
+uschar *continue_batch         = NULL;
 uschar *continue_proxy_cipher  = NULL;
 BOOL    continue_proxy_dane    = FALSE;
 uschar *continue_proxy_sni     = NULL;
 uschar *continue_hostname      = NULL;
 uschar *continue_host_address  = NULL;
+int     continue_in_process_max = 0;
 int     continue_sequence      = 1;
 uschar *continue_transport     = NULL;
 #ifdef EXPERIMENTAL_ESMTP_LIMITS
@@ -757,11 +789,16 @@ cut_t   cutthrough = {
   .callout_hold_only =	FALSE,				/* verify-only: normal delivery */
   .delivery =		FALSE,				/* when to attempt */
   .defer_pass =		FALSE,				/* on defer: spool locally */
+  .partial =		FALSE,				/* cancel on incompatible rcpt */
+  .spooled =		FALSE,				/* all rcpts on the conn */
   .is_tls =		FALSE,				/* not a TLS conn yet */
   .cctx =		{.sock = -1},			/* open connection */
   .nrcpt =		0,				/* number of addresses */
 };
 
+int     daemon_acceptors       = 1;
+uschar *daemon_blocklist_file  = NULL;
+BOOL    daemon_blocklist_silent= FALSE;
 int	daemon_notifier_fd     = -1;
 uschar *daemon_smtp_port       = US"smtp";
 int     daemon_startup_retries = 9;
@@ -852,7 +889,10 @@ const uschar *deliver_localpart_suffix = NULL;
 const uschar *deliver_localpart_suffix_v = NULL;
 uschar *deliver_out_buffer     = NULL;
 int     deliver_queue_load_max = -1;
+int     deliver_shards         = 1;
+int     deliver_shards_threshold = 1000;
 address_item  *deliver_recipients = NULL;
+time_t  deliver_retry_after    = 0;
 uschar *deliver_selectstring   = NULL;
 uschar *deliver_selectstring_sender = NULL;
 
@@ -865,6 +905,7 @@ uschar *dkim_signers             = NULL;
 uschar *dkim_signing_domain      = NULL;
 uschar *dkim_signing_selector    = NULL;
 uschar *dkim_verify_hashes       = US"sha256:sha512";
+int     dkim_verify_key_cache    = 0;
 uschar *dkim_verify_keytypes     = US"ed25519:rsa";
 uschar *dkim_verify_min_keysizes = US"rsa=1024 ed25519=250";
 BOOL	dkim_verify_minimal      = FALSE;
@@ -884,12 +925,17 @@ uschar *dmarc_used_domain       = NULL;
 #endif
 
 uschar *dns_again_means_nonexist = NULL;
+BOOL    dns_cache_shared       = FALSE;
+int     dns_cache_shared_ttl   = 5*60;
 int     dns_csa_search_limit   = 5;
 int	dns_cname_loops	       = 1;
 #ifdef SUPPORT_DANE
 int     dns_dane_ok            = -1;
 #endif
 uschar *dns_ipv4_lookup        = NULL;
+unsigned dns_least_ttl         = UINT_MAX;
+BOOL    dns_prefetch_on_connect = FALSE;
+uschar *dns_prefetch_rcpt_domains = NULL;
 int     dns_retrans            = 0;
 int     dns_retry              = 0;
 int     dns_dnssec_ok          = -1; /* <0 = not coerced */
@@ -899,6 +945,7 @@ uschar *dnslist_domain         = NULL;
 uschar *dnslist_matched        = NULL;
 uschar *dnslist_text           = NULL;
 uschar *dnslist_value          = NULL;
+uschar *dnslist_zones          = NULL;
 tree_node *domainlist_anchor   = NULL;
 int     domainlist_count       = 0;
 const uschar *driver_srcfile   = NULL;
@@ -988,6 +1035,8 @@ uschar *helo_lookup_domains    = US"@ : @[]";
 uschar *helo_try_verify_hosts  = NULL;
 uschar *helo_verify_hosts      = NULL;
 const uschar *hex_digits       = CUS"0123456789abcdef";
+uschar *hints_shared           = NULL;
+int     hints_shared_interval  = 60;
 uschar *hold_domains           = NULL;
 uschar *host_data              = NULL;
 uschar *host_lookup            = NULL;
@@ -1007,6 +1056,9 @@ uschar *hosts_xclient	       = NULL;
 #endif
 tree_node *hostlist_anchor     = NULL;
 int     hostlist_count         = 0;
+hash_set hset_dns_fails        = {.perm = TRUE};
+hash_set hset_duplicates       = {0};
+hash_set hset_unusable         = {0};
 
 
 int     ignore_bounce_errors_after = 10*7*24*60*60;  /* 10 weeks */
@@ -1040,9 +1092,14 @@ uschar *local_interfaces       = US"<; ::0 ; 0.0.0.0";
 #else
 uschar *local_interfaces       = US"0.0.0.0";
 #endif
+int     local_max_parallel     = 1;
 
 #ifdef HAVE_LOCAL_SCAN
 uschar *local_scan_data        = NULL;
+# ifdef EXPAND_DLFUNC
+uschar *local_scan_modules     = NULL;
+# endif
+uschar *local_scan_policy      = NULL;
 int     local_scan_timeout     = 5*60;
 #endif
 gid_t   local_user_gid         = (gid_t)(-1);
@@ -1122,6 +1179,7 @@ bit_table log_options[]        = { /* must be in alphabetical order,
   BIT_TABLE(L, queue_time),
   BIT_TABLE(L, queue_time_exclusive),
   BIT_TABLE(L, queue_time_overall),
+  BIT_TABLE(L, receive_phases),
   BIT_TABLE(L, receive_time),
   BIT_TABLE(L, received_recipients),
   BIT_TABLE(L, received_sender),
@@ -1154,15 +1212,22 @@ int     log_reject_target      = 0;
 unsigned int log_selector[log_selector_size]; /* initialized in main() */
 uschar *log_selector_string    = NULL;
 FILE   *log_stderr             = NULL;
+int     log_via_daemon         = -1;
 uschar *login_sender_address   = NULL;
+uschar *lookup_cache_shared    = NULL;
+int     lookup_cache_shared_ttl = 60;
 uschar *lookup_dnssec_authenticated = NULL;
 int     lookup_open_max        = 25;
+uschar *lookup_proxy           = NULL;
+int     lookup_proxy_processes = 4;
 uschar *lookup_value           = NULL;
+int     lsearch_index_min_size = 1024*1024;
 
 macro_item *macros_user        = NULL;
 uschar *mailstore_basename     = NULL;
 #ifdef WITH_CONTENT_SCAN
 uschar *malware_name           = NULL;  /* Virus Name */
+int     malware_verdict_cache  = 0;
 #endif
 int     max_received_linelength= 0;
 int     max_username_length    = 0;
@@ -1199,6 +1264,7 @@ uschar *mime_content_id        = NULL;
 unsigned int mime_content_size = 0;
 uschar *mime_content_transfer_encoding = NULL;
 uschar *mime_content_type      = NULL;
+int     mime_decode_memory_max = 0;
 uschar *mime_decoded_filename  = NULL;
 uschar *mime_filename          = NULL;
 int     mime_is_multipart      = 0;
@@ -1258,20 +1324,32 @@ qrunner *qrunners	       = NULL;
 
 const uschar *qualify_domain_recipient = NULL;
 uschar *qualify_domain_sender  = NULL;
+int     queue_action_parallel  = 1;
 uschar *queue_domains          = NULL;
 int     queue_interval         = -1;
 uschar *queue_name             = US"";
 uschar *queue_name_dest        = NULL;
 uschar *queue_only_file        = NULL;
 int     queue_only_load        = -1;
+int     queue_list_parallel    = 1;
+int     queue_run_batch_fd     = -1;
+int     queue_run_large_size   = 0;
+tree_node *queue_run_batches   = NULL;
+uschar *queue_run_cpus         = NULL;
 uschar *queue_run_max          = US"5";
+#ifndef DISABLE_QUEUE_RAMP
+int     queue_run_on_recovery  = 0;
+#endif
+int     queue_run_parallel     = 1;
 pid_t   queue_run_pid          = (pid_t)0;
 int     queue_run_pipe         = -1;
+uschar *queue_run_weight       = US"1";
 unsigned queue_size            = 0;
 time_t  queue_size_next        = 0;
 uschar *queue_smtp_domains     = NULL;
 
 uint32_t random_seed	       = 0;
+int     ratelimit_shared       = 0;
 tree_node *ratelimiters_cmd    = NULL;
 tree_node *ratelimiters_conn   = NULL;
 tree_node *ratelimiters_mail   = NULL;
@@ -1331,6 +1409,8 @@ const pcre2_code *regex_SIZE         = NULL;
 #ifndef DISABLE_PIPE_CONNECT
 const pcre2_code *regex_EARLY_PIPE   = NULL;
 #endif
+int    regex_cache_hits		     = 0;
+int    regex_cache_misses	     = 0;
 int    regex_cachesize		     = 0;
 const pcre2_code *regex_ismsgid      = NULL;
 const pcre2_code *regex_smtp_code    = NULL;
@@ -1339,6 +1419,7 @@ const uschar *regex_vars[REGEX_VARS] = { NULL };
 const pcre2_code *regex_whitelisted_macro = NULL;
 #endif
 #ifdef WITH_CONTENT_SCAN
+int     regex_combine_min      = 20;
 uschar *regex_match_string     = NULL;
 #endif
 int     remote_delivery_count  = 0;
@@ -1478,6 +1559,7 @@ uschar *sender_rate_period     = NULL;
 uschar *sender_rcvhost         = NULL;
 uschar *sender_unqualified_hosts = NULL;
 uschar *sender_verify_failure = NULL;
+BOOL    sender_verify_session_cache = FALSE;
 address_item *sender_verified_list  = NULL;
 address_item *sender_verified_failed = NULL;
 int     sender_verified_rc     = -1;
@@ -1488,6 +1570,8 @@ const uschar *sigalarm_setter  = NULL;
 const uschar **sighup_argv     = NULL;
 int     slow_lookup_log        = 0;	/* millisecs, zero disables */
 int     smtp_accept_count      = 0;
+uschar *smtp_accept_cpus       = NULL;
+int     smtp_accept_hold       = 0;
 int     smtp_accept_max        = 20;
 int     smtp_accept_max_nonmail= 10;
 uschar *smtp_accept_max_nonmail_hosts = US"*";
@@ -1496,6 +1580,7 @@ uschar *smtp_accept_max_per_host = NULL;
 int     smtp_accept_queue      = 0;
 int     smtp_accept_queue_per_connection = 10;
 int     smtp_accept_reserve    = 0;
+int     smtp_accept_spares     = 0;
 uschar *smtp_active_hostname   = NULL;
 int	smtp_backlog_monitor   = 0;
 uschar *smtp_banner            = US"$smtp_active_hostname ESMTP "
@@ -1525,6 +1610,7 @@ uschar *smtp_ratelimit_hosts   = NULL;
 uschar *smtp_ratelimit_mail    = NULL;
 uschar *smtp_ratelimit_rcpt    = NULL;
 uschar *smtp_read_error        = US"";
+int     smtp_receive_buffer_size = 65536;
 int     smtp_receive_timeout   = 5*60;
 uschar *smtp_receive_timeout_s = NULL;
 uschar *smtp_reserve_hosts     = NULL;
@@ -1542,6 +1628,7 @@ uschar *smtputf8_advertise_hosts = US"*";	/* overridden under test-harness */
 
 #ifdef WITH_CONTENT_SCAN
 uschar *spamd_address          = US"127.0.0.1 783";
+int     spam_verdict_cache     = 0;
 uschar *spam_bar               = NULL;
 uschar *spam_report            = NULL;
 uschar *spam_action            = NULL;
@@ -1549,6 +1636,7 @@ uschar *spam_score             = NULL;
 uschar *spam_score_int         = NULL;
 #endif
 #ifdef SUPPORT_SPF
+int     spf_cache_ttl          = 0;
 uschar *spf_guess              = US"v=spf1 a/24 mx/24 ptr ?all";
 uschar *spf_header_comment     = NULL;
 uschar *spf_received           = NULL;
@@ -1561,11 +1649,20 @@ uschar *spf_smtp_comment_template
 #endif
 
 FILE   *spool_data_file	       = NULL;
+int     spool_dedup_size       = 0;
 uschar *spool_directory        = US SPOOL_DIRECTORY
                            "\0<--------------Space to patch spool_directory->";
+int     spool_group_sync       = -1;
+int     spool_handoff_size     = 32*1024;
+int     spool_journal_size     = 0;
+int     spool_shard_count      = 0;
+const uschar **spool_shard_roots = NULL;
+uschar *spool_shards           = NULL;
 #ifdef SUPPORT_SRS
 uschar *srs_recipient          = NULL;
 #endif
+int     store_hard_limit       = 0;
+int     store_soft_limit       = 0;
 int     string_datestamp_offset= -1;
 int     string_datestamp_length= 0;
 int     string_datestamp_type  = -1;
@@ -1617,14 +1714,16 @@ const uschar **transport_filter_argv  = NULL;
 int     transport_filter_timeout;
 int     transport_write_timeout= 0;
 
-tree_node  *tree_dns_fails     = NULL;
-tree_node  *tree_duplicates    = NULL;
 tree_node  *tree_nonrecipients = NULL;
-tree_node  *tree_unusable      = NULL;
 
 gid_t  *trusted_groups         = NULL;
 uid_t  *trusted_users          = NULL;
 uschar *timezone_string        = US TIMEZONE_DEFAULT;
+trace_rec *trace_ring          = NULL;
+uschar *trace_ring_file        = NULL;
+unsigned trace_ring_mask       = 0;
+unsigned trace_ring_next       = 0;
+int     trace_ring_size        = 1024;
 
 uschar *unknown_login          = NULL;
 uschar *unknown_username       = NULL;
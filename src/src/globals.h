@@ -28,6 +28,7 @@ typedef volatile sig_atomic_t SIGNAL_BOOL;
 
 #ifdef EXIM_PERL
 extern uschar *opt_perl_startup;       /* Startup code for Perl interpreter */
+extern BOOL    opt_perl_at_daemon_start; /* Start Perl interpreter in a daemon */
 extern BOOL    opt_perl_at_start;      /* Start Perl interpreter at start */
 extern BOOL    opt_perl_started;       /* Set once interpreter started */
 extern BOOL    opt_perl_taintmode;     /* Enable taint mode in Perl */
@@ -127,6 +128,7 @@ extern tls_support tls_out;
 extern BOOL    gnutls_compat_mode;     /* Less security, more compatibility */
 extern BOOL    gnutls_allow_auto_pkcs11; /* Let GnuTLS autoload PKCS11 modules */
 extern uschar *hosts_require_alpn;     /* Mandatory ALPN successful nogitiation */
+extern BOOL    openssl_async;          /* OpenSSL ASYNC mode, for crypto engines */
 extern uschar *openssl_options;        /* OpenSSL compatibility options */
 extern const pcre2_code *regex_STARTTLS;     /* For recognizing STARTTLS settings */
 extern uschar *tls_alpn;	       /* ALPN names acceptable */
@@ -137,13 +139,17 @@ extern uschar *tls_dhparam;            /* DH param file */
 extern uschar *tls_eccurve;            /* EC curve */
 # ifndef DISABLE_OCSP
 extern uschar *tls_ocsp_file;          /* OCSP stapling proof file */
+extern int     tls_ocsp_refresh;       /* Interval for the daemon to fetch it */
 # endif
 extern uschar *tls_privatekey;         /* Private key file */
 extern BOOL    tls_remember_esmtp;     /* For YAEB */
 extern uschar *tls_require_ciphers;    /* So some can be avoided */
 # ifndef DISABLE_TLS_RESUME
 extern uschar *tls_resumption_hosts;   /* TLS session resumption */
+extern uschar *tls_resumption_secret;  /* Shared source of ticket keys */
+extern int     tls_resumption_shared;  /* Client sessions held by the daemon */
 # endif
+extern uschar *tls_sni_preload;        /* SNI values to make contexts for */
 extern uschar *tls_try_verify_hosts;   /* Optional client verification */
 extern uschar *tls_verify_certificates;/* Path for certificates to check */
 extern uschar *tls_verify_hosts;       /* Mandatory client verification */
@@ -283,6 +289,7 @@ extern struct global_flags {
  BOOL   smtp_in_pipelining_used		:1; /* server noted client using PIPELINING */
  BOOL   smtp_in_quit			:1; /* server noted QUIT command */
  BOOL   spool_file_wireformat		:1; /* current -D file has CRLF rather than NL */
+ BOOL   spool_header_only		:1; /* -D file not opened until the body is wanted */
  BOOL   submission_mode			:1; /* Can be forced from ACL */
  BOOL   suppress_local_fixups		:1; /* Can be forced from ACL */
  BOOL   suppress_local_fixups_default	:1; /* former is reset to this; override with -G */
@@ -318,6 +325,7 @@ extern uschar *acl_not_smtp_mime;      /* For MIME parts of ditto */
 #endif
 extern uschar *acl_not_smtp_start;     /* ACL run at the beginning of a non-SMTP session */
 extern uschar *acl_removed_headers;    /* Headers deleted by an ACL */
+extern BOOL    acl_reorder_conditions; /* Test cheap ACL conditions first */
 extern uschar *acl_smtp_auth;          /* ACL run for AUTH */
 extern uschar *acl_smtp_connect;       /* ACL run on SMTP connection */
 extern uschar *acl_smtp_data;          /* ACL run after DATA received */
@@ -373,6 +381,7 @@ extern uschar *authenticator_name;     /* for debug and error messages */
 extern uschar *auth_advertise_hosts;   /* Only advertise to these */
 extern auth_info auths_available[];    /* Vector of available auth mechanisms */
 extern auth_instance *auths;           /* Chain of instantiated auths */
+extern BOOL    auth_cache_used;        /* An authenticator caches server_condition */
 extern auth_instance auth_defaults;    /* Default values */
 extern uschar *auth_defer_msg;         /* Error message for log */
 extern uschar *auth_defer_user_msg;    /* Error message for user */
@@ -398,6 +407,7 @@ extern uschar *bmi_verdicts;           /* BASE64-encoded verdicts with recipient
 #endif
 extern int     bsmtp_transaction_linecount; /* Start of last transaction */
 extern int     body_8bitmime;          /* sender declared BODY= ; 7=7BIT, 8=8BITMIME */
+extern int     bounce_digest_window;   /* Later bounces held for a digest */
 extern uschar *bounce_message_file;    /* Template file */
 extern uschar *bounce_message_text;    /* One-liner */
 extern const uschar *bounce_recipient; /* When writing an errmsg */
@@ -442,11 +452,16 @@ extern const uschar *config_main_filelist; /* List of possible config files */
 extern uschar *config_main_filename;   /* File name actually used */
 extern uschar *config_main_directory;  /* Directory where the main config file was found */
 extern uid_t   config_uid;             /* Additional owner */
+#ifdef WITH_CONTENT_SCAN
+extern int     content_scan_memory_max; /* Largest message copied for scanning in memory */
+#endif
+extern uschar *continue_batch;         /* Message ids still to go down a continued connection */
 extern uschar *continue_proxy_cipher;  /* TLS cipher for proxied continued delivery */
 extern BOOL    continue_proxy_dane;    /* proxied conn is DANE */
 extern uschar *continue_proxy_sni;     /* proxied conn SNI */
 extern uschar *continue_hostname;      /* Host for continued delivery */
 extern uschar *continue_host_address;  /* IP address for ditto */
+extern int     continue_in_process_max; /* Continued deliveries without exec */
 extern int     continue_sequence;      /* Sequence num for continued delivery */
 extern uschar *continue_transport;     /* Transport for continued delivery */
 #ifdef EXPERIMENTAL_ESMTP_LIMITS
@@ -462,6 +477,8 @@ typedef struct {
   unsigned     callout_hold_only:1;    /* Conn is only for verify callout */
   unsigned     delivery:1;             /* When to attempt */
   unsigned     defer_pass:1;           /* Pass 4xx to caller rather than spooling */
+  unsigned     partial:1;              /* Spool recipients the conn cannot take */
+  unsigned     spooled:1;              /* Some recipients were not on the conn */
   unsigned     is_tls:1;	       /* Conn has TLS active */
   client_conn_ctx cctx;                /* Open connection */
   int          nrcpt;                  /* Count of addresses */
@@ -475,6 +492,9 @@ typedef struct {
 } cut_t;
 extern cut_t cutthrough;               /* Deliver-concurrently */
 
+extern int     daemon_acceptors;       /* Number of listening processes */
+extern uschar *daemon_blocklist_file;  /* Addresses refused before forking */
+extern BOOL    daemon_blocklist_silent;/* Close on them without a banner */
 extern int     daemon_notifier_fd;     /* Unix socket for notifications */
 extern uschar *daemon_smtp_port;       /* Can be a list of ports */
 extern int     daemon_startup_retries; /* Number of times to retry */
@@ -527,7 +547,10 @@ extern const uschar *deliver_localpart_suffix;		/* The stripped suffix, if any *
 extern const uschar *deliver_localpart_suffix_v;	/* The stripped-suffix variable portion, if any */
 extern uschar *deliver_out_buffer;     /* Buffer for copying file */
 extern int     deliver_queue_load_max; /* Different value for queue running */
+extern int     deliver_shards;         /* Processes to split a delivery over */
+extern int     deliver_shards_threshold; /* Recipients needed for a split */
 extern address_item *deliver_recipients; /* Current set of addresses */
+extern time_t  deliver_retry_after;    /* Not worth a queue run before this */
 extern uschar *deliver_selectstring;   /* For selecting by recipient */
 extern uschar *deliver_selectstring_sender; /* For selecting by sender */
 #ifdef ENABLE_DISABLE_FSYNC
@@ -544,6 +567,7 @@ extern uschar *dkim_signers;           /* Expansion variable, holds colon-separa
 extern uschar *dkim_signing_domain;    /* Expansion variable, domain used for signing a message. */
 extern uschar *dkim_signing_selector;  /* Expansion variable, selector used for signing a message. */
 extern uschar *dkim_verify_hashes;     /* Preference order for signatures */
+extern int     dkim_verify_key_cache;  /* Max time to hold key records in hints db */
 extern uschar *dkim_verify_keytypes;   /* Preference order for signatures */
 extern uschar *dkim_verify_min_keysizes; /* list of minimum key sizes, keyed by algo */
 extern BOOL    dkim_verify_minimal;    /* Shortcircuit signature verification */
@@ -563,10 +587,15 @@ extern uschar *dmarc_used_domain;      /* Expansion variable, domain libopendmar
 #endif
 
 extern uschar *dns_again_means_nonexist; /* Domains that are badly set up */
+extern BOOL    dns_cache_shared;       /* Hold DNS answers in the daemon */
+extern int     dns_cache_shared_ttl;   /* Max life of a daemon-held answer */
 extern int     dns_csa_search_limit;   /* How deep to search for CSA SRV records */
 extern BOOL    dns_csa_use_reverse;    /* Check CSA in reverse DNS? (non-standard) */
 extern int     dns_cname_loops;	       /* Follow CNAMEs returned by resolver to this depth */
 extern uschar *dns_ipv4_lookup;        /* For these domains, don't look for AAAA (or A6) */
+extern unsigned dns_least_ttl;         /* Least TTL of the records scanned since reset */
+extern BOOL    dns_prefetch_on_connect; /* Start host lookups when connection accepted */
+extern uschar *dns_prefetch_rcpt_domains; /* MX lookups started for pipelined RCPTs */
 #ifdef SUPPORT_DANE
 extern int     dns_dane_ok;            /* Ok to use DANE when checking TLS authenticity */
 #endif
@@ -580,6 +609,7 @@ extern uschar *dnslist_domain;         /* DNS (black) list domain */
 extern uschar *dnslist_matched;        /* DNS (black) list matched key */
 extern uschar *dnslist_text;           /* DNS (black) list text message */
 extern uschar *dnslist_value;          /* DNS (black) list IP address */
+extern uschar *dnslist_zones;          /* DNS lists answered from local files */
 extern tree_node *domainlist_anchor;   /* Tree of defined domain lists */
 extern int     domainlist_count;       /* Number defined */
 
@@ -622,6 +652,7 @@ extern uschar *extra_local_interfaces; /* Local, non-listen interfaces */
 
 extern int     fake_response;          /* Fake FAIL or DEFER response to data */
 extern uschar *fake_response_text;     /* User defined message for the above. Default is in globals.c. */
+extern BOOL    filter_cache;           /* Keep parsed filters in a hints db */
 extern int     filter_n[FILTER_VARIABLE_COUNT]; /* filter variables */
 extern int     filter_sn[FILTER_VARIABLE_COUNT]; /* variables set by system filter */
 extern int     filter_test;            /* Filter test type */
@@ -653,8 +684,11 @@ extern uschar *helo_lookup_domains;    /* If these given, lookup host name */
 extern uschar *helo_try_verify_hosts;  /* Soft check HELO argument for these */
 extern uschar *helo_verify_hosts;      /* Hard check HELO argument for these */
 extern const uschar *hex_digits;             /* Used in several places */
+extern uschar *hints_shared;           /* Hints DBs exchanged with a Redis server */
+extern int     hints_shared_interval;  /* Time between exchanges */
 extern uschar *hold_domains;           /* Hold up deliveries to these */
 extern uschar *host_data;              /* Obtained from lookup in ACL */
+extern BOOL    host_health_used;       /* An smtp transport has hosts_health_order */
 extern uschar *host_lookup;            /* For which IP addresses are always looked up */
 extern BOOL    host_lookup_deferred;   /* TRUE if lookup deferred */
 extern BOOL    host_lookup_failed;     /* TRUE if lookup failed */
@@ -671,6 +705,9 @@ extern uschar *hosts_xclient;	       /* Allow XCLIENT command for specified host
 #endif
 extern tree_node *hostlist_anchor;     /* Tree of defined host lists */
 extern int     hostlist_count;         /* Number defined */
+extern hash_set hset_dns_fails;        /* DNS lookup failures */
+extern hash_set hset_duplicates;       /* Duplicate addresses */
+extern hash_set hset_unusable;         /* Unusable addresses */
 
 
 extern int     ignore_bounce_errors_after; /* Keep them for this time. */
@@ -695,10 +732,15 @@ extern BOOL    local_from_check;       /* For adding Sender: (global value) */
 extern uschar *local_from_prefix;      /* Permitted prefixes */
 extern uschar *local_from_suffix;      /* Permitted suffixes */
 extern uschar *local_interfaces;       /* For forcing specific interfaces */
+extern int     local_max_parallel;     /* Maximum parallel local deliveries */
 #ifdef HAVE_LOCAL_SCAN
 extern uschar *local_scan_data;        /* Text returned by local_scan() */
+# ifdef EXPAND_DLFUNC
+extern uschar *local_scan_modules;     /* More local_scan()s, dynamically loaded */
+# endif
 extern optionlist local_scan_options[];/* Option list for local_scan() */
 extern int     local_scan_options_count; /* Size of the list */
+extern uschar *local_scan_policy;      /* Service given the message as it arrives */
 extern int     local_scan_timeout;     /* Timeout for local_scan() */
 #endif
 extern BOOL    local_sender_retain;    /* Retain Sender: (with no From: check) */
@@ -709,6 +751,7 @@ extern int     localpartlist_count;    /* Number defined */
 extern uschar *log_buffer;             /* For constructing log entries */
 extern int     log_default[];          /* Initialization list for log_selector */
 extern uschar *log_file_path;          /* If unset, use default */
+extern BOOL    log_json;               /* Also write events to the JSON log */
 extern int     log_notall[];           /* Log options excluded from +all */
 extern bit_table log_options[];        /* Table of options */
 extern int     log_options_count;      /* Size of table */
@@ -717,12 +760,18 @@ extern unsigned int log_selector[];    /* Bit map of logging options */
 extern uschar *log_selector_string;    /* As supplied in the config */
 extern FILE   *log_stderr;             /* Copy of stderr for log use, or NULL */
 extern BOOL    log_timezone;           /* TRUE to include the timezone in log lines */
+extern int     log_via_daemon;         /* Window (ms) for the daemon to gather log lines */
 extern uschar *login_sender_address;   /* The actual sender address */
 extern lookup_info **lookup_list;      /* Array of pointers to available lookups */
 extern int     lookup_list_count;      /* Number of entries in the list */
+extern uschar *lookup_cache_shared;    /* Lookup types cached in the daemon */
+extern int     lookup_cache_shared_ttl; /* Max life of a daemon cache entry */
 extern uschar *lookup_dnssec_authenticated; /* AD status of dns lookup */
 extern int     lookup_open_max;        /* Max lookup files to cache */
+extern uschar *lookup_proxy;           /* Lookup types done by the proxy helpers */
+extern int     lookup_proxy_processes; /* Number of proxy helpers */
 extern uschar *lookup_value;           /* Value looked up from file */
+extern int     lsearch_index_min_size; /* Smallest lsearch file to index */
 
 extern macro_item *macros;             /* Configuration macros */
 extern macro_item *macros_user;        /* Non-builtin configuration macros */
@@ -730,6 +779,7 @@ extern macro_item *mlast;              /* Last item in macro list */
 extern uschar *mailstore_basename;     /* For mailstore deliveries */
 #ifdef WITH_CONTENT_SCAN
 extern uschar *malware_name;           /* Name of virus or malware ("W32/Klez-H") */
+extern int     malware_verdict_cache;  /* Max time to hold malware verdicts in hints db */
 #endif
 extern int     max_received_linelength;/* What it says */
 extern int     max_username_length;    /* For systems with broken getpwnam() */
@@ -747,6 +797,7 @@ extern uschar *message_id_domain;      /* Expanded to form domain-part of messag
 extern uschar *message_id_text;        /* Expanded to form message_id */
 extern int     message_linecount;      /* As it says */
 extern BOOL    message_logs;           /* TRUE to write message logs */
+extern BOOL    message_logs_lazy;      /* Keep them in memory until a defer */
 extern int     message_size;           /* Size of message */
 extern uschar *message_size_limit;     /* As it says */
 #ifdef SUPPORT_I18N
@@ -756,6 +807,7 @@ extern const   pcre2_code *regex_UTF8;         /* For recognizing SMTPUTF8 setti
 #endif
 extern uschar  message_subdir[];       /* Subdirectory for messages */
 extern const uschar *message_reference;/* Reference for error messages */
+extern BOOL    metrics;                /* Keep counters in a shared table */
 
 /* MIME ACL expandables */
 #ifdef WITH_CONTENT_SCAN
@@ -769,6 +821,7 @@ extern uschar *mime_content_id;
 extern unsigned int mime_content_size;
 extern uschar *mime_content_transfer_encoding;
 extern uschar *mime_content_type;
+extern int     mime_decode_memory_max; /* Largest part decoded into memory */
 extern uschar *mime_decoded_filename;
 extern uschar *mime_filename;
 extern int     mime_is_multipart;
@@ -811,6 +864,7 @@ extern uschar *percent_hack_domains;   /* Local domains for which '% operates */
 extern const uschar *pid_file_path;    /* For writing daemon pids */
 #ifndef DISABLE_PIPE_CONNECT
 extern uschar *pipe_connect_advertise_hosts; /* for banner/EHLO pipelining */
+extern BOOL    pipe_connect_used;      /* An smtp transport has hosts_pipe_connect */
 #endif
 extern uschar *pipelining_advertise_hosts; /* As it says */
 #ifndef DISABLE_PRDR
@@ -845,10 +899,13 @@ extern qrunner *qrunners;	       /* tracking data for queues */
 
 extern const uschar *qualify_domain_recipient; /* Domain to qualify recipients with */
 extern uschar *qualify_domain_sender;  /* Domain to qualify senders with */
+extern int     queue_action_parallel;  /* Processes for -Mrm etc. on many messages */
 extern uschar *queue_domains;          /* Queue these domains */
 #ifndef DISABLE_QUEUE_RAMP
 extern BOOL    queue_fast_ramp;        /* 2-phase queue-run overlap */
 #endif
+extern BOOL    queue_index;            /* Daemon maintains queue index */
+extern int     queue_list_parallel;    /* Processes for listing the queue */
 extern BOOL    queue_list_requires_admin; /* TRUE if -bp requires admin */
                                        /*   immediate children */
 extern pid_t   queue_run_pid;          /* PID of the queue running process or 0 */
@@ -861,13 +918,25 @@ extern int     queue_only_load;        /* Max load before auto-queue */
 extern BOOL    queue_only_load_latch;  /* Latch queue_only_load TRUE */
 extern uschar *queue_only_file;        /* Queue if file exists/not-exists */
 extern BOOL    queue_only_override;    /* Allow override from command line */
+extern BOOL    queue_run_batch;        /* Collect per-host batches in 2-stage run */
+extern uschar *queue_run_cpus;         /* CPUs for queue runners */
 extern BOOL    queue_run_in_order;     /* As opposed to random */
+extern int     queue_run_large_size;   /* Run messages this big last */
+extern int     queue_run_batch_fd;     /* File for 1st-phase batch records */
+extern tree_node *queue_run_batches;   /* Per transport/host batches for 2nd phase */
 extern uschar *queue_run_max;          /* Max queue runners */
+#ifndef DISABLE_QUEUE_RAMP
+extern int     queue_run_on_recovery;  /* Waiting messages to kick when a host recovers */
+#endif
+extern int     queue_run_parallel;     /* Deliveries in parallel per runner */
+extern BOOL    queue_run_retry_skip;   /* Skip messages waiting on retry times */
+extern uschar *queue_run_weight;       /* Share of runners, per queue, when competing */
 extern unsigned queue_size;            /* items in queue */
 extern time_t  queue_size_next;        /* next time to evaluate queue_size */
 extern uschar *queue_smtp_domains;     /* Ditto, for these domains */
 
 extern unsigned int random_seed;       /* Seed for random numbers */
+extern int     ratelimit_shared;       /* Daemon holds rates; checkpoint interval */
 extern tree_node *ratelimiters_cmd;    /* Results of command ratelimit checks */
 extern tree_node *ratelimiters_conn;   /* Results of connection ratelimit checks */
 extern tree_node *ratelimiters_mail;   /* Results of per-mail ratelimit checks */
@@ -909,6 +978,8 @@ extern const pcre2_code  *regex_SIZE;        /* For recognizing SIZE settings */
 #ifndef DISABLE_PIPE_CONNECT
 extern const pcre2_code  *regex_EARLY_PIPE;  /* For recognizing PIPE_CONNCT */
 #endif
+extern int    regex_cache_hits;	     /* lookups found in the cache */
+extern int    regex_cache_misses;	     /* lookups compiled afresh */
 extern int    regex_cachesize;		     /* number of entries */
 extern const pcre2_code  *regex_ismsgid;     /* Compiled r.e. for message ID */
 extern const pcre2_code  *regex_smtp_code;   /* For recognizing SMTP codes */
@@ -916,6 +987,7 @@ extern const pcre2_code  *regex_smtp_code;   /* For recognizing SMTP codes */
 extern const pcre2_code  *regex_whitelisted_macro; /* For -D macro values */
 #endif
 #ifdef WITH_CONTENT_SCAN
+extern int     regex_combine_min;      /* patterns needed to build a prefilter */
 extern uschar *regex_match_string;     /* regex that matched a line (regex ACL condition) */
 extern const uschar *regex_vars[];
 #endif
@@ -964,6 +1036,7 @@ extern uschar *sender_rate_period;     /* Configured smoothing period */
 extern uschar *sender_rcvhost;         /* Host data for Received: */
 extern uschar *sender_unqualified_hosts; /* Permitted unqualified senders */
 extern uschar *sender_verify_failure;  /* What went wrong */
+extern BOOL    sender_verify_session_cache; /* Keep verify results for the session */
 extern address_item *sender_verified_list; /* Saved chain of sender verifies */
 extern address_item *sender_verified_failed; /* The one that caused denial */
 extern uschar *sending_ip_address;     /* Address of outgoing (SMTP) interface */
@@ -973,7 +1046,9 @@ extern const uschar *sigalarm_setter;  /* For debug, set to callpoint of alarm()
 extern const uschar **sighup_argv;     /* Args for re-execing after SIGHUP */
 extern int     slow_lookup_log;        /* Log DNS lookups taking longer than N millisecs */
 extern int     smtp_accept_count;      /* Count of connections */
+extern uschar *smtp_accept_cpus;       /* CPUs for reception processes */
 extern BOOL    smtp_accept_keepalive;  /* Set keepalive on incoming */
+extern int     smtp_accept_hold;       /* Daemon holds new calls this long */
 extern int     smtp_accept_max;        /* Max SMTP connections */
 extern int     smtp_accept_max_nonmail;/* Max non-mail commands in one con */
 extern uschar *smtp_accept_max_nonmail_hosts; /* Limit non-mail cmds from these hosts */
@@ -982,6 +1057,7 @@ extern uschar *smtp_accept_max_per_host; /* Max SMTP cons from one IP addr */
 extern int     smtp_accept_queue;      /* Queue after so many connections */
 extern int     smtp_accept_queue_per_connection; /* Queue after so many msgs */
 extern int     smtp_accept_reserve;    /* Reserve these SMTP connections */
+extern int     smtp_accept_spares;     /* Reception processes forked early */
 extern uschar *smtp_active_hostname;   /* Hostname for this message */
 extern int     smtp_backlog_monitor;   /* listen backlog level to log */
 extern uschar *smtp_banner;            /* Banner string (to be expanded) */
@@ -1011,6 +1087,7 @@ extern uschar *smtp_ratelimit_hosts;   /* Rate limit these hosts */
 extern uschar *smtp_ratelimit_mail;    /* Parameters for MAIL limiting */
 extern uschar *smtp_ratelimit_rcpt;    /* Parameters for RCPT limiting */
 extern uschar *smtp_read_error;        /* Message for SMTP input error */
+extern int     smtp_receive_buffer_size; /* For reading SMTP input */
 extern int     smtp_receive_timeout;   /* Applies to each received line */
 extern uschar *smtp_receive_timeout_s; /* ... expandable version */
 extern uschar *smtp_reserve_hosts;     /* Hosts for reserved slots */
@@ -1031,6 +1108,7 @@ extern uschar *smtputf8_advertise_hosts; /* ingress control */
 
 #ifdef WITH_CONTENT_SCAN
 extern uschar *spamd_address;          /* address for the spamassassin daemon */
+extern int     spam_verdict_cache;     /* Max time to hold spam verdicts in hints db */
 extern uschar *spam_bar;               /* the spam "bar" (textual representation of spam_score) */
 extern uschar *spam_report;            /* the spamd report (multiline) */
 extern uschar *spam_action;            /* the spamd recommended-action */
@@ -1038,6 +1116,7 @@ extern uschar *spam_score;             /* the spam score (float) */
 extern uschar *spam_score_int;         /* spam_score * 10 (int) */
 #endif
 #ifdef SUPPORT_SPF
+extern int     spf_cache_ttl;          /* Life of a daemon-held SPF result */
 extern uschar *spf_guess;              /* spf best-guess record */
 extern uschar *spf_header_comment;     /* spf header comment */
 extern uschar *spf_received;           /* Received-SPF: header */
@@ -1048,12 +1127,22 @@ extern uschar *spf_smtp_comment_template;
                                        /* template to construct the spf comment by libspf2 */
 #endif
 extern BOOL    split_spool_directory;  /* TRUE to use multiple subdirs */
+extern BOOL    spool_binary_header;    /* write -H files in binary format */
 extern FILE   *spool_data_file;	       /* handle for -D file */
+extern int     spool_dedup_size;       /* Min body size for sharing data files */
 extern uschar *spool_directory;        /* Name of spool directory */
+extern int     spool_group_sync;       /* Window (ms) for group commit of received messages */
+extern int     spool_handoff_size;     /* Max size for passing the header to delivery in memory */
+extern int     spool_journal_size;     /* Max journal size standing in for -H rewrites */
+extern int     spool_shard_count;      /* Number of spool shard roots */
+extern const uschar **spool_shard_roots; /* The roots, split from spool_shards */
+extern uschar *spool_shards;           /* Filesystems to spread the split spool over */
 extern BOOL    spool_wireformat;       /* can write wireformat -D files */
 #ifdef SUPPORT_SRS
 extern uschar *srs_recipient;          /* SRS recipient */
 #endif
+extern int     store_hard_limit;       /* Pool store that panics the process */
+extern int     store_soft_limit;       /* Pool store that defers deliveries */
 extern BOOL    strict_acl_vars;        /* ACL variables have to be set before being used */
 extern int     string_datestamp_offset;/* After insertion by string_format */
 extern int     string_datestamp_length;/* After insertion by string_format */
@@ -1104,14 +1193,16 @@ extern transport_instance transport_defaults; /* Default values */
 
 extern int     transport_write_timeout;/* Set to time out individual writes */
 
-extern tree_node *tree_dns_fails;      /* Tree of DNS lookup failures */
-extern tree_node *tree_duplicates;     /* Tree of duplicate addresses */
 extern tree_node *tree_nonrecipients;  /* Tree of nonrecipient addresses */
-extern tree_node *tree_unusable;       /* Tree of unusable addresses */
 
 extern gid_t  *trusted_groups;         /* List of trusted groups */
 extern uid_t  *trusted_users;          /* List of trusted users */
 extern uschar *timezone_string;        /* Required timezone setting */
+extern trace_rec *trace_ring;          /* Ring of recent events */
+extern uschar *trace_ring_file;        /* Where it is dumped */
+extern unsigned trace_ring_mask;       /* Its size, less one */
+extern unsigned trace_ring_next;       /* Count of events recorded */
+extern int     trace_ring_size;        /* Events it holds */
 
 extern uschar *unknown_login;          /* To use when login id unknown */
 extern uschar *unknown_username;       /* Ditto */
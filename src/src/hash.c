@@ -61,26 +61,39 @@ switch (h->method = m)
 return TRUE;
 
 # else
-EVP_MD * md;
+/* Fetching an implementation from the provider is much more expensive than
+the hashing for the short inputs we mostly see, so each method is fetched
+once per process and kept.  The library picks the fastest implementation the
+CPU supports (SHA-NI, ARMv8 crypto extensions) at fetch time. */
+
+static EVP_MD * fetched[HASH_SHA3_512 + 1];
+const char * name;
+int len;
 
 h->hashlen = 0;
-if (!(h->u.mctx = EVP_MD_CTX_new())) return FALSE;
 switch (h->method = m)
   {
-  case HASH_SHA1:     h->hashlen = 20; md = EVP_MD_fetch(NULL, "SHA1", NULL); break;
-  case HASH_SHA2_256: h->hashlen = 32; md = EVP_MD_fetch(NULL, "SHA2-256", NULL); break;
-  case HASH_SHA2_384: h->hashlen = 48; md = EVP_MD_fetch(NULL, "SHA2-384", NULL); break;
-  case HASH_SHA2_512: h->hashlen = 64; md = EVP_MD_fetch(NULL, "SHA2-512", NULL); break;
-  case HASH_SHA3_224: h->hashlen = 28; md = EVP_MD_fetch(NULL, "SHA3-224", NULL); break;
-  case HASH_SHA3_256: h->hashlen = 32; md = EVP_MD_fetch(NULL, "SHA3-256", NULL); break;
-  case HASH_SHA3_384: h->hashlen = 48; md = EVP_MD_fetch(NULL, "SHA3-384", NULL); break;
-  case HASH_SHA3_512: h->hashlen = 64; md = EVP_MD_fetch(NULL, "SHA3-512", NULL); break;
+  case HASH_SHA1:     len = 20; name = "SHA1"; break;
+  case HASH_SHA2_256: len = 32; name = "SHA2-256"; break;
+  case HASH_SHA2_384: len = 48; name = "SHA2-384"; break;
+  case HASH_SHA2_512: len = 64; name = "SHA2-512"; break;
+  case HASH_SHA3_224: len = 28; name = "SHA3-224"; break;
+  case HASH_SHA3_256: len = 32; name = "SHA3-256"; break;
+  case HASH_SHA3_384: len = 48; name = "SHA3-384"; break;
+  case HASH_SHA3_512: len = 64; name = "SHA3-512"; break;
   default:	      return FALSE;
   }
-if (md && EVP_DigestInit_ex(h->u.mctx, md, NULL))
+if (  !fetched[m] && !(fetched[m] = EVP_MD_fetch(NULL, name, NULL)))
+  return FALSE;
+if (!(h->u.mctx = EVP_MD_CTX_new()))
+  return FALSE;
+if (EVP_DigestInit_ex(h->u.mctx, fetched[m], NULL))
+  {
+  h->hashlen = len;
   return TRUE;
+  }
 
-h->hashlen = 0;
+EVP_MD_CTX_free(h->u.mctx);
 return FALSE;
 # endif
 }
@@ -139,7 +152,6 @@ switch (h->method)
 # else
 
 EVP_DigestFinal_ex(h->u.mctx, b->data, NULL);
-EVP_MD_free((EVP_MD *) EVP_MD_CTX_get0_md(h->u.mctx));
 EVP_MD_CTX_free(h->u.mctx);
 
 # endif
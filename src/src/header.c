@@ -57,9 +57,125 @@ return TRUE;
 
 
 /*************************************************
-*         Add new header backend function        *
+*            Index of header names               *
 *************************************************/
 
+/* Finding the headers of a given name ($h_ expansions, the filter and Sieve
+tests, header_remove()) used to mean a scan of the whole header list each
+time, which adds up for messages with long Received: or ARC chains. An index
+is built on the first such lookup: the headers are grouped by a hash of their
+names, keeping the list order within each group. The caller still checks the
+name of each header it is given, so the index only saves the scan.
+
+The index holds only pointers and is in malloc store, so it is not lost when
+a memory pool is reset. It is rebuilt when the head or tail of the list has
+moved; code that replaces the list, or inserts in the middle of it, calls
+header_index_reset(). While the Received: header is a placeholder with no text
+there is no index, and callers scan the list. */
+
+static header_line **	hx_hdrs = NULL;		/* headers, grouped by hash */
+static unsigned *	hx_start = NULL;	/* group offsets into hx_hdrs */
+static unsigned		hx_mask;		/* number of groups, less one */
+static header_line *	hx_list;		/* header_list when built */
+static header_line *	hx_last;		/* header_last when built */
+
+/* Hash a header name, without case, up to the colon or any white space
+before it */
+
+static unsigned
+header_name_hash(const uschar * name, int len)
+{
+unsigned hash = 5381;
+for (int i = 0; i < len; i++)
+  {
+  int c = name[i];
+  if (!c || c == ':' || c == ' ' || c == '\t' || c == '\n') break;
+  hash = hash * 33 + tolower(c);
+  }
+return hash;
+}
+
+/* Discard the index */
+
+void
+header_index_reset(void)
+{
+if (hx_hdrs)
+  {
+  store_free(hx_hdrs);
+  store_free(hx_start);
+  hx_hdrs = NULL;
+  }
+}
+
+/* Build the index for the current header list
+
+Returns:  TRUE if there is now an index
+*/
+
+static BOOL
+header_index_build(void)
+{
+unsigned count = 0, groups = 16;
+
+header_index_reset();
+for (header_line * h = header_list; h; h = h->next)
+  if (!h->text) return FALSE;
+  else count++;
+
+while (groups < count) groups <<= 1;
+hx_mask = groups - 1;
+hx_hdrs = store_malloc((count + 1) * sizeof(header_line *));
+hx_start = store_malloc((groups + 1) * sizeof(unsigned));
+memset(hx_start, 0, (groups + 1) * sizeof(unsigned));
+
+/* Count each group, make the counts into start offsets, and fill each group
+in list order; that leaves each offset at the start of the next group, so
+shift them back */
+
+for (header_line * h = header_list; h; h = h->next)
+  hx_start[(header_name_hash(h->text, h->slen) & hx_mask) + 1]++;
+for (unsigned i = 1; i <= groups; i++)
+  hx_start[i] += hx_start[i-1];
+for (header_line * h = header_list; h; h = h->next)
+  hx_hdrs[hx_start[header_name_hash(h->text, h->slen) & hx_mask]++] = h;
+for (unsigned i = groups; i > 0; i--)
+  hx_start[i] = hx_start[i-1];
+hx_start[0] = 0;
+
+hx_list = header_list;
+hx_last = header_last;
+DEBUG(D_expand) debug_printf_indent("built index of %u headers\n", count);
+return TRUE;
+}
+
+/* Find the headers that may have a given name.
+
+Arguments:
+  name      the header name; a trailing colon is ignored
+  len       its length
+  count     set to the number of headers returned
+
+Returns:    a vector of candidate headers, in list order, which the caller
+            must check for the name; NULL if there is no index and the
+            caller must scan the list
+*/
+
+header_line **
+header_index_find(const uschar * name, int len, int * count)
+{
+unsigned g;
+
+if (  (!hx_hdrs || hx_list != header_list || hx_last != header_last
+      || (header_last && header_last->next))
+   && !header_index_build())
+  return NULL;
+
+g = header_name_hash(name, len) & hx_mask;
+*count = hx_start[g+1] - hx_start[g];
+return hx_hdrs + hx_start[g];
+}
+
 /* The header_last variable points to the last header during message reception
 and delivery; otherwise it is NULL. We add new headers only when header_last is
 not NULL. The function may get called sometimes when it is NULL (e.g. during
@@ -194,6 +310,7 @@ for (p = q = gs.s; *p; p = q)
   hptr = &new->next;
 
   if (!h) header_last = new;
+  else header_index_reset();
   }
 return new;
 }
@@ -283,9 +400,12 @@ Returns:        nothing
 void
 header_remove(int occ, const uschar *name)
 {
-int hcount = 0;
+int hcount = 0, hn;
 int len = Ustrlen(name);
-for (header_line * h = header_list; h; h = h->next)
+header_line ** hv = header_index_find(name, len, &hn);
+header_line * h = hv ? hn > 0 ? hv[0] : NULL : header_list;
+
+for (int i = 0; h; h = hv ? ++i < hn ? hv[i] : NULL : h->next)
   if (header_testname(h, name, len, TRUE) && (occ <= 0 || ++hcount == occ))
     {
     h->type = htype_old;
@@ -374,6 +494,8 @@ one_pattern_match(uschar * name, int slen, BOOL has_addresses, uschar * pattern)
 {
 BOOL yield = FALSE;
 const pcre2_code *re = NULL;
+header_line ** hv = NULL, * h;
+int hn;
 
 /* If the pattern is a regex, compile it. Bomb out if compiling fails; these
 patterns are all constructed internally and should be valid. */
@@ -382,7 +504,11 @@ if (*pattern == '^') re = regex_must_compile(pattern, MCS_CASELESS, FALSE);
 
 /* Scan for the required header(s) and scan each one */
 
-for (header_line * h = header_list; !yield && h; h = h->next)
+if (slen > 0 && name[slen-1] == ':')
+  hv = header_index_find(name, slen, &hn);
+h = hv ? hn > 0 ? hv[0] : NULL : header_list;
+
+for (int i = 0; !yield && h; h = hv ? ++i < hn ? hv[i] : NULL : h->next)
   {
   if (h->type == htype_old || slen > h->slen ||
       strncmpic(name, h->text, slen) != 0)
@@ -50,7 +50,7 @@ static inline EXIM_DB *
 exim_dbopen__(const uschar * name, const uschar * dirname, int flags,
   unsigned mode)
 {
-return tdb_open(CS name, 0, TDB_DEFAULT, flags, mode);
+return tdb_open(CS name, 0, TDB_DEFAULT|TDB_NOSYNC, flags, mode);
 }
 
 /* EXIM_DBGET - returns TRUE if successful, FALSE otherwise */
@@ -113,6 +113,29 @@ static inline void
 exim_dbclose__(EXIM_DB * db)
 { tdb_close(db); }
 
+/* EXIM_DBCOMPACT - rewrite the file without the space left by deleted
+records.  Returns TRUE if that was done. */
+
+# define EXIM_DBCOMPACT
+static inline BOOL
+exim_dbcompact(EXIM_DB * dbp)
+{ return tdb_repack(dbp) == 0; }
+
+/* EXIM_DBTRANSACTION_START - collect the following writes for application
+as a unit.  Returns TRUE if a transaction was begun; if not, writes go
+directly to the file as usual.  The Exim lockfile already serialises access,
+so the open uses TDB_NOSYNC and the commit is not fsync'd. */
+
+# define EXIM_DBTRANSACTIONS
+static inline BOOL
+exim_dbtransaction_start(EXIM_DB * dbp)
+{ return tdb_transaction_start(dbp) == 0; }
+
+/* EXIM_DBTRANSACTION_COMMIT */
+static inline void
+exim_dbtransaction_commit(EXIM_DB * dbp)
+{ (void) tdb_transaction_commit(dbp); }
+
 /* Datum access */
 
 static inline uschar *
@@ -153,6 +176,231 @@ d->dptr = NULL;
 
 
 
+#elif defined(USE_LMDB)
+
+/* ************************* lmdb interface ************************ */
+/* Each open of a file holds a single LMDB transaction, read-only for an
+O_RDONLY open and a write transaction otherwise, which is committed when the
+file is closed.  Readers work from a consistent snapshot and never wait for a
+writer, so dbfn_open() takes no lockfile for them; writers are serialised both
+by LMDB and by the Exim lockfile. */
+
+# include <lmdb.h>
+
+/* Basic DB type */
+typedef struct {
+  MDB_env *	env;
+  MDB_txn *	txn;
+  MDB_dbi	dbi;
+  BOOL		rdonly;
+} EXIM_DB;
+
+/* Cursor type */
+# define EXIM_CURSOR MDB_cursor
+
+/* The datum type used for queries */
+# define EXIM_DATUM MDB_val
+
+/* Some text for messages */
+# define EXIM_DBTYPE "lmdb"
+
+/* Readers need no lock */
+# define EXIM_DB_MVCC_READERS
+
+/* An extra open flag for a file that is only ever replaced by renaming, never
+written in place (a dbm lookup file). A reader of such a file needs no LMDB
+lockfile, and without one it can safely have it open more than once, as
+lookups of different types do; LMDB does not allow that for an environment
+with a lockfile, as closing one drops the process's locks for the other. */
+# define EXIM_DBOPEN_RENAMED 0x40000000
+
+/* The map is sized once, at open; it only costs address space, the file
+grows as needed. */
+# ifndef EXIM_LMDB_MAPSIZE
+#  define EXIM_LMDB_MAPSIZE (1024UL*1024*1024)
+# endif
+
+/* Access functions */
+
+/* EXIM_DBOPEN - return pointer to an EXIM_DB, NULL if failed.
+LMDB creates a file which does not exist, so check first unless creation was
+asked for.  An exclusive create (the temporary file of exim_dbmbuild) cannot
+be in use by anyone else and needs no LMDB lockfile.  If a read-only open
+cannot create the LMDB lockfile, because the directory is not writable (as for
+a dbm lookup file), read without one; such files are replaced by renaming
+rather than being written in place. */
+
+static inline EXIM_DB *
+exim_dbopen__(const uschar * name, const uschar * dirname, int flags,
+  unsigned mode)
+{
+EXIM_DB * dbp;
+MDB_env * env;
+MDB_txn * txn;
+MDB_dbi dbi;
+BOOL rdonly = !(flags & (O_RDWR|O_WRONLY));
+unsigned eflags = MDB_NOSUBDIR | MDB_NOSYNC | MDB_NOTLS;
+struct stat st;
+int ret;
+
+if (!(flags & O_CREAT) && stat(CCS name, &st) != 0)
+  return NULL;
+if (flags & O_EXCL && stat(CCS name, &st) == 0)
+  { errno = EEXIST; return NULL; }
+
+if (rdonly) eflags |= MDB_RDONLY;
+if (flags & O_EXCL || (rdonly && flags & EXIM_DBOPEN_RENAMED))
+  eflags |= MDB_NOLOCK;
+
+for (;;)
+  {
+  if ((ret = mdb_env_create(&env)))
+    { errno = ret; return NULL; }
+  (void) mdb_env_set_mapsize(env, EXIM_LMDB_MAPSIZE);
+  if ((ret = mdb_env_open(env, CCS name, eflags, mode)) == 0)
+    break;
+  mdb_env_close(env);
+  if (!rdonly || eflags & MDB_NOLOCK || (ret != EACCES && ret != EROFS))
+    { errno = ret > 0 ? ret : EINVAL; return NULL; }
+  eflags |= MDB_NOLOCK;
+  }
+
+if ((ret = mdb_txn_begin(env, NULL, rdonly ? MDB_RDONLY : 0, &txn)))
+  {
+  mdb_env_close(env);
+  errno = ret > 0 ? ret : EINVAL;
+  return NULL;
+  }
+if ((ret = mdb_dbi_open(txn, NULL, 0, &dbi)))
+  {
+  mdb_txn_abort(txn);
+  mdb_env_close(env);
+  errno = ret > 0 ? ret : EINVAL;
+  return NULL;
+  }
+
+if (!(dbp = malloc(sizeof(EXIM_DB))))
+  {
+  mdb_txn_abort(txn);
+  mdb_env_close(env);
+  return NULL;
+  }
+dbp->env = env;
+dbp->txn = txn;
+dbp->dbi = dbi;
+dbp->rdonly = rdonly;
+return dbp;
+}
+
+/* EXIM_DBGET - returns TRUE if successful, FALSE otherwise.  The data
+remains valid until the file is closed. */
+static inline BOOL
+exim_dbget(EXIM_DB * dbp, EXIM_DATUM * key, EXIM_DATUM * res)
+{ return mdb_get(dbp->txn, dbp->dbi, key, res) == 0; }
+
+/* EXIM_DBPUT - returns nothing useful, assumes replace mode */
+static inline int
+exim_dbput(EXIM_DB * dbp, EXIM_DATUM * key, EXIM_DATUM * data)
+{ return mdb_put(dbp->txn, dbp->dbi, key, data, 0); }
+
+/* EXIM_DBPUTB - non-overwriting for use by dbmbuild */
+static inline int
+exim_dbputb(EXIM_DB * dbp, EXIM_DATUM * key, EXIM_DATUM * data)
+{ return mdb_put(dbp->txn, dbp->dbi, key, data, MDB_NOOVERWRITE); }
+
+/* Returns from EXIM_DBPUTB */
+
+# define EXIM_DBPUTB_OK  0
+# define EXIM_DBPUTB_DUP MDB_KEYEXIST
+
+/* EXIM_DBDEL */
+static inline int
+exim_dbdel(EXIM_DB * dbp, EXIM_DATUM * key)
+{ return mdb_del(dbp->txn, dbp->dbi, key, NULL); }
+
+/* EXIM_DBCREATE_CURSOR - initialize for scanning operation */
+static inline EXIM_CURSOR *
+exim_dbcreate_cursor(EXIM_DB * dbp)
+{
+EXIM_CURSOR * c;
+return mdb_cursor_open(dbp->txn, dbp->dbi, &c) == 0 ? c : NULL;
+}
+
+/* EXIM_DBSCAN */
+static inline BOOL
+exim_dbscan(EXIM_DB * dbp, EXIM_DATUM * key, EXIM_DATUM * res, BOOL first,
+  EXIM_CURSOR * cursor)
+{
+return cursor
+  && mdb_cursor_get(cursor, key, res, first ? MDB_FIRST : MDB_NEXT) == 0;
+}
+
+/* EXIM_DBDELETE_CURSOR - terminate scanning operation. */
+static inline void
+exim_dbdelete_cursor(EXIM_CURSOR * cursor)
+{ if (cursor) mdb_cursor_close(cursor); }
+
+/* EXIM_DBCLOSE - commits any writes */
+static inline void
+exim_dbclose__(EXIM_DB * dbp)
+{
+if (dbp->rdonly)
+  mdb_txn_abort(dbp->txn);
+else
+  (void) mdb_txn_commit(dbp->txn);
+mdb_env_close(dbp->env);
+free(dbp);
+}
+
+/* EXIM_DBTRANSACTION_START - the writes made under one open are already a
+single LMDB transaction, committed at close. */
+
+# define EXIM_DBTRANSACTIONS
+static inline BOOL
+exim_dbtransaction_start(EXIM_DB * dbp)
+{ return !dbp->rdonly; }
+
+/* EXIM_DBTRANSACTION_COMMIT */
+static inline void
+exim_dbtransaction_commit(EXIM_DB * dbp)
+{ }
+
+/* Datum access */
+
+static inline uschar *
+exim_datum_data_get(EXIM_DATUM * dp)
+{ return US dp->mv_data; }
+static inline void
+exim_datum_data_set(EXIM_DATUM * dp, void * s)
+{ dp->mv_data = s; }
+
+static inline unsigned
+exim_datum_size_get(EXIM_DATUM * dp)
+{ return dp->mv_size; }
+static inline void
+exim_datum_size_set(EXIM_DATUM * dp, unsigned n)
+{ dp->mv_size = n; }
+
+/* No initialization is needed. */
+
+static inline void
+exim_datum_init(EXIM_DATUM * d)
+{ }
+
+/* Data returned by a read belongs to the map; nothing to free. */
+
+static inline void
+exim_datum_free(EXIM_DATUM * d)
+{ }
+
+/* size limit */
+
+# define EXIM_DB_RLIMIT	150
+
+
+
+
+
 /********************* Berkeley db native definitions **********************/
 
 #elif defined USE_DB
@@ -318,6 +566,20 @@ b->close(b, 0);
 dbp->close(dbp, DB_FORCESYNC);
 }
 
+/* EXIM_DBCOMPACT - give the space left by deleted records back to the
+filesystem.  From 4.4; where the access method does not support it the
+call fails and nothing is done. */
+
+#   if DB_VERSION_MAJOR > 4 || (DB_VERSION_MAJOR == 4 && DB_VERSION_MINOR >= 4)
+#    define EXIM_DBCOMPACT
+static inline BOOL
+exim_dbcompact(EXIM_DB * dbp)
+{
+DB * b = ENV_TO_DB(dbp);
+return b->compact(b, NULL, NULL, NULL, NULL, DB_FREE_SPACE, NULL) == 0;
+}
+#   endif
+
 /* Datum access */
 
 static inline uschar *
@@ -582,6 +844,14 @@ if ((s = dbp->lkey.dptr)) free(s);
 free(dbp);
 }
 
+/* EXIM_DBCOMPACT - rewrite the file without the space left by deleted
+records.  Returns TRUE if that was done. */
+
+# define EXIM_DBCOMPACT
+static inline BOOL
+exim_dbcompact(EXIM_DB * dbp)
+{ return gdbm_reorganize(dbp->gdbm) == 0; }
+
 /* Datum access types */
 
 static inline uschar *
@@ -748,6 +1018,34 @@ exim_datum_free(EXIM_DATUM * d)
 #endif /* USE_GDBM */
 
 
+#ifndef EXIM_DBTRANSACTIONS
+/* For backends without transactions the writes go straight to the file,
+under the protection of the lockfile. */
+
+static inline BOOL
+exim_dbtransaction_start(EXIM_DB * dbp)
+{ return FALSE; }
+
+static inline void
+exim_dbtransaction_commit(EXIM_DB * dbp)
+{ }
+#endif
+
+#ifndef EXIM_DBCOMPACT
+/* Other backends reuse the freed space themselves, or have no way of giving
+it back. */
+
+static inline BOOL
+exim_dbcompact(EXIM_DB * dbp)
+{ return FALSE; }
+#endif
+
+#ifndef EXIM_DBOPEN_RENAMED
+/* Other backends open a file replaced by renaming like any other. */
+# define EXIM_DBOPEN_RENAMED 0
+#endif
+
+
 
 
 
@@ -776,12 +1074,13 @@ exim_dbopen(const uschar * name, const uschar * dirname, int flags,
   unsigned mode)
 {
 void * dbp;
+int oflags = flags & ~EXIM_DBOPEN_RENAMED;
 DEBUG(D_hints_lookup)
   debug_printf_indent("EXIM_DBOPEN: file <%s> dir <%s> flags=%s\n",
     name, dirname,
-    flags == O_RDONLY ? "O_RDONLY"
-    : flags == O_RDWR ? "O_RDWR"
-    : flags == (O_RDWR|O_CREAT) ? "O_RDWR|O_CREAT"
+    oflags == O_RDONLY ? "O_RDONLY"
+    : oflags == O_RDWR ? "O_RDWR"
+    : oflags == (O_RDWR|O_CREAT) ? "O_RDWR|O_CREAT"
     : "??");
 if (is_tainted(name) || is_tainted(dirname))
   {
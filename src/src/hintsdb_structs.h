@@ -113,16 +113,16 @@ record, as defined below. The keys used for a specific type all start with a
 given string such as "etrn-" or "host-serialize-". */
 
 
-/* This structure records a connection to a particular host, for the
-purpose of serializing access to certain hosts. For possible future extension,
-a field is defined for holding the count of connections, but it is not
-at present in use. The same structure is used for recording a running ETRN
-process. */
+/* This structure records the connections to a particular host, for the
+purpose of serializing access to certain hosts, with a count of them. The same
+structure is used for recording a running ETRN process, and the transports
+running under a max_parallel limit. In "host-limit-" records the count is an
+adaptive limit on the connections to the host. */
 
 typedef struct {
   time_t time_stamp;
   /*************/
-  int    count;           /* Reserved for possible connection count */
+  int    count;           /* Connection count, or limit */
 } dbdata_serialize;
 
 
@@ -185,6 +185,84 @@ typedef struct {
   uschar session[1];
 } dbdata_tls_session;
 
+/* For the DKIM public-key cache.  The record text follows the structure, and
+the length of the database record gives its length. */
+
+typedef struct {
+  time_t time_stamp;       /* Timestamp of writing */
+  /*************/
+  time_t expiry;           /* When the key record must be fetched again */
+  unsigned hits;           /* Times used from the cache */
+  unsigned fetches;        /* Times fetched from the DNS */
+  uschar dnssec;           /* 0: not requested, 1: not authenticated, 2: yes */
+  uschar record[1];        /* The TXT record, NUL-terminated */
+} dbdata_dkim_key;
+
+/* For the cache of parsed filters.  The filter text follows the structure,
+and then the parsed commands in the form written by filter.c. */
+
+typedef struct {
+  time_t time_stamp;       /* Timestamp of writing */
+  /*************/
+  int    text_len;         /* Length of the filter text */
+  uschar data[1];          /* The text, not terminated, then the commands */
+} dbdata_filter;
+
+/* For spool_dedup_size.  The key is the queue name, body size and body hash;
+the record names the last message seen with that body. */
+
+typedef struct {
+  time_t time_stamp;       /* Timestamp of writing */
+  /*************/
+  uschar subdir;           /* Spool sub-directory character, or 0 */
+  uschar id[MESSAGE_ID_LENGTH+1];
+} dbdata_body;
+
+/* For the dnslookup router's host_cache.  The key is the router name, the
+lookup flags and the domain.  The fully qualified name follows the structure,
+then for each host its name, its address, and a line of numbers: MX value,
+port, sort key and DNSSEC status, all NUL-terminated. */
+
+typedef struct {
+  time_t time_stamp;       /* Timestamp of writing */
+  /*************/
+  time_t expiry;           /* When the hosts must be looked up again */
+  unsigned hits;           /* Times used from the cache */
+  unsigned count;          /* Number of hosts */
+  uschar yield;            /* HOST_FOUND or HOST_FOUND_LOCAL */
+  uschar removed;          /* The local host was removed from the list */
+  uschar data[1];          /* The strings */
+} dbdata_hostcache;
+
+/* For malware_verdict_cache and spam_verdict_cache.  The key is the kind of
+scan, the scanner settings and the body hash.  For malware the data is the
+name found, if any; for spam it is the action and then the report, both
+NUL-terminated. */
+
+typedef struct {
+  time_t time_stamp;       /* Timestamp of writing */
+  /*************/
+  time_t expiry;           /* When the content must be scanned again */
+  unsigned hits;           /* Times used from the cache */
+  uschar found;            /* Malware was found */
+  double score;            /* Spam score */
+  double threshold;        /* Spam threshold */
+  uschar data[1];          /* The strings */
+} dbdata_scan_verdict;
+
+/* For bounce_digest_window.  The key is the address bounces go to; the
+record holds the failures not yet reported to it, as the text for the
+digest. */
+
+typedef struct {
+  time_t time_stamp;       /* Timestamp of writing */
+  /*************/
+  time_t window_end;       /* When the held failures must be reported */
+  unsigned messages;       /* Messages with failures held */
+  unsigned unlisted;       /* Of those, ones left out of the text */
+  int    text_len;         /* Length of the text */
+  uschar text[1];          /* The failures, not terminated */
+} dbdata_bounce_digest;
 
 #endif	/* whole file */
 /* End of hintsdb_structs.h */
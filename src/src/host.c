@@ -2492,6 +2492,57 @@ Returns:                HOST_FIND_FAILED  Failed to find the host or domain;
                                           an address of the local host
 */
 
+/*************************************************
+*    Send the address lookups of a host list     *
+*************************************************/
+
+/* Called from host_find_bydns() once the MX or SRV hosts are known, to have
+the AAAA and A lookups that set_address_from_dns() will make for them all sent
+together, with one timeout.  The DNS code holds the answers, which are used as
+the hosts are worked through in order; dns_prefetch_clear() discards any left
+over.  Names that are IP addresses, and hosts that match dns_ipv4_lookup, are
+left to the normal path.
+
+Arguments:
+  host       the first host item
+  last       the last host item
+  whichrrs   HOST_FIND_BY_A, and HOST_FIND_BY_AAAA if wanted
+
+Returns:     TRUE if lookups were sent
+*/
+
+#define HOST_PREFETCH_MAX 64
+
+static BOOL
+host_find_prefetch(host_item * host, host_item * last, int whichrrs)
+{
+const uschar * names[HOST_PREFETCH_MAX];
+int types[2], ntypes = 0, count = 0;
+
+#if HAVE_IPV6
+if (!disable_ipv6 && whichrrs & HOST_FIND_BY_AAAA) types[ntypes++] = T_AAAA;
+#endif
+types[ntypes++] = T_A;
+
+for (host_item * h = host; h != last->next && count < HOST_PREFETCH_MAX;
+     h = h->next)
+  if (  !h->address
+     && string_is_ip_address(h->name, NULL) == 0
+#ifndef STAND_ALONE
+     && !(  ntypes > 1 && dns_ipv4_lookup
+	 && match_isinlist(h->name, CUSS &dns_ipv4_lookup, 0,
+	      &domainlist_anchor, NULL, MCL_DOMAIN, TRUE, NULL) == OK)
+#endif
+     )
+    names[count++] = h->name;
+
+if (count * ntypes < 2) return FALSE;
+dns_prefetch_types(names, count, types, ntypes);
+return TRUE;
+}
+
+
+
 int
 host_find_bydns(host_item *host, const uschar *ignore_target_hosts, int whichrrs,
   uschar *srv_service, uschar *srv_fail_domains, uschar *mx_fail_domains,
@@ -2512,6 +2563,7 @@ BOOL dnssec_request = dnssec_require
        && match_isinlist(host->name, CUSS &dnssec_d->request,
 		    0, &domainlist_anchor, NULL, MCL_DOMAIN, TRUE, NULL) == OK);
 dnssec_status_t dnssec;
+BOOL prefetched;
 
 /* Set the default fully qualified name to the incoming name, initialize the
 resolver if necessary, set up the relevant options, and initialize the flag
@@ -2985,6 +3037,12 @@ yield = HOST_FIND_FAILED;    /* Default yield */
 dns_init(FALSE, FALSE,       /* Disable qualify_single and search_parents */
 	 dnssec_request || dnssec_require);
 
+/* Send the address lookups for all the hosts together, so that the loop
+below finds the answers ready. */
+
+prefetched = host_find_prefetch(host, last,
+  whichrrs & HOST_FIND_IPV4_ONLY ? HOST_FIND_BY_A : HOST_FIND_BY_A | HOST_FIND_BY_AAAA);
+
 for (h = host; h != last->next; h = h->next)
   {
   if (h->address) continue;  /* Inserted by a multihomed host */
@@ -3005,6 +3063,7 @@ for (h = host; h != last->next; h = h->next)
       }
     }
   }
+if (prefetched) dns_prefetch_clear();
 
 /* Scan the list for any hosts that are marked unusable because they have
 been explicitly ignored, and remove them from the list, as if they did not
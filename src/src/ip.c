@@ -382,6 +382,57 @@ return -1;
 
 
 
+/*************************************************
+*     Start a non-blocking connection            *
+*************************************************/
+
+/* This is used when racing connections to several hosts. The socket is
+left non-blocking; the caller polls it for completion (writability) and is
+responsible for restoring blocking mode on the one it keeps.
+
+Arguments:
+  sock        the socket
+  af          AF_INET6 or AF_INET for the socket type
+  address     the remote address, in text form
+  port        the remote port
+  fastopen    TRUE if TCP Fast Open (with no early-data) may be requested
+
+Returns:      1 if the connection is under way using TFO
+              0 if it is under way (or complete) without TFO
+              -1 on failure, with errno set
+*/
+
+int
+ip_connect_start(int sock, int af, const uschar * address, int port,
+  BOOL fastopen)
+{
+union sockaddr_46 sin;
+int s_len = ip_addr(&sin, af, address, port);
+
+(void) fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+#if defined(EXIM_SUPPORT_TFO) && defined(MSG_FASTOPEN)
+if (fastopen && f.tcp_fastopen_ok)
+  {
+  if (  sendto(sock, NULL, 0, MSG_FASTOPEN | MSG_DONTWAIT, &sin.v0, s_len) >= 0
+     || errno == EINPROGRESS)
+    {
+    DEBUG(D_transport|D_v)
+      debug_printf(" TFO mode connection attempt to %s\n", address);
+    return 1;
+    }
+  if (errno != EOPNOTSUPP && errno != EPIPE)
+    return -1;
+  DEBUG(D_transport) debug_printf("Tried TCP Fast Open but not usable\n");
+  }
+#endif
+
+DEBUG(D_transport|D_v) debug_printf(" connection attempt to %s\n", address);
+return connect(sock, &sin.v0, s_len) >= 0 || errno == EINPROGRESS ? 0 : -1;
+}
+
+
+
 /*************************************************
 *    Create connected socket to remote host      *
 *************************************************/
@@ -18,9 +18,9 @@ log files was originally contributed by Tony Sheen. */
 #define LOG_MODE_FILE   1
 #define LOG_MODE_SYSLOG 2
 
-enum { lt_main, lt_reject, lt_panic, lt_debug };
+enum { lt_main, lt_reject, lt_panic, lt_debug, lt_json };
 
-static uschar *log_names[] = { US"main", US"reject", US"panic", US"debug" };
+static uschar *log_names[] = { US"main", US"reject", US"panic", US"debug", US"json" };
 
 
 
@@ -30,14 +30,18 @@ static uschar *log_names[] = { US"main", US"reject", US"panic", US"debug" };
 
 static uschar mainlog_name[LOG_NAME_SIZE];
 static uschar rejectlog_name[LOG_NAME_SIZE];
+static uschar jsonlog_name[LOG_NAME_SIZE];
 
 static uschar *mainlog_datestamp = NULL;
 static uschar *rejectlog_datestamp = NULL;
+static uschar *jsonlog_datestamp = NULL;
 
 static int    mainlogfd = -1;
 static int    rejectlogfd = -1;
+static int    jsonlogfd = -1;
 static ino_t  mainlog_inode = 0;
 static ino_t  rejectlog_inode = 0;
+static ino_t  jsonlog_inode = 0;
 
 static uschar *panic_save_buffer = NULL;
 static BOOL   panic_recurseflag = FALSE;
@@ -116,6 +120,7 @@ static const uschar * exim_errstrings[] = {
   [- ERRNO_TRETRY] =		US"Transport concurrency limit",
 
   [- ERRNO_EVENT] =		US"Event requests alternate response",
+  [- ERRNO_MEMLIMIT] =		US"Pool store over store_soft_limit",
 };
 
 
@@ -467,7 +472,7 @@ avoid races.
 
 Arguments:
   fd         where to return the resulting file descriptor
-  type       lt_main, lt_reject, lt_panic, or lt_debug
+  type       lt_main, lt_reject, lt_panic, lt_debug or lt_json
   tag        optional tag to include in the name (only hooked up for debug)
 
 Returns:   nothing
@@ -510,6 +515,13 @@ switch (type)
       rejectlog_datestamp = rejectlog_name + string_datestamp_offset;
     break;
 
+  case lt_json:
+    /* Ditto for the JSON log */
+    Ustrcpy(jsonlog_name, buffer);
+    if (string_datestamp_offset > 0)
+      jsonlog_datestamp = jsonlog_name + string_datestamp_offset;
+    break;
+
   case lt_debug:
     /* and deal with the debug log (which keeps the datestamp, but does not
     update it) */
@@ -750,6 +762,341 @@ mainlogfd = -1;
 mainlog_inode = 0;
 }
 
+/*************************************************
+*         Write to the main or reject log         *
+*************************************************/
+
+/* A real file gets left open during reception or delivery once it has been
+opened, but we don't want to keep on writing to it for too long after it has
+been renamed. Therefore, do a stat() and see if the inode has changed, and if
+so, re-open.
+
+Arguments:
+  s		the text, one or more complete lines
+  len		its length
+*/
+
+static void
+mainlog_write(const uschar * s, int len)
+{
+struct stat statbuf;
+ssize_t written_len;
+
+/* Check for a change to the mainlog file name when datestamping is in
+operation. This happens at midnight, at which point we want to roll over
+the file. Closing it has the desired effect. */
+
+if (mainlog_datestamp)
+  {
+  uschar *nowstamp = tod_stamp(string_datestamp_type);
+  if (Ustrncmp (mainlog_datestamp, nowstamp, Ustrlen(nowstamp)) != 0)
+    {
+    (void)close(mainlogfd);       /* Close the file */
+    mainlogfd = -1;               /* Clear the file descriptor */
+    mainlog_inode = 0;            /* Unset the inode */
+    mainlog_datestamp = NULL;     /* Clear the datestamp */
+    }
+  }
+
+/* Otherwise, we want to check whether the file has been renamed by a
+cycling script. This could be "if else", but for safety's sake, leave it as
+"if" so that renaming the log starts a new file even when datestamping is
+happening. */
+
+if (mainlogfd >= 0)
+  if (Ustat(mainlog_name, &statbuf) < 0 || statbuf.st_ino != mainlog_inode)
+    mainlog_close();
+
+/* If the log is closed, open it. Then write the line. */
+
+if (mainlogfd < 0)
+  {
+  open_log(&mainlogfd, lt_main, NULL);     /* No return on error */
+  if (fstat(mainlogfd, &statbuf) >= 0) mainlog_inode = statbuf.st_ino;
+  }
+
+/* Failing to write to the log is disastrous */
+
+written_len = write_to_fd_buf(mainlogfd, s, len);
+if (written_len != len)
+  {
+  log_write_failed(US"main log", len, written_len);
+  /* That function does not return */
+  }
+}
+
+
+static void
+rejectlog_write(const uschar * s, int len)
+{
+struct stat statbuf;
+ssize_t written_len;
+
+/* Check for a change to the rejectlog file name when datestamping is in
+operation. This happens at midnight, at which point we want to roll over
+the file. Closing it has the desired effect. */
+
+if (rejectlog_datestamp)
+  {
+  uschar *nowstamp = tod_stamp(string_datestamp_type);
+  if (Ustrncmp (rejectlog_datestamp, nowstamp, Ustrlen(nowstamp)) != 0)
+    {
+    (void)close(rejectlogfd);       /* Close the file */
+    rejectlogfd = -1;               /* Clear the file descriptor */
+    rejectlog_inode = 0;            /* Unset the inode */
+    rejectlog_datestamp = NULL;     /* Clear the datestamp */
+    }
+  }
+
+/* Otherwise, we want to check whether the file has been renamed by a
+cycling script. This could be "if else", but for safety's sake, leave it as
+"if" so that renaming the log starts a new file even when datestamping is
+happening. */
+
+if (rejectlogfd >= 0)
+  if (Ustat(rejectlog_name, &statbuf) < 0 ||
+       statbuf.st_ino != rejectlog_inode)
+    {
+    (void)close(rejectlogfd);
+    rejectlogfd = -1;
+    rejectlog_inode = 0;
+    }
+
+/* Open the file if necessary, and write the data */
+
+if (rejectlogfd < 0)
+  {
+  open_log(&rejectlogfd, lt_reject, NULL); /* No return on error */
+  if (fstat(rejectlogfd, &statbuf) >= 0) rejectlog_inode = statbuf.st_ino;
+  }
+
+written_len = write_to_fd_buf(rejectlogfd, s, len);
+if (written_len != len)
+  {
+  log_write_failed(US"reject log", len, written_len);
+  /* That function does not return */
+  }
+}
+
+
+/* The JSON log is handled in the same way */
+
+static void
+jsonlog_write(const uschar * s, int len)
+{
+struct stat statbuf;
+ssize_t written_len;
+
+if (jsonlog_datestamp)
+  {
+  uschar *nowstamp = tod_stamp(string_datestamp_type);
+  if (Ustrncmp (jsonlog_datestamp, nowstamp, Ustrlen(nowstamp)) != 0)
+    {
+    (void)close(jsonlogfd);
+    jsonlogfd = -1;
+    jsonlog_inode = 0;
+    jsonlog_datestamp = NULL;
+    }
+  }
+
+if (jsonlogfd >= 0)
+  if (Ustat(jsonlog_name, &statbuf) < 0 || statbuf.st_ino != jsonlog_inode)
+    {
+    (void)close(jsonlogfd);
+    jsonlogfd = -1;
+    jsonlog_inode = 0;
+    }
+
+if (jsonlogfd < 0)
+  {
+  open_log(&jsonlogfd, lt_json, NULL);	/* No return on error */
+  if (fstat(jsonlogfd, &statbuf) >= 0) jsonlog_inode = statbuf.st_ino;
+  }
+
+written_len = write_to_fd_buf(jsonlogfd, s, len);
+if (written_len != len)
+  {
+  log_write_failed(US"json log", len, written_len);
+  /* That function does not return */
+  }
+}
+
+
+
+/*************************************************
+*        Ship log lines to the daemon            *
+*************************************************/
+
+/* With log_via_daemon set, lines for the main, reject and JSON logs are sent over
+the daemon's notifier socket instead of being written by each process.  The
+daemon gathers them for the time given by the option and writes each log once
+for the lot, so that busy processes do not contend for the files or wait on
+the disk.  Sending does not block: if the daemon cannot be reached, or is not
+keeping up, the line is written directly as usual.  Lines for the panic log,
+and main log lines that are also panics, are always written directly.
+
+The daemon accepts lines only from root or the Exim user, by the credentials
+on the socket, so they are only sent from processes whose real uid is one of
+those, and only where the credentials can be checked. */
+
+#if defined(SCM_CREDENTIALS) || defined(LOCAL_CREDS) && defined(SCM_CREDS)
+# define LOG_SHIP_OK
+#endif
+
+#define LOG_BATCH_SIZE	65536		/* for each log, in the daemon */
+
+static int	log_ship_fd = -1;
+static BOOL	log_ship_failed = FALSE;
+static struct sockaddr_un log_ship_addr = {.sun_family = AF_UNIX};
+static socklen_t log_ship_addrlen = 0;
+
+static uschar *	log_batch[3] = { NULL, NULL, NULL };	/* main, reject, json */
+static int	log_batch_len[3] = { 0, 0, 0 };
+static pid_t	log_batch_pid = 0;
+static struct timeval log_batch_deadline;
+
+
+/* Send a line.  Returns TRUE if it was sent; FALSE if it should be written
+directly. */
+
+static BOOL
+log_ship(int type, const gstring * g)
+{
+#ifdef LOG_SHIP_OK
+uschar hdr[2] = { NOTIFY_LOG_WRITE, (uschar)type };
+struct iovec iov[2] = { {.iov_base = hdr, .iov_len = sizeof(hdr)},
+			{.iov_base = g->s, .iov_len = g->ptr} };
+struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2};
+static BOOL in_ship = FALSE;
+uid_t uid;
+BOOL ok;
+
+if (  log_via_daemon < 0 || log_ship_failed || in_ship
+   || !notifier_socket || !*notifier_socket
+   || daemon_notifier_fd >= 0			/* we are the daemon */
+   || g->ptr + sizeof(hdr) >= NOTIFY_MSG_MAX
+   || ((uid = getuid()) != root_uid && uid != exim_uid))
+  return FALSE;
+
+in_ship = TRUE;
+if (log_ship_fd < 0)
+  {
+  log_ship_addrlen = (socklen_t)daemon_notifier_sockname(&log_ship_addr);
+#ifdef SOCK_CLOEXEC
+  log_ship_fd = socket(PF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+#else
+  if ((log_ship_fd = socket(PF_UNIX, SOCK_DGRAM, 0)) >= 0)
+    (void)fcntl(log_ship_fd, F_SETFD, fcntl(log_ship_fd, F_GETFD) | FD_CLOEXEC);
+#endif
+  if (log_ship_fd < 0) log_ship_failed = TRUE;
+  }
+
+msg.msg_name = &log_ship_addr;
+msg.msg_namelen = log_ship_addrlen;
+ok = log_ship_fd >= 0 && sendmsg(log_ship_fd, &msg, MSG_DONTWAIT) >= 0;
+in_ship = FALSE;
+return ok;
+#else
+return FALSE;
+#endif
+}
+
+
+/* Daemon side: note a line sent by another process.  The buffers are in
+malloc store, as the daemon's loop resets its pools.
+
+Arguments:
+  buf	the notifier message: type, log, then the line
+  len	its length
+*/
+
+void
+log_at_daemon(const uschar * buf, int len)
+{
+int i = buf[1] == lt_reject ? 1 : buf[1] == lt_json ? 2 : 0;
+
+buf += 2; len -= 2;
+if (len <= 0 || buf[len-1] != '\n') return;	/* only whole lines */
+
+if (log_batch_pid != getpid())
+  {
+  log_batch_len[0] = log_batch_len[1] = log_batch_len[2] = 0;
+  log_batch_pid = getpid();
+  }
+if (!log_batch[i]) log_batch[i] = store_malloc(LOG_BATCH_SIZE);
+
+if (log_batch_len[i] + len > LOG_BATCH_SIZE) log_daemon_flush(TRUE);
+
+if (!log_batch_len[0] && !log_batch_len[1] && !log_batch_len[2])
+  {
+  exim_gettime(&log_batch_deadline);
+  log_batch_deadline.tv_usec += log_via_daemon * 1000;
+  log_batch_deadline.tv_sec += log_batch_deadline.tv_usec / 1000000;
+  log_batch_deadline.tv_usec %= 1000000;
+  }
+memcpy(log_batch[i] + log_batch_len[i], buf, len);
+log_batch_len[i] += len;
+}
+
+
+/* Return the time, in milliseconds, until the gathered lines are due to be
+written, for use as a poll timeout: -1 if there are none. */
+
+int
+log_daemon_timeout(void)
+{
+struct timeval now;
+long ms;
+
+if (!log_batch_len[0] && !log_batch_len[1] && !log_batch_len[2]) return -1;
+exim_gettime(&now);
+ms = (log_batch_deadline.tv_sec - now.tv_sec) * 1000
+   + (log_batch_deadline.tv_usec - now.tv_usec) / 1000;
+return ms > 0 ? (int)ms : 0;
+}
+
+
+/* Write the gathered lines, if they are due or if forced.  A process forked
+from the daemon has copies of the buffers, and drops them.
+
+Argument:	TRUE to write them regardless of the time
+*/
+
+void
+log_daemon_flush(BOOL force)
+{
+if (!log_batch_len[0] && !log_batch_len[1] && !log_batch_len[2]) return;
+if (log_batch_pid != getpid())
+  { log_batch_len[0] = log_batch_len[1] = log_batch_len[2] = 0; return; }
+if (!force && log_daemon_timeout() != 0) return;
+
+DEBUG(D_any) debug_printf("log batch: %d main, %d reject, %d json bytes\n",
+  log_batch_len[0], log_batch_len[1], log_batch_len[2]);
+
+/* Clear the lengths first, as a failed write logs a panic */
+
+if (log_batch_len[0])
+  {
+  int len = log_batch_len[0];
+  log_batch_len[0] = 0;
+  mainlog_write(log_batch[0], len);
+  }
+if (log_batch_len[1])
+  {
+  int len = log_batch_len[1];
+  log_batch_len[1] = 0;
+  rejectlog_write(log_batch[1], len);
+  }
+if (log_batch_len[2])
+  {
+  int len = log_batch_len[2];
+  log_batch_len[2] = 0;
+  jsonlog_write(log_batch[2], len);
+  }
+}
+
+
+
 /*************************************************
 *            Write message to log file           *
 *************************************************/
@@ -918,6 +1265,7 @@ if (!path_inspected)
 
 if (flags & LOG_PANIC && dtrigger_selector & BIT(DTi_panictrigger))
   debug_trigger_fire();
+if (flags & LOG_PANIC) trace_ring_dump("panic");
 
 /* If debugging, show all log entries, but don't show headers. Do it all
 in one go so that it doesn't get split when multi-processing. */
@@ -1065,11 +1413,13 @@ if (!f.really_exim || f.log_testing_mode)
   return;
   }
 
+/* In the daemon, write out any lines gathered from other processes first,
+to keep the order. */
+
+log_daemon_flush(TRUE);
+
 /* Handle the main log. We know that either syslog or file logging (or both) is
-set up. A real file gets left open during reception or delivery once it has
-been opened, but we don't want to keep on writing to it for too long after it
-has been renamed. Therefore, do a stat() and see if the inode has changed, and
-if so, re-open. */
+set up. */
 
 if (  flags & LOG_MAIN
    && (!selector ||  selector & log_selector[0]))
@@ -1078,52 +1428,9 @@ if (  flags & LOG_MAIN
      && (syslog_duplication || !(flags & (LOG_REJECT|LOG_PANIC))))
     write_syslog(LOG_INFO, log_buffer);
 
-  if (logging_mode & LOG_MODE_FILE)
-    {
-    struct stat statbuf;
-
-    /* Check for a change to the mainlog file name when datestamping is in
-    operation. This happens at midnight, at which point we want to roll over
-    the file. Closing it has the desired effect. */
-
-    if (mainlog_datestamp)
-      {
-      uschar *nowstamp = tod_stamp(string_datestamp_type);
-      if (Ustrncmp (mainlog_datestamp, nowstamp, Ustrlen(nowstamp)) != 0)
-        {
-        (void)close(mainlogfd);       /* Close the file */
-        mainlogfd = -1;               /* Clear the file descriptor */
-        mainlog_inode = 0;            /* Unset the inode */
-        mainlog_datestamp = NULL;     /* Clear the datestamp */
-        }
-      }
-
-    /* Otherwise, we want to check whether the file has been renamed by a
-    cycling script. This could be "if else", but for safety's sake, leave it as
-    "if" so that renaming the log starts a new file even when datestamping is
-    happening. */
-
-    if (mainlogfd >= 0)
-      if (Ustat(mainlog_name, &statbuf) < 0 || statbuf.st_ino != mainlog_inode)
-	mainlog_close();
-
-    /* If the log is closed, open it. Then write the line. */
-
-    if (mainlogfd < 0)
-      {
-      open_log(&mainlogfd, lt_main, NULL);     /* No return on error */
-      if (fstat(mainlogfd, &statbuf) >= 0) mainlog_inode = statbuf.st_ino;
-      }
-
-    /* Failing to write to the log is disastrous */
-
-    written_len = write_gstring_to_fd_buf(mainlogfd, g);
-    if (written_len != g->ptr)
-      {
-      log_write_failed(US"main log", g->ptr, written_len);
-      /* That function does not return */
-      }
-    }
+  if (  logging_mode & LOG_MODE_FILE
+     && (flags & LOG_PANIC || !log_ship(lt_main, g)))
+    mainlog_write(g->s, g->ptr);
   }
 
 /* Handle the log for rejected messages. This can be globally disabled, in
@@ -1190,55 +1497,9 @@ if (flags & LOG_REJECT)
      && (syslog_duplication || !(flags & LOG_PANIC)))
     write_syslog(LOG_NOTICE, string_from_gstring(g));
 
-  /* Check for a change to the rejectlog file name when datestamping is in
-  operation. This happens at midnight, at which point we want to roll over
-  the file. Closing it has the desired effect. */
-
-  if (logging_mode & LOG_MODE_FILE)
-    {
-    struct stat statbuf;
-
-    if (rejectlog_datestamp)
-      {
-      uschar *nowstamp = tod_stamp(string_datestamp_type);
-      if (Ustrncmp (rejectlog_datestamp, nowstamp, Ustrlen(nowstamp)) != 0)
-        {
-        (void)close(rejectlogfd);       /* Close the file */
-        rejectlogfd = -1;               /* Clear the file descriptor */
-        rejectlog_inode = 0;            /* Unset the inode */
-        rejectlog_datestamp = NULL;     /* Clear the datestamp */
-        }
-      }
-
-    /* Otherwise, we want to check whether the file has been renamed by a
-    cycling script. This could be "if else", but for safety's sake, leave it as
-    "if" so that renaming the log starts a new file even when datestamping is
-    happening. */
-
-    if (rejectlogfd >= 0)
-      if (Ustat(rejectlog_name, &statbuf) < 0 ||
-           statbuf.st_ino != rejectlog_inode)
-        {
-        (void)close(rejectlogfd);
-        rejectlogfd = -1;
-        rejectlog_inode = 0;
-        }
-
-    /* Open the file if necessary, and write the data */
-
-    if (rejectlogfd < 0)
-      {
-      open_log(&rejectlogfd, lt_reject, NULL); /* No return on error */
-      if (fstat(rejectlogfd, &statbuf) >= 0) rejectlog_inode = statbuf.st_ino;
-      }
-
-    written_len = write_gstring_to_fd_buf(rejectlogfd, g);
-    if (written_len != g->ptr)
-      {
-      log_write_failed(US"reject log", g->ptr, written_len);
-      /* That function does not return */
-      }
-    }
+  if (  logging_mode & LOG_MODE_FILE
+     && (flags & LOG_PANIC || !log_ship(lt_reject, g)))
+    rejectlog_write(g->s, g->ptr);
   }
 
 
@@ -1293,6 +1554,134 @@ if (flags & LOG_PANIC)
 
 
 
+/*************************************************
+*            Build lines for the JSON log        *
+*************************************************/
+
+/* With log_json set, each arrival, delivery, deferral and failure is also
+written to the JSON log ("json" for the %s in log_file_path) as one object
+per line, with named and typed fields, so that consumers need not parse the
+main log.  The callers build an object with these functions after writing
+their main log line; when the option is not set, log_json_start() returns
+NULL, the others do nothing with that, and no formatting is done.  The line
+goes by the same route as the main log lines, so is batched by the daemon
+under log_via_daemon.  It is not written when logging only to syslog.
+
+Strings are quoted for JSON.  Bytes that do not form UTF-8 characters are
+written as \u00XX escapes, so that the output is always valid JSON. */
+
+/* Length of the UTF-8 character at s, or 0 if it is not one */
+
+static int
+json_utf8_len(const uschar * s)
+{
+int n = *s >= 0xf0 && *s <= 0xf4 ? 4
+      : *s >= 0xe0 ? 3
+      : *s >= 0xc2 && *s <= 0xdf ? 2 : 0;
+for (int i = 1; i < n; i++)
+  if ((s[i] & 0xc0) != 0x80) return 0;
+return n;
+}
+
+gstring *
+log_json_quote(gstring * g, const uschar * s)
+{
+const uschar * run = s;
+
+g = string_catn(g, US"\"", 1);
+for (const uschar * p = s; ; )
+  {
+  int c = *p, n;
+
+  if (c >= 0x20 && c < 0x7f && c != '"' && c != '\\')
+    { p++; continue; }
+  if (c >= 0x80 && (n = json_utf8_len(p)) > 0)
+    { p += n; continue; }
+
+  if (p > run) g = string_catn(g, run, p - run);
+  if (!c) break;
+  if (c == '"' || c == '\\')
+    g = string_fmt_append(g, "\\%c", c);
+  else
+    g = string_fmt_append(g, "\\u%04x", c);
+  run = ++p;
+  }
+return string_catn(g, US"\"", 1);
+}
+
+/* Start an object for an event.  The time (UTC, to the microsecond), the
+event name, the pid and the message id, if there is one, are always given.
+
+Returns:	the string being built, or NULL if there is no JSON log
+*/
+
+gstring *
+log_json_start(const uschar * event)
+{
+struct timeval now;
+struct tm * t;
+gstring * g;
+
+if (!log_json) return NULL;
+
+gettimeofday(&now, NULL);
+t = gmtime(&now.tv_sec);
+g = string_get_tainted(512, GET_TAINTED);	/* values will be tainted */
+g = string_fmt_append(g,
+  "{\"time\":\"%04d-%02d-%02dT%02d:%02d:%02d.%06ldZ\",\"event\":\"%s\",\"pid\":%d",
+  1900 + t->tm_year, 1 + t->tm_mon, t->tm_mday, t->tm_hour, t->tm_min,
+  t->tm_sec, (long)now.tv_usec, event, (int)getpid());
+if (*message_id)
+  g = log_json_str(g, "id", message_id);
+return g;
+}
+
+/* Add a string field; nothing is added for a NULL value */
+
+gstring *
+log_json_str(gstring * g, const char * name, const uschar * value)
+{
+if (!g || !value) return g;
+g = string_fmt_append(g, ",\"%s\":", name);
+return log_json_quote(g, value);
+}
+
+gstring *
+log_json_int(gstring * g, const char * name, long value)
+{
+return g ? string_fmt_append(g, ",\"%s\":%ld", name, value) : g;
+}
+
+gstring *
+log_json_bool(gstring * g, const char * name, BOOL value)
+{
+return g ? string_fmt_append(g, ",\"%s\":%s", name, value ? "true" : "false") : g;
+}
+
+/* A duration, as a number of seconds */
+
+gstring *
+log_json_time(gstring * g, const char * name, const struct timeval * tv)
+{
+return g
+  ? string_fmt_append(g, ",\"%s\":%ld.%06ld", name, (long)tv->tv_sec, (long)tv->tv_usec)
+  : g;
+}
+
+/* Finish the object and write it */
+
+void
+log_json_write(gstring * g)
+{
+if (!g || f.disable_logging || !path_inspected || !(logging_mode & LOG_MODE_FILE))
+  return;
+g = string_catn(g, US"}\n", 2);
+if (!log_ship(lt_json, g))
+  jsonlog_write(g->s, g->ptr);
+}
+
+
+
 /*************************************************
 *            Close any open log files            *
 *************************************************/
@@ -1300,10 +1689,13 @@ if (flags & LOG_PANIC)
 void
 log_close_all(void)
 {
+log_daemon_flush(TRUE);
 if (mainlogfd >= 0)
   { (void)close(mainlogfd); mainlogfd = -1; }
 if (rejectlogfd >= 0)
   { (void)close(rejectlogfd); rejectlogfd = -1; }
+if (jsonlogfd >= 0)
+  { (void)close(jsonlogfd); jsonlogfd = -1; }
 closelog();
 syslog_open = FALSE;
 }
@@ -0,0 +1,509 @@
+/*************************************************
+*     Exim - an Internet mail transport agent    *
+*************************************************/
+
+/*
+ * Copyright (c) The Exim Maintainers 2024
+ * License: GPL
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+/* A pool of long-lived processes doing lookups on behalf of others.
+
+Lookup drivers for network databases (mysql, pgsql, redis, ldap and so on)
+make their connections lazily and keep them only until search_tidyup(), which
+in practice means for the life of one short-lived process.  When the
+lookup_proxy option names such a type, the daemon starts lookup_proxy_processes
+helper processes that share a listening Unix-domain stream socket.  A process
+needing a lookup of one of those types connects, writes the request and shuts
+down its side of the connection (in the manner of the readsock lookup), then
+reads the response until end of file.  The helper does the lookup using the
+ordinary driver code, so its connections persist from one request to the next.
+
+Results are not cached in the helpers: the requesting process caches them as
+usual.  The helpers tidy their lookups every LOOKUP_PROXY_TIDY requests, to
+bound their memory use and to pick up changes in the backend servers.  If the
+helpers cannot be reached the requesting process does the lookup itself. */
+
+#include "exim.h"
+
+#ifndef COMPILE_UTILITY
+
+/* Request header.  It is followed by the lookup type name, the file name,
+the options and the key, each NUL-terminated. */
+
+typedef struct lp_req {
+  uschar	has_file;
+  uschar	has_opts;
+  uschar	file_tainted;
+  uschar	opts_tainted;
+  uschar	key_tainted;
+} lp_req;
+
+/* Response header.  It is followed by "datalen" bytes of data, then the
+NUL-terminated error message. */
+
+typedef struct lp_resp {
+  int		rc;			/* OK, FAIL or DEFER */
+  uint		do_cache;
+  int		datalen;		/* -1 for no data */
+  BOOL		tainted;
+} lp_resp;
+
+#define LOOKUP_PROXY_SOCKET_NAME "exim_lookup_proxy"
+#define LOOKUP_PROXY_MAXREQ	65536	/* largest request */
+#define LOOKUP_PROXY_TIDY	1000	/* requests between tidyups */
+#define LOOKUP_PROXY_TIMEOUT	(5*60)	/* seconds to wait for a response */
+
+/* Daemon-side state.  The slots are only meaningful in the daemon. */
+
+static int	lp_listen_fd = -1;
+static pid_t *	lp_pids = NULL;
+static time_t	lp_last_spawn = 0;
+
+/* Set when the helpers cannot be reached, so as not to keep trying */
+
+static BOOL	lp_unavailable = FALSE;
+
+
+
+static ssize_t
+lp_sockname(struct sockaddr_un * sup)
+{
+#ifdef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
+sup->sun_path[0] = 0;  /* Abstract local socket addr */
+return offsetof(struct sockaddr_un, sun_path) + 1
+  + snprintf(sup->sun_path+1, sizeof(sup->sun_path)-1, "%s/%s",
+	      spool_directory, LOOKUP_PROXY_SOCKET_NAME);
+#else
+return offsetof(struct sockaddr_un, sun_path)
+  + snprintf(sup->sun_path, sizeof(sup->sun_path), "%s/%s",
+	      spool_directory, LOOKUP_PROXY_SOCKET_NAME);
+#endif
+}
+
+
+/* Read from a socket until end of file, the buffer is full, or a timeout.
+Return the count read, or -1 on error. */
+
+static int
+lp_read_all(int fd, uschar * buf, int size, int timeout)
+{
+int len = 0;
+for (ssize_t n; len < size; len += n)
+  {
+  if (poll_one_fd(fd, POLLIN, timeout * 1000) != 1)
+    { errno = ETIMEDOUT; return -1; }
+  if ((n = read(fd, buf + len, size - len)) < 0) return -1;
+  if (n == 0) break;
+  }
+return len;
+}
+
+
+
+/******************************************************************************/
+/* Helper process */
+
+/* Check that the connected process is root or the Exim user */
+
+static BOOL
+lp_peer_ok(int fd)
+{
+#ifdef SO_PEERCRED				/* Linux */
+struct ucred cr;
+socklen_t len = sizeof(cr);
+
+if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cr, &len) < 0) return FALSE;
+if (cr.uid == root_uid || cr.uid == exim_uid) return TRUE;
+DEBUG(D_lookup) debug_printf("%s: refused pid %d uid %d\n", __FUNCTION__,
+  (int)cr.pid, (int)cr.uid);
+return FALSE;
+
+#else
+	/* Rely on the ownership and permissions of the socket, which is
+	in the filesystem on systems other than Linux. */
+return TRUE;
+#endif
+}
+
+
+/* Copy a string out of the request, with the given taint */
+
+static const uschar *
+lp_string(const uschar * s, BOOL present, BOOL tainted)
+{
+return present
+  ? string_copy_taint(s, tainted ? GET_TAINTED : GET_UNTAINTED) : NULL;
+}
+
+
+/* Handle one request on an accepted connection */
+
+static void
+lp_serve(int fd)
+{
+uschar * buf = store_get(LOOKUP_PROXY_MAXREQ + 1, GET_UNTAINTED);
+const uschar * field[4], * p, * filename, * opts, * key;
+uschar * data = NULL, * errmsg = US"";
+lp_resp resp = {.do_cache = UINT_MAX, .datalen = -1};
+lp_req req;
+void * handle;
+int len, stype, old_pool;
+gstring * g;
+
+if ((len = lp_read_all(fd, buf, LOOKUP_PROXY_MAXREQ, 30)) <= (int)sizeof(req))
+  return;
+buf[len] = '\0';
+memcpy(&req, buf, sizeof(req));
+
+/* Split out the type name, file name, options and key */
+
+p = buf + sizeof(req);
+for (int i = 0; i < 4; i++)
+  {
+  if (p >= buf + len)
+    {
+    DEBUG(D_lookup) debug_printf("%s: malformed request\n", __FUNCTION__);
+    return;
+    }
+  field[i] = p;
+  p += Ustrlen(p) + 1;
+  }
+filename = lp_string(field[1], req.has_file, req.file_tainted);
+opts = lp_string(field[2], req.has_opts, req.opts_tainted);
+key = lp_string(field[3], TRUE, req.key_tainted);
+
+DEBUG(D_lookup)
+  debug_printf("lookup proxy: type=%s key=\"%s\"\n", field[0], key);
+
+/* Lookup drivers keep their connections in the search pool */
+
+old_pool = store_pool;
+store_pool = POOL_SEARCH;
+if ((stype = search_findtype(field[0], Ustrlen(field[0]))) < 0)
+  { resp.rc = DEFER; errmsg = search_error_message; }
+else if (!(handle = search_open(filename, stype, 0, NULL, NULL)))
+  { resp.rc = DEFER; errmsg = search_error_message; }
+else
+  resp.rc = search_find_driver(handle, filename, US key, &data, &errmsg,
+				&resp.do_cache, opts);
+store_pool = old_pool;
+
+if (data)
+  {
+  resp.datalen = Ustrlen(data);
+  resp.tainted = is_tainted(data);
+  }
+g = string_catn(NULL, US &resp, sizeof(resp));
+if (data) g = string_catn(g, data, resp.datalen);
+if (!errmsg) errmsg = US"";
+g = string_catn(g, errmsg, Ustrlen(errmsg) + 1);
+
+if (write_to_fd_buf(fd, g->s, g->ptr) != g->ptr)
+  DEBUG(D_lookup) debug_printf("%s: write: %s\n", __FUNCTION__, strerror(errno));
+}
+
+
+/* The helper's main loop.  It exits when the daemon goes away. */
+
+static void
+lp_helper(int lfd, pid_t daemon_pid)
+{
+int count = 0;
+
+exim_setugid(exim_uid, exim_gid, FALSE, US"lookup proxy");
+set_process_info("lookup proxy");
+
+for (;;)
+  {
+  rmark reset_point;
+  int cfd;
+
+  if (getppid() != daemon_pid) exim_exit(EXIT_SUCCESS);
+  if (poll_one_fd(lfd, POLLIN, 5 * 1000) != 1) continue;
+  if ((cfd = accept(lfd, NULL, NULL)) < 0) continue;	/* another got it */
+  (void) fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) & ~O_NONBLOCK);
+
+  reset_point = store_mark();
+  if (lp_peer_ok(cfd)) lp_serve(cfd);
+  (void) close(cfd);
+  store_reset(reset_point);
+
+  if (++count >= LOOKUP_PROXY_TIDY)
+    {
+    search_tidyup();
+    count = 0;
+    }
+  }
+}
+
+
+
+/******************************************************************************/
+/* Daemon side */
+
+/* Start a helper in any empty slot.  Not more often than once a second, to
+avoid a fork loop if they die at once.
+
+Arguments:
+  fd_polls	the daemon's listening sockets, to be closed in a helper
+  nfds		the number of them
+*/
+
+void
+lookup_proxy_tick(const struct pollfd * fd_polls, int nfds)
+{
+pid_t daemon_pid = getpid();
+
+if (lp_listen_fd < 0 || time(NULL) == lp_last_spawn) return;
+lp_last_spawn = time(NULL);
+
+for (int i = 0; i < lookup_proxy_processes; i++) if (!lp_pids[i])
+  {
+  pid_t pid = exim_fork(US"lookup-proxy");
+
+  if (pid == 0)
+    {
+    if (f.debug_daemon) debug_selector = 0;
+    for (int j = 0; j < nfds; j++) (void) close(fd_polls[j].fd);
+    if (daemon_notifier_fd >= 0) (void) close(daemon_notifier_fd);
+    daemon_notifier_fd = -1;
+    signal(SIGHUP,  SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    lp_helper(lp_listen_fd, daemon_pid);
+    }
+  if (pid < 0)
+    {
+    log_write(0, LOG_MAIN|LOG_PANIC, "lookup proxy fork failed: %s",
+      strerror(errno));
+    break;
+    }
+  lp_pids[i] = pid;
+  DEBUG(D_any) debug_printf("lookup proxy process %d started\n", (int)pid);
+  }
+}
+
+
+/* Create the listening socket and start the helpers */
+
+void
+lookup_proxy_start(void)
+{
+struct sockaddr_un sa_un = {.sun_family = AF_UNIX};
+const uschar * where;
+ssize_t len;
+int fd;
+
+if (!lookup_proxy || !*lookup_proxy || lookup_proxy_processes <= 0) return;
+
+#ifdef SOCK_CLOEXEC
+if ((fd = socket(PF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) < 0)
+  { where = US"socket"; goto bad; }
+#else
+if ((fd = socket(PF_UNIX, SOCK_STREAM, 0)) < 0)
+  { where = US"socket"; goto bad; }
+(void)fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+#endif
+
+len = lp_sockname(&sa_un);
+#ifndef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
+(void) Uunlink(sa_un.sun_path);
+#endif
+DEBUG(D_any) debug_printf("creating lookup proxy socket\n");
+
+if (bind(fd, (const struct sockaddr *)&sa_un, (socklen_t)len) < 0)
+  { where = US"bind"; goto bad2; }
+#ifndef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
+if (  Uchown(sa_un.sun_path, exim_uid, exim_gid) < 0
+   || Uchmod(sa_un.sun_path, 0600) < 0)
+  { where = US"chown"; goto bad2; }
+#endif
+if (listen(fd, 64) < 0) { where = US"listen"; goto bad2; }
+(void) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+lp_listen_fd = fd;
+lp_pids = store_malloc(lookup_proxy_processes * sizeof(pid_t));
+memset(lp_pids, 0, lookup_proxy_processes * sizeof(pid_t));
+lookup_proxy_tick(NULL, 0);
+return;
+
+bad2:
+  close(fd);
+bad:
+  log_write(0, LOG_MAIN|LOG_PANIC, "%s %s: %s",
+    __FUNCTION__, where, strerror(errno));
+}
+
+
+/* Note the end of a daemon child.  Return TRUE if it was a helper. */
+
+BOOL
+lookup_proxy_reaped(pid_t pid)
+{
+if (lp_pids) for (int i = 0; i < lookup_proxy_processes; i++)
+  if (lp_pids[i] == pid)
+    {
+    lp_pids[i] = 0;
+    DEBUG(D_any) debug_printf("lookup proxy process %d ended\n", (int)pid);
+    return TRUE;
+    }
+return FALSE;
+}
+
+
+/* Close the listening socket; in a daemon child, or in the daemon before
+it re-execs or exits.  In the latter case, also stop the helpers so that the
+socket name is free for a new daemon. */
+
+void
+lookup_proxy_close(BOOL stop)
+{
+if (lp_listen_fd < 0) return;
+(void) close(lp_listen_fd);
+lp_listen_fd = -1;
+if (stop && lp_pids)
+  {
+  for (int i = 0; i < lookup_proxy_processes; i++)
+    if (lp_pids[i] > 0) (void) kill(lp_pids[i], SIGTERM);
+#ifndef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
+    {
+    struct sockaddr_un sa_un = {.sun_family = AF_UNIX};
+    (void) lp_sockname(&sa_un);
+    (void) Uunlink(sa_un.sun_path);
+    }
+#endif
+  }
+lp_pids = NULL;
+}
+
+
+
+/******************************************************************************/
+/* Client side */
+
+/* Decide whether to send a lookup to the helpers */
+
+BOOL
+lookup_proxy_wanted(int search_type)
+{
+const uschar * list = lookup_proxy, * s;
+uid_t uid;
+int sep = 0;
+
+if (!list || lp_unavailable || lp_listen_fd >= 0 || f.daemon_listen)
+  return FALSE;
+if ((uid = geteuid()) != root_uid && uid != exim_uid) return FALSE;
+
+while ((s = string_nextinlist(&list, &sep, NULL, 0)))
+  if (Ustrcmp(s, lookup_list[search_type]->name) == 0) return TRUE;
+return FALSE;
+}
+
+
+/* Have a helper do a lookup.
+
+Arguments:
+  search_type	lookup type
+  filename	file name, or NULL for a query-style lookup
+  keystring	the key or query
+  opts		lookup options, or NULL
+  result	where to put the data, or NULL
+  errmsg	where to put an error message
+  do_cache	where to put the cacheability of the result
+  rc		where to put the result code: OK, FAIL or DEFER
+
+Returns:	FALSE if the helpers could not be reached, in which case the
+		caller should do the lookup itself
+*/
+
+BOOL
+lookup_proxy_find(int search_type, const uschar * filename,
+  const uschar * keystring, const uschar * opts, uschar ** result,
+  uschar ** errmsg, uint * do_cache, int * rc)
+{
+struct sockaddr_un sa_un = {.sun_family = AF_UNIX};
+lp_req req = {
+  .has_file = !!filename, .has_opts = !!opts,
+  .file_tainted = filename && is_tainted(filename),
+  .opts_tainted = opts && is_tainted(opts),
+  .key_tainted = is_tainted(keystring)
+  };
+uschar * buf;
+lp_resp resp;
+gstring * g;
+ssize_t len;
+int fd;
+
+g = string_catn(NULL, US &req, sizeof(req));
+g = string_catn(g, lookup_list[search_type]->name,
+		Ustrlen(lookup_list[search_type]->name) + 1);
+g = string_catn(g, filename ? filename : US"",
+		filename ? Ustrlen(filename) + 1 : 1);
+g = string_catn(g, opts ? opts : US"", opts ? Ustrlen(opts) + 1 : 1);
+g = string_catn(g, keystring, Ustrlen(keystring) + 1);
+if (g->ptr > LOOKUP_PROXY_MAXREQ) return FALSE;
+
+if ((fd = socket(PF_UNIX, SOCK_STREAM, 0)) < 0)
+  {
+  DEBUG(D_lookup) debug_printf_indent(" socket: %s\n", strerror(errno));
+  return FALSE;
+  }
+len = lp_sockname(&sa_un);
+if (connect(fd, (const struct sockaddr *)&sa_un, (socklen_t)len) < 0)
+  {
+  DEBUG(D_lookup) debug_printf_indent("lookup proxy connect: %s\n",
+    strerror(errno));
+  close(fd);
+  lp_unavailable = TRUE;
+  return FALSE;
+  }
+
+/* Once the request is sent a failure is a deferral, since repeating a
+lookup that may have been done is not safe. */
+
+DEBUG(D_lookup) debug_printf_indent("lookup sent to proxy\n");
+if (  write_to_fd_buf(fd, g->s, g->ptr) != g->ptr
+   || shutdown(fd, SHUT_WR) < 0)
+  {
+  *errmsg = string_sprintf("lookup proxy write: %s", strerror(errno));
+  goto bad;
+  }
+
+buf = store_get(LOOKUP_PROXY_MAXREQ + sizeof(resp) + 1, GET_UNTAINTED);
+if ((len = lp_read_all(fd, buf, LOOKUP_PROXY_MAXREQ + sizeof(resp),
+			LOOKUP_PROXY_TIMEOUT)) < (ssize_t)sizeof(resp))
+  {
+  *errmsg = len < 0
+    ? string_sprintf("lookup proxy read: %s", strerror(errno))
+    : US"lookup proxy: no response";
+  goto bad;
+  }
+memcpy(&resp, buf, sizeof(resp));
+if (resp.datalen > len - (ssize_t)sizeof(resp) - 1)
+  {
+  *errmsg = US"lookup proxy: malformed response";
+  goto bad;
+  }
+buf[len] = '\0';
+close(fd);
+
+*rc = resp.rc;
+*do_cache = resp.do_cache;
+*result = resp.datalen < 0 ? NULL
+  : string_copyn_taint(buf + sizeof(resp), resp.datalen,
+		      resp.tainted ? GET_TAINTED : GET_UNTAINTED);
+*errmsg = string_copy(buf + sizeof(resp) + (resp.datalen < 0 ? 0 : resp.datalen));
+return TRUE;
+
+bad:
+  close(fd);
+  *rc = DEFER;
+  return TRUE;
+}
+
+#endif	/*!COMPILE_UTILITY*/
+
+/* End of lookup_proxy.c */
@@ -38,6 +38,16 @@ typedef struct lookup_info {
     uschar **,                    /* for error message */
     uint *,                       /* cache TTL, seconds */
     const uschar *);		  /* options */
+  int (*partial_find)(            /* find for partial matching, or NULL */
+    void *,                       /* handle */
+    const uschar *,               /* file name */
+    const uschar **,              /* keys, in order of preference */
+    int,                          /* number of keys */
+    int *,                        /* for returning which key matched */
+    uschar **,                    /* for returning answer */
+    uschar **,                    /* for error message */
+    uint *,                       /* cache TTL, seconds */
+    const uschar *);		  /* options */
   void (*close)(                  /* close function */
     void *);                      /* handle */
   void (*tidy)(void);             /* tidy function */
@@ -51,11 +61,12 @@ typedef struct lookup_info {
 
 /* This magic number is used by the following lookup_module_info structure
    for checking API compatibility. It used to be equivalent to the string"LMM3" */
-#define LOOKUP_MODULE_INFO_MAGIC 0x4c4d4935
+#define LOOKUP_MODULE_INFO_MAGIC 0x4c4d4936
 /* Version 2 adds: version_report */
 /* Version 3 change: non/cache becomes TTL in seconds */
 /* Version 4 add: index on quoting function */
 /* Version 5 change: version report now adds to a gstring */
+/* Version 6 add: partial_find */
 
 typedef struct lookup_module_info {
   uint magic;
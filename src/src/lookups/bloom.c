@@ -0,0 +1,239 @@
+/*************************************************
+*     Exim - an Internet mail transport agent    *
+*************************************************/
+
+/* Copyright (c) The Exim Maintainers 2024 */
+/* See the file NOTICE for conditions of use and distribution. */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/* The bloom lookup tests a key against a Bloom filter file, as written by
+exim_dbmbuild -bloom.  A key that is not in the filter is certainly not one of
+those it was built from, and the lookup fails; otherwise it succeeds with empty
+data, though the key may not be one of them.  It is meant for rejecting
+addresses that are certainly invalid before a costly query to a backend.
+
+Where the system supports it, the file is memory-mapped read-only, so that all
+the processes using it share the pages in the page cache, and a lookup touches
+only the k bytes it tests. */
+
+#include "../exim.h"
+#include "../bloom.h"
+#include "lf_functions.h"
+
+#ifdef HAVE_MMAP
+#  include <sys/mman.h>
+/* Not all implementations declare MAP_FAILED */
+#  ifndef MAP_FAILED
+#    define MAP_FAILED ((void *) -1)
+#  endif /* MAP_FAILED */
+#endif /* HAVE_MMAP */
+
+
+typedef struct {
+  int		fd;
+  uschar *	map;		/* the whole file */
+  off_t		len;
+  BOOL		mapped;
+  uint64_t	m;		/* number of bits */
+  unsigned	k;		/* number of bits per key */
+} bloom_state;
+
+
+
+/*************************************************
+*              Open entry point                  *
+*************************************************/
+
+/* See local README for interface description */
+
+static void *
+bloom_open(const uschar * filename, uschar ** errmsg)
+{
+bloom_state * b;
+struct stat statbuf;
+uint64_t m;
+unsigned k;
+int fd;
+
+if ((fd = Uopen(filename, O_RDONLY, 0)) < 0)
+  {
+  *errmsg = string_open_failed("%s for bloom lookup", filename);
+  return NULL;
+  }
+if (fstat(fd, &statbuf) != 0)
+  {
+  *errmsg = string_open_failed("fstat(%s) failed - cannot do bloom lookup",
+			      filename);
+  (void)close(fd);
+  return NULL;
+  }
+
+b = store_get(sizeof(bloom_state), GET_UNTAINTED);
+b->fd = fd;
+b->len = statbuf.st_size;
+b->mapped = FALSE;
+
+#ifdef HAVE_MMAP
+if (b->len > 0)
+  {
+  void * map = mmap(NULL, b->len, PROT_READ, MAP_SHARED, fd, 0);
+  if (map != MAP_FAILED)
+    {
+    b->map = map;
+    b->mapped = TRUE;
+    }
+  else
+    DEBUG(D_lookup) debug_printf_indent("bloom mmap failed - %d\n", errno);
+  }
+#endif /* HAVE_MMAP */
+
+/* Without a mapping, read the whole file */
+
+if (!b->mapped)
+  {
+  uschar * p;
+  off_t left = b->len;
+
+  b->map = p = store_get(b->len + 1, GET_UNTAINTED);
+  while (left > 0)
+    {
+    ssize_t n = read(fd, p, left);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0)
+      {
+      *errmsg = string_open_failed("cannot read %s for bloom lookup", filename);
+      (void)close(fd);
+      return NULL;
+      }
+    p += n;
+    left -= n;
+    }
+  }
+
+if (  b->len < BLOOM_HDRSIZE
+   || memcmp(b->map, BLOOM_MAGIC, 8) != 0
+   || (m = bloom_get64(b->map + 8)) == 0
+   || (k = bloom_get64(b->map + 16) & 0xffffffff) == 0
+   || k > BLOOM_MAX_K
+   || (uint64_t)(b->len - BLOOM_HDRSIZE) < (m + 7) / 8)
+  {
+  *errmsg = string_sprintf("%s is not a valid bloom filter file", filename);
+#ifdef HAVE_MMAP
+  if (b->mapped) munmap(CS b->map, b->len);
+#endif
+  (void)close(fd);
+  return NULL;
+  }
+b->m = m;
+b->k = k;
+
+DEBUG(D_lookup) debug_printf_indent("bloom: %s m=%lu k=%u keys=%lu%s\n",
+  filename, (unsigned long)m, k,
+  (unsigned long)(bloom_get64(b->map + 16) >> 32),
+  b->mapped ? " (mapped)" : "");
+return b;
+}
+
+
+
+/*************************************************
+*             Check entry point                  *
+*************************************************/
+
+static BOOL
+bloom_check(void * handle, const uschar * filename, int modemask,
+  uid_t * owners, gid_t * owngroups, uschar ** errmsg)
+{
+bloom_state * b = handle;
+return lf_check_file(b->fd, filename, S_IFREG, modemask,
+		     owners, owngroups, "bloom", errmsg) == 0;
+}
+
+
+
+/*************************************************
+*              Find entry point                  *
+*************************************************/
+
+/* Every one of the key's bits must be set for it to be possibly present.
+For a key that is absent, the test usually stops at the first or second bit. */
+
+static int
+bloom_find(void * handle, const uschar * filename, const uschar * keystring,
+  int key_len, uschar ** result, uschar ** errmsg, uint * do_cache,
+  const uschar * opts)
+{
+bloom_state * b = handle;
+const uschar * bits = b->map + BLOOM_HDRSIZE;
+uint64_t h1 = bloom_hash(keystring, key_len), h2 = bloom_hash2(h1);
+
+for (unsigned i = 0; i < b->k; i++, h1 += h2)
+  {
+  uint64_t n = h1 % b->m;
+  if (!(bits[n >> 3] & (1 << (n & 7))))
+    return FAIL;
+  }
+
+*result = string_copy_taint(US"", GET_UNTAINTED);
+return OK;
+}
+
+
+
+/*************************************************
+*              Close entry point                 *
+*************************************************/
+
+/* See local README for interface description */
+
+static void
+bloom_close(void * handle)
+{
+bloom_state * b = handle;
+
+#ifdef HAVE_MMAP
+if (b->mapped) munmap(CS b->map, b->len);
+#endif
+(void)close(b->fd);
+}
+
+
+
+/*************************************************
+*         Version reporting entry point          *
+*************************************************/
+
+/* See local README for interface description. */
+
+#include "../version.h"
+
+gstring *
+bloom_version_report(gstring * g)
+{
+#ifdef DYNLOOKUP
+g = string_fmt_append(g, "Library version: bloom: Exim version %s\n", EXIM_VERSION_STR);
+#endif
+return g;
+}
+
+
+static lookup_info _lookup_info = {
+  .name = US"bloom",			/* lookup name */
+  .type = lookup_absfile,		/* uses absolute file name */
+  .open = bloom_open,			/* open function */
+  .check = bloom_check,			/* check function */
+  .find = bloom_find,			/* find function */
+  .close = bloom_close,			/* close function */
+  .tidy = NULL,				/* no tidy function */
+  .quote = NULL,			/* no quoting function */
+  .version_report = bloom_version_report           /* version reporting */
+};
+
+#ifdef DYNLOOKUP
+#define bloom_lookup_module_info _lookup_module_info
+#endif
+
+static lookup_info *_lookup_list[] = { &_lookup_info };
+lookup_module_info bloom_lookup_module_info = { LOOKUP_MODULE_INFO_MAGIC, _lookup_list, 1 };
+
+/* End of lookups/bloom.c */
@@ -86,8 +86,33 @@ struct cdb_state {
   off_t   filelen;
   uschar *cdb_map;
   uschar *cdb_offsets;
+  struct cdb_mapping *mapping;
 };
 
+#ifdef HAVE_MMAP
+/* Mappings are kept when a file is closed, up to CDB_MAPPINGS_MAX of them, so
+that a later open of the same unchanged file by this process, or by a process
+forked from it, uses the existing mapping rather than mapping the file again
+and faulting its pages in afresh.  A file is identified by its name, device,
+inode, size and modification time; a kept mapping for a name whose file has
+changed is dropped when the name is next opened. */
+
+#define CDB_MAPPINGS_MAX 8
+
+typedef struct cdb_mapping {
+  struct cdb_mapping *next;
+  uschar *name;
+  dev_t   dev;
+  ino_t   ino;
+  off_t   len;
+  time_t  mtime;
+  uschar *map;
+  int     users;             /* open handles using it */
+} cdb_mapping;
+
+static cdb_mapping *cdb_mappings = NULL;
+#endif
+
 /* 32 bit unsigned type - this is an int on all modern machines */
 typedef unsigned int uint32;
 
@@ -148,13 +173,78 @@ return num;
 
 static void cdb_close(void *handle);
 
+#ifdef HAVE_MMAP
+static void
+cdb_mapping_drop(cdb_mapping ** mpp)
+{
+cdb_mapping * mp = *mpp;
+*mpp = mp->next;
+munmap(CS mp->map, mp->len);
+store_free(mp->name);
+store_free(mp);
+}
+
+/* Find a kept mapping for the file, or make one.  Returns NULL if the mmap()
+fails. */
+
+static cdb_mapping *
+cdb_mapping_get(const uschar * filename, int fd, const struct stat * st)
+{
+cdb_mapping * mp, ** mpp;
+int count = 0;
+void * mapbuf;
+
+for (mpp = &cdb_mappings; (mp = *mpp); )
+  if (  mp->dev == st->st_dev && mp->ino == st->st_ino
+     && mp->len == st->st_size && mp->mtime == st->st_mtime)
+    {
+    DEBUG(D_lookup) debug_printf_indent("cdb: using kept mapping\n");
+    mp->users++;
+    return mp;
+    }
+  else if (!mp->users && Ustrcmp(mp->name, filename) == 0)
+    cdb_mapping_drop(mpp);			/* the file has changed */
+  else
+    { mpp = &mp->next; count++; }
+
+if ((mapbuf = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, fd, 0))
+    == MAP_FAILED)
+  return NULL;
+
+/* Make room by dropping the unused one longest kept, which is at the end */
+
+if (count >= CDB_MAPPINGS_MAX)
+  {
+  cdb_mapping ** victim = NULL;
+  for (mpp = &cdb_mappings; *mpp; mpp = &(*mpp)->next)
+    if (!(*mpp)->users) victim = mpp;
+  if (victim) cdb_mapping_drop(victim);
+  }
+
+mp = store_malloc(sizeof(cdb_mapping));
+mp->name = store_malloc(Ustrlen(filename) + 1);
+Ustrcpy(mp->name, filename);
+mp->dev = st->st_dev;
+mp->ino = st->st_ino;
+mp->len = st->st_size;
+mp->mtime = st->st_mtime;
+mp->map = mapbuf;
+mp->users = 1;
+mp->next = cdb_mappings;
+cdb_mappings = mp;
+return mp;
+}
+#endif /* HAVE_MMAP */
+
 static void *
 cdb_open(const uschar * filename, uschar ** errmsg)
 {
 int fileno;
 struct cdb_state *cdbp;
 struct stat statbuf;
-void * mapbuf;
+#ifdef HAVE_MMAP
+cdb_mapping * mp;
+#endif
 
 if ((fileno = Uopen(filename, O_RDONLY, 0)) < 0)
   {
@@ -186,18 +276,19 @@ cdbp->fileno = fileno;
 cdbp->filelen = statbuf.st_size;
 cdbp->cdb_map = NULL;
 cdbp->cdb_offsets = NULL;
+cdbp->mapping = NULL;
 
 /* if we are allowed to we use mmap here.... */
 #ifdef HAVE_MMAP
-if ((mapbuf = mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fileno, 0))
-    != MAP_FAILED)
+if ((mp = cdb_mapping_get(filename, fileno, &statbuf)))
   {
   /* We have an mmap-ed section.  Now we can just use it */
-  cdbp->cdb_map = mapbuf;
+  cdbp->mapping = mp;
+  cdbp->cdb_map = mp->map;
   /* The offsets can be set to the same value since they should
    * effectively be cached as well
    */
-  cdbp->cdb_offsets = mapbuf;
+  cdbp->cdb_offsets = mp->map;
 
   /* Now return the state struct */
   return(cdbp);
@@ -438,11 +529,12 @@ cdb_close(void *handle)
 struct cdb_state * cdbp = handle;
 
 #ifdef HAVE_MMAP
-if (cdbp->cdb_map)
+/* The mapping is kept for a later open of the same file */
+
+if (cdbp->mapping)
   {
-  munmap(CS cdbp->cdb_map, cdbp->filelen);
-  if (cdbp->cdb_map == cdbp->cdb_offsets)
-     cdbp->cdb_offsets = NULL;
+  cdbp->mapping->users--;
+  cdbp->cdb_map = cdbp->cdb_offsets = NULL;
   }
 #endif /* HAVE_MMAP */
 
@@ -25,7 +25,8 @@ uschar * s;
 EXIM_DB * yield = NULL;
 
 if ((s = Ustrrchr(dirname, '/'))) *s = '\0';
-if (!(yield = exim_dbopen(filename, dirname, O_RDONLY, 0)))
+if (!(yield = exim_dbopen(filename, dirname, O_RDONLY|EXIM_DBOPEN_RENAMED,
+		      0)))
   *errmsg = string_open_failed("%s as a %s file", filename, EXIM_DBTYPE);
 return yield;
 }
@@ -39,8 +40,8 @@ return yield;
 /* This needs to know more about the underlying files than is good for it!
 We need to know what the real file names are in order to check the owners and
 modes. If USE_DB is set, we know it is Berkeley DB, which uses an unmodified
-file name. If USE_TDB or USE_GDBM is set, we know it is tdb or gdbm, which do
-the same. Otherwise, for safety, we have to check for x.db or x.dir and x.pag.
+file name. If USE_TDB, USE_GDBM or USE_LMDB is set, we know it is tdb, gdbm
+or lmdb, which do the same. Otherwise, for safety, we have to check for x.db or x.dir and x.pag.
 */
 
 static BOOL
@@ -49,7 +50,8 @@ dbmdb_check(void *handle, const uschar *filename, int modemask, uid_t *owners,
 {
 int rc;
 
-#if defined(USE_DB) || defined(USE_TDB) || defined(USE_GDBM)
+#if defined(USE_DB) || defined(USE_TDB) || defined(USE_GDBM) \
+  || defined(USE_LMDB)
 rc = lf_check_file(-1, filename, S_IFREG, modemask, owners, owngroups,
   "dbm", errmsg);
 #else
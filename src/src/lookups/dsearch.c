@@ -70,6 +70,170 @@ return FALSE;
 #define FILTER_FILE	BIT(2)
 #define FILTER_DIR	BIT(3)
 #define FILTER_SUBDIR	BIT(4)
+#define SCAN		BIT(5)
+
+/* With the "scan" option the directory is read once into a hash set, kept
+for the life of the process (and inherited by processes forked from it), and
+lookups are answered from that.  Each lookup still does a stat() of the
+directory itself; if that shows the directory has changed, it is read again.
+On NFS the stat() is normally answered from the client's attribute cache,
+where an lstat() of each key, particularly of one that does not exist, means
+a round trip to the server.  A change made within the second of the read is
+not trusted to show in the modification time, so the next lookup reads the
+directory again. */
+
+#define DSCAN_NBUCKETS	1024
+
+/* Systems without the entry type in struct dirent get an lstat() for each
+filtered lookup */
+
+#ifdef DT_UNKNOWN
+# define DSCAN_D_TYPE(ent) (ent)->d_type
+#else
+# define DT_UNKNOWN	0
+# define DT_DIR		4
+# define DT_REG		8
+# define DSCAN_D_TYPE(ent) DT_UNKNOWN
+#endif
+
+typedef struct dscan_ent {
+  struct dscan_ent * next;
+  uschar	type;			/* DT_xxx from readdir() */
+  uschar	name[1];		/* extensible */
+} dscan_ent;
+
+typedef struct dscan_dir {
+  struct dscan_dir * next;
+  uschar *	name;
+  dev_t		dev;
+  ino_t		ino;
+  time_t	mtime;
+  time_t	ctime;
+  BOOL		recheck;		/* read again at the next lookup */
+  unsigned	nbuckets;
+  dscan_ent **	buckets;
+} dscan_dir;
+
+static dscan_dir * dscan_dirs = NULL;
+
+static unsigned
+dscan_hash(const uschar * s)
+{
+unsigned h = 5381;
+while (*s) h = (h << 5) + h + *s++;
+return h;
+}
+
+static void
+dscan_clear(dscan_dir * d)
+{
+for (unsigned i = 0; i < d->nbuckets; i++)
+  for (dscan_ent * e = d->buckets[i], * next; e; e = next)
+    { next = e->next; store_free(e); }
+if (d->buckets) store_free(d->buckets);
+d->buckets = NULL;
+d->nbuckets = 0;
+}
+
+/* Read the directory into the set.  Returns FALSE on error, with errno set */
+
+static BOOL
+dscan_read(dscan_dir * d, const struct stat * st)
+{
+time_t started = time(NULL);
+unsigned count = 0;
+struct dirent * ent;
+DIR * dp;
+
+if (!(dp = exim_opendir(d->name))) return FALSE;
+dscan_clear(d);
+d->nbuckets = DSCAN_NBUCKETS;
+d->buckets = store_malloc(d->nbuckets * sizeof(dscan_ent *));
+memset(d->buckets, 0, d->nbuckets * sizeof(dscan_ent *));
+
+while ((ent = readdir(dp)))
+  {
+  int len = Ustrlen(ent->d_name);
+  dscan_ent * e = store_malloc(sizeof(dscan_ent) + len);
+  unsigned h;
+
+  memcpy(e->name, ent->d_name, len + 1);
+  e->type = DSCAN_D_TYPE(ent);
+
+  if (++count > 2 * d->nbuckets)
+    {				/* grow the table */
+    unsigned n = d->nbuckets * 2;
+    dscan_ent ** b = store_malloc(n * sizeof(dscan_ent *));
+    memset(b, 0, n * sizeof(dscan_ent *));
+    for (unsigned i = 0; i < d->nbuckets; i++)
+      for (dscan_ent * f = d->buckets[i], * next; f; f = next)
+	{
+	next = f->next;
+	h = dscan_hash(f->name) % n;
+	f->next = b[h];
+	b[h] = f;
+	}
+    store_free(d->buckets);
+    d->buckets = b;
+    d->nbuckets = n;
+    }
+  h = dscan_hash(e->name) % d->nbuckets;
+  e->next = d->buckets[h];
+  d->buckets[h] = e;
+  }
+closedir(dp);
+
+d->dev = st->st_dev;
+d->ino = st->st_ino;
+d->mtime = st->st_mtime;
+d->ctime = st->st_ctime;
+d->recheck = st->st_mtime >= started || st->st_ctime >= started;
+DEBUG(D_lookup) debug_printf_indent("dsearch: read %u entries from %s\n",
+  count, d->name);
+return TRUE;
+}
+
+/* Find an entry using the set for the directory, reading the directory if
+need be.  Returns OK, FAIL or DEFER (with errno set); the entry's type from
+readdir() is passed back, which may be DT_UNKNOWN. */
+
+static int
+dscan_find(const uschar * dirname, const uschar * key, uschar * typep)
+{
+struct stat st;
+dscan_dir * d;
+
+if (Ustat(dirname, &st) < 0) return DEFER;
+
+for (d = dscan_dirs; d; d = d->next)
+  if (Ustrcmp(d->name, dirname) == 0) break;
+if (!d)
+  {
+  d = store_malloc(sizeof(dscan_dir));
+  memset(d, 0, sizeof(dscan_dir));
+  d->name = store_malloc(Ustrlen(dirname) + 1);
+  Ustrcpy(d->name, dirname);
+  d->recheck = TRUE;
+  d->next = dscan_dirs;
+  dscan_dirs = d;
+  }
+
+if (  d->recheck || st.st_dev != d->dev || st.st_ino != d->ino
+   || st.st_mtime != d->mtime || st.st_ctime != d->ctime)
+  if (!dscan_read(d, &st))
+    {
+    d->recheck = TRUE;
+    return DEFER;
+    }
+
+for (dscan_ent * e = d->buckets[dscan_hash(key) % d->nbuckets]; e; e = e->next)
+  if (Ustrcmp(e->name, key) == 0)
+    {
+    *typep = e->type;
+    return OK;
+    }
+return FAIL;
+}
 
 /* See local README for interface description. We use lstat() instead of
 scanning the directory, as it is hopefully faster to let the OS do the scanning
@@ -110,9 +274,47 @@ if (opts)
       else if (Ustrcmp(ele, "subdir") == 0)
 	flags |= FILTER_TYPE | FILTER_SUBDIR;	/* like dir but not "." or ".." */
       }
+    else if (Ustrcmp(ele, "scan=yes") == 0)
+      flags |= SCAN;
   }
 
 filename = string_sprintf("%s/%s", dirname, keystring);
+
+/* With a scanned directory, the type from readdir() is used when it is known;
+otherwise, for a filter, an lstat() is still needed. */
+
+if (flags & SCAN)
+  {
+  uschar type = DT_UNKNOWN;
+
+  switch (dscan_find(dirname, keystring, &type))
+    {
+    case FAIL:
+      return FAIL;
+    case DEFER:
+      save_errno = errno;
+      *errmsg = string_sprintf("%s: scan: %s", dirname, strerror(errno));
+      errno = save_errno;
+      return DEFER;
+    }
+  if (!(flags & FILTER_TYPE) || type != DT_UNKNOWN)
+    {
+    if (  !(flags & FILTER_TYPE)
+       || (flags & FILTER_FILE && type == DT_REG)
+       || (  flags & (FILTER_DIR | FILTER_SUBDIR)
+	  && type == DT_DIR
+	  && (  flags & FILTER_DIR
+	     || keystring[0] != '.'
+	     || keystring[1] && keystring[1] != '.'
+       )  )  )
+      {
+      *result = string_copy_taint(flags & RET_FULL ? filename : keystring, GET_UNTAINTED);
+      return OK;
+      }
+    return FAIL;
+    }
+  }
+
 if (  Ulstat(filename, &statbuf) >= 0
    && (  !(flags & FILTER_TYPE)
       || (flags & FILTER_FILE && S_ISREG(statbuf.st_mode))
@@ -35,6 +35,20 @@ json_free(void * p)
 /* debug_printf("%s: %p\n", __FUNCTION__, p); */
 }
 
+/* The handle for an open file.  The document is parsed on the first lookup
+and kept, in the search pool, for the life of the handle; it is parsed again
+only if the file is seen to have changed. */
+
+typedef struct {
+  FILE *	f;
+  json_t *	doc;
+  time_t	mtime;		/* of the file when parsed */
+  time_t	ctime;
+  off_t		size;
+} json_handle;
+
+
+
 /*************************************************
 *              Open entry point                  *
 *************************************************/
@@ -44,13 +58,20 @@ json_free(void * p)
 static void *
 json_open(const uschar * filename, uschar ** errmsg)
 {
+json_handle * h;
 FILE * f;
 
 json_set_alloc_funcs(json_malloc, json_free);
 
 if (!(f = Ufopen(filename, "rb")))
+  {
   *errmsg = string_open_failed("%s for json search", filename);
-return f;
+  return NULL;
+  }
+h = store_get(sizeof(json_handle), GET_UNTAINTED);
+h->f = f;
+h->doc = NULL;
+return h;
 }
 
 
@@ -63,12 +84,55 @@ static BOOL
 json_check(void *handle, const uschar *filename, int modemask, uid_t *owners,
   gid_t *owngroups, uschar **errmsg)
 {
-return lf_check_file(fileno((FILE *)handle), filename, S_IFREG, modemask,
+return lf_check_file(fileno(((json_handle *)handle)->f), filename, S_IFREG, modemask,
   owners, owngroups, "json", errmsg) == 0;
 }
 
 
 
+/*************************************************
+*         Get the parsed document                *
+*************************************************/
+
+/* Use the one from an earlier lookup unless the file has been written since;
+otherwise parse the file. */
+
+static json_t *
+json_doc(json_handle * h, uschar ** errmsg)
+{
+json_error_t jerr;
+struct stat statbuf;
+
+if (fstat(fileno(h->f), &statbuf) != 0)
+  {
+  *errmsg = string_sprintf("json: fstat: %s", strerror(errno));
+  return NULL;
+  }
+if (h->doc)
+  {
+  if (  statbuf.st_mtime == h->mtime && statbuf.st_ctime == h->ctime
+     && statbuf.st_size == h->size)
+    return h->doc;
+  DEBUG(D_lookup) debug_printf_indent("json file changed; parsing again\n");
+  json_decref(h->doc);
+  h->doc = NULL;
+  }
+
+rewind(h->f);
+if (!(h->doc = json_loadf(h->f, 0, &jerr)))
+  {
+  *errmsg = string_sprintf("json error on open: %.*s\n",
+       JSON_ERROR_TEXT_LENGTH, jerr.text);
+  return NULL;
+  }
+h->mtime = statbuf.st_mtime;
+h->ctime = statbuf.st_ctime;
+h->size = statbuf.st_size;
+return h->doc;
+}
+
+
+
 /*************************************************
 *         Find entry point for lsearch           *
 *************************************************/
@@ -80,20 +144,12 @@ json_find(void * handle, const uschar * filename, const uschar * keystring,
   int length, uschar ** result, uschar ** errmsg, uint * do_cache,
   const uschar * opts)
 {
-FILE * f = handle;
-json_t * j, * j0;
-json_error_t jerr;
+json_t * j;
 uschar * key;
 int sep = 0;
 
-rewind(f);
-if (!(j = json_loadf(f, 0, &jerr)))
-  {
-  *errmsg = string_sprintf("json error on open: %.*s\n",
-       JSON_ERROR_TEXT_LENGTH, jerr.text);
+if (!(j = json_doc(handle, errmsg)))
   return FAIL;
-  }
-j0 = j;
 
 for (int k = 1;  (key = string_nextinlist(&keystring, &sep, NULL, 0)); k++)
   {
@@ -110,7 +166,6 @@ for (int k = 1;  (key = string_nextinlist(&keystring, &sep, NULL, 0)); k++)
       ? US"bad index, or not json array"
       : US"no such key, or not json object",
       k, key);
-    json_decref(j0);
     return FAIL;
     }
   }
@@ -131,7 +186,6 @@ switch (json_typeof(j))
   case JSON_NULL:	*result = NULL;		break;
   default:		*result = US json_dumps(j, 0); break;
   }
-json_decref(j0);
 return OK;
 }
 
@@ -146,7 +200,9 @@ return OK;
 static void
 json_close(void *handle)
 {
-(void)fclose((FILE *)handle);
+json_handle * h = handle;
+if (h->doc) json_decref(h->doc);
+(void)fclose(h->f);
 }
 
 
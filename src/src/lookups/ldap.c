@@ -84,11 +84,38 @@ typedef struct ldap_connection {
   BOOL  bound;
   int   port;
   BOOL  is_start_tls_called;
+  int   pending;		/* searches started for a prefetch */
   LDAP *ld;
 } LDAP_CONNECTION;
 
 static LDAP_CONNECTION *ldap_connections = NULL;
 
+/* A search started for a prefetch, with what is needed to collect its
+results; several can be outstanding on one connection. */
+
+typedef struct ldap_pending {
+  struct ldap_pending *next;
+  const uschar *query;		/* the lookup key for the cache */
+  LDAP_CONNECTION *lcp;
+  LDAPURLDesc *ludp;
+  int   msgid;
+  int   search_type;
+  int   attrs_requested;
+  BOOL  has_timeout;
+  struct timeval timeout;
+} ldap_pending;
+
+/* Set while a prefetch is starting its searches; each leaves its details for
+the caller in ldap_started. */
+
+static BOOL ldap_start_only = FALSE;
+static ldap_pending *ldap_started = NULL;
+
+
+
+static int eldap_collect(LDAP_CONNECTION *, LDAPURLDesc *, int, int, int,
+  struct timeval *, uschar **, uschar **, BOOL *);
+
 
 
 /*************************************************
@@ -107,6 +134,10 @@ The DN from a successful lookup is placed in $ldap_dn. This feature postdates
 the provision of the SEARCH_LDAP_DN facility for returning just the DN as the
 data.
 
+While a prefetch is starting its searches (ldap_start_only is set), the search
+is only started, and its details are left in ldap_started for the results to
+be collected later by eldap_collect().
+
 Arguments:
   ldap_url      the URL to be looked up
   server        server host name, when URL contains none
@@ -139,30 +170,19 @@ perform_ldap_search(const uschar *ldap_url, uschar *server, int s_port,
 {
 LDAPURLDesc     *ludp = NULL;
 LDAPMessage     *result = NULL;
-BerElement      *ber;
 LDAP_CONNECTION *lcp;
 
-struct timeval timeout;
+struct timeval timeout = {0};
 struct timeval *timeoutptr = NULL;
 
-gstring * data = NULL;
-uschar *dn = NULL;
 uschar *host;
-uschar **values;
-uschar **firstval;
 uschar porttext[16];
 
-uschar *error1 = NULL;   /* string representation of errcode (static) */
-uschar *error2 = NULL;   /* error message from the server */
-uschar *matched = NULL;  /* partially matched DN */
-
 int    attrs_requested = 0;
 int    error_yield = DEFER;
 int    msgid;
-int    rc, ldap_rc, ldap_parse_rc;
+int    rc;
 int    port;
-int    rescount = 0;
-BOOL   attribute_found = FALSE;
 BOOL   ldapi = FALSE;
 
 DEBUG(D_lookup) debug_printf_indent("perform_ldap_search:"
@@ -508,6 +528,7 @@ if (!lcp)
   lcp->ld = ld;
   lcp->next = ldap_connections;
   lcp->is_start_tls_called = FALSE;
+  lcp->pending = 0;
   ldap_connections = lcp;
   }
 
@@ -533,6 +554,15 @@ if (  !lcp->bound
   DEBUG(D_lookup) debug_printf_indent("%sbinding with user=%s password=%s\n",
     lcp->bound ? "re-" : "", user, password);
 
+  /* A bind would abandon the searches outstanding on the connection */
+
+  if (lcp->pending)
+    {
+    *errmsg = string_sprintf("not rebinding the LDAP connection to server "
+      "%s%s while %d searches are outstanding", host, porttext, lcp->pending);
+    goto RETURN_ERROR_BREAK;
+    }
+
   if (eldap_start_tls && !lcp->is_start_tls_called && !ldapi)
     {
 #if defined(LDAP_OPT_X_TLS) && !defined(LDAP_LIB_SOLARIS)
@@ -658,6 +688,82 @@ if (msgid == -1)
   goto RETURN_ERROR;
   }
 
+/* When searches are being started for a prefetch, keep the details for
+collecting the results later. */
+
+if (ldap_start_only)
+  {
+  ldap_pending * lp = store_get(sizeof(ldap_pending), GET_UNTAINTED);
+  lp->next = NULL;
+  lp->query = NULL;
+  lp->lcp = lcp;
+  lp->ludp = ludp;
+  lp->msgid = msgid;
+  lp->search_type = search_type;
+  lp->attrs_requested = attrs_requested;
+  lp->timeout = timeout;
+  lp->has_timeout = !!timeoutptr;
+  lcp->pending++;
+  ldap_started = lp;
+  *res = US"";
+  return OK;
+  }
+
+return eldap_collect(lcp, ludp, msgid, search_type, attrs_requested,
+  timeoutptr, res, errmsg, defer_break);
+
+RETURN_OK:
+if (result) ldap_msgfree(result);
+ldap_free_urldesc(ludp);
+return OK;
+
+/* Error returns */
+
+RETURN_ERROR_BREAK:
+*defer_break = TRUE;
+
+RETURN_ERROR:
+DEBUG(D_lookup) debug_printf_indent("%s\n", *errmsg);
+
+RETURN_ERROR_NOMSG:
+if (result) ldap_msgfree(result);
+if (ludp) ldap_free_urldesc(ludp);
+return error_yield;
+}
+
+
+
+/*************************************************
+*         Collect the results of a search        *
+*************************************************/
+
+/* Collect the results of a search that has been started, and free its URL
+description.  The arguments and result are as for perform_ldap_search(), with
+the connection, message id and count of attributes requested from the start of
+the search. */
+
+static int
+eldap_collect(LDAP_CONNECTION * lcp, LDAPURLDesc * ludp, int msgid,
+  int search_type, int attrs_requested, struct timeval * timeoutptr,
+  uschar ** res, uschar ** errmsg, BOOL * defer_break)
+{
+LDAPMessage     *result = NULL;
+BerElement      *ber;
+
+gstring * data = NULL;
+uschar *dn = NULL;
+uschar **values;
+uschar **firstval;
+
+uschar *error1 = NULL;   /* string representation of errcode (static) */
+uschar *error2 = NULL;   /* error message from the server */
+uschar *matched = NULL;  /* partially matched DN */
+
+int    error_yield = DEFER;
+int    rc, ldap_rc, ldap_parse_rc;
+int    rescount = 0;
+BOOL   attribute_found = FALSE;
+
 /* Loop to pick up results as they come in, setting a timeout if one was
 given. */
 
@@ -1022,7 +1128,6 @@ if (!attribute_found)
 DEBUG(D_lookup) debug_printf_indent("LDAP search: returning: %s\n", data->s);
 *res = data->s;
 
-RETURN_OK:
 if (result) ldap_msgfree(result);
 ldap_free_urldesc(ludp);
 return OK;
@@ -1035,7 +1140,6 @@ RETURN_ERROR_BREAK:
 RETURN_ERROR:
 DEBUG(D_lookup) debug_printf_indent("%s\n", *errmsg);
 
-RETURN_ERROR_NOMSG:
 if (result) ldap_msgfree(result);
 if (ludp) ldap_free_urldesc(ludp);
 
@@ -1276,6 +1380,93 @@ return DEFER;
 
 
 
+/*************************************************
+*             Prefetch for the cache             *
+*************************************************/
+
+/* With the "prefetch" option the query is a list of queries for the same
+kind of search.  All are started, so that several can be outstanding on one
+connection with the server, and the results are then collected in turn and
+put in the lookup cache as though each query had been looked up alone.
+Deferred queries are not cached, and the result of the lookup is the number
+of queries that were.  The value of $ldap_dn is not changed.
+
+Arguments:
+  query         the list of queries
+  search_type   as for control_ldap_search()
+  res           set to point at the result
+  errmsg        set to point a message if result is not OK
+
+Returns:        OK
+*/
+
+static int
+eldap_prefetch(const uschar * query, int search_type, uschar ** res,
+  uschar ** errmsg)
+{
+ldap_pending * head = NULL, ** tail = &head;
+uschar * save_dn = eldap_dn;
+const uschar * list = query, * q;
+int sep = 0, cached = 0;
+
+ldap_start_only = TRUE;
+while ((q = string_nextinlist(&list, &sep, NULL, 0)))
+  {
+  uschar * dummy;
+
+  ldap_started = NULL;
+  if (control_ldap_search(q, search_type, &dummy, errmsg) == OK && ldap_started)
+    {
+    ldap_started->query = q;
+    *tail = ldap_started;
+    tail = &ldap_started->next;
+    }
+  else
+    DEBUG(D_lookup) debug_printf_indent("LDAP prefetch: not started: %s\n", q);
+  }
+ldap_start_only = FALSE;
+ldap_started = NULL;
+
+for (ldap_pending * lp = head; lp; lp = lp->next)
+  {
+  uschar * data, * e;
+  BOOL dummy_break;
+  int rc = eldap_collect(lp->lcp, lp->ludp, lp->msgid, lp->search_type,
+    lp->attrs_requested, lp->has_timeout ? &lp->timeout : NULL,
+    &data, &e, &dummy_break);
+
+  lp->lcp->pending--;
+  if (rc == DEFER) continue;
+  search_cache_seed(lp->query, rc == OK ? data : NULL);
+  cached++;
+  }
+eldap_dn = save_dn;
+
+DEBUG(D_lookup) debug_printf_indent("LDAP prefetch: cached %d\n", cached);
+*res = string_sprintf("%d", cached);
+return OK;
+}
+
+
+/* Run a search, or a prefetch if the options ask for one. */
+
+static int
+eldap_search(const uschar * ldap_url, int search_type, uschar ** res,
+  uschar ** errmsg, const uschar * opts)
+{
+if (opts)
+  {
+  const uschar * list = opts;
+  uschar * ele;
+  for (int sep = ','; (ele = string_nextinlist(&list, &sep, NULL, 0)); )
+    if (Ustrcmp(ele, "prefetch") == 0)
+      return eldap_prefetch(ldap_url, search_type, res, errmsg);
+  }
+return control_ldap_search(ldap_url, search_type, res, errmsg);
+}
+
+
+
 /*************************************************
 *               Find entry point                 *
 *************************************************/
@@ -1289,7 +1480,7 @@ eldap_find(void * handle, const uschar * filename, const uschar * ldap_url,
   int length, uschar ** result, uschar ** errmsg, uint * do_cache,
   const uschar * opts)
 {
-return(control_ldap_search(ldap_url, SEARCH_LDAP_SINGLE, result, errmsg));
+return eldap_search(ldap_url, SEARCH_LDAP_SINGLE, result, errmsg, opts);
 }
 
 static int
@@ -1297,7 +1488,7 @@ eldapm_find(void * handle, const uschar * filename, const uschar * ldap_url,
   int length, uschar ** result, uschar ** errmsg, uint * do_cache,
   const uschar * opts)
 {
-return(control_ldap_search(ldap_url, SEARCH_LDAP_MULTIPLE, result, errmsg));
+return eldap_search(ldap_url, SEARCH_LDAP_MULTIPLE, result, errmsg, opts);
 }
 
 static int
@@ -1305,7 +1496,7 @@ eldapdn_find(void * handle, const uschar * filename, const uschar * ldap_url,
   int length, uschar ** result, uschar ** errmsg, uint * do_cache,
   const uschar * opts)
 {
-return(control_ldap_search(ldap_url, SEARCH_LDAP_DN, result, errmsg));
+return eldap_search(ldap_url, SEARCH_LDAP_DN, result, errmsg, opts);
 }
 
 int
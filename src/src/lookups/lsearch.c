@@ -9,6 +9,7 @@
 
 #include "../exim.h"
 #include "lf_functions.h"
+#include <sys/mman.h>
 
 /* Codes for the different kinds of lsearch that are supported */
 
@@ -19,6 +20,61 @@ enum {
   LSEARCH_IP            /* IP addresses and networks */
 };
 
+/* The handle for an open file. For a plain lsearch or an iplsearch of a large
+file, an index of the lines is built on first use (see lsearch_index() below). */
+
+typedef struct lsearch_handle {
+  FILE *	f;
+  const uschar * index;		/* mapped or malloc'd index, or NULL */
+  size_t	indexlen;
+  BOOL		index_mapped;
+  BOOL		index_tried;
+} lsearch_handle;
+
+/* An index is written to a file in the spool, named by the device and inode
+of the indexed file, and used by later processes until the file changes.
+
+For a plain lsearch the index is a hashtable of the line offsets for the keys,
+using linear probing so that duplicate keys are found in file order.
+
+For an iplsearch there is a hashtable for each distinct address width and mask
+length used by the networks in the file, holding the masked network addresses
+and their line offsets. A lookup probes each table with the address masked to
+its length; of the networks that match, the one earliest in the file is the
+result, as for a linear search. */
+
+typedef struct lsx_header {
+  uschar	magic[8];
+  uint64_t	dev, ino, size;
+  int64_t	mtime, ctime;
+  uint64_t	total;		/* length of the index */
+  uint32_t	nslots;		/* plain: a power of two; ip: tables */
+  uint32_t	nkeys;
+} lsx_header;
+
+typedef struct lsx_slot {
+  uint32_t	hash;
+  uint32_t	spare;
+  uint64_t	offset;		/* of the line, plus one; zero if empty */
+} lsx_slot;
+
+typedef struct lsx_iptable {
+  uint32_t	width;		/* 32 or 128 */
+  uint32_t	masklen;
+  uint32_t	nslots;		/* a power of two */
+  uint32_t	spare;
+  uint64_t	start;		/* offset of the slots in the index */
+} lsx_iptable;
+
+typedef struct lsx_ipslot {
+  uint32_t	addr[4];	/* four words for IPv6, one for IPv4 */
+  uint64_t	offset;		/* of the line, plus one; zero if empty */
+} lsx_ipslot;
+
+#define LSX_MAGIC	"ExLsIx2"
+#define LSX_IPMAGIC	"ExLsIp1"
+#define LSX_DIRECTORY	"lsearch"
+
 
 
 /*************************************************
@@ -31,9 +87,17 @@ static void *
 lsearch_open(const uschar * filename, uschar ** errmsg)
 {
 FILE * f = Ufopen(filename, "rb");
+lsearch_handle * h;
+
 if (!f)
+  {
   *errmsg = string_open_failed("%s for linear search", filename);
-return f;
+  return NULL;
+  }
+h = store_get(sizeof(lsearch_handle), GET_UNTAINTED);
+memset(h, 0, sizeof(lsearch_handle));
+h->f = f;
+return h;
 }
 
 
@@ -46,48 +110,43 @@ static BOOL
 lsearch_check(void *handle, const uschar *filename, int modemask, uid_t *owners,
   gid_t *owngroups, uschar **errmsg)
 {
-return lf_check_file(fileno((FILE *)handle), filename, S_IFREG, modemask,
+return lf_check_file(fileno(((lsearch_handle *)handle)->f), filename,
+  S_IFREG, modemask,
   owners, owngroups, "lsearch", errmsg) == 0;
 }
 
 
 
 /*************************************************
-*  Internal function for the various lsearches   *
+*      Scan the file for the various lsearches   *
 *************************************************/
 
-/* See local README for interface description, plus:
+/* Read lines from the current position of the file, looking for a match.
 
-Extra argument:
+Arguments:
+  f          the open file
+  keystring  the key
+  length     its length
+  result     where to put the data
+  type       one of the values LSEARCH_PLAIN, LSEARCH_WILD, LSEARCH_NWILD, or
+             LSEARCH_IP
+  ret_full   return the whole line rather than the data
+  once       only look at the first line (which is a candidate from the index)
 
-  type     one of the values LSEARCH_PLAIN, LSEARCH_WILD, LSEARCH_NWILD, or
-           LSEARCH_IP
+Returns:     OK, FAIL or DEFER
 
 There is some messy logic in here to cope with very long data lines that do not
 fit into the fixed sized buffer. Most of the time this will never be exercised,
 but people do occasionally do weird things. */
 
 static int
-internal_lsearch_find(void * handle, const uschar * filename,
-  const uschar * keystring, int length, uschar ** result, uschar ** errmsg,
-  int type, const uschar * opts)
+lsearch_scan(FILE * f, const uschar * keystring, int length, uschar ** result,
+  int type, BOOL ret_full, BOOL once)
 {
-FILE *f = handle;
-BOOL ret_full = FALSE;
 int old_pool = store_pool;
 rmark reset_point = NULL;
 uschar buffer[4096];
 
-if (opts)
-  {
-  int sep = ',';
-  uschar * ele;
-
-  while ((ele = string_nextinlist(&opts, &sep, NULL, 0)))
-    if (Ustrcmp(ele, "ret=full") == 0)
-      { ret_full = TRUE; break; }
-  }
-
 /* Wildcard searches may use up some store, because of expansions. We don't
 want them to fill up our search store. What we do is set the pool to the main
 pool and get a point to reset to later. Wildcard searches could also issue
@@ -100,7 +159,6 @@ if (type == LSEARCH_WILD || type == LSEARCH_NWILD)
   reset_point = store_mark();
   }
 
-rewind(f);
 for (BOOL this_is_eol, last_was_eol = TRUE;
      Ufgets(buffer, sizeof(buffer), f) != NULL;
      last_was_eol = this_is_eol)
@@ -174,7 +232,10 @@ for (BOOL this_is_eol, last_was_eol = TRUE;
 
     case LSEARCH_PLAIN:
       if (linekeylength != length || strncmpic(buffer, keystring, length) != 0)
+	{
+	if (once) goto NOMATCH;
 	continue;
+	}
       break;      /* Key matched */
 
     /* A wild lsearch treats each key as a possible wildcarded string; no
@@ -225,7 +286,11 @@ for (BOOL this_is_eol, last_was_eol = TRUE;
 	int save = buffer[linekeylength];
 	buffer[linekeylength] = 0;
 	if (string_is_ip_address(buffer, &maskoffset) == 0 ||
-	    !host_is_in_net(keystring, buffer, maskoffset)) continue;
+	    !host_is_in_net(keystring, buffer, maskoffset))
+	  {
+	  if (once) goto NOMATCH;
+	  continue;
+	  }
 	buffer[linekeylength] = save;
 	}
       break;      /* Key matched */
@@ -308,6 +373,7 @@ for (BOOL this_is_eol, last_was_eol = TRUE;
 
 /* Reset dynamic store, if we need to */
 
+NOMATCH:
 if (reset_point)
   {
   store_reset(reset_point);
@@ -318,6 +384,467 @@ return FAIL;
 }
 
 
+
+/*************************************************
+*          Index for plain lsearch               *
+*************************************************/
+
+/* The key hash is caseless, as is the plain lsearch comparison */
+
+static uint32_t
+lsx_hash(const uschar * key, int len)
+{
+uint32_t h = 5381;
+while (len--) h = (h << 5) + h + tolower(*key++);
+return h;
+}
+
+
+/* Extract the key from the start of a line, as lsearch_scan() does, into the
+given buffer. Return its length, or -1 for a line that is not a key line. */
+
+static int
+lsx_line_key(uschar * buffer)
+{
+uschar * s = buffer;
+
+if (buffer[0] == 0 || buffer[0] == '#' || isspace(buffer[0])) return -1;
+if (*s == '\"')
+  {
+  uschar * t = s++;
+  while (*s && *s != '\"')
+    {
+    *t++ = *s == '\\' ? string_interpret_escape(CUSS &s) : *s;
+    s++;
+    }
+  return t - buffer;
+  }
+while (*s && *s != ':' && !isspace(*s)) s++;
+return s - buffer;
+}
+
+
+static BOOL
+lsx_matches(const lsx_header * hd, const char * magic, const struct stat * st)
+{
+return memcmp(hd->magic, magic, sizeof(hd->magic)) == 0
+  && hd->dev == (uint64_t)st->st_dev && hd->ino == (uint64_t)st->st_ino
+  && hd->size == (uint64_t)st->st_size
+  && hd->mtime == (int64_t)st->st_mtime && hd->ctime == (int64_t)st->st_ctime;
+}
+
+
+static void
+lsx_header_init(lsx_header * hd, const char * magic, const struct stat * st,
+  size_t len)
+{
+memset(hd, 0, len);
+memcpy(hd->magic, magic, sizeof(hd->magic));
+hd->dev = st->st_dev;
+hd->ino = st->st_ino;
+hd->size = st->st_size;
+hd->mtime = st->st_mtime;
+hd->ctime = st->st_ctime;
+hd->total = len;
+}
+
+
+/* Build a plain index in malloc store by reading the whole file */
+
+static lsx_header *
+lsx_build(FILE * f, const struct stat * st, size_t * lenp)
+{
+uschar buffer[4096];
+uint64_t offset = 0, nkeys = 0;
+uint32_t nslots = 1024;
+lsx_header * hd;
+lsx_slot * slots;
+size_t len;
+
+/* Count the keys; the hashtable is kept at most half full */
+
+rewind(f);
+for (BOOL this_is_eol, last_was_eol = TRUE;
+     Ufgets(buffer, sizeof(buffer), f) != NULL;
+     last_was_eol = this_is_eol)
+  {
+  int p = Ustrlen(buffer);
+  this_is_eol = p > 0 && buffer[p-1] == '\n';
+  if (last_was_eol && buffer[0] && buffer[0] != '#' && !isspace(buffer[0]))
+    nkeys++;
+  }
+if (nkeys > 0x40000000) return NULL;
+while (nslots < 2 * nkeys) nslots <<= 1;
+
+len = sizeof(lsx_header) + nslots * sizeof(lsx_slot);
+hd = store_malloc(len);
+lsx_header_init(hd, LSX_MAGIC, st, len);
+hd->nslots = nslots;
+hd->nkeys = nkeys;
+slots = (lsx_slot *)(hd + 1);
+
+rewind(f);
+for (BOOL this_is_eol, last_was_eol = TRUE;
+     Ufgets(buffer, sizeof(buffer), f) != NULL;
+     last_was_eol = this_is_eol, offset += Ustrlen(buffer))
+  {
+  int p = Ustrlen(buffer), keylen;
+  uint64_t here = offset;
+  uint32_t h, i;
+
+  this_is_eol = p > 0 && buffer[p-1] == '\n';
+  if (!last_was_eol) continue;
+
+  /* The key extraction may rewrite the buffer; the offset step above
+  needs the original length, so make a copy first. */
+
+    {
+    uschar kbuf[4096];
+    memcpy(kbuf, buffer, p + 1);
+    if ((keylen = lsx_line_key(kbuf)) < 0) continue;
+    h = lsx_hash(kbuf, keylen);
+    }
+
+  for (i = h & (nslots - 1); slots[i].offset; i = (i + 1) & (nslots - 1)) ;
+  slots[i].hash = h;
+  slots[i].offset = here + 1;
+  }
+
+*lenp = len;
+return hd;
+}
+
+
+/* Convert an address to binary, with IPv4-mapped IPv6 addresses as IPv4, as
+host_is_in_net() does. Return the width in bits. */
+
+static int
+lsx_ip_aton(const uschar * s, uint32_t * bin)
+{
+int size = host_aton(s, (int *)bin);
+
+if (size == 4 && bin[0] == 0 && bin[1] == 0 && bin[2] == 0xffff)
+  { size = 1; bin[0] = bin[3]; }
+for (int i = size; i < 4; i++) bin[i] = 0;
+return size * 32;
+}
+
+static void
+lsx_ip_mask(uint32_t * addr, int masklen)
+{
+for (int i = 0; i < 4; i++, masklen -= 32)
+  if (masklen <= 0) addr[i] = 0;
+  else if (masklen < 32) addr[i] &= ~(uint32_t)0 << (32 - masklen);
+}
+
+static uint32_t
+lsx_ip_hash(const uint32_t * addr)
+{
+uint32_t h = 0;
+for (int i = 0; i < 4; i++) h = (h ^ addr[i]) * 2654435761u;
+return h ^ (h >> 16);
+}
+
+
+/* Build an iplsearch index in malloc store by reading the whole file */
+
+typedef struct lsx_ipentry {
+  uint32_t	addr[4];
+  uint64_t	offset;
+  uschar	table;
+} lsx_ipentry;
+
+static lsx_header *
+lsx_build_ip(FILE * f, const struct stat * st, size_t * lenp)
+{
+uschar buffer[4096];
+uint64_t offset = 0;
+unsigned count[162] = {0};	/* per table: 33 IPv4 then 129 IPv6 lengths */
+unsigned nentries = 0, maxentries = 1024, ntables = 0;
+lsx_ipentry * entries = store_malloc(maxentries * sizeof(lsx_ipentry));
+int tindex[162];
+lsx_header * hd;
+lsx_iptable * tables;
+size_t len;
+
+rewind(f);
+for (BOOL this_is_eol, last_was_eol = TRUE;
+     Ufgets(buffer, sizeof(buffer), f) != NULL;
+     last_was_eol = this_is_eol, offset += Ustrlen(buffer))
+  {
+  int p = Ustrlen(buffer), keylen, maskoffset, width, masklen;
+  uschar kbuf[4096];
+  lsx_ipentry * e;
+
+  this_is_eol = p > 0 && buffer[p-1] == '\n';
+  if (!last_was_eol) continue;
+
+  memcpy(kbuf, buffer, p + 1);
+  if ((keylen = lsx_line_key(kbuf)) < 0) continue;
+  kbuf[keylen] = 0;
+  if (string_is_ip_address(kbuf, &maskoffset) == 0) continue;
+
+  if (nentries >= maxentries)
+    {
+    lsx_ipentry * n = store_malloc(2 * maxentries * sizeof(lsx_ipentry));
+    memcpy(n, entries, maxentries * sizeof(lsx_ipentry));
+    store_free(entries);
+    entries = n;
+    maxentries *= 2;
+    }
+  e = entries + nentries++;
+  width = lsx_ip_aton(kbuf, e->addr);
+  masklen = maskoffset ? Uatoi(kbuf + maskoffset + 1) : width;
+  if (masklen < 0 || masklen > width) masklen = width;
+  lsx_ip_mask(e->addr, masklen);
+  e->offset = offset;
+  e->table = width == 32 ? masklen : 33 + masklen;
+  count[e->table]++;
+  }
+
+/* Lay out the tables, each at most half full */
+
+len = sizeof(lsx_header);
+for (int t = 0; t < 162; t++) if (count[t]) ntables++;
+len += ntables * sizeof(lsx_iptable);
+  {
+  size_t slots_at = len;
+  unsigned n = 0;
+
+  for (int t = 0; t < 162; t++) if (count[t])
+    {
+    uint32_t nslots = 16;
+    while (nslots < 2 * count[t]) nslots <<= 1;
+    tindex[t] = n++;
+    len += nslots * sizeof(lsx_ipslot);
+    count[t] = nslots;
+    }
+
+  hd = store_malloc(len);
+  lsx_header_init(hd, LSX_IPMAGIC, st, len);
+  hd->nslots = ntables;
+  hd->nkeys = nentries;
+  tables = (lsx_iptable *)(hd + 1);
+
+  for (int t = 0; t < 162; t++) if (count[t])
+    {
+    lsx_iptable * tb = tables + tindex[t];
+    tb->width = t < 33 ? 32 : 128;
+    tb->masklen = t < 33 ? t : t - 33;
+    tb->nslots = count[t];
+    tb->start = slots_at;
+    slots_at += tb->nslots * sizeof(lsx_ipslot);
+    }
+  }
+
+/* Insert the entries in file order; a duplicate network keeps the first */
+
+for (lsx_ipentry * e = entries; e < entries + nentries; e++)
+  {
+  lsx_iptable * tb = tables + tindex[e->table];
+  lsx_ipslot * slots = (lsx_ipslot *)(US hd + tb->start);
+  uint32_t mask = tb->nslots - 1, i;
+
+  for (i = lsx_ip_hash(e->addr) & mask; slots[i].offset; i = (i + 1) & mask)
+    if (memcmp(slots[i].addr, e->addr, sizeof(e->addr)) == 0) break;
+  if (slots[i].offset) continue;
+  memcpy(slots[i].addr, e->addr, sizeof(e->addr));
+  slots[i].offset = e->offset + 1;
+  }
+
+store_free(entries);
+*lenp = len;
+return hd;
+}
+
+
+/* Find the offset of the first line whose network holds an address.
+Return it plus one, or zero if there is none. */
+
+static uint64_t
+lsx_ip_find(const lsx_header * hd, const uschar * keystring)
+{
+const lsx_iptable * tables = (const lsx_iptable *)(hd + 1);
+uint32_t addr[4];
+uint64_t best = 0;
+int width = lsx_ip_aton(keystring, addr);
+
+for (const lsx_iptable * tb = tables; tb < tables + hd->nslots; tb++)
+  if (tb->width == width)
+    {
+    const lsx_ipslot * slots = (const lsx_ipslot *)(CUS hd + tb->start);
+    uint32_t masked[4], mask = tb->nslots - 1;
+
+    memcpy(masked, addr, sizeof(masked));
+    lsx_ip_mask(masked, tb->masklen);
+    for (uint32_t i = lsx_ip_hash(masked) & mask; slots[i].offset;
+	 i = (i + 1) & mask)
+      if (memcmp(slots[i].addr, masked, sizeof(masked)) == 0)
+	{
+	if (!best || slots[i].offset < best) best = slots[i].offset;
+	break;
+	}
+    }
+return best;
+}
+
+
+/* Find or build the index for a file, once per handle. An index file in the
+spool that matches the file's identity and change times is mapped; otherwise
+one is built, and written for the use of later processes if possible. Files
+smaller than lsearch_index_min_size are not indexed.
+
+Returns:  the index, or NULL */
+
+static const lsx_header *
+lsearch_index(lsearch_handle * h, int type)
+{
+const char * magic = type == LSEARCH_IP ? LSX_IPMAGIC : LSX_MAGIC;
+struct stat st;
+uschar * dir, * fname, * tname;
+lsx_header * hd;
+size_t len;
+int fd;
+
+if (h->index_tried) return (const lsx_header *)h->index;
+h->index_tried = TRUE;
+
+if (  lsearch_index_min_size <= 0
+   || fstat(fileno(h->f), &st) < 0 || st.st_size < lsearch_index_min_size)
+  return NULL;
+
+dir = string_sprintf("%s/" LSX_DIRECTORY, spool_directory);
+fname = string_sprintf("%s/%lu.%lu%s", dir,
+  (unsigned long)st.st_dev, (unsigned long)st.st_ino,
+  type == LSEARCH_IP ? ".ip" : "");
+
+if ((fd = Uopen(fname, O_RDONLY, 0)) >= 0)
+  {
+  struct stat ist;
+  void * map;
+
+  if (  fstat(fd, &ist) == 0 && ist.st_size >= (off_t)sizeof(lsx_header)
+     && (map = mmap(NULL, ist.st_size, PROT_READ, MAP_SHARED, fd, 0))
+	!= MAP_FAILED)
+    {
+    hd = map;
+    if (lsx_matches(hd, magic, &st) && ist.st_size == (off_t)hd->total)
+      {
+      close(fd);
+      h->index = map;
+      h->indexlen = ist.st_size;
+      h->index_mapped = TRUE;
+      DEBUG(D_lookup) debug_printf_indent("lsearch: using index %s\n", fname);
+      return hd;
+      }
+    munmap(map, ist.st_size);
+    }
+  close(fd);
+  }
+
+if (!(hd = type == LSEARCH_IP
+	  ? lsx_build_ip(h->f, &st, &len) : lsx_build(h->f, &st, &len)))
+  return NULL;
+h->index = US hd;
+h->indexlen = len;
+DEBUG(D_lookup) debug_printf_indent("lsearch: built index of %u keys\n",
+  hd->nkeys);
+
+/* Save it, unless the file changed so recently that a further change in the
+same second would not be noticed. */
+
+if (st.st_mtime < time(NULL) - 1)
+  {
+  (void) directory_make(spool_directory, US LSX_DIRECTORY, 0750, FALSE);
+  tname = string_sprintf("%s.%d", fname, (int)getpid());
+  if ((fd = Uopen(tname, O_WRONLY|O_CREAT|O_TRUNC|O_EXCL, 0640)) >= 0)
+    {
+    BOOL ok = write_to_fd_buf(fd, US hd, len) == len;
+    if (close(fd) < 0) ok = FALSE;
+    if (ok && Urename(tname, fname) == 0)
+      { DEBUG(D_lookup) debug_printf_indent("lsearch: wrote index %s\n", fname); }
+    else
+      (void) Uunlink(tname);
+    }
+  else DEBUG(D_lookup)
+    debug_printf_indent("lsearch: cannot write index: %s\n", strerror(errno));
+  }
+return hd;
+}
+
+
+
+/*************************************************
+*  Internal function for the various lsearches   *
+*************************************************/
+
+/* See local README for interface description, plus:
+
+Extra argument:
+
+  type     one of the values LSEARCH_PLAIN, LSEARCH_WILD, LSEARCH_NWILD, or
+           LSEARCH_IP
+
+A plain lsearch, or an iplsearch for a single address, uses the index, when
+there is one, to go straight to the candidate lines; the others scan the whole
+file. */
+
+static int
+internal_lsearch_find(void * handle, const uschar * filename,
+  const uschar * keystring, int length, uschar ** result, uschar ** errmsg,
+  int type, const uschar * opts)
+{
+lsearch_handle * h = handle;
+const lsx_header * hd;
+BOOL ret_full = FALSE;
+
+if (opts)
+  {
+  int sep = ',';
+  uschar * ele;
+
+  while ((ele = string_nextinlist(&opts, &sep, NULL, 0)))
+    if (Ustrcmp(ele, "ret=full") == 0)
+      { ret_full = TRUE; break; }
+  }
+
+if (type == LSEARCH_IP)
+  {
+  int maskoffset;
+
+  if (  string_is_ip_address(keystring, &maskoffset) != 0 && maskoffset == 0
+     && (hd = lsearch_index(h, type)))
+    {
+    uint64_t offset = lsx_ip_find(hd, keystring);
+
+    if (!offset || fseek(h->f, (long)(offset - 1), SEEK_SET) != 0)
+      return FAIL;
+    return lsearch_scan(h->f, keystring, length, result, type, ret_full, TRUE);
+    }
+  }
+
+else if (type == LSEARCH_PLAIN && (hd = lsearch_index(h, type)))
+  {
+  const lsx_slot * slots = (const lsx_slot *)(hd + 1);
+  uint32_t mask = hd->nslots - 1, hash = lsx_hash(keystring, length);
+
+  for (uint32_t i = hash & mask; slots[i].offset; i = (i + 1) & mask)
+    if (slots[i].hash == hash)
+      {
+      int rc;
+      if (fseek(h->f, (long)(slots[i].offset - 1), SEEK_SET) != 0) break;
+      if ((rc = lsearch_scan(h->f, keystring, length, result, type, ret_full,
+			    TRUE)) != FAIL)
+	return rc;
+      }
+  return FAIL;
+  }
+
+rewind(h->f);
+return lsearch_scan(h->f, keystring, length, result, type, ret_full, FALSE);
+}
+
+
 /*************************************************
 *         Find entry point for lsearch           *
 *************************************************/
@@ -335,6 +862,79 @@ return internal_lsearch_find(handle, filename, keystring, length, result,
 
 
 
+/*************************************************
+*     Partial-match entry point for lsearch      *
+*************************************************/
+
+/* See local README for interface description.  With an index each key costs
+one probe of it.  Otherwise one pass over the file finds the line for the
+earliest of the keys that has one; as the first line for a key is the one a
+plain lsearch uses, a later line only counts for a key earlier in the list.
+The data is then read from that line as usual. */
+
+static int
+lsearch_partial_find(void * handle, const uschar * filename,
+  const uschar ** keys, int count, int * which, uschar ** result,
+  uschar ** errmsg, uint * do_cache, const uschar * opts)
+{
+lsearch_handle * h = handle;
+uschar buffer[4096];
+uint64_t offset = 0, best_offset = 0;
+int best = count;
+BOOL ret_full = FALSE;
+
+if (lsearch_index(h, LSEARCH_PLAIN))
+  {
+  for (int i = 0; i < count; i++)
+    {
+    int rc = internal_lsearch_find(handle, filename, keys[i], Ustrlen(keys[i]),
+	      result, errmsg, LSEARCH_PLAIN, opts);
+    if (rc != FAIL) { *which = i; return rc; }
+    }
+  return FAIL;
+  }
+
+if (opts)
+  {
+  int sep = ',';
+  uschar * ele;
+
+  while ((ele = string_nextinlist(&opts, &sep, NULL, 0)))
+    if (Ustrcmp(ele, "ret=full") == 0)
+      { ret_full = TRUE; break; }
+  }
+
+rewind(h->f);
+for (BOOL this_is_eol, last_was_eol = TRUE;
+     best > 0 && Ufgets(buffer, sizeof(buffer), h->f) != NULL;
+     last_was_eol = this_is_eol, offset += Ustrlen(buffer))
+  {
+  int p = Ustrlen(buffer), keylen;
+  uschar kbuf[4096];
+
+  this_is_eol = p > 0 && buffer[p-1] == '\n';
+  if (!last_was_eol) continue;
+
+  memcpy(kbuf, buffer, p + 1);
+  if ((keylen = lsx_line_key(kbuf)) < 0) continue;
+  for (int i = 0; i < best; i++)
+    if (Ustrlen(keys[i]) == keylen && strncmpic(kbuf, keys[i], keylen) == 0)
+      {
+      best = i;
+      best_offset = offset;
+      break;
+      }
+  }
+
+if (best >= count || fseek(h->f, (long)best_offset, SEEK_SET) != 0)
+  return FAIL;
+*which = best;
+return lsearch_scan(h->f, keys[best], Ustrlen(keys[best]), result,
+  LSEARCH_PLAIN, ret_full, TRUE);
+}
+
+
+
 /*************************************************
 *      Find entry point for wildlsearch          *
 *************************************************/
@@ -404,7 +1004,14 @@ return DEFER;
 static void
 lsearch_close(void *handle)
 {
-(void)fclose((FILE *)handle);
+lsearch_handle * h = handle;
+
+(void)fclose(h->f);
+if (!h->index) return;
+if (h->index_mapped)
+  (void) munmap(US h->index, h->indexlen);
+else
+  store_free(US h->index);
 }
 
 
@@ -445,6 +1052,7 @@ static lookup_info lsearch_lookup_info = {
   .open = lsearch_open,			/* open function */
   .check = lsearch_check,		/* check function */
   .find = lsearch_find,			/* find function */
+  .partial_find = lsearch_partial_find,	/* partial-match function */
   .close = lsearch_close,		/* close function */
   .tidy = NULL,				/* no tidy function */
   .quote = NULL,			/* no quoting function */
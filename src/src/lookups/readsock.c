@@ -131,6 +131,192 @@ bad:
 /* All use of allocations will be done against the POOL_SEARCH memory,
 which is freed once by search_tidyup(). */
 
+
+
+/*************************************************
+*         Connections kept for reuse             *
+*************************************************/
+
+/* With the keepalive option a connection stays open after its response, for
+use by later requests to the same socket, with the same TLS settings, from
+this process.  The search framework's handles go at every search_tidyup(), so
+these are kept apart from them, in the permanent pool.  A connection inherited
+over a fork belongs to the parent; the child drops its copy of the socket
+without any TLS shutdown, and makes its own. */
+
+typedef struct readsock_keep {
+  struct readsock_keep * next;
+  const uschar *	spec;		/* socket specification */
+  const uschar *	tls;		/* NULL, empty-string, or SNI */
+  pid_t			pid;		/* process that opened it */
+  client_conn_ctx	cctx;
+} readsock_keep;
+
+static readsock_keep * readsock_kept = NULL;
+
+
+static void
+readsock_keep_drop(readsock_keep * k, BOOL shutdown)
+{
+for (readsock_keep ** kp = &readsock_kept; *kp; kp = &(*kp)->next)
+  if (*kp == k) { *kp = k->next; break; }
+#ifndef DISABLE_TLS
+if (shutdown && k->cctx.tls_ctx)
+  tls_close(k->cctx.tls_ctx, TLS_SHUTDOWN_NOWAIT);
+#endif
+(void) close(k->cctx.sock);
+}
+
+
+static readsock_keep *
+readsock_keep_find(const uschar * spec, const uschar * tls)
+{
+for (readsock_keep * k = readsock_kept, * next; k; k = next)
+  {
+  next = k->next;
+  if (k->pid != getpid())
+    readsock_keep_drop(k, FALSE);
+  else if (  Ustrcmp(k->spec, spec) == 0
+	  && (tls ? k->tls && Ustrcmp(k->tls, tls) == 0 : !k->tls))
+    {
+    DEBUG(D_lookup)
+      debug_printf_indent("  reusing kept connection to socket %s\n", spec);
+    return k;
+    }
+  }
+return NULL;
+}
+
+
+static readsock_keep *
+readsock_keep_open(const uschar * spec, const uschar * tls, int timeout,
+  uschar ** errmsg)
+{
+int old_pool = store_pool;
+readsock_keep * k;
+
+store_pool = POOL_PERM;
+k = store_get(sizeof(readsock_keep), GET_UNTAINTED);
+k->spec = string_copy_taint(spec, GET_UNTAINTED);
+k->tls = tls ? string_copy_taint(tls, GET_UNTAINTED) : NULL;
+k->pid = getpid();
+k->cctx.tls_ctx = NULL;
+if (internal_readsock_open(&k->cctx, string_copy(spec), timeout,
+			    US k->tls, errmsg) != OK)
+  k = NULL;
+store_pool = old_pool;
+
+if (k)
+  {
+  k->next = readsock_kept;
+  readsock_kept = k;
+  }
+return k;
+}
+
+
+/* Read one line, the response to a request on a kept connection.  The
+newline is not included.
+
+Returns:  the line, or NULL on end-of-file, error or timeout
+*/
+
+static gstring *
+readsock_read_line(client_conn_ctx * cctx)
+{
+gstring * g = string_get(256);
+uschar buffer[1024];
+
+for (;;)
+  {
+  uschar * nl;
+  int rc;
+
+#ifndef DISABLE_TLS
+  if (cctx->tls_ctx)
+    rc = tls_read(cctx->tls_ctx, buffer, sizeof(buffer));
+  else
+#endif
+    rc = read(cctx->sock, buffer, sizeof(buffer));
+  if (rc <= 0) return NULL;
+
+  if ((nl = memchr(buffer, '\n', rc)))
+    {
+    if (nl + 1 < buffer + rc)
+      DEBUG(D_lookup) debug_printf_indent("  readsock: ignoring %d bytes"
+	" after the response line\n", (int)(buffer + rc - nl - 1));
+    return string_catn(g, buffer, nl - buffer);
+    }
+  g = string_catn(g, buffer, rc);
+  }
+}
+
+
+/* Make a request on a kept connection, opening one if needed.  A kept
+connection which turns out to have been closed by the server is replaced, and
+the request made once more.
+
+Arguments:  as for readsock_find(), plus
+  tls		NULL, empty-string, or SNI
+  timeout	for the connect and for the response
+  cache		whether the result may be cached
+
+Returns:    OK or DEFER
+*/
+
+static int
+readsock_find_kept(const uschar * filename, const uschar * keystring,
+  int length, const uschar * tls, int timeout, BOOL cache, uschar ** result,
+  uschar ** errmsg, uint * do_cache)
+{
+for (int try = 0; try < 2; try++)
+  {
+  readsock_keep * k = readsock_keep_find(filename, tls);
+  BOOL reused = !!k;
+  gstring * g;
+
+  if (!k && !(k = readsock_keep_open(filename, tls, timeout, errmsg)))
+    return DEFER;
+
+  if (length && (
+#ifndef DISABLE_TLS
+      k->cctx.tls_ctx ? tls_write(k->cctx.tls_ctx, keystring, length, FALSE) :
+#endif
+		      write(k->cctx.sock, keystring, length)) != length)
+    {
+    *errmsg = string_sprintf("request write to socket "
+      "failed: %s", strerror(errno));
+    readsock_keep_drop(k, TRUE);
+    if (reused) continue;
+    return DEFER;
+    }
+
+  sigalrm_seen = FALSE;
+  ALARM(timeout);
+  g = readsock_read_line(&k->cctx);
+  ALARM_CLR(0);
+
+  if (g)
+    {
+    *result = string_from_gstring(g);
+    if (!cache) *do_cache = 0;
+    return OK;
+    }
+
+  readsock_keep_drop(k, TRUE);
+  if (sigalrm_seen)
+    {
+    *errmsg = US "socket read timed out";
+    return DEFER;
+    }
+  *errmsg = US "socket closed before response";
+  if (!reused) return DEFER;
+  DEBUG(D_lookup)
+    debug_printf_indent("  kept connection to socket %s was closed\n", filename);
+  }
+return DEFER;
+}
+
 /*************************************************
 *              Open entry point                  *
 *************************************************/
@@ -169,6 +355,7 @@ int sep = ',';
 struct {
 	BOOL do_shutdown:1;
 	BOOL cache:1;
+	BOOL keepalive:1;
 	uschar * do_tls;	/* NULL, empty-string, or SNI */
 } lf = {.do_shutdown = TRUE};
 uschar * eol = NULL;
@@ -197,11 +384,17 @@ if (opts) for (uschar * s; s = string_nextinlist(&opts, &sep, NULL, 0); )
     eol = string_unprinting(s + 4);
   else if (Ustrcmp(s, "cache=yes") == 0)
     lf.cache = TRUE;
+  else if (Ustrcmp(s, "keepalive=yes") == 0)
+    lf.keepalive = TRUE;
   else if (Ustrcmp(s, "send=no") == 0)
     length = 0;
 
 if (!filename) return FAIL;	/* Server spec is required */
 
+if (lf.keepalive)
+  return readsock_find_kept(filename, keystring, length, lf.do_tls, timeout,
+			    lf.cache, result, errmsg, do_cache);
+
 /* Open the socket, if not cached */
 
 if (cctx->sock == -1)
@@ -55,6 +55,209 @@ while ((cn = redis_connections))
 }
 
 
+/* Split a command on whitespace into argv; a backslash protects the next
+character.  Returns the count. */
+
+static int
+redis_argv(const uschar * command, uschar ** argv, int max)
+{
+const uschar * s = command;
+int i;
+uschar c;
+
+while (isspace(*s)) s++;
+
+for (i = 0; *s && i < max; i++)
+  {
+  gstring * g;
+
+  for (g = NULL; (c = *s) && !isspace(c); s++)
+    if (c != '\\' || *++s)		/* backslash protects next char */
+      g = string_catn(g, s, 1);
+  argv[i] = string_from_gstring(g);
+
+  DEBUG(D_lookup) debug_printf_indent("REDIS: argv[%d] '%s'\n", i, argv[i]);
+  while (isspace(*s)) s++;
+  }
+return i;
+}
+
+
+/* Turn a reply into the lookup result.
+
+Returns:	OK with *resultp set, FAIL, or DEFER with *errmsg set
+*/
+
+static int
+redis_result(redisReply * reply, gstring ** resultp, uschar ** errmsg,
+  BOOL * defer_break, uint * do_cache)
+{
+redisReply * entry, * tentry;
+
+*resultp = NULL;
+switch (reply->type)
+  {
+  case REDIS_REPLY_ERROR:
+    *errmsg = string_sprintf("REDIS: lookup result failed: %s\n", reply->str);
+
+    /* trap MOVED cluster responses and follow them */
+    if (Ustrncmp(reply->str, "MOVED", 5) == 0)
+      {
+      DEBUG(D_lookup)
+        debug_printf_indent("REDIS: cluster redirect %s\n", reply->str);
+      /* follow redirect
+      This is cheating, we simply set defer_break = FALSE to move on to
+      the next server in the redis_servers list */
+      *defer_break = FALSE;
+      return DEFER;
+      } else {
+      *defer_break = TRUE;
+      }
+    *do_cache = 0;
+    return DEFER;
+
+  case REDIS_REPLY_NIL:
+    DEBUG(D_lookup)
+      debug_printf_indent("REDIS: query was not one that returned any data\n");
+    *resultp = string_catn(NULL, US"", 1);
+    *do_cache = 0;
+    return OK;
+
+  case REDIS_REPLY_INTEGER:
+    *resultp = string_cat(*resultp, reply->integer != 0 ? US"true" : US"false");
+    break;
+
+  case REDIS_REPLY_STRING:
+  case REDIS_REPLY_STATUS:
+    *resultp = string_catn(*resultp, US reply->str, reply->len);
+    break;
+
+  case REDIS_REPLY_ARRAY:
+ 
+    /* NOTE: For now support 1 nested array result. If needed a limitless
+    result can be parsed */
+
+    for (int i = 0; i < reply->elements; i++)
+      {
+      entry = reply->element[i];
+
+      if (*resultp)
+	*resultp = string_catn(*resultp, US"\n", 1);
+
+      switch (entry->type)
+	{
+	case REDIS_REPLY_INTEGER:
+	  *resultp = string_fmt_append(*resultp, "%d", entry->integer);
+	  break;
+	case REDIS_REPLY_STRING:
+	  *resultp = string_catn(*resultp, US entry->str, entry->len);
+	  break;
+	case REDIS_REPLY_ARRAY:
+	  for (int j = 0; j < entry->elements; j++)
+	    {
+	    tentry = entry->element[j];
+
+	    if (*resultp)
+	      *resultp = string_catn(*resultp, US"\n", 1);
+
+	    switch (tentry->type)
+	      {
+	      case REDIS_REPLY_INTEGER:
+		*resultp = string_fmt_append(*resultp, "%d", tentry->integer);
+		break;
+	      case REDIS_REPLY_STRING:
+		*resultp = string_catn(*resultp, US tentry->str, tentry->len);
+		break;
+	      case REDIS_REPLY_ARRAY:
+		DEBUG(D_lookup)
+		  debug_printf_indent("REDIS: result has nesting of arrays which"
+		    " is not supported. Ignoring!\n");
+		break;
+	      default:
+		DEBUG(D_lookup) debug_printf_indent(
+			  "REDIS: result has unsupported type. Ignoring!\n");
+		break;
+	      }
+	    }
+	    break;
+	  default:
+	    DEBUG(D_lookup) debug_printf_indent("REDIS: query returned unsupported type\n");
+	    break;
+	  }
+	}
+      break;
+  }
+
+if (!*resultp)
+  {
+  *errmsg = US"REDIS: no data found";
+  return FAIL;
+  }
+gstring_release_unused(*resultp);
+return OK;
+}
+
+
+/* With the "prefetch" option the query is a list of commands.  They are sent
+together, and the result of each is put in the lookup cache as though it had
+been looked up alone, so that later lookups of the same commands need no round
+trip to the server.  Replies of nil, and errors, are not cached.  The result of
+the lookup is the number of commands cached.
+
+Returns:	OK, or DEFER with *errmsg set
+*/
+
+static int
+redis_prefetch(redisContext * redis_handle, const uschar * query,
+  gstring ** resultp, uschar ** errmsg)
+{
+const uschar * list = query, * cmd;
+int sep = 0, sent = 0, cached = 0;
+
+while ((cmd = string_nextinlist(&list, &sep, NULL, 0)))
+  {
+  uschar * argv[32];
+  int argc = redis_argv(cmd, argv, nele(argv));
+
+  if (argc && redisAppendCommandArgv(redis_handle, argc, CCSS argv, NULL)
+	      != REDIS_OK)
+    {
+    *errmsg = string_sprintf("REDIS: prefetch failed: %s\n", redis_handle->errstr);
+    return DEFER;
+    }
+  if (argc) sent++;
+  }
+
+list = query;
+sep = 0;		/* so that a leading change of separator is skipped again */
+while ((cmd = string_nextinlist(&list, &sep, NULL, 0)))
+  {
+  redisReply * reply;
+  gstring * g;
+  uschar * e;
+  BOOL dummy_break;
+  uint do_cache = UINT_MAX;
+  int rc;
+
+  if (!*cmd || !sent--) continue;
+  if (redisGetReply(redis_handle, (void **)&reply) != REDIS_OK || !reply)
+    {
+    *errmsg = string_sprintf("REDIS: prefetch failed: %s\n", redis_handle->errstr);
+    return DEFER;
+    }
+  rc = redis_result(reply, &g, &e, &dummy_break, &do_cache);
+  freeReplyObject(reply);
+  if (rc == DEFER || !do_cache) continue;
+  search_cache_seed(cmd, rc == OK ? string_from_gstring(g) : NULL);
+  cached++;
+  }
+
+DEBUG(D_lookup) debug_printf_indent("REDIS: prefetched %d\n", cached);
+*resultp = string_fmt_append(NULL, "%d", cached);
+return OK;
+}
+
+
 /* This function is called from the find entry point to do the search for a
 single server.
 
@@ -80,14 +283,20 @@ perform_redis_search(const uschar *command, uschar *server, uschar **resultptr,
 {
 redisContext *redis_handle = NULL;        /* Keep compilers happy */
 redisReply *redis_reply = NULL;
-redisReply *entry = NULL;
-redisReply *tentry = NULL;
 redis_connection *cn;
 int yield = DEFER;
-int i, j;
 gstring * result = NULL;
 uschar *server_copy = NULL;
 uschar *sdata[3];
+BOOL prefetch = FALSE;
+
+if (opts)
+  {
+  const uschar * list = opts;
+  uschar * ele;
+  for (int sep = ','; (ele = string_nextinlist(&list, &sep, NULL, 0)); )
+    if (Ustrcmp(ele, "prefetch") == 0) prefetch = TRUE;
+  }
 
 /* Disaggregate the parameters from the server argument.
 The order is host:port(socket)
@@ -205,32 +414,21 @@ if(sdata[1])
   DEBUG(D_lookup) debug_printf_indent("REDIS: Selecting database=%s\n", sdata[1]);
   }
 
+if (prefetch)
+  {
+  yield = redis_prefetch(redis_handle, command, &result, errmsg);
+  goto REDIS_EXIT;
+  }
+
 /* split string on whitespace into argv */
   {
   uschar * argv[32];
-  const uschar * s = command;
-  int siz, ptr, i;
-  uschar c;
-
-  while (isspace(*s)) s++;
-
-  for (i = 0; *s && i < nele(argv); i++)
-    {
-    gstring * g;
-
-    for (g = NULL; (c = *s) && !isspace(c); s++)
-      if (c != '\\' || *++s)		/* backslash protects next char */
-	g = string_catn(g, s, 1);
-    argv[i] = string_from_gstring(g);
-
-    DEBUG(D_lookup) debug_printf_indent("REDIS: argv[%d] '%s'\n", i, argv[i]);
-    while (isspace(*s)) s++;
-    }
+  int argc = redis_argv(command, argv, nele(argv));
 
   /* Run the command. We use the argv form rather than plain as that parses
   into args by whitespace yet has no escaping mechanism. */
 
-  if (!(redis_reply = redisCommandArgv(redis_handle, i, CCSS argv, NULL)))
+  if (!(redis_reply = redisCommandArgv(redis_handle, argc, CCSS argv, NULL)))
     {
     *errmsg = string_sprintf("REDIS: query failed: %s\n", redis_handle->errstr);
     *defer_break = FALSE;
@@ -238,109 +436,7 @@ if(sdata[1])
     }
   }
 
-switch (redis_reply->type)
-  {
-  case REDIS_REPLY_ERROR:
-    *errmsg = string_sprintf("REDIS: lookup result failed: %s\n", redis_reply->str);
-
-    /* trap MOVED cluster responses and follow them */
-    if (Ustrncmp(redis_reply->str, "MOVED", 5) == 0)
-      {
-      DEBUG(D_lookup)
-        debug_printf_indent("REDIS: cluster redirect %s\n", redis_reply->str);
-      /* follow redirect
-      This is cheating, we simply set defer_break = FALSE to move on to
-      the next server in the redis_servers list */
-      *defer_break = FALSE;
-      return DEFER;
-      } else {
-      *defer_break = TRUE;
-      }
-    *do_cache = 0;
-    goto REDIS_EXIT;
-    /* NOTREACHED */
-
-  case REDIS_REPLY_NIL:
-    DEBUG(D_lookup)
-      debug_printf_indent("REDIS: query was not one that returned any data\n");
-    result = string_catn(result, US"", 1);
-    *do_cache = 0;
-    goto REDIS_EXIT;
-    /* NOTREACHED */
-
-  case REDIS_REPLY_INTEGER:
-    result = string_cat(result, redis_reply->integer != 0 ? US"true" : US"false");
-    break;
-
-  case REDIS_REPLY_STRING:
-  case REDIS_REPLY_STATUS:
-    result = string_catn(result, US redis_reply->str, redis_reply->len);
-    break;
-
-  case REDIS_REPLY_ARRAY:
- 
-    /* NOTE: For now support 1 nested array result. If needed a limitless
-    result can be parsed */
-
-    for (int i = 0; i < redis_reply->elements; i++)
-      {
-      entry = redis_reply->element[i];
-
-      if (result)
-	result = string_catn(result, US"\n", 1);
-
-      switch (entry->type)
-	{
-	case REDIS_REPLY_INTEGER:
-	  result = string_fmt_append(result, "%d", entry->integer);
-	  break;
-	case REDIS_REPLY_STRING:
-	  result = string_catn(result, US entry->str, entry->len);
-	  break;
-	case REDIS_REPLY_ARRAY:
-	  for (int j = 0; j < entry->elements; j++)
-	    {
-	    tentry = entry->element[j];
-
-	    if (result)
-	      result = string_catn(result, US"\n", 1);
-
-	    switch (tentry->type)
-	      {
-	      case REDIS_REPLY_INTEGER:
-		result = string_fmt_append(result, "%d", tentry->integer);
-		break;
-	      case REDIS_REPLY_STRING:
-		result = string_catn(result, US tentry->str, tentry->len);
-		break;
-	      case REDIS_REPLY_ARRAY:
-		DEBUG(D_lookup)
-		  debug_printf_indent("REDIS: result has nesting of arrays which"
-		    " is not supported. Ignoring!\n");
-		break;
-	      default:
-		DEBUG(D_lookup) debug_printf_indent(
-			  "REDIS: result has unsupported type. Ignoring!\n");
-		break;
-	      }
-	    }
-	    break;
-	  default:
-	    DEBUG(D_lookup) debug_printf_indent("REDIS: query returned unsupported type\n");
-	    break;
-	  }
-	}
-      break;
-  }
-
-
-if (result)
-  gstring_release_unused(result);
-else
-  {
-  yield = FAIL;
-  *errmsg = US"REDIS: no data found";
-  }
+yield = redis_result(redis_reply, &result, errmsg, defer_break, do_cache);
 
 REDIS_EXIT:
 
@@ -12,6 +12,25 @@
 
 #include <sqlite3.h>
 
+/* Prepared statements are kept on the handle, keyed by the text of the query
+with its string literals replaced by parameters, so that lookups differing
+only in the values compared need not parse and plan the statement again. */
+
+#define SQLITE_STMT_MAX		16	/* statements kept per handle */
+#define SQLITE_PARAMS_MAX	16	/* literals made into parameters */
+
+typedef struct {
+  uschar *	tmpl;			/* malloc'd */
+  sqlite3_stmt * stmt;
+  unsigned	used;			/* for LRU replacement */
+} sqlite_stmt;
+
+typedef struct {
+  sqlite3 *	db;
+  unsigned	uses;
+  sqlite_stmt	stmts[SQLITE_STMT_MAX];
+} sqlite_handle;
+
 
 /*************************************************
 *              Open entry point                  *
@@ -23,6 +42,7 @@ static void *
 sqlite_open(const uschar * filename, uschar ** errmsg)
 {
 sqlite3 *db = NULL;
+sqlite_handle * h;
 int ret;
 
 if (!filename || !*filename)
@@ -40,9 +60,13 @@ else if ((ret = sqlite3_open(CCS filename, &db)) != 0)
   DEBUG(D_lookup) debug_printf_indent("Error opening database: %s\n", *errmsg);
   }
 
-if (db)
-  sqlite3_busy_timeout(db, 1000 * sqlite_lock_timeout);
-return db;
+if (!db) return NULL;
+
+sqlite3_busy_timeout(db, 1000 * sqlite_lock_timeout);
+h = store_get(sizeof(sqlite_handle), GET_UNTAINTED);
+memset(h, 0, sizeof(*h));
+h->db = db;
+return h;
 }
 
 
@@ -52,13 +76,11 @@ return db;
 
 /* See local README for interface description. */
 
-static int
-sqlite_callback(void *arg, int argc, char **argv, char **azColName)
-{
-gstring * res = *(gstring **)arg;
-
-/* For second and subsequent results, insert \n */
+/* Add a row of results.  For second and subsequent results, insert \n */
 
+static gstring *
+sqlite_row(gstring * res, int argc, const char ** argv, const char ** names)
+{
 if (res)
   res = string_catn(res, US"\n", 1);
 
@@ -68,7 +90,7 @@ if (argc > 1)
   for (int i = 0; i < argc; i++)
     {
     uschar * value = US(argv[i] ? argv[i] : "<NULL>");
-    res = lf_quote(US azColName[i], value, Ustrlen(value), res);
+    res = lf_quote(US names[i], value, Ustrlen(value), res);
     }
   }
 
@@ -76,21 +98,207 @@ else
   res = string_cat(res, argv[0] ? US argv[0] : US "<NULL>");
 
 /* always return a non-null gstring, even for a zero-length string result */
-*(gstring **)arg = res ? res : string_get(1);
+return res ? res : string_get(1);
+}
+
+
+static int
+sqlite_callback(void *arg, int argc, char **argv, char **azColName)
+{
+*(gstring **)arg = sqlite_row(*(gstring **)arg, argc, CCSS argv,
+  CCSS azColName);
 return 0;
 }
 
 
+/* Make the template for a query: string literals which are the operand of a
+comparison are replaced by parameters, their values being returned.  Quoted
+identifiers and comments are copied unchanged.
+
+Arguments:
+  query		the query
+  vals		where to put the values of the literals replaced
+  nvals		where to put their count
+
+Returns:	the template
+*/
+
+static uschar *
+sqlite_template(const uschar * query, uschar ** vals, int * nvals)
+{
+gstring * g = NULL;
+const uschar * s = query, * word = NULL;
+uschar prev = 0;		/* last non-space character copied */
+
+*nvals = 0;
+while (*s)
+  {
+  const uschar * t = s;
+  uschar c = *s;
+
+  if (c == '\'')
+    {
+    BOOL param = *nvals < SQLITE_PARAMS_MAX
+      && (  prev == '=' || prev == '<' || prev == '>'
+	 || (  word
+	    && (  strncmpic(word, US"like", 4) == 0
+	       || strncmpic(word, US"glob", 4) == 0)
+	    && !isalnum(word[4]) && word[4] != '_')
+	 );
+    gstring * v = NULL;
+
+    for (t++; *t; t++)
+      if (*t == '\'')
+	if (t[1] == '\'') v = string_catn(v, ++t, 1);
+	else break;
+      else
+	v = string_catn(v, t, 1);
+    if (!*t) param = FALSE;	/* unterminated; leave it to the parser */
+    else t++;
+
+    if (param)
+      {
+      vals[(*nvals)++] = v ? string_from_gstring(v) : US"";
+      g = string_catn(g, US"?", 1);
+      }
+    else
+      g = string_catn(g, s, t - s);
+    s = t;
+    prev = '\'';
+    word = NULL;
+    continue;
+    }
+
+  if (c == '"' || c == '`' || c == '[')
+    {
+    uschar e = c == '[' ? ']' : c;
+    for (t++; *t && *t != e; ) t++;
+    if (*t) t++;
+    }
+  else if (c == '-' && s[1] == '-')
+    while (*t && *t != '\n') t++;
+  else if (c == '/' && s[1] == '*')
+    {
+    for (t += 2; *t && !(*t == '*' && t[1] == '/'); ) t++;
+    if (*t) t += 2;
+    }
+  else if (isalpha(c) || c == '_')
+    {
+    while (isalnum(*t) || *t == '_') t++;
+    word = s;
+    prev = c;
+    g = string_catn(g, s, t - s);
+    s = t;
+    continue;
+    }
+  else
+    t++;
+
+  if (!isspace(c)) { prev = c; word = NULL; }
+  g = string_catn(g, s, t - s);
+  s = t;
+  }
+return g ? string_from_gstring(g) : US"";
+}
+
+
+/* Get a prepared statement for a template, from the handle or by preparing
+it.  A query of more than one statement is not prepared.
+
+Returns:	the statement, or NULL
+*/
+
+static sqlite3_stmt *
+sqlite_stmt_get(sqlite_handle * h, const uschar * tmpl)
+{
+sqlite_stmt * ss, * lru = h->stmts;
+sqlite3_stmt * stmt;
+const char * tail;
+
+for (ss = h->stmts; ss < h->stmts + SQLITE_STMT_MAX; ss++)
+  {
+  if (ss->tmpl && Ustrcmp(ss->tmpl, tmpl) == 0)
+    {
+    DEBUG(D_lookup) debug_printf_indent("sqlite: using prepared statement\n");
+    ss->used = ++h->uses;
+    return ss->stmt;
+    }
+  if (ss->used < lru->used) lru = ss;
+  }
+
+if (sqlite3_prepare_v2(h->db, CCS tmpl, -1, &stmt, &tail) != SQLITE_OK || !stmt)
+  return NULL;
+while (isspace(*tail) || *tail == ';') tail++;
+if (*tail)
+  {
+  sqlite3_finalize(stmt);
+  return NULL;
+  }
+
+if (lru->tmpl)
+  {
+  sqlite3_finalize(lru->stmt);
+  store_free(lru->tmpl);
+  }
+lru->tmpl = string_copy_malloc(tmpl);
+lru->stmt = stmt;
+lru->used = ++h->uses;
+return stmt;
+}
+
+
 static int
 sqlite_find(void * handle, const uschar * filename, const uschar * query,
   int length, uschar ** result, uschar ** errmsg, uint * do_cache,
   const uschar * opts)
 {
-int ret;
+sqlite_handle * h = handle;
+sqlite3_stmt * stmt;
+uschar * vals[SQLITE_PARAMS_MAX];
+int nvals, ret;
 gstring * res = NULL;
 
-ret = sqlite3_exec(handle, CS query, sqlite_callback, &res, CSS errmsg);
-if (ret != SQLITE_OK)
+/* Use a prepared statement when the query can have one, binding the values
+of the literals taken out of it.  Otherwise, or if the parameters turn out not
+to be allowed where the literals were, run the query text itself. */
+
+if ((stmt = sqlite_stmt_get(h, sqlite_template(query, vals, &nvals))))
+  {
+  const char ** argv = NULL, ** names = NULL;
+  int n = 0;
+
+  for (int i = 0; i < nvals; i++)
+    sqlite3_bind_text(stmt, i+1, CCS vals[i], -1, SQLITE_STATIC);
+
+  /* The column names are got after the first step, which can prepare the
+  statement again if the schema has changed. */
+
+  while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+    if (!argv)
+      {
+      n = sqlite3_column_count(stmt);
+      argv = store_get(2 * (n+1) * sizeof(char *), GET_UNTAINTED);
+      names = argv + n + 1;
+      for (int i = 0; i < n; i++)
+	names[i] = sqlite3_column_name(stmt, i);
+      }
+    for (int i = 0; i < n; i++)
+      argv[i] = CCS sqlite3_column_text(stmt, i);
+    res = sqlite_row(res, n, argv, names);
+    }
+  if (ret != SQLITE_DONE)
+    *errmsg = string_copy(US sqlite3_errmsg(h->db));
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  if (ret != SQLITE_DONE)
+    {
+    debug_printf_indent("sqlite3_step failed: %s\n", *errmsg);
+    return FAIL;
+    }
+  }
+else if ((ret = sqlite3_exec(h->db, CS query, sqlite_callback, &res, CSS errmsg))
+	  != SQLITE_OK)
   {
   debug_printf_indent("sqlite3_exec failed: %s\n", *errmsg);
   return FAIL;
@@ -112,7 +320,15 @@ return OK;
 
 static void sqlite_close(void *handle)
 {
-sqlite3_close(handle);
+sqlite_handle * h = handle;
+
+for (sqlite_stmt * ss = h->stmts; ss < h->stmts + SQLITE_STMT_MAX; ss++)
+  if (ss->tmpl)
+    {
+    sqlite3_finalize(ss->stmt);
+    store_free(ss->tmpl);
+    }
+sqlite3_close(h->db);
 }
 
 
@@ -218,6 +218,9 @@ due to conflicts with other common macros. */
 #ifdef LOOKUP_LSEARCH
   builtin_macro_create(US"_HAVE_LOOKUP_LSEARCH");
 #endif
+#ifdef LOOKUP_BLOOM
+  builtin_macro_create(US"_HAVE_LOOKUP_BLOOM");
+#endif
 #ifdef LOOKUP_CDB
   builtin_macro_create(US"_HAVE_LOOKUP_CDB");
 #endif
@@ -26,7 +26,7 @@ a string as a text string. This is sometimes useful for debugging output. */
 /* When running in the test harness, the load average is fudged. */
 
 #define OS_GETLOADAVG() \
-  (f.running_in_test_harness? (test_harness_load_avg += 10) : os_getloadavg())
+  (f.running_in_test_harness? (test_harness_load_avg += 10) : daemon_getloadavg())
 
 
 /* The address_item structure has a struct full of 1-bit flags. These macros
@@ -187,12 +187,39 @@ message id with a trailing "-H" or "-D" added. */
 #define SPOOL_NAME_LENGTH_OLD	(MESSAGE_ID_LENGTH_OLD + 2)
 #define SPOOL_NAME_LENGTH	(MESSAGE_ID_LENGTH     + 2)
 
+/* How far, in microseconds, the time part of the message ids made by one
+process may run ahead of the clock when they are made within one tick */
+
+#define MESSAGE_ID_MAX_LEAD	1000
+
+/* The binary spool header format is marked by a zero byte following the
+first line, then a version byte. The rest of the file is records, each a tag,
+a length and the data; see spool_out.c. */
+
+#define SPOOL_BINARY_MAGIC	0
+#define SPOOL_BINARY_VERSION	1
+
+enum { SPB_LOGIN = 'l', SPB_UID = 'u', SPB_GID = 'g', SPB_SENDER = 's',
+       SPB_TIME = 't', SPB_WARNINGS = 'w', SPB_OPTION = 'o', SPB_ACLVAR = 'a',
+       SPB_NONRCPT = 'n', SPB_RCPT_COUNT = 'c', SPB_RCPT = 'r',
+       SPB_HEADER = 'h' };
+
 /* The maximum number of message ids to store in a waiting database
 record, and the max number of continuation records allowed. */
 
 #define WAIT_NAME_MAX 50
 #define WAIT_CONT_MAX 1000
 
+/* Maximum number of message ids passed on to a continued delivery as a
+batch (-MCB) */
+
+#define CONTINUE_BATCH_MAX 200
+
+/* Largest message for which the output of a transport filter is held in
+memory for DKIM signing, rather than being written to a -K file */
+
+#define DKIM_MEMORY_SIGN_MAX (1024*1024)
+
 /* Fixed option values for all PCRE functions */
 
 #define PCRE_COPT 0   /* compile */
@@ -434,6 +461,18 @@ enum {
   DTi_pretrigger,
 };
 
+/* Events for the trace ring */
+
+enum {
+  TRACE_SMTP_CONN = 1,		/* remote port, local port */
+  TRACE_SMTP_CMD,		/* command code, bytes still buffered */
+  TRACE_DELIVER_MSG,		/* forced, giving up, in a queue run */
+  TRACE_DELIVER_ADDR,		/* result, basic_errno, more_errno */
+  TRACE_TPT_CONN,		/* socket, errno, port */
+  TRACE_TPT_HOST,		/* result, basic_errno, more_errno */
+  TRACE_DNS,			/* type, answer length, h_errno */
+};
+
 /* Options bits for logging. Those that have values < BITWORDSIZE can be used
 in calls to log_write(). The others are put into later words in log_selector
 and are only ever tested independently, so they do not need bit mask
@@ -487,6 +526,7 @@ enum logbit {
   Li_queue_time,
   Li_queue_time_exclusive,
   Li_queue_time_overall,
+  Li_receive_phases,
   Li_receive_time,
   Li_received_sender,
   Li_received_recipients,
@@ -578,6 +618,7 @@ table exim_errstrings[] in log.c */
 #define ERRNO_QUEUE_DOMAIN   (-56)   /* Domain in queue_domains */
 #define ERRNO_TRETRY         (-57)   /* Transport concurrency limit */
 #define ERRNO_EVENT	     (-58)   /* Event processing request alternate response */
+#define ERRNO_MEMLIMIT       (-59)   /* Pool store over store_soft_limit */
 
 
 
@@ -858,7 +899,7 @@ enum {
 
 enum { MSG_DELIVER, MSG_FREEZE, MSG_REMOVE, MSG_THAW, MSG_ADD_RECIPIENT,
        MSG_MARK_ALL_DELIVERED, MSG_MARK_DELIVERED, MSG_EDIT_SENDER,
-       MSG_SHOW_COPY, MSG_LOAD, MSG_SETQUEUE,
+       MSG_SHOW_COPY, MSG_LOAD, MSG_SETQUEUE, MSG_REWRITE_HEADER,
        /* These ones must be last: a test for >= MSG_SHOW_BODY is used
        to test for actions that list individual spool files. */
        MSG_SHOW_BODY, MSG_SHOW_HEADER, MSG_SHOW_LOG };
@@ -1131,6 +1172,41 @@ should not be one active. */
 #define NOTIFY_MSG_QRUN		1	/* 2stage qrun fast-ramp trigger */
 #define NOTIFY_QUEUE_SIZE_REQ	2	/* obtain current queue count */
 #define NOTIFY_REGEX		3	/* an RE for caching */
+#define NOTIFY_QUEUE_INDEX_ADD	4	/* message arrived in queue */
+#define NOTIFY_QUEUE_INDEX_DEL	5	/* message left queue */
+#define NOTIFY_QUEUE_INDEX_REQ	6	/* obtain a slice of the queue index */
+#define NOTIFY_SPOOL_SYNC	7	/* group commit of received messages */
+#define NOTIFY_LOOKUP_GET	8	/* query the shared lookup cache */
+#define NOTIFY_LOOKUP_PUT	9	/* add to the shared lookup cache */
+#define NOTIFY_LOOKUP_FLUSH	10	/* empty the shared cache for a lookup type */
+#define NOTIFY_LOOKUP_STATS	11	/* counts for the shared cache */
+#define NOTIFY_POOL_PARK	12	/* hand an idle connection to the daemon */
+#define NOTIFY_POOL_BORROW	13	/* take one back */
+#define NOTIFY_RATELIMIT	14	/* ratelimit update against the daemon's rates */
+#define NOTIFY_QUEUE_STATS	15	/* running totals from the queue index */
+#define NOTIFY_LOG_WRITE	16	/* log line for the daemon to write */
+#define NOTIFY_BLOCKLIST	17	/* temporary entry for the daemon blocklist */
+
+#define NOTIFY_MSG_MAX		16384	/* largest notifier datagram handled */
+
+/* Start of the shared-cache keys for server_condition results */
+#define AUTH_CACHE_PREFIX	"auth"
+
+/* Things timed for the metrics option */
+#define METRICS_TIME_DNS	0
+#define METRICS_TIME_LOOKUP	1
+#define METRICS_TIME_TLS_SERVER	2
+#define METRICS_TIME_TLS_CLIENT	3
+
+/* Phases of receiving a message, timed for the metrics option and the
+receive_phases log selector.  Those of the SMTP session come first, before
+RP_MAIL; the rest are per message. */
+
+enum { RP_BANNER, RP_EHLO, RP_STARTTLS, RP_AUTH,
+       RP_MAIL, RP_RCPT, RP_PREDATA, RP_DNSLISTS, RP_DATA, RP_DKIM, RP_SPOOL,
+       RP_COUNT };
+
+#define PHASE_TIMING	(metrics || LOGGING(receive_phases))
 
 /* Flags for match_check_string() */
 typedef unsigned mcs_flags;
@@ -143,7 +143,19 @@ typedef struct clamd_address {
   uschar * hostspec;
   unsigned tcp_port;
   unsigned retry;
+  BOOL	   session;		/* keep the connection, with IDSESSION */
+  BOOL	   fildes;		/* pass the file descriptor (Unix socket) */
 } clamd_address;
+
+/* A clamd connection in IDSESSION mode, kept open by this process for its
+next scan.  The pid guards against use by a forked child. */
+
+static struct {
+  int		 sock;
+  pid_t		 pid;
+  const uschar * hostspec;
+  unsigned	 tcp_port;
+} clamd_session = {.sock = -1};
 #endif
 
 
@@ -537,6 +549,7 @@ clamd_option(clamd_address * cd, const uschar * optstr, int * subsep)
 uschar * s;
 
 cd->retry = 0;
+cd->session = cd->fildes = FALSE;
 while ((s = string_nextinlist(&optstr, subsep, NULL, 0)))
   if (Ustrncmp(s, "retry=", 6) == 0)
     {
@@ -545,10 +558,49 @@ while ((s = string_nextinlist(&optstr, subsep, NULL, 0)))
       return FAIL;
     cd->retry = sec;
     }
+  else if (Ustrcmp(s, "session") == 0)
+    cd->session = TRUE;
+  else if (Ustrcmp(s, "fildes") == 0)
+    cd->fildes = TRUE;
   else
     return FAIL;
 return OK;
 }
+
+
+/* Pass an open file to clamd, after a FILDES command.  The descriptor goes as
+ancillary data with a single dummy byte. */
+
+static BOOL
+clamd_send_fd(int sock, int fd)
+{
+struct msghdr msg;
+union {
+  struct cmsghdr hdr;
+  char buf[CMSG_SPACE(sizeof(int))];
+} cmsgbuf;
+struct cmsghdr * cp;
+char ch = 0;
+struct iovec vec = {.iov_base = &ch, .iov_len = 1};
+ssize_t n;
+
+memset(&msg, 0, sizeof(msg));
+memset(&cmsgbuf, 0, sizeof(cmsgbuf));
+msg.msg_control = &cmsgbuf.buf;
+msg.msg_controllen = sizeof(cmsgbuf.buf);
+
+cp = CMSG_FIRSTHDR(&msg);
+cp->cmsg_len = CMSG_LEN(sizeof(int));
+cp->cmsg_level = SOL_SOCKET;
+cp->cmsg_type = SCM_RIGHTS;
+memcpy(CMSG_DATA(cp), &fd, sizeof(int));
+
+msg.msg_iov = &vec;
+msg.msg_iovlen = 1;
+
+while ((n = sendmsg(sock, &msg, 0)) == -1 && errno == EINTR) ;
+return n == 1;
+}
 #endif
 
 
@@ -587,6 +639,7 @@ const uschar * scanner_options;
 client_conn_ctx malware_daemon_ctx = {.sock = -1};
 time_t tmo;
 uschar * eml_filename, * eml_dir;
+const uschar * cache_key = NULL;
 
 if (!malware_re)
   return FAIL;		/* empty means "don't match anything" */
@@ -640,6 +693,25 @@ if (*av_scanner == '$')
 else
   av_scanner_textonly = TRUE;
 
+/* With malware_verdict_cache set, the verdict of an earlier scan of the
+same body with the same scanner settings may be held. */
+
+if (!malware_ok && malware_verdict_cache > 0 && !scan_filename)
+  {
+  const uschar * bh = spool_mbox_body_hash();
+  dbdata_scan_verdict * v;
+  int len;
+
+  if (bh)
+    if ((v = scan_verdict_get(
+	  cache_key = string_sprintf("malware:%s:%s", av_scanner_work, bh), &len)))
+      {
+      malware_name = v->found ? string_copy(v->data) : NULL;
+      malware_ok = TRUE;
+      cache_key = NULL;
+      }
+  }
+
 /* Do not scan twice (unless av_scanner is dynamic). */
 if (!malware_ok)
   {
@@ -1453,7 +1525,8 @@ badseek:  err = errno;
       host_item connhost;
       int clam_fd;
       unsigned int fsize_uint;
-      BOOL use_scan_command = FALSE;
+      BOOL use_scan_command = FALSE, session = FALSE, fildes = FALSE;
+      BOOL reused = FALSE;
       clamd_address * cv[MAX_CLAMD_SERVERS];
       int num_servers = 0;
       uint32_t send_size, send_final_zeroblock;
@@ -1476,12 +1549,15 @@ badseek:  err = errno;
 	/* extract socket-path part */
 	sublist = scanner_options;
 	cd->hostspec = string_nextinlist(&sublist, &subsep, NULL, 0);
+	cd->tcp_port = 0;
 
 	/* parse options */
 	if (clamd_option(cd, sublist, &subsep) != OK)
 	  return m_panic_defer(scanent, NULL,
 	    string_sprintf("bad option '%s'", scanner_options));
 	cv[0] = cd;
+	session = cd->session;
+	fildes = cd->fildes;
 	}
       else
 	{
@@ -1528,6 +1604,9 @@ badseek:  err = errno;
 	  if (clamd_option(cd, sublist, &subsep) != OK)
 	    return m_panic_defer(scanent, NULL,
 	      string_sprintf("bad option '%s'", scanner_options));
+	  if (cd->fildes)
+	    return m_panic_defer(scanent, NULL,
+	      string_sprintf("fildes needs a Unix socket: '%s'", scanner_options));
 
 	  cv[num_servers++] = cd;
 	  if (num_servers >= MAX_CLAMD_SERVERS)
@@ -1548,7 +1627,7 @@ badseek:  err = errno;
 
       /* See the discussion of response formats below to see why we really
       don't like colons in filenames when passing filenames to ClamAV. */
-      if (use_scan_command && Ustrchr(eml_filename, ':'))
+      if (use_scan_command && !fildes && Ustrchr(eml_filename, ':'))
 	return m_panic_defer(scanent, NULL,
 	  string_sprintf("local/SCAN mode incompatible with" \
 	    " : in path to email filename [%s]", eml_filename));
@@ -1563,8 +1642,34 @@ badseek:  err = errno;
 	cmd_str.len = n;		/* .len is a size_t */
 	}
 
+      /* A session kept from an earlier scan by this process can be used if it
+      is with one of these servers and clamd has not closed it (for its
+      IdleTimeout) since. */
+
+      if (clamd_session.sock >= 0)
+	{
+	if (  clamd_session.pid == getpid()
+	   && poll_one_fd(clamd_session.sock, POLLIN, 0) == 0)
+	  for (int i = 0; i < (num_servers ? num_servers : 1); i++)
+	    if (  cv[i]->session
+	       && cv[i]->tcp_port == clamd_session.tcp_port
+	       && Ustrcmp(cv[i]->hostspec, clamd_session.hostspec) == 0)
+	      {
+	      DEBUG(D_acl) debug_printf_indent("reusing clamd session with %s\n",
+			    cv[i]->hostspec);
+	      malware_daemon_ctx.sock = clamd_session.sock;
+	      hostname = cv[i]->hostspec;
+	      session = reused = TRUE;
+	      break;
+	      }
+	if (!reused) (void) close(clamd_session.sock);
+	clamd_session.sock = -1;
+	}
+
       /* We have some network servers specified */
-      if (num_servers)
+      if (reused)
+	;
+      else if (num_servers)
 	{
 	/* Confirmed in ClamAV source (0.95.3) that the TCPAddr option of clamd
 	only supports AF_INET, but we should probably be looking to the
@@ -1585,11 +1690,13 @@ badseek:  err = errno;
 	    /*XXX we trust that the cmd_str is idempotent */
 	    if ((malware_daemon_ctx.sock = m_tcpsocket(cd->hostspec, cd->tcp_port,
 				    &connhost, &errstr,
-				    use_scan_command ? &cmd_str : NULL)) >= 0)
+				    use_scan_command && !cd->session
+				    ? &cmd_str : NULL)) >= 0)
 	      {
 	      /* Connection successfully established with a server */
 	      hostname = cd->hostspec;
-	      if (use_scan_command) cmd_str.len = 0;
+	      session = cd->session;
+	      if (use_scan_command && !session) cmd_str.len = 0;
 	      break;
 	      }
 	    if (cd->retry <= 0) break;
@@ -1622,6 +1729,31 @@ badseek:  err = errno;
 	  while (cv[0]->retry > 0) cv[0]->retry = sleep(cv[0]->retry);
 	  }
 
+      /* In a session, and for FILDES, commands have the 'n' prefix and the
+      replies end with a newline; replies in a session are also prefixed with
+      a request number. */
+
+      if (session || fildes)
+	{
+	int n;
+	if (session && !reused)
+	  if (send(malware_daemon_ctx.sock, "nIDSESSION\n", 11, 0) < 0)
+	    return m_panic_defer_3(scanent, CUS hostname,
+	      string_sprintf("unable to send IDSESSION to socket (%s)",
+		strerror(errno)),
+	      malware_daemon_ctx.sock);
+
+	if (fildes)
+	  { cmd_str.data = US"nFILDES\n"; cmd_str.len = 8; }
+	else if (!use_scan_command)
+	  { cmd_str.data = US"nINSTREAM\n"; cmd_str.len = 10; }
+	else
+	  {
+	  cmd_str.data = string_sprintf("nSCAN %s\n%n", eml_filename, &n);
+	  cmd_str.len = n;
+	  }
+	}
+
       /* have socket in variable "sock"; command to use is semi-independent of
       the socket protocol.  We use SCAN if is local (either Unix/local
       domain socket, or explicitly told local) else we stream the data.
@@ -1730,6 +1862,34 @@ badseek:  err = errno;
 			  US &off, sizeof(off));
 #endif
 	}
+      else if (fildes)
+	{
+	DEBUG(D_acl) debug_printf_indent(
+	    "Malware scan: issuing %s file-descriptor scan\n", scanner_name);
+
+	if (send(malware_daemon_ctx.sock, cmd_str.data, cmd_str.len, 0) < 0)
+	  return m_panic_defer_3(scanent, CUS callout_address,
+	    string_sprintf("unable to write to socket (%s)", strerror(errno)),
+	    malware_daemon_ctx.sock);
+
+	if ((clam_fd = exim_open2(CS eml_filename, O_RDONLY)) < 0)
+	  {
+	  int err = errno;
+	  return m_panic_defer_3(scanent, NULL,
+	    string_sprintf("can't open spool file %s: %s",
+	      eml_filename, strerror(err)),
+	    malware_daemon_ctx.sock);
+	  }
+	if (!clamd_send_fd(malware_daemon_ctx.sock, clam_fd))
+	  {
+	  int err = errno;
+	  (void)close(clam_fd);
+	  return m_panic_defer_3(scanent, CUS callout_address,
+	    string_sprintf("unable to pass file descriptor (%s)", strerror(err)),
+	    malware_daemon_ctx.sock);
+	  }
+	(void)close(clam_fd);
+	}
       else
 	{ /* use scan command */
 	/* Send a SCAN command pointing to a filename; then in the then in the
@@ -1763,13 +1923,43 @@ badseek:  err = errno;
       /* Commands have been sent, no matter which scan method or connection
       type we're using; now just read the result, independent of method. */
 
-      /* Read the result */
+      /* Read the result.  A session is kept for the next scan unless the
+      reply was not a whole line. */
       memset(av_buffer, 0, sizeof(av_buffer));
-      bread = ip_recv(&malware_daemon_ctx, av_buffer, sizeof(av_buffer), tmo);
-      (void)close(malware_daemon_ctx.sock);
+      if (session || fildes)
+	{
+	bread = recv_line(malware_daemon_ctx.sock, av_buffer, sizeof(av_buffer),
+			  tmo);
+	if (bread == 0) bread = -1;
+	}
+      else
+	bread = ip_recv(&malware_daemon_ctx, av_buffer, sizeof(av_buffer), tmo);
+
+      if (session && bread > 0 && bread < sizeof(av_buffer) - 2)
+	{
+	(void) fcntl(malware_daemon_ctx.sock, F_SETFD, FD_CLOEXEC);
+	clamd_session.sock = malware_daemon_ctx.sock;
+	clamd_session.pid = getpid();
+	if (  !clamd_session.hostspec
+	   || Ustrcmp(clamd_session.hostspec, hostname) != 0)
+	  clamd_session.hostspec = string_copy_perm(hostname, FALSE);
+	for (int i = 0; i < (num_servers ? num_servers : 1); i++)
+	  if (cv[i]->hostspec == hostname)
+	    { clamd_session.tcp_port = cv[i]->tcp_port; break; }
+	}
+      else
+	(void)close(malware_daemon_ctx.sock);
       malware_daemon_ctx.sock = -1;
       malware_daemon_ctx.tls_ctx = NULL;
 
+      if (session && bread > 0)
+	{
+	uschar * s = av_buffer;
+	while (isdigit(*s)) s++;
+	if (s > av_buffer && *s == ':' && s[1] == ' ')
+	  memmove(av_buffer, s + 2, Ustrlen(s + 2) + 1);
+	}
+
       if (bread <= 0)
 	return m_panic_defer(scanent, CUS callout_address,
 	  string_sprintf("unable to read from socket (%s)",
@@ -2183,6 +2373,19 @@ badseek:  err = errno;
   if (malware_daemon_ctx.sock >= 0)
     (void) close (malware_daemon_ctx.sock);
   malware_ok = TRUE;			/* set "been here, done that" marker */
+
+  if (cache_key)
+    {
+    int nlen = malware_name ? Ustrlen(malware_name) : 0;
+    int len = sizeof(dbdata_scan_verdict) + nlen;
+    dbdata_scan_verdict * v = store_get(len, GET_TAINTED);
+
+    v->found = !!malware_name;
+    v->score = v->threshold = 0;
+    if (malware_name) memcpy(v->data, malware_name, nlen);
+    v->data[nlen] = '\0';
+    scan_verdict_put(cache_key, v, len, malware_verdict_cache);
+    }
   }
 
 /* match virus name against pattern (caseless ------->----------v) */
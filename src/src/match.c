@@ -373,6 +373,239 @@ return US"";  /* In practice, should never happen */
 
 
 
+/*************************************************
+*        Precompiled named domain lists          *
+*************************************************/
+
+/* A named domain list whose text needs no expansion is compiled on first use.
+Each run of consecutive plain items - literal domains and "*" tail patterns,
+not negated - is held in a hash table, with the tail patterns keyed by the
+text after the star. Testing the run costs one probe for each suffix of the
+subject, instead of a comparison with each item. The earliest item that hits
+is then handed to the normal matching function, so that the outcome and its
+side effects are as for a linear scan. Other items are kept as they are and
+are tested in turn.
+
+If every item of the list is plain or a regular expression, the result for a
+given subject depends on nothing else, so it is remembered for each subject
+for the life of the process, along with the item that matched. Using a
+remembered result tests just that item again, to set up the variables. */
+
+#define MCL_MAX_RESULTS	1000
+
+typedef struct mcl_entry {
+  struct mcl_entry *	next;		/* in the hash chain */
+  const uschar *	key;		/* lowercased; the suffix for a tail */
+  const uschar *	item;		/* the list item */
+  unsigned		index;		/* its position in the list */
+  unsigned		hash;
+  BOOL			tail;
+} mcl_entry;
+
+typedef struct mcl_item {
+  const uschar *	item;		/* an item to test in turn, or NULL */
+  mcl_entry **		buckets;	/* for a run of plain items */
+  unsigned		mask;		/* number of buckets, less one */
+  unsigned		count;		/* of plain items */
+} mcl_item;
+
+typedef struct mcl_list {
+  unsigned		nitems;
+  unsigned		nresults;
+  BOOL			pure;		/* results may be remembered */
+  tree_node *		results;
+  mcl_item		items[1];	/* extended as needed */
+} mcl_list;
+
+typedef struct mcl_result {
+  int			rc;
+  const uschar *	item;		/* the item that matched, if any */
+} mcl_result;
+
+static mcl_list mcl_none;		/* marks an uncompilable list */
+
+
+/* The hash is computed from the end of the string, so that the hash of each
+suffix of a subject is found on the way to the hash of the whole. */
+
+static inline unsigned
+mcl_hash_step(unsigned h, uschar c)
+{
+return h * 33 + c;
+}
+
+static unsigned
+mcl_hash(const uschar * s, int len)
+{
+unsigned h = 5381;
+while (len > 0) h = mcl_hash_step(h, s[--len]);
+return h;
+}
+
+static BOOL
+mcl_plain(const uschar * s)
+{
+return *s == '*' || (*s && *s != '!' && *s != '+' && *s != '/' && *s != '^'
+		    && *s != '@' && !Ustrchr(s, ';'));
+}
+
+
+/* Compile a list, in permanent store.
+
+Arguments:
+  nb        the named list
+
+Returns:    the compiled list, or &mcl_none if it cannot be compiled
+*/
+
+static mcl_list *
+mcl_compile(const namedlist_block * nb)
+{
+const uschar * list = nb->string;
+int sep = 0, old_pool = store_pool;
+unsigned n = 0, max = 0;
+uschar * ss;
+mcl_list * ml;
+mcl_item * run = NULL;
+
+if (Ustrpbrk(list, "$\\")) return &mcl_none;
+
+for (const uschar * l = list; (ss = string_nextinlist(&l, &sep, NULL, 0)); )
+  max++;
+
+store_pool = POOL_PERM;
+ml = store_get(sizeof(mcl_list) + max * sizeof(mcl_item), GET_UNTAINTED);
+ml->pure = TRUE;
+ml->nresults = 0;
+ml->results = NULL;
+
+sep = 0;
+for (unsigned index = 0; (ss = string_nextinlist(&list, &sep, NULL, 0)); index++)
+  {
+  const uschar * s = ss;
+
+  if (!mcl_plain(s))
+    {
+    if (*s == '!') while (isspace(*++s)) ;
+    if (!mcl_plain(s) && *s != '^') ml->pure = FALSE;
+    ml->items[n++] = (mcl_item) { .item = string_copy(ss) };
+    run = NULL;
+    continue;
+    }
+
+  if (!run)
+    {
+    run = ml->items + n++;
+    *run = (mcl_item) { .item = NULL };
+    }
+  run->count++;
+  /* Remember the entry for now in the first bucket slot; the runs are
+  hashed once their sizes are known. */
+    {
+    mcl_entry * e = store_get(sizeof(mcl_entry), GET_UNTAINTED);
+    e->item = string_copy(ss);
+    e->tail = *s == '*';
+    e->key = string_copylc(s + (e->tail ? 1 : 0));
+    e->hash = mcl_hash(e->key, Ustrlen(e->key));
+    e->index = index;
+    e->next = (mcl_entry *)run->buckets;
+    run->buckets = (mcl_entry **)e;
+    }
+  }
+ml->nitems = n;
+
+for (mcl_item * it = ml->items; it < ml->items + n; it++) if (!it->item)
+  {
+  mcl_entry * e = (mcl_entry *)it->buckets, * next;
+  unsigned nb_ = 16;
+
+  while (nb_ < it->count) nb_ <<= 1;
+  it->buckets = store_get(nb_ * sizeof(mcl_entry *), GET_UNTAINTED);
+  memset(it->buckets, 0, nb_ * sizeof(mcl_entry *));
+  it->mask = nb_ - 1;
+
+  /* The entries were chained in reverse order; pushing them again leaves
+  each chain in list order, so the earliest duplicate is found first. */
+
+  for ( ; e; e = next)
+    {
+    mcl_entry ** b = it->buckets + (e->hash & it->mask);
+    next = e->next;
+    e->next = *b;
+    *b = e;
+    }
+  }
+
+store_pool = old_pool;
+DEBUG(D_lists) debug_printf_indent("compiled named list of %u items into %u\n",
+  max, n);
+return ml;
+}
+
+
+/* Get the compiled form of a named domain list, if one can be used for a
+subject. Matching must be caseless, as the keys are lowercased. */
+
+static mcl_list *
+mcl_get(namedlist_block * nb, const check_string_block * cb)
+{
+if (!(cb->flags & MCS_CASELESS)) return NULL;
+if (!nb->compiled) nb->compiled = mcl_compile(nb);
+return nb->compiled == &mcl_none ? NULL : nb->compiled;
+}
+
+
+/* Find the earliest item of a run of plain items that matches a subject,
+which is lowercased.
+
+Returns:    the item, or NULL if none matches
+*/
+
+static const uschar *
+mcl_find(const mcl_item * it, const uschar * subject)
+{
+int slen = Ustrlen(subject);
+unsigned h = 5381;
+const mcl_entry * best = NULL;
+
+for (int i = slen; i >= 0; i--)
+  {
+  if (i < slen) h = mcl_hash_step(h, subject[i]);
+  for (const mcl_entry * e = it->buckets[h & it->mask]; e; e = e->next)
+    if (  e->hash == h && (e->tail || i == 0)
+       && Ustrcmp(e->key, subject + i) == 0
+       && (!best || e->index < best->index))
+      {
+      best = e;
+      break;
+      }
+  }
+return best ? best->item : NULL;
+}
+
+
+/* Remember the result for a subject */
+
+static void
+mcl_remember(mcl_list * ml, const uschar * key, int rc, const uschar * item)
+{
+int old_pool = store_pool;
+tree_node * t;
+mcl_result * r;
+
+if (ml->nresults >= MCL_MAX_RESULTS) return;
+store_pool = POOL_PERM;
+t = store_get(sizeof(tree_node) + Ustrlen(key), key);
+Ustrcpy(t->name, key);
+t->data.ptr = r = store_get(sizeof(mcl_result), GET_UNTAINTED);
+r->rc = rc;
+r->item = item;
+if (tree_insertnode(&ml->results, t)) ml->nresults++;
+store_pool = old_pool;
+}
+
+
+
 /*************************************************
 *       Scan list and run matching function      *
 *************************************************/
@@ -421,12 +654,14 @@ Returns:       OK    if matched a non-negated item
                DEFER if a something deferred or expansion failed
 */
 
-int
-match_check_list(const uschar **listptr, int sep, tree_node **anchorptr,
+static int
+match_check_list_2(const uschar **listptr, int sep, tree_node **anchorptr,
   unsigned int **cache_ptr, int (*func)(void *,const uschar *,const uschar **,uschar **),
-  void *arg, int type, const uschar *name, const uschar **valueptr)
+  void *arg, int type, const uschar *name, const uschar **valueptr,
+  const mcl_list * ml, const uschar ** matchedp)
 {
 int yield = OK;
+unsigned ml_next = 0;
 unsigned int * original_cache_bits = *cache_ptr;
 BOOL include_unknown = FALSE, ignore_unknown = FALSE,
       include_defer = FALSE, ignore_defer = FALSE;
@@ -521,11 +756,31 @@ HDEBUG(D_lists)
   }
 
 /* Now scan the list and process each item in turn, until one of them matches,
-or we hit an error. */
+or we hit an error. A compiled list is scanned by its items instead; a run of
+plain items gives the one that matches, or counts as a non-negated item that
+did not match. */
 
-while ((sss = string_nextinlist(&list, &sep, NULL, 0)))
+for (;;)
   {
-  uschar * ss = sss;
+  uschar * ss;
+
+  if (!ml)
+    { if (!(sss = string_nextinlist(&list, &sep, NULL, 0))) break; }
+  else if (ml_next >= ml->nitems)
+    break;
+  else
+    {
+    const mcl_item * it = ml->items + ml_next++;
+    if (  !(sss = US it->item)
+       && !(sss = US mcl_find(it, ((check_string_block *)arg)->subject)))
+      {
+      HDEBUG(D_lists) debug_printf_indent("%u hashed items: no match\n",
+	it->count);
+      yield = OK;
+      continue;
+      }
+    }
+  ss = sss;
 
   HDEBUG(D_lists) debug_printf_indent("list element: %s\n", ss);
 
@@ -616,6 +871,7 @@ while ((sss = string_nextinlist(&list, &sep, NULL, 0)))
       unsigned int * use_cache_bits = original_cache_bits;
       uschar * cached = US"";
       namedlist_block * nb;
+      mcl_list * sub_ml = NULL;
       tree_node * t;
 
       DEBUG(D_lists)
@@ -649,12 +905,41 @@ while ((sss = string_nextinlist(&list, &sep, NULL, 0)))
         bits = use_cache_bits[offset] & (3 << shift);
         }
 
-      /* Not previously tested or no cache - run the full test */
+      /* Not previously tested or no cache - run the full test. A named domain
+      list is compiled, and the result of a full test may already be known
+      for the subject. */
 
       if (bits == 0)
         {
-        int res = match_check_list(&(nb->string), 0, anchorptr, &use_cache_bits,
-                func, arg, type, name, valueptr);
+        int res;
+	mcl_result * r = NULL;
+
+	if (type == MCL_DOMAIN && func == check_string)
+	  sub_ml = mcl_get(nb, arg);
+	if (sub_ml && sub_ml->pure)
+	  {
+	  tree_node * rt = tree_search(sub_ml->results,
+	    ((check_string_block *)arg)->origsubject);
+	  if (rt) r = rt->data.ptr;
+	  }
+
+	if (r)
+	  {
+	  uschar * error = NULL;
+	  DEBUG(D_lists) debug_printf_indent("remembered result for subject\n");
+	  res = r->rc;
+	  if (r->item) (void) (func)(arg, r->item, valueptr, &error);
+	  else if (valueptr) *valueptr = NULL;
+	  }
+	else
+	  {
+	  const uschar * matched = NULL;
+	  res = match_check_list_2(&(nb->string), 0, anchorptr, &use_cache_bits,
+                func, arg, type, name, valueptr, sub_ml, &matched);
+	  if (sub_ml && sub_ml->pure && res != DEFER)
+	    mcl_remember(sub_ml, ((check_string_block *)arg)->origsubject, res,
+	      matched);
+	  }
 	DEBUG(D_lists)
 	  { expand_level -= 2; debug_printf_indent(" end sublist %s\n", ss+1); }
 
@@ -750,6 +1035,7 @@ while ((sss = string_nextinlist(&list, &sep, NULL, 0)))
         case OK:
 	  HDEBUG(D_lists) debug_printf_indent("%s %s (matched \"%s\")\n", ot,
 	    (yield == OK)? "yes" : "no", sss);
+	  if (matchedp) *matchedp = ss;
 	  goto YIELD_RETURN;
 
         case DEFER:
@@ -955,6 +1241,16 @@ YIELD_RETURN:
 }
 
 
+int
+match_check_list(const uschar **listptr, int sep, tree_node **anchorptr,
+  unsigned int **cache_ptr, int (*func)(void *,const uschar *,const uschar **,uschar **),
+  void *arg, int type, const uschar *name, const uschar **valueptr)
+{
+return match_check_list_2(listptr, sep, anchorptr, cache_ptr, func, arg, type,
+  name, valueptr, NULL, NULL);
+}
+
+
 /*************************************************
 *          Match in colon-separated list         *
 *************************************************/
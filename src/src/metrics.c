@@ -0,0 +1,722 @@
+/*************************************************
+*     Exim - an Internet mail transport agent    *
+*************************************************/
+
+/*
+ * Copyright (c) The Exim Maintainers 2024
+ * License: GPL
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+/* Operational counters, for the metrics option.
+
+The daemon creates a table of counters in a file in the spool directory, and
+maps it shared.  Processes forked from the daemon inherit the mapping; any
+other Exim process maps the file the first time it has something to count.
+Counting is an atomic add to the mapped table, with no system call, so is
+cheap enough for the places it is done: connections accepted and refused by
+the daemon, ACL verdicts, delivery results by transport, timings of DNS
+lookups, other lookups and TLS handshakes, timings of the phases of
+receiving a message, and the peak store used by each process in its pools.
+
+The daemon replaces the file each time it starts, so the counters restart
+from zero then.  Processes holding the previous table go on counting into
+that.  "exim -bP metrics_table" prints the table in the Prometheus
+(OpenMetrics) text format, for a collector to pick up.
+
+The transports and lookup types are given slots by name, from the
+daemon's configuration, when the table is made.  Anything without a slot
+(for example, a transport added to the configuration since the daemon
+started) is not counted. */
+
+#include "exim.h"
+#include <sys/mman.h>
+
+#ifndef COMPILE_UTILITY
+
+#define METRICS_MAGIC		0x4d584532	/* layout check */
+#define METRICS_FILE		"metrics"
+#define METRICS_BUCKETS		12
+#define METRICS_TRANSPORTS	64
+#define METRICS_LOOKUPS		32
+#define METRICS_NAMELEN		32
+
+/* ACL verdict columns */
+
+enum { MA_ACCEPT, MA_DENY, MA_DEFER, MA_DISCARD, MA_ERROR, MA_COUNT };
+static const uschar * acl_verdicts[] =
+  { US"accept", US"deny", US"defer", US"discard", US"error" };
+
+/* Delivery result columns */
+
+enum { MD_SUCCESS, MD_DEFER, MD_FAIL, MD_COUNT };
+static const uschar * delivery_results[] =
+  { US"success", US"defer", US"fail" };
+
+/* Store pools, in POOL_xxx order, then all of them together */
+
+static const uschar * store_pools[POOL_TAINT_BASE + 1] =
+  { US"main", US"perm", US"config", US"search", US"message", US"all" };
+
+/* Histogram bucket upper bounds, in microseconds; the last bucket has no
+bound.  The counts are kept per bucket, and totalled when printed. */
+
+static const unsigned bucket_bounds[METRICS_BUCKETS - 1] =
+  { 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000,
+    500000, 1000000, 2500000 };
+
+typedef struct metrics_hist {
+  uint64_t	bucket[METRICS_BUCKETS];
+  uint64_t	count;
+  uint64_t	sum_us;			/* total time, microseconds */
+} metrics_hist;
+
+typedef struct metrics_named_hist {
+  uschar	name[METRICS_NAMELEN];
+  metrics_hist	h;
+} metrics_named_hist;
+
+typedef struct metrics_transport {
+  uschar	name[METRICS_NAMELEN];
+  uint64_t	result[MD_COUNT];
+} metrics_transport;
+
+typedef struct metrics_table {
+  unsigned	magic;
+  unsigned	size;			/* of the whole table */
+  time_t	created;
+  uint64_t	conn_accepted;
+  uint64_t	conn_refused;
+  uint64_t	acl[ACL_WHERE_UNKNOWN + 1][MA_COUNT];
+  metrics_hist	dns;
+  metrics_hist	tls[2];			/* server, client */
+  metrics_hist	phase[RP_COUNT];	/* reception phases */
+  metrics_hist	acl_time[ACL_WHERE_UNKNOWN + 1];
+  metrics_named_hist lookup[METRICS_LOOKUPS];
+  metrics_transport transport[METRICS_TRANSPORTS];
+  uint64_t	store_procs;		/* processes reporting store use */
+  uint64_t	store_peak_sum[POOL_TAINT_BASE + 1];
+  uint64_t	store_peak_max[POOL_TAINT_BASE + 1];
+  uint64_t	store_limit[2];		/* soft, hard limit passed */
+} metrics_table;
+
+static metrics_table * metrics_map = NULL;
+static BOOL metrics_tried = FALSE;
+static BOOL metrics_writable = FALSE;	/* not mapped for -bP only */
+
+#ifdef __GNUC__
+# define METRICS_ADD(var, n) (void) __sync_fetch_and_add(&(var), (n))
+#else
+# define METRICS_ADD(var, n) (var) += (n)
+#endif
+
+/* Raise a high-water mark */
+
+static void
+metrics_max(uint64_t * var, uint64_t n)
+{
+#ifdef __GNUC__
+for (uint64_t old = *var; n > old; old = *var)
+  if (__sync_bool_compare_and_swap(var, old, n)) break;
+#else
+if (n > *var) *var = n;
+#endif
+}
+
+
+
+/* Map an existing table file.  Called on first use in a process that did not
+inherit the mapping. */
+
+static metrics_table *
+metrics_attach(int flags)
+{
+uschar * fname;
+metrics_table * map;
+struct stat statbuf;
+int fd;
+
+if (metrics_map || metrics_tried) return metrics_map;
+metrics_tried = TRUE;
+
+fname = string_sprintf("%s/" METRICS_FILE, spool_directory);
+if ((fd = Uopen(fname, EXIM_CLOEXEC | flags, 0)) < 0)
+  {
+  DEBUG(D_any) debug_printf("metrics: open %s: %s\n", fname, strerror(errno));
+  return NULL;
+  }
+if (  fstat(fd, &statbuf) < 0
+   || statbuf.st_size != sizeof(metrics_table)
+   || (map = mmap(NULL, sizeof(metrics_table),
+		  flags == O_RDONLY ? PROT_READ : PROT_READ | PROT_WRITE,
+		  MAP_SHARED, fd, 0)) == MAP_FAILED
+   )
+  {
+  DEBUG(D_any) debug_printf("metrics: cannot map %s\n", fname);
+  (void) close(fd);
+  return NULL;
+  }
+(void) close(fd);
+
+if (map->magic != METRICS_MAGIC || map->size != sizeof(metrics_table))
+  {
+  DEBUG(D_any) debug_printf("metrics: %s has the wrong layout\n", fname);
+  (void) munmap(map, sizeof(metrics_table));
+  return NULL;
+  }
+metrics_writable = flags != O_RDONLY;
+return metrics_map = map;
+}
+
+
+/* Called in the daemon at startup: make a new table, with slots for the
+configured transports and the available lookup types, and map it.  It is
+built under a temporary name and renamed, so that running processes mapping
+an older table are not disturbed. */
+
+void
+metrics_init(void)
+{
+uschar * fname = string_sprintf("%s/" METRICS_FILE, spool_directory);
+uschar * tname = string_sprintf("%s.%d", fname, (int)getpid());
+metrics_table * map;
+int fd, n;
+
+if (!metrics) return;
+
+/* The file is made as root in a directory the exim user can write; it must be
+new, and a symlink is not followed, before it is handed to exim */
+
+(void) Uunlink(tname);
+if (  (fd = Uopen(tname,
+		  EXIM_CLOEXEC | EXIM_NOFOLLOW | O_RDWR | O_CREAT | O_EXCL,
+		  SPOOL_MODE)) < 0
+   || exim_fchown(fd, exim_uid, exim_gid, tname) < 0
+   || ftruncate(fd, sizeof(metrics_table)) < 0
+   || (map = mmap(NULL, sizeof(metrics_table), PROT_READ | PROT_WRITE,
+		  MAP_SHARED, fd, 0)) == MAP_FAILED
+   )
+  {
+  log_write(0, LOG_MAIN|LOG_PANIC, "metrics: failed to set up %s: %s",
+    tname, strerror(errno));
+  if (fd >= 0) { (void) close(fd); (void) Uunlink(tname); }
+  return;
+  }
+(void) close(fd);
+
+map->size = sizeof(metrics_table);
+map->created = time(NULL);
+
+n = 0;
+for (transport_instance * t = transports; t && n < METRICS_TRANSPORTS;
+     t = t->next)
+  string_format_nt(map->transport[n++].name, METRICS_NAMELEN, "%s", t->name);
+
+for (int i = 0; i < lookup_list_count && i < METRICS_LOOKUPS; i++)
+  string_format_nt(map->lookup[i].name, METRICS_NAMELEN, "%s",
+    lookup_list[i]->name);
+
+map->magic = METRICS_MAGIC;
+
+if (Urename(tname, fname) < 0)
+  {
+  log_write(0, LOG_MAIN|LOG_PANIC, "metrics: failed to rename %s: %s",
+    tname, strerror(errno));
+  (void) Uunlink(tname);
+  (void) munmap(map, sizeof(metrics_table));
+  return;
+  }
+metrics_map = map;
+metrics_tried = TRUE;
+metrics_writable = TRUE;
+DEBUG(D_any) debug_printf("metrics table %s set up\n", fname);
+}
+
+
+
+/*************************************************
+*              Counting                          *
+*************************************************/
+
+/* A connection was handed to a reception process, or was refused by the
+daemon's limits. */
+
+void
+metrics_connection(BOOL accepted)
+{
+metrics_table * m;
+
+if (!metrics || !(m = metrics_attach(O_RDWR))) return;
+if (accepted)
+  METRICS_ADD(m->conn_accepted, 1);
+else
+  METRICS_ADD(m->conn_refused, 1);
+}
+
+
+/* An ACL returned a verdict.
+
+Arguments:
+  where		ACL_WHERE_xxx
+  rc		the result from acl_check()
+*/
+
+void
+metrics_acl(int where, int rc)
+{
+metrics_table * m;
+int col;
+
+if (!metrics || !(m = metrics_attach(O_RDWR))) return;
+if (where < 0 || where > ACL_WHERE_UNKNOWN) where = ACL_WHERE_UNKNOWN;
+switch (rc)
+  {
+  case OK:		col = MA_ACCEPT; break;
+  case FAIL:
+  case FAIL_DROP:	col = MA_DENY; break;
+  case DEFER:		col = MA_DEFER; break;
+  case DISCARD:		col = MA_DISCARD; break;
+  default:		col = MA_ERROR; break;
+  }
+METRICS_ADD(m->acl[where][col], 1);
+}
+
+
+/* A delivery by a transport ended.
+
+Arguments:
+  name		the transport name
+  result	OK, DEFER, or anything else for a failure
+*/
+
+void
+metrics_delivery(const uschar * name, int result)
+{
+metrics_table * m;
+
+if (!metrics || !(m = metrics_attach(O_RDWR))) return;
+for (metrics_transport * t = m->transport;
+     t < m->transport + METRICS_TRANSPORTS && *t->name; t++)
+  if (Ustrcmp(t->name, name) == 0)
+    {
+    METRICS_ADD(t->result[result == OK ? MD_SUCCESS
+			  : result == DEFER ? MD_DEFER : MD_FAIL], 1);
+    return;
+    }
+}
+
+
+/* A process is exiting: add its peak store use, per pool, to the totals
+and raise the maxima.  Processes which got no pool store (some utility
+forks) are not counted. */
+
+void
+metrics_store(void)
+{
+metrics_table * m;
+int peak[POOL_TAINT_BASE + 1];
+unsigned hit;
+
+if (!metrics) return;
+hit = store_peaks(peak);
+if (  peak[POOL_TAINT_BASE] <= 0
+   || !(m = metrics_attach(O_RDWR)) || !metrics_writable) return;
+
+METRICS_ADD(m->store_procs, 1);
+for (int i = 0; i <= POOL_TAINT_BASE; i++)
+  {
+  METRICS_ADD(m->store_peak_sum[i], peak[i]);
+  metrics_max(&m->store_peak_max[i], peak[i]);
+  }
+if (hit & 1) METRICS_ADD(m->store_limit[0], 1);
+if (hit & 2) METRICS_ADD(m->store_limit[1], 1);
+}
+
+
+/* The time since a start taken with exim_gettime(), in microseconds */
+
+static unsigned
+metrics_span(const struct timeval * start)
+{
+struct timeval now;
+
+exim_gettime(&now);
+timediff(&now, start);
+return now.tv_sec < 0 ? 0
+  : now.tv_sec >= 2000 ? 2000000000U
+  : (unsigned)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+static void
+metrics_hist_count(metrics_hist * h, unsigned us)
+{
+int b;
+
+for (b = 0; b < METRICS_BUCKETS - 1 && us > bucket_bounds[b]; ) b++;
+METRICS_ADD(h->bucket[b], 1);
+METRICS_ADD(h->count, 1);
+METRICS_ADD(h->sum_us, us);
+}
+
+static void
+metrics_hist_add(metrics_hist * h, const struct timeval * start)
+{
+metrics_hist_count(h, metrics_span(start));
+}
+
+
+/* Something that was timed has finished.  The caller takes the start time,
+with exim_gettime(), only when the metrics option is set.
+
+Arguments:
+  what		METRICS_TIME_xxx
+  lookup_type	for METRICS_TIME_LOOKUP, the index in lookup_list
+  start		when it started
+*/
+
+void
+metrics_time(int what, int lookup_type, const struct timeval * start)
+{
+metrics_table * m;
+
+if (!metrics || !(m = metrics_attach(O_RDWR))) return;
+switch (what)
+  {
+  case METRICS_TIME_DNS:	metrics_hist_add(&m->dns, start); break;
+  case METRICS_TIME_TLS_SERVER:	metrics_hist_add(&m->tls[0], start); break;
+  case METRICS_TIME_TLS_CLIENT:	metrics_hist_add(&m->tls[1], start); break;
+  case METRICS_TIME_LOOKUP:
+    if (  lookup_type >= 0 && lookup_type < METRICS_LOOKUPS
+       && Ustrcmp(m->lookup[lookup_type].name,
+		  lookup_list[lookup_type]->name) == 0)
+      metrics_hist_add(&m->lookup[lookup_type].h, start);
+    break;
+  }
+}
+
+
+
+/*************************************************
+*              Reception phases                  *
+*************************************************/
+
+/* The phases of receiving a message are timed when the metrics option is
+set, for the table's histograms, or when the receive_phases log selector is
+set, for RP= on the reception log line.  For the log line the times are also
+added up here, per process.  The phases of the session (banner, EHLO,
+STARTTLS, AUTH, and the ACLs run for those) are kept until logged, so they
+appear with the first message of the connection; those of a message are
+cleared when the next one starts.  The spans overlap: the time for an SMTP
+command includes that of its ACL, and ACLs include their dnslists. */
+
+static const uschar * phase_names[] = {
+  US"banner", US"ehlo", US"starttls", US"auth", US"mail", US"rcpt",
+  US"predata", US"dnslists", US"data", US"dkim", US"spool" };
+
+/* Short names for ACLs, in ACL_WHERE_xxx order; those before "not_smtp" are
+for a message. */
+
+static const uschar * acl_phase_names[] = {
+  US"rcpt", US"mail", US"predata", US"mime", US"dkim", US"data",
+#ifndef DISABLE_PRDR
+  US"prdr",
+#endif
+  US"not_smtp", US"auth", US"connect", US"etrn", US"expn", US"helo",
+  US"mailauth", US"not_smtp_start", US"notquit", US"quit", US"starttls",
+  US"vrfy", US"delivery", US"unknown" };
+
+#define PHASE_DNSLISTS	8
+
+static int phase_us[RP_COUNT];		/* -1 when not timed */
+static int acl_us[ACL_WHERE_UNKNOWN + 1];
+static struct {
+  uschar	name[2 * METRICS_NAMELEN];
+  int		where;			/* the ACL it was checked in */
+  int		us;
+} dnslist_us[PHASE_DNSLISTS];
+static int dnslist_count = 0;
+static BOOL phases_started = FALSE;
+
+
+/* Clear the times.
+
+Argument:	TRUE for everything, after logging; FALSE at the start of a
+		message, keeping the session phases
+*/
+
+void
+metrics_phases_reset(BOOL all)
+{
+if (!phases_started) all = TRUE;
+for (int i = all ? 0 : RP_MAIL; i < RP_COUNT; i++) phase_us[i] = -1;
+for (int i = 0; i <= ACL_WHERE_UNKNOWN; i++)
+  if (all || i < ACL_WHERE_NOTSMTP) acl_us[i] = -1;
+if (all)
+  dnslist_count = 0;
+else
+  {
+  int n = 0;
+  for (int i = 0; i < dnslist_count; i++)
+    if (dnslist_us[i].where >= ACL_WHERE_NOTSMTP)
+      dnslist_us[n++] = dnslist_us[i];
+  dnslist_count = n;
+  }
+phases_started = TRUE;
+}
+
+
+static void
+phase_add(int * slot, unsigned us)
+{
+if (!phases_started) metrics_phases_reset(TRUE);
+if (*slot > 0) us += *slot;
+*slot = (int)MIN(us, INT_MAX);
+}
+
+
+/* A phase has ended.
+
+Arguments:
+  phase		RP_xxx
+  start		when it started, from exim_gettime()
+*/
+
+void
+metrics_phase(int phase, const struct timeval * start)
+{
+unsigned us = metrics_span(start);
+metrics_table * m;
+
+if (LOGGING(receive_phases) && phase != RP_DNSLISTS)
+  phase_add(&phase_us[phase], us);
+if (metrics && (m = metrics_attach(O_RDWR)))
+  metrics_hist_count(&m->phase[phase], us);
+}
+
+
+/* An ACL has been run.
+
+Arguments:
+  where		ACL_WHERE_xxx
+  start		when it started, from exim_gettime()
+*/
+
+void
+metrics_acl_time(int where, const struct timeval * start)
+{
+unsigned us = metrics_span(start);
+metrics_table * m;
+
+if (where < 0 || where > ACL_WHERE_UNKNOWN) where = ACL_WHERE_UNKNOWN;
+if (LOGGING(receive_phases)) phase_add(&acl_us[where], us);
+if (metrics && (m = metrics_attach(O_RDWR)))
+  metrics_hist_count(&m->acl_time[where], us);
+}
+
+
+/* One domain of a dnslists condition has been checked.  These are only
+logged; the table has the dnslists conditions as a whole (RP_DNSLISTS, which
+is not logged), as the domains are too many and various for slots.  With the
+lookups for a condition sent together beforehand, the wait for them is not
+counted to any domain.
+
+Arguments:
+  where		the ACL being run, ACL_WHERE_xxx
+  domain	the list domain
+  start		when it started, from exim_gettime()
+*/
+
+void
+metrics_dnslist_time(int where, const uschar * domain,
+  const struct timeval * start)
+{
+unsigned us = metrics_span(start);
+int i;
+
+if (!LOGGING(receive_phases)) return;
+if (!phases_started) metrics_phases_reset(TRUE);
+for (i = 0; i < dnslist_count; i++)
+  if (Ustrcmp(dnslist_us[i].name, domain) == 0) break;
+if (i >= dnslist_count)
+  {
+  if (i >= PHASE_DNSLISTS) return;
+  string_format_nt(dnslist_us[i].name, sizeof(dnslist_us[i].name), "%s",
+    domain);
+  dnslist_us[i].where = where;
+  dnslist_us[i].us = -1;
+  dnslist_count++;
+  }
+phase_add(&dnslist_us[i].us, us);
+}
+
+
+static gstring *
+phase_log(gstring * g, const uschar ** sep, const uschar * prefix,
+  const uschar * name, const uschar * suffix, int us)
+{
+if (us < 0) return g;
+g = string_fmt_append(g, "%s%s%s%s:%d.%03d", *sep, prefix, name, suffix,
+  us / 1000, us % 1000);
+*sep = US",";
+return g;
+}
+
+
+/* Add the RP= field to a reception log line, and clear the times.  The
+times are in milliseconds. */
+
+gstring *
+metrics_phases_log(gstring * g)
+{
+const uschar * sep = US" RP=";
+
+if (!phases_started) return g;
+for (int i = 0; i < RP_COUNT; i++)
+  g = phase_log(g, &sep, US"", phase_names[i], US"", phase_us[i]);
+for (int i = 0; i <= ACL_WHERE_UNKNOWN; i++)
+  g = phase_log(g, &sep, US"acl_", acl_phase_names[i], US"", acl_us[i]);
+for (int i = 0; i < dnslist_count; i++)
+  g = phase_log(g, &sep, US"dnslist(", dnslist_us[i].name, US")",
+    dnslist_us[i].us);
+metrics_phases_reset(TRUE);
+return g;
+}
+
+
+
+/*************************************************
+*              Printing                          *
+*************************************************/
+
+static void
+metrics_print_hist(const uschar * name, const uschar * label,
+  const metrics_hist * h)
+{
+uint64_t total = 0;
+const uschar * sep = label ? US"," : US"";
+
+if (!label) label = US"";
+for (int b = 0; b < METRICS_BUCKETS; b++)
+  {
+  total += h->bucket[b];
+  if (b < METRICS_BUCKETS - 1)
+    printf("%s_bucket{%s%sle=\"%g\"} " PR_EXIM_ARITH "\n", name, label, sep,
+      bucket_bounds[b] / 1000000.0, (int_eximarith_t)total);
+  else
+    printf("%s_bucket{%s%sle=\"+Inf\"} " PR_EXIM_ARITH "\n", name, label, sep,
+      (int_eximarith_t)total);
+  }
+if (*label)
+  {
+  printf("%s_sum{%s} %.6f\n", name, label, h->sum_us / 1000000.0);
+  printf("%s_count{%s} " PR_EXIM_ARITH "\n", name, label,
+    (int_eximarith_t)h->count);
+  }
+else
+  {
+  printf("%s_sum %.6f\n", name, h->sum_us / 1000000.0);
+  printf("%s_count " PR_EXIM_ARITH "\n", name, (int_eximarith_t)h->count);
+  }
+}
+
+
+/* Print the table, for -bP metrics_table.
+
+Returns:	FALSE if there is no table to print
+*/
+
+BOOL
+metrics_print(void)
+{
+const metrics_table * m;
+
+if (!metrics)
+  {
+  printf("metrics: the metrics option is not set\n");
+  return FALSE;
+  }
+if (!(m = metrics_attach(O_RDONLY)))
+  {
+  printf("metrics: no table; is the daemon running?\n");
+  return FALSE;
+  }
+
+printf("# TYPE exim_daemon_start_time_seconds gauge\n"
+       "exim_daemon_start_time_seconds " TIME_T_FMT "\n", m->created);
+
+printf("# TYPE exim_connections counter\n"
+       "exim_connections_total{result=\"accepted\"} " PR_EXIM_ARITH "\n"
+       "exim_connections_total{result=\"refused\"} " PR_EXIM_ARITH "\n",
+       (int_eximarith_t)m->conn_accepted, (int_eximarith_t)m->conn_refused);
+
+printf("# TYPE exim_acl_verdicts counter\n");
+for (int w = 0; w <= ACL_WHERE_UNKNOWN; w++)
+  {
+  uint64_t any = 0;
+  for (int c = 0; c < MA_COUNT; c++) any += m->acl[w][c];
+  if (any)
+    for (int c = 0; c < MA_COUNT; c++)
+      printf("exim_acl_verdicts_total{where=\"%s\",verdict=\"%s\"} "
+	PR_EXIM_ARITH "\n", acl_wherenames[w], acl_verdicts[c],
+	(int_eximarith_t)m->acl[w][c]);
+  }
+
+printf("# TYPE exim_deliveries counter\n");
+for (const metrics_transport * t = m->transport;
+     t < m->transport + METRICS_TRANSPORTS && *t->name; t++)
+  for (int c = 0; c < MD_COUNT; c++)
+    printf("exim_deliveries_total{transport=\"%s\",result=\"%s\"} "
+      PR_EXIM_ARITH "\n", t->name, delivery_results[c],
+      (int_eximarith_t)t->result[c]);
+
+printf("# TYPE exim_dns_lookup_seconds histogram\n");
+metrics_print_hist(US"exim_dns_lookup_seconds", NULL, &m->dns);
+
+printf("# TYPE exim_lookup_seconds histogram\n");
+for (const metrics_named_hist * l = m->lookup;
+     l < m->lookup + METRICS_LOOKUPS && *l->name; l++)
+  if (l->h.count)
+    metrics_print_hist(US"exim_lookup_seconds",
+      string_sprintf("type=\"%s\"", l->name), &l->h);
+
+printf("# TYPE exim_tls_handshake_seconds histogram\n");
+metrics_print_hist(US"exim_tls_handshake_seconds", US"side=\"server\"",
+  &m->tls[0]);
+metrics_print_hist(US"exim_tls_handshake_seconds", US"side=\"client\"",
+  &m->tls[1]);
+
+printf("# TYPE exim_smtp_phase_seconds histogram\n");
+for (int i = 0; i < RP_COUNT; i++)
+  if (m->phase[i].count)
+    metrics_print_hist(US"exim_smtp_phase_seconds",
+      string_sprintf("phase=\"%s\"", phase_names[i]), &m->phase[i]);
+
+printf("# TYPE exim_acl_seconds histogram\n");
+for (int w = 0; w <= ACL_WHERE_UNKNOWN; w++)
+  if (m->acl_time[w].count)
+    metrics_print_hist(US"exim_acl_seconds",
+      string_sprintf("where=\"%s\"", acl_phase_names[w]), &m->acl_time[w]);
+
+printf("# TYPE exim_store_processes counter\n"
+       "exim_store_processes_total " PR_EXIM_ARITH "\n",
+       (int_eximarith_t)m->store_procs);
+printf("# TYPE exim_store_peak_bytes counter\n");
+for (int i = 0; i <= POOL_TAINT_BASE; i++)
+  printf("exim_store_peak_bytes_total{pool=\"%s\"} " PR_EXIM_ARITH "\n",
+    store_pools[i], (int_eximarith_t)m->store_peak_sum[i]);
+printf("# TYPE exim_store_peak_bytes_max gauge\n");
+for (int i = 0; i <= POOL_TAINT_BASE; i++)
+  printf("exim_store_peak_bytes_max{pool=\"%s\"} " PR_EXIM_ARITH "\n",
+    store_pools[i], (int_eximarith_t)m->store_peak_max[i]);
+printf("# TYPE exim_store_limit_hits counter\n"
+       "exim_store_limit_hits_total{limit=\"soft\"} " PR_EXIM_ARITH "\n"
+       "exim_store_limit_hits_total{limit=\"hard\"} " PR_EXIM_ARITH "\n",
+       (int_eximarith_t)m->store_limit[0], (int_eximarith_t)m->store_limit[1]);
+
+printf("# EOF\n");
+return TRUE;
+}
+
+#endif	/*!COMPILE_UTILITY*/
+
+/* End of metrics.c */
@@ -17,6 +17,9 @@
 FILE *mime_stream = NULL;
 uschar *mime_current_boundary = NULL;
 
+/* The current part, when it was decoded into memory */
+static gstring *mime_decoded_mem = NULL;
+
 static mime_header mime_header_list[] = {
   /*	name			namelen		value */
   { US"content-type:",              13, &mime_content_type },
@@ -107,7 +110,7 @@ return initial_pos;
 
 /* just dump MIME part without any decoding */
 static ssize_t
-mime_decode_asis(FILE* in, FILE* out, uschar* boundary)
+mime_decode_asis(FILE* in, mime_sink* out, uschar* boundary)
 {
 ssize_t len, size = 0;
 uschar buffer[MIME_MAX_LINE_LENGTH];
@@ -121,7 +124,7 @@ while(fgets(CS buffer, MIME_MAX_LINE_LENGTH, mime_stream) != NULL)
     break;
 
   len = Ustrlen(buffer);
-  if (fwrite(buffer, 1, (size_t)len, out) < len)
+  if (!mime_write(out, buffer, (size_t)len))
     return -1;
   size += len;
   } /* while */
@@ -132,7 +135,7 @@ return size;
 
 /* decode quoted-printable MIME part */
 static ssize_t
-mime_decode_qp(FILE* in, FILE* out, uschar* boundary)
+mime_decode_qp(FILE* in, mime_sink* out, uschar* boundary)
 {
 uschar ibuf[MIME_MAX_LINE_LENGTH], obuf[MIME_MAX_LINE_LENGTH];
 uschar *ipos, *opos;
@@ -151,6 +154,17 @@ while (fgets(CS ibuf, MIME_MAX_LINE_LENGTH, in) != NULL)
 
   while (*ipos != 0)
     {
+    /* Copy a run of literal characters in one go */
+
+    size_t run = Ustrcspn(ipos, "=");
+    if (run)
+      {
+      memcpy(opos, ipos, run);
+      opos += run;
+      ipos += run;
+      continue;
+      }
+
     if (*ipos == '=')
       {
       int decode_qp_result;
@@ -176,7 +190,7 @@ while (fgets(CS ibuf, MIME_MAX_LINE_LENGTH, in) != NULL)
   len = opos - obuf;
   if (len > 0)
     {
-    if (fwrite(obuf, 1, len, out) != len) return -1; /* error */
+    if (!mime_write(out, obuf, len)) return -1; /* error */
     size += len;
     }
   }
@@ -216,6 +230,80 @@ return modefopen(mime_decoded_filename, "wb+", SPOOL_MODE);
 }
 
 
+/* Add some decoded data to a part.  If it is being kept in memory and would
+grow past the limit, what there is so far moves to a file and the rest goes
+after it there.
+
+Arguments:
+  out		the destination
+  buf		the data
+  len		its length
+
+Returns:	FALSE on a write error
+*/
+
+BOOL
+mime_write(mime_sink * out, const uschar * buf, size_t len)
+{
+if (!out->f)
+  {
+  if (gstring_length(out->mem) + len <= out->max)
+    {
+    out->mem = string_catn(out->mem, buf, len);
+    return TRUE;
+    }
+  if (!(out->f = mime_get_decode_file(out->dir, NULL)))
+    return FALSE;
+  if (out->mem && fwrite(out->mem->s, 1, out->mem->ptr, out->f) != out->mem->ptr)
+    return FALSE;
+  out->mem = NULL;
+  }
+return fwrite(buf, 1, len, out->f) == len;
+}
+
+
+/* Return the current part if it was decoded into memory, else NULL */
+
+uschar *
+mime_decoded_memory(int * len)
+{
+if (!mime_decoded_mem) return NULL;
+if (len) *len = mime_decoded_mem->ptr;
+return mime_decoded_mem->s;
+}
+
+
+/* Value of $mime_decoded_filename.  A part decoded into memory is written to
+a file in the default place the first time the name is wanted. */
+
+uschar *
+mime_decoded_file(void)
+{
+FILE * f;
+BOOL ok;
+
+if (mime_decoded_filename || !mime_decoded_mem)
+  return mime_decoded_filename;
+
+if (!(f = mime_get_decode_file(
+	    string_sprintf("%s/scan/%s", spool_directory, message_id), NULL)))
+  {
+  log_write(0, LOG_MAIN, "MIME acl condition warning - "
+	"can't open '%s' for writing: %s", mime_decoded_filename, strerror(errno));
+  return mime_decoded_filename = NULL;
+  }
+ok = fwrite(mime_decoded_mem->s, 1, mime_decoded_mem->ptr, f)
+      == mime_decoded_mem->ptr;
+if (fclose(f) != 0 || !ok)
+  {
+  log_write(0, LOG_MAIN, "MIME acl condition warning - "
+	"error writing '%s': %s", mime_decoded_filename, strerror(errno));
+  return mime_decoded_filename = NULL;
+  }
+return mime_decoded_filename;
+}
+
+
 int
 mime_decode(const uschar **listptr)
 {
@@ -223,10 +311,10 @@ int sep = 0;
 const uschar *list = *listptr;
 uschar * option;
 uschar * decode_path;
-FILE *decode_file = NULL;
+mime_sink out = {0};
 long f_pos = 0;
 ssize_t size_counter = 0;
-ssize_t (*decode_function)(FILE*, FILE*, uschar*);
+ssize_t (*decode_function)(FILE*, mime_sink*, uschar*);
 
 if (!mime_stream || (f_pos = ftell(mime_stream)) < 0)
   return FAIL;
@@ -255,24 +343,32 @@ if ((option = string_nextinlist(&list, &sep, NULL, 0)))
     /* assume either path or path+file name */
     if ( (stat(CS option, &statbuf) == 0) && S_ISDIR(statbuf.st_mode) )
       /* is directory, use it as decode_path */
-      decode_file = mime_get_decode_file(option, NULL);
+      out.f = mime_get_decode_file(option, NULL);
     else
       /* does not exist or is a file, use as full file name */
-      decode_file = mime_get_decode_file(NULL, option);
+      out.f = mime_get_decode_file(NULL, option);
     }
   else
     /* assume file name only, use default path */
-    decode_file = mime_get_decode_file(decode_path, option);
+    out.f = mime_get_decode_file(decode_path, option);
   }
 else
   {
   /* no option? patch default path */
 DEFAULT_PATH:
-  decode_file = mime_get_decode_file(decode_path, NULL);
+  if (mime_decode_memory_max > 0)
+    {
+    out.mem = string_get_tainted(1024, GET_TAINTED);
+    out.max = mime_decode_memory_max;
+    out.dir = decode_path;
+    }
+  else
+    out.f = mime_get_decode_file(decode_path, NULL);
   }
 
-if (!decode_file)
+if (!out.f && !out.mem)
   return DEFER;
+mime_decoded_mem = NULL;
 
 /* decode according to mime type */
 decode_function =
@@ -284,14 +380,24 @@ decode_function =
   ? mime_decode_qp
   : mime_decode_asis;	/* unknown encoding type, just dump as-is */
 
-size_counter = decode_function(mime_stream, decode_file, mime_current_boundary);
+size_counter = decode_function(mime_stream, &out, mime_current_boundary);
 
 clearerr(mime_stream);
 if (fseek(mime_stream, f_pos, SEEK_SET))
   return DEFER;
 
-if (fclose(decode_file) != 0 || size_counter < 0)
-  return DEFER;
+if (out.f)
+  {
+  if (fclose(out.f) != 0 || size_counter < 0)
+    return DEFER;
+  }
+else
+  {
+  if (size_counter < 0)
+    return DEFER;
+  mime_decoded_filename = NULL;		/* written when its name is used */
+  mime_decoded_mem = out.mem;
+  }
 
 /* round up to the next KiB */
 mime_content_size = (size_counter + 1023) / 1024;
@@ -410,6 +516,7 @@ mime_anomaly_text      = NULL;
 mime_boundary          = NULL;
 mime_charset           = NULL;
 mime_decoded_filename  = NULL;
+mime_decoded_mem       = NULL;
 mime_filename          = NULL;
 mime_content_description = NULL;
 mime_content_disposition = NULL;
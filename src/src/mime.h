@@ -37,6 +37,15 @@ typedef struct mime_parameter {
   uschar ** value;
 } mime_parameter;
 
+/* Where a part is decoded to: a file, or memory up to a limit and a file in
+the given directory once it grows past that */
+typedef struct mime_sink {
+  FILE *    f;
+  gstring * mem;
+  int       max;
+  uschar *  dir;
+} mime_sink;
+
 /* MIME Anomaly list */
 #define MIME_ANOMALY_BROKEN_BASE64    1
 #define MIME_ANOMALY_BROKEN_QP        0
@@ -646,6 +646,172 @@ child_close(pid, 0);  /* Waits for child to close; no timeout */
 
 
 
+/*************************************************
+*            Bounce digests                      *
+*************************************************/
+
+/* With bounce_digest_window set, the first bounce to an address is sent as
+usual, and starts a window. The failures of further messages for that address
+within the window are held in the "bounces" hints database and sent as one
+digest when the window is over, either by the next delivery that fails to
+the address or by a queue run. The text held is limited; failures beyond the
+limit are counted but not listed.
+
+A held record is replaced or deleted only once its digest has been handed to
+a child Exim; if that fails the record stays, and the digest is tried again by
+the next delivery or queue run. The hints database stays open, and so locked,
+while the digest is sent, so that two processes do not both send it. */
+
+#define BOUNCE_DIGEST_TEXT_MAX 16384
+
+/* Returns: TRUE if the digest was handed over */
+
+static BOOL
+moan_send_digest(const uschar * who, const dbdata_bounce_digest * d)
+{
+FILE * f;
+int fd, rc;
+pid_t pid = child_open_exim(&fd, US"bounce-digest");
+
+if (pid < 0)
+  {
+  log_write(0, LOG_MAIN|LOG_PANIC, "failed to create child to send bounce "
+    "digest for %u message%s to %s: %s", d->messages,
+    d->messages == 1 ? "" : "s", who, strerror(errno));
+  return FALSE;
+  }
+
+f = fdopen(fd, "wb");
+fprintf(f, "Auto-Submitted: auto-replied\n");
+moan_write_from(f);
+fprintf(f, "To: %s\n", who);
+fprintf(f, "Subject: Mail delivery failed: %u more message%s\n\n",
+  d->messages, d->messages == 1 ? "" : "s");
+fprintf(f,
+"This message was created automatically by mail delivery software.\n\n"
+"After the failure already reported, %u more message%s could not be\n"
+"delivered to one or more of %s recipients. This is a permanent error.\n"
+"The failures are collected here rather than sent one by one:\n\n",
+  d->messages, d->messages == 1 ? "" : "s",
+  d->messages == 1 ? "its" : "their");
+(void)fwrite(d->text, 1, d->text_len, f);
+if (d->unlisted)
+  fprintf(f, "Failures in %u further message%s are not listed.\n",
+    d->unlisted, d->unlisted == 1 ? "" : "s");
+
+(void)fclose(f);
+if ((rc = child_close(pid, 0)) != 0)
+  {
+  log_write(0, LOG_MAIN|LOG_PANIC, "Process failed (%d) when sending bounce "
+    "digest for %u message%s to %s", rc, d->messages,
+    d->messages == 1 ? "" : "s", who);
+  return FALSE;
+  }
+log_write(0, LOG_MAIN, "bounce digest for %u message%s sent to %s",
+  d->messages, d->messages == 1 ? "" : "s", who);
+return TRUE;
+}
+
+
+/* Called before sending a bounce. Within a window the failures are added to
+the record, and the caller need send nothing. Otherwise a new window starts,
+and the bounce goes as usual; any failures held from an ended window are sent
+first. If they cannot be, the old record is left alone.
+
+Arguments:
+  who		the address the bounce goes to
+  g		the text for the failures of this message
+
+Returns:	TRUE if the failures were held
+*/
+
+BOOL
+moan_digest_hold(const uschar * who, const gstring * g)
+{
+open_db dbblock, * dbm;
+dbdata_bounce_digest * d;
+time_t now = time(NULL);
+int len = gstring_length(g);
+BOOL held = FALSE;
+
+if (!(dbm = dbfn_open(US"bounces", O_RDWR|O_CREAT, &dbblock, TRUE, TRUE)))
+  return FALSE;
+
+if (  (d = dbfn_read(dbm, who))
+   && d->window_end > now)
+  {
+  BOOL room = d->text_len + len <= BOUNCE_DIGEST_TEXT_MAX;
+  int size = sizeof(dbdata_bounce_digest) + d->text_len + (room ? len : 0);
+  dbdata_bounce_digest * n = store_get(size, GET_TAINTED);
+
+  memcpy(n, d, sizeof(dbdata_bounce_digest) + d->text_len);
+  if (room)
+    {
+    memcpy(n->text + n->text_len, g->s, len);
+    n->text_len += len;
+    }
+  else
+    n->unlisted++;
+  n->messages++;
+  held = dbfn_write(dbm, who, n, size) == 0;
+  }
+else
+  {
+  dbdata_bounce_digest n = {.window_end = now + bounce_digest_window};
+
+  if (!d || !d->messages || moan_send_digest(who, d))
+    (void) dbfn_write(dbm, who, &n, sizeof(n));
+  }
+dbfn_close(dbm);
+return held;
+}
+
+
+/* Called at the end of a queue run: send the digests whose windows are over,
+and forget the windows. A digest that cannot be sent keeps its record. */
+
+void
+moan_digest_flush(void)
+{
+open_db dbblock, * dbm;
+EXIM_CURSOR * cursor;
+time_t now = time(NULL);
+rmark reset_point = store_mark();
+typedef struct digest_due {
+  struct digest_due *	next;
+  uschar *		key;
+} digest_due;
+digest_due * keys = NULL;
+
+if (!(dbm = dbfn_open(US"bounces", O_RDWR, &dbblock, FALSE, FALSE)))
+  return;
+
+/* Collect the keys first, as a scan cannot be relied on across deletions */
+
+for (uschar * key = dbfn_scan(dbm, TRUE, &cursor); key;
+     key = dbfn_scan(dbm, FALSE, &cursor))
+  {
+  digest_due * k = store_get(sizeof(digest_due), GET_UNTAINTED);
+  k->key = string_copy(key);
+  k->next = keys;
+  keys = k;
+  }
+
+for (digest_due * k = keys, * next; k; k = next)
+  {
+  dbdata_bounce_digest * d = dbfn_read(dbm, k->key);
+
+  next = k->next;
+  if (d && d->window_end > now) continue;
+  if (!d || !d->messages || moan_send_digest(k->key, d))
+    (void) dbfn_delete(dbm, k->key);
+  }
+dbfn_close(dbm);
+store_reset(reset_point);
+}
+
+
+
 /*************************************************
 *            Handle SMTP batch error             *
 *************************************************/
@@ -122,6 +122,10 @@ while (*s != 0 && (*s != ',' || no_term > 0) && (*s != '\n' || !nl_ends))
     else if (*s == '>') no_term--;
     else if (source_routing && *s == ':') no_term--;
     s++;
+
+    /* Runs of other characters need no look at each one */
+
+    s += Ustrcspn(s, "\\\"(<>,:\n");
     }
   }
 
@@ -625,17 +629,69 @@ Arguments:
 Returns:      points to the extracted address, or NULL on error
 */
 
+/* By far the commonest form is a bare local-part@domain with at most white
+space round it, so that is recognized first without the full parse. The
+local part must be dot-separated atoms and the domain dot-separated letters,
+digits and hyphens, not starting with a hyphen; anything else (quotes,
+comments, phrases, literals, empty components, groups, and so on) is left to
+the full parse, so the results are the same. */
+
+static uschar *
+parse_simple_address(const uschar * mailbox, int * start, int * end,
+  int * domain)
+{
+const uschar * s = mailbox, * lp, * at;
+uschar * yield;
+
+Uskip_whitespace(&s);
+for (lp = s; ; s++)
+  {
+  const uschar * w = s;
+  while (!mac_iscntrl_or_special(*s) && *s != '\\') s++;
+  if (s == w) return NULL;
+  if (*s != '.') break;
+  }
+if (*s != '@') return NULL;
+for (at = s++; ; s++)
+  {
+  const uschar * w = s;
+  if (*s == '-') return NULL;
+  while (isalnum(*s) || *s == '-') s++;
+  if (s == w) return NULL;
+  if (*s != '.') break;
+  }
+if (s - lp > EXIM_EMAILADDR_MAX) return NULL;
+
+*start = lp - mailbox;
+*end = s - mailbox;
+*domain = at - lp + 1;
+if (Uskip_whitespace(&s)) return NULL;
+
+yield = store_get(*end - *start + 1, mailbox);
+memcpy(yield, lp, *end - *start);
+yield[*end - *start] = 0;
+return yield;
+}
+
+
 #define FAILED(s) { *errorptr = s; goto PARSE_FAILED; }
 
 uschar *
 parse_extract_address(const uschar *mailbox, uschar **errorptr, int *start, int *end,
   int *domain, BOOL allow_null)
 {
-uschar * yield = store_get(Ustrlen(mailbox) + 1, mailbox);
+uschar * yield;
 const uschar *startptr, *endptr;
 const uschar *s = US mailbox;
-uschar *t = US yield;
+uschar *t;
+
+if ((yield = parse_simple_address(mailbox, start, end, domain)))
+  {
+  *errorptr = NULL;
+  return yield;
+  }
 
+t = yield = store_get(Ustrlen(mailbox) + 1, mailbox);
 *domain = 0;
 
 /* At the start of the string we expect either an addr-spec or a phrase
@@ -1249,6 +1305,7 @@ parse_forward_list(const uschar *s, int options, address_item **anchor,
   error_block **syntax_errors)
 {
 int count = 0;
+error_block ** etail = NULL;
 
 DEBUG(D_route) debug_printf("parse_forward_list: %s\n", s);
 
@@ -1661,14 +1718,14 @@ for (;;)
         if (syntax_errors)
           {
           error_block * e = store_get(sizeof(error_block), GET_UNTAINTED);
-          error_block * last = *syntax_errors;
-          if (last)
-            {
-            while (last->next) last = last->next;
-            last->next = e;
-            }
-          else
-	    *syntax_errors = e;
+
+	  /* Keep track of the end of the chain, which an :include: may have
+	  extended since last time */
+
+	  if (!etail) etail = syntax_errors;
+	  while (*etail) etail = &(*etail)->next;
+	  *etail = e;
+	  etail = &e->next;
           e->next = NULL;
           e->text1 = *error;
           e->text2 = s_ltd;
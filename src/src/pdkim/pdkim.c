@@ -1059,25 +1059,34 @@ else for (int p = 0; p < len; p++)
 
   if (ctx->flags & PDKIM_PAST_HDRS)
     {
-    if (c == '\n' && !(ctx->flags & PDKIM_SEEN_CR))	/* emulate the CR */
+    /* Copy body bytes up to the next LF into the line buffer in one go */
+
+    if (c != '\n')
       {
-      ctx->linebuf[ctx->linebuf_offset++] = '\r';
-      if (ctx->linebuf_offset == PDKIM_MAX_BODY_LINE_LEN-1)
+      const uschar * nl = memchr(data + p, '\n', len - p);
+      int n = (nl ? nl - data : len) - p;
+
+      if (ctx->linebuf_offset + n >= PDKIM_MAX_BODY_LINE_LEN-1)
 	return PDKIM_ERR_LONG_LINE;
+      if (memchr(data + p, '\r', n))
+	ctx->flags |= PDKIM_SEEN_CR;
+      memcpy(ctx->linebuf + ctx->linebuf_offset, data + p, n);
+      ctx->linebuf_offset += n;
+      p += n - 1;
+      continue;
       }
 
-    /* Processing body byte */
-    ctx->linebuf[ctx->linebuf_offset++] = c;
-    if (c == '\r')
-      ctx->flags |= PDKIM_SEEN_CR;
-    else if (c == '\n')
+    if (!(ctx->flags & PDKIM_SEEN_CR))			/* emulate the CR */
       {
-      ctx->flags &= ~PDKIM_SEEN_CR;
-      pdkim_bodyline_complete(ctx);
+      ctx->linebuf[ctx->linebuf_offset++] = '\r';
+      if (ctx->linebuf_offset == PDKIM_MAX_BODY_LINE_LEN-1)
+	return PDKIM_ERR_LONG_LINE;
       }
 
-    if (ctx->linebuf_offset == PDKIM_MAX_BODY_LINE_LEN-1)
-      return PDKIM_ERR_LONG_LINE;
+    /* Processing body LF */
+    ctx->linebuf[ctx->linebuf_offset++] = c;
+    ctx->flags &= ~PDKIM_SEEN_CR;
+    pdkim_bodyline_complete(ctx);
     }
   else
     {
@@ -1607,7 +1616,7 @@ for (pdkim_signature * sig = ctx->sig; sig; sig = sig->next)
     /* Import private key, including the keytype which we need for building
     the signature header  */
 
-    if ((*err = exim_dkim_signing_init(CUS sig->privkey, &sctx)))
+    if ((*err = exim_dkim_signing_key(CUS sig->privkey, &sctx)))
       {
       log_write(0, LOG_MAIN|LOG_PANIC, "signing_init: %s", *err);
       return PDKIM_ERR_RSA_PRIVKEY;
@@ -899,6 +899,54 @@ return US ERR_error_string(ERR_get_error(), NULL);
 #endif
 /******************************************************************************/
 
+/* Import a private key, using a copy already imported by this process if the
+PEM-block is the same.  Keys are never deinit'd, so the library handles can be
+shared.  The cache is keyed by a digest of the PEM rather than holding the key
+text.  This saves the parse for a process signing repeatedly: several
+signatures with one key, ARC as well as DKIM, or a retry to another host.
+
+Return: NULL for success, or an error string */
+
+typedef struct signkey_cache {
+  struct signkey_cache * next;
+  uschar	digest[32];
+  es_ctx	sign_ctx;
+} signkey_cache;
+
+static signkey_cache * signkeys = NULL;
+
+const uschar *
+exim_dkim_signing_key(const uschar * privkey_pem, es_ctx * sign_ctx)
+{
+hctx h;
+blob b;
+signkey_cache * k;
+const uschar * s;
+
+if (!exim_sha_init(&h, HASH_SHA2_256))
+  return exim_dkim_signing_init(privkey_pem, sign_ctx);
+exim_sha_update_string(&h, privkey_pem);
+exim_sha_finish(&h, &b);
+
+for (k = signkeys; k; k = k->next)
+  if (memcmp(k->digest, b.data, sizeof(k->digest)) == 0)
+    {
+    DEBUG(D_transport) debug_printf("DKIM: reusing imported private key\n");
+    *sign_ctx = k->sign_ctx;
+    return NULL;
+    }
+
+if ((s = exim_dkim_signing_init(privkey_pem, sign_ctx)))
+  return s;
+
+k = store_malloc(sizeof(signkey_cache));
+memcpy(k->digest, b.data, sizeof(k->digest));
+k->sign_ctx = *sign_ctx;
+k->next = signkeys;
+signkeys = k;
+return NULL;
+}
+
 #endif	/*DISABLE_DKIM*/
 #endif	/*MACRO_PREDEF*/
 /* End of File */
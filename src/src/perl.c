@@ -54,6 +54,19 @@ EXTERN_C void boot_DynaLoader(pTHX_ CV *cv);
 
 static PerlInterpreter *interp_perl = 0;
 
+/* The globs of subroutines already called, so that later calls skip the
+symbol-table lookup.  The glob, rather than the code, is held so that a
+redefined subroutine is seen; it is given an extra reference so it survives
+being deleted from the symbol table. */
+
+typedef struct perl_sub {
+  struct perl_sub *next;
+  GV *gv;
+  uschar name[1];
+} perl_sub;
+
+static perl_sub *perl_subs = NULL;
+
 XS(xs_expand_string)
 {
   dXSARGS;
@@ -151,11 +164,37 @@ cleanup_perl(void)
 {
   if (!interp_perl)
     return;
+  while (perl_subs)
+    {
+    perl_sub *ps = perl_subs;
+    perl_subs = ps->next;
+    store_free(ps);
+    }
   perl_destruct(interp_perl);
   perl_free(interp_perl);
   interp_perl = 0;
 }
 
+static CV *
+perl_sub_find(uschar *name)
+{
+  perl_sub *ps;
+  GV *gv;
+
+  for (ps = perl_subs; ps; ps = ps->next)
+    if (Ustrcmp(ps->name, name) == 0)
+      return GvCV(ps->gv);
+
+  if (!(gv = gv_fetchpv(CS name, 0, SVt_PVCV)) || !GvCV(gv))
+    return NULL;
+  ps = store_malloc(sizeof(perl_sub) + Ustrlen(name));
+  Ustrcpy(ps->name, name);
+  ps->gv = (GV *)SvREFCNT_inc((SV *)gv);
+  ps->next = perl_subs;
+  perl_subs = ps;
+  return GvCV(gv);
+}
+
 gstring *
 call_perl_cat(gstring * yield, uschar **errstrp, uschar *name, uschar **arg)
 {
@@ -164,6 +203,7 @@ call_perl_cat(gstring * yield, uschar **errstrp, uschar *name, uschar **arg)
   STRLEN len;
   uschar *str;
   int items;
+  CV *cv;
 
   if (!interp_perl)
     {
@@ -176,7 +216,9 @@ call_perl_cat(gstring * yield, uschar **errstrp, uschar *name, uschar **arg)
   PUSHMARK(SP);
   while (*arg != NULL) XPUSHs(newSVpv(CS (*arg++), 0));
   PUTBACK;
-  items = perl_call_pv(CS name, G_SCALAR|G_EVAL);
+  items = (cv = perl_sub_find(name))
+    ? perl_call_sv((SV *)cv, G_SCALAR|G_EVAL)
+    : perl_call_pv(CS name, G_SCALAR|G_EVAL);
   SPAGAIN;
   sv = POPs;
   PUTBACK;
@@ -82,6 +82,28 @@ return first;
 
 
 
+/* Add to the list of sub-directories those under the shard roots of a
+sharded spool.  A root is only searched for the characters that map to it. */
+
+static void
+queue_shard_subdirs(uschar * subdirs, int * subcount)
+{
+for (int i = 0; i < spool_shard_count; i++)
+  {
+  uschar * dname = string_sprintf("%s/%s/input", spool_shard_roots[i],
+				  queue_name);
+  DIR * dd;
+
+  if (!(dd = exim_opendir(dname))) continue;
+  for (struct dirent * ent; ent = readdir(dd); )
+    if (  isalnum(ent->d_name[0]) && !ent->d_name[1]
+       && spool_shard(ent->d_name[0]) == i)
+      subdirs[++*subcount] = ent->d_name[0];
+  closedir(dd);
+  }
+}
+
+
 
 /*************************************************
 *             Get list of spool files            *
@@ -125,7 +147,7 @@ Arguments:
 Returns:         pointer to a chain of queue name items
 */
 
-static queue_filename *
+queue_filename *
 queue_get_spool_list(int subdiroffset, uschar *subdirs, int *subcount,
   BOOL randomize, unsigned * pcount)
 {
@@ -160,6 +182,7 @@ if (subdiroffset <= 0)
   i = 0;
   subdirs[0] = 0;
   *subcount = 0;
+  if (spool_shard_count) queue_shard_subdirs(subdirs, subcount);
   }
 else
   i = subdiroffset;
@@ -182,10 +205,17 @@ for (; i <= *subcount; i++)
   DIR *dd;
 
   if (subdirchar != 0)
-    {
-    buffer[subptr] = '/';
-    buffer[subptr+1] = subdirchar;
-    }
+    if (spool_shard_count)
+      {
+      uschar subdir[2] = { subdirchar, '\0' };
+      snprintf(CS buffer, sizeof(buffer) - 2, "%s/%s/input/%s",
+	spool_root(subdir), queue_name, subdir);
+      }
+    else
+      {
+      buffer[subptr] = '/';
+      buffer[subptr+1] = subdirchar;
+      }
 
   DEBUG(D_queue_run) debug_printf("looking in %s\n", buffer);
   if (!(dd = exim_opendir(buffer)))
@@ -203,12 +233,16 @@ for (; i <= *subcount; i++)
     count++;
 
     /* If we find a single alphameric sub-directory in the base directory,
-    add it to the list for subsequent scans. */
+    add it to the list for subsequent scans. Those of a sharded spool have
+    been found already. */
 
     if (i == 0 && len == 1 && isalnum(*name))
       {
-      *subcount = *subcount + 1;
-      subdirs[*subcount] = *name;
+      if (!spool_shard_count)
+	{
+	*subcount = *subcount + 1;
+	subdirs[*subcount] = *name;
+	}
       continue;
       }
 
@@ -319,6 +353,223 @@ return yield;
 
 
 
+/*************************************************
+*         Sort a list of spool files             *
+*************************************************/
+
+/* Order a list of queue_filename items obtained other than by a directory
+scan (the queue index), using the same bottom-up merge sort as above.
+
+Argument:   the list
+Returns:    the sorted list
+*/
+
+queue_filename *
+queue_sort_list(queue_filename * list)
+{
+queue_filename * root[LOG2_MAXNODES] = {0}, * yield = NULL;
+
+for (queue_filename * next; list; list = next)
+  {
+  next = list->next;
+  list->next = NULL;
+  for (int j = 0; j < LOG2_MAXNODES; j++)
+    if (root[j])
+      {
+      list = merge_queue_lists(list, root[j]);
+      root[j] = j == LOG2_MAXNODES - 1 ? list : NULL;
+      }
+    else
+      {
+      root[j] = list;
+      break;
+      }
+  }
+for (int i = 0; i < LOG2_MAXNODES; ++i)
+  yield = merge_queue_lists(yield, root[i]);
+return yield;
+}
+
+
+
+/*************************************************
+*     Parallel deliveries within a queue run     *
+*************************************************/
+
+/* When queue_run_parallel is more than one, the queue runner keeps that many
+delivery processes going at once.  Each gets its own synchronizing pipe (see
+the comments in queue_run() below); a slot is free again once the pipe shows
+EOF, meaning the delivery process and any children it passed SMTP channels to
+have all finished.  Whichever slot frees first gets the next message, so a
+slow destination ties up only the one slot.
+
+Arguments:
+  q		queue-runner descriptor
+  slots		the slot vector
+  pfds		working space for poll(), one per slot
+  nslots	the number of slots
+  all		TRUE to wait for all slots to finish, FALSE just for one free
+  force_delivery  turned off when a delivery was attempted
+*/
+
+typedef struct {
+  pid_t		pid;		/* delivery process, or 0 for a free slot */
+  int		fd;		/* read end of synchronizing pipe */
+  uschar *	id;
+} qrun_slot;
+
+static void
+qrun_slots_wait(qrunner * q, qrun_slot * slots, struct pollfd * pfds,
+  int nslots, BOOL all, BOOL * force_delivery)
+{
+for (;;)
+  {
+  int busy = 0;
+
+  for (int i = 0; i < nslots; i++)
+    if (slots[i].pid > 0)
+      {
+      pfds[i].fd = slots[i].fd;
+      pfds[i].events = POLLIN;
+      busy++;
+      }
+    else
+      pfds[i].fd = -1;		/* poll() ignores this entry */
+
+  if (busy == 0 || (!all && busy < nslots)) return;
+
+  set_process_info("running queue: %d deliveries in progress", busy);
+  if (poll(pfds, nslots, -1) < 0)
+    {
+    if (errno == EINTR) continue;
+    log_write(0, LOG_MAIN|LOG_PANIC_DIE, "queue run: poll: %s", strerror(errno));
+    }
+
+  for (int i = 0; i < nslots; i++) if (pfds[i].fd >= 0 && pfds[i].revents)
+    {
+    qrun_slot * sp = slots + i;
+    uschar buffer[256];
+    int status;
+
+    if ((status = read(sp->fd, buffer, sizeof(buffer))) != 0)
+      log_write(0, LOG_MAIN|LOG_PANIC, status > 0 ?
+	"queue run: unexpected data on pipe" : "queue run: error on pipe: %s",
+	strerror(errno));
+    (void)close(sp->fd);
+
+    while (waitpid(sp->pid, &status, 0) < 0 && errno == EINTR) ;
+
+    if (!(status & 0xffff)) *force_delivery = q->queue_run_force;
+    else if (status & 0x00ff)
+      log_write(0, LOG_MAIN|LOG_PANIC,
+	"queue run: process %d crashed with signal %d while delivering %s",
+	(int)sp->pid, status & 0x00ff, sp->id);
+
+    DEBUG(D_queue_run) debug_printf("qrun slot %d: %s (pid %d) done\n",
+      i, sp->id, (int)sp->pid);
+    sp->pid = 0;
+    }
+  }
+}
+
+
+
+
+/*************************************************
+*     Per-host batches for a 2-stage queue run   *
+*************************************************/
+
+/* When queue_run_batch is set, the first phase of a 2-stage run collects,
+for each transport and host, the list of messages routed there.  The
+deliveries of the first phase append a line "transport host id" for each host
+to a file (see transport_update_waiting()); the file is unlinked as soon as
+it is opened, the descriptor being inherited by the phase-one processes.
+
+After the first phase the file is read into a tree keyed by "transport/host",
+the data being a gstring of concatenated message ids.  The delivery processes
+of the second phase inherit this, and the first connection to a host takes the
+whole of its batch, passing on the rest with each continued delivery, rather
+than going to the hints database for each message. */
+
+static void
+queue_batch_open(void)
+{
+uschar * fname = spool_fname(US"input", US"",
+		    string_sprintf("qbatch-%d", (int)getpid()), US"");
+
+if ((queue_run_batch_fd = Uopen(fname,
+		  EXIM_CLOEXEC | O_RDWR | O_CREAT | O_EXCL | O_APPEND,
+		  SPOOL_MODE)) < 0)
+  {
+  DEBUG(D_queue_run) debug_printf("queue_run_batch: open %s: %s\n",
+    fname, strerror(errno));
+  return;
+  }
+#ifndef O_CLOEXEC
+(void)fcntl(queue_run_batch_fd, F_SETFD,
+  fcntl(queue_run_batch_fd, F_GETFD) | FD_CLOEXEC);
+#endif
+(void)Uunlink(fname);
+}
+
+
+static void
+queue_batch_load(void)
+{
+int fd = queue_run_batch_fd, len, nhosts = 0, nids = 0;
+struct stat statbuf;
+uschar * buf;
+
+queue_run_batch_fd = -1;
+queue_run_batches = NULL;
+
+if (fstat(fd, &statbuf) != 0 || statbuf.st_size <= 0)
+  { (void)close(fd); return; }
+
+buf = store_get(statbuf.st_size + 1, GET_UNTAINTED);
+len = pread(fd, buf, statbuf.st_size, 0);
+(void)close(fd);
+if (len <= 0) return;
+buf[len] = '\0';
+
+for (uschar * s = buf, * nl; (nl = Ustrchr(s, '\n')); s = nl + 1)
+  {
+  uschar * sp, * id;
+  tree_node * t;
+  gstring * g;
+
+  *nl = '\0';
+  if (  !(sp = Ustrchr(s, ' '))
+     || !(id = Ustrrchr(sp, ' ')) || id == sp
+     || nl - ++id != MESSAGE_ID_LENGTH || !mac_ismsgid(id))
+    continue;
+  *sp = '/';
+  id[-1] = '\0';
+
+  if (!(t = tree_search(queue_run_batches, s)))
+    {
+    t = store_get(sizeof(tree_node) + Ustrlen(s), GET_UNTAINTED);
+    Ustrcpy_nt(t->name, s);
+    t->data.ptr = NULL;
+    (void) tree_insertnode(&queue_run_batches, t);
+    nhosts++;
+    }
+
+  /* Several transport calls for one message give consecutive lines */
+
+  if (  (g = t->data.ptr) && g->ptr >= MESSAGE_ID_LENGTH
+     && Ustrncmp(g->s + g->ptr - MESSAGE_ID_LENGTH, id, MESSAGE_ID_LENGTH) == 0)
+    continue;
+  t->data.ptr = string_catn(g, id, MESSAGE_ID_LENGTH);
+  nids++;
+  }
+
+DEBUG(D_queue_run) debug_printf("queue_run_batch: %d messages for %d hosts\n",
+  nids, nhosts);
+}
+
+
+
 
 /*************************************************
 *              Perform a queue run               *
@@ -358,6 +609,8 @@ queue_run(qrunner * q, const uschar * start_id, const uschar * stop_id, BOOL rec
 {
 BOOL force_delivery = q->queue_run_force
   || deliver_selectstring || deliver_selectstring_sender;
+BOOL skip_waiting = queue_run_retry_skip && !force_delivery
+  && !(start_id && stop_id && Ustrcmp(start_id, stop_id) == 0);
 const pcre2_code *selectstring_regex = NULL;
 const pcre2_code *selectstring_regex_sender = NULL;
 uschar *log_detail = NULL;
@@ -365,6 +618,9 @@ int subcount = 0;
 uschar subdirs[64];
 pid_t qpid[4] = {0};	/* Parallelism factor for q2stage 1st phase */
 BOOL single_id = FALSE;
+qrun_slot * slots = NULL;
+struct pollfd * slot_pfds = NULL;
+int nslots = 0;
 
 #ifdef MEASURE_TIMING
 report_time_since(&timestamp_startup, US"queue_run start");
@@ -435,6 +691,24 @@ if (!recurse)
 	      && Ustrcmp(start_id, stop_id) == 0;
   }
 
+/* For parallel deliveries, set up the slots.  Not for the first phase of a
+2-stage run, which does only routing, nor for a single message. */
+
+if (queue_run_parallel > 1 && !q->queue_2stage && !single_id)
+  {
+  nslots = queue_run_parallel;
+  slots = store_get(nslots * sizeof(qrun_slot), GET_UNTAINTED);
+  slot_pfds = store_get(nslots * sizeof(struct pollfd), GET_UNTAINTED);
+  memset(slots, 0, nslots * sizeof(qrun_slot));
+  DEBUG(D_queue_run) debug_printf("queue run with %d parallel deliveries\n", nslots);
+  }
+
+/* For the first phase of a 2-stage run, collect batches of messages per host
+if wanted.  Only at the top level; a recursive run is the second phase. */
+
+if (q->queue_2stage && queue_run_batch && !recurse)
+  queue_batch_open();
+
 /* If deliver_selectstring is a regex, compile it. */
 
 if (deliver_selectstring && f.deliver_selectstring_regex)
@@ -457,13 +731,18 @@ then randomized after the first time through, before they are scanned in
 subsequent iterations.
 
 When the first argument of queue_get_spool_list() is -1 (for queue_run_in_
-order), it scans all directories and makes a single message list. */
+order), it scans all directories and makes a single message list.
+
+If the daemon is maintaining a queue index we get a single list from that
+instead, and only scan if it was not available. */
 
-for (int i = queue_run_in_order ? -1 : 0;
-     i <= (queue_run_in_order ? -1 : subcount);
+for (int i = queue_run_in_order || queue_index ? -1 : 0;
+     i <= (queue_run_in_order || queue_index ? -1 : subcount);
      i++)
   {
   rmark reset_point1 = store_mark();
+  queue_filename * fq_list;
+  BOOL indexed;
 
   DEBUG(D_queue_run)
     {
@@ -475,9 +754,11 @@ for (int i = queue_run_in_order ? -1 : 0;
       debug_printf("queue running subdirectory '%c'\n", subdirs[i]);
     }
 
-  for (queue_filename * fq = queue_get_spool_list(i, subdirs, &subcount,
-					     !queue_run_in_order, NULL);
-       fq; fq = fq->next)
+  if (!(indexed = queue_index_list(!queue_run_in_order, skip_waiting, &fq_list)))
+    fq_list = queue_get_spool_list(i, subdirs, &subcount,
+				    !queue_run_in_order, NULL);
+
+  for (queue_filename * fq = fq_list; fq; fq = fq->next)
     {
     pid_t pid;
     int status;
@@ -489,7 +770,8 @@ for (int i = queue_run_in_order ? -1 : 0;
     check that the load average is low enough to permit deliveries. */
 
     if (!q->queue_run_force && deliver_queue_load_max >= 0)
-      if ((load_average = os_getloadavg()) > deliver_queue_load_max)
+      {
+      if ((load_average = daemon_getloadavg()) > deliver_queue_load_max)
         {
         log_write(L_queue_run, LOG_MAIN, "Abandon queue run: %s (load %.2f, max %.2f)",
           log_detail,
@@ -502,6 +784,7 @@ for (int i = queue_run_in_order ? -1 : 0;
         DEBUG(D_load) debug_printf("load average = %.2f max = %.2f\n",
           (double)load_average/1000.0,
           (double)deliver_queue_load_max/1000.0);
+      }
 
     /* If initial of a 2-phase run, maintain a set of child procs
     to get disk parallelism */
@@ -537,40 +820,51 @@ for (int i = queue_run_in_order ? -1 : 0;
     if (Ustat(spool_fname(US"input", message_subdir, fq->text, US""), &statbuf) < 0)
       goto go_around;
 
-    /* There are some tests that require the reading of the header file. Ensure
-    the store used is scavenged afterwards so that this process doesn't keep
-    growing its store. We have to read the header file again when actually
-    delivering, but it's cheaper than forking a delivery process for each
-    message when many are not going to be delivered. */
+    /* There are some tests that require looking at the header file. A
+    mapped view is used, which decodes only the fields that are tested and
+    changes no global variables other than the non-recipients tree (which is
+    discarded afterwards, along with any store used). We have to read the
+    header file properly when actually delivering, but it's cheaper than
+    forking a delivery process for each message when many are not going to be
+    delivered. */
 
     if (deliver_selectstring || deliver_selectstring_sender ||
-        q->queue_run_first_delivery)
+        q->queue_run_first_delivery || (skip_waiting && !indexed))
       {
       BOOL wanted = TRUE;
-      BOOL orig_dont_deliver = f.dont_deliver;
+      spool_view v;
+      const uschar * s;
       rmark reset_point2 = store_mark();
 
-      /* Restore the original setting of dont_deliver after reading the header,
-      so that a setting for a particular message doesn't force it for any that
-      follow. If the message is chosen for delivery, the header is read again
-      in the deliver_message() function, in a subprocess. */
-
-      if (spool_read_header(fq->text, FALSE, TRUE) != spool_read_OK) goto go_around;
-      f.dont_deliver = orig_dont_deliver;
+      if (spool_view_open(&v, fq->text, TRUE) != spool_read_OK) goto go_around;
 
-      /* Now decide if we want to deliver this message. As we have read the
-      header file, we might as well do the freeze test now, and save forking
-      another process. */
+      /* Now decide if we want to deliver this message. As we have looked at
+      the header file, we might as well do the freeze test now, and save
+      forking another process. */
 
-      if (f.deliver_freeze && !q->deliver_force_thaw)
+      if (spool_view_option(&v, US"frozen") && !q->deliver_force_thaw)
         {
         log_write(L_skip_delivery, LOG_MAIN, "Message is frozen");
         wanted = FALSE;
         }
 
+      /* With queue_run_retry_skip, the last delivery attempt may have found
+      every deferred address waiting for a retry time, and noted when the
+      first of them comes.  (The queue index, when used, has done this.) */
+
+      else if (  skip_waiting
+	      && (s = spool_view_option(&v, US"retry_after"))
+	      && (time_t) Ustrtol(s, NULL, 10) > time(NULL))
+        {
+        DEBUG(D_queue_run) debug_printf("%s: retry times not reached\n",
+	  fq->text);
+        wanted = FALSE;
+        }
+
       /* Check first_delivery in the case when there are no message logs. */
 
-      else if (q->queue_run_first_delivery && !f.deliver_firsttime)
+      else if (  q->queue_run_first_delivery
+	      && !spool_view_option(&v, US"deliver_firsttime"))
         {
         DEBUG(D_queue_run) debug_printf("%s: not first delivery\n", fq->text);
         wanted = FALSE;
@@ -584,9 +878,9 @@ for (int i = queue_run_in_order ? -1 : 0;
 
       else if (  deliver_selectstring_sender
 	      && !(f.deliver_selectstring_sender_regex
-		  ? regex_match(selectstring_regex_sender, sender_address, -1, NULL)
-		  : (strstric_c(sender_address, deliver_selectstring_sender, FALSE)
-		      != NULL)
+		  ? regex_match(selectstring_regex_sender, v.sender, v.sender_len, NULL)
+		  : (strstric_c(string_copyn(v.sender, v.sender_len),
+		      deliver_selectstring_sender, FALSE) != NULL)
 	      )   )
         {
         DEBUG(D_queue_run) debug_printf("%s: sender address did not match %s\n",
@@ -598,20 +892,29 @@ for (int i = queue_run_in_order ? -1 : 0;
 
       else if (deliver_selectstring)
         {
-        int i;
-        for (i = 0; i < recipients_count; i++)
+	int n = spool_view_recipients(&v), i;
+	const uschar * cursor = NULL;
+
+	if (n < 0 || !spool_view_nonrecipients(&v)) n = 0;
+        for (i = 0; i < n; i++)
           {
-          const uschar * address = recipients_list[i].address;
-          if (  (f.deliver_selectstring_regex
-		? regex_match(selectstring_regex, address, -1, NULL)
-                : (strstric_c(address, deliver_selectstring, FALSE) != NULL)
-		)
-             && tree_search(tree_nonrecipients, address) == NULL
+	  int len;
+	  const uschar * address = spool_view_recipient(&v, &cursor, &len);
+
+	  if (!address) { i = n; break; }
+	  if (f.deliver_selectstring_regex
+	      ? regex_match(selectstring_regex, address, len, NULL)
+	      : (strstric_c(address = string_copyn(address, len),
+			    deliver_selectstring, FALSE) != NULL)
 	     )
-            break;
+	    if (  !tree_nonrecipients
+	       || !tree_search_nonrecipient(f.deliver_selectstring_regex
+				  ? string_copyn(address, len) : address)
+	       )
+              break;
           }
 
-        if (i >= recipients_count)
+        if (i >= n)
           {
           DEBUG(D_queue_run)
             debug_printf("%s: no recipient address matched %s\n",
@@ -620,9 +923,10 @@ for (int i = queue_run_in_order ? -1 : 0;
           }
         }
 
-      /* Recover store used when reading the header */
+      /* Recover store used */
 
-      spool_clear_header_globals();
+      spool_view_close(&v);
+      tree_clear_nonrecipients();
       store_reset(reset_point2);
       if (!wanted) goto go_around;      /* With next message */
       }
@@ -679,6 +983,42 @@ for (int i = queue_run_in_order ? -1 : 0;
       }
 #endif
 
+    /* For parallel deliveries, wait for a free slot and start this one
+    in it.  The slot keeps the read end of the pipe. */
+
+    if (nslots)
+      {
+      int i;
+      qrun_slots_wait(q, slots, slot_pfds, nslots, FALSE, &force_delivery);
+      for (i = 0; slots[i].pid > 0; ) i++;
+
+      if ((pid = exim_fork(US"qrun-delivery")) == 0)
+	{
+	int rc;
+	(void)close(pfd[pipe_read]);
+	rc = deliver_message(fq->text, force_delivery, FALSE);
+	exim_underbar_exit(rc == DELIVER_NOT_ATTEMPTED
+		  ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+      if (pid < 0)
+	log_write(0, LOG_MAIN|LOG_PANIC_DIE, "fork of delivery process from "
+	  "queue runner %d failed\n", queue_run_pid);
+
+      (void)close(pfd[pipe_write]);
+      slots[i].pid = pid;
+      slots[i].fd = pfd[pipe_read];
+      slots[i].id = fq->text;
+      DEBUG(D_queue_run) debug_printf("qrun slot %d: %s (pid %d) started\n",
+	i, fq->text, (int)pid);
+
+      if (f.running_in_test_harness)
+	{
+	uschar * fqtnext = Ustrchr(fudged_queue_times, '/');
+	if (fqtnext) fudged_queue_times = fqtnext + 1;
+	}
+      continue;
+      }
+
 single_item_retry:
     if ((pid = exim_fork(US"qrun-delivery")) == 0)
       {
@@ -758,7 +1098,13 @@ single_item_retry:
       exim_exit(EXIT_SUCCESS);
     }                                  /* End loop for list of messages */
 
-  tree_nonrecipients = NULL;
+  /* The slots refer to message ids in the list, so let them all finish
+  before the list is released */
+
+  if (nslots)
+    qrun_slots_wait(q, slots, slot_pfds, nslots, TRUE, &force_delivery);
+
+  tree_clear_nonrecipients();
   store_reset(reset_point1);           /* Scavenge list of messages */
 
   /* If this was the first time through for random order processing, and
@@ -796,18 +1142,23 @@ if (q->queue_2stage)
 #ifdef MEASURE_TIMING
   report_time_since(&timestamp_startup, US"queue_run 1st phase done");
 #endif
+  if (queue_run_batch_fd >= 0) queue_batch_load();
   q->queue_2stage = f.queue_2stage = FALSE;
   queue_run(q, start_id, stop_id, TRUE);
   }
 
-/* At top level, log the end of the run. */
+/* At top level, send any bounce digests that are due and log the end of
+the run. */
 
 if (!recurse)
+  {
+  if (bounce_digest_window > 0) moan_digest_flush();
   if (q->name)
     log_write(L_queue_run, LOG_MAIN, "End '%s' queue run: %s",
       q->name, log_detail);
   else
     log_write(L_queue_run, LOG_MAIN, "End queue run: %s", log_detail);
+  }
 }
 
 
@@ -895,6 +1246,279 @@ if (p->right) queue_list_extras(p->right);
 
 
 
+/* List one message, for queue_list().  The store used is reset after. */
+
+static void
+queue_list_one(const queue_filename * qf, int option, int count, int now)
+{
+rmark reset_point = store_mark();
+int rc, save_errno;
+int size = 0, hsize = 0, rcount = 0;
+BOOL env_read;
+spool_view v;
+const uschar * cursor = NULL;
+
+/* Only the envelope is wanted, so use a mapped view of the header file
+rather than a full read.  Check the format of the rest of the envelope and
+the headers as spool_read_header() would, for the error reporting. */
+
+message_subdir[0] = qf->dir_uschar;
+rc = spool_view_open(&v, qf->text, count <= 0);
+if (rc == spool_read_notopen && errno == ENOENT && count <= 0)
+  goto out;
+
+if (rc == spool_read_OK)
+  if ((rcount = spool_view_recipients(&v)) < 0 || !spool_view_nonrecipients(&v))
+    {
+    rc = spool_read_enverror;
+    errno = ERRNO_SPOOLFORMAT;
+    }
+  else if (!spool_view_header_size(&v, &hsize))
+    {
+    rc = spool_read_hdrerror;
+    errno = ERRNO_SPOOLFORMAT;
+    }
+save_errno = errno;
+
+env_read = (rc == spool_read_OK || rc == spool_read_hdrerror);
+
+if (env_read)
+  {
+  int i, ptr;
+  FILE *jread;
+  struct stat statbuf;
+  uschar * fname = spool_fname(US"input", message_subdir, qf->text, US"");
+
+  ptr = Ustrlen(fname)-1;
+  fname[ptr] = 'D';
+
+  /* Add the data size to the header size; don't count the file name
+  at the start of the data file, but add one for the notional blank line
+  that precedes the data. */
+
+  if (Ustat(fname, &statbuf) == 0)
+    size = hsize + statbuf.st_size - spool_data_start_offset(qf->text) + 1;
+  i = (now - v.received_time)/60;  /* minutes on queue */
+  if (i > 90)
+    {
+    i = (i + 30)/60;
+    if (i > 72) printf("%2dd ", (i + 12)/24); else printf("%2dh ", i);
+    }
+  else printf("%2dm ", i);
+
+  /* Collect delivered addresses from any J file */
+
+  fname[ptr] = 'J';
+  if ((jread = Ufopen(fname, "rb")))
+    {
+    while (Ufgets(big_buffer, big_buffer_size, jread) != NULL)
+      {
+      int n = Ustrlen(big_buffer);
+      big_buffer[n-1] = 0;
+      if (*big_buffer != '\t')		/* skip other state records */
+	tree_add_nonrecipient(big_buffer);
+      }
+    (void)fclose(jread);
+    }
+  }
+
+fprintf(stdout, "%s %.*s",
+  string_format_size(size, big_buffer),
+  is_old_message_id(qf->text) ? MESSAGE_ID_LENGTH_OLD : MESSAGE_ID_LENGTH,
+  qf->text);
+
+if (env_read)
+  {
+  printf(" <%.*s>", v.sender_len, v.sender);
+  if (spool_view_option(&v, US"sender_set_untrusted"))
+    printf(" (%.*s)", v.login_len, v.login);
+  }
+
+if (rc != spool_read_OK)
+  {
+  printf("\n    ");
+  if (save_errno == ERRNO_SPOOLFORMAT)
+    {
+    struct stat statbuf;
+    uschar * fname = spool_fname(US"input", message_subdir, qf->text, US"");
+
+    if (Ustat(fname, &statbuf) == 0)
+      printf("*** spool format error: size=" OFF_T_FMT " ***",
+        statbuf.st_size);
+    else printf("*** spool format error ***");
+    }
+  else printf("*** spool read error: %s ***", strerror(save_errno));
+  if (rc != spool_read_hdrerror)
+    {
+    printf("\n\n");
+    spool_view_close(&v);
+    goto out;
+    }
+  }
+
+if (spool_view_option(&v, US"frozen")) printf(" *** frozen ***");
+
+printf("\n");
+
+/* The addresses are copied only when there are delivered ones to look
+them up against. */
+
+for (int i = 0; i < rcount; i++)
+  {
+  int len;
+  const uschar * address = spool_view_recipient(&v, &cursor, &len);
+  tree_node * delivered;
+
+  if (!address) break;
+  delivered = tree_nonrecipients
+    ? tree_search_nonrecipient(string_copyn(address, len)) : NULL;
+  if (!delivered || option != QL_UNDELIVERED_ONLY)
+    printf("        %s %.*s\n", delivered ? "D" : " ", len, address);
+  if (delivered) delivered->data.val = TRUE;
+  }
+if (option == QL_PLUS_GENERATED && tree_nonrecipients)
+  queue_list_extras(tree_nonrecipients);
+printf("\n");
+spool_view_close(&v);
+
+out:
+  spool_clear_header_globals();
+  store_reset(reset_point);
+}
+
+
+/* With queue_list_parallel, list the whole queue using several forked
+processes, each reading the spool files for a contiguous part of the list.
+This helps when the spool is on storage with a high latency for each file,
+where one process spends its time waiting.  Output from each process comes
+back on a pipe; that from the part being printed goes straight out, and the
+others are held until their turn, so the order is kept.  A part for which the
+fork fails is done here, when its turn comes.
+
+Returns:	FALSE if the list is too short to be worth splitting
+*/
+
+#define QL_PARALLEL_MIN	100	/* messages per process */
+
+static BOOL
+queue_list_forked(queue_filename * qf, int option, int now)
+{
+typedef struct {
+  queue_filename *	start;
+  int			n;
+  pid_t			pid;
+  int			fd;	/* -1 once at EOF */
+  gstring *		held;
+} ql_part;
+ql_part * parts;
+struct pollfd * pfds;
+int nmsgs = 0, nparts, chunk, cur = 0;
+uschar * buf;
+
+for (queue_filename * q = qf; q; q = q->next) nmsgs++;
+if ((nparts = nmsgs / QL_PARALLEL_MIN) > queue_list_parallel)
+  nparts = queue_list_parallel;
+if (nparts < 2) return FALSE;
+chunk = (nmsgs + nparts - 1) / nparts;
+
+parts = store_get(nparts * sizeof(ql_part), GET_UNTAINTED);
+pfds = store_get(nparts * sizeof(struct pollfd), GET_UNTAINTED);
+buf = store_get(16384, GET_UNTAINTED);
+fflush(stdout);
+
+for (int i = 0; i < nparts; i++)
+  {
+  ql_part * p = parts + i;
+  int pfd[2];
+
+  p->start = qf;
+  for (p->n = 0; qf && p->n < chunk; p->n++) qf = qf->next;
+  p->pid = 0;
+  p->fd = -1;
+  p->held = NULL;
+
+  if (pipe(pfd) != 0) continue;
+  if ((p->pid = exim_fork(US"queue-list")) == 0)
+    {
+    queue_filename * q = p->start;
+
+    (void)close(pfd[0]);
+    for (int j = 0; j < i; j++) if (parts[j].fd >= 0) (void)close(parts[j].fd);
+    if (dup2(pfd[1], 1) < 0) exim_underbar_exit(EXIT_FAILURE);
+    (void)close(pfd[1]);
+    for (int j = 0; j < p->n; j++, q = q->next)
+      queue_list_one(q, option, 0, now);
+    fflush(stdout);
+    exim_underbar_exit(EXIT_SUCCESS);
+    }
+  (void)close(pfd[1]);
+  if (p->pid < 0)
+    { p->pid = 0; (void)close(pfd[0]); }
+  else
+    p->fd = pfd[0];
+  }
+
+while (cur < nparts)
+  {
+  int npoll = 0;
+
+  /* Parts whose process has finished, or was never started, are output in
+  turn, the latter being listed now */
+
+  while (cur < nparts && parts[cur].fd < 0)
+    {
+    ql_part * p = parts + cur++;
+    if (p->held)
+      { fwrite(p->held->s, 1, p->held->ptr, stdout); p->held = NULL; }
+    else if (!p->pid)
+      {
+      queue_filename * q = p->start;
+      for (int j = 0; j < p->n; j++, q = q->next)
+	queue_list_one(q, option, 0, now);
+      }
+    }
+  if (cur >= nparts) break;
+
+  if (parts[cur].held)
+    {
+    fwrite(parts[cur].held->s, 1, parts[cur].held->ptr, stdout);
+    parts[cur].held = NULL;
+    }
+
+  for (int i = cur; i < nparts; i++) if (parts[i].fd >= 0)
+    {
+    pfds[npoll].fd = parts[i].fd;
+    pfds[npoll++].events = POLLIN;
+    }
+  if (poll(pfds, npoll, -1) < 0)
+    {
+    if (errno == EINTR) continue;
+    break;
+    }
+
+  for (int k = 0; k < npoll; k++) if (pfds[k].revents)
+    {
+    ql_part * p = parts + cur;
+    ssize_t len;
+
+    while (p->fd != pfds[k].fd) p++;
+    if ((len = read(p->fd, buf, 16384)) <= 0)
+      {
+      (void)close(p->fd);
+      p->fd = -1;
+      }
+    else if (p == parts + cur)
+      fwrite(buf, 1, len, stdout);
+    else
+      p->held = string_catn(p->held, buf, len);
+    }
+  }
+
+for (int i = 0; i < nparts; i++)
+  if (parts[i].pid > 0) (void) waitpid(parts[i].pid, NULL, 0);
+return TRUE;
+}
+
 /************************************************
 *          List messages on the queue           *
 ************************************************/
@@ -923,7 +1547,6 @@ queue_list(int option, const uschar ** list, int count)
 {
 int subcount;
 int now = (int)time(NULL);
-rmark reset_point;
 queue_filename * qf = NULL;
 uschar subdirs[64];
 
@@ -965,115 +1588,11 @@ if (option == QL_MSGID_ONLY)	/* Print only the message IDs from the chain */
       is_old_message_id(qf->text) ? MESSAGE_ID_LENGTH_OLD : MESSAGE_ID_LENGTH,
       qf->text);
 
-else for (;
-	  qf && (reset_point = store_mark());
-	  spool_clear_header_globals(), store_reset(reset_point), qf = qf->next
-	 )
-  {
-  int rc, save_errno;
-  int size = 0;
-  BOOL env_read;
-
-  message_size = 0;
-  message_subdir[0] = qf->dir_uschar;
-  rc = spool_read_header(qf->text, FALSE, count <= 0);
-  if (rc == spool_read_notopen && errno == ENOENT && count <= 0)
-    continue;
-  save_errno = errno;
-
-  env_read = (rc == spool_read_OK || rc == spool_read_hdrerror);
-
-  if (env_read)
-    {
-    int i, ptr;
-    FILE *jread;
-    struct stat statbuf;
-    uschar * fname = spool_fname(US"input", message_subdir, qf->text, US"");
-
-    ptr = Ustrlen(fname)-1;
-    fname[ptr] = 'D';
-
-    /* Add the data size to the header size; don't count the file name
-    at the start of the data file, but add one for the notional blank line
-    that precedes the data. */
-
-    if (Ustat(fname, &statbuf) == 0)
-      size = message_size + statbuf.st_size - spool_data_start_offset(qf->text) + 1;
-    i = (now - received_time.tv_sec)/60;  /* minutes on queue */
-    if (i > 90)
-      {
-      i = (i + 30)/60;
-      if (i > 72) printf("%2dd ", (i + 12)/24); else printf("%2dh ", i);
-      }
-    else printf("%2dm ", i);
-
-    /* Collect delivered addresses from any J file */
-
-    fname[ptr] = 'J';
-    if ((jread = Ufopen(fname, "rb")))
-      {
-      while (Ufgets(big_buffer, big_buffer_size, jread) != NULL)
-        {
-        int n = Ustrlen(big_buffer);
-        big_buffer[n-1] = 0;
-        tree_add_nonrecipient(big_buffer);
-        }
-      (void)fclose(jread);
-      }
-    }
-
-  fprintf(stdout, "%s %.*s",
-    string_format_size(size, big_buffer),
-    is_old_message_id(qf->text) ? MESSAGE_ID_LENGTH_OLD : MESSAGE_ID_LENGTH,
-    qf->text);
-
-  if (env_read && sender_address)
-    {
-    printf(" <%s>", sender_address);
-    if (f.sender_set_untrusted) printf(" (%s)", originator_login);
-    }
-
-  if (rc != spool_read_OK)
-    {
-    printf("\n    ");
-    if (save_errno == ERRNO_SPOOLFORMAT)
-      {
-      struct stat statbuf;
-      uschar * fname = spool_fname(US"input", message_subdir, qf->text, US"");
-
-      if (Ustat(fname, &statbuf) == 0)
-        printf("*** spool format error: size=" OFF_T_FMT " ***",
-          statbuf.st_size);
-      else printf("*** spool format error ***");
-      }
-    else printf("*** spool read error: %s ***", strerror(save_errno));
-    if (rc != spool_read_hdrerror)
-      {
-      printf("\n\n");
-      continue;
-      }
-    }
-
-  if (f.deliver_freeze) printf(" *** frozen ***");
-
-  printf("\n");
-
-  if (recipients_list)
-    {
-    for (int i = 0; i < recipients_count; i++)
-      {
-      tree_node * delivered =
-        tree_search(tree_nonrecipients, recipients_list[i].address);
-      if (!delivered || option != QL_UNDELIVERED_ONLY)
-        printf("        %s %s\n",
-	  delivered ? "D" : " ", recipients_list[i].address);
-      if (delivered) delivered->data.val = TRUE;
-      }
-    if (option == QL_PLUS_GENERATED && tree_nonrecipients)
-      queue_list_extras(tree_nonrecipients);
-    printf("\n");
-    }
-  }
+else if (  count <= 0 && queue_list_parallel > 1
+	&& queue_list_forked(qf, option, now))
+  ;
+else for (; qf; qf = qf->next)
+  queue_list_one(qf, option, count, now);
 }
 
 
@@ -1334,11 +1853,11 @@ switch(action)
 	DEBUG(D_any) debug_printf(" (ok)\n");
 	}
 
-      for (int i = 0; i < 3; i++)
+      for (int i = 0; i < 4; i++)
 	{
 	uschar * fname;
 
-	suffix[1] = (US"DHJ")[i];
+	suffix[1] = (US"DHJL")[i];
 	fname = spool_fname(US"input", message_subdir, id, suffix);
 
 	DEBUG(D_any) debug_printf(" removing %s", fname);
@@ -1366,11 +1885,12 @@ switch(action)
       else printf("has been removed or did not exist\n");
     if (removed)
       {
+      queue_index_notify(NOTIFY_QUEUE_INDEX_DEL, queue_name, id, 0);
 #ifndef DISABLE_EVENT
       if (event_action) for (int i = 0; i < recipients_count; i++)
 	{
 	tree_node *delivered =
-	  tree_search(tree_nonrecipients, recipients_list[i].address);
+	  tree_search_nonrecipient(recipients_list[i].address);
 	if (!delivered)
 	  {
 	  const uschar * save_local = deliver_localpart;
@@ -1414,6 +1934,24 @@ switch(action)
     break;
 
 
+  /* Used when changing spool_binary_header, to convert the messages already
+  on the queue */
+
+  case MSG_REWRITE_HEADER:
+  if (spool_write_header(id, SW_MODIFYING, &errmsg) >= 0)
+    {
+    printf("has been rewritten in %s format\n",
+      spool_binary_header ? "binary" : "text");
+    log_write(0, LOG_MAIN, "spool header rewritten by %s", username);
+    }
+  else
+    {
+    yield = FALSE;
+    printf("could not be rewritten: %s\n", errmsg);
+    }
+  break;
+
+
   case MSG_MARK_ALL_DELIVERED:
   for (int i = 0; i < recipients_count; i++)
     tree_add_nonrecipient(recipients_list[i].address);
@@ -1545,6 +2083,113 @@ return yield;
 
 
 
+/*************************************************
+*         Act on a list of messages              *
+*************************************************/
+
+/* This is used for the actions which take a list of message ids (-Mf, -MG,
+-Mmad, -Mrm, -Mt).  The ids come from the command line, or, if the only one
+given is "-", from the standard input, one per line (as output by -bpi).  The
+store used for each message is recovered after it.  With queue_action_parallel
+set and enough messages, they are shared out between that many processes; with
+a split spool, all the messages in one sub-directory go to the same process.
+
+Arguments:
+  ids		the message ids, or NULL to read them from stdin
+  count		how many ids
+  action	which action is required (MSG_xxx)
+
+Returns:	FALSE if there was any problem with any message
+*/
+
+#define QA_PARALLEL_MIN	50	/* messages per process */
+
+static BOOL
+queue_action_part(const uschar ** ids, int count, int action, int nparts,
+  int part)
+{
+BOOL yield = TRUE;
+
+for (int i = 0; i < count; i++)
+  {
+  rmark reset_point;
+  int key = split_spool_directory ? ids[i][MESSAGE_ID_TIME_LEN-1] : i;
+
+  if (key % nparts != part) continue;
+  reset_point = store_mark();
+  if (!queue_action(ids[i], action, NULL, 0, 0)) yield = FALSE;
+  spool_clear_header_globals();
+  store_reset(reset_point);
+  }
+return yield;
+}
+
+BOOL
+queue_action_list(const uschar ** ids, int count, int action)
+{
+BOOL yield = TRUE;
+int nparts;
+pid_t * pids;
+
+if (!ids)
+  {
+  gstring * g = NULL;
+  uschar buffer[256];
+  const uschar * s;
+
+  count = 0;
+  while (Ufgets(buffer, sizeof(buffer), stdin))
+    {
+    uschar * p = buffer, * e;
+
+    Uskip_whitespace(&p);
+    for (e = p; *e && !isspace(*e); ) e++;
+    if (e == p) continue;
+    *e = '\0';
+    if (!mac_ismsgid(p))
+      {
+      fprintf(stderr, "exim: malformed message id %s on standard input\n", p);
+      yield = FALSE;
+      continue;
+      }
+    g = string_catn(g, p, e - p + 1);
+    count++;
+    }
+  if (!count) return yield;
+
+  ids = store_get(count * sizeof(uschar *), GET_UNTAINTED);
+  s = g->s;
+  for (int i = 0; i < count; i++, s += Ustrlen(s) + 1) ids[i] = s;
+  }
+
+if ((nparts = count / QA_PARALLEL_MIN) > queue_action_parallel)
+  nparts = queue_action_parallel;
+if (nparts < 2)
+  return queue_action_part(ids, count, action, 1, 0) && yield;
+
+fflush(stdout);
+pids = store_get(nparts * sizeof(pid_t), GET_UNTAINTED);
+for (int i = 0; i < nparts; i++)
+  if ((pids[i] = exim_fork(US"queue-action")) == 0)
+    {
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    exim_underbar_exit(queue_action_part(ids, count, action, nparts, i)
+		      ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+  else if (pids[i] < 0)		/* do this part ourselves */
+    if (!queue_action_part(ids, count, action, nparts, i)) yield = FALSE;
+
+for (int i = 0; i < nparts; i++)
+  if (pids[i] > 0)
+    {
+    int status;
+    if (waitpid(pids[i], &status, 0) != pids[i] || status != 0) yield = FALSE;
+    }
+return yield;
+}
+
+
+
 /*************************************************
 *       Check the queue_only_file condition      *
 *************************************************/
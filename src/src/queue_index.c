@@ -0,0 +1,1184 @@
+/*************************************************
+*     Exim - an Internet mail transport agent    *
+*************************************************/
+
+/*
+ * Copyright (c) The Exim Maintainers 2024
+ * License: GPL
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+/* A daemon-maintained index of the messages on the queue.
+
+When the queue_index option is set, the daemon builds, for each queue it
+runs, an in-memory set of the messages whose -H files are present in the
+spool.  The set is kept current by notifications sent over the daemon
+notifier socket: processes writing a new -H file, moving a message between
+queues, or removing a message, send a fire-and-forget datagram.
+
+Queue-runner processes forked from the daemon inherit the index and use it
+in place of a directory scan.  Queue runners that were re-exec'd, or are
+running from the commandline, ask the daemon for the index via the notifier
+socket, some entries at a time.  If the daemon does not answer they fall back
+to scanning the spool directory.
+
+Datagrams can be lost, so the index is not trusted to be exact.  An entry for
+a message that has gone is harmless: the queue runner checks for the file
+before forking a delivery.  A missing entry would delay the message, so the
+daemon rebuilds the index from the spool every QUEUE_INDEX_RESYNC seconds.
+
+The spool scan for a rebuild, which reads every -H file, is done by a child
+process so that the daemon goes on accepting connections meanwhile.  The child
+writes what it finds to a file and exits; when the daemon reaps it, it loads
+the file in place of the index and replays the notifications that arrived
+during the scan.  Until the first build is complete, queue runners scan the
+spool themselves.
+
+Each entry also carries the size of the message, its arrival time and whether
+it is frozen, taken from the spool by the process sending an add notification
+(which is sent again whenever the -H file is rewritten).  The daemon keeps
+running totals from these, per queue, which are returned for a
+NOTIFY_QUEUE_STATS request; this is used for "exim -bpc" and
+"exim -bP queue_stats".
+
+An entry can also carry the sender and the domains of the recipients, again
+sent by the process writing the -H file.  A queue run selecting messages by
+sender or recipient (-S, -R and friends) passes non-regex selection strings
+with its request, and entries that cannot match are not returned; the queue
+runner still checks each message it is given against the spool, so the index
+only needs to be sure of what it leaves out.  Entries without the data (it did
+not fit in the space for it) are always returned. */
+
+#include "exim.h"
+
+#ifndef COMPILE_UTILITY
+
+#define QUEUE_INDEX_SEL_MAX	256	/* space for sender and domains */
+
+/* Notification, or request, sent to the daemon */
+
+typedef struct qi_req {
+  uschar	notifier_reqtype;
+  uschar	subdir;			/* for add/delete */
+  BOOL		frozen;			/* for add */
+  int		size;			/* for add */
+  time_t	received;		/* for add */
+  time_t	retry_after;		/* for add */
+  BOOL		skip_waiting;		/* for slice requests */
+  int		large_size;		/* for slice requests */
+  unsigned	generation;		/* for slice requests */
+  unsigned	bucket;			/* slice-request cursor */
+  int		sel_len;		/* used length of sel; 0 for none */
+  uschar	sel[QUEUE_INDEX_SEL_MAX];	/* for add: sender, then recipient
+					domains, each NUL-terminated, then an
+					empty string.  For slice: sender
+					substring, recipient domain prefix. */
+  uschar	id[MESSAGE_ID_LENGTH+1];	/* for add/delete */
+  uschar	qname[1];		/* extensible */
+} qi_req;
+
+/* Header for the response to a slice request.  It is followed by
+"nentries" entries, each a subdir char, a flag char that is nonzero for a
+message at least as large as the request's large_size, an id and a
+terminating NUL. */
+
+typedef struct qi_resp {
+  unsigned	generation;
+  unsigned	bucket;			/* cursor for the next request */
+  unsigned	nentries;
+  BOOL		done;
+  BOOL		unbuilt;		/* no index yet; scan the spool */
+} qi_resp;
+
+/* A record in the file written by a rebuild child; it is followed by sel_len
+bytes of sender and domains, as in qi_req. */
+
+typedef struct qi_rec {
+  uschar	subdir;
+  BOOL		frozen;
+  int		size;
+  time_t	received;
+  time_t	retry_after;
+  int		sel_len;
+  uschar	id[MESSAGE_ID_LENGTH+1];
+} qi_rec;
+
+/* A notification kept for replay after a rebuild */
+
+typedef struct qi_journal {
+  struct qi_journal * next;
+  qi_req	req;			/* without the queue name */
+} qi_journal;
+
+/* The daemon-side data, one per queue */
+
+typedef struct qi_entry {
+  struct qi_entry * next;
+  uschar	subdir;
+  BOOL		frozen;
+  int		size;			/* as shown by -bp */
+  time_t	received;
+  time_t	retry_after;		/* from the spool, for queue_run_retry_skip */
+  uschar *	sel;			/* sender and domains as in qi_req, or NULL */
+  uschar	id[MESSAGE_ID_LENGTH+1];
+} qi_entry;
+
+typedef struct qindex {
+  struct qindex * next;
+  const uschar * name;			/* queue name; empty for the default */
+  qi_entry **	buckets;
+  unsigned	nbuckets;
+  unsigned	count;
+  unsigned	frozen;			/* how many of count are frozen */
+  uint64_t	bytes;			/* total of the sizes */
+  time_t	oldest;			/* earliest arrival time */
+  BOOL		oldest_stale;		/* recompute oldest before use */
+  unsigned	generation;		/* bumped when cursors become invalid */
+  time_t	built;			/* zero if never scanned */
+  pid_t		rebuild_pid;		/* child scanning the spool, or 0 */
+  time_t	rebuild_started;
+  qi_journal *	journal;		/* notifications during the scan */
+  qi_journal *	journal_last;
+} qindex;
+
+static qindex * qindexes = NULL;
+
+#define QUEUE_INDEX_RESYNC	(30*60)	/* full rescan interval */
+#define QUEUE_INDEX_NBUCKETS	1024	/* initial hashtable size */
+#define QUEUE_INDEX_SLICE	16384	/* max size of a response datagram */
+
+/******************************************************************************/
+/* Daemon side */
+
+static unsigned
+qi_hash(const uschar * id)
+{
+unsigned h = 5381;
+while (*id) h = (h << 5) + h + *id++;
+return h;
+}
+
+
+static qindex *
+qi_find(const uschar * name, BOOL create)
+{
+qindex * qi;
+int old_pool = store_pool;
+
+for (qi = qindexes; qi; qi = qi->next)
+  if (Ustrcmp(qi->name, name) == 0) return qi;
+if (!create) return NULL;
+
+store_pool = POOL_PERM;
+qi = store_get(sizeof(qindex), GET_UNTAINTED);
+qi->name = string_copy_taint(name, GET_UNTAINTED);
+store_pool = old_pool;
+
+qi->nbuckets = QUEUE_INDEX_NBUCKETS;
+qi->buckets = store_malloc(qi->nbuckets * sizeof(qi_entry *));
+memset(qi->buckets, 0, qi->nbuckets * sizeof(qi_entry *));
+qi->count = qi->frozen = qi->generation = 0;
+qi->bytes = 0;
+qi->oldest = 0;
+qi->oldest_stale = FALSE;
+qi->built = 0;
+qi->rebuild_pid = 0;
+qi->rebuild_started = 0;
+qi->journal = qi->journal_last = NULL;
+qi->next = qindexes;
+qindexes = qi;
+return qi;
+}
+
+
+static void
+qi_grow(qindex * qi)
+{
+unsigned n = qi->nbuckets * 2;
+qi_entry ** b = store_malloc(n * sizeof(qi_entry *));
+
+memset(b, 0, n * sizeof(qi_entry *));
+for (unsigned i = 0; i < qi->nbuckets; i++)
+  for (qi_entry * e = qi->buckets[i], * next; e; e = next)
+    {
+    unsigned h = qi_hash(e->id) % n;
+    next = e->next;
+    e->next = b[h];
+    b[h] = e;
+    }
+store_free(qi->buckets);
+qi->buckets = b;
+qi->nbuckets = n;
+qi->generation++;
+}
+
+
+/* Take an entry out of, or put it into, the running totals */
+
+static void
+qi_totals(qindex * qi, const qi_entry * e, BOOL add)
+{
+if (add)
+  {
+  qi->bytes += e->size;
+  if (e->frozen) qi->frozen++;
+  if (!qi->oldest_stale && (!qi->oldest || e->received < qi->oldest))
+    qi->oldest = e->received;
+  }
+else
+  {
+  qi->bytes -= e->size;
+  if (e->frozen) qi->frozen--;
+  if (e->received <= qi->oldest) qi->oldest_stale = TRUE;
+  }
+}
+
+
+static void
+qi_add(qindex * qi, const uschar * id, uschar subdir, const qi_req * stats)
+{
+qi_entry ** ep = &qi->buckets[qi_hash(id) % qi->nbuckets], * e;
+BOOL new = TRUE;
+
+for (e = *ep; e; e = e->next)
+  if (Ustrcmp(e->id, id) == 0)
+    {
+    qi_totals(qi, e, FALSE);
+    if (e->sel) store_free(e->sel);
+    new = FALSE;
+    break;
+    }
+
+if (new)
+  {
+  e = store_malloc(sizeof(qi_entry));
+  Ustrncpy(e->id, id, MESSAGE_ID_LENGTH);
+  e->id[MESSAGE_ID_LENGTH] = '\0';
+  e->next = *ep;
+  *ep = e;
+  }
+e->subdir = subdir;
+e->frozen = stats->frozen;
+e->size = stats->size;
+e->received = stats->received;
+e->retry_after = stats->retry_after;
+e->sel = NULL;
+if (stats->sel_len > 0 && stats->sel_len <= QUEUE_INDEX_SEL_MAX)
+  {
+  e->sel = store_malloc(stats->sel_len);
+  memcpy(e->sel, stats->sel, stats->sel_len);
+  e->sel[stats->sel_len - 1] = '\0';
+  }
+qi_totals(qi, e, TRUE);
+if (new && ++qi->count > 2 * qi->nbuckets) qi_grow(qi);
+}
+
+
+static void
+qi_del(qindex * qi, const uschar * id)
+{
+for (qi_entry ** ep = &qi->buckets[qi_hash(id) % qi->nbuckets], * e;
+     (e = *ep); ep = &e->next)
+  if (Ustrcmp(e->id, id) == 0)
+    {
+    *ep = e->next;
+    qi_totals(qi, e, FALSE);
+    if (e->sel) store_free(e->sel);
+    store_free(e);
+    qi->count--;
+    return;
+    }
+}
+
+
+static void
+qi_clear(qindex * qi)
+{
+for (unsigned i = 0; i < qi->nbuckets; i++)
+  {
+  for (qi_entry * e = qi->buckets[i], * next; e; e = next)
+    {
+    next = e->next;
+    if (e->sel) store_free(e->sel);
+    store_free(e);
+    }
+  qi->buckets[i] = NULL;
+  }
+qi->count = qi->frozen = 0;
+qi->bytes = 0;
+qi->oldest = 0;
+qi->oldest_stale = FALSE;
+qi->generation++;
+}
+
+
+/* Find the earliest arrival time again, after the message that had it has
+gone.  This is a walk of the whole index, so is left until it is wanted. */
+
+static time_t
+qi_oldest(qindex * qi)
+{
+if (qi->oldest_stale)
+  {
+  qi->oldest = 0;
+  for (unsigned i = 0; i < qi->nbuckets; i++)
+    for (qi_entry * e = qi->buckets[i]; e; e = e->next)
+      if (!qi->oldest || e->received < qi->oldest)
+	qi->oldest = e->received;
+  qi->oldest_stale = FALSE;
+  }
+return qi->oldest;
+}
+
+
+/* Pack the sender and the distinct recipient domains of a message for the
+index.  If they do not fit, or an address has more than one '@' (so that its
+domain might not be what a -R string matched against), nothing is stored and
+the entry will always be selected. */
+
+static void
+qi_spool_sel(spool_view * v, qi_req * stats)
+{
+uschar * p = stats->sel, * end = stats->sel + QUEUE_INDEX_SEL_MAX;
+const uschar * cursor = NULL;
+int n = spool_view_recipients(v);
+
+stats->sel_len = 0;
+if (n < 0 || v->sender_len + 2 > QUEUE_INDEX_SEL_MAX) return;
+memcpy(p, v->sender, v->sender_len);
+p += v->sender_len;
+*p++ = '\0';
+
+while (n-- > 0)
+  {
+  int len;
+  const uschar * addr = spool_view_recipient(v, &cursor, &len), * at, * q;
+  BOOL seen = FALSE;
+
+  if (!addr || !(at = memchr(addr, '@', len))) return;
+  if (memchr(at + 1, '@', addr + len - at - 1)) return;
+  if ((len -= ++at - addr) == 0) return;
+
+  for (q = stats->sel + v->sender_len + 1; q < p; q += Ustrlen(q) + 1)
+    if (Ustrlen(q) == len && strncmpic(q, at, len) == 0)
+      { seen = TRUE; break; }
+  if (seen) continue;
+
+  if (p + len + 2 > end) return;
+  memcpy(p, at, len);
+  p += len;
+  *p++ = '\0';
+  }
+*p++ = '\0';
+stats->sel_len = p - stats->sel;
+}
+
+
+/* Get a message's details for the index from its spool files: the size in the
+same way as -bp shows it, the arrival time, whether it is frozen, any time
+before which it is not worth a delivery attempt, and the sender and recipient
+domains.
+
+Arguments:
+  qname		queue name, empty for the default queue
+  id		message id
+  subdir	spool sub-directory character, or 0
+  stats		where to put the details
+
+Returns:	FALSE if the header file was not readable
+*/
+
+static BOOL
+qi_spool_stats(const uschar * qname, const uschar * id, uschar subdir,
+  qi_req * stats)
+{
+uschar * save_qname = queue_name;
+uschar save_subdir = message_subdir[0];
+spool_view v;
+struct stat statbuf;
+const uschar * s;
+int hsize;
+BOOL yield = FALSE;
+
+queue_name = US qname;
+message_subdir[0] = subdir;
+if (spool_view_open(&v, string_sprintf("%s-H", id), TRUE) == spool_read_OK)
+  {
+  stats->received = v.received_time;
+  stats->frozen = !!spool_view_option(&v, US"frozen");
+  if ((s = spool_view_option(&v, US"retry_after")))
+    stats->retry_after = (time_t) Ustrtol(s, NULL, 10);
+  if (!spool_view_header_size(&v, &hsize)) hsize = 0;
+  qi_spool_sel(&v, stats);
+  spool_view_close(&v);
+
+  stats->size = Ustat(spool_fname(US"input", message_subdir, id, US"-D"),
+		      &statbuf) == 0
+    ? hsize + statbuf.st_size - spool_data_start_offset(id) + 1 : hsize;
+  yield = TRUE;
+  }
+queue_name = save_qname;
+message_subdir[0] = save_subdir;
+return yield;
+}
+
+
+/* The file a rebuild child writes its results to */
+
+static uschar *
+qi_rebuild_fname(pid_t pid)
+{
+return string_sprintf("%s/qindex-%d", spool_directory, (int)pid);
+}
+
+
+/* In a rebuild child: scan the spool for the given queue, and write a record
+for each message to the file.
+
+Returns:	TRUE if the file was written
+*/
+
+static BOOL
+qi_scan(qindex * qi, const uschar * fname)
+{
+uschar subdirs[64];
+int subcount, fd;
+FILE * fp;
+BOOL ok = TRUE;
+
+if (  (fd = Uopen(fname, O_WRONLY|O_CREAT|O_TRUNC|O_EXCL, SPOOL_MODE)) < 0
+   || !(fp = fdopen(fd, "wb")))
+  {
+  log_write(0, LOG_MAIN|LOG_PANIC, "queue index: cannot create %s: %s",
+    fname, strerror(errno));
+  return FALSE;
+  }
+
+queue_name = US qi->name;
+for (queue_filename * fq = queue_get_spool_list(-1, subdirs, &subcount,
+				  TRUE, NULL); fq && ok; fq = fq->next)
+  {
+  qi_req stats = {0};
+  qi_rec rec = {0};
+
+  fq->text[Ustrlen(fq->text)-2] = '\0';		/* lose the -H */
+  if (!qi_spool_stats(qi->name, fq->text, fq->dir_uschar, &stats))
+    continue;
+  rec.subdir = fq->dir_uschar;
+  rec.frozen = stats.frozen;
+  rec.size = stats.size;
+  rec.received = stats.received;
+  rec.retry_after = stats.retry_after;
+  rec.sel_len = stats.sel_len;
+  Ustrncpy(rec.id, fq->text, MESSAGE_ID_LENGTH);
+  ok = fwrite(&rec, sizeof(rec), 1, fp) == 1
+    && (!rec.sel_len || fwrite(stats.sel, rec.sel_len, 1, fp) == 1);
+  }
+if (fclose(fp) != 0) ok = FALSE;
+if (!ok)
+  log_write(0, LOG_MAIN|LOG_PANIC, "queue index: write to %s failed: %s",
+    fname, strerror(errno));
+return ok;
+}
+
+
+/* In the daemon: replace the index content with the result of a rebuild, then
+apply the notifications that arrived while the child was scanning.  They are
+later than the scan, or describe the same state; either way they win. */
+
+static void
+qi_load(qindex * qi, const uschar * fname)
+{
+FILE * fp;
+qi_rec rec;
+
+if (!(fp = Ufopen(fname, "rb")))
+  {
+  log_write(0, LOG_MAIN|LOG_PANIC, "queue index: cannot open %s: %s",
+    fname, strerror(errno));
+  return;
+  }
+
+qi_clear(qi);
+while (fread(&rec, sizeof(rec), 1, fp) == 1)
+  {
+  qi_req stats = {0};
+
+  if (  rec.sel_len < 0 || rec.sel_len > QUEUE_INDEX_SEL_MAX
+     || (rec.sel_len && fread(stats.sel, rec.sel_len, 1, fp) != 1))
+    break;
+  rec.id[MESSAGE_ID_LENGTH] = '\0';
+  stats.frozen = rec.frozen;
+  stats.size = rec.size;
+  stats.received = rec.received;
+  stats.retry_after = rec.retry_after;
+  stats.sel_len = rec.sel_len;
+  qi_add(qi, rec.id, rec.subdir, &stats);
+  }
+(void) fclose(fp);
+
+for (qi_journal * j = qi->journal; j; j = j->next)
+  if (j->req.notifier_reqtype == NOTIFY_QUEUE_INDEX_ADD)
+    qi_add(qi, j->req.id, j->req.subdir, &j->req);
+  else
+    qi_del(qi, j->req.id);
+
+qi->built = qi->rebuild_started;
+DEBUG(D_queue_run) debug_printf("queue index for '%s' built: %u messages\n",
+  qi->name, qi->count);
+}
+
+
+static void
+qi_journal_free(qindex * qi)
+{
+for (qi_journal * j = qi->journal, * next; j; j = next)
+  {
+  next = j->next;
+  store_free(j);
+  }
+qi->journal = qi->journal_last = NULL;
+}
+
+
+/* Called in the daemon before forking a queue runner, and for a fresh
+slice request.  Start a rebuild of the index for the queue if it has not been
+built, or if it is old enough that lost notifications might have accumulated,
+unless one is already under way.  The current index, if any, stays in use until
+the new one is loaded. */
+
+void
+queue_index_refresh(const uschar * qname)
+{
+qindex * qi = qi_find(qname ? qname : US"", TRUE);
+pid_t pid;
+
+if (  qi->rebuild_pid > 0
+   || (qi->built && time(NULL) - qi->built < QUEUE_INDEX_RESYNC))
+  return;
+
+if ((pid = exim_fork(US"queue-index")) == 0)
+  {
+  signal(SIGHUP,  SIG_DFL);
+  signal(SIGCHLD, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  if (daemon_notifier_fd >= 0)
+    { (void) close(daemon_notifier_fd); daemon_notifier_fd = -1; }
+  set_process_info("scanning queue '%s' for the queue index", qi->name);
+  exim_underbar_exit(qi_scan(qi, qi_rebuild_fname(getpid()))
+    ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+if (pid < 0)
+  {
+  log_write(0, LOG_MAIN|LOG_PANIC, "queue index: fork failed: %s",
+    strerror(errno));
+  return;
+  }
+
+qi->rebuild_pid = pid;
+qi->rebuild_started = time(NULL);
+DEBUG(D_queue_run) debug_printf("queue index for '%s': scan started, pid %d\n",
+  qi->name, (int)pid);
+}
+
+
+/* Note the end of a daemon child.  If it was a rebuild, load its results.
+
+Returns:	TRUE if the process was a rebuild child
+*/
+
+BOOL
+queue_index_reaped(pid_t pid, int status)
+{
+for (qindex * qi = qindexes; qi; qi = qi->next)
+  if (qi->rebuild_pid == pid)
+    {
+    uschar * fname = qi_rebuild_fname(pid);
+    rmark reset_point = store_mark();
+
+    qi->rebuild_pid = 0;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS)
+      qi_load(qi, fname);
+    else
+      log_write(0, LOG_MAIN|LOG_PANIC,
+	"queue index scan for '%s' (pid %d) failed: status=0x%x",
+	qi->name, (int)pid, status);
+    (void) Uunlink(fname);
+    qi_journal_free(qi);
+    store_reset(reset_point);
+    return TRUE;
+    }
+return FALSE;
+}
+
+
+/* Handle an add or delete notification arriving at the daemon.  While a
+rebuild is under way a copy is kept, for replay once it has been loaded.
+Otherwise, notifications for a queue that has not yet been scanned are
+dropped; the scan will pick up the message. */
+
+void
+queue_index_at_daemon(const uschar * reqbuf)
+{
+qi_req req;
+qindex * qi;
+
+memcpy(&req, reqbuf, sizeof(req));
+req.id[MESSAGE_ID_LENGTH] = '\0';
+if (!(qi = qi_find(reqbuf + offsetof(qi_req, qname), FALSE)))
+  return;
+
+if (qi->rebuild_pid > 0)
+  {
+  qi_journal * j = store_malloc(sizeof(qi_journal));
+  j->next = NULL;
+  j->req = req;
+  if (qi->journal_last) qi->journal_last->next = j; else qi->journal = j;
+  qi->journal_last = j;
+  }
+if (!qi->built) return;
+
+DEBUG(D_queue_run) debug_printf("queue index '%s': %s %s\n", qi->name,
+  req.notifier_reqtype == NOTIFY_QUEUE_INDEX_ADD ? "add" : "del", req.id);
+
+if (req.notifier_reqtype == NOTIFY_QUEUE_INDEX_ADD)
+  qi_add(qi, req.id, req.subdir, &req);
+else
+  qi_del(qi, req.id);
+}
+
+
+/* Check an entry against the selection strings of a queue run: a substring
+of the sender (-S), and a prefix of a recipient domain (the part after the
+last '@' of a -R string).  Either may be empty.  Entries without the data
+pass. */
+
+static BOOL
+qi_selected(const qi_entry * e, const uschar * sender, const uschar * domain)
+{
+int dlen;
+
+if (!e->sel) return TRUE;
+if (*sender && !strstric_c(e->sel, sender, FALSE)) return FALSE;
+if (!(dlen = Ustrlen(domain))) return TRUE;
+for (const uschar * s = e->sel + Ustrlen(e->sel) + 1; *s; s += Ustrlen(s) + 1)
+  if (strncmpic(s, domain, dlen) == 0) return TRUE;
+return FALSE;
+}
+
+
+/* Handle a slice request arriving at the daemon.  Send back as many whole
+hash buckets as fit in a datagram, starting at the given cursor, plus the
+cursor for the next request.  Adds and deletes between requests do not upset
+this, but a resize of the hashtable (or a rebuild) does; the generation number
+changes and the requester will fall back to a directory scan.  If the request
+asks for it, messages not due for a delivery attempt are left out, as are
+those the request's selection strings rule out. */
+
+void
+queue_index_slice(int fd, const uschar * reqbuf,
+  const struct sockaddr * sa, socklen_t salen)
+{
+static uschar buf[QUEUE_INDEX_SLICE];
+qi_req req;
+qi_resp resp = {0};
+qindex * qi;
+uschar * p = buf + sizeof(qi_resp);
+const uschar * sel_sender = US"", * sel_domain = US"";
+unsigned b;
+time_t now = time(NULL);
+
+memcpy(&req, reqbuf, sizeof(req));
+if (req.sel_len > 0 && req.sel_len <= QUEUE_INDEX_SEL_MAX)
+  {
+  req.sel[req.sel_len - 1] = '\0';
+  sel_sender = req.sel;
+  if (Ustrlen(sel_sender) + 1 < req.sel_len)
+    sel_domain = sel_sender + Ustrlen(sel_sender) + 1;
+  }
+if (req.bucket == 0)
+  queue_index_refresh(reqbuf + offsetof(qi_req, qname));
+qi = qi_find(reqbuf + offsetof(qi_req, qname), TRUE);
+
+resp.generation = qi->generation;
+if (!qi->built)
+  {
+  resp.unbuilt = resp.done = TRUE;
+  goto send;
+  }
+if (req.bucket && req.generation != qi->generation)
+  {
+  resp.done = TRUE;
+  goto send;
+  }
+
+for (b = req.bucket; b < qi->nbuckets; b++)
+  {
+  uschar * bucket_start = p;
+  unsigned n = 0;
+
+  for (qi_entry * e = qi->buckets[b]; e; e = e->next)
+    {
+    int len = Ustrlen(e->id) + 1;
+    if (req.skip_waiting && e->retry_after > now) continue;
+    if (!qi_selected(e, sel_sender, sel_domain)) continue;
+    if (p + 2 + len > buf + sizeof(buf))
+      {
+      /* This bucket does not fit.  Send the ones before it and restart at
+      it next time.  A single bucket too large for a datagram gets truncated;
+      with sane chain lengths that cannot happen. */
+
+      if (bucket_start > buf + sizeof(qi_resp))
+	{ p = bucket_start; resp.bucket = b; }
+      else
+	{ resp.nentries = n; resp.bucket = b + 1; }
+      goto send;
+      }
+    *p++ = e->subdir;
+    *p++ = req.large_size > 0 && e->size >= req.large_size;
+    memcpy(p, e->id, len);
+    p += len;
+    n++;
+    }
+  resp.nentries += n;
+  }
+resp.done = TRUE;
+
+send:
+  DEBUG(D_queue_run) debug_printf("%s: queue index '%s' slice of %u%s\n",
+    __FUNCTION__, qi->name, resp.nentries, resp.done ? " (final)" : "");
+  memcpy(buf, &resp, sizeof(resp));
+  if (sendto(fd, buf, p - buf, 0, sa, salen) < 0)
+    log_write(0, LOG_MAIN|LOG_PANIC,
+      "%s: sendto: %s\n", __FUNCTION__, strerror(errno));
+}
+
+
+/* Handle a stats request arriving at the daemon.  Send back a line for each
+queue that has an index built, starting with the one asked for (a build of
+which is started if need be), giving the running totals. */
+
+static gstring *
+qi_stats_line(gstring * g, qindex * qi, time_t now)
+{
+time_t oldest = qi_oldest(qi);
+
+return string_fmt_append(g,
+  "queue=%s messages=%u frozen=%u bytes=" PR_EXIM_ARITH " oldest=%d\n",
+  qi->name, qi->count, qi->frozen, (int_eximarith_t)qi->bytes,
+  oldest && now > oldest ? (int)(now - oldest) : 0);
+}
+
+void
+queue_index_stats_at_daemon(int fd, const uschar * reqbuf,
+  const struct sockaddr * sa, socklen_t salen)
+{
+const uschar * qname = reqbuf + offsetof(qi_req, qname);
+qindex * want;
+gstring * g;
+time_t now = time(NULL);
+
+queue_index_refresh(qname);
+want = qi_find(qname, FALSE);
+g = want->built
+  ? qi_stats_line(NULL, want, now)
+  : string_fmt_append(NULL, "queue=%s index not yet built\n", want->name);
+for (qindex * qi = qindexes; qi; qi = qi->next)
+  if (qi != want && qi->built)
+    g = qi_stats_line(g, qi, now);
+
+DEBUG(D_queue_run) debug_printf("%s: queue stats for '%s'\n",
+  __FUNCTION__, qname);
+if (sendto(fd, g->s, g->ptr, 0, sa, salen) < 0)
+  log_write(0, LOG_MAIN|LOG_PANIC,
+    "%s: sendto: %s\n", __FUNCTION__, strerror(errno));
+}
+
+
+/* Return the message count from the index for the current queue, if we have
+a built one (in the daemon, or a process forked from it). */
+
+BOOL
+queue_index_count(unsigned * count)
+{
+qindex * qi;
+if (!queue_index || !(qi = qi_find(queue_name, FALSE)) || !qi->built)
+  return FALSE;
+*count = qi->count;
+return TRUE;
+}
+
+/******************************************************************************/
+/* Client side */
+
+/* Tell the daemon of a change to the current queue.  Called after a -H file
+appears (NOTIFY_QUEUE_INDEX_ADD) or goes away (NOTIFY_QUEUE_INDEX_DEL).
+This is a fire-and-forget send.
+
+Arguments:
+  type		notification type
+  qname		queue name, empty for the default queue
+  id		message id
+  subdir	spool sub-directory character, or 0
+*/
+
+void
+queue_index_notify(uschar type, const uschar * qname, const uschar * id,
+  uschar subdir)
+{
+int qlen, rlen, fd;
+qi_req * req;
+
+if (!queue_index || f.daemon_listen) return;
+
+qlen = Ustrlen(qname) + 1;
+rlen = offsetof(qi_req, qname) + qlen;
+req = store_get(rlen, GET_UNTAINTED);
+memset(req, 0, offsetof(qi_req, qname));
+req->notifier_reqtype = type;
+req->subdir = subdir;
+Ustrncpy(req->id, id, MESSAGE_ID_LENGTH);
+memcpy(req->qname, qname, qlen);
+if (type == NOTIFY_QUEUE_INDEX_ADD)
+  (void) qi_spool_stats(qname, id, subdir, req);
+
+DEBUG(D_queue_run) debug_printf("%s: %s %s\n", __FUNCTION__,
+  type == NOTIFY_QUEUE_INDEX_ADD ? "add" : "del", id);
+
+if ((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) >= 0)
+  {
+  struct sockaddr_un sa_un = {.sun_family = AF_UNIX};
+  ssize_t len = daemon_notifier_sockname(&sa_un);
+
+  if (sendto(fd, req, rlen, 0, (struct sockaddr *)&sa_un, (socklen_t)len) < 0)
+    DEBUG(D_queue_run)
+      debug_printf("%s: sendto %s\n", __FUNCTION__, strerror(errno));
+  close(fd);
+  }
+else DEBUG(D_queue_run) debug_printf(" socket: %s\n", strerror(errno));
+}
+
+
+
+/* Add a message to a list being built for a queue run */
+
+static void
+qi_list_add(queue_filename ** listp, queue_filename ** lastp,
+  const uschar * id, uschar subdir, BOOL random)
+{
+int len = Ustrlen(id);
+queue_filename * fq = store_get(sizeof(queue_filename) + len + 2, GET_UNTAINTED);
+
+memcpy(fq->text, id, len);
+Ustrcpy(fq->text + len, US"-H");
+fq->dir_uschar = subdir;
+if (!*listp)
+  { fq->next = NULL; *listp = *lastp = fq; }
+else if (random && random_number(2))
+  { fq->next = *listp; *listp = fq; }
+else
+  { fq->next = NULL; (*lastp)->next = fq; *lastp = fq; }
+}
+
+
+/* Open a socket connected to the daemon's notifier socket, for a request
+expecting a response.  Returns the fd, or -1; the name of the socket's own
+end is returned, for removal after use if it is not abstract. */
+
+static int
+qi_connect(uschar ** snamep)
+{
+struct sockaddr_un sa_un = {.sun_family = AF_UNIX};
+const uschar * where;
+ssize_t len;
+int fd;
+
+if ((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0)
+  {
+  DEBUG(D_queue_run) debug_printf(" socket: %s\n", strerror(errno));
+  return -1;
+  }
+
+len = daemon_client_sockname(&sa_un, snamep);
+if (bind(fd, (const struct sockaddr *)&sa_un, (socklen_t)len) < 0)
+  { where = US"bind"; goto bad; }
+
+len = daemon_notifier_sockname(&sa_un);
+if (connect(fd, (const struct sockaddr *)&sa_un, len) < 0)
+  {
+  where = US"connect";
+#ifndef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
+  Uunlink(*snamep);
+#endif
+  goto bad;
+  }
+return fd;
+
+bad:
+  DEBUG(D_queue_run) debug_printf(" queue index %s: %s\n", where, strerror(errno));
+  close(fd);
+  return -1;
+}
+
+
+/* Ask the daemon for the index, a slice at a time.  Messages of at least
+queue_run_large_size go on the second list. */
+
+static BOOL
+qi_from_daemon(queue_filename ** listp, queue_filename ** largep,
+  BOOL random, BOOL skip_waiting,
+  const uschar * sel_sender, const uschar * sel_domain)
+{
+int qlen = Ustrlen(queue_name) + 1, rlen = offsetof(qi_req, qname) + qlen;
+qi_req * req = store_get(rlen, GET_UNTAINTED);
+uschar * buf = store_get(QUEUE_INDEX_SLICE, GET_UNTAINTED);
+queue_filename * last = NULL, * large_last = NULL;
+const uschar * where;
+uschar * sname;
+unsigned generation = 0;
+BOOL yield = FALSE;
+ssize_t len;
+int fd;
+
+memset(req, 0, offsetof(qi_req, qname));
+req->notifier_reqtype = NOTIFY_QUEUE_INDEX_REQ;
+req->skip_waiting = skip_waiting;
+req->large_size = queue_run_large_size;
+if (*sel_sender || *sel_domain)
+  {
+  int slen = Ustrlen(sel_sender) + 1, dlen = Ustrlen(sel_domain) + 1;
+  if (slen + dlen <= QUEUE_INDEX_SEL_MAX)
+    {
+    memcpy(req->sel, sel_sender, slen);
+    memcpy(req->sel + slen, sel_domain, dlen);
+    req->sel_len = slen + dlen;
+    }
+  }
+memcpy(req->qname, queue_name, qlen);
+
+if ((fd = qi_connect(&sname)) < 0) return FALSE;
+
+for (;;)
+  {
+  qi_resp resp;
+  const uschar * p;
+
+  if (send(fd, req, rlen, 0) < 0) { where = US"send"; goto bad2; }
+  if (poll_one_fd(fd, POLLIN, 2 * 1000) != 1)
+    { where = US"poll"; errno = ETIMEDOUT; goto bad2; }
+  if ((len = recv(fd, buf, QUEUE_INDEX_SLICE, 0)) < (ssize_t)sizeof(resp))
+    { where = US"recv"; goto bad2; }
+
+  memcpy(&resp, buf, sizeof(resp));
+  if (resp.unbuilt)
+    {
+    DEBUG(D_queue_run) debug_printf("queue index not yet built\n");
+    goto out;
+    }
+  if (req->bucket && resp.generation != generation)
+    {
+    DEBUG(D_queue_run) debug_printf("queue index changed during fetch\n");
+    goto out;
+    }
+  generation = resp.generation;
+
+  p = buf + sizeof(resp);
+  for (unsigned n = resp.nentries; n; n--)
+    {
+    uschar subdir = *p++;
+    BOOL large = !!*p++;
+    const uschar * nul = memchr(p, 0, buf + len - p);
+
+    if (!nul || !mac_ismsgid(p))
+      { where = US"content"; errno = EINVAL; goto bad2; }
+    if (large)
+      qi_list_add(largep, &large_last, p, subdir, random);
+    else
+      qi_list_add(listp, &last, p, subdir, random);
+    p = nul + 1;
+    }
+
+  if (resp.done) break;
+  req->generation = generation;
+  req->bucket = resp.bucket;
+  }
+yield = TRUE;
+
+out:
+  close(fd);
+#ifndef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
+  Uunlink(sname);
+#endif
+  return yield;
+
+bad2:
+#ifndef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
+  Uunlink(sname);
+#endif
+  close(fd);
+  DEBUG(D_queue_run) debug_printf(" queue index %s: %s\n", where, strerror(errno));
+  return FALSE;
+}
+
+
+/* Ask the daemon for its running totals, for the current queue first and then
+any others it has indexed.
+
+Returns:	the text of the response, a line per queue, or NULL if the
+		daemon did not answer
+*/
+
+static uschar *
+qi_stats_from_daemon(void)
+{
+int qlen = Ustrlen(queue_name) + 1, rlen = offsetof(qi_req, qname) + qlen;
+qi_req * req = store_get(rlen, GET_UNTAINTED);
+uschar * buf = store_get(NOTIFY_MSG_MAX, GET_UNTAINTED);
+uschar * sname;
+ssize_t len = -1;
+int fd;
+
+memset(req, 0, offsetof(qi_req, qname));
+req->notifier_reqtype = NOTIFY_QUEUE_STATS;
+memcpy(req->qname, queue_name, qlen);
+
+if ((fd = qi_connect(&sname)) < 0) return NULL;
+if (  send(fd, req, rlen, 0) >= 0
+   && poll_one_fd(fd, POLLIN, 2 * 1000) == 1)
+  len = recv(fd, buf, NOTIFY_MSG_MAX - 1, 0);
+close(fd);
+#ifndef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
+Uunlink(sname);
+#endif
+
+if (len <= 0)
+  {
+  DEBUG(D_queue_run) debug_printf(" queue stats: no response from daemon\n");
+  return NULL;
+  }
+buf[len] = '\0';
+return buf;
+}
+
+
+/* Count the messages on the current queue, for -bpc.  The daemon's index is
+used if there is one, else the spool is scanned. */
+
+unsigned
+queue_index_queue_count(void)
+{
+const uschar * s;
+
+if (  queue_index
+   && (s = qi_stats_from_daemon())
+   && (s = Ustrstr(s, " messages="))
+   )
+  return (unsigned) Ustrtoul(s + 10, NULL, 10);
+return queue_count();
+}
+
+
+/* Print the daemon's running totals, for -bP queue_stats.
+
+Returns:	TRUE if the daemon answered
+*/
+
+BOOL
+queue_index_print_stats(void)
+{
+const uschar * s;
+
+if (!queue_index)
+  {
+  printf("queue stats: queue_index is not set\n");
+  return FALSE;
+  }
+if (!(s = qi_stats_from_daemon()))
+  {
+  printf("queue stats: no response from the daemon\n");
+  return FALSE;
+  }
+printf("%s", CS s);
+return TRUE;
+}
+
+
+/* Get the list of messages on the current queue, for a queue run.  A process
+forked from the daemon uses its inherited copy of the index; others ask the
+daemon.  If "random" is FALSE the list is sorted.  If queue_run_large_size is
+set, messages at least that size are put after all the others, so that a few
+big ones do not hold up the small ones at the start of a run.  Non-regex
+-S and -R selection strings are used to leave out messages that cannot
+match; the caller still makes the exact check.
+
+Arguments:
+  random	randomize the list, rather than sorting it
+  skip_waiting	leave out messages whose spool says that no delivery attempt
+		is due yet (queue_run_retry_skip)
+  listp		where to return the list
+
+Returns:	TRUE if the list was obtained.  FALSE means the caller should
+		scan the spool instead.
+*/
+
+BOOL
+queue_index_list(BOOL random, BOOL skip_waiting, queue_filename ** listp)
+{
+qindex * qi;
+queue_filename * last = NULL, * large = NULL, * large_last = NULL;
+const uschar * sel_sender = US"", * sel_domain = US"", * s;
+rmark reset_point = store_mark();
+
+*listp = NULL;
+if (!queue_index) return FALSE;
+
+if (deliver_selectstring_sender && !f.deliver_selectstring_sender_regex)
+  sel_sender = deliver_selectstring_sender;
+if (  deliver_selectstring && !f.deliver_selectstring_regex
+   && (s = Ustrrchr(deliver_selectstring, '@')))
+  sel_domain = s + 1;
+
+if (f.daemon_scion && (qi = qi_find(queue_name, FALSE)))
+  {
+  time_t now = time(NULL);
+
+  if (!qi->built) return FALSE;
+
+  DEBUG(D_queue_run) debug_printf("using inherited queue index\n");
+  for (unsigned i = 0; i < qi->nbuckets; i++)
+    for (qi_entry * e = qi->buckets[i]; e; e = e->next)
+      if (  (skip_waiting && e->retry_after > now)
+	 || !qi_selected(e, sel_sender, sel_domain))
+	;
+      else if (queue_run_large_size > 0 && e->size >= queue_run_large_size)
+	qi_list_add(&large, &large_last, e->id, e->subdir, random);
+      else
+	qi_list_add(listp, &last, e->id, e->subdir, random);
+  }
+else if (!qi_from_daemon(listp, &large, random, skip_waiting,
+	  sel_sender, sel_domain))
+  {
+  store_reset(reset_point);
+  *listp = NULL;
+  return FALSE;
+  }
+
+if (!random)
+  {
+  *listp = queue_sort_list(*listp);
+  large = queue_sort_list(large);
+  }
+if (large)
+  {
+  queue_filename ** pp = listp;
+  while (*pp) pp = &(*pp)->next;
+  *pp = large;
+  DEBUG(D_queue_run) debug_printf("large messages put at the end of the run\n");
+  }
+return TRUE;
+}
+
+#endif	/*!COMPILE_UTILITY*/
+
+/* End of queue_index.c */
@@ -592,6 +592,23 @@ if (!ugid->uid_set ||                         /* Either there's no uid, or */
     sieve_vacation_directory, sieve_enotify_mailto_owner, sieve_useraddress,
     sieve_subaddress, generated, error, eblockp, filtertype);
 
+/* If this process is already running as the given uid and gid, and that is
+not root, exim_setugid() would change nothing, so a sub-process would see
+exactly what this one does. This is the case where everything runs as one
+unprivileged user, for example with virtual users. If initgroups is set,
+exim_setugid() would reset the supplementary groups, so a sub-process is still
+used. */
+
+if (  ugid->uid != root_uid && !ugid->initgroups
+   && geteuid() == ugid->uid && getegid() == ugid->gid)
+  {
+  DEBUG(D_route) debug_printf("already running as uid=%ld gid=%ld: "
+    "no sub-process needed\n", (long int)ugid->uid, (long int)ugid->gid);
+  return rda_extract(rdata, options, include_directory,
+    sieve_vacation_directory, sieve_enotify_mailto_owner, sieve_useraddress,
+    sieve_subaddress, generated, error, eblockp, filtertype);
+  }
+
 /* We need to run the processing code in a sub-process. However, if we can
 determine the non-existence of a file first, we can decline without having to
 create the sub-process. */
@@ -16,6 +16,9 @@ implementation of the conditional .ifdef etc. */
 #ifdef MACRO_PREDEF
 # include "macro_predef.h"
 #endif
+#ifdef CONFIGURE_CACHE
+# include <sys/mman.h>
+#endif
 
 #define READCONF_DEBUG	if (FALSE)	/* Change to TRUE to enable */
 
@@ -41,6 +44,7 @@ static optionlist optionlist_config[] = {
   { "acl_not_smtp_mime",        opt_stringptr,   {&acl_not_smtp_mime} },
 #endif
   { "acl_not_smtp_start",       opt_stringptr,   {&acl_not_smtp_start} },
+  { "acl_reorder_conditions",   opt_bool,        {&acl_reorder_conditions} },
   { "acl_smtp_auth",            opt_stringptr,   {&acl_smtp_auth} },
   { "acl_smtp_connect",         opt_stringptr,   {&acl_smtp_connect} },
   { "acl_smtp_data",            opt_stringptr,   {&acl_smtp_data} },
@@ -80,6 +84,7 @@ static optionlist optionlist_config[] = {
 #ifdef EXPERIMENTAL_BRIGHTMAIL
   { "bmi_config_file",          opt_stringptr,   {&bmi_config_file} },
 #endif
+  { "bounce_digest_window",     opt_time,        {&bounce_digest_window} },
   { "bounce_message_file",      opt_stringptr,   {&bounce_message_file} },
   { "bounce_message_text",      opt_stringptr,   {&bounce_message_text} },
   { "bounce_return_body",       opt_bool,        {&bounce_return_body} },
@@ -99,6 +104,13 @@ static optionlist optionlist_config[] = {
   { "check_spool_space",        opt_Kint,        {&check_spool_space} },
   { "chunking_advertise_hosts", opt_stringptr,	 {&chunking_advertise_hosts} },
   { "commandline_checks_require_admin", opt_bool,{&commandline_checks_require_admin} },
+#ifdef WITH_CONTENT_SCAN
+  { "content_scan_memory_max",  opt_mkint,       {&content_scan_memory_max} },
+#endif
+  { "continue_in_process_max",  opt_int,         {&continue_in_process_max} },
+  { "daemon_acceptors",         opt_int,         {&daemon_acceptors} },
+  { "daemon_blocklist_file",    opt_stringptr,   {&daemon_blocklist_file} },
+  { "daemon_blocklist_silent",  opt_bool,        {&daemon_blocklist_silent} },
   { "daemon_smtp_port",         opt_stringptr|opt_hidden, {&daemon_smtp_port} },
   { "daemon_smtp_ports",        opt_stringptr,   {&daemon_smtp_port} },
   { "daemon_startup_retries",   opt_int,         {&daemon_startup_retries} },
@@ -113,6 +125,8 @@ static optionlist optionlist_config[] = {
   { "delay_warning_condition",  opt_stringptr,   {&delay_warning_condition} },
   { "deliver_drop_privilege",   opt_bool,        {&deliver_drop_privilege} },
   { "deliver_queue_load_max",   opt_fixed,       {&deliver_queue_load_max} },
+  { "deliver_shards",           opt_int,         {&deliver_shards} },
+  { "deliver_shards_threshold", opt_int,         {&deliver_shards_threshold} },
   { "delivery_date_remove",     opt_bool,        {&delivery_date_remove} },
 #ifdef ENABLE_DISABLE_FSYNC
   { "disable_fsync",            opt_bool,        {&disable_fsync} },
@@ -120,6 +134,7 @@ static optionlist optionlist_config[] = {
   { "disable_ipv6",             opt_bool,        {&disable_ipv6} },
 #ifndef DISABLE_DKIM
   { "dkim_verify_hashes",       opt_stringptr,   {&dkim_verify_hashes} },
+  { "dkim_verify_key_cache",    opt_time,        {&dkim_verify_key_cache} },
   { "dkim_verify_keytypes",     opt_stringptr,   {&dkim_verify_keytypes} },
   { "dkim_verify_min_keysizes", opt_stringptr,   {&dkim_verify_min_keysizes} },
   { "dkim_verify_minimal",      opt_bool,        {&dkim_verify_minimal} },
@@ -131,16 +146,21 @@ static optionlist optionlist_config[] = {
   { "dmarc_tld_file",           opt_stringptr,   {&dmarc_tld_file} },
 #endif
   { "dns_again_means_nonexist", opt_stringptr,   {&dns_again_means_nonexist} },
+  { "dns_cache_shared",         opt_bool,        {&dns_cache_shared} },
+  { "dns_cache_shared_ttl",     opt_time,        {&dns_cache_shared_ttl} },
   { "dns_check_names_pattern",  opt_stringptr,   {&check_dns_names_pattern} },
   { "dns_cname_loops",		opt_int,	 {&dns_cname_loops} },
   { "dns_csa_search_limit",     opt_int,         {&dns_csa_search_limit} },
   { "dns_csa_use_reverse",      opt_bool,        {&dns_csa_use_reverse} },
   { "dns_dnssec_ok",            opt_int,         {&dns_dnssec_ok} },
   { "dns_ipv4_lookup",          opt_stringptr,   {&dns_ipv4_lookup} },
+  { "dns_prefetch_on_connect",  opt_bool,        {&dns_prefetch_on_connect} },
+  { "dns_prefetch_rcpt_domains", opt_stringptr,  {&dns_prefetch_rcpt_domains} },
   { "dns_retrans",              opt_time,        {&dns_retrans} },
   { "dns_retry",                opt_int,         {&dns_retry} },
   { "dns_trust_aa",             opt_stringptr,   {&dns_trust_aa} },
   { "dns_use_edns0",            opt_int,         {&dns_use_edns0} },
+  { "dnslist_zones",            opt_stringptr,   {&dnslist_zones} },
  /* This option is now a no-op, retained for compatibility */
   { "drop_cr",                  opt_bool,        {&drop_cr} },
 /*********************************************************/
@@ -158,6 +178,7 @@ static optionlist optionlist_config[] = {
   { "exim_version",             opt_stringptr,   {&version_string} },
   { "extra_local_interfaces",   opt_stringptr,   {&extra_local_interfaces} },
   { "extract_addresses_remove_arguments", opt_bool, {&extract_addresses_remove_arguments} },
+  { "filter_cache",             opt_bool,        {&filter_cache} },
   { "finduser_retries",         opt_int,         {&finduser_retries} },
   { "freeze_tell",              opt_stringptr,   {&freeze_tell} },
   { "gecos_name",               opt_stringptr,   {&gecos_name} },
@@ -174,6 +195,8 @@ static optionlist optionlist_config[] = {
   { "helo_lookup_domains",      opt_stringptr,   {&helo_lookup_domains} },
   { "helo_try_verify_hosts",    opt_stringptr,   {&helo_try_verify_hosts} },
   { "helo_verify_hosts",        opt_stringptr,   {&helo_verify_hosts} },
+  { "hints_shared",             opt_stringptr,   {&hints_shared} },
+  { "hints_shared_interval",    opt_time,        {&hints_shared_interval} },
   { "hold_domains",             opt_stringptr,   {&hold_domains} },
   { "host_lookup",              opt_stringptr,   {&host_lookup} },
   { "host_lookup_order",        opt_stringptr,   {&host_lookup_order} },
@@ -216,22 +239,42 @@ static optionlist optionlist_config[] = {
   { "local_from_prefix",        opt_stringptr,   {&local_from_prefix} },
   { "local_from_suffix",        opt_stringptr,   {&local_from_suffix} },
   { "local_interfaces",         opt_stringptr,   {&local_interfaces} },
+  { "local_max_parallel",       opt_int,         {&local_max_parallel} },
 #ifdef HAVE_LOCAL_SCAN
+# ifdef EXPAND_DLFUNC
+  { "local_scan_modules",       opt_stringptr,   {&local_scan_modules} },
+# endif
+  { "local_scan_policy",        opt_stringptr,   {&local_scan_policy} },
   { "local_scan_timeout",       opt_time,        {&local_scan_timeout} },
 #endif
   { "local_sender_retain",      opt_bool,        {&local_sender_retain} },
   { "localhost_number",         opt_stringptr,   {&host_number_string} },
   { "log_file_path",            opt_stringptr,   {&log_file_path} },
+  { "log_json",                 opt_bool,        {&log_json} },
   { "log_selector",             opt_stringptr,   {&log_selector_string} },
   { "log_timezone",             opt_bool,        {&log_timezone} },
+  { "log_via_daemon",           opt_fixed,       {&log_via_daemon} },
+  { "lookup_cache_shared",      opt_stringptr,   {&lookup_cache_shared} },
+  { "lookup_cache_shared_ttl",  opt_time,        {&lookup_cache_shared_ttl} },
   { "lookup_open_max",          opt_int,         {&lookup_open_max} },
+  { "lookup_proxy",             opt_stringptr,   {&lookup_proxy} },
+  { "lookup_proxy_processes",   opt_int,         {&lookup_proxy_processes} },
+  { "lsearch_index_min_size",   opt_mkint,       {&lsearch_index_min_size} },
+#ifdef WITH_CONTENT_SCAN
+  { "malware_verdict_cache",    opt_time,        {&malware_verdict_cache} },
+#endif
   { "max_username_length",      opt_int,         {&max_username_length} },
   { "message_body_newlines",    opt_bool,        {&message_body_newlines} },
   { "message_body_visible",     opt_mkint,       {&message_body_visible} },
   { "message_id_header_domain", opt_stringptr,   {&message_id_domain} },
   { "message_id_header_text",   opt_stringptr,   {&message_id_text} },
   { "message_logs",             opt_bool,        {&message_logs} },
+  { "message_logs_lazy",        opt_bool,        {&message_logs_lazy} },
   { "message_size_limit",       opt_stringptr,   {&message_size_limit} },
+  { "metrics",                  opt_bool,        {&metrics} },
+#ifdef WITH_CONTENT_SCAN
+  { "mime_decode_memory_max",   opt_mkint,       {&mime_decode_memory_max} },
+#endif
 #ifdef SUPPORT_MOVE_FROZEN_MESSAGES
   { "move_frozen_messages",     opt_bool,        {&move_frozen_messages} },
 #endif
@@ -242,6 +285,7 @@ static optionlist optionlist_config[] = {
   { "never_users",              opt_uidlist,     {&never_users} },
   { "notifier_socket",          opt_stringptr,   {&notifier_socket} },
 #ifndef DISABLE_TLS
+  { "openssl_async",            opt_bool,        {&openssl_async} },
   { "openssl_options",          opt_stringptr,   {&openssl_options} },
 #endif
 #ifdef LOOKUP_ORACLE
@@ -250,6 +294,7 @@ static optionlist optionlist_config[] = {
   { "panic_coredump",           opt_bool,        {&panic_coredump} },
   { "percent_hack_domains",     opt_stringptr,   {&percent_hack_domains} },
 #ifdef EXIM_PERL
+  { "perl_at_daemon_start",     opt_bool,        {&opt_perl_at_daemon_start} },
   { "perl_at_start",            opt_bool,        {&opt_perl_at_start} },
   { "perl_startup",             opt_stringptr,   {&opt_perl_startup} },
   { "perl_taintmode",           opt_bool,        {&opt_perl_taintmode} },
@@ -276,19 +321,32 @@ static optionlist optionlist_config[] = {
 #endif
   { "qualify_domain",           opt_stringptr,   {&qualify_domain_sender} },
   { "qualify_recipient",        opt_stringptr,   {&qualify_domain_recipient} },
+  { "queue_action_parallel",    opt_int,         {&queue_action_parallel} },
   { "queue_domains",            opt_stringptr,   {&queue_domains} },
 #ifndef DISABLE_QUEUE_RAMP
   { "queue_fast_ramp",          opt_bool,        {&queue_fast_ramp} },
 #endif
+  { "queue_index",              opt_bool,        {&queue_index} },
+  { "queue_list_parallel",      opt_int,         {&queue_list_parallel} },
   { "queue_list_requires_admin",opt_bool,        {&queue_list_requires_admin} },
   { "queue_only",               opt_bool,        {&queue_only} },
   { "queue_only_file",          opt_stringptr,   {&queue_only_file} },
   { "queue_only_load",          opt_fixed,       {&queue_only_load} },
   { "queue_only_load_latch",    opt_bool,        {&queue_only_load_latch} },
   { "queue_only_override",      opt_bool,        {&queue_only_override} },
+  { "queue_run_batch",          opt_bool,        {&queue_run_batch} },
+  { "queue_run_cpus",           opt_stringptr,   {&queue_run_cpus} },
   { "queue_run_in_order",       opt_bool,        {&queue_run_in_order} },
+  { "queue_run_large_size",     opt_mkint,       {&queue_run_large_size} },
   { "queue_run_max",            opt_stringptr,   {&queue_run_max} },
+#ifndef DISABLE_QUEUE_RAMP
+  { "queue_run_on_recovery",    opt_int,         {&queue_run_on_recovery} },
+#endif
+  { "queue_run_parallel",       opt_int,         {&queue_run_parallel} },
+  { "queue_run_retry_skip",     opt_bool,        {&queue_run_retry_skip} },
+  { "queue_run_weight",         opt_stringptr,   {&queue_run_weight} },
   { "queue_smtp_domains",       opt_stringptr,   {&queue_smtp_domains} },
+  { "ratelimit_shared",         opt_time,        {&ratelimit_shared} },
   { "receive_timeout",          opt_time,        {&receive_timeout} },
   { "received_header_text",     opt_stringptr,   {&received_header_text} },
   { "received_headers_max",     opt_int,         {&received_headers_max} },
@@ -297,6 +355,9 @@ static optionlist optionlist_config[] = {
   { "recipients_max_reject",    opt_bool,        {&recipients_max_reject} },
 #ifdef LOOKUP_REDIS
   { "redis_servers",            opt_stringptr,   {&redis_servers} },
+#endif
+#ifdef WITH_CONTENT_SCAN
+  { "regex_combine_min",        opt_int,         {&regex_combine_min} },
 #endif
   { "remote_max_parallel",      opt_int,         {&remote_max_parallel} },
   { "remote_sort_domains",      opt_stringptr,   {&remote_sort_domains} },
@@ -307,7 +368,10 @@ static optionlist optionlist_config[] = {
   { "rfc1413_hosts",            opt_stringptr,   {&rfc1413_hosts} },
   { "rfc1413_query_timeout",    opt_time,        {&rfc1413_query_timeout} },
   { "sender_unqualified_hosts", opt_stringptr,   {&sender_unqualified_hosts} },
+  { "sender_verify_session_cache", opt_bool,     {&sender_verify_session_cache} },
   { "slow_lookup_log",          opt_int,         {&slow_lookup_log} },
+  { "smtp_accept_cpus",         opt_stringptr,   {&smtp_accept_cpus} },
+  { "smtp_accept_hold",         opt_time,        {&smtp_accept_hold} },
   { "smtp_accept_keepalive",    opt_bool,        {&smtp_accept_keepalive} },
   { "smtp_accept_max",          opt_int,         {&smtp_accept_max} },
   { "smtp_accept_max_nonmail",  opt_int,         {&smtp_accept_max_nonmail} },
@@ -317,6 +381,7 @@ static optionlist optionlist_config[] = {
   { "smtp_accept_queue",        opt_int,         {&smtp_accept_queue} },
   { "smtp_accept_queue_per_connection", opt_int, {&smtp_accept_queue_per_connection} },
   { "smtp_accept_reserve",      opt_int,         {&smtp_accept_reserve} },
+  { "smtp_accept_spares",       opt_int,         {&smtp_accept_spares} },
   { "smtp_active_hostname",     opt_stringptr,   {&raw_active_hostname} },
   { "smtp_backlog_monitor",     opt_int,         {&smtp_backlog_monitor} },
   { "smtp_banner",              opt_stringptr,   {&smtp_banner} },
@@ -331,6 +396,7 @@ static optionlist optionlist_config[] = {
   { "smtp_ratelimit_hosts",     opt_stringptr,   {&smtp_ratelimit_hosts} },
   { "smtp_ratelimit_mail",      opt_stringptr,   {&smtp_ratelimit_mail} },
   { "smtp_ratelimit_rcpt",      opt_stringptr,   {&smtp_ratelimit_rcpt} },
+  { "smtp_receive_buffer_size", opt_mkint,       {&smtp_receive_buffer_size} },
   { "smtp_receive_timeout",     opt_func,        {.fn = &fn_smtp_receive_timeout} },
   { "smtp_reserve_hosts",       opt_stringptr,   {&smtp_reserve_hosts} },
   { "smtp_return_error_details",opt_bool,        {&smtp_return_error_details} },
@@ -338,19 +404,29 @@ static optionlist optionlist_config[] = {
   { "smtputf8_advertise_hosts", opt_stringptr,   {&smtputf8_advertise_hosts} },
 #endif
 #ifdef WITH_CONTENT_SCAN
+  { "spam_verdict_cache",       opt_time,        {&spam_verdict_cache} },
   { "spamd_address",            opt_stringptr,   {&spamd_address} },
 #endif
 #ifdef SUPPORT_SPF
+  { "spf_cache_ttl",            opt_time,        {&spf_cache_ttl} },
   { "spf_guess",                opt_stringptr,   {&spf_guess} },
   { "spf_smtp_comment_template",opt_stringptr,   {&spf_smtp_comment_template} },
 #endif
   { "split_spool_directory",    opt_bool,        {&split_spool_directory} },
+  { "spool_binary_header",      opt_bool,        {&spool_binary_header} },
+  { "spool_dedup_size",         opt_mkint,       {&spool_dedup_size} },
   { "spool_directory",          opt_stringptr,   {&spool_directory} },
+  { "spool_group_sync",         opt_fixed,       {&spool_group_sync} },
+  { "spool_handoff_size",       opt_mkint,       {&spool_handoff_size} },
+  { "spool_journal_size",       opt_mkint,       {&spool_journal_size} },
+  { "spool_shards",             opt_stringptr,   {&spool_shards} },
   { "spool_wireformat",         opt_bool,        {&spool_wireformat} },
 #ifdef LOOKUP_SQLITE
   { "sqlite_dbfile",            opt_stringptr,   {&sqlite_dbfile} },
   { "sqlite_lock_timeout",      opt_int,         {&sqlite_lock_timeout} },
 #endif
+  { "store_hard_limit",         opt_mkint,       {&store_hard_limit} },
+  { "store_soft_limit",         opt_mkint,       {&store_soft_limit} },
   { "strict_acl_vars",          opt_bool,        {&strict_acl_vars} },
   { "strip_excess_angle_brackets", opt_bool,     {&strip_excess_angle_brackets} },
   { "strip_trailing_dot",       opt_bool,        {&strip_trailing_dot} },
@@ -382,6 +458,7 @@ static optionlist optionlist_config[] = {
   { "tls_eccurve",              opt_stringptr,   {&tls_eccurve} },
 # ifndef DISABLE_OCSP
   { "tls_ocsp_file",            opt_stringptr,   {&tls_ocsp_file} },
+  { "tls_ocsp_refresh",         opt_time,        {&tls_ocsp_refresh} },
 # endif
   { "tls_on_connect_ports",     opt_stringptr,   {&tls_in.on_connect_ports} },
   { "tls_privatekey",           opt_stringptr,   {&tls_privatekey} },
@@ -389,11 +466,16 @@ static optionlist optionlist_config[] = {
   { "tls_require_ciphers",      opt_stringptr,   {&tls_require_ciphers} },
 # ifndef DISABLE_TLS_RESUME
   { "tls_resumption_hosts",     opt_stringptr,   {&tls_resumption_hosts} },
+  { "tls_resumption_secret",    opt_stringptr,   {&tls_resumption_secret} },
+  { "tls_resumption_shared",    opt_time,        {&tls_resumption_shared} },
 # endif
+  { "tls_sni_preload",          opt_stringptr,   {&tls_sni_preload} },
   { "tls_try_verify_hosts",     opt_stringptr,   {&tls_try_verify_hosts} },
   { "tls_verify_certificates",  opt_stringptr,   {&tls_verify_certificates} },
   { "tls_verify_hosts",         opt_stringptr,   {&tls_verify_hosts} },
 #endif
+  { "trace_ring_file",          opt_stringptr,   {&trace_ring_file} },
+  { "trace_ring_size",          opt_int,         {&trace_ring_size} },
   { "trusted_groups",           opt_gidlist,     {&trusted_groups} },
   { "trusted_users",            opt_uidlist,     {&trusted_users} },
   { "unknown_login",            opt_stringptr,   {&unknown_login} },
@@ -886,6 +968,338 @@ Uskip_whitespace(&ss);
 return ss;
 }
 
+#ifdef CONFIGURE_CACHE
+/*************************************************
+*         Cache of configuration lines           *
+*************************************************/
+
+/* When CONFIGURE_CACHE is set at build time, the logical lines of the default
+configuration, after .include, macro, conditional and continuation processing,
+are saved in that file by the first process to read the whole configuration.
+Later processes map the file and take the lines from it, skipping the
+processing.  The cache records every file that was read, and each must be
+unchanged (and each missing .include_if_exists file still missing) for it to
+be used.  It is not used for a -C configuration, with -D macros, for -bP
+config, or for the testing and listing options (the lines it holds no longer
+define the macros that -be and -bP macros need).  It is ignored unless owned by
+root (or the configuration owner) and writeable only by its owner, and only a
+root process records it.  The daemon removes it on SIGHUP.
+
+The file is a sequence of records, each a header followed by data padded to
+the alignment of the header.  The first is the binary's version; last is a
+checksum of all before it. */
+
+typedef struct ccache_hdr {
+  unsigned	type;
+  unsigned	len;		/* of the data following */
+} ccache_hdr;
+
+typedef struct ccache_file {	/* data of CC_FILE, followed by the path */
+  dev_t		dev;
+  ino_t		ino;
+  off_t		size;
+  time_t	mtime;
+  time_t	ctime;
+} ccache_file;
+
+typedef struct ccache_line {	/* data of CC_LINE, followed by the text */
+  int		file;		/* index of CC_FILE records */
+  int		lineno;
+} ccache_line;
+
+enum { CC_VERSION = 1, CC_FILE, CC_ABSENT, CC_LINE, CC_SUM };
+
+#define CC_ALIGN	8		/* enough for the fields of any record */
+#define CC_ROUND(n)	(((n) + CC_ALIGN - 1) & ~(CC_ALIGN - 1))
+
+static uschar *	ccache_buf = NULL;	/* being built, when recording */
+static size_t	ccache_len, ccache_size;
+static const uschar ** ccache_names;	/* files, by index */
+static int	ccache_nfiles, ccache_maxfiles;
+
+static const uschar * ccache_next = NULL; /* next record, when replaying */
+static const uschar * ccache_end;
+
+
+static uint64_t
+ccache_sum(const uschar * s, size_t len)
+{
+uint64_t h = 14695981039346656037ULL;		/* FNV-1a */
+while (len--) h = (h ^ *s++) * 1099511628211ULL;
+return h;
+}
+
+static const uschar *
+ccache_version(void)
+{
+return string_sprintf("%s %s %s", version_string, version_date,
+  version_cnumber);
+}
+
+static BOOL
+ccache_file_same(const ccache_file * cf, const struct stat * st)
+{
+return cf->dev == st->st_dev && cf->ino == st->st_ino
+  && cf->size == st->st_size && cf->mtime == st->st_mtime
+  && cf->ctime == st->st_ctime;
+}
+
+
+/* Add a record to the cache being built */
+
+static void
+ccache_add(unsigned type, const void * d1, unsigned l1, const uschar * s)
+{
+unsigned l2 = s ? Ustrlen(s) + 1 : 0;
+ccache_hdr h = { .type = type, .len = l1 + l2 };
+size_t need = ccache_len + sizeof(h) + CC_ROUND(h.len);
+
+if (need > ccache_size)
+  {
+  uschar * nb;
+  while (need > ccache_size) ccache_size *= 2;
+  nb = store_malloc(ccache_size);
+  memcpy(nb, ccache_buf, ccache_len);
+  store_free(ccache_buf);
+  ccache_buf = nb;
+  }
+memcpy(ccache_buf + ccache_len, &h, sizeof(h));
+if (l1) memcpy(ccache_buf + ccache_len + sizeof(h), d1, l1);
+if (l2) memcpy(ccache_buf + ccache_len + sizeof(h) + l1, s, l2);
+memset(ccache_buf + ccache_len + sizeof(h) + h.len, 0,
+  CC_ROUND(h.len) - h.len);
+ccache_len = need;
+}
+
+
+/* Record a file opened for the configuration, or a missing one */
+
+static void
+ccache_add_file(FILE * fp, const uschar * name)
+{
+ccache_file cf;
+struct stat st;
+
+if (!ccache_buf) return;
+if (!fp)
+  { ccache_add(CC_ABSENT, NULL, 0, name); return; }
+if (fstat(fileno(fp), &st) != 0)
+  {
+  store_free(ccache_buf);
+  ccache_buf = NULL;
+  return;
+  }
+
+memset(&cf, 0, sizeof(cf));
+cf.dev = st.st_dev; cf.ino = st.st_ino; cf.size = st.st_size;
+cf.mtime = st.st_mtime; cf.ctime = st.st_ctime;
+ccache_add(CC_FILE, &cf, sizeof(cf), name);
+
+if (ccache_nfiles >= ccache_maxfiles)
+  {
+  const uschar ** nn = store_malloc((ccache_maxfiles *= 2) * sizeof(uschar *));
+  memcpy(nn, ccache_names, ccache_nfiles * sizeof(uschar *));
+  store_free(ccache_names);
+  ccache_names = nn;
+  }
+ccache_names[ccache_nfiles++] = name;
+}
+
+
+/* Record a logical line.  It comes from the file currently being read, which
+is most likely the one it was last. */
+
+static void
+ccache_add_line(const uschar * s)
+{
+static int last = 0;
+ccache_line cl = { .lineno = config_lineno };
+
+if (!ccache_buf) return;
+if (last >= ccache_nfiles || ccache_names[last] != config_filename)
+  for (last = 0; last < ccache_nfiles; last++)
+    if (ccache_names[last] == config_filename) break;
+cl.file = last;
+ccache_add(CC_LINE, &cl, sizeof(cl), s);
+}
+
+
+/* Once the whole configuration has been read, write the cache.  It is made
+under a temporary name and renamed into place; any failure just means there is
+no cache. */
+
+static void
+ccache_write(void)
+{
+uschar * tmp;
+uint64_t sum;
+int fd;
+
+if (!ccache_buf) return;
+sum = ccache_sum(ccache_buf, ccache_len);
+ccache_add(CC_SUM, &sum, sizeof(sum), NULL);
+
+tmp = string_sprintf("%s.%d", CONFIGURE_CACHE, (int)getpid());
+if ((fd = Uopen(tmp, O_WRONLY|O_CREAT|O_EXCL, 0600)) < 0)
+  { DEBUG(D_any) debug_printf("config cache: %s: %s\n", tmp, strerror(errno)); }
+else
+  {
+  BOOL ok = write(fd, ccache_buf, ccache_len) == ccache_len;
+  if (close(fd) == 0 && ok && Urename(tmp, CONFIGURE_CACHE) == 0)
+    { DEBUG(D_any) debug_printf("config cache: wrote %s\n", CONFIGURE_CACHE); }
+  else
+    (void) Uunlink(tmp);
+  }
+store_free(ccache_buf);
+store_free(ccache_names);
+ccache_buf = NULL;
+}
+
+
+/* Called with the main configuration file open and checked.  Either set up
+to take lines from a valid cache or, if it should be made, to record them. */
+
+static void
+ccache_start(const uschar * filename, BOOL testing)
+{
+const uschar * vers = ccache_version();
+const uschar * p, * end, * lines;
+const ccache_hdr * h;
+struct stat st;
+void * map;
+uint64_t sum;
+int fd, nfiles = 0;
+
+if (  !f.trusted_config || f.config_changed || clmacro_count > 0 || config_lines
+   || testing)
+  return;
+
+if ((fd = Uopen(CONFIGURE_CACHE, O_RDONLY, 0)) < 0)
+  goto RECORD;
+if (  fstat(fd, &st) != 0
+   || st.st_uid != root_uid
+#ifdef CONFIGURE_OWNER
+      && st.st_uid != config_uid
+#endif
+   || (st.st_mode & 022)
+   || st.st_size < sizeof(ccache_hdr) + CC_ROUND(sizeof(uint64_t))
+   || (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED
+   )
+  {
+  (void) close(fd);
+  goto RECORD;
+  }
+(void) close(fd);
+end = US map + st.st_size;
+
+/* Check the checksum at the end, then the version at the start */
+
+h = (const ccache_hdr *)(end - sizeof(ccache_hdr) - CC_ROUND(sizeof(uint64_t)));
+sum = ccache_sum(map, US h - US map);
+if (h->type != CC_SUM || memcmp(h + 1, &sum, sizeof(sum)) != 0)
+  goto BAD;
+end = US h;
+
+h = map;
+if (h->type != CC_VERSION || Ustrcmp(h + 1, vers) != 0)
+  goto BAD;
+
+/* All the files must be unchanged; the first is the main file, already open.
+They are recorded among the lines, as they were met. */
+
+lines = NULL;
+for (p = US map + sizeof(*h) + CC_ROUND(h->len); p + sizeof(*h) <= end;
+     p += sizeof(*h) + CC_ROUND(h->len))
+  {
+  h = (const ccache_hdr *)p;
+  if (h->type == CC_LINE)
+    { if (!lines) lines = p; }
+  else if (h->type == CC_FILE)
+    {
+    const ccache_file * cf = (const ccache_file *)(h + 1);
+    const uschar * name = US (cf + 1);
+    BOOL same = nfiles == 0
+      ? Ustrcmp(name, filename) == 0
+	&& fstat(fileno(config_file), &st) == 0 && ccache_file_same(cf, &st)
+      : Ustat(name, &st) == 0 && ccache_file_same(cf, &st);
+    if (!same) goto BAD;
+    nfiles++;
+    }
+  else if (h->type == CC_ABSENT)
+    {
+    if (Ustat(US (h + 1), &st) == 0) goto BAD;
+    }
+  else
+    goto BAD;
+  }
+if (nfiles == 0) goto BAD;
+
+/* Index the file names, for the lines */
+
+ccache_names = store_get(nfiles * sizeof(uschar *), GET_UNTAINTED);
+nfiles = 0;
+for (const uschar * q = US map; q < end; q += sizeof(*h) + CC_ROUND(h->len))
+  if ((h = (const ccache_hdr *)q)->type == CC_FILE)
+    ccache_names[nfiles++] = US ((const ccache_file *)(h + 1) + 1);
+ccache_nfiles = nfiles;
+ccache_next = lines ? lines : end;
+ccache_end = end;
+DEBUG(D_any) debug_printf("config cache: using %s\n", CONFIGURE_CACHE);
+return;
+
+BAD:
+  (void) munmap(map, st.st_size);
+
+RECORD:
+  DEBUG(D_any) debug_printf("config cache: not using %s\n", CONFIGURE_CACHE);
+  if (geteuid() != root_uid) return;
+  ccache_buf = store_malloc(ccache_size = 16384);
+  ccache_len = 0;
+  ccache_names = store_malloc((ccache_maxfiles = 16) * sizeof(uschar *));
+  ccache_nfiles = 0;
+  ccache_add(CC_VERSION, NULL, 0, vers);
+  ccache_add_file(config_file, filename);
+}
+
+
+/* Take the next line from the cache into big_buffer.  Return its length, or -1
+at the end. */
+
+static int
+ccache_get_line(void)
+{
+const ccache_hdr * h;
+const ccache_line * cl;
+int len;
+
+do
+  {
+  if (ccache_next >= ccache_end) return -1;
+  h = (const ccache_hdr *)ccache_next;
+  ccache_next += sizeof(*h) + CC_ROUND(h->len);
+  } while (h->type != CC_LINE);
+
+cl = (const ccache_line *)(h + 1);
+if (cl->file < 0 || cl->file >= ccache_nfiles)
+  log_write(0, LOG_PANIC_DIE, "corrupt configuration cache %s", CONFIGURE_CACHE);
+config_filename = ccache_names[cl->file];
+config_lineno = cl->lineno;
+
+len = h->len - sizeof(*cl) - 1;
+if (len >= big_buffer_size)
+  {
+  store_free(big_buffer);
+  big_buffer_size = len + BIG_BUFFER_SIZE;
+  big_buffer = store_malloc(big_buffer_size);
+  }
+memcpy(big_buffer, cl + 1, len + 1);
+return len;
+}
+
+#endif	/*CONFIGURE_CACHE*/
+
+
+
 /*************************************************
 *            Read configuration line             *
 *************************************************/
@@ -902,6 +1316,9 @@ next_section vector, and the function returns NULL, indicating the end of a
 configuration section. On end-of-file, NULL is returned with next_section
 empty.
 
+When the lines are being taken from the configuration cache, all of the
+processing of physical lines has been done.
+
 Arguments:      none
 
 Returns:        a pointer to the first non-blank in the line,
@@ -917,6 +1334,18 @@ int newlen;
 uschar *s, *ss;
 BOOL macro_found;
 
+#ifdef CONFIGURE_CACHE
+if (ccache_next)
+  {
+  if ((len = ccache_get_line()) < 0)
+    {
+    next_section[0] = 0;
+    return NULL;
+    }
+  goto LINE_READ;
+  }
+#endif
+
 /* Loop for handling continuation lines, skipping comments, and dealing with
 .include files. */
 
@@ -1077,7 +1506,13 @@ for (;;)
 	ss = string_from_gstring(g);
         }
 
-    if (include_if_exists != 0 && (Ustat(ss, &statbuf) != 0)) continue;
+    if (include_if_exists != 0 && (Ustat(ss, &statbuf) != 0))
+      {
+#ifdef CONFIGURE_CACHE
+      ccache_add_file(NULL, string_copy(ss));
+#endif
+      continue;
+      }
 
     if (config_lines)
       save_config_position(config_filename, config_lineno);
@@ -1096,6 +1531,9 @@ for (;;)
     config_filename = string_copy(ss);
     config_directory = string_copyn(ss, CUstrrchr(ss, '/') - ss);
     config_lineno = 0;
+#ifdef CONFIGURE_CACHE
+    ccache_add_file(config_file, config_filename);
+#endif
     continue;
     }
 
@@ -1138,8 +1576,14 @@ section in next_section, and return NULL. If the name given is longer than
 next_section, truncate it. It will be unrecognized later, because all the known
 section names do fit. Leave space for pluralizing. */
 
+#ifdef CONFIGURE_CACHE
+LINE_READ:
+#endif
 s = big_buffer + startoffset;            /* First non-space character */
 
+#ifdef CONFIGURE_CACHE
+ccache_add_line(s);
+#endif
 if (config_lines)
   save_config_line(s);
 
@@ -2816,6 +3260,15 @@ if (!type)
     return TRUE;
     }
 
+  if (Ustrcmp(name, "shared_cache") == 0)
+    return search_shared_stats();
+
+  if (Ustrcmp(name, "queue_stats") == 0)
+    return queue_index_print_stats();
+
+  if (Ustrcmp(name, "metrics_table") == 0)
+    return metrics_print();
+
   if (Ustrcmp(name, "routers") == 0)
     {
     type = US"router";
@@ -3038,6 +3491,7 @@ if (*s++ != '=') log_write(0, LOG_PANIC_DIE|LOG_CONFIG_IN,
 Uskip_whitespace(&s);
 nb->string = read_string(s, t->name);
 nb->cache_data = NULL;
+nb->compiled = NULL;
 
 /* Check the string for any expansions; if any are found, mark this list
 uncacheable unless the user has explicited forced caching. */
@@ -3282,6 +3736,10 @@ if (f.trusted_config && Ustrcmp(filename, US"/dev/null"))
     }
   }
 
+#ifdef CONFIGURE_CACHE
+ccache_start(config_filename, nowarn);
+#endif
+
 /* Process the main configuration settings. They all begin with a lower case
 letter. If we see something starting with an upper case letter, it is taken as
 a macro definition. */
@@ -3340,9 +3798,10 @@ if (timezone_string && !*timezone_string) timezone_string = NULL;
 
 if (retry_interval_max > 24*60*60) retry_interval_max = 24*60*60;
 
-/* remote_max_parallel must be > 0 */
+/* remote_max_parallel and local_max_parallel must be > 0 */
 
 if (remote_max_parallel <= 0) remote_max_parallel = 1;
+if (local_max_parallel <= 0) local_max_parallel = 1;
 
 /* Save the configured setting of freeze_tell, so we can re-instate it at the
 start of a new SMTP message. */
@@ -3421,6 +3880,32 @@ if (!(s = expand_string(spool_directory)))
     "\"%s\": %s", spool_directory, expand_string_message);
 spool_directory = s;
 
+/* Split the list of spool shard roots, expanded in the same way. Each holds
+the sub-directories of a split spool whose characters spool_shard() maps to
+it, so setting them implies split_spool_directory. */
+
+if (spool_shards)
+  {
+  const uschar * list;
+  uschar * root;
+  int sep = 0, n = 0;
+
+  if (!(s = expand_string(spool_shards)))
+    log_write(0, LOG_MAIN|LOG_PANIC_DIE, "failed to expand spool_shards "
+      "\"%s\": %s", spool_shards, expand_string_message);
+  for (list = s; string_nextinlist(&list, &sep, NULL, 0); ) n++;
+  spool_shard_roots = store_get(n * sizeof(uschar *), GET_UNTAINTED);
+
+  for (list = s, sep = 0; (root = string_nextinlist(&list, &sep, NULL, 0)); )
+    {
+    if (*root != '/' || Ustrlen(root) > 200)
+      log_write(0, LOG_MAIN|LOG_PANIC_DIE, "spool_shards: \"%s\" is not an "
+	"absolute path of up to 200 characters", root);
+    spool_shard_roots[spool_shard_count++] = root;
+    }
+  split_spool_directory = spool_shard_count > 0;
+  }
+
 /* Expand log_file_path, which must contain "%s" in any component that isn't
 the null string or "syslog". It is also allowed to contain one instance of %D
 or %M. However, it must NOT contain % followed by anything else. */
@@ -3609,6 +4094,11 @@ if (openssl_options)
       "openssl_options parse error: %s", openssl_options);
 # endif
   }
+# ifdef USE_GNUTLS
+if (openssl_async)
+  log_write(0, LOG_PANIC_DIE|LOG_CONFIG,
+    "openssl_async is set but we're using GnuTLS");
+# endif
 #endif	/*DISABLE_TLS*/
 
 if (!nowarn && !keep_environment && environ && *environ)
@@ -3865,6 +4355,59 @@ return FALSE;
 
 
 
+/*************************************************
+*      Walk configured string option values      *
+*************************************************/
+
+/* Call a function for every non-NULL string-valued option, main and driver
+(generic and private), set by the configuration.  Used by the daemon to find
+constant regular expressions it can compile once, before forking.
+
+Argument:   function to call with each string
+Returns:    nothing
+*/
+
+static void
+walk_driver_strings(driver_instance * d, optionlist * generic, int gsize,
+  void (*fn)(const uschar *))
+{
+for ( ; d; d = d->next)
+  for (int pass = 0; pass < 2; pass++)
+    {
+    optionlist * ol0 = pass ? d->info->options : generic;
+    int count = pass ? *d->info->options_count : gsize;
+
+    for (optionlist * ol = ol0; ol < ol0 + count; ol++)
+      if ((ol->type & opt_mask) == opt_stringptr)
+	{
+	void * options_block = ol->type & opt_public ? (void *)d : d->options_block;
+	const uschar * value = *CUSS(US options_block + ol->v.offset);
+	if (value) (fn)(value);
+	}
+    }
+}
+
+void
+readconf_walk_strings(void (*fn)(const uschar *))
+{
+for (optionlist * ol = optionlist_config;
+     ol < optionlist_config + optionlist_config_size; ol++)
+  if ((ol->type & opt_mask) == opt_stringptr)
+    {
+    const uschar * value = *CUSS ol->v.value;
+    if (value) (fn)(value);
+    }
+
+walk_driver_strings((driver_instance *)routers,
+  optionlist_routers, optionlist_routers_size, fn);
+walk_driver_strings((driver_instance *)transports,
+  optionlist_transports, optionlist_transports_size, fn);
+walk_driver_strings((driver_instance *)auths,
+  optionlist_auths, optionlist_auths_size, fn);
+}
+
+
+
 
 /*************************************************
 *      Decode an error type for retries          *
@@ -4185,6 +4728,7 @@ for (auth_instance * au = auths; au; au = au->next)
           "(%s and %s) have the same public name (%s)",
           au->client && bu->client ? US"client" : US"server",
 	  au->name, bu->name, au->public_name);
+  if (au->server_condition_cache > 0) auth_cache_used = TRUE;
 #ifndef DISABLE_PIPE_CONNECT
   nauths++;
 #endif
@@ -4378,6 +4922,9 @@ while(next_section[0] != 0)
     }
   }
 
+#ifdef CONFIGURE_CACHE
+ccache_write();
+#endif
 (void)fclose(config_file);
 }
 
@@ -27,6 +27,12 @@ extern int dcc_ok;
 static int     data_fd = -1;
 static uschar *spool_name = US"";
 
+static struct timeval id_lead_tv = { 0, 0 };	/* last id made ahead of the clock */
+static int     id_lead_resolution;
+
+static uschar *msglog_held = NULL;		/* malloc'd; message_logs_lazy */
+static uschar  msglog_held_id[MESSAGE_ID_LENGTH + 1];
+
 enum CH_STATE {LF_SEEN, MID_LINE, CR_SEEN};
 
 #ifdef HAVE_LOCAL_SCAN
@@ -36,6 +42,104 @@ unsigned had_local_scan_timeout;
 #endif
 
 
+/*************************************************
+*      Wait for the clock to pass the ids        *
+*************************************************/
+
+/* Called as the process exits. If the time parts of the message ids it made
+ran ahead of the clock, wait (at most MESSAGE_ID_MAX_LEAD) until the clock has
+passed the last one, so that a process which is given the same pid afterwards
+cannot make the same id. */
+
+void
+receive_id_lead_wait(void)
+{
+if (!id_lead_tv.tv_sec) return;
+exim_wait_tick(&id_lead_tv, id_lead_resolution);
+id_lead_tv.tv_sec = 0;
+}
+
+
+
+/*************************************************
+*      Message log lines from reception          *
+*************************************************/
+
+/* The lines for the message log made as a message is received are kept (in
+malloc store, as the caller may reset the pool) until they are written to the
+file or taken by a delivery in this process. */
+
+static void
+receive_msglog_drop(void)
+{
+if (msglog_held) store_free(msglog_held);
+msglog_held = NULL;
+}
+
+
+/* Create the message log for the message just received, and write the held
+lines to it. Called by the receiving process when a message received with
+message_logs_lazy set is left on the queue; does nothing if there are no lines
+held for it, as the file exists already. */
+
+void
+receive_msglog_write(void)
+{
+uschar * m_name;
+int fd;
+
+if (!msglog_held || Ustrcmp(msglog_held_id, message_id) != 0) return;
+
+m_name = spool_fname(US"msglog", message_subdir, message_id, US"");
+if (  (fd = Uopen(m_name, O_WRONLY|O_APPEND|O_CREAT, SPOOL_MODE)) < 0
+   && errno == ENOENT
+   )
+  {
+  (void)directory_make(spool_root(message_subdir),
+		      spool_sname(US"msglog", message_subdir),
+		      MSGLOG_DIRECTORY_MODE, TRUE);
+  fd = Uopen(m_name, O_WRONLY|O_APPEND|O_CREAT, SPOOL_MODE);
+  }
+
+if (fd < 0)
+  log_write(0, LOG_MAIN|LOG_PANIC, "Couldn't open message log %s: %s",
+    m_name, strerror(errno));
+else
+  {
+  FILE *message_log = fdopen(fd, "a");
+  if (!message_log)
+    {
+    log_write(0, LOG_MAIN|LOG_PANIC, "Couldn't fdopen message log %s: %s",
+      m_name, strerror(errno));
+    (void)close(fd);
+    }
+  else
+    {
+    fputs(CS msglog_held, message_log);
+    (void)fclose(message_log);
+    }
+  }
+receive_msglog_drop();
+}
+
+
+/* Hand the held lines for the given message to a delivery in this process,
+which keeps them with its own; the caller frees them. Returns NULL if there
+are none. */
+
+uschar *
+receive_msglog_take(const uschar * id)
+{
+uschar * s = msglog_held;
+if (!s) return NULL;
+msglog_held = NULL;
+if (Ustrcmp(msglog_held_id, id) == 0) return s;
+store_free(s);
+return NULL;
+}
+
+
+
 /*************************************************
 *      Non-SMTP character reading functions      *
 *************************************************/
@@ -150,6 +254,40 @@ return match_address_list_basic(qnewsender, CUSS &untrusted_set_sender, 0) == OK
 
 
 
+#ifdef HAVE_STATFS
+/* Do the business for one directory */
+
+static int_eximarith_t
+receive_statvfs_path(const uschar * path, const uschar * name, int * inodeptr)
+{
+struct STATVFS statbuf;
+struct stat dummy;
+
+memset(&statbuf, 0, sizeof(statbuf));
+
+if (STATVFS(CS path, &statbuf) != 0)
+  if (stat(CS path, &dummy) == -1 && errno == ENOENT)
+    {				/* Can happen on first run after installation */
+    *inodeptr = -1;
+    return -1;
+    }
+  else
+    {
+    log_write(0, LOG_MAIN|LOG_PANIC, "cannot accept message: failed to stat "
+      "%s directory %s: %s", name, path, strerror(errno));
+    smtp_closedown(US"spool or log directory problem");
+    exim_exit(EXIT_FAILURE);
+    }
+
+*inodeptr = (statbuf.F_FILES > 0)? statbuf.F_FAVAIL : -1;
+
+/* Disks are getting huge. Take care with computing the size in kilobytes. */
+
+return (int_eximarith_t)(((double)statbuf.F_BAVAIL * (double)statbuf.F_FRSIZE)/1024.0);
+}
+#endif
+
+
 /*************************************************
 *          Read space info for a partition       *
 *************************************************/
@@ -179,18 +317,27 @@ int_eximarith_t
 receive_statvfs(BOOL isspool, int *inodeptr)
 {
 #ifdef HAVE_STATFS
-struct STATVFS statbuf;
-struct stat dummy;
 uschar *path;
 uschar *name;
 uschar buffer[1024];
 
-/* The spool directory must always exist. */
+/* The spool directory must always exist. A sharded spool gives the least
+space and inodes left on any of its filesystems. */
 
 if (isspool)
   {
-  path = spool_directory;
-  name = US"spool";
+  int_eximarith_t space = receive_statvfs_path(spool_directory, US"spool",
+					       inodeptr);
+
+  for (int i = 0; i < spool_shard_count; i++)
+    {
+    int inodes;
+    int_eximarith_t s = receive_statvfs_path(spool_shard_roots[i], US"spool",
+					     &inodes);
+    if (s >= 0 && (space < 0 || s < space)) space = s;
+    if (inodes >= 0 && (*inodeptr < 0 || inodes < *inodeptr)) *inodeptr = inodes;
+    }
+  return space;
   }
 
 /* Need to cut down the log file path to the directory, and to ignore any
@@ -235,27 +382,7 @@ else
 
 /* We now have the path; do the business */
 
-memset(&statbuf, 0, sizeof(statbuf));
-
-if (STATVFS(CS path, &statbuf) != 0)
-  if (stat(CS path, &dummy) == -1 && errno == ENOENT)
-    {				/* Can happen on first run after installation */
-    *inodeptr = -1;
-    return -1;
-    }
-  else
-    {
-    log_write(0, LOG_MAIN|LOG_PANIC, "cannot accept message: failed to stat "
-      "%s directory %s: %s", name, path, strerror(errno));
-    smtp_closedown(US"spool or log directory problem");
-    exim_exit(EXIT_FAILURE);
-    }
-
-*inodeptr = (statbuf.F_FILES > 0)? statbuf.F_FAVAIL : -1;
-
-/* Disks are getting huge. Take care with computing the size in kilobytes. */
-
-return (int_eximarith_t)(((double)statbuf.F_BAVAIL * (double)statbuf.F_FRSIZE)/1024.0);
+return receive_statvfs_path(path, name, inodeptr);
 
 #else
 /* Unable to find partition sizes in this environment. */
@@ -470,11 +597,460 @@ Argument:  the signal number
 Returns:   nothing
 */
 
-static void
-local_scan_crash_handler(int sig)
-{
-had_local_scan_crash = sig;
-siglongjmp(local_scan_env, 1);
+static void
+local_scan_crash_handler(int sig)
+{
+had_local_scan_crash = sig;
+siglongjmp(local_scan_env, 1);
+}
+
+
+/*************************************************
+*     Stream a message to a policy service       *
+*************************************************/
+
+/* When local_scan_policy is set, a child process connects to the policy
+service as the body of a message is about to be received. It sends the
+envelope and the header lines, then follows the spool data file as it grows,
+so that the service can work on the message while the rest of it is still
+arriving. The verdict is collected where local_scan() is run, so the service's
+latency is mostly hidden behind the body transfer.
+
+After the envelope, which ends with an empty line, the data goes in chunks,
+each a decimal length on a line of its own followed by that many bytes. A zero
+length ends the message; if the message is abandoned the connection is closed
+without one. The service replies with a single line, a verdict optionally
+followed by a space and some text.
+
+The child and the receiving process talk over a socketpair. The receiving
+process writes a single '.' when the whole message is in the file, and reads
+the verdict line back; if the message is abandoned it just closes its end. */
+
+#define LSP_CHUNK	16384
+#define LSP_POLL_MS	100
+#define LSP_CONNECT_TMO	5
+
+static pid_t         lsp_pid = -1;	/* streaming child */
+static int           lsp_fd = -1;	/* our end of the channel to it */
+static const uschar *lsp_error = NULL;	/* failure to start it */
+
+
+/* Send a chunk of data to the service, with its length line.
+
+Arguments:
+  sock       the connection to the service
+  buf        the data
+  len        its length; zero for the end of the message
+
+Returns:     FALSE on a write error
+*/
+
+static BOOL
+lsp_chunk(int sock, const uschar * buf, int len)
+{
+uschar hdr[16];
+int hlen = snprintf(CS hdr, sizeof(hdr), "%d\n", len);
+
+return write_to_fd_buf(sock, hdr, hlen) == hlen
+  && (len == 0 || write_to_fd_buf(sock, buf, len) == len);
+}
+
+
+/* The streaming child.  It writes the verdict, or "error" and a reason, to
+the channel to the receiving process, and exits.
+
+Arguments:
+  spec       the service, a socket path or a host and port
+  ctl        the channel to the receiving process
+
+Returns:     does not return
+*/
+
+static void
+lsp_child(const uschar * spec, int ctl)
+{
+uschar * errstr = NULL;
+uschar buf[LSP_CHUNK];
+gstring * g;
+off_t off = spool_data_start_offset(message_id);
+int sock, dfd, len;
+BOOL complete = FALSE;
+
+if ((dfd = Uopen(spool_name, O_RDONLY, 0)) < 0)
+  { errstr = string_open_failed("%s", spool_name); goto bad; }
+if ((sock = ip_streamsocket(spec, &errstr, LSP_CONNECT_TMO, NULL)) < 0)
+  goto bad;
+
+g = string_fmt_append(NULL, "queue_id=%s\nsender=%s\n", message_id, sender_address);
+if (sender_host_address)
+  g = string_fmt_append(g, "client_address=%s\n", sender_host_address);
+if (sender_helo_name)
+  g = string_fmt_append(g, "helo=%s\n", sender_helo_name);
+for (int i = 0; i < recipients_count; i++)
+  g = string_fmt_append(g, "recipient=%s\n", recipients_list[i].address);
+g = string_catn(g, US"\n", 1);
+if (write_to_fd_buf(sock, g->s, g->ptr) != g->ptr)
+  goto wbad;
+
+/* The header lines as they stand, then the empty line that ends them */
+
+g = NULL;
+for (header_line * h = header_list; h; h = h->next)
+  if (h->type != htype_old)
+    g = string_catn(g, h->text, h->slen);
+g = string_catn(g, US"\n", 1);
+if (!lsp_chunk(sock, g->s, g->ptr)) goto wbad;
+
+/* Follow the data file.  Having caught up, wait for the receiving process to
+say that the message is complete, then read what remains. */
+
+for (;;)
+  {
+  ssize_t n = pread(dfd, buf, sizeof(buf), off);
+
+  if (n < 0)
+    { errstr = string_sprintf("reading %s: %s", spool_name, strerror(errno)); goto bad; }
+  if (n > 0)
+    {
+    if (!lsp_chunk(sock, buf, n)) goto wbad;
+    off += n;
+    continue;
+    }
+  if (complete) break;
+
+  if (poll_one_fd(ctl, POLLIN, LSP_POLL_MS) > 0)
+    {
+    if (read(ctl, buf, 1) != 1 || *buf != '.')
+      exim_underbar_exit(EXIT_SUCCESS);		/* message abandoned */
+    complete = TRUE;
+    }
+  }
+
+if (!lsp_chunk(sock, NULL, 0)) goto wbad;
+
+/* Read the verdict line */
+
+  {
+  client_conn_ctx cctx = {.sock = sock};
+  time_t limit = local_scan_timeout > 0
+    ? time(NULL) + local_scan_timeout : (time_t)INT_MAX;
+  uschar * nl;
+
+  len = 0;
+  do
+    {
+    int n = ip_recv(&cctx, buf + len, sizeof(buf) - 1 - len, limit);
+    if (n <= 0)
+      {
+      errstr = errno == 0 ? US"connection closed before verdict"
+	: errno == ETIMEDOUT ? US"timed out waiting for verdict"
+	: string_sprintf("reading verdict: %s", strerror(errno));
+      goto bad;
+      }
+    len += n;
+    buf[len] = '\0';
+    } while (!(nl = Ustrchr(buf, '\n')) && len < sizeof(buf) - 1);
+  if (nl) len = nl - buf + 1;
+  }
+
+(void) write_to_fd_buf(ctl, buf, len);
+exim_underbar_exit(EXIT_SUCCESS);
+
+wbad:
+  errstr = string_sprintf("writing to %s: %s", spec, strerror(errno));
+bad:
+  g = string_fmt_append(NULL, "error %s\n", errstr);
+  (void) write_to_fd_buf(ctl, g->s, g->ptr);
+  exim_underbar_exit(EXIT_SUCCESS);
+}
+
+
+/* Kill off a streaming child whose verdict was not wanted, and tidy up */
+
+static void
+local_scan_policy_abandon(void)
+{
+if (lsp_fd >= 0)
+  {
+  (void)close(lsp_fd);
+  lsp_fd = -1;
+  }
+if (lsp_pid > 0)
+  {
+  (void)kill(lsp_pid, SIGKILL);
+  (void)waitpid(lsp_pid, NULL, 0);
+  lsp_pid = -1;
+  }
+lsp_error = NULL;
+}
+
+
+/* Start streaming a message to the policy service, if there is one. Called
+when the spool data file has been created, before the body is read. Any
+problem is held until the verdict is wanted. */
+
+static void
+local_scan_policy_start(void)
+{
+const uschar * spec;
+int pair[2];
+
+local_scan_policy_abandon();
+if (!local_scan_policy) return;
+
+if (!(spec = expand_cstring(local_scan_policy)))
+  {
+  if (!f.expand_string_forcedfail)
+    lsp_error = string_sprintf("failed to expand \"%s\": %s",
+			      local_scan_policy, expand_string_message);
+  return;
+  }
+if (!*spec) return;
+
+if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+  {
+  lsp_error = string_sprintf("socketpair: %s", strerror(errno));
+  return;
+  }
+
+if ((lsp_pid = exim_fork(US"local-scan-policy")) == 0)
+  {
+  (void)close(pair[0]);
+  lsp_child(spec, pair[1]);
+  /* Does not return */
+  }
+
+(void)close(pair[1]);
+if (lsp_pid < 0)
+  {
+  lsp_error = string_sprintf("fork: %s", strerror(errno));
+  (void)close(pair[0]);
+  return;
+  }
+lsp_fd = pair[0];
+(void)fcntl(lsp_fd, F_SETFD, fcntl(lsp_fd, F_GETFD) | FD_CLOEXEC);
+}
+
+
+/* Collect the verdict from the policy service. Called with the data file
+complete and flushed.
+
+Argument:   where to put the text that came with the verdict
+Returns:    a LOCAL_SCAN_ value
+*/
+
+static int
+local_scan_policy_verdict(uschar ** text)
+{
+static const struct { const char * name; int rc; } verdicts[] = {
+  { "accept",		LOCAL_SCAN_ACCEPT },
+  { "freeze",		LOCAL_SCAN_ACCEPT_FREEZE },
+  { "queue",		LOCAL_SCAN_ACCEPT_QUEUE },
+  { "reject",		LOCAL_SCAN_REJECT },
+  { "tempreject",	LOCAL_SCAN_TEMPREJECT },
+};
+uschar buf[LOCAL_SCAN_MAX_RETURN + 32], * s;
+int len = 0, rc = LOCAL_SCAN_TEMPREJECT;
+
+*text = NULL;
+if (lsp_error)
+  {
+  log_write(0, LOG_MAIN, "local_scan_policy: %s", lsp_error);
+  lsp_error = NULL;
+  return rc;
+  }
+if (lsp_fd < 0) return LOCAL_SCAN_ACCEPT;
+
+/* The timeout for local_scan() covers the wait */
+
+(void) write_to_fd_buf(lsp_fd, US".", 1);
+while (len < sizeof(buf) - 1)
+  {
+  int n = read(lsp_fd, buf + len, sizeof(buf) - 1 - len);
+  if (n < 0 && errno == EINTR) continue;
+  if (n <= 0) break;
+  len += n;
+  }
+buf[len] = '\0';
+local_scan_policy_abandon();
+
+if ((s = Ustrchr(buf, '\n'))) *s = '\0';
+if (s && s > buf && s[-1] == '\r') s[-1] = '\0';
+DEBUG(D_receive) debug_printf("local_scan_policy: '%s'\n", buf);
+
+if ((s = Ustrchr(buf, ' '))) *s++ = '\0';
+if (Ustrcmp(buf, "error") == 0)
+  {
+  log_write(0, LOG_MAIN, "local_scan_policy: %s", s ? s : US"failed");
+  return rc;
+  }
+for (int i = 0; i < nelem(verdicts); i++)
+  if (strcmpic(buf, US verdicts[i].name) == 0)
+    {
+    if (s && *s) *text = string_copy(s);
+    return verdicts[i].rc;
+    }
+
+log_write(0, LOG_MAIN, "local_scan_policy: invalid verdict \"%s\"",
+  string_printing(buf));
+return rc;
+}
+
+
+
+#ifdef EXPAND_DLFUNC
+/*************************************************
+*        Load the local_scan() modules           *
+*************************************************/
+
+/* The modules in local_scan_modules are loaded once per process, when the
+first message needs them. Each must define a function called local_scan(),
+with the same arguments and results as the one built into Exim.
+
+Argument:   where to put an error message
+Returns:    FALSE if a module could not be loaded
+*/
+
+typedef int local_scan_fn(int, uschar **);
+
+static local_scan_fn ** lsm_fns = NULL;
+static const uschar **  lsm_names;
+static int              lsm_count = 0;
+
+static BOOL
+local_scan_modules_load(uschar ** errstr)
+{
+const uschar * list = local_scan_modules;
+const uschar * ele;
+int sep = 0, n = 0;
+rmark reset_point;
+
+if (lsm_fns) return TRUE;
+
+reset_point = store_mark();
+while (string_nextinlist(&list, &sep, NULL, 0)) n++;
+reset_point = store_reset(reset_point);
+
+lsm_fns = store_get_perm((n + 1) * sizeof(local_scan_fn *), GET_UNTAINTED);
+lsm_names = store_get_perm((n + 1) * sizeof(uschar *), GET_UNTAINTED);
+
+for (list = local_scan_modules, sep = 0;
+     (ele = string_nextinlist(&list, &sep, NULL, 0)); lsm_count++)
+  {
+  void * handle = dlopen(CCS ele, RTLD_LAZY);
+
+  if (!handle)
+    {
+    *errstr = string_sprintf("dlopen \"%s\" failed: %s", ele, dlerror());
+    goto bad;
+    }
+  if (!(lsm_fns[lsm_count] = (local_scan_fn *) dlsym(handle, "local_scan")))
+    {
+    *errstr = string_sprintf("dlsym \"local_scan\" in \"%s\" failed: %s",
+      ele, dlerror());
+    goto bad;
+    }
+  lsm_names[lsm_count] = string_copy_perm(ele, FALSE);
+  DEBUG(D_receive) debug_printf("loaded local_scan() from %s\n", ele);
+  }
+return TRUE;
+
+bad:
+  lsm_fns = NULL;
+  lsm_count = 0;
+  return FALSE;
+}
+#endif	/*EXPAND_DLFUNC*/
+
+
+
+/*************************************************
+*          Run the chain of scans                *
+*************************************************/
+
+/* The built-in local_scan() runs first, then any modules in order, then the
+policy service's verdict is collected. Each that accepts passes the message
+on; the first that does not gives the result. A freeze or queue request from
+any of them stands, and accepting text from a later one replaces that from an
+earlier one.
+
+Arguments:
+  fd            the data file, positioned at the start of the body
+  return_text   as for local_scan()
+
+Returns:        as for local_scan()
+*/
+
+static const uschar * local_scan_stage;	/* Running now, for logging */
+static uschar *       local_scan_by;	/* Responsible for the result */
+
+static BOOL
+local_scan_accepting(int rc)
+{
+return rc == LOCAL_SCAN_ACCEPT
+  || rc == LOCAL_SCAN_ACCEPT_FREEZE || rc == LOCAL_SCAN_ACCEPT_QUEUE;
+}
+
+static int
+local_scan_merge(int rc, uschar ** return_text, int next_rc, uschar * text,
+  uschar * by)
+{
+if (!local_scan_accepting(next_rc))
+  {
+  *return_text = text;
+  local_scan_by = by;
+  return next_rc;
+  }
+if (text) *return_text = text;
+if (rc == LOCAL_SCAN_ACCEPT && next_rc != LOCAL_SCAN_ACCEPT)
+  {
+  local_scan_by = by;
+  return next_rc;
+  }
+return rc;
+}
+
+static int
+local_scan_chain(int fd, uschar ** return_text)
+{
+uschar * text;
+int rc, next_rc;
+
+local_scan_stage = US"local_scan() function";
+local_scan_by = US"local_scan()";
+rc = local_scan(fd, return_text);
+
+#ifdef EXPAND_DLFUNC
+if (local_scan_modules && local_scan_accepting(rc))
+  {
+  uschar * errstr;
+
+  if (!local_scan_modules_load(&errstr))
+    {
+    log_write(0, LOG_MAIN|LOG_PANIC, "local_scan_modules: %s", errstr);
+    *return_text = NULL;
+    return LOCAL_SCAN_TEMPREJECT;
+    }
+  for (int i = 0; i < lsm_count && local_scan_accepting(rc); i++)
+    {
+    local_scan_stage = string_sprintf("local_scan() function in %s", lsm_names[i]);
+    lseek(fd, (long int)spool_data_start_offset(message_id), SEEK_SET);
+    text = NULL;
+    next_rc = (lsm_fns[i])(fd, &text);
+    rc = local_scan_merge(rc, return_text, next_rc, text,
+	    string_sprintf("local_scan() in %s", lsm_names[i]));
+    }
+  }
+#endif
+
+if (local_scan_accepting(rc) && (lsp_fd >= 0 || lsp_error))
+  {
+  local_scan_stage = US"local_scan_policy service";
+  if (spool_data_file) (void) fflush(spool_data_file);
+  next_rc = local_scan_policy_verdict(&text);
+  rc = local_scan_merge(rc, return_text, next_rc, text, US"local_scan_policy");
+  }
+return rc;
 }
 
 #endif /*HAVE_LOCAL_SCAN*/
@@ -834,134 +1410,206 @@ followed by SMTP commands is a possible "smtp smuggling" attack.  If
 the first (header) line for the message has a proper CRLF then enforce
 that for the body: convert bare LF to a space.
 
+When writing a wireformat spoolfile every line ending (including one converted
+from a bare CR or LF) is stored as CRLF, counted in the message size; leading
+dots are still removed, so the stored body is in the same form as for CHUNKING
+and can be sent as-is by BDAT, or by DATA after a check for lines needing
+dot-stuffing.
+
 Arguments:
   fout		a FILE to which to write the message; NULL if skipping
   strict_crlf	require full CRLF sequence as a line ending
+  wire		write a wireformat (CRLF) spoolfile
 
 Returns:    One of the END_xxx values indicating why it stopped reading
 */
 
 static int
-read_message_data_smtp(FILE * fout, BOOL strict_crlf)
+read_message_data_smtp(FILE * fout, BOOL strict_crlf, BOOL wire)
 {
 enum { s_linestart, s_normal, s_had_cr, s_had_nl_dot, s_had_dot_cr } ch_state =
 	      s_linestart;
-int linelength = 0, ch;
+int linelength = 0, ch, rc = END_EOF;
+uschar * buf, * p = NULL, * end = NULL;
+unsigned len;
 
-while ((ch = (receive_getc)(GETC_BUFFER_UNLIMITED)) != EOF)
+if (fout && wire)
   {
-  if (ch == 0) body_zerocount++;
-  switch (ch_state)
+  DEBUG(D_receive) debug_printf("writing spoolfile in wire format\n");
+  f.spool_file_wireformat = TRUE;
+  }
+else
+  wire = FALSE;
+
+/* Work through the input a buffer-load at a time. Anything left over when we
+stop (commands pipelined after the terminating dot, or the rest of a message
+being rejected) is handed back afterwards. */
+
+for (;;)
+  {
+  len = GETC_BUFFER_UNLIMITED;
+  if (!(buf = (receive_getbuf)(&len))) break;
+
+  for (p = buf, end = buf + len; p < end; )
     {
-    case s_linestart:			/* After LF or CRLF */
-      if (ch == '.')
-	{
-	ch_state = s_had_nl_dot;
-	continue;			/* Don't ever write . after LF */
-	}
-      ch_state = s_normal;
+    /* Within a line, copy up to the next CR or LF in bulk; memchr() is
+    typically vectorised by the C library. */
 
-      /* Else fall through to handle as normal uschar. */
+    if (ch_state == s_normal)
+      {
+      uschar * r = memchr(p, '\n', end - p), * z;
 
-    case s_normal:			/* Normal state */
-      if (ch == '\r')
+      if (!r) r = end;
+      if ((z = memchr(p, '\r', r - p))) r = z;
+      if (r > p)
 	{
-	ch_state = s_had_cr;
-	continue;			/* Don't write the CR */
+	int n = r - p;
+
+	for (z = p; (z = memchr(z, 0, r - z)); z++) body_zerocount++;
+	message_size += n;
+	linelength += n;
+	if (fout)
+	  {
+	  if (fwrite(p, 1, n, fout) != n) { rc = END_WERROR; goto out; }
+	  if (message_size > thismessage_size_limit) { rc = END_SIZE; goto out; }
+	  }
+	cutthrough_data_puts(p, n);
+	p = r;
+	continue;
 	}
-      if (ch == '\n')			/* Bare LF at end of line */
-	if (strict_crlf)
-	  ch = ' ';			/* replace LF with space */
-	else
-	  {				/* treat as line ending */
+      }
+
+    if ((ch = *p++) == 0) body_zerocount++;
+    switch (ch_state)
+      {
+      case s_linestart:			/* After LF or CRLF */
+	if (ch == '.')
+	  {
+	  ch_state = s_had_nl_dot;
+	  continue;			/* Don't ever write . after LF */
+	  }
+	ch_state = s_normal;
+
+	/* Else fall through to handle as normal uschar. */
+
+      case s_normal:			/* Normal state */
+	if (ch == '\r')
+	  {
+	  ch_state = s_had_cr;
+	  continue;			/* Don't write the CR */
+	  }
+	if (ch == '\n')			/* Bare LF at end of line */
+	  if (strict_crlf)
+	    ch = ' ';			/* replace LF with space */
+	  else
+	    {				/* treat as line ending */
+	    ch_state = s_linestart;
+	    body_linecount++;
+	    if (linelength > max_received_linelength)
+	      max_received_linelength = linelength;
+	    linelength = -1;
+	    }
+	break;
+
+      case s_had_cr:			/* After (unwritten) CR */
+	body_linecount++;			/* Any char ends line */
+	if (linelength > max_received_linelength)
+	  max_received_linelength = linelength;
+	linelength = -1;
+	if (ch == '\n')			/* proper CRLF */
 	  ch_state = s_linestart;
-	  body_linecount++;
-	  if (linelength > max_received_linelength)
-	    max_received_linelength = linelength;
-	  linelength = -1;
+	else
+	  {
+	  message_size++;		/* convert the dropped CR to a stored NL */
+	  if (wire)
+	    {
+	    message_size++;
+	    if (fputc('\r', fout) == EOF) { rc = END_WERROR; goto out; }
+	    }
+	  if (fout && fputc('\n', fout) == EOF) { rc = END_WERROR; goto out; }
+	  cutthrough_data_put_nl();
+	  if (ch == '\r')			/* CR; do not write */
+	    continue;
+	  ch_state = s_normal;		/* not LF or CR; process as standard */
 	  }
-      break;
+	break;
+
+      case s_had_nl_dot:			/* After [CR] LF . */
+	if (ch == '\n')			/* [CR] LF . LF */
+	  if (strict_crlf)
+	    ch = ' ';			/* replace LF with space */
+	  else
+	    { rc = END_DOT; goto out; }
+	else if (ch == '\r')		/* [CR] LF . CR */
+	  {
+	  ch_state = s_had_dot_cr;
+	  continue;			/* Don't write the CR */
+	  }
+	/* The dot was removed on reaching s_had_nl_dot. For a doubled dot, here,
+	reinstate it to cutthrough. The current ch, dot or not, is passed both to
+	cutthrough and to file below. */
+	else if (ch == '.')
+	  {
+	  uschar c = ch;
+	  cutthrough_data_puts(&c, 1);
+	  }
+	ch_state = s_normal;
+	break;
+
+      case s_had_dot_cr:			/* After [CR] LF . CR */
+	if (ch == '\n')			/* Preferred termination */
+	  { rc = END_DOT; goto out; }
 
-    case s_had_cr:			/* After (unwritten) CR */
-      body_linecount++;			/* Any char ends line */
-      if (linelength > max_received_linelength)
-	max_received_linelength = linelength;
-      linelength = -1;
-      if (ch == '\n')			/* proper CRLF */
-	ch_state = s_linestart;
-      else
-	{
 	message_size++;		/* convert the dropped CR to a stored NL */
-	if (fout && fputc('\n', fout) == EOF) return END_WERROR;
+	body_linecount++;
+	if (wire)
+	  {
+	  message_size++;
+	  if (fputc('\r', fout) == EOF) { rc = END_WERROR; goto out; }
+	  }
+	if (fout && fputc('\n', fout) == EOF) { rc = END_WERROR; goto out; }
 	cutthrough_data_put_nl();
-	if (ch == '\r')			/* CR; do not write */
-	  continue;
-	ch_state = s_normal;		/* not LF or CR; process as standard */
-	}
-      break;
-
-    case s_had_nl_dot:			/* After [CR] LF . */
-      if (ch == '\n')			/* [CR] LF . LF */
-	if (strict_crlf)
-	  ch = ' ';			/* replace LF with space */
-	else
-	  return END_DOT;
-      else if (ch == '\r')		/* [CR] LF . CR */
-	{
-	ch_state = s_had_dot_cr;
-	continue;			/* Don't write the CR */
-	}
-      /* The dot was removed on reaching s_had_nl_dot. For a doubled dot, here,
-      reinstate it to cutthrough. The current ch, dot or not, is passed both to
-      cutthrough and to file below. */
-      else if (ch == '.')
-	{
-	uschar c = ch;
-	cutthrough_data_puts(&c, 1);
-	}
-      ch_state = s_normal;
-      break;
+	if (ch == '\r')
+	  {
+	  ch_state = s_had_cr;
+	  continue;			/* CR; do not write */
+	  }
+	ch_state = s_normal;
+	break;
+      }
 
-    case s_had_dot_cr:			/* After [CR] LF . CR */
-      if (ch == '\n')
-	return END_DOT;			/* Preferred termination */
+    /* Add the character to the spool file, unless skipping; then loop for the
+    next. */
 
-      message_size++;		/* convert the dropped CR to a stored NL */
-      body_linecount++;
-      if (fout && fputc('\n', fout) == EOF) return END_WERROR;
-      cutthrough_data_put_nl();
-      if (ch == '\r')
+    message_size++;
+    linelength++;
+    if (fout)
+      {
+      if (wire && ch == '\n')		/* line ending, stored as CRLF */
 	{
-	ch_state = s_had_cr;
-	continue;			/* CR; do not write */
+	message_size++;
+	if (fputc('\r', fout) == EOF) { rc = END_WERROR; goto out; }
 	}
-      ch_state = s_normal;
-      break;
-    }
-
-  /* Add the character to the spool file, unless skipping; then loop for the
-  next. */
-
-  message_size++;
-  linelength++;
-  if (fout)
-    {
-    if (fputc(ch, fout) == EOF) return END_WERROR;
-    if (message_size > thismessage_size_limit) return END_SIZE;
-    }
-  if(ch == '\n')
-    cutthrough_data_put_nl();
-  else
-    {
-    uschar c = ch;
-    cutthrough_data_puts(&c, 1);
+      if (fputc(ch, fout) == EOF) { rc = END_WERROR; goto out; }
+      if (message_size > thismessage_size_limit) { rc = END_SIZE; goto out; }
+      }
+    if(ch == '\n')
+      cutthrough_data_put_nl();
+    else
+      {
+      uschar c = ch;
+      cutthrough_data_puts(&c, 1);
+      }
     }
   }
 
 /* Fall through here if EOF encountered. This indicates some kind of error,
-since a correct message is terminated by [CR] LF . [CR] LF. */
+since a correct message is terminated by [CR] LF . [CR] LF. Otherwise give
+back what was not used of the last buffer. */
 
-return END_EOF;
+out:
+while (end > p) (receive_ungetc)(*--end);
+return rc;
 }
 
 
@@ -990,98 +1638,147 @@ BOOL fix_nl = FALSE;
 
 for(;;)
   {
-  switch ((ch = bdat_getc(GETC_BUFFER_UNLIMITED)))
+  uschar * p, * end, one;
+
+  /* Take what is buffered of the current chunk as a span; otherwise go
+  a byte at a time, to handle the chunk boundaries. */
+
+  if (chunking_data_left > 0 && !fix_nl)
     {
-    case EOF:	return END_EOF;
-    case ERR:	return END_PROTOCOL;
-    case EOD:
-      /* Nothing to get from the sender anymore. We check the last
-      character written to the spool.
-
-      RFC 3030 states, that BDAT chunks are normal text, terminated by CRLF.
-      If we would be strict, we would refuse such broken messages.
-      But we are liberal, so we fix it.  It would be easy just to append
-      the "\n" to the spool.
-
-      But there are some more things (line counting, message size calculation and such),
-      that would need to be duplicated here.  So we simply do some ungetc
-      trickery.
-      */
-      if (fout)
-	{
-	if (fseek(fout, -1, SEEK_CUR) < 0)	return END_PROTOCOL;
-	if (fgetc(fout) == '\n')		return END_DOT;
-	}
+    unsigned len = chunking_data_left;
 
-      if (linelength == -1)    /* \r already seen (see below) */
-        {
-        DEBUG(D_receive) debug_printf("Add missing LF\n");
-        bdat_ungetc('\n');
-        continue;
-        }
-      DEBUG(D_receive) debug_printf("Add missing CRLF\n");
-      bdat_ungetc('\r');      /* not even \r was seen */
-      fix_nl = TRUE;
+    if (!(p = bdat_getbuf(&len))) return END_EOF;
+    end = p + len;
+    }
+  else
+    {
+    switch ((ch = bdat_getc(GETC_BUFFER_UNLIMITED)))
+      {
+      case EOF:	return END_EOF;
+      case ERR:	return END_PROTOCOL;
+      case EOD:
+	/* Nothing to get from the sender anymore. We check the last
+	character written to the spool.
+
+	RFC 3030 states, that BDAT chunks are normal text, terminated by CRLF.
+	If we would be strict, we would refuse such broken messages.
+	But we are liberal, so we fix it.  It would be easy just to append
+	the "\n" to the spool.
+
+	But there are some more things (line counting, message size calculation and such),
+	that would need to be duplicated here.  So we simply do some ungetc
+	trickery.
+	*/
+	if (fout)
+	  {
+	  if (fseek(fout, -1, SEEK_CUR) < 0)	return END_PROTOCOL;
+	  if (fgetc(fout) == '\n')		return END_DOT;
+	  }
+
+	if (linelength == -1)    /* \r already seen (see below) */
+	  {
+	  DEBUG(D_receive) debug_printf("Add missing LF\n");
+	  bdat_ungetc('\n');
+	  continue;
+	  }
+	DEBUG(D_receive) debug_printf("Add missing CRLF\n");
+	bdat_ungetc('\r');      /* not even \r was seen */
+	fix_nl = TRUE;
 
-      continue;
-    case '\0':  body_zerocount++; break;
+	continue;
+      }
+    one = ch;
+    p = &one;
+    end = p + 1;
     }
-  switch (ch_state)
+
+  while (p < end)
     {
-    case LF_SEEN:                             /* After LF or CRLF */
-      ch_state = MID_LINE;
-      /* fall through to handle as normal uschar. */
+    /* Within a line, copy up to the next CR or LF in bulk */
+
+    if (ch_state != CR_SEEN)
+      {
+      uschar * r = memchr(p, '\n', end - p), * z;
 
-    case MID_LINE:                            /* Mid-line state */
-      if (ch == '\n')
+      if (!r) r = end;
+      if ((z = memchr(p, '\r', r - p))) r = z;
+      if (r > p)
 	{
-	ch_state = LF_SEEN;
+	int n = r - p;
+
+	for (z = p; (z = memchr(z, 0, r - z)); z++) body_zerocount++;
+	ch_state = MID_LINE;
+	message_size += n;
+	linelength += n;
+	if (fout)
+	  {
+	  if (fwrite(p, 1, n, fout) != n) return END_WERROR;
+	  if (message_size > thismessage_size_limit) return END_SIZE;
+	  }
+	cutthrough_data_puts(p, n);
+	p = r;
+	continue;
+	}
+      }
+
+    if ((ch = *p++) == 0) body_zerocount++;
+    switch (ch_state)
+      {
+      case LF_SEEN:                             /* After LF or CRLF */
+	ch_state = MID_LINE;
+	/* fall through to handle as normal uschar. */
+
+      case MID_LINE:                            /* Mid-line state */
+	if (ch == '\n')
+	  {
+	  ch_state = LF_SEEN;
+	  body_linecount++;
+	  if (linelength > max_received_linelength)
+	    max_received_linelength = linelength;
+	  linelength = -1;
+	  }
+	else if (ch == '\r')
+	  {
+	  ch_state = CR_SEEN;
+	  if (fix_nl) bdat_ungetc('\n');
+	  continue;			/* don't write CR */
+	  }
+	break;
+
+      case CR_SEEN:                       /* After (unwritten) CR */
 	body_linecount++;
 	if (linelength > max_received_linelength)
 	  max_received_linelength = linelength;
 	linelength = -1;
-	}
-      else if (ch == '\r')
-	{
-	ch_state = CR_SEEN;
-       if (fix_nl) bdat_ungetc('\n');
-	continue;			/* don't write CR */
-	}
-      break;
-
-    case CR_SEEN:                       /* After (unwritten) CR */
-      body_linecount++;
-      if (linelength > max_received_linelength)
-	max_received_linelength = linelength;
-      linelength = -1;
-      if (ch == '\n')
-	ch_state = LF_SEEN;
-      else
-	{
-	message_size++;
-	if (fout && fputc('\n', fout) == EOF) return END_WERROR;
-	cutthrough_data_put_nl();
-	if (ch == '\r') continue;	/* don't write CR */
-	ch_state = MID_LINE;
-	}
-      break;
-    }
+	if (ch == '\n')
+	  ch_state = LF_SEEN;
+	else
+	  {
+	  message_size++;
+	  if (fout && fputc('\n', fout) == EOF) return END_WERROR;
+	  cutthrough_data_put_nl();
+	  if (ch == '\r') continue;	/* don't write CR */
+	  ch_state = MID_LINE;
+	  }
+	break;
+      }
 
-  /* Add the character to the spool file, unless skipping */
+    /* Add the character to the spool file, unless skipping */
 
-  message_size++;
-  linelength++;
-  if (fout)
-    {
-    if (fputc(ch, fout) == EOF) return END_WERROR;
-    if (message_size > thismessage_size_limit) return END_SIZE;
-    }
-  if(ch == '\n')
-    cutthrough_data_put_nl();
-  else
-    {
-    uschar c = ch;
-    cutthrough_data_puts(&c, 1);
+    message_size++;
+    linelength++;
+    if (fout)
+      {
+      if (fputc(ch, fout) == EOF) return END_WERROR;
+      if (message_size > thismessage_size_limit) return END_SIZE;
+      }
+    if(ch == '\n')
+      cutthrough_data_put_nl();
+    else
+      {
+      uschar c = ch;
+      cutthrough_data_puts(&c, 1);
+      }
     }
   }
 /*NOTREACHED*/
@@ -1102,10 +1799,32 @@ for (;;)
   {
   if (chunking_data_left > 0)
     {
-    unsigned len = MAX(chunking_data_left, thismessage_size_limit - message_size + 1);
-    uschar * buf = bdat_getbuf(&len);
+    unsigned len = MIN(chunking_data_left,
+		(unsigned)(thismessage_size_limit - message_size) + 1);
+    uschar * buf;
+
+#ifdef EXIM_HAVE_SPLICE
+    /* When none of the chunk is buffered and nothing needs to see the bytes,
+    they go from the socket to the spool file within the kernel. Anything
+    stdio holds is written first, and its idea of the position updated after. */
+
+    if (fout)
+      {
+      int n;
+
+      if (fflush(fout) != 0) return END_WERROR;
+      if ((n = bdat_splice(fileno(fout), len)) != 0)
+	{
+	if (n == -1) return END_EOF;
+	if (n < 0 || fseek(fout, 0, SEEK_END) != 0) return END_WERROR;
+	message_size += n;
+	if (message_size > thismessage_size_limit) return END_SIZE;
+	continue;
+	}
+      }
+#endif
 
-    if (!buf) return END_EOF;
+    if (!(buf = bdat_getbuf(&len))) return END_EOF;
     message_size += len;
     if (fout && fwrite(buf, len, 1, fout) != 1) return END_WERROR;
     }
@@ -1152,7 +1871,7 @@ receive_swallow_smtp(void)
 {
 if (message_ended >= END_NOTENDED)
   message_ended = chunking_state <= CHUNKING_OFFERED
-     ? read_message_data_smtp(NULL, FALSE)
+     ? read_message_data_smtp(NULL, FALSE, FALSE)
      : read_message_bdat_smtp_wire(NULL);
 }
 
@@ -1356,6 +2075,7 @@ for (header_line * h = acl_added_headers, * next; h; h = next)
   DEBUG(D_receive|D_acl) debug_printf("%s", h->text);
   }
 
+header_index_reset();
 acl_added_headers = NULL;
 DEBUG(D_receive|D_acl) debug_printf_indent(">>\n");
 }
@@ -1709,6 +2429,7 @@ int  error_rc = error_handling == ERRORS_SENDER
 int  header_size = 256;
 int  had_zero = 0;
 int  prevlines_length = 0;
+struct timeval phase_start;
 const int id_resolution = BASE_62 == 62 && !host_number_string ? 1
   : BASE_62 != 62 && host_number_string ? 4
   : 2;
@@ -1727,7 +2448,6 @@ uschar *blackholed_by = NULL;
 uschar *blackhole_log_msg = US"";
 enum {NOT_TRIED, TMP_REJ, PERM_REJ, ACCEPTED} cutthrough_done = NOT_TRIED;
 
-flock_t lock_data;
 error_block *bad_addresses = NULL;
 
 uschar *frozen_by = NULL;
@@ -1775,6 +2495,7 @@ accept the message - e.g. by verifying addresses - because reading a message
 might take a fair bit of real time. */
 
 search_tidyup();
+if (PHASE_TIMING) exim_gettime(&phase_start);
 
 /* Extracting the recipient list from an input file is incompatible with
 cutthrough delivery with the no-spool option.  It shouldn't be possible
@@ -1791,6 +2512,7 @@ header_list->next = NULL;
 header_list->type = htype_old;
 header_list->text = NULL;
 header_list->slen = 0;
+header_index_reset();
 
 /* Control block for the next header to be read.
 The data comes from the message, so is tainted. */
@@ -1836,22 +2558,43 @@ if (smtp_input && !smtp_batched_input && !f.dkim_disable_verify)
 if (sender_host_address) dmarc_init();	/* initialize libopendmarc */
 #endif
 
-/* In SMTP sessions we may receive several messages in one connection. Before
-each subsequent one, we wait for the clock to tick at the level of message-id
-granularity.
-This is so that the combination of time+pid is unique, even on systems where the
-pid can be re-used within our time interval. We can't shorten the interval
-without re-designing the message-id. See comments above where the message id is
-created. This is Something For The Future.
-Do this wait any time we have previously created a message-id, even if we
+/* In SMTP sessions we may receive several messages in one connection. Each
+subsequent one must have a later time, at the level of message-id granularity,
+than the previous one. This is so that the combination of time+pid is unique,
+even on systems where the pid can be re-used within our time interval.
+If the clock has not moved on by a tick, rather than waiting for it we take
+the next tick after the previous id's; the ids of this process then run as a
+sequence.  That can lead the clock, and a later process with the same pid could
+meet that lead; so it is bounded, and beyond the bound, or when the next tick
+would be in the next second, we do wait for the clock.  The process also waits
+out any lead before it exits (see receive_id_lead_wait()).
+Do this any time we have previously created a message-id, even if we
 rejected the message.  This gives unique IDs for logging done by ACLs.
 The initial timestamp must have been obtained via exim_gettime() to avoid
 issues on Linux with suspend/resume. */
 
 if (message_id_tv.tv_sec)
   {
+  struct timeval now_tv;
+
   message_id_tv.tv_usec = (message_id_tv.tv_usec/id_resolution) * id_resolution;
-  exim_wait_tick(&message_id_tv, id_resolution);
+  exim_gettime(&now_tv);
+  now_tv.tv_usec = (now_tv.tv_usec/id_resolution) * id_resolution;
+
+  if (  now_tv.tv_sec > message_id_tv.tv_sec
+     || (  now_tv.tv_sec == message_id_tv.tv_sec
+	&& now_tv.tv_usec > message_id_tv.tv_usec))
+    message_id_tv = now_tv;
+  else if (  message_id_tv.tv_sec == now_tv.tv_sec
+	  && message_id_tv.tv_usec - now_tv.tv_usec < MESSAGE_ID_MAX_LEAD
+	  && message_id_tv.tv_usec + id_resolution < 1000000)
+    {
+    message_id_tv.tv_usec += id_resolution;
+    id_lead_tv = message_id_tv;
+    id_lead_resolution = id_resolution;
+    }
+  else
+    exim_wait_tick(&message_id_tv, id_resolution);
   }
 
 /* Remember the time of reception. Exim uses time+pid for uniqueness of message
@@ -2694,7 +3437,7 @@ if (extract_recip)
 
         else if (recipient)
           {
-          if (tree_search(tree_nonrecipients, recipient) == NULL)
+          if (tree_search_nonrecipient(recipient) == NULL)
             receive_add_recipient(recipient, -1);
           else
             extracted_ignored = TRUE;
@@ -2742,11 +3485,15 @@ the time portion. Host numbers are restricted to the range 0-16.
 The time resolution is variously 1, 2 or 4 microseconds [0.5 or 1 ms]
 depending on the use of localhost_nubmer and of case-insensitive filesystems.
 
-After a message has been received, Exim ensures that the timer has ticked at the
-appropriate level before proceeding, to avoid duplication if the pid happened to
-be re-used within the same time period. It seems likely that most messages will
-take at least half a millisecond to be received, so no delay will normally be
-necessary. At least for some time...
+Before a further message is received by the same process, Exim ensures that the
+time used for its id is at least a tick later than that of the previous one, to
+avoid duplication if the pid happened to be re-used within the same time period.
+When the clock has not ticked the next tick is used without waiting, up to a
+small lead over the clock (MESSAGE_ID_MAX_LEAD microseconds) and within the same
+second. It seems likely that most messages will take at least half a
+millisecond to be received, so that lead will not normally build up. A process
+that has taken a lead waits for the clock to pass it before exiting, so that a
+new process given the same pid cannot repeat an id.
 
 Note that string_base62_XX() returns its data in a static storage block, so it
 must be copied before calling string_base62_XXX) again. It always returns exactly
@@ -3194,7 +3941,7 @@ if ((data_fd = Uopen(spool_name, O_RDWR|O_CREAT|O_EXCL, SPOOL_MODE)) < 0)
   {
   if (errno == ENOENT)
     {
-    (void) directory_make(spool_directory,
+    (void) directory_make(spool_root(message_subdir),
 		        spool_sname(US"input", message_subdir),
 			INPUT_DIRECTORY_MODE, TRUE);
     data_fd = Uopen(spool_name, O_RDWR|O_CREAT|O_EXCL, SPOOL_MODE);
@@ -3219,12 +3966,7 @@ are problems when Exim is run under Cygwin (I'm told). See comments in
 spool_in.c, where the same locking is done. */
 
 spool_data_file = fdopen(data_fd, "w+");
-lock_data.l_type = F_WRLCK;
-lock_data.l_whence = SEEK_SET;
-lock_data.l_start = 0;
-lock_data.l_len = spool_data_start_offset(message_id);
-
-if (fcntl(data_fd, F_SETLK, &lock_data) < 0)
+if (!spool_lock_datafile(data_fd, message_id))
   log_write(0, LOG_MAIN|LOG_PANIC_DIE, "Cannot lock %s (%d): %s", spool_name,
     errno, strerror(errno));
 
@@ -3232,16 +3974,37 @@ if (fcntl(data_fd, F_SETLK, &lock_data) < 0)
 self-identifying. Then read the remainder of the input of this message and
 write it to the data file. If the variable next != NULL, it contains the first
 data line (which was read as a header but then turned out not to have the right
-format); write it (remembering that it might contain binary zeros). The result
-of fwrite() isn't inspected; instead we call ferror() below. */
+format); write it (remembering that it might contain binary zeros), with a
+CRLF ending if the body is to be stored in wireformat. The result of fwrite()
+isn't inspected; instead we call ferror() below. */
+
+#ifndef DISABLE_DKIM
+/* The signatures are known now; start fetching their keys */
+if (smtp_input && !smtp_batched_input && !f.dkim_disable_verify)
+  dkim_exim_verify_prefetch();
+#endif
 
 fprintf(spool_data_file, "%s-D\n", message_id);
+
+#ifdef HAVE_LOCAL_SCAN
+/* Start passing the message to a policy service while the body arrives */
+local_scan_policy_start();
+#endif
+
 if (next)
   {
   uschar *s = next->text;
   int len = next->slen;
+  BOOL crlf = smtp_input && spool_wireformat && len > 0 && s[len-1] == '\n';
+
+  if (crlf) len--;
   if (fwrite(s, 1, len, spool_data_file) == len) /* "if" for compiler quietening */
     body_linecount++;                 /* Assumes only 1 line */
+  if (crlf)
+    {
+    fputs("\r\n", spool_data_file);
+    message_size++;
+    }
   }
 
 /* Note that we might already be at end of file, or the logical end of file
@@ -3253,7 +4016,8 @@ if (!ferror(spool_data_file) && !(receive_feof)() && message_ended != END_DOT)
   if (smtp_input)
     {
     message_ended = chunking_state <= CHUNKING_OFFERED
-      ? read_message_data_smtp(spool_data_file, first_line_ended_crlf)
+      ? read_message_data_smtp(spool_data_file, first_line_ended_crlf,
+	  spool_wireformat)
       : spool_wireformat
       ? read_message_bdat_smtp_wire(spool_data_file)
       : read_message_bdat_smtp(spool_data_file);
@@ -3337,8 +4101,15 @@ we can then give up. Note that for SMTP input we must swallow the remainder of
 the input in cases of output errors, since the far end doesn't expect to see
 anything until the terminating dot line is sent. */
 
+if (PHASE_TIMING)
+  {
+  metrics_phase(RP_DATA, &phase_start);
+  exim_gettime(&phase_start);
+  }
+
 if (fflush(spool_data_file) == EOF || ferror(spool_data_file) ||
-    EXIMfsync(fileno(spool_data_file)) < 0 || (receive_ferror)())
+    !spool_sync_deferred() && EXIMfsync(fileno(spool_data_file)) < 0 ||
+    (receive_ferror)())
   {
   uschar *msg_errno = US strerror(errno);
   BOOL input_error = (receive_ferror)() != 0;
@@ -3377,6 +4148,7 @@ if (fflush(spool_data_file) == EOF || ferror(spool_data_file) ||
 
 DEBUG(D_receive) debug_printf("Data file written for message %s\n", message_id);
 gettimeofday(&received_time_complete, NULL);
+if (PHASE_TIMING) metrics_phase(RP_SPOOL, &phase_start);
 
 
 /* If there were any bad addresses extracted by -t, or there were no recipients
@@ -3509,6 +4281,8 @@ else
 #ifndef DISABLE_DKIM
     if (!f.dkim_disable_verify)
       {
+      if (PHASE_TIMING) exim_gettime(&phase_start);
+
       /* Finish verification */
       dkim_exim_verify_finish();
 
@@ -3598,6 +4372,8 @@ else
         }
       else
 	dkim_exim_verify_log_all();
+
+      if (PHASE_TIMING) metrics_phase(RP_DKIM, &phase_start);
       }
 #endif /* DISABLE_DKIM */
 
@@ -3813,7 +4589,7 @@ if (sigsetjmp(local_scan_env, 1) == 0)
   had_local_scan_timeout = 0;
   os_non_restarting_signal(SIGALRM, local_scan_timeout_handler);
   if (local_scan_timeout > 0) ALARM(local_scan_timeout);
-  rc = local_scan(data_fd, &local_scan_data);
+  rc = local_scan_chain(data_fd, &local_scan_data);
   ALARM_CLR(0);
   os_non_restarting_signal(SIGALRM, sigalrm_handler);
 
@@ -3832,16 +4608,16 @@ else
   {
   if (had_local_scan_crash)
     {
-    log_write(0, LOG_MAIN|LOG_REJECT, "local_scan() function crashed with "
+    log_write(0, LOG_MAIN|LOG_REJECT, "%s crashed with "
       "signal %d - message temporarily rejected (size %d)",
-      had_local_scan_crash, message_size);
+      local_scan_stage, had_local_scan_crash, message_size);
     receive_bomb_out(US"local-scan-error", US"local verification problem");
     /* Does not return */
     }
   if (had_local_scan_timeout)
     {
-    log_write(0, LOG_MAIN|LOG_REJECT, "local_scan() function timed out - "
-      "message temporarily rejected (size %d)", message_size);
+    log_write(0, LOG_MAIN|LOG_REJECT, "%s timed out - "
+      "message temporarily rejected (size %d)", local_scan_stage, message_size);
     receive_bomb_out(US"local-scan-timeout", US"local verification problem");
     /* Does not return */
     }
@@ -3863,7 +4639,7 @@ if (rc == LOCAL_SCAN_ACCEPT_FREEZE)
     {
     f.deliver_freeze = TRUE;
     deliver_frozen_at = time(NULL);
-    frozen_by = US"local_scan()";
+    frozen_by = local_scan_by;
     }
   rc = LOCAL_SCAN_ACCEPT;
   }
@@ -3872,7 +4648,7 @@ else if (rc == LOCAL_SCAN_ACCEPT_QUEUE)
   if (!f.queue_only_policy)      /* ACL might have already queued */
     {
     f.queue_only_policy = TRUE;
-    queued_by = US"local_scan()";
+    queued_by = local_scan_by;
     }
   rc = LOCAL_SCAN_ACCEPT;
   }
@@ -3938,8 +4714,8 @@ else
   g = string_append(NULL, 2, US"F=", *sender_address ? sender_address : US"<>");
   g = add_host_info_for_log(g);
 
-  log_write(0, LOG_MAIN|LOG_REJECT, "%Y %srejected by local_scan(): %.256s",
-    g, istemp, string_printing(errmsg));
+  log_write(0, LOG_MAIN|LOG_REJECT, "%Y %srejected by %s: %.256s",
+    g, istemp, local_scan_by, string_printing(errmsg));
 
   if (smtp_input)
     if (!smtp_batched_input)
@@ -4025,13 +4801,34 @@ if (host_checking || blackholed_by)
     if (h->type != '*') msg_size += h->slen;
   }
 
-/* Write the -H file */
+/* Write the -H file, and make both files durable if that was deferred for
+spool_group_sync. With spool_dedup_size set, the body is final now and the data
+file can be shared with an earlier message's; if that goes wrong part way, the
+message is abandoned. */
 
 else
-  if ((msg_size = spool_write_header(message_id, SW_RECEIVING, &errmsg)) < 0)
+  {
+  int dedup = FAIL;
+
+  if (PHASE_TIMING) exim_gettime(&phase_start);
+  if (spool_dedup_size > 0)
+    if ((dedup = spool_dedup_datafile(message_id, &spool_data_file, &errmsg))
+	== OK)
+      deliver_datafile = data_fd = fileno(spool_data_file);
+    else if (dedup == DEFER)
+      msg_size = -1;
+
+  if (  dedup == DEFER
+     || (msg_size = spool_write_header(message_id, SW_RECEIVING, &errmsg)) < 0
+     || !spool_sync_received(message_id, fileno(spool_data_file), &errmsg))
     {
     log_write(0, LOG_MAIN, "Message abandoned: %s", errmsg);
     Uunlink(spool_name);           /* Lose the data file */
+    if (msg_size >= 0)             /* and the header file */
+      {
+      Uunlink(spool_fname(US"input", message_subdir, message_id, US"-H"));
+      queue_index_notify(NOTIFY_QUEUE_INDEX_DEL, queue_name, message_id, 0);
+      }
 
     if (smtp_input)
       {
@@ -4046,6 +4843,8 @@ else
       /* Does not return */
       }
     }
+  if (PHASE_TIMING) metrics_phase(RP_SPOOL, &phase_start);
+  }
 
 
 /* The message has now been successfully received. */
@@ -4164,6 +4963,9 @@ if (LOGGING(receive_time))
   g = string_append(g, 2, US" RT=", string_timediff(&diff));
   }
 
+if (LOGGING(receive_phases))
+  g = metrics_phases_log(g);
+
 if (*queue_name)
   g = string_append(g, 2, US" Q=", queue_name);
 
@@ -4220,49 +5022,33 @@ not put the zero in. */
 /* Create a message log file if message logs are being used and this message is
 not blackholed. Write the reception stuff to it. We used to leave message log
 creation until the first delivery, but this has proved confusing for some
-people. */
+people. With message_logs_lazy the lines are held in memory for the delivery
+process, unless the message is known to be staying on the queue, debugging is
+on, or the delivery will be done by a re-exec of Exim (which would lose them).
+The caller writes them with receive_msglog_write() if it decides to queue the
+message after all. */
 
 if (message_logs && !blackholed_by)
   {
-  int fd;
-  uschar * m_name = spool_fname(US"msglog", message_subdir, message_id, US"");
-
-  if (  (fd = Uopen(m_name, O_WRONLY|O_APPEND|O_CREAT, SPOOL_MODE)) < 0
-     && errno == ENOENT
-     )
-    {
-    (void)directory_make(spool_directory,
-			spool_sname(US"msglog", message_subdir),
-			MSGLOG_DIRECTORY_MODE, TRUE);
-    fd = Uopen(m_name, O_WRONLY|O_APPEND|O_CREAT, SPOOL_MODE);
-    }
-
-  if (fd < 0)
-    log_write(0, LOG_MAIN|LOG_PANIC, "Couldn't open message log %s: %s",
-      m_name, strerror(errno));
-  else
-    {
-    FILE *message_log = fdopen(fd, "a");
-    if (!message_log)
-      {
-      log_write(0, LOG_MAIN|LOG_PANIC, "Couldn't fdopen message log %s: %s",
-        m_name, strerror(errno));
-      (void)close(fd);
-      }
-    else
-      {
-      uschar * now = tod_stamp(tod_log);
-      /* Drop the initial "<= " */
-      fprintf(message_log, "%s Received from %s\n", now, g->s+3);
-      if (f.deliver_freeze) fprintf(message_log, "%s frozen by %s\n", now,
-        frozen_by);
-      if (f.queue_only_policy) fprintf(message_log,
-        "%s no immediate delivery: queued%s%s by %s\n", now,
-        *queue_name ? " in " : "", *queue_name ? CS queue_name : "",
-	queued_by);
-      (void)fclose(message_log);
-      }
-    }
+  uschar * now = tod_stamp(tod_log);
+  /* Drop the initial "<= " */
+  gstring * m = string_fmt_append(NULL, "%s Received from %s\n", now, g->s+3);
+
+  if (f.deliver_freeze)
+    m = string_fmt_append(m, "%s frozen by %s\n", now, frozen_by);
+  if (f.queue_only_policy)
+    m = string_fmt_append(m, "%s no immediate delivery: queued%s%s by %s\n",
+      now, *queue_name ? " in " : "", *queue_name ? CS queue_name : "",
+      queued_by);
+
+  receive_msglog_drop();
+  msglog_held = string_copy_malloc(string_from_gstring(m));
+  Ustrcpy(msglog_held_id, message_id);
+
+  if (  !message_logs_lazy || debug_selector
+     || f.deliver_freeze || f.queue_only_policy || queue_only
+     || (geteuid() != root_uid && !deliver_drop_privilege))
+    receive_msglog_write();
   }
 
 /* Everything has now been done for a successful message except logging its
@@ -4314,6 +5100,7 @@ if (  smtp_input && sender_host_address && !f.sender_host_notsocket
       Uunlink(spool_name);
       Uunlink(spool_fname(US"input", message_subdir, message_id, US"-H"));
       Uunlink(spool_fname(US"msglog", message_subdir, message_id, US""));
+      queue_index_notify(NOTIFY_QUEUE_INDEX_DEL, queue_name, message_id, 0);
 
       goto TIDYUP;
       }
@@ -4340,7 +5127,33 @@ if(cutthrough.cctx.sock >= 0 && cutthrough.delivery)
   {
   uschar * msg = cutthrough_finaldot();	/* Ask the target system to accept the message */
 					/* Logging was done in finaldot() */
-  switch(msg[0])
+
+  /* Partial cutthrough: some recipients were not on the connection so the
+  message stays on the spool and is accepted from the source whatever the
+  target said.  Record the ones the target took as done, and let the usual
+  immediate delivery do the rest (or all, on a reject). */
+
+  if (cutthrough.spooled)
+    {
+    if (msg[0] == '2')
+      {
+      for (address_item * a = &cutthrough.addr; a; a = a->next)
+	if (!a->parent)
+	  tree_add_nonrecipient(a->address);
+	else if (testflag(a, af_homonym))
+	  tree_add_nonrecipient(
+	    string_sprintf("%s/%s", a->unique + 3, a->transport->name));
+	else
+	  tree_add_nonrecipient(a->unique);
+      if (spool_write_header(message_id, SW_RECEIVING, &errmsg) < 0)
+	log_write(0, LOG_MAIN|LOG_PANIC,
+	  "failed to record cutthrough deliveries: %s", errmsg);
+      }
+    cancel_cutthrough_connection(TRUE, US"partial delivery");
+    cutthrough.partial = cutthrough.spooled = cutthrough.defer_pass = FALSE;
+    }
+
+  else switch(msg[0])
     {
     case '2':	/* Accept. Do the same to the source; dump any spoolfiles.   */
       cutthrough_done = ACCEPTED;
@@ -4375,6 +5188,52 @@ if(!smtp_reply)
 		(LOGGING(received_sender) ? LOG_SENDER : 0),
 	    "%Y", g);
 
+  /* The same, with typed fields, for the JSON log */
+
+  gstring * jg;
+  if ((jg = log_json_start(US"arrival")))
+    {
+    struct timeval diff = received_time_complete;
+
+    jg = log_json_str(jg, "sender", sender_address);
+    jg = string_catn(jg, US",\"recipients\":[", 15);
+    for (int i = 0; i < recipients_count; i++)
+      {
+      if (i > 0) jg = string_catn(jg, US",", 1);
+      jg = log_json_quote(jg, recipients_list[i].address);
+      }
+    jg = string_catn(jg, US"]", 1);
+    jg = log_json_int(jg, "size", msg_size);
+    jg = log_json_str(jg, "protocol", received_protocol);
+    if (sender_host_address)
+      {
+      jg = log_json_str(jg, "host_name", sender_host_name);
+      jg = log_json_str(jg, "host_address", sender_host_address);
+      jg = log_json_int(jg, "host_port", sender_host_port);
+      jg = log_json_str(jg, "helo", sender_helo_name);
+      }
+    jg = log_json_str(jg, "ident", sender_ident);
+    jg = log_json_str(jg, "auth", sender_host_authenticated);
+    jg = log_json_str(jg, "auth_id", authenticated_id);
+#ifndef DISABLE_TLS
+    if (tls_in.cipher)
+      {
+      jg = log_json_str(jg, "tls_cipher", tls_in.cipher);
+      jg = log_json_bool(jg, "tls_verified", tls_in.certificate_verified);
+      }
+#endif
+#ifndef DISABLE_DKIM
+    jg = log_json_str(jg, "dkim", dkim_verify_overall);
+#endif
+    if (*queue_name)
+      jg = log_json_str(jg, "queue", queue_name);
+    if (fake_response == FAIL)
+      jg = log_json_bool(jg, "fake_reject", TRUE);
+    timediff(&diff, &received_time);
+    jg = log_json_time(jg, "receive_time", &diff);
+    log_json_write(jg);
+    }
+
   /* Log any control actions taken by an ACL or local_scan(). */
 
   if (f.deliver_freeze) log_write(0, LOG_MAIN, "frozen by %s", frozen_by);
@@ -4447,6 +5306,7 @@ if (spool_data_file && cutthrough_done == NOT_TRIED)
     Uunlink(spool_name);
     Uunlink(spool_fname(US"input", message_subdir, message_id, US"-H"));
     Uunlink(spool_fname(US"msglog", message_subdir, message_id, US""));
+    queue_index_notify(NOTIFY_QUEUE_INDEX_DEL, queue_name, message_id, 0);
 
     /* Claim a data ACL temp-reject, just to get reject logging and response */
     if (smtp_input) smtp_handle_acl_fail(ACL_WHERE_DATA, rc, NULL, log_msg);
@@ -4533,6 +5393,7 @@ if (smtp_input)
 	Uunlink(spool_name);
 	Uunlink(spool_fname(US"input", message_subdir, message_id, US"-H"));
 	Uunlink(spool_fname(US"msglog", message_subdir, message_id, US""));
+	queue_index_notify(NOTIFY_QUEUE_INDEX_DEL, queue_name, message_id, 0);
 	break;
 
       case TMP_REJ:
@@ -4541,6 +5402,7 @@ if (smtp_input)
 	  Uunlink(spool_name);
 	  Uunlink(spool_fname(US"input", message_subdir, message_id, US"-H"));
 	  Uunlink(spool_fname(US"msglog", message_subdir, message_id, US""));
+	  queue_index_notify(NOTIFY_QUEUE_INDEX_DEL, queue_name, message_id, 0);
 	  }
       default:
 	break;
@@ -4554,7 +5416,7 @@ if (smtp_input)
 	}
       message_id[0] = 0;	  /* Prevent a delivery from starting */
       cutthrough.delivery = cutthrough.callout_hold_only = FALSE;
-      cutthrough.defer_pass = FALSE;
+      cutthrough.defer_pass = cutthrough.partial = FALSE;
       }
     }
 
@@ -4584,6 +5446,10 @@ if (blackholed_by)
   message_id[0] = 0;
   }
 
+#ifdef HAVE_LOCAL_SCAN
+local_scan_policy_abandon();	/* in case the verdict was never wanted */
+#endif
+
 /* Reset headers so that logging of rejects for a subsequent message doesn't
 include them. It is also important to set header_last = NULL before exiting
 from this function, as this prevents certain rewrites that might happen during
@@ -4591,6 +5457,7 @@ subsequent verifying (of another incoming message) from trying to add headers
 when they shouldn't. */
 
 header_list = header_last = NULL;
+header_index_reset();
 
 return yield;  /* TRUE if more messages (SMTP only) */
 }
@@ -21,18 +21,111 @@
 typedef struct pcre_list {
   const pcre2_code *	re;
   uschar *		pcre_text;
+  BOOL			combined;	/* included in the prefilter */
   struct pcre_list *	next;
 } pcre_list;
 
+/* Prefilters for cacheable lists, indexed by the list */
+static tree_node * prefilter_cache = NULL;
+
 uschar regex_match_string_buffer[1024];
 
 extern FILE *mime_stream;
 extern uschar *mime_current_boundary;
 
 
+/* Check whether a pattern can be made part of an alternation without
+changing what it matches. Anything that refers to groups by number, or that
+could extend past the end of its own group, is excluded. */
+
+static BOOL
+combinable(const uschar * re)
+{
+for (const uschar * s = re; *s; s++)
+  if (*s == '\\')
+    {
+    if (isdigit(s[1]) || Ustrchr("gkQ", s[1])) return FALSE;
+    if (s[1]) s++;
+    }
+  else if (*s == '(' && (s[1] == '*' || (s[1] == '?'
+	    && !Ustrchr(":=!", s[2])
+	    && !(s[2] == '<' && (s[3] == '=' || s[3] == '!'))
+	    && !(s[2] == 'i' && (s[3] == ')' || s[3] == ':')))))
+    return FALSE;
+return TRUE;
+}
+
+
+/* Build a single pattern which matches wherever any of the combinable
+patterns on a list would, so that text it does not match need only be tested
+against the rest.
+
+Arguments:
+  list        the list, as given
+  head        the compiled patterns
+  cacheable   the list has no dynamic parts
+
+Returns:      the prefilter, or NULL if there is none
+*/
+
+static const pcre2_code *
+prefilter(const uschar * list, pcre_list * head, BOOL cacheable)
+{
+gstring * g = NULL;
+int count = 0, err, old_pool;
+PCRE2_SIZE offset;
+const pcre2_code * cre;
+tree_node * t;
+
+if (regex_combine_min <= 0) return NULL;
+if (cacheable && (t = tree_search(prefilter_cache, list)))
+  {
+  cre = t->data.ptr;
+  if (cre)		/* mark the same patterns as when it was built */
+    for (pcre_list * ri = head; ri; ri = ri->next)
+      ri->combined = combinable(ri->pcre_text);
+  return cre;
+  }
+
+for (pcre_list * ri = head; ri; ri = ri->next)
+  if (combinable(ri->pcre_text)) count++;
+if (count >= regex_combine_min)
+  for (pcre_list * ri = head; ri; ri = ri->next)
+    if ((ri->combined = combinable(ri->pcre_text)))
+      g = string_fmt_append(g, "%s(?:%s)", g ? "|" : "", ri->pcre_text);
+
+old_pool = store_pool;
+store_pool = POOL_PERM;
+if (!g)
+  cre = NULL;
+else if (!(cre = pcre2_compile((PCRE2_SPTR)string_from_gstring(g),
+		    gstring_length(g), PCRE_COPT|PCRE2_NO_AUTO_CAPTURE,
+		    &err, &offset, pcre_gen_cmp_ctx)))
+  {
+  DEBUG(D_acl) debug_printf_indent("regex prefilter not compiled (error %d)\n",
+    err);
+  for (pcre_list * ri = head; ri; ri = ri->next) ri->combined = FALSE;
+  }
+else
+  DEBUG(D_acl) debug_printf_indent("regex prefilter built from %d of the "
+    "patterns\n", count);
+
+if (cacheable)
+  {
+  t = store_get(sizeof(tree_node) + Ustrlen(list), list);
+  Ustrcpy(t->name, list);
+  t->data.ptr = (void *)cre;
+  (void) tree_insertnode(&prefilter_cache, t);
+  }
+store_pool = old_pool;
+return cre;
+}
+
+
 static pcre_list *
-compile(const uschar * list, BOOL cacheable)
+compile(const uschar * list, BOOL cacheable, const pcre2_code ** pfp)
 {
+const uschar * whole = list;
 int sep = 0;
 uschar * regex_string;
 pcre_list * re_list_head = NULL;
@@ -56,21 +149,35 @@ while ((regex_string = string_nextinlist(&list, &sep, NULL, 0)))
     ri = store_get(sizeof(pcre_list), GET_UNTAINTED);
     ri->re = re;
     ri->pcre_text = regex_string;
+    ri->combined = FALSE;
     ri->next = re_list_head;
     re_list_head = ri;
     }
+*pfp = prefilter(whole, re_list_head, cacheable);
 return re_list_head;
 }
 
 static int
-matcher(pcre_list * re_list_head, uschar * linebuffer, int len)
+matcher(pcre_list * re_list_head, const pcre2_code * pf, uschar * linebuffer,
+  int len)
 {
 pcre2_match_data * md = pcre2_match_data_create(REGEX_VARS + 1, pcre_gen_ctx);
+BOOL skip_combined;
+
+/* If the prefilter does not match, none of the patterns it was made from can
+match, and only the others need to be tried. An error from it is treated as a
+possible match. */
+
+skip_combined = pf
+  && pcre2_match(pf, (PCRE2_SPTR)linebuffer, len, 0, 0, md, pcre_gen_mtc_ctx)
+     == PCRE2_ERROR_NOMATCH;
 
 for (pcre_list * ri = re_list_head; ri; ri = ri->next)
   {
   int n;
 
+  if (skip_combined && ri->combined) continue;
+
   /* try matcher on the line */
   if ((n = pcre2_match(ri->re, (PCRE2_SPTR)linebuffer, len, 0, 0, md, pcre_gen_mtc_ctx)) > 0)
     {
@@ -104,12 +211,38 @@ for (int i = 0; i < REGEX_VARS; i++) regex_vars[i] = NULL;
 
 
 
+/* Match against the lines of a copy of the message in memory, each being
+taken as fgets() would give it with the buffer used for the file, and as
+with that, ending at a NUL. */
+
+static int
+regex_memory(pcre_list * re_list_head, const pcre2_code * pf,
+  const uschar * text, unsigned long size)
+{
+const uschar * end = text + size;
+
+while (text < end)
+  {
+  const uschar * nl = memchr(text, '\n', end - text);
+  int len = nl ? nl + 1 - text : end - text;
+
+  if (len > 32766) len = 32766;
+  if (matcher(re_list_head, pf, US text, (int)strnlen(CCS text, len)) == OK)
+    return OK;
+  text += len;
+  }
+return FAIL;
+}
+
+
 int
 regex(const uschar ** listptr, BOOL cacheable)
 {
 unsigned long mbox_size;
 FILE * mbox_file;
+const uschar * mbox_text;
 pcre_list * re_list_head;
+const pcre2_code * pf;
 uschar * linebuffer;
 long f_pos = 0;
 int ret = FAIL;
@@ -118,6 +251,10 @@ regex_vars_clear();
 
 if (!mime_stream)				/* We are in the DATA ACL */
   {
+  if ((mbox_text = spool_mbox_memory(&mbox_size)))
+    return (re_list_head = compile(*listptr, cacheable, &pf))
+      ? regex_memory(re_list_head, pf, mbox_text, mbox_size) : FAIL;
+
   if (!(mbox_file = spool_mbox(&mbox_size, NULL, NULL)))
     {						/* error while spooling */
     log_write(0, LOG_MAIN|LOG_PANIC,
@@ -137,7 +274,7 @@ else
   }
 
 /* precompile our regexes */
-if (!(re_list_head = compile(*listptr, cacheable)))
+if (!(re_list_head = compile(*listptr, cacheable, &pf)))
   return FAIL;			/* no regexes -> nothing to do */
 
 /* match each line against all regexes */
@@ -150,7 +287,7 @@ while (fgets(CS linebuffer, 32767, mbox_file))
 		  Ustrlen(mime_current_boundary)) == 0)
       break;						/* found boundary */
 
-  if ((ret = matcher(re_list_head, linebuffer, (int)Ustrlen(linebuffer))) == OK)
+  if ((ret = matcher(re_list_head, pf, linebuffer, (int)Ustrlen(linebuffer))) == OK)
     goto done;
   }
 /* no matches ... */
@@ -177,6 +314,7 @@ int
 mime_regex(const uschar **listptr, BOOL cacheable)
 {
 pcre_list * re_list_head = NULL;
+const pcre2_code * pf;
 FILE * f;
 uschar * mime_subject = NULL;
 int mime_subject_len = 0;
@@ -185,15 +323,15 @@ int ret;
 regex_vars_clear();
 
 /* precompile our regexes */
-if (!(re_list_head = compile(*listptr, cacheable)))
+if (!(re_list_head = compile(*listptr, cacheable, &pf)))
   return FAIL;			/* no regexes -> nothing to do */
 
-/* check if the file is already decoded */
-if (!mime_decoded_filename)
+/* check if the part is already decoded */
+if (!mime_decoded_filename && !mime_decoded_memory(NULL))
   {				/* no, decode it first */
   const uschar *empty = US"";
   mime_decode(&empty);
-  if (!mime_decoded_filename)
+  if (!mime_decoded_filename && !mime_decoded_memory(NULL))
     {				/* decoding failed */
     log_write(0, LOG_MAIN,
        "mime_regex acl condition warning - could not decode MIME part to file");
@@ -201,6 +339,11 @@ if (!mime_decoded_filename)
     }
   }
 
+/* decoded into memory: use the start of that */
+if ((mime_subject = mime_decoded_memory(&mime_subject_len)))
+  return matcher(re_list_head, pf, mime_subject,
+		  mime_subject_len > 32766 ? 32766 : mime_subject_len);
+
 /* open file */
 if (!(f = fopen(CS mime_decoded_filename, "rb")))
   {
@@ -215,7 +358,7 @@ mime_subject = store_get(32767, GET_TAINTED);
 
 mime_subject_len = fread(mime_subject, 1, 32766, f);
 
-ret = matcher(re_list_head, mime_subject, mime_subject_len);
+ret = matcher(re_list_head, pf, mime_subject, mime_subject_len);
 (void)fclose(f);
 return ret;
 }
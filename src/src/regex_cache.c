@@ -19,6 +19,13 @@ This is a fire-and-forget send with no response, hence cheap from the point-of
 view of the sender.  I have not measured the overall comms costs.  The
 daemon also compiles the RE, and caches the result.
 
+The daemon also compiles, at startup, the constant REs it can find in the
+configuration: the second argument of every "match" expansion condition, the
+lists of the ACL regex conditions, RE items of named domain and host lists, and
+RE rewrite patterns.  Cached REs are JIT-compiled where PCRE2 supports it, and
+the JIT code is inherited along with the rest of the cache.  The counts of
+cache hits and misses in a process are available as expansion variables.
+
 A second layer would be possible by asking the daemon via the notifier socket
 (for a result from its cache, or a compile if it must).  The comms overhead
 is significant, not only for the channel but also for de/serialisation of
@@ -85,10 +92,33 @@ DEBUG(D_expand|D_lists)
   debug_printf_indent("compiled %sRE '%s' %sfound in local cache\n",
 		      caseless ? "caseless " : "", key, node ? "" : "not ");
 
+if (node) regex_cache_hits++; else regex_cache_misses++;
 return node ? node->data.ptr : NULL;
 }
 
 
+/* JIT-compile an RE that is going into the cache.  The first time, give the
+match context a JIT stack big enough that JIT matching does not fail where
+the interpreter would succeed.  A failure (eg. no JIT support in the PCRE2
+library) just leaves the RE interpreted. */
+
+static void
+regex_jit(const pcre2_code * cre)
+{
+#ifdef PCRE2_JIT_COMPLETE
+static BOOL stack_done = FALSE;
+
+if (pcre2_jit_compile((pcre2_code *)cre, PCRE2_JIT_COMPLETE) != 0) return;
+if (!stack_done)
+  {
+  pcre2_jit_stack * js = pcre2_jit_stack_create(32*1024, 1024*1024, NULL);
+  if (js) pcre2_jit_stack_assign(pcre_gen_mtc_ctx, NULL, js);
+  stack_done = TRUE;
+  }
+#endif
+}
+
+
 static void
 regex_to_cache(const uschar * key, BOOL caseless, const pcre2_code * cre)
 {
@@ -97,6 +127,7 @@ regex_to_cache(const uschar * key, BOOL caseless, const pcre2_code * cre)
 tree_node * node = store_get(sizeof(tree_node) + Ustrlen(key) + 1, key);
 Ustrcpy(node->name, key);
 node->data.ptr = (void *)cre;
+regex_jit(cre);
 
 if (!tree_insertnode(caseless ? &regex_caseless_cache : &regex_cache, node))
   { DEBUG(D_expand|D_lists) debug_printf_indent("duplicate key!\n"); }
@@ -249,3 +280,147 @@ else if ((cre = regex_compile(req->re,
 DEBUG(D_any) if (!cre) debug_printf("%s\n", errstr);
 return;
 }
+
+
+
+/******************************************************************************/
+/* Compiling the configuration's constant REs in the daemon */
+
+static void
+regex_prewarm_one(const uschar * re, BOOL caseless)
+{
+uschar * errstr;
+
+if (  regex_cachesize < REGEX_CACHESIZE_LIMIT
+   && !tree_search(caseless ? regex_caseless_cache : regex_cache, re)
+   && regex_compile(re, caseless ? MCS_CASELESS|MCS_CACHEABLE : MCS_CACHEABLE,
+		    &errstr, pcre_gen_cmp_ctx))
+  regex_cachesize++;
+}
+
+
+/* Expand a string that has no expansion items, as it will be at run time,
+giving NULL for one that has.  Anything with an unescaped dollar is refused
+before expansion, so that no lookups or commands are run in the daemon. */
+
+static const uschar *
+regex_constant(const uschar * s)
+{
+BOOL textonly;
+
+for (const uschar * t = s; *t; t++)
+  if (*t == '\\' && t[1] == 'N')
+    {
+    for (t += 2; *t && !(*t == '\\' && t[1] == 'N'); ) t++;
+    if (!*t++) return NULL;
+    }
+  else if (*t == '\\') { if (!*++t) return NULL; }
+  else if (*t == '$') return NULL;
+
+return !(s = expand_string_2(s, &textonly)) || !textonly ? NULL : s;
+}
+
+
+/* Find the end of a braced argument, allowing for backslash quoting and
+\N...\N.  Return a pointer to the closing brace, or NULL. */
+
+static const uschar *
+regex_arg_end(const uschar * s)
+{
+int depth = 0;
+for ( ; *s; s++)
+  if (*s == '\\' && s[1] == 'N')
+    {
+    for (s += 2; *s && !(*s == '\\' && s[1] == 'N'); ) s++;
+    if (!*s++) return NULL;
+    }
+  else if (*s == '\\') { if (!*++s) return NULL; }
+  else if (*s == '{') depth++;
+  else if (*s == '}' && --depth == 0) return s;
+return NULL;
+}
+
+
+/* Find each "match" condition in a string whose RE argument is constant.
+Anything that looks like one but is not does no harm; at worst a string that
+is not an RE fails to compile. */
+
+void
+regex_prewarm_string(const uschar * string)
+{
+const uschar * s = string;
+
+while ((s = Ustrstr(s, "match")))
+  {
+  const uschar * start = s, * e, * re;
+
+  s += 5;
+  if (start > string && (isalnum(start[-1]) || start[-1] == '_')) continue;
+  Uskip_whitespace(&s);
+  if (*s != '{' || !(e = regex_arg_end(s))) continue;
+  s = e + 1;
+  Uskip_whitespace(&s);
+  if (*s != '{' || !(e = regex_arg_end(s))) continue;
+  if ((re = regex_constant(string_copyn(s + 1, e - s - 1))))
+    regex_prewarm_one(re, FALSE);
+  s = e + 1;
+  }
+}
+
+
+/* Items of a list; for named lists only those that are REs */
+
+static void
+regex_prewarm_items(const uschar * list, BOOL named)
+{
+int sep = 0;
+uschar * item;
+
+if (!(list = regex_constant(list))) return;
+while ((item = string_nextinlist(&list, &sep, NULL, 0)))
+  if (!named)
+    regex_prewarm_one(item, FALSE);
+  else
+    {
+    if (*item == '!') while (isspace(*++item)) ;
+    if (*item == '^') regex_prewarm_one(item, TRUE);
+    }
+}
+
+/* The list for an ACL regex condition */
+
+void
+regex_prewarm_list(const uschar * list)
+{
+regex_prewarm_items(list, FALSE);
+}
+
+static void
+regex_prewarm_named(uschar * name, uschar * data, void * ctx)
+{
+regex_prewarm_items(((namedlist_block *)data)->string, TRUE);
+}
+
+
+/* Called by the daemon once its configuration is complete.  Forked
+processes then find these REs in the cache. */
+
+void
+regex_prewarm(void)
+{
+rmark reset_point = store_mark();
+int before = regex_cachesize;
+const uschar * re;
+
+readconf_walk_strings(regex_prewarm_string);
+acl_prewarm_regex();
+tree_walk(domainlist_anchor, regex_prewarm_named, NULL);
+tree_walk(hostlist_anchor, regex_prewarm_named, NULL);
+for (rewrite_rule * r = global_rewrite_rules; r; r = r->next)
+  if (*r->key == '^' && (re = regex_constant(r->key)))
+    regex_prewarm_one(re, FALSE);
+
+DEBUG(D_any) debug_printf("compiled %d REs from the configuration\n",
+  regex_cachesize - before);
+store_reset(reset_point);
+}
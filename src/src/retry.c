@@ -153,13 +153,13 @@ host_key = include_ip_address
 
 message_key = string_sprintf("%s:%s", host_key, message_id);
 
-/* Search the tree of unusable IP addresses. This is filled in when deliveries
+/* Search the set of unusable IP addresses. This is filled in when deliveries
 fail, because the retry database itself is not updated until the end of all
 deliveries (so as to do it all in one go). The tree records addresses that have
 become unusable during this delivery process (i.e. those that will get put into
 the retry database when it is updated). */
 
-if ((node = tree_search(tree_unusable, host_key)))
+if ((node = hset_search(&hset_unusable, host_key)))
   {
   DEBUG(D_transport|D_retry) debug_printf("found in tree of unusables\n");
   host->status = (node->data.val > 255)?
@@ -523,7 +523,17 @@ retry_update(address_item ** addr_defer, address_item ** addr_failed,
 {
 open_db dbblock;
 open_db *dbm_file = NULL;
+BOOL txn = FALSE;
 time_t now = time(NULL);
+gstring * g;
+#ifndef DISABLE_QUEUE_RAMP
+typedef struct recovered {
+  struct recovered *	next;
+  const uschar *	tpname;
+  const uschar *	hostname;
+} recovered;
+recovered * recovered_hosts = NULL;
+#endif
 
 DEBUG(D_retry) debug_printf("Processing retry items\n");
 
@@ -573,21 +583,28 @@ for (int i = 0; i < 3; i++)
         retry_config *retry;
         dbdata_retry *retry_record;
 
+        /* Items for hosts skipped because their retry time had not come are
+        there only for retry_next_attempt(); they are not updates. */
+
+        if (rti->flags & rf_skipped) continue;
+
         /* Open the retry database if it is not already open; failure to open
         the file is logged, but otherwise ignored - deferred addresses will
         get retried at the next opportunity. Not opening earlier than this saves
         opening if no addresses have retry items - common when none have yet
-        reached their retry next try time. */
-
-        if (!dbm_file)
-          dbm_file = dbfn_open(US"retry", O_RDWR, &dbblock, TRUE, TRUE);
+        reached their retry next try time. The updates for all the addresses
+        are applied together, where the DB supports it. */
 
         if (!dbm_file)
-          {
-          DEBUG(D_deliver|D_retry|D_hints_lookup)
-            debug_printf("retry database not available for updating\n");
-          return;
-          }
+	  {
+          if (!(dbm_file = dbfn_open(US"retry", O_RDWR, &dbblock, TRUE, TRUE)))
+	    {
+	    DEBUG(D_deliver|D_retry|D_hints_lookup)
+	      debug_printf("retry database not available for updating\n");
+	    return;
+	    }
+	  txn = dbfn_transaction_start(dbm_file);
+	  }
 
         /* If there are no deferred addresses, that is, if this message is
         completing, and the retry item is for a message-specific SMTP error,
@@ -608,6 +625,29 @@ for (int i = 0; i < 3; i++)
           (void)dbfn_delete(dbm_file, rti->key);
           DEBUG(D_retry)
             debug_printf("deleted retry information for %s\n", rti->key);
+
+#ifndef DISABLE_QUEUE_RAMP
+	  /* A host that had been failing has taken a delivery. Note it, so
+	  that messages waiting for it can be started once we are done here. */
+
+	  if (  i == 0 && rti->flags & rf_host && queue_run_on_recovery > 0
+	     && addr->transport && addr->host_used)
+	    {
+	    recovered * r;
+	    for (r = recovered_hosts; r; r = r->next)
+	      if (  Ustrcmp(r->hostname, addr->host_used->name) == 0
+		 && Ustrcmp(r->tpname, addr->transport->name) == 0)
+		break;
+	    if (!r)
+	      {
+	      r = store_get(sizeof(recovered), GET_UNTAINTED);
+	      r->tpname = addr->transport->name;
+	      r->hostname = addr->host_used->name;
+	      r->next = recovered_hosts;
+	      recovered_hosts = r;
+	      }
+	    }
+#endif
           continue;
           }
 
@@ -901,6 +941,16 @@ for (int i = 0; i < 3; i++)
             addr->parent ? addr->parent->address : US"",
             addr->parent ? US">" : US"");
 
+          if ((g = log_json_start(US"fail")))
+            {
+            g = log_json_str(g, "recipient", addr->address);
+            if (addr->parent)
+              g = log_json_str(g, "original", addr->parent->address);
+            g = log_json_str(g, "sender", sender_address);
+            g = log_json_str(g, "message", addr->message);
+            log_json_write(g);
+            }
+
           if (addr == endaddr) break;
           }
 
@@ -926,9 +976,143 @@ for (int i = 0; i < 3; i++)
 
 /* Close and unlock the database */
 
-if (dbm_file) dbfn_close(dbm_file);
+if (dbm_file)
+  {
+  if (txn) dbfn_transaction_commit(dbm_file);
+  dbfn_close(dbm_file);
+  }
+
+#ifndef DISABLE_QUEUE_RAMP
+for (recovered * r = recovered_hosts; r; r = r->next)
+  transport_kick_waiting(r->tpname, r->hostname, queue_run_on_recovery);
+#endif
 
 DEBUG(D_retry) debug_printf("end of retry processing\n");
 }
 
+
+
+
+/*************************************************
+*    Find when a deferred message is next due    *
+*************************************************/
+
+/* Find how long one retry record holds up a delivery: until its next try
+time, but no later than the point where the message has been on the queue for
+longer than the final cutoff of the relevant retry rule, as the address is
+then allowed through to time out.
+
+Arguments:
+  dbm_file      the open retry database
+  key           the retry key
+  domain        the domain, for finding the retry rule
+  now           the time
+
+Returns:        the time, or zero if the record does not hold up a delivery
+*/
+
+static time_t
+retry_record_wait(open_db * dbm_file, const uschar * key, const uschar * domain,
+  time_t now)
+{
+dbdata_retry * retry_record;
+retry_config * retry;
+time_t t;
+
+if (  !key
+   || !(retry_record = dbfn_read(dbm_file, key))
+   || now - retry_record->time_stamp > retry_data_expire
+   || now >= (t = retry_record->next_try)
+   || !(retry = retry_find_config(key+2, domain,
+		retry_record->basic_errno, retry_record->more_errno))
+   || !retry->rules)
+  return 0;
+
+for (retry_rule * rule = retry->rules; ; rule = rule->next)
+  if (!rule->next)
+    {
+    time_t cutoff = received_time.tv_sec + rule->timeout;
+    if (cutoff < t) t = cutoff;
+    break;
+    }
+return t > now ? t : 0;
+}
+
+
+/* This is used for queue_run_retry_skip, after a delivery attempt in which
+every deferred address was held up by retry data, so that nothing was tried.
+It finds the earliest time at which any of the addresses might be tried again.
+
+Addresses whose routing was deferred have domain and address retry records
+that hold them up (as checked in deliver.c). Remote addresses for which
+the transport found no host to try have items, flagged rf_skipped, for the
+records of the hosts it skipped; these are on the first address of a batch.
+Any other kind of deferral means that the time cannot be known.
+
+Arguments:
+  addr_defer    the chain of deferred addresses
+
+Returns:        the time, or zero if there is none
+*/
+
+time_t
+retry_next_attempt(address_item * addr_defer)
+{
+open_db dbblock, * dbm_file;
+time_t now = time(NULL), yield = 0;
+
+if (continue_hostname || !addr_defer
+   || !(dbm_file = dbfn_open(US"retry", O_RDONLY, &dbblock, FALSE, TRUE)))
+  return 0;
+
+for (address_item * addr = addr_defer; addr; addr = addr->next)
+  {
+  time_t t = 0;
+
+  if (addr->basic_errno == ERRNO_RRETRY)
+    {
+    time_t ta = retry_record_wait(dbm_file, addr->address_retry_key,
+				  addr->domain, now);
+    dbdata_retry * dr;
+
+    if (!ta && addr->address_retry_key)
+      ta = retry_record_wait(dbm_file,
+	    string_sprintf("%s:<%s>", addr->address_retry_key, sender_address),
+	    addr->domain, now);
+
+    /* An expired domain record does not hold up routing */
+
+    if (  addr->domain_retry_key
+       && (dr = dbfn_read(dbm_file, addr->domain_retry_key))
+       && !dr->expired)
+      t = retry_record_wait(dbm_file, addr->domain_retry_key,
+				  addr->domain, now);
+    if (ta > t) t = ta;
+    }
+
+  else if (addr->basic_errno == ERRNO_HRETRY)
+    {
+    address_item * top = addr->first ? addr->first : addr;
+
+    for (retry_item * rti = top->retries; rti; rti = rti->next)
+      {
+      time_t th;
+      if (  !(rti->flags & rf_skipped)
+	 || !(th = retry_record_wait(dbm_file, rti->key, addr->domain, now)))
+	{ t = 0; break; }
+      if (!t || th < t) t = th;
+      }
+    }
+
+  DEBUG(D_retry) debug_printf("%s: next attempt %s\n", addr->address,
+    t ? string_sprintf("in %s", readconf_printtime(t - now)) : US"unknown");
+
+  if (!t) { yield = 0; break; }
+  if (!yield || t < yield) yield = t;
+  }
+
+dbfn_close(dbm_file);
+return yield;
+}
+
 /* End of retry.c */
@@ -47,6 +47,207 @@ static where_list_block where_list[] = {
 
 static int where_list_size = sizeof(where_list)/sizeof(where_list_block);
 
+/* A chain of rewriting rules is indexed, on first use, by the domain of each
+rule whose pattern is a plain local part and literal domain. An address then
+need be tried only against the rules for its domain and the rules whose
+patterns could match any domain, taken together in chain order. Each index
+also remembers addresses that no rule matched, so that an address that is
+seen again (in several headers, say) is not checked again. That is done only
+when none of the rules tried have patterns needing expansion, and when none
+of the matches deferred. */
+
+typedef struct rewrite_ref {
+  struct rewrite_ref *	next;
+  rewrite_rule *	rule;
+  int			number;		/* position in the chain, from 1 */
+  BOOL			dynamic;	/* pattern is expanded */
+} rewrite_ref;
+
+typedef struct rewrite_index {
+  struct rewrite_index * next;
+  const rewrite_rule *	rules;		/* the chain indexed */
+  hash_set		domains;	/* literal domain => rewrite_ref chain */
+  rewrite_ref *		others;		/* rules for any domain */
+  hash_set		unchanged;	/* addresses not rewritten => flags */
+} rewrite_index;
+
+/* Place in an indexed walk of a chain */
+
+typedef struct rewrite_cursor {
+  rewrite_index *	ix;		/* NULL to walk the whole chain */
+  rewrite_rule *	rule;		/* current rule */
+  rewrite_ref *		ref;		/* its index entry */
+  int			number;		/* its position */
+  rewrite_ref *		dom;		/* next rule for the domain */
+  rewrite_ref *		other;		/* next rule for any domain */
+  const uschar *	domain;		/* domain "dom" is for */
+} rewrite_cursor;
+
+#define REWRITE_MEMO_MAX 1024
+
+static rewrite_index * rewrite_indexes = NULL;
+
+
+
+/*************************************************
+*         Index a chain of rewriting rules       *
+*************************************************/
+
+/* Find the literal domain of a rule pattern, if it has one. Regexes, lookups,
+named lists, negations and patterns needing expansion do not, nor do domains
+with wildcards or special forms.
+
+Argument:  the rule's pattern
+Returns:   the domain, or NULL
+*/
+
+static const uschar *
+rewrite_key_domain(const uschar * key)
+{
+const uschar * d;
+
+if (  *key == '^' || *key == '!' || *key == '+'
+   || Ustrpbrk(key, "$\\;\"")
+   || !(d = Ustrrchr(key, '@')) || !*++d)
+  return NULL;
+for (const uschar * s = d; *s; s++)
+  if (!isalnum(*s) && *s != '.' && *s != '-' && *s != '_')
+    return NULL;
+return d;
+}
+
+/* Turn each domain's chain, built backwards, into chain order */
+
+static void
+rewrite_index_reverse(uschar * name, uschar * data, void * ctx)
+{
+tree_node * t = hset_search(ctx, name);
+rewrite_ref * r = (rewrite_ref *)data, * rev = NULL;
+
+while (r)
+  {
+  rewrite_ref * next = r->next;
+  r->next = rev;
+  rev = r;
+  r = next;
+  }
+t->data.ptr = rev;
+}
+
+/* Find or make the index of a chain. It lasts for the life of the process,
+like the rules.
+
+Argument:  the chain of rules
+Returns:   the index
+*/
+
+static rewrite_index *
+rewrite_index_get(rewrite_rule * rules)
+{
+rewrite_index * ix;
+rewrite_ref ** otail;
+int old_pool = store_pool, ndom = 0, n = 1;
+
+for (ix = rewrite_indexes; ix; ix = ix->next)
+  if (ix->rules == rules) return ix;
+
+store_pool = POOL_PERM;
+ix = store_get(sizeof(rewrite_index), GET_UNTAINTED);
+ix->rules = rules;
+ix->domains = ix->unchanged = (hash_set){.perm = TRUE};
+ix->others = NULL;
+otail = &ix->others;
+
+for (rewrite_rule * rule = rules; rule; rule = rule->next, n++)
+  {
+  rewrite_ref * r = store_get(sizeof(rewrite_ref), GET_UNTAINTED);
+  const uschar * d = rewrite_key_domain(rule->key);
+
+  r->rule = rule;
+  r->number = n;
+  r->dynamic = !!Ustrchr(rule->key, '$');
+
+  if (d)
+    {
+    tree_node * t = hset_search(&ix->domains, d);
+    if (!t)
+      {
+      t = store_get(sizeof(tree_node) + Ustrlen(d), GET_UNTAINTED);
+      Ustrcpy(t->name, d);
+      t->data.ptr = NULL;
+      (void) hset_insert(&ix->domains, t);
+      }
+    r->next = t->data.ptr;
+    t->data.ptr = r;
+    ndom++;
+    }
+  else
+    {
+    r->next = NULL;
+    *otail = r;
+    otail = &r->next;
+    }
+  }
+hset_walk(&ix->domains, rewrite_index_reverse, &ix->domains);
+
+ix->next = rewrite_indexes;
+rewrite_indexes = ix;
+store_pool = old_pool;
+
+DEBUG(D_rewrite) debug_printf("rewrite rules indexed: %d by %u domains, %d other\n",
+  ndom, ix->domains.count, n - 1 - ndom);
+return ix;
+}
+
+/* Step to the next rule to try for the subject. When the subject's domain
+has changed, after a rewrite, the rules for the new domain are found.
+
+Arguments:
+  c         the cursor
+  rules     the chain of rules
+  subject   the (current) address being rewritten
+
+Returns:    the next rule, or NULL at the end
+*/
+
+static rewrite_rule *
+rewrite_next(rewrite_cursor * c, rewrite_rule * rules, const uschar * subject)
+{
+const uschar * domain;
+rewrite_ref * r;
+
+if (!c->ix)
+  {
+  c->rule = c->rule ? c->rule->next : rules;
+  c->number++;
+  return c->rule;
+  }
+
+if ((domain = Ustrrchr(subject, '@'))) domain++;
+else domain = US"";
+if (!c->domain || strcmpic(c->domain, domain) != 0)
+  {
+  uschar * lc = string_copylc(domain);
+  tree_node * t = hset_search(&c->ix->domains, lc);
+
+  c->domain = lc;
+  for (c->dom = t ? t->data.ptr : NULL; c->dom && c->dom->number <= c->number; )
+    c->dom = c->dom->next;
+  }
+
+if (!c->dom && !c->other) return c->rule = NULL;
+if (!c->other || (c->dom && c->dom->number < c->other->number))
+  { r = c->dom; c->dom = r->next; }
+else
+  { r = c->other; c->other = r->next; }
+
+c->ref = r;
+c->number = r->number;
+return c->rule = r->rule;
+}
+
+
+
 
 
 /*************************************************
@@ -105,18 +306,38 @@ rewrite_one(const uschar *s, int flag, BOOL *whole, BOOL add_header, uschar *nam
 const uschar *yield = s;
 const uschar *subject = s;
 uschar *domain = NULL;
-BOOL done = FALSE;
-int rule_number = 1;
+tree_node *known = NULL;
+BOOL done = FALSE, memo;
 int yield_start = 0, yield_end = 0;
+rewrite_cursor c = {0};
 
 if (whole) *whole = FALSE;
 
+/* Other than for SMTP-time rewriting, which matches the whole subject, use the
+index of the rules, and see whether this address is known not to be
+rewritten. */
+
+if (!(flag & rewrite_smtp) && Ustrchr(s, '@'))
+  {
+  c.ix = rewrite_index_get(rewrite_rules);
+  c.other = c.ix->others;
+  if (  (known = hset_search(&c.ix->unchanged, s))
+     && (known->data.val & flag) == flag)
+    {
+    DEBUG(D_rewrite) debug_printf("%s: known not rewritten\n", s);
+    return s;
+    }
+  }
+memo = !!c.ix;
+
 /* Scan the rewriting rules, ignoring any without matching flag */
 
-for (rewrite_rule * rule = rewrite_rules;
+for (rewrite_rule * rule = rewrite_next(&c, rewrite_rules, subject);
      rule && !done;
-     rule_number++, rule = rule->next) if (rule->flags & flag)
+     rule = rewrite_next(&c, rewrite_rules, subject)) if (rule->flags & flag)
   {
+  int rule_number = c.number;
+  int rc;
   int start, end, pdomain;
   int count = 0;
   const uschar * save_localpart;
@@ -159,13 +380,18 @@ for (rewrite_rule * rule = rewrite_rules;
   else
     {
     if (!domain) domain = Ustrrchr(subject, '@') + 1;
+    if (c.ix && c.ref->dynamic) memo = FALSE;
 
     /* Use the general function for matching an address against a list (here
     just one item, so use the "impossible value" separator UCHAR_MAX+1). */
 
-    if (match_address_list(subject, FALSE, TRUE, CUSS &(rule->key), NULL, 0,
-        UCHAR_MAX + 1, NULL) != OK)
+    if ((rc = match_address_list(subject, FALSE, TRUE, CUSS &(rule->key), NULL,
+	0, UCHAR_MAX + 1, NULL)) != OK)
+      {
+      if (rc == DEFER) memo = FALSE;
       continue;
+      }
+    memo = FALSE;
 
     /* The source address matches, and numerical variables have been
     set up. If the replacement string consists of precisely "*" then no
@@ -360,6 +586,21 @@ for (rewrite_rule * rule = rewrite_rules;
     }
   }
 
+/* Remember an address no rule matched */
+
+if (memo)
+  {
+  if (known)
+    known->data.val |= flag;
+  else if (c.ix->unchanged.count < REWRITE_MEMO_MAX)
+    {
+    known = store_get_perm(sizeof(tree_node) + Ustrlen(s), s);
+    Ustrcpy(known->name, s);
+    known->data.val = flag;
+    (void) hset_insert(&c.ix->unchanged, known);
+    }
+  }
+
 /* Unset expansion numeric variables, and that's it. */
 
 expand_nmax = -1;
@@ -409,6 +650,61 @@ return s;
 
 
 
+/*************************************************
+*     Apply the address changes to a header      *
+*************************************************/
+
+/* The changes to the addresses in a header are noted as they are found, as
+spans of the old text and their replacements, and the new text is made once
+they are all known. This keeps the cost in line with the length of the
+header, however many of its addresses change.
+
+Arguments:
+  h          the old header
+  patches    the changes, in order
+  slen       the length of the new text
+
+Returns:     the new text, in malloc store
+*/
+
+typedef struct header_patch {
+  struct header_patch *	next;
+  int			from, to;	/* span of the old text replaced */
+  const uschar *	text;		/* replacement */
+  int			len;		/* its length */
+  int			newline;	/* where to add "\n\t", or -1 */
+} header_patch;
+
+static uschar *
+rewrite_patch_header(const header_line * h, const header_patch * patches,
+  int slen)
+{
+uschar * newt = store_malloc(slen + 1), * p = newt;
+int pos = 0;
+
+for (const header_patch * hp = patches; hp; hp = hp->next)
+  {
+  memcpy(p, h->text + pos, hp->from - pos);
+  p += hp->from - pos;
+  memcpy(p, hp->text, hp->len);
+  p += hp->len;
+  pos = hp->to;
+  if (hp->newline >= 0)
+    {
+    memcpy(p, h->text + pos, hp->newline - pos);
+    p += hp->newline - pos;
+    *p++ = '\n';
+    *p++ = '\t';
+    pos = hp->newline;
+    }
+  }
+memcpy(p, h->text + pos, h->slen - pos);
+p[h->slen - pos] = 0;
+return newt;
+}
+
+
+
 /*************************************************
 *    Qualify and possibly rewrite one header     *
 *************************************************/
@@ -449,8 +745,9 @@ rewrite_one_header(header_line *h, int flag,
   const uschar *routed_old, const uschar *routed_new,
   rewrite_rule *rewrite_rules, int existflags, BOOL replace)
 {
-int lastnewline = 0;
+int lastnewline = 0, slen = h->slen;
 header_line *newh = NULL;
+header_patch *patches = NULL, **ptail = &patches;
 rmark function_reset_point = store_mark();
 uschar *s = Ustrchr(h->text, ':') + 1;
 
@@ -464,9 +761,8 @@ f.parse_allow_group = TRUE;     /* Allow group syntax */
 /* Loop for multiple addresses in the header. We have to go through them all
 in case any need qualifying, even if there's no rewriting. Pathological headers
 may have thousands of addresses in them, so cause the store to be reset for
-any that don't actually get rewritten. We also play silly games for those that
-_are_ rewritten so as to avoid runaway store usage for these kinds of header.
-We want to avoid keeping store for any intermediate versions. */
+any that don't actually get rewritten. Those that are rewritten are noted, and
+the new header is made once at the end. */
 
 while (*s)
   {
@@ -589,96 +885,72 @@ while (*s)
 
   if (!changed) loop_reset_point = store_reset(loop_reset_point);
 
-  /* If the address has changed, create a new header containing the
-  rewritten address. We do not need to set the chain pointers at this
-  stage. We want to avoid using more and more memory if the header is very long
-  and contains lots and lots of rewritten addresses. Therefore, we build the
-  new text string in malloc store, then at the end we reset dynamic store
-  before copying the new header to a new block (and then freeing the malloc
-  block). The header must end up in dynamic store so that it's freed at the end
-  of receiving a message. */
+  /* If the address has changed, note the span of the old text to be replaced
+and its replacement. The new header may be substantially longer than the old
+one - qualification of a list of bare addresses can often do this - so we
+stick in a newline after the re-written address if it has increased in length
+and ends more than 40 characters in. In fact, the code is not perfect, since it
+does not scan for existing newlines in the header, but it doesn't seem worth
+going to that amount of trouble. */
 
   else
     {
-    int remlen;
+    header_patch * hp = store_get(sizeof(header_patch), GET_UNTAINTED);
     int newlen = Ustrlen(new);
     int oldlen = end - start;
 
-    header_line * prev = newh ? newh : h;
-    uschar * newt = store_get_perm(prev->slen - oldlen + newlen + 4, GET_TAINTED);
-    uschar * newtstart = newt;
-
-    int type = prev->type;
-    int slen = prev->slen - oldlen + newlen;
-
-    /* Build the new header text by copying the old and putting in the
-    replacement. This process may make the header substantially longer
-    than it was before - qualification of a list of bare addresses can
-    often do this - so we stick in a newline after the re-written address
-    if it has increased in length and ends more than 40 characters in. In
-    fact, the code is not perfect, since it does not scan for existing
-    newlines in the header, but it doesn't seem worth going to that
-    amount of trouble. */
-
-    Ustrncpy(newt, prev->text, sprev - prev->text + start);
-    newt += sprev - prev->text + start;
-    *newt = 0;
-    Ustrcat(newt, new);
-    newt += newlen;
-    remlen = s - (sprev + end);
-    if (remlen > 0)
-      {
-      Ustrncpy(newt, sprev + end, remlen);
-      newt += remlen;
-      *newt = 0;
-      }
+    hp->from = sprev - h->text + start;
+    hp->to = sprev - h->text + end;
+    hp->text = new;
+    hp->len = newlen;
+    hp->newline = -1;
+    hp->next = NULL;
+    *ptail = hp;
+    ptail = &hp->next;
+    slen += newlen - oldlen;
 
     /* Must check that there isn't a newline here anyway; in particular, there
     will be one at the very end of the header, where we DON'T want to insert
     another one! The pointer s has been skipped over white space, so just
-    look back to see if the last non-space-or-tab was a newline. */
+    look back to see if the last non-space-or-tab was a newline, in what
+    follows the new address or else in the new address itself. */
 
-    if (newlen > oldlen && newt - newtstart - lastnewline > 40)
+    if (newlen > oldlen && (s - h->text) + slen - h->slen - lastnewline > 40)
       {
-      uschar *p = s - 1;
-      while (p >= prev->text && (*p == ' ' || *p == '\t')) p--;
+      const uschar * p = s - 1, * base = h->text + hp->to;
+
+      while (p >= base && (*p == ' ' || *p == '\t')) p--;
+      if (p < base)
+	for (p = new + newlen - 1; p > new && (*p == ' ' || *p == '\t'); ) p--;
       if (*p != '\n')
         {
-        lastnewline = newt - newtstart;
-        Ustrcat(newt, US"\n\t");
+        lastnewline = (s - h->text) + slen - h->slen;
+        hp->newline = s - h->text;
         slen += 2;
         }
       }
 
-    /* Finally, the remaining unprocessed addresses, if any. */
-
-    Ustrcat(newt, s);
-
-    DEBUG(D_rewrite) debug_printf("newlen=%d newtype=%c newtext:\n%s",
-      slen, type, newtstart);
-
-    /* Compute the length of the rest of the header line before we possibly
-    flatten a previously rewritten copy. */
-
-    remlen = (s - prev->text) - oldlen + newlen;
+    DEBUG(D_rewrite) debug_printf("remainder: %s", *s ? s : US"\n");
+    }
+  }
 
-    /* We have the new text in a malloc block. That enables us to release all
-    the memory that has been used, back to the point at which the function was
-    entered. Then set up a new header in dynamic store. This will override a
-    rewritten copy from a previous time round this loop. */
+/* Make the new header, if anything changed. The text is built in malloc store,
+so that all the memory used on the way can be released before the header is
+set up in dynamic store. */
 
-    store_reset(function_reset_point);
-    function_reset_point = store_mark();
-    newh = store_get(sizeof(header_line), GET_UNTAINTED);
-    newh->type = type;
-    newh->slen = slen;
-    newh->text = string_copyn(newtstart, slen);
+if (patches)
+  {
+  uschar * newt = rewrite_patch_header(h, patches, slen);
 
-    /* Set up for scanning the rest of the header */
+  DEBUG(D_rewrite) debug_printf("newlen=%d newtype=%c newtext:\n%s",
+    slen, h->type, newt);
 
-    s = newh->text + remlen;
-    DEBUG(D_rewrite) debug_printf("remainder: %s", *s ? s : US"\n");
-    }
+  store_reset(function_reset_point);
+  newh = store_get(sizeof(header_line), GET_UNTAINTED);
+  newh->type = h->type;
+  newh->slen = slen;
+  newh->text = string_copyn_taint(newt, slen, GET_TAINTED);
+  store_free(newt);
   }
 
 f.parse_allow_group = FALSE;  /* Reset group flags */
@@ -693,6 +965,7 @@ if (newh && replace)
   if (!newh->next) header_last = newh;
   h->type = htype_old;
   h->next = newh;
+  header_index_reset();
   }
 
 return newh;
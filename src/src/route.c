@@ -1417,7 +1417,7 @@ delivered. If so, we take it off the relevant queue so that it isn't delivered
 again. Otherwise, it was an alias or something, and the addresses it generated
 are handled in the normal way. */
 
-if (addr->transport && tree_search(tree_nonrecipients, addr->unique))
+if (addr->transport && tree_search_nonrecipient(addr->unique))
   {
   DEBUG(D_route)
     debug_printf("\"unseen\" delivery previously done - discarded\n");
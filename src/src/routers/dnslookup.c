@@ -20,6 +20,7 @@ optionlist dnslookup_router_options[] = {
   { "check_secondary_mx", opt_bool,		LOFF(check_secondary_mx) },
   { "check_srv",          opt_stringptr,	LOFF(check_srv) },
   { "fail_defer_domains", opt_stringptr,	LOFF(fail_defer_domains) },
+  { "host_cache",         opt_time,		LOFF(host_cache) },
   { "ipv4_only",          opt_stringptr,	LOFF(ipv4_only) },
   { "ipv4_prefer",        opt_stringptr,	LOFF(ipv4_prefer) },
   { "mx_domains",         opt_stringptr,	LOFF(mx_domains) },
@@ -69,6 +70,7 @@ dnslookup_router_options_block dnslookup_router_option_defaults = {
   .fail_defer_domains =	NULL,
   .ipv4_only =		NULL,
   .ipv4_prefer =	NULL,
+  .host_cache =		0,
 };
 
 
@@ -92,6 +94,153 @@ rblock = rblock;
 
 
 
+/*************************************************
+*      Hosts held in the hostcache database      *
+*************************************************/
+
+/* With host_cache set, the host list found for a domain is held in the
+"hostcache" hints database, for up to that time or for the least TTL of the DNS
+records used, whichever is less.  Later deliveries to the domain take the list,
+already sorted, from there.  Only complete results are held: every host must
+have an address and none may have been deferred.
+
+Arguments:
+  key         router name, flags and domain
+  h           the initial host item; more are chained on
+  fqn         where to put the fully qualified name
+  removed     where to note the local host's removal
+
+Returns:      HOST_FOUND or HOST_FOUND_LOCAL, or -1 if no usable record
+*/
+
+static int
+dnslookup_cache_get(const uschar * key, host_item * h, const uschar ** fqn,
+  BOOL * removed)
+{
+open_db dbblock, * dbm;
+dbdata_hostcache * hc;
+int len, yield = -1;
+
+if (!(dbm = dbfn_open(US"hostcache", O_RDWR, &dbblock, FALSE, TRUE)))
+  return -1;
+
+if (  (hc = dbfn_read_with_length(dbm, key, &len))
+   && len > (int)offsetof(dbdata_hostcache, data)
+   && (US hc)[len-1] == 0
+   && hc->count > 0
+   && hc->expiry > time(NULL))
+  {
+  const uschar * s = hc->data, * end = US hc + len;
+  host_item first = *h, * last = NULL;
+
+  *fqn = string_copy_taint(s, GET_TAINTED);
+  s += Ustrlen(s) + 1;
+
+  for (unsigned i = 0; i < hc->count; i++)
+    {
+    host_item * hh = last ? store_get(sizeof(host_item), GET_UNTAINTED) : &first;
+    int mx, port, sort_key, dnssec;
+
+    if (last) { *hh = first; last->next = hh; }
+    hh->next = NULL;
+
+    if (s >= end) goto BAD;
+    hh->name = string_copy_taint(s, GET_TAINTED);
+    s += Ustrlen(s) + 1;
+    if (s >= end || !*s) goto BAD;
+    hh->address = string_copy(s);
+    s += Ustrlen(s) + 1;
+    if (s >= end
+       || sscanf(CCS s, "%d %d %d %d", &mx, &port, &sort_key, &dnssec) != 4)
+      goto BAD;
+    s += Ustrlen(s) + 1;
+
+    hh->mx = mx;
+    hh->port = port;
+    hh->sort_key = sort_key;
+    hh->dnssec = dnssec;
+    hh->status = hstatus_unknown;
+    hh->why = hwhy_unknown;
+    hh->last_try = 0;
+    last = hh;
+    }
+
+  *h = first;
+  *removed = hc->removed;
+  yield = hc->yield;
+  lookup_dnssec_authenticated = h->dnssec == DS_YES ? US"yes"
+    : h->dnssec == DS_NO ? US"no" : NULL;
+
+  hc->hits++;
+  dbfn_write(dbm, key, hc, len);
+  }
+
+BAD:
+dbfn_close(dbm);
+
+DEBUG(D_route) debug_printf("host cache %s for %s\n",
+  yield < 0 ? "miss" : "hit", key);
+return yield;
+}
+
+
+/* Write a host list found by host_find_bydns() into the cache, if it is
+complete and the DNS gave it a useful lifetime.
+
+Arguments:
+  key         router name, flags and domain
+  h           the host list
+  yield       the value from host_find_bydns()
+  fqn         the fully qualified name
+  removed     TRUE if the local host was removed from the list
+  maxttl      the host_cache setting
+*/
+
+static void
+dnslookup_cache_put(const uschar * key, const host_item * h, int yield,
+  const uschar * fqn, BOOL removed, int maxttl)
+{
+open_db dbblock, * dbm;
+dbdata_hostcache * hc;
+gstring * g;
+unsigned ttl = dns_least_ttl, count = 0;
+int len;
+
+if (ttl == 0 || ttl == UINT_MAX) return;
+for (const host_item * hh = h; hh; hh = hh->next)
+  if (!hh->address || hh->status >= hstatus_unusable) return;
+
+g = string_catn(NULL, fqn, Ustrlen(fqn) + 1);
+for (const host_item * hh = h; hh; hh = hh->next, count++)
+  {
+  g = string_catn(g, hh->name, Ustrlen(hh->name) + 1);
+  g = string_catn(g, hh->address, Ustrlen(hh->address) + 1);
+  g = string_fmt_append(g, "%d %d %d %d", hh->mx, hh->port, hh->sort_key,
+			(int)hh->dnssec);
+  g = string_catn(g, US"", 1);
+  }
+
+if (!(dbm = dbfn_open(US"hostcache", O_RDWR, &dbblock, FALSE, TRUE)))
+  return;
+
+if (ttl > (unsigned)maxttl) ttl = maxttl;
+len = offsetof(dbdata_hostcache, data) + g->ptr;
+hc = store_get(len, GET_UNTAINTED);
+hc->expiry = time(NULL) + ttl;
+hc->hits = 0;
+hc->count = count;
+hc->yield = yield;
+hc->removed = removed;
+memcpy(hc->data, g->s, g->ptr);
+
+dbfn_write(dbm, key, hc, len);
+dbfn_close(dbm);
+DEBUG(D_route) debug_printf("host cache: %u hosts held for %us as %s\n",
+  count, ttl, key);
+}
+
+
+
 /*************************************************
 *              Main entry point                  *
 *************************************************/
@@ -159,6 +308,7 @@ const uschar *pre_widen = addr->domain;
 const uschar *post_widen = NULL;
 const uschar *fully_qualified_name;
 const uschar *listptr;
+const uschar *cache_key = NULL;
 uschar widen_buffer[256];
 
 DEBUG(D_route)
@@ -287,10 +437,29 @@ for (;;)
     if (ob->search_parents) flags |= HOST_FIND_SEARCH_PARENTS;
     }
 
-  rc = host_find_bydns(&h, CUS rblock->ignore_target_hosts, flags,
-    srv_service, ob->srv_fail_domains, ob->mx_fail_domains,
-    &rblock->dnssec,
-    &fully_qualified_name, &removed);
+  /* With host_cache set, a list held from an earlier delivery saves the DNS
+  lookups and the sorting of the hosts. */
+
+  rc = -1;
+  if (ob->host_cache > 0)
+    {
+    cache_key = string_sprintf("%s:%x:%s:%s", rblock->name, flags,
+      srv_service ? srv_service : US"", string_copylc(h.name));
+    rc = dnslookup_cache_get(cache_key, &h, &fully_qualified_name, &removed);
+    dns_least_ttl = UINT_MAX;
+    }
+
+  if (rc < 0)
+    {
+    rc = host_find_bydns(&h, CUS rblock->ignore_target_hosts, flags,
+      srv_service, ob->srv_fail_domains, ob->mx_fail_domains,
+      &rblock->dnssec,
+      &fully_qualified_name, &removed);
+
+    if (cache_key && (rc == HOST_FOUND || rc == HOST_FOUND_LOCAL))
+      dnslookup_cache_put(cache_key, &h, rc, fully_qualified_name, removed,
+	ob->host_cache);
+    }
 
   if (removed) setflag(addr, af_local_host_removed);
 
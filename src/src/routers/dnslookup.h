@@ -21,6 +21,7 @@ typedef struct {
   uschar *fail_defer_domains;
   uschar *ipv4_only;
   uschar *ipv4_prefer;
+  int     host_cache;
 } dnslookup_router_options_block;
 
 /* Data for reading the private options. */
@@ -45,6 +45,11 @@ static int open_filecount = 0;
 
 static rmark search_reset_point = NULL;
 
+/* The cache of the lookup whose find function is running, for lookups that
+hand back results for more keys than the one asked for */
+
+static search_cache *search_finding = NULL;
+
 
 
 /*************************************************
@@ -81,6 +86,7 @@ for (int bot = 0, top = lookup_list_count; top > bot; )
 
   if (c == 0 && Ustrlen(lookup_list[mid]->name) == len)
     {
+    if (!lookup_list[mid]->find) lookup_module_load(mid);
     if (lookup_list[mid]->find != NULL) return mid;
     search_error_message  = string_sprintf("lookup type \"%.*s\" is not "
       "available (not in the binary - check buildtime LOOKUP configuration)",
@@ -497,6 +503,714 @@ return t;
 
 
 
+/*************************************************
+*          Shared lookup result cache            *
+*************************************************/
+
+/* The per-handle caches above last only as long as the process, and most
+processes handle a single message or connection. When lookup_cache_shared
+names a lookup type, results for it are also held by the daemon,
+and queried over the notifier socket by the processes it forks. A cache miss
+costs one datagram exchange; the lookup is then made as usual and the result
+offered back to the daemon. Only processes running as root or the Exim user
+are served. */
+
+/* Request to the daemon. It is followed by the key (lookup type name, file
+name, options and query, each NUL-terminated), then for an add, the data. */
+
+typedef struct shc_req {
+  uschar	notifier_reqtype;
+  uschar	found;			/* for add: lookup succeeded */
+  uschar	tainted;		/* for add: data is tainted */
+  unsigned	ttl;			/* for add: seconds to keep */
+  int		keylen;
+} shc_req;
+
+/* Response to a query. For a hit on a successful lookup it is followed
+by the data. */
+
+typedef struct shc_resp {
+  uschar	status;			/* SHC_* below */
+  uschar	tainted;
+  unsigned	ttl;			/* seconds of life remaining */
+} shc_resp;
+
+#define SHC_MISS	0
+#define SHC_FAILED	1		/* cached lookup failure */
+#define SHC_FOUND	2
+
+#define SHARED_CACHE_NBUCKETS	4096	/* hashtable size */
+#define SHARED_CACHE_MAX	16384	/* entries before LRU eviction */
+
+/* Set when the daemon does not answer, so as not to keep waiting for it */
+
+static BOOL shc_unavailable = FALSE;
+
+
+
+/* Decide whether this process can use the shared cache at all */
+
+BOOL
+search_shared_usable(void)
+{
+uid_t uid;
+
+if (shc_unavailable || f.daemon_listen || !notifier_socket || !*notifier_socket)
+  return FALSE;
+return (uid = getuid()) == root_uid || uid == exim_uid;
+}
+
+
+/* Decide whether to use the shared cache for a lookup */
+
+static BOOL
+search_shared_wanted(int search_type)
+{
+const uschar * list = lookup_cache_shared, * s;
+int sep = 0;
+
+if (!list || lookup_cache_shared_ttl <= 0 || !search_shared_usable())
+  return FALSE;
+
+while ((s = string_nextinlist(&list, &sep, NULL, 0)))
+  if (Ustrcmp(s, lookup_list[search_type]->name) == 0) return TRUE;
+return FALSE;
+}
+
+
+/* Build a request: header, then the type name and optionally the file name,
+options and key */
+
+static gstring *
+search_shared_req(uschar type, int search_type, const uschar * filename,
+  const uschar * keystring, const uschar * opts)
+{
+shc_req req = {.notifier_reqtype = type};
+gstring * g = string_catn(NULL, US &req, sizeof(req));
+
+g = string_catn(g, lookup_list[search_type]->name,
+		Ustrlen(lookup_list[search_type]->name) + 1);
+if (keystring)
+  {
+  if (!filename) filename = US"";
+  if (!opts) opts = US"";
+  g = string_catn(g, filename, Ustrlen(filename) + 1);
+  g = string_catn(g, opts, Ustrlen(opts) + 1);
+  g = string_catn(g, keystring, Ustrlen(keystring) + 1);
+  }
+((shc_req *)g->s)->keylen = g->ptr - sizeof(req);
+return g;
+}
+
+
+/* Send a request that has no response */
+
+static void
+search_shared_send(const gstring * g)
+{
+int fd;
+
+if (g->ptr > NOTIFY_MSG_MAX - 1) return;
+if ((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) >= 0)
+  {
+  struct sockaddr_un sa_un = {.sun_family = AF_UNIX};
+  ssize_t len = daemon_notifier_sockname(&sa_un);
+
+  if (sendto(fd, g->s, g->ptr, 0, (struct sockaddr *)&sa_un, (socklen_t)len) < 0)
+    DEBUG(D_lookup)
+      debug_printf_indent("%s: sendto %s\n", __FUNCTION__, strerror(errno));
+  close(fd);
+  }
+}
+
+
+/* Send a request and wait for the response.  A daemon that does not answer
+is not asked again.  Also used for ratelimit requests.
+
+Arguments:
+  g		the request
+  buf		where to put the response, NOTIFY_MSG_MAX bytes
+
+Returns:	length of the response, or -1
+*/
+
+ssize_t
+search_shared_exchange(const gstring * g, uschar * buf)
+{
+struct sockaddr_un sa_un = {.sun_family = AF_UNIX};
+const uschar * where;
+uschar * sname;
+ssize_t len;
+int fd;
+
+if (g->ptr > NOTIFY_MSG_MAX - 1) return -1;
+
+if ((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0)
+  {
+  DEBUG(D_lookup) debug_printf_indent(" socket: %s\n", strerror(errno));
+  return -1;
+  }
+
+len = daemon_client_sockname(&sa_un, &sname);
+if (bind(fd, (const struct sockaddr *)&sa_un, (socklen_t)len) < 0)
+  { where = US"bind"; goto bad; }
+
+len = daemon_notifier_sockname(&sa_un);
+if (connect(fd, (const struct sockaddr *)&sa_un, len) < 0)
+  { where = US"connect"; goto bad2; }
+if (send(fd, g->s, g->ptr, 0) < 0)
+  { where = US"send"; goto bad2; }
+if (poll_one_fd(fd, POLLIN, 1000) != 1)
+  { where = US"poll"; errno = ETIMEDOUT; goto bad2; }
+if ((len = recv(fd, buf, NOTIFY_MSG_MAX, 0)) < (ssize_t)sizeof(shc_resp))
+  { where = US"recv"; goto bad2; }
+
+close(fd);
+#ifndef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
+Uunlink(sname);
+#endif
+return len;
+
+bad2:
+#ifndef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
+  Uunlink(sname);
+#endif
+bad:
+  close(fd);
+  DEBUG(D_lookup) debug_printf_indent(" shared cache %s: %s\n",
+    where, strerror(errno));
+  shc_unavailable = TRUE;
+  return -1;
+}
+
+
+/* Ask the daemon for a cached result.
+
+Arguments:
+  search_type	lookup type
+  filename	the file name, or NULL for a query-style lookup
+  keystring	the key or query
+  opts		options, or NULL
+  result	where to put the data; NULL for a cached failure
+  ttl		where to put the remaining life of the entry
+
+Returns:	TRUE for a cache hit
+*/
+
+static BOOL
+search_shared_get(int search_type, const uschar * filename,
+  const uschar * keystring, const uschar * opts, uschar ** result, uint * ttl)
+{
+uschar buf[NOTIFY_MSG_MAX];
+rmark reset_point = store_mark();
+shc_resp resp;
+ssize_t len = search_shared_exchange(
+	search_shared_req(NOTIFY_LOOKUP_GET, search_type, filename, keystring,
+			  opts), buf);
+
+store_reset(reset_point);		/* the request is done with */
+if (len < 0) return FALSE;
+
+memcpy(&resp, buf, sizeof(resp));
+DEBUG(D_lookup) debug_printf_indent("shared cache %s\n",
+  resp.status == SHC_MISS ? "miss" : "hit");
+if (resp.status == SHC_MISS) return FALSE;
+
+if (resp.status == SHC_FOUND)
+  {
+  len -= sizeof(resp);
+  *result = store_get(len + 1, resp.tainted ? GET_TAINTED : GET_UNTAINTED);
+  memcpy(*result, buf + sizeof(resp), len);
+  (*result)[len] = '\0';
+  }
+else
+  *result = NULL;
+*ttl = resp.ttl ? resp.ttl : 1;		/* zero would mean "do not cache" */
+return TRUE;
+}
+
+
+/* Get and put for other users of the shared cache (DNS answers).  The key is
+opaque but must start with a NUL-terminated name for the kind of data, which
+must not be that of a lookup type; the data is binary and taken as tainted.
+
+Arguments:
+  key, keylen	the key
+  data		where to put, or point to, the data
+  len		where to put, or the, data length
+  ttl		seconds the entry is to live (put only)
+
+Returns:	TRUE for a cache hit (get only)
+*/
+
+BOOL
+search_shared_get_raw(const uschar * key, int keylen, uschar ** data, int * len)
+{
+shc_req req = {.notifier_reqtype = NOTIFY_LOOKUP_GET, .keylen = keylen};
+uschar buf[NOTIFY_MSG_MAX];
+rmark reset_point = store_mark();
+shc_resp resp;
+ssize_t rlen = search_shared_exchange(
+	string_catn(string_catn(NULL, US &req, sizeof(req)), key, keylen), buf);
+
+store_reset(reset_point);
+if (rlen < 0) return FALSE;
+
+memcpy(&resp, buf, sizeof(resp));
+if (resp.status != SHC_FOUND) return FALSE;
+*len = rlen - sizeof(resp);
+*data = store_get(*len, GET_TAINTED);
+memcpy(*data, buf + sizeof(resp), *len);
+return TRUE;
+}
+
+void
+search_shared_put_raw(const uschar * key, int keylen, const uschar * data,
+  int len, unsigned ttl)
+{
+shc_req req = {.notifier_reqtype = NOTIFY_LOOKUP_PUT, .found = TRUE,
+		.tainted = TRUE, .ttl = ttl, .keylen = keylen};
+gstring * g = string_catn(NULL, US &req, sizeof(req));
+
+g = string_catn(g, key, keylen);
+search_shared_send(string_catn(g, data, len));
+}
+
+/* Drop every entry whose key starts with the given bytes */
+
+void
+search_shared_flush_raw(const uschar * key, int keylen)
+{
+shc_req req = {.notifier_reqtype = NOTIFY_LOOKUP_FLUSH, .keylen = keylen};
+
+search_shared_send(string_catn(string_catn(NULL, US &req, sizeof(req)),
+				key, keylen));
+}
+
+
+/* Print the daemon's counts for the shared cache, for -bP shared_cache.
+
+Returns:	TRUE if the daemon answered
+*/
+
+BOOL
+search_shared_stats(void)
+{
+shc_req req = {.notifier_reqtype = NOTIFY_LOOKUP_STATS};
+uschar buf[NOTIFY_MSG_MAX];
+ssize_t len;
+
+if (  !notifier_socket || !*notifier_socket
+   || (len = search_shared_exchange(string_catn(NULL, US &req, sizeof(req)),
+				    buf)) < 0)
+  {
+  printf("shared cache: no response from the daemon\n");
+  return FALSE;
+  }
+printf("%.*s", (int)(len - sizeof(shc_resp)), buf + sizeof(shc_resp));
+return TRUE;
+}
+
+
+/* Offer the result of a lookup to the daemon. A lookup that disabled caching
+(for example, an SQL update) empties the shared cache for its type. */
+
+static void
+search_shared_put(int search_type, const uschar * filename,
+  const uschar * keystring, const uschar * opts, const uschar * data,
+  uint do_cache)
+{
+gstring * g;
+
+if (!do_cache)
+  g = search_shared_req(NOTIFY_LOOKUP_FLUSH, search_type, NULL, NULL, NULL);
+else
+  {
+  shc_req * req;
+
+  g = search_shared_req(NOTIFY_LOOKUP_PUT, search_type, filename,
+			  keystring, opts);
+  req = (shc_req *)g->s;
+  req->ttl = do_cache < (uint)lookup_cache_shared_ttl
+    ? do_cache : (uint)lookup_cache_shared_ttl;
+  if ((req->found = !!data))
+    {
+    req->tainted = is_tainted(data);
+    g = string_catn(g, data, Ustrlen(data));
+    }
+  }
+search_shared_send(g);
+}
+
+
+
+/* Daemon side. Entries are in malloc store, on a hash chain and on an LRU
+chain. */
+
+typedef struct shc_entry {
+  struct shc_entry *	next;		/* hash chain */
+  struct shc_entry *	older;		/* LRU chain */
+  struct shc_entry *	newer;
+  time_t		expiry;
+  unsigned		hash;
+  int			keylen;
+  int			datalen;	/* -1 for a cached failure */
+  BOOL			tainted;
+  uschar		text[1];	/* key, then data */
+} shc_entry;
+
+static shc_entry **	shc_buckets = NULL;
+static shc_entry *	shc_oldest = NULL;
+static shc_entry *	shc_newest = NULL;
+static unsigned		shc_count = 0;
+
+
+static unsigned
+shc_hash(const uschar * key, int len)
+{
+unsigned h = 5381;
+while (len--) h = (h << 5) + h + *key++;
+return h;
+}
+
+
+static void
+shc_lru_unlink(shc_entry * e)
+{
+if (e->older) e->older->newer = e->newer; else shc_oldest = e->newer;
+if (e->newer) e->newer->older = e->older; else shc_newest = e->older;
+}
+
+static void
+shc_lru_add(shc_entry * e)
+{
+e->newer = NULL;
+if ((e->older = shc_newest)) shc_newest->newer = e; else shc_oldest = e;
+shc_newest = e;
+}
+
+
+static void
+shc_del(shc_entry * e)
+{
+for (shc_entry ** ep = &shc_buckets[e->hash % SHARED_CACHE_NBUCKETS]; *ep;
+     ep = &(*ep)->next)
+  if (*ep == e) { *ep = e->next; break; }
+shc_lru_unlink(e);
+store_free(e);
+shc_count--;
+}
+
+
+/* Find an unexpired entry, moving it to the new end of the LRU chain */
+
+static shc_entry *
+shc_find(const uschar * key, int keylen, unsigned hash)
+{
+for (shc_entry * e = shc_buckets[hash % SHARED_CACHE_NBUCKETS]; e; e = e->next)
+  if (e->hash == hash && e->keylen == keylen && memcmp(e->text, key, keylen) == 0)
+    {
+    if (e->expiry <= time(NULL)) { shc_del(e); return NULL; }
+    shc_lru_unlink(e);
+    shc_lru_add(e);
+    return e;
+    }
+return NULL;
+}
+
+
+/* Add an entry, replacing any with the same key and making room if the cache
+is full. The text is the key followed by the data; datalen is -1 for a cached
+failure. */
+
+static void
+shc_insert(const uschar * text, int keylen, int datalen, BOOL tainted,
+  time_t expiry)
+{
+unsigned hash = shc_hash(text, keylen);
+shc_entry * e;
+
+if (!shc_buckets)
+  {
+  shc_buckets = store_malloc(SHARED_CACHE_NBUCKETS * sizeof(shc_entry *));
+  memset(shc_buckets, 0, SHARED_CACHE_NBUCKETS * sizeof(shc_entry *));
+  }
+if ((e = shc_find(text, keylen, hash))) shc_del(e);
+else if (shc_count >= SHARED_CACHE_MAX) shc_del(shc_oldest);
+
+e = store_malloc(sizeof(shc_entry) + keylen + MAX(datalen, 0));
+memcpy(e->text, text, keylen + MAX(datalen, 0));
+e->hash = hash;
+e->keylen = keylen;
+e->datalen = datalen;
+e->tainted = tainted;
+e->expiry = expiry;
+e->next = shc_buckets[hash % SHARED_CACHE_NBUCKETS];
+shc_buckets[hash % SHARED_CACHE_NBUCKETS] = e;
+shc_lru_add(e);
+shc_count++;
+}
+
+
+/* Per-kind counts of queries, the kind being the lookup type name (or other
+name) that starts the key */
+
+typedef struct shc_stat {
+  uschar	name[32];
+  unsigned	hits;
+  unsigned	misses;
+} shc_stat;
+
+static shc_stat	shc_stats[32];
+static int	shc_nstats = 0;
+
+static shc_stat *
+shc_stat_for(const uschar * key, int keylen)
+{
+int len = 0;
+
+while (len < keylen && key[len]) len++;
+
+if (len >= (int)sizeof(shc_stats[0].name)) return NULL;
+for (int i = 0; i < shc_nstats; i++)
+  if (Ustrcmp(shc_stats[i].name, key) == 0) return shc_stats + i;
+if (shc_nstats >= nelem(shc_stats)) return NULL;
+memcpy(shc_stats[shc_nstats].name, key, len);
+return shc_stats + shc_nstats++;
+}
+
+
+/* Text for a stats request: per kind, the entries held and the hits and
+misses since the daemon started */
+
+static gstring *
+shc_stats_text(void)
+{
+gstring * g = string_fmt_append(NULL, "shared cache: %u entries (max %u)\n",
+  shc_count, SHARED_CACHE_MAX);
+
+for (shc_stat * st = shc_stats; st < shc_stats + shc_nstats; st++)
+  {
+  int len = Ustrlen(st->name) + 1;
+  unsigned n = 0;
+  for (shc_entry * e = shc_oldest; e; e = e->newer)
+    if (e->keylen >= len && memcmp(e->text, st->name, len) == 0) n++;
+  g = string_fmt_append(g, "  %s: %u entries, %u hits, %u misses\n",
+    st->name, n, st->hits, st->misses);
+  }
+return g;
+}
+
+
+/* Handle a shared-cache request in the daemon.
+
+Arguments:
+  fd		the notifier socket, for a response
+  buf		the request
+  len		its length
+  sa		the requester's address
+  salen		its length
+*/
+
+void
+search_shared_at_daemon(int fd, const uschar * buf, int len,
+  const struct sockaddr * sa, socklen_t salen)
+{
+const uschar * key = buf + sizeof(shc_req);
+shc_req req;
+shc_entry * e;
+shc_stat * st;
+unsigned hash;
+
+if (len < (int)sizeof(req)) return;
+memcpy(&req, buf, sizeof(req));
+if (req.notifier_reqtype == NOTIFY_LOOKUP_STATS)
+  {
+  shc_resp resp = {.status = SHC_FOUND};
+  gstring * g = string_catn(NULL, US &resp, sizeof(resp));
+
+  g = gstring_append(g, shc_stats_text());
+  if (g->ptr > NOTIFY_MSG_MAX) g->ptr = NOTIFY_MSG_MAX;
+  if (sendto(fd, g->s, g->ptr, 0, sa, salen) < 0)
+    DEBUG(D_lookup) debug_printf("%s: sendto: %s\n", __FUNCTION__,
+      strerror(errno));
+  return;
+  }
+if (req.keylen <= 0 || req.keylen > len - (int)sizeof(req)) return;
+if (!shc_buckets)
+  {
+  shc_buckets = store_malloc(SHARED_CACHE_NBUCKETS * sizeof(shc_entry *));
+  memset(shc_buckets, 0, SHARED_CACHE_NBUCKETS * sizeof(shc_entry *));
+  }
+hash = shc_hash(key, req.keylen);
+
+switch (req.notifier_reqtype)
+  {
+  case NOTIFY_LOOKUP_GET:
+    {
+    rmark reset_point = store_mark();
+    shc_resp resp = {.status = SHC_MISS};
+    int rlen = sizeof(resp);
+    uschar * rbuf;
+
+    e = shc_find(key, req.keylen, hash);
+    if ((st = shc_stat_for(key, req.keylen)))
+      if (e) st->hits++; else st->misses++;
+    if (e)
+      {
+      resp.status = e->datalen < 0 ? SHC_FAILED : SHC_FOUND;
+      resp.tainted = e->tainted;
+      resp.ttl = (unsigned)(e->expiry - time(NULL));
+      if (e->datalen > 0) rlen += e->datalen;
+      }
+    rbuf = store_get(rlen, GET_UNTAINTED);
+    memcpy(rbuf, &resp, sizeof(resp));
+    if (rlen > (int)sizeof(resp))
+      memcpy(rbuf + sizeof(resp), e->text + e->keylen, e->datalen);
+    if (sendto(fd, rbuf, rlen, 0, sa, salen) < 0)
+      DEBUG(D_lookup) debug_printf("%s: sendto: %s\n", __FUNCTION__,
+	strerror(errno));
+    store_reset(reset_point);
+    break;
+    }
+
+  case NOTIFY_LOOKUP_PUT:
+    if (req.ttl == 0) break;
+    shc_insert(key, req.keylen,
+      req.found ? len - (int)sizeof(req) - req.keylen : -1,
+      req.tainted, time(NULL) + req.ttl);
+    break;
+
+  case NOTIFY_LOOKUP_FLUSH:		/* the key is just the lookup type */
+    {
+    shc_entry * next;
+    for (e = shc_oldest; e; e = next)
+      {
+      next = e->newer;
+      if (e->keylen >= req.keylen && memcmp(e->text, key, req.keylen) == 0)
+	shc_del(e);
+      }
+    break;
+    }
+  }
+DEBUG(D_lookup) debug_printf("shared lookup cache: %u entries\n", shc_count);
+}
+
+
+/* Across the re-exec of the daemon after a SIGHUP the cache is kept in a
+file, written by the old daemon and read (and removed) by the new one. The
+entries are written oldest first, each a header and the key and data, with
+their absolute expiry times, so that any that expire in between are dropped.
+The new configuration may not use some of them; they just age out, being
+keyed on what was looked up rather than on the options. Cached
+server_condition results are not kept: their keys are made with a secret that
+only the old daemon has, and the condition may have changed. */
+
+#define SHC_SAVE_MAGIC	"exim shared cache 1\n"
+
+typedef struct {
+  time_t	expiry;
+  int		keylen;
+  int		datalen;
+  int		tainted;
+} shc_save_hdr;
+
+/* Returns: TRUE if the file was written */
+
+BOOL
+search_shared_save(const uschar * name)
+{
+uschar * tmp;
+FILE * f;
+int fd;
+BOOL ok;
+
+if (!shc_count) return FALSE;
+tmp = string_sprintf("%s.tmp", name);
+(void) Uunlink(tmp);
+if ((fd = Uopen(tmp, EXIM_CLOEXEC | EXIM_NOFOLLOW | O_WRONLY|O_CREAT|O_EXCL,
+		0600)) < 0) return FALSE;
+if (!(f = fdopen(fd, "wb"))) { (void)close(fd); return FALSE; }
+
+ok = fputs(SHC_SAVE_MAGIC, f) != EOF;
+for (shc_entry * e = shc_oldest; ok && e; e = e->newer)
+  {
+  shc_save_hdr h = {.expiry = e->expiry, .keylen = e->keylen,
+		    .datalen = e->datalen, .tainted = e->tainted};
+  int tlen = e->keylen + MAX(e->datalen, 0);
+
+  if (  e->keylen >= sizeof(AUTH_CACHE_PREFIX)
+     && memcmp(e->text, AUTH_CACHE_PREFIX, sizeof(AUTH_CACHE_PREFIX)) == 0)
+    continue;
+  ok =  fwrite(&h, sizeof(h), 1, f) == 1
+     && fwrite(e->text, 1, tlen, f) == tlen;
+  }
+if (fclose(f) != 0) ok = FALSE;
+if (ok && Urename(tmp, name) == 0)
+  {
+  DEBUG(D_any) debug_printf("shared cache: %u entries saved in %s\n",
+    shc_count, name);
+  return TRUE;
+  }
+(void) Uunlink(tmp);
+return FALSE;
+}
+
+
+/* The spool directory is writable by the exim user, so only a file the old
+daemon made, owned by root and private to it, is believed. */
+
+void
+search_shared_restore(const uschar * name)
+{
+uschar magic[sizeof(SHC_SAVE_MAGIC) - 1];
+time_t now = time(NULL);
+unsigned count = 0;
+shc_save_hdr h;
+struct stat st;
+FILE * f;
+int fd;
+
+if ((fd = Uopen(name, EXIM_CLOEXEC | EXIM_NOFOLLOW | O_RDONLY, 0)) < 0) return;
+(void) Uunlink(name);
+if (  fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)
+   || st.st_uid != root_uid || (st.st_mode & 07777) != 0600)
+  {
+  log_write(0, LOG_MAIN, "shared cache: %s ignored: wrong type, owner or mode",
+    name);
+  (void) close(fd);
+  return;
+  }
+if (!(f = fdopen(fd, "rb"))) { (void) close(fd); return; }
+
+if (  fread(magic, sizeof(magic), 1, f) == 1
+   && memcmp(magic, SHC_SAVE_MAGIC, sizeof(magic)) == 0)
+  while (fread(&h, sizeof(h), 1, f) == 1)
+    {
+    int tlen = h.keylen + MAX(h.datalen, 0);
+    rmark reset_point;
+    uschar * text;
+    BOOL ok;
+
+    if (h.keylen <= 0 || tlen > NOTIFY_MSG_MAX || h.datalen < -1) break;
+    reset_point = store_mark();
+    text = store_get(tlen, GET_UNTAINTED);
+    if ((ok = fread(text, 1, tlen, f) == tlen) && h.expiry > now)
+      {
+      shc_insert(text, h.keylen, h.datalen, h.tainted, h.expiry);
+      count++;
+      }
+    store_reset(reset_point);
+    if (!ok) break;
+    }
+(void) fclose(f);
+DEBUG(D_any) debug_printf("shared cache: %u entries restored from %s\n",
+  count, name);
+}
+
+
+
+
 /*************************************************
 *  Internal function: Find one item in database  *
 *************************************************/
@@ -568,6 +1282,7 @@ else
   {
   uint do_cache = UINT_MAX;
   int keylength = Ustrlen(keystring);
+  BOOL shared = search_shared_wanted(search_type);
 
   DEBUG(D_lookup)
     {
@@ -624,11 +1339,36 @@ else
 
   /* Call the code for the different kinds of search. DEFER is handled
   like FAIL, except that search_find_defer is set so the caller can
-  distinguish if necessary. */
+  distinguish if necessary. For a lookup type shared through the daemon,
+  try its cache first, and offer it the result of a real lookup. Lookup types
+  handled by the lookup proxy are passed to one of its helpers. */
+
+  if (  shared && cache_rd
+     && search_shared_get(search_type, filename, keystring, opts,
+			  &data, &do_cache))
+    ;
+  else
+    {
+    int rc;
+    struct timeval start;
 
-  if (lookup_list[search_type]->find(c->handle, filename, keystring, keylength,
-	  &data, &search_error_message, &do_cache, opts) == DEFER)
-    f.search_find_defer = TRUE;
+    if (metrics) exim_gettime(&start);
+    if (  !lookup_proxy_wanted(search_type)
+       || !lookup_proxy_find(search_type, filename, keystring, opts,
+			    &data, &search_error_message, &do_cache, &rc))
+      {
+      search_finding = c;
+      rc = lookup_list[search_type]->find(c->handle, filename, keystring,
+	  keylength, &data, &search_error_message, &do_cache, opts);
+      search_finding = NULL;
+      }
+    if (metrics) metrics_time(METRICS_TIME_LOOKUP, search_type, &start);
+
+    if (rc == DEFER)
+      f.search_find_defer = TRUE;
+    else if (shared)
+      search_shared_put(search_type, filename, keystring, opts, data, do_cache);
+    }
 
   /* A record that has been found is now in data, which is either NULL
   or points to a bit of dynamic store. Cache the result of the lookup if
@@ -638,6 +1378,8 @@ else
   cache entry; the dnsdb lookup does.
   Finally, the caller can request no caching by setting an option. */
 
+  if (f.search_find_defer)
+    ;
   else if (do_cache)
     {
     DEBUG(D_lookup) debug_printf_indent("%s cache entry\n",
@@ -687,6 +1429,169 @@ return data ? string_copy(data) : NULL;
 
 
 
+/*************************************************
+*       Seed the cache for another key           *
+*************************************************/
+
+/* Called by a lookup's find function when it has, as a side effect, the
+result for another key of the same lookup type and handle; a later search for
+that key, with no options, then uses it without a call to the lookup.
+
+Arguments:
+  keystring	the key or query
+  data		the result, or NULL for a failed lookup
+*/
+
+static void
+search_cache_put(search_cache * c, const uschar * keystring,
+  const uschar * opts, const uschar * data, uint do_cache)
+{
+expiring_data * e;
+tree_node * t;
+int old_pool = store_pool;
+
+store_pool = POOL_SEARCH;
+
+if ((t = tree_search(c->item_cache, keystring)))
+  e = t->data.ptr;
+else
+  {
+  int len = Ustrlen(keystring) + 1;
+  /* The cache node value should never be expanded so use tainted mem */
+  e = store_get(sizeof(expiring_data) + sizeof(tree_node) + len, GET_TAINTED);
+  t = (tree_node *)(e+1);
+  memcpy(t->name, keystring, len);
+  t->data.ptr = e;
+  tree_insertnode(&c->item_cache, t);
+  }
+e->expiry = do_cache == UINT_MAX ? 0 : time(NULL) + do_cache;
+e->opts = opts ? string_copy(opts) : NULL;
+e->data.ptr = data ? string_copy(data) : NULL;
+
+DEBUG(D_lookup) debug_printf_indent("seeded cache entry for %s\n", keystring);
+store_pool = old_pool;
+}
+
+void
+search_cache_seed(const uschar * keystring, const uschar * data)
+{
+if (search_finding && *keystring)
+  search_cache_put(search_finding, keystring, NULL, data, UINT_MAX);
+}
+
+
+
+/*************************************************
+*     Fill the cache for a partial match         *
+*************************************************/
+
+/* For a lookup type with a partial_find function, work out the keys that the
+partial-matching loop in search_find() is going to try, in the same order, and
+have them all looked up in one call.  The answers go into the cache, where the
+loop then finds them; so its results, and the variables it sets, are as
+before.  Nothing is done if the first of the keys is already in the cache, or
+for a lookup that is shared through the daemon or passed to the lookup proxy,
+or that defers.
+
+Arguments:  as for search_find()
+Returns:    nothing
+*/
+
+static void
+search_partial_fill(void * handle, const uschar * filename,
+  const uschar * keystring, int partial, const uschar * affix, int affixlen,
+  const uschar * opts)
+{
+tree_node * t = (tree_node *)handle;
+search_cache * c = (search_cache *)(t->data.ptr);
+int search_type = t->name[0] - '0';
+const lookup_info * li = lookup_list[search_type];
+int dotcount = 0, count = 0, which = -1, rc, old_pool = store_pool;
+const uschar ** keys;
+uschar * data = NULL, * errmsg = US"";
+uint do_cache = UINT_MAX;
+
+if (  !li->partial_find
+   || search_shared_wanted(search_type) || lookup_proxy_wanted(search_type))
+  return;
+
+for (const uschar * s = keystring; *s; ) if (*s++ == '.') dotcount++;
+keys = store_get((dotcount + 2) * sizeof(uschar *), GET_UNTAINTED);
+
+if (affixlen > 0)
+  keys[count++] = string_sprintf("%.*s%s", affixlen, affix, keystring);
+for (const uschar * s = keystring; dotcount-- >= partial; s++)
+  {
+  while (*s && *s != '.') s++;
+  if (*s)
+    keys[count++] = string_sprintf("%.*s%s", affixlen, affix, s + 1);
+  else
+    {
+    if (affixlen > 0)
+      keys[count++] = string_copyn(affix,
+	affixlen > 1 && affix[affixlen-1] == '.' ? affixlen - 1 : affixlen);
+    break;
+    }
+  }
+
+if (count < 2) return;
+if (  (t = tree_search(c->item_cache, keys[0]))
+   && (!((expiring_data *)t->data.ptr)->expiry
+      || ((expiring_data *)t->data.ptr)->expiry > time(NULL)))
+  return;
+
+DEBUG(D_lookup)
+  debug_printf_indent("partial match: %d keys in one lookup\n", count);
+
+store_pool = POOL_SEARCH;
+search_finding = c;
+rc = li->partial_find(c->handle, filename, keys, count, &which, &data,
+  &errmsg, &do_cache, opts);
+search_finding = NULL;
+store_pool = old_pool;
+
+if (rc == DEFER || do_cache == 0) return;
+if (rc != OK) which = count;
+for (int i = 0; i < count && i <= which; i++)
+  search_cache_put(c, keys[i], opts, i == which ? data : NULL, do_cache);
+}
+
+
+
+
+/*************************************************
+*     Find one item, bypassing the caches        *
+*************************************************/
+
+/* Used by the lookup proxy helpers, which cache nothing themselves: call the
+driver directly on a handle from search_open().
+
+Arguments:
+  handle       the handle from search_open
+  filename     the filename that was handed to search_open, or NULL
+  keystring    the key or query
+  result       where to put the data
+  errmsg       where to put an error message
+  do_cache     where the driver puts the cacheability of the result
+  opts         type-specific options, or NULL
+
+Returns:       OK, FAIL or DEFER
+*/
+
+int
+search_find_driver(void * handle, const uschar * filename, uschar * keystring,
+  uschar ** result, uschar ** errmsg, uint * do_cache, const uschar * opts)
+{
+tree_node * t = (tree_node *)handle;
+search_cache * c = (search_cache *)(t->data.ptr);
+
+return lookup_list[t->name[0] - '0']->find(c->handle, filename, keystring,
+	  Ustrlen(keystring), result, errmsg, do_cache, opts);
+}
+
+
+
+
 /*************************************************
 * Find one item in database, possibly wildcarded *
 *************************************************/
@@ -814,6 +1719,10 @@ else if (partial >= 0)
   int len = Ustrlen(keystring);
   uschar * keystring2;
 
+  if (cache_rd)
+    search_partial_fill(handle, filename, keystring, partial, affix, affixlen,
+      opts);
+
   /* Try with the affix on the front, except for a zero-length affix */
 
   if (affixlen == 0) keystring2 = keystring; else
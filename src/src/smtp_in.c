@@ -48,9 +48,10 @@ we need room to handle large base64-encoded AUTHs for GSSAPI.
 
 #define SMTP_CMD_BUFFER_SIZE  16384
 
-/* Size of buffer for reading SMTP incoming packets */
+/* The buffer for reading SMTP incoming packets is sized by the
+smtp_receive_buffer_size option, with this as the floor */
 
-#define IN_BUFFER_SIZE  8192
+#define IN_BUFFER_MIN  1024
 
 /* Structure for SMTP command list */
 
@@ -167,6 +168,7 @@ static int  count_nonmail;
 static int  nonmail_command_count;
 static int  synprot_error_count;
 static int  unknown_command_count;
+static int  rcpt_prefetch_ahead;	/* pipelined RCPTs already prefetched */
 static int  sync_cmd_limit;
 static int  smtp_write_error = 0;
 
@@ -442,11 +444,14 @@ smtp_buf_init(void)
 {
 /* Set up the buffer for inputting using direct read() calls, and arrange to
 call the local functions instead of the standard C ones.  Place a NUL at the
-end of the buffer to safety-stop C-string reads from it. */
+end of the buffer to safety-stop C-string reads from it.  A bigger buffer
+means fewer read() calls for pipelined commands and message data. */
 
-if (!(smtp_inbuffer = US malloc(IN_BUFFER_SIZE)))
+if (smtp_receive_buffer_size < IN_BUFFER_MIN)
+  smtp_receive_buffer_size = IN_BUFFER_MIN;
+if (!(smtp_inbuffer = US malloc(smtp_receive_buffer_size)))
   log_write(0, LOG_MAIN|LOG_PANIC_DIE, "malloc() failed for SMTP input buffer");
-smtp_inbuffer[IN_BUFFER_SIZE-1] = '\0';
+smtp_inbuffer[smtp_receive_buffer_size-1] = '\0';
 
 smtp_inptr = smtp_inend = smtp_inbuffer;
 smtp_had_eof = smtp_had_error = 0;
@@ -454,6 +459,34 @@ smtp_had_eof = smtp_had_error = 0;
 
 
 
+/* Note a failed read of the SMTP input, or EOF if rc is zero. A timeout or
+signal does not return. */
+
+static void
+smtp_read_failed(int rc, int save_errno)
+{
+/* Must put the error text in fixed store, because this might be during
+header reading, where it releases unused store above the header. */
+if (rc < 0)
+  {
+  if (had_command_timeout)		/* set by signal handler */
+    smtp_command_timeout_exit();	/* does not return */
+  if (had_command_sigterm)
+    smtp_command_sigterm_exit();
+  if (had_data_timeout)
+    smtp_data_timeout_exit();
+  if (had_data_sigint)
+    smtp_data_sigint_exit();
+
+  smtp_had_error = save_errno;
+  smtp_read_error = string_copy_perm(
+    string_sprintf(" (error: %s)", strerror(save_errno)), FALSE);
+  }
+else
+  smtp_had_eof = 1;
+}
+
+
 /* Refill the buffer, and notify DKIM verification code.
 Return false for error or EOF.
 */
@@ -470,30 +503,12 @@ if (smtp_receive_timeout > 0) ALARM(smtp_receive_timeout);
 /* Limit amount read, so non-message data is not fed to DKIM.
 Take care to not touch the safety NUL at the end of the buffer. */
 
-rc = read(fileno(smtp_in), smtp_inbuffer, MIN(IN_BUFFER_SIZE-1, lim));
+rc = read(fileno(smtp_in), smtp_inbuffer, MIN(smtp_receive_buffer_size-1, lim));
 save_errno = errno;
 if (smtp_receive_timeout > 0) ALARM_CLR(0);
 if (rc <= 0)
   {
-  /* Must put the error text in fixed store, because this might be during
-  header reading, where it releases unused store above the header. */
-  if (rc < 0)
-    {
-    if (had_command_timeout)		/* set by signal handler */
-      smtp_command_timeout_exit();	/* does not return */
-    if (had_command_sigterm)
-      smtp_command_sigterm_exit();
-    if (had_data_timeout)
-      smtp_data_timeout_exit();
-    if (had_data_sigint)
-      smtp_data_sigint_exit();
-
-    smtp_had_error = save_errno;
-    smtp_read_error = string_copy_perm(
-      string_sprintf(" (error: %s)", strerror(save_errno)), FALSE);
-    }
-  else
-    smtp_had_eof = 1;
+  smtp_read_failed(rc, save_errno);
   return FALSE;
   }
 #ifndef DISABLE_DKIM
@@ -863,6 +878,84 @@ chunking_data_left -= *len;
 return buf;
 }
 
+#ifdef EXIM_HAVE_SPLICE
+/* Move up to len bytes of the current BDAT chunk from the socket to the file
+fd within the kernel, through a pipe, without copying them into the input
+buffer. This is possible only when nothing is buffered, the input is not TLS,
+and DKIM (or ARC) verification has no body hash to compute, as none of the
+bytes are seen. The pipe is made on first use and kept for the connection.
+
+Returns: the number moved; 0 if splicing cannot be used, so that the caller
+	 reads the data as usual; -1 for EOF or an error reading, which is
+	 noted as for smtp_refill(); -2 for an error writing
+*/
+
+int
+bdat_splice(int fd, unsigned len)
+{
+static int pipefd[2] = {-1, -1};
+static BOOL unusable = FALSE;
+ssize_t n;
+int save_errno;
+
+if (  unusable || len == 0 || chunking_data_left <= 0
+   || lwr_receive_getbuf != smtp_getbuf || smtp_hasc()
+#ifndef DISABLE_DKIM
+   || dkim_exim_verify_wants_body()
+#endif
+   )
+  return 0;
+
+if (pipefd[0] < 0)
+  {
+  if (pipe(pipefd) != 0)
+    { unusable = TRUE; return 0; }
+  for (int i = 0; i < 2; i++)
+    (void)fcntl(pipefd[i], F_SETFD, fcntl(pipefd[i], F_GETFD) | FD_CLOEXEC);
+# ifdef F_SETPIPE_SZ
+  (void)fcntl(pipefd[1], F_SETPIPE_SZ, 1024*1024);
+# endif
+  }
+
+if (len > chunking_data_left) len = chunking_data_left;
+fflush(smtp_out);
+if (smtp_receive_timeout > 0) ALARM(smtp_receive_timeout);
+n = splice(fileno(smtp_in), NULL, pipefd[1], NULL, len, SPLICE_F_MOVE);
+save_errno = errno;
+if (smtp_receive_timeout > 0) ALARM_CLR(0);
+
+if (n <= 0)
+  {
+  /* The input is not something that can be spliced; nothing was taken */
+
+  if (n < 0 && (save_errno == EINVAL || save_errno == ENOSYS))
+    {
+    DEBUG(D_receive) debug_printf("CHUNKING: cannot splice input: %s\n",
+      strerror(save_errno));
+    unusable = TRUE;
+    return 0;
+    }
+  smtp_read_failed(n, save_errno);
+  return -1;
+  }
+chunking_data_left -= n;
+
+for (ssize_t left = n, m; left > 0; left -= m)
+  if ((m = splice(pipefd[0], NULL, fd, NULL, left, SPLICE_F_MOVE)) <= 0)
+    {
+    /* Drop whatever is left in the pipe along with it */
+
+    save_errno = m < 0 ? errno : EIO;
+    (void)close(pipefd[0]);
+    (void)close(pipefd[1]);
+    pipefd[0] = pipefd[1] = -1;
+    errno = save_errno;
+    return -2;
+    }
+return n;
+}
+#endif	/*EXIM_HAVE_SPLICE*/
+
 void
 bdat_flush_data(void)
 {
@@ -1628,9 +1721,11 @@ Returns:    nothing
 void *
 smtp_reset(void *reset_point)
 {
+callout_held_close(US"transaction reset");
 recipients_list = NULL;
 rcpt_count = rcpt_defer_count = rcpt_fail_count =
   raw_recipients_count = recipients_count = recipients_list_max = 0;
+rcpt_prefetch_ahead = 0;
 message_linecount = 0;
 message_size = -1;
 message_body = message_body_end = NULL;
@@ -1993,6 +2088,21 @@ if (Ustrncmp(conn_info, US"SMTP ", 5) == 0) conn_info += 5;
 log_write(0, LOG_MAIN, "TLS error on %s %s", conn_info, errstr);
 return FALSE;
 }
+
+
+/* Run the server side of a TLS handshake, timing it for the metrics option */
+
+static int
+smtp_tls_server_start(uschar ** errstr)
+{
+struct timeval start;
+int rc;
+
+if (metrics) exim_gettime(&start);
+rc = tls_server_start(errstr);
+if (metrics) metrics_time(METRICS_TIME_TLS_SERVER, 0, &start);
+return rc;
+}
 #endif
 
 
@@ -2088,8 +2198,15 @@ uschar *user_msg, *log_msg;
 uschar *code, *esc;
 uschar *p, *s;
 gstring * ss;
+struct timeval banner_start;
 
 gettimeofday(&smtp_connection_start, NULL);
+trace_event(TRACE_SMTP_CONN, sender_host_port, interface_port, 0);
+if (PHASE_TIMING)
+  {
+  exim_gettime(&banner_start);
+  metrics_phases_reset(TRUE);
+  }
 for (smtp_ch_index = 0; smtp_ch_index < SMTP_HBUFF_SIZE; smtp_ch_index++)
   smtp_connection_had[smtp_ch_index] = SCH_NONE;
 smtp_ch_index = 0;
@@ -2199,6 +2316,19 @@ if (!f.sender_host_unknown)
   int rc;
   BOOL reserved_host = FALSE;
 
+  /* Start the reverse lookup of the host, and the lookups of the dnslists the
+  ACLs will make, so that the answers arrive while the connection gets going,
+  if so configured. */
+
+  if (dns_prefetch_on_connect && sender_host_address && !sender_host_name)
+    {
+    const uschar * ptrname = dns_build_reverse(sender_host_address);
+
+    dns_init(FALSE, FALSE, FALSE);
+    dns_prefetch_start(&ptrname, 1, T_PTR);
+    acl_prefetch_dnslists();
+    }
+
   /* Look up IP options (source routing info) on the socket if this is not an
   -oMa "host", and if any are found, log them and drop the connection.
 
@@ -2585,7 +2715,7 @@ smtps port for use with older style SSL MTAs. */
 #ifndef DISABLE_TLS
 if (tls_in.on_connect)
   {
-  if (tls_server_start(&user_msg) != OK)
+  if (smtp_tls_server_start(&user_msg) != OK)
     return smtp_log_tls_fail(user_msg);
   cmd_list[CL_TLAU].is_mail_cmd = TRUE;
   }
@@ -2698,6 +2828,7 @@ smtp_printf("%Y",
   SP_NO_MORE,
 #endif
   ss);
+if (PHASE_TIMING) metrics_phase(RP_BANNER, &banner_start);
 
 /* Attempt to see if we sent the banner before the last ACK of the 3-way
 handshake arrived.  If so we must have managed a TFO. */
@@ -2788,6 +2919,7 @@ smtp_respond(uschar * code, int codelen, BOOL final, uschar * msg)
 {
 int esclen = 0;
 uschar *esc = US"";
+BOOL rcpt = fl.rcpt_in_progress, more;
 
 if (!final && f.no_multiline_responses) return;
 
@@ -2814,20 +2946,24 @@ if (fl.rcpt_in_progress)
   }
 
 /* Now output the message, splitting it up into multiple lines if necessary.
-We only handle pipelining these responses as far as nonfinal/final groups,
-not the whole MAIL/RCPT/DATA response set. */
+The final line of a response to RCPT is held back, like a plain "250 Accepted",
+when the client has more commands waiting; a burst of pipelined RCPTs then gets
+its responses, accepts and rejects alike, in one write. Responses to other
+commands are only pipelined as far as nonfinal/final groups. */
+
+more = !final || (rcpt && pipeline_response());
 
 for (;;)
   {
   uschar *nl = Ustrchr(msg, '\n');
   if (!nl)
     {
-    smtp_printf("%.3s%c%.*s%s\r\n", !final, code, final ? ' ':'-', esclen, esc, msg);
+    smtp_printf("%.3s%c%.*s%s\r\n", more, code, final ? ' ':'-', esclen, esc, msg);
     return;
     }
   else if (nl[1] == 0 || f.no_multiline_responses)
     {
-    smtp_printf("%.3s%c%.*s%.*s\r\n", !final, code, final ? ' ':'-', esclen, esc,
+    smtp_printf("%.3s%c%.*s%.*s\r\n", more, code, final ? ' ':'-', esclen, esc,
       (int)(nl - msg), msg);
     return;
     }
@@ -3109,6 +3245,10 @@ if (log_reject_target)
 
 if (!drop) return 0;
 
+/* The response may have been held back for pipelining; the connection is
+going, so push it out now. */
+
+(void) smtp_fflush();
 log_close_event(US"by DROP in ACL");
 
 /* Run the not-quit ACL, but without any custom messages. This should not be a
@@ -3515,6 +3655,7 @@ smtp_quit_handler(uschar ** user_msgp, uschar ** log_msgp)
 HAD(SCH_QUIT);
 f.smtp_in_quit = TRUE;
 incomplete_transaction_log(US"QUIT");
+callout_held_close(US"QUIT received");
 if (  acl_smtp_quit
    && acl_check(ACL_WHERE_QUIT, NULL, acl_smtp_quit, user_msgp, log_msgp)
 	== ERROR)
@@ -3576,6 +3717,98 @@ return *s ? Uatoi(s) : 0;
 *       Initialize for SMTP incoming message     *
 *************************************************/
 
+/* With dns_prefetch_rcpt_domains set, an RCPT command that has more pipelined
+behind it starts the MX lookups for the domains of all of them at once. The
+ACL checks still run one at a time, in order, and the responses go out in
+order; the routing done by verify=recipient (and any callout) then finds the
+DNS answers waiting, instead of making each lookup only when its turn comes.
+Only lines already in the input buffer are looked at. The count of RCPTs seen
+ahead avoids scanning the same lines again for each of them. */
+
+#define RCPT_PREFETCH_MAX 64
+
+static void
+rcpt_prefetch_add(const uschar ** names, int * count, const uschar * domain)
+{
+if (*count >= RCPT_PREFETCH_MAX || !*domain) return;
+for (int i = 0; i < *count; i++)
+  if (strcmpic(names[i], domain) == 0) return;
+if (match_isinlist(domain, CUSS &dns_prefetch_rcpt_domains, 0,
+      &domainlist_anchor, NULL, MCL_DOMAIN, TRUE, NULL) == OK)
+  names[(*count)++] = domain;
+}
+
+static void
+rcpt_dns_prefetch(const uschar * domain)
+{
+const uschar * names[RCPT_PREFETCH_MAX];
+const uschar * buf, * end, * nl;
+unsigned len;
+int count = 0, ahead = 0;
+
+if (rcpt_prefetch_ahead > 0) { rcpt_prefetch_ahead--; return; }
+
+#ifndef DISABLE_TLS
+if (tls_in.active.sock >= 0)
+  buf = tls_peekbuf(&len);
+else
+#endif
+  { buf = smtp_inptr; len = smtp_inend - smtp_inptr; }
+
+rcpt_prefetch_add(names, &count, string_copylc(domain));
+
+for (end = buf + len; buf < end && (nl = memchr(buf, '\n', end - buf));
+     buf = nl + 1)
+  if (nl - buf > 8 && strncmpic(buf, US"RCPT TO:", 8) == 0)
+    {
+    const uschar * s = buf + 8, * e, * at = NULL;
+
+    ahead++;
+    while (s < nl && isspace(*s)) s++;
+    if (s < nl && *s == '<') s++;
+    for (e = s; e < nl && *e != '>' && !isspace(*e); e++)
+      if (*e == '@') at = e;
+    if (at)
+      rcpt_prefetch_add(names, &count, string_copylc(string_copyn(at+1, e-at-1)));
+    }
+
+if (ahead == 0) return;
+rcpt_prefetch_ahead = ahead;
+DEBUG(D_receive) debug_printf("%d pipelined RCPT commands ahead\n", ahead);
+dns_init(FALSE, FALSE, FALSE);
+dns_prefetch_start(names, count, T_MX);
+}
+
+
+
+/* Account the time taken to handle an SMTP command, for the phases timed
+for the metrics option and the receive_phases log selector.  For DATA and
+BDAT this is the time until the message body is read, which includes the
+predata ACL.
+
+Arguments:
+  cmd		the command, from smtp_read_command()
+  start		when it was read, from exim_gettime()
+*/
+
+static void
+smtp_cmd_phase(int cmd, const struct timeval * start)
+{
+switch (cmd)
+  {
+  case HELO_CMD:
+  case EHLO_CMD:	metrics_phase(RP_EHLO, start); break;
+  case STARTTLS_CMD:	metrics_phase(RP_STARTTLS, start); break;
+  case AUTH_CMD:	metrics_phase(RP_AUTH, start); break;
+  case MAIL_CMD:	metrics_phase(RP_MAIL, start); break;
+  case RCPT_CMD:	metrics_phase(RP_RCPT, start); break;
+  case DATA_CMD:
+  case BDAT_CMD:	metrics_phase(RP_PREDATA, start); break;
+  }
+}
+
+
+
 /* This function conducts the initial dialogue at the start of an incoming SMTP
 message, and builds a list of recipients. However, if the incoming message
 is part of a batch (-bS option) a separate function is called since it would
@@ -3617,6 +3850,7 @@ for the host). Note: we do NOT reset AUTH at this point. */
 
 reset_point = smtp_reset(reset_point);
 message_ended = END_NOTSTARTED;
+if (PHASE_TIMING) metrics_phases_reset(FALSE);
 
 chunking_state = f.chunking_offered ? CHUNKING_OFFERED : CHUNKING_NOT_OFFERED;
 
@@ -3673,6 +3907,8 @@ while (done <= 0)
   int c;
   uschar *orcpt = NULL;
   int dsn_flags;
+  int cmd;
+  struct timeval cmd_start;
   gstring * g;
 
 #ifdef AUTH_TLS
@@ -3718,13 +3954,17 @@ while (done <= 0)
     }
 #endif
 
-  switch(smtp_read_command(
+  cmd = smtp_read_command(
 #ifndef DISABLE_PIPE_CONNECT
 	  !fl.pipe_connect_acceptable,
 #else
 	  TRUE,
 #endif
-	  GETC_BUFFER_UNLIMITED))
+	  GETC_BUFFER_UNLIMITED);
+  trace_event(TRACE_SMTP_CMD, cmd, (int)(smtp_inend - smtp_inptr), 0);
+  if (PHASE_TIMING) exim_gettime(&cmd_start);
+
+  switch(cmd)
     {
     /* The AUTH command is not permitted to occur inside a transaction, and may
     occur successfully only once per connection. Actually, that isn't quite
@@ -4924,6 +5164,12 @@ while (done <= 0)
 	break;
 	}
 
+      /* Start the DNS lookups for this and any pipelined recipients */
+
+      if (  dns_prefetch_rcpt_domains && f.smtp_in_pipelining_advertised
+	 && !f.recipients_discarded)
+	rcpt_dns_prefetch(recipient + recipient_domain);
+
       /* If we have passed the threshold for rate limiting, apply the current
       delay, and update it for next time, provided this is a limited host. */
 
@@ -4979,7 +5225,7 @@ while (done <= 0)
 	if (user_msg)
 	  smtp_user_msg(US"250", user_msg);
 	else
-	  smtp_printf("250 Accepted\r\n", SP_NO_MORE);
+	  smtp_printf("250 Accepted\r\n", pipeline_response());
 	rcpt_fail_count++;
 	discarded = TRUE;
 	log_write(0, LOG_MAIN|LOG_REJECT, "%s F=<%s> RCPT %s: "
@@ -5057,6 +5303,7 @@ while (done <= 0)
       f.bdat_readers_wanted = FALSE;
 
     DATA_BDAT:		/* Common code for DATA and BDAT */
+      callout_held_close(US"DATA received");
 #ifndef DISABLE_PIPE_CONNECT
       fl.pipe_connect_acceptable = FALSE;
 #endif
@@ -5284,7 +5531,7 @@ while (done <= 0)
       It seems safest to just wipe away the content rather than leave it as a
       target to jump to. */
 
-      memset(smtp_inbuffer, 0, IN_BUFFER_SIZE);
+      memset(smtp_inbuffer, 0, smtp_receive_buffer_size);
 
       /* Attempt to start up a TLS session, and if successful, discard all
       knowledge that was obtained previously. At least, that's what the RFC says,
@@ -5295,7 +5542,7 @@ while (done <= 0)
       STARTTLS that don't add to the nonmail command count. */
 
       s = NULL;
-      if ((rc = tls_server_start(&s)) == OK)
+      if ((rc = smtp_tls_server_start(&s)) == OK)
 	{
 	if (!tls_remember_esmtp)
 	  fl.helo_seen = fl.esmtp = fl.auth_advertised = f.smtp_in_pipelining_advertised = FALSE;
@@ -5706,6 +5953,7 @@ while (done <= 0)
   COMMAND_LOOP:
   last_was_rej_mail = was_rej_mail;     /* Remember some last commands for */
   last_was_rcpt = was_rcpt;             /* protocol error handling */
+  if (PHASE_TIMING) smtp_cmd_phase(cmd, &cmd_start);
   }
 
 return done - 2;  /* Convert yield values */
@@ -318,6 +318,252 @@ return sock;
 }
 
 
+
+/*************************************************
+*   Race connections to equal-preference hosts   *
+*************************************************/
+
+/* When connect_race_max is greater than one, the transport calls this for
+a host before trying it, and connections are started to that host and to
+following hosts of the same MX preference, staggered by connect_race_delay,
+with a new attempt started at once whenever one fails. The first to complete
+its TCP handshake wins and the rest are abandoned. The result (the connected
+socket, or the errors seen) is held here for smtp_sock_connect() to pick up
+when the transport reaches that host, so nothing else about the delivery
+changes.  TFO is requested for hosts matching hosts_try_fastopen. */
+
+#define SMTP_RACE_MAX	8
+
+typedef struct {
+  const uschar *	address;
+  int			port;
+  int			sock;		/* connected socket, or -1 */
+  int			err;		/* errno for a failed attempt */
+  BOOL			tfo;		/* TFO was requested */
+} race_result;
+
+static race_result race_results[SMTP_RACE_MAX];
+static int race_count = 0;
+
+
+/* Close any raced connection that was not used, and forget the results. */
+
+void
+smtp_race_discard(void)
+{
+for (int i = 0; i < race_count; i++)
+  if (race_results[i].sock >= 0) (void) close(race_results[i].sock);
+race_count = 0;
+}
+
+
+static race_result *
+race_find(const uschar * address, int port)
+{
+for (race_result * r = race_results; r < race_results + race_count; r++)
+  if (r->port == port && Ustrcmp(r->address, address) == 0)
+    return r;
+return NULL;
+}
+
+
+static int
+race_elapsed(const struct timeval * start)
+{
+struct timeval now;
+gettimeofday(&now, NULL);
+return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_usec - start->tv_usec) / 1000;
+}
+
+
+/* Arguments:
+  host        the host about to be tried, with its address set
+  port        the default port for hosts with none of their own
+  tblock      the transport
+  addrlist    the addresses being delivered (for interface expansion errors)
+  msg         for interface expansion errors
+
+Returns:      the host whose connection won, or NULL if there was no race or
+              no connection was made
+*/
+
+host_item *
+smtp_race_connect(host_item * host, int port, transport_instance * tblock,
+  address_item * addrlist, uschar * msg)
+{
+smtp_transport_options_block * ob =
+  (smtp_transport_options_block *)tblock->options_block;
+host_item * cand[SMTP_RACE_MAX];
+struct pollfd pfd[SMTP_RACE_MAX];
+BOOL tfo[SMTP_RACE_MAX];
+int max = MIN(ob->connect_race_max, SMTP_RACE_MAX);
+int n = 1, started = 0, live = 0, next_start = 0, winner = -1;
+BOOL timed_out = FALSE;
+struct timeval start;
+
+/* An earlier race may have already found the fate of this host */
+
+if (race_find(host->address, host->port == PORT_NONE ? port : host->port))
+  return NULL;
+smtp_race_discard();
+
+cand[0] = host;
+for (host_item * h = host->next; h && n < max && h->mx == host->mx; h = h->next)
+  if (h->address && h->status == hstatus_unknown)
+    cand[n++] = h;
+if (n < 2) return NULL;
+
+DEBUG(D_transport) debug_printf("racing connections to %d hosts\n", n);
+gettimeofday(&start, NULL);
+
+for (;;)
+  {
+  int now = race_elapsed(&start), wait = -1, rc;
+
+  /* Start the next attempt if it is due, or if nothing is in progress */
+
+  if (started < n && (live == 0 || now >= next_start))
+    {
+    host_item * h = cand[started];
+    smtp_connect_args sc = {.tblock = tblock, .ob = ob, .host = h, .sock = -1};
+    int hport = h->port == PORT_NONE ? port : h->port;
+    int sock;
+
+    sc.host_af = Ustrchr(h->address, ':') ? AF_INET6 : AF_INET;
+    if (  ob->interface && *ob->interface
+       && !smtp_get_interface(ob->interface, sc.host_af, addrlist,
+				&sc.interface, msg))
+      break;
+
+    HDEBUG(D_transport) debug_printf_indent("%s [%s]:%d ",
+      h->name, h->address, hport);
+
+    tfo[started] = FALSE;
+    pfd[started].fd = -1;
+    pfd[started].events = POLLOUT;
+    pfd[started].revents = 0;
+
+    if ((sock = smtp_boundsock(&sc)) >= 0)
+      {
+      BOOL tfo_ok = FALSE;
+#ifdef TCP_FASTOPEN
+      tfo_ok = verify_check_given_host(CUSS &ob->hosts_try_fastopen, h) == OK;
+#endif
+      if ((rc = ip_connect_start(sock, sc.host_af, h->address, hport, tfo_ok)) >= 0)
+	{
+	tfo[started] = rc > 0;
+	pfd[started].fd = sock;
+	live++;
+	}
+      else
+	{
+	int save_errno = errno;
+	(void) close(sock);
+	errno = save_errno;
+	}
+      }
+
+    if (pfd[started].fd < 0)
+      {
+      race_results[race_count++] = (race_result)
+	{.address = h->address, .port = hport, .sock = -1, .err = errno};
+      HDEBUG(D_transport) debug_printf(" failed: %s\n", strerror(errno));
+      }
+    started++;
+    next_start = now + ob->connect_race_delay;
+    continue;
+    }
+
+  if (live == 0) break;				/* every attempt failed */
+
+  if (started < n) wait = next_start - now;
+  if (ob->connect_timeout > 0)
+    {
+    int left = ob->connect_timeout * 1000 - now;
+    if (left <= 0) { timed_out = TRUE; break; }
+    if (wait < 0 || left < wait) wait = left;
+    }
+
+  if ((rc = poll(pfd, started, wait)) < 0)
+    {
+    if (errno == EINTR) continue;
+    break;
+    }
+
+  for (int i = 0; i < started && rc > 0; i++) if (pfd[i].revents)
+    {
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    rc--;
+    if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+      err = errno;
+    if (err == 0) { winner = i; break; }
+
+    HDEBUG(D_transport) debug_printf("connect to %s [%s] failed: %s\n",
+      cand[i]->name, cand[i]->address, strerror(err));
+    (void) close(pfd[i].fd);
+    pfd[i].fd = -1;
+    live--;
+    race_results[race_count++] = (race_result)
+      {.address = cand[i]->address,
+	.port = cand[i]->port == PORT_NONE ? port : cand[i]->port,
+	.sock = -1, .err = err};
+    }
+  if (winner >= 0) break;
+  }
+
+/* Abandon everything still in progress. The lead host has had the whole of
+connect_timeout if we got here without a winner, so record a timeout for it;
+the others are left to be tried normally in their turn. */
+
+for (int i = 0; i < started; i++)
+  if (pfd[i].fd >= 0 && i != winner)
+    {
+    (void) close(pfd[i].fd);
+    if (i == 0 && timed_out)
+      race_results[race_count++] = (race_result)
+	{.address = host->address,
+	  .port = host->port == PORT_NONE ? port : host->port,
+	  .sock = -1, .err = ETIMEDOUT};
+    }
+
+if (winner < 0) return NULL;
+
+(void) fcntl(pfd[winner].fd, F_SETFL, fcntl(pfd[winner].fd, F_GETFL) & ~O_NONBLOCK);
+race_results[race_count++] = (race_result)
+  {.address = cand[winner]->address,
+    .port = cand[winner]->port == PORT_NONE ? port : cand[winner]->port,
+    .sock = pfd[winner].fd, .err = 0, .tfo = tfo[winner]};
+
+DEBUG(D_transport) debug_printf("connection race won by %s [%s] after %dms\n",
+  cand[winner]->name, cand[winner]->address, race_elapsed(&start));
+return cand[winner];
+}
+
+
+/* If a race has left a result for the host and port of the given connection
+args, take it.  Return the socket, or -1 with errno set for a failed attempt;
+return -2 if there is nothing for this host. */
+
+static int
+race_claim(const smtp_connect_args * sc)
+{
+race_result * r = race_find(sc->host->address, sc->host->port);
+int sock;
+
+if (!r) return -2;
+sock = r->sock;
+r->address = US"";				/* claimed; never matches */
+r->sock = -1;
+if (sock < 0) errno = r->err;
+#ifdef TCP_FASTOPEN
+else if (r->tfo) tcp_out_fastopen = TFO_ATTEMPTED_NODATA;
+#endif
+return sock;
+}
+
+
 /* Arguments:
   host        host item containing name and address and port
   host_af     AF_INET or AF_INET6
@@ -350,6 +596,27 @@ deliver_host_port = sc->host->port;
 if (event_raise(sc->tblock->event_action, US"tcp:connect", NULL, &errno)) return -1;
 #endif
 
+/* A connection race may already have settled this host */
+
+if ((sock = race_count > 0 ? race_claim(sc) : -2) != -2)
+  {
+  if (sc->sock >= 0) (void) close(sc->sock);
+  sc->sock = -1;
+  callout_address = string_sprintf("[%s]:%d", sc->host->address, sc->host->port);
+  if (sock < 0)
+    {
+    HDEBUG(D_transport|D_acl|D_v)
+      debug_printf_indent(" failed in connection race: %s\n", strerror(errno));
+    return -1;
+    }
+  HDEBUG(D_transport|D_acl|D_v)
+    debug_printf_indent(" using raced connection\n");
+  if (  early_data && early_data->data && early_data->len
+     && send(sock, early_data->data, early_data->len, 0) < 0)
+    save_errno = errno;
+  goto CONNECTED;
+  }
+
 if (  (sock = sc->sock) < 0
    && (sock = smtp_boundsock(sc)) < 0)
   save_errno = errno;
@@ -404,6 +671,7 @@ if (!save_errno)
 #endif
   }
 
+CONNECTED:
 if (!save_errno)
   {
   union sockaddr_46 interface_sock;
@@ -931,6 +1199,347 @@ out:
   return yield;
 }
 
+
+
+/*************************************************
+*     Pool of idle connections in the daemon     *
+*************************************************/
+
+/* A connection for which a transport has no further work can, instead of
+being closed, be handed to the daemon over the notifier socket, the fd going as
+SCM_RIGHTS ancillary data. A later delivery to the same destination, with the
+same local identity, borrows it back the same way and carries on as for a
+continued connection. TLS state cannot be handed over; the transport leaves a
+proxy process holding the TLS session, as it does when passing a connection on,
+and the pool holds the cleartext side.
+
+The key is opaque here, and so is the state, which is whatever the borrower
+needs to treat the connection as continued. Only processes running as root or
+the Exim user are served. */
+
+#define SMTP_POOL_MAX	128		/* connections held by the daemon */
+
+typedef struct {
+  uschar	notifier_reqtype;
+  unsigned	idle;			/* park: seconds to hold */
+  int		keylen;
+} pool_req;
+
+
+/* Set up a socket to the daemon; bound to a name if a reply is wanted */
+
+static int
+pool_socket(uschar ** sname)
+{
+struct sockaddr_un sa_un = {.sun_family = AF_UNIX};
+ssize_t len;
+int fd;
+
+if ((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) return -1;
+if (sname)
+  {
+  len = daemon_client_sockname(&sa_un, sname);
+  if (bind(fd, (const struct sockaddr *)&sa_un, (socklen_t)len) < 0)
+    { close(fd); return -1; }
+  }
+len = daemon_notifier_sockname(&sa_un);
+if (connect(fd, (const struct sockaddr *)&sa_un, len) >= 0)
+  return fd;
+
+close(fd);
+#ifndef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
+if (sname) Uunlink(*sname);
+#endif
+return -1;
+}
+
+
+static void
+pool_fd_control(struct msghdr * msg, void * cbuf, size_t cbufsize, int fd)
+{
+struct cmsghdr * cp;
+
+msg->msg_control = cbuf;
+msg->msg_controllen = cbufsize;
+cp = CMSG_FIRSTHDR(msg);
+cp->cmsg_level = SOL_SOCKET;
+cp->cmsg_type = SCM_RIGHTS;
+cp->cmsg_len = CMSG_LEN(sizeof(int));
+memcpy(CMSG_DATA(cp), &fd, sizeof(int));
+}
+
+
+/* Hand a connection to the daemon. The caller closes its own copy.
+
+Arguments:
+  fd		the connection
+  key		destination and identity
+  state		opaque data for the borrower
+  statelen	its length
+  idle		seconds to hold the connection for
+
+Returns:	TRUE if the daemon was sent the connection
+*/
+
+BOOL
+smtp_pool_park(int fd, const uschar * key, const void * state, int statelen,
+  int idle)
+{
+union { struct cmsghdr align; uschar buf[CMSG_SPACE(sizeof(int))]; } cbuf;
+pool_req req = {.notifier_reqtype = NOTIFY_POOL_PARK, .idle = idle,
+		.keylen = Ustrlen(key)};
+struct iovec iov[3] = {
+  {.iov_base = &req, .iov_len = sizeof(req)},
+  {.iov_base = US key, .iov_len = req.keylen},
+  {.iov_base = US state, .iov_len = statelen}};
+struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 3};
+int sock;
+BOOL yield;
+
+if (sizeof(req) + req.keylen + statelen > NOTIFY_MSG_MAX - 1) return FALSE;
+pool_fd_control(&msg, cbuf.buf, sizeof(cbuf.buf), fd);
+
+if ((sock = pool_socket(NULL)) < 0)
+  {
+  DEBUG(D_transport) debug_printf("connection pool: %s\n", strerror(errno));
+  return FALSE;
+  }
+if (!(yield = sendmsg(sock, &msg, 0) >= 0))
+  DEBUG(D_transport) debug_printf("connection pool: sendmsg: %s\n",
+    strerror(errno));
+close(sock);
+return yield;
+}
+
+
+/* Ask the daemon for a held connection.
+
+Arguments:
+  key		destination and identity
+  state		where to point to the state given when the connection was parked
+  statelen	where to put its length
+
+Returns:	the connection, or -1 if none is held
+*/
+
+int
+smtp_pool_borrow(const uschar * key, uschar ** state, int * statelen)
+{
+union { struct cmsghdr align; uschar buf[CMSG_SPACE(sizeof(int))]; } cbuf;
+pool_req req = {.notifier_reqtype = NOTIFY_POOL_BORROW, .keylen = Ustrlen(key)};
+gstring * g;
+uschar * buf, * sname;
+struct iovec iov;
+struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1,
+		     .msg_control = cbuf.buf, .msg_controllen = sizeof(cbuf.buf)};
+ssize_t len;
+int sock, fd = -1;
+
+if (sizeof(req) + req.keylen > NOTIFY_MSG_MAX - 1) return -1;
+if ((sock = pool_socket(&sname)) < 0)
+  {
+  DEBUG(D_transport) debug_printf("connection pool: %s\n", strerror(errno));
+  return -1;
+  }
+
+g = string_catn(NULL, US &req, sizeof(req));
+g = string_catn(g, key, req.keylen);
+buf = store_get(NOTIFY_MSG_MAX, GET_UNTAINTED);
+iov = (struct iovec) {.iov_base = buf, .iov_len = NOTIFY_MSG_MAX};
+
+if (  send(sock, g->s, g->ptr, 0) >= 0
+   && poll_one_fd(sock, POLLIN, 1000) == 1
+   && (len = recvmsg(sock, &msg, 0)) > 1
+   && buf[0]
+   )
+  for (struct cmsghdr * cp = CMSG_FIRSTHDR(&msg); cp; cp = CMSG_NXTHDR(&msg, cp))
+    if (cp->cmsg_level == SOL_SOCKET && cp->cmsg_type == SCM_RIGHTS)
+      {
+      memcpy(&fd, CMSG_DATA(cp), sizeof(int));
+      *state = buf + 1;
+      *statelen = len - 1;
+      break;
+      }
+
+close(sock);
+#ifndef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
+Uunlink(sname);
+#endif
+DEBUG(D_transport) debug_printf("connection pool: %s\n",
+  fd >= 0 ? "borrowed a connection" : "nothing held");
+return fd;
+}
+
+
+
+/* Daemon side. Held connections are kept in malloc store, newest first, as
+the daemon's loop resets its pools. */
+
+typedef struct pool_conn {
+  struct pool_conn *	next;
+  time_t		expires;
+  int			fd;
+  int			keylen;
+  int			statelen;
+  uschar		data[1];	/* key then state */
+} pool_conn;
+
+static pool_conn *	pool_conns = NULL;
+static int		pool_count = 0;
+
+
+static void
+pool_drop(pool_conn ** pp)
+{
+pool_conn * p = *pp;
+(void) close(p->fd);
+*pp = p->next;
+store_free(p);
+pool_count--;
+}
+
+
+/* A held connection on which anything can be read (the server giving up with
+a 421, or just closing) is no use. */
+
+static BOOL
+pool_dead(const pool_conn * p)
+{
+return poll_one_fd(p->fd, POLLIN, 0) != 0;
+}
+
+
+/* Handle a park or borrow request.
+
+Arguments:
+  nfd		the notifier socket
+  buf, len	the request
+  fd		connection passed with the request, or -1
+  sa, salen	the requester's socket address, for the reply
+
+Returns:	TRUE if the passed connection has been taken over
+*/
+
+BOOL
+smtp_pool_at_daemon(int nfd, const uschar * buf, int len, int fd,
+  const struct sockaddr * sa, socklen_t salen)
+{
+pool_req req;
+const uschar * key = buf + sizeof(req);
+
+if (len < sizeof(req)) return FALSE;
+memcpy(&req, buf, sizeof(req));
+if (req.keylen < 0 || req.keylen > len - sizeof(req)) return FALSE;
+
+if (req.notifier_reqtype == NOTIFY_POOL_PARK)
+  {
+  pool_conn * p;
+  int statelen = len - sizeof(req) - req.keylen;
+
+  if (fd < 0 || req.idle == 0) return FALSE;
+  if (pool_count >= SMTP_POOL_MAX)		/* drop the oldest */
+    {
+    pool_conn ** pp = &pool_conns;
+    while ((*pp)->next) pp = &(*pp)->next;
+    pool_drop(pp);
+    }
+
+  p = store_malloc(sizeof(pool_conn) + req.keylen + statelen);
+  p->expires = time(NULL) + req.idle;
+  p->fd = fd;
+  p->keylen = req.keylen;
+  p->statelen = statelen;
+  memcpy(p->data, key, req.keylen + statelen);
+  p->next = pool_conns;
+  pool_conns = p;
+  pool_count++;
+  DEBUG(D_any) debug_printf("connection pool: holding %.*s (%d held)\n",
+    req.keylen, key, pool_count);
+  return TRUE;
+  }
+
+if (req.notifier_reqtype == NOTIFY_POOL_BORROW)
+  {
+  union { struct cmsghdr align; uschar buf[CMSG_SPACE(sizeof(int))]; } cbuf;
+  uschar status = 0;
+  struct iovec iov[2] = {{.iov_base = &status, .iov_len = 1}};
+  struct msghdr msg = {.msg_name = US sa, .msg_namelen = salen,
+		       .msg_iov = iov, .msg_iovlen = 1};
+  pool_conn ** pp = &pool_conns, * p;
+
+  while ((p = *pp))
+    if (p->keylen != req.keylen || memcmp(p->data, key, req.keylen) != 0)
+      pp = &p->next;
+    else if (pool_dead(p))
+      pool_drop(pp);
+    else
+      {
+      status = 1;
+      iov[1] = (struct iovec)
+	{.iov_base = p->data + p->keylen, .iov_len = p->statelen};
+      msg.msg_iovlen = 2;
+      pool_fd_control(&msg, cbuf.buf, sizeof(cbuf.buf), p->fd);
+      break;
+      }
+
+  if (sendmsg(nfd, &msg, 0) < 0)
+    {
+    DEBUG(D_any) debug_printf("%s: sendmsg: %s\n", __FUNCTION__, strerror(errno));
+    }
+  else if (p)
+    {
+    DEBUG(D_any) debug_printf("connection pool: lent %.*s\n", req.keylen, key);
+    pool_drop(pp);
+    }
+  }
+return FALSE;
+}
+
+
+/* Return the time, in milliseconds, until the next held connection is due to
+be dropped, for use as a poll timeout: -1 if nothing is held. */
+
+int
+smtp_pool_timeout(void)
+{
+time_t next = 0, now;
+
+if (!pool_conns) return -1;
+for (pool_conn * p = pool_conns; p; p = p->next)
+  if (!next || p->expires < next) next = p->expires;
+now = time(NULL);
+return next > now ? (int)(next - now) * 1000 : 0;
+}
+
+
+/* Drop all held connections; used in children of the daemon, and by the
+daemon itself before a re-exec */
+
+void
+smtp_pool_close(void)
+{
+while (pool_conns) pool_drop(&pool_conns);
+}
+
+
+/* Drop held connections that have expired or died */
+
+void
+smtp_pool_tick(void)
+{
+time_t now = time(NULL);
+
+for (pool_conn ** pp = &pool_conns, * p; (p = *pp); )
+  if (p->expires <= now || pool_dead(p))
+    {
+    DEBUG(D_any) debug_printf("connection pool: dropping %.*s\n",
+      p->keylen, p->data);
+    pool_drop(pp);
+    }
+  else
+    pp = &p->next;
+}
+
 /* End of smtp_out.c */
 /* vi: aw ai sw=2
 */
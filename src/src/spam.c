@@ -28,6 +28,19 @@ uschar *prev_spamd_address_work = NULL;
 static const uschar * loglabel = US"spam acl condition:";
 
 
+/* Copy a string from the verdict cache to one of the result buffers */
+
+static void
+spam_buffer_set(uschar * buf, size_t size, const uschar * s)
+{
+size_t len = Ustrlen(s);
+
+if (len >= size) len = size - 1;
+memcpy(buf, s, len);
+buf[len] = '\0';
+}
+
+
 static int
 spamd_param_init(spamd_address_container *spamd)
 {
@@ -198,6 +211,8 @@ time_t start;
 size_t read, wrote;
 uschar *spamd_address_work;
 spamd_address_container * sd;
+const uschar * cache_key = NULL, * bh;
+dbdata_scan_verdict * v;
 
 /* stop compiler warning */
 result = 0;
@@ -242,6 +257,29 @@ if (  spam_ok
 if (spam_ok && Ustrcmp(prev_user_name, user_name) == 0)
   return override ? OK : spam_rc;
 
+/* With spam_verdict_cache set, the result of an earlier scan of the same
+message, headers and body, for the same user and servers may be held. */
+
+if (spam_verdict_cache > 0 && (bh = spool_mbox_hash()))
+  {
+  int len;
+
+  cache_key = string_sprintf("spam:%s:%s:%s", user_name, spamd_address_work, bh);
+  if ((v = scan_verdict_get(cache_key, &len)))
+    {
+    const uschar * action = v->data;
+    const uschar * report = action + Ustrlen(action) + 1;
+
+    if (report >= US v + len) report = US"";
+    spamd_score = v->score;
+    spamd_threshold = v->threshold;
+    spam_buffer_set(spam_action_buffer, sizeof(spam_action_buffer), action);
+    spam_buffer_set(spam_report_buffer, sizeof(spam_report_buffer), report);
+    cache_key = NULL;
+    goto RESULT;
+    }
+  }
+
 /* make sure the eml mbox file is spooled up */
 
 if (!(mbox_file = spool_mbox(&mbox_size, NULL, NULL)))
@@ -559,6 +597,7 @@ while (*p != '\0')
 while (*q <= ' ')
   *q-- = '\0';
 
+RESULT:
 spam_report = spam_report_buffer;
 spam_action = spam_action_buffer;
 
@@ -593,6 +632,20 @@ spam_rc = spamd_score >= spamd_threshold
   ? OK	/* spam as determined by user's threshold */
   : FAIL;	/* not spam */
 
+if (cache_key)
+  {
+  int alen = Ustrlen(spam_action_buffer) + 1, rlen = Ustrlen(spam_report_buffer);
+  int len = sizeof(dbdata_scan_verdict) + alen + rlen;
+
+  v = store_get(len, GET_TAINTED);
+  v->found = spam_rc == OK;
+  v->score = spamd_score;
+  v->threshold = spamd_threshold;
+  memcpy(v->data, spam_action_buffer, alen);
+  memcpy(v->data + alen, spam_report_buffer, rlen + 1);
+  scan_verdict_put(cache_key, v, len, spam_verdict_cache);
+  }
+
 /* remember expanded spamd_address if needed */
 if (spamd_address_work != spamd_address)
   prev_spamd_address_work = string_copy(spamd_address_work);
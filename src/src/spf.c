@@ -34,6 +34,14 @@ SPF_response_t  *spf_response_2mx = NULL;
 
 SPF_dns_rr_t  * spf_nxdomain = NULL;
 
+/* For spf_cache_ttl: the least TTL of the DNS records seen, and whether a
+lookup for the current evaluation was deferred.  The library's own DNS cache
+can answer for records fetched earlier in this process, so the least TTL is
+kept over the life of the process, which can only make it too small. */
+
+static unsigned spf_cache_min_ttl = UINT_MAX;
+static BOOL	spf_cache_deferred;
+
 
 gstring *
 spf_lib_version_report(gstring * g)
@@ -88,7 +96,8 @@ if (rr_type == T_SPF)
 
 switch (dns_lookup(dnsa, US domain, rr_type, NULL))
   {
-  case DNS_AGAIN:	srr.herrno = TRY_AGAIN;		break;
+  case DNS_AGAIN:	srr.herrno = TRY_AGAIN;
+			spf_cache_deferred = TRUE;	break;
   case DNS_NOMATCH:	srr.herrno = HOST_NOT_FOUND;	break;
   case DNS_NODATA:	srr.herrno = NO_DATA;		break;
   case DNS_FAIL:
@@ -98,7 +107,11 @@ switch (dns_lookup(dnsa, US domain, rr_type, NULL))
     for (dns_record * rr = dns_next_rr(dnsa, &dnss, RESET_ANSWERS); rr;
 	 rr = dns_next_rr(dnsa, &dnss, RESET_NEXT))
       /* Need to alloc space for all records, so no early-out */
-      if (rr->type == rr_type) found++;
+      if (rr->type == rr_type)
+	{
+	found++;
+	if (rr->ttl < spf_cache_min_ttl) spf_cache_min_ttl = rr->ttl;
+	}
     break;
   }
 
@@ -334,6 +347,90 @@ else for (int i = 0; i < SPF_response_messages(spf_response); i++)
 }
 
 
+/* A result cache, held by the daemon when spf_cache_ttl is set.  The
+key is the whole of the request, as the macros of a record and the generated
+texts can use any part of it: the client address and HELO name as given to
+spf_conn_init(), the envelope sender, and whether the best-guess record was
+used.  The data is the result code followed by the texts for the expansion
+variables, each marked for presence. */
+
+static uschar *
+spf_cache_key(const uschar * sender, int action, int * len)
+{
+gstring * g = string_catn(NULL, US"spf", 4);
+
+g = string_catn(g, action == SPF_PROCESS_FALLBACK ? US"g" : US"m", 1);
+g = string_catn(g, sender_host_address, Ustrlen(sender_host_address) + 1);
+if (sender_helo_name)
+  g = string_catn(g, sender_helo_name, Ustrlen(sender_helo_name));
+g = string_catn(g, US"", 1);
+g = string_catn(g, sender, Ustrlen(sender) + 1);
+*len = g->ptr;
+return g->s;
+}
+
+static gstring *
+spf_cache_addstr(gstring * g, const char * s)
+{
+return s ? string_catn(string_catn(g, US"1", 1), CUS s, Ustrlen(s) + 1)
+	 : string_catn(g, US"0", 1);
+}
+
+static char *
+spf_cache_getstr(const uschar ** pp, const uschar * end)
+{
+const uschar * p = *pp, * q;
+
+if (p >= end || *p++ != '1') { *pp = p; return NULL; }
+if (!(q = memchr(p, 0, end - p))) { *pp = end; return NULL; }
+*pp = q + 1;
+return CS string_copy_malloc(p);
+}
+
+static BOOL
+spf_cache_get(const uschar * key, int keylen)
+{
+uschar * data;
+const uschar * p, * end;
+int len;
+
+if (!search_shared_get_raw(key, keylen, &data, &len) || len < 1)
+  return FALSE;
+if (data[0] >= nelem(spf_result_id_list)) return FALSE;
+
+/* The library frees the texts of a response, so they are malloc()d */
+
+p = data + 1;
+end = data + len;
+spf_response = SPF_response_new(spf_request);
+spf_response->result = data[0];
+spf_response->received_spf = spf_cache_getstr(&p, end);
+spf_response->header_comment = spf_cache_getstr(&p, end);
+spf_response->smtp_comment = spf_cache_getstr(&p, end);
+DEBUG(D_receive) debug_printf("SPF result found in shared cache\n");
+return TRUE;
+}
+
+static void
+spf_cache_put(const uschar * key, int keylen, SPF_response_t * resp)
+{
+SPF_result_t res = SPF_response_result(resp);
+unsigned ttl = spf_cache_min_ttl;
+gstring * g;
+uschar c = res;
+
+if (res == SPF_RESULT_TEMPERROR || spf_cache_deferred || ttl == 0)
+  return;
+if (ttl > (unsigned)spf_cache_ttl) ttl = spf_cache_ttl;
+
+g = string_catn(NULL, &c, 1);
+g = spf_cache_addstr(g, SPF_response_get_received_spf(resp));
+g = spf_cache_addstr(g, SPF_response_get_header_comment(resp));
+g = spf_cache_addstr(g, SPF_response_get_smtp_comment(resp));
+search_shared_put_raw(key, keylen, g->s, g->ptr, ttl);
+}
+
+
 /* spf_process adds the envelope sender address to the existing
    context (if any), retrieves the result, sets up expansion
    strings and evaluates the condition outcome.
@@ -361,14 +458,29 @@ else if (SPF_request_set_env_from(spf_request, CS spf_envelope_sender))
 
 else
   {
-  /* get SPF result */
-  if (action == SPF_PROCESS_FALLBACK)
+  uschar * key = NULL;
+  int keylen;
+
+  if (  spf_cache_ttl > 0 && sender_host_address && search_shared_usable()
+     && spf_cache_get(key = spf_cache_key(spf_envelope_sender, action, &keylen),
+		      keylen))
     {
-    SPF_request_query_fallback(spf_request, &spf_response, CS spf_guess);
-    spf_result_guessed = TRUE;
+    if (action == SPF_PROCESS_FALLBACK) spf_result_guessed = TRUE;
     }
+
+  /* get SPF result */
   else
-    SPF_request_query_mailfrom(spf_request, &spf_response);
+    {
+    spf_cache_deferred = FALSE;
+    if (action == SPF_PROCESS_FALLBACK)
+      {
+      SPF_request_query_fallback(spf_request, &spf_response, CS spf_guess);
+      spf_result_guessed = TRUE;
+      }
+    else
+      SPF_request_query_mailfrom(spf_request, &spf_response);
+    if (key) spf_cache_put(key, keylen, spf_response);
+    }
 
   /* set up expansion items */
   spf_header_comment     = US SPF_response_get_header_comment(spf_response);
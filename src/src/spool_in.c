@@ -12,10 +12,63 @@ not all are needed, and some functionality can be cut out. */
 
 
 #include "exim.h"
+#include <sys/mman.h>
 
 
 
 #ifndef COMPILE_UTILITY
+/*************************************************
+*           Lock a message by its id             *
+*************************************************/
+
+/* With spool_dedup_size set, a data file can be shared by messages with
+identical bodies, and its first line then names only one of them. The
+first-line lock is still taken, so messages sharing a body are handled one at
+a time, but each message also locks a file of its own, <id>-L beside its data
+file, whatever that is shared with. The file is made as needed and removed
+with the message's other files. The lock is held until this process locks
+another message, or exits.
+
+Argument: the id of the message; message_subdir is set
+Returns:  TRUE if locked; else FALSE, with errno zero if the message is
+          locked by another process
+*/
+
+static int spool_msglock_fd = -1;
+
+static BOOL
+spool_lock_message(const uschar * id)
+{
+uschar * fname = spool_fname(US"input", message_subdir, id, US"-L");
+flock_t lock_data = {.l_type = F_WRLCK, .l_whence = SEEK_SET};
+int fd;
+
+if (spool_msglock_fd >= 0)
+  {
+  (void)close(spool_msglock_fd);
+  spool_msglock_fd = -1;
+  }
+
+if ((fd = Uopen(fname, EXIM_CLOEXEC | EXIM_NOFOLLOW | O_RDWR | O_CREAT,
+		SPOOL_MODE)) < 0)
+  return FALSE;
+if (geteuid() == root_uid && exim_fchown(fd, exim_uid, exim_gid, fname) != 0)
+  {
+  (void)close(fd);
+  return FALSE;
+  }
+if (fcntl(fd, F_SETLK, &lock_data) < 0)
+  {
+  (void)close(fd);
+  errno = 0;
+  return FALSE;
+  }
+spool_msglock_fd = fd;
+return TRUE;
+}
+
+
+
 /*************************************************
 *           Open and lock data file              *
 *************************************************/
@@ -39,7 +92,7 @@ int
 spool_open_datafile(const uschar * id)
 {
 struct stat statbuf;
-flock_t lock_data;
+BOOL locked;
 int fd;
 
 /* If split_spool_directory is set (handled by set_subdir_str()), first look for
@@ -93,24 +146,30 @@ because this apparently is needed for running Exim under Cygwin. If the entire
 file is locked in one process, a sub-process cannot access it, even when passed
 an open file descriptor (at least, I think that's the Cygwin story). On real
 Unix systems it doesn't make any difference as long as Exim is consistent in
-what it locks. */
+what it locks. When data files may be shared, the message is also locked by its
+id. */
 
 #ifndef O_CLOEXEC
 (void)fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
 #endif
 
-lock_data.l_type = F_WRLCK;
-lock_data.l_whence = SEEK_SET;
-lock_data.l_start = 0;
-lock_data.l_len = spool_data_start_offset(id);
+if (!(locked = spool_lock_datafile(fd, id)))
+  errno = 0;
+else if (spool_dedup_size > 0)
+  locked = spool_lock_message(id);
 
-if (fcntl(fd, F_SETLK, &lock_data) < 0)
+if (!locked)
   {
-  log_write(L_skip_delivery, LOG_MAIN,
+  int save_errno = errno;
+  if (save_errno)
+    log_write(0, LOG_MAIN, "Spool error for %s-L: %s", id,
+      strerror(save_errno));
+  else
+    log_write(L_skip_delivery, LOG_MAIN,
       "Spool file for %s is locked (another process is handling this message)",
       id);
   (void)close(fd);
-  errno = 0;
+  errno = save_errno;
   return -1;
   }
 
@@ -125,6 +184,56 @@ if (fstat(fd, &statbuf) == 0)
 
 return fd;
 }
+
+
+
+/*************************************************
+*   Open data file for a header-only operation   *
+*************************************************/
+
+/* Operations that only look at a message, such as -be with -Mset, set
+f.spool_header_only and read just the -H file (with message_subdir set by
+spool_read_header()). The data file is opened on the first reference to a
+variable that depends on the body, that is $message_body, $message_body_end,
+$message_body_size and $message_size, so that most uses never touch it.
+
+It is opened read-only and not locked: nothing is changed, and the message may
+be seen while it is being delivered. Its size is added to message_size, which
+up to now has counted only the headers. There is one attempt.
+
+Arguments:  none
+Returns:    TRUE if deliver_datafile is open
+*/
+
+BOOL
+spool_open_body(void)
+{
+struct stat statbuf;
+
+if (!f.spool_header_only) return deliver_datafile >= 0;
+f.spool_header_only = FALSE;
+
+if ((deliver_datafile = Uopen(spool_fname(US"input", message_subdir, message_id,
+		US"-D"), EXIM_CLOEXEC | EXIM_NOFOLLOW | O_RDONLY, 0)) < 0)
+  {
+  DEBUG(D_deliver) debug_printf_indent("Spool data file for %s: %s\n",
+    message_id, strerror(errno));
+  return FALSE;
+  }
+#ifndef O_CLOEXEC
+(void)fcntl(deliver_datafile, F_SETFD,
+  fcntl(deliver_datafile, F_GETFD) | FD_CLOEXEC);
+#endif
+
+if (fstat(deliver_datafile, &statbuf) == 0)
+  {
+  message_body_size = statbuf.st_size - spool_data_start_offset(message_id);
+  message_size += message_body_size + 1;
+  }
+DEBUG(D_deliver) debug_printf_indent("Spool data file for %s opened when "
+  "first needed\n", message_id);
+return TRUE;
+}
 #endif  /* COMPILE_UTILITY */
 
 
@@ -232,8 +341,10 @@ f.deliver_firsttime = FALSE;
 f.deliver_freeze = FALSE;
 deliver_frozen_at = 0;
 f.deliver_manual_thaw = FALSE;
+deliver_retry_after = 0;
 /* f.dont_deliver must NOT be reset */
 header_list = header_last = NULL;
+header_index_reset();
 host_lookup_deferred = FALSE;
 host_lookup_failed = FALSE;
 interface_address = NULL;
@@ -261,7 +372,7 @@ smtp_active_hostname = primary_hostname;
 #ifndef COMPILE_UTILITY
 f.spool_file_wireformat = FALSE;
 #endif
-tree_nonrecipients = NULL;
+tree_clear_nonrecipients();
 
 #ifdef EXPERIMENTAL_BRIGHTMAIL
 bmi_run = 0;
@@ -337,6 +448,679 @@ return big_buffer;
 
 
 
+enum { SRO_OK, SRO_READ_ERROR, SRO_FORMAT_ERROR };
+
+/* Handle one of the optional lines in the envelope part of a spool header
+file, each starting with "-".  This is also used for the option records in the
+binary format.
+
+Arguments:
+  line		the line, without its newline
+  fp		the file, from which the value of an ACL variable is read; NULL
+		for the binary format, which has separate records for these
+  where		for a description of where a format error was found
+
+Returns:	SRO_OK, SRO_READ_ERROR or SRO_FORMAT_ERROR
+*/
+
+static int
+spool_read_option(uschar * line, FILE * fp, const uschar ** where)
+{
+const void * proto_mem;
+uschar * var;
+const uschar * p;
+
+proto_mem = line[1] == '-' ? GET_TAINTED : GET_UNTAINTED;
+var = line + (proto_mem == GET_UNTAINTED ? 1 : 2);
+if (*var == '(')				/* marker for quoted value */
+  {
+  uschar * s;
+  for (s = ++var; *s != ')'; s++)
+    if (!*s) return SRO_FORMAT_ERROR;
+#ifndef COMPILE_UTILITY
+    {
+    int idx;
+    if ((idx = search_findtype(var, s - var)) < 0)
+      {
+      DEBUG(D_any)
+	debug_printf("Unrecognised quoter %.*s\n", (int)(s - var), var+1);
+      *where = NULL;
+      return SRO_FORMAT_ERROR;
+      }
+    proto_mem = store_get_quoted(1, GET_TAINTED, idx);
+    }
+#endif  /* COMPILE_UTILITY */
+  var = s + 1;
+  }
+p = var + 1;
+
+switch(*var)
+  {
+  case 'a':
+
+  /* Nowadays we use "-aclc" and "-aclm" for the different types of ACL
+  variable, because Exim allows any number of them, with arbitrary names.
+  The line in the spool file is "-acl[cm] <name> <length>". The name excludes
+  the c or m. */
+
+  if (Ustrncmp(p, "clc ", 4) == 0 ||
+      Ustrncmp(p, "clm ", 4) == 0)
+    {
+    uschar *name, *endptr;
+    int count;
+    tree_node *node;
+    endptr = Ustrchr(var + 5, ' ');
+    *where = US"-aclXn";
+    if (!endptr || !fp) return SRO_FORMAT_ERROR;
+    name = string_sprintf("%c%.*s", var[3],
+      (int)(endptr - var - 5), var + 5);
+    if (sscanf(CS endptr, " %d", &count) != 1) return SRO_FORMAT_ERROR;
+    node = acl_var_create(name);
+    node->data.ptr = store_get(count + 1, proto_mem);
+    if (fread(node->data.ptr, 1, count+1, fp) < count) return SRO_READ_ERROR;
+    ((uschar*)node->data.ptr)[count] = 0;
+    }
+
+  else if (Ustrcmp(p, "llow_unqualified_recipient") == 0)
+    f.allow_unqualified_recipient = TRUE;
+  else if (Ustrcmp(p, "llow_unqualified_sender") == 0)
+    f.allow_unqualified_sender = TRUE;
+
+  else if (Ustrncmp(p, "uth_id", 6) == 0)
+    authenticated_id = string_copy_taint(var + 8, proto_mem);
+  else if (Ustrncmp(p, "uth_sender", 10) == 0)
+    authenticated_sender = string_copy_taint(var + 12, proto_mem);
+  else if (Ustrncmp(p, "ctive_hostname", 14) == 0)
+    smtp_active_hostname = string_copy_taint(var + 16, proto_mem);
+
+  /* For long-term backward compatibility, we recognize "-acl", which was
+  used before the number of ACL variables changed from 10 to 20. This was
+  before the subsequent change to an arbitrary number of named variables.
+  This code is retained so that upgrades from very old versions can still
+  handle old-format spool files. The value given after "-acl" is a number
+  that is 0-9 for connection variables, and 10-19 for message variables. */
+
+  else if (Ustrncmp(p, "cl ", 3) == 0)
+    {
+    unsigned index, count;
+    uschar name[20];   /* Need plenty of space for %u format */
+    tree_node * node;
+    *where = US"-acl (old)";
+    if (  !fp
+       || sscanf(CS var + 4, "%u %u", &index, &count) != 2
+       || index >= 20
+       || count > 16384	/* arbitrary limit on variable size */
+       )
+      return SRO_FORMAT_ERROR;
+    if (index < 10)
+      (void) string_format(name, sizeof(name), "%c%u", 'c', index);
+    else
+      (void) string_format(name, sizeof(name), "%c%u", 'm', index - 10);
+    node = acl_var_create(name);
+    node->data.ptr = store_get(count + 1, proto_mem);
+    /* We sanity-checked the count, so disable the Coverity error */
+    /* coverity[tainted_data] */
+    if (fread(node->data.ptr, 1, count+1, fp) < count) return SRO_READ_ERROR;
+    (US node->data.ptr)[count] = '\0';
+    }
+  break;
+
+  case 'b':
+  if (Ustrncmp(p, "ody_linecount", 13) == 0)
+    body_linecount = Uatoi(var + 14);
+  else if (Ustrncmp(p, "ody_zerocount", 13) == 0)
+    body_zerocount = Uatoi(var + 14);
+#ifdef EXPERIMENTAL_BRIGHTMAIL
+  else if (Ustrncmp(p, "mi_verdicts ", 12) == 0)
+    bmi_verdicts = string_copy_taint(var + 13, proto_mem);
+#endif
+  break;
+
+  case 'd':
+  if (Ustrcmp(p, "eliver_firsttime") == 0)
+    f.deliver_firsttime = TRUE;
+  else if (Ustrncmp(p, "sn_ret", 6) == 0)
+    dsn_ret= atoi(CS var + 7);
+  else if (Ustrncmp(p, "sn_envid", 8) == 0)
+    dsn_envid = string_copy_taint(var + 10, proto_mem);
+#ifndef COMPILE_UTILITY
+  else if (Ustrncmp(p, "ebug_selector ", 14) == 0)
+    debug_selector = strtol(CS var + 15, NULL, 0);
+  else if (Ustrncmp(p, "ebuglog_name ", 13) == 0)
+    debug_logging_from_spool(var + 14);
+#endif
+  break;
+
+  case 'f':
+  if (Ustrncmp(p, "rozen", 5) == 0)
+    {
+    f.deliver_freeze = TRUE;
+    if (sscanf(CS var+6, TIME_T_FMT, &deliver_frozen_at) != 1)
+      return SRO_READ_ERROR;
+    }
+  break;
+
+  case 'h':
+  if (Ustrcmp(p, "ost_lookup_deferred") == 0)
+    host_lookup_deferred = TRUE;
+  else if (Ustrcmp(p, "ost_lookup_failed") == 0)
+    host_lookup_failed = TRUE;
+  else if (Ustrncmp(p, "ost_auth_pubname", 16) == 0)
+    sender_host_auth_pubname = string_copy_taint(var + 18, proto_mem);
+  else if (Ustrncmp(p, "ost_auth", 8) == 0)
+    sender_host_authenticated = string_copy_taint(var + 10, proto_mem);
+  else if (Ustrncmp(p, "ost_name", 8) == 0)
+    sender_host_name = string_copy_taint(var + 10, proto_mem);
+  else if (Ustrncmp(p, "elo_name", 8) == 0)
+    sender_helo_name = string_copy_taint(var + 10, proto_mem);
+
+  /* We now record the port number after the address, separated by a
+  dot. For compatibility during upgrading, do nothing if there
+  isn't a value (it gets left at zero). */
+
+  else if (Ustrncmp(p, "ost_address", 11) == 0)
+    {
+    sender_host_port = host_address_extract_port(var + 13);
+    sender_host_address = string_copy_taint(var + 13, proto_mem);
+    }
+  break;
+
+  case 'i':
+  if (Ustrncmp(p, "nterface_address", 16) == 0)
+    {
+    interface_port = host_address_extract_port(var + 18);
+    interface_address = string_copy_taint(var + 18, proto_mem);
+    }
+  else if (Ustrncmp(p, "dent", 4) == 0)
+    sender_ident = string_copy_taint(var + 6, proto_mem);
+  break;
+
+  case 'l':
+  if (Ustrcmp(p, "ocal") == 0)
+    f.sender_local = TRUE;
+  else if (Ustrcmp(var, "localerror") == 0)
+    f.local_error_message = TRUE;
+#ifdef HAVE_LOCAL_SCAN
+  else if (Ustrncmp(p, "ocal_scan ", 10) == 0)
+    local_scan_data = string_copy_taint(var + 11, proto_mem);
+#endif
+  break;
+
+  case 'm':
+  if (Ustrcmp(p, "anual_thaw") == 0)
+    f.deliver_manual_thaw = TRUE;
+  else if (Ustrncmp(p, "ax_received_linelength", 22) == 0)
+    max_received_linelength = Uatoi(var + 23);
+  break;
+
+  case 'N':
+  if (*p == 0) f.dont_deliver = TRUE;   /* -N */
+  break;
+
+  case 'r':
+  if (Ustrncmp(p, "eceived_protocol", 16) == 0)
+    received_protocol = string_copy_taint(var + 18, proto_mem);
+  else if (Ustrncmp(p, "eceived_time_usec", 17) == 0)
+    {
+    unsigned usec;
+    if (sscanf(CS var + 20, "%u", &usec) == 1)
+      {
+      received_time.tv_usec = usec;
+      if (!received_time_complete.tv_sec) received_time_complete.tv_usec = usec;
+      }
+    }
+  else if (Ustrncmp(p, "eceived_time_complete", 21) == 0)
+    {
+    unsigned sec, usec;
+    if (sscanf(CS var + 23, "%u.%u", &sec, &usec) == 2)
+      {
+      received_time_complete.tv_sec = sec;
+      received_time_complete.tv_usec = usec;
+      }
+    }
+  else if (Ustrncmp(p, "etry_after ", 11) == 0)
+    (void) sscanf(CS var + 12, TIME_T_FMT, &deliver_retry_after);
+  break;
+
+  case 's':
+  if (Ustrncmp(p, "ender_set_untrusted", 19) == 0)
+    f.sender_set_untrusted = TRUE;
+#ifdef WITH_CONTENT_SCAN
+  else if (Ustrncmp(p, "pam_bar ", 8) == 0)
+    spam_bar = string_copy_taint(var + 9, proto_mem);
+  else if (Ustrncmp(p, "pam_score ", 10) == 0)
+    spam_score = string_copy_taint(var + 11, proto_mem);
+  else if (Ustrncmp(p, "pam_score_int ", 14) == 0)
+    spam_score_int = string_copy_taint(var + 15, proto_mem);
+#endif
+#ifndef COMPILE_UTILITY
+  else if (Ustrncmp(p, "pool_file_wireformat", 20) == 0)
+    f.spool_file_wireformat = TRUE;
+#endif
+#if defined(SUPPORT_I18N) && !defined(COMPILE_UTILITY)
+  else if (Ustrncmp(p, "mtputf8", 7) == 0)
+    message_smtputf8 = TRUE;
+#endif
+  break;
+
+#ifndef DISABLE_TLS
+  case 't':
+  if (Ustrncmp(p, "ls_", 3) == 0)
+    {
+    const uschar * q = p + 3;
+    if (Ustrncmp(q, "certificate_verified", 20) == 0)
+      tls_in.certificate_verified = TRUE;
+    else if (Ustrncmp(q, "cipher", 6) == 0)
+      tls_in.cipher = string_copy_taint(q+7, proto_mem);
+# ifndef COMPILE_UTILITY	/* tls support fns not built in */
+    else if (Ustrncmp(q, "ourcert", 7) == 0)
+      (void) tls_import_cert(q+8, &tls_in.ourcert);
+    else if (Ustrncmp(q, "peercert", 8) == 0)
+      (void) tls_import_cert(q+9, &tls_in.peercert);
+# endif
+    else if (Ustrncmp(q, "peerdn", 6) == 0)
+      tls_in.peerdn = string_unprinting(string_copy_taint(q+7, proto_mem));
+    else if (Ustrncmp(q, "sni", 3) == 0)
+      tls_in.sni = string_unprinting(string_copy_taint(q+4, proto_mem));
+    else if (Ustrncmp(q, "ocsp", 4) == 0)
+      tls_in.ocsp = q[5] - '0';
+# ifndef DISABLE_TLS_RESUME
+    else if (Ustrncmp(q, "resumption", 10) == 0)
+      tls_in.resumption = q[11] - 'A';
+# endif
+    else if (Ustrncmp(q, "ver", 3) == 0)
+      tls_in.ver = string_copy_taint(q+4, proto_mem);
+    }
+  break;
+#endif
+
+#if defined(SUPPORT_I18N) && !defined(COMPILE_UTILITY)
+  case 'u':
+  if (Ustrncmp(p, "tf8_downcvt", 11) == 0)
+    message_utf8_downconvert = 1;
+  else if (Ustrncmp(p, "tf8_optdowncvt", 15) == 0)
+    message_utf8_downconvert = -1;
+  break;
+#endif
+
+  default:    /* Present because some compilers complain if all */
+  break;      /* possibilities are not covered. */
+  }
+return SRO_OK;
+}
+
+
+
+/*************************************************
+*       Read a binary format spool header        *
+*************************************************/
+
+/* See spool_out.c for the layout. Decode a variable-length number, returning
+the position after it, or NULL if it runs off the end of the data. */
+
+static const uschar *
+spb_uint(const uschar * p, const uschar * e, unsigned long * np)
+{
+unsigned long n = 0;
+for (int shift = 0; p < e && shift < 64; shift += 7)
+  {
+  n |= (unsigned long)(*p & 0x7f) << shift;
+  if (!(*p++ & 0x80)) { *np = n; return p; }
+  }
+return NULL;
+}
+
+static const uschar *
+spb_int(const uschar * p, const uschar * e, long * np)
+{
+unsigned long n;
+if ((p = spb_uint(p, e, &n))) *np = (long)(n >> 1) ^ -(long)(n & 1);
+return p;
+}
+
+/* Check that a string is terminated within its record; return the position
+after it, or NULL. */
+
+static uschar *
+spb_string(uschar * p, const uschar * e)
+{
+uschar * z = memchr(p, 0, e - p);
+return z ? z + 1 : NULL;
+}
+
+
+/* Decode the records of a binary format header, which are in tainted store;
+strings are used in place where their taint allows. Records with unknown tags
+are skipped, so that a newer Exim can add them without a version change.
+
+Arguments:
+  buf           the records, following the version byte
+  len           their length
+  read_headers  TRUE if in-store header structures are to be built
+  inheader      set TRUE when the headers are reached
+  where         for a description of where an error was found
+
+Returns:        SRO_OK or SRO_FORMAT_ERROR
+*/
+
+static int
+spool_parse_binary(uschar * buf, size_t len, BOOL read_headers,
+  BOOL * inheader, const uschar ** where)
+{
+uschar * p, * e;
+long v;
+int n, rcount = -1;
+BOOL got_login = FALSE, got_sender = FALSE, got_time = FALSE;
+
+recipients_count = 0;
+
+for (p = buf, e = buf + len; p < e; )
+  {
+  uschar tag = *p++, * r, * re;
+  unsigned long rlen;
+
+  *where = US"binary record";
+  if (!(p = US spb_uint(p, e, &rlen)) || rlen > (unsigned long)(e - p))
+    return SRO_FORMAT_ERROR;
+  r = p;
+  re = p += rlen;
+
+  switch (tag)
+    {
+    case SPB_LOGIN:
+      *where = US"login";
+      if (!spb_string(r, re)) return SRO_FORMAT_ERROR;
+      originator_login = string_copy_taint(r, GET_UNTAINTED);
+      got_login = TRUE;
+      break;
+
+    case SPB_UID:
+    case SPB_GID:
+    case SPB_TIME:
+    case SPB_WARNINGS:
+    case SPB_RCPT_COUNT:
+      *where = US"binary number";
+      if (!spb_int(r, re, &v)) return SRO_FORMAT_ERROR;
+      switch (tag)
+	{
+	case SPB_UID:	originator_uid = (uid_t)v; break;
+	case SPB_GID:	originator_gid = (gid_t)v; break;
+	case SPB_TIME:	received_time.tv_sec = (time_t)v;
+			received_time.tv_usec = 0;
+			received_time_complete = received_time;
+			got_time = TRUE;
+			break;
+	case SPB_WARNINGS: warning_count = (int)v; break;
+	case SPB_RCPT_COUNT:
+	  *where = US"rcpt cnt";
+	  if (rcount >= 0 || v < 0 || v > 16384) return SRO_FORMAT_ERROR;
+	  rcount = (int)v;
+	  recipients_list_max = rcount;
+	  recipients_list = store_get(rcount * sizeof(recipient_item),
+				      GET_UNTAINTED);
+	  break;
+	}
+      break;
+
+    case SPB_SENDER:
+      *where = US"envelope from";
+      if (!spb_string(r, re)) return SRO_FORMAT_ERROR;
+      sender_address = r;
+      got_sender = TRUE;
+      break;
+
+    case SPB_OPTION:
+      *where = US"option";
+      if (!spb_string(r, re) || *r != '-') return SRO_FORMAT_ERROR;
+      if ((n = spool_read_option(r, NULL, where)) != SRO_OK) return n;
+      break;
+
+    case SPB_ACLVAR:
+      {
+      uschar * q, * val;
+      const void * proto_mem = GET_UNTAINTED;
+
+      *where = US"acl variable";
+      if (  !(q = spb_string(r, re))
+	 || !(val = spb_string(q, re))
+	 || !spb_string(val, re)
+	 || (*r != 'c' && *r != 'm')
+	 )
+	return SRO_FORMAT_ERROR;
+      if (*q)
+	{
+	proto_mem = GET_TAINTED;
+#ifndef COMPILE_UTILITY
+	if (Ustrcmp(q, "-") != 0)
+	  {
+	  int idx;
+	  if ((idx = search_findtype(q, Ustrlen(q))) < 0)
+	    {
+	    DEBUG(D_any) debug_printf("Unrecognised quoter %s\n", q);
+	    return SRO_FORMAT_ERROR;
+	    }
+	  proto_mem = store_get_quoted(1, GET_TAINTED, idx);
+	  }
+#endif  /* COMPILE_UTILITY */
+	}
+      acl_var_create(r)->data.ptr = proto_mem == GET_TAINTED
+	? val : string_copy_taint(val, proto_mem);
+      break;
+      }
+
+    case SPB_NONRCPT:
+      *where = US"nondeliver";
+      if (!spb_string(r, re)) return SRO_FORMAT_ERROR;
+      tree_add_nonrecipient(r);
+      break;
+
+    case SPB_RCPT:
+      {
+      recipient_item * ri = recipients_list + recipients_count;
+      const uschar * s;
+      uschar * address, * orcpt, * errors_to;
+      long pno, dsn_flags;
+
+      *where = US"recipient";
+      if (  recipients_count >= rcount
+	 || !(s = spb_int(r, re, &dsn_flags))
+	 || !(s = spb_int(s, re, &pno))
+	 || !(orcpt = spb_string(address = US s, re))
+	 || !(errors_to = spb_string(orcpt, re))
+	 || !spb_string(errors_to, re)
+	 )
+	return SRO_FORMAT_ERROR;
+      ri->address = address;
+      ri->orcpt = *orcpt ? orcpt : NULL;
+      ri->errors_to = *errors_to ? errors_to : NULL;
+      ri->pno = (int)pno;
+      ri->dsn_flags = (int)dsn_flags;
+      recipients_count++;
+      break;
+      }
+
+    /* Each header record is the type letter and the text. As for the text
+    format, the header list is built only if requested. */
+
+    case SPB_HEADER:
+      *inheader = TRUE;
+      *where = US"headers";
+      if (rlen < 2 || re[-1] != 0 || memchr(r + 1, 0, rlen - 2))
+	return SRO_FORMAT_ERROR;
+      if (*r != '*') message_size += rlen - 2;
+      if (read_headers)
+	{
+	header_line * h = store_get(sizeof(header_line), GET_UNTAINTED);
+	h->next = NULL;
+	h->type = *r;
+	h->slen = rlen - 2;
+	h->text = r + 1;
+
+	if (h->type == htype_received) received_count++;
+	if (h->type != htype_old)
+	  for (uschar * s = h->text; (s = Ustrchr(s, '\n')); s++)
+	    message_linecount++;
+
+	if (header_list) header_last->next = h;
+	else header_list = h;
+	header_last = h;
+	}
+      break;
+
+    default:
+      break;
+    }
+  }
+
+/* The fixed items must all have been present */
+
+*where = US"binary envelope";
+if (  !got_login || !got_sender || !got_time
+   || rcount < 0 || recipients_count != rcount)
+  return SRO_FORMAT_ERROR;
+return SRO_OK;
+}
+
+
+/* Called from spool_read_header() when the byte after the first line marks
+the binary format. The rest of the file is read in one go, into tainted store,
+for spool_parse_binary().
+
+Arguments:
+  fp            the file, positioned at the version byte
+  read_headers  TRUE if in-store header structures are to be built
+  inheader      set TRUE when the headers are reached
+  where         for a description of where an error was found
+
+Returns:        SRO_OK, SRO_READ_ERROR or SRO_FORMAT_ERROR
+*/
+
+static int
+spool_read_binary(FILE * fp, BOOL read_headers, BOOL * inheader,
+  const uschar ** where)
+{
+struct stat statbuf;
+uschar * buf;
+long off;
+size_t len;
+int n;
+
+*where = US"binary version";
+if ((n = getc(fp)) == EOF) return SRO_READ_ERROR;
+if (n != SPOOL_BINARY_VERSION) return SRO_FORMAT_ERROR;
+
+*where = US"binary read";
+if (fstat(fileno(fp), &statbuf) != 0 || (off = ftell(fp)) < 0)
+  return SRO_READ_ERROR;
+len = statbuf.st_size - off;
+buf = store_get(len + 1, GET_TAINTED);
+if (fread(buf, 1, len, fp) != len) return SRO_READ_ERROR;
+return spool_parse_binary(buf, len, read_headers, inheader, where);
+}
+
+
+
+#ifndef COMPILE_UTILITY
+/*************************************************
+*        In-memory header for a new message      *
+*************************************************/
+
+/* A process that has just received a message no larger than
+spool_handoff_size keeps an image of its header, in the binary format, so that
+a delivery process it forks can set up from that instead of reading and parsing
+the -H file again. The -H file is still written and remains what matters; the
+image is used only if the file is still the one that was written with it, as
+shown by its inode, size and modification time. Anything else (say, another
+process having updated the file) means it is read from disc as usual. */
+
+static struct {
+  uschar	id[MESSAGE_ID_LENGTH + 1];
+  uschar *	image;			/* malloc'd; survives smtp_reset() */
+  size_t	len;
+  ino_t		ino;
+  off_t		size;
+  time_t	mtime;
+} spool_handoff = { .image = NULL };
+
+
+/* Called from spool_write_header() when it writes a header for a message
+being received. Any previous image is dropped.
+
+Arguments:
+  id        the message id
+  g         the binary format header, apart from its first line, or NULL
+  sb        the result of fstat() on the new -H file
+*/
+
+void
+spool_handoff_set(const uschar * id, const gstring * g, const struct stat * sb)
+{
+if (spool_handoff.image)
+  {
+  store_free(spool_handoff.image);
+  spool_handoff.image = NULL;
+  }
+if (!g || g->ptr < 2) return;
+
+spool_handoff.image = store_malloc(g->ptr);
+memcpy(spool_handoff.image, g->s, spool_handoff.len = g->ptr);
+Ustrncpy(spool_handoff.id, id, MESSAGE_ID_LENGTH);
+spool_handoff.id[MESSAGE_ID_LENGTH] = '\0';
+spool_handoff.ino = sb->st_ino;
+spool_handoff.size = sb->st_size;
+spool_handoff.mtime = sb->st_mtime;
+}
+
+
+/* Called from spool_read_header() for a header wanted by name. The image is
+used (at most) once; it is copied into tainted store for the parser, which
+leaves strings in place, just as it does for a file.
+
+Arguments:
+  name          the -H file's name
+  read_headers  as for spool_read_header()
+  inheader      as for spool_parse_binary()
+  where         ditto
+
+Returns:  SRO_OK, SRO_FORMAT_ERROR, or SRO_READ_ERROR if there is no usable
+          image, for which the file is to be read
+*/
+
+static int
+spool_handoff_read(const uschar * name, BOOL read_headers, BOOL * inheader,
+  const uschar ** where)
+{
+struct stat sb;
+uschar * buf;
+size_t len;
+
+if (  !spool_handoff.image
+   || Ustrncmp(name, spool_handoff.id, MESSAGE_ID_LENGTH) != 0
+   || Ustrcmp(name + MESSAGE_ID_LENGTH, "-H") != 0)
+  return SRO_READ_ERROR;
+
+if (  Ustat(spool_fname(US"input", message_subdir, name, US""), &sb) != 0
+   || sb.st_ino != spool_handoff.ino || sb.st_size != spool_handoff.size
+   || sb.st_mtime != spool_handoff.mtime)
+  {
+  DEBUG(D_deliver) debug_printf_indent("spool file %s changed since it was"
+    " written; not using in-memory copy\n", name);
+  spool_handoff_set(NULL, NULL, NULL);
+  return SRO_READ_ERROR;
+  }
+
+DEBUG(D_deliver) debug_printf_indent("using in-memory copy of spool file %s\n",
+  name);
+len = spool_handoff.len - 2;		/* skip the magic and version bytes */
+buf = store_get(len + 1, GET_TAINTED);
+memcpy(buf, spool_handoff.image + 2, len);
+spool_handoff_set(NULL, NULL, NULL);
+return spool_parse_binary(buf, len, read_headers, inheader, where);
+}
+#endif  /* COMPILE_UTILITY */
+
+
+
 /*************************************************
 *             Read spool header file             *
 *************************************************/
@@ -382,6 +1166,22 @@ be forced by an external setting. */
 
 spool_clear_header_globals();
 
+#ifndef COMPILE_UTILITY
+/* A message just received by this process may have its header in memory.
+Should that somehow not parse, start again from the file. */
+
+if (subdir_set)
+  {
+  if ((n = spool_handoff_read(name, read_headers, &inheader, &where)) == SRO_OK)
+    goto SPOOL_BINARY_DONE;
+  if (n == SRO_FORMAT_ERROR)
+    {
+    spool_clear_header_globals();
+    inheader = FALSE;
+    }
+  }
+#endif  /* COMPILE_UTILITY */
+
 /* Generate the full name and open the file. If message_subdir is already
 set, just look in the given directory. Otherwise, look in both the split
 and unsplit directories, as for the data file above. */
@@ -417,6 +1217,37 @@ if (  (  Ustrlen(big_buffer) != MESSAGE_ID_LENGTH + 3
    )  )
   goto SPOOL_FORMAT_ERROR;
 
+/* A zero byte after the first line marks the binary format, which has its
+own reader. */
+
+where = US"format marker";
+if ((n = getc(fp)) == SPOOL_BINARY_MAGIC)
+  {
+  if ((n = spool_read_binary(fp, read_headers, &inheader, &where)) == SRO_READ_ERROR)
+    goto SPOOL_READ_ERROR;
+  else if (n == SRO_FORMAT_ERROR)
+    goto SPOOL_FORMAT_ERROR;
+
+#ifndef COMPILE_UTILITY
+SPOOL_BINARY_DONE:
+#endif
+  message_age = time(NULL) - received_time.tv_sec;
+#ifndef COMPILE_UTILITY
+  if (f.running_in_test_harness)
+    message_age = test_harness_fudged_queue_time(message_age);
+  host_build_sender_fullhost();
+  DEBUG(D_deliver)
+    {
+    debug_printf_indent("user=%s uid=%ld gid=%ld sender=%s (binary)\n",
+      originator_login, (long int)originator_uid, (long int)originator_gid,
+      sender_address);
+    debug_printf_indent("recipients_count=%d\n", recipients_count);
+    }
+#endif
+  goto SPOOL_READ_DONE;
+  }
+if (n == EOF || ungetc(n, fp) == EOF) goto SPOOL_READ_ERROR;
+
 /* The next three lines in the header file are in a fixed format. The first
 contains the login, uid, and gid of the user who caused the file to be written.
 There are known cases where a negative gid is used, so we allow for both
@@ -502,286 +1333,16 @@ If the line start "--(<lookuptype>)" it is also quoted for the given <lookuptype
 
 for (;;)
   {
-  const void * proto_mem;
-  uschar * var;
-  const uschar * p;
+  int rc;
 
   if (fgets_big_buffer(fp) == NULL) goto SPOOL_READ_ERROR;
   if (big_buffer[0] != '-') break;
   big_buffer[Ustrlen(big_buffer)-1] = 0;
 
-  proto_mem = big_buffer[1] == '-' ? GET_TAINTED : GET_UNTAINTED;
-  var =  big_buffer + (proto_mem == GET_UNTAINTED ? 1 : 2);
-  if (*var == '(')				/* marker for quoted value */
-    {
-    uschar * s;
-    for (s = ++var; *s != ')'; ) s++;
-#ifndef COMPILE_UTILITY
-      {
-      int idx;
-      if ((idx = search_findtype(var, s - var)) < 0)
-	{
-	DEBUG(D_any)
-	  debug_printf("Unrecognised quoter %.*s\n", (int)(s - var), var+1);
-	where = NULL;
-	goto SPOOL_FORMAT_ERROR;
-	}
-      proto_mem = store_get_quoted(1, GET_TAINTED, idx);
-      }
-#endif  /* COMPILE_UTILITY */
-    var = s + 1;
-    }
-  p = var + 1;
-
-  switch(*var)
-    {
-    case 'a':
-
-    /* Nowadays we use "-aclc" and "-aclm" for the different types of ACL
-    variable, because Exim allows any number of them, with arbitrary names.
-    The line in the spool file is "-acl[cm] <name> <length>". The name excludes
-    the c or m. */
-
-    if (Ustrncmp(p, "clc ", 4) == 0 ||
-        Ustrncmp(p, "clm ", 4) == 0)
-      {
-      uschar *name, *endptr;
-      int count;
-      tree_node *node;
-      endptr = Ustrchr(var + 5, ' ');
-      where = US"-aclXn";
-      if (!endptr) goto SPOOL_FORMAT_ERROR;
-      name = string_sprintf("%c%.*s", var[3],
-        (int)(endptr - var - 5), var + 5);
-      if (sscanf(CS endptr, " %d", &count) != 1) goto SPOOL_FORMAT_ERROR;
-      node = acl_var_create(name);
-      node->data.ptr = store_get(count + 1, proto_mem);
-      if (fread(node->data.ptr, 1, count+1, fp) < count) goto SPOOL_READ_ERROR;
-      ((uschar*)node->data.ptr)[count] = 0;
-      }
-
-    else if (Ustrcmp(p, "llow_unqualified_recipient") == 0)
-      f.allow_unqualified_recipient = TRUE;
-    else if (Ustrcmp(p, "llow_unqualified_sender") == 0)
-      f.allow_unqualified_sender = TRUE;
-
-    else if (Ustrncmp(p, "uth_id", 6) == 0)
-      authenticated_id = string_copy_taint(var + 8, proto_mem);
-    else if (Ustrncmp(p, "uth_sender", 10) == 0)
-      authenticated_sender = string_copy_taint(var + 12, proto_mem);
-    else if (Ustrncmp(p, "ctive_hostname", 14) == 0)
-      smtp_active_hostname = string_copy_taint(var + 16, proto_mem);
-
-    /* For long-term backward compatibility, we recognize "-acl", which was
-    used before the number of ACL variables changed from 10 to 20. This was
-    before the subsequent change to an arbitrary number of named variables.
-    This code is retained so that upgrades from very old versions can still
-    handle old-format spool files. The value given after "-acl" is a number
-    that is 0-9 for connection variables, and 10-19 for message variables. */
-
-    else if (Ustrncmp(p, "cl ", 3) == 0)
-      {
-      unsigned index, count;
-      uschar name[20];   /* Need plenty of space for %u format */
-      tree_node * node;
-      where = US"-acl (old)";
-      if (  sscanf(CS var + 4, "%u %u", &index, &count) != 2
-	 || index >= 20
-	 || count > 16384	/* arbitrary limit on variable size */
-         )
-        goto SPOOL_FORMAT_ERROR;
-      if (index < 10)
-        (void) string_format(name, sizeof(name), "%c%u", 'c', index);
-      else
-        (void) string_format(name, sizeof(name), "%c%u", 'm', index - 10);
-      node = acl_var_create(name);
-      node->data.ptr = store_get(count + 1, proto_mem);
-      /* We sanity-checked the count, so disable the Coverity error */
-      /* coverity[tainted_data] */
-      if (fread(node->data.ptr, 1, count+1, fp) < count) goto SPOOL_READ_ERROR;
-      (US node->data.ptr)[count] = '\0';
-      }
-    break;
-
-    case 'b':
-    if (Ustrncmp(p, "ody_linecount", 13) == 0)
-      body_linecount = Uatoi(var + 14);
-    else if (Ustrncmp(p, "ody_zerocount", 13) == 0)
-      body_zerocount = Uatoi(var + 14);
-#ifdef EXPERIMENTAL_BRIGHTMAIL
-    else if (Ustrncmp(p, "mi_verdicts ", 12) == 0)
-      bmi_verdicts = string_copy_taint(var + 13, proto_mem);
-#endif
-    break;
-
-    case 'd':
-    if (Ustrcmp(p, "eliver_firsttime") == 0)
-      f.deliver_firsttime = TRUE;
-    else if (Ustrncmp(p, "sn_ret", 6) == 0)
-      dsn_ret= atoi(CS var + 7);
-    else if (Ustrncmp(p, "sn_envid", 8) == 0)
-      dsn_envid = string_copy_taint(var + 10, proto_mem);
-#ifndef COMPILE_UTILITY
-    else if (Ustrncmp(p, "ebug_selector ", 14) == 0)
-      debug_selector = strtol(CS var + 15, NULL, 0);
-    else if (Ustrncmp(p, "ebuglog_name ", 13) == 0)
-      debug_logging_from_spool(var + 14);
-#endif
-    break;
-
-    case 'f':
-    if (Ustrncmp(p, "rozen", 5) == 0)
-      {
-      f.deliver_freeze = TRUE;
-      if (sscanf(CS var+6, TIME_T_FMT, &deliver_frozen_at) != 1)
-	goto SPOOL_READ_ERROR;
-      }
-    break;
-
-    case 'h':
-    if (Ustrcmp(p, "ost_lookup_deferred") == 0)
-      host_lookup_deferred = TRUE;
-    else if (Ustrcmp(p, "ost_lookup_failed") == 0)
-      host_lookup_failed = TRUE;
-    else if (Ustrncmp(p, "ost_auth_pubname", 16) == 0)
-      sender_host_auth_pubname = string_copy_taint(var + 18, proto_mem);
-    else if (Ustrncmp(p, "ost_auth", 8) == 0)
-      sender_host_authenticated = string_copy_taint(var + 10, proto_mem);
-    else if (Ustrncmp(p, "ost_name", 8) == 0)
-      sender_host_name = string_copy_taint(var + 10, proto_mem);
-    else if (Ustrncmp(p, "elo_name", 8) == 0)
-      sender_helo_name = string_copy_taint(var + 10, proto_mem);
-
-    /* We now record the port number after the address, separated by a
-    dot. For compatibility during upgrading, do nothing if there
-    isn't a value (it gets left at zero). */
-
-    else if (Ustrncmp(p, "ost_address", 11) == 0)
-      {
-      sender_host_port = host_address_extract_port(var + 13);
-      sender_host_address = string_copy_taint(var + 13, proto_mem);
-      }
-    break;
-
-    case 'i':
-    if (Ustrncmp(p, "nterface_address", 16) == 0)
-      {
-      interface_port = host_address_extract_port(var + 18);
-      interface_address = string_copy_taint(var + 18, proto_mem);
-      }
-    else if (Ustrncmp(p, "dent", 4) == 0)
-      sender_ident = string_copy_taint(var + 6, proto_mem);
-    break;
-
-    case 'l':
-    if (Ustrcmp(p, "ocal") == 0)
-      f.sender_local = TRUE;
-    else if (Ustrcmp(var, "localerror") == 0)
-      f.local_error_message = TRUE;
-#ifdef HAVE_LOCAL_SCAN
-    else if (Ustrncmp(p, "ocal_scan ", 10) == 0)
-      local_scan_data = string_copy_taint(var + 11, proto_mem);
-#endif
-    break;
-
-    case 'm':
-    if (Ustrcmp(p, "anual_thaw") == 0)
-      f.deliver_manual_thaw = TRUE;
-    else if (Ustrncmp(p, "ax_received_linelength", 22) == 0)
-      max_received_linelength = Uatoi(var + 23);
-    break;
-
-    case 'N':
-    if (*p == 0) f.dont_deliver = TRUE;   /* -N */
-    break;
-
-    case 'r':
-    if (Ustrncmp(p, "eceived_protocol", 16) == 0)
-      received_protocol = string_copy_taint(var + 18, proto_mem);
-    else if (Ustrncmp(p, "eceived_time_usec", 17) == 0)
-      {
-      unsigned usec;
-      if (sscanf(CS var + 20, "%u", &usec) == 1)
-	{
-	received_time.tv_usec = usec;
-	if (!received_time_complete.tv_sec) received_time_complete.tv_usec = usec;
-	}
-      }
-    else if (Ustrncmp(p, "eceived_time_complete", 21) == 0)
-      {
-      unsigned sec, usec;
-      if (sscanf(CS var + 23, "%u.%u", &sec, &usec) == 2)
-	{
-	received_time_complete.tv_sec = sec;
-	received_time_complete.tv_usec = usec;
-	}
-      }
-    break;
-
-    case 's':
-    if (Ustrncmp(p, "ender_set_untrusted", 19) == 0)
-      f.sender_set_untrusted = TRUE;
-#ifdef WITH_CONTENT_SCAN
-    else if (Ustrncmp(p, "pam_bar ", 8) == 0)
-      spam_bar = string_copy_taint(var + 9, proto_mem);
-    else if (Ustrncmp(p, "pam_score ", 10) == 0)
-      spam_score = string_copy_taint(var + 11, proto_mem);
-    else if (Ustrncmp(p, "pam_score_int ", 14) == 0)
-      spam_score_int = string_copy_taint(var + 15, proto_mem);
-#endif
-#ifndef COMPILE_UTILITY
-    else if (Ustrncmp(p, "pool_file_wireformat", 20) == 0)
-      f.spool_file_wireformat = TRUE;
-#endif
-#if defined(SUPPORT_I18N) && !defined(COMPILE_UTILITY)
-    else if (Ustrncmp(p, "mtputf8", 7) == 0)
-      message_smtputf8 = TRUE;
-#endif
-    break;
-
-#ifndef DISABLE_TLS
-    case 't':
-    if (Ustrncmp(p, "ls_", 3) == 0)
-      {
-      const uschar * q = p + 3;
-      if (Ustrncmp(q, "certificate_verified", 20) == 0)
-	tls_in.certificate_verified = TRUE;
-      else if (Ustrncmp(q, "cipher", 6) == 0)
-	tls_in.cipher = string_copy_taint(q+7, proto_mem);
-# ifndef COMPILE_UTILITY	/* tls support fns not built in */
-      else if (Ustrncmp(q, "ourcert", 7) == 0)
-	(void) tls_import_cert(q+8, &tls_in.ourcert);
-      else if (Ustrncmp(q, "peercert", 8) == 0)
-	(void) tls_import_cert(q+9, &tls_in.peercert);
-# endif
-      else if (Ustrncmp(q, "peerdn", 6) == 0)
-	tls_in.peerdn = string_unprinting(string_copy_taint(q+7, proto_mem));
-      else if (Ustrncmp(q, "sni", 3) == 0)
-	tls_in.sni = string_unprinting(string_copy_taint(q+4, proto_mem));
-      else if (Ustrncmp(q, "ocsp", 4) == 0)
-	tls_in.ocsp = q[5] - '0';
-# ifndef DISABLE_TLS_RESUME
-      else if (Ustrncmp(q, "resumption", 10) == 0)
-	tls_in.resumption = q[11] - 'A';
-# endif
-      else if (Ustrncmp(q, "ver", 3) == 0)
-	tls_in.ver = string_copy_taint(q+4, proto_mem);
-      }
-    break;
-#endif
-
-#if defined(SUPPORT_I18N) && !defined(COMPILE_UTILITY)
-    case 'u':
-    if (Ustrncmp(p, "tf8_downcvt", 11) == 0)
-      message_utf8_downconvert = 1;
-    else if (Ustrncmp(p, "tf8_optdowncvt", 15) == 0)
-      message_utf8_downconvert = -1;
-    break;
-#endif
-
-    default:    /* Present because some compilers complain if all */
-    break;      /* possibilities are not covered. */
-    }
+  if ((rc = spool_read_option(big_buffer, fp, &where)) == SRO_READ_ERROR)
+    goto SPOOL_READ_ERROR;
+  else if (rc == SRO_FORMAT_ERROR)
+    goto SPOOL_FORMAT_ERROR;
   }
 
 /* Build sender_fullhost if required */
@@ -803,6 +1364,7 @@ where = US"nondeliver";
 if (Ustrncmp(big_buffer, "XX\n", 3) != 0 &&
   !read_nonrecipients_tree(&tree_nonrecipients, fp, big_buffer, big_buffer_size))
     goto SPOOL_FORMAT_ERROR;
+tree_index_nonrecipients();
 
 #ifndef COMPILE_UTILITY
 DEBUG(D_deliver) debug_print_tree("Non-recipients", tree_nonrecipients);
@@ -1032,6 +1594,8 @@ while ((n = fgetc(fp)) != EOF)
 line count by adding the body linecount to the header linecount. Close the file
 and give a positive response. */
 
+SPOOL_READ_DONE:
+
 #ifndef COMPILE_UTILITY
 DEBUG(D_deliver) debug_printf_indent("body_linecount=%d message_linecount=%d\n",
   body_linecount, message_linecount);
@@ -1039,7 +1603,7 @@ DEBUG(D_deliver) debug_printf_indent("body_linecount=%d message_linecount=%d\n",
 
 message_linecount += body_linecount;
 
-fclose(fp);
+if (fp) fclose(fp);
 return spool_read_OK;
 
 
@@ -1068,7 +1632,7 @@ DEBUG(D_any) debug_printf("Format error in spool file %s%s%s\n", name,
   where ? ": " : "", where ? where : US"");
 #endif  /* COMPILE_UTILITY */
 
-fclose(fp);
+if (fp) fclose(fp);
 errno = ERRNO_SPOOLFORMAT;
 return inheader? spool_read_hdrerror : spool_read_enverror;
 }
@@ -1077,6 +1641,7 @@ return inheader? spool_read_hdrerror : spool_read_enverror;
 #ifndef COMPILE_UTILITY
 /* Read out just the (envelope) sender string from the spool -H file.
 Remove the <> wrap and return it in allocated store.  Return NULL on error.
+The view handles both the text and binary formats.
 
 We assume that message_subdir is already set.
 */
@@ -1084,32 +1649,534 @@ We assume that message_subdir is already set.
 uschar *
 spool_sender_from_msgid(const uschar * id)
 {
-FILE * fp;
-int n;
+spool_view v;
 uschar * yield = NULL;
 
-if (!(fp = Ufopen(spool_fname(US"input", message_subdir, id, US"-H"), "rb")))
+if (spool_view_open(&v, string_sprintf("%s-H", id), TRUE) == spool_read_OK)
+  {
+  yield = string_copyn_taint(v.sender, v.sender_len, GET_TAINTED);
+  spool_view_close(&v);
+  }
+return yield;
+}
+
+
+
+/*************************************************
+*      Memory-mapped view of a spool header      *
+*************************************************/
+
+/* These functions give read-only access to the envelope in a -H file, for
+callers such as queue listing and queue-run message selection that look at
+only a few fields.  The file is mapped rather than read, and nothing is copied
+into store or into the global variables.  Opening the view checks the fixed
+lines at the start of the file; the option lines, the non-recipients tree, the
+recipients and the headers are located only when asked for.
+
+The checks made follow spool_read_header(), so a file that it would reject as
+malformed is also rejected here; errno is set to ERRNO_SPOOLFORMAT.  */
+
+/* Find the newline ending the line that starts at p, or return NULL */
+
+static const uschar *
+view_eol(const spool_view * v, const uschar * p)
+{
+const uschar * end = v->map + v->len;
+return p < end ? memchr(p, '\n', end - p) : NULL;
+}
+
+
+/* Step over a binary format record, returning the start of the next, or NULL
+if there is not a complete record at p.  The tag, data and data length are
+returned. */
+
+static const uschar *
+view_record(const spool_view * v, const uschar * p, uschar * tag,
+  const uschar ** data, unsigned long * len)
+{
+const uschar * end = v->map + v->len;
+
+if (p >= end) return NULL;
+*tag = *p++;
+if (!(p = spb_uint(p, end, len)) || *len > (unsigned long)(end - p))
   return NULL;
+*data = p;
+return p + *len;
+}
 
-DEBUG(D_deliver) debug_printf_indent("reading spool file %s-H\n", id);
 
-/* Skip the line with the copy of the filename, then the line with login/uid/gid.
-Read the next line, which should be the envelope sender.
-Do basic validation on that. */
+/* Locate everything in a binary format file, starting at the version byte.
+The envelope is small, so there is no point in deferring any of it.  Returns
+FALSE on a format error. */
 
-if (  Ufgets(big_buffer, big_buffer_size, fp) != NULL
-   && Ufgets(big_buffer, big_buffer_size, fp) != NULL
-   && Ufgets(big_buffer, big_buffer_size, fp) != NULL
-   && (n = Ustrlen(big_buffer)) >= 3
-   && big_buffer[0] == '<' && big_buffer[n-2] == '>'
-   )
+static BOOL
+view_open_binary(spool_view * v, const uschar * p)
+{
+const uschar * end = v->map + v->len, * data, * next;
+unsigned long len;
+uschar tag;
+long n;
+BOOL got_time = FALSE;
+
+if (p >= end || *p++ != SPOOL_BINARY_VERSION) return FALSE;
+v->binary = TRUE;
+v->opts = p;
+v->rcpt_count = -1;
+
+for ( ; p < end && !v->headers; p = next)
   {
-  yield = store_get(n-2, GET_TAINTED);
-  Ustrncpy(yield, big_buffer+1, n-3);
-  yield[n-3] = 0;
+  if (!(next = view_record(v, p, &tag, &data, &len))) return FALSE;
+  switch (tag)
+    {
+    case SPB_LOGIN:
+    case SPB_SENDER:
+      if (len < 1 || data[len-1] != 0) return FALSE;
+      if (tag == SPB_LOGIN) { v->login = data; v->login_len = len - 1; }
+      else { v->sender = data; v->sender_len = len - 1; }
+      break;
+    case SPB_TIME:
+      if (!spb_int(data, data + len, &n)) return FALSE;
+      v->received_time = (time_t)n;
+      got_time = TRUE;
+      break;
+    case SPB_RCPT_COUNT:
+      if (!spb_int(data, data + len, &n) || n < 0 || n > 16384) return FALSE;
+      v->rcpt_count = (int)n;
+      break;
+    case SPB_NONRCPT:	if (!v->nonrcpts) v->nonrcpts = p; break;
+    case SPB_RCPT:	if (!v->rcpts) v->rcpts = p; break;
+    case SPB_HEADER:	v->headers = p; break;
+    }
   }
-fclose(fp);
-return yield;
+return v->login && v->sender && got_time && v->rcpt_count >= 0;
+}
+
+
+/* Open a view on a spool header file.
+
+Arguments:
+  v             the view to set up
+  name          name of the header file, including the -H
+  subdir_set    TRUE is message_subdir is already set
+
+Returns:        spool_read_OK        success
+                spool_read_notopen   open failed
+                spool_read_enverror  error in the fixed lines
+*/
+
+int
+spool_view_open(spool_view * v, const uschar * name, BOOL subdir_set)
+{
+struct stat statbuf;
+const uschar * p, * e, * s;
+int fd, save_errno;
+
+memset(v, 0, sizeof(spool_view));
+
+for (int n = 0; n < 2; n++)
+  {
+  if (!subdir_set)
+    set_subdir_str(message_subdir, name, n);
+
+  if ((fd = Uopen(spool_fname(US"input", message_subdir, name, US""),
+		  EXIM_CLOEXEC | O_RDONLY, 0)) >= 0)
+    break;
+  if (n != 0 || subdir_set || errno != ENOENT)
+    return spool_read_notopen;
+  }
+
+DEBUG(D_deliver) debug_printf_indent("mapping spool file %s\n", name);
+
+if (fstat(fd, &statbuf) != 0)
+  {
+  save_errno = errno;
+  (void)close(fd);
+  errno = save_errno;
+  return spool_read_enverror;
+  }
+if (statbuf.st_size == 0)
+  {
+  (void)close(fd);
+  goto FORMAT_ERROR;
+  }
+
+p = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+save_errno = errno;
+(void)close(fd);
+if (p == MAP_FAILED)
+  {
+  errno = save_errno;
+  return spool_read_enverror;
+  }
+v->map = p;
+v->len = statbuf.st_size;
+
+/* The first line is the file name */
+
+if (  !(e = view_eol(v, p))
+   || (e - p != MESSAGE_ID_LENGTH + 2 && e - p != MESSAGE_ID_LENGTH_OLD + 2)
+   || Ustrncmp(p, name, e - p) != 0)
+  goto FORMAT_ERROR;
+
+/* A zero byte following marks the binary format */
+
+if (e + 1 < v->map + v->len && e[1] == SPOOL_BINARY_MAGIC)
+  {
+  if (!view_open_binary(v, e + 2)) goto FORMAT_ERROR;
+  return spool_read_OK;
+  }
+
+/* Login, uid and gid; the numbers are at the end, as the login could
+contain spaces. */
+
+if (!(e = view_eol(v, p = e + 1))) goto FORMAT_ERROR;
+for (s = e; s > p && isspace(s[-1]); ) s--;
+for (int i = 0; i < 2; i++)
+  {
+  if (s <= p || !isdigit(s[-1])) goto FORMAT_ERROR;
+  while (s > p && (isdigit(s[-1]) || s[-1] == '-')) s--;
+  if (s <= p || *--s != ' ') goto FORMAT_ERROR;
+  }
+v->login = p;
+v->login_len = s - p;
+
+/* Sender, in <> */
+
+if (  !(e = view_eol(v, p = e + 1))
+   || e - p < 2 || *p != '<' || e[-1] != '>')
+  goto FORMAT_ERROR;
+v->sender = p + 1;
+v->sender_len = e - p - 2;
+
+/* Time received, and the warning count */
+
+if (!(e = view_eol(v, p = e + 1)) || !isdigit(*p)) goto FORMAT_ERROR;
+v->received_time = (time_t) strtol(CCS p, CSS &s, 10);
+if (*s != ' ' || !isdigit(s[1])) goto FORMAT_ERROR;
+
+v->opts = e + 1;
+return spool_read_OK;
+
+FORMAT_ERROR:
+DEBUG(D_any) debug_printf("Format error in spool file %s\n", name);
+spool_view_close(v);
+errno = ERRNO_SPOOLFORMAT;
+return spool_read_enverror;
+}
+
+
+void
+spool_view_close(spool_view * v)
+{
+if (v->map) (void) munmap((void *)v->map, v->len);
+v->map = NULL;
+}
+
+
+
+/* Return the start of the name in an option line, passing over the
+introduction for tainted and quoted values.  The line is known to be
+newline-terminated. */
+
+static const uschar *
+view_opt_name(const uschar * p)
+{
+if (*++p == '-') p++;
+if (*p == '(')
+  {
+  while (*p != ')' && *p != '\n' && *p) p++;
+  if (*p == ')') p++;
+  }
+return p;
+}
+
+/* Step over the option line at p, returning the start of the next line, or
+NULL for a format error.  An ACL variable line is followed by the value, of
+the length given, plus a newline; the value may contain newlines. */
+
+static const uschar *
+view_next_opt(const spool_view * v, const uschar * p)
+{
+const uschar * e = view_eol(v, p), * var;
+
+if (!e) return NULL;
+var = view_opt_name(p);
+
+if (  Ustrncmp(var, "aclc ", 5) == 0 || Ustrncmp(var, "aclm ", 5) == 0
+   || Ustrncmp(var, "acl ", 4) == 0)
+  {
+  const uschar * s = e;
+  while (s > var && isdigit(s[-1])) s--;
+  if (s == e || s[-1] != ' ') return NULL;
+  e += Uatoi(s) + 1;
+  if (e >= v->map + v->len) return NULL;
+  }
+return e + 1;
+}
+
+
+/* Look for an option in the view.
+
+Arguments:
+  v		the view
+  name		the option name, without the leading "-"
+
+Returns:	the value following the name (at a space, or the end of the line,
+		which for the binary format is a zero), or NULL if the option is
+		not present
+*/
+
+const uschar *
+spool_view_option(const spool_view * v, const uschar * name)
+{
+int len = Ustrlen(name);
+
+if (v->binary)
+  {
+  const uschar * data, * end = v->headers ? v->headers : v->map + v->len;
+  unsigned long rlen;
+  uschar tag;
+
+  for (const uschar * p = v->opts;
+       p < end && (p = view_record(v, p, &tag, &data, &rlen)); )
+    if (tag == SPB_OPTION && rlen > 1 && *data == '-' && !data[rlen-1])
+      {
+      const uschar * var = view_opt_name(data);
+      if (Ustrncmp(var, name, len) == 0 && (var[len] == ' ' || !var[len]))
+	return var + len;
+      }
+  return NULL;
+  }
+
+for (const uschar * p = v->opts; p && view_eol(v, p) && *p == '-';
+     p = view_next_opt(v, p))
+  {
+  const uschar * var = view_opt_name(p);
+
+  if (Ustrncmp(var, name, len) == 0 && (var[len] == ' ' || var[len] == '\n'))
+    return var + len;
+  }
+return NULL;
+}
+
+
+/* Locate the non-recipients tree and the recipients.  The tree is written in
+preorder, with flags saying whether each node has children, so the number of
+lines still to come is known.  Returns FALSE on a format error. */
+
+static BOOL
+view_locate_rcpts(spool_view * v)
+{
+const uschar * p = v->opts, * e;
+
+if (v->binary || v->rcpts) return TRUE;
+
+while (p && view_eol(v, p) && *p == '-') p = view_next_opt(v, p);
+if (!p || !(e = view_eol(v, p))) return FALSE;
+
+if (e - p == 2 && p[0] == 'X' && p[1] == 'X')
+  v->nonrcpts = NULL;
+else for (int pending = 1; pending > 0; pending--)
+  {
+  if (!e || e - p < 4 || p[2] != ' ') return FALSE;
+  if (!v->nonrcpts) v->nonrcpts = p;
+  if (p[0] == 'Y') pending++;
+  if (p[1] == 'Y') pending++;
+  if (pending > 1) e = view_eol(v, p = e + 1);
+  }
+
+/* The recipients count, with the same sanity check as when reading */
+
+if (  !(e = view_eol(v, p = e + 1)) || !isdigit(*p)
+   || (v->rcpt_count = Uatoi(p)) > 16384)
+  return FALSE;
+v->rcpts = e + 1;
+return TRUE;
+}
+
+
+/* Return the number of recipients, or -1 for a format error */
+
+int
+spool_view_recipients(spool_view * v)
+{
+return view_locate_rcpts(v) ? v->rcpt_count : -1;
+}
+
+
+/* Add the addresses from the non-recipients tree in the view to
+tree_nonrecipients.  Unlike the rest of the view these are copied, being
+needed for lookups by address.  Returns FALSE on a format error. */
+
+BOOL
+spool_view_nonrecipients(spool_view * v)
+{
+if (!view_locate_rcpts(v)) return FALSE;
+if (v->binary)
+  {
+  const uschar * data, * end = v->headers ? v->headers : v->map + v->len;
+  unsigned long rlen;
+  uschar tag;
+
+  if (v->nonrcpts)
+    for (const uschar * p = v->nonrcpts;
+	 p < end && (p = view_record(v, p, &tag, &data, &rlen)); )
+      if (tag == SPB_NONRCPT && rlen > 0 && !data[rlen-1])
+	tree_add_nonrecipient(string_copy_taint(data, GET_TAINTED));
+  return TRUE;
+  }
+if (v->nonrcpts)
+  for (const uschar * p = v->nonrcpts, * e;
+       (e = view_eol(v, p)) && (*p == 'Y' || *p == 'N') && p[2] == ' ';
+       p = e + 1)
+    tree_add_nonrecipient(string_copyn_taint(p + 3, e - p - 3, GET_TAINTED));
+return TRUE;
+}
+
+
+/* Find the end of the address in a recipient line, passing over any
+additional data.  This follows the backwards parse in spool_read_header(),
+where the formats are described. */
+
+static const uschar *
+view_rcpt_end(const uschar * s, const uschar * e)
+{
+const uschar * p = e - 1;
+int flags, len;
+
+while (p > s && isdigit(*p)) p--;
+
+if (*p == ',')				/* Exim 3 */
+  {
+  while (p > s && (isdigit(*--p) || *p == ','));
+  return *p == ' ' ? p : e;
+  }
+if (*p == ' ') return p;		/* Early Exim 4 */
+if (*p != '#') return e;		/* No additional fields */
+
+flags = Uatoi(p + 1);
+if (flags & 0x01)
+  {
+  while (p > s && (isdigit(*--p) || *p == ',' || *p == '-'));
+  if ((len = Uatoi(p + 1)) > 0) p -= len;
+  }
+p--;
+if (flags & 0x02)
+  {
+  while (p > s && (isdigit(*--p) || *p == ',' || *p == '-'));
+  if ((len = Uatoi(p + 1)) > 0) p -= len;
+  }
+p--;
+return p > s ? p : e;
+}
+
+
+/* Step through the recipients in the view.  Call spool_view_recipients()
+first for the count; then call this that many times, with *cursor set NULL for
+the first.
+
+Arguments:
+  v		the view
+  cursor	where we are; updated
+  len		set to the length of the address
+
+Returns:	the address, or NULL on a format error
+*/
+
+const uschar *
+spool_view_recipient(spool_view * v, const uschar ** cursor, int * len)
+{
+const uschar * p = *cursor ? *cursor : v->rcpts, * e;
+
+if (v->binary)
+  {
+  const uschar * data, * end = v->headers ? v->headers : v->map + v->len, * s;
+  unsigned long rlen;
+  uschar tag;
+  long n;
+
+  while (p && p < end)
+    {
+    if (!(p = view_record(v, p, &tag, &data, &rlen))) return NULL;
+    if (tag != SPB_RCPT) continue;
+    if (  !(s = spb_int(data, data + rlen, &n))
+       || !(s = spb_int(s, data + rlen, &n))
+       || !(e = memchr(s, 0, data + rlen - s)))
+      return NULL;
+    *cursor = p;
+    *len = e - s;
+    return s;
+    }
+  return NULL;
+  }
+
+if (!p || !(e = view_eol(v, p)) || e == p) return NULL;
+*cursor = e + 1;
+*len = view_rcpt_end(p, e) - p;
+return p;
+}
+
+
+/* Add up the size of the headers to be transmitted, checking the format as
+spool_read_header() does.
+
+Arguments:
+  v		the view
+  size		set to the total, so far as it could be counted
+
+Returns:	FALSE on a format error
+*/
+
+BOOL
+spool_view_header_size(spool_view * v, int * size)
+{
+const uschar * p = v->headers, * end = v->map + v->len;
+
+*size = 0;
+if (v->binary)
+  {
+  const uschar * data;
+  unsigned long rlen;
+  uschar tag;
+
+  while (p && p < end)
+    {
+    if (!(p = view_record(v, p, &tag, &data, &rlen))) return FALSE;
+    if (tag != SPB_HEADER) continue;
+    if (rlen < 2 || data[rlen-1] || memchr(data + 1, 0, rlen - 2)) return FALSE;
+    if (*data != '*') *size += rlen - 2;
+    }
+  return TRUE;
+  }
+
+if (!p)
+  {
+  const uschar * cursor = NULL;
+  int n = spool_view_recipients(v), len;
+
+  if (n < 0) return FALSE;
+  for (int i = 0; i < n; i++)
+    if (!spool_view_recipient(v, &cursor, &len)) return FALSE;
+  if ((p = cursor ? cursor : v->rcpts) >= end || *p != '\n') return FALSE;
+  v->headers = ++p;
+  }
+
+while (p < end)
+  {
+  int n = 0;
+  uschar flag;
+
+  if (!isdigit(*p)) return FALSE;
+  while (p < end && isdigit(*p))
+    if ((n = n * 10 + *p++ - '0') > v->len) return FALSE;
+  if (p >= end) return FALSE;
+  flag = *p++;
+  while (p < end && isspace(*p)) p++;
+  if (n > end - p || memchr(p, 0, n)) return FALSE;
+  if (flag != '*') *size += n;
+  p += n;
+  }
+return TRUE;
 }
 #endif  /* COMPILE_UTILITY */
 
@@ -21,164 +21,356 @@ extern int spam_ok;
 int spool_mbox_ok = 0;
 uschar spooled_message_id[MESSAGE_ID_LENGTH+1];
 
-/*
-Create an MBOX-style message file from the spooled files.
+/* A copy made in memory, for a message no bigger than
+content_scan_memory_max; it is written to disk only for a scanner that needs a
+file.  It is in the tainted message pool, being message content. */
 
-Returns a pointer to the FILE, and puts the size in bytes into mbox_file_size.
-If mbox_fname is non-null, fill in a pointer to the name.
-Normally, source_file_override is NULL
+static uschar * mbox_mem = NULL;
+static unsigned long mbox_mem_size;
+static BOOL mbox_on_disk = FALSE;
+
+/* Hashes taken while the copy is made, for the keys of the verdict caches: of
+the body, for the malware condition, and of the whole copy, for the spam
+condition, whose verdict can depend on the headers. The time in the first
+line of the copy is left out of the latter, as it would make every key
+different. */
+
+static uschar mbox_body_hash[2*64 + 1];
+static uschar mbox_hash[2*64 + 1];
+
+
+/* Finish a hash into a hex string. */
+
+static void
+mbox_hash_finish(hctx * h, uschar * s)
+{
+blob b;
+
+exim_sha_finish(h, &b);
+for (int i = 0; i < b.len && i < 64; i++, s += 2)
+  sprintf(CS s, "%02x", b.data[i]);
+}
+
+
+/* Append to the copy being made, either on disk or in memory */
+
+static BOOL
+mbox_put(FILE * f, uschar ** mem, const void * s, size_t len)
+{
+if (f) return fwrite(s, len, 1, f) == 1;
+memcpy(*mem, s, len);
+*mem += len;
+return TRUE;
+}
+
+
+/* Open the scan directory and the file for writing */
+
+static FILE *
+mbox_open(const uschar * mbox_path)
+{
+uschar * temp_string = string_sprintf("scan/%s", message_id);
+FILE * f;
+
+/* create temp directory inside scan dir, directory_make works recursively */
+if (!directory_make(spool_directory, temp_string, 0750, FALSE))
+  {
+  log_write(0, LOG_MAIN|LOG_PANIC, "%s",
+    string_open_failed("scan directory %s/scan/%s", spool_directory, temp_string));
+  return NULL;
+  }
+
+/* open [message_id].eml file for writing */
+
+if (!(f = modefopen(mbox_path, "wb", SPOOL_MODE)))
+  log_write(0, LOG_MAIN|LOG_PANIC, "%s",
+    string_open_failed("scan file %s", mbox_path));
+return f;
+}
+
+
+/* Make the MBOX-style copy of the message from the spooled files; in memory
+if that is allowed and it is small enough, else on disk.
+
+Arguments:
+  mbox_path		the name for it on disk
+  source_file_override	data file to use, for -bmalware
+  memory_ok		it may be made in memory
+
+Returns:	TRUE if it was made
 */
 
-FILE *
-spool_mbox(unsigned long *mbox_file_size, const uschar *source_file_override,
-  uschar ** mbox_fname)
+static BOOL
+mbox_create(const uschar * mbox_path, const uschar * source_file_override,
+  BOOL memory_ok)
 {
 uschar message_subdir[2];
 uschar buffer[16384];
-uschar *temp_string;
-uschar *mbox_path;
-FILE *mbox_file = NULL, *l_data_file = NULL, *yield = NULL;
+uschar *temp_string, *from_lines;
+FILE *mbox_file = NULL, *l_data_file = NULL;
+uschar *mem = NULL;
 struct stat statbuf;
+unsigned long size = 0;
+BOOL yield = FALSE, hashing;
+hctx h, hm;
 int j;
-rmark reset_point;
 
-mbox_path = string_sprintf("%s/scan/%s/%s.eml",
-  spool_directory, message_id, message_id);
-if (mbox_fname) *mbox_fname = mbox_path;
+*mbox_body_hash = *mbox_hash = '\0';
+#ifdef EXIM_HAVE_SHA2
+hashing = exim_sha_init(&h, HASH_SHA2_256) && exim_sha_init(&hm, HASH_SHA2_256);
+#else
+hashing = exim_sha_init(&h, HASH_SHA1) && exim_sha_init(&hm, HASH_SHA1);
+#endif
 
-reset_point = store_mark();
+/* Generate mailbox headers. The $received_for variable is (up to at least
+Exim 4.64) never set here, because it is only set when expanding the
+contents of the Received: header line. However, the code below will use it
+if it should become available in future. */
 
-/* Skip creation if already spooled out as mbox file */
-if (!spool_mbox_ok)
+from_lines = expand_string(
+  US"From ${if def:return_path{$return_path}{MAILER-DAEMON}} ${tod_bsdinbox}\n"
+  "${if def:sender_address{X-Envelope-From: <${sender_address}>\n}}"
+  "${if def:recipients{X-Envelope-To: ${recipients}\n}}");
+
+/* Copy body file.  If the main receive still has it open then it is holding
+a lock, and we must not close it (which releases the lock), so just use the
+global file handle. */
+
+if (source_file_override)
+  l_data_file = Ufopen(source_file_override, "rb");
+else if (spool_data_file)
+  l_data_file = spool_data_file;
+else
+  for (int i = 0; i < 2; i++)
+    {
+    set_subdir_str(message_subdir, message_id, i);
+    temp_string = spool_fname(US"input", message_subdir, message_id, US"-D");
+    if ((l_data_file = Ufopen(temp_string, "rb"))) break;
+    }
+
+if (!l_data_file)
   {
-  /* create temp directory inside scan dir, directory_make works recursively */
-  temp_string = string_sprintf("scan/%s", message_id);
-  if (!directory_make(spool_directory, temp_string, 0750, FALSE))
+  log_write(0, LOG_MAIN|LOG_PANIC, "Could not open datafile for message %s",
+    message_id);
+  goto OUT;
+  }
+
+/* The headers and the data file give an upper bound on the size, the data
+shrinking when in wire format.  If that fits, make the copy in memory. */
+
+if (  memory_ok && !source_file_override && fstat(fileno(l_data_file), &statbuf) == 0)
+  {
+  size = (from_lines ? Ustrlen(from_lines) : 0) + 1
+    + statbuf.st_size - spool_data_start_offset(message_id);
+  for (header_line * h = header_list; h; h = h->next)
+    if (h->type != '*') size += h->slen;
+  if (size <= content_scan_memory_max)
     {
-    log_write(0, LOG_MAIN|LOG_PANIC, "%s",
-      string_open_failed("scan directory %s/scan/%s", spool_directory, temp_string));
-    goto OUT;
+    int old_pool = store_pool;
+    store_pool = POOL_MESSAGE;
+    mbox_mem = mem = store_get(size + 1, GET_TAINTED);
+    store_pool = old_pool;
     }
+  }
+
+if (!mem && !(mbox_file = mbox_open(mbox_path)))
+  goto OUT;
 
-  /* open [message_id].eml file for writing */
+if (from_lines)
+  {
+  const uschar * s;
 
-  if (!(mbox_file = modefopen(mbox_path, "wb", SPOOL_MODE)))
+  if (!mbox_put(mbox_file, &mem, from_lines, Ustrlen(from_lines)))
     {
-    log_write(0, LOG_MAIN|LOG_PANIC, "%s",
-      string_open_failed("scan file %s", mbox_path));
+    log_write(0, LOG_MAIN|LOG_PANIC, "Error/short write while writing \
+	mailbox headers to %s", mbox_path);
     goto OUT;
     }
+  if (hashing)
+    {
+    exim_sha_update_string(&hm, return_path);
+    if ((s = Ustrchr(from_lines, '\n')))
+      exim_sha_update_string(&hm, s + 1);
+    }
+  }
 
-  /* Generate mailbox headers. The $received_for variable is (up to at least
-  Exim 4.64) never set here, because it is only set when expanding the
-  contents of the Received: header line. However, the code below will use it
-  if it should become available in future. */
-
-  temp_string = expand_string(
-    US"From ${if def:return_path{$return_path}{MAILER-DAEMON}} ${tod_bsdinbox}\n"
-    "${if def:sender_address{X-Envelope-From: <${sender_address}>\n}}"
-    "${if def:recipients{X-Envelope-To: ${recipients}\n}}");
+/* write all non-deleted header lines to mbox file */
 
-  if (temp_string)
-    if (fwrite(temp_string, Ustrlen(temp_string), 1, mbox_file) != 1)
+for (header_line * my_headerlist = header_list; my_headerlist;
+    my_headerlist = my_headerlist->next)
+  if (my_headerlist->type != '*')
+    {
+    if (!mbox_put(mbox_file, &mem, my_headerlist->text, my_headerlist->slen))
       {
       log_write(0, LOG_MAIN|LOG_PANIC, "Error/short write while writing \
-	  mailbox headers to %s", mbox_path);
+	  message headers to %s", mbox_path);
       goto OUT;
       }
+    if (hashing)
+      exim_sha_update(&hm, my_headerlist->text, my_headerlist->slen);
+    }
+
+/* End headers */
 
-  /* write all non-deleted header lines to mbox file */
+if (!mbox_put(mbox_file, &mem, "\n", 1))
+  {
+  log_write(0, LOG_MAIN|LOG_PANIC, "Error/short write while writing \
+    message headers to %s", mbox_path);
+  goto OUT;
+  }
 
-  for (header_line * my_headerlist = header_list; my_headerlist;
-      my_headerlist = my_headerlist->next)
-    if (my_headerlist->type != '*')
-      if (fwrite(my_headerlist->text, my_headerlist->slen, 1, mbox_file) != 1)
-	{
-	log_write(0, LOG_MAIN|LOG_PANIC, "Error/short write while writing \
-	    message headers to %s", mbox_path);
-	goto OUT;
-	}
+/* The code used to use this line, but it doesn't work in Cygwin.
 
-  /* End headers */
+    (void)fread(data_buffer, 1, 18, l_data_file);
 
-  if (fwrite("\n", 1, 1, mbox_file) != 1)
-    {
-    log_write(0, LOG_MAIN|LOG_PANIC, "Error/short write while writing \
-      message headers to %s", mbox_path);
-    goto OUT;
-    }
+   What's happening is that spool_mbox used to use an fread to jump over the
+   file header. That fails under Cygwin because the header is locked, but
+   doing an fseek succeeds. We have to output the leading newline
+   explicitly, because the one in the file is parted of the locked area.  */
 
-  /* Copy body file.  If the main receive still has it open then it is holding
-  a lock, and we must not close it (which releases the lock), so just use the
-  global file handle. */
+if (!source_file_override)
+  (void)fseek(l_data_file, spool_data_start_offset(message_id), SEEK_SET);
+if (hashing) exim_sha_update(&hm, US"\n", 1);
 
-  if (source_file_override)
-    l_data_file = Ufopen(source_file_override, "rb");
-  else if (spool_data_file)
-    l_data_file = spool_data_file;
-  else
-    for (int i = 0; i < 2; i++)
+do
+  {
+  uschar * s;
+
+  if (!f.spool_file_wireformat || source_file_override)
+    j = fread(buffer, 1, sizeof(buffer), l_data_file);
+  else						/* needs CRLF -> NL */
+    if ((s = US fgets(CS buffer, sizeof(buffer), l_data_file)))
       {
-      set_subdir_str(message_subdir, message_id, i);
-      temp_string = spool_fname(US"input", message_subdir, message_id, US"-D");
-      if ((l_data_file = Ufopen(temp_string, "rb"))) break;
+      uschar * p = s + Ustrlen(s) - 1;
+
+      if (*p == '\n' && p[-1] == '\r')
+	*--p = '\n';
+      else if (*p == '\r')
+	ungetc(*p--, l_data_file);
+
+      j = p - buffer;
       }
+    else
+      j = 0;
+
+  /* The data file could have grown since it was measured only if something
+  were still writing it, but do not trust that. */
 
-  if (!l_data_file)
+  if (j > 0 && mem && (mem - mbox_mem) + j > size)
     {
-    log_write(0, LOG_MAIN|LOG_PANIC, "Could not open datafile for message %s",
-      message_id);
+    log_write(0, LOG_MAIN|LOG_PANIC, "data file for %s grew while being "
+      "copied for scanning", message_id);
     goto OUT;
     }
+  if (j > 0)
+    {
+    if (!mbox_put(mbox_file, &mem, buffer, j))
+      {
+      log_write(0, LOG_MAIN|LOG_PANIC, "Error/short write while writing \
+	  message body to %s", mbox_path);
+      goto OUT;
+      }
+    if (hashing)
+      {
+      exim_sha_update(&h, buffer, j);
+      exim_sha_update(&hm, buffer, j);
+      }
+    }
+  } while (j > 0);
+
+if (hashing)
+  {
+  mbox_hash_finish(&h, mbox_body_hash);
+  mbox_hash_finish(&hm, mbox_hash);
+  }
 
-  /* The code used to use this line, but it doesn't work in Cygwin.
+if (mem)
+  {
+  *mem = '\0';
+  mbox_mem_size = mem - mbox_mem;
+  mbox_on_disk = FALSE;
+  DEBUG(D_acl) debug_printf_indent("scan copy of message (%lu bytes) "
+    "made in memory\n", mbox_mem_size);
+  }
+else
+  mbox_on_disk = TRUE;
+yield = TRUE;
+
+OUT:
+if (!yield) mbox_mem = NULL;
+if (l_data_file && !spool_data_file) (void)fclose(l_data_file);
+if (mbox_file && fclose(mbox_file) != 0 && yield)
+  {
+  log_write(0, LOG_MAIN|LOG_PANIC, "Error closing %s: %s", mbox_path,
+    strerror(errno));
+  yield = FALSE;
+  }
+return yield;
+}
+
+
+/* Make the copy, as for spool_mbox(); the caller checks spool_mbox_ok */
+
+static BOOL
+mbox_make(const uschar * mbox_path, const uschar * source_file_override,
+  BOOL memory_ok)
+{
+rmark reset_point = store_mark();
+BOOL ok = mbox_create(mbox_path, source_file_override,
+		      memory_ok && content_scan_memory_max > 0 && !f.no_mbox_unspool);
+store_reset(reset_point);
+if (!ok) return FALSE;
+
+Ustrncpy(spooled_message_id, message_id, sizeof(spooled_message_id));
+spooled_message_id[sizeof(spooled_message_id)-1] = '\0';
+spool_mbox_ok = 1;
+return TRUE;
+}
+
+
+/*
+Create an MBOX-style message file from the spooled files.
+
+Returns a pointer to the FILE, and puts the size in bytes into mbox_file_size.
+If mbox_fname is non-null, fill in a pointer to the name.
+Normally, source_file_override is NULL
+*/
+
+FILE *
+spool_mbox(unsigned long *mbox_file_size, const uschar *source_file_override,
+  uschar ** mbox_fname)
+{
+uschar *mbox_path;
+FILE *yield = NULL;
+struct stat statbuf;
 
-      (void)fread(data_buffer, 1, 18, l_data_file);
+mbox_path = string_sprintf("%s/scan/%s/%s.eml",
+  spool_directory, message_id, message_id);
+if (mbox_fname) *mbox_fname = mbox_path;
 
-     What's happening is that spool_mbox used to use an fread to jump over the
-     file header. That fails under Cygwin because the header is locked, but
-     doing an fseek succeeds. We have to output the leading newline
-     explicitly, because the one in the file is parted of the locked area.  */
+/* Skip creation if already spooled out as mbox file */
+if (!spool_mbox_ok)
+  {
+  if (!mbox_make(mbox_path, source_file_override, TRUE))
+    return NULL;
+  }
+
+/* A copy in memory has to be written out for the scanners which use it */
 
-  if (!source_file_override)
-    (void)fseek(l_data_file, spool_data_start_offset(message_id), SEEK_SET);
+if (mbox_mem && !mbox_on_disk)
+  {
+  FILE * mbox_file = mbox_open(mbox_path);
 
-  do
+  if (!mbox_file)
+    return NULL;
+  if (  fwrite(mbox_mem, 1, mbox_mem_size, mbox_file) != mbox_mem_size
+     || fclose(mbox_file) != 0)
     {
-    uschar * s;
-
-    if (!f.spool_file_wireformat || source_file_override)
-      j = fread(buffer, 1, sizeof(buffer), l_data_file);
-    else						/* needs CRLF -> NL */
-      if ((s = US fgets(CS buffer, sizeof(buffer), l_data_file)))
-	{
-	uschar * p = s + Ustrlen(s) - 1;
-
-	if (*p == '\n' && p[-1] == '\r')
-	  *--p = '\n';
-	else if (*p == '\r')
-	  ungetc(*p--, l_data_file);
-
-	j = p - buffer;
-	}
-      else
-	j = 0;
-
-    if (j > 0)
-      if (fwrite(buffer, j, 1, mbox_file) != 1)
-        {
-	log_write(0, LOG_MAIN|LOG_PANIC, "Error/short write while writing \
-	    message body to %s", mbox_path);
-	goto OUT;
-	}
-    } while (j > 0);
-
-  (void)fclose(mbox_file);
-  mbox_file = NULL;
-
-  Ustrncpy(spooled_message_id, message_id, sizeof(spooled_message_id));
-  spooled_message_id[sizeof(spooled_message_id)-1] = '\0';
-  spool_mbox_ok = 1;
+    log_write(0, LOG_MAIN|LOG_PANIC, "Error/short write while writing %s",
+      mbox_path);
+    return NULL;
+    }
+  mbox_on_disk = TRUE;
   }
 
 /* get the size of the mbox message and open [message_id].eml file for reading*/
@@ -191,14 +383,114 @@ if (  !(yield = Ufopen(mbox_path,"rb"))
 else
   *mbox_file_size = statbuf.st_size;
 
-OUT:
-if (l_data_file && !spool_data_file) (void)fclose(l_data_file);
-if (mbox_file) (void)fclose(mbox_file);
-store_reset(reset_point);
 return yield;
 }
 
 
+/* Return the copy made in memory, making it first if need be, or NULL if the
+message is too big (or was copied before this was allowed).  This is for the
+regex condition, which reads the text of the message and nothing else. */
+
+const uschar *
+spool_mbox_memory(unsigned long * mbox_size)
+{
+if (!spool_mbox_ok)
+  if (  content_scan_memory_max <= 0
+     || !mbox_make(string_sprintf("%s/scan/%s/%s.eml",
+			spool_directory, message_id, message_id), NULL, TRUE))
+    return NULL;
+
+if (mbox_mem) *mbox_size = mbox_mem_size;
+return mbox_mem;
+}
+
+
+
+
+/* Return the hash of the message body, as a hex string, making the copy of
+the message first if need be (in memory if that is allowed), or NULL if it
+could not be made. */
+
+const uschar *
+spool_mbox_body_hash(void)
+{
+if (!spool_mbox_ok)
+  if (!mbox_make(string_sprintf("%s/scan/%s/%s.eml",
+			spool_directory, message_id, message_id), NULL, TRUE))
+    return NULL;
+
+return *mbox_body_hash ? mbox_body_hash : NULL;
+}
+
+
+/* The same for the hash of the whole copy, headers and body */
+
+const uschar *
+spool_mbox_hash(void)
+{
+if (!spool_mbox_ok)
+  if (!mbox_make(string_sprintf("%s/scan/%s/%s.eml",
+			spool_directory, message_id, message_id), NULL, TRUE))
+    return NULL;
+
+return *mbox_hash ? mbox_hash : NULL;
+}
+
+
+
+/* The verdict cache for the malware and spam conditions, kept in the
+"scancache" hints database.  A record is used until its expiry time, and
+counts the times it was used.
+
+Arguments:
+  key		the record key
+  len		set to the length of the record
+
+Returns:	the record, in the main pool, or NULL if none is current
+*/
+
+dbdata_scan_verdict *
+scan_verdict_get(const uschar * key, int * len)
+{
+open_db dbblock, * dbm;
+dbdata_scan_verdict * v, * yield = NULL;
+
+if (!(dbm = dbfn_open(US"scancache", O_RDWR, &dbblock, FALSE, TRUE)))
+  return NULL;
+
+if (  (v = dbfn_read_with_length(dbm, key, len))
+   && *len >= (int)sizeof(dbdata_scan_verdict)
+   && v->expiry > time(NULL))
+  {
+  v->hits++;
+  dbfn_write(dbm, key, v, *len);
+  yield = store_get(*len, GET_TAINTED);
+  memcpy(yield, v, *len);
+  ((uschar *)yield)[*len - 1] = '\0';
+  }
+dbfn_close(dbm);
+
+DEBUG(D_acl) debug_printf_indent("scan verdict cache %s for %s\n",
+				  yield ? "hit" : "miss", key);
+return yield;
+}
+
+/* Write a verdict record; the caller fills in the data fields */
+
+void
+scan_verdict_put(const uschar * key, dbdata_scan_verdict * v, int len,
+  int ttl)
+{
+open_db dbblock, * dbm;
+
+if (!(dbm = dbfn_open(US"scancache", O_RDWR, &dbblock, FALSE, TRUE)))
+  return;
+v->expiry = time(NULL) + ttl;
+v->hits = 0;
+dbfn_write(dbm, key, v, len);
+dbfn_close(dbm);
+}
+
 
 
 
@@ -209,7 +501,7 @@ unspool_mbox(void)
 spam_ok = 0;
 malware_ok = 0;
 
-if (spool_mbox_ok && !f.no_mbox_unspool)
+if (spool_mbox_ok && !(mbox_mem && !mbox_on_disk) && !f.no_mbox_unspool)
   {
   uschar *file_path;
   DIR *tempdir;
@@ -243,6 +535,9 @@ if (spool_mbox_ok && !f.no_mbox_unspool)
   store_reset(reset_point);
   }
 spool_mbox_ok = 0;
+mbox_mem = NULL;
+mbox_on_disk = FALSE;
+*mbox_body_hash = *mbox_hash = '\0';
 }
 
 #endif
@@ -118,195 +118,397 @@ while ((p = Ustrchr(p, '\n')) != NULL) *p++ = ' ';
 return z;
 }
 
-static void
-spool_var_write(FILE * fp, const uschar * name, const uschar * val)
+static gstring *
+spool_var_write(gstring * g, const uschar * name, const uschar * val)
 {
-putc('-', fp);
+g = string_catn(g, US"-", 1);
 if (is_tainted(val))
   {
   int q = quoter_for_address(val);
-  putc('-', fp);
-  if (is_real_quoter(q)) fprintf(fp, "(%s)", lookup_list[q]->name);
+  g = string_catn(g, US"-", 1);
+  if (is_real_quoter(q)) g = string_fmt_append(g, "(%s)", lookup_list[q]->name);
   }
-fprintf(fp, "%s %s\n", name, val);
+return string_fmt_append(g, "%s %s\n", name, val);
 }
 
+
+
 /*************************************************
-*          Write the header spool file           *
+*       Build the optional spool header lines    *
 *************************************************/
 
-/* Returns the size of the file for success; zero for failure. The file is
-written under a temporary name, and then renamed. It's done this way so that it
-works with re-writing the file on message deferral as well as for the initial
-write. Whenever this function is called, the data file for the message should
-be open and locked, thus preventing any other exim process from working on this
-message.
+/* The "-name value" lines that follow the received time are common to both
+the text and binary spool header formats. They are built as newline-terminated
+lines in a growable string; the binary writer turns each one into an option
+record.
 
-Argument:
-  id      the message id (used for the eventual filename; the *content* uses the global. Unclear why.)
-  where   SW_RECEIVING, SW_DELIVERING, or SW_MODIFYING
-  errmsg  where to put an error message; if NULL, panic-die on error
-
-Returns:  the size of the header texts on success;
-          negative on writing failure, unless errmsg == NULL
+Argument:  TRUE if building for the binary format (ACL variables omitted)
+Returns:   the lines
 */
 
-int
-spool_write_header(const uschar * id, int where, uschar ** errmsg)
+static gstring *
+spool_write_options(BOOL binary)
 {
-int fd, size_correction;
-FILE * fp;
-struct stat statbuf;
-uschar * fname;
-uschar * tname = spool_fname(US"input", message_subdir, US"hdr.", message_id);
-
-if ((fd = spool_open_temp(tname)) < 0)
-  return spool_write_error(where, errmsg, US"open", NULL, NULL);
-fp = fdopen(fd, "wb");
-DEBUG(D_receive|D_deliver) debug_printf("Writing spool header file: %s\n", tname);
-
-/* We now have an open file to which the header data is to be written. Start
-with the file's leaf name, to make the file self-identifying. Continue with the
-identity of the submitting user, followed by the sender's address. The sender's
-address is enclosed in <> because it might be the null address. Then write the
-received time and the number of warning messages that have been sent. */
-
-fprintf(fp, "%s-H\n", message_id);
-fprintf(fp, "%.63s %ld %ld\n", originator_login, (long int)originator_uid,
-  (long int)originator_gid);
-fprintf(fp, "<%s>\n", sender_address);
-fprintf(fp, "%d %d\n", (int)received_time.tv_sec, warning_count);
+gstring * g = NULL;
 
-fprintf(fp, "-received_time_usec .%06d\n", (int)received_time.tv_usec);
-fprintf(fp, "-received_time_complete %d.%06d\n",
+g = string_fmt_append(g, "-received_time_usec .%06d\n",
+  (int)received_time.tv_usec);
+g = string_fmt_append(g, "-received_time_complete %d.%06d\n",
   (int)received_time_complete.tv_sec, (int)received_time_complete.tv_usec);
 
 /* If there is information about a sending host, remember it. The HELO
 data can be set for local SMTP as well as remote. */
 
-if (sender_helo_name) spool_var_write(fp, US"helo_name", sender_helo_name);
+if (sender_helo_name) g = spool_var_write(g, US"helo_name", sender_helo_name);
 
 if (sender_host_address)
   {
-  if (is_tainted(sender_host_address)) putc('-', fp);
-  fprintf(fp, "-host_address [%s]:%d\n", sender_host_address, sender_host_port);
+  if (is_tainted(sender_host_address)) g = string_catn(g, US"-", 1);
+  g = string_fmt_append(g, "-host_address [%s]:%d\n",
+    sender_host_address, sender_host_port);
   if (sender_host_name)
-    spool_var_write(fp, US"host_name", sender_host_name);
+    g = spool_var_write(g, US"host_name", sender_host_name);
   }
 if (sender_host_authenticated)
-  spool_var_write(fp, US"host_auth", sender_host_authenticated);
+  g = spool_var_write(g, US"host_auth", sender_host_authenticated);
 if (sender_host_auth_pubname)
-  spool_var_write(fp, US"host_auth_pubname", sender_host_auth_pubname);
+  g = spool_var_write(g, US"host_auth_pubname", sender_host_auth_pubname);
 
 /* Also about the interface a message came in on */
 
 if (interface_address)
   {
-  if (is_tainted(interface_address)) putc('-', fp);
-  fprintf(fp, "-interface_address [%s]:%d\n", interface_address, interface_port);
+  if (is_tainted(interface_address)) g = string_catn(g, US"-", 1);
+  g = string_fmt_append(g, "-interface_address [%s]:%d\n",
+    interface_address, interface_port);
   }
 
 if (smtp_active_hostname != primary_hostname)
-  spool_var_write(fp, US"active_hostname", smtp_active_hostname);
+  g = spool_var_write(g, US"active_hostname", smtp_active_hostname);
 
 /* Likewise for any ident information; for local messages this is
 likely to be the same as originator_login, but will be different if
 the originator was root, forcing a different ident. */
 
 if (sender_ident)
-  spool_var_write(fp, US"ident", sender_ident);
+  g = spool_var_write(g, US"ident", sender_ident);
 
 /* Ditto for the received protocol */
 
 if (received_protocol)
-  spool_var_write(fp, US"received_protocol", received_protocol);
+  g = spool_var_write(g, US"received_protocol", received_protocol);
 
-/* Preserve any ACL variables that are set. */
+/* Preserve any ACL variables that are set. The binary format has its own
+records for these, as the values may contain newlines. */
 
-tree_walk(acl_var_c, &acl_var_write, fp);
-tree_walk(acl_var_m, &acl_var_write, fp);
+if (!binary)
+  {
+  tree_walk(acl_var_c, &acl_var_write, &g);
+  tree_walk(acl_var_m, &acl_var_write, &g);
+  }
 
 /* Now any other data that needs to be remembered. */
 
 if (*debuglog_name)
   {
-  fprintf(fp, "-debug_selector 0x%x\n", debug_selector);
-  fprintf(fp, "-debuglog_name %s\n", debuglog_name);
+  g = string_fmt_append(g, "-debug_selector 0x%x\n", debug_selector);
+  g = string_fmt_append(g, "-debuglog_name %s\n", debuglog_name);
   }
 
 if (f.spool_file_wireformat)
-  fprintf(fp, "-spool_file_wireformat\n");
+  g = string_cat(g, US"-spool_file_wireformat\n");
 else
-  fprintf(fp, "-body_linecount %d\n", body_linecount);
-fprintf(fp, "-max_received_linelength %d\n", max_received_linelength);
+  g = string_fmt_append(g, "-body_linecount %d\n", body_linecount);
+g = string_fmt_append(g, "-max_received_linelength %d\n", max_received_linelength);
 
-if (body_zerocount > 0) fprintf(fp, "-body_zerocount %d\n", body_zerocount);
+if (body_zerocount > 0) g = string_fmt_append(g, "-body_zerocount %d\n", body_zerocount);
 
 if (authenticated_id)
-  spool_var_write(fp, US"auth_id", authenticated_id);
+  g = spool_var_write(g, US"auth_id", authenticated_id);
 if (authenticated_sender)
-  spool_var_write(fp, US"auth_sender", zap_newlines(authenticated_sender));
-
-if (f.allow_unqualified_recipient) fprintf(fp, "-allow_unqualified_recipient\n");
-if (f.allow_unqualified_sender) fprintf(fp, "-allow_unqualified_sender\n");
-if (f.deliver_firsttime) fprintf(fp, "-deliver_firsttime\n");
-if (f.deliver_freeze) fprintf(fp, "-frozen " TIME_T_FMT "\n", deliver_frozen_at);
-if (f.dont_deliver) fprintf(fp, "-N\n");
-if (host_lookup_deferred) fprintf(fp, "-host_lookup_deferred\n");
-if (host_lookup_failed) fprintf(fp, "-host_lookup_failed\n");
-if (f.sender_local) fprintf(fp, "-local\n");
-if (f.local_error_message) fprintf(fp, "-localerror\n");
+  g = spool_var_write(g, US"auth_sender",
+    zap_newlines(authenticated_sender));
+
+if (f.allow_unqualified_recipient) g = string_cat(g, US"-allow_unqualified_recipient\n");
+if (f.allow_unqualified_sender) g = string_cat(g, US"-allow_unqualified_sender\n");
+if (f.deliver_firsttime) g = string_cat(g, US"-deliver_firsttime\n");
+if (f.deliver_freeze) g = string_fmt_append(g, "-frozen " TIME_T_FMT "\n", deliver_frozen_at);
+if (f.dont_deliver) g = string_cat(g, US"-N\n");
+if (host_lookup_deferred) g = string_cat(g, US"-host_lookup_deferred\n");
+if (host_lookup_failed) g = string_cat(g, US"-host_lookup_failed\n");
+if (f.sender_local) g = string_cat(g, US"-local\n");
+if (f.local_error_message) g = string_cat(g, US"-localerror\n");
 #ifdef HAVE_LOCAL_SCAN
-if (local_scan_data) spool_var_write(fp, US"local_scan", local_scan_data);
+if (local_scan_data) g = spool_var_write(g, US"local_scan", local_scan_data);
 #endif
 #ifdef WITH_CONTENT_SCAN
-if (spam_bar)       spool_var_write(fp, US"spam_bar",       spam_bar);
-if (spam_score)     spool_var_write(fp, US"spam_score",     spam_score);
-if (spam_score_int) spool_var_write(fp, US"spam_score_int", spam_score_int);
+if (spam_bar)       g = spool_var_write(g, US"spam_bar",       spam_bar);
+if (spam_score)     g = spool_var_write(g, US"spam_score",     spam_score);
+if (spam_score_int) g = spool_var_write(g, US"spam_score_int", spam_score_int);
 #endif
-if (f.deliver_manual_thaw) fprintf(fp, "-manual_thaw\n");
-if (f.sender_set_untrusted) fprintf(fp, "-sender_set_untrusted\n");
+if (f.deliver_manual_thaw) g = string_cat(g, US"-manual_thaw\n");
+if (deliver_retry_after) g = string_fmt_append(g, "-retry_after " TIME_T_FMT "\n", deliver_retry_after);
+if (f.sender_set_untrusted) g = string_cat(g, US"-sender_set_untrusted\n");
 
 #ifdef EXPERIMENTAL_BRIGHTMAIL
-if (bmi_verdicts) spool_var_write(fp, US"bmi_verdicts", bmi_verdicts);
+if (bmi_verdicts) g = spool_var_write(g, US"bmi_verdicts", bmi_verdicts);
 #endif
 
 #ifndef DISABLE_TLS
-if (tls_in.certificate_verified) fprintf(fp, "-tls_certificate_verified\n");
-if (tls_in.cipher) spool_var_write(fp, US"tls_cipher", tls_in.cipher);
+if (tls_in.certificate_verified) g = string_cat(g, US"-tls_certificate_verified\n");
+if (tls_in.cipher) g = spool_var_write(g, US"tls_cipher", tls_in.cipher);
 if (tls_in.peercert)
   {
   if (tls_export_cert(big_buffer, big_buffer_size, tls_in.peercert))
-    fprintf(fp, "--tls_peercert %s\n", CS big_buffer);
+    g = string_fmt_append(g, "--tls_peercert %s\n", CS big_buffer);
   }
-if (tls_in.peerdn)       spool_var_write(fp, US"tls_peerdn", string_printing(tls_in.peerdn));
-if (tls_in.sni)		 spool_var_write(fp, US"tls_sni",    string_printing(tls_in.sni));
+if (tls_in.peerdn)       g = spool_var_write(g, US"tls_peerdn", string_printing(tls_in.peerdn));
+if (tls_in.sni)		 g = spool_var_write(g, US"tls_sni",    string_printing(tls_in.sni));
 if (tls_in.ourcert)
   {
   if (tls_export_cert(big_buffer, big_buffer_size, tls_in.ourcert))
-    fprintf(fp, "-tls_ourcert %s\n", CS big_buffer);
+    g = string_fmt_append(g, "-tls_ourcert %s\n", CS big_buffer);
   }
-if (tls_in.ocsp)	 fprintf(fp, "-tls_ocsp %d\n",   tls_in.ocsp);
+if (tls_in.ocsp)	 g = string_fmt_append(g, "-tls_ocsp %d\n",   tls_in.ocsp);
 # ifndef DISABLE_TLS_RESUME
-fprintf(fp, "-tls_resumption %c\n", 'A' + tls_in.resumption);
+g = string_fmt_append(g, "-tls_resumption %c\n", 'A' + tls_in.resumption);
 # endif
-if (tls_in.ver) spool_var_write(fp, US"tls_ver", tls_in.ver);
+if (tls_in.ver) g = spool_var_write(g, US"tls_ver", tls_in.ver);
 #endif
 
 #ifdef SUPPORT_I18N
 if (message_smtputf8)
   {
-  fprintf(fp, "-smtputf8\n");
+  g = string_cat(g, US"-smtputf8\n");
   if (message_utf8_downconvert)
-    fprintf(fp, "-utf8_%sdowncvt\n", message_utf8_downconvert < 0 ? "opt" : "");
+    g = string_fmt_append(g, "-utf8_%sdowncvt\n",
+      message_utf8_downconvert < 0 ? "opt" : "");
   }
 #endif
 
 /* Write the dsn flags to the spool header file */
 /* DEBUG(D_deliver) debug_printf("DSN: Write SPOOL: -dsn_envid %s\n", dsn_envid); */
-if (dsn_envid) fprintf(fp, "-dsn_envid %s\n", dsn_envid);
+if (dsn_envid) g = string_fmt_append(g, "-dsn_envid %s\n", dsn_envid);
 /* DEBUG(D_deliver) debug_printf("DSN: Write SPOOL: -dsn_ret %d\n", dsn_ret); */
-if (dsn_ret) fprintf(fp, "-dsn_ret %d\n", dsn_ret);
+if (dsn_ret) g = string_fmt_append(g, "-dsn_ret %d\n", dsn_ret);
+
+return g;
+}
+
+
+
+/*************************************************
+*      Write a binary format spool header        *
+*************************************************/
+
+/* The binary format exists to make header rewrites on deferral and header
+reads on queue runs cheaper: there is no line-by-line stdio or number parsing,
+and every field is located by its length. After the first line, which is the
+same as for the text format, come a zero byte and a version byte. Then the
+file is a sequence of records, each being a tag byte, a variable-length record
+length and the data. Strings include their terminating zero so that the reader
+can use them in place. See spool_read_header() for the reader.
+
+Variable-length numbers are 7 bits per byte, least significant first, with the
+top bit set on all but the last byte. Signed values are zigzag-encoded first.
+*/
+
+static gstring *
+spb_uint(gstring * g, unsigned long n)
+{
+do
+  {
+  uschar c = n & 0x7f;
+  if ((n >>= 7)) c |= 0x80;
+  g = string_catn(g, &c, 1);
+  }
+while (n);
+return g;
+}
+
+static gstring *
+spb_int(gstring * g, long n)
+{
+return spb_uint(g,
+  ((unsigned long)n << 1) ^ (unsigned long)(n >> (sizeof(long)*8 - 1)));
+}
+
+static gstring *
+spb_record(gstring * g, uschar tag, const uschar * s, int len)
+{
+g = string_catn(g, &tag, 1);
+g = spb_uint(g, len);
+return string_catn(g, s, len);
+}
+
+static gstring *
+spb_string(gstring * g, uschar tag, const uschar * s)
+{
+return spb_record(g, tag, s, Ustrlen(s) + 1);
+}
+
+static gstring *
+spb_number(gstring * g, uschar tag, long n)
+{
+gstring * v = spb_int(NULL, n);
+return spb_record(g, tag, v->s, v->ptr);
+}
+
+/* Callbacks for tree_walk. An ACL variable record is the name, the quoter
+("" for an untainted value, "-" for a plain tainted one) and the value. */
+
+static void
+spb_acl_var(uschar * name, uschar * value, void * ctx)
+{
+gstring ** gp = ctx, * v = string_catn(NULL, name, Ustrlen(name) + 1);
+if (is_tainted(value))
+  {
+  int q = quoter_for_address(value);
+  v = string_cat(v, is_real_quoter(q) ? lookup_list[q]->name : US"-");
+  }
+v = string_catn(v, US"", 1);
+v = string_catn(v, value, Ustrlen(value) + 1);
+*gp = spb_record(*gp, SPB_ACLVAR, v->s, v->ptr);
+}
+
+static void
+spb_nonrcpt(uschar * name, uschar * value, void * ctx)
+{
+gstring ** gp = ctx;
+*gp = spb_string(*gp, SPB_NONRCPT, name);
+}
+
+
+/* Build the whole of a binary header, apart from the first line.
+
+Argument:  where to return the size of the message's headers
+Returns:   the file content
+*/
+
+static gstring *
+spool_binary_header_build(int * hsize)
+{
+static const uschar preamble[] = { SPOOL_BINARY_MAGIC, SPOOL_BINARY_VERSION };
+gstring * g = string_get(big_buffer_size), * opts = spool_write_options(TRUE);
+
+g = string_catn(g, preamble, sizeof(preamble));
+g = spb_string(g, SPB_LOGIN, string_sprintf("%.63s", originator_login));
+g = spb_number(g, SPB_UID, (long)originator_uid);
+g = spb_number(g, SPB_GID, (long)originator_gid);
+g = spb_string(g, SPB_SENDER, sender_address);
+g = spb_number(g, SPB_TIME, (long)received_time.tv_sec);
+g = spb_number(g, SPB_WARNINGS, warning_count);
+
+if (opts)
+  for (uschar * s = opts->s, * e = s + opts->ptr, * nl; s < e; s = nl + 1)
+    {
+    nl = memchr(s, '\n', e - s);	/* every line is terminated */
+    *nl = 0;
+    g = spb_string(g, SPB_OPTION, s);
+    }
+
+tree_walk(acl_var_c, &spb_acl_var, &g);
+tree_walk(acl_var_m, &spb_acl_var, &g);
+tree_walk(tree_nonrecipients, &spb_nonrcpt, &g);
+
+g = spb_number(g, SPB_RCPT_COUNT, recipients_count);
+for (int i = 0; i < recipients_count; i++)
+  {
+  recipient_item * r = recipients_list + i;
+  gstring * v = spb_int(NULL, r->dsn_flags);
+
+  v = spb_int(v, r->pno);
+  v = string_catn(v, r->address, Ustrlen(r->address) + 1);
+  v = r->orcpt
+    ? string_catn(v, r->orcpt, Ustrlen(r->orcpt) + 1) : string_catn(v, US"", 1);
+  v = r->errors_to
+    ? string_catn(v, r->errors_to, Ustrlen(r->errors_to) + 1)
+    : string_catn(v, US"", 1);
+  g = spb_record(g, SPB_RCPT, v->s, v->ptr);
+  }
+
+/* Each header record is the type letter followed by the text. As for the
+text format, old headers that have been rewritten are not counted in the
+message's size. */
+
+*hsize = 0;
+for (header_line * h = header_list; h; h = h->next)
+  {
+  uschar type = h->type;
+  gstring * v = string_catn(NULL, &type, 1);
+
+  v = string_catn(v, h->text, h->slen + 1);
+  g = spb_record(g, SPB_HEADER, v->s, v->ptr);
+  if (h->type != '*') *hsize += h->slen;
+  }
+return g;
+}
+
+
+
+/*************************************************
+*          Write the header spool file           *
+*************************************************/
+
+/* Returns the size of the file for success; zero for failure. The file is
+written under a temporary name, and then renamed. It's done this way so that it
+works with re-writing the file on message deferral as well as for the initial
+write. Whenever this function is called, the data file for the message should
+be open and locked, thus preventing any other exim process from working on this
+message. The binary format is written instead of the text one if
+spool_binary_header is set.
+
+Argument:
+  id      the message id (used for the eventual filename; the *content* uses the global. Unclear why.)
+  where   SW_RECEIVING, SW_DELIVERING, or SW_MODIFYING
+  errmsg  where to put an error message; if NULL, panic-die on error
+
+Returns:  the size of the header texts on success;
+          negative on writing failure, unless errmsg == NULL
+*/
+
+int
+spool_write_header(const uschar * id, int where, uschar ** errmsg)
+{
+int fd, size_correction = 0, hsize = 0;
+FILE * fp;
+struct stat statbuf;
+uschar * fname;
+uschar * tname = spool_fname(US"input", message_subdir, US"hdr.", message_id);
+gstring * g;
+
+if ((fd = spool_open_temp(tname)) < 0)
+  return spool_write_error(where, errmsg, US"open", NULL, NULL);
+fp = fdopen(fd, "wb");
+DEBUG(D_receive|D_deliver) debug_printf("Writing spool header file: %s%s\n",
+  tname, spool_binary_header ? " (binary)" : "");
+
+/* We now have an open file to which the header data is to be written. Start
+with the file's leaf name, to make the file self-identifying. Continue with the
+identity of the submitting user, followed by the sender's address. The sender's
+address is enclosed in <> because it might be the null address. Then write the
+received time and the number of warning messages that have been sent. */
+
+fprintf(fp, "%s-H\n", message_id);
+
+/* The binary format is built in memory and written in one go; the size of
+the headers comes back from the build function. */
+
+if (spool_binary_header)
+  {
+  g = spool_binary_header_build(&hsize);
+  if (fwrite(g->s, 1, g->ptr, fp) != g->ptr)
+    return spool_write_error(where, errmsg, US"write", tname, fp);
+  goto SYNC;
+  }
+
+fprintf(fp, "%.63s %ld %ld\n", originator_login, (long int)originator_uid,
+  (long int)originator_gid);
+fprintf(fp, "<%s>\n", sender_address);
+fprintf(fp, "%d %d\n", (int)received_time.tv_sec, warning_count);
+
+if ((g = spool_write_options(FALSE)))
+  fwrite(g->s, 1, g->ptr, fp);
 
 /* To complete the envelope, write out the tree of non-recipients, followed by
 the list of recipients. These won't be disjoint the first time, when no
@@ -367,6 +569,7 @@ for (header_line * h = header_list; h; h = h->next)
   if (h->type == '*') size_correction += h->slen;
   }
 
+SYNC:
 /* Flush and check for any errors while writing */
 
 if (fflush(fp) != 0 || ferror(fp))
@@ -374,9 +577,11 @@ if (fflush(fp) != 0 || ferror(fp))
 
 /* Force the file's contents to be written to disk. Note that fflush()
 just pushes it out of C, and fclose() doesn't guarantee to do the write
-either. That's just the way Unix works... */
+either. That's just the way Unix works... When a new message is being
+received under spool_group_sync, this is left for spool_sync_received(). */
 
-if (EXIMfsync(fileno(fp)) < 0)
+if (  !(where == SW_RECEIVING && spool_sync_deferred())
+   && EXIMfsync(fileno(fp)) < 0)
   return spool_write_error(where, errmsg, US"sync", tname, fp);
 
 /* Get the size of the file, and close it. */
@@ -395,6 +600,17 @@ DEBUG(D_receive|D_deliver) debug_printf("Renaming spool header file: %s\n", fnam
 if (Urename(tname, fname) < 0)
   return spool_write_error(where, errmsg, US"rename", tname, NULL);
 
+/* A message small enough for spool_handoff_size has an image of its header
+kept in memory, for an immediate delivery process forked from this one. */
+
+if (where == SW_RECEIVING)
+  {
+  int dummy;
+  spool_handoff_set(id, message_size < spool_handoff_size
+    ? spool_binary_header ? g : spool_binary_header_build(&dummy) : NULL,
+    &statbuf);
+  }
+
 /* Linux (and maybe other OS?) does not automatically sync a directory after
 an operation like rename. We therefore have to do it forcibly ourselves in
 these cases, to make sure the file is actually accessible on disk, as opposed
@@ -407,6 +623,8 @@ these cases. One hack on top of another... but that's life. */
 
 #ifdef NEED_SYNC_DIRECTORY
 
+if (!(where == SW_RECEIVING && spool_sync_deferred()))
+{
 tname = spool_fname(US"input", message_subdir, US".", US"");
 
 # ifndef O_DIRECTORY
@@ -421,17 +639,481 @@ if (EXIMfsync(fd) < 0 && errno != EINVAL)
 
 if (close(fd) < 0)
   return spool_write_error(where, errmsg, US"directory close", fname, NULL);
+}
 
 #endif  /* NEED_SYNC_DIRECTORY */
 
-/* Return the number of characters in the headers, which is the file size, less
-the preliminary stuff, less the additional count fields on the headers. */
+/* A new message is now visible on the queue, or the details the queue index
+keeps about it (such as being frozen) may have changed. */
+
+queue_index_notify(NOTIFY_QUEUE_INDEX_ADD, queue_name, id, *message_subdir);
+
+/* Return the number of characters in the headers. For the text format that is
+the file size, less the preliminary stuff, less the additional count fields on
+the headers. */
+
+if (!spool_binary_header) hsize = statbuf.st_size - size_correction;
+DEBUG(D_receive) debug_printf("Size of headers = %d\n", hsize);
+return hsize;
+}
+
+
+/*************************************************
+*      Share the body of a received message      *
+*************************************************/
+
+/* With spool_dedup_size set, the data file of a message just received is
+compared with that of an earlier message having the same hash of its body.
+If they are the same, the new file is replaced by a hard link to the earlier
+one; the filesystem link count does the refcounting, so the body goes when the
+last message using it is removed. This is done only once the body is final,
+after the ACLs and local_scan(), and the shared file is opened read-only, so
+nothing done for one message can change the body of another. The first line
+of a shared file names the message it was written for. The "bodies" hints
+database maps a body hash to the last message seen with it; entries are only
+hints, and the contents are always compared.
+
+Arguments:
+  id		message id
+  fp		the data file, open and locked; replaced on success
+  errmsg	where to put an error message
+
+Returns:	OK if the data file was replaced by a shared one
+		FAIL if it was not
+		DEFER if the message's data file was replaced, but could not
+		  be opened; the message must be abandoned
+*/
+
+#define DEDUP_BUFSIZE	16384
+
+static BOOL
+dedup_same(int fd1, int fd2, off_t start, off_t end, uschar * buf)
+{
+for (off_t off = start; off < end; )
+  {
+  ssize_t n = end - off > DEDUP_BUFSIZE ? DEDUP_BUFSIZE : end - off;
+  if (  pread(fd1, buf, n, off) != n
+     || pread(fd2, buf + DEDUP_BUFSIZE, n, off) != n
+     || memcmp(buf, buf + DEDUP_BUFSIZE, n) != 0)
+    return FALSE;
+  off += n;
+  }
+return TRUE;
+}
+
+int
+spool_dedup_datafile(const uschar * id, FILE ** fp, uschar ** errmsg)
+{
+int fd = fileno(*fp), nfd = -1;
+off_t start = spool_data_start_offset(id);
+uint64_t h = 14695981039346656037ULL;		/* FNV-1a */
+rmark reset_point = store_mark();
+uschar * buf = store_get(2 * DEDUP_BUFSIZE, GET_UNTAINTED);
+uschar * key;
+struct stat statbuf, cstatbuf;
+dbdata_body * rec, newrec;
+open_db dbblock, * dbm;
+int yield = FAIL, save_errno = 0;
+
+if (  fflush(*fp) != 0
+   || fstat(fd, &statbuf) != 0 || statbuf.st_size - start < spool_dedup_size)
+  goto out;
+for (off_t off = start; off < statbuf.st_size; )
+  {
+  ssize_t n = pread(fd, buf, DEDUP_BUFSIZE, off);
+  if (n <= 0) goto out;
+  for (ssize_t i = 0; i < n; i++) h = (h ^ buf[i]) * 1099511628211ULL;
+  off += n;
+  }
+
+/* The link can only be made within one shard of a sharded spool, and only
+between files in the same format */
+
+key = string_sprintf("%s%s:%c:" PR_EXIM_ARITH ":%016llx", queue_name,
+  spool_shard_count
+  ? string_sprintf("/%d", spool_shard(message_subdir[0])) : US"",
+  f.spool_file_wireformat ? 'w' : 'n',
+  (int_eximarith_t)(statbuf.st_size - start), (unsigned long long)h);
+
+if (!(dbm = dbfn_open(US"bodies", O_RDWR|O_CREAT, &dbblock, TRUE, TRUE)))
+  goto out;
+
+if (  (rec = dbfn_read_enforce_length(dbm, key, sizeof(dbdata_body)))
+   && (rec->id[MESSAGE_ID_LENGTH] = '\0', mac_ismsgid(rec->id))
+   && Ustrcmp(rec->id, id) != 0
+   && spool_data_start_offset(rec->id) == start
+   && (!rec->subdir || isalnum(rec->subdir)))
+  {
+  /* The record is from a file; it has been checked, so can be trusted */
+  uschar csubdir[2] = { rec->subdir, '\0' };
+  const uschar * cid = string_copy_taint(rec->id, GET_UNTAINTED);
+  uschar * cname = spool_fname(US"input", csubdir, cid, US"-D");
+  BOOL same = FALSE;
+  FILE * nfp;
+  int cfd;
+
+  /* Closing any descriptor for a file drops this process's locks on it, so
+  this one is closed before the new link is locked */
+
+  if ((cfd = Uopen(cname, EXIM_CLOEXEC | EXIM_NOFOLLOW | O_RDONLY, 0)) >= 0)
+    {
+    same =  fstat(cfd, &cstatbuf) == 0
+	 && cstatbuf.st_size == statbuf.st_size
+	 && dedup_same(fd, cfd, start, statbuf.st_size, buf);
+    (void) close(cfd);
+    }
+
+  if (same)
+    {
+    uschar * dname = spool_fname(US"input", message_subdir, id, US"-D");
+    uschar * tname = spool_fname(US"input", message_subdir, US"dedup",
+			string_sprintf(".%d", (int)getpid()));
+    flock_t lock_data = {.l_type = F_RDLCK, .l_whence = SEEK_SET,
+			 .l_start = 0, .l_len = start};
+
+    /* The new link is locked before it replaces the data file. A process
+    handling another message using the file holds a write lock, and then
+    there is no sharing this time. */
+
+    (void) Uunlink(tname);
+    if (Ulink(cname, tname) == 0)
+      {
+      if (  (nfd = Uopen(tname, EXIM_CLOEXEC | EXIM_NOFOLLOW | O_RDONLY, 0)) < 0
+	 || fcntl(nfd, F_SETLK, &lock_data) < 0
+	 || Urename(tname, dname) < 0)
+	(void) Uunlink(tname);
+
+      /* The message's data file is now the shared one, and the one open is
+      unlinked, so from here any failure loses the message */
+
+      else if (!(nfp = fdopen(nfd, "r")))
+	{
+	save_errno = errno;
+	yield = DEFER;
+	}
+      else
+	{
+	(void) fclose(*fp);
+	*fp = nfp;
+	nfd = -1;
+	yield = OK;
+	DEBUG(D_receive) debug_printf("data file for %s shared with %s\n",
+	  id, cid);
+	}
+      }
+    }
+  }
+
+if (yield == FAIL)
+  {
+  newrec.subdir = message_subdir[0];
+  Ustrncpy(newrec.id, id, MESSAGE_ID_LENGTH);
+  newrec.id[MESSAGE_ID_LENGTH] = '\0';
+  (void) dbfn_write(dbm, key, &newrec, sizeof(dbdata_body));
+  }
+dbfn_close(dbm);
+
+out:
+  if (nfd >= 0) (void) close(nfd);
+  store_reset(reset_point);
+  if (yield == DEFER)
+    *errmsg = string_sprintf("failed to open shared data file for %s: %s",
+      id, strerror(save_errno));
+  return yield;
+}
+
+
+
+/*************************************************
+*     Group commit of received messages          *
+*************************************************/
+
+/* With spool_group_sync set, a receiving process does not fsync the -D and -H
+files as it writes them. Once both are in place it asks the daemon, over the
+notifier socket, to make them durable, and waits for the answer before the
+message is acknowledged. The daemon collects the requests that arrive within
+the configured window and covers them all with a single syncfs() of the
+spool's filesystem. If the daemon cannot be reached, or the OS has no syncfs(),
+the process falls back to doing its own fsyncs.
+
+Returns:  TRUE if the fsyncs of a file being received are left for
+          spool_sync_received()
+*/
+
+BOOL
+spool_sync_deferred(void)
+{
+#ifndef EXIM_HAVE_SYNCFS
+return FALSE;
+#else
+return spool_group_sync >= 0 && notifier_socket && *notifier_socket
+# ifdef ENABLE_DISABLE_FSYNC
+  && !disable_fsync
+# endif
+  ;
+#endif
+}
+
+
+#ifdef EXIM_HAVE_SYNCFS
+/* Ask the daemon; return TRUE if it reports success */
+
+static BOOL
+spool_sync_by_daemon(void)
+{
+struct sockaddr_un sa_un = {.sun_family = AF_UNIX};
+uschar buf[1] = { NOTIFY_SPOOL_SYNC };
+const uschar * where;
+uschar * sname;
+ssize_t len;
+int fd;
+
+if ((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0)
+  {
+  DEBUG(D_receive) debug_printf(" socket: %s\n", strerror(errno));
+  return FALSE;
+  }
+
+len = daemon_client_sockname(&sa_un, &sname);
+if (bind(fd, (const struct sockaddr *)&sa_un, (socklen_t)len) < 0)
+  { where = US"bind"; goto bad; }
+
+len = daemon_notifier_sockname(&sa_un);
+if (connect(fd, (const struct sockaddr *)&sa_un, len) < 0)
+  { where = US"connect"; goto bad2; }
+if (send(fd, buf, 1, 0) < 0)
+  { where = US"send"; goto bad2; }
+if (poll_one_fd(fd, POLLIN, 5 * 1000) != 1)
+  { where = US"poll"; errno = ETIMEDOUT; goto bad2; }
+if (recv(fd, buf, 1, 0) != 1)
+  { where = US"recv"; goto bad2; }
+
+close(fd);
+# ifndef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
+Uunlink(sname);
+# endif
+DEBUG(D_receive) debug_printf("spool group sync by daemon: %s\n",
+  buf[0] ? "failed" : "ok");
+return buf[0] == 0;
+
+bad2:
+# ifndef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
+  Uunlink(sname);
+# endif
+bad:
+  close(fd);
+  DEBUG(D_receive) debug_printf(" spool group sync %s: %s\n",
+    where, strerror(errno));
+  return FALSE;
+}
+#endif	/* EXIM_HAVE_SYNCFS */
+
+
+/* Called by a receiving process once the -H file for a new message has been
+renamed into place. Does nothing unless the fsyncs were deferred.
+
+Arguments:
+  id        message id
+  data_fd   the open -D file
+  errmsg    where to put an error message
+
+Returns:    FALSE on failure, with *errmsg set
+*/
+
+BOOL
+spool_sync_received(const uschar * id, int data_fd, uschar ** errmsg)
+{
+uschar * fname;
+int fd;
+
+if (!spool_sync_deferred()) return TRUE;
+#ifdef EXIM_HAVE_SYNCFS
+if (spool_sync_by_daemon()) return TRUE;
+#endif
+
+DEBUG(D_receive) debug_printf("spool group sync: doing own fsyncs\n");
+if (EXIMfsync(data_fd) < 0) goto bad;
+
+fname = spool_fname(US"input", message_subdir, id, US"-H");
+if ((fd = Uopen(fname, O_RDONLY, 0)) < 0) goto bad;
+if (EXIMfsync(fd) < 0) { close(fd); goto bad; }
+(void)close(fd);
+
+#ifdef NEED_SYNC_DIRECTORY
+fname = spool_fname(US"input", message_subdir, US".", US"");
+if ((fd = Uopen(fname, O_RDONLY|O_DIRECTORY, 0)) < 0) goto bad;
+if (EXIMfsync(fd) < 0 && errno != EINVAL) { close(fd); goto bad; }
+(void)close(fd);
+#endif
+return TRUE;
+
+bad:
+  *errmsg = string_sprintf("spool file sync error while receiving from %s: %s",
+    sender_fullhost ? sender_fullhost : sender_ident, strerror(errno));
+  return FALSE;
+}
+
+
+#ifdef EXIM_HAVE_SYNCFS
+/* Daemon side. The waiting processes are remembered by their socket
+addresses, in malloc store as the daemon's loop resets its pools. */
+
+typedef struct sync_waiter {
+  struct sync_waiter *	next;
+  socklen_t		len;
+  struct sockaddr_un	addr;
+} sync_waiter;
+
+static sync_waiter *	sync_waiters = NULL;
+static struct timeval	sync_deadline;
+static int		sync_spool_fd = -1;
+static int *		sync_shard_fds = NULL;	/* for the spool shard roots */
+
+
+/* Note a request, starting the window if it is the first one */
+
+void
+spool_sync_at_daemon(const struct sockaddr * sa, socklen_t len)
+{
+sync_waiter * w;
+
+if (len > sizeof(w->addr)) return;
+w = store_malloc(sizeof(sync_waiter));
+memcpy(&w->addr, sa, len);
+w->len = len;
+if (!sync_waiters)
+  {
+  gettimeofday(&sync_deadline, NULL);
+  sync_deadline.tv_usec += spool_group_sync * 1000;
+  sync_deadline.tv_sec += sync_deadline.tv_usec / 1000000;
+  sync_deadline.tv_usec %= 1000000;
+  }
+w->next = sync_waiters;
+sync_waiters = w;
+}
+
+
+/* Return the time, in milliseconds, until the window closes, for use as a poll
+timeout: -1 if there are no waiting processes. */
+
+int
+spool_sync_timeout(void)
+{
+struct timeval now;
+long ms;
+
+if (!sync_waiters) return -1;
+gettimeofday(&now, NULL);
+ms = (sync_deadline.tv_sec - now.tv_sec) * 1000
+   + (sync_deadline.tv_usec - now.tv_usec) / 1000;
+return ms > 0 ? (int)ms : 0;
+}
+
+
+/* Sync the filesystem of one spool root. The descriptor was opened by the
+daemon and is inherited by the syncing process. */
+
+static BOOL
+spool_syncfs(int fd, const uschar * root)
+{
+if (fd < 0 || syncfs(fd) < 0)
+  {
+  log_write(0, LOG_MAIN|LOG_PANIC, "spool group sync: %s: %s", root,
+    strerror(errno));
+  return FALSE;
+  }
+return TRUE;
+}
+
+
+/* Answer all the waiting processes with the given status, and forget them */
+
+static void
+spool_sync_answer(int fd, uschar status)
+{
+int count = 0;
+
+for (sync_waiter * w = sync_waiters, * next; w; w = next)
+  {
+  next = w->next;
+  if (fd >= 0 && sendto(fd, &status, 1, 0, (const struct sockaddr *)&w->addr,
+		w->len) < 0)
+    DEBUG(D_receive) debug_printf("%s: sendto: %s\n", __FUNCTION__,
+      strerror(errno));
+  store_free(w);
+  count++;
+  }
+sync_waiters = NULL;
+if (fd >= 0)
+  { DEBUG(D_receive) debug_printf("spool group sync for %d process%s\n",
+    count, count == 1 ? "" : "es"); }
+}
+
 
-DEBUG(D_receive) debug_printf("Size of headers = %d\n",
-  (int)(statbuf.st_size - size_correction));
+/* If the window has closed, sync the spool filesystem, and those of any shard
+roots, and answer all the waiting processes. A syncfs() can take a long time on
+a busy filesystem, so it is done by a child process, which sends the answers;
+the daemon just forgets the waiters and carries on. The child is an unknown pid
+to handle_ending_processes(), which only reaps it. If the fork fails the
+waiters are told to do their own fsyncs.
 
-return statbuf.st_size - size_correction;
+Argument:  the notifier socket
+*/
+
+void
+spool_sync_flush(int fd)
+{
+pid_t pid;
+
+if (spool_sync_timeout() != 0) return;
+
+if (spool_shard_count && !sync_shard_fds)
+  {
+  sync_shard_fds = store_malloc(spool_shard_count * sizeof(int));
+  for (int i = 0; i < spool_shard_count; i++) sync_shard_fds[i] = -1;
+  }
+
+/* The roots are opened once, by the daemon, so that each child need not */
+
+if (sync_spool_fd < 0)
+  sync_spool_fd = Uopen(spool_directory, O_RDONLY|EXIM_CLOEXEC, 0);
+for (int i = 0; i < spool_shard_count; i++)
+  if (sync_shard_fds[i] < 0)
+    sync_shard_fds[i] = Uopen(spool_shard_roots[i], O_RDONLY|EXIM_CLOEXEC, 0);
+
+if ((pid = exim_fork(US"spool-sync")) == 0)
+  {
+  uschar status = 0;
+
+  signal(SIGHUP,  SIG_DFL);
+  signal(SIGCHLD, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  set_process_info("syncing the spool for a group commit");
+
+  if (!spool_syncfs(sync_spool_fd, spool_directory))
+    status = 1;
+  for (int i = 0; i < spool_shard_count; i++)
+    if (!spool_syncfs(sync_shard_fds[i], spool_shard_roots[i]))
+      status = 1;
+  spool_sync_answer(fd, status);
+  exim_underbar_exit(EXIT_SUCCESS);
+  }
+
+if (pid < 0)
+  {
+  log_write(0, LOG_MAIN|LOG_PANIC, "spool group sync: fork failed: %s",
+    strerror(errno));
+  spool_sync_answer(fd, 1);
+  return;
+  }
+
+/* The child has its own copy of the list */
+
+spool_sync_answer(-1, 0);
 }
+#endif	/* EXIM_HAVE_SYNCFS */
+
 
 
 /************************************************
@@ -513,9 +1195,8 @@ return TRUE;
 *            Move message files                 *
 ************************************************/
 
-/* Move the files for a message (-H, -D, and msglog) from one directory (or
-hierarchy) to another. It is assume that there is no -J file in existence when
-this is done.
+/* Move the files for a message (-H, -D, any -J, and msglog) from one
+directory (or hierarchy) to another.
 
 Arguments:
   id          the id of the message to be delivered
@@ -538,10 +1219,10 @@ dest_qname = string_copy_taint(dest_qname, GET_UNTAINTED);
 
 /* Create any output directories that do not exist. */
 
-(void) directory_make(spool_directory,
+(void) directory_make(spool_root(subdir),
   spool_q_sname(string_sprintf("%sinput", to), dest_qname, subdir),
   INPUT_DIRECTORY_MODE, TRUE);
-(void) directory_make(spool_directory,
+(void) directory_make(spool_root(subdir),
   spool_q_sname(string_sprintf("%smsglog", to), dest_qname, subdir),
   INPUT_DIRECTORY_MODE, TRUE);
 
@@ -552,18 +1233,26 @@ message to be delivered, so we create its new link last and remove its old link
 first. Programs that look at the alternate directories should follow the same
 rule of waiting for a -H file before doing anything. When moving messages off
 the mail spool, the -D file should be open and locked at the time, thus keeping
-Exim's hands off. */
+Exim's hands off. Any -J file goes too, as with spool_journal_size set it can
+hold deliveries that the -H file does not record. Any -L lock file is just
+removed; it is made again when needed. */
 
 if (!make_link(US"msglog", dest_qname, subdir, id, US"", from, to, TRUE) ||
     !make_link(US"input",  dest_qname, subdir, id, US"-D", from, to, FALSE) ||
+    !make_link(US"input",  dest_qname, subdir, id, US"-J", from, to, TRUE) ||
     !make_link(US"input",  dest_qname, subdir, id, US"-H", from, to, FALSE))
   return FALSE;
 
 if (!break_link(US"input",  subdir, id, US"-H", from, FALSE) ||
+    !break_link(US"input",  subdir, id, US"-J", from, TRUE) ||
     !break_link(US"input",  subdir, id, US"-D", from, FALSE) ||
+    !break_link(US"input",  subdir, id, US"-L", from, TRUE) ||
     !break_link(US"msglog", subdir, id, US"", from, TRUE))
   return FALSE;
 
+if (!*from) queue_index_notify(NOTIFY_QUEUE_INDEX_DEL, queue_name, id, 0);
+if (!*to)   queue_index_notify(NOTIFY_QUEUE_INDEX_ADD, dest_qname, id, *subdir);
+
 log_write(0, LOG_MAIN, "moved from %s%s%s%sinput, %smsglog to %s%s%s%sinput, %smsglog",
    *queue_name?"(":"", *queue_name?queue_name:US"", *queue_name?") ":"",
    from, from,
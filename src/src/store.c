@@ -111,6 +111,9 @@ typedef struct pooldesc {
   void *	next_yield;		/* next allocation point */
   int		yield_length;		/* remaining space in current block */
   unsigned	store_block_order;	/* log2(size) block allocation size */
+  unsigned	startorder;		/* order to back off to on reset */
+  storeblock *	freelist;		/* blocks kept from resets, for reuse */
+  int		freebytes;		/* total size of those */
 
   /* This variable is set by store_get() to its yield, and by store_reset() to
   NULL. This enables string_cat() to optimize its store handling for very long
@@ -159,6 +162,13 @@ defining RESTRICTED_MEMORY */
 /* #define RESTRICTED_MEMORY */
 #define STORE_BLOCK_SIZE(order) ((1U << (order)) - ALIGNED_SIZEOF_STOREBLOCK)
 
+/* Blocks freed by store_reset() are kept, up to this much per pool, for reuse
+rather than given back to malloc.  The order a pool backs off to after a reset
+is learned from its use, up to this limit. */
+
+#define STORE_KEEP_BYTES	(1 << 17)
+#define STORE_MAX_START_ORDER	16
+
 /* Variables holding data for the local pools of store. The current pool number
 is held in store_pool, which is global so that it can be changed from outside.
 Setting the initial length values to -1 forces a malloc for the first call,
@@ -182,6 +192,14 @@ pointer. */
 static int pool_malloc;
 static int nonpool_malloc;
 
+#ifndef COMPILE_UTILITY
+/* Set once the store_soft_limit or store_hard_limit has been passed; each is
+only reported once per process. */
+
+static BOOL store_soft_limit_hit = FALSE;
+static BOOL store_hard_limit_hit = FALSE;
+#endif
+
 
 #ifndef COMPILE_UTILITY
 static const uschar * pooluse[N_PAIRED_POOLS] = {
@@ -214,6 +232,42 @@ static const uschar * poolclass[N_PAIRED_POOLS] = {
 static void * internal_store_malloc(size_t, const char *, int);
 static void   internal_store_free(void *, const char *, int linenumber);
 
+
+/* The blocks for the tainted and quoted pools are carved from one reserved
+range of address space, so that is_tainted() can be a range comparison.  Their
+sizes are rounded up to a power of two, not less than a page, and freed blocks
+are kept on a list for each size for reuse, the larger ones having their pages
+handed back to the system.  Should the reservation fail, or fill up, tainted
+blocks are got from malloc as before and is_tainted() falls back to searching
+the pools' block chains. */
+
+#if defined(MAP_ANONYMOUS) || defined(MAP_ANON)
+# define TAINT_RANGE
+# ifndef MAP_ANONYMOUS
+#  define MAP_ANONYMOUS MAP_ANON
+# endif
+# ifndef MAP_NORESERVE
+#  define MAP_NORESERVE 0
+# endif
+# ifndef TAINT_RANGE_SIZE
+#  define TAINT_RANGE_SIZE ((size_t)1 << (sizeof(void *) > 4 ? 32 : 28))
+# endif
+# define TAINT_MAX_ORDER 31
+# define TAINT_MADVISE_ORDER 16
+
+static uschar *	taint_base = NULL;		/* reserved range */
+static uschar *	taint_top = NULL;
+static uschar *	taint_next;			/* first never-used address */
+static unsigned	taint_page_order;
+static storeblock * taint_free[TAINT_MAX_ORDER+1];
+#endif
+static BOOL	taint_spilled =			/* tainted blocks off-range */
+#ifdef TAINT_RANGE
+				FALSE;
+#else
+				TRUE;
+#endif
+
 /******************************************************************************/
 
 static void
@@ -222,6 +276,7 @@ pool_init(pooldesc * pp)
 memset(pp, 0, sizeof(*pp));
 pp->yield_length = -1;
 pp->store_block_order = 12; /* log2(allocation_size) ie. 4kB */
+pp->startorder = 13;
 }
 
 /* Initialisation, for things fragile with parameter channges when using
@@ -259,36 +314,134 @@ for (pooldesc * pp = paired_pools; pp < paired_pools + N_PAIRED_POOLS; pp++)
 return NULL;
 }
 
-static pooldesc *
-pool_for_pointer(const void * p, const char * func, int linenumber)
+
+/******************************************************************************/
+/* Blocks for tainted pools */
+
+static BOOL
+pool_is_tainted(const pooldesc * pp)
 {
-pooldesc * pp;
-storeblock * b;
+return pp < paired_pools || pp >= paired_pools + POOL_TAINT_BASE;
+}
 
-if ((pp = pool_current_for_pointer(p))) return pp;
+#ifdef TAINT_RANGE
+static BOOL
+is_in_taint_range(const void * p)
+{
+return US p >= taint_base && US p < taint_top;
+}
 
-for (quoted_pooldesc * qp = quoted_pools; qp; qp = qp->next)
-  for (b = qp->pool.chainbase; b; b = b->next)
-    if (is_pointer_in_block(b, p)) return &qp->pool;
+static unsigned
+taint_order(size_t size)
+{
+unsigned order = taint_page_order;
+while (((size_t)1 << order) < size) order++;
+return order;
+}
+#endif
 
-for (pp = paired_pools; pp < paired_pools + N_PAIRED_POOLS; pp++)
-  for (b = pp->chainbase; b; b = b->next)
-    if (is_pointer_in_block(b, p)) return pp;
+/* Get a block for a tainted pool.  The accounting is as for
+internal_store_malloc(), which is used if the range is not available.
 
-#ifndef COMPILE_UTILITY
-stackdump();
+Arguments:
+  size        the size of the block, including its header
+  func        function from which called
+  linenumber  line number in source file
+
+Returns:      the block
+*/
+
+static storeblock *
+taint_block_get(size_t size, const char * func, int linenumber)
+{
+#ifdef TAINT_RANGE
+storeblock * b = NULL;
+unsigned order;
+
+if (!taint_base && !taint_spilled)
+  {
+  void * base = mmap(NULL, TAINT_RANGE_SIZE, PROT_NONE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED)
+    taint_spilled = TRUE;
+  else
+    {
+    taint_next = taint_base = base;
+    taint_top = taint_base + TAINT_RANGE_SIZE;
+    for (long pgsize = sysconf(_SC_PAGESIZE); (1L << taint_page_order) < pgsize; )
+      taint_page_order++;
+    }
+  }
+
+if (taint_base && (order = taint_order(size)) <= TAINT_MAX_ORDER)
+  {
+  size_t bsize = (size_t)1 << order;
+
+  if ((b = taint_free[order]))
+    taint_free[order] = b->next;
+  else if (  bsize <= (size_t)(taint_top - taint_next)
+	  && mprotect(taint_next, bsize, PROT_READ|PROT_WRITE) == 0)
+    {
+    b = (storeblock *)taint_next;
+    taint_next += bsize;
+    }
+  }
+
+if (b)
+  {
+  if ((nonpool_malloc += size) > max_nonpool_malloc)
+    max_nonpool_malloc = nonpool_malloc;
+# ifndef COMPILE_UTILITY
+  if (f.running_in_test_harness)
+    memset(b, 0xF0, size);
+  DEBUG(D_memory) debug_printf("--TaintGet %6p %5lu bytes\t%-20s %4d\tpool %5d  nonpool %5d\n",
+    (void *)b, (unsigned long)size, func, linenumber, pool_malloc, nonpool_malloc);
+# endif
+  return b;
+  }
+
+taint_spilled = TRUE;
+#endif	/*TAINT_RANGE*/
+return internal_store_malloc(size, func, linenumber);
+}
+
+
+/* Free a block of a pool, tainted or not */
+
+static void
+pool_block_free(storeblock * b, const char * func, int linenumber)
+{
+#ifdef TAINT_RANGE
+if (is_in_taint_range(b))
+  {
+  size_t size = b->length + ALIGNED_SIZEOF_STOREBLOCK;
+  unsigned order = taint_order(size);
+
+# ifndef COMPILE_UTILITY
+  DEBUG(D_any) nonpool_malloc -= size;
+  DEBUG(D_memory) debug_printf("----TaintFree %6p %5lu bytes\t%-20s %4d\n",
+		    (void *)b, (unsigned long)size, func, linenumber);
+# endif
+# ifdef MADV_DONTNEED
+  if (order >= TAINT_MADVISE_ORDER)
+    (void) madvise(US b + ((size_t)1 << taint_page_order),
+		    ((size_t)1 << order) - ((size_t)1 << taint_page_order),
+		    MADV_DONTNEED);
+# endif
+  b->next = taint_free[order];
+  taint_free[order] = b;
+  return;
+  }
 #endif
-log_write(0, LOG_MAIN|LOG_PANIC_DIE,
-  "bad memory reference; pool not found, at %s %d", func, linenumber);
-return NULL;
+internal_store_free(b, func, linenumber);
 }
 
 /******************************************************************************/
 /* Test if a pointer refers to tainted memory.
 
-Slower version check, for use when platform intermixes malloc and mmap area
-addresses. Test against the current-block of all tainted pools first, then all
-blocks of all tainted pools.
+Normally all tainted blocks are in the reserved range.  Otherwise use the
+slower check; test against the current-block of all tainted pools first, then
+all blocks of all tainted pools.
 
 Return: TRUE iff tainted
 */
@@ -301,6 +454,11 @@ storeblock * b;
 if (p == GET_UNTAINTED) return FALSE;
 if (p == GET_TAINTED) return TRUE;
 
+#ifdef TAINT_RANGE
+if (is_in_taint_range(p)) return TRUE;
+#endif
+if (!taint_spilled) return FALSE;
+
 for (pooldesc * pp = paired_pools + POOL_TAINT_BASE;
      pp < paired_pools + N_PAIRED_POOLS; pp++)
   if ((b = pp->current_block))
@@ -416,27 +574,50 @@ if (size > pp->yield_length)
     {
     /* Give up on this block, because it's too small */
     pp->nblocks--;
-    internal_store_free(newblock, func, linenumber);
+    pool_block_free(newblock, func, linenumber);
     newblock = NULL;
     }
 
-  /* If there was no free block, get a new one */
+  /* If there was no free block, take one kept by an earlier store_reset()
+  if there is one big enough, or get a new one */
 
   if (!newblock)
     {
+    storeblock ** bp = &pp->freelist;
+
+    while (*bp && (*bp)->length < length) bp = &(*bp)->next;
+    if ((newblock = *bp))
+      {
+      *bp = newblock->next;
+      length = newblock->length;
+      mlength = length + ALIGNED_SIZEOF_STOREBLOCK;
+      pp->freebytes -= mlength;
+      }
+
     if ((pp->nbytes += mlength) > pp->maxbytes)
       pp->maxbytes = pp->nbytes;
     if ((pool_malloc += mlength) > max_pool_malloc)	/* Used in pools */
       max_pool_malloc = pool_malloc;
-    nonpool_malloc -= mlength;			/* Exclude from overall total */
     if (++pp->nblocks > pp->maxblocks)
       pp->maxblocks = pp->nblocks;
 
+    if (newblock)
+      {
+#ifndef COMPILE_UTILITY
+      if (f.running_in_test_harness)
+	memset(CS newblock + ALIGNED_SIZEOF_STOREBLOCK, 0xF0, length);
+      DEBUG(D_memory) debug_printf("--Reuse  %6p %5d bytes\t%-20s %4d\tpool %5d\n",
+	(void *)newblock, mlength, func, linenumber, pool_malloc);
+#endif
+      }
 #ifndef MISSING_POSIX_MEMALIGN
-    if (align_mem)
+    else if (align_mem)
       {
       long pgsize = sysconf(_SC_PAGESIZE);
-      int err = posix_memalign((void **)&newblock,
+      int err;
+
+      nonpool_malloc -= mlength;		/* Exclude from overall total */
+      err = posix_memalign((void **)&newblock,
 				pgsize, (mlength + pgsize - 1) & ~(pgsize - 1));
       if (err)
 	log_write(0, LOG_MAIN|LOG_PANIC_DIE,
@@ -444,9 +625,14 @@ if (size > pp->yield_length)
 	  "called from line %d in %s",
 	  size, strerror(err), linenumber, func);
       }
-    else
 #endif
-      newblock = internal_store_malloc(mlength, func, linenumber);
+    else
+      {
+      nonpool_malloc -= mlength;		/* Exclude from overall total */
+      newblock = pool_is_tainted(pp)
+	? taint_block_get(mlength, func, linenumber)
+	: internal_store_malloc(mlength, func, linenumber);
+      }
     newblock->next = NULL;
     newblock->length = length;
 #ifndef RESTRICTED_MEMORY
@@ -465,6 +651,20 @@ if (size > pp->yield_length)
   pp->next_yield =
     (void *)(CS pp->current_block + ALIGNED_SIZEOF_STOREBLOCK);
   (void) VALGRIND_MAKE_MEM_NOACCESS(pp->next_yield, pp->yield_length);
+
+#ifndef COMPILE_UTILITY
+  /* A runaway process is stopped once its pools pass the hard limit. The
+  flag is set first as the logging might itself want store. The daemon is
+  exempt; losing it would take down every other process with it. */
+
+  if (  store_hard_limit > 0 && pool_malloc > store_hard_limit
+     && !store_hard_limit_hit && !f.daemon_listen)
+    {
+    store_hard_limit_hit = TRUE;
+    log_write(0, LOG_MAIN|LOG_PANIC_DIE,
+      "pool store of %d kB is over store_hard_limit", pool_malloc/1024);
+    }
+#endif
   }
 
 /* There's (now) enough room in the current block; the yield is the next
@@ -710,6 +910,10 @@ Returns:     TRUE if the block is at the top of the stack and has been
              extended; FALSE if it isn't at the top of the stack, or cannot
              be extended
 
+Only the current blocks of the pools need be searched, as the top allocation
+of a pool is in its current block.  Memory not in a pool at all, such as a
+caller's buffer for a growable-string, just gives FALSE.
+
 XXX needs extension for quoted-tracking.  This assumes that the global store_pool
 is the one to alloc from, which breaks with separated pools.
 */
@@ -718,7 +922,7 @@ BOOL
 store_extend_3(void * ptr, int oldsize, int newsize,
    const char * func, int linenumber)
 {
-pooldesc * pp = pool_for_pointer(ptr, func, linenumber);
+pooldesc * pp;
 int inc = newsize - oldsize;
 int rounded_oldsize = oldsize;
 
@@ -727,6 +931,9 @@ if (oldsize < 0 || newsize < oldsize || newsize >= INT_MAX/2)
             "bad memory extension requested (%d -> %d bytes) at %s %d",
             oldsize, newsize, func, linenumber);
 
+if (!(pp = pool_current_for_pointer(ptr)))
+  return FALSE;
+
 if (rounded_oldsize % alignment != 0)
   rounded_oldsize += alignment - (rounded_oldsize % alignment);
 
@@ -794,6 +1001,29 @@ Arguments:
 Returns:      nothing
 */
 
+/* Keep a block freed from a pool, for reuse by the pool.  Only blocks of the
+sizes pool_get() makes from STORE_BLOCK_SIZE() are kept, up to STORE_KEEP_BYTES;
+others go back to malloc. */
+
+static void
+pool_block_keep(pooldesc * pp, storeblock * b, const char * func, int linenumber)
+{
+#ifndef RESTRICTED_MEMORY
+int siz = b->length + ALIGNED_SIZEOF_STOREBLOCK;
+
+if (  is_pwr2_size(siz + ALIGNED_SIZEOF_STOREBLOCK)
+   && pp->freebytes + siz <= STORE_KEEP_BYTES)
+  {
+  b->next = pp->freelist;
+  pp->freelist = b;
+  pp->freebytes += siz;
+  return;
+  }
+#endif
+pool_block_free(b, func, linenumber);
+}
+
+
 static void
 internal_store_reset(void * ptr, int pool, const char *func, int linenumber)
 {
@@ -871,6 +1101,17 @@ bb = b->next;
 if (pool != POOL_CONFIG)
   b->next = NULL;
 
+#ifndef RESTRICTED_MEMORY
+/* Freeing blocks back to the first one ends a use of the pool, such as for a
+message.  Move the order to back off to halfway towards the one this use
+reached, so that a long-lived process for many similar messages starts each
+at about the block size it needs. */
+
+if (bb && b == pp->chainbase)
+  pp->startorder = MIN((pp->startorder + pp->store_block_order + 1) / 2,
+			STORE_MAX_START_ORDER);
+#endif
+
 while ((b = bb))
   {
   int siz = b->length + ALIGNED_SIZEOF_STOREBLOCK;
@@ -885,10 +1126,10 @@ while ((b = bb))
   pool_malloc -= siz;
   pp->nblocks--;
   if (pool != POOL_CONFIG)
-    internal_store_free(b, func, linenumber);
+    pool_block_keep(pp, b, func, linenumber);
 
 #ifndef RESTRICTED_MEMORY
-  if (pp->store_block_order > 13) pp->store_block_order--;
+  if (pp->store_block_order > pp->startorder) pp->store_block_order--;
 #endif
   }
 
@@ -1075,7 +1316,7 @@ for (storeblock * b =  pp->chainbase; b; b = b->next)
       memset(bb, 0xF0, bb->length+ALIGNED_SIZEOF_STOREBLOCK);
 #endif  /* COMPILE_UTILITY */
 
-    internal_store_free(bb, func, linenumber);
+    pool_block_free(bb, func, linenumber);
     return;
     }
   }
@@ -1096,7 +1337,9 @@ the old block iff the previous copy of the string is at its start,
 and therefore the only thing in it. Otherwise, for very long strings,
 dead store can pile up somewhat disastrously. This function checks that
 the pointer it is given is the first thing in a block, and that nothing
-has been allocated since. If so, releases that block.
+has been allocated since. If so, releases that block.  As the last thing
+got from a pool is in its current block, only those need be searched for the
+old block; it need not be in a pool at all.
 
 Arguments:
   oldblock
@@ -1110,8 +1353,8 @@ void *
 store_newblock_3(void * oldblock, int newsize, int len,
   const char * func, int linenumber)
 {
-pooldesc * pp = pool_for_pointer(oldblock, func, linenumber);
-BOOL release_ok = !is_tainted(oldblock) && pp->store_last_get == oldblock;		/*XXX why tainted not handled? */
+pooldesc * pp = pool_current_for_pointer(oldblock);
+BOOL release_ok = pp && !is_tainted(oldblock) && pp->store_last_get == oldblock;		/*XXX why tainted not handled? */
 uschar * newblock;
 
 if (len < 0 || len > newsize)
@@ -1230,6 +1473,51 @@ n_nonpool_blocks--;
 internal_store_free(block, func, linenumber);
 }
 
+/******************************************************************************/
+/* Memory limits and accounting */
+
+#ifndef COMPILE_UTILITY
+/* Check the pool store in use against the store_soft_limit option. Once over
+it, a process should stop taking on new work and defer what it can; the
+condition is logged once.
+
+Returns:	TRUE if over the limit
+*/
+
+BOOL
+store_over_soft_limit(void)
+{
+if (store_soft_limit <= 0 || pool_malloc <= store_soft_limit) return FALSE;
+if (!store_soft_limit_hit)
+  {
+  store_soft_limit_hit = TRUE;
+  log_write(0, LOG_MAIN, "pool store of %d kB is over store_soft_limit",
+    pool_malloc/1024);
+  }
+return TRUE;
+}
+
+
+/* Report the peak store used by the process for each pool, the tainted and
+untainted halves of a pair being summed, and overall.
+
+Argument:	vector of POOL_TAINT_BASE+1 ints for the peaks; the last is
+		the peak over all the pools together
+Returns:	bitmap of limits passed: 1 for soft, 2 for hard
+*/
+
+unsigned
+store_peaks(int * peak)
+{
+for (int i = 0; i < POOL_TAINT_BASE; i++)
+  peak[i] = paired_pools[i].maxbytes
+	  + paired_pools[i + POOL_TAINT_BASE].maxbytes;
+peak[POOL_TAINT_BASE] = max_pool_malloc;
+return (store_soft_limit_hit ? 1 : 0) | (store_hard_limit_hit ? 2 : 0);
+}
+#endif
+
+
 /******************************************************************************/
 /* Stats output on process exit */
 void
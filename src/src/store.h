@@ -77,6 +77,9 @@ extern void *  store_newblock_3(void *, int, int, const char *, int);
 extern void    store_release_above_3(void *, const char *, int);
 extern rmark   store_reset_3(rmark, const char *, int);
 
+extern BOOL    store_over_soft_limit(void);
+extern unsigned store_peaks(int *);
+
 #define GET_UNTAINTED	(const void *)0
 #define GET_TAINTED	(const void *)1
 
@@ -708,6 +708,11 @@ Arguments:
 Returns:    pointer to fresh piece of store containing sprintf'ed string
 */
 
+/* Most results are short; they are built on the stack and copied once to
+store of the exact size, rather than grown in store from a small start. */
+
+#define STRING_SPRINTF_INBUF_SIZE 256
+
 uschar *
 string_sprintf_trc(const char * format, const uschar * func, unsigned line, ...)
 {
@@ -717,7 +722,8 @@ gstring gs = { .size = STRING_SPRINTF_BUFFER_SIZE, .ptr = 0, .s = buffer };
 gstring * g = &gs;
 unsigned flags = 0;
 #else
-gstring * g = NULL;
+uschar buffer[STRING_SPRINTF_INBUF_SIZE];
+gstring gs, * g = gstring_in_buf(&gs, buffer, sizeof(buffer));
 unsigned flags = SVFMT_REBUFFER|SVFMT_EXTEND;
 #endif
 
@@ -736,8 +742,7 @@ if (!g)
 #ifdef COMPILE_UTILITY
 return string_copyn(g->s, g->ptr);
 #else
-gstring_release_unused(g);
-return string_from_gstring(g);
+return string_from_gstring_buf(g, buffer);
 #endif
 }
 
@@ -105,6 +105,14 @@ typedef struct rewrite_rule {
   uschar *replacement;
 } rewrite_rule;
 
+/* An event in the trace ring */
+
+typedef struct trace_rec {
+  uint64_t	ns;		/* when, in ns since the epoch */
+  unsigned	event;
+  int		arg[3];
+} trace_rec;
+
 /* This structure is used to pass back configuration data from the smtp
 transport to the outside world. It is used during callback processing. If ever
 another remote transport were implemented, it could use the same structure. */
@@ -185,6 +193,7 @@ typedef struct transport_instance {
   BOOL    overrides_hosts;        /* ) Used only for remote transports  */
   uschar *max_addresses;          /* )                                  */
   int     connection_max_messages;/* )                                  */
+  int     max_rcpt_parallel;      /* )                                  */
                                   /**************************************/
   BOOL    deliver_as_creator;     /* Used only by pipe at present */
   BOOL    disable_logging;        /* For very weird requirements */
@@ -196,6 +205,7 @@ typedef struct transport_instance {
   uschar *expand_uid;             /* Variable uid */
   uschar *expand_gid;             /* Variable gid */
   uschar *warn_message;           /* Used only by appendfile at present */
+  BOOL    deliver_in_process;     /* Used only by appendfile at present */
   uschar *shadow;                 /* Name of shadow transport */
   uschar *shadow_condition;       /* Condition for running it */
   uschar *filter_command;         /* For on-the-fly-filtering */
@@ -421,6 +431,7 @@ typedef struct auth_instance {
   uschar *mail_auth_condition;    /* Condition for AUTH on MAIL command */
   uschar *server_debug_string;    /* Debugging output */
   uschar *server_condition;       /* Authorization condition */
+  int     server_condition_cache; /* Life of a cached success */
   BOOL    client;                 /* TRUE if client option(s) set */
   BOOL    server;                 /* TRUE if server options(s) set */
   BOOL    advertised;             /* Set TRUE when advertised */
@@ -492,6 +503,7 @@ typedef struct retry_item {
 #define rf_delete   0x0001        /* retry info is to be deleted */
 #define rf_host     0x0002        /* retry info is for a remote host */
 #define rf_message  0x0004        /* retry info is for a host+message */
+#define rf_skipped  0x0008        /* retry time not reached; read only */
 
 /* Information about a constructed message that is to be sent using the
 autoreply transport. This is pointed to from the address block. */
@@ -549,6 +561,8 @@ typedef struct address_item {
   struct address_item *parent;    /* parent address */
   struct address_item *first;     /* points to first after group delivery */
   struct address_item *dupof;     /* points to address this is a duplicate of */
+  struct address_item *dups;      /* duplicates of this address, via dupnext */
+  struct address_item *dupnext;   /* next duplicate of the same address */
 
   router_instance *start_router;  /* generated address starts here */
   router_instance *router;        /* the router that routed */
@@ -707,6 +721,27 @@ typedef struct queue_filename {
   uschar text[1];
 } queue_filename;
 
+/* Read-only view of a spool header file, mapped into memory.  Only the fixed
+envelope lines are located when the view is opened; the rest of the file is
+found as needed.  The strings point into the mapping and are not terminated.
+For a binary format file the pointers are to records, all located on open. */
+
+typedef struct spool_view {
+  const uschar *	map;		/* the mapped -H file */
+  size_t		len;		/* its length */
+  BOOL			binary;		/* binary format */
+  const uschar *	login;		/* originator login */
+  int			login_len;
+  const uschar *	sender;		/* envelope sender, without the <> */
+  int			sender_len;
+  time_t		received_time;
+  const uschar *	opts;		/* first of the "-" option lines */
+  const uschar *	nonrcpts;	/* non-recipients tree, once located */
+  const uschar *	rcpts;		/* first recipient line, once located */
+  int			rcpt_count;
+  const uschar *	headers;	/* first header, once located */
+} spool_view;
+
 /* Chain of items of retry information, read from the retry config. */
 
 typedef struct retry_rule {
@@ -740,6 +775,18 @@ typedef struct tree_node {
   uschar  name[1];                /* node name - variable length */
 } tree_node;
 
+/* Structure for a hash set of tree_nodes, for large sets that are only
+searched by name.  The nodes are got in the same way as for a tree; the table
+is open-addressed and doubles in size as needed, in the current store pool
+(or in permanent store). */
+
+typedef struct hash_set {
+  tree_node **slot;               /* the table, NULL when empty */
+  unsigned size;                  /* number of slots, a power of two */
+  unsigned count;                 /* number of nodes */
+  BOOL    perm;                   /* table to be in permanent store */
+} hash_set;
+
 /* Structure for holding time-limited data such as DNS returns.
 We use this rather than extending tree_node to avoid wasting
 space for most tree use (variables...) at the cost of complexity
@@ -913,6 +960,7 @@ typedef struct namedlist_cacheblock {
 typedef struct namedlist_block {
   const uschar *string;			/* the list string */
   namedlist_cacheblock *cache_data;	/* cached domain_data or localpart_data */
+  struct mcl_list *compiled;		/* compiled form, see match.c */
   short		number;			/* the number of the list for caching */
   BOOL		hide;			/* -bP does not display value */
 } namedlist_block;
@@ -968,6 +1016,7 @@ typedef struct qrunner {
   time_t	next_tick;	/* next run should, or should have, start(ed) */
   unsigned	run_max;	/* concurrent queue runner limit */
   unsigned	run_count;	/* current runners */
+  unsigned	weight;		/* share of runners when competing */
 
   BOOL queue_run_force :1;
   BOOL deliver_force_thaw :1;
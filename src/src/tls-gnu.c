@@ -125,6 +125,10 @@ require current GnuTLS, then we'll drop support for the ancient libraries).
 #if GNUTLS_VERSION_NUMBER >= 0x030702
 # define HAVE_GNUTLS_EXPORTER
 #endif
+#if GNUTLS_VERSION_NUMBER >= 0x030703
+# define EXIM_HAVE_KTLS
+# include <gnutls/socket.h>
+#endif
 
 #ifndef DISABLE_OCSP
 # include <gnutls/ocsp.h>
@@ -498,6 +502,48 @@ tls_per_lib_daemon_tick(void)
 {
 }
 
+/* Milliseconds until the daemon next needs a tick; never, for GnuTLS */
+
+static int
+tls_per_lib_daemon_timeout(void)
+{
+return -1;
+}
+
+#ifdef EXIM_HAVE_TLS_RESUME
+/* With tls_resumption_secret set, make the ticket master key from it, so
+that every server given the same secret accepts the others' tickets. GnuTLS
+rotates the keys it uses from the master key by time, so the servers stay in
+step as long as their clocks do. Returns FALSE to have a random key. */
+
+static BOOL
+tls_resumption_sessticket_key(void)
+{
+const uschar * secret;
+
+if (!tls_resumption_secret) return FALSE;
+if (!(secret = expand_cstring(tls_resumption_secret)))
+  {
+  log_write(0, LOG_MAIN|LOG_PANIC, "expansion of tls_resumption_secret "
+    "failed: %s; using a local session ticket key", expand_string_message);
+  return FALSE;
+  }
+if (!*secret) return FALSE;
+
+server_sessticket_key.size = 64;
+server_sessticket_key.data = gnutls_malloc(server_sessticket_key.size);
+if (gnutls_hash_fast(GNUTLS_DIG_SHA512, secret, Ustrlen(secret),
+      server_sessticket_key.data) < 0)
+  {
+  gnutls_free(server_sessticket_key.data);
+  server_sessticket_key.data = NULL;
+  return FALSE;
+  }
+DEBUG(D_tls) debug_printf("GnuTLS: ticket key from tls_resumption_secret\n");
+return TRUE;
+}
+#endif
+
 /* Daemon one-time initialisation */
 
 static void
@@ -519,7 +565,8 @@ if (!once)
   the strength at least matches that of the ciphersuite (but GnuTLS does not
   document this). */
 
-  gnutls_session_ticket_key_generate(&server_sessticket_key);	/* >= 2.10.0 */
+  if (!tls_resumption_sessticket_key())
+    gnutls_session_ticket_key_generate(&server_sessticket_key);	/* >= 2.10.0 */
   if (f.running_in_test_harness) ssl_session_timeout = 6;
 #endif
 
@@ -3200,7 +3247,7 @@ extract_exim_vars_from_tls_state(state);
 /* TLS has been set up. Adjust the input functions to read via TLS,
 and initialize appropriately. */
 
-state->xfer_buffer = store_malloc(ssl_xfer_buffer_size);
+state->xfer_buffer = store_malloc(smtp_receive_buffer_size);
 
 receive_getc = tls_getc;
 receive_getbuf = tls_getbuf;
@@ -3307,8 +3354,8 @@ return TRUE;
 
 
 #ifdef EXIM_HAVE_TLS_RESUME
-/* On the client, get any stashed session for the given IP from hints db
-and apply it to the ssl-connection for attempted resumption.  Although
+/* On the client, get any stashed session for the given IP from the session
+store and apply it to the ssl-connection for attempted resumption.  Although
 there is a gnutls_session_ticket_enable_client() interface it is
 documented as unnecessary (as of 3.6.7) as "session tickets are emabled
 by deafult".  There seems to be no way to disable them, so even hosts not
@@ -3328,28 +3375,24 @@ else if (verify_check_given_host(CUSS &ob->tls_resumption_hosts, conn_args->host
   {
   dbdata_tls_session * dt;
   int len, rc;
-  open_db dbblock, * dbm_file;
 
   tlsp->host_resumable = TRUE;
   tls_client_resmption_key(tlsp, conn_args, ob);
 
   tlsp->resumption |= RESUME_CLIENT_REQUESTED;
-  if ((dbm_file = dbfn_open(US"tls", O_RDONLY, &dbblock, FALSE, FALSE)))
-    {
-    /* We'd like to filter the retrieved session for ticket advisory expiry,
-    but 3.6.1 seems to give no access to that */
 
-    if ((dt = dbfn_read_with_length(dbm_file, tlsp->resume_index, &len)))
-      if (!(rc = gnutls_session_set_data(session,
-		    CUS dt->session, (size_t)len - sizeof(dbdata_tls_session))))
-	{
-	DEBUG(D_tls) debug_printf("good session\n");
-	tlsp->resumption |= RESUME_CLIENT_SUGGESTED;
-	}
-      else DEBUG(D_tls) debug_printf("setting session resumption data: %s\n",
-	    US gnutls_strerror(rc));
-    dbfn_close(dbm_file);
-    }
+  /* We'd like to filter the retrieved session for ticket advisory expiry,
+  but 3.6.1 seems to give no access to that */
+
+  if ((dt = tls_session_read(tlsp->resume_index, &len)))
+    if (!(rc = gnutls_session_set_data(session,
+		  CUS dt->session, (size_t)len - sizeof(dbdata_tls_session))))
+      {
+      DEBUG(D_tls) debug_printf("good session\n");
+      tlsp->resumption |= RESUME_CLIENT_SUGGESTED;
+      }
+    else DEBUG(D_tls) debug_printf("setting session resumption data: %s\n",
+	  US gnutls_strerror(rc));
   }
 else DEBUG(D_tls) debug_printf("no resumption for this host\n");
 }
@@ -3375,7 +3418,6 @@ if (gnutls_session_get_flags(session) & GNUTLS_SFLAGS_SESSION_TICKET)
   if (tlsp->host_resumable)
     if (!(rc = gnutls_session_get_data2(session, &tkt)))
       {
-      open_db dbblock, * dbm_file;
       int dlen = sizeof(dbdata_tls_session) + tkt.size;
       dbdata_tls_session * dt = store_get(dlen, GET_TAINTED);
 
@@ -3383,15 +3425,8 @@ if (gnutls_session_get_flags(session) & GNUTLS_SFLAGS_SESSION_TICKET)
       memcpy(dt->session, tkt.data, tkt.size);
       gnutls_free(tkt.data);
 
-      if ((dbm_file = dbfn_open(US"tls", O_RDWR, &dbblock, FALSE, FALSE)))
-	{
-	/* key for the db is the IP */
-	dbfn_write(dbm_file, tlsp->resume_index, dt, dlen);
-	dbfn_close(dbm_file);
-
-	DEBUG(D_tls)
-	  debug_printf(" wrote session db (len %u)\n", (unsigned)dlen);
-	}
+      /* No lifetime is available, so the store's own limit applies */
+      tls_session_write(tlsp->resume_index, dt, dlen, 0);
       }
     else
       { DEBUG(D_tls)
@@ -3850,7 +3885,7 @@ exim_gnutls_state_st * state = &state_server;
 ssize_t inbytes;
 
 DEBUG(D_tls) debug_printf("Calling gnutls_record_recv(session=%p, buffer=%p, buffersize=%u)\n",
-  state->session, state->xfer_buffer, ssl_xfer_buffer_size);
+  state->session, state->xfer_buffer, smtp_receive_buffer_size);
 
 sigalrm_seen = FALSE;
 if (smtp_receive_timeout > 0) ALARM(smtp_receive_timeout);
@@ -3858,7 +3893,7 @@ if (smtp_receive_timeout > 0) ALARM(smtp_receive_timeout);
 errno = 0;
 do
   inbytes = gnutls_record_recv(state->session, state->xfer_buffer,
-    MIN(ssl_xfer_buffer_size, lim));
+    MIN(smtp_receive_buffer_size, lim));
 while (inbytes == GNUTLS_E_AGAIN);
 
 if (smtp_receive_timeout > 0) ALARM_CLR(0);
@@ -3942,6 +3977,16 @@ exim_gnutls_state_st * state = &state_server;
 return state->xfer_buffer_lwm < state->xfer_buffer_hwm;
 }
 
+/* Look at the buffered input without taking it */
+
+const uschar *
+tls_peekbuf(unsigned * len)
+{
+exim_gnutls_state_st * state = &state_server;
+*len = state->xfer_buffer_hwm - state->xfer_buffer_lwm;
+return &state->xfer_buffer[state->xfer_buffer_lwm];
+}
+
 uschar *
 tls_getbuf(unsigned * len)
 {
@@ -4164,6 +4209,75 @@ return (int) len;
 
 
 
+/*************************************************
+*        Send file data down TLS channel         *
+*************************************************/
+
+/* When the kernel does the encryption for transmit (kTLS, which GnuTLS uses if
+its system configuration says so) data can be sent directly from the spool
+file.
+
+Arguments:
+  ct_ctx    client context pointer, or NULL for the one global server context
+
+Returns:    TRUE if tls_sendfile() can be used
+*/
+
+BOOL
+tls_can_sendfile(void * ct_ctx)
+{
+#ifdef EXIM_HAVE_KTLS
+exim_gnutls_state_st * state = ct_ctx ? ct_ctx : &state_server;
+
+return state->session
+  && gnutls_transport_is_ktls_enabled(state->session) & GNUTLS_KTLS_SEND;
+#else
+return FALSE;
+#endif
+}
+
+
+/*
+Arguments:
+  ct_ctx    client context pointer, or NULL for the one global server context
+  fd        file to send from
+  offset    where in the file to start; updated
+  len       number of bytes
+
+Returns:    the number of bytes sent, or -1 after a failure
+*/
+
+ssize_t
+tls_sendfile(void * ct_ctx, int fd, off_t * offset, size_t len)
+{
+#ifdef EXIM_HAVE_KTLS
+exim_gnutls_state_st * state = ct_ctx ? ct_ctx : &state_server;
+ssize_t sent;
+
+if (tls_write(ct_ctx, NULL, 0, FALSE) < 0)	/* uncork */
+  return -1;
+
+DEBUG(D_tls)
+  debug_printf("gnutls_record_send_file(session=%p, fd=%d, len=" SIZE_T_FMT ")\n",
+    state->session, fd, len);
+do
+  sent = gnutls_record_send_file(state->session, fd, offset, len);
+while (sent == GNUTLS_E_AGAIN);
+
+if (sent < 0)
+  {
+  record_io_error(state, (int)sent, US"send", NULL);
+  return -1;
+  }
+return sent;
+#else
+return -1;
+#endif
+}
+
+
+
+
 /*************************************************
 *            Random number generation            *
 *************************************************/
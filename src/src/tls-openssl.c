@@ -35,6 +35,10 @@ functions from the OpenSSL library. */
 #endif
 
 
+#if defined(SSL_MODE_ASYNC) && !defined(OPENSSL_NO_ASYNC)
+# define EXIM_HAVE_OPENSSL_ASYNC
+#endif
+
 #ifndef DISABLE_OCSP
 # define EXIM_OCSP_SKEW_SECONDS (300L)
 # define EXIM_OCSP_MAX_AGE (-1L)
@@ -101,6 +105,7 @@ change this guard and punt the issue for a while longer. */
 #if !defined(LIBRESSL_VERSION_NUMBER) && (OPENSSL_VERSION_NUMBER >= 0x030000000L)
 # define EXIM_HAVE_EXPORT_CHNL_BNGNG
 # define EXIM_HAVE_OPENSSL_X509_STORE_GET1_ALL_CERTS
+# define EXIM_HAVE_KTLS
 #endif
 
 #if !defined(LIBRESSL_VERSION_NUMBER) \
@@ -197,6 +202,9 @@ static exim_openssl_option exim_openssl_options[] = {
 #ifdef SSL_OP_DONT_INSERT_EMPTY_FRAGMENTS
   { US"dont_insert_empty_fragments", SSL_OP_DONT_INSERT_EMPTY_FRAGMENTS },
 #endif
+#ifdef SSL_OP_ENABLE_KTLS
+  { US"enable_ktls", SSL_OP_ENABLE_KTLS },
+#endif
 #ifdef SSL_OP_ENABLE_MIDDLEBOX_COMPAT
   { US"enable_middlebox_compat", SSL_OP_ENABLE_MIDDLEBOX_COMPAT },
 #endif
@@ -399,6 +407,12 @@ static BOOL server_verify_optional = FALSE;
 
 static BOOL reexpand_tls_files_for_sni = FALSE;
 
+#ifdef EXIM_HAVE_OPENSSL_TLSEXT
+/* Contexts made by the daemon for the names in tls_sni_preload, keyed by the
+lowercased name, and inherited by the processes it forks */
+static hash_set server_sni_preloaded = {.perm = TRUE};
+#endif
+
 
 typedef struct ocsp_resp {
   struct ocsp_resp *	next;
@@ -449,6 +463,10 @@ exim_openssl_state_st state_server = {.is_server = TRUE};
 static int
 setup_certs(SSL_CTX * sctx, uschar ** certs, uschar * crl, host_item * host,
     uschar ** errstr);
+#if defined(EXIM_HAVE_OPENSSL_TLSEXT) \
+    && (defined(EXIM_HAVE_INOTIFY) || defined(EXIM_HAVE_KEVENT))
+static void tls_server_sni_preload(void);
+#endif
 
 /* Callbacks */
 #ifndef DISABLE_OCSP
@@ -464,6 +482,10 @@ static void x509_store_dump_cert_s_names(X509_STORE * store);
 static void tk_init(void);
 static int tls_exdata_idx = -1;
 #endif
+#ifndef DISABLE_OCSP
+static void ocsp_refresh_tick(void);
+static int ocsp_refresh_timeout(void);
+#endif
 
 static void
 tls_per_lib_daemon_tick(void)
@@ -471,6 +493,21 @@ tls_per_lib_daemon_tick(void)
 #ifndef DISABLE_TLS_RESUME
 tk_init();
 #endif
+#ifndef DISABLE_OCSP
+ocsp_refresh_tick();
+#endif
+}
+
+/* Milliseconds until the daemon next needs a tick, or -1 */
+
+static int
+tls_per_lib_daemon_timeout(void)
+{
+#ifndef DISABLE_OCSP
+return ocsp_refresh_timeout();
+#else
+return -1;
+#endif
 }
 
 /* Called once at daemon startup */
@@ -564,6 +601,49 @@ EVP_add_digest(EVP_sha256());
 
 
 
+/*************************************************
+*        Wait for an offloaded crypto job        *
+*************************************************/
+
+/* With openssl_async set, a handshake, read or write can pause while an
+engine works on its crypto: OpenSSL returns SSL_ERROR_WANT_ASYNC, and the call
+is to be made again once the job's descriptors are readable. Wait for that,
+under any timeout already running.
+
+Arguments:
+  ssl       the connection
+  rc        the return from the call
+
+Returns:    TRUE if the call should be made again
+*/
+
+static BOOL
+tls_async_retry(SSL * ssl, int rc)
+{
+#ifdef EXIM_HAVE_OPENSSL_ASYNC
+OSSL_ASYNC_FD fds[8];
+struct pollfd p[nelem(fds)];
+size_t nfds = 0;
+
+if (rc > 0 || SSL_get_error(ssl, rc) != SSL_ERROR_WANT_ASYNC) return FALSE;
+if (!SSL_get_all_async_fds(ssl, NULL, &nfds)) return FALSE;
+if (nfds == 0 || nfds > nelem(fds)) return TRUE;	/* nothing to wait on */
+(void) SSL_get_all_async_fds(ssl, fds, &nfds);
+
+DEBUG(D_tls) debug_printf("waiting on %u async fd%s\n",
+  (unsigned)nfds, nfds == 1 ? "" : "s");
+for (int i = 0; i < nfds; i++)
+  { p[i].fd = fds[i]; p[i].events = POLLIN; }
+if (poll(p, nfds, -1) >= 0) return TRUE;
+return errno == EINTR
+  && !sigalrm_seen && !had_command_timeout && !had_data_timeout;
+#else
+return FALSE;
+#endif
+}
+
+
+
 /*************************************************
 *                Initialize for DH               *
 *************************************************/
@@ -1530,6 +1610,252 @@ for (ocsp_resplist * olist = state->u_ocsp.server.olist; olist;
   OCSP_RESPONSE_free(olist->resp);
 state->u_ocsp.server.olist = NULL;
 }
+
+
+
+/*************************************************
+*      Fetch OCSP responses, in the daemon       *
+*************************************************/
+
+/* With tls_ocsp_refresh set and the server creds preloaded, the daemon forks a
+process every that often to get a fresh response for each certificate from the
+responder it names, and writes it to the matching tls_ocsp_file once it has
+checked it.  The file watch then has the daemon reload the creds, so each
+connection copies the parsed responses rather than reading the files. */
+
+static time_t ocsp_refresh_next = 0;
+
+static BOOL
+ocsp_refresh_wanted(void)
+{
+return tls_ocsp_refresh > 0 && tls_ocsp_file && *tls_ocsp_file
+  && state_server.lib_state.conn_certs;
+}
+
+
+/* Send an OCSP request over HTTP and read the response.
+
+Arguments:
+  host, port, path  from the responder URL
+  req               the request
+
+Returns:            the response, or NULL
+*/
+
+static OCSP_RESPONSE *
+ocsp_http_post(const char * host, const char * port, const char * path,
+  OCSP_REQUEST * req, const uschar ** errp)
+{
+BIO * bio;
+uschar * der = NULL, * body;
+const uschar * p;
+int dlen, n;
+gstring * g = NULL;
+OCSP_RESPONSE * resp = NULL;
+
+if ((dlen = i2d_OCSP_REQUEST(req, &der)) <= 0)
+  { *errp = US"failed to encode request"; return NULL; }
+
+if (  !(bio = BIO_new_connect(CCS string_sprintf("%s:%s", host, port)))
+   || BIO_do_connect(bio) <= 0)
+  {
+  *errp = string_sprintf("failed to connect to %s:%s", host, port);
+  goto out;
+  }
+
+if (  BIO_printf(bio, "POST %s HTTP/1.0\r\nHost: %s\r\n"
+		  "Content-Type: application/ocsp-request\r\n"
+		  "Content-Length: %d\r\n\r\n", path, host, dlen) <= 0
+   || BIO_write(bio, der, dlen) != dlen
+   || BIO_flush(bio) <= 0)
+  {
+  *errp = US"failed to send request";
+  goto out;
+  }
+
+while (  (n = BIO_read(bio, big_buffer, big_buffer_size)) > 0
+      && (g = string_catn(g, big_buffer, n))->ptr < 65536) ;
+
+if (  !g
+   || !(p = Ustrstr(string_from_gstring(g), "\r\n\r\n"))
+   || Ustrncmp(g->s, "HTTP/1.", 7) != 0 || Ustrncmp(g->s + 8, " 200", 4) != 0)
+  {
+  *errp = US"no good HTTP response";
+  goto out;
+  }
+p += 4;
+body = US p;
+if (!(resp = d2i_OCSP_RESPONSE(NULL, CUSS &p, g->ptr - (body - g->s))))
+  *errp = US"failed to parse response";
+
+out:
+  if (bio) BIO_free_all(bio);
+  OPENSSL_free(der);
+  return resp;
+}
+
+
+/* Get, check and save the OCSP response for one certificate.  The certificate
+file must contain the issuer's certificate as the second in the chain.
+
+Arguments:
+  cfile      the certificate file
+  ofile      the response file
+  is_pem     write the response in PEM rather than DER
+*/
+
+static void
+ocsp_refresh_one(const uschar * cfile, const uschar * ofile, BOOL is_pem)
+{
+BIO * bio;
+X509 * x, * cert, * issuer;
+STACK_OF(X509) * chain = sk_X509_new_null();
+STACK_OF(OPENSSL_STRING) * urls = NULL;
+X509_STORE * store = NULL;
+OCSP_REQUEST * req = NULL;
+OCSP_RESPONSE * resp = NULL;
+OCSP_BASICRESP * basic = NULL;
+OCSP_CERTID * id = NULL, * cid = NULL;
+ASN1_GENERALIZEDTIME * rev, * thisupd, * nextupd;
+char * host = NULL, * port = NULL, * path = NULL;
+int use_ssl, status, reason;
+const uschar * err = NULL;
+uschar * tmpfile;
+
+if (!(bio = BIO_new_file(CCS cfile, "r")))
+  { err = US"cannot read certificate file"; goto out; }
+while ((x = PEM_read_bio_X509(bio, NULL, NULL, NULL)))
+  sk_X509_push(chain, x);
+ERR_clear_error();
+BIO_free(bio);
+
+if (sk_X509_num(chain) < 2)
+  { err = US"no issuer certificate in the file"; goto out; }
+cert = sk_X509_value(chain, 0);
+issuer = sk_X509_value(chain, 1);
+
+if (!(urls = X509_get1_ocsp(cert)) || sk_OPENSSL_STRING_num(urls) < 1)
+  { err = US"certificate names no OCSP responder"; goto out; }
+if (  !OCSP_parse_url(sk_OPENSSL_STRING_value(urls, 0),
+		      &host, &port, &path, &use_ssl)
+   || use_ssl)
+  { err = US"unusable OCSP responder URL"; goto out; }
+
+if (  !(req = OCSP_REQUEST_new())
+   || !(id = OCSP_cert_to_id(NULL, cert, issuer))
+   || !(cid = OCSP_CERTID_dup(id))
+   || !OCSP_request_add0_id(req, id))
+  { err = US"failed to build request"; goto out; }
+id = NULL;				/* now owned by the request */
+
+DEBUG(D_tls) debug_printf("OCSP refresh: asking %s for %s\n",
+  sk_OPENSSL_STRING_value(urls, 0), cfile);
+if (!(resp = ocsp_http_post(host, port, path, req, &err)))
+  goto out;
+
+/* Check it the same way the loader will, and that it is signed by the
+issuer or by a responder the issuer delegated to */
+
+if (OCSP_response_status(resp) != OCSP_RESPONSE_STATUS_SUCCESSFUL)
+  { err = US OCSP_response_status_str(OCSP_response_status(resp)); goto out; }
+if (!(basic = OCSP_response_get1_basic(resp)))
+  { err = US"no basic response"; goto out; }
+
+if (  !(store = X509_STORE_new())
+   || !X509_STORE_add_cert(store, issuer)
+   || !X509_STORE_set_flags(store, X509_V_FLAG_PARTIAL_CHAIN)
+   || OCSP_basic_verify(basic, chain, store, 0) <= 0)
+  { err = US"response signature does not verify"; goto out; }
+
+if (!OCSP_resp_find_status(basic, cid, &status, &reason, &rev,
+			    &thisupd, &nextupd))
+  { err = US"response is not for the certificate"; goto out; }
+if (status != V_OCSP_CERTSTATUS_GOOD)
+  { err = US OCSP_cert_status_str(status); goto out; }
+if (!OCSP_check_validity(thisupd, nextupd, EXIM_OCSP_SKEW_SECONDS,
+			  EXIM_OCSP_MAX_AGE))
+  { err = US"response times are invalid"; goto out; }
+
+/* Replace the file in one step, for the watch to see */
+
+tmpfile = string_sprintf("%s.tmp", ofile);
+if (  !(bio = BIO_new_file(CCS tmpfile, "wb"))
+   || !(is_pem
+       ? PEM_write_bio_OCSP_RESPONSE(bio, resp)
+       : i2d_OCSP_RESPONSE_bio(bio, resp)))
+  err = US"failed to write response";
+if (bio) BIO_free(bio);
+if (!err && Urename(tmpfile, ofile) < 0)
+  err = string_sprintf("rename: %s", strerror(errno));
+if (err) Uunlink(tmpfile);
+
+out:
+  if (err)
+    log_write(0, LOG_MAIN, "OCSP refresh for %s failed: %s", cfile, err);
+  else
+    DEBUG(D_tls) debug_printf("OCSP refresh: wrote %s\n", ofile);
+
+  OCSP_BASICRESP_free(basic);
+  OCSP_RESPONSE_free(resp);
+  OCSP_REQUEST_free(req);
+  OCSP_CERTID_free(id);
+  OCSP_CERTID_free(cid);
+  X509_STORE_free(store);
+  OPENSSL_free(host);
+  OPENSSL_free(port);
+  OPENSSL_free(path);
+  X509_email_free(urls);
+  sk_X509_pop_free(chain, X509_free);
+}
+
+
+/* Called every time round the daemon loop.  The fetching process pairs the
+certificate and response file lists as the loader does, and is killed if the
+responders are too slow. */
+
+static void
+ocsp_refresh_tick(void)
+{
+time_t now = time(NULL);
+pid_t pid;
+
+if (!ocsp_refresh_wanted() || now < ocsp_refresh_next) return;
+ocsp_refresh_next = now + tls_ocsp_refresh;
+
+if ((pid = exim_fork(US"OCSP-refresh")) < 0)
+  log_write(0, LOG_MAIN, "OCSP refresh: fork failed: %s", strerror(errno));
+else if (pid == 0)
+  {
+  const uschar * clist = tls_certificate, * olist = tls_ocsp_file;
+  uschar * cfile, * ofile;
+  int csep = 0, osep = 0;
+  BOOL is_pem = FALSE;
+
+  signal(SIGALRM, SIG_DFL);
+  ALARM(300);
+  while (  (cfile = string_nextinlist(&clist, &csep, NULL, 0))
+	&& (ofile = string_nextinlist(&olist, &osep, NULL, 0)))
+    {
+    if (Ustrncmp(ofile, US"PEM ", 4) == 0)
+      { is_pem = TRUE; ofile += 4; }
+    else if (Ustrncmp(ofile, US"DER ", 4) == 0)
+      { is_pem = FALSE; ofile += 4; }
+    ocsp_refresh_one(cfile, ofile, is_pem);
+    }
+  exim_underbar_exit(EXIT_SUCCESS);
+  }
+}
+
+static int
+ocsp_refresh_timeout(void)
+{
+time_t now;
+
+if (!ocsp_refresh_wanted()) return -1;
+now = time(NULL);
+return ocsp_refresh_next <= now ? 0
+  : (int) MIN(ocsp_refresh_next - now, 86400) * 1000;
+}
 #endif	/*!DISABLE_OCSP*/
 
 
@@ -1767,6 +2093,11 @@ DEBUG(D_tls)
 
 /* Automatically re-try reads/writes after renegotiation. */
 (void) SSL_CTX_set_mode(ctx, SSL_MODE_AUTO_RETRY);
+#ifdef EXIM_HAVE_OPENSSL_ASYNC
+/* Let the crypto run as ASYNC jobs, for an engine or provider that can
+offload it; see tls_async_retry() */
+if (openssl_async) (void) SSL_CTX_set_mode(ctx, SSL_MODE_ASYNC);
+#endif
 *ctxp = ctx;
 return OK;
 }
@@ -1890,6 +2221,11 @@ if (opt_set_and_noexpand(tls_require_ciphers))
   }
 else
   DEBUG(D_tls) debug_printf("TLS: not preloading cipher list for server\n");
+
+#if defined(EXIM_HAVE_OPENSSL_TLSEXT) \
+    && (defined(EXIM_HAVE_INOTIFY) || defined(EXIM_HAVE_KEVENT))
+tls_server_sni_preload();
+#endif
 return lifetime;
 }
 
@@ -1977,11 +2313,23 @@ else
 /* Invalidate the creds cached, by dropping the current ones.
 Call when we notice one of the source files has changed. */
 
+# ifdef EXIM_HAVE_OPENSSL_TLSEXT
+static void
+server_sni_ctx_free(uschar * name, uschar * ctx, void * arg)
+{
+SSL_CTX_free((SSL_CTX *)ctx);
+}
+# endif
+
 static void
 tls_server_creds_invalidate(void)
 {
 SSL_CTX_free(state_server.lib_state.lib_ctx);
 state_server.lib_state = null_tls_preload;
+# ifdef EXIM_HAVE_OPENSSL_TLSEXT
+hset_walk(&server_sni_preloaded, server_sni_ctx_free, NULL);
+hset_clear(&server_sni_preloaded);	/* the table is left in perm store */
+# endif
 #ifndef DISABLE_OCSP
 state_server.u_ocsp.server.file_expanded = NULL;
 #endif
@@ -2078,20 +2426,97 @@ typedef struct {			/* Session ticket encryption key */
 
 static exim_stek exim_tk;	/* current key */
 static exim_stek exim_tk_old;	/* previous key */
+static time_t exim_tk_period = -1;	/* of the keys from tls_resumption_secret */
+
+
+/* With tls_resumption_secret set, the keys come from it rather than from
+random, so that every server given the same secret makes the same keys and a
+ticket issued by one can be used with any. Time is cut into periods of the
+ticket lifetime; the key for a period is derived from the secret and the
+period number, issues tickets during its period and is accepted during the
+next one as the previous key. */
+
+static void
+tk_derive(exim_stek * key, const uschar * secret, time_t period)
+{
+static const struct { const char * label; size_t off, len; } parts[] = {
+  { "name", offsetof(exim_stek, name), sizeof(key->name) },
+  { "aes",  offsetof(exim_stek, aes_key), sizeof(key->aes_key) },
+  { "hmac", offsetof(exim_stek, hmac_key), sizeof(key->hmac_key) }
+};
+uschar pbuf[8];
+
+for (int i = 0; i < 8; i++) pbuf[i] = (uschar)((uint64_t)period >> (56 - 8*i));
+for (int i = 0; i < nelem(parts); i++)
+  {
+  gstring * g = string_catn(NULL, US parts[i].label, strlen(parts[i].label) + 1);
+  uschar md[EVP_MAX_MD_SIZE];
+  unsigned mdlen;
+
+  g = string_catn(g, pbuf, sizeof(pbuf));
+  g = string_cat(g, secret);
+  (void) EVP_Digest(g->s, g->ptr, md, &mdlen, EVP_sha256(), NULL);
+  memcpy(US key + parts[i].off, md, parts[i].len);
+  memset(g->s, 0, g->ptr);
+  memset(md, 0, sizeof(md));
+  }
+
+key->name[0] = 'S';
+key->aes_cipher = EVP_aes_256_cbc();
+# if OPENSSL_VERSION_NUMBER < 0x30000000L
+key->hmac_hash = EVP_sha256();
+# else
+key->hmac_hashname = US "sha256";
+# endif
+key->renew = (period + 1) * ssl_session_timeout;
+key->expire = (period + 2) * ssl_session_timeout;
+}
+
+/* Set up the keys from tls_resumption_secret, if they are not already the
+ones for this period. Returns FALSE if random keys should be used instead. */
+
+static BOOL
+tk_shared(time_t t)
+{
+time_t period = t / ssl_session_timeout;
+const uschar * secret;
+
+if (period == exim_tk_period) return exim_tk.name[0] == 'S';
+exim_tk_period = period;
+
+if (!(secret = expand_cstring(tls_resumption_secret)))
+  {
+  log_write(0, LOG_MAIN|LOG_PANIC, "expansion of tls_resumption_secret "
+    "failed: %s; using local session ticket keys", expand_string_message);
+  log_close_all();
+  return FALSE;
+  }
+if (!*secret) return FALSE;
+
+DEBUG(D_tls) debug_printf("OpenSSL: STEK from tls_resumption_secret, period "
+  TIME_T_FMT "\n", period);
+tk_derive(&exim_tk, secret, period);
+tk_derive(&exim_tk_old, secret, period - 1);
+return TRUE;
+}
+
 
 static void
 tk_init(void)
 {
 time_t t = time(NULL);
 
-if (exim_tk.name[0])
+if (f.running_in_test_harness) ssl_session_timeout = TESTSUITE_TICKET_LIFE;
+if (tls_resumption_secret && tk_shared(t)) return;
+
+if (exim_tk.name[0] == 'S')		/* secret no longer usable */
+  exim_tk.name[0] = exim_tk_old.name[0] = 0;
+else if (exim_tk.name[0])
   {
   if (exim_tk.renew >= t) return;
   exim_tk_old = exim_tk;
   }
 
-if (f.running_in_test_harness) ssl_session_timeout = TESTSUITE_TICKET_LIFE;
-
 DEBUG(D_tls) debug_printf("OpenSSL: %s STEK\n", exim_tk.name[0] ? "rotating" : "creating");
 if (RAND_bytes(exim_tk.aes_key, sizeof(exim_tk.aes_key)) <= 0) return;
 if (RAND_bytes(exim_tk.hmac_key, sizeof(exim_tk.hmac_key)) <= 0) return;
@@ -2256,83 +2681,124 @@ per https://www.openssl.org/docs/manmaster/man3/SSL_client_hello_cb_fn.html
 */
 
 #ifdef EXIM_HAVE_OPENSSL_TLSEXT
-static int
-tls_servername_cb(SSL * s, int * ad ARG_UNUSED, void * arg)
+
+/* Copy the settings of the initial context to one for SNI.  Not sure how many
+of these are actually needed, since SSL object already exists.  Might even need
+this selfsame callback, for reneg? */
+
+static int tls_servername_cb(SSL * s, int * ad, void * arg);
+
+static void
+server_sni_ctx_settings(SSL_CTX * sni_ctx, exim_openssl_state_st * state)
 {
-const char * servername = SSL_get_servername(s, TLSEXT_NAMETYPE_host_name);
-exim_openssl_state_st * state = (exim_openssl_state_st *) arg;
-int rc;
-int old_pool = store_pool;
-uschar * errstr;
+SSL_CTX * ctx = state_server.lib_state.lib_ctx;
 
-if (!servername)
-  return SSL_TLSEXT_ERR_OK;
+SSL_CTX_set_info_callback(sni_ctx, SSL_CTX_get_info_callback(ctx));
+SSL_CTX_set_mode(sni_ctx, SSL_CTX_get_mode(ctx));
+#ifdef OPENSSL_MIN_PROTO_VERSION
+SSL_CTX_set_min_proto_version(sni_ctx, SSL3_VERSION);
+#endif
+SSL_CTX_set_options(sni_ctx, SSL_CTX_get_options(ctx));
+SSL_CTX_clear_options(sni_ctx, ~SSL_CTX_get_options(ctx));
+SSL_CTX_set_timeout(sni_ctx, SSL_CTX_get_timeout(ctx));
+SSL_CTX_set_tlsext_servername_callback(sni_ctx, tls_servername_cb);
+SSL_CTX_set_tlsext_servername_arg(sni_ctx, state);
+}
 
-DEBUG(D_tls) debug_printf("Received TLS SNI \"%s\"%s\n", servername,
-    reexpand_tls_files_for_sni ? "" : " (unused for certificate selection)");
 
-/* Make the extension value available for expansion */
-store_pool = POOL_PERM;
-tls_in.sni = string_copy_taint(US servername, GET_TAINTED);
-store_pool = old_pool;
+/* Make a context for the current $tls_in_sni, re-expanding the certificate
+and key options.
 
-if (!reexpand_tls_files_for_sni)
-  return SSL_TLSEXT_ERR_OK;
+Arguments:
+  state           the server state
+  ctxp            where to put the context
+  errstr          where to put an error message
+
+Returns:          OK, or an error code
+*/
+
+static int
+server_sni_ctx_new(exim_openssl_state_st * state, SSL_CTX ** ctxp,
+  uschar ** errstr)
+{
+SSL_CTX * sni_ctx;
+int rc;
 
 /* Can't find an SSL_CTX_clone() or equivalent, so we do it manually;
 not confident that memcpy wouldn't break some internal reference counting.
 Especially since there's a references struct member, which would be off. */
 
-if (lib_ctx_new(&server_sni, NULL, &errstr) != OK)
-  goto bad;
-
-/* Not sure how many of these are actually needed, since SSL object
-already exists.  Might even need this selfsame callback, for reneg? */
-
- {
-  SSL_CTX * ctx = state_server.lib_state.lib_ctx;
-  SSL_CTX_set_info_callback(server_sni, SSL_CTX_get_info_callback(ctx));
-  SSL_CTX_set_mode(server_sni, SSL_CTX_get_mode(ctx));
-#ifdef OPENSSL_MIN_PROTO_VERSION
-  SSL_CTX_set_min_proto_version(server_sni, SSL3_VERSION);
-#endif
-  SSL_CTX_set_options(server_sni, SSL_CTX_get_options(ctx));
-  SSL_CTX_clear_options(server_sni, ~SSL_CTX_get_options(ctx));
-  SSL_CTX_set_timeout(server_sni, SSL_CTX_get_timeout(ctx));
-  SSL_CTX_set_tlsext_servername_callback(server_sni, tls_servername_cb);
-  SSL_CTX_set_tlsext_servername_arg(server_sni, state);
- }
+if ((rc = lib_ctx_new(ctxp, NULL, errstr)) != OK)
+  return rc;
+sni_ctx = *ctxp;
+server_sni_ctx_settings(sni_ctx, state);
 
-if (  !init_dh(server_sni, state->dhparam, &errstr)
-   || !init_ecdh(server_sni, &errstr)
+if (  !init_dh(sni_ctx, state->dhparam, errstr)
+   || !init_ecdh(sni_ctx, errstr)
    )
-  goto bad;
+  return DEFER;
 
 if (  state->server_cipher_list
-   && !SSL_CTX_set_cipher_list(server_sni, CS state->server_cipher_list))
-  goto bad;
+   && !SSL_CTX_set_cipher_list(sni_ctx, CS state->server_cipher_list))
+  return tls_error(US"SSL_CTX_set_cipher_list", NULL, NULL, errstr);
 
 #ifndef DISABLE_OCSP
 if (state->u_ocsp.server.file)
   {
-  SSL_CTX_set_tlsext_status_cb(server_sni, tls_server_stapling_cb);
-  SSL_CTX_set_tlsext_status_arg(server_sni, state);
+  SSL_CTX_set_tlsext_status_cb(sni_ctx, tls_server_stapling_cb);
+  SSL_CTX_set_tlsext_status_arg(sni_ctx, state);
   }
 #endif
 
   {
   uschar * v_certs = tls_verify_certificates;
-  if ((rc = setup_certs(server_sni, &v_certs, tls_crl, NULL,
-			&errstr)) != OK)
-    goto bad;
+  if ((rc = setup_certs(sni_ctx, &v_certs, tls_crl, NULL, errstr)) != OK)
+    return rc;
 
   if (v_certs && *v_certs)
-    setup_cert_verify(server_sni, FALSE, verify_callback_server);
+    setup_cert_verify(sni_ctx, FALSE, verify_callback_server);
   }
 
 /* do this after setup_certs, because this can require the certs for verifying
 OCSP information. */
-if ((rc = tls_expand_session_files(server_sni, state, &errstr)) != OK)
+return tls_expand_session_files(sni_ctx, state, errstr);
+}
+
+
+static int
+tls_servername_cb(SSL * s, int * ad ARG_UNUSED, void * arg)
+{
+const char * servername = SSL_get_servername(s, TLSEXT_NAMETYPE_host_name);
+exim_openssl_state_st * state = (exim_openssl_state_st *) arg;
+int old_pool = store_pool;
+tree_node * node;
+uschar * errstr;
+
+if (!servername)
+  return SSL_TLSEXT_ERR_OK;
+
+DEBUG(D_tls) debug_printf("Received TLS SNI \"%s\"%s\n", servername,
+    reexpand_tls_files_for_sni ? "" : " (unused for certificate selection)");
+
+/* Make the extension value available for expansion */
+store_pool = POOL_PERM;
+tls_in.sni = string_copy_taint(US servername, GET_TAINTED);
+store_pool = old_pool;
+
+if (!reexpand_tls_files_for_sni)
+  return SSL_TLSEXT_ERR_OK;
+
+/* Use a context made by the daemon for this name, if there is one */
+
+if ((node = hset_search(&server_sni_preloaded, string_copylc(tls_in.sni))))
+  {
+  DEBUG(D_tls) debug_printf("Switching to preloaded SSL context.\n");
+  server_sni_ctx_settings(node->data.ptr, state);
+  SSL_set_SSL_CTX(s, node->data.ptr);
+  return SSL_TLSEXT_ERR_OK;
+  }
+
+if (server_sni_ctx_new(state, &server_sni, &errstr) != OK)
   goto bad;
 
 DEBUG(D_tls) debug_printf("Switching SSL context.\n");
@@ -2343,6 +2809,92 @@ bad:
   log_write(0, LOG_MAIN|LOG_PANIC, "%s", errstr);
   return SSL_TLSEXT_ERR_ALERT_FATAL;
 }
+
+
+# if defined(EXIM_HAVE_INOTIFY) || defined(EXIM_HAVE_KEVENT)
+/* Called in the daemon, after the other server creds are preloaded.  For a
+tls_certificate that depends on the SNI, make a context for each of the names
+listed by tls_sni_preload, so that a connection using one of them need only
+switch to it.  This is done only when everything else that goes into such a
+context was preloaded, as the context is used unchanged; and not with OCSP,
+whose responses are per-connection.  The certificate and key files are
+watched like the others, so a change to one rebuilds them all. */
+
+static void
+tls_server_sni_preload(void)
+{
+const uschar * list;
+uschar * name, * errstr;
+int sep = 0, count = 0;
+
+if (  !tls_sni_preload || !tls_certificate
+   || !Ustrstr(tls_certificate, US"tls_sni")
+      && !Ustrstr(tls_certificate, US"tls_in_sni"))
+  return;
+
+if (  !state_server.lib_state.dh || !state_server.lib_state.ecdh
+   || tls_require_ciphers && !state_server.lib_state.pri_string
+   || tls_verify_certificates && !state_server.lib_state.cabundle
+# ifndef DISABLE_OCSP
+   || tls_ocsp_file
+# endif
+   )
+  {
+  DEBUG(D_tls) debug_printf("TLS: not preloading SNI contexts:"
+    " other server creds are not fixed\n");
+  return;
+  }
+
+if (!(list = expand_cstring(tls_sni_preload)))
+  {
+  log_write(0, LOG_MAIN|LOG_PANIC, "failed to expand tls_sni_preload: %s",
+    expand_string_message);
+  return;
+  }
+
+state_server.certificate = tls_certificate;
+state_server.privatekey = tls_privatekey;
+state_server.dhparam = tls_dhparam;
+# ifndef DISABLE_OCSP
+state_server.u_ocsp.server.file = NULL;
+# endif
+
+while ((name = string_nextinlist(&list, &sep, NULL, 0)))
+  {
+  rmark reset_point = store_mark();
+  uschar * files;
+  SSL_CTX * ctx;
+  tree_node * node;
+
+  name = string_copylc(name);
+  tls_in.sni = string_copy_taint(name, GET_TAINTED);
+  errstr = US"failed to watch the files";
+
+  if (  !(files = expand_string(tls_certificate)) || !tls_set_watch(files, TRUE)
+     || tls_privatekey
+	&& (!(files = expand_string(tls_privatekey)) || !tls_set_watch(files, TRUE))
+     || server_sni_ctx_new(&state_server, &ctx, &errstr) != OK)
+    {
+    log_write(0, LOG_MAIN, "TLS: not preloading creds for SNI %s: %s",
+      name, files ? errstr : expand_string_message);
+    store_reset(reset_point);
+    continue;
+    }
+
+  node = store_get_perm(sizeof(tree_node) + Ustrlen(name), GET_UNTAINTED);
+  Ustrcpy(node->name, name);
+  node->data.ptr = ctx;
+  if (hset_insert(&server_sni_preloaded, node))
+    count++;
+  else
+    SSL_CTX_free(ctx);
+  store_reset(reset_point);
+  }
+
+tls_in.sni = NULL;
+DEBUG(D_tls) debug_printf("TLS: preloaded contexts for %d SNI values\n", count);
+}
+# endif
 #endif /* EXIM_HAVE_OPENSSL_TLSEXT */
 
 
@@ -3640,7 +4192,9 @@ DEBUG(D_tls) debug_printf("Calling SSL_accept\n");
 ERR_clear_error();
 sigalrm_seen = FALSE;
 if (smtp_receive_timeout > 0) ALARM(smtp_receive_timeout);
-rc = SSL_accept(ssl);
+do
+  rc = SSL_accept(ssl);
+while (tls_async_retry(ssl, rc));
 ALARM_CLR(0);
 
 if (rc <= 0)
@@ -3789,7 +4343,7 @@ tls_get_channel_binding(ssl, &tls_in, GET_UNTAINTED);
    smtp_read_response()/ip_recv().
    Hence no need to duplicate for _in and _out.
  */
-if (!ssl_xfer_buffer) ssl_xfer_buffer = store_malloc(ssl_xfer_buffer_size);
+if (!ssl_xfer_buffer) ssl_xfer_buffer = store_malloc(smtp_receive_buffer_size);
 ssl_xfer_buffer_lwm = ssl_xfer_buffer_hwm = 0;
 ssl_xfer_eof = ssl_xfer_error = FALSE;
 
@@ -3925,8 +4479,8 @@ return DEFER;
 
 
 #ifndef DISABLE_TLS_RESUME
-/* On the client, get any stashed session for the given IP from hints db
-and apply it to the ssl-connection for attempted resumption. */
+/* On the client, get any stashed session for the given IP from the session
+store and apply it to the ssl-connection for attempted resumption. */
 
 static void
 tls_retrieve_session(tls_support * tlsp, SSL * ssl)
@@ -3935,61 +4489,56 @@ if (tlsp->host_resumable)
   {
   dbdata_tls_session * dt;
   int len;
-  open_db dbblock, * dbm_file;
 
   tlsp->resumption |= RESUME_CLIENT_REQUESTED;
   DEBUG(D_tls)
     debug_printf("checking for resumable session for %s\n", tlsp->resume_index);
-  if ((dbm_file = dbfn_open(US"tls", O_RDWR, &dbblock, FALSE, FALSE)))
+  if ((dt = tls_session_read(tlsp->resume_index, &len)))
     {
-    if ((dt = dbfn_read_with_length(dbm_file, tlsp->resume_index, &len)))
-      {
-      SSL_SESSION * ss = NULL;
-      const uschar * sess_asn1 = dt->session;
+    SSL_SESSION * ss = NULL;
+    const uschar * sess_asn1 = dt->session;
 
-      len -= sizeof(dbdata_tls_session);
-      if (!(d2i_SSL_SESSION(&ss, &sess_asn1, (long)len)))
+    len -= sizeof(dbdata_tls_session);
+    if (!(d2i_SSL_SESSION(&ss, &sess_asn1, (long)len)))
+      {
+      DEBUG(D_tls)
 	{
-	DEBUG(D_tls)
-	  {
-	  ERR_error_string_n(ERR_get_error(),
-	    ssl_errstring, sizeof(ssl_errstring));
-	  debug_printf("decoding session: %s\n", ssl_errstring);
-	  }
+	ERR_error_string_n(ERR_get_error(),
+	  ssl_errstring, sizeof(ssl_errstring));
+	debug_printf("decoding session: %s\n", ssl_errstring);
 	}
-      else
-	{
-	unsigned long lifetime =
+      }
+    else
+      {
+      unsigned long lifetime =
 #ifdef EXIM_HAVE_SESSION_TICKET
-	  SSL_SESSION_get_ticket_lifetime_hint(ss);
+	SSL_SESSION_get_ticket_lifetime_hint(ss);
 #else			/* Use, fairly arbitrilarily, what we as server would */
-	  f.running_in_test_harness ? TESTSUITE_TICKET_LIFE : ssl_session_timeout;
+	f.running_in_test_harness ? TESTSUITE_TICKET_LIFE : ssl_session_timeout;
 #endif
-	time_t now = time(NULL), expires = lifetime + dt->time_stamp;
-	if (expires < now)
-	  {
-	  DEBUG(D_tls) debug_printf("session expired (by " TIME_T_FMT "s from %lus)\n", now - expires, lifetime);
-	  dbfn_delete(dbm_file, tlsp->resume_index);
-	  }
-	else if (SSL_set_session(ssl, ss))
-	  {
-	  DEBUG(D_tls) debug_printf("good session (" TIME_T_FMT "s left of %lus)\n", expires - now, lifetime);
-	  tlsp->resumption |= RESUME_CLIENT_SUGGESTED;
-	  tlsp->verify_override = dt->verify_override;
-	  tlsp->ocsp = dt->ocsp;
-	  }
-	else DEBUG(D_tls)
-	  {
-	  ERR_error_string_n(ERR_get_error(),
-	    ssl_errstring, sizeof(ssl_errstring));
-	  debug_printf("applying session to ssl: %s\n", ssl_errstring);
-	  }
+      time_t now = time(NULL), expires = lifetime + dt->time_stamp;
+      if (expires < now)
+	{
+	DEBUG(D_tls) debug_printf("session expired (by " TIME_T_FMT "s from %lus)\n", now - expires, lifetime);
+	tls_session_delete(tlsp->resume_index);
+	}
+      else if (SSL_set_session(ssl, ss))
+	{
+	DEBUG(D_tls) debug_printf("good session (" TIME_T_FMT "s left of %lus)\n", expires - now, lifetime);
+	tlsp->resumption |= RESUME_CLIENT_SUGGESTED;
+	tlsp->verify_override = dt->verify_override;
+	tlsp->ocsp = dt->ocsp;
+	}
+      else DEBUG(D_tls)
+	{
+	ERR_error_string_n(ERR_get_error(),
+	  ssl_errstring, sizeof(ssl_errstring));
+	debug_printf("applying session to ssl: %s\n", ssl_errstring);
 	}
       }
-    else
-      DEBUG(D_tls) debug_printf("no session record\n");
-    dbfn_close(dbm_file);
     }
+  else
+    DEBUG(D_tls) debug_printf("no session record\n");
   }
 }
 
@@ -4014,7 +4563,6 @@ if (SSL_SESSION_is_resumable(ss)) 	/* 1.1.1 */
   int dlen = sizeof(dbdata_tls_session) + len;
   dbdata_tls_session * dt = store_get(dlen, GET_TAINTED);
   uschar * s = dt->session;
-  open_db dbblock, * dbm_file;
 
   DEBUG(D_tls) debug_printf("session is resumable\n");
   tlsp->resumption |= RESUME_SERVER_TICKET;	/* server gave us a ticket */
@@ -4023,13 +4571,13 @@ if (SSL_SESSION_is_resumable(ss)) 	/* 1.1.1 */
   dt->ocsp = tlsp->ocsp;
   (void) i2d_SSL_SESSION(ss, &s);		/* s gets bumped to end */
 
-  if ((dbm_file = dbfn_open(US"tls", O_RDWR, &dbblock, FALSE, FALSE)))
-    {
-    dbfn_write(dbm_file, tlsp->resume_index, dt, dlen);
-    dbfn_close(dbm_file);
-    DEBUG(D_tls) debug_printf("wrote session (len %u) to db\n",
-		  (unsigned)dlen);
-    }
+  tls_session_write(tlsp->resume_index, dt, dlen,
+#ifdef EXIM_HAVE_SESSION_TICKET
+    (unsigned) SSL_SESSION_get_ticket_lifetime_hint(ss)
+#else
+    0
+#endif
+    );
   }
 return 1;
 }
@@ -4411,7 +4959,9 @@ client_static_state->event_action = tb ? tb->event_action : NULL;
 DEBUG(D_tls) debug_printf("Calling SSL_connect\n");
 sigalrm_seen = FALSE;
 ALARM(ob->command_timeout);
-rc = SSL_connect(exim_client_ctx->ssl);
+do
+  rc = SSL_connect(exim_client_ctx->ssl);
+while (tls_async_retry(exim_client_ctx->ssl, rc));
 ALARM_CLR(0);
 
 #ifdef SUPPORT_DANE
@@ -4494,12 +5044,14 @@ int error;
 int inbytes;
 
 DEBUG(D_tls) debug_printf("Calling SSL_read(%p, %p, %u)\n", ssl,
-  ssl_xfer_buffer, ssl_xfer_buffer_size);
+  ssl_xfer_buffer, smtp_receive_buffer_size);
 
 ERR_clear_error();
 if (smtp_receive_timeout > 0) ALARM(smtp_receive_timeout);
-inbytes = SSL_read(ssl, CS ssl_xfer_buffer,
-		  MIN(ssl_xfer_buffer_size, lim));
+do
+  inbytes = SSL_read(ssl, CS ssl_xfer_buffer,
+		    MIN(smtp_receive_buffer_size, lim));
+while (tls_async_retry(ssl, inbytes));
 error = SSL_get_error(ssl, inbytes);
 if (smtp_receive_timeout > 0) ALARM_CLR(0);
 
@@ -4590,6 +5142,15 @@ tls_hasc(void)
 return ssl_xfer_buffer_lwm < ssl_xfer_buffer_hwm;
 }
 
+/* Look at the buffered input without taking it */
+
+const uschar *
+tls_peekbuf(unsigned * len)
+{
+*len = ssl_xfer_buffer_hwm - ssl_xfer_buffer_lwm;
+return &ssl_xfer_buffer[ssl_xfer_buffer_lwm];
+}
+
 uschar *
 tls_getbuf(unsigned * len)
 {
@@ -4662,7 +5223,9 @@ DEBUG(D_tls) debug_printf("Calling SSL_read(%p, %p, %u)\n", ssl,
   buff, (unsigned int)len);
 
 ERR_clear_error();
-inbytes = SSL_read(ssl, CS buff, len);
+do
+  inbytes = SSL_read(ssl, CS buff, len);
+while (tls_async_retry(ssl, inbytes));
 error = SSL_get_error(ssl, inbytes);
 
 if (error == SSL_ERROR_ZERO_RETURN)
@@ -4749,7 +5312,9 @@ for (int left = len; left > 0;)
   {
   DEBUG(D_tls) debug_printf("SSL_write(%p, %p, %d)\n", ssl, buff, left);
   ERR_clear_error();
-  outbytes = SSL_write(ssl, CS buff, left);
+  do
+    outbytes = SSL_write(ssl, CS buff, left);
+  while (tls_async_retry(ssl, outbytes));
   error = SSL_get_error(ssl, outbytes);
   DEBUG(D_tls) debug_printf("outbytes=%d error=%d\n", outbytes, error);
   switch (error)
@@ -4791,6 +5356,74 @@ return olen;
 
 
 
+/*************************************************
+*        Send file data down TLS channel         *
+*************************************************/
+
+/* When the kernel does the encryption for transmit (kTLS, requested by the
+"enable_ktls" openssl_option) data can be sent directly from the spool file.
+
+Arguments:
+  ct_ctx	client TLS context pointer, or NULL for the one global server context
+
+Returns:	TRUE if tls_sendfile() can be used
+*/
+
+BOOL
+tls_can_sendfile(void * ct_ctx)
+{
+#ifdef EXIM_HAVE_KTLS
+SSL * ssl = ct_ctx
+  ? ((exim_openssl_client_tls_ctx *)ct_ctx)->ssl
+  : state_server.lib_state.lib_ssl;
+
+return ssl && BIO_get_ktls_send(SSL_get_wbio(ssl));
+#else
+return FALSE;
+#endif
+}
+
+
+/*
+Arguments:
+  ct_ctx	client TLS context pointer, or NULL for the one global server context
+  fd		file to send from
+  offset	where in the file to start; updated
+  len		number of bytes
+
+Returns:	the number of bytes sent, or -1 after a failure
+*/
+
+ssize_t
+tls_sendfile(void * ct_ctx, int fd, off_t * offset, size_t len)
+{
+#ifdef EXIM_HAVE_KTLS
+SSL * ssl = ct_ctx
+  ? ((exim_openssl_client_tls_ctx *)ct_ctx)->ssl
+  : state_server.lib_state.lib_ssl;
+ossl_ssize_t sent;
+
+if (tls_write(ct_ctx, NULL, 0, FALSE) < 0)	/* flush anything corked */
+  return -1;
+
+DEBUG(D_tls) debug_printf("SSL_sendfile(%p, %d, " OFF_T_FMT ", " SIZE_T_FMT ")\n",
+  ssl, fd, *offset, len);
+ERR_clear_error();
+if ((sent = SSL_sendfile(ssl, fd, *offset, len, 0)) < 0)
+  {
+  ERR_error_string_n(ERR_get_error(), ssl_errstring, sizeof(ssl_errstring));
+  log_write(0, LOG_MAIN, "TLS error (SSL_sendfile): %s", ssl_errstring);
+  return -1;
+  }
+*offset += sent;
+return sent;
+#else
+return -1;
+#endif
+}
+
+
+
 /*
 Arguments:
   ct_ctx	client TLS context pointer, or NULL for the one global server context
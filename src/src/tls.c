@@ -39,6 +39,7 @@ functions from the OpenSSL or GNU TLS libraries. */
 
 static void tls_per_lib_daemon_init(void);
 static void tls_per_lib_daemon_tick(void);
+static int  tls_per_lib_daemon_timeout(void);
 static unsigned  tls_server_creds_init(void);
 static void tls_server_creds_invalidate(void);
 static void tls_client_creds_init(transport_instance *, BOOL);
@@ -66,9 +67,11 @@ const exim_tlslib_state	null_tls_preload = {0};
 functions and the common functions below.
 
 We're moving away from this; GnuTLS is already using a state, which
-can switch, so we can do TLS callouts during ACLs. */
+can switch, so we can do TLS callouts during ACLs.
+
+The input buffers are sized by smtp_receive_buffer_size, as is the one for
+SMTP input in clear. */
 
-static const int ssl_xfer_buffer_size = 4096;
 #ifdef USE_OPENSSL
 static uschar *ssl_xfer_buffer = NULL;
 static int ssl_xfer_buffer_lwm = 0;
@@ -378,6 +381,16 @@ opt_unset_or_noexpand(const uschar * opt)
 
 
 
+/* Timeout, in milliseconds, for the daemon to wait before calling
+tls_daemon_tick() again; -1 for no limit. */
+
+int
+tls_daemon_timeout(void)
+{
+return tls_per_lib_daemon_timeout();
+}
+
+
 /* Called every time round the daemon loop.
 
 If we reloaded fd-watcher, return the old watch fd
@@ -457,6 +470,14 @@ tzset();
 /* Forward decl. */
 static void tls_client_resmption_key(tls_support *, smtp_connect_args *,
   smtp_transport_options_block *);
+#ifndef DISABLE_TLS_RESUME
+static dbdata_tls_session * tls_session_read(const uschar *, int *);
+static void tls_session_write(const uschar *, dbdata_tls_session *, int,
+  unsigned);
+# ifdef USE_OPENSSL
+static void tls_session_delete(const uschar *);
+# endif
+#endif
 
 
 #ifdef USE_GNUTLS
@@ -862,6 +883,129 @@ DEBUG(D_tls) debug_printf("TLS: resume session index %s\n", tlsp->resume_index);
 
 
 
+#ifndef DISABLE_TLS_RESUME
+/* Client sessions for resumption are kept by the daemon, in its shared cache,
+when tls_resumption_shared is set and the daemon can be used; else in the "tls"
+hints database.  The daemon's cache saves a database open, with its locking,
+for every connection.  The key there is the kind name "tls" and the index. */
+
+static BOOL
+tls_session_shared(const uschar * index, uschar ** key, int * keylen)
+{
+int len;
+
+if (tls_resumption_shared <= 0 || !search_shared_usable()) return FALSE;
+len = Ustrlen(index) + 1;
+*key = store_get(4 + len, index);
+memcpy(*key, "tls", 4);
+memcpy(*key + 4, index, len);
+*keylen = 4 + len;
+return TRUE;
+}
+
+
+/* Get a stored session.
+
+Arguments:
+  index		the key for the session
+  len		where to put the length of the record
+
+Returns:	the record, or NULL
+*/
+
+static dbdata_tls_session *
+tls_session_read(const uschar * index, int * len)
+{
+dbdata_tls_session * dt = NULL;
+uschar * key;
+int keylen;
+
+if (tls_session_shared(index, &key, &keylen))
+  {
+  uschar * data;
+
+  if (  search_shared_get_raw(key, keylen, &data, len)
+     && *len > sizeof(dbdata_tls_session))
+    dt = (dbdata_tls_session *)data;
+  DEBUG(D_tls) debug_printf("%s session in daemon cache\n",
+    dt ? "found" : "no");
+  }
+else
+  {
+  open_db dbblock, * dbm_file;
+
+  if ((dbm_file = dbfn_open(US"tls", O_RDONLY, &dbblock, FALSE, FALSE)))
+    {
+    dt = dbfn_read_with_length(dbm_file, index, len);
+    dbfn_close(dbm_file);
+    }
+  }
+return dt;
+}
+
+
+/* Store a session.
+
+Arguments:
+  index		the key for the session
+  dt, dlen	the record
+  lifetime	seconds the session is good for, or zero if not known
+*/
+
+static void
+tls_session_write(const uschar * index, dbdata_tls_session * dt, int dlen,
+  unsigned lifetime)
+{
+uschar * key;
+int keylen;
+
+if (tls_session_shared(index, &key, &keylen))
+  {
+  if (!lifetime || lifetime > (unsigned)tls_resumption_shared)
+    lifetime = tls_resumption_shared;
+  dt->time_stamp = time(NULL);
+  search_shared_put_raw(key, keylen, US dt, dlen, lifetime);
+  DEBUG(D_tls) debug_printf("offered session (len %u) to daemon cache\n",
+		(unsigned)dlen);
+  }
+else
+  {
+  open_db dbblock, * dbm_file;
+
+  if ((dbm_file = dbfn_open(US"tls", O_RDWR, &dbblock, FALSE, FALSE)))
+    {
+    dbfn_write(dbm_file, index, dt, dlen);
+    dbfn_close(dbm_file);
+    DEBUG(D_tls) debug_printf("wrote session (len %u) to db\n",
+		  (unsigned)dlen);
+    }
+  }
+}
+
+
+/* Forget a stored session.  One in the daemon's cache is left to time out.
+Only the OpenSSL client checks the expiry of a session it has read. */
+
+# ifdef USE_OPENSSL
+static void
+tls_session_delete(const uschar * index)
+{
+uschar * key;
+int keylen;
+open_db dbblock, * dbm_file;
+
+if (  !tls_session_shared(index, &key, &keylen)
+   && (dbm_file = dbfn_open(US"tls", O_RDWR, &dbblock, FALSE, FALSE)))
+  {
+  dbfn_delete(dbm_file, index);
+  dbfn_close(dbm_file);
+  }
+}
+# endif	/*USE_OPENSSL*/
+#endif	/*!DISABLE_TLS_RESUME*/
+
+
+
 /* Start TLS as a client for an ajunct connection, eg. readsocket
 Return boolean success.
 */
@@ -17,76 +17,29 @@
 
 static uschar timebuf[sizeof("www, dd-mmm-yyyy hh:mm:ss.ddd +zzzz")];
 
+/* The last stamp made of each type, with the second it is for and the
+settings it was made with */
 
-/*************************************************
-*                Return timestamp                *
-*************************************************/
+typedef struct {
+  time_t	sec;
+  int		variant;
+  uschar	buf[sizeof(timebuf)];
+} tod_cached;
 
-/* The log timestamp format is dd-mmm-yy so as to be non-confusing on both
-sides of the Atlantic. We calculate an explicit numerical offset from GMT for
-the full datestamp and BSD inbox datestamp. Note that on some systems
-localtime() and gmtime() re-use the same store, so we must save the local time
-values before calling gmtime(). If timestamps_utc is set, don't use
-localtime(); all times are then in UTC (with offset +0000).
+static tod_cached tod_cache[tod_mbx + 1];
 
-There are also some contortions to get the day of the month without
-a leading zero for the full stamp, since Ustrftime() doesn't provide this
-option.
 
-Argument:  type of timestamp required:
-             tod_bsdin                  BSD inbox format
-             tod_epoch                  Unix epoch format
-             tod_epochl                 Unix epoch/usec format
-             tod_full                   full date and time
-             tod_log                    log file data line format,
-                                          with zone if log_timezone is TRUE
-             tod_log_bare               always without zone
-             tod_log_datestamp_daily    for log file names when datestamped daily
-             tod_log_datestamp_monthly  for log file names when datestamped monthly
-             tod_log_zone               always with zone
-             tod_mbx                    MBX inbox format
-             tod_zone                   just the timezone offset
-             tod_zulu                   time in 8601 zulu format
+/* Format a timestamp of one of the types needing the broken-down time into
+timebuf.  See tod_stamp() for the types. */
 
-Returns:   pointer to fixed buffer containing the timestamp
-*/
-
-uschar *
-tod_stamp(int type)
+static void
+tod_format(int type, const struct timeval * now)
 {
-struct timeval now;
 struct tm * t;
 
-gettimeofday(&now, NULL);
-
-/* Styles that don't need local time */
-
-switch(type)
-  {
-  case tod_epoch:
-    (void) snprintf(CS timebuf, sizeof(timebuf), TIME_T_FMT, now.tv_sec);  /* Unix epoch format */
-    return timebuf;	/* NB the above will be wrong if time_t is FP */
-
-  case tod_epoch_l:
-    /* Unix epoch/usec format */
-    (void) snprintf(CS timebuf, sizeof(timebuf), TIME_T_FMT "%06ld", now.tv_sec, (long) now.tv_usec );
-    return timebuf;
-
-  case tod_zulu:
-    t = gmtime(&now.tv_sec);
-    (void) snprintf(CS timebuf, sizeof(timebuf), "%04u%02u%02u%02u%02u%02uZ",
-      1900 + (uint)t->tm_year, 1 + (uint)t->tm_mon, (uint)t->tm_mday, (uint)t->tm_hour, (uint)t->tm_min,
-      (uint)t->tm_sec);
-    return timebuf;
-  }
-
-/* Vary log type according to timezone requirement */
-
-if (type == tod_log) type = log_timezone ? tod_log_zone : tod_log_bare;
-
 /* Convert to local time or UTC */
 
-t = f.timestamps_utc ? gmtime(&now.tv_sec) : localtime(&now.tv_sec);
+t = f.timestamps_utc ? gmtime(&now->tv_sec) : localtime(&now->tv_sec);
 
 switch(type)
   {
@@ -96,7 +49,7 @@ switch(type)
       snprintf(CS timebuf, sizeof(timebuf), "%04u-%02u-%02u %02u:%02u:%02u.%03u",
 	1900 + (uint)t->tm_year, 1 + (uint)t->tm_mon, (uint)t->tm_mday,
 	(uint)t->tm_hour, (uint)t->tm_min, (uint)t->tm_sec,
-	(uint)(now.tv_usec/1000));
+	(uint)(now->tv_usec/1000));
     else
 #endif
       snprintf(CS timebuf, sizeof(timebuf), "%04u-%02u-%02u %02u:%02u:%02u",
@@ -157,7 +110,7 @@ switch(type)
 	diff_hour = diff_min = 0;
       else
 	{
-	struct tm * gmt = gmtime(&now.tv_sec);
+	struct tm * gmt = gmtime(&now->tv_sec);
 
 	if (local.tm_sec == gmt->tm_sec)	/* usual case */
 	  {
@@ -185,7 +138,7 @@ switch(type)
 	    (void) snprintf(CS timebuf, sizeof(timebuf),
 	      "%04u-%02u-%02u %02u:%02u:%02u.%03u %+03d%02d",
 	      1900 + (uint)lp->tm_year, 1 + (uint)lp->tm_mon, (uint)lp->tm_mday,
-	      (uint)lp->tm_hour, (uint)lp->tm_min, (uint)lp->tm_sec, (uint)(now.tv_usec/1000),
+	      (uint)lp->tm_hour, (uint)lp->tm_min, (uint)lp->tm_sec, (uint)(now->tv_usec/1000),
 	      diff_hour, diff_min);
 	  else
 #endif
@@ -234,6 +187,113 @@ switch(type)
     break;
   }
 
+}
+
+
+
+/*************************************************
+*                Return timestamp                *
+*************************************************/
+
+/* The log timestamp format is dd-mmm-yy so as to be non-confusing on both
+sides of the Atlantic. We calculate an explicit numerical offset from GMT for
+the full datestamp and BSD inbox datestamp. Note that on some systems
+localtime() and gmtime() re-use the same store, so we must save the local time
+values before calling gmtime(). If timestamps_utc is set, don't use
+localtime(); all times are then in UTC (with offset +0000).
+
+There are also some contortions to get the day of the month without
+a leading zero for the full stamp, since Ustrftime() doesn't provide this
+option.
+
+Argument:  type of timestamp required:
+             tod_bsdin                  BSD inbox format
+             tod_epoch                  Unix epoch format
+             tod_epochl                 Unix epoch/usec format
+             tod_full                   full date and time
+             tod_log                    log file data line format,
+                                          with zone if log_timezone is TRUE
+             tod_log_bare               always without zone
+             tod_log_datestamp_daily    for log file names when datestamped daily
+             tod_log_datestamp_monthly  for log file names when datestamped monthly
+             tod_log_zone               always with zone
+             tod_mbx                    MBX inbox format
+             tod_zone                   just the timezone offset
+             tod_zulu                   time in 8601 zulu format
+
+Returns:   pointer to fixed buffer containing the timestamp
+*/
+
+uschar *
+tod_stamp(int type)
+{
+struct timeval now;
+struct tm * t;
+
+gettimeofday(&now, NULL);
+
+/* Styles that don't need local time */
+
+switch(type)
+  {
+  case tod_epoch:
+    (void) snprintf(CS timebuf, sizeof(timebuf), TIME_T_FMT, now.tv_sec);  /* Unix epoch format */
+    return timebuf;	/* NB the above will be wrong if time_t is FP */
+
+  case tod_epoch_l:
+    /* Unix epoch/usec format */
+    (void) snprintf(CS timebuf, sizeof(timebuf), TIME_T_FMT "%06ld", now.tv_sec, (long) now.tv_usec );
+    return timebuf;
+
+  case tod_zulu:
+    t = gmtime(&now.tv_sec);
+    (void) snprintf(CS timebuf, sizeof(timebuf), "%04u%02u%02u%02u%02u%02uZ",
+      1900 + (uint)t->tm_year, 1 + (uint)t->tm_mon, (uint)t->tm_mday, (uint)t->tm_hour, (uint)t->tm_min,
+      (uint)t->tm_sec);
+    return timebuf;
+  }
+
+/* Vary log type according to timezone requirement */
+
+if (type == tod_log) type = log_timezone ? tod_log_zone : tod_log_bare;
+
+/* The rest need the broken-down local time, which localtime() can make
+costly by checking the timezone file each call.  Keep the formatted stamp of
+each type for the second it was made, and only patch in milliseconds. */
+
+if (type >= 0 && type < nelem(tod_cache))
+  {
+  tod_cached * c = tod_cache + type;
+  int variant = f.timestamps_utc ? 1 : 0;
+  BOOL ms = FALSE;
+
+#ifndef COMPILE_UTILITY
+  if (  LOGGING(millisec)
+     && (type == tod_log_bare || type == tod_log_zone))
+    { variant |= 2; ms = TRUE; }
+#endif
+
+  if (c->sec == now.tv_sec && c->variant == variant)
+    memcpy(timebuf, c->buf, sizeof(timebuf));
+  else
+    {
+    tod_format(type, &now);
+    memcpy(c->buf, timebuf, sizeof(timebuf));
+    c->sec = now.tv_sec;
+    c->variant = variant;
+    }
+
+  if (ms)				/* "yyyy-mm-dd hh:mm:ss.mmm" */
+    {
+    unsigned msec = (unsigned)(now.tv_usec / 1000);
+    timebuf[20] = '0' + msec / 100;
+    timebuf[21] = '0' + msec / 10 % 10;
+    timebuf[22] = '0' + msec % 10;
+    }
+  return timebuf;
+  }
+
+tod_format(type, &now);
 return timebuf;
 }
 
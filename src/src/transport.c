@@ -12,6 +12,11 @@ transports. */
 
 
 #include "exim.h"
+#include <sys/mman.h>
+
+/* Above this size a CHUNKING message gets an initial BDAT of just the headers.
+It is independent of the output buffer size. */
+#define BDAT_HEADERS_FIRST_SIZE 8192
 
 /* Generic options for transports, all of which live inside transport_instance
 data blocks and which therefore have the opt_public flag set. Note that there
@@ -129,6 +134,7 @@ static int     nl_check_length;     /* length of same */
 static uschar *nl_escape;           /* string to insert */
 static int     nl_escape_length;    /* length of same */
 static int     nl_partial_match;    /* length matched at chunk end */
+static int     inproc_continues = 0; /* chain of in-process continuations */
 
 
 /*************************************************
@@ -503,6 +509,32 @@ for (const uschar * ptr = start; ptr < end; ptr++)
     chunk_ptr = deliver_out_buffer;
     }
 
+  /* Copy a run of characters up to the next NL in bulk, as far as the buffer
+  threshold allows; memchr() is typically vectorised by the C library. A CR
+  that is to be removed before the NL is left for the code below. */
+
+  if (*ptr != '\n')
+    {
+    const uschar * stop = memchr(ptr, '\n', end - ptr);
+    int n = mlen + 1 - (chunk_ptr - deliver_out_buffer);
+
+    if (!stop)
+      stop = end;
+    else if (  stop[-1] == '\r'
+	    && !(tctx->options & topt_use_crlf)
+	    && f.spool_file_wireformat
+	    )
+      stop--;
+
+    if ((n = MIN(stop - ptr, n)) > 0)
+      {
+      memcpy(chunk_ptr, ptr, n);
+      chunk_ptr += n;
+      ptr += n - 1;
+      continue;
+      }
+    }
+
   /* Remove CR before NL if required */
 
   if (  *ptr == '\r' && ptr[1] == '\n'
@@ -661,11 +693,9 @@ ppp->ptr = p;
 
 for (pp = p;; pp = pp->parent)
   {
-  address_item *dup;
-  for (dup = addr_duplicate; dup; dup = dup->next)
-    if (dup->dupof == pp)   /* a dup of our address */
-      if (!write_env_to(dup, pplist, pdlist, first, tctx))
-	return FALSE;
+  for (address_item * dup = pp->dups; dup; dup = dup->dupnext)
+    if (!write_env_to(dup, pplist, pdlist, first, tctx))
+      return FALSE;
   if (!pp->parent) break;
   }
 
@@ -689,6 +719,143 @@ return write_chunk(tctx, pp->address, Ustrlen(pp->address));
 
 
 
+/* The message's own headers, after remove_headers and headers_rewrite, come
+out the same for every host, fallback host and batch that a delivery process
+sends through one transport, so the block is kept once built.  The key holds
+the message ID, a fingerprint of the header list (the lines, their lengths and
+types, so a re-read or a change is noticed), the transport, the expanded
+remove_headers items, the address's remove list and the truncation option.
+Rewrite rules that expand anything beyond the matched parts and the rewritten
+address might differ per host or address, so their output is not kept.  The
+address-specific and added headers are not part of the block. */
+
+typedef struct hdr_cache_entry {
+  uschar *	key;
+  int		keylen;
+  uschar *	block;
+  int		len;
+} hdr_cache_entry;
+
+#define HDR_CACHE_MAX	4
+
+static hdr_cache_entry	hdr_cache[HDR_CACHE_MAX];
+static unsigned		hdr_cache_next = 0;
+
+
+/* Say whether a rewrite rule component expands only $0-$9, $local_part
+and $domain (with or without braces) */
+
+static BOOL
+rewrite_part_fixed(const uschar * s)
+{
+while (s && (s = Ustrchr(s, '$')))
+  {
+  BOOL brace = *++s == '{';
+  size_t n;
+
+  if (brace) s++;
+  if (isdigit(*s)) n = 1;
+  else if (Ustrncmp(s, "local_part", 10) == 0) n = 10;
+  else if (Ustrncmp(s, "domain", 6) == 0) n = 6;
+  else return FALSE;
+  s += n;
+  if (isalnum(*s) || *s == '_' || (brace && *s++ != '}')) return FALSE;
+  }
+return TRUE;
+}
+
+static BOOL
+rewrite_rules_fixed(const rewrite_rule * r)
+{
+for ( ; r; r = r->next)
+  if (!rewrite_part_fixed(r->key) || !rewrite_part_fixed(r->replacement))
+    return FALSE;
+return TRUE;
+}
+
+
+static gstring *
+hdr_cache_key(const transport_instance * tblock, const address_item * addr,
+  const uschar ** pats, int npats, BOOL truncate)
+{
+gstring * g = string_catn(NULL, message_id, Ustrlen(message_id) + 1);
+unsigned long fp = 0;
+
+for (const header_line * h = header_list; h; h = h->next)
+  fp = fp * 31 + (unsigned long)h + (unsigned long)h->slen * 7 + h->type;
+g = string_fmt_append(g, "%lx %d", fp, truncate);
+g = string_catn(g, US"", 1);
+if (tblock && tblock->name)
+  g = string_catn(g, tblock->name, Ustrlen(tblock->name) + 1);
+for (int i = 0; i < npats; i++)
+  g = string_catn(g, pats[i], Ustrlen(pats[i]) + 1);
+g = string_catn(g, US"\n", 1);
+if (addr && addr->prop.remove_headers)
+  g = string_cat(g, addr->prop.remove_headers);
+return g;
+}
+
+static hdr_cache_entry *
+hdr_cache_find(const gstring * key)
+{
+for (int i = 0; i < HDR_CACHE_MAX; i++)
+  {
+  hdr_cache_entry * e = &hdr_cache[i];
+  if (e->key && e->keylen == key->ptr && memcmp(e->key, key->s, key->ptr) == 0)
+    return e;
+  }
+return NULL;
+}
+
+static void
+hdr_cache_put(const gstring * key, const gstring * block)
+{
+hdr_cache_entry * e = &hdr_cache[hdr_cache_next++ % HDR_CACHE_MAX];
+int len = block ? block->ptr : 0;
+
+if (e->key) store_free(e->key);
+e->key = store_malloc(key->ptr + len + 1);
+memcpy(e->key, key->s, e->keylen = key->ptr);
+e->block = e->key + key->ptr;
+if (len) memcpy(e->block, block->s, len);
+e->block[e->len = len] = '\0';		/* the verify sendfn wants a string */
+}
+
+
+/* Remove a header line? */
+
+static BOOL
+hdr_removed(const header_line * h, const uschar ** pats, int npats,
+  const uschar * list)
+{
+int sep = ':';         /* This is specified as a colon-separated list */
+const uschar * s;
+
+for (int i = 0; ; i++)
+  {
+  int len;
+  const uschar * ss;
+
+  if (i < npats) s = pats[i];
+  else if (!list || !(s = string_nextinlist(&list, &sep, NULL, 0)))
+    return FALSE;
+
+  len = Ustrlen(s);
+  if (!len) continue;
+  if (s[len-1] == '*')			/* trailing glob */
+    {
+    if (strncmpic(h->text, s, len-1) == 0) return TRUE;
+    }
+  else if (strncmpic(h->text, s, len) == 0)
+    {
+    ss = h->text + len;
+    while (*ss == ' ' || *ss == '\t') ss++;
+    if (*ss == ':') return TRUE;
+    }
+  }
+}
+
+
 /* Add/remove/rewrite headers, and send them plus the empty-line separator.
 
 Globals:
@@ -709,86 +876,79 @@ transport_headers_send(transport_ctx * tctx,
 const uschar * list;
 transport_instance * tblock = tctx ? tctx->tblock : NULL;
 address_item * addr = tctx ? tctx->addr : NULL;
+BOOL truncate = !!(tctx->options & topt_truncate_headers);
+const uschar ** pats = NULL;
+int npats = 0;
+gstring * key, * block = NULL;
+hdr_cache_entry * e;
 
-/* Then the message's headers. Don't write any that are flagged as "old";
-that means they were rewritten, or are a record of envelope rewriting, or
-were removed (e.g. Bcc). If remove_headers is not null, skip any headers that
-match any entries therein.  It is a colon-sep list; expand the items
-separately and squash any empty ones.
-Then check addr->prop.remove_headers too, provided that addr is not NULL. */
+/* The transport's remove_headers is a colon-sep list; expand the items
+separately, once, and squash any empty ones. */
 
-for (header_line * h = header_list; h; h = h->next) if (h->type != htype_old)
+if (tblock && (list = tblock->remove_headers))
   {
-  BOOL include_header = TRUE;
+  int sep = ':', n = 0;
+  uschar * s;
 
-  list = tblock ? tblock->remove_headers : NULL;
-  for (int i = 0; i < 2; i++)    /* For remove_headers && addr->prop.remove_headers */
-    {
-    if (list)
+  for (const uschar * l = list; string_nextinlist(&l, &sep, NULL, 0); ) n++;
+  pats = store_get(n * sizeof(uschar *), GET_UNTAINTED);
+  while ((s = string_nextinlist(&list, &sep, NULL, 0)))
+    if ((s = expand_string(s)))
+      { if (*s) pats[npats++] = s; }
+    else if (!f.expand_string_forcedfail)
       {
-      int sep = ':';         /* This is specified as a colon-separated list */
-      uschar *s, *ss;
-      while ((s = string_nextinlist(&list, &sep, NULL, 0)))
-	{
-	int len;
-
-	if (i == 0)
-	  if (!(s = expand_string(s)) && !f.expand_string_forcedfail)
-	    {
-	    errno = ERRNO_CHHEADER_FAIL;
-	    return FALSE;
-	    }
-	len = s ? Ustrlen(s) : 0;
-	if (len && s[len-1] == '*')	/* trailing glob */
-	  {
-	  if (strncmpic(h->text, s, len-1) == 0) break;
-	  }
-	else
-	  {
-	  if (strncmpic(h->text, s, len) != 0) continue;
-	  ss = h->text + len;
-	  while (*ss == ' ' || *ss == '\t') ss++;
-	  if (*ss == ':') break;
-	  }
-	}
-      if (s) { include_header = FALSE; break; }
+      errno = ERRNO_CHHEADER_FAIL;
+      return FALSE;
       }
-    if (addr) list = addr->prop.remove_headers;
-    }
+  }
 
-  /* If this header is to be output, try to rewrite it if there are rewriting
-  rules. */
+key = hdr_cache_key(tblock, addr, pats, npats, truncate);
+if ((e = hdr_cache_find(key)))
+  {
+  DEBUG(D_transport) debug_printf("message headers (%d bytes) from cache\n",
+    e->len);
+  if (e->len && !sendfn(tctx, e->block, e->len)) return FALSE;
+  }
+else
+  {
+  /* Then the message's headers. Don't write any that are flagged as "old";
+  that means they were rewritten, or are a record of envelope rewriting, or
+  were removed (e.g. Bcc). Skip any that match the transport's remove_headers
+  items, or addr->prop.remove_headers (which is not expanded) if addr is not
+  NULL. */
 
-  if (include_header)
+  for (header_line * h = header_list; h; h = h->next) if (h->type != htype_old)
     {
-    int len;
-    if (tblock && tblock->rewrite_rules)
+    /* If this header is to be output, try to rewrite it if there are
+    rewriting rules. */
+
+    if (!hdr_removed(h, pats, npats, addr ? addr->prop.remove_headers : NULL))
       {
-      rmark reset_point = store_mark();
-      header_line * hh;
+      const header_line * hh = NULL;
+      int len;
 
-      if ((hh = rewrite_header(h, NULL, NULL, tblock->rewrite_rules,
-		  tblock->rewrite_existflags, FALSE)))
-	{
-	len = hh->slen;
-	if (tctx->options & topt_truncate_headers && len > 998) len = 998;
-	if (!sendfn(tctx, hh->text, len)) return FALSE;
-	store_reset(reset_point);
-	continue;     /* With the next header line */
-	}
+      if (tblock && tblock->rewrite_rules)
+	hh = rewrite_header(h, NULL, NULL, tblock->rewrite_rules,
+		  tblock->rewrite_existflags, FALSE);
+
+      /* Either no rewriting rules, or it didn't get rewritten */
+
+      if (!hh) hh = h;
+      len = hh->slen;
+      if (truncate && len > 998) len = 998;
+      block = string_catn(block, hh->text, len);
       }
 
-    /* Either no rewriting rules, or it didn't get rewritten */
+    /* Header removed */
 
-    len = h->slen;
-    if (tctx->options & topt_truncate_headers && len > 998) len = 998;
-    if (!sendfn(tctx, h->text, len)) return FALSE;
+    else
+      DEBUG(D_transport) debug_printf("removed header line:\n %s---\n", h->text);
     }
 
-  /* Header removed */
-
-  else
-    DEBUG(D_transport) debug_printf("removed header line:\n %s---\n", h->text);
+  if (!tblock || rewrite_rules_fixed(tblock->rewrite_rules))
+    hdr_cache_put(key, block);
+  if (block && !sendfn(tctx, string_from_gstring(block), block->ptr))
+    return FALSE;
   }
 
 /* Add on any address-specific headers. If there are multiple addresses,
@@ -860,6 +1020,66 @@ return sendfn(tctx, US"\n", 1);
 }
 
 
+#ifdef OS_SENDFILE
+/*************************************************
+*     Check a wireformat body can go as it is    *
+*************************************************/
+
+/* The -D file is mapped for the check for lines needing escape, which is much
+cheaper than copying the body through the output buffer.
+
+Arguments:
+  tctx		the transport context
+  offset	start of the body in the -D file
+  fsize		amount of the body to be sent
+  size_limit	as for internal_transport_write_message()
+
+Returns:	NULL if the body can be sent unchanged, else why not
+*/
+
+static const uschar *
+wireformat_body_verbatim(transport_ctx * tctx, off_t offset, off_t fsize,
+  int size_limit)
+{
+const uschar * why = NULL, * map, * p, * e;
+int clen = abs(nl_check_length);
+
+if (fsize <= 0)
+  return US"empty body";
+if (!clen && !(tctx->options & topt_end_dot))
+  return NULL;
+if (tctx->options & topt_end_dot && size_limit > 0 && fsize >= size_limit)
+  return US"size limit applied";
+
+if ((map = mmap(NULL, (size_t)(offset + fsize), PROT_READ, MAP_PRIVATE,
+		deliver_datafile, 0)) == MAP_FAILED)
+  return US"spoolfile not mappable";
+p = map + offset;
+e = p + fsize;
+
+if (tctx->options & topt_end_dot && (e[-2] != '\r' || e[-1] != '\n'))
+  why = US"no final newline";
+else if (clen)
+  {
+  /* A line start is the start of the body or follows a NL.  A partial match
+  at the end of the data counts, to be safe. */
+
+  for (const uschar * q = p - 1; q; q = memchr(q + 1, '\n', e - q - 1))
+    {
+    int n = MIN(clen, e - q - 1);
+    if (n > 0 && memcmp(q + 1, nl_check, n) == 0)
+      { why = US"dot- or From-stuffing wanted"; break; }
+    if (e - q <= 1) break;
+    }
+  }
+
+(void) munmap((void *)map, (size_t)(offset + fsize));
+return why;
+}
+#endif
+
+
+
 /*************************************************
 *                Write the message               *
 *************************************************/
@@ -1060,7 +1280,7 @@ if (tctx->options & topt_use_bdat)
   on the assumption they are cheap enough and some clever implementations
   might errorcheck them too, on-the-fly, and reject that chunk. */
 
-  if (size > DELIVER_OUT_BUFFER_SIZE && hsize > 0)
+  if (size > BDAT_HEADERS_FIRST_SIZE && hsize > 0)
     {
     DEBUG(D_transport)
       debug_printf("sending small initial BDAT; hsize=%d\n", hsize);
@@ -1088,50 +1308,91 @@ is positioned at the start of its file (following the message id), then write
 it, applying the size limit if required. */
 
 /* If we have a wireformat -D file (CRNL lines, non-dotstuffed, no ending dot)
-and we want to send a body without dotstuffing or ending-dot, in-clear,
-then we can just dump it using sendfile.
-This should get used for CHUNKING output and also for writing the -K file for
-dkim signing,  when we had CHUNKING input.  */
+and we want CRLF output, in-clear or over TLS done by the kernel, to a socket,
+then the body can go out with no copying, using sendfile - provided it needs
+no dot- or From-stuffing.  For CHUNKING output that is always so.  Otherwise
+the body is checked for lines needing to be escaped, and the ending dot is then
+written separately.  This should get used for SMTP and LMTP output and also for
+writing the -K file for dkim signing, when we had CHUNKING input.  */
 
 #ifdef OS_SENDFILE
 if (  f.spool_file_wireformat
-   && !(tctx->options & (topt_no_body | topt_end_dot))
-   && !nl_check_length
-   && tls_out.active.sock != tctx->u.fd
+   && (tctx->options & (topt_use_crlf | topt_no_body | topt_not_socket))
+      == topt_use_crlf
+#ifndef DISABLE_TLS
+   && (  tls_out.active.sock != tctx->u.fd
+      || tls_can_sendfile(tls_out.active.tls_ctx))
+#endif
    )
   {
-  ssize_t copied = 0;
-  off_t offset = spool_data_start_offset(message_id);
+  off_t offset = spool_data_start_offset(message_id), fsize;
+  const uschar * why;
 
-  /* Write out any header data in the buffer */
+  if ((fsize = lseek(deliver_datafile, 0, SEEK_END)) < 0) return FALSE;
+  fsize -= offset;
+  if (size_limit > 0 && fsize > size_limit) fsize = size_limit;
 
-  if ((len = chunk_ptr - deliver_out_buffer) > 0)
+  if ((why = wireformat_body_verbatim(tctx, offset, fsize, size_limit)))
+    { DEBUG(D_transport) debug_printf("cannot use sendfile for body: %s\n", why); }
+  else
     {
-    if (!transport_write_block(tctx, deliver_out_buffer, len, TRUE))
+    ssize_t copied = 0;
+
+    /* Write out any header data in the buffer */
+
+    if ((len = chunk_ptr - deliver_out_buffer) > 0
+       && !transport_write_block(tctx, deliver_out_buffer, len, TRUE))
       return FALSE;
-    size -= len;
-    }
+    chunk_ptr = deliver_out_buffer;
+
+#ifndef DISABLE_TLS
+    if (tls_out.active.sock == tctx->u.fd)
+      {
+      DEBUG(D_transport) debug_printf("using sendfile for body (kTLS)\n");
+      while (fsize > 0)
+	{
+	if ((copied = tls_sendfile(tls_out.active.tls_ctx, deliver_datafile,
+				    &offset, fsize)) <= 0) break;
+	fsize -= copied;
+	transport_count += copied;
+	}
+      }
+    else
+#endif
+      {
+      DEBUG(D_transport) debug_printf("using sendfile for body\n");
+      while (fsize > 0)
+	{
+	if ((copied = os_sendfile(tctx->u.fd, deliver_datafile, &offset, fsize)) <= 0)
+	  break;
+	fsize -= copied;
+	transport_count += copied;
+	}
+      }
+    if (copied < 0) return FALSE;
 
-  DEBUG(D_transport) debug_printf("using sendfile for body\n");
+    nl_check_length = nl_escape_length = 0;
+    f.spool_file_wireformat = FALSE;
 
-  while(size > 0)
-    {
-    if ((copied = os_sendfile(tctx->u.fd, deliver_datafile, &offset, size)) <= 0) break;
-    size -= copied;
+    if (tctx->options & topt_end_dot)
+      {
+      smtp_debug_cmd(US".", 0);
+      return transport_write_block(tctx, US".\r\n", 3,
+			    !!(tctx->options & topt_no_flush));
+      }
+    return TRUE;
     }
-  return copied >= 0;
   }
-#else
-DEBUG(D_transport) debug_printf("cannot use sendfile for body: no support\n");
-#endif
-
-DEBUG(D_transport)
+else DEBUG(D_transport)
   if (!(tctx->options & topt_no_body))
     debug_printf("cannot use sendfile for body: %s\n",
       !f.spool_file_wireformat ? "spoolfile not wireformat"
-      : tctx->options & topt_end_dot ? "terminating dot wanted"
-      : nl_check_length ? "dot- or From-stuffing wanted"
+      : !(tctx->options & topt_use_crlf) ? "no CRLF wanted"
+      : tctx->options & topt_not_socket ? "not a socket"
       : "TLS output wanted");
+#else
+DEBUG(D_transport) debug_printf("cannot use sendfile for body: no support\n");
+#endif
 
 if (!(tctx->options & topt_no_body))
   {
@@ -1235,7 +1496,8 @@ else nl_check_length = nl_escape_length = 0;
 be closed when the subprocess execs, but remove the flag afterwards.
 (Otherwise, if this is a TCP/IP socket, it can't get passed on to another
 process to deliver another message.) We get back stdin/stdout file descriptors.
-If the process creation failed, give an error return. */
+If the process creation failed, give an error return.  When the output is
+going to a string (for DKIM signing) there is no fd to protect. */
 
 fd_read = -1;
 fd_write = -1;
@@ -1243,6 +1505,10 @@ save_errno = 0;
 yield = FALSE;
 write_pid = (pid_t)(-1);
 
+if (tctx->options & topt_output_string)
+  filter_pid = child_open(USS transport_filter_argv, NULL, 077,
+			  &fd_write, &fd_read, FALSE, US"transport-filter");
+else
   {
   int bits = fcntl(tctx->u.fd, F_GETFD);
   (void) fcntl(tctx->u.fd, F_SETFD, bits | FD_CLOEXEC);
@@ -1270,7 +1536,8 @@ if ((write_pid = exim_fork(US"tpt-filter-writer")) == 0)
 
   tctx->u.fd = fd_write;
   tctx->check_string = tctx->escape_string = NULL;
-  tctx->options &= ~(topt_use_crlf | topt_end_dot | topt_use_bdat | topt_no_flush);
+  tctx->options &= ~(topt_use_crlf | topt_end_dot | topt_use_bdat | topt_no_flush
+		    | topt_output_string);
 
   rc = internal_transport_write_message(tctx, size_limit);
 
@@ -1502,6 +1769,7 @@ transport_update_waiting(host_item * hostlist, uschar * tpname)
 const uschar *prevname = US"";
 open_db dbblock;
 open_db *dbm_file;
+BOOL txn;
 
 if (!is_new_message_id(message_id))
   {
@@ -1510,6 +1778,27 @@ if (!is_new_message_id(message_id))
   return;
   }
 
+/* In the first phase of a 2-stage queue run collecting batches, also tell
+the queue runner which hosts this message is waiting for.  All the records
+for the message go in a single write, the file being opened for append. */
+
+if (queue_run_batch_fd >= 0)
+  {
+  gstring * g = NULL;
+
+  for (host_item * host = hostlist; host; host = host->next)
+    if (Ustrcmp(prevname, host->name) != 0)
+      {
+      g = string_fmt_append(g, "%s %s %s\n", tpname, host->name, message_id);
+      prevname = host->name;
+      }
+  prevname = US"";
+
+  if (g && write(queue_run_batch_fd, g->s, g->ptr) != g->ptr)
+    DEBUG(D_transport) debug_printf("queue_run_batch write: %s\n",
+      strerror(errno));
+  }
+
 DEBUG(D_transport) debug_printf("updating wait-%s database\n", tpname);
 
 /* Open the database for this transport */
@@ -1519,7 +1808,11 @@ if (!(dbm_file = dbfn_open(string_sprintf("wait-%.200s", tpname),
   return;
 
 /* Scan the list of hosts for which this message is waiting, and ensure
-that the message id is in each host record. */
+that the message id is in each host record. The writes for all the hosts
+(and any continuation records) are applied together where the DB supports
+it. */
+
+txn = dbfn_transaction_start(dbm_file);
 
 for (host_item * host = hostlist; host; host = host->next)
   {
@@ -1641,12 +1934,78 @@ for (host_item * host = hostlist; host; host = host->next)
 
 /* All now done */
 
+if (txn) dbfn_transaction_commit(dbm_file);
 dbfn_close(dbm_file);
 }
 
 
 
 
+/*************************************************
+*       Take next message from a batch           *
+*************************************************/
+
+/* This is called from the following function to find the next message for
+a connection from a batch collected during the first phase of a 2-stage queue
+run, avoiding the hints database lookup and rewrite.  The first delivery
+process of the second phase inherits the batches from the queue runner; the
+part of a batch beyond the chosen message is passed on down the chain of
+continued deliveries (-MCB) in continue_batch.
+
+Arguments:	as for transport_check_waiting()
+Returns:	TRUE if new_message_id set; FALSE otherwise
+*/
+
+static BOOL
+transport_check_batch(const uschar * transport_name, const uschar * hostname,
+  uschar * new_message_id, oicf oicf_func, void * oicf_data)
+{
+const uschar * batch = continue_batch;
+
+if (!batch && queue_run_batches)
+  {
+  tree_node * t = tree_search(queue_run_batches,
+			string_sprintf("%s/%s", transport_name, hostname));
+  if (t)
+    {
+    batch = string_from_gstring(t->data.ptr);
+    t->data.ptr = NULL;		/* Only one connection gets the batch */
+    }
+  }
+if (!batch) return FALSE;
+continue_batch = NULL;
+
+for (int len = Ustrlen(batch); len >= MESSAGE_ID_LENGTH;
+     batch += MESSAGE_ID_LENGTH, len -= MESSAGE_ID_LENGTH)
+  {
+  uschar mid[MESSAGE_ID_LENGTH + 1], subdir[2];
+  struct stat statbuf;
+
+  Ustrncpy_nt(mid, batch, MESSAGE_ID_LENGTH);
+  mid[MESSAGE_ID_LENGTH] = '\0';
+
+  if (Ustrcmp(mid, message_id) == 0) continue;
+  set_subdir_str(subdir, mid, 0);
+  if (Ustat(spool_fname(US"input", subdir, mid, US"-D"), &statbuf) != 0)
+    continue;
+  if (oicf_func && !oicf_func(mid, oicf_data)) continue;
+
+  Ustrcpy_nt(new_message_id, mid);
+  if ((len -= MESSAGE_ID_LENGTH) > 0)
+    continue_batch = string_copyn(batch + MESSAGE_ID_LENGTH,
+		  MIN(len, CONTINUE_BATCH_MAX * MESSAGE_ID_LENGTH));
+  DEBUG(D_transport) debug_printf_indent("%s from batch for %s, %d more\n",
+    new_message_id, hostname, len / MESSAGE_ID_LENGTH);
+  return TRUE;
+  }
+
+DEBUG(D_transport) debug_printf_indent("batch for %s used up\n", hostname);
+return FALSE;
+}
+
+
+
+
 /*************************************************
 *         Test for waiting messages              *
 *************************************************/
@@ -1713,6 +2072,16 @@ if (local_message_max > 0 && continue_sequence >= local_message_max)
   goto retfalse;
   }
 
+/* Use any batch we were given before going to the database; once that is
+used up, the database is consulted for messages that arrived since. */
+
+if (transport_check_batch(transport_name, hostname, new_message_id,
+      oicf_func, oicf_data))
+  {
+  DEBUG(D_transport) {acl_level--; debug_printf("transport_check_waiting: TRUE\n"); }
+  return TRUE;
+  }
+
 /* Open the waiting information database. */
 
 if (!(dbm_file = dbfn_open(string_sprintf("wait-%.200s", transport_name),
@@ -1926,6 +2295,73 @@ DEBUG(D_transport) {acl_level--; debug_printf("transport_check_waiting: FALSE\n"
 return FALSE;
 }
 
+
+
+#ifndef DISABLE_QUEUE_RAMP
+/*************************************************
+*   Kick messages waiting for a recovered host   *
+*************************************************/
+
+/* This function is called at the end of a delivery, when a host that had a
+retry record has been used successfully. The messages listed in the waiting
+database for the host would otherwise wait for a queue runner to reach them,
+possibly long after the host has come back. Ask the daemon to start a
+single-message queue run for some of them; each such delivery can then take
+further waiting messages down its connection in the usual way.
+
+The oldest entries of the main record are used, because a continued connection
+takes messages from the other end. The database is not changed here. The
+daemon drops requests it has no spare queue runner for, so the number of
+deliveries started at once is bounded by the queue_run_max setting as well as
+by the limit given.
+
+Arguments:
+  transport_name     name of the transport
+  hostname           name of the host
+  max                maximum number of messages to notify
+
+Returns:             nothing
+*/
+
+void
+transport_kick_waiting(const uschar * transport_name, const uschar * hostname,
+  int max)
+{
+dbdata_wait * host_record;
+open_db dbblock, * dbm_file;
+int kicked = 0;
+
+if (!(dbm_file = dbfn_open(string_sprintf("wait-%.200s", transport_name),
+			  O_RDONLY, &dbblock, FALSE, TRUE)))
+  return;
+
+if ((host_record = dbfn_read(dbm_file, hostname))
+   && host_record->count <= WAIT_NAME_MAX)
+  for (int i = 0; i < host_record->count && kicked < max; i++)
+    {
+    uschar mid[MESSAGE_ID_LENGTH + 1], subdir[2];
+    struct stat statbuf;
+
+    Ustrncpy_nt(mid, host_record->text + i * MESSAGE_ID_LENGTH,
+      MESSAGE_ID_LENGTH);
+    mid[MESSAGE_ID_LENGTH] = 0;
+    if (!is_new_message_id(mid) || Ustrcmp(mid, message_id) == 0)
+      continue;
+
+    set_subdir_str(subdir, mid, 0);
+    if (Ustat(spool_fname(US"input", subdir, mid, US"-D"), &statbuf) != 0)
+      continue;
+
+    queue_notify_daemon(mid);
+    kicked++;
+    }
+dbfn_close(dbm_file);
+
+DEBUG(D_transport|D_retry) debug_printf("%d message%s waiting for %s notified\n",
+  kicked, kicked == 1 ? "" : "s", hostname);
+}
+#endif
+
 /*************************************************
 *    Deliver waiting message down same socket    *
 *************************************************/
@@ -1946,6 +2382,7 @@ if (continue_limit_mail || continue_limit_rcpt || continue_limit_rcptdom)
 				    i += 4;
 #endif
 if (queue_run_pid != (pid_t)0)	    i += 3;
+if (continue_batch)		    i += 2;
 #ifdef SUPPORT_SOCKS
 if (proxy_session)		    i += 5;
 #endif
@@ -2000,6 +2437,12 @@ if (queue_run_pid != (pid_t)0)
   argv[i++] = string_sprintf("%d", queue_run_pipe);
   }
 
+if (continue_batch)
+  {
+  argv[i++] = US"-MCB";
+  argv[i++] = continue_batch;
+  }
+
 #ifdef SUPPORT_SOCKS
 if (proxy_session)
   {
@@ -2042,6 +2485,13 @@ _exit(errno);         /* Note: must be _exit(), NOT exit() */
 get a clean delivery process, and to regain root privilege in cases where it
 has been given away.
 
+When deliver_drop_privilege is set, the new process would run as the Exim user
+anyway.  If this process is running as the Exim user, the option
+continue_in_process_max allows that many successive messages to be delivered
+in forked processes without the exec, carrying over the configuration, the TLS
+library setup and any loaded lookup modules.  The count bounds the store that
+each generation inherits from the last.
+
 Arguments:
   transport_name  to pass to the new process
   hostname        ditto
@@ -2082,6 +2532,14 @@ if ((pid = exim_fork(US"continued-transport-interproc")) == 0)
     _exit(EXIT_SUCCESS);
   testharness_pause_ms(1000);
 
+  if (  inproc_continues < continue_in_process_max
+     && deliver_drop_privilege
+     && getuid() == exim_uid && geteuid() == exim_uid)
+    {
+    inproc_continues++;
+    deliver_continue_in_process(transport_name, hostname, hostaddress,
+      id, socket_fd);
+    }
   transport_do_pass_socket(transport_name, hostname, hostaddress,
     id, socket_fd);
   }
@@ -41,6 +41,7 @@ optionlist appendfile_transport_options[] = {
   { "check_string",      opt_stringptr,	LOFF(check_string) },
   { "create_directory",  opt_bool,	LOFF(create_directory) },
   { "create_file",       opt_stringptr,	LOFF(create_file_string) },
+  { "deliver_in_process", opt_bool | opt_public, OPT_OFF(transport_instance, deliver_in_process) },
   { "directory",         opt_stringptr,	LOFF(dirname) },
   { "directory_file",    opt_stringptr,	LOFF(dirfilename) },
   { "directory_mode",    opt_octint,	LOFF(dirmode) },
@@ -58,8 +59,10 @@ optionlist appendfile_transport_options[] = {
   { "mailbox_size",      opt_stringptr,	LOFF(mailbox_size_string) },
 #ifdef SUPPORT_MAILDIR
   { "maildir_format",    opt_bool,	LOFF(maildir_format ) } ,
+  { "maildir_link_copies", opt_bool,	LOFF(maildir_link_copies) },
   { "maildir_quota_directory_regex", opt_stringptr, LOFF(maildir_dir_regex) },
   { "maildir_retries",   opt_int,	LOFF(maildir_retries) },
+  { "maildir_size_file_compact", opt_bool, LOFF(maildir_size_file_compact) },
   { "maildir_tag",       opt_stringptr,	LOFF(maildir_tag) },
   { "maildir_use_size_file", opt_expand_bool, LOFF(maildir_use_size_file ) } ,
   { "maildirfolder_create_regex", opt_stringptr, LOFF(maildirfolder_create_regex ) },
@@ -153,6 +156,45 @@ static const char *mailbox_formats[] = {
   (!ob->quota_warn_threshold_is_percent || ob->quota_value > 0))
 
 
+#ifdef SUPPORT_MAILDIR
+/* The file written by the last maildir delivery with maildir_link_copies set.
+When the transport runs in the delivery process, a further delivery of the same
+message can link this file instead of writing the message out again. */
+
+static struct {
+  const transport_instance * tblock;
+  uschar	message_id[MESSAGE_ID_LENGTH + 1];
+  uschar *	return_path;
+  uschar *	path;
+  uid_t		uid;
+  gid_t		gid;
+  int		mode;
+  int		size;
+  int		linecount;
+} maildir_last = {0};
+
+
+/* A file can be shared only when nothing that is written into it can differ
+between deliveries. Headers added or removed by the router or the transport,
+header rewriting, a transport filter and the message prefix and suffix may all
+depend on the address, so any of them rules linking out, both to and from the
+file. So do the Envelope-To: and Delivery-Date: headers. */
+
+static BOOL
+maildir_linkable(const transport_instance * tblock,
+  const appendfile_transport_options_block * ob, const address_item * addr)
+{
+return ob->maildir_link_copies
+  && !addr->prop.extra_headers && !addr->prop.remove_headers
+  && !tblock->add_headers && !tblock->remove_headers
+  && !tblock->rewrite_rules && !tblock->filter_command
+  && !(ob->message_prefix && *ob->message_prefix)
+  && !(ob->message_suffix && *ob->message_suffix)
+  && !tblock->envelope_to_add && !tblock->delivery_date_add;
+}
+#endif
+
+
 
 /*************************************************
 *              Setup entry point                 *
@@ -1178,6 +1220,7 @@ FILE *temp_file = NULL;
 #ifdef SUPPORT_MAILDIR
 int maildirsize_fd = -1;      /* fd for maildirsize file */
 int maildir_save_errno;
+const uschar * linkfrom = NULL; /* earlier copy to link, for maildir */
 #endif
 
 
@@ -2439,6 +2482,19 @@ else
       goto ret_panic;
       }
 
+    /* If maildir_link_copies is set and an earlier delivery of this message by
+    this transport left a file with the same owner and mode, and with the same
+    Return-Path:, link that file in place of writing out a new copy. Anything
+    that can make the content differ for each delivery rules this out. */
+
+    if (  maildir_last.path && maildir_linkable(tblock, ob, addr)
+       && maildir_last.tblock == tblock
+       && Ustrcmp(maildir_last.message_id, message_id) == 0
+       && Ustrcmp(maildir_last.return_path, return_path) == 0
+       && maildir_last.uid == uid && maildir_last.gid == gid
+       && maildir_last.mode == mode)
+      linkfrom = maildir_last.path;
+
     /* We ensured the existence of all the relevant directories above. Attempt
     to open the temporary file a limited number of times. I think this rather
     scary-looking for statement is actually OK. If open succeeds, the loop is
@@ -2462,6 +2518,22 @@ else
         errno = EEXIST;
       else if (errno == ENOENT)
         {
+        if (linkfrom)
+          {
+          if (Ulink(linkfrom, filename) == 0)
+            {
+            if ((fd = Uopen(filename, O_RDONLY, 0)) >= 0)
+              {
+              DEBUG(D_transport) debug_printf("linked %s as %s\n",
+                linkfrom, filename);
+              break;
+              }
+            Uunlink(filename);
+            }
+          DEBUG(D_transport) debug_printf("link from %s failed: %s\n",
+            linkfrom, strerror(errno));
+          linkfrom = NULL;
+          }
         if ((fd = Uopen(filename, O_WRONLY | O_CREAT | O_EXCL, mode)) >= 0)
 	  break;
         DEBUG (D_transport) debug_printf ("open failed for %s: %s\n",
@@ -2749,6 +2821,18 @@ functions. */
 transport_count = 0;
 transport_newlines = 0;
 
+/* A maildir file linked from an earlier delivery is already complete and on
+disk; take its counts and skip the writing. */
+
+#ifdef SUPPORT_MAILDIR
+if (yield == OK && linkfrom)
+  {
+  transport_count = maildir_last.size;
+  transport_newlines = maildir_last.linecount + 1;
+  goto WRITTEN;
+  }
+#endif
+
 /* Write any configured prefix text first */
 
 if (yield == OK && ob->message_prefix && *ob->message_prefix)
@@ -2869,6 +2953,10 @@ fsync() to be called for a FIFO. */
 
 if (yield == OK && !isfifo && EXIMfsync(fd) < 0) yield = DEFER;
 
+#ifdef SUPPORT_MAILDIR
+WRITTEN:
+#endif
+
 /* Update message_size and message_linecount to the accurate count of bytes
 written, including added headers. Note; we subtract 1 from message_linecount as
 this variable doesn't count the new line between the header and the body of the
@@ -2889,6 +2977,7 @@ if (!disable_quota)
   maildir_save_errno = errno;    /* Preserve errno while closing the file */
   if (maildirsize_fd >= 0)
     (void)close(maildirsize_fd);
+  maildir_check_sizefile();
   errno = maildir_save_errno;
   }
 #endif  /* SUPPORT_MAILDIR */
@@ -3209,6 +3298,32 @@ else
           DEBUG(D_transport) debug_printf("renamed %s as %s\n", filename,
             renamename);
           filename = dataname = NULL;   /* Prevents attempt to unlink at end */
+
+#ifdef SUPPORT_MAILDIR
+          /* Remember a newly-written maildir file for linking further copies
+          of the message. */
+
+          if (  mbformat == mbf_maildir && !linkfrom
+             && maildir_linkable(tblock, ob, addr))
+            {
+            if (maildir_last.path)
+              {
+              store_free(maildir_last.path);
+              store_free(maildir_last.return_path);
+              }
+            maildir_last.tblock = tblock;
+            Ustrncpy(maildir_last.message_id, message_id, MESSAGE_ID_LENGTH);
+            maildir_last.message_id[MESSAGE_ID_LENGTH] = 0;
+            maildir_last.return_path = string_copy_malloc(return_path);
+            maildir_last.path = string_copy_malloc(
+              string_sprintf("%s/%s", path, renamename));
+            maildir_last.uid = uid;
+            maildir_last.gid = gid;
+            maildir_last.mode = mode;
+            maildir_last.size = message_size;
+            maildir_last.linecount = message_linecount;
+            }
+#endif
           }
         }        /* maildir or mailstore */
       }          /* successful write + close */
@@ -67,7 +67,9 @@ typedef struct {
   BOOL  file_must_exist;
   BOOL  mode_fail_narrower;
   BOOL  maildir_format;
+  BOOL  maildir_link_copies;
   BOOL  maildir_use_size_file;
+  BOOL  maildir_size_file_compact;
   BOOL  mailstore_format;
   BOOL  mbx_format;
   BOOL  quota_warn_threshold_is_percent;
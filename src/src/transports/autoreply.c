@@ -248,6 +248,94 @@ return NULL;
 
 
 
+/*************************************************
+*          Expire records in a once DBM          *
+*************************************************/
+
+/* With once_repeat set, a record older than the repeat time has no effect, as
+the message is sent anyway. Such records are deleted in one pass at most once
+per repeat time, so that the DBM file stays the size of the recent recipient
+set rather than growing without limit. The time of the last pass is kept
+under the empty key, which no address can have. The keys are collected before
+any deletion, as not all DBM libraries allow a scan to continue across one.
+
+Arguments:
+  dbm_file	the open once DBM
+  now		the current time
+  repeat	the once_repeat time
+
+Returns:	nothing
+*/
+
+static void
+once_dbm_expire(EXIM_DB * dbm_file, time_t now, time_t repeat)
+{
+EXIM_DATUM key_datum, value_datum;
+EXIM_CURSOR * cursor;
+gstring * keys = NULL;
+time_t then;
+int deleted = 0;
+rmark reset_point = store_mark();
+
+exim_datum_init(&key_datum);
+exim_datum_init(&value_datum);
+exim_datum_data_set(&key_datum, US"");
+exim_datum_size_set(&key_datum, 1);
+if (  exim_dbget(dbm_file, &key_datum, &value_datum)
+   && exim_datum_size_get(&value_datum) == sizeof(time_t))
+  {
+  memcpy(&then, exim_datum_data_get(&value_datum), sizeof(time_t));
+  if (now - then < repeat) return;
+  }
+
+cursor = exim_dbcreate_cursor(dbm_file);
+for (BOOL first = TRUE;
+     exim_dbscan(dbm_file, &key_datum, &value_datum, first, cursor);
+     first = FALSE)
+  {
+  int len = exim_datum_size_get(&key_datum);
+  const uschar * k = exim_datum_data_get(&key_datum);
+
+  if (len > 1 && !k[len-1])
+    keys = string_catn(keys, k, len);
+  }
+exim_dbdelete_cursor(cursor);
+
+for (const uschar * k = keys ? string_from_gstring(keys) : NULL;
+     k && k < keys->s + keys->ptr; k += Ustrlen(k) + 1)
+  {
+  exim_datum_init(&key_datum);
+  exim_datum_init(&value_datum);
+  exim_datum_data_set(&key_datum, (void *) k);
+  exim_datum_size_set(&key_datum, Ustrlen(k) + 1);
+  if (  exim_dbget(dbm_file, &key_datum, &value_datum)
+     && exim_datum_size_get(&value_datum) == sizeof(time_t))
+    {
+    memcpy(&then, exim_datum_data_get(&value_datum), sizeof(time_t));
+    if (now - then >= repeat)
+      {
+      exim_dbdel(dbm_file, &key_datum);
+      deleted++;
+      }
+    }
+  }
+
+exim_datum_init(&key_datum);
+exim_datum_init(&value_datum);
+exim_datum_data_set(&key_datum, US"");
+exim_datum_size_set(&key_datum, 1);
+exim_datum_data_set(&value_datum, &now);
+exim_datum_size_set(&value_datum, sizeof(time_t));
+exim_dbput(dbm_file, &key_datum, &value_datum);
+
+DEBUG(D_transport)
+  debug_printf("%d expired record%s deleted from once DBM\n",
+    deleted, deleted == 1 ? "" : "s");
+store_reset(reset_point);
+}
+
+
+
 /*************************************************
 *              Main entry point                  *
 *************************************************/
@@ -748,6 +836,8 @@ else if (dbm_file)
   exim_datum_data_set(&value_datum, &now);
   exim_datum_size_set(&value_datum, sizeof(time_t));
   exim_dbput(dbm_file, &key_datum, &value_datum);
+
+  if (once_repeat_sec > 0) once_dbm_expire(dbm_file, now, once_repeat_sec);
   }
 
 /* If sending failed, defer to try again - but if once is set the next
@@ -52,6 +52,10 @@ BOOL lmtp_transport_entry(transport_instance *tblock, address_item *addr) {retur
 
 #else   /*!MACRO_PREDEF*/
 
+/* Commands held for a pipelined write, if any */
+
+static gstring * lmtp_pipe = NULL;
+
 
 /* Default private options block for the lmtp transport. */
 
@@ -212,7 +216,8 @@ return FALSE;
 *************************************************/
 
 /* The formatted command is left in big_buffer so that it can be reflected in
-any error message.
+any error message. When commands are being pipelined, it is added to the
+pending output instead of being written; lmtp_flush() sends it.
 
 Arguments:
   fd         the fd to write to
@@ -241,7 +246,13 @@ if (!string_vformat(&gs, SVFMT_TAINT_NOCHK, CS format, ap))
   return FALSE;
   }
 va_end(ap);
-DEBUG(D_transport|D_v) debug_printf("  LMTP>> %Y", &gs);
+DEBUG(D_transport|D_v) debug_printf("  LMTP%s>> %Y", lmtp_pipe ? "|" : "", &gs);
+if (lmtp_pipe)
+  {
+  lmtp_pipe = string_catn(lmtp_pipe, gs.s, gs.ptr);
+  gs.ptr -= 2; string_from_gstring(&gs);
+  return TRUE;
+  }
 rc = write(fd, gs.s, gs.ptr);
 gs.ptr -= 2; string_from_gstring(&gs); /* remove \r\n for debug and error message */
 if (rc > 0) return TRUE;
@@ -251,6 +262,72 @@ return FALSE;
 
 
 
+/*************************************************
+*        Restore command for error messages      *
+*************************************************/
+
+/* When pipelining, the responses are read after all the commands have been
+written, so the command that each one belongs to is put back in big_buffer
+before it is read.
+
+Arguments:
+  format     a format for the command, without the CRLF
+  ...        data for the format
+
+Returns:     nothing
+*/
+
+static void
+lmtp_command_text(const char * format, ...)
+{
+gstring gs = { .size = big_buffer_size, .ptr = 0, .s = big_buffer };
+va_list ap;
+
+va_start(ap, format);
+(void) string_vformat(&gs, SVFMT_TAINT_NOCHK, CS format, ap);
+va_end(ap);
+string_from_gstring(&gs);
+}
+
+
+
+/*************************************************
+*          Write pipelined LMTP commands         *
+*************************************************/
+
+/* Send the commands saved by lmtp_write_command() since pipelining was
+started, and stop pipelining.
+
+Arguments:
+  fd         the fd to write to
+
+Returns:     TRUE if successful, FALSE if not, with errno set
+*/
+
+static BOOL
+lmtp_flush(int fd)
+{
+gstring * g = lmtp_pipe;
+int done = 0;
+
+lmtp_pipe = NULL;
+DEBUG(D_transport|D_v) debug_printf("  LMTP>> flush %d bytes\n", gstring_length(g));
+while (done < gstring_length(g))
+  {
+  int rc = write(fd, g->s + done, g->ptr - done);
+  if (rc < 0)
+    {
+    if (errno == EINTR) continue;
+    DEBUG(D_transport) debug_printf("write failed: %s\n", strerror(errno));
+    return FALSE;
+    }
+  done += rc;
+  }
+return TRUE;
+}
+
+
+
 
 /*************************************************
 *              Read LMTP response                *
@@ -448,6 +525,76 @@ return buffer[0] == okdigit;
 
 
 
+/*************************************************
+*       Handle responses to MAIL and RCPT        *
+*************************************************/
+
+/* Read the response to MAIL FROM, noting a temporary error code in the
+address for the retry logic.
+
+Arguments:
+  f         a file to read from
+  addrlist  the first address
+  buffer    where to put the response
+  size      the size of the buffer
+  timeout   the timeout to use
+
+Returns:    TRUE if the sender was accepted
+*/
+
+static BOOL
+lmtp_mail_response(FILE * f, address_item * addrlist, uschar * buffer,
+  int size, int timeout)
+{
+if (lmtp_read_response(f, buffer, size, '2', timeout))
+  return TRUE;
+if (errno == 0 && buffer[0] == '4')
+  {
+  errno = ERRNO_MAIL4XX;
+  addrlist->more_errno |= ((buffer[1] - '0')*10 + buffer[2] - '0') << 8;
+  }
+return FALSE;
+}
+
+
+/* Read the response to RCPT TO and set the status of the address. An accepted
+address is left PENDING_OK until the response after the data.
+
+Arguments:
+  f         a file to read from
+  addr      the address
+  buffer    where to put the response
+  size      the size of the buffer
+  timeout   the timeout to use
+  send_data set TRUE if the address was accepted
+
+Returns:    FALSE if the connection has failed; TRUE otherwise
+*/
+
+static BOOL
+lmtp_rcpt_response(FILE * f, address_item * addr, uschar * buffer, int size,
+  int timeout, BOOL * send_data)
+{
+if (lmtp_read_response(f, buffer, size, '2', timeout))
+  {
+  *send_data = TRUE;
+  addr->transport_return = PENDING_OK;
+  return TRUE;
+  }
+if (errno != 0 || buffer[0] == 0) return FALSE;
+addr->message = string_sprintf("LMTP error after %s: %s", big_buffer,
+  string_printing(buffer));
+setflag(addr, af_pass_message);   /* Allow message to go to user */
+if (buffer[0] == '5') addr->transport_return = FAIL; else
+  {
+  addr->basic_errno = ERRNO_RCPT4XX;
+  addr->more_errno |= ((buffer[1] - '0')*10 + buffer[2] - '0') << 8;
+  }
+return TRUE;
+}
+
+
+
 
 
 
@@ -473,12 +620,12 @@ struct sockaddr_un sockun;         /* don't call this "sun" ! */
 int timeout = ob->timeout;
 int fd_in = -1, fd_out = -1;
 int code, save_errno;
-BOOL send_data;
+BOOL send_data, pipelining;
 BOOL yield = FALSE;
 uschar *igquotstr = US"";
 uschar *sockname = NULL;
 const uschar **argv;
-uschar buffer[256];
+uschar buffer[1024];
 
 DEBUG(D_transport) debug_printf("%s transport entered\n", tblock->name);
 
@@ -577,20 +724,21 @@ if (ob->ignore_quota)
   igquotstr = regex_match(regex_IGNOREQUOTA, buffer, -1, NULL)
     ? US" IGNOREQUOTA" : US"";
 
+/* If the server supports PIPELINING, the envelope and the DATA command are
+sent in a single write, and the responses are read afterwards (RFC 2920).
+Otherwise each command waits for its response. */
+
+if ((pipelining = regex_match(regex_PIPELINING, buffer, -1, NULL)))
+  lmtp_pipe = string_get(256);
+
 /* Now the envelope sender */
 
 if (!lmtp_write_command(fd_in, "MAIL FROM:<%s>\r\n", return_path))
   goto WRITE_FAILED;
 
-if (!lmtp_read_response(out, buffer, sizeof(buffer), '2', timeout))
-  {
-  if (errno == 0 && buffer[0] == '4')
-    {
-    errno = ERRNO_MAIL4XX;
-    addrlist->more_errno |= ((buffer[1] - '0')*10 + buffer[2] - '0') << 8;
-    }
+if (  !pipelining
+   && !lmtp_mail_response(out, addrlist, buffer, sizeof(buffer), timeout))
   goto RESPONSE_FAILED;
-  }
 
 /* Next, we hand over all the recipients. Some may be permanently or
 temporarily rejected; others may be accepted, for now. */
@@ -601,23 +749,42 @@ for (address_item * addr = addrlist; addr; addr = addr->next)
   if (!lmtp_write_command(fd_in, "RCPT TO:<%s>%s\r\n",
        transport_rcpt_address(addr, tblock->rcpt_include_affixes), igquotstr))
     goto WRITE_FAILED;
-  if (lmtp_read_response(out, buffer, sizeof(buffer), '2', timeout))
-    {
-    send_data = TRUE;
-    addr->transport_return = PENDING_OK;
-    }
-  else
+  if (  !pipelining
+     && !lmtp_rcpt_response(out, addr, buffer, sizeof(buffer), timeout,
+	  &send_data))
+    goto RESPONSE_FAILED;
+  }
+
+/* When pipelining, send DATA along with the envelope, then collect the
+responses in order. The command text is put back in big_buffer before each
+one for any error message. */
+
+if (pipelining)
+  {
+  if (!lmtp_write_command(fd_in, "DATA\r\n") || !lmtp_flush(fd_in))
+    goto WRITE_FAILED;
+
+  lmtp_command_text("MAIL FROM:<%s>", return_path);
+  if (!lmtp_mail_response(out, addrlist, buffer, sizeof(buffer), timeout))
+    goto RESPONSE_FAILED;
+
+  for (address_item * addr = addrlist; addr; addr = addr->next)
     {
-    if (errno != 0 || buffer[0] == 0) goto RESPONSE_FAILED;
-    addr->message = string_sprintf("LMTP error after %s: %s", big_buffer,
-      string_printing(buffer));
-    setflag(addr, af_pass_message);   /* Allow message to go to user */
-    if (buffer[0] == '5') addr->transport_return = FAIL; else
-      {
-      addr->basic_errno = ERRNO_RCPT4XX;
-      addr->more_errno |= ((buffer[1] - '0')*10 + buffer[2] - '0') << 8;
-      }
+    lmtp_command_text("RCPT TO:<%s>%s",
+      transport_rcpt_address(addr, tblock->rcpt_include_affixes), igquotstr);
+    if (!lmtp_rcpt_response(out, addr, buffer, sizeof(buffer), timeout,
+	  &send_data))
+      goto RESPONSE_FAILED;
     }
+  Ustrcpy(big_buffer, US"DATA");
+
+  /* With no good recipients, the server should have refused DATA. If it did
+  not, end the empty message at once. */
+
+  if (!send_data
+     && lmtp_read_response(out, buffer, sizeof(buffer), '3', timeout)
+     && !lmtp_write_command(fd_in, ".\r\n"))
+    goto WRITE_FAILED;
   }
 
 /* Now send the text of the message if there were any good recipients. */
@@ -633,7 +800,8 @@ if (send_data)
     ob->options
   };
 
-  if (!lmtp_write_command(fd_in, "DATA\r\n")) goto WRITE_FAILED;
+  if (!pipelining && !lmtp_write_command(fd_in, "DATA\r\n"))
+    goto WRITE_FAILED;
   if (!lmtp_read_response(out, buffer, sizeof(buffer), '3', timeout))
     {
     if (errno == 0 && buffer[0] == '4')
@@ -761,6 +929,7 @@ itself. This error will be applied to all the addresses. */
 
 WRITE_FAILED:
 
+lmtp_pipe = NULL;
 addrlist->transport_return = PANIC;
 addrlist->basic_errno = errno;
 if (errno == ERRNO_CHHEADER_FAIL)
@@ -57,6 +57,7 @@ optionlist pipe_transport_options[] = {
       OPT_OFF(transport_instance, return_fail_output) },
   { "return_output",     opt_bool | opt_public,
       OPT_OFF(transport_instance, return_output) },
+  { "socket",            opt_stringptr,	LOFF(skt) },
   { "temp_errors",       opt_stringptr,	LOFF(temp_errors) },
   { "timeout",           opt_time,	LOFF(timeout) },
   { "timeout_defer",     opt_bool,	LOFF(timeout_defer) },
@@ -234,15 +235,21 @@ if (ob->use_bsmtp)
   }
 
 /* If not batch SMTP, and message_prefix or message_suffix are unset, insert
-default values for them. */
+default values for them. Deliveries to a socket do not use them. */
 
-else
+else if (!ob->skt)
   {
   if (ob->message_prefix == NULL) ob->message_prefix =
     US"From ${if def:return_path{$return_path}{MAILER-DAEMON}} ${tod_bsdinbox}\n";
   if (ob->message_suffix == NULL) ob->message_suffix = US"\n";
   }
 
+/* A delivery is either to a command or to a socket */
+
+if (ob->cmd && ob->skt)
+  log_write(0, LOG_PANIC_DIE|LOG_CONFIG,
+    "both command and socket set for %s transport", tblock->name);
+
 /* The restrict_to_path  and use_shell options are incompatible */
 
 if (ob->restrict_to_path && ob->use_shell)
@@ -495,6 +502,226 @@ return TRUE;
 
 
 
+/*************************************************
+*          Write a block to a socket             *
+*************************************************/
+
+/* Arguments:
+  sock      the socket
+  s         the data
+  len       its length
+
+Returns:    TRUE if all was written; FALSE with errno set if not
+*/
+
+static BOOL
+pipe_socket_write(int sock, const uschar * s, int len)
+{
+while (len > 0)
+  {
+  int rc = write(sock, s, len);
+  if (rc < 0)
+    {
+    if (errno == EINTR && !sigalrm_seen) continue;
+    if (sigalrm_seen) errno = ETIMEDOUT;
+    return FALSE;
+    }
+  s += rc;
+  len -= rc;
+  }
+return TRUE;
+}
+
+
+
+/*************************************************
+*       Deliver to a worker over a socket        *
+*************************************************/
+
+/* When the socket option is set, no command is run. Instead, the transport
+connects to a worker process that is already running, and sends it the message
+framed by an envelope:
+
+  MESSAGE <message id>
+  SENDER <return path>
+  RECIPIENT <address>     (one line for each address in the batch)
+  SIZE <number of bytes in the message>
+  <empty line>
+  <the message>
+
+The reply is a single line starting with OK, DEFER, or FAIL, optionally
+followed by text that is used as the delivery's message. The worker may then
+wait for the next connection. The message is written to a temporary file first
+so that its size is known in advance.
+
+Arguments:
+  tblock     the transport instance
+  addr       the address(es) being delivered
+  ob         the private options block
+  tctx       context for writing the message
+
+Returns:     nothing; the status is set in the first address
+*/
+
+static void
+pipe_socket_deliver(transport_instance * tblock, address_item * addr,
+  pipe_transport_options_block * ob, transport_ctx * tctx)
+{
+const uschar * spec;
+uschar * errstr, * s;
+uschar reply[256];
+gstring * g;
+FILE * tmp;
+int sock, size, rc, len = 0;
+int timeout = ob->timeout;
+
+if (!(spec = expand_string(ob->skt)))
+  {
+  addr->transport_return = f.search_find_defer ? DEFER : PANIC;
+  addr->message = string_sprintf("Expansion of \"%s\" (socket for %s "
+    "transport) failed: %s", ob->skt, tblock->name, expand_string_message);
+  return;
+  }
+if (is_tainted(spec))
+  {
+  addr->transport_return = PANIC;
+  addr->message = string_sprintf("Tainted '%s' (socket "
+    "for %s transport) not permitted", spec, tblock->name);
+  return;
+  }
+
+if (f.dont_deliver)
+  {
+  DEBUG(D_transport)
+    debug_printf("*** delivery by %s transport bypassed by -N option",
+      tblock->name);
+  return;
+  }
+
+if (!(tmp = tmpfile()))
+  {
+  addr->transport_return = DEFER;
+  addr->basic_errno = errno;
+  addr->message = US"while setting up temporary file";
+  return;
+  }
+
+tctx->u.fd = fileno(tmp);
+transport_count = 0;
+if (!transport_write_message(tctx, 0))
+  {
+  addr->transport_return = PANIC;
+  addr->basic_errno = errno;
+  addr->message = errno == ERRNO_CHHEADER_FAIL
+    ? string_sprintf("Failed to expand headers_add or headers_remove: %s",
+	expand_string_message)
+    : errno == ERRNO_FILTER_FAIL
+    ? string_sprintf("Transport filter process failed (%d)", addr->more_errno)
+    : string_sprintf("Error %d while writing temporary file", errno);
+  (void)fclose(tmp);
+  return;
+  }
+size = transport_count;
+
+DEBUG(D_transport) debug_printf("connecting to %s\n", spec);
+if ((sock = ip_streamsocket(spec, &errstr, timeout, NULL)) < 0)
+  {
+  addr->transport_return = DEFER;
+  addr->message = string_sprintf("%s transport: %s", tblock->name, errstr);
+  (void)fclose(tmp);
+  return;
+  }
+
+g = string_fmt_append(NULL, "MESSAGE %s\nSENDER %s\n", message_id, return_path);
+for (address_item * a = addr; a; a = a->next)
+  g = string_fmt_append(g, "RECIPIENT %s\n",
+    transport_rcpt_address(a, tblock->rcpt_include_affixes));
+g = string_fmt_append(g, "SIZE %d\n\n", size);
+
+/* Send the envelope and the message, then wait for the reply, all within the
+timeout. */
+
+sigalrm_seen = FALSE;
+ALARM(timeout);
+
+rc = pipe_socket_write(sock, g->s, g->ptr) && lseek(fileno(tmp), 0, SEEK_SET) == 0;
+while (rc && size > 0)
+  {
+  int n = read(fileno(tmp), big_buffer,
+    size < big_buffer_size ? size : big_buffer_size);
+  if (n <= 0) { rc = FALSE; if (n == 0) errno = ERRNO_WRITEINCOMPLETE; break; }
+  rc = pipe_socket_write(sock, big_buffer, n);
+  size -= n;
+  }
+
+while (rc && len < sizeof(reply) - 1)
+  {
+  int n = read(sock, reply + len, sizeof(reply) - 1 - len);
+  if (n < 0 && errno == EINTR && !sigalrm_seen) continue;
+  if (n <= 0)
+    {
+    if (sigalrm_seen) errno = ETIMEDOUT;
+    else if (n == 0) errno = ERRNO_SMTPCLOSED;
+    rc = FALSE;
+    break;
+    }
+  len += n;
+  if (memchr(reply, '\n', len)) break;
+  }
+
+ALARM_CLR(0);
+(void)close(sock);
+(void)fclose(tmp);
+
+if (!rc)
+  {
+  if (errno == ETIMEDOUT)
+    {
+    addr->transport_return = ob->timeout_defer ? DEFER : FAIL;
+    addr->message = string_sprintf("timeout on socket %s for %s transport",
+      spec, tblock->name);
+    }
+  else
+    {
+    addr->transport_return = DEFER;
+    addr->basic_errno = errno;
+    addr->message = string_sprintf("%s on socket %s for %s transport",
+      errno == ERRNO_SMTPCLOSED ? "connection closed" : "I/O error",
+      spec, tblock->name);
+    }
+  return;
+  }
+
+/* Interpret the reply */
+
+reply[len] = 0;
+for (s = reply; *s && *s != '\n' && *s != '\r'; ) s++;
+*s = 0;
+DEBUG(D_transport) debug_printf("%s transport reply: %s\n", tblock->name, reply);
+
+for (s = reply; isalpha(*s); ) s++;
+len = s - reply;
+while (isspace(*s)) s++;
+
+if (len == 2 && strncmpic(reply, US"OK", 2) == 0)
+  addr->transport_return = OK;
+else if (len == 5 && strncmpic(reply, US"DEFER", 5) == 0)
+  addr->transport_return = DEFER;
+else if (len == 4 && strncmpic(reply, US"FAIL", 4) == 0)
+  addr->transport_return = FAIL;
+else
+  {
+  addr->transport_return = DEFER;
+  addr->message = string_sprintf("unexpected reply from socket %s for %s "
+    "transport: %s", spec, tblock->name, string_printing(reply));
+  return;
+  }
+
+if (*s) addr->message = string_copy(string_printing(s));
+}
+
+
+
 /*************************************************
 *              Main entry point                  *
 *************************************************/
@@ -539,6 +766,16 @@ DEBUG(D_transport) debug_printf("%s transport entered\n", tblock->name);
 addr->transport_return = OK;
 addr->basic_errno = 0;
 
+/* A delivery to a worker over a socket does not use a command at all */
+
+if (ob->skt)
+  {
+  pipe_socket_deliver(tblock, addr, ob, &tctx);
+  if (addr->transport_return != OK)
+    addr->user_message = US"local delivery failed";
+  return FALSE;
+  }
+
 /* Pipes are not accepted as general addresses, but they can be generated from
 .forward files or alias files. In those cases, the pfr flag is set, and the
 command to be obeyed is pointed to by addr->local_part; it starts with the pipe
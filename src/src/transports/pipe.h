@@ -18,6 +18,7 @@ typedef struct {
   uschar *temp_errors;
   uschar *check_string;
   uschar *escape_string;
+  uschar *skt;
   int   umask;
   int   max_output;
   int   timeout;
@@ -68,9 +68,12 @@ if (!ob->dirname)
     "directory must be set for the %s transport", tblock->name);
 }
 
-/* This function will copy from a file to another
+/* This function will copy from a file to another. Where the OS can copy
+within the kernel (a reflink or copy_file_range() on Linux) that is tried
+first; the read/write loop is the fallback.
 
 Arguments:
+  tb         the transport block, for debug
   dst        fd to write to (the destination queue file)
   src        fd to read from (the spool queue file)
 
@@ -78,11 +81,24 @@ Returns:       TRUE if all went well, FALSE otherwise with errno set
 */
 
 static BOOL
-copy_spool_file(int dst, int src)
+copy_spool_file(const transport_instance * tb, int dst, int src)
 {
 int i, j;
 uschar buffer[16384];
 
+#ifdef OS_FILE_CLONE
+if (os_file_clone(dst, src) == 0)
+  {
+  DEBUG(D_transport) debug_printf("%s transport, copied in kernel\n",
+    tb->name);
+  return TRUE;
+  }
+DEBUG(D_transport) debug_printf("%s transport, kernel copy failed (%s), "
+  "using read/write\n", tb->name, strerror(errno));
+if (ftruncate(dst, 0) != 0 || lseek(dst, 0, SEEK_SET) != 0)
+  return FALSE;
+#endif
+
 if (lseek(src, 0, SEEK_SET) != 0)
   return FALSE;
 
@@ -106,7 +122,7 @@ Arguments:
   dstpath	destination directory name
   sdfd          int Source directory fd
   ddfd          int Destination directory fd
-  link_file     BOOL use linkat instead of data copy
+  link_file     BOOL try linkat before a data copy
   srcfd		fd for data file, or -1 for header file
 
 Returns:       TRUE if all went well, FALSE otherwise
@@ -133,33 +149,43 @@ if (link_file)
   if (linkat(sdfd, CCS filename, ddfd, CCS filename, 0) >= 0)
     return TRUE;
 
-  op = US"linking";
-  s = dstpath;
+  /* A link can be refused on the same filesystem (for example across bind
+  mounts, or by protected_hardlinks); copy instead, unless the file exists */
+
+  if (errno == EEXIST)
+    {
+    op = US"linking";
+    s = dstpath;
+    goto COPY_FAILED;
+    }
+  DEBUG(D_transport) debug_printf("%s transport, linking failed (%s)\n",
+    tb->name, strerror(errno));
   }
-else					/* use data copy */
-  {
-  DEBUG(D_transport) debug_printf("%s transport, copying %s => %s\n",
-    tb->name, srcpath, dstpath);
 
-  if (  (s = dstpath,
-	 (dstfd = exim_openat4(ddfd, CCS filename, O_RDWR|O_CREAT|O_EXCL, SPOOL_MODE))
-	 < 0
-	)
-     ||    is_hdr_file
-	&& (s = srcpath, (srcfd = exim_openat(sdfd, CCS filename, O_RDONLY)) < 0)
-     )
-    op = US"opening";
+/* Use data copy */
+
+DEBUG(D_transport) debug_printf("%s transport, copying %s => %s\n",
+  tb->name, srcpath, dstpath);
 
+if (  (s = dstpath,
+       (dstfd = exim_openat4(ddfd, CCS filename, O_RDWR|O_CREAT|O_EXCL, SPOOL_MODE))
+       < 0
+      )
+   ||    is_hdr_file
+      && (s = srcpath, (srcfd = exim_openat(sdfd, CCS filename, O_RDONLY)) < 0)
+   )
+  op = US"opening";
+
+else
+  if (s = dstpath, fchmod(dstfd, SPOOL_MODE) != 0)
+    op = US"setting perms on";
   else
-    if (s = dstpath, fchmod(dstfd, SPOOL_MODE) != 0)
-      op = US"setting perms on";
+    if (!copy_spool_file(tb, dstfd, srcfd))
+      op = US"creating";
     else
-      if (!copy_spool_file(dstfd, srcfd))
-	op = US"creating";
-      else
-	return TRUE;
-  }
+      return TRUE;
 
+COPY_FAILED:
 addr->basic_errno = errno;
 addr->message = string_sprintf("%s transport %s file: %s failed with error: %s",
   tb->name, op, s, strerror(errno));
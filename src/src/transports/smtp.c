@@ -37,9 +37,12 @@ optionlist smtp_transport_options[] = {
   { "authenticated_sender", opt_stringptr, LOFF(authenticated_sender) },
   { "authenticated_sender_force", opt_bool, LOFF(authenticated_sender_force) },
   { "command_timeout",      opt_time,	   LOFF(command_timeout) },
+  { "connect_race_delay",   opt_fixed,	   LOFF(connect_race_delay) },
+  { "connect_race_max",     opt_int,	   LOFF(connect_race_max) },
   { "connect_timeout",      opt_time,	   LOFF(connect_timeout) },
   { "connection_max_messages", opt_int | opt_public,
       OPT_OFF(transport_instance, connection_max_messages) },
+  { "connection_pool_time", opt_time,	   LOFF(connection_pool_time) },
 # ifdef SUPPORT_DANE
   { "dane_require_tls_ciphers", opt_stringptr, LOFF(dane_require_tls_ciphers) },
 # endif
@@ -74,6 +77,7 @@ optionlist smtp_transport_options[] = {
 #ifndef DISABLE_TLS
   { "hosts_avoid_tls",      opt_stringptr, LOFF(hosts_avoid_tls) },
 #endif
+  { "hosts_health_order",   opt_bool,	   LOFF(hosts_health_order) },
   { "hosts_max_try",        opt_int,	   LOFF(hosts_max_try) },
   { "hosts_max_try_hardlimit", opt_int,	   LOFF(hosts_max_try_hardlimit) },
 #ifndef DISABLE_TLS
@@ -116,6 +120,8 @@ optionlist smtp_transport_options[] = {
   { "lmtp_ignore_quota",    opt_bool,	   LOFF(lmtp_ignore_quota) },
   { "max_rcpt",             opt_stringptr | opt_public,
       OPT_OFF(transport_instance, max_addresses) },
+  { "max_rcpt_parallel",    opt_int | opt_public,
+      OPT_OFF(transport_instance, max_rcpt_parallel) },
   { "message_linelength_limit", opt_int,   LOFF(message_linelength_limit) },
   { "multi_domain",         opt_expand_bool | opt_public,
       OPT_OFF(transport_instance, multi_domain) },
@@ -123,6 +129,8 @@ optionlist smtp_transport_options[] = {
   { "protocol",             opt_stringptr, LOFF(protocol) },
   { "retry_include_ip_address", opt_expand_bool, LOFF(retry_include_ip_address) },
   { "serialize_hosts",      opt_stringptr, LOFF(serialize_hosts) },
+  { "serialize_hosts_adapt", opt_bool,     LOFF(serialize_hosts_adapt) },
+  { "serialize_hosts_max",  opt_stringptr, LOFF(serialize_hosts_max) },
   { "size_addition",        opt_int,	   LOFF(size_addition) },
 #ifdef SUPPORT_SOCKS
   { "socks_proxy",          opt_stringptr, LOFF(socks_proxy) },
@@ -185,6 +193,8 @@ smtp_transport_options_block smtp_transport_option_defaults = {
 #endif
   .command_timeout =		5*60,
   .connect_timeout =		5*60,
+  .connect_race_delay =		250,		/* fixed-point: 0.25s */
+  .connect_race_max =		1,
   .data_timeout =		5*60,
   .final_timeout =		10*60,
   .size_addition =		1024,
@@ -228,6 +238,8 @@ static uschar *smtp_command;		/* Points to last cmd for error messages */
 static uschar *mail_command;		/* Points to MAIL cmd for error messages */
 static uschar *data_command = US"";	/* Points to DATA cmd for error messages */
 static BOOL    update_waiting;		/* TRUE to update the "wait" database */
+static BOOL    host_tempfailed;		/* TRUE if the host sent a 4xx response */
+static int     host_banner_ms;		/* Time to the host's greeting, or -1 */
 
 /*XXX move to smtp_context */
 static BOOL    pipelining_active;	/* current transaction is in pipe mode */
@@ -383,6 +395,17 @@ flag that stops verify from showing router hosts. */
 
 if (ob->hosts_override && ob->hosts) tblock->overrides_hosts = TRUE;
 
+/* Host health records are kept by the daemon's shared cache; tell it they
+are wanted. */
+
+if (ob->hosts_health_order) host_health_used = TRUE;
+
+/* So is a copy of the EHLO responses cached for early pipelining */
+
+#ifndef DISABLE_PIPE_CONNECT
+if (ob->hosts_pipe_connect) pipe_connect_used = TRUE;
+#endif
+
 /* If there are any fallback hosts listed, build a chain of host items
 for them, but do not do any lookups at this time. */
 
@@ -569,6 +592,7 @@ if (buffer[0] != 0)
     "%s", pl, smtp_command, s = string_printing(buffer));
   *pass_message = TRUE;
   *yield = buffer[0];
+  if (buffer[0] == '4') host_tempfailed = TRUE;
   return TRUE;
   }
 
@@ -729,6 +753,13 @@ BOOL good_response;
 #endif
 good_response = smtp_read_response(sx, sx->buffer, sizeof(sx->buffer),
   '2', (SOB sx->conn_args.ob)->command_timeout);
+if (good_response)
+  {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  host_banner_ms = (now.tv_sec - sx->delivery_start.tv_sec) * 1000
+		  + (now.tv_usec - sx->delivery_start.tv_usec) / 1000;
+  }
 #ifdef EXPERIMENTAL_DSN_INFO
 sx->smtp_greeting = string_copy(sx->buffer);
 #endif
@@ -874,6 +905,67 @@ return Ustrchr(host->address, ':')
     host->port == PORT_NONE ? sx->port : host->port);
 }
 
+
+/* The hints DB is the lasting store for the EHLO cache, but opening and
+locking it for every outbound connection costs more than the pipelining
+saves.  Where there is a daemon, its shared cache holds a copy of each record:
+it is read first, copied into on a DB read, written through, and flushed when
+the DB record is removed.  The key is the kind name "ehlo" followed by the DB key.
+*/
+
+# define EHLO_SHARED_TTL	(60*60)
+
+static uschar *
+ehlo_shared_key(const uschar * dbkey, int * len)
+{
+int klen = Ustrlen(dbkey) + 1;
+uschar * key = store_get(5 + klen, dbkey);
+
+memcpy(key, "ehlo", 5);
+memcpy(key + 5, dbkey, klen);
+*len = 5 + klen;
+return key;
+}
+
+static void
+ehlo_shared_put(const uschar * dbkey, const dbdata_ehlo_resp * er)
+{
+uschar * key;
+int keylen, ttl = retry_data_expire - (int)(time(NULL) - er->time_stamp);
+
+if (ttl <= 0 || !search_shared_usable()) return;
+if (ttl > EHLO_SHARED_TTL) ttl = EHLO_SHARED_TTL;
+key = ehlo_shared_key(dbkey, &keylen);
+search_shared_put_raw(key, keylen, CUS er, (int)sizeof(*er), ttl);
+}
+
+static BOOL
+ehlo_shared_get(const uschar * dbkey, dbdata_ehlo_resp * er)
+{
+uschar * key, * data;
+int keylen, len;
+
+if (!search_shared_usable()) return FALSE;
+key = ehlo_shared_key(dbkey, &keylen);
+if (  !search_shared_get_raw(key, keylen, &data, &len)
+   || len != (int)sizeof(*er))
+  return FALSE;
+memcpy(er, data, sizeof(*er));
+return TRUE;
+}
+
+static void
+ehlo_shared_flush(const uschar * dbkey)
+{
+uschar * key;
+int keylen;
+
+if (!search_shared_usable()) return;
+key = ehlo_shared_key(dbkey, &keylen);
+search_shared_flush_raw(key, keylen);
+}
+
+
 /* Cache EHLO-response info for use by early-pipe.
 Called
 - During a normal flow on EHLO response (either cleartext or under TLS),
@@ -916,6 +1008,7 @@ if ((dbm_file = dbfn_open(US"misc", O_RDWR, &dbblock, TRUE, TRUE)))
 
   dbfn_write(dbm_file, ehlo_resp_key, &er, (int)sizeof(er));
   dbfn_close(dbm_file);
+  ehlo_shared_put(ehlo_resp_key, &er);	/* time_stamp set by the write */
   }
 }
 
@@ -923,11 +1016,14 @@ static void
 invalidate_ehlo_cache_entry(smtp_context * sx)
 {
 open_db dbblock, * dbm_file;
+uschar * ehlo_resp_key;
+
+if (!sx->early_pipe_active) return;
 
-if (  sx->early_pipe_active
-   && (dbm_file = dbfn_open(US"misc", O_RDWR, &dbblock, TRUE, TRUE)))
+ehlo_resp_key = ehlo_cache_key(sx);
+ehlo_shared_flush(ehlo_resp_key);
+if ((dbm_file = dbfn_open(US"misc", O_RDWR, &dbblock, TRUE, TRUE)))
   {
-  uschar * ehlo_resp_key = ehlo_cache_key(sx);
   HDEBUG(D_transport)
     {
     dbdata_ehlo_resp * er;
@@ -943,17 +1039,52 @@ if (  sx->early_pipe_active
   }
 }
 
+/* Take a cached EHLO response into the connection context */
+
+static void
+ehlo_cache_entry_use(smtp_context * sx, const dbdata_ehlo_resp * er)
+{
+DEBUG(D_transport)
+# ifdef EXPERIMENTAL_ESMTP_LIMITS
+  if (er->data.limit_mail || er->data.limit_rcpt || er->data.limit_rcptdom)
+    debug_printf("EHLO response bits from cache:"
+      " cleartext 0x%04x/0x%04x crypted 0x%04x/0x%04x lim %05d/%05d/%05d\n",
+      er->data.cleartext_features, er->data.cleartext_auths,
+      er->data.crypted_features, er->data.crypted_auths,
+      er->data.limit_mail, er->data.limit_rcpt, er->data.limit_rcptdom);
+  else
+# endif
+    debug_printf("EHLO response bits from cache:"
+      " cleartext 0x%04x/0x%04x crypted 0x%04x/0x%04x\n",
+      er->data.cleartext_features, er->data.cleartext_auths,
+      er->data.crypted_features, er->data.crypted_auths);
+
+sx->ehlo_resp = er->data;
+# ifdef EXPERIMENTAL_ESMTP_LIMITS
+ehlo_cache_limits_apply(sx);
+# endif
+}
+
 static BOOL
 read_ehlo_cache_entry(smtp_context * sx)
 {
 open_db dbblock;
 open_db * dbm_file;
+uschar * ehlo_resp_key = ehlo_cache_key(sx);
+dbdata_ehlo_resp shared_er;
+
+if (  ehlo_shared_get(ehlo_resp_key, &shared_er)
+   && time(NULL) - shared_er.time_stamp <= retry_data_expire)
+  {
+  DEBUG(D_transport) debug_printf("ehlo-resp record from shared cache\n");
+  ehlo_cache_entry_use(sx, &shared_er);
+  return TRUE;
+  }
 
 if (!(dbm_file = dbfn_open(US"misc", O_RDONLY, &dbblock, FALSE, TRUE)))
   { DEBUG(D_transport) debug_printf("ehlo-cache: no misc DB\n"); }
 else
   {
-  uschar * ehlo_resp_key = ehlo_cache_key(sx);
   dbdata_ehlo_resp * er;
 
   if (!(er = dbfn_read_enforce_length(dbm_file, ehlo_resp_key, sizeof(dbdata_ehlo_resp))))
@@ -967,25 +1098,8 @@ else
     }
   else
     {
-    DEBUG(D_transport)
-# ifdef EXPERIMENTAL_ESMTP_LIMITS
-      if (er->data.limit_mail || er->data.limit_rcpt || er->data.limit_rcptdom)
-	debug_printf("EHLO response bits from cache:"
-	  " cleartext 0x%04x/0x%04x crypted 0x%04x/0x%04x lim %05d/%05d/%05d\n",
-	  er->data.cleartext_features, er->data.cleartext_auths,
-	  er->data.crypted_features, er->data.crypted_auths,
-	  er->data.limit_mail, er->data.limit_rcpt, er->data.limit_rcptdom);
-      else
-# endif
-	debug_printf("EHLO response bits from cache:"
-	  " cleartext 0x%04x/0x%04x crypted 0x%04x/0x%04x\n",
-	  er->data.cleartext_features, er->data.cleartext_auths,
-	  er->data.crypted_features, er->data.crypted_auths);
-
-    sx->ehlo_resp = er->data;
-# ifdef EXPERIMENTAL_ESMTP_LIMITS
-    ehlo_cache_limits_apply(sx);
-# endif
+    ehlo_cache_entry_use(sx, er);
+    ehlo_shared_put(ehlo_resp_key, er);
     dbfn_close(dbm_file);
     return TRUE;
     }
@@ -1871,6 +1985,216 @@ return Ustrcmp(current_local_identity, message_local_identity) == 0;
 
 
 
+/* Connections held by the daemon.  The key is the destination and the local
+identity; the state is what a borrower needs to continue with the connection.
+Three NUL-terminated strings follow the state: the sending IP address, the TLS
+cipher and the SNI, the last two empty if TLS is not being proxied. */
+
+typedef struct {
+  int		sequence;
+  unsigned	peer_options;
+  int		sending_port;
+  BOOL		authenticated;
+  BOOL		dane;
+} pool_state;
+
+static uschar *
+pool_key(transport_instance * tblock, address_item * addrlist,
+  const host_item * host, int port)
+{
+const uschar * s_host = deliver_host, * s_address = deliver_host_address;
+int s_port = deliver_host_port;
+uschar * id = smtp_local_identity(sender_address, tblock);
+
+deliver_set_expansions(addrlist);	/* undo smtp_local_identity() */
+deliver_host = s_host;
+deliver_host_address = s_address;
+deliver_host_port = s_port;
+return string_sprintf("%s %s [%s]:%d %s", tblock->name, host->name,
+  host->address, port, id);
+}
+
+
+/* Offer the connection of a finished delivery to the daemon for reuse.
+If it is TLS, leave a proxy process holding the TLS session, as for passing
+the connection on, and offer the cleartext side.
+
+Returns:  TRUE if the daemon has the connection; the caller closes its copy
+*/
+
+static BOOL
+pool_park(smtp_context * sx)
+{
+smtp_transport_options_block * ob = sx->conn_args.ob;
+transport_instance * tblock = sx->conn_args.tblock;
+host_item * host = sx->conn_args.host;
+pool_state ps = {.sequence = continue_sequence,
+		 .peer_options = smtp_peer_options,
+		 .sending_port = sending_port,
+		 .authenticated = f.smtp_authenticated};
+const uschar * cipher = continue_proxy_cipher, * sni = continue_proxy_sni;
+int fd = sx->cctx.sock;
+gstring * g;
+#ifndef DISABLE_TLS
+int pfd[2];
+BOOL proxy = tls_out.active.sock >= 0;
+#endif
+
+if (  tblock->connection_max_messages > 0
+   && continue_sequence >= tblock->connection_max_messages)
+  return FALSE;
+#ifdef SUPPORT_SOCKS
+if (proxy_session) return FALSE;
+#endif
+
+if (sx->send_rset)
+  {
+  if (  smtp_write_command(sx, SCMD_FLUSH, "RSET\r\n") < 0
+     || !smtp_read_response(sx, sx->buffer, sizeof(sx->buffer), '2',
+			    ob->command_timeout))
+    return FALSE;
+  sx->send_rset = FALSE;
+  }
+
+ps.dane = continue_proxy_dane;
+#ifndef DISABLE_TLS
+if (proxy)
+  {
+  if (  verify_check_given_host(CUSS &ob->hosts_noproxy_tls, host) == OK
+     || socketpair(AF_UNIX, SOCK_STREAM, 0, pfd) != 0)
+    return FALSE;
+  cipher = tls_out.cipher;
+  sni = tls_out.sni;
+# ifdef SUPPORT_DANE
+  ps.dane = tls_out.dane_verified;
+# endif
+  ps.peer_options |= OPTION_TLS;
+  fd = pfd[1];
+  }
+#endif
+
+g = string_catn(NULL, US &ps, sizeof(ps));
+g = string_catn(g, sending_ip_address ? sending_ip_address : US"",
+  (sending_ip_address ? Ustrlen(sending_ip_address) : 0) + 1);
+g = string_catn(g, cipher ? cipher : US"", (cipher ? Ustrlen(cipher) : 0) + 1);
+g = string_catn(g, sni ? sni : US"", (sni ? Ustrlen(sni) : 0) + 1);
+
+if (!smtp_pool_park(fd, pool_key(tblock, sx->addrlist, host, sx->port),
+		    g->s, g->ptr, ob->connection_pool_time))
+  {
+#ifndef DISABLE_TLS
+  if (proxy) { close(pfd[0]); close(pfd[1]); }
+#endif
+  return FALSE;
+  }
+DEBUG(D_transport) debug_printf("connection handed to the daemon's pool\n");
+
+#ifndef DISABLE_TLS
+if (proxy)
+  {
+  int pid = exim_fork(US"tls-proxy-interproc");
+
+  if (pid == 0)		/* child; does not return */
+    smtp_proxy_tls(sx->cctx.tls_ctx, sx->buffer, sizeof(sx->buffer), pfd,
+      MAX(ob->command_timeout, ob->connection_pool_time), host->name);
+  if (pid < 0) log_write(0, LOG_PANIC_DIE, "fork failed");
+
+  close(pfd[0]);
+  close(pfd[1]);
+  waitpid(pid, NULL, 0);
+  tls_close(sx->cctx.tls_ctx, TLS_NO_SHUTDOWN);
+  sx->cctx.tls_ctx = NULL;
+  tls_out.active.sock = -1;
+  }
+#endif
+return TRUE;
+}
+
+
+/* Take over a connection to the host held by the daemon, if there is one,
+checking with an RSET that the server is still there.  On success the
+connection is on stdin and the state is set as for a continued connection
+passed by -MC.
+
+Returns:  TRUE if a connection was taken over
+*/
+
+static BOOL
+pool_borrow(transport_instance * tblock, address_item * addrlist,
+  host_item * host, int port)
+{
+smtp_transport_options_block * ob = SOB tblock->options_block;
+uschar * state, * ip, * cipher, * sni, buf[256];
+pool_state ps;
+int fd, statelen, n;
+
+if (host->port != PORT_NONE) port = host->port;
+if ((fd = smtp_pool_borrow(pool_key(tblock, addrlist, host, port),
+			    &state, &statelen)) < 0)
+  return FALSE;
+
+if (statelen < sizeof(ps) + 3 || state[statelen-1])
+  goto bad;
+memcpy(&ps, state, sizeof(ps));
+ip = state + sizeof(ps);
+cipher = ip + Ustrlen(ip) + 1;
+if (cipher >= state + statelen) goto bad;
+sni = cipher + Ustrlen(cipher) + 1;
+if (sni >= state + statelen) goto bad;
+
+HDEBUG(D_transport|D_acl|D_v) debug_printf_indent("  SMTP>> RSET (pooled)\n");
+if (  write(fd, "RSET\r\n", 6) != 6
+   || poll_one_fd(fd, POLLIN, ob->command_timeout * 1000) != 1
+   || (n = read(fd, buf, sizeof(buf) - 1)) < 5
+   || buf[0] != '2' || buf[n-1] != '\n'
+   )
+  {
+  DEBUG(D_transport) debug_printf("pooled connection unusable\n");
+  goto bad;
+  }
+HDEBUG(D_transport|D_acl|D_v)
+  debug_printf_indent("  SMTP<< %.*s", n, buf);
+
+if (fd != 0)
+  {
+  (void) dup2(fd, 0);
+  (void) close(fd);
+  }
+
+continue_transport = tblock->name;
+continue_hostname = string_copy(host->name);
+continue_host_address = string_copy(host->address);
+continue_sequence = ps.sequence + 1;
+smtp_peer_options = ps.peer_options;
+f.smtp_authenticated = ps.authenticated;
+continue_proxy_cipher = *cipher ? string_copy(cipher) : NULL;
+continue_proxy_sni = *sni ? string_copy(sni) : NULL;
+continue_proxy_dane = ps.dane;
+
+if (continue_proxy_cipher)
+  {
+  sending_ip_address = string_copy(ip);
+  sending_port = ps.sending_port;
+  }
+else
+  {
+  union sockaddr_46 interface_sock;
+  EXIM_SOCKLEN_T size = sizeof(interface_sock);
+  if (getsockname(0, (struct sockaddr *)&interface_sock, &size) == 0)
+    sending_ip_address = host_ntoa(-1, &interface_sock, NULL, &sending_port);
+  }
+
+DEBUG(D_transport) debug_printf("using pooled connection to %s [%s]\n",
+  host->name, host->address);
+return TRUE;
+
+bad:
+  (void) close(fd);
+  return FALSE;
+}
+
+
+
 static unsigned
 ehlo_response(uschar * buf, unsigned checks)
 {
@@ -2086,6 +2410,27 @@ if(  sx->dane_required
     }
 return OK;
 }
+
+
+/* Send the TLSA lookups for all the hosts of a list that may be
+DANE-verified at once, so that trying the hosts in turn does not wait for each
+lookup.  The answers are held, and taken by tlsa_lookup(). */
+
+static void
+tlsa_prefetch(const host_item * hostlist, smtp_transport_options_block * ob,
+  int defport)
+{
+const uschar * names[32];
+int count = 0;
+
+for (const host_item * h = hostlist; h && count < nelem(names); h = h->next)
+  if (  h->address && h->dnssec == DS_YES && h->status != hstatus_unusable
+     && (  verify_check_given_host(CUSS &ob->hosts_require_dane, h) == OK
+	|| verify_check_given_host(CUSS &ob->hosts_try_dane, h) == OK))
+    names[count++] = string_sprintf("_%d._tcp.%.256s",
+			  h->port == PORT_NONE ? defport : h->port, h->name);
+dns_prefetch(names, count, T_TLSA);
+}
 #endif
 
 
@@ -2341,8 +2686,11 @@ PIPE_CONNECT_RETRY:
     /* For TLS-connect, a TFO lazy-connect is useful since the Client Hello
     can go on the TCP SYN. */
 
-    if ((sx->cctx.sock = smtp_connect(&sx->conn_args,
-			    sx->smtps ? &lazy_conn : NULL)) < 0)
+    sx->cctx.sock = smtp_connect(&sx->conn_args,
+			    sx->smtps ? &lazy_conn : NULL);
+    trace_event(TRACE_TPT_CONN, sx->cctx.sock, sx->cctx.sock < 0 ? errno : 0,
+      sx->port);
+    if (sx->cctx.sock < 0)
       {
       set_errno_nohost(sx->addrlist,
 	errno == ETIMEDOUT ? ERRNO_CONNECTTIMEOUT : errno,
@@ -2751,8 +3099,15 @@ if (  smtp_peer_options & OPTION_TLS
   else
   TLS_NEGOTIATE:
     {
+    struct timeval start;
+    BOOL ok;
+
     sx->conn_args.sending_ip_address = sending_ip_address;
-    if (!tls_client_start(&sx->cctx, &sx->conn_args, sx->addrlist, &tls_out, &tls_errstr))
+    if (metrics) exim_gettime(&start);
+    ok = tls_client_start(&sx->cctx, &sx->conn_args, sx->addrlist, &tls_out,
+			  &tls_errstr);
+    if (metrics) metrics_time(METRICS_TIME_TLS_CLIENT, 0, &start);
+    if (!ok)
       {
       /* TLS negotiation failed; give an error. From outside, this function may
       be called again to try in clear on a new connection, if the options permit
@@ -3722,6 +4077,35 @@ done:
 #endif
 
 
+/*************************************************
+*        Journal lines for delivered addresses   *
+*************************************************/
+
+/* The journal lines for the addresses accepted by the server are collected,
+and written together once the responses have been dealt with. Just carry on
+after a write error, as it may prove possible to update the spool file later.
+*/
+
+static gstring *
+smtp_journal_line(gstring * g, const address_item * addr,
+  const transport_instance * tblock)
+{
+return testflag(addr, af_homonym)
+  ? string_fmt_append(g, "%.500s/%s\n", addr->unique + 3, tblock->name)
+  : string_fmt_append(g, "%.500s\n", addr->unique);
+}
+
+static void
+smtp_journal_write(gstring ** gp)
+{
+gstring * g = *gp;
+if (g && write(journal_fd, g->s, g->ptr) != g->ptr)
+  log_write(0, LOG_MAIN|LOG_PANIC, "failed to write journal: %s",
+    strerror(errno));
+*gp = NULL;
+}
+
+
 /*************************************************
 *       Deliver address list to given host       *
 *************************************************/
@@ -4097,6 +4481,7 @@ else
      && sx->send_quit
      && !(sx->first_addr || f.continue_more)
      && f.deliver_firsttime
+     && !ob->connection_pool_time
      )
     {
     smtp_compare_t t_compare =
@@ -4267,7 +4652,7 @@ else
     {
     int flag = '=';
     struct timeval delivery_time;
-    int len;
+    gstring * jg = NULL;
     uschar * conf = NULL;
 
     timesince(&delivery_time, &sx->delivery_start);
@@ -4310,7 +4695,11 @@ else
         if (!smtp_read_response(sx, sx->buffer, sizeof(sx->buffer), '2',
             ob->final_timeout))
           {
-          if (errno != 0 || sx->buffer[0] == 0) goto RESPONSE_FAILED;
+          if (errno != 0 || sx->buffer[0] == 0)
+	    {
+	    smtp_journal_write(&jg);
+	    goto RESPONSE_FAILED;
+	    }
           addr->message = string_sprintf(
 #ifndef DISABLE_PRDR
 	    "%s error after %s: %s", sx->prdr_active ? "PRDR":"LMTP",
@@ -4373,19 +4762,11 @@ else
         {
         /* Update the journal. For homonymic addresses, use the base address plus
         the transport name. See lots of comments in deliver.c about the reasons
-        for the complications when homonyms are involved. Just carry on after
-        write error, as it may prove possible to update the spool file later. */
-
-        if (testflag(addr, af_homonym))
-          sprintf(CS sx->buffer, "%.500s/%s\n", addr->unique + 3, tblock->name);
-        else
-          sprintf(CS sx->buffer, "%.500s\n", addr->unique);
-
-        DEBUG(D_deliver) debug_printf("S:journalling %s", sx->buffer);
-        len = Ustrlen(CS sx->buffer);
-        if (write(journal_fd, sx->buffer, len) != len)
-          log_write(0, LOG_MAIN|LOG_PANIC, "failed to write journal for "
-            "%s: %s", sx->buffer, strerror(errno));
+        for the complications when homonyms are involved. The lines are
+        collected for one write after the loop. */
+
+        jg = smtp_journal_line(jg, addr, tblock);
+        DEBUG(D_deliver) debug_printf("S:journalling %s\n", addr->unique);
         }
       }
 
@@ -4409,6 +4790,7 @@ else
 	for (address_item * addr = addrlist; addr != sx->first_addr; addr = addr->next)
 	  if (sx->buffer[0] == '5' || addr->transport_return == OK)
 	    addr->transport_return = PENDING_OK; /* allow set_errno action */
+	smtp_journal_write(&jg);
 	goto RESPONSE_FAILED;
 	}
 
@@ -4423,16 +4805,8 @@ else
       for (address_item * addr = addrlist; addr != sx->first_addr; addr = addr->next)
 	if (addr->transport_return == OK)
 	  {
-	  if (testflag(addr, af_homonym))
-	    sprintf(CS sx->buffer, "%.500s/%s\n", addr->unique + 3, tblock->name);
-	  else
-	    sprintf(CS sx->buffer, "%.500s\n", addr->unique);
-
-	  DEBUG(D_deliver) debug_printf("journalling(PRDR) %s\n", sx->buffer);
-	  len = Ustrlen(CS sx->buffer);
-	  if (write(journal_fd, sx->buffer, len) != len)
-	    log_write(0, LOG_MAIN|LOG_PANIC, "failed to write journal for "
-	      "%s: %s", sx->buffer, strerror(errno));
+	  jg = smtp_journal_line(jg, addr, tblock);
+	  DEBUG(D_deliver) debug_printf("journalling(PRDR) %s\n", addr->unique);
 	  }
 	else if (addr->transport_return == DEFER)
 	  /*XXX magic value -2 ? maybe host+message ? */
@@ -4440,9 +4814,10 @@ else
       }
 #endif
 
-    /* Ensure the journal file is pushed out to disk. */
+    /* Write the journal lines, and ensure they are pushed out to disk. */
 
-    if (EXIMfsync(journal_fd) < 0)
+    smtp_journal_write(&jg);
+    if (EXIMfdatasync(journal_fd) < 0)
       log_write(0, LOG_MAIN|LOG_PANIC, "failed to fsync journal: %s",
         strerror(errno));
     }
@@ -4831,6 +5206,18 @@ if (sx->completed_addr && sx->ok && sx->send_quit)
       }
     }
 
+/* Rather than closing a good connection for which there is no more work here,
+hand it to the daemon to hold for reuse, if so configured. */
+
+if (  ob->connection_pool_time > 0
+   && sx->ok && sx->send_quit && sx->completed_addr
+   && !sx->first_addr && !f.continue_more
+#ifdef EXPERIMENTAL_ESMTP_LIMITS
+   && !mail_limit
+#endif
+   && pool_park(sx))
+  sx->send_quit = FALSE;
+
 /* End off tidily with QUIT unless the connection has died or the socket has
 been passed to another process. */
 
@@ -5083,6 +5470,136 @@ return first_addr;
 
 
 
+/*************************************************
+*          Health of hosts, for ordering         *
+*************************************************/
+
+/* With hosts_health_order set, each delivery attempt updates a record for the
+host's IP address, held by the daemon in its shared cache: a smoothed time from
+the start of the connection to the greeting, and a penalty for deferred
+attempts (including TLS failures) and temporary error responses which halves
+every HOST_HEALTH_HALFLIFE seconds. The sum of the two, in milliseconds, is
+the host's score; lower is healthier. */
+
+typedef struct host_health {
+  time_t	stamp;		/* last update */
+  unsigned	latency;	/* smoothed time to the greeting, ms */
+  unsigned	penalty;	/* decaying failure score, ms */
+} host_health;
+
+#define HOST_HEALTH_TTL		3600	/* life of an unrefreshed record */
+#define HOST_HEALTH_HALFLIFE	600
+#define HOST_HEALTH_DEFER	10000	/* penalty for a deferred attempt */
+#define HOST_HEALTH_TEMPFAIL	5000	/* penalty for a 4xx response */
+
+static gstring *
+host_health_key(const uschar * address)
+{
+return string_catn(string_catn(NULL, US"health", 7),
+		    address, Ustrlen(address) + 1);
+}
+
+/* Fetch the record for an address, with its penalty decayed to now.
+Returns FALSE if there is none. */
+
+static BOOL
+host_health_get(const uschar * address, host_health * hh)
+{
+gstring * g = host_health_key(address);
+uschar * data;
+int len;
+time_t now = time(NULL);
+
+if (  !search_shared_get_raw(g->s, g->ptr, &data, &len)
+   || len != sizeof(host_health))
+  return FALSE;
+memcpy(hh, data, sizeof(host_health));
+if (now > hh->stamp)
+  {
+  time_t halvings = (now - hh->stamp) / HOST_HEALTH_HALFLIFE;
+  hh->penalty = halvings >= 32 ? 0 : hh->penalty >> halvings;
+  }
+return TRUE;
+}
+
+/* Fold the outcome of an attempt into the host's record */
+
+static void
+host_health_update(const host_item * host, int rc)
+{
+host_health hh;
+gstring * g;
+
+if (!host->address || !search_shared_usable()) return;
+if (!host_health_get(host->address, &hh))
+  hh = (host_health) {.latency = host_banner_ms >= 0 ? host_banner_ms : 0};
+else if (host_banner_ms >= 0)
+  hh.latency = (3 * hh.latency + host_banner_ms) / 4;
+
+if (rc == DEFER) hh.penalty += HOST_HEALTH_DEFER;
+if (host_tempfailed) hh.penalty += HOST_HEALTH_TEMPFAIL;
+hh.stamp = time(NULL);
+
+DEBUG(D_transport) debug_printf("health of %s [%s]: latency %ums penalty %u\n",
+  host->name, host->address, hh.latency, hh.penalty);
+g = host_health_key(host->address);
+search_shared_put_raw(g->s, g->ptr, US &hh, sizeof(hh), HOST_HEALTH_TTL);
+}
+
+/* Reorder a host list by score within each run of hosts of the same MX
+preference, keeping the existing order for equal scores. Hosts with no record
+score zero, so that they are tried and get one. Hosts not from MX records are
+kept in place unless all is set (for hosts_randomize, when their order is of no
+significance). The score is left in the sort_key field.
+
+Arguments:
+  list     the host list
+  all      TRUE to reorder hosts not from MX records
+
+Returns:   the new start of the list
+*/
+
+static host_item *
+host_health_order(host_item * list, BOOL all)
+{
+host_item * newlist = NULL, ** tail = &newlist;
+
+while (list)
+  {
+  host_item * run = NULL;
+  int mx = list->mx;
+
+  do
+    {
+    host_item * h = list, ** pp = &run;
+    host_health hh;
+
+    list = list->next;
+    h->sort_key = h->address && host_health_get(h->address, &hh)
+      ? hh.latency + hh.penalty > INT_MAX ? INT_MAX : hh.latency + hh.penalty
+      : 0;
+    while (*pp && (*pp)->sort_key <= h->sort_key) pp = &(*pp)->next;
+    h->next = *pp;
+    *pp = h;
+    }
+  while (list && list->mx == mx && (mx != MX_NONE || all));
+
+  *tail = run;
+  while (*tail) tail = &(*tail)->next;
+  }
+
+DEBUG(D_transport)
+  {
+  debug_printf("hosts ordered by health:\n");
+  for (host_item * h = newlist; h; h = h->next)
+    debug_printf("  %s [%s] MX=%d score %d\n", h->name,
+      h->address ? h->address : US"<unset>", h->mx, h->sort_key);
+  }
+return newlist;
+}
+
+
+
 /*************************************************
 *              Main entry point                  *
 *************************************************/
@@ -5106,7 +5623,8 @@ int hosts_retry = 0;
 int hosts_serial = 0;
 int hosts_total = 0;
 int total_hosts_tried = 0;
-BOOL expired = TRUE;
+BOOL expired = TRUE, retry_skipped_ok = TRUE;
+string_item * retry_skipped = NULL;
 uschar *expanded_hosts = NULL;
 uschar *pistring;
 uschar *tid = string_sprintf("%s transport", tblock->name);
@@ -5276,10 +5794,22 @@ else if (ob->hosts_randomize && hostlist->mx == MX_NONE && !continue_hostname)
   hostlist = addrlist->host_list = newlist;
   }
 
+/* With hosts_health_order set, put the healthiest of each group of hosts of
+equal preference first. Only a list from the router has the addresses needed. */
+
+if (  ob->hosts_health_order && !continue_hostname
+   && hostlist == addrlist->host_list && search_shared_usable())
+  hostlist = addrlist->host_list =
+    host_health_order(hostlist, ob->hosts_randomize);
+
 /* Sort out the default port.  */
 
 if (!smtp_get_port(ob->port, addrlist, &defport, tid)) return FALSE;
 
+#ifdef SUPPORT_DANE
+if (!continue_hostname) tlsa_prefetch(hostlist, ob, defport);
+#endif
+
 /* For each host-plus-IP-address on the list:
 
 .  If this is a continued delivery and the host isn't the one with the
@@ -5350,6 +5880,8 @@ retry_non_continued:
     uschar *retry_host_key = NULL;
     uschar *retry_message_key = NULL;
     uschar *serialize_key = NULL;
+    uschar *serialize_limkey = NULL;
+    int serialize_lim = 1;
 
     /* Deal slightly better with a possible Linux kernel bug that results
     in intermittent TFO-conn fails deep into the TCP flow.  Bug 2907 tracks.
@@ -5514,6 +6046,29 @@ retry_non_continued:
       continue;      /* With next host */
       }
 
+    /* If configured, race connections to this host and any following hosts
+    of the same preference. If one of the others wins, swap it into this
+    place in the list (just a reordering of equal-MX hosts) so that its
+    connection is the one used; smtp_sock_connect() picks it up. */
+
+    if (  ob->connect_race_max > 1 && cutoff_retry == 0
+       && !continue_hostname && !f.dont_deliver
+#ifdef SUPPORT_SOCKS
+       && !ob->socks_proxy
+#endif
+       )
+      {
+      host_item * winner = smtp_race_connect(host, defport, tblock, addrlist, tid);
+      if (winner && winner != host)
+	{
+	host_item save = *host;
+	*host = *winner;
+	host->next = save.next;
+	save.next = winner->next;
+	*winner = save;
+	}
+      }
+
     /* Count hosts being considered - purely for an intelligent comment
     if none are usable. */
 
@@ -5594,7 +6149,26 @@ retry_non_continued:
         case hstatus_unusable_expired:
 	  switch (host->why)
 	    {
-	    case hwhy_retry: hosts_retry++; break;
+	    case hwhy_retry:
+	      hosts_retry++;
+
+	      /* For queue_run_retry_skip, remember the retry record that made
+	      the host unusable, in case none can be tried. */
+
+	      if (queue_run_retry_skip)
+		{
+		uschar * key = retry_message_key ? retry_message_key : retry_host_key;
+		if (key)
+		  {
+		  string_item * si = store_get(sizeof(string_item), GET_UNTAINTED);
+		  si->text = key;
+		  si->next = retry_skipped;
+		  retry_skipped = si;
+		  }
+		else
+		  retry_skipped_ok = FALSE;	/* made unusable in this process */
+		}
+	      break;
 	    case hwhy_failed:  hosts_fail++; break;
 	    case hwhy_insecure:
 	    case hwhy_deferred: hosts_defer++; break;
@@ -5630,20 +6204,39 @@ retry_non_continued:
     expired = FALSE;
 
     /* If this host is listed as one to which access must be serialized,
-    see if another Exim process has a connection to it, and if so, skip
-    this host. If not, update the database to record our connection to it
-    and remember this for later deletion. Do not do any of this if we are
-    sending the message down a pre-existing connection. */
+    see if other Exim processes have as many connections to it as are allowed
+    (one, unless serialize_hosts_max says otherwise), and if so, skip this
+    host. If not, update the database to record our connection to it and
+    remember this for later deletion. Do not do any of this if we are sending
+    the message down a pre-existing connection. */
 
     if (  !continue_hostname
        && verify_check_given_host(CUSS &ob->serialize_hosts, host) == OK)
       {
+      int lim = 1;
+
+      if (ob->serialize_hosts_max)
+	{
+	lim = (int) expand_string_integer(ob->serialize_hosts_max, TRUE);
+	if (expand_string_message)
+	  {
+	  log_write(0, LOG_MAIN|LOG_PANIC, "Failed to expand serialize_hosts_max"
+	    " option in %s transport (%s): %s", tblock->name, host->name,
+	    expand_string_message);
+	  lim = 1;
+	  }
+	else if (lim < 1) lim = 1;
+	}
+      serialize_lim = lim;
+      if (ob->serialize_hosts_adapt)
+	serialize_limkey = string_sprintf("host-limit-%s", host->name);
+
       serialize_key = string_sprintf("host-serialize-%s", host->name);
-      if (!enq_start(serialize_key, 1))
+      if (!enq_start_limited(serialize_key, serialize_limkey, lim))
         {
         DEBUG(D_transport)
-          debug_printf("skipping host %s because another Exim process "
-            "is connected to it\n", host->name);
+          debug_printf("skipping host %s because other Exim processes "
+            "have its limit of connections to it\n", host->name);
         hosts_serial++;
         continue;
         }
@@ -5657,6 +6250,7 @@ retry_non_continued:
     is still to be delivered. */
 
     first_addr = prepare_addresses(addrlist, host);
+    host_tempfailed = FALSE;
 
     DEBUG(D_transport) debug_printf("delivering %s to %s [%s] (%s%s)\n",
       message_id, host->name, host->address, addrlist->address,
@@ -5734,11 +6328,27 @@ retry_non_continued:
 	  }
         }
 
+      /* Take over a connection to this host held by the daemon, if there is
+      one; the delivery then proceeds as a continued one. */
+
+      if (  ob->connection_pool_time > 0 && !continue_hostname
+	 && cutthrough.cctx.sock < 0
+	 && pool_borrow(tblock, addrlist, thost, defport))
+	{
+	clearflag(first_addr, af_new_conn);
+	setflag(first_addr, af_cont_conn);	/* Causes * in logging */
+	}
+
       /* Attempt the delivery. */
 
       total_hosts_tried++;
+      host_banner_ms = -1;
       rc = smtp_deliver(addrlist, thost, host_af, defport, interface, tblock,
         &message_defer, FALSE);
+      trace_event(TRACE_TPT_HOST, rc, first_addr->basic_errno,
+	first_addr->more_errno);
+      if (ob->hosts_health_order)
+	host_health_update(host, rc);
 
       /* Yield is one of:
          OK     => connection made, each address contains its result;
@@ -5814,9 +6424,17 @@ retry_non_continued:
       message_id, host->name, host->address, pistring, addrlist->address,
       addrlist->next ? " (& others)" : "", rc_to_string(rc));
 
-    /* Release serialization if set up */
+    /* Release serialization if set up.  With an adaptive limit, halve it if
+    the host sent a temporary error response (it may be throttling us), and
+    raise it by one after a clean delivery. */
 
-    if (serialize_key) enq_end(serialize_key);
+    if (serialize_key)
+      {
+      enq_end(serialize_key);
+      if (serialize_limkey)
+	enq_limit_adjust(serialize_limkey, serialize_lim,
+	  host_tempfailed ? -1 : rc == OK && !message_defer ? 1 : 0);
+      }
 
     /* If the result is DEFER, or if a host retry record is known to exist, we
     need to add an item to the retry chain for updating the retry database
@@ -6094,7 +6712,16 @@ for (address_item * addr = addrlist; addr; addr = addr->next)
       {
       const char * s;
       if (hosts_retry == hosts_total)
+	{
         s = "retry time not reached for any host%s";
+
+	/* Pass back the retry records that are holding up the address, for
+	queue_run_retry_skip.  They are only read, not updated. */
+
+	if (addr == addrlist && retry_skipped_ok)
+	  for (string_item * si = retry_skipped; si; si = si->next)
+	    retry_add_item(addr, si->text, rf_host | rf_skipped);
+	}
       else if (hosts_fail == hosts_total)
         s = "all host address lookups%s failed permanently";
       else if (hosts_defer == hosts_total)
@@ -6125,6 +6752,10 @@ if (update_waiting && tblock->connection_max_messages != 1)
 
 END_TRANSPORT:
 
+smtp_race_discard();
+#ifdef SUPPORT_DANE
+dns_prefetch_clear();
+#endif
 DEBUG(D_transport) debug_printf("Leaving %s transport\n", tblock->name);
 
 return TRUE;   /* Each address has its status */
@@ -48,6 +48,7 @@ typedef struct {
   uschar	*protocol;
   uschar	*dscp;
   uschar	*serialize_hosts;
+  uschar	*serialize_hosts_max;
   uschar	*hosts_try_auth;
   uschar	*hosts_require_alpn;
   uschar	*hosts_require_auth;
@@ -79,6 +80,9 @@ typedef struct {
 #endif
   int		command_timeout;
   int		connect_timeout;
+  int		connect_race_delay;
+  int		connect_race_max;
+  int		connection_pool_time;
   int		data_timeout;
   int		final_timeout;
   int		size_addition;
@@ -93,12 +97,14 @@ typedef struct {
   BOOL		dns_search_parents;
   dnssec_domains dnssec;
   BOOL		delay_after_cutoff;
+  BOOL		hosts_health_order;
   BOOL		hosts_override;
   BOOL		hosts_randomize;
   BOOL		keepalive;
   BOOL		lmtp_ignore_quota;
   uschar	*expand_retry_include_ip_address;
   BOOL		retry_include_ip_address;
+  BOOL		serialize_hosts_adapt;
 #ifdef SUPPORT_SOCKS
   uschar	*socks_proxy;
 #endif
@@ -21,6 +21,7 @@ calculations are not hard wired in, but are supplied as a regex. */
 #include "tf_maildir.h"
 
 #define MAX_FILE_SIZE  5120
+#define MAX_COMPACT_SIZE  (1024*1024)	/* read for compacting, at most */
 
 
 
@@ -321,6 +322,130 @@ return sum;
 
 
 
+/*************************************************
+*       Write a new maildirsizefile              *
+*************************************************/
+
+/* The contents are written to a temporary file, which is then renamed.
+
+Arguments:
+  path             the path to the maildir directory
+  filename         the path of the maildirsize file
+  ob               the appendfile options block
+  size             the size of the maildir
+  filecount        the count of files in the maildir
+
+Returns:           a file descriptor for the new file, or -1 on error
+*/
+
+static int
+maildir_write_sizefile(const uschar * path, const uschar * filename,
+  appendfile_transport_options_block * ob, off_t size, int filecount)
+{
+uschar buffer[128];
+uschar * tempname;
+struct timeval tv;
+int fd, len;
+
+(void)gettimeofday(&tv, NULL);
+tempname = string_sprintf("%s/tmp/" TIME_T_FMT ".H%luP%lu.%s",
+  path, tv.tv_sec, tv.tv_usec, (long unsigned) getpid(), primary_hostname);
+
+if ((fd = Uopen(tempname, O_RDWR|O_CREAT|O_EXCL, ob->mode ? ob->mode : 0600))
+    >= 0)
+  {
+  (void)sprintf(CS buffer, OFF_T_FMT "S,%dC\n" OFF_T_FMT " %d\n",
+    ob->quota_value, ob->quota_filecount_value, size, filecount);
+  len = Ustrlen(buffer);
+  if (write(fd, buffer, len) != len || Urename(tempname, filename) < 0)
+    {
+    (void)close(fd);
+    fd = -1;
+    }
+  }
+return fd;
+}
+
+
+
+/*************************************************
+*   Check a maildirsizefile in the background    *
+*************************************************/
+
+/* When a maildirsize file has been compacted from its own contents, which
+assumes that they were correct, the details are kept here for a check once the
+delivery is done. */
+
+static struct {
+  const uschar *	path;		/* the maildir directory */
+  const uschar *	filename;	/* its maildirsize file */
+  appendfile_transport_options_block * ob;
+  const pcre2_code *	regex;
+  const pcre2_code *	dir_regex;
+} sizefile_check = {0};
+
+
+/* Called by appendfile after a delivery.  If the maildirsize file was
+compacted, a subprocess computes the size of the maildir as for a
+recalculation and writes it as the new file, unless a subdirectory was modified
+meanwhile; in that case the compacted file is left, to be checked by the next
+compaction.  The delivery does not wait for it. */
+
+void
+maildir_check_sizefile(void)
+{
+const uschar * path = sizefile_check.path, * filename = sizefile_check.filename;
+appendfile_transport_options_block * ob = sizefile_check.ob;
+const pcre2_code * regex = sizefile_check.regex;
+const pcre2_code * dir_regex = sizefile_check.dir_regex;
+time_t old_latest = 0, new_latest = 0;
+int filecount = 0, fd, keep = debug_file ? fileno(debug_file) : -1;
+long max = sysconf(_SC_OPEN_MAX);
+off_t size;
+pid_t pid;
+
+if (!path) return;
+sizefile_check.path = NULL;
+
+if ((pid = exim_fork(US"maildirsize-check")) != 0)
+  {
+  if (pid < 0) DEBUG(D_transport)
+    debug_printf("fork for maildirsize check failed: %s\n", strerror(errno));
+  return;
+  }
+
+/* Do not hold open the pipe to the delivery process, or anything else */
+
+if (max < 0 || max > 4096) max = 4096;
+for (int i = 3; i < max; i++) if (i != keep) (void)close(i);
+
+size = maildir_compute_size(US path, &filecount, &old_latest, regex, dir_regex,
+  FALSE);
+(void)maildir_compute_size(US path, NULL, &new_latest, NULL, dir_regex, TRUE);
+
+if (new_latest > old_latest)
+  {
+  DEBUG(D_transport) debug_printf("maildirsize check: abandoned because of a "
+    "later subdirectory modification\n");
+  }
+else if ((fd = maildir_write_sizefile(path, filename, ob, size, filecount)) < 0)
+  {
+  DEBUG(D_transport)
+    debug_printf("maildirsize check: failed to write new file\n");
+  }
+else
+  {
+  new_latest = 0;
+  (void)maildir_compute_size(US path, NULL, &new_latest, NULL, dir_regex, TRUE);
+  if (new_latest > old_latest) (void)Uunlink(filename);
+  (void)close(fd);
+  }
+
+exim_underbar_exit(EXIT_SUCCESS);
+}
+
+
+
 /*************************************************
 *        Create or update maildirsizefile        *
 *************************************************/
@@ -361,9 +486,11 @@ int filecount = 0;
 int linecount = 0;
 off_t size = 0;
 uschar *filename;
-uschar buffer[MAX_FILE_SIZE];
-uschar *ptr = buffer;
+uschar sbuffer[MAX_FILE_SIZE];
+uschar *buffer = sbuffer;
+uschar *ptr;
 uschar *endptr;
+BOOL compact = FALSE;
 
 /* Try a few times to open or create the file, in case another process is doing
 the same thing. */
@@ -383,13 +510,31 @@ if ((fd = Uopen(filename, O_RDWR|O_APPEND, ob->mode ? ob->mode : 0600)) < 0)
 still correct, and that the size of the file is still small enough. If so,
 compute the maildir size from the file. */
 
-if ((count = read(fd, buffer, sizeof(buffer))) >= sizeof(buffer))
+if ((count = read(fd, buffer, MAX_FILE_SIZE)) >= MAX_FILE_SIZE)
   {
+  struct stat statbuf;
+
+  /* Optionally the file is read in full and is rewritten with the totals of
+  its entries, rather than recalculated. */
+
+  if (  !ob->maildir_size_file_compact
+     || fstat(fd, &statbuf) < 0
+     || statbuf.st_size > MAX_COMPACT_SIZE
+     || (count = pread(fd,
+	  buffer = store_get(statbuf.st_size + 1, GET_UNTAINTED),
+	  statbuf.st_size, 0)) != statbuf.st_size
+     )
+    {
+    DEBUG(D_transport)
+      debug_printf("maildirsize file too big (%d): recalculating\n", count);
+    goto RECALCULATE;
+    }
   DEBUG(D_transport)
-    debug_printf("maildirsize file too big (%d): recalculating\n", count);
-  goto RECALCULATE;
+    debug_printf("maildirsize file too big (%d): compacting\n", count);
+  compact = TRUE;
   }
 buffer[count] = 0;   /* Ensure string terminated */
+ptr = buffer;
 
 /* Read the quota parameters from the first line of the data. */
 
@@ -496,6 +641,34 @@ if (*endptr == 0)
       goto RECALCULATE;
       }
     }
+
+  /* Write the totals as the new file.  Entries appended to the old one since
+  it was read are copied over; then a subprocess checks the totals. */
+
+  if (compact)
+    {
+    int nfd = maildir_write_sizefile(path, filename, ob, size, filecount);
+    struct stat statbuf;
+
+    if (nfd < 0) goto RECALCULATE;
+    if (fstat(fd, &statbuf) == 0 && statbuf.st_size > count)
+      {
+      off_t off = count;
+      int n;
+      while ((n = pread(fd, sbuffer, sizeof(sbuffer), off)) > 0)
+	{
+	if (write(nfd, sbuffer, n) != n) break;
+	off += n;
+	}
+      }
+    (void)close(fd);
+    fd = nfd;
+    sizefile_check.path = path;
+    sizefile_check.filename = filename;
+    sizefile_check.ob = ob;
+    sizefile_check.regex = regex;
+    sizefile_check.dir_regex = dir_regex;
+    }
   }
 
 
@@ -503,10 +676,7 @@ if (*endptr == 0)
 
 else
   {
-  int len;
   time_t old_latest, new_latest;
-  uschar *tempname;
-  struct timeval tv;
 
   DEBUG(D_transport)
     {
@@ -532,22 +702,7 @@ else
   size = maildir_compute_size(path, &filecount, &old_latest, regex, dir_regex,
     FALSE);
 
-  (void)gettimeofday(&tv, NULL);
-  tempname = string_sprintf("%s/tmp/" TIME_T_FMT ".H%luP%lu.%s",
-    path, tv.tv_sec, tv.tv_usec, (long unsigned) getpid(), primary_hostname);
-
-  fd = Uopen(tempname, O_RDWR|O_CREAT|O_EXCL, ob->mode ? ob->mode : 0600);
-  if (fd >= 0)
-    {
-    (void)sprintf(CS buffer, OFF_T_FMT "S,%dC\n" OFF_T_FMT " %d\n",
-      ob->quota_value, ob->quota_filecount_value, size, filecount);
-    len = Ustrlen(buffer);
-    if (write(fd, buffer, len) != len || Urename(tempname, filename) < 0)
-      {
-      (void)close(fd);
-      fd = -1;
-      }
-    }
+  fd = maildir_write_sizefile(path, filename, ob, size, filecount);
 
   /* If any of the directories have been modified since the last timestamp we
   saw, we have to junk this maildirsize file. */
@@ -10,6 +10,7 @@
 /* Header file for the functions that are used to support the use of
 maildirsize files for quota handling in maildir directories. */
 
+extern void   maildir_check_sizefile(void);
 extern off_t  maildir_compute_size(uschar *, int *, time_t *, const pcre2_code *,
                 const pcre2_code *, BOOL);
 extern BOOL   maildir_ensure_directories(uschar *, address_item *, BOOL, int,
@@ -8,11 +8,21 @@
 /* SPDX-License-Identifier: GPL-2.0-or-later */
 
 /* Functions for maintaining binary balanced trees and some associated
-functions as well. */
+functions as well, and for hash sets of the same nodes. */
 
 
 #include "exim.h"
 
+#define HSET_MIN_SIZE 64
+
+/* The non-recipients must be kept as a tree, as that is how they are
+written to the spool, but for a large message they are searched many times.
+This index of the tree is kept by tree_add_nonrecipient(), and made by
+tree_index_nonrecipients() for a tree read from the spool.  The index table
+is got along with the nodes, so that it lives as long as they do. */
+
+static hash_set nonrecipients_index = {0};
+
 
 
 
@@ -31,11 +41,66 @@ Returns:  nothing
 void
 tree_add_nonrecipient(const uschar *s)
 {
-rmark rpoint = store_mark();
-tree_node * node = store_get(sizeof(tree_node) + Ustrlen(s), s);
+rmark rpoint;
+tree_node * node;
+
+if (tree_search_nonrecipient(s)) return;
+rpoint = store_mark();
+node = store_get(sizeof(tree_node) + Ustrlen(s), s);
 Ustrcpy(node->name, s);
 node->data.ptr = NULL;
 if (!tree_insertnode(&tree_nonrecipients, node)) store_reset(rpoint);
+else (void) hset_insert(&nonrecipients_index, node);
+}
+
+
+
+/*************************************************
+*        Search the non-recipients               *
+*************************************************/
+
+/* This is a search of tree_nonrecipients, done with its index.  The tree
+must have been changed only by the functions here.
+
+Argument:  the address
+Returns:   the node, or NULL if not found
+*/
+
+tree_node *
+tree_search_nonrecipient(const uschar * s)
+{
+return hset_search(&nonrecipients_index, s);
+}
+
+
+/* Index a tree of non-recipients read from the spool */
+
+static void
+tree_index(hash_set * hs, tree_node * p)
+{
+for (; p; p = p->right)
+  {
+  (void) hset_insert(hs, p);
+  tree_index(hs, p->left);
+  }
+}
+
+void
+tree_index_nonrecipients(void)
+{
+hset_clear(&nonrecipients_index);
+tree_index(&nonrecipients_index, tree_nonrecipients);
+}
+
+
+/* Empty the non-recipients, and their index.  Use this rather than setting
+tree_nonrecipients to NULL. */
+
+void
+tree_clear_nonrecipients(void)
+{
+tree_nonrecipients = NULL;
+hset_clear(&nonrecipients_index);
 }
 
 
@@ -60,7 +125,7 @@ rmark rpoint = store_mark();
 tree_node * node = store_get(sizeof(tree_node) + Ustrlen(s), s);
 Ustrcpy(node->name, s);
 node->data.ptr = addr;
-if (!tree_insertnode(&tree_duplicates, node)) store_reset(rpoint);
+if (!hset_insert(&hset_duplicates, node)) store_reset(rpoint);
 }
 
 
@@ -87,7 +152,7 @@ node = store_get(sizeof(tree_node) + Ustrlen(s),
 Ustrcpy(node->name, s);
 node->data.val = h->why;
 if (h->status == hstatus_unusable_expired) node->data.val += 256;
-if (!tree_insertnode(&tree_unusable, node)) store_reset(rpoint);
+if (!hset_insert(&hset_unusable, node)) store_reset(rpoint);
 }
 
 
@@ -391,4 +456,110 @@ tree_walk(src, tree_add_var, dstp);
 
 
 
+/*************************************************
+*              Hash sets                         *
+*************************************************/
+
+static unsigned
+hset_hash(const uschar * s)
+{
+unsigned h = 5381;
+while (*s) h = (h << 5) + h + *s++;
+return h;
+}
+
+
+/* Search a hash set for a node by name.
+
+Arguments:
+  hs        the hash set
+  name      key to search for
+
+Returns:    pointer to node, or NULL if not found
+*/
+
+tree_node *
+hset_search(const hash_set * hs, const uschar * name)
+{
+unsigned mask = hs->size - 1;
+
+if (hs->count)
+  for (unsigned i = hset_hash(name) & mask; hs->slot[i]; i = (i + 1) & mask)
+    if (Ustrcmp(hs->slot[i]->name, name) == 0)
+      return hs->slot[i];
+return NULL;
+}
+
+
+/* Double the table (or make the first one), and place the nodes again.
+The old table is left to the store pool. */
+
+static void
+hset_grow(hash_set * hs)
+{
+unsigned size = hs->size ? hs->size * 2 : HSET_MIN_SIZE, mask = size - 1;
+size_t len = size * sizeof(tree_node *);
+tree_node ** slot = hs->perm
+  ? store_get_perm(len, GET_UNTAINTED) : store_get(len, GET_UNTAINTED);
+
+memset(slot, 0, len);
+for (unsigned j = 0; j < hs->size; j++) if (hs->slot[j])
+  {
+  unsigned i = hset_hash(hs->slot[j]->name) & mask;
+  while (slot[i]) i = (i + 1) & mask;
+  slot[i] = hs->slot[j];
+  }
+hs->slot = slot;
+hs->size = size;
+}
+
+
+/* Add a node to a hash set.  Any table growth happens only for a new name,
+so a caller can release the node's store when it was a duplicate.
+
+Arguments:
+  hs        the hash set
+  node      the node, with its name set
+
+Returns:    TRUE if added; FALSE if the name was already there
+*/
+
+BOOL
+hset_insert(hash_set * hs, tree_node * node)
+{
+unsigned mask, i;
+
+if (hset_search(hs, node->name)) return FALSE;
+if ((hs->count + 1) * 4 > hs->size * 3) hset_grow(hs);
+
+mask = hs->size - 1;
+for (i = hset_hash(node->name) & mask; hs->slot[i]; i = (i + 1) & mask) ;
+hs->slot[i] = node;
+hs->count++;
+return TRUE;
+}
+
+
+/* Run a function for each node of a hash set, in no particular order.
+The arguments are as for tree_walk(). */
+
+void
+hset_walk(const hash_set * hs, void (*f)(uschar*, uschar*, void*), void *ctx)
+{
+for (unsigned i = 0; i < hs->size; i++)
+  if (hs->slot[i]) f(hs->slot[i]->name, hs->slot[i]->data.ptr, ctx);
+}
+
+
+/* Empty a hash set.  Its store is left to the pool it came from. */
+
+void
+hset_clear(hash_set * hs)
+{
+hs->slot = NULL;
+hs->size = hs->count = 0;
+}
+
+
+
 /* End of tree.c */
@@ -40,6 +40,43 @@ string_is_alabel(const uschar * s)
 return s[0] == 'x' && s[1] == 'n' && s[2] == '-' && s[3] == '-';
 }
 
+/**************************************************/
+/* A per-process cache of domain conversions, one tree for each direction.
+The same few domains are typically converted many times while a message is
+routed, verified and logged; a hit saves the library calls and their
+malloc/free pairs.  The trees are in the permanent pool, so are limited in
+size; errors are not held.  A result is returned as a copy in the current
+pool, tainted as the input was. */
+
+#define UTF8_DOMAIN_CACHE_MAX	256
+
+static tree_node * dom_alabels = NULL;		/* from UTF-8 */
+static tree_node * dom_ulabels = NULL;		/* from A-labels */
+static int dom_cache_count = 0;
+
+static uschar *
+dom_cache_get(tree_node * tree, const uschar * from)
+{
+tree_node * t = tree_search(tree, from);
+return t ? string_copy_taint(t->data.ptr, from) : NULL;
+}
+
+static void
+dom_cache_put(tree_node ** treep, const uschar * from, const uschar * to)
+{
+int old_pool = store_pool;
+tree_node * t;
+
+if (dom_cache_count >= UTF8_DOMAIN_CACHE_MAX) return;
+store_pool = POOL_PERM;
+t = store_get(sizeof(tree_node) + Ustrlen(from), GET_UNTAINTED);
+Ustrcpy(t->name, from);
+t->data.ptr = string_copy_taint(to, GET_UNTAINTED);
+store_pool = old_pool;
+if (tree_insertnode(treep, t)) dom_cache_count++;
+}
+
+
 /**************************************************/
 /* Domain conversions.
 The *err string pointer should be null before the call
@@ -47,17 +84,13 @@ The *err string pointer should be null before the call
 Return NULL for error, with optional errstr pointer filled in
 */
 
-uschar *
-string_domain_utf8_to_alabel(const uschar * utf8, uschar ** err)
+static uschar *
+string_domain_utf8_to_alabel_(const uschar * utf8, uschar ** err)
 {
 uschar * s1, * s;
 int rc;
 
 #ifdef SUPPORT_I18N_2008
-/* Avoid lowercasing plain-ascii domains */
-if (!string_is_utf8(utf8))
-  return string_copy(utf8);
-
 /* Only lowercase is accepted by the library call.  A pity since we lose
 any mixed-case annotation.  This does not really matter for a domain. */
   {
@@ -91,10 +124,27 @@ free(s1);
 return s;
 }
 
+uschar *
+string_domain_utf8_to_alabel(const uschar * utf8, uschar ** err)
+{
+uschar * s;
+
+#ifdef SUPPORT_I18N_2008
+/* Avoid lowercasing plain-ascii domains */
+if (!string_is_utf8(utf8))
+  return string_copy(utf8);
+#endif
+
+if (!(s = dom_cache_get(dom_alabels, utf8))
+   && (s = string_domain_utf8_to_alabel_(utf8, err)))
+  dom_cache_put(&dom_alabels, utf8, s);
+return s;
+}
+
 
 
-uschar *
-string_domain_alabel_to_utf8(const uschar * alabel, uschar ** err)
+static uschar *
+string_domain_alabel_to_utf8_(const uschar * alabel, uschar ** err)
 {
 #ifdef SUPPORT_I18N_2008
 const uschar * label;
@@ -127,6 +177,17 @@ return s;
 #endif
 }
 
+uschar *
+string_domain_alabel_to_utf8(const uschar * alabel, uschar ** err)
+{
+uschar * s;
+
+if (!(s = dom_cache_get(dom_ulabels, alabel))
+   && (s = string_domain_alabel_to_utf8_(alabel, err)))
+  dom_cache_put(&dom_ulabels, alabel, s);
+return s;
+}
+
 /**************************************************/
 /* localpart conversions */
 /* the *err string pointer should be null before the call */
@@ -19,6 +19,21 @@ caching was contributed by Kevin Fleming (but I hacked it around a bit). */
 static smtp_context ctctx;
 uschar ctbuffer[8192];
 
+/* A recipient-callout connection held open, within its transaction, for the
+callouts of further recipients of the message to the same host.  This is the
+hold option without use_sender; with use_sender the cutthrough connection is
+used instead. */
+
+static struct {
+  client_conn_ctx	cctx;
+  host_item		host;
+  uschar *		interface;
+  transport_instance *	transport;
+  uschar *		from;
+  int			nrcpt;
+} callout_held = {.cctx = {.sock = -1}};
+static smtp_context chctx;
+
 
 static uschar cutthrough_response(client_conn_ctx *, char, uschar **, int);
 
@@ -335,6 +350,69 @@ if (dbm_file) dbfn_close(dbm_file);
 }
 
 
+/* A recipient cannot be added to the held cutthrough connection.  Usually
+this ends cutthrough for the message.  With the partial option, once the
+connection holds a recipient it is kept for those, and this one is left to
+be delivered from the spool after reception. */
+
+static void
+cutthrough_incompatible(const uschar * why)
+{
+if (  cutthrough.partial && cutthrough.delivery
+   && cutthrough.cctx.sock >= 0 && cutthrough.nrcpt > 0)
+  {
+  HDEBUG(D_acl|D_v)
+    debug_printf_indent("cutthrough conn kept for partial delivery (%s)\n", why);
+  }
+else
+  cancel_cutthrough_connection(TRUE, why);
+}
+
+
+/* Find the host, in the list for a callout, which an open connection can
+serve: the same address, and the interface and port a new connection to it
+would use.  The deliver_host variables are left set up for the host. */
+
+static host_item *
+held_conn_host(address_item * addr, host_item * host_list,
+  transport_feedback * tf, const host_item * held, const uschar * held_interface)
+{
+for (host_item * host = host_list; host; host = host->next)
+  if (host->address && Ustrcmp(host->address, held->address) == 0)
+    {
+    int host_af;
+    uschar * interface = NULL;  /* Outgoing interface to use; NULL => any */
+    int port = 25;
+
+    deliver_host = host->name;
+    deliver_host_address = host->address;
+    deliver_host_port = host->port;
+    deliver_domain = addr->domain;
+    transport_name = addr->transport->name;
+
+    host_af = Ustrchr(host->address, ':') ? AF_INET6 : AF_INET;
+
+    if (  !smtp_get_interface(tf->interface, host_af, addr, &interface,
+	    US"callout")
+       || !smtp_get_port(tf->port, addr, &port, US"callout")
+       )
+      log_write(0, LOG_MAIN|LOG_PANIC, "<%s>: %s", addr->address,
+	addr->message);
+
+    smtp_port_for_connect(host, port);
+
+    return (  interface == held_interface
+	   || (  interface
+	      && held_interface
+	      && Ustrcmp(interface, held_interface) == 0
+	   )  )
+	&& host->port == held->port
+      ? host : NULL;
+    }
+return NULL;
+}
+
+
 /* Cutthrough-multi.  If the existing cached cutthrough connection matches
 the one we would make for a subsequent recipient, use it.  Send the RCPT TO
 and check the result, nonpipelined as it may be wanted immediately for
@@ -352,97 +430,193 @@ cutthrough_multi(address_item * addr, host_item * host_list,
 {
 BOOL done = FALSE;
 
-if (addr->transport == cutthrough.addr.transport)
-  for (host_item * host = host_list; host; host = host->next)
-    if (Ustrcmp(host->address, cutthrough.host.address) == 0)
-      {
-      int host_af;
-      uschar *interface = NULL;  /* Outgoing interface to use; NULL => any */
-      int port = 25;
+if (  addr->transport == cutthrough.addr.transport
+   && held_conn_host(addr, host_list, tf, &cutthrough.host,
+			cutthrough.interface))
+  {
+  uschar * resp = NULL;
 
-      deliver_host = host->name;
-      deliver_host_address = host->address;
-      deliver_host_port = host->port;
-      deliver_domain = addr->domain;
-      transport_name = addr->transport->name;
+  /* Match!  Send the RCPT TO, set done from the response */
+  done =
+       smtp_write_command(&ctctx, SCMD_FLUSH, "RCPT TO:<%.1000s>\r\n",
+	transport_rcpt_address(addr,
+	   addr->transport->rcpt_include_affixes)) >= 0
+    && cutthrough_response(&cutthrough.cctx, '2', &resp,
+	CUTTHROUGH_DATA_TIMEOUT) == '2';
 
-      host_af = Ustrchr(host->address, ':') ? AF_INET6 : AF_INET;
+  /* This would go horribly wrong if a callout fail was ignored by ACL.
+  We punt by abandoning cutthrough on a reject, like the
+  first-rcpt does. */
 
-      if (  !smtp_get_interface(tf->interface, host_af, addr, &interface,
-	      US"callout")
-	 || !smtp_get_port(tf->port, addr, &port, US"callout")
-	 )
-	log_write(0, LOG_MAIN|LOG_PANIC, "<%s>: %s", addr->address,
-	  addr->message);
+  if (done)
+    {
+    address_item * na = store_get(sizeof(address_item), GET_UNTAINTED);
+    *na = cutthrough.addr;
+    cutthrough.addr = *addr;
+    cutthrough.addr.host_used = &cutthrough.host;
+    cutthrough.addr.next = na;
 
-      smtp_port_for_connect(host, port);
+    cutthrough.nrcpt++;
+    }
+  else
+    {
+    cancel_cutthrough_connection(TRUE, US"recipient rejected");
+    if (!resp || errno == ETIMEDOUT)
+      {
+      HDEBUG(D_verify) debug_printf("SMTP timeout\n");
+      }
+    else if (errno == 0)
+      {
+      if (*resp == 0)
+	Ustrcpy(resp, US"connection dropped");
 
-      if (  (  interface == cutthrough.interface
-	    || (  interface
-	       && cutthrough.interface
-	       && Ustrcmp(interface, cutthrough.interface) == 0
-	    )  )
-	 && host->port == cutthrough.host.port
-	 )
+      addr->message =
+	string_sprintf("response to \"%s\" was: %s",
+	  big_buffer, string_printing(resp));
+
+      addr->user_message =
+	string_sprintf("Callout verification failed:\n%s", resp);
+
+      /* Hard rejection ends the process */
+
+      if (resp[0] == '5')   /* Address rejected */
 	{
-	uschar * resp = NULL;
+	*yield = FAIL;
+	done = TRUE;
+	}
+      }
+    }
+  }
+if (!done)
+  cutthrough_incompatible(US"incompatible connection");
+return done;
+}
 
-	/* Match!  Send the RCPT TO, set done from the response */
-	done =
-	     smtp_write_command(&ctctx, SCMD_FLUSH, "RCPT TO:<%.1000s>\r\n",
-	      transport_rcpt_address(addr,
-		 addr->transport->rcpt_include_affixes)) >= 0
-	  && cutthrough_response(&cutthrough.cctx, '2', &resp,
-	      CUTTHROUGH_DATA_TIMEOUT) == '2';
 
-	/* This would go horribly wrong if a callout fail was ignored by ACL.
-	We punt by abandoning cutthrough on a reject, like the
-	first-rcpt does. */
 
-	if (done)
-	  {
-	  address_item * na = store_get(sizeof(address_item), GET_UNTAINTED);
-	  *na = cutthrough.addr;
-	  cutthrough.addr = *addr;
-	  cutthrough.addr.host_used = &cutthrough.host;
-	  cutthrough.addr.next = na;
+/* Close a held recipient-callout connection, if there is one. */
 
-	  cutthrough.nrcpt++;
-	  }
-	else
-	  {
-	  cancel_cutthrough_connection(TRUE, US"recipient rejected");
-	  if (!resp || errno == ETIMEDOUT)
-	    {
-	    HDEBUG(D_verify) debug_printf("SMTP timeout\n");
-	    }
-	  else if (errno == 0)
-	    {
-	    if (*resp == 0)
-	      Ustrcpy(resp, US"connection dropped");
+void
+callout_held_close(const uschar * why)
+{
+if (callout_held.cctx.sock < 0) return;
 
-	    addr->message =
-	      string_sprintf("response to \"%s\" was: %s",
-		big_buffer, string_printing(resp));
+chctx.outblock.ptr = chctx.outblock.buffer;
+if (smtp_write_command(&chctx, SCMD_FLUSH, "QUIT\r\n") != -1)
+  /* Wait a short time for response, and discard it */
+  smtp_read_response(&chctx, chctx.buffer, sizeof(chctx.buffer), '2', 1);
+#ifndef DISABLE_TLS
+if (callout_held.cctx.tls_ctx)
+  tls_close(callout_held.cctx.tls_ctx, TLS_SHUTDOWN_NOWAIT);
+#endif
+HDEBUG(D_transport|D_acl|D_v) debug_printf_indent("  SMTP(close)>>\n");
+(void)close(callout_held.cctx.sock);
+callout_held.cctx.sock = -1;
+callout_held.cctx.tls_ctx = NULL;
+HDEBUG(D_verify) debug_printf_indent("held callout conn closed after %d rcpt%s (%s)\n",
+  callout_held.nrcpt, callout_held.nrcpt == 1 ? "" : "s", why);
+#ifndef DISABLE_EVENT
+(void) event_raise(callout_held.transport->event_action, US"tcp:close",
+  NULL, NULL);
+#endif
+}
 
-	    addr->user_message =
-	      string_sprintf("Callout verification failed:\n%s", resp);
 
-	    /* Hard rejection ends the process */
+/* Keep the connection of a callout which has had its RCPT answered, for
+further recipients.  Takes over the socket and TLS context from the smtp
+context, so the caller's close does nothing. */
 
-	    if (resp[0] == '5')   /* Address rejected */
-	      {
-	      *yield = FAIL;
-	      done = TRUE;
-	      }
-	    }
-	  }
-	}
-      break;	/* host_list */
-      }
-if (!done)
-  cancel_cutthrough_connection(TRUE, US"incompatible connection");
-return done;
+static void
+callout_held_save(smtp_context * sx, address_item * addr, host_item * host,
+  uschar * interface, const uschar * from_address)
+{
+int oldpool = store_pool;
+
+callout_held_close(US"replaced");
+HDEBUG(D_verify) debug_printf_indent("holding callout conn open for further"
+  " recipients\n");
+
+callout_held.cctx = sx->cctx;
+sx->cctx.sock = -1;
+sx->cctx.tls_ctx = NULL;
+callout_held.transport = addr->transport;
+callout_held.nrcpt = 1;
+callout_held.host = *host;
+store_pool = POOL_PERM;
+callout_held.host.name = string_copy(host->name);
+callout_held.host.address = string_copy(host->address);
+callout_held.interface = interface ? string_copy(interface) : NULL;
+callout_held.from = string_copy(from_address);
+store_pool = oldpool;
+
+chctx.outblock.buffer = chctx.outbuffer;
+chctx.outblock.buffersize = sizeof(chctx.outbuffer);
+chctx.outblock.ptr = chctx.outbuffer;
+chctx.outblock.cctx = &callout_held.cctx;
+chctx.inblock.buffer = chctx.inbuffer;
+chctx.inblock.buffersize = sizeof(chctx.inbuffer);
+chctx.inblock.ptr = chctx.inblock.ptrend = chctx.inbuffer;
+chctx.inblock.cctx = &callout_held.cctx;
+}
+
+
+/* If a held recipient-callout connection matches the one we would make for
+this recipient, with the same sender, send just the RCPT TO on it.  A 2xx or
+5xx response is definitive; anything else drops the connection and leaves
+the caller to make a new one.
+
+Return: TRUE for a definitive result for the recipient
+*/
+
+static BOOL
+callout_held_rcpt(address_item * addr, host_item * host_list,
+  transport_feedback * tf, const uschar * from_address, int callout,
+  int * yield, uschar ** failure_ptr,
+  dbdata_callout_cache * new_domain_record,
+  dbdata_callout_cache_address * new_address_record)
+{
+host_item * host;
+
+if (  addr->transport != callout_held.transport
+   || Ustrcmp(from_address, callout_held.from) != 0
+   || !(host = held_conn_host(addr, host_list, tf, &callout_held.host,
+			      callout_held.interface)))
+  return FALSE;
+
+HDEBUG(D_verify) debug_printf_indent("using held callout conn to %s [%s]\n",
+  host->name, host->address);
+
+if (smtp_write_command(&chctx, SCMD_FLUSH, "RCPT TO:<%.1000s>\r\n",
+      transport_rcpt_address(addr, addr->transport->rcpt_include_affixes)) < 0)
+  {
+  callout_held_close(US"transmit failed");
+  return FALSE;
+  }
+
+callout_held.nrcpt++;
+new_domain_record->result = ccache_accept;
+if (smtp_read_response(&chctx, chctx.buffer, sizeof(chctx.buffer), '2',
+      callout))
+  {
+  new_address_record->result = ccache_accept;
+  return TRUE;
+  }
+
+if (errno == 0 && chctx.buffer[0] == '5')
+  {
+  addr->message = string_sprintf("%s [%s] : response to \"%s\" was: %s",
+    host->name, host->address, big_buffer, string_printing(chctx.buffer));
+  addr->user_message = string_sprintf("Callout verification failed:\n%s",
+    chctx.buffer);
+  *failure_ptr = US"recipient";
+  new_address_record->result = ccache_reject;
+  *yield = FAIL;
+  return TRUE;
+  }
+
+new_domain_record->result = ccache_unknown;
+callout_held_close(US"unexpected response");
+return FALSE;
 }
 
 
@@ -555,7 +729,7 @@ if (cached_callout_lookup(addr, address_key, from_address,
       &options, &pm_mailfrom, &yield, failure_ptr,
       &new_domain_record, &old_domain_cache_result))
   {
-  cancel_cutthrough_connection(TRUE, US"cache-hit");
+  cutthrough_incompatible(US"cache-hit");
   goto END_CALLOUT;
   }
 
@@ -620,6 +794,15 @@ coding means skipping this whole loop and doing the append separately.  */
      )
     done = cutthrough_multi(addr, host_list, tf, &yield);
 
+  /* Or a connection held from the callout for an earlier recipient? */
+  else if (  callout_held.cctx.sock >= 0
+	  && options & vopt_is_recipient
+	  && !random_local_part
+	  && !pm_mailfrom
+	  )
+    done = callout_held_rcpt(addr, host_list, tf, from_address, callout,
+	      &yield, failure_ptr, &new_domain_record, &new_address_record);
+
   /* If we did not use a cached connection, make connections to the hosts
   and do real callouts. The list of hosts is passed in as an argument. */
 
@@ -1072,7 +1255,7 @@ no_conn:
     here is where we want to leave the conn open.  Ditto for a lazy-close
     verify. */
 
-    if (cutthrough.delivery)
+    if (cutthrough.delivery && cutthrough.cctx.sock < 0)
       {
       if (addr->transport->filter_command)
         {
@@ -1118,6 +1301,7 @@ no_conn:
       /* We assume no buffer in use in the outblock */
       cutthrough.cctx =		sx->cctx;
       cutthrough.nrcpt =	1;
+      cutthrough.spooled =	FALSE;
       cutthrough.transport =	addr->transport->name;
       cutthrough.interface =	interface;
       cutthrough.snd_port =	sending_port;
@@ -1151,7 +1335,22 @@ no_conn:
       {
       /* Ensure no cutthrough on multiple verifies that were incompatible */
       if (options & vopt_callout_recipsender)
-        cancel_cutthrough_connection(TRUE, US"not usable for cutthrough");
+        cutthrough_incompatible(US"not usable for cutthrough");
+
+      /* A lazy-close verify which could not be kept for cutthrough is kept
+      for the callouts of further recipients, once its RCPT was answered. */
+
+      if (  options & vopt_callout_hold
+	 && options & vopt_is_recipient
+	 && done
+	 && new_address_record.result != ccache_unknown
+	 && !random_local_part
+	 && !pm_mailfrom
+	 && !sx->lmtp
+	 && sx->cctx.sock >= 0
+	 )
+	callout_held_save(sx, addr, host, interface, from_address);
+
       if (sx->send_quit && sx->cctx.sock >= 0)
 	if (smtp_write_command(sx, SCMD_FLUSH, "QUIT\r\n") != -1)
 	  /* Wait a short time for response, and discard it */
@@ -2060,7 +2259,7 @@ while (addr_new)
         }
       respond_printf(fp, "%s\n", cr);
       }
-    cancel_cutthrough_connection(TRUE, US"routing hard fail");
+    cutthrough_incompatible(US"routing hard fail");
 
     if (!full_info)
       {
@@ -2099,7 +2298,7 @@ while (addr_new)
         }
       respond_printf(fp, "%s\n", cr);
       }
-    cancel_cutthrough_connection(TRUE, US"routing soft fail");
+    cutthrough_incompatible(US"routing soft fail");
 
     if (!full_info)
       {
@@ -2212,7 +2411,7 @@ for (addr_list = addr_local, i = 0; i < 2; addr_list = addr_remote, i++)
     if (!testflag(addr, af_pfr))
       {
       tree_node *tnode;
-      if ((tnode = tree_search(tree_duplicates, addr->unique)))
+      if ((tnode = hset_search(&hset_duplicates, addr->unique)))
         fprintf(fp, "   [duplicate, would not be delivered]");
       else tree_add_duplicate(addr->unique, addr);
       }
@@ -2541,6 +2740,149 @@ return NULL;
 
 
 
+/*************************************************
+*     Sender verify results for the session      *
+*************************************************/
+
+/* With sender_verify_session_cache set, the results of sender and header
+sender verifications done without a callout are kept for the rest of the
+SMTP session, so that later messages from the same sender need not route it
+again.  An entry is for an address and a set of verify options, and is used
+only while the HELO name, authenticated id and TLS cipher are what they were
+when it was made.  Only OK and FAIL results are kept, and not those that set
+address variables.  The entries are in the permanent pool, as that survives
+the reset between messages; there is a limit on their number. */
+
+#define SVERIFY_CACHE_MAX	32
+
+typedef struct sverify_cache {
+  struct sverify_cache * next;
+  int		options;
+  int		rc;
+  int		basic_errno;
+  int		more_errno;
+  BOOL		routed;
+  BOOL		pass_message;
+  const uschar * helo;		/* inputs at the time of the verify */
+  const uschar * auth_id;
+  const uschar * cipher;
+  const uschar * result;	/* the address as verified */
+  const uschar * sender;	/* sender_address, for the real sender */
+  const uschar * failure;	/* $sender_verify_failure */
+  const uschar * message;
+  const uschar * user_message;
+  const uschar * address_data;
+  uschar	address[1];	/* expands */
+} sverify_cache;
+
+static sverify_cache * sverify_cached = NULL;
+static int sverify_cache_count = 0;
+
+
+static BOOL
+sverify_same(const uschar * a, const uschar * b)
+{
+return a ? b && Ustrcmp(a, b) == 0 : !b;
+}
+
+static const uschar *
+sverify_copy(const uschar * s)
+{
+return s ? string_copy(s) : NULL;
+}
+
+
+/* Look for a result for an address.  On a hit the address item is filled in
+as verify_address() would have left it.
+
+Arguments:
+  vaddr		the address item, with the address as given
+  options	the verify options
+  routed	if not NULL, set as by verify_address()
+  rc		where to put the result
+
+Returns:	TRUE if a result was found
+*/
+
+BOOL
+verify_session_cache_get(address_item * vaddr, int options, BOOL * routed,
+  int * rc)
+{
+if (!sender_verify_session_cache) return FALSE;
+
+for (sverify_cache * c = sverify_cached; c; c = c->next)
+  if (  c->options == options && Ustrcmp(c->address, vaddr->address) == 0
+     && sverify_same(c->helo, sender_helo_name)
+     && sverify_same(c->auth_id, authenticated_id)
+     && sverify_same(c->cipher, tls_in.cipher))
+    {
+    vaddr->address = string_copy(c->result);
+    vaddr->basic_errno = c->basic_errno;
+    vaddr->more_errno = c->more_errno;
+    vaddr->message = US sverify_copy(c->message);
+    vaddr->user_message = US sverify_copy(c->user_message);
+    vaddr->prop.address_data = US sverify_copy(c->address_data);
+    if (c->pass_message) setflag(vaddr, af_pass_message);
+    if (c->sender) sender_address = string_copy(c->sender);
+    sender_verify_failure = US sverify_copy(c->failure);
+    if (routed) *routed = c->routed;
+    *rc = c->rc;
+    HDEBUG(D_verify) debug_printf("using session-cached verify result for %s\n",
+      c->address);
+    return TRUE;
+    }
+return FALSE;
+}
+
+
+/* Keep the result of a verify_address() for the session.
+
+Arguments:
+  address	the address as given
+  options	the verify options
+  vaddr		the address item, after verify_address()
+  routed	as set by verify_address()
+  rc		the result
+*/
+
+void
+verify_session_cache_put(const uschar * address, int options,
+  const address_item * vaddr, BOOL routed, int rc)
+{
+int old_pool = store_pool;
+sverify_cache * c;
+
+if (  !sender_verify_session_cache || (rc != OK && rc != FAIL)
+   || vaddr->prop.variables || sverify_cache_count >= SVERIFY_CACHE_MAX)
+  return;
+
+store_pool = POOL_PERM;
+c = store_get(sizeof(sverify_cache) + Ustrlen(address), address);
+Ustrcpy(c->address, address);
+c->options = options;
+c->rc = rc;
+c->basic_errno = vaddr->basic_errno;
+c->more_errno = vaddr->more_errno;
+c->routed = routed;
+c->pass_message = testflag(vaddr, af_pass_message);
+c->helo = sverify_copy(sender_helo_name);
+c->auth_id = sverify_copy(authenticated_id);
+c->cipher = sverify_copy(tls_in.cipher);
+c->result = string_copy(vaddr->address);
+c->sender = options & vopt_fake_sender ? NULL : sverify_copy(sender_address);
+c->failure = sverify_copy(sender_verify_failure);
+c->message = sverify_copy(vaddr->message);
+c->user_message = sverify_copy(vaddr->user_message);
+c->address_data = sverify_copy(vaddr->prop.address_data);
+store_pool = old_pool;
+
+c->next = sverify_cached;
+sverify_cached = c;
+sverify_cache_count++;
+}
+
+
+
 
 
 /*************************************************
@@ -2685,9 +3027,17 @@ for (int i = 0; i < 3 && !done; i++)
         else
           {
           vaddr = deliver_make_addr(address, FALSE);
-          new_ok = verify_address(vaddr, NULL, options | vopt_fake_sender,
-            callout, callout_overall, callout_connect, se_mailfrom,
-            pm_mailfrom, NULL);
+          if (  callout > 0
+	     || !verify_session_cache_get(vaddr, options | vopt_fake_sender,
+					  NULL, &new_ok))
+	    {
+	    new_ok = verify_address(vaddr, NULL, options | vopt_fake_sender,
+	      callout, callout_overall, callout_connect, se_mailfrom,
+	      pm_mailfrom, NULL);
+	    if (callout <= 0)
+	      verify_session_cache_put(address, options | vopt_fake_sender,
+		vaddr, TRUE, new_ok);
+	    }
           }
         }
 
@@ -0,0 +1,12 @@
+From CALLER@test.ex Tue Mar 02 09:44:33 1999
+Received: from CALLER by myhost.test.ex with local (Exim x.yz)
+	(envelope-from <CALLER@test.ex>)
+	id 10HmaX-000000005vi-0000;
+	Tue, 2 Mar 1999 09:44:33 +0000
+Subject: binary one
+Message-Id: <E10HmaX-000000005vi-0000@myhost.test.ex>
+From: CALLER_NAME <CALLER@test.ex>
+Date: Tue, 2 Mar 1999 09:44:33 +0000
+
+First message
+
@@ -0,0 +1,13 @@
+From CALLER@test.ex Tue Mar 02 09:44:33 1999
+Received: from CALLER by myhost.test.ex with local (Exim x.yz)
+	(envelope-from <CALLER@test.ex>)
+	id 10HmaY-000000005vi-0000
+	for y@test.ex;
+	Tue, 2 Mar 1999 09:44:33 +0000
+Subject: text one
+Message-Id: <E10HmaY-000000005vi-0000@myhost.test.ex>
+From: CALLER_NAME <CALLER@test.ex>
+Date: Tue, 2 Mar 1999 09:44:33 +0000
+
+Second message
+
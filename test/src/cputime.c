@@ -0,0 +1,87 @@
+/* A program that runs a command and reports the CPU time used by it and by
+all of its descendants, for the performance tests run by perftest. Exim's
+daemon and delivery processes fork children that they do not always wait for,
+so on Linux this program makes itself a "subreaper", which causes orphaned
+descendants to become its children rather than those of init; it waits for
+them all before it reports. Elsewhere only the descendants that were waited
+for are counted.
+
+Usage: cputime <file> <command> [<arg> ...]
+
+When the command and all the descendants have finished, a line giving the user
+and system CPU seconds is written to the file, and the program exits with the
+command's status (or 128 plus the signal number if it was killed). */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef __linux__
+# include <sys/prctl.h>
+#endif
+
+
+int main(int argc, char **argv)
+{
+pid_t pid;
+int status, rc = 0;
+struct rusage ru;
+FILE *f;
+
+if (argc < 3)
+  {
+  fprintf(stderr, "usage: cputime <file> <command> [<arg> ...]\n");
+  exit(2);
+  }
+
+#ifdef PR_SET_CHILD_SUBREAPER
+if (prctl(PR_SET_CHILD_SUBREAPER, 1) < 0)
+  fprintf(stderr, "cputime: prctl failed: %s\n", strerror(errno));
+#endif
+
+if ((pid = fork()) == 0)
+  {
+  execvp(argv[2], argv + 2);
+  fprintf(stderr, "cputime: failed to run %s: %s\n", argv[2], strerror(errno));
+  _exit(127);
+  }
+if (pid < 0)
+  {
+  fprintf(stderr, "cputime: fork failed: %s\n", strerror(errno));
+  exit(2);
+  }
+
+/* Wait for everything, noting the command's own status */
+
+for (;;)
+  {
+  pid_t p = wait(&status);
+  if (p < 0)
+    {
+    if (errno == EINTR) continue;
+    break;
+    }
+  if (p == pid)
+    rc = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+  }
+
+getrusage(RUSAGE_CHILDREN, &ru);
+if (!(f = fopen(argv[1], "w")))
+  {
+  fprintf(stderr, "cputime: failed to open %s: %s\n", argv[1], strerror(errno));
+  exit(2);
+  }
+fprintf(f, "user %ld.%06ld sys %ld.%06ld\n",
+  (long)ru.ru_utime.tv_sec, (long)ru.ru_utime.tv_usec,
+  (long)ru.ru_stime.tv_sec, (long)ru.ru_stime.tv_usec);
+fclose(f);
+return rc;
+}
+
+/* End */
@@ -0,0 +1,967 @@
+/* A load generator for an SMTP server, for measuring an Exim daemon. One
+process keeps a given number of connections open at once, driving each of them
+through an event loop (epoll on Linux, poll elsewhere), and sends messages down
+them as fast as the server will accept them. It can use PIPELINING, CHUNKING
+(BDAT) and STARTTLS, resuming TLS sessions, and can replay a directory of real
+messages. At the end the overall rate and the spread of the times are reported:
+from connect() to the greeting, which is the daemon's accept path, and for one
+message from MAIL to the reply to the final dot or last BDAT.
+
+Usage: smtpload [options] <host> <port>
+
+  -c <n>	number of concurrent connections (default 1)
+  -m <n>	messages per connection (default 1)
+  -n <n>	total number of messages (default 100)
+  -s <n>	approximate size of a generated message body (default 1000)
+  -d <dir>	send the messages in the files in <dir> in turn, instead
+  -f <addr>	envelope sender (default load@test.ex)
+  -r <addr>	recipient (default userx@test.ex)
+  -e <name>	EHLO name (default smtpload.test.ex)
+  -p		pipeline MAIL, RCPT and DATA or BDAT, if the server offers it
+  -b		send with BDAT, which the server must offer
+  -k <n>	BDAT chunk size (default the whole message)
+  -tls		issue STARTTLS after EHLO (needs a build with HAVE_OPENSSL)
+  -noresume	do not try to resume TLS sessions
+  -q		only the summary lines
+
+The host must be an IP address. Files in a corpus are sent as they are, apart
+from line endings being made CRLF and, for DATA, dot-stuffing; a leading mbox
+"From " line is dropped. A connection that fails loses its remaining messages,
+which are counted as failed; the first few failures are reported on stderr. */
+
+/* ANSI C standard includes */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+/* Unix includes */
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#ifdef __linux__
+# define USE_EPOLL
+# include <sys/epoll.h>
+#else
+# include <poll.h>
+#endif
+
+#ifdef HAVE_OPENSSL
+# include <openssl/ssl.h>
+# include <openssl/err.h>
+#endif
+
+#define FALSE         0
+#define TRUE          1
+
+#define EV_IN		1
+#define EV_OUT		2
+
+#define CAP_PIPELINING	1
+#define CAP_CHUNKING	2
+#define CAP_STARTTLS	4
+
+#define EXP_MAX		64		/* outstanding replies on one connection */
+#define ERRORS_SHOWN	10
+
+enum { S_FREE, S_CONNECT, S_GREET, S_EHLO, S_STARTTLS, S_HANDSHAKE, S_MAIL,
+       S_RCPT, S_DATA, S_BDAT, S_BODY, S_QUIT };
+
+typedef struct {
+  char *	crlf;		/* for BDAT */
+  size_t	crlf_len;
+  char *	stuffed;	/* for DATA, including the final dot */
+  size_t	stuffed_len;
+} message;
+
+typedef struct {
+  int		fd;
+  int		slot;
+  int		step;
+  int		interest;
+  int		caps;
+  int		closing;	/* our side shut down after QUIT */
+#ifdef HAVE_OPENSSL
+  SSL *		ssl;
+  int		hs_want;	/* what the TLS handshake is waiting for */
+#endif
+  int		exp[EXP_MAX];	/* first digits of the replies awaited */
+  int		exp_head, exp_count;
+  char		line[1024];
+  int		line_len;
+  char *	out;
+  size_t	out_len, out_off, out_size;
+  int		quota;		/* messages for this connection */
+  int		sent;		/* ... of which completed */
+  message *	msg;
+  size_t	bdat_off;
+  double	t_start, t_msg;
+} conn;
+
+static const char * sender = "load@test.ex";
+static const char * recipient = "userx@test.ex";
+static const char * ehlo_name = "smtpload.test.ex";
+static int pipelining = FALSE;
+static int use_bdat = FALSE;
+static size_t chunk_size = 0;
+static int use_tls = FALSE;
+static int quiet = FALSE;
+
+static struct sockaddr_in server;
+static int concurrency = 1, per_conn = 1, total = 100;
+
+static message * corpus;
+static int corpus_count = 0, corpus_next = 0;
+
+static conn * conns;
+static int active = 0, reserved = 0;
+
+static double * msg_times, * conn_times;
+static int msgs_done = 0, msgs_failed = 0, conns_made = 0, conns_greeted = 0;
+static int tls_conns = 0, tls_resumed = 0, errors = 0;
+
+#ifdef USE_EPOLL
+static int epfd;
+#else
+static struct pollfd * pfds;
+#endif
+
+#ifdef HAVE_OPENSSL
+static SSL_CTX * ctx;
+static SSL_SESSION * tls_session = NULL;
+static int tls_resume = TRUE;
+#endif
+
+static void advance(conn *);
+
+
+
+/*************************************************
+*                  Utilities                     *
+*************************************************/
+
+static double
+now(void)
+{
+struct timespec ts;
+(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+cmp_double(const void * a, const void * b)
+{
+double x = *(const double *)a, y = *(const double *)b;
+return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static void
+fail(const char * fmt, ...)
+{
+va_list ap;
+va_start(ap, fmt);
+fprintf(stderr, "smtpload: ");
+vfprintf(stderr, fmt, ap);
+fprintf(stderr, "\n");
+va_end(ap);
+exit(1);
+}
+
+static void *
+xmalloc(size_t n)
+{
+void * p = malloc(n ? n : 1);
+if (!p) fail("malloc failed");
+return p;
+}
+
+static void
+report(const char * what, double * times, int count)
+{
+if (count == 0) return;
+qsort(times, count, sizeof(double), cmp_double);
+printf("%s: p50 %.2fms p99 %.2fms max %.2fms\n", what,
+  times[count / 2] * 1e3, times[(int)(count * 0.99)] * 1e3,
+  times[count - 1] * 1e3);
+}
+
+
+
+/*************************************************
+*              The message corpus                *
+*************************************************/
+
+/* Make the CRLF and dot-stuffed forms of a message from its text */
+
+static void
+add_message(const char * text, size_t len)
+{
+message * m = corpus + corpus_count++;
+char * c, * s;
+
+if (len >= 5 && strncmp(text, "From ", 5) == 0)
+  {
+  const char * nl = memchr(text, '\n', len);
+  size_t skip = nl ? nl + 1 - text : len;
+  text += skip;
+  len -= skip;
+  }
+
+m->crlf = c = xmalloc(2 * len + 2);
+m->stuffed = s = xmalloc(3 * len + 5);
+
+for (size_t i = 0; i < len; i++)
+  {
+  int bol = i == 0 || text[i-1] == '\n';
+  if (bol && text[i] == '.') *s++ = '.';
+  if (text[i] == '\n' && (i == 0 || text[i-1] != '\r'))
+    { *c++ = '\r'; *s++ = '\r'; }
+  *c++ = *s++ = text[i];
+  }
+if (len > 0 && text[len-1] != '\n')
+  { *c++ = *s++ = '\r'; *c++ = *s++ = '\n'; }
+memcpy(s, ".\r\n", 3);
+
+m->crlf_len = c - m->crlf;
+m->stuffed_len = s + 3 - m->stuffed;
+}
+
+static void
+load_corpus(const char * dir)
+{
+DIR * d;
+struct dirent * ent;
+int size = 16;
+
+if (!(d = opendir(dir))) fail("cannot open %s: %s", dir, strerror(errno));
+corpus = xmalloc(size * sizeof(message));
+
+while ((ent = readdir(d)))
+  {
+  char path[1024];
+  struct stat st;
+  char * text;
+  int fd;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+  if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) continue;
+  if ((fd = open(path, O_RDONLY)) < 0)
+    fail("cannot open %s: %s", path, strerror(errno));
+  text = xmalloc(st.st_size);
+  if (read(fd, text, st.st_size) != st.st_size)
+    fail("failed to read %s", path);
+  close(fd);
+
+  if (corpus_count >= size)
+    if (!(corpus = realloc(corpus, (size *= 2) * sizeof(message))))
+      fail("malloc failed");
+  add_message(text, st.st_size);
+  free(text);
+  }
+closedir(d);
+if (corpus_count == 0) fail("no messages in %s", dir);
+}
+
+/* Without a corpus, one message of about the given size */
+
+static void
+make_message(int size)
+{
+char * text = xmalloc(size + 256);
+int len = snprintf(text, 256, "From: <%s>\nTo: <%s>\nSubject: load test\n\n",
+  sender, recipient);
+
+for (int i = 0; i < size; i += 77)
+  len += sprintf(text + len, "%.76s\n",
+    "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789"
+    "abcdefghijklmnopqrstuvwxyz");
+
+corpus = xmalloc(sizeof(message));
+add_message(text, len);
+free(text);
+}
+
+
+
+/*************************************************
+*                 Event handling                 *
+*************************************************/
+
+static void
+ev_set(conn * c, int interest)
+{
+if (interest == c->interest) return;
+
+#ifdef USE_EPOLL
+  {
+  struct epoll_event ev = { .data.ptr = c };
+  if (interest & EV_IN) ev.events |= EPOLLIN;
+  if (interest & EV_OUT) ev.events |= EPOLLOUT;
+  if (epoll_ctl(epfd, c->interest ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, c->fd, &ev)
+      < 0)
+    fail("epoll_ctl failed: %s", strerror(errno));
+  }
+#else
+pfds[c->slot].fd = c->fd;
+pfds[c->slot].events = (interest & EV_IN ? POLLIN : 0)
+		     | (interest & EV_OUT ? POLLOUT : 0);
+#endif
+
+c->interest = interest;
+}
+
+/* Update what the connection is waiting for after some activity */
+
+static void
+ev_update(conn * c)
+{
+int interest = EV_IN;
+
+if (c->step == S_CONNECT || c->out_off < c->out_len) interest |= EV_OUT;
+#ifdef HAVE_OPENSSL
+if (c->step == S_HANDSHAKE) interest = c->hs_want;
+#endif
+ev_set(c, interest);
+}
+
+
+
+/*************************************************
+*          Connection setup and teardown         *
+*************************************************/
+
+static void
+conn_free(conn * c)
+{
+#ifdef USE_EPOLL
+if (c->interest) (void) epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+#else
+pfds[c->slot].fd = -1;
+#endif
+#ifdef HAVE_OPENSSL
+if (c->ssl) SSL_free(c->ssl);
+c->ssl = NULL;
+#endif
+close(c->fd);
+c->fd = -1;
+c->step = S_FREE;
+c->interest = 0;
+active--;
+}
+
+static void
+conn_fail(conn * c, const char * fmt, ...)
+{
+if (errors++ < ERRORS_SHOWN)
+  {
+  va_list ap;
+  va_start(ap, fmt);
+  fprintf(stderr, "smtpload: connection %d: ", c->slot);
+  vfprintf(stderr, fmt, ap);
+  fprintf(stderr, "\n");
+  va_end(ap);
+  }
+msgs_failed += c->quota - c->sent;
+conn_free(c);
+}
+
+static void
+conn_open(conn * c)
+{
+int on = 1;
+
+c->quota = total - reserved < per_conn ? total - reserved : per_conn;
+reserved += c->quota;
+c->sent = 0;
+c->caps = 0;
+c->closing = FALSE;
+c->exp_head = c->exp_count = 0;
+c->line_len = 0;
+c->out_len = c->out_off = 0;
+c->interest = 0;
+c->t_start = now();
+active++;
+conns_made++;
+
+if ((c->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+  fail("socket failed: %s", strerror(errno));
+(void) fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+(void) setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+c->step = S_CONNECT;
+if (connect(c->fd, (struct sockaddr *)&server, sizeof(server)) < 0
+    && errno != EINPROGRESS)
+  {
+  conn_fail(c, "connect failed: %s", strerror(errno));
+  return;
+  }
+ev_update(c);
+}
+
+/* Open connections until there are enough, or no more work for them */
+
+static void
+conn_fill(void)
+{
+for (int i = 0; i < concurrency && active < concurrency && reserved < total; i++)
+  if (conns[i].step == S_FREE)
+    conn_open(conns + i);
+}
+
+
+
+/*************************************************
+*               Output and input                 *
+*************************************************/
+
+/* Write as much of the pending output as the socket will take. Returns FALSE
+if the connection has failed. */
+
+static int
+conn_flush(conn * c)
+{
+while (c->out_off < c->out_len)
+  {
+  ssize_t n;
+#ifdef HAVE_OPENSSL
+  if (c->ssl)
+    {
+    if ((n = SSL_write(c->ssl, c->out + c->out_off, c->out_len - c->out_off))
+	<= 0)
+      {
+      int err = SSL_get_error(c->ssl, n);
+      if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) break;
+      conn_fail(c, "TLS write failed");
+      return FALSE;
+      }
+    }
+  else
+#endif
+  if ((n = write(c->fd, c->out + c->out_off, c->out_len - c->out_off)) < 0)
+    {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+    conn_fail(c, "write failed: %s", strerror(errno));
+    return FALSE;
+    }
+  c->out_off += n;
+  }
+if (c->out_off >= c->out_len) c->out_off = c->out_len = 0;
+return TRUE;
+}
+
+/* Queue some output, noting the first digit of the reply it will get (or
+zero if none) */
+
+static void
+conn_send(conn * c, const char * s, size_t len, int expect)
+{
+if (c->out_len + len > c->out_size)
+  {
+  c->out_size = c->out_len + len + 4096;
+  if (!(c->out = realloc(c->out, c->out_size))) fail("malloc failed");
+  }
+memcpy(c->out + c->out_len, s, len);
+c->out_len += len;
+
+if (expect)
+  {
+  if (c->exp_count >= EXP_MAX) fail("too many outstanding commands");
+  c->exp[(c->exp_head + c->exp_count++) % EXP_MAX] = expect;
+  }
+}
+
+static void
+conn_printf(conn * c, int expect, const char * fmt, ...)
+{
+char buf[1024];
+va_list ap;
+int len;
+va_start(ap, fmt);
+len = vsnprintf(buf, sizeof(buf), fmt, ap);
+va_end(ap);
+conn_send(c, buf, len, expect);
+}
+
+/* Handle one line of a reply. When the last of the outstanding replies has
+arrived, move the connection on. Returns FALSE if the connection has gone. */
+
+static int
+conn_line(conn * c)
+{
+char * line = c->line;
+int len = c->line_len;
+
+if (len > 0 && line[len-1] == '\r') len--;
+line[len] = 0;
+c->line_len = 0;
+
+if (len < 3 || (len > 3 && line[3] != ' ' && line[3] != '-'))
+  { conn_fail(c, "malformed reply: %s", line); return FALSE; }
+
+if (c->step == S_EHLO && len > 4)
+  {
+  if (strncasecmp(line+4, "PIPELINING", 10) == 0) c->caps |= CAP_PIPELINING;
+  else if (strncasecmp(line+4, "CHUNKING", 8) == 0) c->caps |= CAP_CHUNKING;
+  else if (strncasecmp(line+4, "STARTTLS", 8) == 0) c->caps |= CAP_STARTTLS;
+  }
+if (len > 3 && line[3] == '-') return TRUE;
+
+if (c->exp_count == 0)
+  { conn_fail(c, "unexpected reply: %s", line); return FALSE; }
+if (line[0] != '0' + c->exp[c->exp_head])
+  { conn_fail(c, "reply to step %d: %s", c->step, line); return FALSE; }
+
+c->exp_head = (c->exp_head + 1) % EXP_MAX;
+if (--c->exp_count == 0)
+  {
+  advance(c);
+  if (c->step == S_FREE) return FALSE;
+  }
+return TRUE;
+}
+
+/* Read what there is. Returns FALSE if the connection has gone. */
+
+static int
+conn_input(conn * c)
+{
+char buf[4096];
+
+for (;;)
+  {
+  ssize_t n;
+#ifdef HAVE_OPENSSL
+  if (c->ssl)
+    {
+    if ((n = SSL_read(c->ssl, buf, sizeof(buf))) <= 0)
+      {
+      int err = SSL_get_error(c->ssl, n);
+      if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+	return TRUE;
+      n = 0;
+      }
+    }
+  else
+#endif
+  if ((n = read(c->fd, buf, sizeof(buf))) < 0)
+    {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) return TRUE;
+    conn_fail(c, "read failed: %s", strerror(errno));
+    return FALSE;
+    }
+
+  if (n == 0)
+    {
+    if (c->step == S_QUIT) conn_free(c);
+    else conn_fail(c, "connection closed at step %d", c->step);
+    return FALSE;
+    }
+
+  for (ssize_t i = 0; i < n; i++)
+    if (buf[i] != '\n')
+      {
+      if (c->line_len < sizeof(c->line) - 1) c->line[c->line_len++] = buf[i];
+      }
+    else if (!conn_line(c))
+      return FALSE;
+
+    /* After STARTTLS the rest is for the TLS library */
+
+    else if (c->step == S_HANDSHAKE)
+      return TRUE;
+  }
+}
+
+
+
+/*************************************************
+*              The SMTP conversation             *
+*************************************************/
+
+#ifdef HAVE_OPENSSL
+static void
+tls_handshake(conn * c)
+{
+int rc = SSL_connect(c->ssl);
+
+if (rc == 1)
+  {
+  tls_conns++;
+  if (SSL_session_reused(c->ssl)) tls_resumed++;
+  c->step = S_EHLO;
+  c->caps = 0;
+  conn_printf(c, 2, "EHLO %s\r\n", ehlo_name);
+  return;
+  }
+
+switch (SSL_get_error(c->ssl, rc))
+  {
+  case SSL_ERROR_WANT_READ:  c->hs_want = EV_IN; break;
+  case SSL_ERROR_WANT_WRITE: c->hs_want = EV_IN | EV_OUT; break;
+  default:
+    if (errors < ERRORS_SHOWN) ERR_print_errors_fp(stderr);
+    conn_fail(c, "TLS negotiation failed");
+  }
+}
+
+/* Keep the latest resumable session for new connections. With TLS 1.3 the
+ticket arrives after the handshake, so this is done after the EHLO reply. */
+
+static void
+tls_keep_session(conn * c)
+{
+SSL_SESSION * s;
+
+if (!tls_resume || !(s = SSL_get1_session(c->ssl))) return;
+# if OPENSSL_VERSION_NUMBER >= 0x10101000L
+if (!SSL_SESSION_is_resumable(s)) { SSL_SESSION_free(s); return; }
+# endif
+if (tls_session) SSL_SESSION_free(tls_session);
+tls_session = s;
+}
+#endif
+
+/* Send chunks of the message with BDAT; all the rest if pipelining, else
+just the next one. */
+
+static void
+send_bdat(conn * c, int all)
+{
+message * m = c->msg;
+
+do
+  {
+  size_t len = m->crlf_len - c->bdat_off;
+  int last;
+
+  if (chunk_size && len > chunk_size) len = chunk_size;
+  last = c->bdat_off + len >= m->crlf_len;
+  conn_printf(c, 2, "BDAT %lu%s\r\n", (unsigned long)len, last ? " LAST" : "");
+  conn_send(c, m->crlf + c->bdat_off, len, 0);
+  c->bdat_off += len;
+  c->step = last ? S_BODY : S_BDAT;
+  }
+while (all && c->step == S_BDAT && c->exp_count < EXP_MAX);
+}
+
+/* Start the next message on the connection, or finish with it */
+
+static void
+next_message(conn * c)
+{
+int pipe = pipelining && (c->caps & CAP_PIPELINING);
+
+if (c->sent >= c->quota)
+  {
+  c->step = S_QUIT;
+  conn_printf(c, 2, "QUIT\r\n");
+  return;
+  }
+
+if (use_bdat && !(c->caps & CAP_CHUNKING))
+  { conn_fail(c, "the server does not offer CHUNKING"); return; }
+
+c->msg = corpus + corpus_next++ % corpus_count;
+c->bdat_off = 0;
+c->t_msg = now();
+conn_printf(c, 2, "MAIL FROM:<%s>\r\n", sender);
+if (!pipe)
+  {
+  c->step = S_MAIL;
+  return;
+  }
+conn_printf(c, 2, "RCPT TO:<%s>\r\n", recipient);
+if (use_bdat)
+  send_bdat(c, TRUE);
+else
+  {
+  c->step = S_DATA;
+  conn_printf(c, 3, "DATA\r\n");
+  }
+}
+
+/* All the replies awaited for the current step have arrived */
+
+static void
+advance(conn * c)
+{
+switch (c->step)
+  {
+  case S_GREET:
+    conn_times[conns_greeted++] = now() - c->t_start;
+    c->step = S_EHLO;
+    conn_printf(c, 2, "EHLO %s\r\n", ehlo_name);
+    break;
+
+  case S_EHLO:
+#ifdef HAVE_OPENSSL
+    if (use_tls && !c->ssl)
+      {
+      if (!(c->caps & CAP_STARTTLS))
+	{ conn_fail(c, "the server does not offer STARTTLS"); return; }
+      c->step = S_STARTTLS;
+      conn_printf(c, 2, "STARTTLS\r\n");
+      break;
+      }
+    if (c->ssl) tls_keep_session(c);
+#endif
+    next_message(c);
+    break;
+
+#ifdef HAVE_OPENSSL
+  case S_STARTTLS:
+    if (!(c->ssl = SSL_new(ctx))) fail("SSL_new failed");
+    SSL_set_mode(c->ssl,
+      SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_set_fd(c->ssl, c->fd);
+    if (tls_session) SSL_set_session(c->ssl, tls_session);
+    c->step = S_HANDSHAKE;
+    tls_handshake(c);
+    break;
+#endif
+
+  case S_MAIL:
+    c->step = S_RCPT;
+    conn_printf(c, 2, "RCPT TO:<%s>\r\n", recipient);
+    break;
+
+  case S_RCPT:
+    if (use_bdat)
+      send_bdat(c, FALSE);
+    else
+      {
+      c->step = S_DATA;
+      conn_printf(c, 3, "DATA\r\n");
+      }
+    break;
+
+  case S_DATA:
+    c->step = S_BODY;
+    conn_send(c, c->msg->stuffed, c->msg->stuffed_len, 2);
+    break;
+
+  case S_BDAT:
+    send_bdat(c, pipelining && (c->caps & CAP_PIPELINING));
+    break;
+
+  case S_BODY:
+    msg_times[msgs_done++] = now() - c->t_msg;
+    c->sent++;
+    next_message(c);
+    break;
+
+  case S_QUIT:
+    conn_free(c);
+    break;
+  }
+}
+
+/* Deal with an event on a connection */
+
+static void
+conn_event(conn * c, int ev)
+{
+switch (c->step)
+  {
+  case S_CONNECT:
+    {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    (void) getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err) { conn_fail(c, "connect failed: %s", strerror(err)); return; }
+    c->step = S_GREET;
+    c->exp[c->exp_head] = 2;
+    c->exp_count = 1;
+    break;
+    }
+
+#ifdef HAVE_OPENSSL
+  case S_HANDSHAKE:
+    tls_handshake(c);
+    break;
+#endif
+
+  default:
+    if (ev & EV_IN && !conn_input(c)) return;
+    break;
+  }
+
+if (c->step == S_FREE || !conn_flush(c)) return;
+
+/* Once QUIT has gone, close our side as a sending MTA does; the server waits
+a while for that before it closes. */
+
+if (c->step == S_QUIT && c->out_len == 0 && !c->closing)
+  {
+#ifdef HAVE_OPENSSL
+  if (c->ssl) (void) SSL_shutdown(c->ssl);
+#endif
+  (void) shutdown(c->fd, SHUT_WR);
+  c->closing = TRUE;
+  }
+ev_update(c);
+}
+
+
+
+/*************************************************
+*                 Main program                   *
+*************************************************/
+
+int
+main(int argc, char ** argv)
+{
+int size = 1000, argi = 1;
+const char * corpus_dir = NULL;
+double start, elapsed;
+struct rlimit rl;
+
+for (; argi < argc && argv[argi][0] == '-'; argi++)
+  {
+  const char * opt = argv[argi];
+  if (strcmp(opt, "-p") == 0) pipelining = TRUE;
+  else if (strcmp(opt, "-b") == 0) use_bdat = TRUE;
+  else if (strcmp(opt, "-q") == 0) quiet = TRUE;
+  else if (strcmp(opt, "-tls") == 0 || strcmp(opt, "-noresume") == 0)
+    {
+#ifdef HAVE_OPENSSL
+    use_tls = TRUE;
+    if (opt[1] == 'n') tls_resume = FALSE;
+#else
+    fail("this smtpload was built without TLS support");
+#endif
+    }
+  else if (argi + 1 >= argc) fail("missing value for %s", opt);
+  else if (strcmp(opt, "-c") == 0) concurrency = atoi(argv[++argi]);
+  else if (strcmp(opt, "-m") == 0) per_conn = atoi(argv[++argi]);
+  else if (strcmp(opt, "-n") == 0) total = atoi(argv[++argi]);
+  else if (strcmp(opt, "-s") == 0) size = atoi(argv[++argi]);
+  else if (strcmp(opt, "-k") == 0)
+    { chunk_size = atoi(argv[++argi]); use_bdat = TRUE; }
+  else if (strcmp(opt, "-d") == 0) corpus_dir = argv[++argi];
+  else if (strcmp(opt, "-f") == 0) sender = argv[++argi];
+  else if (strcmp(opt, "-r") == 0) recipient = argv[++argi];
+  else if (strcmp(opt, "-e") == 0) ehlo_name = argv[++argi];
+  else fail("unknown option %s", opt);
+  }
+
+if (argc - argi != 2)
+  fail("usage: smtpload [-c n] [-m n] [-n n] [-s n] [-d dir] [-f addr]"
+    " [-r addr] [-e name] [-p] [-b] [-k n] [-tls] [-noresume] [-q]"
+    " <host> <port>");
+if (concurrency < 1 || per_conn < 1 || total < 1 || size < 0)
+  fail("counts must be positive");
+if (concurrency > total) concurrency = total;
+
+memset(&server, 0, sizeof(server));
+server.sin_family = AF_INET;
+server.sin_port = htons(atoi(argv[argi+1]));
+if (inet_pton(AF_INET, argv[argi], &server.sin_addr) != 1)
+  fail("bad IPv4 address %s", argv[argi]);
+
+if (corpus_dir) load_corpus(corpus_dir); else make_message(size);
+
+/* Thousands of connections need thousands of descriptors */
+
+if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+  {
+  rl.rlim_cur = rl.rlim_max;
+  (void) setrlimit(RLIMIT_NOFILE, &rl);
+  }
+if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && concurrency + 16 > rl.rlim_cur)
+  fail("%d connections need more than the %lu descriptors allowed",
+    concurrency, (unsigned long)rl.rlim_cur);
+signal(SIGPIPE, SIG_IGN);
+
+#ifdef HAVE_OPENSSL
+if (use_tls)
+  {
+  SSL_library_init();
+  SSL_load_error_strings();
+  if (!(ctx = SSL_CTX_new(SSLv23_client_method())))
+    fail("SSL_CTX_new failed");
+  SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+  }
+#endif
+
+conns = xmalloc(concurrency * sizeof(conn));
+memset(conns, 0, concurrency * sizeof(conn));
+for (int i = 0; i < concurrency; i++) conns[i].slot = i;
+msg_times = xmalloc(total * sizeof(double));
+conn_times = xmalloc(total * sizeof(double));
+
+#ifdef USE_EPOLL
+if ((epfd = epoll_create1(0)) < 0) fail("epoll_create failed: %s", strerror(errno));
+#else
+pfds = xmalloc(concurrency * sizeof(struct pollfd));
+for (int i = 0; i < concurrency; i++) pfds[i].fd = -1;
+#endif
+
+start = now();
+conn_fill();
+
+while (active > 0)
+  {
+#ifdef USE_EPOLL
+  struct epoll_event evs[256];
+  int n = epoll_wait(epfd, evs, 256, -1);
+
+  if (n < 0 && errno != EINTR) fail("epoll_wait failed: %s", strerror(errno));
+  for (int i = 0; i < n; i++)
+    {
+    conn * c = evs[i].data.ptr;
+    if (c->step != S_FREE)
+      conn_event(c, (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR) ? EV_IN : 0)
+		  | (evs[i].events & EPOLLOUT ? EV_OUT : 0));
+    }
+#else
+  int n = poll(pfds, concurrency, -1);
+
+  if (n < 0 && errno != EINTR) fail("poll failed: %s", strerror(errno));
+  for (int i = 0; i < concurrency && n > 0; i++)
+    if (pfds[i].fd >= 0 && pfds[i].revents)
+      {
+      short rev = pfds[i].revents;
+      n--;
+      conn_event(conns + i, (rev & (POLLIN | POLLHUP | POLLERR) ? EV_IN : 0)
+			  | (rev & POLLOUT ? EV_OUT : 0));
+      }
+#endif
+  conn_fill();
+  }
+elapsed = now() - start;
+
+if (!quiet)
+  {
+  printf("%d connections, %d at once, %d messages per connection",
+    conns_made, concurrency, per_conn);
+  if (use_tls) printf(", %d TLS (%d resumed)", tls_conns, tls_resumed);
+  printf("\n%s%s, %d message%s%s\n", use_bdat ? "BDAT" : "DATA",
+    pipelining ? " pipelined" : "", corpus_count, corpus_count == 1 ? "" : "s",
+    corpus_dir ? " from the corpus" : "");
+  }
+printf("%d messages in %.3fs, %.1f msgs/s", msgs_done, elapsed,
+  msgs_done / elapsed);
+if (msgs_failed) printf(", %d failed", msgs_failed);
+printf("\n");
+report("connect to greeting", conn_times, conns_greeted);
+report("message, MAIL to 250", msg_times, msgs_done);
+
+return msgs_failed || msgs_done == 0 ? 1 : 0;
+}
+
+/* End of smtpload.c */